@@ -0,0 +1,142 @@
+#!/usr/bin/env python
+#
+# bench_compile  Break down the time tools spend compiling and loading their
+#                BPF programs.
+#
+# Each tool is started with $BCC_PHASE_TIMES set, interrupted once it had
+# the time to attach its probes, and the times of the compile phases its BPF
+# objects recorded at cleanup are reported: parse (clang preprocessing,
+# parsing and rewriting), annotate, finalize (code generation), the
+# run_pass_manager optimizations, load_maps and func_load (verification).
+#
+# USAGE: bench_compile.py [-h] [-n RUNS] [-t SECONDS] [-w] [-j] [tool ...]
+#
+# Tools are paths or names in tools/, with their arguments in the same
+# argument ("profile.py -F 49"). By default every tool in tools/ runs without
+# arguments; those that need some exit early and are reported as failed.
+#
+# Copyright (c) Facebook, Inc.
+# Licensed under the Apache License, Version 2.0 (the "License")
+
+from __future__ import print_function
+import argparse
+import glob
+import json
+import os
+import shlex
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+PHASES = ["load_cached_object", "parse", "annotate", "finalize",
+          "run_pass_manager", "load_maps", "func_load"]
+TOOLS_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                         "..", "tools")
+
+parser = argparse.ArgumentParser(
+    description="Break down the compile and load time of tools",
+    formatter_class=argparse.RawDescriptionHelpFormatter)
+parser.add_argument("-n", "--runs", type=int, default=3,
+    help="runs of each tool, the median of each phase is reported")
+parser.add_argument("-t", "--timeout", type=float, default=10,
+    help="seconds to let each tool start before interrupting it")
+parser.add_argument("-w", "--warm", action="store_true",
+    help="reuse the object cache between runs, for the tools that cache "
+         "their objects, instead of starting cold")
+parser.add_argument("-j", "--json", action="store_true",
+    help="print one JSON object per tool")
+parser.add_argument("tools", nargs="*",
+    help="tools to run, with their arguments (default all of tools/)")
+args = parser.parse_args()
+
+def tool_command(spec):
+    argv = shlex.split(spec)
+    path = argv[0]
+    if not os.path.exists(path):
+        path = os.path.join(TOOLS_DIR, path)
+        if not os.path.exists(path) and os.path.exists(path + ".py"):
+            path += ".py"
+    return [sys.executable, path] + argv[1:]
+
+def run_once(cmd, cache_dir):
+    """Run cmd and return the list of phase times of its BPF objects, or
+    None if it recorded none."""
+    fd, out = tempfile.mkstemp(prefix="bench_compile.", suffix=".json")
+    os.close(fd)
+    env = dict(os.environ, BCC_PHASE_TIMES=out, BCC_OBJ_CACHE_DIR=cache_dir)
+    start = time.time()
+    with open(os.devnull, "w") as devnull:
+        proc = subprocess.Popen(cmd, env=env, stdout=devnull, stderr=devnull)
+        while proc.poll() is None and time.time() - start < args.timeout:
+            time.sleep(0.1)
+        if proc.poll() is None:
+            # the tools clean up, and so record their times, on Ctrl-C
+            proc.send_signal(signal.SIGINT)
+            for _ in range(50):
+                if proc.poll() is not None:
+                    break
+                time.sleep(0.1)
+            else:
+                proc.kill()
+                proc.wait()
+    records = []
+    with open(out) as f:
+        for line in f:
+            try:
+                records.append(json.loads(line)["phases"])
+            except ValueError:
+                pass
+    os.unlink(out)
+    return records or None
+
+def total_phases(records):
+    # a tool may build several BPF objects
+    total = dict((p, 0) for p in PHASES)
+    for rec in records:
+        for phase, ns in rec.items():
+            total[phase] = total.get(phase, 0) + ns
+    return total
+
+def median(vals):
+    vals = sorted(vals)
+    mid = len(vals) // 2
+    return vals[mid] if len(vals) % 2 else (vals[mid - 1] + vals[mid]) / 2.0
+
+specs = args.tools or sorted(os.path.basename(p) for p in
+                             glob.glob(os.path.join(TOOLS_DIR, "*.py")))
+if not args.json:
+    print("%-24s %5s" % ("TOOL", "RUNS") +
+          "".join(" %9s" % p[:9] for p in PHASES) + " %9s" % "TOTAL(ms)")
+failed = 0
+for spec in specs:
+    cmd = tool_command(spec)
+    warm_dir = tempfile.mkdtemp(prefix="bench_compile.") if args.warm else None
+    runs = []
+    for _ in range(args.runs):
+        cache_dir = warm_dir or tempfile.mkdtemp(prefix="bench_compile.")
+        records = run_once(cmd, cache_dir)
+        if not warm_dir:
+            shutil.rmtree(cache_dir, ignore_errors=True)
+        if records:
+            runs.append(total_phases(records))
+    if warm_dir:
+        shutil.rmtree(warm_dir, ignore_errors=True)
+    if not runs:
+        failed += 1
+        print("%s: no BPF program was compiled" % spec, file=sys.stderr)
+        continue
+    phases = dict((p, median([r.get(p, 0) for r in runs]))
+                  for p in set(p for r in runs for p in r))
+    total = median([sum(r.values()) for r in runs])
+    if args.json:
+        print(json.dumps({"tool": spec, "runs": len(runs), "warm": args.warm,
+                          "phases_ns": phases, "total_ns": total}))
+    else:
+        print("%-24s %5d" % (spec[:24], len(runs)) +
+              "".join(" %9.1f" % (phases.get(p, 0) / 1e6) for p in PHASES) +
+              " %9.1f" % (total / 1e6))
+    sys.stdout.flush()
+sys.exit(1 if failed and args.tools else 0)
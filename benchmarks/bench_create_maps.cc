@@ -0,0 +1,155 @@
+/*
+ * bench_create_maps Measure the time to create the maps of programs with many
+ *                   tables.
+ *
+ * For each map count, a program declaring that many hash tables, each with
+ * a struct value type of its own, is compiled and loaded. The "load_maps"
+ * phase of BPFModule covers looking up the BTF key and value types of every
+ * table and creating the maps; "parse" and "finalize" are printed alongside
+ * for scale. Each count is run a number of times and the median reported,
+ * in ms.
+ *
+ * USAGE: bench_create_maps [-n COUNT[,COUNT...]] [-r RUNS] [-j]
+ *
+ * Copyright (c) Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ */
+
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "BPF.h"
+
+namespace {
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct Options {
+  std::vector<size_t> counts = {10, 100, 500};
+  int runs = 3;
+  bool json = false;
+};
+
+std::string make_program(size_t count) {
+  std::stringstream ss;
+  for (size_t i = 0; i < count; i++) {
+    ss << "struct val_" << i << " { u64 a; u32 b[" << i % 8 + 1 << "]; };\n"
+       << "BPF_HASH(map_" << i << ", u64, struct val_" << i << ", 1);\n";
+  }
+  // Reference every map so none is left out of the object
+  ss << "int use_maps(void *ctx) {\n  u64 k = 0;\n";
+  for (size_t i = 0; i < count; i++)
+    ss << "  map_" << i << ".lookup(&k);\n";
+  ss << "  return 0;\n}\n";
+  return ss.str();
+}
+
+uint64_t phase_ns(const ebpf::BPF& bpf, const std::string& phase) {
+  for (const auto& p : bpf.get_phase_times())
+    if (p.first == phase)
+      return p.second;
+  return 0;
+}
+
+uint64_t median(std::vector<uint64_t> v) {
+  std::sort(v.begin(), v.end());
+  return v[v.size() / 2];
+}
+
+bool bench_count(const Options& opts, size_t count) {
+  std::string program = make_program(count);
+  std::vector<uint64_t> init, parse, finalize, load_maps;
+  for (int r = 0; r < opts.runs; r++) {
+    ebpf::BPF bpf;
+    uint64_t start = now_ns();
+    auto res = bpf.init(program);
+    uint64_t ns = now_ns() - start;
+    if (!res.ok()) {
+      std::fprintf(stderr, "%zu maps: %s\n", count, res.msg().c_str());
+      return false;
+    }
+    init.push_back(ns);
+    parse.push_back(phase_ns(bpf, "parse"));
+    finalize.push_back(phase_ns(bpf, "finalize"));
+    load_maps.push_back(phase_ns(bpf, "load_maps"));
+  }
+
+  if (opts.json)
+    std::printf("{\"maps\": %zu, \"runs\": %d, \"init_ms\": %.3f, "
+                "\"parse_ms\": %.3f, \"finalize_ms\": %.3f, "
+                "\"load_maps_ms\": %.3f, \"load_maps_us_per_map\": %.1f}\n",
+                count, opts.runs, median(init) / 1e6, median(parse) / 1e6,
+                median(finalize) / 1e6, median(load_maps) / 1e6,
+                median(load_maps) / 1e3 / count);
+  else
+    std::printf("%6zu %10.1f %10.1f %10.1f %10.1f %12.1f\n", count,
+                median(init) / 1e6, median(parse) / 1e6,
+                median(finalize) / 1e6, median(load_maps) / 1e6,
+                median(load_maps) / 1e3 / count);
+  std::fflush(stdout);
+  return true;
+}
+
+void usage(const char* prog) {
+  std::fprintf(stderr,
+               "USAGE: %s [-n COUNT[,COUNT...]] [-r RUNS] [-j]\n"
+               "  -n COUNTS  tables of the programs (default 10,100,500)\n"
+               "  -r RUNS    runs per count, the median is reported "
+               "(default 3)\n"
+               "  -j         print one JSON object per count\n",
+               prog);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options opts;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:r:jh")) != -1) {
+    switch (opt) {
+    case 'n': {
+      opts.counts.clear();
+      std::stringstream ss(optarg);
+      std::string item;
+      while (std::getline(ss, item, ','))
+        opts.counts.push_back(std::strtoull(item.c_str(), nullptr, 10));
+      break;
+    }
+    case 'r':
+      opts.runs = std::atoi(optarg);
+      break;
+    case 'j':
+      opts.json = true;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (opts.runs <= 0 || opts.counts.empty() ||
+      std::find(opts.counts.begin(), opts.counts.end(), 0) !=
+          opts.counts.end()) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (!opts.json)
+    std::printf("%6s %10s %10s %10s %10s %12s\n", "MAPS", "INIT(ms)",
+                "PARSE(ms)", "FINAL(ms)", "MAPS(ms)", "US/MAP");
+  bool ok = true;
+  for (size_t count : opts.counts)
+    ok = bench_count(opts, count) && ok;
+  return ok ? 0 : 1;
+}
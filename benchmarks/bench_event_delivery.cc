@@ -0,0 +1,453 @@
+/*
+ * bench_event_delivery Measure the delivery of events from BPF to userspace.
+ *
+ * Producer threads call getppid() at a controlled rate. A raw_syscalls
+ * tracepoint program turns each call into an event of the requested size,
+ * stamped with bpf_ktime_get_ns(), and outputs it to a perf buffer or a ring
+ * buffer, which is consumed in each of the modes below:
+ *
+ *   perf           BPFPerfBuffer::poll(), woken up for every sample
+ *   perf-batched   BPFPerfBuffer::poll(), woken up every 64 samples
+ *   perf-threads   BPFPerfBuffer::start_consumers() with 2 threads
+ *   ringbuf        BPFRingBuffer::poll()
+ *   ringbuf-busy   BPFRingBuffer::busy_poll()
+ *
+ * For each mode, the consumer throughput, the latency percentiles from
+ * submission to callback, and the share of events dropped are reported.
+ *
+ * USAGE: bench_event_delivery [-r RATE] [-s SIZE] [-d SECONDS] [-p PRODUCERS]
+ *                             [-m MODE[,MODE...]] [-j]
+ *
+ * Copyright (c) Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ */
+
+#include <getopt.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "BPF.h"
+
+const std::string BPF_PROGRAM = R"(
+struct event_t {
+  u64 ts;
+  char payload[EVENT_SIZE - sizeof(u64)];
+};
+
+BPF_ARRAY(drops, u64, 1);
+
+#ifdef USE_RINGBUF
+BPF_RINGBUF_OUTPUT(events, RINGBUF_PAGES);
+#else
+BPF_PERF_OUTPUT(events);
+BPF_PERCPU_ARRAY(scratch, struct event_t, 1);
+#endif
+
+TRACEPOINT_PROBE(raw_syscalls, sys_enter) {
+  if (args->id != TRIGGER_SYSCALL ||
+      (bpf_get_current_pid_tgid() >> 32) != TARGET_TGID)
+    return 0;
+
+  int zero = 0;
+#ifdef USE_RINGBUF
+  struct event_t *event = events.ringbuf_reserve(sizeof(*event));
+  if (!event) {
+    u64 *cnt = drops.lookup(&zero);
+    if (cnt)
+      lock_xadd(cnt, 1);
+    return 0;
+  }
+  event->ts = bpf_ktime_get_ns();
+  events.ringbuf_submit(event, 0);
+#else
+  struct event_t *event = scratch.lookup(&zero);
+  if (!event)
+    return 0;
+  event->ts = bpf_ktime_get_ns();
+  events.perf_submit(args, event, sizeof(*event));
+#endif
+  return 0;
+}
+)";
+
+namespace {
+
+const int kPerfBufferPages = 64;
+const int kRingBufferPages = 64 * 16;
+const int kBatchedWakeupEvents = 64;
+const int kPollTimeoutMs = 100;
+const unsigned kConsumerThreads = 2;
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Log-linear latency histogram: 16 sub-buckets per power of 2, so
+// percentiles are within about 6% of the exact value.
+class LatencyHist {
+ public:
+  static const int kSubBits = 4;
+  static const int kBuckets = (64 - kSubBits + 1) << kSubBits;
+
+  LatencyHist() : counts_(kBuckets, 0), count_(0), max_(0) {}
+
+  void add(uint64_t ns) {
+    counts_[bucket(ns)]++;
+    count_++;
+    max_ = std::max(max_, ns);
+  }
+
+  void merge(const LatencyHist& other) {
+    for (int i = 0; i < kBuckets; i++)
+      counts_[i] += other.counts_[i];
+    count_ += other.count_;
+    max_ = std::max(max_, other.max_);
+  }
+
+  uint64_t count() const { return count_; }
+  uint64_t max() const { return max_; }
+
+  // Upper bound of the bucket holding the q quantile
+  uint64_t percentile(double q) const {
+    if (count_ == 0)
+      return 0;
+    uint64_t rank = std::max<uint64_t>(1, q * count_ + 0.5), seen = 0;
+    for (int i = 0; i < kBuckets; i++) {
+      seen += counts_[i];
+      if (seen >= rank)
+        return std::min(upper(i), max_);
+    }
+    return max_;
+  }
+
+ private:
+  static int bucket(uint64_t v) {
+    if (v < (1ULL << kSubBits))
+      return v;
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - kSubBits;
+    return ((shift + 1) << kSubBits) + ((v >> shift) & ((1 << kSubBits) - 1));
+  }
+
+  static uint64_t upper(int b) {
+    if (b < (1 << kSubBits))
+      return b;
+    int shift = (b >> kSubBits) - 1;
+    uint64_t sub = b & ((1 << kSubBits) - 1);
+    return (((1ULL << kSubBits) + sub + 1) << shift) - 1;
+  }
+
+  std::vector<uint64_t> counts_;
+  uint64_t count_;
+  uint64_t max_;
+};
+
+// Counters of one consumer thread, merged once the run is over
+struct ConsumerStats {
+  LatencyHist latency;
+  uint64_t received = 0;
+  uint64_t lost = 0;
+};
+
+class Run {
+ public:
+  Run() : id_(++last_id_) {}
+
+  // Counters of the calling thread for this run
+  ConsumerStats& stats() {
+    thread_local ConsumerStats* stats = nullptr;
+    thread_local uint64_t owner = 0;
+    if (owner != id_) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stats_.emplace_back(new ConsumerStats());
+      stats = stats_.back().get();
+      owner = id_;
+    }
+    return *stats;
+  }
+
+  void on_event(const void* data) {
+    uint64_t ts;
+    std::memcpy(&ts, data, sizeof(ts));
+    auto& s = stats();
+    s.received++;
+    s.latency.add(now_ns() - ts);
+  }
+
+  ConsumerStats total() {
+    ConsumerStats res;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& s : stats_) {
+      res.latency.merge(s->latency);
+      res.received += s->received;
+      res.lost += s->lost;
+    }
+    return res;
+  }
+
+ private:
+  static std::atomic<uint64_t> last_id_;
+  const uint64_t id_;
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<ConsumerStats>> stats_;
+};
+
+std::atomic<uint64_t> Run::last_id_{0};
+
+void perf_cb(void* cookie, void* data, int size) {
+  if (size >= (int)sizeof(uint64_t))
+    static_cast<Run*>(cookie)->on_event(data);
+}
+
+void perf_lost_cb(void* cookie, uint64_t lost) {
+  static_cast<Run*>(cookie)->stats().lost += lost;
+}
+
+int ringbuf_cb(void* ctx, void* data, size_t size) {
+  if (size >= sizeof(uint64_t))
+    static_cast<Run*>(ctx)->on_event(data);
+  return 0;
+}
+
+struct Options {
+  uint64_t rate = 100000;  // events per second, 0 for unthrottled
+  int size = 64;
+  int duration = 5;
+  int producers = 1;
+  bool json = false;
+  std::vector<std::string> modes = {"perf", "perf-batched", "perf-threads",
+                                    "ringbuf", "ringbuf-busy"};
+};
+
+// Call getppid() at rate / producers per second on each thread until stop
+void produce(const Options& opts, std::atomic<bool>& stop,
+             std::atomic<uint64_t>& produced) {
+  uint64_t start = now_ns(), cnt = 0;
+  double per_ns = opts.rate / 1e9 / opts.producers;
+  while (!stop.load(std::memory_order_relaxed)) {
+    for (int i = 0; i < 64; i++)
+      syscall(SYS_getppid);
+    cnt += 64;
+    if (opts.rate) {
+      uint64_t due = start + cnt / per_ns;
+      uint64_t now = now_ns();
+      if (due > now)
+        std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+    }
+  }
+  produced += cnt;
+}
+
+bool run_mode(const Options& opts, const std::string& mode) {
+  bool ringbuf = mode.compare(0, 7, "ringbuf") == 0;
+  std::vector<std::string> cflags = {
+      "-DEVENT_SIZE=" + std::to_string(opts.size),
+      "-DTRIGGER_SYSCALL=" + std::to_string(SYS_getppid),
+      "-DTARGET_TGID=" + std::to_string(getpid()),
+  };
+  if (ringbuf) {
+    cflags.push_back("-DUSE_RINGBUF");
+    cflags.push_back("-DRINGBUF_PAGES=" + std::to_string(kRingBufferPages));
+  }
+
+  ebpf::BPF bpf;
+  auto res = bpf.init(BPF_PROGRAM, cflags, {});
+  if (!res.ok()) {
+    std::fprintf(stderr, "%s: %s\n", mode.c_str(), res.msg().c_str());
+    return false;
+  }
+
+  Run run;
+  ebpf::BPFPerfBuffer* perf_buffer = nullptr;
+  ebpf::BPFRingBuffer* ring_buffer = nullptr;
+  if (ringbuf) {
+    res = bpf.open_ring_buffer("events", &ringbuf_cb, &run);
+    ring_buffer = bpf.get_ring_buffer("events");
+  } else {
+    int wakeup = mode == "perf-batched" ? kBatchedWakeupEvents : 1;
+    res = bpf.open_perf_buffer("events", &perf_cb, &perf_lost_cb, &run,
+                               kPerfBufferPages, wakeup);
+    perf_buffer = bpf.get_perf_buffer("events");
+  }
+  if (!res.ok()) {
+    std::fprintf(stderr, "%s: %s\n", mode.c_str(), res.msg().c_str());
+    return false;
+  }
+  if (mode == "perf-threads") {
+    res = perf_buffer->start_consumers(kConsumerThreads);
+    if (!res.ok()) {
+      std::fprintf(stderr, "%s: %s\n", mode.c_str(), res.msg().c_str());
+      return false;
+    }
+  }
+
+  res = bpf.attach_tracepoint("raw_syscalls:sys_enter",
+                              "tracepoint__raw_syscalls__sys_enter");
+  if (!res.ok()) {
+    std::fprintf(stderr, "%s: %s\n", mode.c_str(), res.msg().c_str());
+    return false;
+  }
+
+  std::atomic<bool> stop{false};
+  std::atomic<uint64_t> produced{0};
+  std::vector<std::thread> producers;
+  for (int i = 0; i < opts.producers; i++)
+    producers.emplace_back(produce, std::cref(opts), std::ref(stop),
+                           std::ref(produced));
+
+  uint64_t start = now_ns();
+  uint64_t end = start + opts.duration * 1000000000ULL;
+  while (now_ns() < end) {
+    if (mode == "perf-threads")
+      std::this_thread::sleep_for(std::chrono::milliseconds(kPollTimeoutMs));
+    else if (perf_buffer)
+      perf_buffer->poll(kPollTimeoutMs);
+    else if (mode == "ringbuf-busy")
+      ring_buffer->busy_poll(kPollTimeoutMs);
+    else
+      ring_buffer->poll(kPollTimeoutMs);
+  }
+  stop = true;
+  for (auto& t : producers)
+    t.join();
+  bpf.detach_tracepoint("raw_syscalls:sys_enter");
+  double elapsed = (now_ns() - start) / 1e9;
+
+  // Drain what was submitted before detaching, below the wakeup threshold too
+  if (mode == "perf-threads")
+    perf_buffer->stop_consumers();
+  if (perf_buffer)
+    perf_buffer->consume_all();
+  else
+    while (ring_buffer->consume() > 0) {
+    }
+
+  ConsumerStats total = run.total();
+  uint64_t dropped = total.lost;
+  if (ringbuf) {
+    auto drops = bpf.get_array_table<uint64_t>("drops");
+    uint64_t cnt = 0;
+    drops.get_value(0, cnt);
+    dropped += cnt;
+  }
+  uint64_t sent = produced.load();
+  double drop_pct = sent ? 100.0 * (sent - std::min(sent, total.received)) /
+                               sent
+                         : 0;
+
+  if (opts.json) {
+    std::printf(
+        "{\"mode\": \"%s\", \"size\": %d, \"rate\": %" PRIu64
+        ", \"produced\": %" PRIu64 ", \"received\": %" PRIu64
+        ", \"dropped\": %" PRIu64
+        ", \"drop_pct\": %.3f, \"events_per_sec\": %.0f, "
+        "\"p50_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64
+        ", \"p999_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64 "}\n",
+        mode.c_str(), opts.size, opts.rate, sent, total.received, dropped,
+        drop_pct, total.received / elapsed, total.latency.percentile(0.5),
+        total.latency.percentile(0.99), total.latency.percentile(0.999),
+        total.latency.max());
+  } else {
+    std::printf("%-13s %10" PRIu64 " %10" PRIu64 " %8" PRIu64
+                " %7.3f%% %12.0f %9.1f %9.1f %9.1f %9.1f\n",
+                mode.c_str(), sent, total.received, dropped, drop_pct,
+                total.received / elapsed,
+                total.latency.percentile(0.5) / 1e3,
+                total.latency.percentile(0.99) / 1e3,
+                total.latency.percentile(0.999) / 1e3,
+                total.latency.max() / 1e3);
+  }
+  std::fflush(stdout);
+  return true;
+}
+
+void usage(const char* prog) {
+  std::fprintf(
+      stderr,
+      "USAGE: %s [-r RATE] [-s SIZE] [-d SECONDS] [-p PRODUCERS]\n"
+      "          [-m MODE[,MODE...]] [-j]\n"
+      "  -r RATE       events per second over all producers, 0 for as many\n"
+      "                as possible (default 100000)\n"
+      "  -s SIZE       event size in bytes, at least 8 (default 64)\n"
+      "  -d SECONDS    duration of each mode (default 5)\n"
+      "  -p PRODUCERS  producer threads (default 1)\n"
+      "  -m MODES      perf, perf-batched, perf-threads, ringbuf and/or\n"
+      "                ringbuf-busy (default all)\n"
+      "  -j            print one JSON object per mode\n",
+      prog);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options opts;
+  int opt;
+  while ((opt = getopt(argc, argv, "r:s:d:p:m:jh")) != -1) {
+    switch (opt) {
+    case 'r':
+      opts.rate = std::strtoull(optarg, nullptr, 10);
+      break;
+    case 's':
+      opts.size = std::atoi(optarg);
+      break;
+    case 'd':
+      opts.duration = std::atoi(optarg);
+      break;
+    case 'p':
+      opts.producers = std::atoi(optarg);
+      break;
+    case 'm': {
+      opts.modes.clear();
+      std::stringstream ss(optarg);
+      std::string mode;
+      while (std::getline(ss, mode, ','))
+        opts.modes.push_back(mode);
+      break;
+    }
+    case 'j':
+      opts.json = true;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (opts.size < (int)sizeof(uint64_t) || opts.duration <= 0 ||
+      opts.producers <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  for (const auto& mode : opts.modes) {
+    if (mode != "perf" && mode != "perf-batched" && mode != "perf-threads" &&
+        mode != "ringbuf" && mode != "ringbuf-busy") {
+      std::fprintf(stderr, "Unknown mode %s\n", mode.c_str());
+      return 1;
+    }
+  }
+
+  if (!opts.json)
+    std::printf("%-13s %10s %10s %8s %8s %12s %9s %9s %9s %9s\n", "MODE",
+                "PRODUCED", "RECEIVED", "DROPPED", "DROP", "EVENTS/S",
+                "P50(us)", "P99(us)", "P999(us)", "MAX(us)");
+  bool ok = true;
+  for (const auto& mode : opts.modes)
+    ok = run_mode(opts, mode) && ok;
+  return ok ? 0 : 1;
+}
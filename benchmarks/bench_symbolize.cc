@@ -0,0 +1,501 @@
+/*
+ * bench_symbolize Measure the loading and lookups of symbol tables.
+ *
+ * The symbols of /proc/kallsyms, of the ELF files mapped by a process and of
+ * the same files looked up by build-id are loaded with each lazy_symbolize
+ * setting. For each, the time taken by the first lookup to load the tables,
+ * the resident memory they add, and the lookups per second are reported:
+ *
+ *   uniform   addresses picked uniformly among all function symbols
+ *   zipf      addresses picked with a Zipf distribution, as the hot
+ *             functions of a profile are
+ *   name      bcc_symcache_resolve_name() of the same functions
+ *
+ * By default the process is the benchmark itself, which links libbcc and
+ * LLVM statically; -f maps other large shared objects into it. Symbol
+ * indexes are used when BCC_SYM_CACHE_DIR is set, as in the tools.
+ *
+ * USAGE: bench_symbolize [-p PID] [-f FILE[,FILE...]] [-n LOOKUPS]
+ *                        [-z SKEW] [-l LAZY[,LAZY...]] [-j]
+ *
+ * Copyright (c) Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ */
+
+#include <dlfcn.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "bcc_elf.h"
+#include "bcc_proc.h"
+#include "bcc_syms.h"
+#include "linux/bpf.h"
+
+namespace {
+
+// Function symbols kept per module, the rest adds little to the lookups
+const size_t kMaxSymbolsPerModule = 100000;
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Resident memory of the benchmark in bytes
+uint64_t rss_bytes() {
+  unsigned long size = 0, resident = 0;
+  FILE* f = std::fopen("/proc/self/statm", "r");
+  if (!f)
+    return 0;
+  if (std::fscanf(f, "%lu %lu", &size, &resident) != 2)
+    resident = 0;
+  std::fclose(f);
+  return (uint64_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+// Resident memory added since before bytes, 0 if the kernel took some back
+uint64_t rss_growth(uint64_t before) {
+  uint64_t now = rss_bytes();
+  return now > before ? now - before : 0;
+}
+
+struct Options {
+  int pid = -1;  // the benchmark itself
+  std::vector<std::string> files;
+  size_t lookups = 1000000;
+  double skew = 1.0;
+  bool json = false;
+  std::vector<int> lazy = {0, 1};
+};
+
+struct Symbol {
+  std::string module;
+  std::string name;
+  uint64_t addr;  // in the process, or in the ELF file for build-ids
+};
+
+struct Module {
+  std::string name;  // as mapped by the process
+  std::string path;  // as opened from here
+  uint64_t start;
+};
+
+struct Result {
+  std::string target;
+  int lazy;  // -1 if the symbols are always loaded the same way
+  size_t symbols = 0;
+  double load_ms = 0;
+  uint64_t rss = 0;
+  double uniform_ops = 0;
+  double zipf_ops = 0;
+  double name_ops = 0;
+  double resolved_pct = 0;
+};
+
+// Indexes into the symbols, uniform or heavily skewed
+class Streams {
+ public:
+  Streams(size_t nsyms, const Options& opts) {
+    std::mt19937_64 rng(42);
+    std::uniform_int_distribution<size_t> pick(0, nsyms - 1);
+    uniform_.resize(opts.lookups);
+    for (auto& i : uniform_)
+      i = pick(rng);
+
+    // The hottest functions are spread over the address space
+    std::vector<size_t> rank(nsyms);
+    for (size_t i = 0; i < nsyms; i++)
+      rank[i] = i;
+    std::shuffle(rank.begin(), rank.end(), rng);
+    std::vector<double> cdf(nsyms);
+    double sum = 0;
+    for (size_t i = 0; i < nsyms; i++)
+      cdf[i] = sum += 1.0 / std::pow(i + 1, opts.skew);
+    std::uniform_real_distribution<double> u(0, sum);
+    zipf_.resize(opts.lookups);
+    for (auto& i : zipf_) {
+      size_t r = std::lower_bound(cdf.begin(), cdf.end(), u(rng)) - cdf.begin();
+      i = rank[std::min(r, nsyms - 1)];
+    }
+  }
+
+  const std::vector<size_t>& uniform() const { return uniform_; }
+  const std::vector<size_t>& zipf() const { return zipf_; }
+
+ private:
+  std::vector<size_t> uniform_;
+  std::vector<size_t> zipf_;
+};
+
+// Lookups per second of fn over the stream, and how many succeeded
+template <typename Fn>
+double measure(const std::vector<size_t>& stream, Fn fn, size_t* resolved) {
+  size_t ok = 0;
+  uint64_t start = now_ns();
+  for (size_t i : stream)
+    ok += fn(i) ? 1 : 0;
+  double elapsed = (now_ns() - start) / 1e9;
+  if (resolved)
+    *resolved = ok;
+  return elapsed > 0 ? stream.size() / elapsed : 0;
+}
+
+// SYM_CB has no payload
+std::vector<Symbol>* collecting = nullptr;
+std::string collecting_module;
+size_t collected = 0;
+
+int collect_sym(const char* name, uint64_t addr) {
+  collecting->push_back({collecting_module, name, addr});
+  return ++collected < kMaxSymbolsPerModule ? 0 : -1;
+}
+
+void collect_ksym(const char* name, const char* mod, uint64_t addr,
+                  void* payload) {
+  auto syms = static_cast<std::vector<Symbol>*>(payload);
+  syms->push_back({mod ? mod : "", name, addr});
+}
+
+int collect_module(mod_info* info, int enter_ns, void* payload) {
+  auto mods = static_cast<std::vector<Module>*>(payload);
+  for (const auto& m : *mods)
+    if (m.name == info->name)
+      return 0;
+  mods->push_back({info->name, info->name, info->start_addr});
+  return 0;
+}
+
+void print(const Result& r, const Options& opts) {
+  if (opts.json) {
+    std::printf(
+        "{\"target\": \"%s\", \"lazy\": %d, \"symbols\": %zu, "
+        "\"load_ms\": %.3f, \"rss_bytes\": %" PRIu64
+        ", \"uniform_ops\": %.0f, \"zipf_ops\": %.0f, \"name_ops\": %.0f, "
+        "\"resolved_pct\": %.2f}\n",
+        r.target.c_str(), r.lazy, r.symbols, r.load_ms, r.rss, r.uniform_ops,
+        r.zipf_ops, r.name_ops, r.resolved_pct);
+  } else {
+    std::printf("%-9s %4s %9zu %10.1f %9.1f %12.0f %12.0f %12.0f %8.2f%%\n",
+                r.target.c_str(),
+                r.lazy < 0 ? "-" : std::to_string(r.lazy).c_str(), r.symbols,
+                r.load_ms, r.rss / 1048576.0, r.uniform_ops, r.zipf_ops,
+                r.name_ops, r.resolved_pct);
+  }
+  std::fflush(stdout);
+}
+
+// The kernel table is loaded once per process, whatever the options
+bool bench_kernel(const Options& opts) {
+  std::vector<Symbol> syms;
+  if (bcc_procutils_each_ksym(collect_ksym, &syms) < 0 || syms.empty()) {
+    std::fprintf(stderr, "kernel: cannot read /proc/kallsyms\n");
+    return false;
+  }
+  bool have_addrs = false;
+  for (const auto& s : syms)
+    have_addrs = have_addrs || s.addr != 0;
+  Streams streams(syms.size(), opts);
+
+  Result r;
+  r.target = "kernel";
+  r.lazy = -1;
+  r.symbols = syms.size();
+
+  uint64_t rss = rss_bytes();
+  uint64_t start = now_ns();
+  void* cache = bcc_symcache_new(-1, nullptr);
+  struct bcc_symbol sym;
+  bcc_symcache_resolve(cache, syms[0].addr, &sym);
+  r.load_ms = (now_ns() - start) / 1e6;
+  r.rss = rss_growth(rss);
+
+  size_t resolved = 0;
+  if (have_addrs) {
+    r.uniform_ops = measure(
+        streams.uniform(),
+        [&](size_t i) {
+          return bcc_symcache_resolve(cache, syms[i].addr, &sym) == 0;
+        },
+        &resolved);
+    r.zipf_ops = measure(streams.zipf(), [&](size_t i) {
+      return bcc_symcache_resolve(cache, syms[i].addr, &sym) == 0;
+    }, nullptr);
+    r.resolved_pct = 100.0 * resolved / streams.uniform().size();
+  } else {
+    std::fprintf(stderr,
+                 "kernel: addresses are hidden by kptr_restrict, only names "
+                 "are looked up\n");
+  }
+  uint64_t addr;
+  r.name_ops = measure(streams.uniform(), [&](size_t i) {
+    return bcc_symcache_resolve_name(cache, nullptr, syms[i].name.c_str(),
+                                     &addr) == 0;
+  }, nullptr);
+  bcc_free_symcache(cache, -1);
+  print(r, opts);
+  return true;
+}
+
+// The symbols of every ELF module of the process, with their addresses
+// within it as resolved by a cache that is then freed
+std::vector<Symbol> process_symbols(const std::vector<Module>& mods,
+                                    int pid) {
+  std::vector<Symbol> raw, syms;
+  for (const auto& m : mods) {
+    collecting = &raw;
+    collecting_module = m.path;
+    collected = 0;
+    size_t before = raw.size();
+    bcc_foreach_function_symbol(m.path.c_str(), collect_sym);
+    for (size_t i = before; i < raw.size(); i++)
+      raw[i].module = m.name;
+  }
+  collecting = nullptr;
+
+  void* cache = bcc_symcache_new(pid, nullptr);
+  for (auto& s : raw) {
+    uint64_t addr;
+    if (bcc_symcache_resolve_name(cache, s.module.c_str(), s.name.c_str(),
+                                  &addr) == 0 && addr) {
+      s.addr = addr;
+      syms.push_back(std::move(s));
+    }
+  }
+  bcc_free_symcache(cache, pid);
+  return syms;
+}
+
+bool bench_process(const Options& opts, const std::vector<Module>& mods,
+                   const std::vector<Symbol>& syms, int lazy) {
+  int pid = opts.pid < 0 ? getpid() : opts.pid;
+  Streams streams(syms.size(), opts);
+  Result r;
+  r.target = "process";
+  r.lazy = lazy;
+  r.symbols = syms.size();
+
+  struct bcc_symbol_option option = {
+      .use_debug_file = 1,
+      .check_debug_file_crc = 1,
+      .lazy_symbolize = lazy,
+      .use_symbol_type = BCC_SYM_ALL_TYPES,
+  };
+  struct bcc_symbol sym;
+  uint64_t rss = rss_bytes();
+  uint64_t start = now_ns();
+  void* cache = bcc_symcache_new(pid, &option);
+  // A lookup in a module loads its table
+  for (const auto& m : mods)
+    bcc_symcache_resolve(cache, m.start, &sym);
+  r.load_ms = (now_ns() - start) / 1e6;
+  r.rss = rss_growth(rss);
+
+  size_t resolved = 0;
+  r.uniform_ops = measure(
+      streams.uniform(),
+      [&](size_t i) {
+        return bcc_symcache_resolve(cache, syms[i].addr, &sym) == 0;
+      },
+      &resolved);
+  r.zipf_ops = measure(streams.zipf(), [&](size_t i) {
+    return bcc_symcache_resolve(cache, syms[i].addr, &sym) == 0;
+  }, nullptr);
+  uint64_t addr;
+  r.name_ops = measure(streams.uniform(), [&](size_t i) {
+    return bcc_symcache_resolve_name(cache, syms[i].module.c_str(),
+                                     syms[i].name.c_str(), &addr) == 0;
+  }, nullptr);
+  r.resolved_pct = 100.0 * resolved / streams.uniform().size();
+  bcc_free_symcache(cache, pid);
+  print(r, opts);
+  return true;
+}
+
+bool parse_build_id(const char* hex, unsigned char* out) {
+  for (int i = 0; i < BPF_BUILD_ID_SIZE; i++) {
+    unsigned int byte;
+    if (std::sscanf(hex + 2 * i, "%2x", &byte) != 1)
+      return false;
+    out[i] = byte;
+  }
+  return true;
+}
+
+// BuildSyms reads every name of a module when it is first used
+bool bench_build_id(const Options& opts, const std::vector<Module>& mods) {
+  struct Entry {
+    unsigned char build_id[BPF_BUILD_ID_SIZE];
+    uint64_t offset;
+  };
+  std::vector<Entry> entries;
+  std::vector<std::string> paths;
+  std::vector<Symbol> raw;
+  for (const auto& m : mods) {
+    char hex[BPF_BUILD_ID_SIZE * 2 + 1] = {};
+    Entry e;
+    if (bcc_elf_get_buildid(m.path.c_str(), hex) < 0 ||
+        !parse_build_id(hex, e.build_id))
+      continue;
+    paths.push_back(m.path);
+    collecting = &raw;
+    collecting_module = m.path;
+    collected = 0;
+    size_t before = raw.size();
+    bcc_foreach_function_symbol(m.path.c_str(), collect_sym);
+    for (size_t i = before; i < raw.size(); i++) {
+      e.offset = raw[i].addr;
+      entries.push_back(e);
+    }
+  }
+  collecting = nullptr;
+  if (entries.empty()) {
+    std::fprintf(stderr, "build-id: no module has a build-id\n");
+    return false;
+  }
+  Streams streams(entries.size(), opts);
+
+  Result r;
+  r.target = "build-id";
+  r.lazy = -1;
+  r.symbols = entries.size();
+
+  struct bcc_symbol sym;
+  struct bpf_stack_build_id trace = {};
+  trace.status = BPF_STACK_BUILD_ID_VALID;
+  uint64_t rss = rss_bytes();
+  uint64_t start = now_ns();
+  void* cache = bcc_buildsymcache_new();
+  for (const auto& p : paths)
+    bcc_buildsymcache_add_module(cache, p.c_str());
+  std::set<std::string> loaded;
+  for (const auto& e : entries) {
+    std::string id((const char*)e.build_id, BPF_BUILD_ID_SIZE);
+    if (!loaded.insert(id).second)
+      continue;
+    std::memcpy(trace.build_id, e.build_id, BPF_BUILD_ID_SIZE);
+    trace.offset = e.offset;
+    bcc_buildsymcache_resolve(cache, &trace, &sym);
+  }
+  r.load_ms = (now_ns() - start) / 1e6;
+  r.rss = rss_growth(rss);
+
+  auto lookup = [&](size_t i) {
+    std::memcpy(trace.build_id, entries[i].build_id, BPF_BUILD_ID_SIZE);
+    trace.offset = entries[i].offset;
+    return bcc_buildsymcache_resolve(cache, &trace, &sym) == 0;
+  };
+  size_t resolved = 0;
+  r.uniform_ops = measure(streams.uniform(), lookup, &resolved);
+  r.zipf_ops = measure(streams.zipf(), lookup, nullptr);
+  r.resolved_pct = 100.0 * resolved / streams.uniform().size();
+  bcc_free_buildsymcache(cache);
+  print(r, opts);
+  return true;
+}
+
+void usage(const char* prog) {
+  std::fprintf(
+      stderr,
+      "USAGE: %s [-p PID] [-f FILE[,FILE...]] [-n LOOKUPS] [-z SKEW]\n"
+      "          [-l LAZY[,LAZY...]] [-j]\n"
+      "  -p PID      symbolize another process (default this one)\n"
+      "  -f FILES    shared objects to load into this process first\n"
+      "  -n LOOKUPS  lookups of each kind (default 1000000)\n"
+      "  -z SKEW     exponent of the Zipf distribution (default 1.0)\n"
+      "  -l LAZY     lazy_symbolize settings to run (default 0,1)\n"
+      "  -j          print one JSON object per run\n",
+      prog);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options opts;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:f:n:z:l:jh")) != -1) {
+    switch (opt) {
+    case 'p':
+      opts.pid = std::atoi(optarg);
+      break;
+    case 'f': {
+      std::stringstream ss(optarg);
+      std::string file;
+      while (std::getline(ss, file, ','))
+        opts.files.push_back(file);
+      break;
+    }
+    case 'n':
+      opts.lookups = std::strtoull(optarg, nullptr, 10);
+      break;
+    case 'z':
+      opts.skew = std::atof(optarg);
+      break;
+    case 'l': {
+      opts.lazy.clear();
+      std::stringstream ss(optarg);
+      std::string lazy;
+      while (std::getline(ss, lazy, ','))
+        opts.lazy.push_back(std::atoi(lazy.c_str()) ? 1 : 0);
+      break;
+    }
+    case 'j':
+      opts.json = true;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (opts.lookups == 0 || opts.skew < 0 || opts.pid == 0 ||
+      (opts.pid > 0 && !opts.files.empty())) {
+    usage(argv[0]);
+    return 1;
+  }
+  for (const auto& file : opts.files) {
+    if (!dlopen(file.c_str(), RTLD_LAZY | RTLD_LOCAL)) {
+      std::fprintf(stderr, "%s\n", dlerror());
+      return 1;
+    }
+  }
+
+  int pid = opts.pid < 0 ? getpid() : opts.pid;
+  std::vector<Module> mods;
+  if (bcc_procutils_each_module(pid, collect_module, &mods) < 0) {
+    std::fprintf(stderr, "Cannot read the mappings of %d\n", pid);
+    return 1;
+  }
+  // Open the files of another process within its mount namespace
+  if (opts.pid > 0)
+    for (auto& m : mods)
+      m.path = "/proc/" + std::to_string(pid) + "/root" + m.name;
+
+  if (!opts.json)
+    std::printf("%-9s %4s %9s %10s %9s %12s %12s %12s %9s\n", "TARGET",
+                "LAZY", "SYMBOLS", "LOAD(ms)", "RSS(MB)", "UNIFORM/S",
+                "ZIPF/S", "NAME/S", "RESOLVED");
+  bool ok = bench_kernel(opts);
+  std::vector<Symbol> syms = process_symbols(mods, pid);
+  if (syms.empty()) {
+    std::fprintf(stderr, "process: no function symbols found\n");
+    ok = false;
+  } else {
+    for (int lazy : opts.lazy)
+      ok = bench_process(opts, mods, syms, lazy) && ok;
+  }
+  ok = bench_build_id(opts, mods) && ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,407 @@
+/*
+ * bench_table_ops Measure the throughput of the table APIs from userspace.
+ *
+ * For each map type and size, u64 keys and values are written, read and
+ * removed through the C++ table classes:
+ *
+ *   hash           BPFHashTable: update, get, remove, get_table_offline with
+ *                  and without batch ops, drain and clear_table_non_atomic
+ *   percpu_hash    BPFPercpuHashTable: the same, and
+ *                  get_table_offline_reduced
+ *   array          BPFArrayTable: update, get and get_table_offline
+ *   queue, stack   BPFQueueStackTable: push and pop
+ *
+ * The point operations (update, get, remove, push, pop) are split over each
+ * number of threads given, to show how they scale with CPUs. The operations
+ * over the whole table run on one thread. Every rate is in entries per
+ * second.
+ *
+ * USAGE: bench_table_ops [-s SIZE[,SIZE...]] [-m MAP[,MAP...]]
+ *                        [-t THREADS[,THREADS...]] [-b BATCH] [-j]
+ *
+ * Copyright (c) Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ */
+
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "BPF.h"
+
+const std::string BPF_PROGRAM = R"(
+#if defined(MAP_hash)
+BPF_HASH(table, u64, u64, MAX_ENTRIES);
+#elif defined(MAP_percpu_hash)
+BPF_PERCPU_HASH(table, u64, u64, MAX_ENTRIES);
+#elif defined(MAP_array)
+BPF_ARRAY(table, u64, MAX_ENTRIES);
+#elif defined(MAP_queue)
+BPF_QUEUE(table, u64, MAX_ENTRIES);
+#elif defined(MAP_stack)
+BPF_STACK(table, u64, MAX_ENTRIES);
+#endif
+)";
+
+namespace {
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct Options {
+  std::vector<size_t> sizes = {1000, 100000, 1000000};
+  std::vector<std::string> maps = {"hash", "percpu_hash", "array", "queue",
+                                   "stack"};
+  std::vector<int> threads;
+  long batch = -1;  // the table default
+  bool json = false;
+};
+
+class Reporter {
+ public:
+  Reporter(const Options& opts, const std::string& map, size_t size)
+      : opts_(opts), map_(map), size_(size) {}
+
+  void report(const std::string& op, int threads, size_t entries,
+              uint64_t ns, bool ok = true) {
+    double ops = ns ? entries * 1e9 / ns : 0;
+    if (!ok) {
+      std::fprintf(stderr, "%s %zu: %s failed\n", map_.c_str(), size_,
+                   op.c_str());
+      ok_ = false;
+    }
+    if (opts_.json)
+      std::printf("{\"map\": \"%s\", \"size\": %zu, \"op\": \"%s\", "
+                  "\"threads\": %d, \"entries\": %zu, \"ms\": %.3f, "
+                  "\"ops_per_sec\": %.0f, \"ok\": %s}\n",
+                  map_.c_str(), size_, op.c_str(), threads, entries, ns / 1e6,
+                  ops, ok ? "true" : "false");
+    else
+      std::printf("%-12s %9zu %-26s %7d %10.1f %12.0f%s\n", map_.c_str(),
+                  size_, op.c_str(), threads, ns / 1e6, ops,
+                  ok ? "" : "  FAILED");
+    std::fflush(stdout);
+  }
+
+  bool ok() const { return ok_; }
+
+ private:
+  const Options& opts_;
+  std::string map_;
+  size_t size_;
+  bool ok_ = true;
+};
+
+// Run fn(begin, end) over [0, n) split into one range per thread, and
+// return the wall time and whether every call succeeded
+uint64_t run_threads(int nthreads, size_t n,
+                     const std::function<bool(size_t, size_t)>& fn,
+                     bool* ok) {
+  std::vector<std::thread> threads;
+  std::vector<char> res(nthreads, 1);
+  uint64_t start = now_ns();
+  for (int t = 0; t < nthreads; t++) {
+    size_t begin = n * t / nthreads, end = n * (t + 1) / nthreads;
+    threads.emplace_back([&, t, begin, end]() { res[t] = fn(begin, end); });
+  }
+  for (auto& t : threads)
+    t.join();
+  uint64_t ns = now_ns() - start;
+  *ok = std::all_of(res.begin(), res.end(), [](char r) { return r; });
+  return ns;
+}
+
+std::vector<uint64_t> shuffled_keys(size_t n) {
+  std::vector<uint64_t> keys(n);
+  std::iota(keys.begin(), keys.end(), 0);
+  std::shuffle(keys.begin(), keys.end(), std::mt19937_64(42));
+  return keys;
+}
+
+template <class Table>
+void set_batch(Table& table, const Options& opts) {
+  if (opts.batch >= 0)
+    table.set_batch_size(opts.batch);
+}
+
+// update, get and remove on hash tables, with value made by make_value
+template <class Table, class Value>
+void bench_hash_points(ebpf::BPF& bpf, Reporter& rep, const Options& opts,
+                       const std::vector<uint64_t>& keys,
+                       const std::function<Table(ebpf::BPF&)>& get_table,
+                       const Value& value) {
+  bool ok;
+  for (int nthreads : opts.threads) {
+    uint64_t ns = run_threads(nthreads, keys.size(), [&](size_t b, size_t e) {
+      Table t = get_table(bpf);
+      for (size_t i = b; i < e; i++)
+        if (!t.update_value(keys[i], value).ok())
+          return false;
+      return true;
+    }, &ok);
+    rep.report("update", nthreads, keys.size(), ns, ok);
+
+    ns = run_threads(nthreads, keys.size(), [&](size_t b, size_t e) {
+      Table t = get_table(bpf);
+      Value v;
+      for (size_t i = b; i < e; i++)
+        if (!t.get_value(keys[i], v).ok())
+          return false;
+      return true;
+    }, &ok);
+    rep.report("get", nthreads, keys.size(), ns, ok);
+
+    ns = run_threads(nthreads, keys.size(), [&](size_t b, size_t e) {
+      Table t = get_table(bpf);
+      for (size_t i = b; i < e; i++)
+        if (!t.remove_value(keys[i]).ok())
+          return false;
+      return true;
+    }, &ok);
+    rep.report("remove", nthreads, keys.size(), ns, ok);
+  }
+}
+
+template <class Table, class Value>
+bool fill(Table& t, const std::vector<uint64_t>& keys, const Value& value) {
+  for (uint64_t k : keys)
+    if (!t.update_value(k, value).ok())
+      return false;
+  return true;
+}
+
+// The operations over the whole table, on a full table
+template <class Table, class Value>
+void bench_hash_walks(Table& t, Reporter& rep, const Options& opts,
+                      const std::vector<uint64_t>& keys, const Value& value) {
+  size_t n = keys.size();
+  bool ok = fill(t, keys, value);
+  size_t batch = t.get_batch_size();
+  uint64_t start = now_ns();
+  size_t got = t.get_table_offline().size();
+  rep.report("get_table_offline", 1, got, now_ns() - start, ok && got == n);
+
+  t.set_batch_size(0);
+  start = now_ns();
+  got = t.get_table_offline().size();
+  rep.report("get_table_offline_nobatch", 1, got, now_ns() - start,
+             got == n);
+  t.set_batch_size(batch);
+
+  std::vector<std::pair<uint64_t, Value>> drained;
+  start = now_ns();
+  ok = t.drain(drained).ok();
+  rep.report("drain", 1, drained.size(), now_ns() - start,
+             ok && drained.size() == n);
+
+  ok = fill(t, keys, value);
+  start = now_ns();
+  ok = t.clear_table_non_atomic().ok() && ok;
+  rep.report("clear_table_non_atomic", 1, n, now_ns() - start, ok);
+}
+
+bool bench_map(const Options& opts, const std::string& map, size_t size) {
+  std::vector<std::string> cflags = {
+      "-DMAP_" + map,
+      "-DMAX_ENTRIES=" + std::to_string(size),
+  };
+  ebpf::BPF bpf;
+  auto res = bpf.init(BPF_PROGRAM, cflags, {});
+  if (!res.ok()) {
+    std::fprintf(stderr, "%s %zu: %s\n", map.c_str(), size,
+                 res.msg().c_str());
+    return false;
+  }
+  Reporter rep(opts, map, size);
+  std::vector<uint64_t> keys = shuffled_keys(size);
+  bool ok;
+
+  if (map == "hash") {
+    typedef ebpf::BPFHashTable<uint64_t, uint64_t> Table;
+    std::function<Table(ebpf::BPF&)> get = [&opts](ebpf::BPF& b) {
+      auto t = b.get_hash_table<uint64_t, uint64_t>("table");
+      set_batch(t, opts);
+      return t;
+    };
+    bench_hash_points<Table, uint64_t>(bpf, rep, opts, keys, get, 1);
+    Table t = get(bpf);
+    bench_hash_walks<Table, uint64_t>(t, rep, opts, keys, 1);
+  } else if (map == "percpu_hash") {
+    typedef ebpf::BPFPercpuHashTable<uint64_t, uint64_t> Table;
+    std::function<Table(ebpf::BPF&)> get = [&opts](ebpf::BPF& b) {
+      auto t = b.get_percpu_hash_table<uint64_t, uint64_t>("table");
+      set_batch(t, opts);
+      return t;
+    };
+    std::vector<uint64_t> value(ebpf::BPFTable::get_possible_cpu_count(), 1);
+    bench_hash_points<Table, std::vector<uint64_t>>(bpf, rep, opts, keys, get,
+                                                    value);
+    Table t = get(bpf);
+    ok = fill(t, keys, value);
+    uint64_t start = now_ns();
+    size_t got = t.get_table_offline_reduced(std::plus<uint64_t>()).size();
+    rep.report("get_table_offline_reduced", 1, got, now_ns() - start,
+               ok && got == size);
+    t.clear_table_non_atomic();
+    bench_hash_walks<Table, std::vector<uint64_t>>(t, rep, opts, keys, value);
+  } else if (map == "array") {
+    for (int nthreads : opts.threads) {
+      uint64_t ns = run_threads(nthreads, size, [&](size_t b, size_t e) {
+        auto t = bpf.get_array_table<uint64_t>("table");
+        for (size_t i = b; i < e; i++)
+          if (!t.update_value(keys[i], 1).ok())
+            return false;
+        return true;
+      }, &ok);
+      rep.report("update", nthreads, size, ns, ok);
+
+      ns = run_threads(nthreads, size, [&](size_t b, size_t e) {
+        auto t = bpf.get_array_table<uint64_t>("table");
+        uint64_t v;
+        for (size_t i = b; i < e; i++)
+          if (!t.get_value(keys[i], v).ok())
+            return false;
+        return true;
+      }, &ok);
+      rep.report("get", nthreads, size, ns, ok);
+    }
+    auto t = bpf.get_array_table<uint64_t>("table");
+    uint64_t start = now_ns();
+    size_t got = t.get_table_offline().size();
+    rep.report("get_table_offline", 1, got, now_ns() - start, got == size);
+  } else {
+    for (int nthreads : opts.threads) {
+      uint64_t ns = run_threads(nthreads, size, [&](size_t b, size_t e) {
+        auto t = bpf.get_queuestack_table<uint64_t>("table");
+        for (size_t i = b; i < e; i++)
+          if (!t.push_value(keys[i]).ok())
+            return false;
+        return true;
+      }, &ok);
+      rep.report("push", nthreads, size, ns, ok);
+
+      ns = run_threads(nthreads, size, [&](size_t b, size_t e) {
+        auto t = bpf.get_queuestack_table<uint64_t>("table");
+        uint64_t v;
+        for (size_t i = b; i < e; i++)
+          if (!t.pop_value(v).ok())
+            return false;
+        return true;
+      }, &ok);
+      rep.report("pop", nthreads, size, ns, ok);
+    }
+  }
+  return rep.ok();
+}
+
+template <class T>
+std::vector<T> parse_list(const char* arg,
+                          const std::function<T(const std::string&)>& conv) {
+  std::vector<T> res;
+  std::stringstream ss(arg);
+  std::string item;
+  while (std::getline(ss, item, ','))
+    res.push_back(conv(item));
+  return res;
+}
+
+void usage(const char* prog) {
+  std::fprintf(
+      stderr,
+      "USAGE: %s [-s SIZE[,SIZE...]] [-m MAP[,MAP...]]\n"
+      "          [-t THREADS[,THREADS...]] [-b BATCH] [-j]\n"
+      "  -s SIZES    max entries of the tables, all filled (default\n"
+      "              1000,100000,1000000, up to 10000000 or more)\n"
+      "  -m MAPS     hash, percpu_hash, array, queue and/or stack (default "
+      "all)\n"
+      "  -t THREADS  threads of the point operations (default 1 and the\n"
+      "              number of CPUs)\n"
+      "  -b BATCH    entries per batch syscall, 0 to walk key by key\n"
+      "              (default the table default)\n"
+      "  -j          print one JSON object per operation\n",
+      prog);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options opts;
+  std::function<size_t(const std::string&)> to_size =
+      [](const std::string& s) { return std::strtoull(s.c_str(), nullptr, 10); };
+  std::function<int(const std::string&)> to_int = [](const std::string& s) {
+    return std::atoi(s.c_str());
+  };
+  std::function<std::string(const std::string&)> to_str =
+      [](const std::string& s) { return s; };
+  int opt;
+  while ((opt = getopt(argc, argv, "s:m:t:b:jh")) != -1) {
+    switch (opt) {
+    case 's':
+      opts.sizes = parse_list(optarg, to_size);
+      break;
+    case 'm':
+      opts.maps = parse_list(optarg, to_str);
+      break;
+    case 't':
+      opts.threads = parse_list(optarg, to_int);
+      break;
+    case 'b':
+      opts.batch = std::atol(optarg);
+      break;
+    case 'j':
+      opts.json = true;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (opts.threads.empty()) {
+    opts.threads.push_back(1);
+    int ncpus = std::thread::hardware_concurrency();
+    if (ncpus > 1)
+      opts.threads.push_back(ncpus);
+  }
+  for (size_t size : opts.sizes) {
+    if (size == 0) {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  for (int t : opts.threads) {
+    if (t <= 0) {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  for (const auto& map : opts.maps) {
+    if (map != "hash" && map != "percpu_hash" && map != "array" &&
+        map != "queue" && map != "stack") {
+      std::fprintf(stderr, "Unknown map %s\n", map.c_str());
+      return 1;
+    }
+  }
+
+  if (!opts.json)
+    std::printf("%-12s %9s %-26s %7s %10s %12s\n", "MAP", "SIZE", "OP",
+                "THREADS", "TIME(ms)", "ENTRIES/S");
+  bool ok = true;
+  for (const auto& map : opts.maps)
+    for (size_t size : opts.sizes)
+      ok = bench_map(opts, map, size) && ok;
+  return ok ? 0 : 1;
+}
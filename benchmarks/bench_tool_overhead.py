@@ -0,0 +1,267 @@
+#!/usr/bin/env python
+#
+# bench_tool_overhead  Measure the overhead tools impose on the workloads
+#                      they trace.
+#
+# Each workload first runs with no tool attached, then once more while each
+# tool runs. The throughput and latency deltas are reported, along with the
+# runs and run time the kernel counted for the BPF programs the tool loaded
+# (kernel.bpf_stats_enabled is on for the duration of the benchmark).
+#
+# Workloads:
+#   syscall  getppid() loop                      (bench_workload)
+#   malloc   malloc()/free() churn               (bench_workload)
+#   tcp      64 byte loopback TCP round trips    (bench_workload)
+#   fio      4k random reads with O_DIRECT, if fio is installed
+#
+# USAGE: bench_tool_overhead.py [-h] [-w WORKLOADS] [-d SECONDS] [-n RUNS]
+#                               [-s SECONDS] [-b PATH] [-f DIR]
+#                               [-m PERCENT] [-j] [tool ...]
+#
+# Tools are paths, names in tools/ or names of built libbpf-tools, with their
+# arguments in the same argument ("profile.py -F 49"). By default every tool
+# in tools/ and every built tool in libbpf-tools/ runs without arguments;
+# those that need some exit early and are reported as failed. With -m, the
+# exit status is 1 if a tool costs any workload more than PERCENT of its
+# throughput, to catch overhead regressions before a release.
+#
+# Copyright (c) Facebook, Inc.
+# Licensed under the Apache License, Version 2.0 (the "License")
+
+from __future__ import print_function
+import argparse
+import ctypes as ct
+import glob
+import json
+import os
+import shlex
+import signal
+import subprocess
+import sys
+import time
+
+from bcc.libbcc import lib
+
+SRC_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+TOOLS_DIR = os.path.join(SRC_DIR, "tools")
+LIBBPF_TOOLS_DIR = os.path.join(SRC_DIR, "libbpf-tools")
+WORKLOADS = ["syscall", "malloc", "tcp", "fio"]
+
+lib.bpf_prog_get_next_id.restype = ct.c_int
+lib.bpf_prog_get_next_id.argtypes = [ct.c_uint32, ct.POINTER(ct.c_uint32)]
+lib.bpf_prog_get_fd_by_id.restype = ct.c_int
+lib.bpf_prog_get_fd_by_id.argtypes = [ct.c_uint32]
+
+parser = argparse.ArgumentParser(
+    description="Measure the overhead of tools on standard workloads",
+    formatter_class=argparse.RawDescriptionHelpFormatter)
+parser.add_argument("-w", "--workloads", default=",".join(WORKLOADS),
+    help="comma separated workloads to run (default %(default)s)")
+parser.add_argument("-d", "--duration", type=float, default=2,
+    help="seconds each workload runs")
+parser.add_argument("-n", "--runs", type=int, default=3,
+    help="runs of each workload, the median of each metric is reported")
+parser.add_argument("-s", "--settle", type=float, default=5,
+    help="seconds to let each tool start and attach before measuring")
+parser.add_argument("-b", "--workload-bin",
+    help="path to bench_workload (default: next to this script, then PATH)")
+parser.add_argument("-f", "--fio-dir", default="/var/tmp",
+    help="directory of the fio test file, on a disk supporting O_DIRECT")
+parser.add_argument("-m", "--max-overhead", type=float,
+    help="fail if a tool costs a workload more than this percentage of its "
+         "throughput")
+parser.add_argument("-j", "--json", action="store_true",
+    help="print one JSON object per tool and workload")
+parser.add_argument("tools", nargs="*",
+    help="tools to run, with their arguments (default all tools)")
+args = parser.parse_args()
+
+def find_workload_bin():
+    if args.workload_bin:
+        return args.workload_bin
+    here = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                        "bench_workload")
+    return here if os.access(here, os.X_OK) else "bench_workload"
+
+def tool_command(spec):
+    argv = shlex.split(spec)
+    path = argv[0]
+    if not os.path.exists(path):
+        for d in (TOOLS_DIR, LIBBPF_TOOLS_DIR):
+            if os.path.exists(os.path.join(d, path)):
+                path = os.path.join(d, path)
+                break
+            if os.path.exists(os.path.join(d, path + ".py")):
+                path = os.path.join(d, path + ".py")
+                break
+    if path.endswith(".py"):
+        return [sys.executable, path] + argv[1:]
+    return [path] + argv[1:]
+
+def default_tools():
+    specs = sorted(os.path.basename(p) for p in
+                   glob.glob(os.path.join(TOOLS_DIR, "*.py")))
+    # the libbpf-tools that were built, named after their BPF objects
+    for src in sorted(glob.glob(os.path.join(LIBBPF_TOOLS_DIR, "*.bpf.c"))):
+        name = os.path.basename(src)[:-len(".bpf.c")]
+        if os.access(os.path.join(LIBBPF_TOOLS_DIR, name), os.X_OK):
+            specs.append(name)
+    return specs
+
+def run_workload(name, workload_bin):
+    """Run workload name and return {"ops_per_sec", "lat_ns": {...}}, or None
+    if it could not run."""
+    if name == "fio":
+        return run_fio()
+    try:
+        out = subprocess.check_output(
+            [workload_bin, name, "-d", str(args.duration)])
+    except (OSError, subprocess.CalledProcessError):
+        return None
+    res = json.loads(out.decode())
+    return {"ops_per_sec": res["ops_per_sec"], "lat_ns": res["lat_ns"]}
+
+def run_fio():
+    fio_file = os.path.join(args.fio_dir, "bench_tool_overhead.fio")
+    cmd = ["fio", "--name=bench", "--filename=" + fio_file, "--size=256m",
+           "--rw=randread", "--bs=4k", "--direct=1", "--ioengine=psync",
+           "--time_based", "--runtime=%gs" % args.duration,
+           "--output-format=json"]
+    try:
+        with open(os.devnull, "w") as devnull:
+            out = subprocess.check_output(cmd, stderr=devnull)
+        job = json.loads(out.decode())["jobs"][0]["read"]
+    except (OSError, subprocess.CalledProcessError, ValueError, KeyError):
+        return None
+    clat = job["clat_ns"]
+    pct = clat.get("percentile", {})
+    return {"ops_per_sec": job["iops"],
+            "lat_ns": {"mean": clat["mean"],
+                       "p50": pct.get("50.000000", clat["mean"]),
+                       "p99": pct.get("99.000000", clat["mean"])}}
+
+def median(vals):
+    vals = sorted(vals)
+    mid = len(vals) // 2
+    return vals[mid] if len(vals) % 2 else (vals[mid - 1] + vals[mid]) / 2.0
+
+def measure(workload, workload_bin):
+    runs = [r for r in (run_workload(workload, workload_bin)
+                        for _ in range(args.runs)) if r]
+    if not runs:
+        return None
+    return {"ops_per_sec": median([r["ops_per_sec"] for r in runs]),
+            "lat_ns": dict((k, median([r["lat_ns"][k] for r in runs]))
+                           for k in ("mean", "p50", "p99"))}
+
+def prog_ids():
+    ids = []
+    next_id = ct.c_uint32(0)
+    while lib.bpf_prog_get_next_id(next_id.value, ct.byref(next_id)) == 0:
+        ids.append(next_id.value)
+    return ids
+
+def prog_stats(ids):
+    """Return the total run count and run time of the programs in ids that
+    still exist."""
+    run_cnt, run_time_ns = ct.c_uint64(), ct.c_uint64()
+    total_cnt = total_ns = 0
+    for prog_id in ids:
+        fd = lib.bpf_prog_get_fd_by_id(prog_id)
+        if fd < 0:
+            continue
+        if lib.bcc_prog_run_stats(fd, ct.byref(run_cnt),
+                                  ct.byref(run_time_ns)) == 0:
+            total_cnt += run_cnt.value
+            total_ns += run_time_ns.value
+        os.close(fd)
+    return total_cnt, total_ns
+
+def stop(proc):
+    if proc.poll() is None:
+        proc.send_signal(signal.SIGINT)
+        for _ in range(50):
+            if proc.poll() is not None:
+                return
+            time.sleep(0.1)
+        proc.kill()
+    proc.wait()
+
+def delta_pct(new, old):
+    return (new - old) * 100.0 / old if old else 0.0
+
+def report(spec, workload, base, res, bpf_cnt, bpf_ns):
+    tput = delta_pct(res["ops_per_sec"], base["ops_per_sec"])
+    p50 = delta_pct(res["lat_ns"]["p50"], base["lat_ns"]["p50"])
+    p99 = delta_pct(res["lat_ns"]["p99"], base["lat_ns"]["p99"])
+    if args.json:
+        print(json.dumps({"tool": spec, "workload": workload,
+                          "baseline": base, "traced": res,
+                          "throughput_delta_pct": tput,
+                          "p50_delta_pct": p50, "p99_delta_pct": p99,
+                          "bpf_run_cnt": bpf_cnt, "bpf_run_time_ns": bpf_ns}))
+    else:
+        print("%-24s %-8s %9.1f %9.1f %9.1f %12d %9.1f %9.1f" %
+              (spec[:24], workload, tput, p50, p99, bpf_cnt, bpf_ns / 1e6,
+               bpf_ns / float(bpf_cnt) if bpf_cnt else 0))
+    sys.stdout.flush()
+    return -tput
+
+if os.geteuid() != 0:
+    print("bench_tool_overhead.py needs root to run tools", file=sys.stderr)
+    sys.exit(1)
+
+# the kernel counts run time while this fd is open
+stats_fd = lib.bcc_enable_run_stats()
+if stats_fd < 0:
+    print("Failed to enable BPF run stats, counts will be 0", file=sys.stderr)
+
+workload_bin = find_workload_bin()
+baselines = {}
+for workload in args.workloads.split(","):
+    base = measure(workload, workload_bin)
+    if base:
+        baselines[workload] = base
+    else:
+        print("%s: workload could not run, skipped" % workload,
+              file=sys.stderr)
+if not baselines:
+    sys.exit(1)
+
+if not args.json:
+    print("%-24s %-8s %9s %9s %9s %12s %9s %9s" %
+          ("TOOL", "WORKLOAD", "TPUT(%)", "P50(%)", "P99(%)", "BPF_RUNS",
+           "BPF(ms)", "NS/RUN"))
+failed = 0
+worst = 0.0
+for spec in args.tools or default_tools():
+    known = set(prog_ids())
+    with open(os.devnull, "w") as devnull:
+        proc = subprocess.Popen(tool_command(spec), stdout=devnull,
+                                stderr=devnull)
+    time.sleep(args.settle)
+    if proc.poll() is not None:
+        failed += 1
+        print("%s: exited before the workloads ran" % spec, file=sys.stderr)
+        continue
+    ids = [i for i in prog_ids() if i not in known]
+    for workload, base in baselines.items():
+        cnt0, ns0 = prog_stats(ids)
+        res = measure(workload, workload_bin)
+        cnt1, ns1 = prog_stats(ids)
+        if not res:
+            print("%s: %s could not run" % (spec, workload), file=sys.stderr)
+            continue
+        worst = max(worst, report(spec, workload, base, res,
+                                  cnt1 - cnt0, ns1 - ns0))
+    stop(proc)
+
+if stats_fd >= 0:
+    os.close(stats_fd)
+if os.path.exists(os.path.join(args.fio_dir, "bench_tool_overhead.fio")):
+    os.unlink(os.path.join(args.fio_dir, "bench_tool_overhead.fio"))
+if args.max_overhead is not None and worst > args.max_overhead:
+    print("worst throughput overhead %.1f%% is above %.1f%%" %
+          (worst, args.max_overhead), file=sys.stderr)
+    sys.exit(1)
+sys.exit(1 if failed and args.tools else 0)
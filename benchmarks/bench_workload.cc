@@ -0,0 +1,201 @@
+/*
+ * bench_workload Run one standard workload and report its throughput and
+ *                latency, for bench_tool_overhead.py.
+ *
+ *   syscall  getppid() in a loop, the cost of syscall entry and exit probes
+ *   malloc   malloc() and free() of mixed sizes, the cost of libc uprobes
+ *   tcp      64 byte request and response over loopback TCP, the cost of
+ *            network stack probes
+ *
+ * syscall and malloc are timed in batches of 1000 operations, so their
+ * latencies are batch averages; tcp round trips are timed one by one. The
+ * result is printed as one JSON object: {"workload", "ops", "seconds",
+ * "ops_per_sec", "lat_ns": {"mean", "p50", "p99"}}.
+ *
+ * USAGE: bench_workload WORKLOAD [-d SECONDS]
+ *
+ * Copyright (c) Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ */
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+const int BATCH = 1000;
+
+// keeps the allocations from being optimized out
+void *volatile malloc_sink;
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct Result {
+  uint64_t ops = 0;
+  uint64_t elapsed_ns = 0;
+  // latency of each sample, in ns per operation
+  std::vector<double> lat;
+};
+
+// Run batch, which does ops operations, until duration_ns has passed
+Result run_batches(uint64_t duration_ns, int ops,
+                   const std::function<void()> &batch) {
+  Result res;
+  uint64_t start = now_ns(), t = start;
+  while (t - start < duration_ns) {
+    batch();
+    uint64_t end = now_ns();
+    res.lat.push_back(double(end - t) / ops);
+    res.ops += ops;
+    t = end;
+  }
+  res.elapsed_ns = t - start;
+  return res;
+}
+
+Result run_syscall(uint64_t duration_ns) {
+  return run_batches(duration_ns, BATCH, []() {
+    for (int i = 0; i < BATCH; i++)
+      syscall(SYS_getppid);
+  });
+}
+
+Result run_malloc(uint64_t duration_ns) {
+  return run_batches(duration_ns, BATCH, []() {
+    for (int i = 0; i < BATCH; i++) {
+      // from small bins to the mmap threshold
+      void *p = malloc(16 << (i % 12));
+      malloc_sink = p;
+      free(p);
+    }
+  });
+}
+
+bool read_full(int fd, char *buf, size_t len) {
+  while (len) {
+    ssize_t n = read(fd, buf, len);
+    if (n <= 0)
+      return false;
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+Result run_tcp(uint64_t duration_ns) {
+  Result res;
+  int lfd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addrlen = sizeof(addr);
+  if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(lfd, 1) < 0 ||
+      getsockname(lfd, (struct sockaddr *)&addr, &addrlen) < 0) {
+    perror("tcp listener");
+    exit(1);
+  }
+
+  std::thread server([lfd]() {
+    int fd = accept(lfd, nullptr, nullptr);
+    char buf[64];
+    while (fd >= 0 && read_full(fd, buf, sizeof(buf)) &&
+           write(fd, buf, sizeof(buf)) == sizeof(buf))
+      ;
+    if (fd >= 0)
+      close(fd);
+  });
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("tcp connect");
+    exit(1);
+  }
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  char buf[64] = {};
+  res = run_batches(duration_ns, 1, [fd, &buf]() {
+    if (write(fd, buf, sizeof(buf)) != sizeof(buf) ||
+        !read_full(fd, buf, sizeof(buf))) {
+      perror("tcp round trip");
+      exit(1);
+    }
+  });
+  close(fd);
+  server.join();
+  close(lfd);
+  return res;
+}
+
+double percentile(std::vector<double> &v, double p) {
+  if (v.empty())
+    return 0;
+  size_t i = std::min(v.size() - 1, size_t(p * v.size()));
+  std::nth_element(v.begin(), v.begin() + i, v.end());
+  return v[i];
+}
+
+void usage(const char *prog) {
+  fprintf(stderr, "USAGE: %s syscall|malloc|tcp [-d SECONDS]\n", prog);
+  exit(1);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  double seconds = 2;
+  int opt;
+  while ((opt = getopt(argc, argv, "d:h")) != -1) {
+    switch (opt) {
+    case 'd':
+      seconds = atof(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1)
+    usage(argv[0]);
+
+  std::string workload = argv[optind];
+  uint64_t duration_ns = seconds * 1e9;
+  Result res;
+  if (workload == "syscall")
+    res = run_syscall(duration_ns);
+  else if (workload == "malloc")
+    res = run_malloc(duration_ns);
+  else if (workload == "tcp")
+    res = run_tcp(duration_ns);
+  else
+    usage(argv[0]);
+
+  double mean = res.elapsed_ns / double(res.ops ?: 1);
+  double p50 = percentile(res.lat, 0.5);
+  double p99 = percentile(res.lat, 0.99);
+  printf("{\"workload\": \"%s\", \"ops\": %llu, \"seconds\": %.3f, "
+         "\"ops_per_sec\": %.1f, \"lat_ns\": {\"mean\": %.1f, \"p50\": %.1f, "
+         "\"p99\": %.1f}}\n",
+         workload.c_str(), (unsigned long long)res.ops, res.elapsed_ns / 1e9,
+         res.ops * 1e9 / (res.elapsed_ns ?: 1), mean, p50, p99);
+  return 0;
+}
@@ -0,0 +1,13 @@
+# bcc_table_header(<header> <bpf source> <namespace> [CFLAGS <flags>...])
+#
+# Generate <header> with bcc-table-header whenever <bpf source> changes:
+# C++ declarations of the key and leaf types of its tables, from BTF, and a
+# typed accessor per table. List <header> in the sources of a target to
+# build it first.
+function(bcc_table_header header source ns)
+  cmake_parse_arguments(ARG "" "" "CFLAGS" ${ARGN})
+  add_custom_command(OUTPUT ${header}
+    COMMAND bcc-table-header ${source} ${ns} ${header} ${ARG_CFLAGS}
+    DEPENDS bcc-table-header ${source}
+    COMMENT "Generating BPF table header ${header}")
+endfunction()
@@ -0,0 +1,293 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ *
+ * Usage:
+ *   ./TCPTelemetry [interval_secs] [count]
+ *
+ * Per-connection TCP counters, in the spirit of tcptop, tcpretrans and
+ * tcplife together, kept in socket local storage instead of hash tables
+ * keyed by socket or tuple: the counters live and die with their socket,
+ * so there is no global map to contend on and no entry to clean up when a
+ * connection closes. Every interval, a BPF iterator over the storage map
+ * dumps the counters of all live TCP sockets in one read loop.
+ *
+ * An example output likes below:
+ *   PID     LADDR:LPORT             RADDR:RPORT                TX_KB   RX_KB  RETRANS   AGE_MS
+ *   1234    10.0.0.2:41742          93.184.216.34:443             12     380        1     5210
+ *
+ * Socket local storage can be used from tracing programs since 5.11.
+ */
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "bcc_version.h"
+#include "BPF.h"
+
+const std::string BPF_PROGRAM = R"(
+#include <linux/bpf.h>
+#include <linux/seq_file.h>
+#include <net/sock.h>
+
+/* the structure is defined in .c file, so explicitly define
+ * the structure here.
+ */
+struct bpf_iter__bpf_sk_storage_map {
+  union {
+    struct bpf_iter_meta *meta;
+  };
+  union {
+    struct bpf_map *map;
+  };
+  union {
+    struct sock *sk;
+  };
+  union {
+    void *value;
+  };
+};
+
+struct tcp_stats_t {
+  u64 start_ns;
+  u64 tx_bytes;
+  u64 rx_bytes;
+  u64 retrans;
+  u32 pid;
+};
+
+BPF_SK_STORAGE(tcp_stats, struct tcp_stats_t);
+
+struct tcp_record_t {
+  u32 family;
+  u32 pid;
+  u32 saddr[4];
+  u32 daddr[4];
+  u16 sport;
+  u16 dport;
+  u32 state;
+  u64 age_ns;
+  u64 tx_bytes;
+  u64 rx_bytes;
+  u64 retrans;
+};
+
+static __always_inline struct tcp_stats_t *get_stats(struct sock *sk) {
+  struct tcp_stats_t *stats =
+      tcp_stats.sk_storage_get(sk, 0, BPF_SK_STORAGE_GET_F_CREATE);
+  if (stats && !stats->start_ns)
+    stats->start_ns = bpf_ktime_get_ns();
+  return stats;
+}
+
+KFUNC_PROBE(tcp_sendmsg, struct sock *sk, struct msghdr *msg, size_t size)
+{
+  struct tcp_stats_t *stats = get_stats(sk);
+  if (stats) {
+    stats->pid = bpf_get_current_pid_tgid() >> 32;
+    __sync_fetch_and_add(&stats->tx_bytes, size);
+  }
+  return 0;
+}
+
+KFUNC_PROBE(tcp_cleanup_rbuf, struct sock *sk, int copied)
+{
+  if (copied <= 0)
+    return 0;
+  struct tcp_stats_t *stats = get_stats(sk);
+  if (stats)
+    __sync_fetch_and_add(&stats->rx_bytes, copied);
+  return 0;
+}
+
+KFUNC_PROBE(tcp_retransmit_skb, struct sock *sk, struct sk_buff *skb, int segs)
+{
+  struct tcp_stats_t *stats = get_stats(sk);
+  if (stats)
+    __sync_fetch_and_add(&stats->retrans, segs);
+  return 0;
+}
+
+BPF_ITER(bpf_sk_storage_map) {
+  struct seq_file *seq = ctx->meta->seq;
+  struct sock *sk = ctx->sk;
+  struct tcp_stats_t *stats = ctx->value;
+  struct tcp_record_t rec = {};
+
+  if (sk == (void *)0 || stats == (void *)0)
+    return 0;
+
+  rec.family = sk->__sk_common.skc_family;
+  if (rec.family == AF_INET) {
+    rec.saddr[0] = sk->__sk_common.skc_rcv_saddr;
+    rec.daddr[0] = sk->__sk_common.skc_daddr;
+  } else if (rec.family == AF_INET6) {
+    #pragma unroll
+    for (int i = 0; i < 4; i++) {
+      rec.saddr[i] = sk->__sk_common.skc_v6_rcv_saddr.in6_u.u6_addr32[i];
+      rec.daddr[i] = sk->__sk_common.skc_v6_daddr.in6_u.u6_addr32[i];
+    }
+  }
+  rec.sport = sk->__sk_common.skc_num;
+  rec.dport = bpf_ntohs(sk->__sk_common.skc_dport);
+  rec.state = sk->__sk_common.skc_state;
+  rec.pid = stats->pid;
+  rec.age_ns = bpf_ktime_get_ns() - stats->start_ns;
+  rec.tx_bytes = stats->tx_bytes;
+  rec.rx_bytes = stats->rx_bytes;
+  rec.retrans = stats->retrans;
+  bpf_seq_write(seq, &rec, sizeof(rec));
+
+  return 0;
+}
+)";
+
+struct tcp_stats_t {
+  uint64_t start_ns;
+  uint64_t tx_bytes;
+  uint64_t rx_bytes;
+  uint64_t retrans;
+  uint32_t pid;
+};
+
+struct tcp_record_t {
+  uint32_t family;
+  uint32_t pid;
+  uint32_t saddr[4];
+  uint32_t daddr[4];
+  uint16_t sport;
+  uint16_t dport;
+  uint32_t state;
+  uint64_t age_ns;
+  uint64_t tx_bytes;
+  uint64_t rx_bytes;
+  uint64_t retrans;
+};
+
+static std::string endpoint(uint32_t family, const uint32_t* addr,
+                            uint16_t port) {
+  char buf[INET6_ADDRSTRLEN];
+  if (!inet_ntop(family, addr, buf, sizeof(buf)))
+    return "?";
+  if (family == AF_INET6)
+    return "[" + std::string(buf) + "]:" + std::to_string(port);
+  return std::string(buf) + ":" + std::to_string(port);
+}
+
+// Run the iterator once and collect the records it writes
+static bool dump(int link_fd, std::vector<tcp_record_t>& records) {
+  int iter_fd = bcc_iter_create(link_fd);
+  if (iter_fd < 0) {
+    std::cerr << "bcc_iter_create failed: " << iter_fd << std::endl;
+    return false;
+  }
+
+  records.clear();
+  std::vector<char> buf(64 * sizeof(tcp_record_t));
+  size_t leftover = 0;
+  ssize_t len;
+  while ((len = read(iter_fd, buf.data() + leftover, buf.size() - leftover))) {
+    if (len < 0) {
+      if (errno == EAGAIN)
+        continue;
+      std::cerr << "read failed: " << std::strerror(errno) << std::endl;
+      break;
+    }
+    size_t avail = leftover + len;
+    size_t num = avail / sizeof(tcp_record_t);
+    for (size_t i = 0; i < num; i++) {
+      tcp_record_t rec;
+      std::memcpy(&rec, buf.data() + i * sizeof(rec), sizeof(rec));
+      records.push_back(rec);
+    }
+    leftover = avail % sizeof(tcp_record_t);
+    std::memmove(buf.data(), buf.data() + num * sizeof(tcp_record_t),
+                 leftover);
+  }
+
+  close(iter_fd);
+  return true;
+}
+
+int main(int argc, char** argv) {
+  int interval = argc > 1 ? atoi(argv[1]) : 1;
+  int count = argc > 2 ? atoi(argv[2]) : -1;
+
+  ebpf::BPF bpf;
+  auto res = bpf.init(BPF_PROGRAM);
+  if (!res.ok()) {
+    std::cerr << res.msg() << std::endl;
+    return 1;
+  }
+
+  for (const char* fn : {"kfunc__tcp_sendmsg", "kfunc__tcp_cleanup_rbuf",
+                         "kfunc__tcp_retransmit_skb"}) {
+    int prog_fd;
+    res = bpf.load_func(fn, BPF_PROG_TYPE_TRACING, prog_fd);
+    if (!res.ok()) {
+      std::cerr << res.msg() << std::endl;
+      return 1;
+    }
+    int ret = bpf_attach_kfunc(prog_fd);
+    if (ret < 0) {
+      std::cerr << "bpf_attach_kfunc failed for " << fn << ": " << ret
+                << std::endl;
+      return 1;
+    }
+  }
+
+  int prog_fd;
+  res = bpf.load_func("bpf_iter__bpf_sk_storage_map", BPF_PROG_TYPE_TRACING,
+                      prog_fd);
+  if (!res.ok()) {
+    std::cerr << res.msg() << std::endl;
+    return 1;
+  }
+
+  auto sk_table = bpf.get_sk_storage_table<tcp_stats_t>("tcp_stats");
+  union bpf_iter_link_info link_info = {};
+  link_info.map.map_fd = sk_table.get_fd();
+  int link_fd = bcc_iter_attach(prog_fd, &link_info,
+                                sizeof(union bpf_iter_link_info));
+  if (link_fd < 0) {
+    std::cerr << "bcc_iter_attach failed: " << link_fd << std::endl;
+    return 1;
+  }
+
+  std::vector<tcp_record_t> records;
+  for (int i = 0; count < 0 || i < count; i++) {
+    sleep(interval);
+    if (!dump(link_fd, records))
+      break;
+
+    std::sort(records.begin(), records.end(),
+              [](const tcp_record_t& a, const tcp_record_t& b) {
+                return a.tx_bytes + a.rx_bytes > b.tx_bytes + b.rx_bytes;
+              });
+    std::cout << std::left << std::setw(8) << "PID" << std::setw(24)
+              << "LADDR:LPORT" << std::setw(24) << "RADDR:RPORT"
+              << std::right << std::setw(8) << "TX_KB" << std::setw(8)
+              << "RX_KB" << std::setw(9) << "RETRANS" << std::setw(9)
+              << "AGE_MS" << std::endl;
+    for (const auto& rec : records) {
+      std::cout << std::left << std::setw(8) << rec.pid << std::setw(24)
+                << endpoint(rec.family, rec.saddr, rec.sport) << std::setw(24)
+                << endpoint(rec.family, rec.daddr, rec.dport) << std::right
+                << std::setw(8) << rec.tx_bytes / 1024 << std::setw(8)
+                << rec.rx_bytes / 1024 << std::setw(9) << rec.retrans
+                << std::setw(9) << rec.age_ns / 1000000 << std::endl;
+    }
+    std::cout << std::endl;
+  }
+
+  close(link_fd);
+  return 0;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ */
+
+#include "PyPerfType.h"
+
+namespace ebpf {
+namespace pyperf {
+
+extern const OffsetConfig kPy310OffsetConfig = {
+    .PyObject_type = 8,               // offsetof(PyObject, ob_type)
+    .PyTypeObject_name = 24,          // offsetof(PyTypeObject, tp_name)
+    .PyThreadState_frame = 24,        // offsetof(PyThreadState, frame)
+    .PyThreadState_cframe = -1,
+    .PyThreadState_thread = 176,      // offsetof(PyThreadState, thread_id)
+    .PyFrameObject_back = 24,         // offsetof(PyFrameObject, f_back)
+    .PyFrameObject_code = 32,         // offsetof(PyFrameObject, f_code)
+    .PyFrameObject_lineno = 100,      // offsetof(PyFrameObject, f_lineno)
+    .PyFrameObject_localsplus = 352,  // offsetof(PyFrameObject, f_localsplus)
+    .PyCodeObject_filename = 104,     // offsetof(PyCodeObject, co_filename)
+    .PyCodeObject_name = 112,         // offsetof(PyCodeObject, co_name)
+    .PyCodeObject_varnames = 72,      // offsetof(PyCodeObject, co_varnames)
+    .PyTupleObject_item = 24,         // offsetof(PyTupleObject, ob_item)
+    .String_data = 48,                // sizeof(PyASCIIObject)
+    .String_size = 16,                // offsetof(PyVarObject, ob_size)
+};
+
+extern const RuntimeOffsetConfig kPy310RuntimeOffsetConfig = {
+    .tstate_current = 568,
+    .autoTSSkey = 588,
+    .gil_locked = 368,
+    .gil_last_holder = 360,
+};
+
+}
+}  // namespace ebpf
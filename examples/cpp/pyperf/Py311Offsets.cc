@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ */
+
+#include "PyPerfType.h"
+
+namespace ebpf {
+namespace pyperf {
+
+// Frames are _PyInterpreterFrame, pointed to by PyThreadState.cframe
+extern const OffsetConfig kPy311OffsetConfig = {
+    .PyObject_type = 8,               // offsetof(PyObject, ob_type)
+    .PyTypeObject_name = 24,          // offsetof(PyTypeObject, tp_name)
+    .PyThreadState_frame = 8,         // offsetof(_PyCFrame, current_frame)
+    .PyThreadState_cframe = 56,       // offsetof(PyThreadState, cframe)
+    .PyThreadState_thread = 152,      // offsetof(PyThreadState, thread_id)
+    .PyFrameObject_back = 48,         // offsetof(_PyInterpreterFrame, previous)
+    .PyFrameObject_code = 32,         // offsetof(_PyInterpreterFrame, f_code)
+    .PyFrameObject_lineno = -1,       // no longer stored in the frame
+    .PyFrameObject_localsplus = 72,   // offsetof(_PyInterpreterFrame, localsplus)
+    .PyCodeObject_filename = 112,     // offsetof(PyCodeObject, co_filename)
+    .PyCodeObject_name = 120,         // offsetof(PyCodeObject, co_name)
+    .PyCodeObject_varnames = 96,      // offsetof(PyCodeObject, co_localsplusnames)
+    .PyTupleObject_item = 24,         // offsetof(PyTupleObject, ob_item)
+    .String_data = 48,                // sizeof(PyASCIIObject)
+    .String_size = 16,                // offsetof(PyVarObject, ob_size)
+};
+
+extern const RuntimeOffsetConfig kPy311RuntimeOffsetConfig = {
+    .tstate_current = 576,
+    .autoTSSkey = 596,
+    .gil_locked = 376,
+    .gil_last_holder = 368,
+};
+
+}
+}  // namespace ebpf
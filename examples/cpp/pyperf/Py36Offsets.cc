@@ -12,6 +12,7 @@ extern const OffsetConfig kPy36OffsetConfig = {
     .PyObject_type = 8,               // offsetof(PyObject, ob_type)
     .PyTypeObject_name = 24,          // offsetof(PyTypeObject, tp_name)
     .PyThreadState_frame = 24,        // offsetof(PyThreadState, frame)
+    .PyThreadState_cframe = -1,
     .PyThreadState_thread = 152,      // offsetof(PyThreadState, thread_id)
     .PyFrameObject_back = 24,         // offsetof(PyFrameObject, f_back)
     .PyFrameObject_code = 32,         // offsetof(PyFrameObject, f_code)
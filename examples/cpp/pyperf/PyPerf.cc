@@ -5,7 +5,7 @@
  * Example of using BPF to profile Python Processes with Python stack-trace.
  *
  * USAGE: PyPerf [-d|--duration DURATION_MS] [-c|--sample-rate SAMPLE_RATE]
- *               [-v|--verbosity LOG_VERBOSITY]
+ *               [-v|--verbosity LOG_VERBOSITY] [--lru-symbols]
  *
  * Copyright (c) Facebook, Inc.
  * Licensed under the Apache License, Version 2.0 (the "License")
@@ -69,6 +69,7 @@ int main(int argc, char** argv) {
   bool showGILState = true;
   bool showThreadState = true;
   bool showPthreadIDState = false;
+  bool lruSymbols = false;
 
   while (true) {
     if (pos >= argc) {
@@ -82,6 +83,7 @@ int main(int argc, char** argv) {
     found = found || parseBoolArg({"show-thread-state"}, showThreadState);
     found =
         found || parseBoolArg({"show-pthread-id-state"}, showPthreadIDState);
+    found = found || parseBoolArg({"lru-symbols"}, lruSymbols);
     if (!found) {
       std::fprintf(stderr, "Unexpected argument: %s\n", argv[pos]);
       std::exit(1);
@@ -96,9 +98,10 @@ int main(int argc, char** argv) {
   ebpf::pyperf::logInfo(1, "Showing Thread state: %d\n", showThreadState);
   ebpf::pyperf::logInfo(1, "Showing Pthread ID state: %d\n",
                         showPthreadIDState);
+  ebpf::pyperf::logInfo(1, "LRU symbols: %d\n", lruSymbols);
 
   ebpf::pyperf::PyPerfUtil util;
-  util.init();
+  util.init(lruSymbols);
 
   ebpf::pyperf::PyPerfDefaultPrinter printer(showGILState, showThreadState,
                                              showPthreadIDState);
@@ -59,6 +59,9 @@ typedef struct {
   int64_t PyObject_type;
   int64_t PyTypeObject_name;
   int64_t PyThreadState_frame;
+  // offset of the _PyCFrame pointer holding the frame pointer instead of
+  // PyThreadState (3.11+), -1 if the frame pointer is in PyThreadState
+  int64_t PyThreadState_cframe;
   int64_t PyThreadState_thread;
   int64_t PyFrameObject_back;
   int64_t PyFrameObject_code;
@@ -122,7 +125,22 @@ typedef struct {
 } sample_state_t;
 
 BPF_PERCPU_ARRAY(state_heap, sample_state_t, 1);
+#ifdef SYMBOLS_LRU
+// Symbols seen recently, old ones are evicted and get a new id when seen
+// again. Userspace learns new ids from symbol_ring below.
+BPF_TABLE("lru_hash", Symbol, int32_t, symbols, __SYMBOLS_SIZE__);
+
+typedef struct {
+  // symbol counter of the CPU plus one, 0 for a slot never written
+  int64_t seq;
+  Symbol sym;
+} symbol_ring_entry_t;
+
+// SYMBOL_RING_SIZE (a power of 2) most recent new symbols of every CPU
+BPF_ARRAY(symbol_ring, symbol_ring_entry_t, NUM_CPUS * SYMBOL_RING_SIZE);
+#else
 BPF_HASH(symbols, Symbol, int32_t, __SYMBOLS_SIZE__);
+#endif
 BPF_HASH(pid_config, pid_t, PidData);
 BPF_PROG_ARRAY(progs, 1);
 
@@ -330,11 +348,18 @@ int on_event(struct pt_regs* ctx) {
   event->stack_len = 0;
 
   if (thread_state != 0) {
-    // Get pointer to top frame from PyThreadState
+    // Get pointer to top frame from PyThreadState, or from its _PyCFrame
+    void* frame_holder = thread_state;
+    if (pid_data->offsets.PyThreadState_cframe >= 0) {
+      bpf_probe_read_user(
+          &frame_holder,
+          sizeof(void*),
+          thread_state + pid_data->offsets.PyThreadState_cframe);
+    }
     bpf_probe_read_user(
         &state->frame_ptr,
         sizeof(void*),
-        thread_state + pid_data->offsets.PyThreadState_frame);
+        frame_holder + pid_data->offsets.PyThreadState_frame);
     // jump to reading first set of Python frames
     progs.call(ctx, PYTHON_STACK_PROG_IDX);
     // we won't ever get here
@@ -446,6 +471,16 @@ static inline __attribute__((__always_inline__)) int64_t get_symbol_id(
   }
   // the symbol is new, bump the counter
   int32_t symbol_id = state->symbol_counter * NUM_CPUS + state->cur_cpu;
+#ifdef SYMBOLS_LRU
+  int32_t ring_idx = state->cur_cpu * SYMBOL_RING_SIZE +
+                     (state->symbol_counter & (SYMBOL_RING_SIZE - 1));
+  symbol_ring_entry_t* entry = symbol_ring.lookup(&ring_idx);
+  if (entry) {
+    // seq last, userspace checks it to know the slot holds this symbol
+    __builtin_memcpy(&entry->sym, sym, sizeof(Symbol));
+    entry->seq = state->symbol_counter + 1;
+  }
+#endif
   state->symbol_counter++;
   symbols.update(sym, &symbol_id);
   return symbol_id;
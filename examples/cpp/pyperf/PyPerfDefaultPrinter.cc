@@ -3,6 +3,7 @@
  * Licensed under the Apache License, Version 2.0 (the "License")
  */
 
+#include <cinttypes>
 #include <map>
 #include <string>
 
@@ -49,13 +50,14 @@ const static std::map<int, const char*> kPthreadIDStateValues = {
     {PTHREAD_ID_NULL, "Pthread ID on TLS ThreadState is NULL"},
     {PTHREAD_ID_ERROR, "Error Reading System Pthread ID"}};
 
-void PyPerfDefaultPrinter::processSamples(
-    const std::vector<PyPerfSample>& samples, PyPerfUtil* util) {
-  auto symbols = util->getSymbolMapping();
-  uint32_t lostSymbols = 0;
-  uint32_t truncatedStack = 0;
+void PyPerfDefaultPrinter::finish(PyPerfUtil* util) {
+  const auto& symbols = util->getSymbolMapping();
+  uint64_t lostSymbols = 0;
+  uint64_t truncatedStack = 0;
 
-  for (auto& sample : samples) {
+  for (const auto& entry : getStackCounts()) {
+    const auto& sample = entry.first;
+    const uint64_t count = entry.second;
     if (sample.threadStateMatch != THREAD_STATE_THIS_THREAD_NULL &&
         sample.threadStateMatch != THREAD_STATE_BOTH_NULL) {
       for (const auto stackId : sample.pyStackIds) {
@@ -64,13 +66,13 @@ void PyPerfDefaultPrinter::processSamples(
           std::printf("    %s\n", symbIt->second.c_str());
         } else {
           std::printf("    %s\n", kLostSymbol.c_str());
-          lostSymbols++;
+          lostSymbols += count;
         }
       }
       switch (sample.stackStatus) {
       case STACK_STATUS_TRUNCATED:
         std::printf("    %s\n", kIncompleteStack.c_str());
-        truncatedStack++;
+        truncatedStack += count;
         break;
       case STACK_STATUS_ERROR:
         std::printf("    %s\n", kErrorStack.c_str());
@@ -84,6 +86,7 @@ void PyPerfDefaultPrinter::processSamples(
 
     std::printf("PID: %d TID: %d (%s)\n", sample.pid, sample.tid,
                 sample.comm.c_str());
+    std::printf("Samples: %" PRIu64 "\n", count);
     if (showGILState_)
       std::printf("GIL State: %s\n", kGILStateValues.at(sample.gilState));
     if (showThreadState_)
@@ -98,8 +101,9 @@ void PyPerfDefaultPrinter::processSamples(
 
   std::printf("%d samples collected\n", util->getTotalSamples());
   std::printf("%d samples lost\n", util->getLostSamples());
-  std::printf("%d samples with truncated stack\n", truncatedStack);
-  std::printf("%d times Python symbol lost\n", lostSymbols);
+  std::printf("%zu unique stacks\n", getStackCounts().size());
+  std::printf("%" PRIu64 " samples with truncated stack\n", truncatedStack);
+  std::printf("%" PRIu64 " times Python symbol lost\n", lostSymbols);
 }
 
 }  // namespace pyperf
@@ -5,12 +5,13 @@
 
 #pragma once
 
-#include "PyPerfSampleProcessor.h"
+#include "PyPerfStackAggregator.h"
 
 namespace ebpf {
 namespace pyperf {
 
-class PyPerfDefaultPrinter : public PyPerfSampleProcessor {
+// Prints every unique stack once profiling finished, with its sample count
+class PyPerfDefaultPrinter : public PyPerfStackAggregator {
  public:
   PyPerfDefaultPrinter(bool showGILState, bool showThreadState,
                        bool showPthreadIDState)
@@ -18,8 +19,7 @@ class PyPerfDefaultPrinter : public PyPerfSampleProcessor {
         showThreadState_(showThreadState),
         showPthreadIDState_(showPthreadIDState) {}
 
-  void processSamples(const std::vector<PyPerfSample>& samples,
-                      PyPerfUtil* util) override;
+  void finish(PyPerfUtil* util) override;
 
  private:
   bool showGILState_;
@@ -5,8 +5,6 @@
 
 #pragma once
 
-#include <vector>
-
 #include "PyPerfType.h"
 
 namespace ebpf {
@@ -16,8 +14,14 @@ class PyPerfUtil;
 
 class PyPerfSampleProcessor {
  public:
-  virtual void processSamples(const std::vector<PyPerfSample>& samples,
-                              PyPerfUtil* util) = 0;
+  virtual ~PyPerfSampleProcessor() = default;
+
+  // Invoked from the Perf Buffer polling loop for every sample as it arrives.
+  // The sample is only valid for the duration of the call.
+  virtual void processSample(const PyPerfSample& sample, PyPerfUtil* util) = 0;
+
+  // Invoked once profiling finished and remaining samples were drained
+  virtual void finish(PyPerfUtil* util) {}
 };
 
 }  // namespace pyperf
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ */
+
+#include <functional>
+
+#include "PyPerfStackAggregator.h"
+
+namespace ebpf {
+namespace pyperf {
+
+namespace {
+
+void hashCombine(size_t& seed, size_t value) {
+  seed ^= value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2);
+}
+
+}  // namespace
+
+size_t PyPerfSampleHash::operator()(const PyPerfSample& sample) const {
+  size_t seed = std::hash<pid_t>()(sample.pid);
+  hashCombine(seed, std::hash<pid_t>()(sample.tid));
+  hashCombine(seed, std::hash<std::string>()(sample.comm));
+  hashCombine(seed, sample.threadStateMatch | sample.gilState << 8 |
+                        sample.pthreadIDMatch << 16 |
+                        sample.stackStatus << 24);
+  for (const auto stackId : sample.pyStackIds) {
+    hashCombine(seed, std::hash<int32_t>()(stackId));
+  }
+  return seed;
+}
+
+bool PyPerfSampleEqual::operator()(const PyPerfSample& a,
+                                   const PyPerfSample& b) const {
+  return a.pid == b.pid && a.tid == b.tid &&
+         a.threadStateMatch == b.threadStateMatch &&
+         a.gilState == b.gilState && a.pthreadIDMatch == b.pthreadIDMatch &&
+         a.stackStatus == b.stackStatus && a.pyStackIds == b.pyStackIds &&
+         a.comm == b.comm;
+}
+
+void PyPerfStackAggregator::processSample(const PyPerfSample& sample,
+                                          PyPerfUtil* util) {
+  auto it = stackCounts_.find(sample);
+  if (it != stackCounts_.end()) {
+    it->second++;
+  } else {
+    stackCounts_.emplace(sample, 1);
+  }
+}
+
+}  // namespace pyperf
+}  // namespace ebpf
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+
+#include "PyPerfSampleProcessor.h"
+
+namespace ebpf {
+namespace pyperf {
+
+struct PyPerfSampleHash {
+  size_t operator()(const PyPerfSample& sample) const;
+};
+
+struct PyPerfSampleEqual {
+  bool operator()(const PyPerfSample& a, const PyPerfSample& b) const;
+};
+
+// Counts samples by their thread, states and Python stack as they arrive, so
+// memory is proportional to the number of unique stacks rather than to the
+// number of samples collected.
+class PyPerfStackAggregator : public PyPerfSampleProcessor {
+ public:
+  using StackCounts = std::unordered_map<PyPerfSample, uint64_t,
+                                         PyPerfSampleHash, PyPerfSampleEqual>;
+
+  void processSample(const PyPerfSample& sample, PyPerfUtil* util) override;
+
+  const StackCounts& getStackCounts() const { return stackCounts_; }
+
+ private:
+  StackCounts stackCounts_;
+};
+
+}  // namespace pyperf
+}  // namespace ebpf
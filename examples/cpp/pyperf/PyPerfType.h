@@ -60,6 +60,9 @@ typedef struct {
   int64_t PyObject_type;
   int64_t PyTypeObject_name;
   int64_t PyThreadState_frame;
+  // offset of the _PyCFrame pointer holding the frame pointer instead of
+  // PyThreadState (3.11+), -1 if the frame pointer is in PyThreadState
+  int64_t PyThreadState_cframe;
   int64_t PyThreadState_thread;
   int64_t PyFrameObject_back;
   int64_t PyFrameObject_code;
@@ -73,6 +76,15 @@ typedef struct {
   int64_t String_size;
 } OffsetConfig;
 
+// Offsets in _PyRuntime of the globals that CPython 3.7+ moved there from
+// symbols of their own
+typedef struct {
+  int64_t tstate_current;   // gilstate.tstate_current
+  int64_t autoTSSkey;       // gilstate.autoTSSkey._key
+  int64_t gil_locked;       // ceval.gil.locked
+  int64_t gil_last_holder;  // ceval.gil.last_holder
+} RuntimeOffsetConfig;
+
 typedef struct {
   uintptr_t current_state_addr;  // virtual address of _PyThreadState_Current
   uintptr_t tls_key_addr;     // virtual address of autoTLSkey for pthreads TLS
@@ -90,6 +102,12 @@ typedef struct {
   // to get the actual line
 } Symbol;
 
+// Entry of the BPF symbol_ring of new symbols, when symbols are LRU-backed
+typedef struct {
+  int64_t seq;  // symbol counter of the CPU plus one, 0 if never written
+  Symbol sym;
+} SymbolRingEntry;
+
 typedef struct {
   uint32_t pid;
   uint32_t tid;
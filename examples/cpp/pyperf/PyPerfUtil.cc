@@ -4,11 +4,13 @@
  */
 
 #include <algorithm>
+#include <atomic>
 #include <cerrno>
 #include <chrono>
 #include <cstdio>
 #include <cstring>
 #include <exception>
+#include <thread>
 
 #include <dirent.h>
 #include <linux/elf.h>
@@ -16,8 +18,10 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "BPFTaskIter.h"
 #include "PyPerfLoggingHelper.h"
 #include "PyPerfUtil.h"
+#include "PyPerfVersions.h"
 #include "bcc_elf.h"
 #include "bcc_proc.h"
 #include "bcc_syms.h"
@@ -25,7 +29,6 @@
 namespace ebpf {
 namespace pyperf {
 
-extern OffsetConfig kPy36OffsetConfig;
 extern std::string PYPERF_BPF_PROGRAM;
 
 const static int kPerfBufSizePages = 32;
@@ -44,9 +47,42 @@ const static std::string kNumCpusFlag("-DNUM_CPUS=");
 const static std::string kSymbolsHashSizeFlag("-D__SYMBOLS_SIZE__=");
 const static int kSymbolsHashSize = 16384;
 
+const static std::string kSymbolsLRUFlag("-DSYMBOLS_LRU");
+const static std::string kSymbolRingName("symbol_ring");
+const static std::string kSymbolRingSizeFlag("-DSYMBOL_RING_SIZE=");
+// per CPU, must be a power of 2
+const static int kSymbolRingSize = 256;
+const static int64_t kSymbolDrainIntervalMs = 1000;
+
+const static unsigned kMaxPidWorkers = 16;
+const static int64_t kPidRefreshIntervalMs = 1000;
+// A process checked between its exec and the dynamic loader mapping
+// libpython is not found to be Python the first time
+const static int kPidChecksAfterExec = 2;
+
 namespace {
 
+// List processes with a BPF task iterator, without scanning /proc
+bool getRunningPidsIter(std::vector<int>& output) {
+  static BPFTaskIter iter;
+  static bool usable = iter.init().ok();
+  if (!usable)
+    return false;
+
+  std::vector<BPFTaskInfo> tasks;
+  if (!iter.tasks(tasks).ok()) {
+    usable = false;
+    return false;
+  }
+  for (const auto& task : tasks)
+    output.push_back(task.pid);
+  return true;
+}
+
 bool getRunningPids(std::vector<int>& output) {
+  if (getRunningPidsIter(output))
+    return true;
+
   auto dir = ::opendir("/proc/");
   if (!dir) {
     std::fprintf(stderr, "Open /proc failed: %d\n", errno);
@@ -87,12 +123,22 @@ bool getRunningPids(std::vector<int>& output) {
 typedef struct {
   int pid;
   bool found;
+  bool isLib;
+  int major;
+  int minor;
   uint64_t st;
   uint64_t en;
+  uint64_t fileOffset;
+  uint64_t devMajor;
+  uint64_t devMinor;
+  uint64_t inode;
 } FindPythonPathHelper;
 
-const static std::string kPy36LibName = "libpython3.6";
+const static std::string kPythonLibPrefix = "lib";
+const static std::string kPythonName = "python";
 
+// Matches libpython3.X*.so and python3.X executables, preferring the
+// library when an executable links to it
 int findPythonPathCallback(mod_info *mod, int, void* payload) {
   auto helper = static_cast<FindPythonPathHelper*>(payload);
   std::string file = mod->name;
@@ -100,25 +146,55 @@ int findPythonPathCallback(mod_info *mod, int, void* payload) {
   if (pos != std::string::npos) {
     file = file.substr(pos + 1);
   }
-  if (file.find(kPy36LibName) == 0) {
-    logInfo(1, "Found Python library %s loaded at %lx-%lx for PID %d\n", mod->name,
-            mod->start_addr, mod->end_addr, helper->pid);
-    helper->found = true;
-    helper->st = mod->start_addr;
-    helper->en = mod->end_addr;
-    return -1;
+  bool isLib = file.find(kPythonLibPrefix + kPythonName) == 0;
+  if (isLib) {
+    file = file.substr(kPythonLibPrefix.size());
   }
-  return 0;
+  int major, minor;
+  if (file.find(kPythonName) != 0 ||
+      std::sscanf(file.c_str() + kPythonName.size(), "%d.%d", &major,
+                  &minor) != 2) {
+    return 0;
+  }
+  if (helper->found && !isLib) {
+    return 0;
+  }
+  logInfo(1, "Found Python %d.%d %s %s loaded at %lx-%lx for PID %d\n", major,
+          minor, isLib ? "library" : "executable", mod->name, mod->start_addr,
+          mod->end_addr, helper->pid);
+  helper->found = true;
+  helper->isLib = isLib;
+  helper->major = major;
+  helper->minor = minor;
+  helper->st = mod->start_addr;
+  helper->en = mod->end_addr;
+  helper->fileOffset = mod->file_offset;
+  helper->devMajor = mod->dev_major;
+  helper->devMinor = mod->dev_minor;
+  helper->inode = mod->inode;
+  return isLib ? -1 : 0;
 }
 
-bool allAddrFound(const PidData& data) {
-  return (data.current_state_addr > 0) && (data.tls_key_addr > 0) &&
-         (data.gil_locked_addr > 0) && (data.gil_last_holder_addr > 0);
+typedef struct {
+  uintptr_t currentStateAddr;  // _PyThreadState_Current
+  uintptr_t tlsKeyAddr;        // autoTLSkey
+  uintptr_t gilLockedAddr;     // gil_locked
+  uintptr_t gilLastHolderAddr; // gil_last_holder
+  uintptr_t runtimeAddr;       // _PyRuntime
+  bool useRuntime;
+} PythonSymbols;
+
+bool allAddrFound(const PythonSymbols& syms) {
+  if (syms.useRuntime) {
+    return syms.runtimeAddr > 0;
+  }
+  return (syms.currentStateAddr > 0) && (syms.tlsKeyAddr > 0) &&
+         (syms.gilLockedAddr > 0) && (syms.gilLastHolderAddr > 0);
 }
 
 int getAddrOfPythonBinaryCallback(const char* name, uint64_t addr, uint64_t,
                                   void* payload) {
-  PidData& data = *static_cast<PidData*>(payload);
+  PythonSymbols& syms = *static_cast<PythonSymbols*>(payload);
 
   auto checkAndGetAddr = [&](uintptr_t& targetAddr, const char* targetName) {
     if (targetAddr == 0 && std::strcmp(name, targetName) == 0) {
@@ -126,29 +202,53 @@ int getAddrOfPythonBinaryCallback(const char* name, uint64_t addr, uint64_t,
     }
   };
 
-  checkAndGetAddr(data.tls_key_addr, "autoTLSkey");
-  checkAndGetAddr(data.current_state_addr, "_PyThreadState_Current");
-  checkAndGetAddr(data.gil_locked_addr, "gil_locked");
-  checkAndGetAddr(data.gil_last_holder_addr, "gil_last_holder");
+  if (syms.useRuntime) {
+    checkAndGetAddr(syms.runtimeAddr, "_PyRuntime");
+  } else {
+    checkAndGetAddr(syms.tlsKeyAddr, "autoTLSkey");
+    checkAndGetAddr(syms.currentStateAddr, "_PyThreadState_Current");
+    checkAndGetAddr(syms.gilLockedAddr, "gil_locked");
+    checkAndGetAddr(syms.gilLastHolderAddr, "gil_last_holder");
+  }
 
-  if (allAddrFound(data)) {
+  if (allAddrFound(syms)) {
     return -1;
   }
   return 0;
 }
 
-bool getAddrOfPythonBinary(const std::string& path, PidData& data) {
+bool getAddrOfPythonBinary(const std::string& path,
+                           const PyVersionConfig& version, PidData& data) {
   std::memset(&data, 0, sizeof(data));
 
+  PythonSymbols syms = {};
+  syms.useRuntime = version.runtimeOffsets != nullptr;
+
   struct bcc_symbol_option option = {.use_debug_file = 0,
                                      .check_debug_file_crc = 0,
                                      .lazy_symbolize = 1,
                                      .use_symbol_type = (1 << STT_OBJECT)};
 
   bcc_elf_foreach_sym(path.c_str(), &getAddrOfPythonBinaryCallback, &option,
-                      &data);
+                      &syms);
+  if (!allAddrFound(syms)) {
+    return false;
+  }
 
-  return allAddrFound(data);
+  if (syms.useRuntime) {
+    const auto& runtime = *version.runtimeOffsets;
+    data.current_state_addr = syms.runtimeAddr + runtime.tstate_current;
+    data.tls_key_addr = syms.runtimeAddr + runtime.autoTSSkey;
+    data.gil_locked_addr = syms.runtimeAddr + runtime.gil_locked;
+    data.gil_last_holder_addr = syms.runtimeAddr + runtime.gil_last_holder;
+  } else {
+    data.current_state_addr = syms.currentStateAddr;
+    data.tls_key_addr = syms.tlsKeyAddr;
+    data.gil_locked_addr = syms.gilLockedAddr;
+    data.gil_last_holder_addr = syms.gilLastHolderAddr;
+  }
+  data.offsets = *version.offsets;
+  return true;
 }
 }  // namespace
 
@@ -162,11 +262,18 @@ void handleLostSamplesCallback(void* cb_cookie, uint64_t lost_cnt) {
   profiler->handleLostSamples(lost_cnt);
 }
 
-PyPerfUtil::PyPerfResult PyPerfUtil::init() {
+PyPerfUtil::PyPerfResult PyPerfUtil::init(bool lruSymbols) {
+  lruSymbols_ = lruSymbols;
+  numCpus_ = ::sysconf(_SC_NPROCESSORS_ONLN);
+
   std::vector<std::string> cflags;
-  cflags.emplace_back(kNumCpusFlag +
-                      std::to_string(::sysconf(_SC_NPROCESSORS_ONLN)));
+  cflags.emplace_back(kNumCpusFlag + std::to_string(numCpus_));
   cflags.emplace_back(kSymbolsHashSizeFlag + std::to_string(kSymbolsHashSize));
+  if (lruSymbols_) {
+    cflags.emplace_back(kSymbolsLRUFlag);
+    cflags.emplace_back(kSymbolRingSizeFlag + std::to_string(kSymbolRingSize));
+    symbolCounters_.assign(numCpus_, 0);
+  }
   cflags.emplace_back(kPythonStackProgIdxFlag +
                       std::to_string(kPythonStackProgIdx));
 
@@ -202,15 +309,7 @@ PyPerfUtil::PyPerfResult PyPerfUtil::init() {
   }
 
   // Populate config for each Python Process
-  auto pid_hash = bpf_.get_hash_table<int, PidData>(kPidCfgTableName);
-  PidData pidData;
-  for (const auto pid : pids) {
-    if (!tryTargetPid(pid, pidData)) {
-      // Not a Python Process
-      continue;
-    }
-    pid_hash.update_value(pid, pidData);
-  }
+  targetPids(pids);
 
   // Open perf buffer
   auto openRes = bpf_.open_perf_buffer(
@@ -228,8 +327,10 @@ PyPerfUtil::PyPerfResult PyPerfUtil::init() {
 
 void PyPerfUtil::handleSample(const void* data, int dataSize) {
   const Event* raw = static_cast<const Event*>(data);
-  samples_.emplace_back(raw, dataSize);
   totalSamples_++;
+  if (processor_) {
+    processor_->processSample(PyPerfSample(raw, dataSize), this);
+  }
 }
 
 void PyPerfUtil::handleLostSamples(int lostCnt) { lostSamples_ += lostCnt; }
@@ -242,6 +343,9 @@ PyPerfUtil::PyPerfResult PyPerfUtil::profile(int64_t sampleRate,
     return PyPerfResult::NO_INIT;
   }
 
+  // Samples are handed to the processor as the Perf Buffer is polled
+  processor_ = processor;
+
   // Attach to CPU cycles
   auto attachRes =
       bpf_.attach_perf_event(0, 0, kOnEventFuncName, sampleRate, 0);
@@ -261,9 +365,24 @@ PyPerfUtil::PyPerfResult PyPerfUtil::profile(int64_t sampleRate,
   }
   logInfo(2, "Started polling Perf Buffer\n");
   auto start = std::chrono::steady_clock::now();
+  auto lastDrain = start;
+  auto lastPidRefresh = start;
   while (std::chrono::steady_clock::now() <
          start + std::chrono::milliseconds(durationMs)) {
     perfBuffer->poll(50 /* 50ms timeout */);
+    // Target processes started or exec'ed since the last refresh
+    if (std::chrono::steady_clock::now() >=
+        lastPidRefresh + std::chrono::milliseconds(kPidRefreshIntervalMs)) {
+      refreshPids();
+      lastPidRefresh = std::chrono::steady_clock::now();
+    }
+    // Drain new symbols before the ring wraps around
+    if (lruSymbols_ && std::chrono::steady_clock::now() >=
+                           lastDrain + std::chrono::milliseconds(
+                                           kSymbolDrainIntervalMs)) {
+      drainSymbols();
+      lastDrain = std::chrono::steady_clock::now();
+    }
   }
   logInfo(2, "Profiling duration finished\n");
 
@@ -282,21 +401,60 @@ PyPerfUtil::PyPerfResult PyPerfUtil::profile(int64_t sampleRate,
   }
   logInfo(2, "Finished draining remaining samples\n");
 
-  processor->processSamples(samples_, this);
+  processor->finish(this);
+  processor_ = nullptr;
 
   return PyPerfResult::SUCCESS;
 }
 
-std::unordered_map<int32_t, std::string> PyPerfUtil::getSymbolMapping() {
+const std::unordered_map<int32_t, std::string>&
+PyPerfUtil::getSymbolMapping() {
+  if (lruSymbols_) {
+    // Evicted symbols are no longer in the map, but their ids are still in
+    // the samples: keep everything drained so far
+    drainSymbols();
+    logInfo(1, "Total %d unique Python symbols, %d lost\n", symbols_.size(),
+            lostSymbols_);
+    return symbols_;
+  }
+
   auto symbolTable = bpf_.get_hash_table<Symbol, int32_t>("symbols");
-  std::unordered_map<int32_t, std::string> symbols;
+  symbols_.clear();
   for (auto& x : symbolTable.get_table_offline()) {
     auto symbolName = getSymbolName(x.first);
     logInfo(2, "Symbol ID %d is %s\n", x.second, symbolName.c_str());
-    symbols.emplace(x.second, std::move(symbolName));
+    symbols_.emplace(x.second, std::move(symbolName));
+  }
+  logInfo(1, "Total %d unique Python symbols\n", symbols_.size());
+  return symbols_;
+}
+
+// Read the symbols added to the ring since the last call. Ids are assigned
+// per CPU in sequence, so only the slots after the last one drained of every
+// CPU are read, instead of the whole symbols map.
+void PyPerfUtil::drainSymbols() {
+  auto symbolRing = bpf_.get_array_table<SymbolRingEntry>(kSymbolRingName);
+  SymbolRingEntry entry;
+  for (int cpu = 0; cpu < numCpus_; cpu++) {
+    auto& next = symbolCounters_[cpu];
+    while (true) {
+      int idx = cpu * kSymbolRingSize + (next & (kSymbolRingSize - 1));
+      if (!symbolRing.get_value(idx, entry).ok() || entry.seq <= next) {
+        // not assigned yet
+        break;
+      }
+      if (entry.seq == next + 1) {
+        int32_t id = next * numCpus_ + cpu;
+        auto symbolName = getSymbolName(entry.sym);
+        logInfo(2, "Symbol ID %d is %s\n", id, symbolName.c_str());
+        symbols_.emplace(id, std::move(symbolName));
+      } else {
+        // the slot was reused by a newer symbol of this CPU
+        lostSymbols_++;
+      }
+      next++;
+    }
   }
-  logInfo(1, "Total %d unique Python symbols\n", symbols.size());
-  return symbols;
 }
 
 std::string PyPerfUtil::getSymbolName(Symbol& sym) const {
@@ -325,41 +483,177 @@ std::string PyPerfUtil::getSymbolName(Symbol& sym) const {
 }
 
 bool PyPerfUtil::tryTargetPid(int pid, PidData& data) {
-  FindPythonPathHelper helper{pid, false, 0, 0};
+  FindPythonPathHelper helper{pid, false, false, 0, 0, 0, 0, 0, 0, 0, 0};
   bcc_procutils_each_module(pid, &findPythonPathCallback, &helper);
   if (!helper.found) {
     logInfo(2, "PID %d does not contain Python library\n", pid);
     return false;
   }
 
-  char path[256];
-  int res = std::snprintf(path, sizeof(path), "/proc/%d/map_files/%lx-%lx", pid,
-                          helper.st, helper.en);
-  if (res < 0 || size_t(res) >= sizeof(path)) {
+  auto version = getPyVersionConfig(helper.major, helper.minor);
+  if (!version) {
+    logInfo(1, "PID %d runs unsupported Python %d.%d\n", pid, helper.major,
+            helper.minor);
     return false;
   }
 
-  if (!getAddrOfPythonBinary(path, data)) {
-    std::fprintf(
-        stderr,
-        "Failed getting addresses in potential Python library in PID %d\n",
-        pid);
+  auto binaryKey =
+      std::make_tuple(helper.devMajor, helper.devMinor, helper.inode);
+  BinaryInfo binary;
+  bool cached = false;
+  {
+    std::lock_guard<std::mutex> lock(binariesMutex_);
+    auto it = binaries_.find(binaryKey);
+    if (it != binaries_.end()) {
+      binary = it->second;
+      cached = true;
+    }
+  }
+
+  if (!cached) {
+    char path[256];
+    int res = std::snprintf(path, sizeof(path), "/proc/%d/map_files/%lx-%lx",
+                            pid, helper.st, helper.en);
+    if (res < 0 || size_t(res) >= sizeof(path)) {
+      return false;
+    }
+
+    binary.valid = getAddrOfPythonBinary(path, *version, binary.data);
+    if (!binary.valid) {
+      std::fprintf(
+          stderr,
+          "Failed getting addresses in potential Python library in PID %d\n",
+          pid);
+    }
+    binary.isSharedObj = bcc_elf_get_type(path) == ET_DYN;
+
+    std::lock_guard<std::mutex> lock(binariesMutex_);
+    binaries_.emplace(binaryKey, binary);
+  }
+  if (!binary.valid) {
     return false;
   }
-  data.offsets = kPy36OffsetConfig;
-  data.current_state_addr += helper.st;
+  data = binary.data;
+
+  // Symbol addresses are relative to the load address of shared objects and
+  // PIE executables
+  uint64_t base = 0;
+  if (binary.isSharedObj) {
+    base = helper.st - helper.fileOffset;
+  }
+  data.current_state_addr += base;
   logInfo(2, "PID %d has _PyThreadState_Current at %lx\n", pid,
           data.current_state_addr);
-  data.tls_key_addr += helper.st;
-  logInfo(2, "PID %d has autoTLSKey at %lx\n", pid, data.current_state_addr);
-  data.gil_locked_addr += helper.st;
-  logInfo(2, "PID %d has gil_locked at %lx\n", pid, data.current_state_addr);
-  data.gil_last_holder_addr += helper.st;
+  data.tls_key_addr += base;
+  logInfo(2, "PID %d has autoTLSKey at %lx\n", pid, data.tls_key_addr);
+  data.gil_locked_addr += base;
+  logInfo(2, "PID %d has gil_locked at %lx\n", pid, data.gil_locked_addr);
+  data.gil_last_holder_addr += base;
   logInfo(2, "PID %d has gil_last_holder at %lx\n", pid,
-          data.current_state_addr);
+          data.gil_last_holder_addr);
 
   return true;
 }
 
+// Check the processes on a pool of threads and add the Python ones to the
+// pid_config table
+void PyPerfUtil::targetPids(const std::vector<int>& pids) {
+  std::vector<PidData> pidData(pids.size());
+  std::vector<char> found(pids.size(), 0);
+  std::atomic<size_t> next{0};
+
+  auto worker = [&]() {
+    size_t i;
+    while ((i = next++) < pids.size()) {
+      found[i] = tryTargetPid(pids[i], pidData[i]);
+    }
+  };
+
+  unsigned nrWorkers = std::min<size_t>(
+      std::min(std::max(std::thread::hardware_concurrency(), 1u),
+               kMaxPidWorkers),
+      pids.size());
+  std::vector<std::thread> workers;
+  for (unsigned i = 1; i < nrWorkers; i++) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto& t : workers) {
+    t.join();
+  }
+
+  auto pid_hash = bpf_.get_hash_table<int, PidData>(kPidCfgTableName);
+  for (size_t i = 0; i < pids.size(); i++) {
+    auto& state = pids_[pids[i]];
+    struct stat st;
+    // Remember the binary the process was checked with, to check it again
+    // when it execs another one
+    if (::stat(("/proc/" + std::to_string(pids[i]) + "/exe").c_str(), &st) ==
+            0 &&
+        (st.st_dev != state.exeDev || st.st_ino != state.exeIno)) {
+      state.exeDev = st.st_dev;
+      state.exeIno = st.st_ino;
+      state.checks = 0;
+    }
+    state.checks++;
+    bool wasTargeted = state.targeted;
+    state.targeted = found[i];
+    if (!found[i]) {
+      // Not a Python Process, or no longer after an exec
+      if (wasTargeted) {
+        pid_hash.remove_value(pids[i]);
+      }
+      continue;
+    }
+    pid_hash.update_value(pids[i], pidData[i]);
+  }
+}
+
+// Check the processes that are new or exec'ed another binary since they were
+// last checked, and forget the ones that exited
+void PyPerfUtil::refreshPids() {
+  std::vector<int> pids;
+  if (!getRunningPids(pids)) {
+    return;
+  }
+
+  std::unordered_map<int, bool> running;
+  std::vector<int> toCheck;
+  for (const auto pid : pids) {
+    running[pid] = true;
+    auto it = pids_.find(pid);
+    if (it == pids_.end()) {
+      toCheck.push_back(pid);
+      continue;
+    }
+    auto& state = it->second;
+    struct stat st;
+    if (::stat(("/proc/" + std::to_string(pid) + "/exe").c_str(), &st) != 0) {
+      continue;
+    }
+    if (st.st_dev != state.exeDev || st.st_ino != state.exeIno ||
+        (!state.targeted && state.checks < kPidChecksAfterExec)) {
+      toCheck.push_back(pid);
+    }
+  }
+
+  auto pid_hash = bpf_.get_hash_table<int, PidData>(kPidCfgTableName);
+  for (auto it = pids_.begin(); it != pids_.end();) {
+    if (running.count(it->first)) {
+      ++it;
+      continue;
+    }
+    if (it->second.targeted) {
+      pid_hash.remove_value(it->first);
+    }
+    it = pids_.erase(it);
+  }
+
+  if (!toCheck.empty()) {
+    logInfo(2, "Checking %d new or exec'ed processes\n", toCheck.size());
+    targetPids(toCheck);
+  }
+}
+
 }  // namespace pyperf
 }  // namespace ebpf
@@ -5,7 +5,10 @@
 
 #pragma once
 
+#include <map>
+#include <mutex>
 #include <string>
+#include <tuple>
 #include <unordered_map>
 #include <vector>
 
@@ -30,33 +33,66 @@ class PyPerfUtil {
     EVENT_DETACH_FAIL
   };
 
-  // init must be invoked exactly once before invoking profile
-  PyPerfResult init();
+  // init must be invoked exactly once before invoking profile. With
+  // lruSymbols, the BPF symbols map evicts old symbols when full instead of
+  // leaving new ones unresolved, and new symbols are drained periodically.
+  PyPerfResult init(bool lruSymbols = false);
 
   PyPerfResult profile(int64_t sampleRate, int64_t durationMs,
                        PyPerfSampleProcessor* processor);
 
-  std::unordered_map<int32_t, std::string> getSymbolMapping();
+  const std::unordered_map<int32_t, std::string>& getSymbolMapping();
 
   uint32_t getTotalSamples() const { return totalSamples_; }
 
   uint32_t getLostSamples() const { return lostSamples_; }
 
+  // Symbols overwritten in the BPF ring before being drained
+  uint32_t getLostSymbols() const { return lostSymbols_; }
+
  private:
-  uint32_t totalSamples_ = 0, lostSamples_ = 0;
+  uint32_t totalSamples_ = 0, lostSamples_ = 0, lostSymbols_ = 0;
 
   ebpf::BPF bpf_{0, nullptr, false, "", true};
-  std::vector<PyPerfSample> samples_;
+  PyPerfSampleProcessor* processor_{nullptr};
   bool initCompleted_{false};
 
+  bool lruSymbols_{false};
+  int numCpus_{0};
+  // per CPU symbol counter of the next symbol to drain from the ring
+  std::vector<int64_t> symbolCounters_;
+  std::unordered_map<int32_t, std::string> symbols_;
+
   void handleSample(const void* data, int dataSize);
   void handleLostSamples(int lostCnt);
   friend void handleLostSamplesCallback(void*, uint64_t);
   friend void handleSampleCallback(void*, void*, int);
 
   std::string getSymbolName(Symbol& sym) const;
+  void drainSymbols();
+
+  // Result of the ELF lookups of a Python binary, shared by every process
+  // running it. Addresses are not rebased on the load address.
+  struct BinaryInfo {
+    bool valid;
+    bool isSharedObj;
+    PidData data;
+  };
+  // by device major, minor and inode of the binary
+  std::map<std::tuple<uint64_t, uint64_t, uint64_t>, BinaryInfo> binaries_;
+  std::mutex binariesMutex_;
+
+  struct PidState {
+    dev_t exeDev;
+    ino_t exeIno;
+    int checks;  // since the last exec
+    bool targeted;
+  };
+  std::unordered_map<int, PidState> pids_;
 
   bool tryTargetPid(int pid, PidData& data);
+  void targetPids(const std::vector<int>& pids);
+  void refreshPids();
 };
 }  // namespace pyperf
 }  // namespace ebpf
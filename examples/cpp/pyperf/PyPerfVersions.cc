@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ */
+
+#include "PyPerfVersions.h"
+
+namespace ebpf {
+namespace pyperf {
+
+extern const OffsetConfig kPy36OffsetConfig;
+extern const OffsetConfig kPy38OffsetConfig;
+extern const RuntimeOffsetConfig kPy38RuntimeOffsetConfig;
+extern const OffsetConfig kPy39OffsetConfig;
+extern const RuntimeOffsetConfig kPy39RuntimeOffsetConfig;
+extern const OffsetConfig kPy310OffsetConfig;
+extern const RuntimeOffsetConfig kPy310RuntimeOffsetConfig;
+extern const OffsetConfig kPy311OffsetConfig;
+extern const RuntimeOffsetConfig kPy311RuntimeOffsetConfig;
+
+// Offsets are for x86_64 builds of CPython
+const static PyVersionConfig kPyVersionConfigs[] = {
+    {3, 6, &kPy36OffsetConfig, nullptr},
+    {3, 8, &kPy38OffsetConfig, &kPy38RuntimeOffsetConfig},
+    {3, 9, &kPy39OffsetConfig, &kPy39RuntimeOffsetConfig},
+    {3, 10, &kPy310OffsetConfig, &kPy310RuntimeOffsetConfig},
+    {3, 11, &kPy311OffsetConfig, &kPy311RuntimeOffsetConfig},
+};
+
+const PyVersionConfig* getPyVersionConfig(int major, int minor) {
+  for (const auto& config : kPyVersionConfigs) {
+    if (config.major == major && config.minor == minor) {
+      return &config;
+    }
+  }
+  return nullptr;
+}
+
+}  // namespace pyperf
+}  // namespace ebpf
@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ */
+
+#pragma once
+
+#include "PyPerfType.h"
+
+namespace ebpf {
+namespace pyperf {
+
+struct PyVersionConfig {
+  int major;
+  int minor;
+  const OffsetConfig* offsets;
+  // nullptr for versions where _PyThreadState_Current, autoTLSkey,
+  // gil_locked and gil_last_holder are symbols of their own
+  const RuntimeOffsetConfig* runtimeOffsets;
+};
+
+// Returns nullptr if the CPython version is not supported
+const PyVersionConfig* getPyVersionConfig(int major, int minor);
+
+}  // namespace pyperf
+}  // namespace ebpf
@@ -11,20 +11,29 @@ struct tunnel_key {
   u32 tunnel_id;
   u32 remote_ipv4;
 };
-BPF_HASH(tunkey2if, struct tunnel_key, int, 1024);
+
+// Route from a tunnel and the prefix of its remote endpoints to a port, so
+// that a whole subnet of endpoints behind one port takes a single entry
+struct tunnel_route {
+  u32 prefixlen;    // 32 bits of tunnel_id, then the remote prefix length
+  u32 tunnel_id;
+  u32 remote_ipv4;  // network byte order
+};
+BPF_LPM_TRIE(tunroute2if, struct tunnel_route, int, 1024);
 
 BPF_HASH(if2tunkey, int, struct tunnel_key, 1024);
 
 // Handle packets from the encap device, demux into the dest tenant
 int handle_ingress(struct __sk_buff *skb) {
   struct bpf_tunnel_key tkey = {};
-  struct tunnel_key key;
+  struct tunnel_route key;
   bpf_skb_get_tunnel_key(skb, &tkey,
       offsetof(struct bpf_tunnel_key, remote_ipv6[1]), 0);
 
+  key.prefixlen = 64;
   key.tunnel_id = tkey.tunnel_id;
-  key.remote_ipv4 = tkey.remote_ipv4;
-  int *ifindex = tunkey2if.lookup(&key);
+  key.remote_ipv4 = bpf_htonl(tkey.remote_ipv4);
+  int *ifindex = tunroute2if.lookup(&key);
   if (ifindex) {
     //bpf_trace_printk("ingress tunnel_id=%d remote_ip=%08x ifindex=%d\n",
     //                 key.tunnel_id, key.remote_ipv4, *ifindex);
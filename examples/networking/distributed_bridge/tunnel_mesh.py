@@ -10,7 +10,7 @@ from http.server import HTTPServer, SimpleHTTPRequestHandler
 import json
 from netaddr import EUI, IPAddress
 from pyroute2 import IPRoute, NetNS, IPDB, NSPopen
-from socket import htons, AF_INET
+from socket import htonl, htons, AF_INET
 from threading import Thread
 from subprocess import call, Popen, PIPE
 
@@ -22,7 +22,7 @@ gretap = int(argv[4])
 b = BPF(src_file="tunnel_mesh.c")
 ingress_fn = b.load_func("handle_ingress", BPF.SCHED_CLS)
 egress_fn = b.load_func("handle_egress", BPF.SCHED_CLS)
-tunkey2if = b.get_table("tunkey2if")
+tunroute2if = b.get_table("tunroute2if")
 if2tunkey = b.get_table("if2tunkey")
 conf = b.get_table("conf")
 
@@ -59,6 +59,9 @@ def run():
     ipr.tc("add-filter", "bpf", vx.index, ":1", fd=ingress_fn.fd,
            name=ingress_fn.name, parent="ffff:", action="drop", classid=1)
 
+    # routes and ports of all the peers, written to the maps in one go
+    routes = []
+    ports = []
     for j in range(0, 2):
         vni = 10000 + j
         with ipdb.create(ifname="br%d" % j, kind="bridge") as br:
@@ -66,15 +69,14 @@ def run():
                 if i != host_id:
                     v = ipdb.create(ifname="dummy%d%d" % (j , i), kind="dummy").up().commit()
                     ipaddr = "172.16.1.%d" % (100 + i)
-                    tunkey2if_key = tunkey2if.Key(vni)
-                    tunkey2if_key.remote_ipv4 = IPAddress(ipaddr)
-                    tunkey2if_leaf = tunkey2if.Leaf(v.index)
-                    tunkey2if[tunkey2if_key] = tunkey2if_leaf
+                    # a single remote endpoint: full tunnel id and address
+                    routes.append((tunroute2if.Key(64, vni,
+                                       htonl(int(IPAddress(ipaddr)))),
+                                   tunroute2if.Leaf(v.index)))
 
-                    if2tunkey_key = if2tunkey.Key(v.index)
                     if2tunkey_leaf = if2tunkey.Leaf(vni)
                     if2tunkey_leaf.remote_ipv4 = IPAddress(ipaddr)
-                    if2tunkey[if2tunkey_key] = if2tunkey_leaf
+                    ports.append((if2tunkey.Key(v.index), if2tunkey_leaf))
 
                     ipr.tc("add", "sfq", v.index, "1:")
                     ipr.tc("add-filter", "bpf", v.index, ":1", fd=egress_fn.fd,
@@ -87,6 +89,14 @@ def run():
                 br.add_ip(ipaddr)
             ifc_gc.append(br.ifname)
 
+    # a few syscalls for the hash, where the kernel has batch updates (5.6+),
+    # one per entry for the trie
+    for table, entries in ((tunroute2if, routes), (if2tunkey, ports)):
+        if entries:
+            keys = (table.Key * len(entries))(*[k for k, _ in entries])
+            leaves = (table.Leaf * len(entries))(*[l for _, l in entries])
+            table.items_update_batch(keys, leaves)
+
     # dhcp server only runs on host 0
     if dhcp == 1 and host_id == 0:
         for j in range(0, 2):
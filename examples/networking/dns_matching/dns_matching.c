@@ -53,6 +53,30 @@ struct Leaf {
 
 BPF_HASH(cache, struct Key, struct Leaf, 128);
 
+#ifdef AGGREGATE
+#define NAME_BYTES 64
+
+struct FlowKey {
+  u32 src_ip;
+  u32 dst_ip;
+  u16 src_port;
+  u16 dst_port;
+  u32 proto;
+};
+
+struct FlowLeaf {
+  u64 last_ts;
+  u64 packets;
+  u64 bytes;
+  // First bytes of the name asked first on the flow
+  unsigned char name[NAME_BYTES];
+};
+
+// Matching queries aggregated per flow, instead of copied to user space.
+// The least recently seen flows are evicted when it is full.
+BPF_TABLE("lru_hash", struct FlowKey, struct FlowLeaf, flows, 10240);
+#endif
+
 int dns_matching(struct __sk_buff *skb)
 {
   u8 *cursor = 0;
@@ -92,8 +116,33 @@ int dns_matching(struct __sk_buff *skb)
 
         // If DNS name is contained in our map, keep the packet
         if(lookup_leaf) {
+#ifdef AGGREGATE
+          // Or account for it in its flow and drop it
+          struct FlowKey flow_key = {};
+          flow_key.src_ip = ip->src;
+          flow_key.dst_ip = ip->dst;
+          flow_key.src_port = udp->sport;
+          flow_key.dst_port = udp->dport;
+          flow_key.proto = IPPROTO_UDP;
+          u64 ts = bpf_ktime_get_ns();
+          struct FlowLeaf *flow = flows.lookup(&flow_key);
+          if (flow) {
+            lock_xadd(&flow->packets, 1);
+            lock_xadd(&flow->bytes, udp->length);
+            flow->last_ts = ts;
+          } else {
+            struct FlowLeaf zero = {};
+            zero.last_ts = ts;
+            zero.packets = 1;
+            zero.bytes = udp->length;
+            __builtin_memcpy(zero.name, key.p, NAME_BYTES);
+            flows.update(&flow_key, &zero);
+          }
+          return 0;
+#else
           bpf_trace_printk("Matched1\n");
           return -1;
+#endif
         }
       }
     }
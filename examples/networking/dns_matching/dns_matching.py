@@ -7,6 +7,9 @@ from ctypes import *
 import os
 import sys
 import fcntl
+import socket
+import struct
+import time
 import dnslib
 import argparse
 
@@ -35,6 +38,34 @@ def add_cache_entry(cache, name):
   leaf.p = (c_ubyte * 4).from_buffer(bytearray(4))
   cache[key] = leaf
 
+def decode_dns(name):
+  labels = []
+  i = 0
+  while i < len(name) and name[i] != 0:
+    labels.append(bytearray(name[i + 1:i + 1 + name[i]]).decode('ascii', 'replace'))
+    i += name[i] + 1
+  return '.'.join(labels)
+
+def print_flows(flows, interval):
+  # Flows are read in batches, and only those with new queries are printed
+  seen = {}
+  while 1:
+    try:
+      time.sleep(interval)
+    except KeyboardInterrupt:
+      sys.exit(0)
+    current = {}
+    for k, v in flows.items_lookup_batch():
+      key = (k.src_ip, k.src_port, k.dst_ip, k.dst_port)
+      current[key] = v.packets
+      if seen.get(key) == v.packets:
+        continue
+      print("%s:%d -> %s:%d %d queries, %d bytes, first for %s" % (
+          socket.inet_ntoa(struct.pack("!I", k.src_ip)), k.src_port,
+          socket.inet_ntoa(struct.pack("!I", k.dst_ip)), k.dst_port,
+          v.packets, v.bytes, decode_dns(v.name)))
+    seen = current
+
 
 parser = argparse.ArgumentParser(usage='For detailed information about usage,\
  try with -h option')
@@ -43,10 +74,15 @@ req_args.add_argument("-i", "--interface", type=str, default="",
                       help="Interface name, defaults to all if unspecified.")
 req_args.add_argument("-d", "--domains", type=str, required=True, nargs="+",
     help='List of domain names separated by space. For example: -d abc.def xyz.mno')
+parser.add_argument("-a", "--aggregate", type=int, metavar="INTERVAL",
+    help="Aggregate matching packets per flow in the kernel and print the "
+         "flows every INTERVAL seconds, instead of copying each packet to "
+         "user space. Needs Linux 5.6 or later.")
 args = parser.parse_args()
 
 # initialize BPF - load source code from http-parse-simple.c
-bpf = BPF(src_file = "dns_matching.c", debug=0)
+bpf = BPF(src_file = "dns_matching.c", debug=0,
+          cflags=["-DAGGREGATE"] if args.aggregate else [])
 # print(bpf.dump_func("dns_test"))
 
 #load eBPF program http_filter of type SOCKET_FILTER into the kernel eBPF vm
@@ -73,6 +109,9 @@ print("\nBPF program will filter-in DNS packets which match with map entries.")
 print("Packets received by user space program will be printed here")
 print("\nHit Ctrl+C to end...")
 
+if args.aggregate:
+  print_flows(bpf.get_table("flows"), args.aggregate)
+
 socket_fd = function_dns_matching.sock
 fl = fcntl.fcntl(socket_fd, fcntl.F_GETFL)
 fcntl.fcntl(socket_fd, fcntl.F_SETFL, fl & (~os.O_NONBLOCK))
@@ -0,0 +1,153 @@
+#include <uapi/linux/ptrace.h>
+#include <net/sock.h>
+#include <bcc/proto.h>
+
+#define IP_TCP 	6
+#define ETH_HLEN 14
+#define FIRST_BYTES 64
+
+struct Key {
+	u32 src_ip;               //source ip
+	u32 dst_ip;               //destination ip
+	unsigned short src_port;  //source port
+	unsigned short dst_port;  //destination port
+	u32 proto;                //ip protocol, always TCP here
+};
+
+struct Leaf {
+	u64 first_ts;             //timestamp of the first packet in ns
+	u64 last_ts;              //timestamp of the last packet in ns
+	u64 packets;              //packets of the flow
+	u64 bytes;                //payload bytes of the flow
+	u32 len;                  //valid bytes in first
+	u8 first[FIRST_BYTES];    //first payload bytes of the flow
+};
+
+//map <Key, Leaf> of the HTTP flows, the least recently
+//seen ones are evicted when it is full
+BPF_TABLE("lru_hash", struct Key, struct Leaf, flows, 10240);
+
+/*eBPF program.
+  Aggregate in the kernel, per (src_ip,dst_ip,src_port,dst_port) flow,
+  the IP and TCP packets of the flows whose first payload starts with
+  "HTTP", "GET", "POST" ...: count their packets and payload bytes and keep
+  the first FIRST_BYTES bytes of payload (the request or status line).
+  Userspace reads the flows table in batches instead of a copy of every packet,
+  so every packet is dropped
+  return  0 -> DROP the packet
+*/
+int http_filter(struct __sk_buff *skb) {
+
+	u8 *cursor = 0;
+
+	struct ethernet_t *ethernet = cursor_advance(cursor, sizeof(*ethernet));
+	//filter IP packets (ethernet type = 0x0800)
+	if (!(ethernet->type == 0x0800)) {
+		goto DROP;
+	}
+
+	struct ip_t *ip = cursor_advance(cursor, sizeof(*ip));
+	//filter TCP packets (ip next protocol = 0x06)
+	if (ip->nextp != IP_TCP) {
+		goto DROP;
+	}
+
+	u32  tcp_header_length = 0;
+	u32  ip_header_length = 0;
+	u32  payload_offset = 0;
+	u32  payload_length = 0;
+	struct Key key = {};
+
+	ip_header_length = ip->hlen << 2;    //SHL 2 -> *4 multiply
+
+	//check ip header length against minimum
+	if (ip_header_length < sizeof(*ip)) {
+		goto DROP;
+	}
+
+	//shift cursor forward for dynamic ip header size
+	void *_ = cursor_advance(cursor, (ip_header_length-sizeof(*ip)));
+
+	struct tcp_t *tcp = cursor_advance(cursor, sizeof(*tcp));
+
+	key.src_ip = ip->src;
+	key.dst_ip = ip->dst;
+	key.src_port = tcp->src_port;
+	key.dst_port = tcp->dst_port;
+	key.proto = IP_TCP;
+
+	tcp_header_length = tcp->offset << 2; //SHL 2 -> *4 multiply
+
+	payload_offset = ETH_HLEN + ip_header_length + tcp_header_length;
+	payload_length = ip->tlen - ip_header_length - tcp_header_length;
+
+	u64 ts = bpf_ktime_get_ns();
+	struct Leaf *leaf = flows.lookup(&key);
+	if (leaf) {
+		//packet of a known flow, just account for it
+		lock_xadd(&leaf->packets, 1);
+		lock_xadd(&leaf->bytes, payload_length);
+		leaf->last_ts = ts;
+		goto DROP;
+	}
+
+	//a new flow needs an HTTP message as first payload
+	//minimum length of http request is always geater than 7 bytes
+	if (payload_length < 7) {
+		goto DROP;
+	}
+
+	unsigned long p[7];
+	int i = 0;
+	for (i = 0; i < 7; i++) {
+		p[i] = load_byte(skb , payload_offset + i);
+	}
+
+	//HTTP
+	if ((p[0] == 'H') && (p[1] == 'T') && (p[2] == 'T') && (p[3] == 'P')) {
+		goto NEW_FLOW;
+	}
+	//GET
+	if ((p[0] == 'G') && (p[1] == 'E') && (p[2] == 'T')) {
+		goto NEW_FLOW;
+	}
+	//POST
+	if ((p[0] == 'P') && (p[1] == 'O') && (p[2] == 'S') && (p[3] == 'T')) {
+		goto NEW_FLOW;
+	}
+	//PUT
+	if ((p[0] == 'P') && (p[1] == 'U') && (p[2] == 'T')) {
+		goto NEW_FLOW;
+	}
+	//DELETE
+	if ((p[0] == 'D') && (p[1] == 'E') && (p[2] == 'L') && (p[3] == 'E') && (p[4] == 'T') && (p[5] == 'E')) {
+		goto NEW_FLOW;
+	}
+	//HEAD
+	if ((p[0] == 'H') && (p[1] == 'E') && (p[2] == 'A') && (p[3] == 'D')) {
+		goto NEW_FLOW;
+	}
+
+	//no HTTP match
+	goto DROP;
+
+	NEW_FLOW: {
+		struct Leaf zero = {};
+		zero.first_ts = ts;
+		zero.last_ts = ts;
+		zero.packets = 1;
+		zero.bytes = payload_length;
+		//copy the first bytes of payload, as many as the packet has
+		u32 len = payload_length < FIRST_BYTES ? payload_length : FIRST_BYTES;
+		if (len > 0 && len <= FIRST_BYTES &&
+		    bpf_skb_load_bytes(skb, payload_offset, zero.first, len) == 0) {
+			zero.len = len;
+		}
+		flows.update(&key, &zero);
+	}
+
+	//drop the packet, nothing is copied to userspace
+	DROP:
+	return 0;
+
+}
@@ -0,0 +1,67 @@
+#!/usr/bin/python
+#
+# eBPF application that aggregates HTTP traffic per flow in the kernel
+# and prints, for each active flow, its first request or status line and
+# the packets and bytes it carried.
+#
+# eBPF program http_filter is used as SOCKET_FILTER attached to eth0 interface.
+# Unlike http-parse-simple and http-parse-complete, no packet is returned to
+# userspace: the program keeps counters and the first payload bytes of each
+# HTTP flow in an LRU hash, which this script reads in batches.
+#
+# Batched map lookups need Linux 5.6 or later.
+
+from __future__ import print_function
+from bcc import BPF
+
+import argparse
+import socket
+import struct
+import time
+
+parser = argparse.ArgumentParser(
+    description="Aggregate HTTP flows in the kernel",
+    formatter_class=argparse.RawDescriptionHelpFormatter)
+parser.add_argument("-i", "--interface", default="eth0",
+    help="interface to bind to, default is eth0")
+parser.add_argument("interval", nargs="?", default=1, type=int,
+    help="output interval, in seconds")
+args = parser.parse_args()
+
+print("binding socket to '%s'" % args.interface)
+
+bpf = BPF(src_file="http-parse-flows.c", debug=0)
+function_http_filter = bpf.load_func("http_filter", BPF.SOCKET_FILTER)
+BPF.attach_raw_socket(function_http_filter, args.interface)
+flows = bpf.get_table("flows")
+
+
+def addr(ip, port):
+    # header fields were loaded in host byte order
+    return "%s:%d" % (socket.inet_ntoa(struct.pack("!I", ip)), port)
+
+
+# counters of the flows at the previous interval, to print only the
+# active ones
+seen = {}
+
+print("%-21s %-21s %8s %10s %s" % ("SOURCE", "DESTINATION", "PKTS", "BYTES",
+                                   "FIRST LINE"))
+while 1:
+    try:
+        time.sleep(args.interval)
+    except KeyboardInterrupt:
+        exit()
+
+    current = {}
+    for k, v in flows.items_lookup_batch():
+        key = (k.src_ip, k.src_port, k.dst_ip, k.dst_port)
+        current[key] = v.packets
+        if seen.get(key) == v.packets:
+            continue
+        first = bytearray(v.first[:v.len]).split(b"\r\n")[0]
+        print("%-21s %-21s %8d %10d %s" % (addr(k.src_ip, k.src_port),
+              addr(k.dst_ip, k.dst_port), v.packets, v.bytes,
+              first.decode("ascii", "replace")))
+    # flows evicted from the LRU hash are forgotten here too
+    seen = current
@@ -0,0 +1,62 @@
+#!/usr/bin/python
+#
+# xdp_cpu_steer.py Spread the incoming packets over CPUs by flow, and move
+#                  flows off the busiest CPUs every second
+#
+# Copyright (c) Facebook, Inc.
+# Licensed under the Apache License, Version 2.0 (the "License")
+
+from bcc import BPF
+from bcc.xdp import CpuSteering
+from multiprocessing import cpu_count
+import argparse
+import time
+
+parser = argparse.ArgumentParser(
+    description="Steer incoming packets to CPUs by flow")
+parser.add_argument("device", help="network device")
+parser.add_argument("cpus", type=int, nargs="+", help="CPUs to steer to")
+parser.add_argument("-q", "--qsize", type=int, default=192,
+    help="packets queued to each CPU (default 192)")
+parser.add_argument("-t", "--tolerance", type=float, default=0.1,
+    help="load above the average left alone (default 0.1)")
+parser.add_argument("-S", "--skb-mode", action="store_true",
+    help="use skb mode")
+args = parser.parse_args()
+
+flags = BPF.XDP_FLAGS_SKB_MODE if args.skb_mode else 0
+
+b = BPF(text="""
+BPF_CPUMAP(cpumap, __MAX_CPU__);
+BPF_ARRAY(cpu_slots, u32, 256);
+BPF_PERCPU_ARRAY(cpu_slot_pkts, u64, 256);
+
+int xdp_cpu_steer(struct xdp_md *ctx) {
+    u32 slot = bpf_xdp_flow_hash(ctx) % 256;
+    u32 *cpu = cpu_slots.lookup(&slot);
+    u64 *pkts = cpu_slot_pkts.lookup(&slot);
+    if (!cpu || !pkts)
+        return XDP_PASS;
+    *pkts += 1;
+    return cpumap.redirect_map(*cpu, 0);
+}
+""", cflags=["-D__MAX_CPU__=%u" % cpu_count()])
+
+steering = CpuSteering(b, "cpumap", "cpu_slots", "cpu_slot_pkts")
+steering.set_cpus(args.cpus, args.qsize)
+
+fn = b.load_func("xdp_cpu_steer", BPF.XDP)
+b.attach_xdp(args.device, fn, flags)
+
+print("Steering packets to CPUs %s, hit CTRL+C to stop" %
+      ", ".join(str(c) for c in steering.cpus))
+while 1:
+    try:
+        time.sleep(1)
+        moved = steering.rebalance(args.tolerance)
+        print("%s  moved %d slots" % ("  ".join("CPU %d: %d pkt/s" %
+              (c, steering.load[c]) for c in steering.cpus), moved))
+    except KeyboardInterrupt:
+        break
+
+b.remove_xdp(args.device, flags)
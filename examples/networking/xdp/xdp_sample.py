@@ -0,0 +1,64 @@
+#!/usr/bin/python
+#
+# xdp_sample.py Sample 1 in N incoming packets on XDP layer and print their
+#               headers, without slowing down the other packets
+#
+# Copyright (c) Facebook, Inc.
+# Licensed under the Apache License, Version 2.0 (the "License")
+
+from bcc import BPF
+from bcc.xdp import XdpSampleReader
+import argparse
+import binascii
+import time
+
+parser = argparse.ArgumentParser(
+    description="Sample incoming packets on XDP layer")
+parser.add_argument("device", help="network device")
+parser.add_argument("-r", "--rate", type=int, default=1000,
+    help="sample 1 packet in RATE (default 1000)")
+parser.add_argument("-s", "--snaplen", type=int, default=64,
+    help="bytes of each packet to capture (default 64)")
+parser.add_argument("-S", "--skb-mode", action="store_true",
+    help="use skb mode")
+args = parser.parse_args()
+
+flags = BPF.XDP_FLAGS_SKB_MODE if args.skb_mode else 0
+
+# Samples are submitted without waking the reader up, which consumes them
+# every 100ms instead: one wakeup per batch rather than per sample
+b = BPF(text="""
+BPF_RINGBUF_OUTPUT(samples, 64);
+
+int xdp_sample(struct xdp_md *ctx) {
+    if (bpf_xdp_sample_hit(RATE)) {
+        struct xdp_sample *s = samples.ringbuf_reserve(sizeof(*s));
+        if (s) {
+            bpf_xdp_sample_fill(ctx, s);
+            samples.ringbuf_submit(s, BPF_RB_NO_WAKEUP);
+        }
+    }
+    return XDP_PASS;
+}
+""", cflags=["-DRATE=%d" % args.rate, "-DXDP_SAMPLE_SNAPLEN=%d" % args.snaplen])
+
+def print_batch(batch):
+    for s in batch:
+        print("%-18d q%-3d %5d  %s" % (s.ts, s.rx_queue, s.pkt_len,
+              binascii.hexlify(s.packet()).decode()))
+
+reader = XdpSampleReader(b["samples"], print_batch, snaplen=args.snaplen)
+fn = b.load_func("xdp_sample", BPF.XDP)
+b.attach_xdp(args.device, fn, flags)
+
+print("Sampling 1 in %d packets, hit CTRL+C to stop" % args.rate)
+print("%-18s %-4s %5s  %s" % ("TIME(ns)", "RXQ", "LEN", "HEADERS"))
+while 1:
+    try:
+        time.sleep(0.1)
+        b.ring_buffer_consume()
+        reader.flush()
+    except KeyboardInterrupt:
+        break
+
+b.remove_xdp(args.device, flags)
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ *
+ * bcc-table-header: write the C++ header of the tables of a BPF program,
+ * their key and leaf types from BTF and typed accessors, for BPF.h users
+ * to include instead of declaring the structs by hand.
+ *
+ * USAGE: bcc-table-header SOURCE NAMESPACE OUTPUT [CFLAGS...]
+ */
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "BPF.h"
+
+int main(int argc, char **argv) {
+  if (argc < 4) {
+    std::cerr << "USAGE: " << argv[0]
+              << " SOURCE NAMESPACE OUTPUT [CFLAGS...]" << std::endl;
+    return 2;
+  }
+
+  std::ifstream src(argv[1]);
+  if (!src) {
+    std::cerr << "Can't read " << argv[1] << std::endl;
+    return 1;
+  }
+  std::stringstream text;
+  text << src.rdbuf();
+
+  std::vector<std::string> cflags(argv + 4, argv + argc);
+  std::string header;
+  auto res = ebpf::BPF::table_header(text.str(), argv[2], header, cflags);
+  if (!res.ok()) {
+    std::cerr << argv[1] << ": " << res.msg() << std::endl;
+    return 1;
+  }
+
+  std::ofstream out(argv[3]);
+  out << header;
+  if (!out) {
+    std::cerr << "Can't write " << argv[3] << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -5,9 +5,10 @@
 #include <bpf/bpf_core_read.h>
 #include <bpf/bpf_tracing.h>
 #include "biolatency.h"
-#include "bits.bpf.h"
+#include "hist.bpf.h"
 
 #define MAX_ENTRIES	10240
+#define START_SLOTS	65536	/* power of two */
 
 extern int LINUX_KERNEL_VERSION __kconfig;
 
@@ -25,12 +26,22 @@ struct {
 	__uint(max_entries, 1);
 } cgroup_map SEC(".maps");
 
+/*
+ * Issue timestamps of in-flight requests, indexed by a hash of the request
+ * address and tagged with it. Unlike a hash map keyed by the pointer, no
+ * element is allocated or freed per I/O and no bucket lock is taken; a
+ * request whose slot is reused before it completes is not counted.
+ */
+struct start_slot {
+	u64 rq;
+	u64 ts;
+};
+
 struct {
-	__uint(type, BPF_MAP_TYPE_HASH);
-	__uint(max_entries, MAX_ENTRIES);
-	__type(key, struct request *);
-	__type(value, u64);
-	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, START_SLOTS);
+	__type(key, u32);
+	__type(value, struct start_slot);
 } start SEC(".maps");
 
 static struct hist initial_hist;
@@ -43,13 +54,24 @@ struct {
 	__uint(map_flags, BPF_F_NO_PREALLOC);
 } hists SEC(".maps");
 
+static __always_inline u32 start_index(struct request *rq)
+{
+	u64 h = (u64)rq;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h & (START_SLOTS - 1);
+}
+
 static __always_inline
 int trace_rq_start(struct request *rq, int issue)
 {
 	if (issue && targ_queued && BPF_CORE_READ(rq->q, elevator))
 		return 0;
 
-	u64 ts = bpf_ktime_get_ns();
+	u32 idx = start_index(rq);
+	struct start_slot *slot;
 
 	if (targ_dev != -1) {
 		struct gendisk *disk = BPF_CORE_READ(rq, rq_disk);
@@ -60,7 +82,11 @@ int trace_rq_start(struct request *rq, int issue)
 		if (targ_dev != dev)
 			return 0;
 	}
-	bpf_map_update_elem(&start, &rq, &ts, 0);
+	slot = bpf_map_lookup_elem(&start, &idx);
+	if (!slot)
+		return 0;
+	slot->ts = bpf_ktime_get_ns();
+	slot->rq = (u64)rq;
 	return 0;
 }
 
@@ -105,17 +131,20 @@ int BPF_PROG(block_rq_complete, struct request *rq, int error,
 	if (filter_cg && !bpf_current_task_under_cgroup(&cgroup_map, 0))
 		return 0;
 
-	u64 slot, *tsp, ts = bpf_ktime_get_ns();
+	u64 ts = bpf_ktime_get_ns();
+	u32 idx = start_index(rq);
+	struct start_slot *slot;
 	struct hist_key hkey = {};
 	struct hist *histp;
 	s64 delta;
 
-	tsp = bpf_map_lookup_elem(&start, &rq);
-	if (!tsp)
+	slot = bpf_map_lookup_elem(&start, &idx);
+	if (!slot || slot->rq != (u64)rq)
 		return 0;
-	delta = (s64)(ts - *tsp);
+	slot->rq = 0;
+	delta = (s64)(ts - slot->ts);
 	if (delta < 0)
-		goto cleanup;
+		return 0;
 
 	if (targ_per_disk) {
 		struct gendisk *disk = BPF_CORE_READ(rq, rq_disk);
@@ -126,25 +155,15 @@ int BPF_PROG(block_rq_complete, struct request *rq, int error,
 	if (targ_per_flag)
 		hkey.cmd_flags = rq->cmd_flags;
 
-	histp = bpf_map_lookup_elem(&hists, &hkey);
-	if (!histp) {
-		bpf_map_update_elem(&hists, &hkey, &initial_hist, 0);
-		histp = bpf_map_lookup_elem(&hists, &hkey);
-		if (!histp)
-			goto cleanup;
-	}
+	histp = hist_lookup_or_init(&hists, &hkey, &initial_hist);
+	if (!histp)
+		return 0;
 
 	if (targ_ms)
 		delta /= 1000000U;
 	else
 		delta /= 1000U;
-	slot = log2l(delta);
-	if (slot >= MAX_SLOTS)
-		slot = MAX_SLOTS - 1;
-	__sync_fetch_and_add(&histp->slots[slot], 1);
-
-cleanup:
-	bpf_map_delete_elem(&start, &rq);
+	hist_log2_inc(histp->slots, MAX_SLOTS, delta);
 	return 0;
 }
 
@@ -16,6 +16,7 @@
 #include "biolatency.h"
 #include "biolatency.skel.h"
 #include "trace_helpers.h"
+#include "hist_helpers.h"
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(*(x)))
 
@@ -28,6 +29,7 @@ static struct env {
 	bool per_disk;
 	bool per_flag;
 	bool milliseconds;
+	bool json;
 	bool verbose;
 	char *cgroupspath;
 	bool cg;
@@ -44,7 +46,7 @@ const char *argp_program_bug_address =
 const char argp_program_doc[] =
 "Summarize block device I/O latency as a histogram.\n"
 "\n"
-"USAGE: biolatency [--help] [-T] [-m] [-Q] [-D] [-F] [-d DISK] [-c CG] [interval] [count]\n"
+"USAGE: biolatency [--help] [-T] [-m] [-Q] [-D] [-F] [-j] [-d DISK] [-c CG] [interval] [count]\n"
 "\n"
 "EXAMPLES:\n"
 "    biolatency              # summarize block I/O latency as a histogram\n"
@@ -53,6 +55,7 @@ const char argp_program_doc[] =
 "    biolatency -Q           # include OS queued time in I/O time\n"
 "    biolatency -D           # show each disk device separately\n"
 "    biolatency -F           # show I/O flags separately\n"
+"    biolatency -DFj 1       # JSON line per disk and flags every second\n"
 "    biolatency -d sdc       # Trace sdc only\n"
 "    biolatency -c CG        # Trace process under cgroupsPath CG\n";
 
@@ -62,6 +65,7 @@ static const struct argp_option opts[] = {
 	{ "queued", 'Q', NULL, 0, "Include OS queued time in I/O time" },
 	{ "disk", 'D', NULL, 0, "Print a histogram per disk device" },
 	{ "flag", 'F', NULL, 0, "Print a histogram per set of I/O flags" },
+	{ "json", 'j', NULL, 0, "Print histograms as JSON lines with percentiles" },
 	{ "disk",  'd', "DISK",  0, "Trace this disk only" },
 	{ "verbose", 'v', NULL, 0, "Verbose debug output" },
 	{ "cgroup", 'c', "/sys/fs/cgroup/unified", 0, "Trace process in cgroup path"},
@@ -92,6 +96,9 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 	case 'F':
 		env.per_flag = true;
 		break;
+	case 'j':
+		env.json = true;
+		break;
 	case 'T':
 		env.timestamp = true;
 		break;
@@ -146,7 +153,7 @@ static void sig_handler(int sig)
 	exiting = true;
 }
 
-static void print_cmd_flags(int cmd_flags)
+static void format_cmd_flags(int cmd_flags, char *buf, size_t sz)
 {
 	static struct { int bit; const char *str; } flags[] = {
 		{ REQ_NOWAIT, "NoWait-" },
@@ -179,59 +186,99 @@ static void print_cmd_flags(int cmd_flags)
 		[REQ_OP_DRV_IN] = "DrvIn",
 		[REQ_OP_DRV_OUT] = "DrvOut",
 	};
-	int i;
-
-	printf("flags = ");
+	const char *op;
+	int i, n = 0;
 
+	buf[0] = '\0';
 	for (i = 0; i < ARRAY_SIZE(flags); i++) {
-		if (cmd_flags & flags[i].bit)
-			printf("%s", flags[i].str);
+		if (cmd_flags & flags[i].bit && n < sz)
+			n += snprintf(buf + n, sz - n, "%s", flags[i].str);
 	}
 
 	if ((cmd_flags & REQ_OP_MASK) < ARRAY_SIZE(ops))
-		printf("%s", ops[cmd_flags & REQ_OP_MASK]);
+		op = ops[cmd_flags & REQ_OP_MASK];
 	else
-		printf("Unknown");
+		op = NULL;
+	if (n < sz)
+		snprintf(buf + n, sz - n, "%s", op ?: "Unknown");
 }
 
 static
 int print_log2_hists(struct bpf_map *hists, struct partitions *partitions)
 {
-	struct hist_key lookup_key = { .cmd_flags = -1 }, next_key;
+	struct hist_key invalid_key = { .cmd_flags = -1 }, *key;
 	const char *units = env.milliseconds ? "msecs" : "usecs";
 	const struct partition *partition;
-	int err, fd = bpf_map__fd(hists);
-	struct hist hist;
-
-	while (!bpf_map_get_next_key(fd, &lookup_key, &next_key)) {
-		err = bpf_map_lookup_elem(fd, &next_key, &hist);
-		if (err < 0) {
-			fprintf(stderr, "failed to lookup hist: %d\n", err);
-			return -1;
-		}
+	int fd = bpf_map__fd(hists);
+	char flags[256], labels[384], ts[32];
+	struct hist_dump dump;
+	const char *disk;
+	struct hist *hist;
+	struct tm *tm;
+	time_t t;
+	__u32 i;
+	int n;
+
+	if (env.json && env.timestamp) {
+		time(&t);
+		tm = localtime(&t);
+		strftime(ts, sizeof(ts), "%H:%M:%S", tm);
+	}
+
+	/* all histograms are read together, in batches where supported */
+	if (hist_dump__read(&dump, fd, sizeof(struct hist_key),
+			    sizeof(struct hist), bpf_map__max_entries(hists),
+			    &invalid_key)) {
+		fprintf(stderr, "failed to read hists: %s\n", strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < dump.count; i++) {
+		key = hist_dump__key(&dump, i);
+		hist = hist_dump__value(&dump, i);
+		disk = NULL;
 		if (env.per_disk) {
-			partition = partitions__get_by_dev(partitions,
-							next_key.dev);
-			printf("\ndisk = %s\t", partition ? partition->name :
-				"Unknown");
+			partition = partitions__get_by_dev(partitions, key->dev);
+			disk = partition ? partition->name : "Unknown";
 		}
 		if (env.per_flag)
-			print_cmd_flags(next_key.cmd_flags);
+			format_cmd_flags(key->cmd_flags, flags, sizeof(flags));
+
+		if (env.json) {
+			n = 0;
+			labels[0] = '\0';
+			if (env.timestamp)
+				n = snprintf(labels, sizeof(labels),
+					     "\"time\":\"%s\"", ts);
+			if (disk && n < sizeof(labels))
+				n += snprintf(labels + n, sizeof(labels) - n,
+					      "%s\"disk\":\"%s\"", n ? "," : "",
+					      disk);
+			if (env.per_flag && n < sizeof(labels))
+				snprintf(labels + n, sizeof(labels) - n,
+					 "%s\"flags\":\"%s\"", n ? "," : "",
+					 flags);
+			print_log2_hist_json(hist->slots, MAX_SLOTS, units,
+					     labels);
+			continue;
+		}
+
+		if (disk)
+			printf("\ndisk = %s\t", disk);
+		if (env.per_flag)
+			printf("flags = %s", flags);
 		printf("\n");
-		print_log2_hist(hist.slots, MAX_SLOTS, units);
-		lookup_key = next_key;
+		print_log2_hist(hist->slots, MAX_SLOTS, units);
 	}
 
-	lookup_key.cmd_flags = -1;
-	while (!bpf_map_get_next_key(fd, &lookup_key, &next_key)) {
-		err = bpf_map_delete_elem(fd, &next_key);
-		if (err < 0) {
-			fprintf(stderr, "failed to cleanup hist : %d\n", err);
-			return -1;
-		}
-		lookup_key = next_key;
+	if (hist_dump__clear(&dump, fd)) {
+		fprintf(stderr, "failed to cleanup hist : %s\n",
+			strerror(errno));
+		hist_dump__free(&dump);
+		return -1;
 	}
 
+	hist_dump__free(&dump);
 	return 0;
 }
 
@@ -330,14 +377,16 @@ int main(int argc, char **argv)
 
 	signal(SIGINT, sig_handler);
 
-	printf("Tracing block device I/O... Hit Ctrl-C to end.\n");
+	if (!env.json)
+		printf("Tracing block device I/O... Hit Ctrl-C to end.\n");
 
 	/* main: poll */
 	while (1) {
 		sleep(env.interval);
-		printf("\n");
+		if (!env.json)
+			printf("\n");
 
-		if (env.timestamp) {
+		if (env.timestamp && !env.json) {
 			time(&t);
 			tm = localtime(&t);
 			strftime(ts, sizeof(ts), "%H:%M:%S", tm);
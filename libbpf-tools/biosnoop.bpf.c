@@ -4,6 +4,7 @@
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_core_read.h>
 #include <bpf/bpf_tracing.h>
+#include "compat.bpf.h"
 #include "biosnoop.h"
 
 #define MAX_ENTRIES	10240
@@ -47,12 +48,6 @@ struct {
 	__type(value, struct stage);
 } start SEC(".maps");
 
-struct {
-	__uint(type, BPF_MAP_TYPE_PERF_EVENT_ARRAY);
-	__uint(key_size, sizeof(u32));
-	__uint(value_size, sizeof(u32));
-} events SEC(".maps");
-
 static __always_inline
 int trace_pid(struct request *rq)
 {
@@ -181,8 +176,7 @@ int BPF_PROG(block_rq_complete, struct request *rq, int error,
 	event.len = rq->__data_len;
 	event.cmd_flags = rq->cmd_flags;
 	event.dev = stagep->dev;
-	bpf_perf_event_output(ctx, &events, BPF_F_CURRENT_CPU, &event,
-			sizeof(event));
+	submit_buf(ctx, &event, sizeof(event));
 
 cleanup:
 	bpf_map_delete_elem(&start, &rq);
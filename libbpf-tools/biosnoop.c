@@ -16,9 +16,9 @@
 #include "biosnoop.h"
 #include "biosnoop.skel.h"
 #include "trace_helpers.h"
+#include "compat.h"
 
-#define PERF_BUFFER_PAGES	16
-#define PERF_POLL_TIMEOUT_MS	100
+#define EVENT_QUEUE_SLOTS	8192
 
 static volatile sig_atomic_t exiting = 0;
 
@@ -158,7 +158,7 @@ static void blk_fill_rwbs(char *rwbs, unsigned int op)
 
 static struct partitions *partitions;
 
-void handle_event(void *ctx, int cpu, void *data, __u32 data_sz)
+static int handle_event(void *ctx, void *data, size_t data_sz)
 {
 	const struct partition *partition;
 	const struct event *e = data;
@@ -176,11 +176,7 @@ void handle_event(void *ctx, int cpu, void *data, __u32 data_sz)
 		printf("%7.3f ", e->qdelta != -1 ?
 			e->qdelta / 1000000.0 : -1);
 	printf("%7.3f\n", e->delta / 1000000.0);
-}
-
-void handle_lost_events(void *ctx, int cpu, __u64 lost_cnt)
-{
-	fprintf(stderr, "lost %llu events on CPU #%d\n", lost_cnt, cpu);
+	return 0;
 }
 
 int main(int argc, char **argv)
@@ -191,7 +187,7 @@ int main(int argc, char **argv)
 		.parser = parse_arg,
 		.doc = argp_program_doc,
 	};
-	struct perf_buffer *pb = NULL;
+	struct bpf_buffer *buf = NULL;
 	struct ksyms *ksyms = NULL;
 	struct biosnoop_bpf *obj;
 	__u64 time_end = 0;
@@ -229,6 +225,19 @@ int main(int argc, char **argv)
 	obj->rodata->targ_queued = env.queued;
 	obj->rodata->filter_cg = env.cg;
 
+	buf = bpf_buffer__new(obj->maps.events, obj->maps.events_lost);
+	if (!buf) {
+		err = -errno;
+		fprintf(stderr, "failed to create ring/perf buffer: %d\n", err);
+		goto cleanup;
+	}
+
+	err = bpf_buffer__set_async(buf, EVENT_QUEUE_SLOTS, sizeof(struct event));
+	if (err) {
+		fprintf(stderr, "failed to set up event queue: %d\n", err);
+		goto cleanup;
+	}
+
 	err = biosnoop_bpf__load(obj);
 	if (err) {
 		fprintf(stderr, "failed to load BPF object: %d\n", err);
@@ -295,20 +304,19 @@ int main(int argc, char **argv)
 		goto cleanup;
 	}
 
-	pb = perf_buffer__new(bpf_map__fd(obj->maps.events), PERF_BUFFER_PAGES,
-			      handle_event, handle_lost_events, NULL, NULL);
-	if (!pb) {
-		err = -errno;
-		fprintf(stderr, "failed to open perf buffer: %d\n", err);
-		goto cleanup;
-	}
-
 	printf("%-11s %-14s %-6s %-7s %-4s %-10s %-7s ",
 		"TIME(s)", "COMM", "PID", "DISK", "T", "SECTOR", "BYTES");
 	if (env.queued)
 		printf("%7s ", "QUE(ms)");
 	printf("%7s\n", "LAT(ms)");
 
+	/* after the headers, events are printed by a thread of their own */
+	err = bpf_buffer__open(buf, handle_event, NULL);
+	if (err) {
+		fprintf(stderr, "failed to open ring/perf buffer: %d\n", err);
+		goto cleanup;
+	}
+
 	/* setup duration */
 	if (env.duration)
 		time_end = get_ktime_ns() + env.duration * NSEC_PER_SEC;
@@ -321,9 +329,9 @@ int main(int argc, char **argv)
 
 	/* main: poll */
 	while (!exiting) {
-		err = perf_buffer__poll(pb, PERF_POLL_TIMEOUT_MS);
+		err = bpf_buffer__poll(buf, POLL_TIMEOUT_MS);
 		if (err < 0 && err != -EINTR) {
-			fprintf(stderr, "error polling perf buffer: %s\n", strerror(-err));
+			fprintf(stderr, "error polling ring/perf buffer: %s\n", strerror(-err));
 			goto cleanup;
 		}
 		if (env.duration && get_ktime_ns() > time_end)
@@ -333,7 +341,8 @@ int main(int argc, char **argv)
 	}
 
 cleanup:
-	perf_buffer__free(pb);
+	bpf_buffer__print_stats(buf);
+	bpf_buffer__free(buf);
 	biosnoop_bpf__destroy(obj);
 	ksyms__free(ksyms);
 	partitions__free(partitions);
@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause) */
+#ifndef __COMPAT_BPF_H
+#define __COMPAT_BPF_H
+
+#include <vmlinux.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+
+/*
+ * Becomes a ring buffer in bpf_buffer__new() on kernels that have them,
+ * it's declared as a perf buffer because the vmlinux.h of older kernels
+ * doesn't know BPF_MAP_TYPE_RINGBUF.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERF_EVENT_ARRAY);
+	__uint(key_size, sizeof(u32));
+	__uint(value_size, sizeof(u32));
+} events SEC(".maps");
+
+/* events that did not fit in the ring buffer, perf buffers count them */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__type(value, u64);
+} events_lost SEC(".maps");
+
+/* CO-RE matches it to struct bpf_ringbuf by name, which is enough */
+struct bpf_ringbuf___compat {
+	int dummy;
+};
+
+static __always_inline long submit_buf(void *ctx, void *data, __u64 size)
+{
+	u32 zero = 0;
+	u64 *lost;
+	long err;
+
+	if (!bpf_core_type_exists(struct bpf_ringbuf___compat))
+		return bpf_perf_event_output(ctx, &events, BPF_F_CURRENT_CPU,
+					     data, size);
+
+	err = bpf_ringbuf_output(&events, data, size, 0);
+	if (err) {
+		lost = bpf_map_lookup_elem(&events_lost, &zero);
+		if (lost)
+			*lost += 1;
+	}
+	return err;
+}
+
+#endif /* __COMPAT_BPF_H */
@@ -0,0 +1,388 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+#include <bpf/btf.h>
+#include "compat.h"
+#include "map_helpers.h"
+#include "trace_helpers.h"
+
+#define PERF_BUFFER_PAGES	64
+#define RINGBUF_SIZE		(1024 * 1024)
+
+#define CACHE_LINE_SIZE		64
+
+enum {
+	BPF_BUF_RINGBUF,
+	BPF_BUF_PERFBUF,
+};
+
+/*
+ * Single producer, single consumer queue between the thread polling the
+ * buffer and the thread handling the events. head and tail only grow, the
+ * queue is full when they are nr_slots apart.
+ */
+struct event_queue {
+	size_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+	size_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+	char *slots __attribute__((aligned(CACHE_LINE_SIZE)));
+	size_t nr_slots;
+	size_t slot_size;
+	size_t stride;
+	/* counts the wakeups of the consumer */
+	int efd;
+	bool stop;
+	bool started;
+	pthread_t thread;
+};
+
+struct bpf_buffer {
+	struct bpf_map *events;
+	struct bpf_map *events_lost;
+	void *inner;
+	bpf_buffer_sample_fn fn;
+	void *ctx;
+	int type;
+	struct event_queue *queue;
+	/* events queued since the consumer was last woken up */
+	size_t queued;
+	__u64 nr_events;
+	__u64 nr_lost;
+	__u64 nr_dropped;
+};
+
+/*
+ * Ring buffers came with struct bpf_ringbuf in 5.8, compat.bpf.h makes the
+ * same check to pick the helper.
+ */
+static bool ringbuf_exists(void)
+{
+	struct btf *btf;
+	int id;
+
+	btf = vmlinux_btf__get();
+	if (!btf)
+		return false;
+	id = btf__find_by_name_kind(btf, "bpf_ringbuf", BTF_KIND_STRUCT);
+	vmlinux_btf__put();
+	return id > 0;
+}
+
+static bool queue_push(struct event_queue *q, const void *data, size_t size)
+{
+	size_t head = q->head;
+	char *slot;
+
+	if (size > q->slot_size)
+		return false;
+	if (head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == q->nr_slots)
+		return false;
+
+	slot = q->slots + (head & (q->nr_slots - 1)) * q->stride;
+	memcpy(slot, &size, sizeof(size));
+	memcpy(slot + sizeof(size), data, size);
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static void queue_wakeup(struct event_queue *q)
+{
+	__u64 one = 1;
+
+	if (write(q->efd, &one, sizeof(one)) < 0)
+		fprintf(stderr, "failed to wake up event thread: %s\n",
+			strerror(errno));
+}
+
+static void queue_drain(struct bpf_buffer *buffer)
+{
+	struct event_queue *q = buffer->queue;
+	size_t tail = q->tail, head;
+	size_t size;
+	char *slot;
+
+	head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	for (; tail != head; tail++) {
+		slot = q->slots + (tail & (q->nr_slots - 1)) * q->stride;
+		memcpy(&size, slot, sizeof(size));
+		buffer->fn(buffer->ctx, slot + sizeof(size), size);
+		__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&buffer->nr_events, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void *queue_thread(void *arg)
+{
+	struct bpf_buffer *buffer = arg;
+	struct event_queue *q = buffer->queue;
+	__u64 cnt;
+	bool stop;
+
+	for (;;) {
+		/* whatever was queued before stop is still handled */
+		stop = __atomic_load_n(&q->stop, __ATOMIC_ACQUIRE);
+		queue_drain(buffer);
+		fflush(stdout);
+		if (stop)
+			break;
+		if (read(q->efd, &cnt, sizeof(cnt)) < 0 && errno != EINTR) {
+			fprintf(stderr, "failed to wait for events: %s\n",
+				strerror(errno));
+			break;
+		}
+	}
+	return NULL;
+}
+
+static void queue_free(struct event_queue *q)
+{
+	if (!q)
+		return;
+
+	if (q->started) {
+		__atomic_store_n(&q->stop, true, __ATOMIC_RELEASE);
+		queue_wakeup(q);
+		pthread_join(q->thread, NULL);
+	}
+	if (q->efd >= 0)
+		close(q->efd);
+	free(q->slots);
+	free(q);
+}
+
+static int handle_event(struct bpf_buffer *buffer, void *data, size_t size)
+{
+	if (!buffer->queue) {
+		buffer->nr_events++;
+		return buffer->fn(buffer->ctx, data, size);
+	}
+
+	if (!queue_push(buffer->queue, data, size))
+		buffer->nr_dropped++;
+	else
+		buffer->queued++;
+	return 0;
+}
+
+static void perfbuf_sample_fn(void *ctx, int cpu, void *data, __u32 size)
+{
+	handle_event(ctx, data, size);
+}
+
+static void perfbuf_lost_fn(void *ctx, int cpu, __u64 cnt)
+{
+	struct bpf_buffer *buffer = ctx;
+
+	buffer->nr_lost += cnt;
+}
+
+static int ringbuf_sample_fn(void *ctx, void *data, size_t size)
+{
+	return handle_event(ctx, data, size);
+}
+
+struct bpf_buffer *bpf_buffer__new(struct bpf_map *events,
+				   struct bpf_map *events_lost)
+{
+	struct bpf_buffer *buffer;
+	int type, err;
+
+	if (ringbuf_exists()) {
+		type = BPF_BUF_RINGBUF;
+		err = bpf_map__set_type(events, BPF_MAP_TYPE_RINGBUF);
+		if (!err)
+			err = bpf_map__set_key_size(events, 0);
+		if (!err)
+			err = bpf_map__set_value_size(events, 0);
+		if (!err)
+			err = bpf_map__set_max_entries(events, RINGBUF_SIZE);
+		if (err) {
+			errno = -err;
+			return NULL;
+		}
+	} else {
+		type = BPF_BUF_PERFBUF;
+	}
+
+	buffer = calloc(1, sizeof(*buffer));
+	if (!buffer) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	buffer->events = events;
+	buffer->events_lost = events_lost;
+	buffer->type = type;
+	return buffer;
+}
+
+int bpf_buffer__set_async(struct bpf_buffer *buffer, size_t nr_slots,
+			  size_t slot_size)
+{
+	struct event_queue *q;
+	size_t nr = 1;
+
+	if (buffer->inner || buffer->queue || !nr_slots)
+		return -EINVAL;
+
+	while (nr < nr_slots)
+		nr <<= 1;
+
+	q = calloc(1, sizeof(*q));
+	if (!q)
+		return -ENOMEM;
+	q->nr_slots = nr;
+	q->slot_size = slot_size;
+	q->stride = (sizeof(size_t) + slot_size + 7) & ~(size_t)7;
+	q->slots = calloc(nr, q->stride);
+	q->efd = eventfd(0, EFD_CLOEXEC);
+	if (!q->slots || q->efd < 0) {
+		queue_free(q);
+		return -ENOMEM;
+	}
+
+	buffer->queue = q;
+	return 0;
+}
+
+int bpf_buffer__open(struct bpf_buffer *buffer, bpf_buffer_sample_fn sample_cb,
+		     void *ctx)
+{
+	int fd, err;
+
+	fd = bpf_map__fd(buffer->events);
+	buffer->fn = sample_cb;
+	buffer->ctx = ctx;
+
+	switch (buffer->type) {
+	case BPF_BUF_RINGBUF:
+		buffer->inner = ring_buffer__new(fd, ringbuf_sample_fn, buffer,
+						 NULL);
+		break;
+	case BPF_BUF_PERFBUF:
+		buffer->inner = perf_buffer__new(fd, PERF_BUFFER_PAGES,
+						 perfbuf_sample_fn,
+						 perfbuf_lost_fn, buffer, NULL);
+		break;
+	}
+	if (!buffer->inner)
+		return -errno;
+
+	if (buffer->queue) {
+		err = pthread_create(&buffer->queue->thread, NULL,
+				     queue_thread, buffer);
+		if (err)
+			return -err;
+		buffer->queue->started = true;
+	}
+	return 0;
+}
+
+/* one wakeup for all the events of a poll */
+static void bpf_buffer__wakeup(struct bpf_buffer *buffer)
+{
+	if (buffer->queued) {
+		queue_wakeup(buffer->queue);
+		buffer->queued = 0;
+	}
+}
+
+int bpf_buffer__poll(struct bpf_buffer *buffer, int timeout_ms)
+{
+	int err = -EINVAL;
+
+	switch (buffer->type) {
+	case BPF_BUF_RINGBUF:
+		err = ring_buffer__poll(buffer->inner, timeout_ms);
+		break;
+	case BPF_BUF_PERFBUF:
+		err = perf_buffer__poll(buffer->inner, timeout_ms);
+		break;
+	}
+
+	bpf_buffer__wakeup(buffer);
+	return err;
+}
+
+int bpf_buffer__epoll_fd(const struct bpf_buffer *buffer)
+{
+	switch (buffer->type) {
+	case BPF_BUF_RINGBUF:
+		return ring_buffer__epoll_fd(buffer->inner);
+	case BPF_BUF_PERFBUF:
+		return perf_buffer__epoll_fd(buffer->inner);
+	}
+	return -EINVAL;
+}
+
+int bpf_buffer__consume(struct bpf_buffer *buffer)
+{
+	int err = -EINVAL;
+
+	switch (buffer->type) {
+	case BPF_BUF_RINGBUF:
+		err = ring_buffer__consume(buffer->inner);
+		break;
+	case BPF_BUF_PERFBUF:
+		err = perf_buffer__consume(buffer->inner);
+		break;
+	}
+
+	bpf_buffer__wakeup(buffer);
+	return err;
+}
+
+int bpf_buffer__stats(const struct bpf_buffer *buffer,
+		      struct bpf_buffer_stats *stats)
+{
+	__u32 zero = 0;
+	__u64 lost = 0;
+
+	if (buffer->type == BPF_BUF_RINGBUF && buffer->events_lost &&
+	    lookup_percpu(bpf_map__fd(buffer->events_lost), &zero, &lost,
+			  sizeof(lost), percpu_sum_u64))
+		return -errno;
+
+	stats->events = __atomic_load_n(&buffer->nr_events, __ATOMIC_RELAXED);
+	stats->lost = buffer->nr_lost + lost;
+	stats->dropped = buffer->nr_dropped;
+	return 0;
+}
+
+void bpf_buffer__print_stats(const struct bpf_buffer *buffer)
+{
+	struct bpf_buffer_stats stats;
+
+	if (!buffer || bpf_buffer__stats(buffer, &stats))
+		return;
+	if (stats.lost)
+		fprintf(stderr, "Lost %llu events in the kernel buffer\n",
+			stats.lost);
+	if (stats.dropped)
+		fprintf(stderr, "Dropped %llu events, handling them was too slow\n",
+			stats.dropped);
+}
+
+void bpf_buffer__free(struct bpf_buffer *buffer)
+{
+	if (!buffer)
+		return;
+
+	queue_free(buffer->queue);
+	switch (buffer->type) {
+	case BPF_BUF_RINGBUF:
+		ring_buffer__free(buffer->inner);
+		break;
+	case BPF_BUF_PERFBUF:
+		perf_buffer__free(buffer->inner);
+		break;
+	}
+	free(buffer);
+}
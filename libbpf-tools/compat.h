@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause) */
+#ifndef __COMPAT_H
+#define __COMPAT_H
+
+#include <stddef.h>
+#include <linux/types.h>
+
+#define POLL_TIMEOUT_MS		100
+
+struct bpf_buffer;
+struct bpf_map;
+
+typedef int (*bpf_buffer_sample_fn)(void *ctx, void *data, size_t size);
+
+struct bpf_buffer_stats {
+	__u64 events;	/* handed to sample_cb */
+	__u64 lost;	/* did not fit in the kernel buffer */
+	__u64 dropped;	/* did not fit in the queue of an async buffer */
+};
+
+/*
+ * Event buffer of the tools including compat.bpf.h: a BPF ring buffer on
+ * kernels that have one, a perf buffer on the others. Create it from the
+ * events and events_lost maps of the skeleton before loading it, as this
+ * may change the type of events, and open it after loading.
+ */
+struct bpf_buffer *bpf_buffer__new(struct bpf_map *events,
+				   struct bpf_map *events_lost);
+
+/*
+ * Hand events to sample_cb in a thread of its own instead of the thread
+ * calling bpf_buffer__poll(), so slow formatting of events does not make
+ * the kernel drop them. Events are copied into a queue of nr_slots events
+ * of up to slot_size bytes, and stdout is flushed whenever the queue has
+ * been drained. Must be called before bpf_buffer__open().
+ */
+int bpf_buffer__set_async(struct bpf_buffer *buffer, size_t nr_slots,
+			  size_t slot_size);
+
+int bpf_buffer__open(struct bpf_buffer *buffer, bpf_buffer_sample_fn sample_cb,
+		     void *ctx);
+int bpf_buffer__poll(struct bpf_buffer *buffer, int timeout_ms);
+/*
+ * For a process running several skeletons with a single epoll loop: add
+ * the epoll fd of each buffer to it, and consume a buffer when its fd is
+ * readable.
+ */
+int bpf_buffer__epoll_fd(const struct bpf_buffer *buffer);
+int bpf_buffer__consume(struct bpf_buffer *buffer);
+int bpf_buffer__stats(const struct bpf_buffer *buffer,
+		      struct bpf_buffer_stats *stats);
+/* print the number of lost and dropped events to stderr, if any */
+void bpf_buffer__print_stats(const struct bpf_buffer *buffer);
+/* handles the events still queued before returning */
+void bpf_buffer__free(struct bpf_buffer *buffer);
+
+#endif /* __COMPAT_H */
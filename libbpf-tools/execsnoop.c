@@ -13,11 +13,14 @@
 #include "execsnoop.h"
 #include "execsnoop.skel.h"
 #include "trace_helpers.h"
+#include "compat.h"
+#include "record_helpers.h"
 
-#define PERF_BUFFER_PAGES   64
-#define PERF_POLL_TIMEOUT_MS	100
+/* events are big, keep the queue to the handling thread at about 8MB */
+#define EVENT_QUEUE_SLOTS	1024
 #define NSEC_PRECISION (NSEC_PER_SEC / 1000)
 #define MAX_ARGS_KEY 259
+#define OUTPUT_KEY 260
 
 static volatile sig_atomic_t exiting = 0;
 
@@ -32,6 +35,7 @@ static struct env {
 	bool print_uid;
 	bool verbose;
 	int max_args;
+	int output;
 } env = {
 	.max_args = DEFAULT_MAXARGS,
 	.uid = INVALID_UID
@@ -39,6 +43,20 @@ static struct env {
 
 static struct timespec start_time;
 
+static struct record_writer *writer;
+
+static const struct record_field record_fields[] = {
+	RECORD_FIELD(struct event, pid, RECORD_FIELD_INT),
+	RECORD_FIELD(struct event, ppid, RECORD_FIELD_INT),
+	RECORD_FIELD(struct event, uid, RECORD_FIELD_UINT),
+	RECORD_FIELD(struct event, retval, RECORD_FIELD_INT),
+	RECORD_FIELD(struct event, args_count, RECORD_FIELD_INT),
+	RECORD_FIELD(struct event, args_size, RECORD_FIELD_UINT),
+	RECORD_FIELD(struct event, comm, RECORD_FIELD_STR),
+	/* NUL separated, args_size bytes long */
+	RECORD_FIELD(struct event, args, RECORD_FIELD_BYTES),
+};
+
 const char *argp_program_version = "execsnoop 0.1";
 const char *argp_program_bug_address =
 	"https://github.com/iovisor/bcc/tree/master/libbpf-tools";
@@ -46,7 +64,7 @@ const char argp_program_doc[] =
 "Trace exec syscalls\n"
 "\n"
 "USAGE: execsnoop [-h] [-T] [-t] [-x] [-u UID] [-q] [-n NAME] [-l LINE] [-U]\n"
-"                 [--max-args MAX_ARGS]\n"
+"                 [--max-args MAX_ARGS] [--output FORMAT]\n"
 "\n"
 "EXAMPLES:\n"
 "   ./execsnoop           # trace all exec() syscalls\n"
@@ -57,7 +75,8 @@ const char argp_program_doc[] =
 "   ./execsnoop -t        # include timestamps\n"
 "   ./execsnoop -q        # add \"quotemarks\" around arguments\n"
 "   ./execsnoop -n main   # only print command lines containing \"main\"\n"
-"   ./execsnoop -l tpkg   # only print command where arguments contains \"tpkg\"";
+"   ./execsnoop -l tpkg   # only print command where arguments contains \"tpkg\"\n"
+"   ./execsnoop --output binary-gz   # write compressed binary records";
 
 static const struct argp_option opts[] = {
 	{ "time", 'T', NULL, 0, "include time column on output (HH:MM:SS)" },
@@ -70,6 +89,7 @@ static const struct argp_option opts[] = {
 	{ "print-uid", 'U', NULL, 0, "print UID column" },
 	{ "max-args", MAX_ARGS_KEY, "MAX_ARGS", 0,
 		"maximum number of arguments parsed and displayed, defaults to 20" },
+	{ "output", OUTPUT_KEY, "FORMAT", 0, OUTPUT_FORMAT_HELP },
 	{ "verbose", 'v', NULL, 0, "Verbose debug output" },
 	{ NULL, 'h', NULL, OPTION_HIDDEN, "Show the full help" },
 	{},
@@ -127,6 +147,13 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 		}
 		env.max_args = max_args;
 		break;
+	case OUTPUT_KEY:
+		env.output = output_format__parse(arg);
+		if (env.output < 0) {
+			fprintf(stderr, "Invalid output format %s\n", arg);
+			argp_usage(state);
+		}
+		break;
 	default:
 		return ARGP_ERR_UNKNOWN;
 	}
@@ -218,7 +245,7 @@ static void print_args(const struct event *e, bool quote)
 	}
 }
 
-static void handle_event(void *ctx, int cpu, void *data, __u32 data_sz)
+static int handle_event(void *ctx, void *data, size_t data_sz)
 {
 	const struct event *e = data;
 	time_t t;
@@ -227,11 +254,16 @@ static void handle_event(void *ctx, int cpu, void *data, __u32 data_sz)
 
 	/* TODO: use pcre lib */
 	if (env.name && strstr(e->comm, env.name) == NULL)
-		return;
+		return 0;
 
 	/* TODO: use pcre lib */
 	if (env.line && strstr(e->comm, env.line) == NULL)
-		return;
+		return 0;
+
+	if (writer) {
+		record_writer__write(writer, data, data_sz);
+		return 0;
+	}
 
 	time(&t);
 	tm = localtime(&t);
@@ -250,11 +282,7 @@ static void handle_event(void *ctx, int cpu, void *data, __u32 data_sz)
 	printf("%-16s %-6d %-6d %3d ", e->comm, e->pid, e->ppid, e->retval);
 	print_args(e, env.quote);
 	putchar('\n');
-}
-
-static void handle_lost_events(void *ctx, int cpu, __u64 lost_cnt)
-{
-	fprintf(stderr, "Lost %llu events on CPU #%d!\n", lost_cnt, cpu);
+	return 0;
 }
 
 int main(int argc, char **argv)
@@ -264,7 +292,7 @@ int main(int argc, char **argv)
 		.parser = parse_arg,
 		.doc = argp_program_doc,
 	};
-	struct perf_buffer *pb = NULL;
+	struct bpf_buffer *buf = NULL;
 	struct execsnoop_bpf *obj;
 	int err;
 
@@ -286,6 +314,33 @@ int main(int argc, char **argv)
 	obj->rodata->targ_uid = env.uid;
 	obj->rodata->max_args = env.max_args;
 
+	buf = bpf_buffer__new(obj->maps.events, obj->maps.events_lost);
+	if (!buf) {
+		err = -errno;
+		fprintf(stderr, "failed to create ring/perf buffer: %d\n", err);
+		goto cleanup;
+	}
+
+	/* binary records are written straight out of the buffer */
+	if (env.output != OUTPUT_TEXT) {
+		writer = record_writer__new(STDOUT_FILENO, "execsnoop",
+					    record_fields,
+					    RECORD_NR_FIELDS(record_fields),
+					    env.output == OUTPUT_BINARY_GZ);
+		if (!writer) {
+			err = -errno;
+			fprintf(stderr, "failed to set up binary output: %d\n", err);
+			goto cleanup;
+		}
+	} else {
+		err = bpf_buffer__set_async(buf, EVENT_QUEUE_SLOTS,
+					    sizeof(struct event));
+		if (err) {
+			fprintf(stderr, "failed to set up event queue: %d\n", err);
+			goto cleanup;
+		}
+	}
+
 	err = execsnoop_bpf__load(obj);
 	if (err) {
 		fprintf(stderr, "failed to load BPF object: %d\n", err);
@@ -299,24 +354,24 @@ int main(int argc, char **argv)
 		goto cleanup;
 	}
 	/* print headers */
-	if (env.time) {
-		printf("%-9s", "TIME");
-	}
-	if (env.timestamp) {
-		printf("%-8s ", "TIME(s)");
-	}
-	if (env.print_uid) {
-		printf("%-6s ", "UID");
-	}
+	if (env.output == OUTPUT_TEXT) {
+		if (env.time) {
+			printf("%-9s", "TIME");
+		}
+		if (env.timestamp) {
+			printf("%-8s ", "TIME(s)");
+		}
+		if (env.print_uid) {
+			printf("%-6s ", "UID");
+		}
 
-	printf("%-16s %-6s %-6s %3s %s\n", "PCOMM", "PID", "PPID", "RET", "ARGS");
+		printf("%-16s %-6s %-6s %3s %s\n", "PCOMM", "PID", "PPID", "RET", "ARGS");
+	}
 
 	/* setup event callbacks */
-	pb = perf_buffer__new(bpf_map__fd(obj->maps.events), PERF_BUFFER_PAGES,
-			      handle_event, handle_lost_events, NULL, NULL);
-	if (!pb) {
-		err = -errno;
-		fprintf(stderr, "failed to open perf buffer: %d\n", err);
+	err = bpf_buffer__open(buf, handle_event, NULL);
+	if (err) {
+		fprintf(stderr, "failed to open ring/perf buffer: %d\n", err);
 		goto cleanup;
 	}
 
@@ -328,17 +383,21 @@ int main(int argc, char **argv)
 
 	/* main: poll */
 	while (!exiting) {
-		err = perf_buffer__poll(pb, PERF_POLL_TIMEOUT_MS);
+		err = bpf_buffer__poll(buf, POLL_TIMEOUT_MS);
 		if (err < 0 && err != -EINTR) {
-			fprintf(stderr, "error polling perf buffer: %s\n", strerror(-err));
+			fprintf(stderr, "error polling ring/perf buffer: %s\n", strerror(-err));
 			goto cleanup;
 		}
+		if (writer)
+			record_writer__flush(writer);
 		/* reset err to return 0 if exiting */
 		err = 0;
 	}
 
 cleanup:
-	perf_buffer__free(pb);
+	bpf_buffer__print_stats(buf);
+	bpf_buffer__free(buf);
+	record_writer__free(writer);
 	execsnoop_bpf__destroy(obj);
 
 	return err != 0;
@@ -231,6 +231,8 @@ static bool check_fentry()
 	const char *fn_name, *module;
 	bool support_fentry = true;
 
+	/* parse vmlinux BTF once for all the functions */
+	vmlinux_btf__get();
 	for (i = 0; i < MAX_OP; i++) {
 		fn_name = fs_configs[fs_type].op_funcs[i];
 		module = fs_configs[fs_type].fs;
@@ -239,6 +241,7 @@ static bool check_fentry()
 			break;
 		}
 	}
+	vmlinux_btf__put();
 	return support_fentry;
 }
 
@@ -15,6 +15,7 @@
 #include "hardirqs.h"
 #include "hardirqs.skel.h"
 #include "trace_helpers.h"
+#include "map_helpers.h"
 
 struct env {
 	bool count;
@@ -24,6 +25,7 @@ struct env {
 	int times;
 	bool timestamp;
 	bool verbose;
+	bool percpu;
 } env = {
 	.interval = 99999999,
 	.times = 99999999,
@@ -37,7 +39,7 @@ const char *argp_program_bug_address =
 const char argp_program_doc[] =
 "Summarize hard irq event time as histograms.\n"
 "\n"
-"USAGE: hardirqs [--help] [-T] [-N] [-d] [interval] [count]\n"
+"USAGE: hardirqs [--help] [-T] [-N] [-d] [--percpu] [interval] [count]\n"
 "\n"
 "EXAMPLES:\n"
 "    hardirqs            # sum hard irq event time\n"
@@ -45,11 +47,15 @@ const char argp_program_doc[] =
 "    hardirqs 1 10       # print 1 second summaries, 10 times\n"
 "    hardirqs -NT 1      # 1s summaries, nanoseconds, and timestamps\n";
 
+#define OPT_PERCPU	1 /* --percpu */
+
 static const struct argp_option opts[] = {
 	{ "count", 'C', NULL, 0, "Show event counts instead of timing" },
 	{ "distributed", 'd', NULL, 0, "Show distributions as histograms" },
 	{ "timestamp", 'T', NULL, 0, "Include timestamp on output" },
 	{ "nanoseconds", 'N', NULL, 0, "Output in nanoseconds" },
+	{ "percpu", OPT_PERCPU, NULL, 0,
+	  "Count in per-CPU maps, avoids contention on machines with many CPUs" },
 	{ "verbose", 'v', NULL, 0, "Verbose debug output" },
 	{ NULL, 'h', NULL, OPTION_HIDDEN, "Show the full help" },
 	{},
@@ -78,6 +84,9 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 	case 'T':
 		env.timestamp = true;
 		break;
+	case OPT_PERCPU:
+		env.percpu = true;
+		break;
 	case ARGP_KEY_ARG:
 		errno = 0;
 		if (pos_args == 0) {
@@ -118,6 +127,17 @@ static void sig_handler(int sig)
 	exiting = true;
 }
 
+static void info_sum(void *sum, const void *value, __u32 value_size)
+{
+	const struct info *v = value;
+	struct info *s = sum;
+	int i;
+
+	s->count += v->count;
+	for (i = 0; i < MAX_SLOTS; i++)
+		s->slots[i] += v->slots[i];
+}
+
 static int print_map(struct bpf_map *map)
 {
 	struct irq_key lookup_key = {}, next_key;
@@ -134,7 +154,11 @@ static int print_map(struct bpf_map *map)
 
 	fd = bpf_map__fd(map);
 	while (!bpf_map_get_next_key(fd, &lookup_key, &next_key)) {
-		err = bpf_map_lookup_elem(fd, &next_key, &info);
+		if (env.percpu)
+			err = lookup_percpu(fd, &next_key, &info, sizeof(info),
+					    info_sum);
+		else
+			err = bpf_map_lookup_elem(fd, &next_key, &info);
 		if (err < 0) {
 			fprintf(stderr, "failed to lookup infos: %d\n", err);
 			return -1;
@@ -195,6 +219,19 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	/*
+	 * The handlers update infos in place, a per-CPU hash makes that safe
+	 * when several CPUs take the same irq without any atomics.
+	 */
+	if (env.percpu) {
+		err = bpf_map__set_type(obj->maps.infos,
+					BPF_MAP_TYPE_PERCPU_HASH);
+		if (err) {
+			fprintf(stderr, "failed to set infos map type: %d\n", err);
+			goto cleanup;
+		}
+	}
+
 	/* initialize global data (filtering options) */
 	if (!env.count) {
 		obj->rodata->targ_dist = env.distributed;
@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause) */
+#ifndef __HIST_BPF_H
+#define __HIST_BPF_H
+
+#include "bits.bpf.h"
+#include "maps.bpf.h"
+
+/*
+ * Helpers for histograms kept as the values of a hash map, keyed by
+ * whatever dimensions a tool breaks its histograms down by. User space
+ * reads all of them at once with hist_dump__read() from hist_helpers.h.
+ */
+
+/* count val in the log2 histogram slots[0..max_slots) */
+static __always_inline void hist_log2_inc(__u32 *slots, __u32 max_slots,
+					  u64 val)
+{
+	u64 slot = log2l(val);
+
+	if (slot >= max_slots)
+		slot = max_slots - 1;
+	__sync_fetch_and_add(&slots[slot], 1);
+}
+
+/* count val in the histogram of max_slots slots of step from base */
+static __always_inline void hist_linear_inc(__u32 *slots, __u32 max_slots,
+					    u64 val, u64 base, u64 step)
+{
+	u64 slot;
+
+	slot = val > base ? (val - base) / step : 0;
+	if (slot >= max_slots)
+		slot = max_slots - 1;
+	__sync_fetch_and_add(&slots[slot], 1);
+}
+
+/* find the histogram of key in map, adding the empty histogram init */
+static __always_inline void *hist_lookup_or_init(void *map, const void *key,
+						 const void *init)
+{
+	return bpf_map_lookup_or_try_init(map, key, init);
+}
+
+#endif /* __HIST_BPF_H */
@@ -0,0 +1,175 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <bpf/bpf.h>
+
+#include "hist_helpers.h"
+#include "map_helpers.h"
+
+#ifndef ENOTSUPP
+#define ENOTSUPP	524
+#endif
+
+static bool batch_delete = true; /* hope for the best */
+
+int hist_dump__read(struct hist_dump *dump, int map_fd, __u32 key_size,
+		    __u32 value_size, __u32 max_entries, void *invalid_key)
+{
+	memset(dump, 0, sizeof(*dump));
+	dump->key_size = key_size;
+	dump->value_size = value_size;
+	dump->keys = calloc(max_entries, key_size);
+	dump->values = calloc(max_entries, value_size);
+	if (!dump->keys || !dump->values) {
+		hist_dump__free(dump);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	dump->count = max_entries;
+	if (dump_hash(map_fd, dump->keys, key_size, dump->values, value_size,
+		      &dump->count, invalid_key)) {
+		hist_dump__free(dump);
+		return -1;
+	}
+	return 0;
+}
+
+int hist_dump__clear(const struct hist_dump *dump, int map_fd)
+{
+	__u32 i, count = dump->count;
+
+	if (!count)
+		return 0;
+
+	if (batch_delete) {
+		if (!bpf_map_delete_batch(map_fd, dump->keys, &count, NULL))
+			return 0;
+		if (errno != EINVAL && errno != ENOTSUPP && errno != EOPNOTSUPP)
+			return -1;
+		/* batch operations are not supported, delete one by one */
+		batch_delete = false;
+	}
+
+	for (i = 0; i < dump->count; i++) {
+		if (bpf_map_delete_elem(map_fd, hist_dump__key(dump, i)) &&
+		    errno != ENOENT)
+			return -1;
+	}
+	return 0;
+}
+
+void hist_dump__free(struct hist_dump *dump)
+{
+	free(dump->keys);
+	free(dump->values);
+	dump->keys = NULL;
+	dump->values = NULL;
+	dump->count = 0;
+}
+
+static int hist_percentile_slot(const unsigned int *vals, int vals_size,
+				double percentile)
+{
+	unsigned long long total = 0, sum = 0, rank;
+	int i;
+
+	for (i = 0; i < vals_size; i++)
+		total += vals[i];
+	if (!total)
+		return -1;
+
+	/* rank of the sample at the percentile, counting from 1 */
+	rank = (unsigned long long)(total * percentile / 100.0 + 0.5);
+	if (rank < 1)
+		rank = 1;
+	if (rank > total)
+		rank = total;
+
+	for (i = 0; i < vals_size; i++) {
+		sum += vals[i];
+		if (sum >= rank)
+			return i;
+	}
+	return vals_size - 1;
+}
+
+static unsigned long long log2_slot_low(int i)
+{
+	unsigned long long low = (1ULL << (i + 1)) >> 1;
+
+	return i == 0 ? 0 : low;
+}
+
+static unsigned long long log2_slot_high(int i)
+{
+	return (1ULL << (i + 1)) - 1;
+}
+
+unsigned long long log2_hist_percentile(const unsigned int *vals,
+					int vals_size, double percentile)
+{
+	int i = hist_percentile_slot(vals, vals_size, percentile);
+
+	return i < 0 ? 0 : log2_slot_high(i);
+}
+
+unsigned long long linear_hist_percentile(const unsigned int *vals,
+					  int vals_size, unsigned int base,
+					  unsigned int step, double percentile)
+{
+	int i = hist_percentile_slot(vals, vals_size, percentile);
+
+	return i < 0 ? 0 : base + (unsigned long long)(i + 1) * step - 1;
+}
+
+void print_log2_hist_json(const unsigned int *vals, int vals_size,
+			  const char *val_type, const char *labels)
+{
+	const char *sep = "";
+	int i;
+
+	printf("{");
+	if (labels && labels[0])
+		printf("%s,", labels);
+	printf("\"unit\":\"%s\",\"buckets\":[", val_type);
+	for (i = 0; i < vals_size; i++) {
+		if (!vals[i])
+			continue;
+		printf("%s{\"low\":%llu,\"high\":%llu,\"count\":%u}", sep,
+		       log2_slot_low(i), log2_slot_high(i), vals[i]);
+		sep = ",";
+	}
+	printf("],\"p50\":%llu,\"p90\":%llu,\"p99\":%llu}\n",
+	       log2_hist_percentile(vals, vals_size, 50),
+	       log2_hist_percentile(vals, vals_size, 90),
+	       log2_hist_percentile(vals, vals_size, 99));
+}
+
+void print_linear_hist_json(const unsigned int *vals, int vals_size,
+			    unsigned int base, unsigned int step,
+			    const char *val_type, const char *labels)
+{
+	const char *sep = "";
+	unsigned long long low;
+	int i;
+
+	printf("{");
+	if (labels && labels[0])
+		printf("%s,", labels);
+	printf("\"unit\":\"%s\",\"buckets\":[", val_type);
+	for (i = 0; i < vals_size; i++) {
+		if (!vals[i])
+			continue;
+		low = base + (unsigned long long)i * step;
+		printf("%s{\"low\":%llu,\"high\":%llu,\"count\":%u}", sep,
+		       low, low + step - 1, vals[i]);
+		sep = ",";
+	}
+	printf("],\"p50\":%llu,\"p90\":%llu,\"p99\":%llu}\n",
+	       linear_hist_percentile(vals, vals_size, base, step, 50),
+	       linear_hist_percentile(vals, vals_size, base, step, 90),
+	       linear_hist_percentile(vals, vals_size, base, step, 99));
+}
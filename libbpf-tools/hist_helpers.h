@@ -0,0 +1,58 @@
+/* SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause) */
+#ifndef __HIST_HELPERS_H
+#define __HIST_HELPERS_H
+
+#include <stdbool.h>
+#include <linux/types.h>
+
+/*
+ * Keys and values of a hash map of histograms, like the ones updated with
+ * hist.bpf.h, read in batches with dump_hash().
+ */
+struct hist_dump {
+	void *keys;
+	void *values;
+	__u32 key_size;
+	__u32 value_size;
+	__u32 count;
+};
+
+int hist_dump__read(struct hist_dump *dump, int map_fd, __u32 key_size,
+		    __u32 value_size, __u32 max_entries, void *invalid_key);
+/* delete the keys that were read from map_fd, in one batch if supported */
+int hist_dump__clear(const struct hist_dump *dump, int map_fd);
+void hist_dump__free(struct hist_dump *dump);
+
+static inline void *hist_dump__key(const struct hist_dump *dump, __u32 i)
+{
+	return (char *)dump->keys + (size_t)i * dump->key_size;
+}
+
+static inline void *hist_dump__value(const struct hist_dump *dump, __u32 i)
+{
+	return (char *)dump->values + (size_t)i * dump->value_size;
+}
+
+/*
+ * Upper bound of the slot holding the given percentile (0-100) of the
+ * counted values, or 0 if the histogram is empty.
+ */
+unsigned long long log2_hist_percentile(const unsigned int *vals,
+					int vals_size, double percentile);
+unsigned long long linear_hist_percentile(const unsigned int *vals,
+					  int vals_size, unsigned int base,
+					  unsigned int step, double percentile);
+
+/*
+ * Print a histogram as one line of JSON, for scripts. labels, if not NULL,
+ * are JSON members naming the dimensions of the histogram, e.g.
+ * "\"disk\":\"sda\"". Empty slots are left out, and p50, p90 and p99 are
+ * computed with the functions above.
+ */
+void print_log2_hist_json(const unsigned int *vals, int vals_size,
+			  const char *val_type, const char *labels);
+void print_linear_hist_json(const unsigned int *vals, int vals_size,
+			    unsigned int base, unsigned int step,
+			    const char *val_type, const char *labels);
+
+#endif /* __HIST_HELPERS_H */
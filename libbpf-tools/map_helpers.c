@@ -2,7 +2,9 @@
 // Copyright (c) 2020 Anton Protopopov
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
+#include <bpf/libbpf.h>
 
 #include "map_helpers.h"
 
@@ -85,15 +87,14 @@ int dump_hash(int map_fd,
 	if (batch_map_ops) {
 		err = dump_hash_batch(map_fd, keys, key_size,
 				      values, value_size, count);
-		if (err) {
-			if (errno != EINVAL) {
-				return -1;
-
-				/* assume that batch operations are not
-				 * supported and try non-batch mode */
-				batch_map_ops = false;
-			}
-		}
+		if (!err)
+			return 0;
+		if (errno != EINVAL)
+			return -1;
+
+		/* assume that batch operations are not
+		 * supported and try non-batch mode */
+		batch_map_ops = false;
 	}
 
 	if (!invalid_key) {
@@ -104,3 +105,67 @@ int dump_hash(int map_fd,
 	return dump_hash_iter(map_fd, keys, key_size,
 			      values, value_size, count, invalid_key);
 }
+
+void percpu_sum_u64(void *sum, const void *value, __u32 value_size)
+{
+	const __u64 *v = value;
+	__u64 *s = sum;
+	__u32 i;
+
+	for (i = 0; i < value_size / sizeof(*s); i++)
+		s[i] += v[i];
+}
+
+void percpu_sum_u32(void *sum, const void *value, __u32 value_size)
+{
+	const __u32 *v = value;
+	__u32 *s = sum;
+	__u32 i;
+
+	for (i = 0; i < value_size / sizeof(*s); i++)
+		s[i] += v[i];
+}
+
+int percpu_nr_cpus(void)
+{
+	static int nr_cpus;
+
+	if (!nr_cpus)
+		nr_cpus = libbpf_num_possible_cpus();
+	return nr_cpus;
+}
+
+void reduce_percpu(const void *values, void *sum, __u32 value_size,
+		   percpu_reduce_fn reduce)
+{
+	__u32 stride = percpu_value_size(value_size);
+	int cpu, nr_cpus = percpu_nr_cpus();
+
+	memset(sum, 0, value_size);
+	for (cpu = 0; cpu < nr_cpus; cpu++)
+		reduce(sum, values + stride * cpu, value_size);
+}
+
+int lookup_percpu(int map_fd, const void *key, void *sum, __u32 value_size,
+		  percpu_reduce_fn reduce)
+{
+	int err, nr_cpus = percpu_nr_cpus();
+	void *values;
+
+	if (nr_cpus < 0) {
+		errno = -nr_cpus;
+		return -1;
+	}
+
+	values = calloc(nr_cpus, percpu_value_size(value_size));
+	if (!values) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	err = bpf_map_lookup_elem(map_fd, key, values);
+	if (!err)
+		reduce_percpu(values, sum, value_size, reduce);
+	free(values);
+	return err;
+}
@@ -8,4 +8,29 @@
 int dump_hash(int map_fd, void *keys, __u32 key_size,
 	      void *values, __u32 value_size, __u32 *count, void *invalid_key);
 
+/*
+ * Helpers for per-CPU maps, which tools use for counters that are updated
+ * from all CPUs to avoid atomics on shared cache lines. A lookup returns
+ * one value per possible CPU, each padded to 8 bytes, and reduce folds a
+ * CPU's value into the sum. percpu_sum_u64 and percpu_sum_u32 add up
+ * values made only of __u64 or __u32 fields.
+ */
+typedef void (*percpu_reduce_fn)(void *sum, const void *value,
+				 __u32 value_size);
+
+void percpu_sum_u64(void *sum, const void *value, __u32 value_size);
+void percpu_sum_u32(void *sum, const void *value, __u32 value_size);
+
+static inline __u32 percpu_value_size(__u32 value_size)
+{
+	return (value_size + 7) & ~7U;
+}
+
+int percpu_nr_cpus(void);
+/* reduce the per-CPU values returned by a lookup into sum */
+void reduce_percpu(const void *values, void *sum, __u32 value_size,
+		   percpu_reduce_fn reduce);
+int lookup_percpu(int map_fd, const void *key, void *sum, __u32 value_size,
+		  percpu_reduce_fn reduce);
+
 #endif /* __MAP_HELPERS_H */
@@ -0,0 +1,202 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <vmlinux.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+#include "memleak.h"
+#include "maps.bpf.h"
+
+#define MAX_ENTRIES		10240
+#define MAX_ALLOCS		1000000
+
+const volatile __u64 min_size = 0;
+const volatile __u64 max_size = -1;
+const volatile __u64 sample_rate = 1;
+
+/* size of the allocation a thread is in */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, u32);
+	__type(value, u64);
+	__uint(max_entries, MAX_ENTRIES);
+} sizes SEC(".maps");
+
+/* posix_memalign() returns the address through this pointer */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, u32);
+	__type(value, u64);
+	__uint(max_entries, MAX_ENTRIES);
+} memptrs SEC(".maps");
+
+/* outstanding allocations, preallocated so that tracing never allocates */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, u64);
+	__type(value, struct alloc_info);
+	__uint(max_entries, MAX_ALLOCS);
+} allocs SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_STACK_TRACE);
+	__uint(key_size, sizeof(u32));
+} stack_traces SEC(".maps");
+
+/* outstanding bytes and allocations by stack id, all user space reads */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+	__type(key, u64);
+	__type(value, struct combined_alloc_info);
+	__uint(max_entries, MAX_ENTRIES);
+} combined_allocs SEC(".maps");
+
+static void update_statistics_add(u64 stack_id, u64 sz)
+{
+	static const struct combined_alloc_info zero;
+	struct combined_alloc_info *info;
+
+	info = bpf_map_lookup_or_try_init(&combined_allocs, &stack_id, &zero);
+	if (!info)
+		return;
+	/* no atomics needed, this is the value of the current CPU */
+	info->total_size += sz;
+	info->number_of_allocs += 1;
+}
+
+static void update_statistics_del(u64 stack_id, u64 sz)
+{
+	static const struct combined_alloc_info zero;
+	struct combined_alloc_info *info;
+
+	info = bpf_map_lookup_or_try_init(&combined_allocs, &stack_id, &zero);
+	if (!info)
+		return;
+	info->total_size -= sz;
+	info->number_of_allocs -= 1;
+}
+
+static int gen_alloc_enter(u64 size)
+{
+	u32 tid = bpf_get_current_pid_tgid();
+
+	if (size < min_size || size > max_size)
+		return 0;
+	if (sample_rate > 1 && bpf_ktime_get_ns() % sample_rate != 0)
+		return 0;
+
+	bpf_map_update_elem(&sizes, &tid, &size, BPF_ANY);
+	return 0;
+}
+
+static int gen_alloc_exit2(void *ctx, u64 address)
+{
+	u32 tid = bpf_get_current_pid_tgid();
+	struct alloc_info info = {}, *old;
+	u64 *size;
+
+	size = bpf_map_lookup_elem(&sizes, &tid);
+	if (!size)
+		return 0;
+	info.size = *size;
+	bpf_map_delete_elem(&sizes, &tid);
+
+	if (!address)
+		return 0;
+
+	/* the free of an older allocation at this address was missed */
+	old = bpf_map_lookup_elem(&allocs, &address);
+	if (old)
+		update_statistics_del(old->stack_id, old->size);
+
+	info.timestamp_ns = bpf_ktime_get_ns();
+	info.stack_id = bpf_get_stackid(ctx, &stack_traces, BPF_F_USER_STACK);
+	bpf_map_update_elem(&allocs, &address, &info, BPF_ANY);
+	update_statistics_add(info.stack_id, info.size);
+	return 0;
+}
+
+static int gen_free_enter(const void *address)
+{
+	u64 addr = (u64)address;
+	struct alloc_info *info;
+	u64 stack_id, size;
+
+	info = bpf_map_lookup_elem(&allocs, &addr);
+	if (!info)
+		return 0;
+	stack_id = info->stack_id;
+	size = info->size;
+	bpf_map_delete_elem(&allocs, &addr);
+	update_statistics_del(stack_id, size);
+	return 0;
+}
+
+SEC("uprobe/malloc")
+int BPF_KPROBE(malloc_enter, size_t size)
+{
+	return gen_alloc_enter(size);
+}
+
+SEC("uretprobe/malloc")
+int BPF_KRETPROBE(malloc_exit)
+{
+	return gen_alloc_exit2(ctx, PT_REGS_RC(ctx));
+}
+
+SEC("uprobe/free")
+int BPF_KPROBE(free_enter, void *address)
+{
+	return gen_free_enter(address);
+}
+
+SEC("uprobe/calloc")
+int BPF_KPROBE(calloc_enter, size_t nmemb, size_t size)
+{
+	return gen_alloc_enter(nmemb * size);
+}
+
+SEC("uprobe/realloc")
+int BPF_KPROBE(realloc_enter, void *ptr, size_t size)
+{
+	gen_free_enter(ptr);
+	return gen_alloc_enter(size);
+}
+
+SEC("uprobe/memalign")
+int BPF_KPROBE(memalign_enter, size_t alignment, size_t size)
+{
+	return gen_alloc_enter(size);
+}
+
+SEC("uprobe/posix_memalign")
+int BPF_KPROBE(posix_memalign_enter, void **memptr, size_t alignment,
+	       size_t size)
+{
+	u64 memptr64 = (u64)memptr;
+	u32 tid = bpf_get_current_pid_tgid();
+
+	bpf_map_update_elem(&memptrs, &tid, &memptr64, BPF_ANY);
+	return gen_alloc_enter(size);
+}
+
+SEC("uretprobe/posix_memalign")
+int BPF_KRETPROBE(posix_memalign_exit)
+{
+	u32 tid = bpf_get_current_pid_tgid();
+	u64 *memptr64, addr = 0;
+	void *memptr;
+
+	memptr64 = bpf_map_lookup_elem(&memptrs, &tid);
+	if (!memptr64)
+		return 0;
+	memptr = (void *)*memptr64;
+	bpf_map_delete_elem(&memptrs, &tid);
+
+	/* posix_memalign() returns 0 on success */
+	if (PT_REGS_RC(ctx) == 0 &&
+	    bpf_probe_read_user(&addr, sizeof(addr), memptr))
+		return 0;
+	return gen_alloc_exit2(ctx, addr);
+}
+
+char LICENSE[] SEC("license") = "GPL";
@@ -0,0 +1,487 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+//
+// Based on memleak(8) from BCC by Sasha Goldshtein.
+#include <argp.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+#include "memleak.h"
+#include "memleak.skel.h"
+#include "trace_helpers.h"
+#include "uprobe_helpers.h"
+
+#define warn(...) fprintf(stderr, __VA_ARGS__)
+
+static struct env {
+	pid_t pid;
+	int interval;
+	int count;
+	int top_stacks;
+	__u64 min_size;
+	__u64 max_size;
+	__u64 sample_rate;
+	const char *object;
+	int stack_storage_size;
+	int perf_max_stack_depth;
+	int max_allocs;
+	bool verbose;
+} env = {
+	.interval = 5,
+	.count = -1,
+	.top_stacks = 10,
+	.max_size = -1,
+	.sample_rate = 1,
+	.object = "c",
+	.stack_storage_size = 10240,
+	.perf_max_stack_depth = 127,
+	.max_allocs = 1000000,
+};
+
+const char *argp_program_version = "memleak 0.1";
+const char *argp_program_bug_address =
+	"https://github.com/iovisor/bcc/tree/master/libbpf-tools";
+const char argp_program_doc[] =
+"Trace outstanding memory allocations of a process.\n"
+"\n"
+"USAGE: memleak [--help] -p PID [-s SAMPLE_RATE] [-T TOP_STACKS] [-z MIN_SIZE] "
+"[-Z MAX_SIZE] [-O OBJ] [interval] [count]\n"
+"EXAMPLES:\n"
+"    memleak -p 185          # trace allocations of PID 185, print every 5 seconds\n"
+"    memleak -p 185 10 3     # print every 10 seconds, 3 times\n"
+"    memleak -p 185 -s 5     # trace roughly every 5th allocation\n"
+"    memleak -p 185 -T 20    # print the top 20 stacks\n"
+"    memleak -p 185 -z 64    # only trace allocations of 64 bytes or more\n"
+"    memleak -p 185 -O jemalloc  # trace allocations of libjemalloc\n";
+
+#define OPT_PERF_MAX_STACK_DEPTH	1 /* --perf-max-stack-depth */
+#define OPT_STACK_STORAGE_SIZE		2 /* --stack-storage-size */
+#define OPT_MAX_ALLOCS			3 /* --max-allocs */
+
+static const struct argp_option opts[] = {
+	{ "pid", 'p', "PID", 0, "Process ID to trace" },
+	{ "sample-rate", 's', "SAMPLE_RATE", 0,
+	  "Sample every N-th allocation to decrease the overhead" },
+	{ "top", 'T', "TOP_STACKS", 0,
+	  "Display only this many top allocating stacks (by size, default 10)" },
+	{ "min-size", 'z', "MIN_SIZE", 0, "Capture only allocations larger than this size" },
+	{ "max-size", 'Z', "MAX_SIZE", 0, "Capture only allocations smaller than this size" },
+	{ "obj", 'O', "OBJ", 0,
+	  "Library or path of the allocator to trace (default libc)" },
+	{ "perf-max-stack-depth", OPT_PERF_MAX_STACK_DEPTH,
+	  "PERF-MAX-STACK-DEPTH", 0, "the limit for stack traces (default 127)" },
+	{ "stack-storage-size", OPT_STACK_STORAGE_SIZE, "STACK-STORAGE-SIZE", 0,
+	  "the number of unique stack traces that can be stored and displayed (default 10240)" },
+	{ "max-allocs", OPT_MAX_ALLOCS, "MAX-ALLOCS", 0,
+	  "the number of outstanding allocations that can be tracked (default 1000000)" },
+	{ "verbose", 'v', NULL, 0, "Verbose debug output" },
+	{ NULL, 'h', NULL, OPTION_HIDDEN, "Show the full help" },
+	{},
+};
+
+static error_t parse_arg(int key, char *arg, struct argp_state *state)
+{
+	static int pos_args;
+
+	switch (key) {
+	case 'h':
+		argp_state_help(state, stderr, ARGP_HELP_STD_HELP);
+		break;
+	case 'v':
+		env.verbose = true;
+		break;
+	case 'p':
+		errno = 0;
+		env.pid = strtol(arg, NULL, 10);
+		if (errno || env.pid <= 0) {
+			warn("Invalid PID: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 's':
+		errno = 0;
+		env.sample_rate = strtoull(arg, NULL, 10);
+		if (errno || env.sample_rate == 0) {
+			warn("Invalid sample rate: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 'T':
+		errno = 0;
+		env.top_stacks = strtol(arg, NULL, 10);
+		if (errno || env.top_stacks <= 0) {
+			warn("Invalid number of top stacks: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 'z':
+		errno = 0;
+		env.min_size = strtoull(arg, NULL, 10);
+		if (errno) {
+			warn("Invalid min size: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 'Z':
+		errno = 0;
+		env.max_size = strtoull(arg, NULL, 10);
+		if (errno) {
+			warn("Invalid max size: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 'O':
+		env.object = arg;
+		break;
+	case OPT_PERF_MAX_STACK_DEPTH:
+		errno = 0;
+		env.perf_max_stack_depth = strtol(arg, NULL, 10);
+		if (errno || env.perf_max_stack_depth <= 0) {
+			warn("invalid perf max stack depth: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case OPT_STACK_STORAGE_SIZE:
+		errno = 0;
+		env.stack_storage_size = strtol(arg, NULL, 10);
+		if (errno || env.stack_storage_size <= 0) {
+			warn("invalid stack storage size: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case OPT_MAX_ALLOCS:
+		errno = 0;
+		env.max_allocs = strtol(arg, NULL, 10);
+		if (errno || env.max_allocs <= 0) {
+			warn("invalid max allocs: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case ARGP_KEY_ARG:
+		errno = 0;
+		if (pos_args == 0) {
+			env.interval = strtol(arg, NULL, 10);
+			if (errno || env.interval <= 0) {
+				warn("Invalid interval: %s\n", arg);
+				argp_usage(state);
+			}
+		} else if (pos_args == 1) {
+			env.count = strtol(arg, NULL, 10);
+			if (errno || env.count <= 0) {
+				warn("Invalid count: %s\n", arg);
+				argp_usage(state);
+			}
+		} else {
+			warn("Unrecognized positional argument: %s\n", arg);
+			argp_usage(state);
+		}
+		pos_args++;
+		break;
+	case ARGP_KEY_END:
+		if (!env.pid) {
+			warn("A PID to trace is required\n");
+			argp_usage(state);
+		}
+		if (env.min_size > env.max_size) {
+			warn("min size should not be greater than max size\n");
+			argp_usage(state);
+		}
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+int libbpf_print_fn(enum libbpf_print_level level,
+		    const char *format, va_list args)
+{
+	if (level == LIBBPF_DEBUG && !env.verbose)
+		return 0;
+	return vfprintf(stderr, format, args);
+}
+
+static volatile bool exiting;
+
+static void sig_handler(int sig)
+{
+	exiting = true;
+}
+
+#define MAX_LINKS	32
+
+static struct bpf_link *links[MAX_LINKS];
+static int nr_links;
+
+static int attach_uprobe(struct bpf_program *prog, bool retprobe,
+			 const char *path, const char *func, bool required)
+{
+	struct bpf_link *link;
+	off_t func_off;
+
+	func_off = get_elf_func_offset(path, func);
+	if (func_off < 0) {
+		if (!required)
+			return 0;
+		warn("could not find %s in %s\n", func, path);
+		return -1;
+	}
+	link = bpf_program__attach_uprobe(prog, retprobe, env.pid, path,
+					  func_off);
+	if (!link) {
+		warn("failed to attach %s: %d\n", func, -errno);
+		return -1;
+	}
+	links[nr_links++] = link;
+	return 0;
+}
+
+static int attach_uprobes(struct memleak_bpf *obj)
+{
+	struct alloc_fn {
+		const char *name;
+		struct bpf_program *enter;
+		struct bpf_program *exit;
+		bool required;
+	} fns[] = {
+		{ "malloc", obj->progs.malloc_enter, obj->progs.malloc_exit, true },
+		{ "free", obj->progs.free_enter, NULL, true },
+		{ "calloc", obj->progs.calloc_enter, obj->progs.malloc_exit },
+		{ "realloc", obj->progs.realloc_enter, obj->progs.malloc_exit },
+		{ "posix_memalign", obj->progs.posix_memalign_enter,
+		  obj->progs.posix_memalign_exit },
+		{ "aligned_alloc", obj->progs.memalign_enter, obj->progs.malloc_exit },
+		{ "memalign", obj->progs.memalign_enter, obj->progs.malloc_exit },
+		{ "valloc", obj->progs.malloc_enter, obj->progs.malloc_exit },
+		{ "pvalloc", obj->progs.malloc_enter, obj->progs.malloc_exit },
+	};
+	char path[PATH_MAX];
+	size_t i;
+
+	if (strchr(env.object, '/')) {
+		if (snprintf(path, sizeof(path), "%s", env.object) >= sizeof(path)) {
+			warn("path too long: %s\n", env.object);
+			return -1;
+		}
+	} else if (resolve_binary_path(env.object, env.pid, path, sizeof(path))) {
+		return -1;
+	}
+
+	for (i = 0; i < sizeof(fns) / sizeof(fns[0]); i++) {
+		if (attach_uprobe(fns[i].enter, false, path, fns[i].name,
+				  fns[i].required))
+			return -1;
+		if (fns[i].exit &&
+		    attach_uprobe(fns[i].exit, true, path, fns[i].name,
+				  fns[i].required))
+			return -1;
+	}
+	return 0;
+}
+
+struct stack_info {
+	__u64 stack_id;
+	struct combined_alloc_info info;
+};
+
+static int stack_info_cmp(const void *p1, const void *p2)
+{
+	const struct stack_info *s1 = p1, *s2 = p2;
+
+	if (s1->info.total_size == s2->info.total_size)
+		return 0;
+	return s1->info.total_size > s2->info.total_size ? -1 : 1;
+}
+
+static int read_combined_allocs(struct memleak_bpf *obj, int nr_cpus,
+				struct stack_info **stacksp, size_t *nrp)
+{
+	struct combined_alloc_info *values;
+	struct stack_info *stacks = NULL;
+	__u64 lookup_key = -1, next_key;
+	size_t nr = 0, cap = 0;
+	int err = 0, fd, cpu;
+	void *tmp;
+
+	values = calloc(nr_cpus, sizeof(*values));
+	if (!values)
+		return -1;
+
+	fd = bpf_map__fd(obj->maps.combined_allocs);
+	while (!bpf_map_get_next_key(fd, &lookup_key, &next_key)) {
+		lookup_key = next_key;
+		if (bpf_map_lookup_elem(fd, &next_key, values))
+			continue;
+		if (nr == cap) {
+			cap = cap ? cap * 2 : 1024;
+			tmp = realloc(stacks, cap * sizeof(*stacks));
+			if (!tmp) {
+				err = -1;
+				break;
+			}
+			stacks = tmp;
+		}
+		stacks[nr].stack_id = next_key;
+		memset(&stacks[nr].info, 0, sizeof(stacks[nr].info));
+		for (cpu = 0; cpu < nr_cpus; cpu++) {
+			stacks[nr].info.total_size += values[cpu].total_size;
+			stacks[nr].info.number_of_allocs +=
+				values[cpu].number_of_allocs;
+		}
+		/* every allocation from this stack was freed */
+		if (!stacks[nr].info.number_of_allocs)
+			continue;
+		nr++;
+	}
+
+	free(values);
+	*stacksp = stacks;
+	*nrp = nr;
+	return err;
+}
+
+static void print_outstanding_combined_allocs(struct memleak_bpf *obj,
+					      const struct syms *syms,
+					      int nr_cpus, unsigned long *ip)
+{
+	struct stack_info *stacks;
+	const struct sym *sym;
+	char ts[32];
+	struct tm *tm;
+	__u32 stack_id;
+	size_t nr, i;
+	time_t t;
+	int sfd, j;
+
+	if (read_combined_allocs(obj, nr_cpus, &stacks, &nr)) {
+		warn("failed to read combined allocations\n");
+		free(stacks);
+		return;
+	}
+	qsort(stacks, nr, sizeof(*stacks), stack_info_cmp);
+	if (nr > env.top_stacks)
+		nr = env.top_stacks;
+
+	time(&t);
+	tm = localtime(&t);
+	strftime(ts, sizeof(ts), "%H:%M:%S", tm);
+	printf("[%s] Top %d stacks with outstanding allocations:\n", ts,
+	       env.top_stacks);
+
+	sfd = bpf_map__fd(obj->maps.stack_traces);
+	/* the largest stacks are printed last, closest to the prompt */
+	for (i = nr; i-- > 0;) {
+		printf("\t%llu bytes in %llu allocations from stack\n",
+		       stacks[i].info.total_size,
+		       stacks[i].info.number_of_allocs);
+		stack_id = stacks[i].stack_id;
+		if ((__s64)stacks[i].stack_id < 0 ||
+		    bpf_map_lookup_elem(sfd, &stack_id, ip)) {
+			printf("\t\t[Missed User Stack]\n");
+			continue;
+		}
+		for (j = 0; j < env.perf_max_stack_depth && ip[j]; j++) {
+			sym = syms ? syms__map_addr(syms, ip[j]) : NULL;
+			if (sym)
+				printf("\t\t0x%lx %s+0x%lx\n", ip[j], sym->name,
+				       ip[j] - sym->start);
+			else
+				printf("\t\t0x%lx [unknown]\n", ip[j]);
+		}
+	}
+	free(stacks);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct argp argp = {
+		.options = opts,
+		.parser = parse_arg,
+		.doc = argp_program_doc,
+	};
+	struct syms *syms = NULL, *new_syms;
+	struct memleak_bpf *obj;
+	unsigned long *ip = NULL;
+	int err, i, nr_cpus;
+
+	err = argp_parse(&argp, argc, argv, 0, NULL, NULL);
+	if (err)
+		return err;
+
+	libbpf_set_strict_mode(LIBBPF_STRICT_ALL);
+	libbpf_set_print(libbpf_print_fn);
+
+	nr_cpus = libbpf_num_possible_cpus();
+	if (nr_cpus < 0) {
+		warn("failed to get # of possible cpus: '%s'!\n",
+		     strerror(-nr_cpus));
+		return 1;
+	}
+
+	ip = calloc(env.perf_max_stack_depth, sizeof(*ip));
+	if (!ip) {
+		warn("failed to alloc ip\n");
+		return 1;
+	}
+
+	obj = memleak_bpf__open();
+	if (!obj) {
+		warn("failed to open BPF object\n");
+		err = 1;
+		goto cleanup;
+	}
+
+	/* initialize global data (filtering options) */
+	obj->rodata->min_size = env.min_size;
+	obj->rodata->max_size = env.max_size;
+	obj->rodata->sample_rate = env.sample_rate;
+
+	bpf_map__set_value_size(obj->maps.stack_traces,
+				env.perf_max_stack_depth * sizeof(unsigned long));
+	bpf_map__set_max_entries(obj->maps.stack_traces, env.stack_storage_size);
+	bpf_map__set_max_entries(obj->maps.combined_allocs,
+				 env.stack_storage_size);
+	bpf_map__set_max_entries(obj->maps.allocs, env.max_allocs);
+
+	err = memleak_bpf__load(obj);
+	if (err) {
+		warn("failed to load BPF programs\n");
+		goto cleanup;
+	}
+
+	err = attach_uprobes(obj);
+	if (err)
+		goto cleanup;
+
+	signal(SIGINT, sig_handler);
+
+	printf("Attaching to pid %d, Ctrl+C to quit.\n", env.pid);
+
+	while (!exiting && env.count--) {
+		sleep(env.interval);
+
+		/*
+		 * Reload the maps to see libraries loaded since the last
+		 * interval. Symbol tables of files that were mapped before
+		 * are shared with the old syms, so they are not read again.
+		 */
+		new_syms = syms__load_pid(env.pid);
+		syms__free(syms);
+		syms = new_syms;
+
+		print_outstanding_combined_allocs(obj, syms, nr_cpus, ip);
+	}
+
+cleanup:
+	for (i = 0; i < nr_links; i++)
+		bpf_link__destroy(links[i]);
+	memleak_bpf__destroy(obj);
+	syms__free(syms);
+	free(ip);
+	return err != 0;
+}
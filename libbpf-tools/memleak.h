@@ -0,0 +1,20 @@
+/* SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause) */
+#ifndef __MEMLEAK_H
+#define __MEMLEAK_H
+
+struct alloc_info {
+	__u64 size;
+	__u64 timestamp_ns;
+	int stack_id;
+};
+
+/*
+ * Kept per CPU, so a free on another CPU than its allocation makes the
+ * values of one CPU wrap around. Their sum over all CPUs is still right.
+ */
+struct combined_alloc_info {
+	__u64 total_size;
+	__u64 number_of_allocs;
+};
+
+#endif /* __MEMLEAK_H */
@@ -3,6 +3,7 @@
 // Copyright (c) 2020 Netflix
 #include <vmlinux.h>
 #include <bpf/bpf_helpers.h>
+#include "compat.bpf.h"
 #include "opensnoop.h"
 
 #define TASK_RUNNING	0
@@ -20,12 +21,6 @@ struct {
 	__type(value, struct args_t);
 } start SEC(".maps");
 
-struct {
-	__uint(type, BPF_MAP_TYPE_PERF_EVENT_ARRAY);
-	__uint(key_size, sizeof(u32));
-	__uint(value_size, sizeof(u32));
-} events SEC(".maps");
-
 static __always_inline bool valid_uid(uid_t uid) {
 	return uid != INVALID_UID;
 }
@@ -109,8 +104,7 @@ int trace_exit(struct trace_event_raw_sys_exit* ctx)
 	event.ret = ret;
 
 	/* emit event */
-	bpf_perf_event_output(ctx, &events, BPF_F_CURRENT_CPU,
-			      &event, sizeof(event));
+	submit_buf(ctx, &event, sizeof(event));
 
 cleanup:
 	bpf_map_delete_elem(&start, &pid);
@@ -17,15 +17,13 @@
 #include "opensnoop.h"
 #include "opensnoop.skel.h"
 #include "trace_helpers.h"
+#include "compat.h"
+#include "record_helpers.h"
 
-/* Tune the buffer size and wakeup rate. These settings cope with roughly
- * 50k opens/sec.
- */
-#define PERF_BUFFER_PAGES	64
-#define PERF_BUFFER_TIME_MS	10
+/* Events queued to the printing thread, absorbs bursts of opens. */
+#define EVENT_QUEUE_SLOTS	8192
 
-/* Set the poll timeout when no events occur. This can affect -d accuracy. */
-#define PERF_POLL_TIMEOUT_MS	100
+#define OPT_OUTPUT		1 /* --output */
 
 #define NSEC_PER_SEC		1000000000ULL
 
@@ -42,6 +40,7 @@ static struct env {
 	bool extended;
 	bool failed;
 	char *name;
+	int output;
 } env = {
 	.uid = INVALID_UID
 };
@@ -53,7 +52,7 @@ const char argp_program_doc[] =
 "Trace open family syscalls\n"
 "\n"
 "USAGE: opensnoop [-h] [-T] [-U] [-x] [-p PID] [-t TID] [-u UID] [-d DURATION]\n"
-"                 [-n NAME] [-e]\n"
+"                 [-n NAME] [-e] [--output FORMAT]\n"
 "\n"
 "EXAMPLES:\n"
 "    ./opensnoop           # trace all open() syscalls\n"
@@ -65,7 +64,20 @@ const char argp_program_doc[] =
 "    ./opensnoop -u 1000   # only trace UID 1000\n"
 "    ./opensnoop -d 10     # trace for 10 seconds only\n"
 "    ./opensnoop -n main   # only print process names containing \"main\"\n"
-"    ./opensnoop -e        # show extended fields\n";
+"    ./opensnoop -e        # show extended fields\n"
+"    ./opensnoop --output binary   # write binary records\n";
+
+static struct record_writer *writer;
+
+static const struct record_field record_fields[] = {
+	RECORD_FIELD(struct event, ts, RECORD_FIELD_UINT),
+	RECORD_FIELD(struct event, pid, RECORD_FIELD_INT),
+	RECORD_FIELD(struct event, uid, RECORD_FIELD_UINT),
+	RECORD_FIELD(struct event, ret, RECORD_FIELD_INT),
+	RECORD_FIELD(struct event, flags, RECORD_FIELD_INT),
+	RECORD_FIELD(struct event, comm, RECORD_FIELD_STR),
+	RECORD_FIELD(struct event, fname, RECORD_FIELD_STR),
+};
 
 static const struct argp_option opts[] = {
 	{ "duration", 'd', "DURATION", 0, "Duration to trace"},
@@ -79,6 +91,7 @@ static const struct argp_option opts[] = {
 	{ "print-uid", 'U', NULL, 0, "Print UID"},
 	{ "verbose", 'v', NULL, 0, "Verbose debug output" },
 	{ "failed", 'x', NULL, 0, "Failed opens only"},
+	{ "output", OPT_OUTPUT, "FORMAT", 0, OUTPUT_FORMAT_HELP },
 	{},
 };
 
@@ -146,6 +159,13 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 		}
 		env.uid = uid;
 		break;
+	case OPT_OUTPUT:
+		env.output = output_format__parse(arg);
+		if (env.output < 0) {
+			fprintf(stderr, "Invalid output format: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
 	case ARGP_KEY_ARG:
 		if (pos_args++) {
 			fprintf(stderr,
@@ -173,7 +193,7 @@ static void sig_int(int signo)
 	exiting = 1;
 }
 
-void handle_event(void *ctx, int cpu, void *data, __u32 data_sz)
+static int handle_event(void *ctx, void *data, size_t data_sz)
 {
 	const struct event *e = data;
 	struct tm *tm;
@@ -183,7 +203,12 @@ void handle_event(void *ctx, int cpu, void *data, __u32 data_sz)
 
 	/* name filtering is currently done in user space */
 	if (env.name && strstr(e->comm, env.name) == NULL)
-		return;
+		return 0;
+
+	if (writer) {
+		record_writer__write(writer, data, data_sz);
+		return 0;
+	}
 
 	/* prepare fields */
 	time(&t);
@@ -206,11 +231,7 @@ void handle_event(void *ctx, int cpu, void *data, __u32 data_sz)
 	if (env.extended)
 		printf("%08o ", e->flags);
 	printf("%s\n", e->fname);
-}
-
-void handle_lost_events(void *ctx, int cpu, __u64 lost_cnt)
-{
-	fprintf(stderr, "Lost %llu events on CPU #%d!\n", lost_cnt, cpu);
+	return 0;
 }
 
 int main(int argc, char **argv)
@@ -220,7 +241,7 @@ int main(int argc, char **argv)
 		.parser = parse_arg,
 		.doc = argp_program_doc,
 	};
-	struct perf_buffer *pb = NULL;
+	struct bpf_buffer *buf = NULL;
 	struct opensnoop_bpf *obj;
 	__u64 time_end = 0;
 	int err;
@@ -244,6 +265,33 @@ int main(int argc, char **argv)
 	obj->rodata->targ_uid = env.uid;
 	obj->rodata->targ_failed = env.failed;
 
+	buf = bpf_buffer__new(obj->maps.events, obj->maps.events_lost);
+	if (!buf) {
+		err = -errno;
+		fprintf(stderr, "failed to create ring/perf buffer: %d\n", err);
+		goto cleanup;
+	}
+
+	/* binary records are written straight out of the buffer */
+	if (env.output != OUTPUT_TEXT) {
+		writer = record_writer__new(STDOUT_FILENO, "opensnoop",
+					    record_fields,
+					    RECORD_NR_FIELDS(record_fields),
+					    env.output == OUTPUT_BINARY_GZ);
+		if (!writer) {
+			err = -errno;
+			fprintf(stderr, "failed to set up binary output: %d\n", err);
+			goto cleanup;
+		}
+	} else {
+		err = bpf_buffer__set_async(buf, EVENT_QUEUE_SLOTS,
+					    sizeof(struct event));
+		if (err) {
+			fprintf(stderr, "failed to set up event queue: %d\n", err);
+			goto cleanup;
+		}
+	}
+
 #ifdef __aarch64__
 	/* aarch64 has no open syscall, only openat variants.
 	 * Disable associated tracepoints that do not exist. See #3344.
@@ -267,21 +315,21 @@ int main(int argc, char **argv)
 	}
 
 	/* print headers */
-	if (env.timestamp)
-		printf("%-8s ", "TIME");
-	if (env.print_uid)
-		printf("%-6s ", "UID");
-	printf("%-6s %-16s %3s %3s ", "PID", "COMM", "FD", "ERR");
-	if (env.extended)
-		printf("%-8s ", "FLAGS");
-	printf("%s\n", "PATH");
+	if (env.output == OUTPUT_TEXT) {
+		if (env.timestamp)
+			printf("%-8s ", "TIME");
+		if (env.print_uid)
+			printf("%-6s ", "UID");
+		printf("%-6s %-16s %3s %3s ", "PID", "COMM", "FD", "ERR");
+		if (env.extended)
+			printf("%-8s ", "FLAGS");
+		printf("%s\n", "PATH");
+	}
 
 	/* setup event callbacks */
-	pb = perf_buffer__new(bpf_map__fd(obj->maps.events), PERF_BUFFER_PAGES,
-			      handle_event, handle_lost_events, NULL, NULL);
-	if (!pb) {
-		err = -errno;
-		fprintf(stderr, "failed to open perf buffer: %d\n", err);
+	err = bpf_buffer__open(buf, handle_event, NULL);
+	if (err) {
+		fprintf(stderr, "failed to open ring/perf buffer: %d\n", err);
 		goto cleanup;
 	}
 
@@ -297,11 +345,14 @@ int main(int argc, char **argv)
 
 	/* main: poll */
 	while (!exiting) {
-		err = perf_buffer__poll(pb, PERF_POLL_TIMEOUT_MS);
+		/* the poll timeout affects -d accuracy when there are no events */
+		err = bpf_buffer__poll(buf, POLL_TIMEOUT_MS);
 		if (err < 0 && err != -EINTR) {
-			fprintf(stderr, "error polling perf buffer: %s\n", strerror(-err));
+			fprintf(stderr, "error polling ring/perf buffer: %s\n", strerror(-err));
 			goto cleanup;
 		}
+		if (writer)
+			record_writer__flush(writer);
 		if (env.duration && get_ktime_ns() > time_end)
 			goto cleanup;
 		/* reset err to return 0 if exiting */
@@ -309,7 +360,9 @@ int main(int argc, char **argv)
 	}
 
 cleanup:
-	perf_buffer__free(pb);
+	bpf_buffer__print_stats(buf);
+	bpf_buffer__free(buf);
+	record_writer__free(writer);
 	opensnoop_bpf__destroy(obj);
 
 	return err != 0;
@@ -0,0 +1,503 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+//
+// Based on profile(8) from BCC by Brendan Gregg.
+#include <argp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <asm/unistd.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+#include "profile.h"
+#include "profile.skel.h"
+#include "trace_helpers.h"
+
+static struct env {
+	pid_t pid;
+	pid_t tid;
+	bool user_stacks_only;
+	bool kernel_stacks_only;
+	bool include_idle;
+	bool folded;
+	bool delimiter;
+	int stack_storage_size;
+	int perf_max_stack_depth;
+	int frequency;
+	int cpu;
+	int duration;
+	bool verbose;
+} env = {
+	.pid = -1,
+	.tid = -1,
+	.stack_storage_size = 16384,
+	.perf_max_stack_depth = 127,
+	.frequency = 49,
+	.cpu = -1,
+	.duration = 99999999,
+};
+
+const char *argp_program_version = "profile 0.1";
+const char *argp_program_bug_address =
+	"https://github.com/iovisor/bcc/tree/master/libbpf-tools";
+const char argp_program_doc[] =
+"Profile CPU usage by sampling stack traces at a timed interval.\n"
+"\n"
+"USAGE: profile [--help] [-p PID | -L TID] [-U | -K] [-F FREQUENCY] [-C CPU] "
+"[-f] [-d] [-I] [--perf-max-stack-depth] [--stack-storage-size] [duration]\n"
+"EXAMPLES:\n"
+"    profile             # profile stack traces at 49 Hertz until Ctrl-C\n"
+"    profile -F 99       # profile stack traces at 99 Hertz\n"
+"    profile 5           # profile at 49 Hertz for 5 seconds only\n"
+"    profile -f 5        # output in folded format for flame graphs\n"
+"    profile -p 185      # only profile process with PID 185\n"
+"    profile -L 185      # only profile thread with TID 185\n"
+"    profile -U          # only show user space stacks (no kernel)\n"
+"    profile -K          # only show kernel space stacks (no user)\n"
+"    profile -C 2        # only profile CPU 2\n";
+
+#define OPT_PERF_MAX_STACK_DEPTH	1 /* --perf-max-stack-depth */
+#define OPT_STACK_STORAGE_SIZE		2 /* --stack-storage-size */
+
+static const struct argp_option opts[] = {
+	{ "pid", 'p', "PID", 0, "Profile this PID only" },
+	{ "tid", 'L', "TID", 0, "Profile this TID only" },
+	{ "user-stacks-only", 'U', NULL, 0,
+	  "Show stacks from user space only (no kernel space stacks)" },
+	{ "kernel-stacks-only", 'K', NULL, 0,
+	  "Show stacks from kernel space only (no user space stacks)" },
+	{ "frequency", 'F', "FREQUENCY", 0, "Sample frequency in Hertz (default 49)" },
+	{ "cpu", 'C', "CPU", 0, "CPU number to run profile on" },
+	{ "folded", 'f', NULL, 0,
+	  "Output folded format, one line per stack (for flame graphs)" },
+	{ "delimited", 'd', NULL, 0,
+	  "Insert delimiter between kernel/user stacks" },
+	{ "include-idle", 'I', NULL, 0, "Include CPU idle stacks" },
+	{ "perf-max-stack-depth", OPT_PERF_MAX_STACK_DEPTH,
+	  "PERF-MAX-STACK-DEPTH", 0, "the limit for both kernel and user stack traces (default 127)" },
+	{ "stack-storage-size", OPT_STACK_STORAGE_SIZE, "STACK-STORAGE-SIZE", 0,
+	  "the number of unique stack traces that can be stored and displayed (default 16384)" },
+	{ "verbose", 'v', NULL, 0, "Verbose debug output" },
+	{ NULL, 'h', NULL, OPTION_HIDDEN, "Show the full help" },
+	{},
+};
+
+static error_t parse_arg(int key, char *arg, struct argp_state *state)
+{
+	static int pos_args;
+
+	switch (key) {
+	case 'h':
+		argp_state_help(state, stderr, ARGP_HELP_STD_HELP);
+		break;
+	case 'v':
+		env.verbose = true;
+		break;
+	case 'p':
+		errno = 0;
+		env.pid = strtol(arg, NULL, 10);
+		if (errno || env.pid <= 0) {
+			fprintf(stderr, "Invalid PID: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 'L':
+		errno = 0;
+		env.tid = strtol(arg, NULL, 10);
+		if (errno || env.tid <= 0) {
+			fprintf(stderr, "Invalid TID: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 'U':
+		env.user_stacks_only = true;
+		break;
+	case 'K':
+		env.kernel_stacks_only = true;
+		break;
+	case 'F':
+		errno = 0;
+		env.frequency = strtol(arg, NULL, 10);
+		if (errno || env.frequency <= 0) {
+			fprintf(stderr, "Invalid frequency: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 'C':
+		errno = 0;
+		env.cpu = strtol(arg, NULL, 10);
+		if (errno || env.cpu < 0) {
+			fprintf(stderr, "Invalid CPU: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 'f':
+		env.folded = true;
+		break;
+	case 'd':
+		env.delimiter = true;
+		break;
+	case 'I':
+		env.include_idle = true;
+		break;
+	case OPT_PERF_MAX_STACK_DEPTH:
+		errno = 0;
+		env.perf_max_stack_depth = strtol(arg, NULL, 10);
+		if (errno || env.perf_max_stack_depth <= 0) {
+			fprintf(stderr, "invalid perf max stack depth: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case OPT_STACK_STORAGE_SIZE:
+		errno = 0;
+		env.stack_storage_size = strtol(arg, NULL, 10);
+		if (errno || env.stack_storage_size <= 0) {
+			fprintf(stderr, "invalid stack storage size: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case ARGP_KEY_ARG:
+		if (pos_args++) {
+			fprintf(stderr,
+				"Unrecognized positional argument: %s\n", arg);
+			argp_usage(state);
+		}
+		errno = 0;
+		env.duration = strtol(arg, NULL, 10);
+		if (errno || env.duration <= 0) {
+			fprintf(stderr, "Invalid duration (in s): %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static int nr_cpus;
+
+static int open_and_attach_perf_event(int freq, struct bpf_program *prog,
+				      struct bpf_link *links[])
+{
+	struct perf_event_attr attr = {
+		.type = PERF_TYPE_SOFTWARE,
+		.freq = 1,
+		.sample_freq = freq,
+		.config = PERF_COUNT_SW_CPU_CLOCK,
+	};
+	int i, fd;
+
+	for (i = 0; i < nr_cpus; i++) {
+		if (env.cpu != -1 && env.cpu != i)
+			continue;
+		fd = syscall(__NR_perf_event_open, &attr, -1, i, -1, 0);
+		if (fd < 0) {
+			/* Ignore CPU that is offline */
+			if (errno == ENODEV)
+				continue;
+			fprintf(stderr, "failed to init perf sampling: %s\n",
+				strerror(errno));
+			return -1;
+		}
+		links[i] = bpf_program__attach_perf_event(prog, fd);
+		if (!links[i]) {
+			fprintf(stderr, "failed to attach perf event on cpu: %d\n", i);
+			close(fd);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int libbpf_print_fn(enum libbpf_print_level level,
+		    const char *format, va_list args)
+{
+	if (level == LIBBPF_DEBUG && !env.verbose)
+		return 0;
+	return vfprintf(stderr, format, args);
+}
+
+static void sig_handler(int sig)
+{
+}
+
+struct stack_count {
+	struct key_t key;
+	__u64 count;
+};
+
+static int stack_count_cmp(const void *p1, const void *p2)
+{
+	const struct stack_count *s1 = p1, *s2 = p2;
+
+	if (s1->count == s2->count)
+		return 0;
+	return s1->count < s2->count ? -1 : 1;
+}
+
+/* -EFAULT means there is no stack of that kind, e.g. for kernel threads */
+static bool stack_id_err(int stack_id)
+{
+	return stack_id < 0 && stack_id != -EFAULT;
+}
+
+static bool has_stack(int stack_id)
+{
+	return stack_id >= 0;
+}
+
+static const char *user_sym_name(struct syms_cache *syms_cache, __u32 pid,
+				 unsigned long addr)
+{
+	const struct syms *syms;
+	const struct sym *sym;
+
+	syms = syms_cache__get_syms(syms_cache, pid);
+	if (!syms)
+		return "[unknown]";
+	sym = syms__map_addr(syms, addr);
+	return sym ? sym->name : "[unknown]";
+}
+
+static void print_folded(struct ksyms *ksyms, struct syms_cache *syms_cache,
+			 int sfd, const struct stack_count *sc,
+			 unsigned long *ip)
+{
+	const struct key_t *key = &sc->key;
+	const struct ksym *ksym;
+	int i, depth;
+
+	printf("%s", key->name);
+
+	if (!env.kernel_stacks_only) {
+		if (stack_id_err(key->user_stack_id)) {
+			printf(";[Missed User Stack]");
+		} else if (has_stack(key->user_stack_id) &&
+			   !bpf_map_lookup_elem(sfd, &key->user_stack_id, ip)) {
+			for (depth = 0; depth < env.perf_max_stack_depth &&
+			     ip[depth]; depth++)
+				;
+			for (i = depth - 1; i >= 0; i--)
+				printf(";%s", user_sym_name(syms_cache,
+							    key->pid, ip[i]));
+		}
+	}
+
+	if (!env.user_stacks_only) {
+		if (env.delimiter && !env.kernel_stacks_only)
+			printf(";-");
+		if (stack_id_err(key->kern_stack_id)) {
+			printf(";[Missed Kernel Stack]");
+		} else if (has_stack(key->kern_stack_id) &&
+			   !bpf_map_lookup_elem(sfd, &key->kern_stack_id, ip)) {
+			for (depth = 0; depth < env.perf_max_stack_depth &&
+			     ip[depth]; depth++)
+				;
+			for (i = depth - 1; i >= 0; i--) {
+				ksym = ksyms__map_addr(ksyms, ip[i]);
+				printf(";%s", ksym ? ksym->name : "[unknown]");
+			}
+		}
+	}
+
+	printf(" %llu\n", sc->count);
+}
+
+static void print_multi_line(struct ksyms *ksyms,
+			     struct syms_cache *syms_cache, int sfd,
+			     const struct stack_count *sc, unsigned long *ip)
+{
+	const struct key_t *key = &sc->key;
+	const struct ksym *ksym;
+	int i;
+
+	if (!env.user_stacks_only) {
+		if (stack_id_err(key->kern_stack_id)) {
+			printf("    [Missed Kernel Stack]\n");
+		} else if (has_stack(key->kern_stack_id) &&
+			   !bpf_map_lookup_elem(sfd, &key->kern_stack_id, ip)) {
+			for (i = 0; i < env.perf_max_stack_depth && ip[i]; i++) {
+				ksym = ksyms__map_addr(ksyms, ip[i]);
+				printf("    %s\n", ksym ? ksym->name : "[unknown]");
+			}
+		}
+	}
+
+	if (!env.kernel_stacks_only) {
+		if (env.delimiter && !env.user_stacks_only)
+			printf("    --\n");
+		if (stack_id_err(key->user_stack_id)) {
+			printf("    [Missed User Stack]\n");
+		} else if (has_stack(key->user_stack_id) &&
+			   !bpf_map_lookup_elem(sfd, &key->user_stack_id, ip)) {
+			for (i = 0; i < env.perf_max_stack_depth && ip[i]; i++)
+				printf("    %s\n", user_sym_name(syms_cache,
+								 key->pid, ip[i]));
+		}
+	}
+
+	printf("    %-16s %s (%d)\n", "-", key->name, key->pid);
+	printf("        %llu\n\n", sc->count);
+}
+
+static void print_map(struct ksyms *ksyms, struct syms_cache *syms_cache,
+		      struct profile_bpf *obj)
+{
+	struct key_t lookup_key = {}, next_key;
+	struct stack_count *counts = NULL;
+	size_t nr = 0, cap = 0, i;
+	int err, cfd, sfd;
+	unsigned long *ip;
+	void *tmp;
+
+	ip = calloc(env.perf_max_stack_depth, sizeof(*ip));
+	if (!ip) {
+		fprintf(stderr, "failed to alloc ip\n");
+		return;
+	}
+
+	cfd = bpf_map__fd(obj->maps.counts);
+	sfd = bpf_map__fd(obj->maps.stackmap);
+	while (!bpf_map_get_next_key(cfd, &lookup_key, &next_key)) {
+		if (nr == cap) {
+			cap = cap ? cap * 2 : 1024;
+			tmp = realloc(counts, cap * sizeof(*counts));
+			if (!tmp) {
+				fprintf(stderr, "failed to alloc counts\n");
+				goto cleanup;
+			}
+			counts = tmp;
+		}
+		err = bpf_map_lookup_elem(cfd, &next_key, &counts[nr].count);
+		if (err < 0) {
+			fprintf(stderr, "failed to lookup counts: %d\n", err);
+			goto cleanup;
+		}
+		counts[nr++].key = next_key;
+		lookup_key = next_key;
+	}
+
+	/* the hottest stacks are printed last, closest to the prompt */
+	qsort(counts, nr, sizeof(*counts), stack_count_cmp);
+
+	for (i = 0; i < nr; i++) {
+		if (env.folded)
+			print_folded(ksyms, syms_cache, sfd, &counts[i], ip);
+		else
+			print_multi_line(ksyms, syms_cache, sfd, &counts[i], ip);
+	}
+
+cleanup:
+	free(counts);
+	free(ip);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct argp argp = {
+		.options = opts,
+		.parser = parse_arg,
+		.doc = argp_program_doc,
+	};
+	struct syms_cache *syms_cache = NULL;
+	struct bpf_link **links = NULL;
+	struct ksyms *ksyms = NULL;
+	struct profile_bpf *obj;
+	int err, i;
+
+	err = argp_parse(&argp, argc, argv, 0, NULL, NULL);
+	if (err)
+		return err;
+	if (env.user_stacks_only && env.kernel_stacks_only) {
+		fprintf(stderr, "user_stacks_only and kernel_stacks_only cannot be used together.\n");
+		return 1;
+	}
+
+	libbpf_set_strict_mode(LIBBPF_STRICT_ALL);
+	libbpf_set_print(libbpf_print_fn);
+
+	nr_cpus = libbpf_num_possible_cpus();
+	if (nr_cpus < 0) {
+		fprintf(stderr, "failed to get # of possible cpus: '%s'!\n",
+			strerror(-nr_cpus));
+		return 1;
+	}
+	if (env.cpu >= nr_cpus) {
+		fprintf(stderr, "CPU %d is not a possible CPU\n", env.cpu);
+		return 1;
+	}
+	links = calloc(nr_cpus, sizeof(*links));
+	if (!links) {
+		fprintf(stderr, "failed to alloc links\n");
+		return 1;
+	}
+
+	obj = profile_bpf__open();
+	if (!obj) {
+		fprintf(stderr, "failed to open BPF object\n");
+		err = 1;
+		goto cleanup;
+	}
+
+	/* initialize global data (filtering options) */
+	obj->rodata->targ_pid = env.pid;
+	obj->rodata->targ_tid = env.tid;
+	obj->rodata->user_stacks_only = env.user_stacks_only;
+	obj->rodata->kernel_stacks_only = env.kernel_stacks_only;
+	obj->rodata->include_idle = env.include_idle;
+
+	bpf_map__set_value_size(obj->maps.stackmap,
+				env.perf_max_stack_depth * sizeof(unsigned long));
+	bpf_map__set_max_entries(obj->maps.stackmap, env.stack_storage_size);
+
+	err = profile_bpf__load(obj);
+	if (err) {
+		fprintf(stderr, "failed to load BPF programs\n");
+		goto cleanup;
+	}
+	ksyms = ksyms__load();
+	if (!ksyms) {
+		fprintf(stderr, "failed to load kallsyms\n");
+		err = 1;
+		goto cleanup;
+	}
+	syms_cache = syms_cache__new(0);
+	if (!syms_cache) {
+		fprintf(stderr, "failed to create syms_cache\n");
+		err = 1;
+		goto cleanup;
+	}
+
+	err = open_and_attach_perf_event(env.frequency, obj->progs.do_perf_event,
+					 links);
+	if (err)
+		goto cleanup;
+
+	signal(SIGINT, sig_handler);
+
+	if (!env.folded)
+		printf("Sampling at %d Hertz... Hit Ctrl-C to end.\n",
+		       env.frequency);
+
+	/*
+	 * We'll get sleep interrupted when someone presses Ctrl-C (which will
+	 * be "handled" with noop by sig_handler).
+	 */
+	sleep(env.duration);
+
+	print_map(ksyms, syms_cache, obj);
+
+cleanup:
+	if (links) {
+		for (i = 0; i < nr_cpus; i++)
+			bpf_link__destroy(links[i]);
+		free(links);
+	}
+	profile_bpf__destroy(obj);
+	syms_cache__free(syms_cache);
+	ksyms__free(ksyms);
+	return err != 0;
+}
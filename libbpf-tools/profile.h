@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause) */
+#ifndef __PROFILE_H
+#define __PROFILE_H
+
+#define TASK_COMM_LEN		16
+
+struct key_t {
+	__u32 pid;
+	int user_stack_id;
+	int kern_stack_id;
+	char name[TASK_COMM_LEN];
+};
+
+#endif /* __PROFILE_H */
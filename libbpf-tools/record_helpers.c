@@ -0,0 +1,170 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "record_helpers.h"
+
+#define RECORD_MAGIC		"BREC"
+#define RECORD_BUF_SIZE		(1 << 20)
+#define RECORD_FLUSH_NS		1000000000ULL
+
+struct record_writer {
+	FILE *f;
+	gzFile gz;
+	unsigned long long last_flush;
+};
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int output_format__parse(const char *name)
+{
+	if (!strcmp(name, "text"))
+		return OUTPUT_TEXT;
+	if (!strcmp(name, "binary"))
+		return OUTPUT_BINARY;
+	if (!strcmp(name, "binary-gz"))
+		return OUTPUT_BINARY_GZ;
+	return -1;
+}
+
+static int writer_put(struct record_writer *writer, const void *data,
+		      size_t size)
+{
+	if (writer->gz) {
+		if (gzwrite(writer->gz, data, size) != (int)size)
+			return -EIO;
+		return 0;
+	}
+	if (fwrite(data, 1, size, writer->f) != size)
+		return -errno;
+	return 0;
+}
+
+static int writer_put_str(struct record_writer *writer, const char *s,
+			  size_t len_size)
+{
+	size_t len = strlen(s);
+	__u16 len16 = len;
+	__u8 len8 = len;
+	int err;
+
+	if (len_size == sizeof(len8))
+		err = writer_put(writer, &len8, sizeof(len8));
+	else
+		err = writer_put(writer, &len16, sizeof(len16));
+	return err ?: writer_put(writer, s, len);
+}
+
+static int writer_put_header(struct record_writer *writer, const char *tool,
+			     const struct record_field *fields, int nr_fields)
+{
+	__u16 version = RECORD_VERSION, byte_order = 0x0102, nr = nr_fields;
+	__u8 type;
+	int i, err;
+
+	err = writer_put(writer, RECORD_MAGIC, 4);
+	err = err ?: writer_put(writer, &version, sizeof(version));
+	err = err ?: writer_put(writer, &byte_order, sizeof(byte_order));
+	err = err ?: writer_put_str(writer, tool, sizeof(__u16));
+	err = err ?: writer_put(writer, &nr, sizeof(nr));
+	for (i = 0; i < nr_fields && !err; i++) {
+		type = fields[i].type;
+		err = writer_put(writer, &type, sizeof(type));
+		err = err ?: writer_put_str(writer, fields[i].name, sizeof(__u8));
+		err = err ?: writer_put(writer, &fields[i].offset,
+					sizeof(fields[i].offset));
+		err = err ?: writer_put(writer, &fields[i].size,
+					sizeof(fields[i].size));
+	}
+	return err;
+}
+
+struct record_writer *record_writer__new(int fd, const char *tool,
+					 const struct record_field *fields,
+					 int nr_fields, bool compress)
+{
+	struct record_writer *writer;
+	int dup_fd, err;
+
+	writer = calloc(1, sizeof(*writer));
+	if (!writer)
+		return NULL;
+
+	/* the writer owns its fd, closing it doesn't close stdout */
+	dup_fd = dup(fd);
+	if (dup_fd < 0)
+		goto err_out;
+
+	if (compress) {
+		/* level 1, the point is to spend less CPU, not less disk */
+		writer->gz = gzdopen(dup_fd, "wb1");
+		if (!writer->gz) {
+			close(dup_fd);
+			goto err_out;
+		}
+		gzbuffer(writer->gz, RECORD_BUF_SIZE);
+	} else {
+		writer->f = fdopen(dup_fd, "w");
+		if (!writer->f) {
+			close(dup_fd);
+			goto err_out;
+		}
+		setvbuf(writer->f, NULL, _IOFBF, RECORD_BUF_SIZE);
+	}
+
+	err = writer_put_header(writer, tool, fields, nr_fields);
+	if (err) {
+		errno = -err;
+		goto err_out;
+	}
+	writer->last_flush = now_ns();
+	return writer;
+
+err_out:
+	record_writer__free(writer);
+	return NULL;
+}
+
+int record_writer__write(struct record_writer *writer, const void *data,
+			 size_t size)
+{
+	__u32 len = size;
+
+	return writer_put(writer, &len, sizeof(len)) ?:
+	       writer_put(writer, data, size);
+}
+
+int record_writer__flush(struct record_writer *writer)
+{
+	unsigned long long now = now_ns();
+
+	if (now - writer->last_flush < RECORD_FLUSH_NS)
+		return 0;
+	writer->last_flush = now;
+
+	if (writer->gz)
+		return gzflush(writer->gz, Z_SYNC_FLUSH) == Z_OK ? 0 : -EIO;
+	return fflush(writer->f) ? -errno : 0;
+}
+
+void record_writer__free(struct record_writer *writer)
+{
+	if (!writer)
+		return;
+
+	if (writer->gz)
+		gzclose(writer->gz);
+	if (writer->f)
+		fclose(writer->f);
+	free(writer);
+}
@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause) */
+#ifndef __RECORD_HELPERS_H
+#define __RECORD_HELPERS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <linux/types.h>
+
+/*
+ * Binary output of events, for tools whose output is parsed by programs.
+ * A stream starts with a header describing the records:
+ *
+ *	char magic[4]		"BREC"
+ *	__u16 version		RECORD_VERSION
+ *	__u16 byte_order	0x0102, in the byte order of all other fields
+ *	__u16 tool_len, then tool_len bytes of tool name
+ *	__u16 nr_fields, then for each field:
+ *		__u8 type	enum record_field_type
+ *		__u8 name_len, then name_len bytes of name
+ *		__u32 offset	in the record
+ *		__u32 size
+ *
+ * followed by records, each a __u32 length and that many bytes of the
+ * event as the BPF program sent it. A field that extends beyond the end
+ * of a record, like the arguments of execsnoop, is truncated. Compressed
+ * streams are all of the above in gzip format.
+ */
+#define RECORD_VERSION		1
+
+enum record_field_type {
+	RECORD_FIELD_INT,	/* signed integer of size bytes */
+	RECORD_FIELD_UINT,	/* unsigned integer of size bytes */
+	RECORD_FIELD_STR,	/* NUL padded string of up to size bytes */
+	RECORD_FIELD_BYTES,	/* raw bytes, e.g. IP addresses */
+};
+
+struct record_field {
+	const char *name;
+	enum record_field_type type;
+	__u32 offset;
+	__u32 size;
+};
+
+#define RECORD_FIELD(ty, field, rtype)				\
+	{ #field, rtype, offsetof(ty, field), sizeof(((ty *)0)->field) }
+#define RECORD_NR_FIELDS(fields)	(sizeof(fields) / sizeof((fields)[0]))
+
+enum output_format {
+	OUTPUT_TEXT,
+	OUTPUT_BINARY,
+	OUTPUT_BINARY_GZ,
+};
+
+#define OUTPUT_FORMAT_HELP	"Output format: text (default), binary or binary-gz"
+
+/* returns -1 for unknown format names */
+int output_format__parse(const char *name);
+
+struct record_writer;
+
+/* writes the header to fd, which is usually STDOUT_FILENO */
+struct record_writer *record_writer__new(int fd, const char *tool,
+					 const struct record_field *fields,
+					 int nr_fields, bool compress);
+int record_writer__write(struct record_writer *writer, const void *data,
+			 size_t size);
+/*
+ * Make written records visible to readers. Output is flushed at most once
+ * a second, so this can be called after every poll.
+ */
+int record_writer__flush(struct record_writer *writer);
+void record_writer__free(struct record_writer *writer);
+
+#endif /* __RECORD_HELPERS_H */
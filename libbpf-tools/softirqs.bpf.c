@@ -9,6 +9,7 @@
 
 const volatile bool targ_dist = false;
 const volatile bool targ_ns = false;
+const volatile bool use_percpu = false;
 
 struct {
 	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
@@ -20,6 +21,21 @@ struct {
 __u64 counts[NR_SOFTIRQS] = {};
 struct hist hists[NR_SOFTIRQS] = {};
 
+/* used instead of counts and hists with use_percpu */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, NR_SOFTIRQS);
+	__type(key, u32);
+	__type(value, u64);
+} percpu_counts SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, NR_SOFTIRQS);
+	__type(key, u32);
+	__type(value, struct hist);
+} percpu_hists SEC(".maps");
+
 SEC("tp_btf/softirq_entry")
 int BPF_PROG(softirq_entry, unsigned int vec_nr)
 {
@@ -49,16 +65,32 @@ int BPF_PROG(softirq_exit, unsigned int vec_nr)
 		delta /= 1000U;
 
 	if (!targ_dist) {
-		__sync_fetch_and_add(&counts[vec_nr], delta);
+		if (use_percpu) {
+			u64 *count = bpf_map_lookup_elem(&percpu_counts, &vec_nr);
+
+			if (count)
+				*count += delta;
+		} else {
+			__sync_fetch_and_add(&counts[vec_nr], delta);
+		}
 	} else {
 		struct hist *hist;
 		u64 slot;
 
-		hist = &hists[vec_nr];
+		if (use_percpu) {
+			hist = bpf_map_lookup_elem(&percpu_hists, &vec_nr);
+			if (!hist)
+				return 0;
+		} else {
+			hist = &hists[vec_nr];
+		}
 		slot = log2(delta);
 		if (slot >= MAX_SLOTS)
 			slot = MAX_SLOTS - 1;
-		__sync_fetch_and_add(&hist->slots[slot], 1);
+		if (use_percpu)
+			hist->slots[slot]++;
+		else
+			__sync_fetch_and_add(&hist->slots[slot], 1);
 	}
 
 	return 0;
@@ -15,6 +15,7 @@
 #include "softirqs.h"
 #include "softirqs.skel.h"
 #include "trace_helpers.h"
+#include "map_helpers.h"
 
 struct env {
 	bool distributed;
@@ -23,6 +24,7 @@ struct env {
 	int times;
 	bool timestamp;
 	bool verbose;
+	bool percpu;
 } env = {
 	.interval = 99999999,
 	.times = 99999999,
@@ -36,7 +38,7 @@ const char *argp_program_bug_address =
 const char argp_program_doc[] =
 "Summarize soft irq event time as histograms.\n"
 "\n"
-"USAGE: softirqs [--help] [-T] [-N] [-d] [interval] [count]\n"
+"USAGE: softirqs [--help] [-T] [-N] [-d] [--percpu] [interval] [count]\n"
 "\n"
 "EXAMPLES:\n"
 "    softirqss            # sum soft irq event time\n"
@@ -44,10 +46,14 @@ const char argp_program_doc[] =
 "    softirqss 1 10       # print 1 second summaries, 10 times\n"
 "    softirqss -NT 1      # 1s summaries, nanoseconds, and timestamps\n";
 
+#define OPT_PERCPU	1 /* --percpu */
+
 static const struct argp_option opts[] = {
 	{ "distributed", 'd', NULL, 0, "Show distributions as histograms" },
 	{ "timestamp", 'T', NULL, 0, "Include timestamp on output" },
 	{ "nanoseconds", 'N', NULL, 0, "Output in nanoseconds" },
+	{ "percpu", OPT_PERCPU, NULL, 0,
+	  "Count in per-CPU maps, avoids contention on machines with many CPUs" },
 	{ "verbose", 'v', NULL, 0, "Verbose debug output" },
 	{ NULL, 'h', NULL, OPTION_HIDDEN, "Show the full help" },
 	{},
@@ -73,6 +79,9 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 	case 'T':
 		env.timestamp = true;
 		break;
+	case OPT_PERCPU:
+		env.percpu = true;
+		break;
 	case ARGP_KEY_ARG:
 		errno = 0;
 		if (pos_args == 0) {
@@ -179,6 +188,65 @@ static int print_hist(struct softirqs_bpf__bss *bss)
 	return 0;
 }
 
+/*
+ * Per-CPU counters are never reset, so the per-CPU variants keep the sums
+ * of the previous interval and print what was added since.
+ */
+static int print_percpu_count(int fd)
+{
+	const char *units = env.nanoseconds ? "nsecs" : "usecs";
+	static __u64 last[NR_SOFTIRQS];
+	__u64 count;
+	__u32 vec;
+
+	printf("%-16s %6s%5s\n", "SOFTIRQ", "TOTAL_", units);
+
+	for (vec = 0; vec < NR_SOFTIRQS; vec++) {
+		if (lookup_percpu(fd, &vec, &count, sizeof(count),
+				  percpu_sum_u64)) {
+			fprintf(stderr, "failed to read counts: %s\n",
+				strerror(errno));
+			return -1;
+		}
+		if (count > last[vec])
+			printf("%-16s %11llu\n", vec_names[vec],
+			       count - last[vec]);
+		last[vec] = count;
+	}
+
+	return 0;
+}
+
+static int print_percpu_hist(int fd)
+{
+	const char *units = env.nanoseconds ? "nsecs" : "usecs";
+	static struct hist last[NR_SOFTIRQS];
+	struct hist hist;
+	__u32 vec, i;
+
+	for (vec = 0; vec < NR_SOFTIRQS; vec++) {
+		if (lookup_percpu(fd, &vec, &hist, sizeof(hist),
+				  percpu_sum_u32)) {
+			fprintf(stderr, "failed to read hists: %s\n",
+				strerror(errno));
+			return -1;
+		}
+		for (i = 0; i < MAX_SLOTS; i++) {
+			__u32 total = hist.slots[i];
+
+			hist.slots[i] -= last[vec].slots[i];
+			last[vec].slots[i] = total;
+		}
+		if (!memcmp(&zero, &hist, sizeof(hist)))
+			continue;
+		printf("softirq = %s\n", vec_names[vec]);
+		print_log2_hist(hist.slots, MAX_SLOTS, units);
+		printf("\n");
+	}
+
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	static const struct argp argp = {
@@ -208,6 +276,7 @@ int main(int argc, char **argv)
 	/* initialize global data (filtering options) */
 	obj->rodata->targ_dist = env.distributed;
 	obj->rodata->targ_ns = env.nanoseconds;
+	obj->rodata->use_percpu = env.percpu;
 
 	err = softirqs_bpf__load(obj);
 	if (err) {
@@ -215,7 +284,7 @@ int main(int argc, char **argv)
 		goto cleanup;
 	}
 
-	if (!obj->bss) {
+	if (!env.percpu && !obj->bss) {
 		fprintf(stderr, "Memory-mapping BPF maps is supported starting from Linux 5.7, please upgrade.\n");
 		goto cleanup;
 	}
@@ -242,7 +311,11 @@ int main(int argc, char **argv)
 			printf("%-8s\n", ts);
 		}
 
-		if (!env.distributed)
+		if (env.percpu && !env.distributed)
+			err = print_percpu_count(bpf_map__fd(obj->maps.percpu_counts));
+		else if (env.percpu)
+			err = print_percpu_hist(bpf_map__fd(obj->maps.percpu_hists));
+		else if (!env.distributed)
 			err = print_count(obj->bss);
 		else
 			err = print_hist(obj->bss);
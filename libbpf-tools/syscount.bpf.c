@@ -14,6 +14,7 @@ const volatile bool measure_latency = false;
 const volatile bool filter_failed = false;
 const volatile int filter_errno = false;
 const volatile pid_t filter_pid = 0;
+const volatile bool use_percpu = false;
 
 struct {
 	__uint(type, BPF_MAP_TYPE_HASH);
@@ -31,6 +32,15 @@ struct {
 	__uint(map_flags, BPF_F_NO_PREALLOC);
 } data SEC(".maps");
 
+/* used instead of data with use_percpu, for machines with many CPUs */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+	__uint(max_entries, MAX_ENTRIES);
+	__type(key, u32);
+	__type(value, struct data_t);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+} percpu_data SEC(".maps");
+
 static __always_inline
 void save_proc_name(struct data_t *val)
 {
@@ -88,7 +98,10 @@ int sys_exit(struct trace_event_raw_sys_exit *args)
 	}
 
 	key = (count_by_process) ? pid : args->id;
-	val = bpf_map_lookup_or_try_init(&data, &key, &zero);
+	if (use_percpu)
+		val = bpf_map_lookup_or_try_init(&percpu_data, &key, &zero);
+	else
+		val = bpf_map_lookup_or_try_init(&data, &key, &zero);
 	if (val) {
 		__sync_fetch_and_add(&val->count, 1);
 		if (count_by_process)
@@ -13,6 +13,7 @@
 #include "errno_helpers.h"
 #include "syscall_helpers.h"
 #include "trace_helpers.h"
+#include "map_helpers.h"
 
 /* This structure extends data_t by adding a key item which should be sorted
  * together with the count and total_ns fields */
@@ -41,6 +42,8 @@ static const char argp_program_doc[] =
 "    syscount -e ENOENT -i 5  # count only syscalls failed with a given errno"
 ;
 
+#define OPT_PERCPU	1 /* --percpu */
+
 static const struct argp_option opts[] = {
 	{ "verbose", 'v', NULL, 0, "Verbose debug output" },
 	{ "pid", 'p', "PID", 0, "Process PID to trace" },
@@ -56,6 +59,8 @@ static const struct argp_option opts[] = {
 	{ "errno", 'e', "ERRNO", 0, "Trace only syscalls that return this error"
 				 "(numeric or EPERM, etc.)" },
 	{ "list", 'l', NULL, 0, "Print list of recognized syscalls and exit" },
+	{ "percpu", OPT_PERCPU, NULL, 0,
+	  "Count in per-CPU maps, avoids contention on machines with many CPUs" },
 	{ NULL, 'h', NULL, OPTION_HIDDEN, "Show the full help" },
 	{},
 };
@@ -67,6 +72,7 @@ static struct env {
 	bool verbose;
 	bool latency;
 	bool process;
+	bool percpu;
 	int filter_errno;
 	int interval;
 	int duration;
@@ -186,48 +192,88 @@ static void print_timestamp()
 
 static bool batch_map_ops = true; /* hope for the best */
 
+static void syscount_reduce(void *sum, const void *value, __u32 value_size)
+{
+	const struct data_t *v = value;
+	struct data_t *s = sum;
+
+	s->count += v->count;
+	s->total_ns += v->total_ns;
+	if (v->comm[0])
+		memcpy(s->comm, v->comm, TASK_COMM_LEN);
+}
+
+/* size of the value of one key in a lookup */
+static size_t value_stride(void)
+{
+	if (env.percpu)
+		return percpu_nr_cpus() * percpu_value_size(sizeof(struct data_t));
+	return sizeof(struct data_t);
+}
+
+static void set_val(struct data_ext_t *ext, __u32 key, const void *value)
+{
+	struct data_t val;
+
+	if (env.percpu) {
+		reduce_percpu(value, &val, sizeof(val), syscount_reduce);
+		value = &val;
+	}
+	ext->count = ((const struct data_t *)value)->count;
+	ext->total_ns = ((const struct data_t *)value)->total_ns;
+	ext->key = key;
+	memcpy(ext->comm, ((const struct data_t *)value)->comm, TASK_COMM_LEN);
+}
+
 static bool read_vals_batch(int fd, struct data_ext_t *vals, __u32 *count)
 {
-	struct data_t orig_vals[*count];
+	size_t stride = value_stride();
 	void *in = NULL, *out;
 	__u32 i, n, n_read = 0;
 	__u32 keys[*count];
+	char *orig_vals;
 	int err = 0;
 
+	orig_vals = malloc(*count * stride);
+	if (!orig_vals) {
+		warn("failed to alloc values\n");
+		return false;
+	}
+
 	while (n_read < *count && !err) {
 		n = *count - n_read;
 		err = bpf_map_lookup_and_delete_batch(fd, &in, &out,
-				keys + n_read, orig_vals + n_read, &n, NULL);
+				keys + n_read, orig_vals + n_read * stride,
+				&n, NULL);
 		if (err && errno != ENOENT) {
 			/* we want to propagate EINVAL upper, so that
 			 * the batch_map_ops flag is set to false */
 			if (errno != EINVAL)
 				warn("bpf_map_lookup_and_delete_batch: %s\n",
 				     strerror(-err));
+			free(orig_vals);
 			return false;
 		}
 		n_read += n;
 		in = out;
 	}
 
-	for (i = 0; i < n_read; i++) {
-		vals[i].count = orig_vals[i].count;
-		vals[i].total_ns = orig_vals[i].total_ns;
-		vals[i].key = keys[i];
-		strncpy(vals[i].comm, orig_vals[i].comm, TASK_COMM_LEN);
-	}
+	for (i = 0; i < n_read; i++)
+		set_val(&vals[i], keys[i], orig_vals + i * stride);
 
+	free(orig_vals);
 	*count = n_read;
 	return true;
 }
 
 static bool read_vals(int fd, struct data_ext_t *vals, __u32 *count)
 {
+	size_t stride = value_stride();
 	__u32 keys[MAX_ENTRIES];
-	struct data_t val;
 	__u32 key = -1;
 	__u32 next_key;
 	int i = 0, j;
+	void *val;
 	int err;
 
 	if (batch_map_ops) {
@@ -254,17 +300,21 @@ static bool read_vals(int fd, struct data_ext_t *vals, __u32 *count)
 		key = keys[i++] = next_key;
 	}
 
+	val = malloc(stride);
+	if (!val) {
+		warn("failed to alloc value\n");
+		return false;
+	}
 	for (j = 0; j < i; j++) {
-		err = bpf_map_lookup_elem(fd, &keys[j], &val);
+		err = bpf_map_lookup_elem(fd, &keys[j], val);
 		if (err && errno != ENOENT) {
 			warn("failed to lookup element: %s\n", strerror(errno));
+			free(val);
 			return false;
 		}
-		vals[j].count = val.count;
-		vals[j].total_ns = val.total_ns;
-		vals[j].key = keys[j];
-		memcpy(vals[j].comm, val.comm, TASK_COMM_LEN);
+		set_val(&vals[j], keys[j], val);
 	}
+	free(val);
 
 	/* There is a race here: system calls which are represented by keys
 	 * above and happened between lookup and delete will be ignored.  This
@@ -298,6 +348,9 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 	case 'x':
 		env.failures = true;
 		break;
+	case OPT_PERCPU:
+		env.percpu = true;
+		break;
 	case 'L':
 		env.latency = true;
 		break;
@@ -411,6 +464,14 @@ int main(int argc, char **argv)
 		obj->rodata->count_by_process = true;
 	if (env.filter_errno)
 		obj->rodata->filter_errno = env.filter_errno;
+	if (env.percpu) {
+		if (percpu_nr_cpus() < 0) {
+			warn("failed to get # of possible cpus\n");
+			err = 1;
+			goto cleanup_obj;
+		}
+		obj->rodata->use_percpu = true;
+	}
 
 	err = syscount_bpf__load(obj);
 	if (err) {
@@ -454,7 +515,8 @@ int main(int argc, char **argv)
 			continue;
 
 		count = MAX_ENTRIES;
-		if (!read_vals(bpf_map__fd(obj->maps.data), vals, &count))
+		if (!read_vals(bpf_map__fd(env.percpu ? obj->maps.percpu_data :
+					   obj->maps.data), vals, &count))
 			break;
 		if (!count)
 			continue;
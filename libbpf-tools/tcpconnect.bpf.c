@@ -7,6 +7,7 @@
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_core_read.h>
 #include <bpf/bpf_tracing.h>
+#include "compat.bpf.h"
 
 #include "maps.bpf.h"
 #include "tcpconnect.h"
@@ -45,12 +46,6 @@ struct {
 	__uint(map_flags, BPF_F_NO_PREALLOC);
 } ipv6_count SEC(".maps");
 
-struct {
-	__uint(type, BPF_MAP_TYPE_PERF_EVENT_ARRAY);
-	__uint(key_size, sizeof(u32));
-	__uint(value_size, sizeof(u32));
-} events SEC(".maps");
-
 static __always_inline bool filter_port(__u16 port)
 {
 	int i;
@@ -129,8 +124,7 @@ trace_v4(struct pt_regs *ctx, pid_t pid, struct sock *sk, __u16 dport)
 	event.dport = dport;
 	bpf_get_current_comm(event.task, sizeof(event.task));
 
-	bpf_perf_event_output(ctx, &events, BPF_F_CURRENT_CPU,
-			      &event, sizeof(event));
+	submit_buf(ctx, &event, sizeof(event));
 }
 
 static __always_inline void
@@ -149,8 +143,7 @@ trace_v6(struct pt_regs *ctx, pid_t pid, struct sock *sk, __u16 dport)
 	event.dport = dport;
 	bpf_get_current_comm(event.task, sizeof(event.task));
 
-	bpf_perf_event_output(ctx, &events, BPF_F_CURRENT_CPU,
-			      &event, sizeof(event));
+	submit_buf(ctx, &event, sizeof(event));
 }
 
 static __always_inline int
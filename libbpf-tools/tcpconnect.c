@@ -14,9 +14,15 @@
 #include "tcpconnect.skel.h"
 #include "trace_helpers.h"
 #include "map_helpers.h"
+#include "compat.h"
+#include "record_helpers.h"
 
 #define warn(...) fprintf(stderr, __VA_ARGS__)
 
+#define EVENT_QUEUE_SLOTS	8192
+
+#define OPT_OUTPUT		1 /* --output */
+
 static volatile sig_atomic_t exiting = 0;
 
 const char *argp_program_version = "tcpconnect 0.1";
@@ -36,6 +42,7 @@ static const char argp_program_doc[] =
 	"    tcpconnect -c          # count connects per src, dest, port\n"
 	"    tcpconnect --C mappath # only trace cgroups in the map\n"
 	"    tcpconnect --M mappath # only trace mount namespaces in the map\n"
+	"    tcpconnect --output binary # write binary records\n"
 	;
 
 static int get_int(const char *arg, int *ret, int min, int max)
@@ -113,6 +120,7 @@ static const struct argp_option opts[] = {
 	  "Comma-separated list of destination ports to trace" },
 	{ "cgroupmap", 'C', "PATH", 0, "trace cgroups in this map" },
 	{ "mntnsmap", 'M', "PATH", 0, "trace mount namespaces in this map" },
+	{ "output", OPT_OUTPUT, "FORMAT", 0, OUTPUT_FORMAT_HELP },
 	{ NULL, 'h', NULL, OPTION_HIDDEN, "Show the full help" },
 	{},
 };
@@ -126,6 +134,7 @@ static struct env {
 	uid_t uid;
 	int nports;
 	int ports[MAX_PORTS];
+	int output;
 } env = {
 	.uid = (uid_t) -1,
 };
@@ -180,6 +189,13 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 	case 'M':
 		warn("not implemented: --mntnsmap");
 		break;
+	case OPT_OUTPUT:
+		env.output = output_format__parse(arg);
+		if (env.output < 0) {
+			warn("invalid output format: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
 	default:
 		return ARGP_ERR_UNKNOWN;
 	}
@@ -269,6 +285,21 @@ static void print_count(int map_fd_ipv4, int map_fd_ipv6)
 	print_count_ipv6(map_fd_ipv6);
 }
 
+static struct record_writer *writer;
+
+static const struct record_field record_fields[] = {
+	/* the first 4 bytes for IPv4 */
+	RECORD_FIELD(struct event, saddr_v6, RECORD_FIELD_BYTES),
+	RECORD_FIELD(struct event, daddr_v6, RECORD_FIELD_BYTES),
+	RECORD_FIELD(struct event, task, RECORD_FIELD_STR),
+	RECORD_FIELD(struct event, ts_us, RECORD_FIELD_UINT),
+	RECORD_FIELD(struct event, af, RECORD_FIELD_UINT),
+	RECORD_FIELD(struct event, pid, RECORD_FIELD_UINT),
+	RECORD_FIELD(struct event, uid, RECORD_FIELD_UINT),
+	/* network byte order */
+	RECORD_FIELD(struct event, dport, RECORD_FIELD_BYTES),
+};
+
 static void print_events_header()
 {
 	if (env.print_timestamp)
@@ -279,7 +310,7 @@ static void print_events_header()
 	       "PID", "COMM", "IP", "SADDR", "DADDR", "DPORT");
 }
 
-static void handle_event(void *ctx, int cpu, void *data, __u32 data_sz)
+static int handle_event(void *ctx, void *data, size_t data_sz)
 {
 	const struct event *event = data;
 	char src[INET6_ADDRSTRLEN];
@@ -290,6 +321,11 @@ static void handle_event(void *ctx, int cpu, void *data, __u32 data_sz)
 	} s, d;
 	static __u64 start_ts;
 
+	if (writer) {
+		record_writer__write(writer, data, data_sz);
+		return 0;
+	}
+
 	if (event->af == AF_INET) {
 		s.x4.s_addr = event->saddr_v4;
 		d.x4.s_addr = event->daddr_v4;
@@ -298,7 +334,7 @@ static void handle_event(void *ctx, int cpu, void *data, __u32 data_sz)
 		memcpy(&d.x6.s6_addr, event->daddr_v6, sizeof(d.x6.s6_addr));
 	} else {
 		warn("broken event: event->af=%d", event->af);
-		return;
+		return 0;
 	}
 
 	if (env.print_timestamp) {
@@ -316,39 +352,52 @@ static void handle_event(void *ctx, int cpu, void *data, __u32 data_sz)
 	       inet_ntop(event->af, &s, src, sizeof(src)),
 	       inet_ntop(event->af, &d, dst, sizeof(dst)),
 	       ntohs(event->dport));
+	return 0;
 }
 
-static void handle_lost_events(void *ctx, int cpu, __u64 lost_cnt)
-{
-	warn("Lost %llu events on CPU #%d!\n", lost_cnt, cpu);
-}
-
-static void print_events(int perf_map_fd)
+static void print_events(struct bpf_buffer *buf)
 {
-	struct perf_buffer *pb;
 	int err;
 
-	pb = perf_buffer__new(perf_map_fd, 128,
-			      handle_event, handle_lost_events, NULL, NULL);
-	if (!pb) {
-		err = -errno;
-		warn("failed to open perf buffer: %d\n", err);
+	/* binary records are written straight out of the buffer */
+	if (env.output != OUTPUT_TEXT) {
+		writer = record_writer__new(STDOUT_FILENO, "tcpconnect",
+					    record_fields,
+					    RECORD_NR_FIELDS(record_fields),
+					    env.output == OUTPUT_BINARY_GZ);
+		if (!writer) {
+			warn("failed to set up binary output: %d\n", -errno);
+			return;
+		}
+	} else {
+		err = bpf_buffer__set_async(buf, EVENT_QUEUE_SLOTS,
+					    sizeof(struct event));
+		if (err) {
+			warn("failed to set up event queue: %d\n", err);
+			return;
+		}
+		print_events_header();
+	}
+
+	err = bpf_buffer__open(buf, handle_event, NULL);
+	if (err) {
+		warn("failed to open ring/perf buffer: %d\n", err);
 		goto cleanup;
 	}
 
-	print_events_header();
 	while (!exiting) {
-		err = perf_buffer__poll(pb, 100);
+		err = bpf_buffer__poll(buf, POLL_TIMEOUT_MS);
 		if (err < 0 && err != -EINTR) {
-			warn("error polling perf buffer: %s\n", strerror(-err));
-			goto cleanup;
+			warn("error polling ring/perf buffer: %s\n", strerror(-err));
+			break;
 		}
-		/* reset err to return 0 if exiting */
-		err = 0;
+		if (writer)
+			record_writer__flush(writer);
 	}
 
+	bpf_buffer__print_stats(buf);
 cleanup:
-	perf_buffer__free(pb);
+	record_writer__free(writer);
 }
 
 int main(int argc, char **argv)
@@ -359,6 +408,7 @@ int main(int argc, char **argv)
 		.doc = argp_program_doc,
 		.args_doc = NULL,
 	};
+	struct bpf_buffer *buf = NULL;
 	struct tcpconnect_bpf *obj;
 	int i, err;
 
@@ -388,6 +438,13 @@ int main(int argc, char **argv)
 		}
 	}
 
+	buf = bpf_buffer__new(obj->maps.events, obj->maps.events_lost);
+	if (!buf) {
+		err = -errno;
+		warn("failed to create ring/perf buffer: %d\n", err);
+		goto cleanup;
+	}
+
 	err = tcpconnect_bpf__load(obj);
 	if (err) {
 		warn("failed to load BPF object: %d\n", err);
@@ -410,10 +467,11 @@ int main(int argc, char **argv)
 		print_count(bpf_map__fd(obj->maps.ipv4_count),
 			    bpf_map__fd(obj->maps.ipv6_count));
 	} else {
-		print_events(bpf_map__fd(obj->maps.events));
+		print_events(buf);
 	}
 
 cleanup:
+	bpf_buffer__free(buf);
 	tcpconnect_bpf__destroy(obj);
 
 	return err != 0;
@@ -34,6 +34,43 @@
 
 #define MKDEV(ma, mi)	(((ma) << MINORBITS) | (mi))
 
+/*
+ * Direct-mapped cache of address lookups. Stack traces keep hitting the
+ * same few return addresses, so most lookups are answered without a
+ * binary search. Only found symbols are cached.
+ */
+#define KSYMS_ADDR_CACHE_BITS	10
+#define SYMS_ADDR_CACHE_BITS	8
+
+struct addr_cache_entry {
+	unsigned long addr;
+	const void *sym;
+};
+
+static inline unsigned int addr_cache__slot(unsigned long addr, int bits)
+{
+	return (unsigned int)(((unsigned long long)addr * 0x9e3779b97f4a7c15ULL) >>
+			      (64 - bits));
+}
+
+static inline const void *
+addr_cache__lookup(const struct addr_cache_entry *cache, int bits,
+		   unsigned long addr)
+{
+	const struct addr_cache_entry *e = &cache[addr_cache__slot(addr, bits)];
+
+	return e->sym && e->addr == addr ? e->sym : NULL;
+}
+
+static inline void addr_cache__store(struct addr_cache_entry *cache, int bits,
+				     unsigned long addr, const void *sym)
+{
+	struct addr_cache_entry *e = &cache[addr_cache__slot(addr, bits)];
+
+	e->addr = addr;
+	e->sym = sym;
+}
+
 struct ksyms {
 	struct ksym *syms;
 	int syms_sz;
@@ -41,6 +78,7 @@ struct ksyms {
 	char *strs;
 	int strs_sz;
 	int strs_cap;
+	struct addr_cache_entry cache[1 << KSYMS_ADDR_CACHE_BITS];
 };
 
 static int ksyms__add_symbol(struct ksyms *ksyms, const char *name, unsigned long addr)
@@ -145,8 +183,8 @@ void ksyms__free(struct ksyms *ksyms)
 	free(ksyms);
 }
 
-const struct ksym *ksyms__map_addr(const struct ksyms *ksyms,
-				   unsigned long addr)
+static const struct ksym *ksyms__search(const struct ksyms *ksyms,
+					unsigned long addr)
 {
 	int start = 0, end = ksyms->syms_sz - 1, mid;
 	unsigned long sym_addr;
@@ -167,6 +205,22 @@ const struct ksym *ksyms__map_addr(const struct ksyms *ksyms,
 	return NULL;
 }
 
+const struct ksym *ksyms__map_addr(const struct ksyms *ksyms,
+				   unsigned long addr)
+{
+	/* the cache is not part of what ksyms are, see trace_helpers.h */
+	struct addr_cache_entry *cache = ((struct ksyms *)ksyms)->cache;
+	const struct ksym *ksym;
+
+	ksym = addr_cache__lookup(cache, KSYMS_ADDR_CACHE_BITS, addr);
+	if (ksym)
+		return ksym;
+	ksym = ksyms__search(ksyms, addr);
+	if (ksym)
+		addr_cache__store(cache, KSYMS_ADDR_CACHE_BITS, addr, ksym);
+	return ksym;
+}
+
 const struct ksym *ksyms__get_symbol(const struct ksyms *ksyms,
 				     const char *name)
 {
@@ -194,19 +248,34 @@ enum elf_type {
 	UNKNOWN,
 };
 
-struct dso {
+/*
+ * Symbols of one file. A table is shared by the dsos of all processes that
+ * map the same file, looked up by device and inode so that a file reached
+ * by different paths, e.g. from another mount namespace, is still loaded
+ * once. Mappings without an inode, like [vdso], are looked up by path. The
+ * ELF is only opened by the first lookup in any of the dsos.
+ */
+struct dso_syms {
+	struct dso_syms *next;
 	char *name;
-	struct load_range *ranges;
-	int range_sz;
+	uint64_t dev_major;
+	uint64_t dev_minor;
+	uint64_t inode;
+	int refcnt;
+
 	/* Dyn's first text section virtual addr at execution */
 	uint64_t sh_addr;
 	/* Dyn's first text section file offset */
 	uint64_t sh_offset;
 	enum elf_type type;
 
+	bool probed;
+	bool loaded;
 	struct sym *syms;
 	int syms_sz;
 	int syms_cap;
+	/* bytes of syms and symbol names, counted in dso_tables.mem */
+	size_t mem;
 
 	/*
 	 * libbpf's struct btf is actually a pretty efficient
@@ -216,6 +285,20 @@ struct dso {
 	struct btf *btf;
 };
 
+struct dso {
+	struct load_range *ranges;
+	int range_sz;
+	struct dso_syms *table;
+};
+
+static struct {
+	struct dso_syms **buckets;
+	size_t nr_buckets;
+	size_t cnt;
+	/* bytes of all loaded symbol tables */
+	size_t mem;
+} dso_tables;
+
 struct map {
 	uint64_t start_addr;
 	uint64_t end_addr;
@@ -228,6 +311,8 @@ struct map {
 struct syms {
 	struct dso *dsos;
 	int dso_sz;
+	/* allocated by the first lookup */
+	struct addr_cache_entry *cache;
 };
 
 static bool is_file_backed(const char *mapname)
@@ -310,14 +395,169 @@ err_out:
 	return err;
 }
 
+static size_t dso_syms__hash(const char *name, const struct map *map)
+{
+	size_t h = 2166136261u;
+
+	if (map->inode)
+		return (map->inode * 0x9e3779b97f4a7c15ULL) ^
+		       ((map->dev_major << 20 | map->dev_minor) * 0x61c88647);
+	while (*name)
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+	return h;
+}
+
+static bool dso_syms__match(const struct dso_syms *t, const struct map *map,
+			    const char *name)
+{
+	if (t->inode != map->inode)
+		return false;
+	if (map->inode)
+		return t->dev_major == map->dev_major &&
+		       t->dev_minor == map->dev_minor;
+	return !strcmp(t->name, name);
+}
+
+static int dso_tables__grow(void)
+{
+	size_t i, nr_buckets, idx;
+	struct dso_syms **buckets, *t, *next;
+
+	nr_buckets = dso_tables.nr_buckets ? dso_tables.nr_buckets * 2 : 64;
+	buckets = calloc(nr_buckets, sizeof(*buckets));
+	if (!buckets)
+		return -1;
+
+	for (i = 0; i < dso_tables.nr_buckets; i++) {
+		for (t = dso_tables.buckets[i]; t; t = next) {
+			struct map map = {
+				.dev_major = t->dev_major,
+				.dev_minor = t->dev_minor,
+				.inode = t->inode,
+			};
+
+			next = t->next;
+			idx = dso_syms__hash(t->name, &map) & (nr_buckets - 1);
+			t->next = buckets[idx];
+			buckets[idx] = t;
+		}
+	}
+
+	free(dso_tables.buckets);
+	dso_tables.buckets = buckets;
+	dso_tables.nr_buckets = nr_buckets;
+	return 0;
+}
+
+static void dso_syms__free_syms(struct dso_syms *t)
+{
+	free(t->syms);
+	btf__free(t->btf);
+	t->syms = NULL;
+	t->syms_sz = 0;
+	t->syms_cap = 0;
+	t->btf = NULL;
+	dso_tables.mem -= t->mem;
+	t->mem = 0;
+}
+
+/* Find out how to read the symbols of the file on its first lookup */
+static void dso_syms__probe(struct dso_syms *t)
+{
+	int type;
+
+	if (t->probed)
+		return;
+	t->probed = true;
+
+	type = get_elf_type(t->name);
+	if (type == ET_EXEC) {
+		t->type = EXEC;
+	} else if (type == ET_DYN) {
+		t->type = DYN;
+		if (get_elf_text_scn_info(t->name, &t->sh_addr,
+					  &t->sh_offset) < 0)
+			t->type = UNKNOWN;
+	} else if (is_perf_map(t->name)) {
+		t->type = PERF_MAP;
+	} else if (is_vdso(t->name)) {
+		t->type = VDSO;
+	} else {
+		t->type = UNKNOWN;
+	}
+}
+
+static struct dso_syms *dso_syms__get(const struct map *map, const char *name)
+{
+	struct dso_syms *t;
+	size_t idx;
+
+	if (dso_tables.nr_buckets) {
+		idx = dso_syms__hash(name, map) & (dso_tables.nr_buckets - 1);
+		for (t = dso_tables.buckets[idx]; t; t = t->next) {
+			if (dso_syms__match(t, map, name)) {
+				t->refcnt++;
+				return t;
+			}
+		}
+	}
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+	t->name = strdup(name);
+	if (!t->name)
+		goto err_out;
+	t->dev_major = map->dev_major;
+	t->dev_minor = map->dev_minor;
+	t->inode = map->inode;
+
+	if (dso_tables.cnt >= dso_tables.nr_buckets && dso_tables__grow())
+		goto err_out;
+	idx = dso_syms__hash(name, map) & (dso_tables.nr_buckets - 1);
+	t->next = dso_tables.buckets[idx];
+	dso_tables.buckets[idx] = t;
+	dso_tables.cnt++;
+	t->refcnt = 1;
+	return t;
+
+err_out:
+	free(t->name);
+	free(t);
+	return NULL;
+}
+
+static void dso_syms__put(struct dso_syms *t)
+{
+	struct dso_syms **p;
+	struct map map;
+
+	if (!t || --t->refcnt > 0)
+		return;
+
+	map.dev_major = t->dev_major;
+	map.dev_minor = t->dev_minor;
+	map.inode = t->inode;
+	p = &dso_tables.buckets[dso_syms__hash(t->name, &map) &
+				(dso_tables.nr_buckets - 1)];
+	while (*p != t)
+		p = &(*p)->next;
+	*p = t->next;
+	dso_tables.cnt--;
+
+	dso_syms__free_syms(t);
+	free(t->name);
+	free(t);
+}
+
 static int syms__add_dso(struct syms *syms, struct map *map, const char *name)
 {
 	struct dso *dso = NULL;
-	int i, type;
+	int i;
 	void *tmp;
 
 	for (i = 0; i < syms->dso_sz; i++) {
-		if (!strcmp(syms->dsos[i].name, name)) {
+		if (!strcmp(syms->dsos[i].table->name, name)) {
 			dso = &syms->dsos[i];
 			break;
 		}
@@ -329,10 +569,12 @@ static int syms__add_dso(struct syms *syms, struct map *map, const char *name)
 		if (!tmp)
 			return -1;
 		syms->dsos = tmp;
-		dso = &syms->dsos[syms->dso_sz++];
+		dso = &syms->dsos[syms->dso_sz];
 		memset(dso, 0, sizeof(*dso));
-		dso->name = strdup(name);
-		dso->btf = btf__new_empty();
+		dso->table = dso_syms__get(map, name);
+		if (!dso->table)
+			return -1;
+		syms->dso_sz++;
 	}
 
 	tmp = realloc(dso->ranges, (dso->range_sz + 1) * sizeof(*dso->ranges));
@@ -343,20 +585,6 @@ static int syms__add_dso(struct syms *syms, struct map *map, const char *name)
 	dso->ranges[dso->range_sz].end = map->end_addr;
 	dso->ranges[dso->range_sz].file_off = map->file_off;
 	dso->range_sz++;
-	type = get_elf_type(name);
-	if (type == ET_EXEC) {
-		dso->type = EXEC;
-	} else if (type == ET_DYN) {
-		dso->type = DYN;
-		if (get_elf_text_scn_info(name, &dso->sh_addr, &dso->sh_offset) < 0)
-			return -1;
-	} else if (is_perf_map(name)) {
-		dso->type = PERF_MAP;
-	} else if (is_vdso(name)) {
-		dso->type = VDSO;
-	} else {
-		dso->type = UNKNOWN;
-	}
 	return 0;
 }
 
@@ -373,11 +601,14 @@ static struct dso *syms__find_dso(const struct syms *syms, unsigned long addr,
 			range = &dso->ranges[j];
 			if (addr <= range->start || addr >= range->end)
 				continue;
-			if (dso->type == DYN || dso->type == VDSO) {
+			dso_syms__probe(dso->table);
+			if (dso->table->type == DYN ||
+			    dso->table->type == VDSO) {
 				/* Offset within the mmap */
 				*offset = addr - range->start + range->file_off;
 				/* Offset within the ELF for dyn symbol lookup */
-				*offset += dso->sh_addr - dso->sh_offset;
+				*offset += dso->table->sh_addr -
+					   dso->table->sh_offset;
 			} else {
 				*offset = addr;
 			}
@@ -389,35 +620,41 @@ static struct dso *syms__find_dso(const struct syms *syms, unsigned long addr,
 	return NULL;
 }
 
-static int dso__load_sym_table_from_perf_map(struct dso *dso)
+static int dso_syms__load_from_perf_map(struct dso_syms *t)
 {
 	return -1;
 }
 
-static int dso__add_sym(struct dso *dso, const char *name, uint64_t start,
-			uint64_t size)
+static int dso_syms__add_sym(struct dso_syms *t, const char *name,
+			     uint64_t start, uint64_t size)
 {
 	struct sym *sym;
 	size_t new_cap;
 	void *tmp;
 	int off;
 
-	off = btf__add_str(dso->btf, name);
+	off = btf__add_str(t->btf, name);
 	if (off < 0)
 		return off;
 
-	if (dso->syms_sz + 1 > dso->syms_cap) {
-		new_cap = dso->syms_cap * 4 / 3;
+	if (t->syms_sz + 1 > t->syms_cap) {
+		new_cap = t->syms_cap * 4 / 3;
 		if (new_cap < 1024)
 			new_cap = 1024;
-		tmp = realloc(dso->syms, sizeof(*dso->syms) * new_cap);
+		tmp = realloc(t->syms, sizeof(*t->syms) * new_cap);
 		if (!tmp)
 			return -1;
-		dso->syms = tmp;
-		dso->syms_cap = new_cap;
+		t->syms = tmp;
+		t->mem += (new_cap - t->syms_cap) * sizeof(*t->syms);
+		dso_tables.mem += (new_cap - t->syms_cap) * sizeof(*t->syms);
+		t->syms_cap = new_cap;
 	}
 
-	sym = &dso->syms[dso->syms_sz++];
+	/* names are deduplicated, so this overestimates a little */
+	t->mem += strlen(name) + 1;
+	dso_tables.mem += strlen(name) + 1;
+
+	sym = &t->syms[t->syms_sz++];
 	/* while constructing, re-use pointer as just a plain offset */
 	sym->name = (void*)(unsigned long)off;
 	sym->start = start;
@@ -435,8 +672,8 @@ static int sym_cmp(const void *p1, const void *p2)
 	return s1->start < s2->start ? -1 : 1;
 }
 
-static int dso__add_syms(struct dso *dso, Elf *e, Elf_Scn *section,
-			 size_t stridx, size_t symsize)
+static int dso_syms__add_syms(struct dso_syms *t, Elf *e, Elf_Scn *section,
+			      size_t stridx, size_t symsize)
 {
 	Elf_Data *data = NULL;
 
@@ -460,7 +697,7 @@ static int dso__add_syms(struct dso *dso, Elf *e, Elf_Scn *section,
 			if (sym.st_value == 0)
 				continue;
 
-			if (dso__add_sym(dso, name, sym.st_value, sym.st_size))
+			if (dso_syms__add_sym(t, name, sym.st_value, sym.st_size))
 				goto err_out;
 		}
 	}
@@ -476,22 +713,24 @@ static void dso__free_fields(struct dso *dso)
 	if (!dso)
 		return;
 
-	free(dso->name);
 	free(dso->ranges);
-	free(dso->syms);
-	btf__free(dso->btf);
+	dso_syms__put(dso->table);
 }
 
-static int dso__load_sym_table_from_elf(struct dso *dso, int fd)
+static int dso_syms__load_from_elf(struct dso_syms *t, int fd)
 {
 	Elf_Scn *section = NULL;
 	Elf *e;
 	int i;
 
-	e = fd > 0 ? open_elf_by_fd(fd) : open_elf(dso->name, &fd);
+	e = fd > 0 ? open_elf_by_fd(fd) : open_elf(t->name, &fd);
 	if (!e)
 		return -1;
 
+	t->btf = btf__new_empty();
+	if (!t->btf)
+		goto err_out;
+
 	while ((section = elf_nextscn(e, section)) != 0) {
 		GElf_Shdr header;
 
@@ -502,29 +741,29 @@ static int dso__load_sym_table_from_elf(struct dso *dso, int fd)
 		    header.sh_type != SHT_DYNSYM)
 			continue;
 
-		if (dso__add_syms(dso, e, section, header.sh_link,
-				  header.sh_entsize))
+		if (dso_syms__add_syms(t, e, section, header.sh_link,
+				       header.sh_entsize))
 			goto err_out;
 	}
 
 	/* now when strings are finalized, adjust pointers properly */
-	for (i = 0; i < dso->syms_sz; i++)
-		dso->syms[i].name =
-			btf__name_by_offset(dso->btf,
-					    (unsigned long)dso->syms[i].name);
+	for (i = 0; i < t->syms_sz; i++)
+		t->syms[i].name =
+			btf__name_by_offset(t->btf,
+					    (unsigned long)t->syms[i].name);
 
-	qsort(dso->syms, dso->syms_sz, sizeof(*dso->syms), sym_cmp);
+	qsort(t->syms, t->syms_sz, sizeof(*t->syms), sym_cmp);
 
 	close_elf(e, fd);
 	return 0;
 
 err_out:
-	dso__free_fields(dso);
+	dso_syms__free_syms(t);
 	close_elf(e, fd);
 	return -1;
 }
 
-static int create_tmp_vdso_image(struct dso *dso)
+static int create_tmp_vdso_image(void)
 {
 	uint64_t start_addr, end_addr;
 	long pid = getpid();
@@ -590,43 +829,49 @@ err_out:
 	return fd;
 }
 
-static int dso__load_sym_table_from_vdso_image(struct dso *dso)
+static int dso_syms__load_from_vdso_image(struct dso_syms *t)
 {
-	int fd = create_tmp_vdso_image(dso);
+	int fd = create_tmp_vdso_image();
 
 	if (fd < 0)
 		return -1;
-	return dso__load_sym_table_from_elf(dso, fd);
+	return dso_syms__load_from_elf(t, fd);
 }
 
-static int dso__load_sym_table(struct dso *dso)
+static int dso_syms__load(struct dso_syms *t)
 {
-	if (dso->type == UNKNOWN)
+	if (t->type == UNKNOWN)
 		return -1;
-	if (dso->type == PERF_MAP)
-		return dso__load_sym_table_from_perf_map(dso);
-	if (dso->type == EXEC || dso->type == DYN)
-		return dso__load_sym_table_from_elf(dso, 0);
-	if (dso->type == VDSO)
-		return dso__load_sym_table_from_vdso_image(dso);
+	if (t->type == PERF_MAP)
+		return dso_syms__load_from_perf_map(t);
+	if (t->type == EXEC || t->type == DYN)
+		return dso_syms__load_from_elf(t, 0);
+	if (t->type == VDSO)
+		return dso_syms__load_from_vdso_image(t);
 	return -1;
 }
 
 static struct sym *dso__find_sym(struct dso *dso, uint64_t offset)
 {
+	struct dso_syms *t = dso->table;
 	unsigned long sym_addr;
 	int start, end, mid;
 
-	if (!dso->syms && dso__load_sym_table(dso))
+	/* a table that failed to load is not retried on every lookup */
+	if (!t->loaded) {
+		t->loaded = true;
+		dso_syms__load(t);
+	}
+	if (!t->syms)
 		return NULL;
 
 	start = 0;
-	end = dso->syms_sz - 1;
+	end = t->syms_sz - 1;
 
 	/* find largest sym_addr <= addr using binary search */
 	while (start < end) {
 		mid = start + (end - start + 1) / 2;
-		sym_addr = dso->syms[mid].start;
+		sym_addr = t->syms[mid].start;
 
 		if (sym_addr <= offset)
 			start = mid;
@@ -634,8 +879,8 @@ static struct sym *dso__find_sym(struct dso *dso, uint64_t offset)
 			end = mid - 1;
 	}
 
-	if (start == end && dso->syms[start].start <= offset)
-		return &dso->syms[start];
+	if (start == end && t->syms[start].start <= offset)
+		return &t->syms[start];
 	return NULL;
 }
 
@@ -706,28 +951,61 @@ void syms__free(struct syms *syms)
 	for (i = 0; i < syms->dso_sz; i++)
 		dso__free_fields(&syms->dsos[i]);
 	free(syms->dsos);
+	free(syms->cache);
 	free(syms);
 }
 
 const struct sym *syms__map_addr(const struct syms *syms, unsigned long addr)
 {
+	struct syms *s = (struct syms *)syms;
+	const struct sym *sym;
 	struct dso *dso;
 	uint64_t offset;
 
+	if (!s->cache)
+		s->cache = calloc(1 << SYMS_ADDR_CACHE_BITS, sizeof(*s->cache));
+	if (s->cache) {
+		sym = addr_cache__lookup(s->cache, SYMS_ADDR_CACHE_BITS, addr);
+		if (sym)
+			return sym;
+	}
+
 	dso = syms__find_dso(syms, addr, &offset);
 	if (!dso)
 		return NULL;
-	return dso__find_sym(dso, offset);
+	sym = dso__find_sym(dso, offset);
+	if (sym && s->cache)
+		addr_cache__store(s->cache, SYMS_ADDR_CACHE_BITS, addr, sym);
+	return sym;
 }
 
+#define SYMS_CACHE_MAX_NR	1024
+#define SYMS_CACHE_MAX_MEM	(256UL << 20)
+
+struct syms_cache_entry {
+	/* next entry in the same hash bucket */
+	struct syms_cache_entry *hnext;
+	/* LRU list, most recently used first */
+	struct syms_cache_entry *prev;
+	struct syms_cache_entry *next;
+	struct syms *syms;
+	int tgid;
+};
+
 struct syms_cache {
-	struct {
-		struct syms *syms;
-		int tgid;
-	} *data;
+	struct syms_cache_entry **buckets;
+	int hash_bits;
 	int nr;
+	int max_nr;
+	struct syms_cache_entry lru;
 };
 
+static unsigned int syms_cache__hash(const struct syms_cache *syms_cache,
+				     int tgid)
+{
+	return ((unsigned int)tgid * 0x61c88647u) >> (32 - syms_cache->hash_bits);
+}
+
 struct syms_cache *syms_cache__new(int nr)
 {
 	struct syms_cache *syms_cache;
@@ -735,49 +1013,141 @@ struct syms_cache *syms_cache__new(int nr)
 	syms_cache = calloc(1, sizeof(*syms_cache));
 	if (!syms_cache)
 		return NULL;
-	if (nr > 0)
-		syms_cache->data = calloc(nr, sizeof(*syms_cache->data));
+	syms_cache->max_nr = nr > 0 ? nr : SYMS_CACHE_MAX_NR;
+	syms_cache->hash_bits = 4;
+	while ((1 << syms_cache->hash_bits) < syms_cache->max_nr &&
+	       syms_cache->hash_bits < 16)
+		syms_cache->hash_bits++;
+	syms_cache->buckets = calloc(1 << syms_cache->hash_bits,
+				     sizeof(*syms_cache->buckets));
+	if (!syms_cache->buckets) {
+		free(syms_cache);
+		return NULL;
+	}
+	syms_cache->lru.prev = &syms_cache->lru;
+	syms_cache->lru.next = &syms_cache->lru;
 	return syms_cache;
 }
 
 void syms_cache__free(struct syms_cache *syms_cache)
 {
-	int i;
+	struct syms_cache_entry *e, *next;
 
 	if (!syms_cache)
 		return;
 
-	for (i = 0; i < syms_cache->nr; i++)
-		syms__free(syms_cache->data[i].syms);
-	free(syms_cache->data);
+	for (e = syms_cache->lru.next; e != &syms_cache->lru; e = next) {
+		next = e->next;
+		syms__free(e->syms);
+		free(e);
+	}
+	free(syms_cache->buckets);
 	free(syms_cache);
 }
 
-struct syms *syms_cache__get_syms(struct syms_cache *syms_cache, int tgid)
+static void syms_cache__lru_del(struct syms_cache_entry *e)
 {
-	void *tmp;
-	int i;
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+static void syms_cache__lru_add(struct syms_cache *syms_cache,
+				struct syms_cache_entry *e)
+{
+	e->prev = &syms_cache->lru;
+	e->next = syms_cache->lru.next;
+	e->next->prev = e;
+	syms_cache->lru.next = e;
+}
+
+static void syms_cache__evict(struct syms_cache *syms_cache)
+{
+	struct syms_cache_entry *e, **p;
 
-	for (i = 0; i < syms_cache->nr; i++) {
-		if (syms_cache->data[i].tgid == tgid)
-			return syms_cache->data[i].syms;
+	/*
+	 * Symbol tables are freed together with the last process that maps
+	 * them, so the memory bound is met by dropping the least recently
+	 * used processes. The newest entry is always kept.
+	 */
+	while (syms_cache->nr > 1 &&
+	       (syms_cache->nr > syms_cache->max_nr ||
+		dso_tables.mem > SYMS_CACHE_MAX_MEM)) {
+		e = syms_cache->lru.prev;
+		p = &syms_cache->buckets[syms_cache__hash(syms_cache, e->tgid)];
+		while (*p != e)
+			p = &(*p)->hnext;
+		*p = e->hnext;
+		syms_cache__lru_del(e);
+		syms_cache->nr--;
+		syms__free(e->syms);
+		free(e);
 	}
+}
 
-	tmp = realloc(syms_cache->data, (syms_cache->nr + 1) *
-		      sizeof(*syms_cache->data));
-	if (!tmp)
+struct syms *syms_cache__get_syms(struct syms_cache *syms_cache, int tgid)
+{
+	struct syms_cache_entry *e, **bucket;
+
+	bucket = &syms_cache->buckets[syms_cache__hash(syms_cache, tgid)];
+	for (e = *bucket; e; e = e->hnext) {
+		if (e->tgid == tgid) {
+			syms_cache__lru_del(e);
+			syms_cache__lru_add(syms_cache, e);
+			return e->syms;
+		}
+	}
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
 		return NULL;
-	syms_cache->data = tmp;
-	syms_cache->data[syms_cache->nr].syms = syms__load_pid(tgid);
-	syms_cache->data[syms_cache->nr].tgid = tgid;
-	return syms_cache->data[syms_cache->nr++].syms;
+	e->syms = syms__load_pid(tgid);
+	e->tgid = tgid;
+	e->hnext = *bucket;
+	*bucket = e;
+	syms_cache__lru_add(syms_cache, e);
+	syms_cache->nr++;
+	syms_cache__evict(syms_cache);
+	return e->syms;
 }
 
 struct partitions {
 	struct partition *items;
 	int sz;
+	/* open addressing hash of dev to index + 1 in items, 0 if free */
+	int *by_dev;
+	int by_dev_bits;
 };
 
+static unsigned int partitions__hash(const struct partitions *partitions,
+				     unsigned int dev)
+{
+	return (dev * 0x61c88647u) >> (32 - partitions->by_dev_bits);
+}
+
+static int partitions__index(struct partitions *partitions)
+{
+	unsigned int mask, h;
+	int i, bits = 1;
+
+	/* keep the table at most half full */
+	while ((1 << bits) < partitions->sz * 2)
+		bits++;
+
+	partitions->by_dev = calloc(1 << bits, sizeof(*partitions->by_dev));
+	if (!partitions->by_dev)
+		return -1;
+	partitions->by_dev_bits = bits;
+
+	mask = (1U << bits) - 1;
+	for (i = 0; i < partitions->sz; i++) {
+		h = partitions__hash(partitions, partitions->items[i].dev);
+		while (partitions->by_dev[h])
+			h = (h + 1) & mask;
+		partitions->by_dev[h] = i + 1;
+	}
+	return 0;
+}
+
 static int partitions__add_partition(struct partitions *partitions,
 				     const char *name, unsigned int dev)
 {
@@ -826,6 +1196,9 @@ struct partitions *partitions__load(void)
 			goto err_out;
 	}
 
+	if (partitions__index(partitions))
+		goto err_out;
+
 	fclose(f);
 	return partitions;
 
@@ -845,17 +1218,21 @@ void partitions__free(struct partitions *partitions)
 	for (i = 0; i < partitions->sz; i++)
 		free(partitions->items[i].name);
 	free(partitions->items);
+	free(partitions->by_dev);
 	free(partitions);
 }
 
 const struct partition *
 partitions__get_by_dev(const struct partitions *partitions, unsigned int dev)
 {
+	unsigned int mask = (1U << partitions->by_dev_bits) - 1;
+	unsigned int h = partitions__hash(partitions, dev);
 	int i;
 
-	for (i = 0; i < partitions->sz; i++) {
-		if (partitions->items[i].dev == dev)
-			return &partitions->items[i];
+	while ((i = partitions->by_dev[h])) {
+		if (partitions->items[i - 1].dev == dev)
+			return &partitions->items[i - 1];
+		h = (h + 1) & mask;
 	}
 
 	return NULL;
@@ -990,35 +1367,55 @@ bool is_kernel_module(const char *name)
 	return found;
 }
 
-bool fentry_exists(const char *name, const char *mod)
+static struct btf *vmlinux_btf;
+static int vmlinux_btf_refcnt;
+
+struct btf *vmlinux_btf__get(void)
+{
+	if (!vmlinux_btf) {
+		vmlinux_btf = btf__parse("/sys/kernel/btf/vmlinux", NULL);
+		if (!vmlinux_btf)
+			return NULL;
+	}
+	vmlinux_btf_refcnt++;
+	return vmlinux_btf;
+}
+
+void vmlinux_btf__put(void)
+{
+	if (!vmlinux_btf_refcnt || --vmlinux_btf_refcnt)
+		return;
+	btf__free(vmlinux_btf);
+	vmlinux_btf = NULL;
+}
+
+static int probe_fentry(const char *name, const char *mod)
 {
 	const char sysfs_vmlinux[] = "/sys/kernel/btf/vmlinux";
-	struct btf *base, *btf = NULL;
+	struct btf *base, *btf, *mod_btf = NULL;
 	const struct btf_type *type;
 	const struct btf_enum *e;
 	char sysfs_mod[80];
 	int id = -1, i, err;
 
-	base = btf__parse(sysfs_vmlinux, NULL);
+	base = vmlinux_btf__get();
 	if (!base) {
 		err = -errno;
 		fprintf(stderr, "failed to parse vmlinux BTF at '%s': %s\n",
 			sysfs_vmlinux, strerror(-err));
-		goto err_out;
+		return false;
 	}
+	btf = base;
 	if (mod && module_btf_exists(mod)) {
 		snprintf(sysfs_mod, sizeof(sysfs_mod), "/sys/kernel/btf/%s", mod);
-		btf = btf__parse_split(sysfs_mod, base);
-		if (!btf) {
+		mod_btf = btf__parse_split(sysfs_mod, base);
+		if (!mod_btf) {
 			err = -errno;
 			fprintf(stderr, "failed to load BTF from %s: %s\n",
 				sysfs_mod, strerror(-err));
-			btf = base;
-			base = NULL;
+		} else {
+			btf = mod_btf;
 		}
-	} else {
-		btf = base;
-		base = NULL;
 	}
 
 	id = btf__find_by_name_kind(btf, "bpf_attach_type", BTF_KIND_ENUM);
@@ -1040,12 +1437,12 @@ bool fentry_exists(const char *name, const char *mod)
 	}
 
 err_out:
-	btf__free(btf);
-	btf__free(base);
+	btf__free(mod_btf);
+	vmlinux_btf__put();
 	return id > 0;
 }
 
-bool kprobe_exists(const char *name)
+static int probe_kprobe(const char *name)
 {
 	char sym_name[256];
 	FILE *f;
@@ -1095,6 +1492,147 @@ slow_path:
 	return false;
 }
 
+/*
+ * Probe results are kept, like those of libbcc, in
+ * <cache dir>/features.<boot id>.<modules hash>, one "<feature> <arg> <value>"
+ * line each, so that tools started until the next reboot or module (un)load
+ * skip parsing BTF and scanning tracefs. The cache dir is $BCC_OBJ_CACHE_DIR,
+ * else $XDG_CACHE_HOME/bcc or ~/.cache/bcc.
+ */
+static char features_path[PATH_MAX];
+static bool features_path_set;
+
+/* FNV-1a of the name and size of each loaded module, as in libbcc */
+static unsigned long long modules_hash(void)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	char name[256], size[32];
+	const char *p;
+	FILE *f;
+
+	f = fopen("/proc/modules", "re");
+	if (!f)
+		return 0;
+	while (fscanf(f, "%255s %31s%*[^\n]\n", name, size) == 2) {
+		for (p = name; *p; p++)
+			hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+		hash = (hash ^ ' ') * 1099511628211ULL;
+		for (p = size; *p; p++)
+			hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+		hash = (hash ^ '\n') * 1099511628211ULL;
+	}
+	fclose(f);
+	return hash;
+}
+
+static const char *features_file(void)
+{
+	char dir[PATH_MAX - 128], boot_id[64];
+	const char *env;
+	FILE *f;
+	int n;
+
+	if (features_path_set)
+		return features_path[0] ? features_path : NULL;
+	features_path_set = true;
+
+	if ((env = getenv("BCC_OBJ_CACHE_DIR")) && *env)
+		n = snprintf(dir, sizeof(dir), "%s", env);
+	else if ((env = getenv("XDG_CACHE_HOME")) && *env)
+		n = snprintf(dir, sizeof(dir), "%s/bcc", env);
+	else if ((env = getenv("HOME")) && *env)
+		n = snprintf(dir, sizeof(dir), "%s/.cache/bcc", env);
+	else
+		return NULL;
+	if (n < 0 || n >= sizeof(dir) || access(dir, W_OK))
+		return NULL;
+
+	f = fopen("/proc/sys/kernel/random/boot_id", "re");
+	if (!f)
+		return NULL;
+	if (!fgets(boot_id, sizeof(boot_id), f)) {
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+	boot_id[strcspn(boot_id, "\n")] = '\0';
+	snprintf(features_path, sizeof(features_path), "%s/features.%s.%016llx",
+		 dir, boot_id, modules_hash());
+	return features_path;
+}
+
+static int feature_lookup(const char *feature, const char *arg)
+{
+	char key[256], line[512], *value;
+	const char *path = features_file();
+	int ret = -1;
+	size_t len;
+	FILE *f;
+
+	if (!path)
+		return -1;
+	f = fopen(path, "re");
+	if (!f)
+		return -1;
+	len = snprintf(key, sizeof(key), "%s %s ", feature, arg);
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, key, len) || !strchr(line, '\n'))
+			continue;
+		value = line + len;
+		if (value[strspn(value, "-0123456789")] == '\n')
+			ret = atoi(value);
+	}
+	fclose(f);
+	return ret;
+}
+
+static void feature_store(const char *feature, const char *arg, int value)
+{
+	const char *path = features_file();
+	char record[512];
+	int fd, n;
+
+	if (!path)
+		return;
+	n = snprintf(record, sizeof(record), "%s %s %d\n", feature, arg, value);
+	if (n < 0 || n >= sizeof(record))
+		return;
+	/* a single O_APPEND write keeps records of concurrent writers whole */
+	fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return;
+	if (write(fd, record, n) < 0) {
+		/* the cache is an optimization only */
+	}
+	close(fd);
+}
+
+bool fentry_exists(const char *name, const char *mod)
+{
+	char arg[256];
+	int ret;
+
+	snprintf(arg, sizeof(arg), "%s:%s", mod ? mod : "vmlinux", name);
+	ret = feature_lookup("fentry", arg);
+	if (ret < 0) {
+		ret = probe_fentry(name, mod);
+		feature_store("fentry", arg, ret);
+	}
+	return ret > 0;
+}
+
+bool kprobe_exists(const char *name)
+{
+	int ret;
+
+	ret = feature_lookup("ftrace_function", name);
+	if (ret < 0) {
+		ret = probe_kprobe(name);
+		feature_store("ftrace_function", name, ret);
+	}
+	return ret > 0;
+}
+
 bool vmlinux_btf_exists(void)
 {
 	if (!access("/sys/kernel/btf/vmlinux", R_OK))
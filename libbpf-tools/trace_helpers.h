@@ -15,6 +15,10 @@ struct ksyms;
 
 struct ksyms *ksyms__load(void);
 void ksyms__free(struct ksyms *ksyms);
+/*
+ * ksyms__map_addr() and syms__map_addr() remember recent lookups, so a
+ * ksyms or syms must not be used by several threads at once.
+ */
 const struct ksym *ksyms__map_addr(const struct ksyms *ksyms,
 				   unsigned long addr);
 const struct ksym *ksyms__get_symbol(const struct ksyms *ksyms,
@@ -35,6 +39,13 @@ const struct sym *syms__map_addr(const struct syms *syms, unsigned long addr);
 
 struct syms_cache;
 
+/*
+ * Cache of per-process symbols, keeping at most nr processes (a default
+ * limit if nr is 0) and evicting the least recently used ones when loaded
+ * symbol tables grow too large. Tables of files mapped by several processes
+ * are shared. The syms returned by syms_cache__get_syms() stay valid until
+ * the next call to it.
+ */
 struct syms_cache *syms_cache__new(int nr);
 struct syms *syms_cache__get_syms(struct syms_cache *syms_cache, int tgid);
 void syms_cache__free(struct syms_cache *syms_cache);
@@ -79,6 +90,18 @@ bool is_kernel_module(const char *name);
  */
 bool fentry_exists(const char *name, const char *mod);
 
+struct btf;
+
+/*
+ * Parsed vmlinux BTF, shared by everything in the process that holds a
+ * reference to it. Parsing it takes a while and several MB, so tools that
+ * check many functions with fentry_exists(), or run several skeletons,
+ * should hold a reference until they are done. Returns NULL with errno
+ * set if the kernel has no BTF.
+ */
+struct btf *vmlinux_btf__get(void);
+void vmlinux_btf__put(void);
+
 /*
  * The name of a kernel function to be attached to may be changed between
  * kernel releases. This helper is used to confirm whether the target kernel
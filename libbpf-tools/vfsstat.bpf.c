@@ -7,10 +7,29 @@
 #include <bpf/bpf_tracing.h>
 #include "vfsstat.h"
 
+const volatile bool use_percpu = false;
+
 __u64 stats[S_MAXSTAT] = {};
 
+/* used instead of stats with use_percpu, for machines with many CPUs */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, S_MAXSTAT);
+	__type(key, u32);
+	__type(value, u64);
+} percpu_stats SEC(".maps");
+
 static __always_inline int inc_stats(int key)
 {
+	u32 idx = key;
+	u64 *val;
+
+	if (use_percpu) {
+		val = bpf_map_lookup_elem(&percpu_stats, &idx);
+		if (val)
+			*val += 1;
+		return 0;
+	}
 	__atomic_add_fetch(&stats[key], 1, __ATOMIC_RELAXED);
 	return 0;
 }
@@ -9,6 +9,7 @@
 #include "vfsstat.h"
 #include "vfsstat.skel.h"
 #include "trace_helpers.h"
+#include "map_helpers.h"
 
 const char *argp_program_version = "vfsstat 0.1";
 const char *argp_program_bug_address =
@@ -21,14 +22,19 @@ static const char argp_program_doc[] =
 	"    vfsstat 5 3  # interval five seconds, three output lines\n";
 static char args_doc[] = "[interval [count]]";
 
+#define OPT_PERCPU	1 /* --percpu */
+
 static const struct argp_option opts[] = {
 	{ "verbose", 'v', NULL, 0, "Verbose debug output" },
+	{ "percpu", OPT_PERCPU, NULL, 0,
+	  "Count in per-CPU maps, avoids contention on machines with many CPUs" },
 	{ NULL, 'h', NULL, OPTION_HIDDEN, "Show the full help" },
 	{},
 };
 
 static struct env {
 	bool verbose;
+	bool percpu;
 	int count;
 	int interval;
 } env = {
@@ -47,6 +53,9 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 	case 'v':
 		env.verbose = true;
 		break;
+	case OPT_PERCPU:
+		env.percpu = true;
+		break;
 	case ARGP_KEY_ARG:
 		switch (state->arg_num) {
 		case 0:
@@ -136,6 +145,29 @@ static void print_and_reset_stats(__u64 stats[S_MAXSTAT])
 	printf("\n");
 }
 
+static int print_percpu_stats(int fd)
+{
+	static __u64 last[S_MAXSTAT];
+	__u64 total;
+	char s[16];
+	__u32 i;
+
+	printf("%-8s: ", strftime_now(s, sizeof(s), "%H:%M:%S"));
+	for (i = 0; i < S_MAXSTAT; i++) {
+		/* counters are never reset, print what they grew by */
+		if (lookup_percpu(fd, &i, &total, sizeof(total),
+				  percpu_sum_u64)) {
+			fprintf(stderr, "failed to read stats: %s\n",
+				strerror(errno));
+			return -1;
+		}
+		printf(" %8llu", (total - last[i]) / env.interval);
+		last[i] = total;
+	}
+	printf("\n");
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	static const struct argp argp = {
@@ -160,6 +192,8 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	skel->rodata->use_percpu = env.percpu;
+
 	/* It fallbacks to kprobes when kernel does not support fentry. */
 	if (vmlinux_btf_exists() && fentry_exists("vfs_read", NULL)) {
 		bpf_program__set_autoload(skel->progs.kprobe_vfs_read, false);
@@ -181,7 +215,7 @@ int main(int argc, char **argv)
 		goto cleanup;
 	}
 
-	if (!skel->bss) {
+	if (!env.percpu && !skel->bss) {
 		fprintf(stderr, "Memory-mapping BPF maps is supported starting from Linux 5.7, please upgrade.\n");
 		goto cleanup;
 	}
@@ -196,7 +230,13 @@ int main(int argc, char **argv)
 	print_header();
 	do {
 		sleep(env.interval);
-		print_and_reset_stats(skel->bss->stats);
+		if (env.percpu) {
+			err = print_percpu_stats(bpf_map__fd(skel->maps.percpu_stats));
+			if (err)
+				break;
+		} else {
+			print_and_reset_stats(skel->bss->stats);
+		}
 	} while (!env.count || --env.count);
 
 cleanup:
@@ -15,22 +15,30 @@
  */
 
 #include <linux/bpf.h>
+#include <linux/if_link.h>
 #include <linux/perf_event.h>
 #include <unistd.h>
 #include <cstdio>
 #include <cstring>
+#include <dirent.h>
+#include <algorithm>
+#include <atomic>
 #include <exception>
 #include <fcntl.h>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <sstream>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include "bcc_exception.h"
 #include "bcc_elf.h"
+#include "bcc_proc.h"
 #include "bcc_syms.h"
 #include "bpf_module.h"
 #include "common.h"
@@ -41,6 +49,8 @@
 #include "usdt.h"
 
 #include "BPF.h"
+#include "BPFMapIter.h"
+#include "BPFTableStream.h"
 
 namespace {
 /*
@@ -71,6 +81,54 @@ bool uprobe_ref_ctr_supported() {
   }
   return false;
 }
+
+/*
+ * Closing the perf event of a probe unregisters it in the kernel, which waits
+ * for an RCU grace period. That wait dominates detaching many probes and
+ * doesn't serialize across threads, so close large sets in parallel.
+ */
+void close_perf_event_fds(const std::vector<int>& fds) {
+  const size_t per_job = 64;
+  size_t n = fds.size();
+  size_t njobs = std::min<size_t>(
+      std::max(std::thread::hardware_concurrency(), 1u),
+      (n + per_job - 1) / per_job);
+
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    size_t i;
+    while ((i = next++) < n)
+      bpf_close_perf_event_fd(fds[i]);
+  };
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < njobs; i++)
+    workers.emplace_back(worker);
+  worker();
+  for (auto& t : workers)
+    t.join();
+}
+
+// kprobes of attach_kprobe_shared() by event name, across the BPF objects of
+// the process. Each object opens its own perf event on the kprobe_events
+// entry, and the kernel runs the programs of all of them from the program
+// array of the event, so a hit costs one kprobe whatever their number.
+struct shared_kprobe_t {
+  std::string kernel_func;
+  uint64_t offset;
+  int refs;
+};
+std::mutex shared_kprobes_mutex;
+std::map<std::string, shared_kprobe_t> shared_kprobes;
+
+// The last object to release the kprobe of event removes it
+int release_shared_kprobe(const std::string& event) {
+  std::lock_guard<std::mutex> lock(shared_kprobes_mutex);
+  auto it = shared_kprobes.find(event);
+  if (it == shared_kprobes.end() || --it->second.refs > 0)
+    return 0;
+  shared_kprobes.erase(it);
+  return bpf_detach_kprobe(event.c_str());
+}
 } // namespace
 
 namespace ebpf {
@@ -132,6 +190,200 @@ StatusTuple BPF::init(const std::string& bpf_program,
   return StatusTuple::OK();
 };
 
+StatusTuple BPF::init_batch(const std::vector<std::string>& bpf_programs,
+                            std::vector<std::unique_ptr<BPF>>& bpfs,
+                            const std::vector<std::string>& cflags,
+                            unsigned int flag, unsigned int max_jobs) {
+  size_t n = bpf_programs.size();
+  bpfs.clear();
+
+  // LLVM target initialization done by the BPFModule constructor is not
+  // thread-safe, so only the compilation itself runs on the workers.
+  std::vector<std::unique_ptr<BPF>> objs;
+  objs.reserve(n);
+  for (size_t i = 0; i < n; i++) {
+    auto ts = createLocalTableStorage();
+    std::unique_ptr<BPF> bpf(new BPF(flag, &*ts));
+    bpf->local_ts_ = std::move(ts);
+    objs.push_back(std::move(bpf));
+  }
+
+  if (max_jobs == 0)
+    max_jobs = std::max(std::thread::hardware_concurrency(), 1u);
+  size_t njobs = std::min<size_t>(max_jobs, n);
+
+  std::vector<StatusTuple> res(n, StatusTuple::OK());
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    size_t i;
+    while ((i = next++) < n)
+      res[i] = objs[i]->init(bpf_programs[i], cflags);
+  };
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < njobs; i++)
+    workers.emplace_back(worker);
+  worker();
+  for (auto& t : workers)
+    t.join();
+
+  for (size_t i = 0; i < n; i++) {
+    if (!res[i].ok())
+      return StatusTuple(-1, "Unable to initialize BPF program %zu: %s", i,
+                         res[i].msg().c_str());
+  }
+  bpfs = std::move(objs);
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::compile_object(const std::string& bpf_program,
+                                const std::string& path,
+                                const std::vector<std::string>& cflags,
+                                unsigned int flag) {
+  auto flags_len = cflags.size();
+  const char* flags[flags_len];
+  for (size_t i = 0; i < flags_len; i++)
+    flags[i] = cflags[i].c_str();
+
+  BPFModule mod(flag, nullptr, false);
+  if (mod.compile_object(bpf_program, flags, flags_len, path) != 0)
+    return StatusTuple(-1, "Unable to compile BPF program to %s",
+                       path.c_str());
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::table_header(const std::string& bpf_program,
+                              const std::string& ns, std::string& header,
+                              const std::vector<std::string>& cflags,
+                              unsigned int flag) {
+  auto flags_len = cflags.size();
+  const char* flags[flags_len];
+  for (size_t i = 0; i < flags_len; i++)
+    flags[i] = cflags[i].c_str();
+
+  BPFModule mod(flag, nullptr, false);
+  if (mod.table_header(bpf_program, flags, flags_len, ns, header) != 0)
+    return StatusTuple(-1, "Unable to generate a table header");
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::init_object(const std::string& path) {
+  if (bpf_module_->load_object(path) != 0)
+    return StatusTuple(-1, "Unable to load BPF object %s", path.c_str());
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::pin_all(const std::string& dir) {
+  if (!swappable_.empty())
+    return StatusTuple(-1, "Swappable functions can't be pinned");
+
+  for (const char* sub : {"/maps/", "/progs/"}) {
+    std::string probe = dir + sub + "x";
+    if (bcc_make_parent_dir(probe.c_str()) ||
+        bcc_check_bpffs_path(probe.c_str()))
+      return StatusTuple(-1, "Can't use %s%s, not on a bpffs", dir.c_str(),
+                         sub);
+  }
+
+  // Replace the pins of a previous run, which may be of the same objects
+  auto pin = [](int fd, const std::string& path) {
+    unlink(path.c_str());
+    return bpf_obj_pin(fd, path.c_str());
+  };
+  auto& ts = bpf_module_->table_storage();
+  Path prefix({bpf_module_->id()});
+  for (auto it = ts.lower_bound(prefix), up = ts.upper_bound(prefix);
+       it != up; ++it) {
+    const TableDesc& table = it->second;
+    if (table.is_extern)
+      continue;
+    std::string path = dir + "/maps/" + table.name;
+    if (pin(table.fd, path) < 0)
+      return StatusTuple(-1, "Can't pin table %s to %s: %s",
+                         table.name.c_str(), path.c_str(),
+                         std::strerror(errno));
+  }
+  for (const auto& it : funcs_) {
+    std::string path = dir + "/progs/" + it.first;
+    if (pin(it.second, path) < 0)
+      return StatusTuple(-1, "Can't pin function %s to %s: %s",
+                         it.first.c_str(), path.c_str(), std::strerror(errno));
+  }
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::restore(const std::string& dir) {
+  std::string maps_dir = dir + "/maps", progs_dir = dir + "/progs";
+  DIR* maps = opendir(maps_dir.c_str());
+  if (!maps)
+    return StatusTuple(-1, "Can't open %s: %s", maps_dir.c_str(),
+                       std::strerror(errno));
+
+  auto& ts = bpf_module_->table_storage();
+  struct dirent* entry;
+  std::string error;
+  while (error.empty() && (entry = readdir(maps)) != nullptr) {
+    if (entry->d_name[0] == '.')
+      continue;
+    std::string name = entry->d_name, path = maps_dir + "/" + name;
+    int fd = bpf_obj_get(path.c_str());
+    if (fd < 0) {
+      error = "Can't open table " + path + ": " + std::strerror(errno);
+      break;
+    }
+    struct bpf_map_info info = {};
+    uint32_t info_len = sizeof(info);
+    if (bpf_obj_get_info_by_fd(fd, &info, &info_len) < 0) {
+      error = "Can't get the info of table " + path + ": " +
+              std::strerror(errno);
+      close(fd);
+      break;
+    }
+    TableDesc table(name, FileDesc(fd), info.type, info.key_size,
+                    info.value_size, info.max_entries, info.map_flags);
+    ts.Insert(Path({bpf_module_->id(), name}), std::move(table));
+  }
+  closedir(maps);
+
+  DIR* progs = error.empty() ? opendir(progs_dir.c_str()) : nullptr;
+  if (progs) {
+    while ((entry = readdir(progs)) != nullptr) {
+      if (entry->d_name[0] == '.')
+        continue;
+      std::string name = entry->d_name, path = progs_dir + "/" + name;
+      int fd = bpf_obj_get(path.c_str());
+      if (fd < 0) {
+        error = "Can't open function " + path + ": " + std::strerror(errno);
+        break;
+      }
+      funcs_[name] = fd;
+    }
+    closedir(progs);
+  } else if (error.empty() && errno != ENOENT) {
+    error = "Can't open " + progs_dir + ": " + std::strerror(errno);
+  }
+
+  if (!error.empty()) {
+    ts.DeletePrefix(Path({bpf_module_->id()}));
+    for (auto& it : funcs_)
+      close(it.second);
+    funcs_.clear();
+    return StatusTuple(-1, error);
+  }
+  return StatusTuple::OK();
+}
+
+void BPF::set_map_size(const std::string& name, unsigned max_entries) {
+  bpf_module_->set_map_size(name, max_entries);
+}
+
+void BPF::set_map_numa_node(const std::string& name, int numa_node) {
+  bpf_module_->set_map_numa_node(name, numa_node);
+}
+
+void BPF::set_rodata(const std::string& name, const void* data, size_t size) {
+  bpf_module_->set_rodata(name, data, size);
+}
+
 BPF::~BPF() {
   auto res = detach_all();
   if (!res.ok())
@@ -139,38 +391,68 @@ BPF::~BPF() {
               << res.msg() << std::endl;
   bcc_free_buildsymcache(bsymcache_);
   bsymcache_ = NULL;
+  if (run_stats_fd_ >= 0)
+    close(run_stats_fd_);
 }
 
 StatusTuple BPF::detach_all() {
   bool has_error = false;
   std::string error_msg;
 
+  // Close the perf events of all probes at once, then remove the probes that
+  // were created through tracefs with one write per events file.
+  std::vector<int> fds;
+  std::vector<const char*> kprobe_events, uprobe_events;
   for (auto& it : kprobes_) {
-    auto res = detach_kprobe_event(it.first, it.second);
-    if (!res.ok()) {
-      error_msg += "Failed to detach kprobe event " + it.first + ": ";
-      error_msg += res.msg() + "\n";
-      has_error = true;
+    if (it.second.kfunc) {
+      close(it.second.perf_event_fd);
+      continue;
     }
+    fds.push_back(it.second.perf_event_fd);
+    if (!it.second.shared)
+      kprobe_events.push_back(it.first.c_str());
   }
-
   for (auto& it : uprobes_) {
-    auto res = detach_uprobe_event(it.first, it.second);
-    if (!res.ok()) {
-      error_msg += "Failed to detach uprobe event " + it.first + ": ";
-      error_msg += res.msg() + "\n";
-      has_error = true;
+    if (it.second.link)
+      close(it.second.perf_event_fd);
+    else
+      fds.push_back(it.second.perf_event_fd);
+    uprobe_events.push_back(it.first.c_str());
+  }
+  for (auto& it : tracepoints_)
+    fds.push_back(it.second.perf_event_fd);
+  close_perf_event_fds(fds);
+
+  for (auto* probes : {&kprobes_, &uprobes_, &tracepoints_}) {
+    for (auto& it : *probes) {
+      auto res = unload_func(it.second.func);
+      if (!res.ok()) {
+        error_msg += "Failed to detach " + it.first + ": ";
+        error_msg += res.msg() + "\n";
+        has_error = true;
+      }
     }
   }
 
-  for (auto& it : tracepoints_) {
-    auto res = detach_tracepoint_event(it.first, it.second);
-    if (!res.ok()) {
-      error_msg += "Failed to detach Tracepoint " + it.first + ": ";
-      error_msg += res.msg() + "\n";
+  if (bpf_detach_kprobes(kprobe_events.data(), kprobe_events.size()) < 0) {
+    error_msg += "Failed to detach kprobe events\n";
+    has_error = true;
+  }
+  for (auto& it : kprobes_) {
+    if (it.second.shared && release_shared_kprobe(it.first) < 0) {
+      error_msg += "Failed to detach shared kprobe " + it.first + "\n";
       has_error = true;
     }
   }
+  if (bpf_detach_uprobes(uprobe_events.data(), uprobe_events.size()) < 0) {
+    error_msg += "Failed to detach uprobe events\n";
+    has_error = true;
+  }
+  // TODO: bpf_detach_tracepoint currently does nothing.
+  kprobes_.clear();
+  uprobes_.clear();
+  uprobe_pids_.clear();
+  tracepoints_.clear();
 
   for (auto& it : raw_tracepoints_) {
     auto res = detach_raw_tracepoint_event(it.first, it.second);
@@ -191,6 +473,16 @@ StatusTuple BPF::detach_all() {
     delete it.second;
   }
 
+  for (auto& it : ring_buffers_) {
+    auto res = it.second->close();
+    if (!res.ok()) {
+      error_msg += "Failed to close ring buffer " + it.first + ": ";
+      error_msg += res.msg() + "\n";
+      has_error = true;
+    }
+    delete it.second;
+  }
+
   for (auto& it : perf_event_arrays_) {
     auto res = it.second->close_all_cpu();
     if (!res.ok()) {
@@ -209,6 +501,26 @@ StatusTuple BPF::detach_all() {
     }
   }
 
+  for (auto& it : xdp_) {
+    auto res = detach_xdp_dev(it.first, it.second);
+    if (!res.ok()) {
+      error_msg += "Failed to detach XDP program from " + it.first + ": ";
+      error_msg += res.msg() + "\n";
+      has_error = true;
+    }
+  }
+  xdp_.clear();
+
+  for (auto& it : tc_) {
+    auto res = detach_tc_hook(it.first.first, it.first.second, it.second);
+    if (!res.ok()) {
+      error_msg += "Failed to detach tc program from " + it.first.first + ": ";
+      error_msg += res.msg() + "\n";
+      has_error = true;
+    }
+  }
+  tc_.clear();
+
   for (auto& it : funcs_) {
     int res = close(it.second);
     if (res != 0) {
@@ -217,6 +529,9 @@ StatusTuple BPF::detach_all() {
       has_error = true;
     }
   }
+  for (auto& it : swappable_)
+    close(it.second.first);
+  swappable_.clear();
 
   if (has_error)
     return StatusTuple(-1, error_msg);
@@ -233,6 +548,13 @@ StatusTuple BPF::attach_kprobe(const std::string& kernel_func,
   if (kprobes_.find(probe_event) != kprobes_.end())
     return StatusTuple(-1, "kprobe %s already attached", probe_event.c_str());
 
+  open_probe_t p = {};
+  if (kernel_func_offset == 0 &&
+      attach_kfunc_compat(kernel_func, probe_func, attach_type, p).ok()) {
+    kprobes_[probe_event] = std::move(p);
+    return StatusTuple::OK();
+  }
+
   int probe_fd;
   TRY2(load_func(probe_func, BPF_PROG_TYPE_KPROBE, probe_fd));
 
@@ -247,20 +569,99 @@ StatusTuple BPF::attach_kprobe(const std::string& kernel_func,
                        kernel_func.c_str(), probe_func.c_str());
   }
 
+  p.perf_event_fd = res_fd;
+  p.func = probe_func;
+  kprobes_[probe_event] = std::move(p);
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::attach_kprobe_shared(const std::string& kernel_func,
+                                      const std::string& probe_func,
+                                      uint64_t kernel_func_offset,
+                                      bpf_probe_attach_type attach_type) {
+  std::string probe_event = get_kprobe_event(kernel_func, attach_type);
+  if (kprobes_.find(probe_event) != kprobes_.end())
+    return StatusTuple(-1, "kprobe %s already attached", probe_event.c_str());
+
+  std::lock_guard<std::mutex> lock(shared_kprobes_mutex);
+  auto it = shared_kprobes.find(probe_event);
+  if (it != shared_kprobes.end() &&
+      it->second.offset != kernel_func_offset)
+    return StatusTuple(-1, "kprobe %s is shared at offset 0x%lx",
+                       probe_event.c_str(), it->second.offset);
+  bool create = it == shared_kprobes.end();
+
+  int probe_fd;
+  TRY2(load_func(probe_func, BPF_PROG_TYPE_KPROBE, probe_fd));
+  int res_fd = bpf_attach_kprobe_shared(probe_fd, attach_type,
+                                        probe_event.c_str(),
+                                        kernel_func.c_str(),
+                                        kernel_func_offset, create);
+  if (res_fd < 0) {
+    if (create)
+      bpf_detach_kprobe(probe_event.c_str());
+    TRY2(unload_func(probe_func));
+    return StatusTuple(-1, "Unable to attach shared %skprobe for %s using %s",
+                       attach_type_debug(attach_type).c_str(),
+                       kernel_func.c_str(), probe_func.c_str());
+  }
+  if (create)
+    shared_kprobes[probe_event] = {kernel_func, kernel_func_offset, 1};
+  else
+    it->second.refs++;
+
   open_probe_t p = {};
   p.perf_event_fd = res_fd;
   p.func = probe_func;
+  p.shared = true;
   kprobes_[probe_event] = std::move(p);
   return StatusTuple::OK();
 }
 
+// Attach the copy of probe_func the frontend made with -DBCC_KPROBE_AS_KFUNC
+// as an fentry or fexit program of kernel_func, which is cheaper than a
+// kprobe. Fails if there is no copy or the verifier rejects it.
+StatusTuple BPF::attach_kfunc_compat(const std::string& kernel_func,
+                                     const std::string& probe_func,
+                                     bpf_probe_attach_type attach_type,
+                                     open_probe_t& p) {
+  std::string copy = BPF_KFUNC_COMPAT_PREFIX + probe_func;
+  uint8_t* func_start = bpf_module_->function_start(copy);
+  if (!func_start)
+    return StatusTuple(-1, "No %s", copy.c_str());
+
+  // loaded once for each kernel function, which it is attached to by BTF id
+  std::string prog_name =
+      (attach_type == BPF_PROBE_ENTRY ? "kfunc__" : "kretfunc__") +
+      kernel_func;
+  std::string key = copy + "/" + prog_name;
+  int fd = bpf_module_->bcc_func_load(
+      BPF_PROG_TYPE_TRACING, prog_name.c_str(),
+      reinterpret_cast<struct bpf_insn*>(func_start),
+      bpf_module_->function_size(copy), bpf_module_->license(),
+      bpf_module_->kern_version(), 0, nullptr, 0);
+  if (fd < 0)
+    return StatusTuple(-1, "Failed to load %s", key.c_str());
+
+  int link_fd = bpf_attach_kfunc(fd);
+  if (link_fd < 0) {
+    close(fd);
+    return StatusTuple(-1, "Unable to attach %s", key.c_str());
+  }
+  funcs_[key] = fd;
+  p.perf_event_fd = link_fd;
+  p.func = key;
+  p.kfunc = true;
+  return StatusTuple::OK();
+}
+
 StatusTuple BPF::attach_uprobe(const std::string& binary_path,
                                const std::string& symbol,
                                const std::string& probe_func,
                                uint64_t symbol_addr,
                                bpf_probe_attach_type attach_type, pid_t pid,
                                uint64_t symbol_offset,
-                               uint32_t ref_ctr_offset) {
+                               uint32_t ref_ctr_offset, uint64_t cookie) {
 
   if (symbol_addr != 0 && symbol_offset != 0)
     return StatusTuple(-1,
@@ -272,16 +673,36 @@ StatusTuple BPF::attach_uprobe(const std::string& binary_path,
   TRY2(check_binary_symbol(binary_path, symbol, symbol_addr, module, offset,
                            symbol_offset));
 
-  std::string probe_event = get_uprobe_event(module, offset, attach_type, pid);
-  if (uprobes_.find(probe_event) != uprobes_.end())
-    return StatusTuple(-1, "uprobe %s already attached", probe_event.c_str());
+  bool shared = pid != -1 && !uprobe_pid_table_.empty();
+  std::string probe_event =
+      get_uprobe_event(module, offset, attach_type, shared ? -1 : pid);
+  auto it = uprobes_.find(probe_event);
+  if (it != uprobes_.end()) {
+    auto pids = uprobe_pids_.find(probe_event);
+    if (!shared || pids == uprobe_pids_.end() ||
+        it->second.func != probe_func)
+      return StatusTuple(-1, "uprobe %s already attached", probe_event.c_str());
+    if (!pids->second.insert(pid).second)
+      return StatusTuple(-1, "uprobe %s already attached for pid %d",
+                         probe_event.c_str(), pid);
+    auto res = update_uprobe_pid(pid, true);
+    if (!res.ok())
+      pids->second.erase(pid);
+    return res;
+  }
 
   int probe_fd;
   TRY2(load_func(probe_func, BPF_PROG_TYPE_KPROBE, probe_fd));
 
-  int res_fd = bpf_attach_uprobe(probe_fd, attach_type, probe_event.c_str(),
-                                 binary_path.c_str(), offset, pid,
-                                 ref_ctr_offset);
+  int res_fd =
+      cookie ? bpf_attach_uprobe_cookie(probe_fd, attach_type,
+                                        probe_event.c_str(),
+                                        binary_path.c_str(), offset,
+                                        shared ? -1 : pid, ref_ctr_offset,
+                                        cookie)
+             : bpf_attach_uprobe(probe_fd, attach_type, probe_event.c_str(),
+                                 binary_path.c_str(), offset,
+                                 shared ? -1 : pid, ref_ctr_offset);
 
   if (res_fd < 0) {
     TRY2(unload_func(probe_func));
@@ -296,6 +717,15 @@ StatusTuple BPF::attach_uprobe(const std::string& binary_path,
   open_probe_t p = {};
   p.perf_event_fd = res_fd;
   p.func = probe_func;
+  p.link = cookie != 0;
+  if (shared) {
+    auto res = update_uprobe_pid(pid, true);
+    if (!res.ok()) {
+      detach_uprobe_event(probe_event, p);
+      return res;
+    }
+    uprobe_pids_[probe_event] = {pid};
+  }
   uprobes_[probe_event] = std::move(p);
   return StatusTuple::OK();
 }
@@ -308,10 +738,16 @@ StatusTuple BPF::attach_usdt_without_validation(const USDT& u, pid_t pid) {
   bool failed = false;
   std::string err_msg;
   int cnt = 0;
-  for (const auto& loc : probe.locations_) {
-    auto res = attach_uprobe(loc.bin_path_, std::string(), u.probe_func_,
-                             loc.address_, BPF_PROBE_ENTRY, pid, 0,
-                             probe.semaphore_offset());
+  for (size_t i = 0; i < probe.locations_.size(); i++) {
+    const auto& loc = probe.locations_[i];
+    uint64_t cookie = 0;
+    StatusTuple res(0);
+    if (u.cookie_args_ && probe.num_arguments() > 0)
+      res = usdt_spec_slot(u, i, pid, cookie);
+    if (res.ok())
+      res = attach_uprobe(loc.bin_path_, std::string(), u.probe_func_,
+                          loc.address_, BPF_PROBE_ENTRY, pid, 0,
+                          probe.semaphore_offset(), cookie);
     if (!res.ok()) {
       failed = true;
       err_msg += "USDT " + u.print_name() + " at " + loc.bin_path_ +
@@ -334,6 +770,45 @@ StatusTuple BPF::attach_usdt_without_validation(const USDT& u, pid_t pid) {
   }
 }
 
+StatusTuple BPF::usdt_spec_slot(const USDT& u, size_t location, pid_t pid,
+                                uint64_t& slot) {
+  auto& probe = *static_cast<::USDT::Probe*>(u.probe_.get());
+  ::USDT::ArgSpec specs[::USDT::MAX_SPEC_ARGS] = {};
+  ::USDT::optional<int> spec_pid = probe.pid_;
+  if (pid > 0)
+    spec_pid = pid;
+  if (!probe.arg_specs(location, spec_pid, specs))
+    return StatusTuple(-1, "Unable to locate the arguments");
+
+  std::string key(reinterpret_cast<const char*>(specs), sizeof(specs));
+  auto it = usdt_spec_slots_.find(key);
+  if (it != usdt_spec_slots_.end()) {
+    slot = it->second;
+    return StatusTuple::OK();
+  }
+
+  TableStorage::iterator table;
+  if (!bpf_module_->table_storage().Find(
+          Path({bpf_module_->id(), ::USDT::SPECS_TABLE}), table))
+    return StatusTuple(-1, "Can't find USDT specs table %s",
+                       ::USDT::SPECS_TABLE.c_str());
+  const TableDesc& desc = table->second;
+  if (desc.leaf_size != sizeof(specs))
+    return StatusTuple(-1, "USDT specs table %s does not hold %zu arguments",
+                       ::USDT::SPECS_TABLE.c_str(), ::USDT::MAX_SPEC_ARGS);
+  // Cookie 0 is what programs see of uprobes attached without one
+  uint32_t next = usdt_spec_slots_.size() + 1;
+  if (next >= desc.max_entries)
+    return StatusTuple(-1, "USDT specs table %s is full, raise "
+                       "BCC_USDT_MAX_SPECS", ::USDT::SPECS_TABLE.c_str());
+  if (bpf_update_elem(desc.fd, &next, specs, 0) < 0)
+    return StatusTuple(-1, "Unable to update USDT specs table %s: %s",
+                       ::USDT::SPECS_TABLE.c_str(), std::strerror(errno));
+  usdt_spec_slots_.emplace(key, next);
+  slot = next;
+  return StatusTuple::OK();
+}
+
 StatusTuple BPF::attach_usdt(const USDT& usdt, pid_t pid) {
   for (const auto& u : usdt_) {
     if (u == usdt) {
@@ -414,6 +889,59 @@ StatusTuple BPF::attach_perf_event(uint32_t ev_type, uint32_t ev_config,
                                    const std::string& probe_func,
                                    uint64_t sample_period, uint64_t sample_freq,
                                    pid_t pid, int cpu, int group_fd) {
+  return attach_perf_event_cpus(
+      ev_type, ev_config, probe_func, cpu, [&](int probe_fd, int i) {
+        return bpf_attach_perf_event(probe_fd, ev_type, ev_config,
+                                     sample_period, sample_freq, pid, i,
+                                     group_fd);
+      });
+}
+
+StatusTuple BPF::attach_perf_event_raw(void* perf_event_attr,
+                                       const std::string& probe_func, pid_t pid,
+                                       int cpu, int group_fd,
+                                       unsigned long extra_flags) {
+  auto attr = static_cast<struct perf_event_attr*>(perf_event_attr);
+  return attach_perf_event_cpus(
+      attr->type, attr->config, probe_func, cpu, [&](int probe_fd, int i) {
+        return bpf_attach_perf_event_raw(probe_fd, attr, pid, i, group_fd,
+                                         extra_flags);
+      });
+}
+
+StatusTuple BPF::attach_perf_event_branch(uint32_t ev_type, uint32_t ev_config,
+                                          const std::string& probe_func,
+                                          uint64_t sample_period,
+                                          uint64_t sample_freq,
+                                          uint64_t branch_sample_type,
+                                          pid_t pid, int cpu, int group_fd) {
+  return attach_perf_event_cpus(
+      ev_type, ev_config, probe_func, cpu, [&](int probe_fd, int i) {
+        return bpf_attach_perf_event_branch(probe_fd, ev_type, ev_config,
+                                            sample_period, sample_freq,
+                                            branch_sample_type, pid, i,
+                                            group_fd);
+      });
+}
+
+StatusTuple BPF::attach_perf_event_cgroup(uint32_t ev_type, uint32_t ev_config,
+                                          const std::string& probe_func,
+                                          uint64_t sample_period,
+                                          uint64_t sample_freq, int cgroup_fd,
+                                          int cpu) {
+  return attach_perf_event_cpus(
+      ev_type, ev_config, probe_func, cpu, [&](int probe_fd, int i) {
+        return bpf_attach_perf_event_cgroup(probe_fd, ev_type, ev_config,
+                                            sample_period, sample_freq,
+                                            cgroup_fd, i);
+      });
+}
+
+// Attach probe_func to the event opened by open(probe_fd, cpu) on cpu, or on
+// every online CPU if it is negative
+StatusTuple BPF::attach_perf_event_cpus(
+    uint32_t ev_type, uint32_t ev_config, const std::string& probe_func,
+    int cpu, const std::function<int(int, int)>& open) {
   auto ev_pair = std::make_pair(ev_type, ev_config);
   if (perf_events_.find(ev_pair) != perf_events_.end())
     return StatusTuple(-1, "Perf event type %d config %d already attached",
@@ -430,8 +958,7 @@ StatusTuple BPF::attach_perf_event(uint32_t ev_type, uint32_t ev_config,
   auto fds = new std::vector<std::pair<int, int>>();
   fds->reserve(cpus.size());
   for (int i : cpus) {
-    int fd = bpf_attach_perf_event(probe_fd, ev_type, ev_config, sample_period,
-                                   sample_freq, pid, i, group_fd);
+    int fd = open(probe_fd, i);
     if (fd < 0) {
       for (const auto& it : *fds)
         close(it.second);
@@ -450,44 +977,131 @@ StatusTuple BPF::attach_perf_event(uint32_t ev_type, uint32_t ev_config,
   return StatusTuple::OK();
 }
 
-StatusTuple BPF::attach_perf_event_raw(void* perf_event_attr,
-                                       const std::string& probe_func, pid_t pid,
-                                       int cpu, int group_fd,
-                                       unsigned long extra_flags) {
-  auto attr = static_cast<struct perf_event_attr*>(perf_event_attr);
-  auto ev_pair = std::make_pair(attr->type, attr->config);
-  if (perf_events_.find(ev_pair) != perf_events_.end())
-    return StatusTuple(-1, "Perf event type %d config %d already attached",
-                       attr->type, attr->config);
+// Handle of the filters attached by attach_tc(), which tells them apart from
+// others by priority
+static const uint32_t TC_FILTER_HANDLE = 1;
+
+static const char* tc_direction_name(TcDirection direction) {
+  return direction == TcDirection::EGRESS ? "egress" : "ingress";
+}
+
+static uint32_t xdp_mode_flags(XdpMode mode) {
+  switch (mode) {
+  case XdpMode::SKB:
+    return XDP_FLAGS_SKB_MODE;
+  case XdpMode::DRV:
+    return XDP_FLAGS_DRV_MODE;
+  case XdpMode::HW:
+    return XDP_FLAGS_HW_MODE;
+  default:
+    return 0;
+  }
+}
+
+StatusTuple BPF::attach_xdp(const std::string& dev,
+                            const std::string& probe_func, XdpMode mode) {
+  if (xdp_.find(dev) != xdp_.end())
+    return StatusTuple(-1, "XDP program already attached to %s", dev.c_str());
 
   int probe_fd;
-  TRY2(load_func(probe_func, BPF_PROG_TYPE_PERF_EVENT, probe_fd));
+  if (mode == XdpMode::HW) {
+    // Offloaded programs are loaded for their device, so can't be shared
+    // with another attachment
+    if (funcs_.find(probe_func) != funcs_.end())
+      return StatusTuple(-1, "Function %s is already loaded, can't offload it",
+                         probe_func.c_str());
+    uint8_t* func_start = bpf_module_->function_start(probe_func);
+    if (!func_start)
+      return StatusTuple(-1, "Can't find start of function %s",
+                         probe_func.c_str());
+    probe_fd = bpf_module_->bcc_func_load(
+        BPF_PROG_TYPE_XDP, probe_func.c_str(),
+        reinterpret_cast<struct bpf_insn*>(func_start),
+        bpf_module_->function_size(probe_func), bpf_module_->license(),
+        bpf_module_->kern_version(), default_log_level(), nullptr, 0,
+        dev.c_str());
+    if (probe_fd < 0)
+      return StatusTuple(-1, "Failed to load %s for %s: %d",
+                         probe_func.c_str(), dev.c_str(), probe_fd);
+    funcs_[probe_func] = probe_fd;
+  } else {
+    TRY2(load_func(probe_func, BPF_PROG_TYPE_XDP, probe_fd));
+  }
 
-  std::vector<int> cpus;
-  if (cpu >= 0)
-    cpus.push_back(cpu);
-  else
-    cpus = get_online_cpus();
-  auto fds = new std::vector<std::pair<int, int>>();
-  fds->reserve(cpus.size());
-  for (int i : cpus) {
-    int fd = bpf_attach_perf_event_raw(probe_fd, attr, pid, i, group_fd,
-                                       extra_flags);
-    if (fd < 0) {
-      for (const auto& it : *fds)
-        close(it.second);
-      delete fds;
-      TRY2(unload_func(probe_func));
-      return StatusTuple(-1, "Failed to attach perf event type %d config %d",
-                         attr->type, attr->config);
-    }
-    fds->emplace_back(i, fd);
+  uint32_t flags = xdp_mode_flags(mode);
+  if (bpf_attach_xdp(dev.c_str(), probe_fd,
+                     flags | XDP_FLAGS_UPDATE_IF_NOEXIST) < 0) {
+    TRY2(unload_func(probe_func));
+    return StatusTuple(-1, "Unable to attach XDP program %s to %s",
+                       probe_func.c_str(), dev.c_str());
   }
 
-  open_probe_t p = {};
-  p.func = probe_func;
-  p.per_cpu_fd = fds;
-  perf_events_[ev_pair] = std::move(p);
+  xdp_[dev] = open_xdp_t{probe_func, flags};
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::attach_xdp_chain(const std::string& dev,
+                                  const std::string& dispatcher_func,
+                                  const std::string& prog_table,
+                                  const std::vector<std::string>& funcs,
+                                  XdpMode mode) {
+  if (mode == XdpMode::HW)
+    return StatusTuple(-1, "Chained XDP programs can't be offloaded");
+  if (xdp_.find(dev) != xdp_.end())
+    return StatusTuple(-1, "XDP program already attached to %s", dev.c_str());
+
+  TableStorage::iterator it;
+  if (!bpf_module_->table_storage().Find(
+          Path({bpf_module_->id(), prog_table}), it) ||
+      it->second.type != BPF_MAP_TYPE_PROG_ARRAY)
+    return StatusTuple(-1, "Table %s is not a BPF_PROG_ARRAY",
+                       prog_table.c_str());
+  if (funcs.size() > it->second.max_entries)
+    return StatusTuple(-1, "Table %s can't hold %zu functions",
+                       prog_table.c_str(), funcs.size());
+  BPFProgTable table(it->second);
+
+  std::vector<std::pair<std::string, bpf_prog_type>> to_load;
+  for (const auto& func : funcs)
+    to_load.emplace_back(func, BPF_PROG_TYPE_XDP);
+  std::vector<int> fds;
+  TRY2(load_funcs(to_load, fds));
+  for (size_t i = 0; i < fds.size(); i++)
+    TRY2(table.update_value(i, fds[i]));
+
+  return attach_xdp(dev, dispatcher_func, mode);
+}
+
+StatusTuple BPF::attach_tc(const std::string& dev, TcDirection direction,
+                           const std::string& probe_func, uint32_t priority) {
+  auto key = std::make_pair(dev, direction);
+  if (tc_.find(key) != tc_.end())
+    return StatusTuple(-1, "tc program already attached to %s %s",
+                       dev.c_str(), tc_direction_name(direction));
+
+  int probe_fd;
+  TRY2(load_func(probe_func, BPF_PROG_TYPE_SCHED_CLS, probe_fd));
+  if (bpf_attach_tc(dev.c_str(), probe_fd, direction == TcDirection::EGRESS,
+                    TC_FILTER_HANDLE, priority) < 0) {
+    TRY2(unload_func(probe_func));
+    return StatusTuple(-1, "Unable to attach tc program %s to %s %s",
+                       probe_func.c_str(), dev.c_str(),
+                       tc_direction_name(direction));
+  }
+
+  tc_[key] = open_tc_t{probe_func, priority};
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::get_kprobe_functions(const std::string& pattern,
+                                      std::vector<std::string>& fns) {
+  fns.clear();
+  auto cb = [](const char* fn, void* payload) {
+    static_cast<std::vector<std::string>*>(payload)->emplace_back(fn);
+  };
+  if (bcc_foreach_kprobe_function(pattern.c_str(), cb, &fns) < 0)
+    return StatusTuple(-1, "Unable to list kernel functions matching %s",
+                       pattern.c_str());
   return StatusTuple::OK();
 }
 
@@ -517,6 +1131,20 @@ StatusTuple BPF::detach_uprobe(const std::string& binary_path,
 
   std::string event = get_uprobe_event(module, offset, attach_type, pid);
   auto it = uprobes_.find(event);
+  if (it == uprobes_.end() && pid != -1) {
+    // The uprobe of the pid may be shared with other pids
+    event = get_uprobe_event(module, offset, attach_type, -1);
+    auto pids = uprobe_pids_.find(event);
+    if (pids != uprobe_pids_.end() && pids->second.erase(pid)) {
+      it = uprobes_.find(event);
+      TRY2(update_uprobe_pid(pid, false));
+      if (!pids->second.empty())
+        return StatusTuple::OK();
+      uprobe_pids_.erase(pids);
+    } else {
+      it = uprobes_.end();
+    }
+  }
   if (it == uprobes_.end())
     return StatusTuple(-1, "No open %suprobe for binary %s symbol %s addr %lx",
                        attach_type_debug(attach_type).c_str(),
@@ -609,6 +1237,25 @@ StatusTuple BPF::detach_perf_event_raw(void* perf_event_attr) {
   return detach_perf_event(attr->type, attr->config);
 }
 
+StatusTuple BPF::detach_xdp(const std::string& dev) {
+  auto it = xdp_.find(dev);
+  if (it == xdp_.end())
+    return StatusTuple(-1, "No XDP program attached to %s", dev.c_str());
+  TRY2(detach_xdp_dev(it->first, it->second));
+  xdp_.erase(it);
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::detach_tc(const std::string& dev, TcDirection direction) {
+  auto it = tc_.find(std::make_pair(dev, direction));
+  if (it == tc_.end())
+    return StatusTuple(-1, "No tc program attached to %s %s", dev.c_str(),
+                       tc_direction_name(direction));
+  TRY2(detach_tc_hook(dev, direction, it->second));
+  tc_.erase(it);
+  return StatusTuple::OK();
+}
+
 StatusTuple BPF::open_perf_event(const std::string& name, uint32_t type,
                                  uint64_t config) {
   if (perf_event_arrays_.find(name) == perf_event_arrays_.end()) {
@@ -623,6 +1270,40 @@ StatusTuple BPF::open_perf_event(const std::string& name, uint32_t type,
   return StatusTuple::OK();
 }
 
+StatusTuple BPF::open_perf_event_group(
+    const std::vector<std::string>& names,
+    const std::vector<std::pair<uint32_t, uint64_t>>& events) {
+  if (names.empty() || names.size() != events.size())
+    return StatusTuple(-1, "open_perf_event_group: %zu tables for %zu events",
+                       names.size(), events.size());
+
+  for (size_t i = 0; i < names.size(); i++) {
+    const std::string& name = names[i];
+    if (perf_event_arrays_.find(name) == perf_event_arrays_.end()) {
+      TableStorage::iterator it;
+      if (!bpf_module_->table_storage().Find(Path({bpf_module_->id(), name}),
+                                             it))
+        return StatusTuple(
+            -1, "open_perf_event_group: unable to find table_storage %s",
+            name.c_str());
+      perf_event_arrays_[name] = new BPFPerfEventArray(it->second);
+    }
+  }
+
+  auto leader = perf_event_arrays_[names[0]];
+  TRY2(leader->open_all_cpu(events[0].first, events[0].second));
+  for (size_t i = 1; i < names.size(); i++) {
+    auto res = perf_event_arrays_[names[i]]->open_all_cpu(
+        events[i].first, events[i].second, *leader);
+    if (!res.ok()) {
+      for (size_t j = 0; j < i; j++)
+        perf_event_arrays_[names[j]]->close_all_cpu();
+      return res;
+    }
+  }
+  return StatusTuple::OK();
+}
+
 StatusTuple BPF::close_perf_event(const std::string& name) {
   auto it = perf_event_arrays_.find(name);
   if (it == perf_event_arrays_.end())
@@ -631,22 +1312,62 @@ StatusTuple BPF::close_perf_event(const std::string& name) {
   return StatusTuple::OK();
 }
 
-StatusTuple BPF::open_perf_buffer(const std::string& name,
-                                  perf_reader_raw_cb cb,
-                                  perf_reader_lost_cb lost_cb, void* cb_cookie,
-                                  int page_cnt) {
+StatusTuple BPF::new_perf_buffer(const std::string& name, BPFPerfBuffer** pb) {
   if (perf_buffers_.find(name) == perf_buffers_.end()) {
     TableStorage::iterator it;
     if (!bpf_module_->table_storage().Find(Path({bpf_module_->id(), name}), it))
       return StatusTuple(-1,
                          "open_perf_buffer: unable to find table_storage %s",
                          name.c_str());
+    if (it->second.type == BPF_MAP_TYPE_RINGBUF)
+      return StatusTuple(-1,
+                         "open_perf_buffer: %s was compiled as a ring buffer, "
+                         "use open_ring_buffer",
+                         name.c_str());
     perf_buffers_[name] = new BPFPerfBuffer(it->second);
   }
+  *pb = perf_buffers_[name];
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::open_perf_buffer(const std::string& name,
+                                  perf_reader_raw_cb cb,
+                                  perf_reader_lost_cb lost_cb, void* cb_cookie,
+                                  int page_cnt, int wakeup_events,
+                                  int wakeup_watermark) {
+  BPFPerfBuffer* table;
+  TRY2(new_perf_buffer(name, &table));
+  if ((page_cnt & (page_cnt - 1)) != 0)
+    return StatusTuple(-1, "open_perf_buffer page_cnt must be a power of two");
+  TRY2(table->open_all_cpu(cb, lost_cb, cb_cookie, page_cnt, wakeup_events,
+                           wakeup_watermark));
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::open_perf_buffer(const std::string& name,
+                                  perf_reader_raw_cb cb,
+                                  perf_reader_lost_cb lost_cb, void* cb_cookie,
+                                  BPFPerfBuffer::timestamp_fn ts_fn,
+                                  uint64_t reorder_window, int page_cnt) {
+  BPFPerfBuffer* table;
+  TRY2(new_perf_buffer(name, &table));
   if ((page_cnt & (page_cnt - 1)) != 0)
     return StatusTuple(-1, "open_perf_buffer page_cnt must be a power of two");
-  auto table = perf_buffers_[name];
-  TRY2(table->open_all_cpu(cb, lost_cb, cb_cookie, page_cnt));
+  TRY2(table->open_all_cpu(cb, lost_cb, cb_cookie, page_cnt, std::move(ts_fn),
+                           reorder_window));
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::open_flight_recorder(const std::string& name,
+                                      perf_reader_raw_cb cb,
+                                      perf_reader_lost_cb lost_cb,
+                                      void* cb_cookie, int page_cnt) {
+  BPFPerfBuffer* table;
+  TRY2(new_perf_buffer(name, &table));
+  if ((page_cnt & (page_cnt - 1)) != 0)
+    return StatusTuple(-1,
+                       "open_flight_recorder page_cnt must be a power of two");
+  TRY2(table->open_flight_recorder(cb, lost_cb, cb_cookie, page_cnt));
   return StatusTuple::OK();
 }
 
@@ -670,24 +1391,82 @@ int BPF::poll_perf_buffer(const std::string& name, int timeout_ms) {
   return it->second->poll(timeout_ms);
 }
 
+int BPF::snapshot_perf_buffer(const std::string& name) {
+  auto it = perf_buffers_.find(name);
+  if (it == perf_buffers_.end())
+    return -1;
+  return it->second->snapshot();
+}
+
+StatusTuple BPF::new_ring_buffer(const std::string& name, BPFRingBuffer** rb) {
+  if (ring_buffers_.find(name) == ring_buffers_.end()) {
+    TableStorage::iterator it;
+    if (!bpf_module_->table_storage().Find(Path({bpf_module_->id(), name}), it))
+      return StatusTuple(-1,
+                         "open_ring_buffer: unable to find table_storage %s",
+                         name.c_str());
+    try {
+      ring_buffers_[name] = new BPFRingBuffer(it->second);
+    } catch (std::invalid_argument& e) {
+      return StatusTuple(-1, "open_ring_buffer: %s", e.what());
+    }
+  }
+  *rb = ring_buffers_[name];
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::open_ring_buffer(const std::string& name,
+                                  ring_buffer_sample_fn cb, void* ctx) {
+  BPFRingBuffer* rb;
+  TRY2(new_ring_buffer(name, &rb));
+  return rb->open(cb, ctx);
+}
+
+StatusTuple BPF::open_ring_buffer(const std::string& name,
+                                  BPFRingBuffer::sample_fn cb) {
+  BPFRingBuffer* rb;
+  TRY2(new_ring_buffer(name, &rb));
+  return rb->open(std::move(cb));
+}
+
+StatusTuple BPF::close_ring_buffer(const std::string& name) {
+  auto it = ring_buffers_.find(name);
+  if (it == ring_buffers_.end())
+    return StatusTuple(-1, "Ring buffer for %s not open", name.c_str());
+  TRY2(it->second->close());
+  return StatusTuple::OK();
+}
+
+BPFRingBuffer* BPF::get_ring_buffer(const std::string& name) {
+  auto it = ring_buffers_.find(name);
+  return (it == ring_buffers_.end()) ? nullptr : it->second;
+}
+
+int BPF::poll_ring_buffer(const std::string& name, int timeout_ms) {
+  auto it = ring_buffers_.find(name);
+  if (it == ring_buffers_.end())
+    return -1;
+  return it->second->poll(timeout_ms);
+}
+
 StatusTuple BPF::load_func(const std::string& func_name, bpf_prog_type type,
-                           int& fd, unsigned flags) {
+                           int& fd, unsigned flags, int log_level) {
   if (funcs_.find(func_name) != funcs_.end()) {
     fd = funcs_[func_name];
     return StatusTuple::OK();
   }
 
+  if (bpf_module_->compiler_state_released())
+    return StatusTuple(-1, "Can't load %s after release_compiler_state()",
+                       func_name.c_str());
   uint8_t* func_start = bpf_module_->function_start(func_name);
   if (!func_start)
     return StatusTuple(-1, "Can't find start of function %s",
                        func_name.c_str());
   size_t func_size = bpf_module_->function_size(func_name);
 
-  int log_level = 0;
-  if (flag_ & DEBUG_BPF_REGISTER_STATE)
-    log_level = 2;
-  else if (flag_ & DEBUG_BPF)
-    log_level = 1;
+  if (log_level < 0)
+    log_level = default_log_level();
 
   fd = bpf_module_->bcc_func_load(type, func_name.c_str(),
                      reinterpret_cast<struct bpf_insn*>(func_start), func_size,
@@ -705,6 +1484,95 @@ StatusTuple BPF::load_func(const std::string& func_name, bpf_prog_type type,
   return StatusTuple::OK();
 }
 
+StatusTuple BPF::load_funcs(
+    const std::vector<std::pair<std::string, bpf_prog_type>>& funcs,
+    std::vector<int>& fds, unsigned flags, unsigned int max_jobs) {
+  struct pending_load {
+    size_t idx;
+    uint8_t* start;
+    size_t size;
+    int fd;
+  };
+
+  fds.assign(funcs.size(), -1);
+  std::vector<pending_load> pending;
+  std::set<std::string> queued;
+  for (size_t i = 0; i < funcs.size(); i++) {
+    const std::string& name = funcs[i].first;
+    auto it = funcs_.find(name);
+    if (it != funcs_.end()) {
+      fds[i] = it->second;
+      continue;
+    }
+    if (!queued.insert(name).second)
+      continue;
+    if (bpf_module_->compiler_state_released())
+      return StatusTuple(-1, "Can't load %s after release_compiler_state()",
+                         name.c_str());
+    uint8_t* func_start = bpf_module_->function_start(name);
+    if (!func_start)
+      return StatusTuple(-1, "Can't find start of function %s", name.c_str());
+    pending.push_back({i, func_start, bpf_module_->function_size(name), -1});
+  }
+
+  if (max_jobs == 0)
+    max_jobs = std::max(std::thread::hardware_concurrency(), 1u);
+  size_t n = pending.size();
+  size_t njobs = std::min<size_t>(max_jobs, n);
+  int log_level = default_log_level();
+
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    size_t i;
+    while ((i = next++) < n) {
+      auto& p = pending[i];
+      p.fd = bpf_module_->bcc_func_load(
+          funcs[p.idx].second, funcs[p.idx].first.c_str(),
+          reinterpret_cast<struct bpf_insn*>(p.start), p.size,
+          bpf_module_->license(), bpf_module_->kern_version(), log_level,
+          nullptr, 0, nullptr, flags);
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < njobs; i++)
+    workers.emplace_back(worker);
+  worker();
+  for (auto& t : workers)
+    t.join();
+
+  for (auto& p : pending) {
+    if (p.fd >= 0)
+      continue;
+    for (auto& q : pending)
+      if (q.fd >= 0)
+        close(q.fd);
+    fds.assign(funcs.size(), -1);
+    return StatusTuple(-1, "Failed to load %s: %d",
+                       funcs[p.idx].first.c_str(), p.fd);
+  }
+
+  // Saving the sources by program tag touches module state, keep it serial
+  for (auto& p : pending) {
+    const std::string& name = funcs[p.idx].first;
+    int ret = bpf_module_->annotate_prog_tag(
+        name, p.fd, reinterpret_cast<struct bpf_insn*>(p.start), p.size);
+    if (ret < 0)
+      fprintf(stderr, "WARNING: cannot get prog tag, ignore saving source with program tag\n");
+    funcs_[name] = p.fd;
+  }
+  for (size_t i = 0; i < funcs.size(); i++)
+    fds[i] = funcs_[funcs[i].first];
+  return StatusTuple::OK();
+}
+
+int BPF::default_log_level() const {
+  if (flag_ & DEBUG_BPF_REGISTER_STATE)
+    return 2;
+  if (flag_ & DEBUG_BPF)
+    return 1;
+  return 0;
+}
+
 StatusTuple BPF::unload_func(const std::string& func_name) {
   auto it = funcs_.find(func_name);
   if (it == funcs_.end())
@@ -715,6 +1583,173 @@ StatusTuple BPF::unload_func(const std::string& func_name) {
     return StatusTuple(-1, "Can't close FD for %s: %d", it->first.c_str(), res);
 
   funcs_.erase(it);
+  auto swap = swappable_.find(func_name);
+  if (swap != swappable_.end()) {
+    // Closing the last fd of the prog array empties it
+    close(swap->second.first);
+    swappable_.erase(swap);
+  }
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::load_func_swappable(const std::string& func_name,
+                                     bpf_prog_type type) {
+  if (funcs_.find(func_name) != funcs_.end())
+    return StatusTuple(-1, "%s is already loaded", func_name.c_str());
+
+  int impl_fd;
+  TRY2(load_func(func_name, type, impl_fd));
+  funcs_.erase(func_name);
+
+  std::string table_name = "swap_" + func_name;
+  int table_fd = bcc_create_map(BPF_MAP_TYPE_PROG_ARRAY, table_name.c_str(),
+                                sizeof(int), sizeof(int), 1, 0);
+  if (table_fd < 0) {
+    close(impl_fd);
+    return StatusTuple(-1, "Can't create the prog array of %s: %s",
+                       func_name.c_str(), std::strerror(errno));
+  }
+  int key = 0;
+  int res = bpf_update_elem(table_fd, &key, &impl_fd, BPF_ANY);
+  // The prog array holds its own reference to the function
+  close(impl_fd);
+  if (res < 0) {
+    close(table_fd);
+    return StatusTuple(-1, "Can't add %s to its prog array: %s",
+                       func_name.c_str(), std::strerror(errno));
+  }
+
+  // r1, the context, is passed as is to the tail call, which only returns
+  // if the slot is empty
+  struct bpf_insn trampoline[] = {
+    BPF_LD_MAP_FD(BPF_REG_2, 0),
+    BPF_MOV64_IMM(BPF_REG_3, 0),
+    BPF_RAW_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_tail_call),
+    BPF_MOV64_IMM(BPF_REG_0, 0),
+    BPF_EXIT_INSN(),
+  };
+  trampoline[0].imm = table_fd;
+  int fd = bpf_module_->bcc_func_load(
+      type, func_name.c_str(), trampoline, sizeof(trampoline),
+      bpf_module_->license(), bpf_module_->kern_version(),
+      default_log_level(), nullptr, 0, nullptr, 0);
+  if (fd < 0) {
+    close(table_fd);
+    return StatusTuple(-1, "Failed to load the trampoline of %s: %d",
+                       func_name.c_str(), fd);
+  }
+
+  funcs_[func_name] = fd;
+  swappable_[func_name] = std::make_pair(table_fd, type);
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::replace_func(const std::string& func_name, int new_fd) {
+  auto it = swappable_.find(func_name);
+  if (it == swappable_.end())
+    return StatusTuple(-1, "%s was not loaded with load_func_swappable",
+                       func_name.c_str());
+
+  int key = 0;
+  if (bpf_update_elem(it->second.first, &key, &new_fd, BPF_ANY) < 0)
+    return StatusTuple(-1, "Can't replace %s: %s", func_name.c_str(),
+                       std::strerror(errno));
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::replace_func(const std::string& func_name,
+                              const std::string& new_func) {
+  auto it = swappable_.find(func_name);
+  if (it == swappable_.end())
+    return StatusTuple(-1, "%s was not loaded with load_func_swappable",
+                       func_name.c_str());
+
+  int fd;
+  TRY2(load_func(new_func, it->second.second, fd));
+  return replace_func(func_name, fd);
+}
+
+StatusTuple BPF::enable_run_stats() {
+  if (run_stats_fd_ >= 0)
+    return StatusTuple::OK();
+  run_stats_fd_ = bcc_enable_run_stats();
+  if (run_stats_fd_ < 0)
+    return StatusTuple(-1, "Can't enable BPF run stats: %s",
+                       std::strerror(errno));
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::get_run_stats(std::vector<BPFRunStats>& stats) {
+  std::map<std::string, std::vector<std::string>> points;
+  for (const auto& it : kprobes_)
+    points[it.second.func].push_back("kprobe:" + it.first);
+  for (const auto& it : uprobes_)
+    points[it.second.func].push_back("uprobe:" + it.first);
+  for (const auto& it : tracepoints_)
+    points[it.second.func].push_back("tracepoint:" + it.first);
+  for (const auto& it : raw_tracepoints_)
+    points[it.second.func].push_back("raw_tracepoint:" + it.first);
+  for (const auto& it : perf_events_)
+    points[it.second.func].push_back("perf_event:" +
+                                     std::to_string(it.first.first) + ":" +
+                                     std::to_string(it.first.second));
+
+  stats.clear();
+  for (const auto& it : funcs_) {
+    BPFRunStats s;
+    s.func = it.first;
+    if (bcc_prog_run_stats(it.second, &s.run_cnt, &s.run_time_ns) < 0)
+      return StatusTuple(-1, "Can't get run stats of %s: %s",
+                         it.first.c_str(), std::strerror(errno));
+    auto p = points.find(it.first);
+    if (p != points.end())
+      s.attach_points = std::move(p->second);
+    stats.push_back(std::move(s));
+  }
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::get_memory_usage(BPFMemoryUsage& usage,
+                                  bool count_entries) {
+  uint64_t page_size = sysconf(_SC_PAGESIZE);
+  usage = BPFMemoryUsage();
+  for (size_t i = 0; i < bpf_module_->num_tables(); i++) {
+    struct bcc_map_mem mem;
+    BPFMapMemory m;
+    m.name = bpf_module_->table_name(i);
+    if (bcc_map_mem_info(bpf_module_->table_fd(i), &mem, count_entries) < 0)
+      return StatusTuple(-1, "Can't get memory usage of table %s: %s",
+                         m.name.c_str(), std::strerror(errno));
+    m.type = mem.type;
+    m.max_entries = mem.max_entries;
+    m.entries = mem.entries;
+    m.memlock = mem.memlock;
+    if (mem.type == BPF_MAP_TYPE_RINGBUF)
+      usage.ringbuf_pages += mem.max_entries / page_size;
+    usage.total_bytes += mem.memlock;
+    usage.maps.push_back(std::move(m));
+  }
+
+  for (const auto& it : funcs_) {
+    struct bcc_prog_mem mem;
+    if (bcc_prog_mem_info(it.second, &mem) < 0)
+      return StatusTuple(-1, "Can't get memory usage of %s: %s",
+                         it.first.c_str(), std::strerror(errno));
+    usage.progs.push_back({it.first, mem.jited_len, mem.xlated_len,
+                           mem.memlock});
+    usage.total_bytes += mem.memlock;
+  }
+
+  std::vector<int> cpus = get_online_cpus();
+  for (const auto& it : perf_buffers_) {
+    for (int cpu : cpus) {
+      int page_cnt = it.second->page_cnt(cpu);
+      // the kernel maps a header page in front of the ring
+      if (page_cnt)
+        usage.perf_buffer_pages += page_cnt + 1;
+    }
+  }
+  usage.total_bytes += usage.perf_buffer_pages * page_size;
   return StatusTuple::OK();
 }
 
@@ -788,6 +1823,22 @@ std::string BPF::get_kprobe_event(const std::string& kernel_func,
   return res;
 }
 
+StatusTuple BPF::add_stream_table(BPFTableStreamer& streamer,
+                                  const std::string& name) {
+  TableStorage::iterator it;
+  if (bpf_module_->table_storage().Find(Path({bpf_module_->id(), name}), it))
+    return streamer.add_table(it->second);
+  return StatusTuple(-1, "Table %s not found", name.c_str());
+}
+
+StatusTuple BPF::init_map_iter(BPFMapIter& iter, const std::string& name,
+                               const std::string& filter) {
+  TableStorage::iterator it;
+  if (bpf_module_->table_storage().Find(Path({bpf_module_->id(), name}), it))
+    return iter.init(it->second, filter);
+  return StatusTuple(-1, "Table %s not found", name.c_str());
+}
+
 BPFProgTable BPF::get_prog_table(const std::string& name) {
   TableStorage::iterator it;
   if (bpf_module_->table_storage().Find(Path({bpf_module_->id(), name}), it))
@@ -809,6 +1860,20 @@ BPFDevmapTable BPF::get_devmap_table(const std::string& name) {
   return BPFDevmapTable({});
 }
 
+BPFCpumapTable BPF::get_cpumap_table(const std::string& name) {
+  TableStorage::iterator it;
+  if (bpf_module_->table_storage().Find(Path({bpf_module_->id(), name}), it))
+    return BPFCpumapTable(it->second);
+  return BPFCpumapTable({});
+}
+
+BPFQueueStatsTable BPF::get_queue_stats_table(const std::string& name) {
+  TableStorage::iterator it;
+  if (bpf_module_->table_storage().Find(Path({bpf_module_->id(), name}), it))
+    return BPFQueueStatsTable(it->second);
+  return BPFQueueStatsTable({});
+}
+
 BPFXskmapTable BPF::get_xskmap_table(const std::string& name) {
   TableStorage::iterator it;
   if (bpf_module_->table_storage().Find(Path({bpf_module_->id(), name}), it))
@@ -824,6 +1889,48 @@ BPFStackTable BPF::get_stack_table(const std::string& name, bool use_debug_file,
   return BPFStackTable({}, use_debug_file, check_debug_file_crc);
 }
 
+StatusTuple BPF::get_numa_replica_fds(const std::string& name,
+                                      std::vector<int>& fds) {
+  TableStorage::iterator it;
+  if (!bpf_module_->table_storage().Find(Path({bpf_module_->id(), name}), it))
+    return StatusTuple(-1, "Table %s not found", name.c_str());
+  const TableDesc& desc = it->second;
+  if (desc.type != BPF_MAP_TYPE_ARRAY_OF_MAPS)
+    return StatusTuple(-1, "Table %s is not a BPF_NUMA_REPLICAS",
+                       name.c_str());
+  fds.clear();
+  for (int node = 0; size_t(node) < desc.max_entries; node++) {
+    // arrays of maps hold the ids of their maps for user space
+    uint32_t id;
+    if (bpf_lookup_elem(desc.fd, &node, &id))
+      continue;
+    int fd = bpf_map_get_fd_by_id(id);
+    if (fd < 0) {
+      for (int f : fds)
+        close(f);
+      fds.clear();
+      return StatusTuple(-1, "Unable to open replica of %s on node %d: %s",
+                         name.c_str(), node, std::strerror(errno));
+    }
+    fds.push_back(fd);
+  }
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::flip_epoch(const std::string& name, int& idle_fd) {
+  TableStorage::iterator it;
+  if (!bpf_module_->table_storage().Find(Path({bpf_module_->id(), name}), it))
+    return StatusTuple(-1, "Table %s not found", name.c_str());
+  const TableDesc& desc = it->second;
+  if (desc.type != BPF_MAP_TYPE_ARRAY_OF_MAPS || desc.max_entries != 2)
+    return StatusTuple(-1, "Table %s is not a BPF_EPOCH_BUFFERS", name.c_str());
+  idle_fd = bcc_flip_epoch(desc.fd);
+  if (idle_fd < 0)
+    return StatusTuple(-1, "Unable to flip the epoch of %s: %s", name.c_str(),
+                       std::strerror(errno));
+  return StatusTuple::OK();
+}
+
 BPFStackBuildIdTable BPF::get_stackbuildid_table(const std::string &name, bool use_debug_file,
                                                  bool check_debug_file_crc) {
   TableStorage::iterator it;
@@ -866,22 +1973,65 @@ std::string BPF::get_uprobe_event(const std::string& binary_path,
 
 StatusTuple BPF::detach_kprobe_event(const std::string& event,
                                      open_probe_t& attr) {
+  if (attr.kfunc) {
+    close(attr.perf_event_fd);
+    return unload_func(attr.func);
+  }
   bpf_close_perf_event_fd(attr.perf_event_fd);
   TRY2(unload_func(attr.func));
-  if (bpf_detach_kprobe(event.c_str()) < 0)
+  int res = attr.shared ? release_shared_kprobe(event)
+                        : bpf_detach_kprobe(event.c_str());
+  if (res < 0)
     return StatusTuple(-1, "Unable to detach kprobe %s", event.c_str());
   return StatusTuple::OK();
 }
 
 StatusTuple BPF::detach_uprobe_event(const std::string& event,
                                      open_probe_t& attr) {
-  bpf_close_perf_event_fd(attr.perf_event_fd);
+  if (attr.link)
+    close(attr.perf_event_fd);
+  else
+    bpf_close_perf_event_fd(attr.perf_event_fd);
   TRY2(unload_func(attr.func));
   if (bpf_detach_uprobe(event.c_str()) < 0)
     return StatusTuple(-1, "Unable to detach uprobe %s", event.c_str());
   return StatusTuple::OK();
 }
 
+StatusTuple BPF::update_uprobe_pid(pid_t pid, bool add) {
+  uint32_t key = pid;
+  if (!add) {
+    // Other shared uprobes may still trace the pid
+    for (const auto& it : uprobe_pids_)
+      if (it.second.count(pid))
+        return StatusTuple::OK();
+  }
+
+  TableStorage::iterator it;
+  if (!bpf_module_->table_storage().Find(
+          Path({bpf_module_->id(), uprobe_pid_table_}), it))
+    return StatusTuple(-1, "Can't find uprobe pid table %s",
+                       uprobe_pid_table_.c_str());
+  const TableDesc& desc = it->second;
+  if ((desc.type != BPF_MAP_TYPE_HASH &&
+       desc.type != BPF_MAP_TYPE_LRU_HASH) ||
+      desc.key_size != sizeof(key))
+    return StatusTuple(-1, "uprobe pid table %s is not a hash of u32",
+                       uprobe_pid_table_.c_str());
+
+  if (add) {
+    std::vector<uint8_t> leaf(desc.leaf_size, 0);
+    leaf[0] = 1;
+    if (bpf_update_elem(desc.fd, &key, leaf.data(), 0) < 0)
+      return StatusTuple(-1, "Can't add pid %d to %s: %s", pid,
+                         uprobe_pid_table_.c_str(), std::strerror(errno));
+  } else if (bpf_delete_elem(desc.fd, &key) < 0 && errno != ENOENT) {
+    return StatusTuple(-1, "Can't remove pid %d from %s: %s", pid,
+                       uprobe_pid_table_.c_str(), std::strerror(errno));
+  }
+  return StatusTuple::OK();
+}
+
 StatusTuple BPF::detach_tracepoint_event(const std::string& tracepoint,
                                          open_probe_t& attr) {
   bpf_close_perf_event_fd(attr.perf_event_fd);
@@ -899,6 +2049,27 @@ StatusTuple BPF::detach_raw_tracepoint_event(const std::string& tracepoint,
   return StatusTuple::OK();
 }
 
+StatusTuple BPF::detach_xdp_dev(const std::string& dev,
+                                const open_xdp_t& attr) {
+  if (bpf_attach_xdp(dev.c_str(), -1, attr.flags) < 0)
+    return StatusTuple(-1, "Unable to detach XDP program %s from %s",
+                       attr.func.c_str(), dev.c_str());
+  TRY2(unload_func(attr.func));
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::detach_tc_hook(const std::string& dev,
+                                TcDirection direction,
+                                const open_tc_t& attr) {
+  if (bpf_detach_tc(dev.c_str(), direction == TcDirection::EGRESS,
+                    TC_FILTER_HANDLE, attr.priority) < 0)
+    return StatusTuple(-1, "Unable to detach tc program %s from %s %s",
+                       attr.func.c_str(), dev.c_str(),
+                       tc_direction_name(direction));
+  TRY2(unload_func(attr.func));
+  return StatusTuple::OK();
+}
+
 StatusTuple BPF::detach_perf_event_all_cpu(open_probe_t& attr) {
   bool has_error = false;
   std::string err_msg;
@@ -920,9 +2091,22 @@ StatusTuple BPF::detach_perf_event_all_cpu(open_probe_t& attr) {
 }
 
 int BPF::free_bcc_memory() {
+  // the parsed vmlinux BTF goes once nothing uses it any more
+  bcc_vmlinux_btf_drop_cache();
   return bcc_free_memory();
 }
 
+StatusTuple BPF::release_compiler_state() {
+  if (!bpf_module_)
+    return StatusTuple(-1, "BPF module is not initialized");
+  all_bpf_program_.clear();
+  all_bpf_program_.shrink_to_fit();
+  bcc_vmlinux_btf_drop_cache();
+  if (bpf_module_->release_compiler_state() != 0)
+    return StatusTuple(-1, "Failed to free compiler memory");
+  return StatusTuple::OK();
+}
+
 USDT::USDT(const std::string& binary_path, const std::string& provider,
            const std::string& name, const std::string& probe_func)
     : initialized_(false),
@@ -931,7 +2115,8 @@ USDT::USDT(const std::string& binary_path, const std::string& provider,
       provider_(provider),
       name_(name),
       probe_func_(probe_func),
-      mod_match_inode_only_(1) {}
+      mod_match_inode_only_(1),
+      cookie_args_(false) {}
 
 USDT::USDT(pid_t pid, const std::string& provider, const std::string& name,
            const std::string& probe_func)
@@ -941,7 +2126,8 @@ USDT::USDT(pid_t pid, const std::string& provider, const std::string& name,
       provider_(provider),
       name_(name),
       probe_func_(probe_func),
-      mod_match_inode_only_(1) {}
+      mod_match_inode_only_(1),
+      cookie_args_(false) {}
 
 USDT::USDT(const std::string& binary_path, pid_t pid,
            const std::string& provider, const std::string& name,
@@ -952,7 +2138,8 @@ USDT::USDT(const std::string& binary_path, pid_t pid,
       provider_(provider),
       name_(name),
       probe_func_(probe_func),
-      mod_match_inode_only_(1) {}
+      mod_match_inode_only_(1),
+      cookie_args_(false) {}
 
 USDT::USDT(const USDT& usdt)
     : initialized_(false),
@@ -961,7 +2148,8 @@ USDT::USDT(const USDT& usdt)
       provider_(usdt.provider_),
       name_(usdt.name_),
       probe_func_(usdt.probe_func_),
-      mod_match_inode_only_(usdt.mod_match_inode_only_) {}
+      mod_match_inode_only_(usdt.mod_match_inode_only_),
+      cookie_args_(usdt.cookie_args_) {}
 
 USDT::USDT(USDT&& usdt) noexcept
     : initialized_(usdt.initialized_),
@@ -972,7 +2160,8 @@ USDT::USDT(USDT&& usdt) noexcept
       probe_func_(std::move(usdt.probe_func_)),
       probe_(std::move(usdt.probe_)),
       program_text_(std::move(usdt.program_text_)),
-      mod_match_inode_only_(usdt.mod_match_inode_only_) {
+      mod_match_inode_only_(usdt.mod_match_inode_only_),
+      cookie_args_(usdt.cookie_args_) {
   usdt.initialized_ = false;
 }
 
@@ -1022,7 +2211,9 @@ StatusTuple USDT::init() {
   auto& probe = *static_cast<::USDT::Probe*>(probe_.get());
 
   std::ostringstream stream;
-  if (!probe.usdt_getarg(stream, probe_func_))
+  bool generated = cookie_args_ ? probe.usdt_getarg_spec(stream, probe_func_)
+                                : probe.usdt_getarg(stream, probe_func_);
+  if (!generated)
     return StatusTuple(
         -1, "Unable to generate program text for USDT " + print_name());
   program_text_ = ::USDT::USDT_PROGRAM_HEADER + stream.str();
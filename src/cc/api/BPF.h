@@ -18,8 +18,10 @@
 
 #include <cctype>
 #include <cstdint>
+#include <functional>
 #include <memory>
 #include <ostream>
+#include <set>
 #include <string>
 
 #include "BPFTable.h"
@@ -38,9 +40,81 @@ struct open_probe_t {
   int perf_event_fd;
   std::string func;
   std::vector<std::pair<int, int>>* per_cpu_fd;
+  // a kprobe attached as an fentry or fexit program, perf_event_fd is its
+  // link
+  bool kfunc;
+  // a kprobe of attach_kprobe_shared(), perf_event_fd is this object's
+  // event on it
+  bool shared;
+  // a uprobe attached with a cookie, perf_event_fd is the BPF link holding
+  // its perf event
+  bool link;
 };
 
+struct open_xdp_t {
+  std::string func;
+  // XDP_FLAGS_* of the mode it was attached in, to detach it the same way
+  uint32_t flags;
+};
+
+struct open_tc_t {
+  std::string func;
+  uint32_t priority;
+};
+
+// Runs of a loaded function counted by the kernel, see
+// BPF::enable_run_stats(). The kernel counts per program, so a function
+// attached to several points has one entry listing all of them.
+struct BPFRunStats {
+  std::string func;
+  // e.g. "kprobe:p_vfs_read" or "tracepoint:sched:sched_switch"
+  std::vector<std::string> attach_points;
+  uint64_t run_cnt;
+  uint64_t run_time_ns;
+};
+
+// Kernel memory held by a BPF object, see BPF::get_memory_usage(). memlock
+// is what the kernel charges for each map and program, 0 on kernels that
+// don't report it. A ring buffer's pages are part of its map's memlock,
+// while perf buffers are mmapped per CPU and charged to no map.
+struct BPFMapMemory {
+  std::string name;
+  uint32_t type;
+  uint32_t max_entries;
+  // Keys present, if they were counted; arrays always hold max_entries
+  uint32_t entries;
+  uint64_t memlock;
+};
+
+struct BPFProgMemory {
+  std::string func;
+  uint32_t jited_len;
+  uint32_t xlated_len;
+  uint64_t memlock;
+};
+
+struct BPFMemoryUsage {
+  std::vector<BPFMapMemory> maps;
+  std::vector<BPFProgMemory> progs;
+  // Pages of the open perf buffers over all CPUs, including the header page
+  // of each ring
+  uint64_t perf_buffer_pages;
+  uint64_t ringbuf_pages;
+  // Bytes of all of the above
+  uint64_t total_bytes;
+};
+
+// Where BPF::attach_xdp() runs a program: in the driver if it supports XDP
+// and on the generic sk_buff path otherwise, only on the sk_buff path, only
+// in the driver, or offloaded to the NIC
+enum class XdpMode { AUTO, SKB, DRV, HW };
+
+// Which tc hook of a device BPF::attach_tc() runs a program on
+enum class TcDirection { INGRESS, EGRESS };
+
 class USDT;
+class BPFTableStreamer;
+class BPFMapIter;
 
 class BPF {
  public:
@@ -52,6 +126,7 @@ class BPF {
                bool allow_rlimit = true)
       : flag_(flag),
         bsymcache_(NULL),
+        run_stats_fd_(-1),
         bpf_module_(new BPFModule(flag, ts, rw_engine_enabled, maps_ns,
                     allow_rlimit)) {}
   StatusTuple init(const std::string& bpf_program,
@@ -60,6 +135,54 @@ class BPF {
 
   StatusTuple init_usdt(const USDT& usdt);
 
+  // Compile and load several independent programs concurrently, using up to
+  // max_jobs threads (0 means one per online CPU). Each program gets its own
+  // BPF object backed by a private table storage, so tables are not shared
+  // between programs of a batch. On success bpfs holds one initialized
+  // object per program, in order; on failure it is left empty.
+  static StatusTuple init_batch(const std::vector<std::string>& bpf_programs,
+                                std::vector<std::unique_ptr<BPF>>& bpfs,
+                                const std::vector<std::string>& cflags = {},
+                                unsigned int flag = 0,
+                                unsigned int max_jobs = 0);
+
+  // Compile a program into an object file at path, which init_object() loads
+  // later without Clang and LLVM, e.g. on hosts without them. See
+  // BPFModule::compile_object() for the restrictions.
+  static StatusTuple compile_object(const std::string& bpf_program,
+                                    const std::string& path,
+                                    const std::vector<std::string>& cflags = {},
+                                    unsigned int flag = 0);
+  // Write to header a C++ header declaring, in namespace ns, the key and
+  // leaf types of the tables of a program from their BTF and one typed
+  // accessor per table, e.g. ns::counts(bpf) for
+  // bpf.get_hash_table<ns::key_t, uint64_t>("counts"). Nothing is loaded.
+  // The bcc-table-header tool does the same at build time.
+  static StatusTuple table_header(const std::string& bpf_program,
+                                  const std::string& ns, std::string& header,
+                                  const std::vector<std::string>& cflags = {},
+                                  unsigned int flag = 0);
+  // Load an object file written by compile_object() instead of init(). The
+  // rw engine of this object must be disabled.
+  StatusTuple init_object(const std::string& path);
+  // Pin the tables of this object and the functions loaded so far to dir,
+  // a directory of a bpffs created if needed, as dir/maps/<table> and
+  // dir/progs/<function>. Attachments are not pinned, they end with this
+  // object, and swappable functions can't be pinned.
+  StatusTuple pin_all(const std::string& dir);
+  // Reopen what pin_all() pinned to dir instead of init(), for an agent to
+  // restart in milliseconds: nothing is compiled or verified, the tables
+  // keep their contents and the functions are ready to attach. The tables
+  // have no text conversion functions, only their typed accessors work.
+  StatusTuple restore(const std::string& dir);
+  // Map sizes and BPF_RODATA contents applied when init() or init_object()
+  // creates the maps, without recompiling the program for each value. See
+  // BPFModule::set_map_size() and BPFModule::set_rodata().
+  void set_map_size(const std::string& name, unsigned max_entries);
+  void set_rodata(const std::string& name, const void* data, size_t size);
+  // See BPFModule::set_map_numa_node()
+  void set_map_numa_node(const std::string& name, int numa_node);
+
   ~BPF();
   StatusTuple detach_all();
 
@@ -71,7 +194,22 @@ class BPF {
   StatusTuple detach_kprobe(
       const std::string& kernel_func,
       bpf_probe_attach_type attach_type = BPF_PROBE_ENTRY);
+  // Like attach_kprobe, but the kprobe is shared by all BPF objects of the
+  // process that attach this way to the same kernel_func and attach_type:
+  // a hit runs the programs of all of them, instead of one kprobe per
+  // object. Needs kprobe_events in tracefs. Detached with detach_kprobe(),
+  // the kprobe being removed with the last of them.
+  StatusTuple attach_kprobe_shared(
+      const std::string& kernel_func, const std::string& probe_func,
+      uint64_t kernel_func_offset = 0,
+      bpf_probe_attach_type attach_type = BPF_PROBE_ENTRY);
+  // Names of the kernel functions kprobes can be attached to that match the
+  // POSIX extended regular expression pattern at their start, sorted
+  static StatusTuple get_kprobe_functions(const std::string& pattern,
+                                          std::vector<std::string>& fns);
 
+  // A cookie other than 0 is what bpf_get_attach_cookie() returns in
+  // probe_func for this uprobe (Linux 5.15).
   StatusTuple attach_uprobe(const std::string& binary_path,
                             const std::string& symbol,
                             const std::string& probe_func,
@@ -79,7 +217,20 @@ class BPF {
                             bpf_probe_attach_type attach_type = BPF_PROBE_ENTRY,
                             pid_t pid = -1,
                             uint64_t symbol_offset = 0,
-                            uint32_t ref_ctr_offset = 0);
+                            uint32_t ref_ctr_offset = 0,
+                            uint64_t cookie = 0);
+  // With a pid table set, attach_uprobe() for a pid shares one uprobe per
+  // binary, offset and probe type among all the pids, and adds the pid to
+  // pid_table, a BPF_HASH(pid_table, u32, u8) of this module, instead of
+  // creating one uprobe per pid. The probe functions must then filter on
+  // the table themselves, e.g. with
+  //   u32 tgid = bpf_get_current_pid_tgid() >> 32;
+  //   if (!pid_table.lookup(&tgid)) return 0;
+  // detach_uprobe() for a pid removes it from the table, and the uprobe
+  // once it was the last pid. An empty name restores the default.
+  void set_uprobe_pid_table(const std::string& pid_table) {
+    uprobe_pid_table_ = pid_table;
+  }
   StatusTuple detach_uprobe(const std::string& binary_path,
                             const std::string& symbol, uint64_t symbol_addr = 0,
                             bpf_probe_attach_type attach_type = BPF_PROBE_ENTRY,
@@ -108,10 +259,72 @@ class BPF {
                                     pid_t pid = -1, int cpu = -1,
                                     int group_fd = -1,
                                     unsigned long extra_flags = 0);
+  // Keep the last branch records of the CPU, as selected by the
+  // PERF_SAMPLE_BRANCH_* bits of branch_sample_type, for
+  // bpf_read_branch_records() in probe_func. Needs a hardware event, and
+  // a PMU with LBR or an equivalent. Detached with detach_perf_event().
+  StatusTuple attach_perf_event_branch(uint32_t ev_type, uint32_t ev_config,
+                                       const std::string& probe_func,
+                                       uint64_t sample_period,
+                                       uint64_t sample_freq,
+                                       uint64_t branch_sample_type,
+                                       pid_t pid = -1, int cpu = -1,
+                                       int group_fd = -1);
+  // Sample only while the tasks of a cgroup v2 directory, opened as
+  // cgroup_fd, run: the CPU time of other cgroups raises no interrupt.
+  // Detached with detach_perf_event(). cgroup_fd can be closed afterwards.
+  StatusTuple attach_perf_event_cgroup(uint32_t ev_type, uint32_t ev_config,
+                                       const std::string& probe_func,
+                                       uint64_t sample_period,
+                                       uint64_t sample_freq, int cgroup_fd,
+                                       int cpu = -1);
   StatusTuple detach_perf_event(uint32_t ev_type, uint32_t ev_config);
   StatusTuple detach_perf_event_raw(void* perf_event_attr);
   std::string get_syscall_fnname(const std::string& name);
 
+  // Attach probe_func to the XDP hook of dev. It fails if dev already has an
+  // XDP program, or if mode isn't AUTO and the device can't run it there.
+  // HW mode loads the function for dev, and doesn't offload the maps.
+  StatusTuple attach_xdp(const std::string& dev, const std::string& probe_func,
+                         XdpMode mode = XdpMode::AUTO);
+  // Share the XDP hook of dev between several functions: each of funcs goes
+  // in the BPF_PROG_ARRAY prog_table at its index, and dispatcher_func, which
+  // is expected to tail call index 0, is attached. Each function continues
+  // the chain by tail calling the next index. HW mode isn't supported.
+  StatusTuple attach_xdp_chain(const std::string& dev,
+                               const std::string& dispatcher_func,
+                               const std::string& prog_table,
+                               const std::vector<std::string>& funcs,
+                               XdpMode mode = XdpMode::AUTO);
+  StatusTuple detach_xdp(const std::string& dev);
+
+  // Attach probe_func as a direct-action cls_bpf filter of priority to the
+  // ingress or egress hook of dev, adding a clsact qdisc to dev if needed.
+  // The qdisc is left in place on detach, for the other filters it may hold.
+  StatusTuple attach_tc(const std::string& dev, TcDirection direction,
+                        const std::string& probe_func, uint32_t priority = 1);
+  StatusTuple detach_tc(const std::string& dev, TcDirection direction);
+
+  // Have the kernel count the runs and run time of all BPF programs while
+  // this object lives. It costs a couple of clock reads per program run, so
+  // it is off unless enabled here or with sysctl kernel.bpf_stats_enabled.
+  StatusTuple enable_run_stats();
+  // Run counts and time of every loaded function so far
+  StatusTuple get_run_stats(std::vector<BPFRunStats>& stats);
+
+  // Kernel memory held by the tables, loaded functions and open perf
+  // buffers. Counting the entries of hash-like tables walks all their keys,
+  // which takes a syscall per entry.
+  StatusTuple get_memory_usage(BPFMemoryUsage& usage,
+                               bool count_entries = false);
+
+  // Wall time in ns of each phase of init() and of loading the functions so
+  // far, see BPFModule::phase_times()
+  const std::vector<std::pair<std::string, uint64_t>>& get_phase_times()
+      const {
+    return bpf_module_->phase_times();
+  }
+
   BPFTable get_table(const std::string& name) {
     TableStorage::iterator it;
     if (bpf_module_->table_storage().Find(Path({bpf_module_->id(), name}), it))
@@ -119,6 +332,63 @@ class BPF {
     return BPFTable({});
   }
 
+  template <class KeyType = int>
+  BPFHistogramTable<KeyType> get_histogram_table(const std::string& name) {
+    TableStorage::iterator it;
+    if (bpf_module_->table_storage().Find(Path({bpf_module_->id(), name}), it))
+      return BPFHistogramTable<KeyType>(it->second);
+    return BPFHistogramTable<KeyType>({});
+  }
+
+  BPFTableSnapshot get_table_snapshot(const std::string& name) {
+    TableStorage::iterator it;
+    if (bpf_module_->table_storage().Find(Path({bpf_module_->id(), name}), it))
+      return BPFTableSnapshot(it->second);
+    return BPFTableSnapshot({});
+  }
+
+  BPFHistogramDelta get_histogram_delta(const std::string& name) {
+    TableStorage::iterator it;
+    if (bpf_module_->table_storage().Find(Path({bpf_module_->id(), name}), it))
+      return BPFHistogramDelta(it->second);
+    return BPFHistogramDelta({});
+  }
+
+  BPFTableTop get_table_top(const std::string& name,
+                            std::vector<BPFTableTop::Field> fields,
+                            size_t k) {
+    TableStorage::iterator it;
+    if (bpf_module_->table_storage().Find(Path({bpf_module_->id(), name}), it))
+      return BPFTableTop(it->second, std::move(fields), k);
+    return BPFTableTop({}, std::move(fields), k);
+  }
+
+  template <class KeyType>
+  BPFHeavyHitters<KeyType> get_heavy_hitters(const std::string& name,
+                                             size_t k) {
+    TableStorage::iterator it;
+    if (bpf_module_->table_storage().Find(Path({bpf_module_->id(), name}), it))
+      return BPFHeavyHitters<KeyType>(it->second, k);
+    return BPFHeavyHitters<KeyType>({}, k);
+  }
+
+  // The poller must not outlive this module
+  StatusTuple add_poller_table(BPFTablePoller& poller,
+                               const std::string& name) {
+    TableStorage::iterator it;
+    if (bpf_module_->table_storage().Find(Path({bpf_module_->id(), name}), it))
+      return poller.add_table(it->second);
+    return StatusTuple(-1, "Table %s not found", name.c_str());
+  }
+
+  // The streamer must not outlive this module
+  StatusTuple add_stream_table(BPFTableStreamer& streamer,
+                               const std::string& name);
+
+  // Set up iter to dump the map name, see BPFMapIter
+  StatusTuple init_map_iter(BPFMapIter& iter, const std::string& name,
+                            const std::string& filter = "");
+
   template <class ValueType>
   BPFArrayTable<ValueType> get_array_table(const std::string& name) {
     TableStorage::iterator it;
@@ -127,6 +397,14 @@ class BPF {
     return BPFArrayTable<ValueType>({});
   }
 
+  template <class ValueType>
+  BPFMmapArrayTable<ValueType> get_mmap_array_table(const std::string& name) {
+    TableStorage::iterator it;
+    if (bpf_module_->table_storage().Find(Path({bpf_module_->id(), name}), it))
+      return BPFMmapArrayTable<ValueType>(it->second);
+    return BPFMmapArrayTable<ValueType>({});
+  }
+
   template <class ValueType>
   BPFPercpuArrayTable<ValueType> get_percpu_array_table(
       const std::string& name) {
@@ -144,6 +422,15 @@ class BPF {
     return BPFHashTable<KeyType, ValueType>({});
   }
 
+  template <class KeyType, class ValueType>
+  BPFLpmTrieTable<KeyType, ValueType> get_lpm_trie_table(
+      const std::string& name) {
+    TableStorage::iterator it;
+    if (bpf_module_->table_storage().Find(Path({bpf_module_->id(), name}), it))
+      return BPFLpmTrieTable<KeyType, ValueType>(it->second);
+    return BPFLpmTrieTable<KeyType, ValueType>({});
+  }
+
   template <class KeyType, class ValueType>
   BPFPercpuHashTable<KeyType, ValueType> get_percpu_hash_table(
       const std::string& name) {
@@ -198,6 +485,10 @@ class BPF {
 
   BPFDevmapTable get_devmap_table(const std::string& name);
 
+  BPFCpumapTable get_cpumap_table(const std::string& name);
+
+  BPFQueueStatsTable get_queue_stats_table(const std::string& name);
+
   BPFXskmapTable get_xskmap_table(const std::string& name);
 
   BPFSockmapTable get_sockmap_table(const std::string& name);
@@ -219,20 +510,129 @@ class BPF {
       return BPFMapInMapTable<KeyType>({});
   }
 
+  // Open the copies of the inner map of the BPF_NUMA_REPLICAS called name,
+  // in node order. The caller closes the fds.
+  StatusTuple get_numa_replica_fds(const std::string& name,
+                                   std::vector<int>& fds);
+  // The entries of all copies of a BPF_NUMA_REPLICAS, with the values of a
+  // key found on several nodes combined by merge
+  template <class KeyType, class ValueType>
+  StatusTuple get_numa_replicas_offline(
+      const std::string& name, std::vector<std::pair<KeyType, ValueType>>& res,
+      std::function<void(ValueType&, const ValueType&)> merge) {
+    std::vector<int> fds;
+    TRY2(get_numa_replica_fds(name, fds));
+    // index in res of each key, by its bytes
+    std::map<std::string, size_t> index;
+    res.clear();
+    for (int fd : fds) {
+      KeyType key, next;
+      ValueType value;
+      bool first = true;
+      while (bpf_get_next_key(fd, first ? nullptr : &key, &next) == 0) {
+        first = false;
+        key = next;
+        // removed since
+        if (bpf_lookup_elem(fd, &key, &value))
+          continue;
+        std::string raw(reinterpret_cast<const char*>(&key), sizeof(key));
+        auto it = index.find(raw);
+        if (it == index.end()) {
+          index.emplace(std::move(raw), res.size());
+          res.emplace_back(key, value);
+        } else {
+          merge(res[it->second].second, value);
+        }
+      }
+      close(fd);
+    }
+    return StatusTuple::OK();
+  }
+  // Same as above, adding up the values of a key
+  template <class KeyType, class ValueType>
+  StatusTuple get_numa_replicas_offline(
+      const std::string& name, std::vector<std::pair<KeyType, ValueType>>& res) {
+    return get_numa_replicas_offline<KeyType, ValueType>(
+        name, res, [](ValueType& sum, const ValueType& v) { sum += v; });
+  }
+
+  // Swap the buffers of the BPF_EPOCH_BUFFERS called name, see
+  // bcc_flip_epoch(). The fd of the buffer that was active is returned in
+  // idle_fd, to read and clear before the next flip. The caller closes it.
+  StatusTuple flip_epoch(const std::string& name, int& idle_fd);
+  // Flip the BPF_EPOCH_BUFFERS called name and move the entries of the
+  // buffer that was active to res: those of a hash are deleted, those of an
+  // array zeroed. res then holds exactly what was counted since the
+  // previous flip.
+  template <class KeyType, class ValueType>
+  StatusTuple get_epoch_offline(
+      const std::string& name,
+      std::vector<std::pair<KeyType, ValueType>>& res) {
+    int fd;
+    TRY2(flip_epoch(name, fd));
+    res.clear();
+    KeyType key, next;
+    ValueType value;
+    bool first = true;
+    while (bpf_get_next_key(fd, first ? nullptr : &key, &next) == 0) {
+      first = false;
+      key = next;
+      if (bpf_lookup_elem(fd, &key, &value) == 0)
+        res.emplace_back(key, value);
+    }
+    for (auto& it : res) {
+      // elements of arrays can't be deleted
+      if (bpf_delete_elem(fd, &it.first) && errno == EINVAL) {
+        ValueType zero{};
+        bpf_update_elem(fd, &it.first, &zero, BPF_EXIST);
+      }
+    }
+    close(fd);
+    return StatusTuple::OK();
+  }
+
   bool add_module(std::string module);
 
   StatusTuple open_perf_event(const std::string& name, uint32_t type,
                               uint64_t config);
+  // Open events[i] on each CPU in the BPF_PERF_ARRAY names[i], all in one
+  // group per CPU led by events[0]. The PMU schedules a group as a whole,
+  // so the counters read with perf_counter_value() cover the same periods,
+  // e.g. cycles and instructions for the IPC. Each array is closed with
+  // close_perf_event().
+  StatusTuple open_perf_event_group(
+      const std::vector<std::string>& names,
+      const std::vector<std::pair<uint32_t, uint64_t>>& events);
 
   StatusTuple close_perf_event(const std::string& name);
 
   // Open a Perf Buffer of given name, providing callback and callback cookie
   // to use when polling. BPF class owns the opened Perf Buffer and will free
   // it on-demand or on destruction.
+  // Readers are woken up every wakeup_events samples, or once
+  // wakeup_watermark bytes are available if that is non-zero. Raising them
+  // trades latency for fewer wakeups.
   StatusTuple open_perf_buffer(const std::string& name, perf_reader_raw_cb cb,
                                perf_reader_lost_cb lost_cb = nullptr,
                                void* cb_cookie = nullptr,
+                               int page_cnt = DEFAULT_PERF_BUFFER_PAGE_CNT,
+                               int wakeup_events = 1,
+                               int wakeup_watermark = 0);
+  // Same as above, but samples from all CPUs are delivered in the order of
+  // the timestamps returned by ts_fn, see BPFPerfBuffer::open_all_cpu.
+  StatusTuple open_perf_buffer(const std::string& name, perf_reader_raw_cb cb,
+                               perf_reader_lost_cb lost_cb, void* cb_cookie,
+                               BPFPerfBuffer::timestamp_fn ts_fn,
+                               uint64_t reorder_window,
                                int page_cnt = DEFAULT_PERF_BUFFER_PAGE_CNT);
+  // Open the Perf Buffer of given name as a flight recorder: the rings keep
+  // the latest samples of each CPU, overwriting the oldest ones, and cost
+  // nothing to userspace until snapshot_perf_buffer() reads them.
+  StatusTuple open_flight_recorder(const std::string& name,
+                                   perf_reader_raw_cb cb,
+                                   perf_reader_lost_cb lost_cb = nullptr,
+                                   void* cb_cookie = nullptr,
+                                   int page_cnt = DEFAULT_PERF_BUFFER_PAGE_CNT);
   // Close and free the Perf Buffer of given name.
   StatusTuple close_perf_buffer(const std::string& name);
   // Obtain an pointer to the opened BPFPerfBuffer instance of given name.
@@ -245,11 +645,67 @@ class BPF {
   //   0, if no data was available before timeout;
   //   number of CPUs that have new data, otherwise.
   int poll_perf_buffer(const std::string& name, int timeout_ms = -1);
+  // Invoke the callback of a flight recorder on the samples it holds, see
+  // BPFPerfBuffer::snapshot. Returns the number of samples, or -1 if no such
+  // flight recorder is open.
+  int snapshot_perf_buffer(const std::string& name);
+
+  // Open a Ring Buffer of given name, with a callback invoked for each record
+  // when polling or consuming. BPF class owns the opened Ring Buffer and will
+  // free it on-demand or on destruction.
+  StatusTuple open_ring_buffer(const std::string& name,
+                               ring_buffer_sample_fn cb, void* ctx = nullptr);
+  StatusTuple open_ring_buffer(const std::string& name,
+                               BPFRingBuffer::sample_fn cb);
+  template <class T>
+  StatusTuple open_ring_buffer(const std::string& name,
+                               std::function<int(const T&)> cb) {
+    BPFRingBuffer* rb;
+    TRY2(new_ring_buffer(name, &rb));
+    return rb->open(std::move(cb));
+  }
+  // Close and free the Ring Buffer of given name.
+  StatusTuple close_ring_buffer(const std::string& name);
+  // Obtain an pointer to the opened BPFRingBuffer instance of given name.
+  // Will return nullptr if such open Ring Buffer doesn't exist.
+  BPFRingBuffer* get_ring_buffer(const std::string& name);
+  // Poll an opened Ring Buffer of given name with given timeout.
+  // Returns:
+  //   -1 on error or if ring buffer with such name doesn't exist;
+  //   number of records consumed, otherwise.
+  int poll_ring_buffer(const std::string& name, int timeout_ms = -1);
 
+  // log_level is the verifier log level, by default 1 with DEBUG_BPF and 2
+  // with DEBUG_BPF_REGISTER_STATE. A failed load is verified again to get
+  // its log unless log_level is above 0.
   StatusTuple load_func(const std::string& func_name, enum bpf_prog_type type,
-                        int& fd, unsigned flags = 0);
+                        int& fd, unsigned flags = 0, int log_level = -1);
+  // Load several functions at once, verifying up to max_jobs of them
+  // concurrently (0 means one per online CPU). fds receives the fd of each
+  // function, in order. Functions that are already loaded are reused; if any
+  // load fails, the functions loaded by this call are unloaded again.
+  StatusTuple load_funcs(
+      const std::vector<std::pair<std::string, enum bpf_prog_type>>& funcs,
+      std::vector<int>& fds, unsigned flags = 0, unsigned int max_jobs = 0);
   StatusTuple unload_func(const std::string& func_name);
 
+  // Load func_name behind a trampoline, a program of the same type that
+  // tail calls it through a BPF_PROG_ARRAY of one slot. Probes attached to
+  // func_name afterwards run the trampoline, whose target replace_func()
+  // swaps atomically, without detaching them: no event is lost, and the
+  // maps of this module are kept. The cost is one tail call per event.
+  StatusTuple load_func_swappable(const std::string& func_name,
+                                  enum bpf_prog_type type);
+  // Make the probes of func_name, loaded by load_func_swappable(), run the
+  // program new_fd from their next event on. new_fd must have the type of
+  // func_name, it can be a function of another BPF object sharing the
+  // tables of this one through a TableStorage, and can be closed by the
+  // caller afterwards.
+  StatusTuple replace_func(const std::string& func_name, int new_fd);
+  // Same, with new_func, a function of this module
+  StatusTuple replace_func(const std::string& func_name,
+                           const std::string& new_func);
+
   StatusTuple attach_func(int prog_fd, int attachable_fd,
                           enum bpf_attach_type attach_type,
                           uint64_t flags);
@@ -257,6 +713,12 @@ class BPF {
                           enum bpf_attach_type attach_type);
 
   int free_bcc_memory();
+  // Once every function is loaded, free the compiler state kept since
+  // init(), for long running agents. Tables remain usable through their
+  // typed accessors and loaded functions can still be attached and
+  // detached, but no other function can be loaded. See
+  // BPFModule::release_compiler_state().
+  StatusTuple release_compiler_state();
 
  private:
   std::string get_kprobe_event(const std::string& kernel_func,
@@ -264,16 +726,31 @@ class BPF {
   std::string get_uprobe_event(const std::string& binary_path, uint64_t offset,
                                bpf_probe_attach_type type, pid_t pid);
 
+  int default_log_level() const;
+
   StatusTuple attach_usdt_without_validation(const USDT& usdt, pid_t pid);
   StatusTuple detach_usdt_without_validation(const USDT& usdt, pid_t pid);
-
+  StatusTuple usdt_spec_slot(const USDT& usdt, size_t location, pid_t pid,
+                             uint64_t& slot);
+
+  StatusTuple attach_perf_event_cpus(uint32_t ev_type, uint32_t ev_config,
+                                     const std::string& probe_func, int cpu,
+                                     const std::function<int(int, int)>& open);
+  StatusTuple attach_kfunc_compat(const std::string& kernel_func,
+                                  const std::string& probe_func,
+                                  bpf_probe_attach_type attach_type,
+                                  open_probe_t& p);
   StatusTuple detach_kprobe_event(const std::string& event, open_probe_t& attr);
   StatusTuple detach_uprobe_event(const std::string& event, open_probe_t& attr);
+  StatusTuple update_uprobe_pid(pid_t pid, bool add);
   StatusTuple detach_tracepoint_event(const std::string& tracepoint,
                                       open_probe_t& attr);
   StatusTuple detach_raw_tracepoint_event(const std::string& tracepoint,
                                           open_probe_t& attr);
   StatusTuple detach_perf_event_all_cpu(open_probe_t& attr);
+  StatusTuple detach_xdp_dev(const std::string& dev, const open_xdp_t& attr);
+  StatusTuple detach_tc_hook(const std::string& dev, TcDirection direction,
+                             const open_tc_t& attr);
 
   std::string attach_type_debug(bpf_probe_attach_type type) {
     switch (type) {
@@ -310,27 +787,45 @@ class BPF {
                                   uint64_t symbol_offset = 0);
 
   void init_fail_reset();
+  StatusTuple new_perf_buffer(const std::string& name, BPFPerfBuffer** pb);
+  StatusTuple new_ring_buffer(const std::string& name, BPFRingBuffer** rb);
 
   int flag_;
 
   void *bsymcache_;
+  int run_stats_fd_;
 
   std::unique_ptr<std::string> syscall_prefix_;
 
+  // Must outlive bpf_module_, which refers to it when set
+  std::unique_ptr<TableStorage> local_ts_;
   std::unique_ptr<BPFModule> bpf_module_;
 
   std::map<std::string, int> funcs_;
+  // Functions loaded by load_func_swappable(), with the prog array their
+  // trampoline in funcs_ tail calls
+  std::map<std::string, std::pair<int, bpf_prog_type>> swappable_;
 
   std::vector<USDT> usdt_;
   std::string all_bpf_program_;
 
   std::map<std::string, open_probe_t> kprobes_;
   std::map<std::string, open_probe_t> uprobes_;
+  std::string uprobe_pid_table_;
+  // Pids of the uprobes in uprobes_ shared through uprobe_pid_table_
+  std::map<std::string, std::set<pid_t>> uprobe_pids_;
+  // Slots in the USDT specs table of the argument specs of the locations
+  // attached with cookies, by spec. Distinct specs are few, they keep their
+  // slot for the lifetime of the object.
+  std::map<std::string, uint32_t> usdt_spec_slots_;
   std::map<std::string, open_probe_t> tracepoints_;
   std::map<std::string, open_probe_t> raw_tracepoints_;
   std::map<std::string, BPFPerfBuffer*> perf_buffers_;
+  std::map<std::string, BPFRingBuffer*> ring_buffers_;
   std::map<std::string, BPFPerfEventArray*> perf_event_arrays_;
   std::map<std::pair<uint32_t, uint32_t>, open_probe_t> perf_events_;
+  std::map<std::string, open_xdp_t> xdp_;
+  std::map<std::pair<std::string, TcDirection>, open_tc_t> tc_;
 };
 
 class USDT {
@@ -382,6 +877,18 @@ class USDT {
   // BPF::init()
   int set_probe_matching_kludge(uint8_t kludge);
 
+  // Read the arguments through the BPF cookie of the uprobe of each location,
+  // the slot of where they are at that location in a table, rather than by
+  // comparing the instruction pointer with the addresses of all locations.
+  // Arguments are then read in constant time, and the program text does not
+  // depend on the process: the probe can be attached to any process running
+  // the binary with BPF::attach_usdt(usdt, pid). Needs Linux 5.15.
+  //
+  // set_cookie_args(true) must be called before USDTs are submitted to
+  // BPF::init()
+  void set_cookie_args(bool cookie_args) { cookie_args_ = cookie_args; }
+  bool cookie_args() const { return cookie_args_; }
+
  private:
   bool initialized_;
 
@@ -396,6 +903,7 @@ class USDT {
   std::string program_text_;
 
   uint8_t mod_match_inode_only_;
+  bool cookie_args_;
 
   friend class BPF;
 };
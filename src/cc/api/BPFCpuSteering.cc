@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <functional>
+#include <set>
+
+#include "BPFCpuSteering.h"
+
+namespace ebpf {
+
+BPFCpuSteering::BPFCpuSteering(BPF& bpf, const std::string& cpumap,
+                               const std::string& slots,
+                               const std::string& slot_pkts)
+    : cpumap_(bpf.get_cpumap_table(cpumap)),
+      slots_(bpf.get_array_table<uint32_t>(slots)),
+      slot_pkts_(bpf.get_percpu_array_table<uint64_t>(slot_pkts)) {
+  if (slots_.capacity() != slot_pkts_.capacity())
+    throw std::invalid_argument("Tables '" + slots + "' and '" + slot_pkts +
+                                "' differ in size");
+  slot_cpu_.assign(slots_.capacity(), 0);
+  prev_pkts_.assign(slots_.capacity(), 0);
+}
+
+StatusTuple BPFCpuSteering::set_cpus(const std::vector<int>& cpus,
+                                     uint32_t qsize) {
+  if (cpus.empty())
+    return StatusTuple(-1, "No CPU to steer packets to");
+  for (int cpu : cpus) {
+    if (cpu < 0 || static_cast<size_t>(cpu) >= cpumap_.capacity())
+      return StatusTuple(-1, "CPU %d out of range of the cpumap", cpu);
+  }
+
+  for (int cpu : cpus)
+    TRY2(cpumap_.update_value(cpu, qsize));
+  // Deal the slots out before removing the old queues, so no slot points to
+  // a missing one
+  for (size_t i = 0; i < slot_cpu_.size(); i++) {
+    uint32_t cpu = cpus[i % cpus.size()];
+    TRY2(slots_.update_value(i, cpu));
+    slot_cpu_[i] = cpu;
+  }
+  std::set<int> kept(cpus.begin(), cpus.end());
+  for (int cpu : cpus_) {
+    if (kept.find(cpu) == kept.end())
+      TRY2(cpumap_.remove_value(cpu));
+  }
+  cpus_.assign(kept.begin(), kept.end());
+  return StatusTuple::OK();
+}
+
+StatusTuple BPFCpuSteering::set_qsize(int cpu, uint32_t qsize) {
+  if (std::find(cpus_.begin(), cpus_.end(), cpu) == cpus_.end())
+    return StatusTuple(-1, "Packets are not steered to CPU %d", cpu);
+  return cpumap_.update_value(cpu, qsize);
+}
+
+StatusTuple BPFCpuSteering::read_deltas(std::vector<uint64_t>& deltas) {
+  std::vector<uint64_t> pkts =
+      slot_pkts_.get_table_offline_reduced(std::plus<uint64_t>());
+  if (pkts.size() != prev_pkts_.size())
+    return StatusTuple(-1, "Failed to read the packet counts of the slots");
+  deltas.resize(pkts.size());
+  for (size_t i = 0; i < pkts.size(); i++)
+    deltas[i] = pkts[i] - prev_pkts_[i];
+  prev_pkts_ = std::move(pkts);
+
+  load_.clear();
+  for (int cpu : cpus_)
+    load_[cpu] = 0;
+  for (size_t i = 0; i < deltas.size(); i++)
+    load_[slot_cpu_[i]] += deltas[i];
+  return StatusTuple::OK();
+}
+
+StatusTuple BPFCpuSteering::update_load(std::map<int, uint64_t>& load) {
+  std::vector<uint64_t> deltas;
+  TRY2(read_deltas(deltas));
+  load = load_;
+  return StatusTuple::OK();
+}
+
+StatusTuple BPFCpuSteering::rebalance(double tolerance, size_t& moved) {
+  moved = 0;
+  std::vector<uint64_t> deltas;
+  TRY2(read_deltas(deltas));
+  if (cpus_.size() < 2)
+    return StatusTuple::OK();
+
+  std::map<int, uint64_t> load = load_;
+  uint64_t total = 0;
+  for (const auto& it : load)
+    total += it.second;
+  double limit = (1.0 + tolerance) * total / cpus_.size();
+
+  // Each move takes the biggest slot of the busiest CPU that still leaves it
+  // above the least loaded one, so the loads only get closer
+  for (size_t round = 0; round < slot_cpu_.size(); round++) {
+    auto cmp = [](const std::pair<const int, uint64_t>& a,
+                  const std::pair<const int, uint64_t>& b) {
+      return a.second < b.second;
+    };
+    auto hot = std::max_element(load.begin(), load.end(), cmp);
+    auto cold = std::min_element(load.begin(), load.end(), cmp);
+    if (hot->second <= limit)
+      break;
+
+    uint64_t gap = hot->second - cold->second;
+    size_t best = slot_cpu_.size();
+    for (size_t i = 0; i < slot_cpu_.size(); i++) {
+      if (slot_cpu_[i] != static_cast<uint32_t>(hot->first) || !deltas[i] ||
+          deltas[i] >= gap)
+        continue;
+      if (best == slot_cpu_.size() || deltas[i] > deltas[best])
+        best = i;
+    }
+    if (best == slot_cpu_.size())
+      break;
+
+    uint32_t cpu = cold->first;
+    TRY2(slots_.update_value(best, cpu));
+    slot_cpu_[best] = cpu;
+    hot->second -= deltas[best];
+    cold->second += deltas[best];
+    moved++;
+  }
+  return StatusTuple::OK();
+}
+
+}  // namespace ebpf
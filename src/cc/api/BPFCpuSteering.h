@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "BPF.h"
+#include "BPFTable.h"
+#include "bcc_exception.h"
+
+namespace ebpf {
+
+// Spread the packets of an XDP program over CPUs by flow, like RSS does over
+// NIC queues, and move flows away from the busiest CPUs at runtime.
+//
+// The program hashes each packet's flow to a slot of an indirection table,
+// counts the packet for the slot and redirects it to the CPU of the slot:
+//
+//   BPF_CPUMAP(cpumap, NR_CPUS);
+//   BPF_ARRAY(cpu_slots, u32, 256);
+//   BPF_PERCPU_ARRAY(cpu_slot_pkts, u64, 256);
+//
+//   int steer(struct xdp_md *ctx) {
+//     u32 slot = bpf_xdp_flow_hash(ctx) % 256;
+//     u32 *cpu = cpu_slots.lookup(&slot);
+//     u64 *pkts = cpu_slot_pkts.lookup(&slot);
+//     if (!cpu || !pkts)
+//       return XDP_PASS;
+//     *pkts += 1;
+//     return cpumap.redirect_map(*cpu, 0);
+//   }
+//
+// and this class owns the contents of the three tables. The tables must
+// outlive it.
+class BPFCpuSteering {
+ public:
+  // Throws std::invalid_argument if a table is missing or of the wrong type
+  BPFCpuSteering(BPF& bpf, const std::string& cpumap,
+                 const std::string& slots, const std::string& slot_pkts);
+
+  // Create a queue of qsize packets to each of cpus, remove those to other
+  // CPUs, and deal the slots out to cpus in turn
+  StatusTuple set_cpus(const std::vector<int>& cpus, uint32_t qsize);
+  StatusTuple set_qsize(int cpu, uint32_t qsize);
+
+  // Packets of each CPU since the last call to update_load() or rebalance()
+  StatusTuple update_load(std::map<int, uint64_t>& load);
+  // Move slots from the CPUs whose load is more than tolerance above the
+  // average to the least loaded ones, until none is or no move helps.
+  // moved is set to the number of slots moved.
+  StatusTuple rebalance(double tolerance, size_t& moved);
+  // Load read by the last update_load() or rebalance(), before its moves
+  const std::map<int, uint64_t>& load() const { return load_; }
+
+  const std::vector<int>& cpus() const { return cpus_; }
+  const std::vector<uint32_t>& slot_cpus() const { return slot_cpu_; }
+
+ private:
+  // Packets of each slot since the last read, and load_ from them
+  StatusTuple read_deltas(std::vector<uint64_t>& deltas);
+
+  BPFCpumapTable cpumap_;
+  BPFArrayTable<uint32_t> slots_;
+  BPFPercpuArrayTable<uint64_t> slot_pkts_;
+  std::vector<int> cpus_;
+  std::vector<uint32_t> slot_cpu_;
+  std::vector<uint64_t> prev_pkts_;
+  std::map<int, uint64_t> load_;
+};
+
+}  // namespace ebpf
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "BPFMapIter.h"
+#include "common.h"
+#include "libbpf.h"
+
+namespace ebpf {
+
+namespace {
+
+const char* MAP_ITER_PROGRAM = R"(
+#include <linux/bpf.h>
+#include <linux/seq_file.h>
+
+/* the structure is defined in a .c file, so explicitly define
+ * it here.
+ */
+struct bpf_iter__bpf_map_elem {
+  union {
+    struct bpf_iter_meta *meta;
+  };
+  union {
+    struct bpf_map *map;
+  };
+  union {
+    void *key;
+  };
+  union {
+    void *value;
+  };
+};
+
+BPF_ITER(bpf_map_elem) {
+  struct seq_file *seq = ctx->meta->seq;
+  void *key = ctx->key;
+  void *value = ctx->value;
+
+  /* called once more at the end, without an element */
+  if (key == (void *)0 || value == (void *)0)
+    return 0;
+#ifdef ITER_FILTER
+  if (!(ITER_FILTER))
+    return 0;
+#endif
+
+  /* an element whose value does not fit in the buffer any more is written
+   * again, whole, in the next read
+   */
+  bpf_seq_write(seq, key, KEY_SIZE);
+  bpf_seq_write(seq, value, VALUE_SIZE);
+  return 0;
+}
+)";
+
+}  // namespace
+
+BPFMapIter::~BPFMapIter() {
+  if (link_fd_ >= 0)
+    close(link_fd_);
+}
+
+StatusTuple BPFMapIter::init(const TableDesc& desc, const std::string& filter) {
+  if (initialized_)
+    return StatusTuple(-1, "BPFMapIter is already initialized");
+  bool percpu = false;
+  switch (desc.type) {
+  case BPF_MAP_TYPE_HASH:
+  case BPF_MAP_TYPE_LRU_HASH:
+  case BPF_MAP_TYPE_ARRAY:
+    break;
+  case BPF_MAP_TYPE_PERCPU_HASH:
+  case BPF_MAP_TYPE_LRU_PERCPU_HASH:
+  case BPF_MAP_TYPE_PERCPU_ARRAY:
+    percpu = true;
+    break;
+  default:
+    return StatusTuple(-1, "Map type %d has no element iterator", desc.type);
+  }
+  key_size_ = desc.key_size;
+  value_size_ = desc.leaf_size;
+  if (percpu)
+    value_size_ = ((value_size_ + 7) & ~7) * get_possible_cpus().size();
+
+  std::vector<std::string> cflags = {
+      "-DKEY_SIZE=" + std::to_string(key_size_),
+      "-DVALUE_SIZE=" + std::to_string(value_size_)};
+  std::string program = MAP_ITER_PROGRAM;
+  if (!filter.empty()) {
+    std::string expr = filter;
+    std::replace(expr.begin(), expr.end(), '\n', ' ');
+    program = "#define ITER_FILTER " + expr + "\n" + program;
+  }
+  TRY2(bpf_.init(program, cflags));
+
+  int prog_fd;
+  TRY2(bpf_.load_func("bpf_iter__bpf_map_elem", BPF_PROG_TYPE_TRACING,
+                      prog_fd));
+  // the link holds a reference of the map, which the module may close first
+  union bpf_iter_link_info link_info = {};
+  link_info.map.map_fd = desc.fd;
+  link_fd_ = bcc_iter_attach(prog_fd, &link_info, sizeof(link_info));
+  if (link_fd_ < 0)
+    return StatusTuple(-1, "Unable to attach map element iterator: %s",
+                       std::strerror(errno));
+  initialized_ = true;
+  return StatusTuple::OK();
+}
+
+StatusTuple BPFMapIter::dump(std::vector<char>& records) {
+  if (!initialized_)
+    return StatusTuple(-1, "BPFMapIter is not initialized");
+  int iter_fd = bcc_iter_create(link_fd_);
+  if (iter_fd < 0)
+    return StatusTuple(-1, "Unable to create iterator: %s",
+                       std::strerror(errno));
+
+  // The kernel hands out whole records, at most a few pages worth per read
+  records.clear();
+  size_t used = 0;
+  while (true) {
+    if (records.size() - used < 64 * 1024)
+      records.resize(std::max(records.size() * 2, used + 64 * 1024));
+    ssize_t len = read(iter_fd, records.data() + used, records.size() - used);
+    if (len == 0)
+      break;
+    if (len < 0) {
+      if (errno == EAGAIN)
+        continue;
+      int err = errno;
+      close(iter_fd);
+      return StatusTuple(-1, "Error reading iterator: %s", std::strerror(err));
+    }
+    used += len;
+  }
+  close(iter_fd);
+  records.resize(used - used % record_size());
+  return StatusTuple::OK();
+}
+
+StatusTuple BPFMapIter::for_each(const visit_fn& fn) {
+  std::vector<char> records;
+  TRY2(dump(records));
+  for (size_t off = 0; off < records.size(); off += record_size())
+    if (!fn(records.data() + off, records.data() + off + key_size_))
+      break;
+  return StatusTuple::OK();
+}
+
+}  // namespace ebpf
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "BPF.h"
+#include "bcc_exception.h"
+#include "table_desc.h"
+
+namespace ebpf {
+
+// Dump a hash or array map with a BPF map element iterator: the kernel runs
+// a program on every element, which writes the key and the value to a file
+// read in one loop, instead of a syscall per element or per batch. Elements
+// can be filtered in the kernel, before they are copied at all.
+//
+// Needs Linux 5.9. init() compiles the iterator program for the key and
+// value sizes of the map, so the object is meant to be kept and reused. It
+// is usually initialized with BPF::init_map_iter().
+class BPFMapIter {
+ public:
+  BPFMapIter() = default;
+  ~BPFMapIter();
+  BPFMapIter(const BPFMapIter&) = delete;
+  BPFMapIter& operator=(const BPFMapIter&) = delete;
+
+  // filter is a C expression over key and value, void pointers to the key
+  // and the value of an element, e.g. "*(u64 *)value >= 100". Elements it
+  // is false for are skipped. The value of a per-CPU map is that of every
+  // possible CPU, each rounded up to 8 bytes.
+  StatusTuple init(const TableDesc& desc, const std::string& filter = "");
+
+  size_t key_size() const { return key_size_; }
+  size_t value_size() const { return value_size_; }
+  size_t record_size() const { return key_size_ + value_size_; }
+
+  // Records of the key followed by the value, packed
+  StatusTuple dump(std::vector<char>& records);
+
+  // Visit the records of a dump. Returning false from fn stops the walk.
+  typedef std::function<bool(const void* key, const void* value)> visit_fn;
+  StatusTuple for_each(const visit_fn& fn);
+
+ private:
+  size_t key_size_ = 0;
+  size_t value_size_ = 0;
+
+  BPF bpf_;
+  bool initialized_ = false;
+  int link_fd_ = -1;
+};
+
+}  // namespace ebpf
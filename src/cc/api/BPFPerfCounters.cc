@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+#include "BPFPerfCounters.h"
+
+namespace ebpf {
+
+namespace {
+
+#if defined(__x86_64__) || defined(__i386__)
+inline uint64_t rdpmc(uint32_t counter) {
+  uint32_t low, high;
+  asm volatile("rdpmc" : "=a"(low), "=d"(high) : "c"(counter));
+  return low | (uint64_t(high) << 32);
+}
+#define HAVE_RDPMC 1
+#endif
+
+}  // namespace
+
+BPFPerfCounters::~BPFPerfCounters() { close(); }
+
+StatusTuple BPFPerfCounters::open(
+    const std::vector<std::pair<uint32_t, uint64_t>>& events) {
+  if (!fds_.empty())
+    return StatusTuple(-1, "Perf counters already open");
+  if (events.empty())
+    return StatusTuple(-1, "No perf counter to open");
+
+  long page_size = sysconf(_SC_PAGESIZE);
+  for (const auto& ev : events) {
+    struct perf_event_attr attr = {};
+    attr.size = sizeof(attr);
+    attr.type = ev.first;
+    attr.config = ev.second;
+    attr.read_format = PERF_FORMAT_GROUP;
+    int group_fd = fds_.empty() ? -1 : fds_[0];
+    int fd = syscall(__NR_perf_event_open, &attr, 0, -1, group_fd,
+                     PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0) {
+      int err = errno;
+      close();
+      return StatusTuple(-1, "Can't open perf counter %u:%lu: %s", ev.first,
+                         (unsigned long)ev.second, std::strerror(err));
+    }
+    fds_.push_back(fd);
+
+    // The first page only, which holds the state of the counter
+    void* page = mmap(nullptr, page_size, PROT_READ, MAP_SHARED, fd, 0);
+    pages_.push_back(page == MAP_FAILED
+                         ? nullptr
+                         : static_cast<perf_event_mmap_page*>(page));
+  }
+  return StatusTuple::OK();
+}
+
+void BPFPerfCounters::close() {
+  long page_size = sysconf(_SC_PAGESIZE);
+  for (auto page : pages_)
+    if (page)
+      munmap(page, page_size);
+  for (int fd : fds_)
+    ::close(fd);
+  pages_.clear();
+  fds_.clear();
+}
+
+bool BPFPerfCounters::read_rdpmc(std::vector<uint64_t>& values) {
+#ifdef HAVE_RDPMC
+  for (size_t i = 0; i < pages_.size(); i++) {
+    volatile perf_event_mmap_page* pc = pages_[i];
+    if (!pc)
+      return false;
+    uint32_t seq;
+    uint64_t count;
+    do {
+      seq = pc->lock;
+      asm volatile("" ::: "memory");
+      // index is 0 for software events, or while the counter is not on the
+      // PMU, e.g. multiplexed out
+      uint32_t idx = pc->index;
+      if (!pc->cap_user_rdpmc || !idx)
+        return false;
+      uint16_t width = pc->pmc_width;
+      int64_t pmc = rdpmc(idx - 1);
+      // Sign extend the width bits of the counter
+      pmc <<= 64 - width;
+      pmc >>= 64 - width;
+      count = pc->offset + pmc;
+      asm volatile("" ::: "memory");
+    } while (pc->lock != seq);
+    values[i] = count;
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+StatusTuple BPFPerfCounters::read(std::vector<uint64_t>& values) {
+  if (fds_.empty())
+    return StatusTuple(-1, "Perf counters not open");
+
+  values.assign(fds_.size(), 0);
+  used_rdpmc_ = read_rdpmc(values);
+  if (used_rdpmc_)
+    return StatusTuple::OK();
+
+  // PERF_FORMAT_GROUP: the number of events, then their values
+  std::vector<uint64_t> buf(fds_.size() + 1);
+  ssize_t size = buf.size() * sizeof(uint64_t);
+  if (::read(fds_[0], buf.data(), size) != size)
+    return StatusTuple(-1, "Can't read perf counters: %s",
+                       std::strerror(errno));
+  for (size_t i = 0; i < fds_.size(); i++)
+    values[i] = buf[i + 1];
+  return StatusTuple::OK();
+}
+
+}  // namespace ebpf
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "bcc_exception.h"
+
+struct perf_event_mmap_page;
+
+namespace ebpf {
+
+// A group of perf events counting the thread that opens it, on any CPU, to
+// attribute e.g. cycles, instructions and cache misses to sections of its
+// own code. The events are mapped, so that on x86 read() takes the hardware
+// counters with rdpmc, without any syscall, when the kernel allows it
+// (/sys/bus/event_source/devices/cpu/rdpmc). Otherwise, and for software
+// events, read() costs one read() of the group.
+//
+//   ebpf::BPFPerfCounters counters;
+//   counters.open({{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+//                  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS}});
+//   counters.read(before);
+//   ...
+//   counters.read(after);
+//
+// Only the thread that opened the group may read it.
+class BPFPerfCounters {
+ public:
+  BPFPerfCounters() = default;
+  ~BPFPerfCounters();
+  BPFPerfCounters(const BPFPerfCounters&) = delete;
+  BPFPerfCounters& operator=(const BPFPerfCounters&) = delete;
+
+  // Open events, the first one leading the group
+  StatusTuple open(const std::vector<std::pair<uint32_t, uint64_t>>& events);
+  void close();
+
+  // Values of the counters since open(), in the order of the events
+  StatusTuple read(std::vector<uint64_t>& values);
+  // Whether the last read() used rdpmc
+  bool used_rdpmc() const { return used_rdpmc_; }
+
+ private:
+  bool read_rdpmc(std::vector<uint64_t>& values);
+
+  std::vector<int> fds_;
+  std::vector<perf_event_mmap_page*> pages_;
+  bool used_rdpmc_ = false;
+};
+
+}  // namespace ebpf
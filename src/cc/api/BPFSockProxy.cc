@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include "BPFSockProxy.h"
+#include "libbpf.h"
+
+namespace ebpf {
+
+BPFSockProxy::BPFSockProxy(BPF& bpf, const std::string& sockhash)
+    : bpf_(bpf), sockhash_fd_(bpf.get_sockhash_table(sockhash).get_fd()) {}
+
+BPFSockProxy::~BPFSockProxy() {
+  auto res = detach_all();
+  if (!res.ok())
+    std::cerr << "Failed to detach socket proxy programs: " << res.msg()
+              << std::endl;
+}
+
+StatusTuple BPFSockProxy::attach(const std::string& func,
+                                 enum bpf_prog_type prog_type, int target_fd,
+                                 enum bpf_attach_type type) {
+  int prog_fd;
+  TRY2(bpf_.load_func(func, prog_type, prog_fd));
+  TRY2(bpf_.attach_func(prog_fd, target_fd, type, 0));
+  attachments_.push_back({prog_fd, target_fd, type});
+  return StatusTuple::OK();
+}
+
+StatusTuple BPFSockProxy::attach_sock_ops(const std::string& cgroup_path,
+                                          const std::string& func) {
+  int cgroup_fd = open(cgroup_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (cgroup_fd < 0)
+    return StatusTuple(-1, "Unable to open cgroup %s: %s",
+                       cgroup_path.c_str(), std::strerror(errno));
+  auto res = attach(func, BPF_PROG_TYPE_SOCK_OPS, cgroup_fd,
+                    BPF_CGROUP_SOCK_OPS);
+  if (!res.ok()) {
+    close(cgroup_fd);
+    return res;
+  }
+  cgroup_fds_.push_back(cgroup_fd);
+  return StatusTuple::OK();
+}
+
+StatusTuple BPFSockProxy::attach_msg_verdict(const std::string& func) {
+  return attach(func, BPF_PROG_TYPE_SK_MSG, sockhash_fd_,
+                BPF_SK_MSG_VERDICT);
+}
+
+StatusTuple BPFSockProxy::attach_skb_verdict(const std::string& func,
+                                             const std::string& parser_func) {
+  if (!parser_func.empty())
+    TRY2(attach(parser_func, BPF_PROG_TYPE_SK_SKB, sockhash_fd_,
+                BPF_SK_SKB_STREAM_PARSER));
+  return attach(func, BPF_PROG_TYPE_SK_SKB, sockhash_fd_,
+                BPF_SK_SKB_STREAM_VERDICT);
+}
+
+StatusTuple BPFSockProxy::detach_all() {
+  bool has_error = false;
+  std::string error_msg;
+
+  // In reverse, so a stream verdict program goes before its parser
+  for (auto it = attachments_.rbegin(); it != attachments_.rend(); ++it) {
+    auto res = bpf_.detach_func(it->prog_fd, it->target_fd, it->type);
+    if (!res.ok()) {
+      error_msg += res.msg() + "\n";
+      has_error = true;
+    }
+  }
+  attachments_.clear();
+  for (int fd : cgroup_fds_)
+    close(fd);
+  cgroup_fds_.clear();
+
+  if (has_error)
+    return StatusTuple(-1, error_msg);
+  return StatusTuple::OK();
+}
+
+StatusTuple BPFSockProxy::remove(const BPFSockKey& key) {
+  if (bpf_delete_elem(sockhash_fd_, const_cast<BPFSockKey*>(&key)) < 0)
+    return StatusTuple(-1, "Error removing socket: %s", std::strerror(errno));
+  return StatusTuple::OK();
+}
+
+}  // namespace ebpf
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <linux/bpf.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "BPF.h"
+#include "bcc_exception.h"
+
+namespace ebpf {
+
+// struct sock_tuple_key of helpers.h
+struct BPFSockKey {
+  uint32_t family;
+  uint32_t local_ip[4];
+  uint32_t remote_ip[4];
+  uint32_t local_port;
+  uint32_t remote_port;
+};
+
+// Splice local TCP connections, e.g. between a sidecar proxy and an
+// application, in the kernel: data sent on one socket is queued straight to
+// the receive queue of the socket at the other end, without going down and
+// back up the TCP/IP stack.
+//
+// A sock_ops program adds the established sockets of a cgroup to a
+// BPF_SOCKHASH keyed by struct sock_tuple_key, and an sk_msg (or sk_skb)
+// verdict program on the hash redirects each message to the socket of the
+// other end:
+//
+//   BPF_SOCKHASH(socks, struct sock_tuple_key, 65535);
+//
+//   int add_sock(struct bpf_sock_ops *skops) {
+//     struct sock_tuple_key key;
+//     if (skops->op == BPF_SOCK_OPS_PASSIVE_ESTABLISHED_CB ||
+//         skops->op == BPF_SOCK_OPS_ACTIVE_ESTABLISHED_CB) {
+//       bpf_sock_ops_tuple(skops, &key);
+//       socks.sock_hash_update(skops, &key, BPF_NOEXIST);
+//     }
+//     return 0;
+//   }
+//
+//   int redirect(struct sk_msg_md *msg) {
+//     struct sock_tuple_key key;
+//     bpf_sk_msg_peer_tuple(msg, &key);
+//     return socks.msg_redirect_hash(msg, &key, BPF_F_INGRESS);
+//   }
+//
+// Messages whose peer isn't in the hash take the regular path. Programs
+// attached through this class are detached when it is destroyed, which must
+// happen before the BPF object goes away.
+class BPFSockProxy {
+ public:
+  // Throws std::invalid_argument if sockhash isn't a BPF_SOCKHASH
+  BPFSockProxy(BPF& bpf, const std::string& sockhash);
+  ~BPFSockProxy();
+  BPFSockProxy(const BPFSockProxy&) = delete;
+  BPFSockProxy& operator=(const BPFSockProxy&) = delete;
+
+  // Run the sock_ops function for the sockets of the cgroup v2 at path
+  StatusTuple attach_sock_ops(const std::string& cgroup_path,
+                              const std::string& func);
+  // Run the sk_msg function for the data sent on the sockets of the hash
+  StatusTuple attach_msg_verdict(const std::string& func);
+  // Run the sk_skb function for the data received on the sockets of the
+  // hash, after the optional parser_func cut it into messages
+  StatusTuple attach_skb_verdict(const std::string& func,
+                                 const std::string& parser_func = "");
+  StatusTuple detach_all();
+
+  // Take the socket of key out of the hash, so its data goes through the
+  // stack again
+  StatusTuple remove(const BPFSockKey& key);
+
+ private:
+  struct attachment {
+    int prog_fd;
+    int target_fd;
+    enum bpf_attach_type type;
+  };
+
+  StatusTuple attach(const std::string& func, enum bpf_prog_type prog_type,
+                     int target_fd, enum bpf_attach_type type);
+
+  BPF& bpf_;
+  int sockhash_fd_;
+  std::vector<int> cgroup_fds_;
+  std::vector<attachment> attachments_;
+};
+
+}  // namespace ebpf
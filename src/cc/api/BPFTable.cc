@@ -14,26 +14,36 @@
  * limitations under the License.
  */
 
+#include <arpa/inet.h>
 #include <fcntl.h>
 #include <linux/elf.h>
 #include <linux/perf_event.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
+#include <algorithm>
 #include <cerrno>
+#include <chrono>
 #include <cinttypes>
+#include <cmath>
 #include <cstdint>
 #include <cstring>
 #include <iostream>
 #include <memory>
 
 #include "BPFTable.h"
+#include "BPFMapIter.h"
 
+#include "bcc_common.h"
 #include "bcc_exception.h"
 #include "bcc_syms.h"
 #include "common.h"
 #include "file_desc.h"
 #include "libbpf.h"
 #include "perf_reader.h"
+#include "table_storage.h"
 
 namespace ebpf {
 
@@ -180,8 +190,30 @@ StatusTuple BPFTable::clear_table_non_atomic() {
   return StatusTuple::OK();
 }
 
+static bool is_array_map(int type) {
+  return type == BPF_MAP_TYPE_ARRAY ||
+         type == BPF_MAP_TYPE_PROG_ARRAY ||
+         type == BPF_MAP_TYPE_PERF_EVENT_ARRAY ||
+         type == BPF_MAP_TYPE_PERCPU_ARRAY ||
+         type == BPF_MAP_TYPE_CGROUP_ARRAY ||
+         type == BPF_MAP_TYPE_ARRAY_OF_MAPS ||
+         type == BPF_MAP_TYPE_DEVMAP ||
+         type == BPF_MAP_TYPE_CPUMAP ||
+         type == BPF_MAP_TYPE_REUSEPORT_SOCKARRAY;
+}
+
 StatusTuple BPFTable::get_table_offline(
   std::vector<std::pair<std::string, std::string>> &res) {
+  if (!is_array_map(desc.type))
+    res.clear();
+  return for_each([&](const std::string& key_str,
+                      const std::string& value_str) {
+    res.emplace_back(key_str, value_str);
+    return true;
+  });
+}
+
+StatusTuple BPFTable::for_each(const visit_fn& fn) {
   StatusTuple r(0);
   int err;
 
@@ -192,15 +224,7 @@ StatusTuple BPFTable::get_table_offline(
   std::string key_str;
   std::string value_str;
 
-  if (desc.type == BPF_MAP_TYPE_ARRAY ||
-      desc.type == BPF_MAP_TYPE_PROG_ARRAY ||
-      desc.type == BPF_MAP_TYPE_PERF_EVENT_ARRAY ||
-      desc.type == BPF_MAP_TYPE_PERCPU_ARRAY ||
-      desc.type == BPF_MAP_TYPE_CGROUP_ARRAY ||
-      desc.type == BPF_MAP_TYPE_ARRAY_OF_MAPS ||
-      desc.type == BPF_MAP_TYPE_DEVMAP ||
-      desc.type == BPF_MAP_TYPE_CPUMAP ||
-      desc.type == BPF_MAP_TYPE_REUSEPORT_SOCKARRAY) {
+  if (is_array_map(desc.type)) {
     // For arrays, just iterate over all indices
     for (size_t i = 0; i < desc.max_entries; i++) {
       err = bpf_lookup_elem(desc.fd, &i, value.get());
@@ -219,10 +243,30 @@ StatusTuple BPFTable::get_table_offline(
       r = leaf_to_string(value.get(), value_str);
       if (!r.ok())
         return r;
-      res.emplace_back(key_str, value_str);
+      if (!fn(key_str, value_str))
+        break;
     }
   } else {
-    res.clear();
+    if (desc.type != BPF_MAP_TYPE_PERCPU_HASH &&
+        desc.type != BPF_MAP_TYPE_LRU_PERCPU_HASH) {
+      // Fetch entries in bulk when the kernel supports batch ops
+      auto batch_fn = [&](const char* keys, const char* values, __u32 count) {
+        for (__u32 i = 0; i < count; i++) {
+          r = key_to_string(keys + i * desc.key_size, key_str);
+          if (r.ok())
+            r = leaf_to_string(values + i * desc.leaf_size, value_str);
+          if (!r.ok() || !fn(key_str, value_str))
+            return false;
+        }
+        return true;
+      };
+      if (batch_walk(desc.leaf_size, batch_fn) == 0)
+        return r;
+      if (errno != EOPNOTSUPP)
+        return StatusTuple(-1, "Error looking up batch: %s",
+                           std::strerror(errno));
+    }
+
     // For other maps, try to use the first() and next() interfaces
     if (!this->first(key.get()))
       return StatusTuple::OK();
@@ -237,7 +281,8 @@ StatusTuple BPFTable::get_table_offline(
       r = leaf_to_string(value.get(), value_str);
       if (!r.ok())
         return r;
-      res.emplace_back(key_str, value_str);
+      if (!fn(key_str, value_str))
+        break;
       if (!this->next(key.get(), key.get()))
         break;
     }
@@ -246,12 +291,715 @@ StatusTuple BPFTable::get_table_offline(
   return StatusTuple::OK();
 }
 
+StatusTuple BPFTable::dump_via_iter(
+    std::vector<std::pair<std::string, std::string>>& res,
+    const std::string& filter) {
+  if (desc.type == BPF_MAP_TYPE_PERCPU_HASH ||
+      desc.type == BPF_MAP_TYPE_LRU_PERCPU_HASH ||
+      desc.type == BPF_MAP_TYPE_PERCPU_ARRAY)
+    return StatusTuple(-1, "Per-CPU values need BPFMapIter");
+
+  BPFMapIter iter;
+  TRY2(iter.init(desc, filter));
+  res.clear();
+  std::string key_str;
+  std::string value_str;
+  StatusTuple r(0);
+  TRY2(iter.for_each([&](const void* key, const void* value) {
+    r = key_to_string(key, key_str);
+    if (r.ok())
+      r = leaf_to_string(value, value_str);
+    if (!r.ok())
+      return false;
+    res.emplace_back(key_str, value_str);
+    return true;
+  }));
+  return r;
+}
+
 size_t BPFTable::get_possible_cpu_count() { return get_possible_cpus().size(); }
 
+uint64_t BPFHistogram::total() const {
+  uint64_t sum = 0;
+  for (uint64_t c : counts)
+    sum += c;
+  return sum;
+}
+
+void BPFHistogram::merge(const BPFHistogram& other) {
+  if (counts.size() < other.counts.size())
+    counts.resize(other.counts.size());
+  for (size_t i = 0; i < other.counts.size(); i++)
+    counts[i] += other.counts[i];
+}
+
+template <class Bounds>
+static double hist_percentile(const std::vector<uint64_t>& counts, double q,
+                              Bounds bounds) {
+  uint64_t sum = 0;
+  for (uint64_t c : counts)
+    sum += c;
+  if (!sum)
+    return 0;
+  q = std::min(std::max(q, 0.0), 1.0);
+
+  double rank = q * sum, seen = 0;
+  for (size_t i = 0; i < counts.size(); i++) {
+    if (!counts[i] || seen + counts[i] < rank) {
+      seen += counts[i];
+      continue;
+    }
+    double low, high;
+    bounds(i, low, high);
+    return low + (high - low) * (rank - seen) / counts[i];
+  }
+  double low, high;
+  bounds(counts.size(), low, high);
+  return low;
+}
+
+double BPFHistogram::percentile(double q, Scale scale) const {
+  return hist_percentile(counts, q, [scale](size_t i, double& low,
+                                            double& high) {
+    if (scale == LINEAR) {
+      low = i;
+      high = i + 1;
+    } else {
+      low = i ? std::ldexp(1.0, i - 1) : 0;
+      high = std::ldexp(1.0, i);
+    }
+  });
+}
+
+double BPFHistogram::percentile(double q,
+                                const std::vector<double>& bounds) const {
+  if (bounds.size() < counts.size() + 1)
+    return 0;
+  return hist_percentile(counts, q, [&bounds](size_t i, double& low,
+                                              double& high) {
+    low = bounds[i];
+    high = i + 1 < bounds.size() ? bounds[i + 1] : bounds[i];
+  });
+}
+
+std::vector<double> BPFHistogram::log_linear_bounds(unsigned int sub_bits,
+                                                    size_t n) {
+  std::vector<double> bounds(n + 1);
+  size_t linear = size_t(1) << sub_bits;
+  for (size_t i = 0; i <= n; i++) {
+    if (i < linear) {
+      bounds[i] = i;
+      continue;
+    }
+    // slot (g << sub_bits) + m starts at (2^sub_bits + m) << (g - 1)
+    size_t g = i >> sub_bits, m = i & (linear - 1);
+    bounds[i] = std::ldexp(double(linear + m), g - 1);
+  }
+  return bounds;
+}
+
+BPFHistogramDelta::BPFHistogramDelta(const TableDesc& desc)
+    : BPFTableBase<void, void>(desc), ncpus_(1) {
+  if (desc.type == BPF_MAP_TYPE_PERCPU_ARRAY)
+    ncpus_ = BPFTable::get_possible_cpu_count();
+  else if (desc.type != BPF_MAP_TYPE_ARRAY)
+    throw std::invalid_argument("Table '" + desc.name +
+                                "' is not an array or percpu array table");
+  if (desc.key_size != sizeof(int) || desc.leaf_size != sizeof(uint64_t))
+    throw std::invalid_argument("Table '" + desc.name +
+                                "' does not hold u64 slots");
+  last_.assign(desc.max_entries, 0);
+}
+
+StatusTuple BPFHistogramDelta::update(bool advance) {
+  cur_.assign(desc.max_entries, 0);
+
+  auto add = [&](int index, const char* values) {
+    if (index < 0 || (size_t)index >= cur_.size())
+      return;
+    for (size_t cpu = 0; cpu < ncpus_; cpu++) {
+      uint64_t v;
+      std::memcpy(&v, values + cpu * sizeof(v), sizeof(v));
+      cur_[index] += v;
+    }
+  };
+  size_t value_size = sizeof(uint64_t) * ncpus_;
+  auto batch_fn = [&](const char* keys, const char* values, __u32 count) {
+    for (__u32 i = 0; i < count; i++) {
+      int index;
+      std::memcpy(&index, keys + i * sizeof(int), sizeof(int));
+      add(index, values + i * value_size);
+    }
+    return true;
+  };
+  if (batch_walk(value_size, batch_fn) != 0) {
+    if (errno != EOPNOTSUPP)
+      return StatusTuple(-1, "Error looking up batch: %s",
+                         std::strerror(errno));
+
+    std::vector<char> value(value_size);
+    for (int i = 0; i < (int)cur_.size(); i++) {
+      if (lookup(&i, value.data()))
+        add(i, value.data());
+    }
+  }
+
+  delta_.counts.resize(cur_.size());
+  for (size_t i = 0; i < cur_.size(); i++)
+    delta_.counts[i] = cur_[i] > last_[i] ? cur_[i] - last_[i] : 0;
+  if (advance)
+    std::swap(last_, cur_);
+  return StatusTuple::OK();
+}
+
+static void put_varint(std::string& out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back((char)(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back((char)v);
+}
+
+static bool get_varint(const std::string& in, size_t& pos, uint64_t& v) {
+  v = 0;
+  for (int shift = 0; pos < in.size() && shift < 64; shift += 7) {
+    unsigned char b = in[pos++];
+    v |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return true;
+  }
+  return false;
+}
+
+std::string BPFHistogram::serialize() const {
+  std::string out;
+  uint64_t n = 0;
+  for (uint64_t c : counts)
+    n += c != 0;
+  put_varint(out, n);
+
+  uint64_t prev = 0;
+  for (size_t i = 0; i < counts.size(); i++) {
+    if (!counts[i])
+      continue;
+    put_varint(out, i - prev);
+    put_varint(out, counts[i]);
+    prev = i;
+  }
+  return out;
+}
+
+StatusTuple BPFHistogram::deserialize(const std::string& data,
+                                      BPFHistogram& hist) {
+  size_t pos = 0;
+  uint64_t n, slot = 0, delta, count;
+
+  hist.counts.clear();
+  if (!get_varint(data, pos, n))
+    return StatusTuple(-1, "truncated histogram");
+  for (uint64_t i = 0; i < n; i++) {
+    if (!get_varint(data, pos, delta) || !get_varint(data, pos, count))
+      return StatusTuple(-1, "truncated histogram");
+    slot += delta;
+    if (slot >= (1 << 16))
+      return StatusTuple(-1, "histogram slot %" PRIu64 " out of range", slot);
+    if (hist.counts.size() <= slot)
+      hist.counts.resize(slot + 1);
+    hist.counts[slot] = count;
+  }
+  return StatusTuple::OK();
+}
+
+BPFTableSnapshot::BPFTableSnapshot(const TableDesc& desc)
+    : BPFTableBase<void, void>(desc),
+      entry_size_(desc.key_size + desc.leaf_size) {
+  if (desc.type != BPF_MAP_TYPE_HASH &&
+      desc.type != BPF_MAP_TYPE_LRU_HASH &&
+      desc.type != BPF_MAP_TYPE_ARRAY)
+    throw std::invalid_argument("Table '" + desc.name +
+                                "' is not a hash or array table");
+}
+
+static uint64_t hash_key(const char* key, size_t size) {
+  // FNV-1a
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; i++) {
+    h ^= (unsigned char)key[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+void BPFTableSnapshot::append(Store& store, const void* key,
+                              const void* value) {
+  size_t off = store.count * entry_size_;
+  store.entries.resize(off + entry_size_);
+  std::memcpy(&store.entries[off], key, desc.key_size);
+  std::memcpy(&store.entries[off + desc.key_size], value, desc.leaf_size);
+  store.count++;
+}
+
+void BPFTableSnapshot::build_index(Store& store) {
+  size_t nslots = 16;
+  while (nslots < store.count * 2)
+    nslots <<= 1;
+  store.slots.assign(nslots, 0);
+  store.seen.assign(store.count, 0);
+
+  for (size_t i = 0; i < store.count; i++) {
+    const char* key = &store.entries[i * entry_size_];
+    size_t slot = hash_key(key, desc.key_size) & (nslots - 1);
+    while (store.slots[slot]) {
+      // a key returned twice by the walk keeps its latest value
+      if (!std::memcmp(&store.entries[(store.slots[slot] - 1) * entry_size_],
+                       key, desc.key_size))
+        break;
+      slot = (slot + 1) & (nslots - 1);
+    }
+    store.slots[slot] = i + 1;
+  }
+}
+
+ssize_t BPFTableSnapshot::find(const Store& store, const char* key) const {
+  if (store.slots.empty())
+    return -1;
+  size_t mask = store.slots.size() - 1;
+  size_t slot = hash_key(key, desc.key_size) & mask;
+  while (store.slots[slot]) {
+    size_t i = store.slots[slot] - 1;
+    if (!std::memcmp(&store.entries[i * entry_size_], key, desc.key_size))
+      return i;
+    slot = (slot + 1) & mask;
+  }
+  return -1;
+}
+
+template <class T>
+static void sub_counters(char* dst, const char* cur, const char* prev,
+                         size_t size) {
+  for (size_t off = 0; off < size; off += sizeof(T)) {
+    T a, b;
+    std::memcpy(&a, cur + off, sizeof(T));
+    std::memcpy(&b, prev + off, sizeof(T));
+    a -= b;
+    std::memcpy(dst + off, &a, sizeof(T));
+  }
+}
+
+void BPFTableSnapshot::compute_delta(char* dst, const char* cur,
+                                     const char* prev) const {
+  size_t size = desc.leaf_size;
+  if (size % 8 == 0)
+    sub_counters<uint64_t>(dst, cur, prev, size);
+  else if (size % 4 == 0)
+    sub_counters<uint32_t>(dst, cur, prev, size);
+  else if (size % 2 == 0)
+    sub_counters<uint16_t>(dst, cur, prev, size);
+  else
+    sub_counters<uint8_t>(dst, cur, prev, size);
+}
+
+StatusTuple BPFTableSnapshot::update() {
+  // next_ reuses the buffers of the snapshot before the current one
+  std::swap(next_, prev_);
+  next_.count = 0;
+  next_.entries.clear();
+
+  auto batch_fn = [&](const char* keys, const char* values, __u32 count) {
+    for (__u32 i = 0; i < count; i++)
+      append(next_, keys + i * desc.key_size, values + i * desc.leaf_size);
+    return true;
+  };
+  if (batch_walk(desc.leaf_size, batch_fn) != 0) {
+    if (errno != EOPNOTSUPP)
+      return StatusTuple(-1, "Error looking up batch: %s",
+                         std::strerror(errno));
+
+    std::vector<char> key(desc.key_size), value(desc.leaf_size);
+    if (first(key.data())) {
+      do {
+        if (lookup(key.data(), value.data()))
+          append(next_, key.data(), value.data());
+      } while (next(key.data(), key.data()));
+    }
+  }
+  build_index(next_);
+
+  changes_.clear();
+  deltas_.resize(next_.count * desc.leaf_size);
+  for (size_t i = 0; i < next_.count; i++) {
+    const char* key = &next_.entries[i * entry_size_];
+    const char* value = key + desc.key_size;
+    // skip the stale copy of a key returned twice
+    if (find(next_, key) != (ssize_t)i)
+      continue;
+
+    ssize_t j = find(cur_, key);
+    if (j < 0) {
+      changes_.push_back({ADDED, key, value, value});
+      continue;
+    }
+    cur_.seen[j] = 1;
+    const char* prev_value = &cur_.entries[j * entry_size_ + desc.key_size];
+    if (!std::memcmp(value, prev_value, desc.leaf_size))
+      continue;
+    char* delta = &deltas_[i * desc.leaf_size];
+    compute_delta(delta, value, prev_value);
+    changes_.push_back({CHANGED, key, value, delta});
+  }
+  for (size_t j = 0; j < cur_.count; j++) {
+    if (cur_.seen[j])
+      continue;
+    const char* key = &cur_.entries[j * entry_size_];
+    // the same key may appear twice in cur_ as well
+    if (find(cur_, key) != (ssize_t)j)
+      continue;
+    changes_.push_back({REMOVED, key, key + desc.key_size, nullptr});
+  }
+
+  // entries removed in this round point into prev_, keep it until next time
+  std::swap(prev_, cur_);
+  std::swap(cur_, next_);
+  return StatusTuple::OK();
+}
+
+BPFTableTop::BPFTableTop(const TableDesc& desc, std::vector<Field> fields,
+                         size_t k)
+    : BPFTableBase<void, void>(desc),
+      fields_(std::move(fields)),
+      k_(k),
+      entry_size_(desc.key_size + desc.leaf_size) {
+  if (desc.type != BPF_MAP_TYPE_HASH && desc.type != BPF_MAP_TYPE_LRU_HASH)
+    throw std::invalid_argument("Table '" + desc.name +
+                                "' is not a hash table");
+  for (const Field& f : fields_) {
+    if ((f.size != 1 && f.size != 2 && f.size != 4 && f.size != 8) ||
+        f.offset + f.size > desc.leaf_size)
+      throw std::invalid_argument("Invalid score field for table '" +
+                                  desc.name + "'");
+  }
+}
+
+uint64_t BPFTableTop::score(const char* value) const {
+  uint64_t sum = 0;
+  for (const Field& f : fields_) {
+    switch (f.size) {
+    case 1: sum += *(const uint8_t*)(value + f.offset); break;
+    case 2: {
+      uint16_t v;
+      std::memcpy(&v, value + f.offset, sizeof(v));
+      sum += v;
+      break;
+    }
+    case 4: {
+      uint32_t v;
+      std::memcpy(&v, value + f.offset, sizeof(v));
+      sum += v;
+      break;
+    }
+    default: {
+      uint64_t v;
+      std::memcpy(&v, value + f.offset, sizeof(v));
+      sum += v;
+    }
+    }
+  }
+  return sum;
+}
+
+void BPFTableTop::add(const char* key, const char* value) {
+  typedef std::pair<uint64_t, size_t> Item;
+  uint64_t s = score(value);
+  size_t i;
+
+  total_++;
+  if (k_ && order_.size() == k_) {
+    // replace the smallest candidate, if this one is larger
+    if (s <= order_.front().first)
+      return;
+    std::pop_heap(order_.begin(), order_.end(), std::greater<Item>());
+    i = order_.back().second;
+    order_.back().first = s;
+  } else {
+    i = order_.size();
+    entries_.resize((i + 1) * entry_size_);
+    order_.emplace_back(s, i);
+  }
+  std::memcpy(&entries_[i * entry_size_], key, desc.key_size);
+  std::memcpy(&entries_[i * entry_size_ + desc.key_size], value,
+              desc.leaf_size);
+  if (k_)
+    std::push_heap(order_.begin(), order_.end(), std::greater<Item>());
+}
+
+StatusTuple BPFTableTop::update(bool drain) {
+  typedef std::pair<uint64_t, size_t> Item;
+
+  total_ = 0;
+  entries_.clear();
+  order_.clear();
+
+  auto batch_fn = [&](const char* keys, const char* values, __u32 count) {
+    for (__u32 i = 0; i < count; i++)
+      add(keys + i * desc.key_size, values + i * desc.leaf_size);
+    return true;
+  };
+  if (batch_walk(desc.leaf_size, batch_fn, drain) != 0) {
+    if (errno != EOPNOTSUPP)
+      return StatusTuple(-1, "Error looking up batch: %s",
+                         std::strerror(errno));
+
+    // collect the keys first, next() cannot walk a table being deleted from
+    std::vector<char> keys, key(desc.key_size), value(desc.leaf_size);
+    if (first(key.data())) {
+      do {
+        keys.insert(keys.end(), key.begin(), key.end());
+      } while (next(key.data(), key.data()));
+    }
+    for (size_t off = 0; off < keys.size(); off += desc.key_size) {
+      if (!lookup(&keys[off], value.data()))
+        continue;
+      if (drain)
+        remove(&keys[off]);
+      add(&keys[off], value.data());
+    }
+  }
+
+  // largest score first. Without k, entries of equal scores stay in the
+  // order they were read.
+  std::sort(order_.begin(), order_.end(), [](const Item& a, const Item& b) {
+    return a.first != b.first ? a.first > b.first : a.second < b.second;
+  });
+  keys_.resize(order_.size() * desc.key_size);
+  values_.resize(order_.size() * desc.leaf_size);
+  for (size_t i = 0; i < order_.size(); i++) {
+    const char* entry = &entries_[order_[i].second * entry_size_];
+    std::memcpy(&keys_[i * desc.key_size], entry, desc.key_size);
+    std::memcpy(&values_[i * desc.leaf_size], entry + desc.key_size,
+                desc.leaf_size);
+  }
+  return StatusTuple::OK();
+}
+
+class BPFTablePoller::Source : public BPFTableBase<void, void> {
+ public:
+  Source(const TableDesc& desc, size_t value_size)
+      : BPFTableBase<void, void>(desc), value_size_(value_size) {}
+
+  StatusTuple read(Table& table) {
+    table.name = desc.name;
+    table.key_size = desc.key_size;
+    table.value_size = value_size_;
+    // clear() keeps the capacity, so a buffer stops allocating once it has
+    // held the largest table seen
+    table.entries.clear();
+    table.count = 0;
+
+    auto append = [&](const char* key, const char* value) {
+      table.entries.insert(table.entries.end(), key, key + desc.key_size);
+      table.entries.insert(table.entries.end(), value, value + value_size_);
+      table.count++;
+    };
+    auto batch_fn = [&](const char* keys, const char* values, __u32 count) {
+      for (__u32 i = 0; i < count; i++)
+        append(keys + i * desc.key_size, values + i * value_size_);
+      return true;
+    };
+    if (batch_walk(value_size_, batch_fn) == 0)
+      return StatusTuple::OK();
+    if (errno != EOPNOTSUPP)
+      return StatusTuple(-1, "Error looking up batch in table %s: %s",
+                         desc.name.c_str(), std::strerror(errno));
+
+    std::vector<char> key(desc.key_size), value(value_size_);
+    if (!first(key.data()))
+      return StatusTuple::OK();
+    do {
+      if (lookup(key.data(), value.data()))
+        append(key.data(), value.data());
+    } while (next(key.data(), key.data()));
+    return StatusTuple::OK();
+  }
+
+ private:
+  size_t value_size_;
+};
+
+const BPFTablePoller::Table* BPFTablePoller::Snapshot::find(
+    const std::string& name) const {
+  for (auto& table : tables)
+    if (table.name == name)
+      return &table;
+  return nullptr;
+}
+
+BPFTablePoller::BPFTablePoller(std::chrono::milliseconds interval)
+    : interval_(interval),
+      current_(0),
+      generation_(0),
+      stopping_(false),
+      last_status_(StatusTuple::OK()) {
+  pins_[0] = 0;
+  pins_[1] = 0;
+}
+
+BPFTablePoller::~BPFTablePoller() { stop(); }
+
+StatusTuple BPFTablePoller::add_table(const TableDesc& desc) {
+  if (thread_.joinable())
+    return StatusTuple(-1, "Cannot add table %s to a running poller",
+                       desc.name.c_str());
+
+  size_t value_size;
+  switch (desc.type) {
+  case BPF_MAP_TYPE_HASH:
+  case BPF_MAP_TYPE_LRU_HASH:
+  case BPF_MAP_TYPE_ARRAY:
+    value_size = desc.leaf_size;
+    break;
+  case BPF_MAP_TYPE_PERCPU_HASH:
+  case BPF_MAP_TYPE_LRU_PERCPU_HASH:
+  case BPF_MAP_TYPE_PERCPU_ARRAY:
+    // the kernel pads every per-cpu value to 8 bytes
+    value_size = ((desc.leaf_size + 7) & ~7UL) * BPFTable::get_possible_cpu_count();
+    break;
+  default:
+    return StatusTuple(-1, "Table %s is not a hash or array table",
+                       desc.name.c_str());
+  }
+  sources_.emplace_back(new Source(desc, value_size));
+  return StatusTuple::OK();
+}
+
+StatusTuple BPFTablePoller::poll_into(Snapshot& snapshot) {
+  snapshot.timestamp_ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count();
+  snapshot.tables.resize(sources_.size());
+  for (size_t i = 0; i < sources_.size(); i++)
+    TRY2(sources_[i]->read(snapshot.tables[i]));
+  snapshot.generation = ++generation_;
+  return StatusTuple::OK();
+}
+
+void BPFTablePoller::publish(StatusTuple status) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  last_status_ = std::move(status);
+}
+
+StatusTuple BPFTablePoller::poll_next() {
+  int next = 1 - current_.load();
+  // Grace period: readers that pinned this buffer before the last swap
+  // must be done before it is refilled
+  while (pins_[next].load() != 0)
+    std::this_thread::yield();
+
+  StatusTuple status = poll_into(buffers_[next]);
+  // a failed poll leaves the previous snapshot in place
+  if (status.ok())
+    current_.store(next);
+  publish(status);
+  return status;
+}
+
+StatusTuple BPFTablePoller::poll() {
+  if (thread_.joinable())
+    return StatusTuple(-1, "Poller is running in the background");
+  return poll_next();
+}
+
+BPFTablePoller::Reader BPFTablePoller::read() const {
+  while (true) {
+    int cur = current_.load();
+    pins_[cur].fetch_add(1);
+    // The poller may have swapped and started refilling cur in between;
+    // it checks the pins before writing, so the pin holds only if cur is
+    // still current afterwards
+    if (current_.load() == cur)
+      return Reader(&buffers_[cur], &pins_[cur]);
+    pins_[cur].fetch_sub(1);
+  }
+}
+
+StatusTuple BPFTablePoller::last_status() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return last_status_;
+}
+
+void BPFTablePoller::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopping_) {
+    auto deadline = std::chrono::steady_clock::now() + interval_;
+    lock.unlock();
+    poll_next();
+    lock.lock();
+    cv_.wait_until(lock, deadline, [this] { return stopping_; });
+  }
+}
+
+StatusTuple BPFTablePoller::start() {
+  if (thread_.joinable())
+    return StatusTuple(-1, "Poller already started");
+  if (sources_.empty())
+    return StatusTuple(-1, "No tables to poll");
+
+  stopping_ = false;
+  thread_ = std::thread(&BPFTablePoller::run, this);
+  return StatusTuple::OK();
+}
+
+StatusTuple BPFTablePoller::stop() {
+  if (!thread_.joinable())
+    return StatusTuple::OK();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+  return StatusTuple::OK();
+}
+
+namespace {
+
+template <class KeyType>
+StatusTuple parse_prefix(const std::string& prefix, int family,
+                         KeyType& key) {
+  const uint32_t max_len = key.data.size() * 8;
+  std::string addr = prefix;
+  key.prefixlen = max_len;
+  size_t slash = prefix.find('/');
+  if (slash != std::string::npos) {
+    addr = prefix.substr(0, slash);
+    const char* len = prefix.c_str() + slash + 1;
+    char* end;
+    unsigned long n = strtoul(len, &end, 10);
+    if (!*len || *end || n > max_len)
+      return StatusTuple(-1, "Invalid prefix length in %s", prefix.c_str());
+    key.prefixlen = n;
+  }
+  if (inet_pton(family, addr.c_str(), key.data.data()) != 1)
+    return StatusTuple(-1, "Invalid address in %s", prefix.c_str());
+  return StatusTuple::OK();
+}
+
+}  // namespace
+
+StatusTuple parse_lpm_prefix(const std::string& prefix, BPFLpmKeyV4& key) {
+  return parse_prefix(prefix, AF_INET, key);
+}
+
+StatusTuple parse_lpm_prefix(const std::string& prefix, BPFLpmKeyV6& key) {
+  return parse_prefix(prefix, AF_INET6, key);
+}
+
 BPFStackTable::BPFStackTable(const TableDesc& desc, bool use_debug_file,
                              bool check_debug_file_crc)
     : BPFTableBase<int, stacktrace_t>(desc) {
-  if (desc.type != BPF_MAP_TYPE_STACK_TRACE)
+  if (desc.type == BPF_MAP_TYPE_RINGBUF)
+    record_stacks_.reset(new record_stacks_t());
+  else if (desc.type != BPF_MAP_TYPE_STACK_TRACE)
     throw std::invalid_argument("Table '" + desc.name +
                                 "' is not a stack table");
 
@@ -260,31 +1008,55 @@ BPFStackTable::BPFStackTable(const TableDesc& desc, bool use_debug_file,
                     .check_debug_file_crc = check_debug_file_crc,
                     .lazy_symbolize = 1,
                     .use_symbol_type = use_symbol_type};
+  shards_.reset(new shard_t[NUM_SHARDS]);
 }
 
 BPFStackTable::BPFStackTable(BPFStackTable&& that)
     : BPFTableBase<int, stacktrace_t>(that.desc),
       symbol_option_(std::move(that.symbol_option_)),
-      pid_sym_(std::move(that.pid_sym_)) {
-  that.pid_sym_.clear();
-}
+      shards_(std::move(that.shards_)),
+      stack_cache_size_(that.stack_cache_size_.load()),
+      verify_stacks_(that.verify_stacks_.load()),
+      record_stacks_(std::move(that.record_stacks_)),
+      records_(std::move(that.records_)) {}
 
-BPFStackTable::~BPFStackTable() {
-  for (auto it : pid_sym_)
-    bcc_free_symcache(it.second, it.first);
-}
+BPFStackTable::~BPFStackTable() {}
 
 void BPFStackTable::free_symcache(int pid) {
-  auto iter = pid_sym_.find(pid);
-  if (iter != pid_sym_.end()) {
-    bcc_free_symcache(iter->second, iter->first);
-    pid_sym_.erase(iter);
+  shard_t& sh = shard(pid);
+  std::lock_guard<std::mutex> lock(sh.mutex);
+  sh.pid_sym.erase(pid);
+  for (auto it = sh.stack_cache.begin(); it != sh.stack_cache.end();) {
+    if (it->first.second == pid)
+      it = sh.stack_cache.erase(it);
+    else
+      ++it;
   }
 }
 
 void BPFStackTable::clear_table_non_atomic() {
-  for (int i = 0; size_t(i) < capacity(); i++) {
-    remove(&i);
+  if (record_stacks_) {
+    std::lock_guard<std::mutex> lock(record_stacks_->mutex);
+    record_stacks_->stacks.clear();
+    record_stacks_->ids.clear();
+  } else {
+    for (int i = 0; size_t(i) < capacity(); i++) {
+      remove(&i);
+    }
+  }
+  for (size_t i = 0; i < NUM_SHARDS; i++) {
+    std::lock_guard<std::mutex> lock(shards_[i].mutex);
+    shards_[i].stack_cache.clear();
+  }
+}
+
+void BPFStackTable::set_symbol_cache_size(size_t max_entries,
+                                          bool verify_stacks) {
+  stack_cache_size_ = (max_entries + NUM_SHARDS - 1) / NUM_SHARDS;
+  verify_stacks_ = verify_stacks;
+  for (size_t i = 0; i < NUM_SHARDS; i++) {
+    std::lock_guard<std::mutex> lock(shards_[i].mutex);
+    shards_[i].stack_cache.clear();
   }
 }
 
@@ -293,6 +1065,12 @@ std::vector<uintptr_t> BPFStackTable::get_stack_addr(int stack_id) {
   stacktrace_t stack;
   if (stack_id < 0)
     return res;
+  if (record_stacks_) {
+    std::lock_guard<std::mutex> lock(record_stacks_->mutex);
+    if (size_t(stack_id) < record_stacks_->stacks.size())
+      res = record_stacks_->stacks[stack_id];
+    return res;
+  }
   if (!lookup(&stack_id, &stack))
     return res;
   for (int i = 0; (i < BPF_MAX_STACK_DEPTH) && (stack.ip[i] != 0); i++)
@@ -302,30 +1080,154 @@ std::vector<uintptr_t> BPFStackTable::get_stack_addr(int stack_id) {
 
 std::vector<std::string> BPFStackTable::get_stack_symbol(int stack_id,
                                                          int pid) {
-  auto addresses = get_stack_addr(stack_id);
-  std::vector<std::string> res;
-  if (addresses.empty())
-    return res;
-  res.reserve(addresses.size());
+  auto res = get_stack_symbols({stack_id}, pid);
+  return std::move(res[0]);
+}
 
+std::vector<std::vector<std::string>> BPFStackTable::get_stack_symbols(
+    const std::vector<int>& stack_ids, int pid) {
+  std::vector<std::vector<std::string>> res(stack_ids.size());
+  std::vector<uint64_t> addrs;
+  std::vector<size_t> ends;
+  // Stacks found in the cache, which are not resolved again
+  std::vector<bool> cached(stack_ids.size());
   if (pid < 0)
     pid = -1;
-  if (pid_sym_.find(pid) == pid_sym_.end())
-    pid_sym_[pid] = bcc_symcache_new(pid, &symbol_option_);
-  void* cache = pid_sym_[pid];
-
-  bcc_symbol symbol;
-  for (auto addr : addresses)
-    if (bcc_symcache_resolve(cache, addr, &symbol) != 0)
-      res.emplace_back("[UNKNOWN]");
-    else {
-      res.push_back(symbol.demangle_name);
-      bcc_symbol_free_demangle_name(&symbol);
+  shard_t& sh = shard(pid);
+  size_t cache_size = stack_cache_size_;
+  bool verify_stacks = verify_stacks_;
+  for (size_t s = 0; s < stack_ids.size(); s++) {
+    int stack_id = stack_ids[s];
+    cached_stack_t entry;
+    bool found = false;
+    if (cache_size > 0 && stack_id >= 0) {
+      std::lock_guard<std::mutex> lock(sh.mutex);
+      auto it = sh.stack_cache.find(std::make_pair(stack_id, pid));
+      if (it != sh.stack_cache.end()) {
+        if (!verify_stacks)
+          res[s] = it->second.symbols;
+        else
+          entry = it->second;
+        found = true;
+      }
+    }
+    if (found && !verify_stacks) {
+      cached[s] = true;
+      ends.push_back(addrs.size());
+      continue;
+    }
+    auto stack = get_stack_addr(stack_id);
+    if (found && entry.addrs == stack) {
+      res[s] = std::move(entry.symbols);
+      cached[s] = true;
+      ends.push_back(addrs.size());
+      continue;
     }
+    addrs.insert(addrs.end(), stack.begin(), stack.end());
+    ends.push_back(addrs.size());
+  }
+  if (addrs.empty())
+    return res;
+
+  std::shared_ptr<void> cache;
+  {
+    std::lock_guard<std::mutex> lock(sh.mutex);
+    auto& slot = sh.pid_sym[pid];
+    if (!slot)
+      slot.reset(bcc_symcache_new(pid, &symbol_option_),
+                 [pid](void* c) { bcc_free_symcache(c, pid); });
+    cache = slot;
+  }
 
+  std::vector<bcc_symbol> symbols(addrs.size());
+  bcc_symcache_resolve_batch(cache.get(), addrs.data(), addrs.size(),
+                             symbols.data());
+  size_t i = 0;
+  for (size_t s = 0; s < stack_ids.size(); s++) {
+    if (cached[s])
+      continue;
+    size_t start = i;
+    res[s].reserve(ends[s] - i);
+    for (; i < ends[s]; i++) {
+      if (!symbols[i].name) {
+        res[s].emplace_back("[UNKNOWN]");
+      } else {
+        res[s].push_back(symbols[i].demangle_name);
+        bcc_symbol_free_demangle_name(&symbols[i]);
+      }
+    }
+    if (cache_size == 0 || stack_ids[s] < 0 || start == i)
+      continue;
+    std::lock_guard<std::mutex> lock(sh.mutex);
+    if (sh.stack_cache.size() >= cache_size)
+      sh.stack_cache.clear();
+    auto& entry = sh.stack_cache[std::make_pair(stack_ids[s], pid)];
+    entry.addrs.assign(addrs.begin() + start, addrs.begin() + i);
+    entry.symbols = res[s];
+  }
   return res;
 }
 
+int BPFStackTable::record_stack_id(record_stacks_t& rs, const uint64_t* ip,
+                                   size_t nr) {
+  if (nr == 0)
+    return -1;
+  std::vector<uintptr_t> stack(ip, ip + nr);
+  std::lock_guard<std::mutex> lock(rs.mutex);
+  auto it = rs.ids.find(stack);
+  if (it != rs.ids.end())
+    return it->second;
+  int id = rs.stacks.size();
+  rs.stacks.push_back(stack);
+  rs.ids.emplace(std::move(stack), id);
+  return id;
+}
+
+StatusTuple BPFStackTable::open_records(
+    std::function<void(const BPFStackRecord&)> cb) {
+  if (!record_stacks_)
+    return StatusTuple(-1, "Table %s is not a BPF_STACK_RINGBUF",
+                       desc.name.c_str());
+  if (records_)
+    return StatusTuple(-1, "Stack records of %s already open",
+                       desc.name.c_str());
+  // struct bpf_stack_record of helpers.h, without its frames
+  struct record_header_t {
+    uint64_t tag;
+    uint32_t pid;
+    uint16_t kernel_nr;
+    uint16_t user_nr;
+  };
+  // the stacks, unlike this table, stay in place when it is moved
+  record_stacks_t* rs = record_stacks_.get();
+  std::unique_ptr<BPFRingBuffer> records(new BPFRingBuffer(desc));
+  TRY2(records->open(BPFRingBuffer::sample_fn(
+      [rs, cb](void* data, size_t size) {
+        auto* hdr = static_cast<const record_header_t*>(data);
+        auto* ip = reinterpret_cast<const uint64_t*>(hdr + 1);
+        if (size < sizeof(*hdr) ||
+            size < sizeof(*hdr) +
+                       (hdr->kernel_nr + hdr->user_nr) * sizeof(uint64_t))
+          return -EINVAL;
+        BPFStackRecord rec;
+        rec.tag = hdr->tag;
+        rec.pid = hdr->pid;
+        rec.kernel_stack_id = record_stack_id(*rs, ip, hdr->kernel_nr);
+        rec.user_stack_id = record_stack_id(*rs, ip + hdr->kernel_nr,
+                                            hdr->user_nr);
+        cb(rec);
+        return 0;
+      })));
+  records_ = std::move(records);
+  return StatusTuple::OK();
+}
+
+int BPFStackTable::poll_records(int timeout_ms) {
+  if (!records_)
+    return -1;
+  return records_->poll(timeout_ms);
+}
+
 BPFStackBuildIdTable::BPFStackBuildIdTable(const TableDesc& desc, bool use_debug_file,
                                            bool check_debug_file_crc,
                                            void *bsymcache)
@@ -391,20 +1293,55 @@ std::vector<std::string> BPFStackBuildIdTable::get_stack_symbol(int stack_id)
 }
 
 BPFPerfBuffer::BPFPerfBuffer(const TableDesc& desc)
-    : BPFTableBase<int, int>(desc), epfd_(-1) {
+    : BPFTableBase<int, int>(desc),
+      raw_cb_(nullptr),
+      lost_cb_(nullptr),
+      cb_cookie_(nullptr),
+      wakeup_events_(1),
+      wakeup_watermark_(0),
+      overwrite_(false),
+      adaptive_max_page_cnt_(0),
+      adaptive_budget_pages_(0),
+      ordered_user_cb_(nullptr),
+      ordered_user_lost_cb_(nullptr),
+      ordered_user_cookie_(nullptr),
+      reorder_window_(0),
+      max_pending_(0),
+      max_ts_(0),
+      seq_(0),
+      epfd_(-1),
+      stop_fd_(-1) {
   if (desc.type != BPF_MAP_TYPE_PERF_EVENT_ARRAY)
     throw std::invalid_argument("Table '" + desc.name +
                                 "' is not a perf buffer");
 }
 
-StatusTuple BPFPerfBuffer::open_on_cpu(perf_reader_raw_cb cb,
-                                       perf_reader_lost_cb lost_cb, int cpu,
-                                       void* cb_cookie, int page_cnt) {
+perf_reader* BPFPerfBuffer::new_reader(int cpu, int page_cnt) {
+  struct bcc_perf_buffer_opts opts = {};
+  opts.pid = -1;
+  opts.cpu = cpu;
+  opts.wakeup_events = wakeup_events_;
+  opts.wakeup_watermark = wakeup_watermark_;
+  opts.overwrite = overwrite_;
+  if (!adaptive_max_page_cnt_)
+    return static_cast<perf_reader*>(bpf_open_perf_buffer_opts(
+        raw_cb_, lost_cb_, cb_cookie_, page_cnt, &opts));
+
+  // The losses are counted per CPU, so each reader gets its own cookie
+  adaptive_cpu& state = adaptive_cpus_[cpu];
+  state.pb = this;
+  state.lost = 0;
+  return static_cast<perf_reader*>(
+      bpf_open_perf_buffer_opts(&BPFPerfBuffer::adaptive_cb,
+                                &BPFPerfBuffer::adaptive_lost_cb,
+                                static_cast<void*>(&state), page_cnt, &opts));
+}
+
+StatusTuple BPFPerfBuffer::open_on_cpu(int cpu, int page_cnt) {
   if (cpu_readers_.find(cpu) != cpu_readers_.end())
     return StatusTuple(-1, "Perf buffer already open on CPU %d", cpu);
 
-  auto reader = static_cast<perf_reader*>(
-      bpf_open_perf_buffer(cb, lost_cb, cb_cookie, -1, cpu, page_cnt));
+  auto reader = new_reader(cpu, page_cnt);
   if (reader == nullptr)
     return StatusTuple(-1, "Unable to construct perf reader");
 
@@ -415,6 +1352,30 @@ StatusTuple BPFPerfBuffer::open_on_cpu(perf_reader_raw_cb cb,
                        std::strerror(errno));
   }
 
+  // Flight recorders are never polled
+  struct epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.ptr = static_cast<void*>(reader);
+  if (!overwrite_ &&
+      epoll_ctl(epfd_, EPOLL_CTL_ADD, reader_fd, &event) != 0) {
+    perf_reader_free(static_cast<void*>(reader));
+    return StatusTuple(-1, "Unable to add perf_reader FD to epoll: %s",
+                       std::strerror(errno));
+  }
+
+  cpu_readers_[cpu] = reader;
+  cpu_page_cnt_[cpu] = page_cnt;
+  return StatusTuple::OK();
+}
+
+// Replace the ring of an open CPU, without losing the samples in the old one
+StatusTuple BPFPerfBuffer::reopen_on_cpu(int cpu, int page_cnt) {
+  perf_reader* old_reader = cpu_readers_[cpu];
+  auto reader = new_reader(cpu, page_cnt);
+  if (reader == nullptr)
+    return StatusTuple(-1, "Unable to construct perf reader");
+
+  int reader_fd = perf_reader_fd(reader);
   struct epoll_event event = {};
   event.events = EPOLLIN;
   event.data.ptr = static_cast<void*>(reader);
@@ -423,23 +1384,42 @@ StatusTuple BPFPerfBuffer::open_on_cpu(perf_reader_raw_cb cb,
     return StatusTuple(-1, "Unable to add perf_reader FD to epoll: %s",
                        std::strerror(errno));
   }
+  if (!update(&cpu, &reader_fd)) {
+    int err = errno;
+    epoll_ctl(epfd_, EPOLL_CTL_DEL, reader_fd, nullptr);
+    perf_reader_free(static_cast<void*>(reader));
+    return StatusTuple(-1, "Unable to reopen perf buffer on CPU %d: %s", cpu,
+                       std::strerror(err));
+  }
 
+  // The program writes to the new ring from now on
+  perf_reader_event_read(old_reader);
+  epoll_ctl(epfd_, EPOLL_CTL_DEL, perf_reader_fd(old_reader), nullptr);
+  perf_reader_free(static_cast<void*>(old_reader));
   cpu_readers_[cpu] = reader;
+  cpu_page_cnt_[cpu] = page_cnt;
   return StatusTuple::OK();
 }
 
 StatusTuple BPFPerfBuffer::open_all_cpu(perf_reader_raw_cb cb,
                                         perf_reader_lost_cb lost_cb,
-                                        void* cb_cookie, int page_cnt) {
+                                        void* cb_cookie, int page_cnt,
+                                        int wakeup_events,
+                                        int wakeup_watermark) {
   if (cpu_readers_.size() != 0 || epfd_ != -1)
     return StatusTuple(-1, "Previously opened perf buffer not cleaned");
 
+  raw_cb_ = cb;
+  lost_cb_ = lost_cb;
+  cb_cookie_ = cb_cookie;
+  wakeup_events_ = wakeup_events;
+  wakeup_watermark_ = wakeup_watermark;
   std::vector<int> cpus = get_online_cpus();
   ep_events_.reset(new epoll_event[cpus.size()]);
   epfd_ = epoll_create1(EPOLL_CLOEXEC);
 
   for (int i : cpus) {
-    auto res = open_on_cpu(cb, lost_cb, i, cb_cookie, page_cnt);
+    auto res = open_on_cpu(i, page_cnt);
     if (!res.ok()) {
       TRY2(close_all_cpu());
       return res;
@@ -448,6 +1428,156 @@ StatusTuple BPFPerfBuffer::open_all_cpu(perf_reader_raw_cb cb,
   return StatusTuple::OK();
 }
 
+StatusTuple BPFPerfBuffer::open_all_cpu(perf_reader_raw_cb cb,
+                                        perf_reader_lost_cb lost_cb,
+                                        void* cb_cookie, int page_cnt,
+                                        timestamp_fn ts_fn,
+                                        uint64_t reorder_window,
+                                        size_t max_pending) {
+  if (!ts_fn)
+    return StatusTuple(-1, "Timestamp extractor required for ordered perf buffer");
+  ordered_user_cb_ = cb;
+  ordered_user_lost_cb_ = lost_cb;
+  ordered_user_cookie_ = cb_cookie;
+  ts_fn_ = std::move(ts_fn);
+  reorder_window_ = reorder_window;
+  max_pending_ = max_pending;
+  max_ts_ = 0;
+  seq_ = 0;
+  auto res = open_all_cpu(&BPFPerfBuffer::ordered_cb,
+                          lost_cb ? &BPFPerfBuffer::ordered_lost_cb : nullptr,
+                          this, page_cnt);
+  if (!res.ok())
+    ordered_user_cb_ = nullptr;
+  return res;
+}
+
+StatusTuple BPFPerfBuffer::open_flight_recorder(perf_reader_raw_cb cb,
+                                                perf_reader_lost_cb lost_cb,
+                                                void* cb_cookie, int page_cnt) {
+  if (cpu_readers_.size() != 0 || epfd_ != -1)
+    return StatusTuple(-1, "Previously opened perf buffer not cleaned");
+  overwrite_ = true;
+  auto res = open_all_cpu(cb, lost_cb, cb_cookie, page_cnt);
+  if (!res.ok())
+    overwrite_ = false;
+  return res;
+}
+
+int BPFPerfBuffer::snapshot() {
+  if (!overwrite_)
+    return -1;
+  // Pause every CPU first, so that the rings cover about the same period
+  for (auto& it : cpu_readers_)
+    perf_reader_pause(it.second, 1);
+  int cnt = 0;
+  for (auto& it : cpu_readers_) {
+    int res = perf_reader_snapshot(it.second);
+    if (res > 0)
+      cnt += res;
+  }
+  for (auto& it : cpu_readers_)
+    perf_reader_pause(it.second, 0);
+  return cnt;
+}
+
+void BPFPerfBuffer::ordered_lost_cb(void* cb_cookie, uint64_t lost) {
+  auto pb = static_cast<BPFPerfBuffer*>(cb_cookie);
+  pb->ordered_user_lost_cb_(pb->ordered_user_cookie_, lost);
+}
+
+void BPFPerfBuffer::ordered_cb(void* cb_cookie, void* raw, int raw_size) {
+  auto pb = static_cast<BPFPerfBuffer*>(cb_cookie);
+  std::lock_guard<std::mutex> lock(pb->ordered_mutex_);
+  uint64_t ts = pb->ts_fn_(raw, raw_size);
+  pb->max_ts_ = std::max(pb->max_ts_, ts);
+  pb->pending_.push({ts, pb->seq_++,
+                     std::string(static_cast<char*>(raw), raw_size)});
+  pb->drain_ordered(false);
+}
+
+void BPFPerfBuffer::adaptive_cb(void* cb_cookie, void* raw, int raw_size) {
+  auto pb = static_cast<adaptive_cpu*>(cb_cookie)->pb;
+  pb->raw_cb_(pb->cb_cookie_, raw, raw_size);
+}
+
+void BPFPerfBuffer::adaptive_lost_cb(void* cb_cookie, uint64_t lost) {
+  auto state = static_cast<adaptive_cpu*>(cb_cookie);
+  auto pb = state->pb;
+  state->lost += lost;
+  if (pb->lost_cb_)
+    pb->lost_cb_(pb->cb_cookie_, lost);
+  else
+    fprintf(stderr, "Possibly lost %" PRIu64 " samples\n", lost);
+}
+
+void BPFPerfBuffer::grow_lossy_cpus() {
+  if (!adaptive_max_page_cnt_ || !consumers_.empty() || overwrite_)
+    return;
+  size_t total = 0;
+  for (auto& it : cpu_page_cnt_)
+    total += it.second;
+  for (auto& it : adaptive_cpus_) {
+    if (!it.second.lost)
+      continue;
+    it.second.lost = 0;
+    int page_cnt = cpu_page_cnt_[it.first];
+    int new_page_cnt = page_cnt * 2;
+    if (new_page_cnt > adaptive_max_page_cnt_ ||
+        total + new_page_cnt - page_cnt > adaptive_budget_pages_)
+      continue;
+    // On failure the CPU keeps its current ring
+    if (reopen_on_cpu(it.first, new_page_cnt).ok())
+      total += new_page_cnt - page_cnt;
+  }
+}
+
+StatusTuple BPFPerfBuffer::enable_adaptive(int max_page_cnt,
+                                           size_t budget_pages) {
+  if (max_page_cnt <= 0 || (max_page_cnt & (max_page_cnt - 1)) != 0)
+    return StatusTuple(-1, "Adaptive max_page_cnt must be a power of two");
+  if (!consumers_.empty())
+    return StatusTuple(-1, "Stop the perf buffer consumers first");
+  if (overwrite_)
+    return StatusTuple(-1, "Flight recorders can't be resized");
+  bool was_adaptive = adaptive_max_page_cnt_ != 0;
+  adaptive_max_page_cnt_ = max_page_cnt;
+  adaptive_budget_pages_ = budget_pages;
+  if (was_adaptive)
+    return StatusTuple::OK();
+
+  // Open rings need the per CPU cookie
+  for (auto& it : cpu_page_cnt_)
+    TRY2(reopen_on_cpu(it.first, it.second));
+  return StatusTuple::OK();
+}
+
+int BPFPerfBuffer::page_cnt(int cpu) const {
+  auto it = cpu_page_cnt_.find(cpu);
+  return it == cpu_page_cnt_.end() ? 0 : it->second;
+}
+
+// Called with ordered_mutex_ held
+void BPFPerfBuffer::drain_ordered(bool all) {
+  while (!pending_.empty()) {
+    const ordered_sample& top = pending_.top();
+    if (!all && pending_.size() <= max_pending_ &&
+        top.ts + reorder_window_ > max_ts_)
+      break;
+    // The callback gets a private copy, so it may keep using the buffer
+    // while the entry is popped.
+    std::string data = std::move(const_cast<ordered_sample&>(top).data);
+    pending_.pop();
+    ordered_user_cb_(ordered_user_cookie_, &data[0], data.size());
+  }
+}
+
+void BPFPerfBuffer::flush_ordered() {
+  std::lock_guard<std::mutex> lock(ordered_mutex_);
+  if (ordered_user_cb_)
+    drain_ordered(true);
+}
+
 StatusTuple BPFPerfBuffer::close_on_cpu(int cpu) {
   auto it = cpu_readers_.find(cpu);
   if (it == cpu_readers_.end())
@@ -456,6 +1586,8 @@ StatusTuple BPFPerfBuffer::close_on_cpu(int cpu) {
   if (!remove(const_cast<int*>(&(it->first))))
     return StatusTuple(-1, "Unable to close perf buffer on CPU %d", it->first);
   cpu_readers_.erase(it);
+  cpu_page_cnt_.erase(cpu);
+  adaptive_cpus_.erase(cpu);
   return StatusTuple::OK();
 }
 
@@ -463,6 +1595,15 @@ StatusTuple BPFPerfBuffer::close_all_cpu() {
   std::string errors;
   bool has_error = false;
 
+  auto stop_res = stop_consumers();
+  if (!stop_res.ok()) {
+    errors += stop_res.msg() + "\n";
+    has_error = true;
+  }
+  flush_ordered();
+  ordered_user_cb_ = nullptr;
+  overwrite_ = false;
+
   if (epfd_ >= 0) {
     int close_res = close(epfd_);
     epfd_ = -1;
@@ -491,15 +1632,161 @@ StatusTuple BPFPerfBuffer::close_all_cpu() {
 }
 
 int BPFPerfBuffer::poll(int timeout_ms) {
-  if (epfd_ < 0)
+  if (epfd_ < 0 || !consumers_.empty())
     return -1;
   int cnt =
       epoll_wait(epfd_, ep_events_.get(), cpu_readers_.size(), timeout_ms);
   for (int i = 0; i < cnt; i++)
     perf_reader_event_read(static_cast<perf_reader*>(ep_events_[i].data.ptr));
+  grow_lossy_cpus();
   return cnt;
 }
 
+int BPFPerfBuffer::consume_all() {
+  if (epfd_ < 0 || !consumers_.empty() || overwrite_)
+    return -1;
+  for (auto& it : cpu_readers_)
+    perf_reader_event_read(it.second);
+  grow_lossy_cpus();
+  return cpu_readers_.size();
+}
+
+int BPFPerfBuffer::consume() {
+  if (epfd_ < 0 || !consumers_.empty() || overwrite_)
+    return -1;
+  int cnt = epoll_wait(epfd_, ep_events_.get(), cpu_readers_.size(), 0);
+  int samples = 0;
+  for (int i = 0; i < cnt; i++) {
+    int n = perf_reader_consume(
+        static_cast<perf_reader*>(ep_events_[i].data.ptr));
+    if (n > 0)
+      samples += n;
+  }
+  grow_lossy_cpus();
+  return samples;
+}
+
+void BPFPerfBuffer::consumer_loop(int epfd, int nevents) {
+  std::unique_ptr<epoll_event[]> events(new epoll_event[nevents]);
+  while (true) {
+    int cnt = epoll_wait(epfd, events.get(), nevents, -1);
+    if (cnt < 0 && errno == EINTR)
+      continue;
+    if (cnt < 0)
+      return;
+    bool stop = false;
+    for (int i = 0; i < cnt; i++) {
+      if (events[i].data.ptr == nullptr)
+        stop = true;
+      else
+        perf_reader_event_read(static_cast<perf_reader*>(events[i].data.ptr));
+    }
+    if (stop)
+      return;
+  }
+}
+
+StatusTuple BPFPerfBuffer::start_consumers(unsigned int num_threads) {
+  if (epfd_ < 0)
+    return StatusTuple(-1, "Perf buffer not open");
+  if (!consumers_.empty())
+    return StatusTuple(-1, "Perf buffer consumers already started");
+  if (overwrite_)
+    return StatusTuple(-1, "Flight recorders are read with snapshot()");
+  if (num_threads == 0)
+    return StatusTuple(-1, "Need at least one consumer thread");
+
+  // Order the CPUs by NUMA node so that each shard stays within as few nodes
+  // as possible.
+  std::map<int, int> cpu_node;
+  std::map<int, std::vector<int>> node_cpus;
+  for (int node : get_online_nodes()) {
+    node_cpus[node] = get_node_cpus(node);
+    for (int cpu : node_cpus[node])
+      cpu_node[cpu] = node;
+  }
+  std::vector<std::pair<int, int>> cpus;
+  for (auto& it : cpu_readers_) {
+    auto node = cpu_node.find(it.first);
+    cpus.emplace_back(node == cpu_node.end() ? -1 : node->second, it.first);
+  }
+  std::sort(cpus.begin(), cpus.end());
+  num_threads = std::min<size_t>(num_threads, cpus.size());
+
+  stop_fd_ = eventfd(0, EFD_CLOEXEC);
+  if (stop_fd_ < 0)
+    return StatusTuple(-1, "Unable to create eventfd: %s",
+                       std::strerror(errno));
+
+  size_t start = 0;
+  for (unsigned int t = 0; t < num_threads; t++) {
+    size_t end = start + (cpus.size() - start) / (num_threads - t);
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+      StatusTuple res(-1, "Unable to create epoll: %s", std::strerror(errno));
+      TRY2(stop_consumers());
+      return res;
+    }
+    consumer_epfds_.push_back(epfd);
+
+    // stop_fd_ is never read, so once written it wakes up every consumer
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    bool ok = epoll_ctl(epfd, EPOLL_CTL_ADD, stop_fd_, &event) == 0;
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    bool pin = false;
+    for (size_t i = start; ok && i < end; i++) {
+      perf_reader* reader = cpu_readers_[cpus[i].second];
+      event.data.ptr = static_cast<void*>(reader);
+      ok = epoll_ctl(epfd, EPOLL_CTL_ADD, perf_reader_fd(reader), &event) == 0;
+      if (cpus[i].first >= 0) {
+        for (int cpu : node_cpus[cpus[i].first])
+          if (cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &cpuset);
+            pin = true;
+          }
+      }
+    }
+    if (!ok) {
+      StatusTuple res(-1, "Unable to add perf_reader FD to epoll: %s",
+                      std::strerror(errno));
+      TRY2(stop_consumers());
+      return res;
+    }
+
+    consumers_.emplace_back(&BPFPerfBuffer::consumer_loop, epfd, end - start + 1);
+    if (pin)
+      pthread_setaffinity_np(consumers_.back().native_handle(),
+                             sizeof(cpuset), &cpuset);
+    start = end;
+  }
+  return StatusTuple::OK();
+}
+
+StatusTuple BPFPerfBuffer::stop_consumers() {
+  StatusTuple res = StatusTuple::OK();
+  if (stop_fd_ >= 0) {
+    uint64_t one = 1;
+    if (write(stop_fd_, &one, sizeof(one)) != sizeof(one))
+      res = StatusTuple(-1, "Unable to stop perf buffer consumers: %s",
+                        std::strerror(errno));
+  }
+  for (auto& t : consumers_)
+    t.join();
+  consumers_.clear();
+  for (int epfd : consumer_epfds_)
+    close(epfd);
+  consumer_epfds_.clear();
+  if (stop_fd_ >= 0) {
+    close(stop_fd_);
+    stop_fd_ = -1;
+  }
+  return res;
+}
+
 BPFPerfBuffer::~BPFPerfBuffer() {
   auto res = close_all_cpu();
   if (!res.ok())
@@ -507,6 +1794,79 @@ BPFPerfBuffer::~BPFPerfBuffer() {
               << std::endl;
 }
 
+BPFRingBuffer::BPFRingBuffer(const TableDesc& desc)
+    : BPFTableBase<int, int>(desc), rb_(nullptr) {
+  if (desc.type != BPF_MAP_TYPE_RINGBUF)
+    throw std::invalid_argument("Table '" + desc.name +
+                                "' is not a ring buffer");
+}
+
+StatusTuple BPFRingBuffer::open(ring_buffer_sample_fn cb, void* ctx) {
+  if (rb_)
+    return StatusTuple(-1, "Ring buffer %s already open", desc.name.c_str());
+  rb_ = static_cast<ring_buffer*>(bpf_new_ringbuf(desc.fd, cb, ctx));
+  if (!rb_)
+    return StatusTuple(-1, "Unable to open ring buffer %s: %s",
+                       desc.name.c_str(), std::strerror(errno));
+  return StatusTuple::OK();
+}
+
+StatusTuple BPFRingBuffer::open(sample_fn cb) {
+  fn_ = std::move(cb);
+  auto res = open(&BPFRingBuffer::sample_cb, this);
+  if (!res.ok())
+    fn_ = nullptr;
+  return res;
+}
+
+int BPFRingBuffer::sample_cb(void* ctx, void* data, size_t size) {
+  return static_cast<BPFRingBuffer*>(ctx)->fn_(data, size);
+}
+
+StatusTuple BPFRingBuffer::close() {
+  if (rb_) {
+    bpf_free_ringbuf(rb_);
+    rb_ = nullptr;
+  }
+  fn_ = nullptr;
+  return StatusTuple::OK();
+}
+
+int BPFRingBuffer::poll(int timeout_ms) {
+  if (!rb_)
+    return -1;
+  return bpf_poll_ringbuf(rb_, timeout_ms);
+}
+
+int BPFRingBuffer::consume() {
+  if (!rb_)
+    return -1;
+  return bpf_consume_ringbuf(rb_);
+}
+
+int BPFRingBuffer::epoll_fd() const {
+  if (!rb_)
+    return -1;
+  return bpf_ringbuf_epoll_fd(rb_);
+}
+
+int BPFRingBuffer::busy_poll(int timeout_ms) {
+  if (!rb_)
+    return -1;
+  auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+  int cnt;
+  while ((cnt = bpf_consume_ringbuf(rb_)) == 0) {
+    if (timeout_ms >= 0 && std::chrono::steady_clock::now() >= deadline)
+      break;
+  }
+  return cnt;
+}
+
+BPFRingBuffer::~BPFRingBuffer() {
+  close();
+}
+
 BPFPerfEventArray::BPFPerfEventArray(const TableDesc& desc)
     : BPFTableBase<int, int>(desc) {
   if (desc.type != BPF_MAP_TYPE_PERF_EVENT_ARRAY)
@@ -530,6 +1890,23 @@ StatusTuple BPFPerfEventArray::open_all_cpu(uint32_t type, uint64_t config) {
   return StatusTuple::OK();
 }
 
+StatusTuple BPFPerfEventArray::open_all_cpu(uint32_t type, uint64_t config,
+                                            const BPFPerfEventArray& leader) {
+  if (cpu_fds_.size() != 0)
+    return StatusTuple(-1, "Previously opened perf event not cleaned");
+  if (leader.cpu_fds_.empty())
+    return StatusTuple(-1, "The group leader is not open");
+
+  for (const auto& it : leader.cpu_fds_) {
+    auto res = open_on_cpu(it.first, type, config, it.second);
+    if (!res.ok()) {
+      TRY2(close_all_cpu());
+      return res;
+    }
+  }
+  return StatusTuple::OK();
+}
+
 StatusTuple BPFPerfEventArray::close_all_cpu() {
   std::string errors;
   bool has_error = false;
@@ -552,10 +1929,10 @@ StatusTuple BPFPerfEventArray::close_all_cpu() {
 }
 
 StatusTuple BPFPerfEventArray::open_on_cpu(int cpu, uint32_t type,
-                                           uint64_t config) {
+                                           uint64_t config, int group_fd) {
   if (cpu_fds_.find(cpu) != cpu_fds_.end())
     return StatusTuple(-1, "Perf event already open on CPU %d", cpu);
-  int fd = bpf_open_perf_event(type, config, -1, cpu);
+  int fd = bpf_open_perf_event_group(type, config, -1, cpu, group_fd);
   if (fd < 0) {
     return StatusTuple(-1, "Error constructing perf event %" PRIu32 ":%" PRIu64,
                        type, config);
@@ -662,6 +2039,42 @@ StatusTuple BPFDevmapTable::remove_value(const int& index) {
     return StatusTuple::OK();
 }
 
+BPFCpumapTable::BPFCpumapTable(const TableDesc& desc)
+    : BPFTableBase<int, uint32_t>(desc) {
+    if(desc.type != BPF_MAP_TYPE_CPUMAP)
+      throw std::invalid_argument("Table '" + desc.name +
+                                  "' is not a cpumap table");
+}
+
+StatusTuple BPFCpumapTable::update_value(const int& cpu,
+                                         const uint32_t& qsize) {
+    if (!this->update(const_cast<int*>(&cpu), const_cast<uint32_t*>(&qsize)))
+      return StatusTuple(-1, "Error updating value: %s", std::strerror(errno));
+    return StatusTuple::OK();
+}
+
+StatusTuple BPFCpumapTable::get_value(const int& cpu, uint32_t& qsize) {
+    if (!this->lookup(const_cast<int*>(&cpu), &qsize))
+      return StatusTuple(-1, "Error getting value: %s", std::strerror(errno));
+    return StatusTuple::OK();
+}
+
+StatusTuple BPFCpumapTable::remove_value(const int& cpu) {
+    if (!this->remove(const_cast<int*>(&cpu)))
+      return StatusTuple(-1, "Error removing value: %s", std::strerror(errno));
+    return StatusTuple::OK();
+}
+
+BPFQueueStatsTable::BPFQueueStatsTable(const TableDesc& desc)
+    : BPFPercpuArrayTable<BPFQueueStats>(desc) {}
+
+std::vector<BPFQueueStats> BPFQueueStatsTable::get_queue_stats() {
+    return get_table_offline_reduced(
+        [](const BPFQueueStats& a, const BPFQueueStats& b) {
+          return BPFQueueStats{a.packets + b.packets, a.bytes + b.bytes};
+        });
+}
+
 BPFXskmapTable::BPFXskmapTable(const TableDesc& desc)
     : BPFTableBase<int, int>(desc) {
     if(desc.type != BPF_MAP_TYPE_XSKMAP)
@@ -730,3 +2143,144 @@ StatusTuple BPFSockhashTable::remove_value(const int& key) {
 }
 
 }  // namespace ebpf
+
+static_assert(sizeof(struct bcc_table_change) ==
+                  sizeof(ebpf::BPFTableSnapshot::Change),
+              "bcc_table_change must match BPFTableSnapshot::Change");
+static_assert(sizeof(struct bcc_table_top_field) ==
+                  sizeof(ebpf::BPFTableTop::Field),
+              "bcc_table_top_field must match BPFTableTop::Field");
+
+extern "C" {
+
+void *bcc_table_snapshot_new(void *program, size_t id) {
+  auto mod = static_cast<ebpf::BPFModule *>(program);
+  if (!mod)
+    return nullptr;
+  const char *name = mod->table_name(id);
+  ebpf::TableStorage::iterator it;
+  if (!name ||
+      !mod->table_storage().Find(ebpf::Path({mod->id(), name}), it))
+    return nullptr;
+  try {
+    return new ebpf::BPFTableSnapshot(it->second);
+  } catch (std::exception &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return nullptr;
+  }
+}
+
+void bcc_table_snapshot_free(void *snap) {
+  delete static_cast<ebpf::BPFTableSnapshot *>(snap);
+}
+
+int bcc_table_snapshot_update(void *snap,
+                              const struct bcc_table_change **changes) {
+  auto s = static_cast<ebpf::BPFTableSnapshot *>(snap);
+  if (!s)
+    return -1;
+  ebpf::StatusTuple res = s->update();
+  if (!res.ok()) {
+    fprintf(stderr, "%s\n", res.msg().c_str());
+    return -1;
+  }
+  *changes = reinterpret_cast<const struct bcc_table_change *>(
+      s->changes().data());
+  return s->changes().size();
+}
+
+void *bcc_table_top_new(void *program, size_t id,
+                        const struct bcc_table_top_field *fields,
+                        int nr_fields, size_t k) {
+  auto mod = static_cast<ebpf::BPFModule *>(program);
+  if (!mod || nr_fields < 0)
+    return nullptr;
+  const char *name = mod->table_name(id);
+  ebpf::TableStorage::iterator it;
+  if (!name ||
+      !mod->table_storage().Find(ebpf::Path({mod->id(), name}), it))
+    return nullptr;
+  std::vector<ebpf::BPFTableTop::Field> f;
+  for (int i = 0; i < nr_fields; i++)
+    f.push_back({fields[i].offset, fields[i].size});
+  try {
+    return new ebpf::BPFTableTop(it->second, std::move(f), k);
+  } catch (std::exception &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return nullptr;
+  }
+}
+
+void bcc_table_top_free(void *top) {
+  delete static_cast<ebpf::BPFTableTop *>(top);
+}
+
+int bcc_table_top_update(void *top, int drain, const void **keys,
+                         const void **values, size_t *total) {
+  auto t = static_cast<ebpf::BPFTableTop *>(top);
+  if (!t)
+    return -1;
+  ebpf::StatusTuple res = t->update(drain);
+  if (!res.ok()) {
+    fprintf(stderr, "%s\n", res.msg().c_str());
+    return -1;
+  }
+  *keys = t->keys();
+  *values = t->values();
+  *total = t->total();
+  return t->size();
+}
+
+void *bcc_hist_delta_new(void *program, size_t id) {
+  auto mod = static_cast<ebpf::BPFModule *>(program);
+  if (!mod)
+    return nullptr;
+  const char *name = mod->table_name(id);
+  ebpf::TableStorage::iterator it;
+  if (!name ||
+      !mod->table_storage().Find(ebpf::Path({mod->id(), name}), it))
+    return nullptr;
+  try {
+    return new ebpf::BPFHistogramDelta(it->second);
+  } catch (std::exception &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return nullptr;
+  }
+}
+
+void bcc_hist_delta_free(void *hist) {
+  delete static_cast<ebpf::BPFHistogramDelta *>(hist);
+}
+
+int bcc_hist_delta_update(void *hist, int advance, const uint64_t **counts) {
+  auto h = static_cast<ebpf::BPFHistogramDelta *>(hist);
+  if (!h)
+    return -1;
+  ebpf::StatusTuple res = h->update(advance);
+  if (!res.ok()) {
+    fprintf(stderr, "%s\n", res.msg().c_str());
+    return -1;
+  }
+  *counts = h->delta().counts.data();
+  return h->delta().counts.size();
+}
+
+void bcc_hist_percentiles(const uint64_t *counts, size_t n, int scale,
+                          const double *bounds, const double *q, size_t nq,
+                          double *out) {
+  ebpf::BPFHistogram hist;
+  hist.counts.assign(counts, counts + n);
+  std::vector<double> b;
+  if (bounds)
+    b.assign(bounds, bounds + n + 1);
+  for (size_t i = 0; i < nq; i++) {
+    if (bounds)
+      out[i] = hist.percentile(q[i], b);
+    else
+      out[i] = hist.percentile(q[i], scale == BCC_HIST_LINEAR
+                                         ? ebpf::BPFHistogram::LINEAR
+                                         : ebpf::BPFHistogram::LOG2);
+  }
+}
+
+}
@@ -18,11 +18,24 @@
 
 #include <errno.h>
 #include <sys/epoll.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
 #include <exception>
+#include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <queue>
+#include <set>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
@@ -107,6 +120,11 @@ class BPFTableBase {
     return desc.fd;
   }
 
+  // Number of entries fetched per BPF_MAP_LOOKUP_BATCH syscall when walking
+  // the table. 0 disables batching and walks the table key by key.
+  void set_batch_size(size_t batch_size) { batch_size_ = batch_size; }
+  size_t get_batch_size() const { return batch_size_; }
+
  protected:
   explicit BPFTableBase(const TableDesc& desc) : desc(desc) {}
 
@@ -128,7 +146,94 @@ class BPFTableBase {
 
   bool remove(void* key) { return bpf_delete_elem(desc.fd, key) >= 0; }
 
+  // Walk the table with the kernel batch API, calling fn(keys, values, count)
+  // for every chunk returned, until fn returns false. With del set, the returned entries are removed
+  // from the table in the same syscall. value_size is the per-entry stride of the value
+  // buffer (leaf size times the number of possible cpus for percpu maps).
+  // Returns 0 once the whole table has been visited and -1 with errno set on
+  // error. If batching is disabled or not supported by the kernel for this
+  // map, nothing has been visited and errno is set to EOPNOTSUPP so that the
+  // caller can fall back to first()/next().
+  template <class Fn>
+  int batch_walk(size_t value_size, Fn fn, bool del = false) {
+    size_t n = std::min<size_t>(batch_size_, std::max<size_t>(desc.max_entries, 1));
+    if (n == 0) {
+      errno = EOPNOTSUPP;
+      return -1;
+    }
+
+    std::vector<char> keys(n * desc.key_size), values(n * value_size);
+    __u32 in_batch, out_batch, count;
+    __u32 *in = nullptr;
+    while (true) {
+      count = n;
+      int ret = del ? bpf_lookup_and_delete_batch(desc.fd, in, &out_batch,
+                                                  keys.data(), values.data(),
+                                                  &count)
+                    : bpf_lookup_batch(desc.fd, in, &out_batch, keys.data(),
+                                       values.data(), &count);
+      int err = ret < 0 ? errno : 0;
+      if (ret < 0 && err != ENOENT) {
+        if (err == ENOSPC && n < desc.max_entries) {
+          // A single hash bucket holds more entries than fit in the buffer
+          n = std::min<size_t>(n * 2, desc.max_entries);
+          keys.resize(n * desc.key_size);
+          values.resize(n * value_size);
+          continue;
+        }
+        // 524 is the kernel internal ENOTSUPP, returned for map types
+        // without batch ops
+        if (!in && (err == EINVAL || err == ENOSYS || err == EOPNOTSUPP ||
+                    err == 524))
+          err = EOPNOTSUPP;
+        errno = err;
+        return -1;
+      }
+      if (count > 0 && !fn(keys.data(), values.data(), count))
+        return 0;
+      // ENOENT signals that the last chunk has been returned
+      if (ret < 0)
+        return 0;
+      in_batch = out_batch;
+      in = &in_batch;
+    }
+  }
+
+  // Write count entries from the keys and values buffers, laid out as for
+  // batch_walk(), with one BPF_MAP_UPDATE_BATCH per batch_size_ entries.
+  // Maps without batch ops, like LPM tries, are updated entry by entry.
+  // Returns 0, or -1 with errno set on error.
+  int batch_update(const char* keys, const char* values, size_t value_size,
+                   size_t count) {
+    size_t done = 0;
+    while (batch_size_ > 0 && done < count) {
+      __u32 n = std::min<size_t>(batch_size_, count - done);
+      if (bpf_update_batch(desc.fd,
+                           const_cast<char*>(keys + done * desc.key_size),
+                           const_cast<char*>(values + done * value_size),
+                           &n) == 0) {
+        done += n;
+        continue;
+      }
+      int err = errno;
+      if (done == 0 && (err == EINVAL || err == ENOSYS ||
+                        err == EOPNOTSUPP || err == 524))
+        break;
+      errno = err;
+      return -1;
+    }
+    for (; done < count; done++) {
+      if (bpf_update_elem(desc.fd,
+                          const_cast<char*>(keys + done * desc.key_size),
+                          const_cast<char*>(values + done * value_size),
+                          0) < 0)
+        return -1;
+    }
+    return 0;
+  }
+
   const TableDesc& desc;
+  size_t batch_size_ = 1024;
 };
 
 class BPFTable : public BPFTableBase<void, void> {
@@ -149,6 +254,20 @@ class BPFTable : public BPFTableBase<void, void> {
   StatusTuple clear_table_non_atomic();
   StatusTuple get_table_offline(std::vector<std::pair<std::string, std::string>> &res);
 
+  // Visit every entry without materializing the table; the key and value
+  // strings are reused between calls. Returning false from fn stops the walk.
+  typedef std::function<bool(const std::string& key, const std::string& value)>
+      visit_fn;
+  StatusTuple for_each(const visit_fn& fn);
+
+  // Like get_table_offline, through a BPF map element iterator (Linux 5.9+)
+  // that skips the entries filter, a C expression over the key and value
+  // pointers, is false for (see BPFMapIter). The iterator program is
+  // compiled on every call: keep a BPFMapIter to dump a map repeatedly.
+  StatusTuple dump_via_iter(
+      std::vector<std::pair<std::string, std::string>>& res,
+      const std::string& filter = "");
+
   static size_t get_possible_cpu_count();
 };
 
@@ -231,6 +350,90 @@ class BPFArrayTable : public BPFTableBase<int, ValueType> {
   }
 };
 
+// Fold the ncpus per-cpu copies of a value starting at values with op, e.g.
+// std::plus<T>() to sum them. The loop runs over contiguous memory so that
+// the compiler can vectorize it for simple operators.
+template <class ValueType, class Op>
+ValueType reduce_percpu(const ValueType* values, size_t ncpus, Op op) {
+  ValueType acc = values[0];
+  for (size_t i = 1; i < ncpus; i++)
+    acc = op(acc, values[i]);
+  return acc;
+}
+
+// Array table created with BPF_F_MMAPABLE (see BPF_MMAP_ARRAY), accessed
+// through a shared memory mapping instead of one syscall per element. If the
+// mapping cannot be established, is_mapped() returns false and accesses fall
+// back to the syscall interface.
+template <class ValueType>
+class BPFMmapArrayTable : public BPFArrayTable<ValueType> {
+ public:
+  BPFMmapArrayTable(const TableDesc& desc) : BPFArrayTable<ValueType>(desc) {
+    if (desc.type != BPF_MAP_TYPE_ARRAY || !(desc.flags & BPF_F_MMAPABLE))
+      throw std::invalid_argument("Table '" + desc.name +
+                                  "' is not a mmapable array table");
+    // array elements are laid out with an 8 byte stride by the kernel
+    if (sizeof(ValueType) % 8)
+      throw std::invalid_argument("leaf must be aligned to 8 bytes");
+
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_ = (desc.max_entries * sizeof(ValueType) + page_size - 1) &
+            ~(page_size - 1);
+    void* addr = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      desc.fd, 0);
+    if (addr != MAP_FAILED)
+      data_ = static_cast<ValueType*>(addr);
+  }
+
+  BPFMmapArrayTable(const BPFMmapArrayTable&) = delete;
+  BPFMmapArrayTable(BPFMmapArrayTable&& that)
+      : BPFArrayTable<ValueType>(that.desc), data_(that.data_),
+        size_(that.size_) {
+    that.data_ = nullptr;
+  }
+
+  ~BPFMmapArrayTable() {
+    if (data_)
+      munmap(data_, size_);
+  }
+
+  bool is_mapped() const { return data_ != nullptr; }
+
+  // Direct view of the table, capacity() elements long. Null if the table
+  // is not mapped.
+  ValueType* data() { return data_; }
+  ValueType* begin() { return data_; }
+  ValueType* end() { return data_ ? data_ + this->capacity() : nullptr; }
+
+  StatusTuple get_value(const int& index, ValueType& value) override {
+    if (!data_)
+      return BPFArrayTable<ValueType>::get_value(index, value);
+    if (index < 0 || (size_t)index >= this->capacity())
+      return StatusTuple(-1, "Error getting value: index out of range");
+    value = data_[index];
+    return StatusTuple::OK();
+  }
+
+  StatusTuple update_value(const int& index, const ValueType& value) override {
+    if (!data_)
+      return BPFArrayTable<ValueType>::update_value(index, value);
+    if (index < 0 || (size_t)index >= this->capacity())
+      return StatusTuple(-1, "Error updating value: index out of range");
+    data_[index] = value;
+    return StatusTuple::OK();
+  }
+
+  std::vector<ValueType> get_table_offline() {
+    if (!data_)
+      return BPFArrayTable<ValueType>::get_table_offline();
+    return std::vector<ValueType>(data_, data_ + this->capacity());
+  }
+
+ private:
+  ValueType* data_ = nullptr;
+  size_t size_ = 0;
+};
+
 template <class ValueType>
 class BPFPercpuArrayTable : public BPFArrayTable<std::vector<ValueType>> {
  public:
@@ -258,8 +461,43 @@ class BPFPercpuArrayTable : public BPFArrayTable<std::vector<ValueType>> {
     return BPFArrayTable<std::vector<ValueType>>::update_value(index, value);
   }
 
+  // Read an element and fold its per-cpu values with op without allocating
+  template <class Op>
+  StatusTuple get_value_reduced(const int& index, ValueType& value, Op op) {
+    scratch_.resize(ncpus);
+    if (!this->lookup(const_cast<int*>(&index), scratch_.data()))
+      return StatusTuple(-1, "Error getting value: %s", std::strerror(errno));
+    value = reduce_percpu(scratch_.data(), ncpus, op);
+    return StatusTuple::OK();
+  }
+
+  template <class Op>
+  std::vector<ValueType> get_table_offline_reduced(Op op) {
+    std::vector<ValueType> res(this->capacity());
+
+    auto batch_fn = [&](const char* keys, const char* values, __u32 count) {
+      auto vals = reinterpret_cast<const ValueType*>(values);
+      for (__u32 i = 0; i < count; i++) {
+        int index;
+        std::memcpy(&index, keys + i * sizeof(int), sizeof(int));
+        if (index >= 0 && (size_t)index < res.size())
+          res[index] = reduce_percpu(vals + i * ncpus, ncpus, op);
+      }
+      return true;
+    };
+    if (this->batch_walk(sizeof(ValueType) * ncpus, batch_fn) == 0 ||
+        errno != EOPNOTSUPP)
+      return res;
+
+    for (int i = 0; i < (int)this->capacity(); i++)
+      get_value_reduced(i, res[i], op);
+
+    return res;
+  }
+
  private:
   unsigned int ncpus;
+  std::vector<ValueType> scratch_;
 };
 
 template <class KeyType, class ValueType>
@@ -302,24 +540,70 @@ class BPFHashTable : public BPFTableBase<KeyType, ValueType> {
 
   std::vector<std::pair<KeyType, ValueType>> get_table_offline() {
     std::vector<std::pair<KeyType, ValueType>> res;
-    KeyType cur;
-    ValueType value;
-
-    StatusTuple r(0);
-
-    if (!this->first(&cur))
-      return res;
+    for_each([&](const KeyType& key, const ValueType& value) {
+      res.emplace_back(key, value);
+      return true;
+    });
+    return res;
+  }
 
-    while (true) {
-      r = get_value(cur, value);
-      if (!r.ok())
+  // Visit every entry with fn(key, value) in constant memory: one key/value
+  // pair, or one batch buffer, is reused for the whole walk. Returning false
+  // from fn stops the walk.
+  template <class Fn>
+  StatusTuple for_each(Fn fn) {
+    KeyType key;
+    ValueType value;
+    size_t value_size = batch_value_size();
+
+    auto batch_fn = [&](const char* keys, const char* values, __u32 count) {
+      for (__u32 i = 0; i < count; i++) {
+        std::memcpy(&key, keys + i * this->desc.key_size, sizeof(KeyType));
+        batch_value_load(values + i * value_size, value);
+        if (!fn(static_cast<const KeyType&>(key),
+                static_cast<const ValueType&>(value)))
+          return false;
+      }
+      return true;
+    };
+    if (this->batch_walk(value_size, batch_fn) == 0)
+      return StatusTuple::OK();
+    if (errno != EOPNOTSUPP)
+      return StatusTuple(-1, "Error looking up batch: %s",
+                         std::strerror(errno));
+
+    if (!this->first(&key))
+      return StatusTuple::OK();
+    do {
+      // the entry may have been removed since next() returned it
+      if (!get_value(key, value).ok())
         break;
-      res.emplace_back(cur, value);
-      if (!this->next(&cur, &cur))
+      if (!fn(static_cast<const KeyType&>(key),
+              static_cast<const ValueType&>(value)))
         break;
-    }
+    } while (this->next(&key, &key));
 
-    return res;
+    return StatusTuple::OK();
+  }
+
+  // Insert or replace all entries, batch_size entries per syscall when the
+  // kernel supports batch updates (Linux 5.6)
+  StatusTuple update_batch(
+      const std::vector<std::pair<KeyType, ValueType>>& entries) {
+    size_t value_size = batch_value_size();
+    std::vector<char> keys(entries.size() * this->desc.key_size);
+    std::vector<char> values(entries.size() * value_size);
+    for (size_t i = 0; i < entries.size(); i++) {
+      std::memcpy(keys.data() + i * this->desc.key_size, &entries[i].first,
+                  sizeof(KeyType));
+      if (!batch_value_store(entries[i].second,
+                             values.data() + i * value_size))
+        return StatusTuple(-1, "bad value size");
+    }
+    if (this->batch_update(keys.data(), values.data(), value_size,
+                           entries.size()) < 0)
+      return StatusTuple(-1, "Error updating batch: %s", std::strerror(errno));
+    return StatusTuple::OK();
   }
 
   StatusTuple clear_table_non_atomic() {
@@ -329,6 +613,60 @@ class BPFHashTable : public BPFTableBase<KeyType, ValueType> {
 
     return StatusTuple::OK();
   }
+
+  // Return all entries and remove them from the table. With kernel batch
+  // support every chunk is read and deleted atomically, so no update is lost
+  // between the read and the delete. Otherwise entries are looked up and
+  // removed one by one.
+  StatusTuple drain(std::vector<std::pair<KeyType, ValueType>>& res) {
+    KeyType cur;
+    ValueType value;
+
+    res.clear();
+    if (batch_collect(res, true) == 0)
+      return StatusTuple::OK();
+    if (errno != EOPNOTSUPP)
+      return StatusTuple(-1, "Error draining table: %s", std::strerror(errno));
+
+    while (this->first(&cur)) {
+      TRY2(get_value(cur, value));
+      TRY2(remove_value(cur));
+      res.emplace_back(cur, value);
+    }
+
+    return StatusTuple::OK();
+  }
+
+ protected:
+  // Size of one value in the buffers filled by the kernel batch ops
+  virtual size_t batch_value_size() { return this->desc.leaf_size; }
+
+  virtual void batch_value_load(const char* src, ValueType& value) {
+    std::memcpy(get_value_addr(value), src, this->desc.leaf_size);
+  }
+
+  virtual bool batch_value_store(const ValueType& value, char* dst) {
+    std::memcpy(dst, get_value_addr(const_cast<ValueType&>(value)),
+                this->desc.leaf_size);
+    return true;
+  }
+
+  int batch_collect(std::vector<std::pair<KeyType, ValueType>>& res,
+                    bool del) {
+    size_t value_size = batch_value_size();
+    KeyType key;
+    ValueType value;
+
+    auto batch_fn = [&](const char* keys, const char* values, __u32 count) {
+      for (__u32 i = 0; i < count; i++) {
+        std::memcpy(&key, keys + i * this->desc.key_size, sizeof(KeyType));
+        batch_value_load(values + i * value_size, value);
+        res.emplace_back(key, value);
+      }
+      return true;
+    };
+    return this->batch_walk(value_size, batch_fn, del);
+  }
 };
 
 template <class KeyType, class ValueType>
@@ -361,8 +699,660 @@ class BPFPercpuHashTable
                                                                        value);
   }
 
+  // Read an entry and fold its per-cpu values with op without allocating
+  template <class Op>
+  StatusTuple get_value_reduced(const KeyType& key, ValueType& value, Op op) {
+    scratch_.resize(ncpus);
+    if (!this->lookup(const_cast<KeyType*>(&key), scratch_.data()))
+      return StatusTuple(-1, "Error getting value: %s", std::strerror(errno));
+    value = reduce_percpu(scratch_.data(), ncpus, op);
+    return StatusTuple::OK();
+  }
+
+  template <class Op>
+  std::vector<std::pair<KeyType, ValueType>> get_table_offline_reduced(Op op) {
+    std::vector<std::pair<KeyType, ValueType>> res;
+    KeyType key;
+    ValueType value;
+
+    auto batch_fn = [&](const char* keys, const char* values, __u32 count) {
+      auto vals = reinterpret_cast<const ValueType*>(values);
+      for (__u32 i = 0; i < count; i++) {
+        std::memcpy(&key, keys + i * this->desc.key_size, sizeof(KeyType));
+        res.emplace_back(key, reduce_percpu(vals + i * ncpus, ncpus, op));
+      }
+      return true;
+    };
+    if (this->batch_walk(sizeof(ValueType) * ncpus, batch_fn) == 0 ||
+        errno != EOPNOTSUPP)
+      return res;
+
+    if (!this->first(&key))
+      return res;
+    do {
+      if (!get_value_reduced(key, value, op).ok())
+        break;
+      res.emplace_back(key, value);
+    } while (this->next(&key, &key));
+
+    return res;
+  }
+
+ protected:
+  size_t batch_value_size() override { return sizeof(ValueType) * ncpus; }
+
+  void batch_value_load(const char* src,
+                        std::vector<ValueType>& value) override {
+    value.resize(ncpus);
+    std::memcpy(value.data(), src, sizeof(ValueType) * ncpus);
+  }
+
+  bool batch_value_store(const std::vector<ValueType>& value,
+                         char* dst) override {
+    if (value.size() != ncpus)
+      return false;
+    std::memcpy(dst, value.data(), sizeof(ValueType) * ncpus);
+    return true;
+  }
+
  private:
   unsigned int ncpus;
+  std::vector<ValueType> scratch_;
+};
+
+// Key of a BPF_LPM_TRIE: a prefix length in bits and the data it applies
+// to, in network byte order. AddrT is the data as declared on the BPF side,
+// e.g. BPFLpmKeyV4 for struct { u32 prefixlen; u32 addr; }.
+template <class AddrT>
+struct BPFLpmKey {
+  uint32_t prefixlen;
+  AddrT data;
+};
+
+typedef BPFLpmKey<std::array<uint8_t, 4>> BPFLpmKeyV4;
+typedef BPFLpmKey<std::array<uint8_t, 16>> BPFLpmKeyV6;
+
+// Parse an address or a prefix like "10.0.0.0/8" or "2001:db8::/32". An
+// address without prefix length gets the full length of its family.
+StatusTuple parse_lpm_prefix(const std::string& prefix, BPFLpmKeyV4& key);
+StatusTuple parse_lpm_prefix(const std::string& prefix, BPFLpmKeyV6& key);
+
+// A BPF_LPM_TRIE. KeyType starts with a uint32_t prefix length in bits,
+// followed by the data to match, in network byte order, like BPFLpmKey:
+// lookups return the entry with the longest prefix matching the key's data.
+template <class KeyType, class ValueType>
+class BPFLpmTrieTable : public BPFTableBase<KeyType, ValueType> {
+ public:
+  explicit BPFLpmTrieTable(const TableDesc& desc)
+      : BPFTableBase<KeyType, ValueType>(desc) {
+    if (desc.type != BPF_MAP_TYPE_LPM_TRIE)
+      throw std::invalid_argument("Table '" + desc.name +
+                                  "' is not a lpm trie table");
+  }
+
+  StatusTuple get_value(const KeyType& key, ValueType& value) {
+    if (!this->lookup(const_cast<KeyType*>(&key), &value))
+      return StatusTuple(-1, "Error getting value: %s", std::strerror(errno));
+    return StatusTuple::OK();
+  }
+
+  StatusTuple update_value(const KeyType& key, const ValueType& value) {
+    if (!this->update(const_cast<KeyType*>(&key),
+                      const_cast<ValueType*>(&value)))
+      return StatusTuple(-1, "Error updating value: %s", std::strerror(errno));
+    return StatusTuple::OK();
+  }
+
+  StatusTuple remove_value(const KeyType& key) {
+    if (!this->remove(const_cast<KeyType*>(&key)))
+      return StatusTuple(-1, "Error removing value: %s", std::strerror(errno));
+    return StatusTuple::OK();
+  }
+
+  // Insert or replace all entries. The kernel has no batch ops for tries,
+  // so this takes a syscall per entry: keep per-endpoint state in a hash
+  // table and only prefixes here.
+  StatusTuple update_batch(
+      const std::vector<std::pair<KeyType, ValueType>>& entries) {
+    std::vector<char> keys(entries.size() * this->desc.key_size);
+    std::vector<char> values(entries.size() * this->desc.leaf_size);
+    for (size_t i = 0; i < entries.size(); i++) {
+      std::memcpy(keys.data() + i * this->desc.key_size, &entries[i].first,
+                  sizeof(KeyType));
+      std::memcpy(values.data() + i * this->desc.leaf_size,
+                  &entries[i].second, sizeof(ValueType));
+    }
+    if (this->batch_update(keys.data(), values.data(), this->desc.leaf_size,
+                           entries.size()) < 0)
+      return StatusTuple(-1, "Error updating batch: %s", std::strerror(errno));
+    return StatusTuple::OK();
+  }
+
+  // Make the trie hold exactly entries, e.g. to reload an allow-list: the
+  // entries are written first, then the prefixes missing from entries are
+  // removed, so prefixes in both the old and the new list never miss.
+  StatusTuple load(const std::vector<std::pair<KeyType, ValueType>>& entries) {
+    TRY2(update_batch(entries));
+
+    std::set<std::string> wanted;
+    for (const auto& entry : entries)
+      wanted.emplace(reinterpret_cast<const char*>(&entry.first),
+                     sizeof(KeyType));
+    std::vector<KeyType> stale;
+    TRY2(for_each([&](const KeyType& key, const ValueType&) {
+      if (!wanted.count(std::string(reinterpret_cast<const char*>(&key),
+                                    sizeof(KeyType))))
+        stale.push_back(key);
+      return true;
+    }));
+    for (const auto& key : stale)
+      if (!this->remove(const_cast<KeyType*>(&key)) && errno != ENOENT)
+        return StatusTuple(-1, "Error removing value: %s",
+                           std::strerror(errno));
+    return StatusTuple::OK();
+  }
+
+  // Visit every prefix with fn(key, value), with the batch API when the
+  // kernel has it for tries and key by key otherwise. Returning false from fn
+  // stops the walk.
+  template <class Fn>
+  StatusTuple for_each(Fn fn) {
+    KeyType key;
+    ValueType value;
+
+    auto batch_fn = [&](const char* keys, const char* values, __u32 count) {
+      for (__u32 i = 0; i < count; i++) {
+        std::memcpy(&key, keys + i * this->desc.key_size, sizeof(KeyType));
+        std::memcpy(&value, values + i * this->desc.leaf_size,
+                    sizeof(ValueType));
+        if (!fn(static_cast<const KeyType&>(key),
+                static_cast<const ValueType&>(value)))
+          return false;
+      }
+      return true;
+    };
+    if (this->batch_walk(this->desc.leaf_size, batch_fn) == 0)
+      return StatusTuple::OK();
+    if (errno != EOPNOTSUPP)
+      return StatusTuple(-1, "Error looking up batch: %s",
+                         std::strerror(errno));
+
+    if (!this->first(&key))
+      return StatusTuple::OK();
+    do {
+      // A lookup of a full key matches the prefix itself. The entry may have
+      // been removed since next() returned it.
+      if (!this->lookup(&key, &value))
+        continue;
+      if (!fn(static_cast<const KeyType&>(key),
+              static_cast<const ValueType&>(value)))
+        break;
+    } while (this->next(&key, &key));
+    return StatusTuple::OK();
+  }
+
+  std::vector<std::pair<KeyType, ValueType>> get_table_offline() {
+    std::vector<std::pair<KeyType, ValueType>> res;
+    for_each([&](const KeyType& key, const ValueType& value) {
+      res.emplace_back(key, value);
+      return true;
+    });
+    return res;
+  }
+};
+
+// Counts of a BPF_HISTOGRAM, indexed by slot. With LOG2 scale slot i holds
+// values in [2^(i-1), 2^i - 1] (slot 0 holds 0) as produced by bpf_log2l();
+// with LINEAR scale slot i holds the value i. Slots of other widths, like
+// those of bpf_log_linear_slot(), are described by bounds.
+struct BPFHistogram {
+  enum Scale { LOG2, LINEAR };
+
+  std::vector<uint64_t> counts;
+
+  uint64_t total() const;
+  void merge(const BPFHistogram& other);
+
+  // Value below which a fraction q (0 to 1) of the samples fall, linearly
+  // interpolated within the matching slot
+  double percentile(double q, Scale scale = LOG2) const;
+  // Same for slots of any width, slot i holding values in
+  // [bounds[i], bounds[i + 1]). bounds has one more element than counts.
+  double percentile(double q, const std::vector<double>& bounds) const;
+
+  // Bounds of the first n slots of bpf_log_linear_slot(v, sub_bits), to
+  // compute percentiles of log-linear histograms, e.g.
+  //   hist.percentile(0.999, log_linear_bounds(5, hist.counts.size()))
+  static std::vector<double> log_linear_bounds(unsigned int sub_bits,
+                                               size_t n);
+
+  // Compact binary form: varint number of non-empty slots, followed by a
+  // varint slot delta and a varint count for each of them
+  std::string serialize() const;
+  static StatusTuple deserialize(const std::string& data, BPFHistogram& hist);
+};
+
+template <class KeyType>
+typename std::enable_if<std::is_integral<KeyType>::value, uint64_t>::type
+hist_key_slot(const KeyType& key) {
+  return key;
+}
+
+template <class KeyType>
+typename std::enable_if<std::is_integral<KeyType>::value, KeyType>::type
+hist_key_section(const KeyType&) {
+  return 0;
+}
+
+// Keys of sectioned histograms are structs ending with a slot member, e.g.
+// struct { char disk[32]; u64 slot; }
+template <class KeyType>
+auto hist_key_slot(const KeyType& key) -> decltype((uint64_t)key.slot) {
+  return key.slot;
+}
+
+template <class KeyType>
+auto hist_key_section(const KeyType& key)
+    -> decltype(key.slot, KeyType()) {
+  KeyType section = key;
+  section.slot = 0;
+  return section;
+}
+
+// Table declared with BPF_HISTOGRAM. Integer keyed histograms are arrays of
+// slots; struct keyed ones are hashes with one histogram per section, where
+// the section is the key with its slot set to 0.
+template <class KeyType = int>
+class BPFHistogramTable : public BPFTableBase<KeyType, uint64_t> {
+ public:
+  explicit BPFHistogramTable(const TableDesc& desc)
+      : BPFTableBase<KeyType, uint64_t>(desc) {
+    if (desc.type != BPF_MAP_TYPE_ARRAY && desc.type != BPF_MAP_TYPE_HASH)
+      throw std::invalid_argument("Table '" + desc.name +
+                                  "' is not a histogram table");
+    if (desc.key_size != sizeof(KeyType) || desc.leaf_size != sizeof(uint64_t))
+      throw std::invalid_argument("Table '" + desc.name +
+                                  "' key or leaf size mismatch");
+  }
+
+  // All buckets of the table, with every section merged together
+  StatusTuple get_histogram(BPFHistogram& hist) {
+    std::vector<std::pair<KeyType, BPFHistogram>> sections;
+    TRY2(get_sections(sections));
+    hist.counts.clear();
+    for (const auto& it : sections)
+      hist.merge(it.second);
+    return StatusTuple::OK();
+  }
+
+  StatusTuple get_sections(
+      std::vector<std::pair<KeyType, BPFHistogram>>& res) {
+    std::map<std::string, size_t> index;
+
+    res.clear();
+    auto add = [&](const KeyType& key, uint64_t count) {
+      uint64_t slot = hist_key_slot(key);
+      if (!count || slot >= kMaxSlots)
+        return;
+      KeyType section = hist_key_section(key);
+      std::string id(reinterpret_cast<const char*>(&section), sizeof(section));
+      auto it = index.find(id);
+      if (it == index.end()) {
+        it = index.emplace(id, res.size()).first;
+        res.emplace_back(section, BPFHistogram());
+      }
+      auto& counts = res[it->second].second.counts;
+      if (counts.size() <= slot)
+        counts.resize(slot + 1);
+      counts[slot] += count;
+    };
+
+    // all buckets are usually fetched in a single batch
+    auto batch_fn = [&](const char* keys, const char* values, __u32 count) {
+      for (__u32 i = 0; i < count; i++) {
+        KeyType key;
+        uint64_t value;
+        std::memcpy(&key, keys + i * sizeof(KeyType), sizeof(KeyType));
+        std::memcpy(&value, values + i * sizeof(uint64_t), sizeof(uint64_t));
+        add(key, value);
+      }
+      return true;
+    };
+    if (this->batch_walk(sizeof(uint64_t), batch_fn) == 0)
+      return StatusTuple::OK();
+    if (errno != EOPNOTSUPP)
+      return StatusTuple(-1, "Error looking up batch: %s",
+                         std::strerror(errno));
+
+    KeyType key;
+    uint64_t value;
+    if (!this->first(&key))
+      return StatusTuple::OK();
+    do {
+      if (this->lookup(&key, &value))
+        add(key, value);
+    } while (this->next(&key, &key));
+    return StatusTuple::OK();
+  }
+
+ private:
+  // bounds linear histograms against garbage slot values
+  static const uint64_t kMaxSlots = 1 << 16;
+};
+
+// Interval counts of a BPF_ARRAY or BPF_PERCPU_ARRAY of u64 histogram slots,
+// summed over the CPUs. The table is never cleared: update() computes the
+// counts added since the previous read, so no event is lost to a clear()
+// and the table can be read at short intervals.
+class BPFHistogramDelta : public BPFTableBase<void, void> {
+ public:
+  explicit BPFHistogramDelta(const TableDesc& desc);
+
+  // Read the table and compute the counts added since the last update()
+  // that advanced. Without advance, the counts keep accumulating from there.
+  StatusTuple update(bool advance = true);
+
+  const BPFHistogram& delta() const { return delta_; }
+
+ private:
+  size_t ncpus_;
+  std::vector<uint64_t> last_, cur_;
+  BPFHistogram delta_;
+};
+
+// Keeps the contents of a hash or array table between two reads and reports
+// only the entries that were added, changed or removed in between. Values are
+// treated as arrays of unsigned counters, as wide as the leaf size alignment
+// allows (up to 64 bits), and deltas are computed counter by counter.
+class BPFTableSnapshot : public BPFTableBase<void, void> {
+ public:
+  enum ChangeKind { ADDED = 1, CHANGED = 2, REMOVED = 3 };
+
+  // Layout matches struct bcc_table_change in bcc_common.h
+  struct Change {
+    int kind;
+    const void* key;
+    // current value, or last known value of a removed entry
+    const void* value;
+    // value minus the previous value; the value itself for added entries and
+    // null for removed entries
+    const void* delta;
+  };
+
+  explicit BPFTableSnapshot(const TableDesc& desc);
+  BPFTableSnapshot(const BPFTableSnapshot&) = delete;
+  BPFTableSnapshot(BPFTableSnapshot&&) = default;
+
+  // Read the table and compute the changes since the previous update(). The
+  // first call reports every entry as added. Pointers in changes() remain
+  // valid until the next update().
+  StatusTuple update();
+
+  const std::vector<Change>& changes() const { return changes_; }
+  size_t size() const { return cur_.count; }
+
+ private:
+  struct Store {
+    // key followed by value, entry_size_ bytes per entry
+    std::vector<char> entries;
+    // open addressing index, holds entry index + 1 or 0 for an empty slot
+    std::vector<uint32_t> slots;
+    std::vector<uint8_t> seen;
+    size_t count = 0;
+  };
+
+  void append(Store& store, const void* key, const void* value);
+  void build_index(Store& store);
+  ssize_t find(const Store& store, const char* key) const;
+  void compute_delta(char* dst, const char* cur, const char* prev) const;
+
+  size_t entry_size_;
+  Store cur_, prev_, next_;
+  std::vector<char> deltas_;
+  std::vector<Change> changes_;
+};
+
+// Reads, and optionally drains, a hash table while keeping only the k entries
+// with the largest score, the sum of some unsigned integer fields of the
+// value. Top-style tools use it so that only the rows they display are copied
+// out of the library each interval.
+class BPFTableTop : public BPFTableBase<void, void> {
+ public:
+  // Layout matches struct bcc_table_top_field in bcc_common.h
+  struct Field {
+    size_t offset;
+    // 1, 2, 4 or 8 bytes
+    size_t size;
+  };
+
+  // With no fields the entries are kept in table order. k of 0 keeps all of
+  // them.
+  BPFTableTop(const TableDesc& desc, std::vector<Field> fields, size_t k);
+  BPFTableTop(const BPFTableTop&) = delete;
+  BPFTableTop(BPFTableTop&&) = default;
+
+  // Read the table, removing the entries read when drain is set, and select
+  // the top entries, largest score first. keys() and values() remain valid
+  // until the next update().
+  StatusTuple update(bool drain);
+
+  const char* keys() const { return keys_.data(); }
+  const char* values() const { return values_.data(); }
+  size_t size() const { return order_.size(); }
+  // number of entries read by the last update()
+  size_t total() const { return total_; }
+
+ private:
+  uint64_t score(const char* value) const;
+  void add(const char* key, const char* value);
+
+  std::vector<Field> fields_;
+  size_t k_;
+  size_t entry_size_;
+  size_t total_ = 0;
+  // key followed by value of the candidates, at most k_ of them
+  std::vector<char> entries_;
+  // min-heap of (score, candidate index) while reading, then sorted
+  std::vector<std::pair<uint64_t, size_t>> order_;
+  std::vector<char> keys_, values_;
+};
+
+// Reads a BPF_HEAVY_HITTERS table: the count-min sketches of all CPUs are
+// summed, and the candidates of every CPU are estimated with the sum. k is
+// the one the table was declared with, the sketch width follows from it.
+template <class KeyType>
+class BPFHeavyHitters : public BPFTableBase<int, void> {
+ public:
+  // BPF_HEAVY_HITTERS_DEPTH in helpers.h
+  static const size_t DEPTH = 4;
+
+  BPFHeavyHitters(const TableDesc& desc, size_t k)
+      : BPFTableBase<int, void>(desc),
+        k_(k),
+        slot_size_((16 + sizeof(KeyType) + 7) & ~7UL),
+        ncpus_(BPFTable::get_possible_cpu_count()) {
+    if (desc.type != BPF_MAP_TYPE_PERCPU_ARRAY)
+      throw std::invalid_argument("Table '" + desc.name +
+                                  "' is not a per-cpu array table");
+    size_t counts = desc.leaf_size - 8 - k * slot_size_;
+    if (desc.leaf_size < 8 + k * slot_size_ || counts % (DEPTH * 8) ||
+        !counts)
+      throw std::invalid_argument("Table '" + desc.name +
+                                  "' does not match the key type and k");
+    width_ = counts / (DEPTH * 8);
+  }
+
+  // The candidates of all CPUs with their estimated count, largest first,
+  // and the sum of all counts in total if not null.
+  StatusTuple get_top(std::vector<std::pair<KeyType, uint64_t>>& top,
+                      uint64_t* total = nullptr) {
+    int zero = 0;
+    std::vector<char> buf(desc.leaf_size * ncpus_);
+    if (!lookup(&zero, buf.data()))
+      return StatusTuple(-1, "Error reading table %s: %s", desc.name.c_str(),
+                         std::strerror(errno));
+
+    uint64_t sum = 0;
+    std::map<uint64_t, KeyType> candidates;
+    for (size_t cpu = 0; cpu < ncpus_; cpu++) {
+      const char* value = &buf[cpu * desc.leaf_size];
+      sum += word(value, 0);
+      for (size_t i = 0; i < k_; i++) {
+        size_t off = top_offset() + i * slot_size_;
+        if (!word(value, off + 8))
+          continue;
+        KeyType key;
+        std::memcpy(&key, value + off + 16, sizeof(key));
+        candidates.emplace(word(value, off), key);
+      }
+    }
+
+    top.clear();
+    for (const auto& c : candidates) {
+      uint64_t est = UINT64_MAX;
+      for (size_t row = 0; row < DEPTH; row++) {
+        size_t off =
+            8 + (row * width_ + ((c.first >> (row * 16)) & (width_ - 1))) * 8;
+        uint64_t count = 0;
+        for (size_t cpu = 0; cpu < ncpus_; cpu++)
+          count += word(&buf[cpu * desc.leaf_size], off);
+        est = std::min(est, count);
+      }
+      top.emplace_back(c.second, est);
+    }
+    std::stable_sort(top.begin(), top.end(),
+                     [](const std::pair<KeyType, uint64_t>& a,
+                        const std::pair<KeyType, uint64_t>& b) {
+                       return a.second > b.second;
+                     });
+    if (total)
+      *total = sum;
+    return StatusTuple::OK();
+  }
+
+  // Zero the sketches and candidates of all CPUs, to count the next
+  // interval on its own
+  StatusTuple clear() {
+    int zero = 0;
+    std::vector<char> buf(desc.leaf_size * ncpus_);
+    if (!update(&zero, buf.data()))
+      return StatusTuple(-1, "Error clearing table %s: %s", desc.name.c_str(),
+                         std::strerror(errno));
+    return StatusTuple::OK();
+  }
+
+  size_t width() const { return width_; }
+
+ private:
+  static uint64_t word(const char* value, size_t off) {
+    uint64_t v;
+    std::memcpy(&v, value + off, sizeof(v));
+    return v;
+  }
+  size_t top_offset() const { return 8 + DEPTH * width_ * 8; }
+
+  size_t k_;
+  size_t slot_size_;
+  size_t ncpus_;
+  size_t width_;
+};
+
+// Periodically copies a set of tables on a background thread. Snapshots are
+// double buffered: the poller fills the buffer no reader is using and then
+// publishes it, so read() never blocks on the poller or on map syscalls.
+class BPFTablePoller {
+ public:
+  struct Table {
+    std::string name;
+    size_t key_size = 0;
+    // leaf_size, or the size of all per-cpu values for percpu tables
+    size_t value_size = 0;
+    // key followed by value, key_size + value_size bytes per entry
+    std::vector<char> entries;
+    size_t count = 0;
+
+    const char* key(size_t i) const {
+      return &entries[i * (key_size + value_size)];
+    }
+    const char* value(size_t i) const { return key(i) + key_size; }
+  };
+
+  struct Snapshot {
+    // 0 until the first poll completes
+    uint64_t generation = 0;
+    // steady_clock time the poll started
+    uint64_t timestamp_ns = 0;
+    // in the order the tables were added
+    std::vector<Table> tables;
+
+    const Table* find(const std::string& name) const;
+  };
+
+  // Pins the snapshot it was created with until destroyed. The poller only
+  // overwrites a buffer once every reader of it is gone, so hold a Reader for
+  // no longer than it takes to consume the data.
+  class Reader {
+   public:
+    Reader(Reader&& that) : snapshot_(that.snapshot_), pins_(that.pins_) {
+      that.pins_ = nullptr;
+    }
+    Reader(const Reader&) = delete;
+    ~Reader() {
+      if (pins_)
+        pins_->fetch_sub(1);
+    }
+
+    const Snapshot& operator*() const { return *snapshot_; }
+    const Snapshot* operator->() const { return snapshot_; }
+
+   private:
+    friend class BPFTablePoller;
+    Reader(const Snapshot* snapshot, std::atomic<int>* pins)
+        : snapshot_(snapshot), pins_(pins) {}
+
+    const Snapshot* snapshot_;
+    std::atomic<int>* pins_;
+  };
+
+  explicit BPFTablePoller(std::chrono::milliseconds interval);
+  BPFTablePoller(const BPFTablePoller&) = delete;
+  ~BPFTablePoller();
+
+  // Register a hash, array or percpu hash/array table. Tables can only be
+  // added while the poller is stopped.
+  StatusTuple add_table(const TableDesc& desc);
+
+  StatusTuple start();
+  StatusTuple stop();
+  // Run one poll on the calling thread. Not allowed while started.
+  StatusTuple poll();
+
+  // The latest complete snapshot. Lock-free and safe from any thread.
+  Reader read() const;
+  // Result of the most recent poll
+  StatusTuple last_status() const;
+
+ private:
+  class Source;
+
+  StatusTuple poll_into(Snapshot& snapshot);
+  StatusTuple poll_next();
+  void publish(StatusTuple status);
+  void run();
+
+  std::chrono::milliseconds interval_;
+  std::vector<std::unique_ptr<Source>> sources_;
+
+  Snapshot buffers_[2];
+  mutable std::atomic<int> pins_[2];
+  std::atomic<int> current_;
+  uint64_t generation_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stopping_;
+  StatusTuple last_status_;
+  std::thread thread_;
 };
 
 // From src/cc/export/helpers.h
@@ -371,6 +1361,17 @@ struct stacktrace_t {
   uintptr_t ip[BPF_MAX_STACK_DEPTH];
 };
 
+// A record of a BPF_STACK_RINGBUF, with the ids of its stacks in the
+// BPFStackTable reading it, or -1 for a stack that was not recorded
+struct BPFStackRecord {
+  uint64_t tag;
+  uint32_t pid;
+  int kernel_stack_id;
+  int user_stack_id;
+};
+
+class BPFRingBuffer;
+
 class BPFStackTable : public BPFTableBase<int, stacktrace_t> {
  public:
   BPFStackTable(const TableDesc& desc, bool use_debug_file,
@@ -382,10 +1383,64 @@ class BPFStackTable : public BPFTableBase<int, stacktrace_t> {
   void clear_table_non_atomic();
   std::vector<uintptr_t> get_stack_addr(int stack_id);
   std::vector<std::string> get_stack_symbol(int stack_id, int pid);
+  // Symbolize several stacks of the same pid with a single batched lookup,
+  // which resolves frames shared between the stacks only once
+  std::vector<std::vector<std::string>> get_stack_symbols(
+      const std::vector<int>& stack_ids, int pid);
+  // Keep the symbols of about max_entries (stack id, pid) pairs, for the
+  // stacks asked for again to be returned without resolving them again; 0,
+  // the default, disables it. The cache is split by pid into shards, each
+  // emptied when full, and emptied by clear_table_non_atomic(). If
+  // verify_stacks is true, the stack is still
+  // looked up, for a stack id reused by another stack to be detected. It
+  // can be false when stack ids are only freed by this object, which means
+  // the programs don't use BPF_F_REUSE_STACKID.
+  void set_symbol_cache_size(size_t max_entries, bool verify_stacks = true);
+
+  // For a BPF_STACK_RINGBUF: invoke cb with each record read by
+  // poll_records(), after giving each distinct stack an id of this table, so
+  // that the ids are symbolized like those of a stack map. The stacks are
+  // kept until clear_table_non_atomic().
+  StatusTuple open_records(std::function<void(const BPFStackRecord&)> cb);
+  // Wait up to timeout_ms for records and read them. Returns the number of
+  // records read, or negative on error.
+  int poll_records(int timeout_ms);
 
  private:
+  // The stacks read from a BPF_STACK_RINGBUF, indexed by their id
+  struct record_stacks_t {
+    std::mutex mutex;
+    std::vector<std::vector<uintptr_t>> stacks;
+    std::map<std::vector<uintptr_t>, int> ids;
+  };
+
+  static int record_stack_id(record_stacks_t& rs, const uint64_t* ip,
+                             size_t nr);
+
+  struct cached_stack_t {
+    std::vector<uintptr_t> addrs;
+    std::vector<std::string> symbols;
+  };
+
+  // The symbol caches of pids and the cached stacks, sharded by pid for
+  // threads symbolizing stacks at the same time not to wait for each other.
+  // Symbol caches are resolved from without the lock of their shard, and
+  // freed with the last reference to them.
+  struct shard_t {
+    std::mutex mutex;
+    std::map<int, std::shared_ptr<void>> pid_sym;
+    std::map<std::pair<int, int>, cached_stack_t> stack_cache;
+  };
+  static const size_t NUM_SHARDS = 16;
+  shard_t& shard(int pid) { return shards_[unsigned(pid) % NUM_SHARDS]; }
+
   bcc_symbol_option symbol_option_;
-  std::map<int, void*> pid_sym_;
+  std::unique_ptr<shard_t[]> shards_;
+  // per shard
+  std::atomic<size_t> stack_cache_size_{0};
+  std::atomic<bool> verify_stacks_{true};
+  std::unique_ptr<record_stacks_t> record_stacks_;
+  std::unique_ptr<BPFRingBuffer> records_;
 };
 
 // from src/cc/export/helpers.h
@@ -410,23 +1465,172 @@ class BPFStackBuildIdTable : public BPFTableBase<int, stacktrace_buildid_t> {
 
 class BPFPerfBuffer : public BPFTableBase<int, int> {
  public:
+  // Extracts the ordering timestamp of a raw sample
+  typedef std::function<uint64_t(const void* raw, int raw_size)> timestamp_fn;
+
   BPFPerfBuffer(const TableDesc& desc);
   ~BPFPerfBuffer();
 
+  // Readers are woken up every wakeup_events samples, or once
+  // wakeup_watermark bytes are available if that is non-zero.
+  StatusTuple open_all_cpu(perf_reader_raw_cb cb, perf_reader_lost_cb lost_cb,
+                           void* cb_cookie, int page_cnt,
+                           int wakeup_events = 1, int wakeup_watermark = 0);
+  // Same as above, but samples from all CPUs are merged in timestamp order
+  // before cb is invoked. A sample is held back until one at least
+  // reorder_window newer has been seen, or until more than max_pending
+  // samples are held, so samples arriving later than that may still be out
+  // of order.
   StatusTuple open_all_cpu(perf_reader_raw_cb cb, perf_reader_lost_cb lost_cb,
-                           void* cb_cookie, int page_cnt);
+                           void* cb_cookie, int page_cnt, timestamp_fn ts_fn,
+                           uint64_t reorder_window, size_t max_pending = 65536);
+  // Flight recorder: each CPU writes to a backward ring which the kernel
+  // keeps overwriting, so it holds the latest samples and nothing needs to
+  // read it meanwhile. snapshot() delivers them. Needs Linux 4.7.
+  StatusTuple open_flight_recorder(perf_reader_raw_cb cb,
+                                   perf_reader_lost_cb lost_cb,
+                                   void* cb_cookie, int page_cnt);
+  // Pause the rings of a flight recorder, invoke the callback on their
+  // samples, oldest first for each CPU, and resume them. Samples are left in
+  // the rings. Returns the number of samples, or -1 if not a flight recorder.
+  int snapshot();
   StatusTuple close_all_cpu();
   int poll(int timeout_ms);
+  // Read the samples available on every CPU without waiting, including those
+  // that did not reach wakeup_events or wakeup_watermark yet. Returns the
+  // number of CPUs read, or -1 while consumer threads run.
+  int consume_all();
+  // Deliver all samples held back by the merge stage
+  void flush_ordered();
+
+  // For an event loop of the application to read the buffer: epoll_fd() is
+  // readable when the ring of any CPU reached its wakeup condition, and
+  // consume() then reads the rings that did without waiting. It returns the
+  // number of samples read, or -1 if the buffer isn't open, is a flight
+  // recorder or has consumer threads. epoll_fd() is -1 if not open, and
+  // changes when the buffer is reopened.
+  int epoll_fd() const { return epfd_; }
+  int consume();
+
+  // Shard the per-CPU readers across num_threads consumer threads, each with
+  // its own epoll set and pinned to the NUMA node(s) of the CPUs it drains.
+  // Callbacks are then invoked on those threads, and poll() returns -1 until
+  // stop_consumers() is called.
+  StatusTuple start_consumers(unsigned int num_threads);
+  StatusTuple stop_consumers();
+
+  // Size the ring of each CPU by its own losses: after poll() or
+  // consume_all(), a CPU whose ring lost samples is reopened with twice as
+  // many pages, up to max_page_cnt, as long as the rings of all CPUs stay
+  // within budget_pages in total. The samples left in the old ring are read
+  // first. Takes effect at once if the buffer is open, and also applies to
+  // later opens. Rings aren't resized while consumer threads run.
+  StatusTuple enable_adaptive(int max_page_cnt, size_t budget_pages);
+  // Pages of the ring of cpu, 0 if it isn't open
+  int page_cnt(int cpu) const;
 
  private:
-  StatusTuple open_on_cpu(perf_reader_raw_cb cb, perf_reader_lost_cb lost_cb,
-                          int cpu, void* cb_cookie, int page_cnt);
+  StatusTuple open_on_cpu(int cpu, int page_cnt);
+  StatusTuple reopen_on_cpu(int cpu, int page_cnt);
   StatusTuple close_on_cpu(int cpu);
+  perf_reader* new_reader(int cpu, int page_cnt);
+  static void consumer_loop(int epfd, int nevents);
+  static void ordered_cb(void* cb_cookie, void* raw, int raw_size);
+  static void ordered_lost_cb(void* cb_cookie, uint64_t lost);
+  void drain_ordered(bool all);
+  static void adaptive_cb(void* cb_cookie, void* raw, int raw_size);
+  static void adaptive_lost_cb(void* cb_cookie, uint64_t lost);
+  void grow_lossy_cpus();
+
+  // Losses of one CPU since its ring was last considered for growing, the
+  // cookie of its reader in adaptive mode
+  struct adaptive_cpu {
+    BPFPerfBuffer* pb;
+    uint64_t lost;
+  };
+
+  struct ordered_sample {
+    uint64_t ts;
+    uint64_t seq;
+    std::string data;
+    bool operator>(const ordered_sample& other) const {
+      return ts != other.ts ? ts > other.ts : seq > other.seq;
+    }
+  };
 
   std::map<int, perf_reader*> cpu_readers_;
+  std::map<int, int> cpu_page_cnt_;
+
+  perf_reader_raw_cb raw_cb_;
+  perf_reader_lost_cb lost_cb_;
+  void* cb_cookie_;
+  int wakeup_events_;
+  int wakeup_watermark_;
+  bool overwrite_;
+
+  int adaptive_max_page_cnt_;
+  size_t adaptive_budget_pages_;
+  std::map<int, adaptive_cpu> adaptive_cpus_;
+
+  perf_reader_raw_cb ordered_user_cb_;
+  perf_reader_lost_cb ordered_user_lost_cb_;
+  void* ordered_user_cookie_;
+  timestamp_fn ts_fn_;
+  uint64_t reorder_window_;
+  size_t max_pending_;
+  uint64_t max_ts_;
+  uint64_t seq_;
+  std::priority_queue<ordered_sample, std::vector<ordered_sample>,
+                      std::greater<ordered_sample>>
+      pending_;
+  std::mutex ordered_mutex_;
 
   int epfd_;
   std::unique_ptr<epoll_event[]> ep_events_;
+
+  int stop_fd_;
+  std::vector<int> consumer_epfds_;
+  std::vector<std::thread> consumers_;
+};
+
+class BPFRingBuffer : public BPFTableBase<int, int> {
+ public:
+  typedef std::function<int(void* data, size_t size)> sample_fn;
+
+  BPFRingBuffer(const TableDesc& desc);
+  ~BPFRingBuffer();
+
+  StatusTuple open(ring_buffer_sample_fn cb, void* ctx = nullptr);
+  StatusTuple open(sample_fn cb);
+  // Invoke cb with each record viewed as a T. Records shorter than T are
+  // dropped, and stop the current poll or consume with -EINVAL.
+  template <class T>
+  StatusTuple open(std::function<int(const T&)> cb) {
+    return open(sample_fn([cb](void* data, size_t size) {
+      if (size < sizeof(T))
+        return -EINVAL;
+      return cb(*static_cast<const T*>(data));
+    }));
+  }
+  StatusTuple close();
+
+  // Wait up to timeout_ms for records and consume them. Returns the number of
+  // records consumed, or negative on error.
+  int poll(int timeout_ms);
+  // Consume available records without waiting.
+  int consume();
+  // Spin on consume() without sleeping in the kernel, until at least one
+  // record was consumed or timeout_ms elapsed. Trades a CPU for latency.
+  int busy_poll(int timeout_ms);
+  // Readable when records are available, for an event loop of the
+  // application to call consume(). -1 if not open.
+  int epoll_fd() const;
+
+ private:
+  static int sample_cb(void* ctx, void* data, size_t size);
+
+  ring_buffer* rb_;
+  sample_fn fn_;
 };
 
 class BPFPerfEventArray : public BPFTableBase<int, int> {
@@ -435,10 +1639,15 @@ class BPFPerfEventArray : public BPFTableBase<int, int> {
   ~BPFPerfEventArray();
 
   StatusTuple open_all_cpu(uint32_t type, uint64_t config);
+  // Open the event on each CPU in the group of the event of leader on that
+  // CPU, so that the PMU counts both over the same periods
+  StatusTuple open_all_cpu(uint32_t type, uint64_t config,
+                           const BPFPerfEventArray& leader);
   StatusTuple close_all_cpu();
 
  private:
-  StatusTuple open_on_cpu(int cpu, uint32_t type, uint64_t config);
+  StatusTuple open_on_cpu(int cpu, uint32_t type, uint64_t config,
+                          int group_fd = -1);
   StatusTuple close_on_cpu(int cpu);
 
   std::map<int, int> cpu_fds_;
@@ -470,6 +1679,31 @@ public:
   StatusTuple remove_value(const int& index);
 };
 
+// Values are the sizes of the queues to each CPU, in packets
+class BPFCpumapTable : public BPFTableBase<int, uint32_t> {
+public:
+  BPFCpumapTable(const TableDesc& desc);
+
+  StatusTuple update_value(const int& cpu, const uint32_t& qsize);
+  StatusTuple get_value(const int& cpu, uint32_t& qsize);
+  StatusTuple remove_value(const int& cpu);
+};
+
+// struct bpf_queue_stats of helpers.h
+struct BPFQueueStats {
+  uint64_t packets;
+  uint64_t bytes;
+};
+
+// A BPF_QUEUE_STATS table, indexed by device queue
+class BPFQueueStatsTable : public BPFPercpuArrayTable<BPFQueueStats> {
+public:
+  BPFQueueStatsTable(const TableDesc& desc);
+
+  // Counters of each queue, summed over CPUs
+  std::vector<BPFQueueStats> get_queue_stats();
+};
+
 class BPFXskmapTable : public BPFTableBase<int, int> {
 public:
   BPFXskmapTable(const TableDesc& desc);
@@ -499,6 +1733,38 @@ class BPFMapInMapTable : public BPFTableBase<KeyType, int> {
       return StatusTuple(-1, "Error removing value: %s", std::strerror(errno));
     return StatusTuple::OK();
   }
+
+  // Replace the contents of the inner map at key without BPF programs ever
+  // seeing them half updated, and without updating the map they read: of a
+  // and b, two inner hash tables of this table, the one not installed at
+  // key is emptied, filled with entries in batches, and then installed with
+  // a single update of key. Programs that looked up the previous map keep
+  // reading it until they return, it is only emptied by the next swap. The
+  // table now installed is stored in installed if not null.
+  template <class InnerKeyType, class InnerValueType>
+  StatusTuple swap_inner_map(
+      const KeyType& key, BPFHashTable<InnerKeyType, InnerValueType>& a,
+      BPFHashTable<InnerKeyType, InnerValueType>& b,
+      const std::vector<std::pair<InnerKeyType, InnerValueType>>& entries,
+      BPFHashTable<InnerKeyType, InnerValueType>** installed = nullptr) {
+    struct bpf_map_info info = {};
+    uint32_t info_len = sizeof(info);
+    if (bpf_obj_get_info_by_fd(a.get_fd(), &info, &info_len) < 0)
+      return StatusTuple(-1, "Error getting inner map info: %s",
+                         std::strerror(errno));
+    // Looked up from user space, map-in-map values are map ids
+    uint32_t installed_id = 0;
+    this->lookup(const_cast<KeyType*>(&key), &installed_id);
+    auto& spare = installed_id == info.id ? b : a;
+
+    std::vector<std::pair<InnerKeyType, InnerValueType>> old;
+    TRY2(spare.drain(old));
+    TRY2(spare.update_batch(entries));
+    TRY2(update_value(key, spare.get_fd()));
+    if (installed)
+      *installed = &spare;
+    return StatusTuple::OK();
+  }
 };
 
 class BPFSockmapTable : public BPFTableBase<int, int> {
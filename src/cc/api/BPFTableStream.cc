@@ -0,0 +1,374 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <exception>
+
+#include "BPFTableStream.h"
+
+namespace ebpf {
+
+namespace {
+
+const uint8_t STREAM_VERSION = 1;
+const uint8_t FLAG_KEYFRAME = 1;
+
+enum RecordTag { REC_TABLE = 1, REC_ADD = 2, REC_DELTA = 3, REC_REMOVE = 4 };
+
+// Same counter width as BPFTableSnapshot::compute_delta()
+size_t word_width(size_t leaf_size) {
+  if (leaf_size % 8 == 0)
+    return 8;
+  if (leaf_size % 4 == 0)
+    return 4;
+  if (leaf_size % 2 == 0)
+    return 2;
+  return 1;
+}
+
+uint64_t get_word(const char* p, size_t width) {
+  switch (width) {
+  case 8: {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+  }
+  case 4: {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+  }
+  case 2: {
+    uint16_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+  }
+  default:
+    return (unsigned char)*p;
+  }
+}
+
+void set_word(char* p, size_t width, uint64_t v) {
+  switch (width) {
+  case 8:
+    std::memcpy(p, &v, sizeof(v));
+    break;
+  case 4: {
+    uint32_t w = v;
+    std::memcpy(p, &w, sizeof(w));
+    break;
+  }
+  case 2: {
+    uint16_t w = v;
+    std::memcpy(p, &w, sizeof(w));
+    break;
+  }
+  default:
+    *p = (char)v;
+  }
+}
+
+void put_varint(std::vector<uint8_t>& out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back((v & 0x7f) | 0x80);
+    v >>= 7;
+  }
+  out.push_back(v);
+}
+
+bool get_varint(const uint8_t*& p, const uint8_t* end, uint64_t& v) {
+  v = 0;
+  for (unsigned shift = 0; shift < 64 && p < end; shift += 7) {
+    uint8_t b = *p++;
+    v |= uint64_t(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return true;
+  }
+  return false;
+}
+
+// Counters mostly grow by small amounts, but a reset or a gauge going down
+// gives a delta that is small only when read as signed
+uint64_t zigzag(uint64_t delta, size_t width) {
+  unsigned shift = 64 - width * 8;
+  int64_t v = (int64_t)(delta << shift) >> shift;
+  return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+uint64_t unzigzag(uint64_t v) { return (v >> 1) ^ -(v & 1); }
+
+}  // namespace
+
+StatusTuple BPFFdStreamTransport::send(const uint8_t* data, size_t size) {
+  if (size > UINT32_MAX)
+    return StatusTuple(-1, "Frame of %zu bytes is too large", size);
+  uint8_t hdr[4] = {uint8_t(size), uint8_t(size >> 8), uint8_t(size >> 16),
+                    uint8_t(size >> 24)};
+  struct {
+    const uint8_t* p;
+    size_t len;
+  } parts[2] = {{hdr, sizeof(hdr)}, {data, size}};
+
+  for (auto& part : parts) {
+    while (part.len) {
+      ssize_t n = write(fd_, part.p, part.len);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return StatusTuple(-1, "Failed to write frame: %s",
+                           n < 0 ? std::strerror(errno) : "short write");
+      part.p += n;
+      part.len -= n;
+    }
+  }
+  return StatusTuple::OK();
+}
+
+BPFTableStreamer::BPFTableStreamer(
+    std::unique_ptr<BPFStreamTransport> transport, unsigned keyframe_interval)
+    : transport_(std::move(transport)),
+      keyframe_interval_(keyframe_interval) {}
+
+StatusTuple BPFTableStreamer::add_table(const TableDesc& desc) {
+  if (seq_)
+    return StatusTuple(-1, "Cannot add table %s to a started stream",
+                       desc.name.c_str());
+  Table table;
+  table.desc = &desc;
+  try {
+    table.snap.reset(new BPFTableSnapshot(desc));
+  } catch (std::exception& e) {
+    return StatusTuple(-1, "%s", e.what());
+  }
+  tables_.push_back(std::move(table));
+  return StatusTuple::OK();
+}
+
+uint32_t BPFTableStreamer::assign_id(Table& table, const std::string& key) {
+  uint32_t id;
+  if (!table.free_ids.empty()) {
+    id = table.free_ids.back();
+    table.free_ids.pop_back();
+  } else {
+    id = table.next_id++;
+  }
+  table.key_ids[key] = id;
+  return id;
+}
+
+void BPFTableStreamer::encode_changes(uint32_t id, Table& table) {
+  size_t key_size = table.desc->key_size;
+  size_t leaf_size = table.desc->leaf_size;
+  size_t width = word_width(leaf_size);
+
+  for (const auto& c : table.snap->changes()) {
+    std::string key(static_cast<const char*>(c.key), key_size);
+    if (c.kind == BPFTableSnapshot::ADDED) {
+      frame_.push_back(REC_ADD);
+      put_varint(frame_, id);
+      put_varint(frame_, assign_id(table, key));
+      frame_.insert(frame_.end(), key.begin(), key.end());
+      auto value = static_cast<const char*>(c.value);
+      for (size_t off = 0; off < leaf_size; off += width)
+        put_varint(frame_, get_word(value + off, width));
+      continue;
+    }
+
+    auto it = table.key_ids.find(key);
+    if (it == table.key_ids.end())
+      continue;
+    if (c.kind == BPFTableSnapshot::CHANGED) {
+      frame_.push_back(REC_DELTA);
+      put_varint(frame_, id);
+      put_varint(frame_, it->second);
+      auto delta = static_cast<const char*>(c.delta);
+      for (size_t off = 0; off < leaf_size; off += width)
+        put_varint(frame_, zigzag(get_word(delta + off, width), width));
+    } else {
+      frame_.push_back(REC_REMOVE);
+      put_varint(frame_, id);
+      put_varint(frame_, it->second);
+      table.free_ids.push_back(it->second);
+      table.key_ids.erase(it);
+    }
+  }
+}
+
+StatusTuple BPFTableStreamer::push(uint64_t timestamp_ns) {
+  if (keyframe_interval_ && since_keyframe_ >= keyframe_interval_)
+    keyframe_ = true;
+  bool keyframe = keyframe_;
+
+  frame_.clear();
+  frame_.push_back(STREAM_VERSION);
+  frame_.push_back(keyframe ? FLAG_KEYFRAME : 0);
+  put_varint(frame_, ++seq_);
+  put_varint(frame_, timestamp_ns);
+
+  for (size_t i = 0; i < tables_.size(); i++) {
+    Table& table = tables_[i];
+    if (keyframe) {
+      // a fresh snapshot reports every entry as added
+      table.snap.reset(new BPFTableSnapshot(*table.desc));
+      table.key_ids.clear();
+      table.free_ids.clear();
+      table.next_id = 0;
+
+      const std::string& name = table.desc->name;
+      frame_.push_back(REC_TABLE);
+      put_varint(frame_, i);
+      put_varint(frame_, table.desc->key_size);
+      put_varint(frame_, table.desc->leaf_size);
+      put_varint(frame_, name.size());
+      frame_.insert(frame_.end(), name.begin(), name.end());
+    }
+
+    StatusTuple res = table.snap->update();
+    if (!res.ok()) {
+      // the snapshots already read are ahead of what the collector has
+      keyframe_ = true;
+      return res;
+    }
+    encode_changes(i, table);
+  }
+
+  StatusTuple res = transport_->send(frame_.data(), frame_.size());
+  if (!res.ok()) {
+    keyframe_ = true;
+    return res;
+  }
+  keyframe_ = false;
+  since_keyframe_ = keyframe ? 1 : since_keyframe_ + 1;
+  return StatusTuple::OK();
+}
+
+const BPFTableStreamDecoder::Table* BPFTableStreamDecoder::find(
+    const std::string& name) const {
+  for (const auto& it : tables_)
+    if (it.second.name == name)
+      return &it.second;
+  return nullptr;
+}
+
+StatusTuple BPFTableStreamDecoder::decode(const uint8_t* data, size_t size) {
+  if (size < 2)
+    return StatusTuple(-1, "Truncated frame header");
+  const uint8_t* p = data + 2;
+  const uint8_t* end = data + size;
+  uint64_t seq, timestamp_ns;
+  if (!get_varint(p, end, seq) || !get_varint(p, end, timestamp_ns))
+    return StatusTuple(-1, "Truncated frame header");
+  if (data[0] != STREAM_VERSION)
+    return StatusTuple(-1, "Unsupported stream version %d", data[0]);
+
+  bool keyframe = data[1] & FLAG_KEYFRAME;
+  if (!keyframe && (!synced_ || seq != seq_ + 1)) {
+    synced_ = false;
+    return StatusTuple(-1, "Frame %llu out of sequence, waiting for a keyframe",
+                       (unsigned long long)seq);
+  }
+  if (keyframe) {
+    tables_.clear();
+    keys_.clear();
+  }
+
+  StatusTuple res = decode_records(p, end);
+  if (!res.ok()) {
+    synced_ = false;
+    return res;
+  }
+  synced_ = true;
+  seq_ = seq;
+  timestamp_ns_ = timestamp_ns;
+  return StatusTuple::OK();
+}
+
+StatusTuple BPFTableStreamDecoder::decode_records(const uint8_t* p,
+                                                  const uint8_t* end) {
+  while (p < end) {
+    uint8_t tag = *p++;
+    uint64_t table_id, key_id;
+    if (!get_varint(p, end, table_id))
+      return StatusTuple(-1, "Truncated record");
+
+    if (tag == REC_TABLE) {
+      uint64_t key_size, leaf_size, name_len;
+      if (!get_varint(p, end, key_size) || !get_varint(p, end, leaf_size) ||
+          !get_varint(p, end, name_len) || name_len > size_t(end - p))
+        return StatusTuple(-1, "Truncated table record");
+      Table& table = tables_[table_id];
+      table.name.assign(reinterpret_cast<const char*>(p), name_len);
+      table.key_size = key_size;
+      table.leaf_size = leaf_size;
+      table.entries.clear();
+      keys_[table_id].clear();
+      p += name_len;
+      continue;
+    }
+
+    auto it = tables_.find(table_id);
+    if (it == tables_.end())
+      return StatusTuple(-1, "Record for unknown table %llu",
+                         (unsigned long long)table_id);
+    Table& table = it->second;
+    auto& keys = keys_[table_id];
+    size_t width = word_width(table.leaf_size);
+    if (!get_varint(p, end, key_id))
+      return StatusTuple(-1, "Truncated record");
+
+    if (tag == REC_ADD) {
+      if (table.key_size > size_t(end - p))
+        return StatusTuple(-1, "Truncated key");
+      std::string key(reinterpret_cast<const char*>(p), table.key_size);
+      p += table.key_size;
+      std::string value(table.leaf_size, '\0');
+      for (size_t off = 0; off < table.leaf_size; off += width) {
+        uint64_t word;
+        if (!get_varint(p, end, word))
+          return StatusTuple(-1, "Truncated value");
+        set_word(&value[off], width, word);
+      }
+      keys[key_id] = key;
+      table.entries[key] = std::move(value);
+      continue;
+    }
+
+    auto key = keys.find(key_id);
+    if (key == keys.end())
+      return StatusTuple(-1, "Unknown key %llu in table %s",
+                         (unsigned long long)key_id, table.name.c_str());
+    if (tag == REC_DELTA) {
+      std::string& value = table.entries[key->second];
+      for (size_t off = 0; off < table.leaf_size; off += width) {
+        uint64_t delta;
+        if (!get_varint(p, end, delta))
+          return StatusTuple(-1, "Truncated delta");
+        set_word(&value[off], width,
+                 get_word(&value[off], width) + unzigzag(delta));
+      }
+    } else if (tag == REC_REMOVE) {
+      table.entries.erase(key->second);
+      keys.erase(key);
+    } else {
+      return StatusTuple(-1, "Unknown record type %d", tag);
+    }
+  }
+  return StatusTuple::OK();
+}
+
+}  // namespace ebpf
@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "BPFTable.h"
+#include "bcc_exception.h"
+
+namespace ebpf {
+
+// Exports the contents of hash and array tables as a stream of frames, each
+// holding only what changed since the previous frame.
+//
+// A frame is a header followed by records, all integers being LEB128
+// varints:
+//
+//   frame  := version(u8 = 1) flags(u8, 1 = keyframe) seq timestamp_ns
+//             record*
+//   TABLE  := 1 table_id key_size leaf_size name_len name
+//   ADD    := 2 table_id key_id key[key_size] word*
+//   DELTA  := 3 table_id key_id zigzag(word delta)*
+//   REMOVE := 4 table_id key_id
+//
+// Values are split into counter words as BPFTableSnapshot does: 8, 4, 2 or 1
+// bytes wide depending on the leaf size alignment. ADD carries the words of
+// the value and defines key_id for the key, DELTA carries the wrapping
+// difference of each word with the previous value, and REMOVE releases the
+// key_id, which a later ADD may reuse. Keyframes start with a TABLE record
+// for every table, after which the collector drops what it knew of it, and
+// then add every entry again, so a collector can join or resync at any
+// keyframe.
+class BPFStreamTransport {
+ public:
+  virtual ~BPFStreamTransport() = default;
+
+  // Deliver one frame. A failure makes the next frame a keyframe.
+  virtual StatusTuple send(const uint8_t* data, size_t size) = 0;
+};
+
+// Writes each frame to a file descriptor, socket or pipe, preceded by its
+// size as a little endian u32. The descriptor is not closed.
+class BPFFdStreamTransport : public BPFStreamTransport {
+ public:
+  explicit BPFFdStreamTransport(int fd) : fd_(fd) {}
+
+  StatusTuple send(const uint8_t* data, size_t size) override;
+
+ private:
+  int fd_;
+};
+
+class BPFCallbackStreamTransport : public BPFStreamTransport {
+ public:
+  typedef std::function<StatusTuple(const uint8_t*, size_t)> Callback;
+
+  explicit BPFCallbackStreamTransport(Callback cb) : cb_(std::move(cb)) {}
+
+  StatusTuple send(const uint8_t* data, size_t size) override {
+    return cb_(data, size);
+  }
+
+ private:
+  Callback cb_;
+};
+
+class BPFTableStreamer {
+ public:
+  // A keyframe is sent on the first push() and then every keyframe_interval
+  // pushes, 0 meaning only after transport failures.
+  explicit BPFTableStreamer(std::unique_ptr<BPFStreamTransport> transport,
+                            unsigned keyframe_interval = 60);
+  BPFTableStreamer(const BPFTableStreamer&) = delete;
+
+  // Tables are streamed in the order they are added, and must not be added
+  // once push() has been called. See also BPF::add_stream_table().
+  StatusTuple add_table(const TableDesc& desc);
+
+  // Read every table and send the changes since the previous push() as one
+  // frame.
+  StatusTuple push(uint64_t timestamp_ns);
+
+  // Make the next frame a keyframe, e.g. when a collector reconnects.
+  void request_keyframe() { keyframe_ = true; }
+
+  uint64_t seq() const { return seq_; }
+  size_t last_frame_size() const { return frame_.size(); }
+
+ private:
+  struct Table {
+    const TableDesc* desc;
+    std::unique_ptr<BPFTableSnapshot> snap;
+    std::unordered_map<std::string, uint32_t> key_ids;
+    std::vector<uint32_t> free_ids;
+    uint32_t next_id = 0;
+  };
+
+  uint32_t assign_id(Table& table, const std::string& key);
+  void encode_changes(uint32_t id, Table& table);
+
+  std::unique_ptr<BPFStreamTransport> transport_;
+  unsigned keyframe_interval_;
+  std::vector<Table> tables_;
+  std::vector<uint8_t> frame_;
+  uint64_t seq_ = 0;
+  unsigned since_keyframe_ = 0;
+  bool keyframe_ = true;
+};
+
+// Rebuilds the tables on the collector side from the frames of a
+// BPFTableStreamer.
+class BPFTableStreamDecoder {
+ public:
+  struct Table {
+    std::string name;
+    size_t key_size = 0;
+    size_t leaf_size = 0;
+    // key bytes to value bytes
+    std::map<std::string, std::string> entries;
+  };
+
+  // Apply one frame, without the size prefix of BPFFdStreamTransport.
+  // After a gap in the sequence, or before the first keyframe, frames are
+  // skipped until the next keyframe and an error is returned.
+  StatusTuple decode(const uint8_t* data, size_t size);
+
+  bool synced() const { return synced_; }
+  uint64_t seq() const { return seq_; }
+  uint64_t timestamp_ns() const { return timestamp_ns_; }
+  const std::map<uint32_t, Table>& tables() const { return tables_; }
+  const Table* find(const std::string& name) const;
+
+ private:
+  StatusTuple decode_records(const uint8_t* p, const uint8_t* end);
+
+  std::map<uint32_t, Table> tables_;
+  // key_id to key bytes, per table
+  std::map<uint32_t, std::unordered_map<uint32_t, std::string>> keys_;
+  bool synced_ = false;
+  uint64_t seq_ = 0;
+  uint64_t timestamp_ns_ = 0;
+};
+
+}  // namespace ebpf
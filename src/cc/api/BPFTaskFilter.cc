@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstring>
+#include <set>
+#include <stdexcept>
+
+#include "BPFTaskFilter.h"
+
+namespace ebpf {
+
+namespace {
+
+// Same as bcc.filters.task_filter_text()
+const char* TASK_FILTER_PROGRAM = R"(
+BPF_TASK_FILTER(task_filter, MAX_ENTRIES);
+
+static inline int task_should_be_filtered() {
+  int zero = 0;
+  u32 *conf = task_filter_conf.lookup(&zero);
+  if (!conf || !*conf)
+    return 0;
+
+  u32 flags = *conf;
+  u64 id = bpf_get_current_pid_tgid();
+  if (flags & BPF_TASK_FILTER_PID) {
+    u32 pid = id >> 32;
+    if (!task_filter_pids.lookup(&pid))
+      return 1;
+  }
+  if (flags & BPF_TASK_FILTER_TID) {
+    u32 tid = id;
+    if (!task_filter_tids.lookup(&tid))
+      return 1;
+  }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 18, 0)
+  if (flags & BPF_TASK_FILTER_CGROUP) {
+    u64 cgroupid = bpf_get_current_cgroup_id();
+    if (!task_filter_cgroups.lookup(&cgroupid))
+      return 1;
+  }
+#endif
+  if (flags & BPF_TASK_FILTER_COMM) {
+    struct bpf_task_filter_comm comm = {};
+    bpf_get_current_comm(&comm.comm, sizeof(comm.comm));
+    if (!task_filter_comms.lookup(&comm))
+      return 1;
+  }
+  return 0;
+}
+)";
+
+// Same values as in helpers.h
+const uint32_t TASK_FILTER_PID = 1 << 0;
+const uint32_t TASK_FILTER_TID = 1 << 1;
+const uint32_t TASK_FILTER_CGROUP = 1 << 2;
+const uint32_t TASK_FILTER_COMM = 1 << 3;
+
+struct task_filter_comm {
+  char comm[16];
+};
+
+template <class KeyType>
+std::string raw_key(const KeyType& key) {
+  return std::string(reinterpret_cast<const char*>(&key), sizeof(key));
+}
+
+}  // namespace
+
+std::string BPFTaskFilter::program(int max_entries) {
+  std::string text = TASK_FILTER_PROGRAM;
+  std::string pattern = "MAX_ENTRIES";
+  text.replace(text.find(pattern), pattern.size(),
+               std::to_string(max_entries));
+  return text;
+}
+
+template <class KeyType>
+StatusTuple BPFTaskFilter::set(const std::string& name, uint32_t flag,
+                               const std::vector<KeyType>& keys) {
+  try {
+    auto table = bpf_.get_hash_table<KeyType, uint8_t>(name);
+    auto old = table.get_table_offline();
+    // Add the new entries before removing the stale ones, for the set never
+    // to be empty in between
+    std::set<std::string> wanted;
+    for (const auto& key : keys) {
+      TRY2(table.update_value(key, 1));
+      wanted.insert(raw_key(key));
+    }
+    for (const auto& it : old)
+      if (!wanted.count(raw_key(it.first)))
+        TRY2(table.remove_value(it.first));
+  } catch (const std::invalid_argument& e) {
+    return StatusTuple(-1, "%s, is BPFTaskFilter::program() included?",
+                       e.what());
+  }
+
+  if (keys.empty())
+    flags_ &= ~flag;
+  else
+    flags_ |= flag;
+  return update_conf();
+}
+
+StatusTuple BPFTaskFilter::update_conf() {
+  try {
+    return bpf_.get_array_table<uint32_t>("task_filter_conf")
+        .update_value(0, flags_);
+  } catch (const std::invalid_argument& e) {
+    return StatusTuple(-1, "%s, is BPFTaskFilter::program() included?",
+                       e.what());
+  }
+}
+
+StatusTuple BPFTaskFilter::set_pids(const std::vector<pid_t>& pids) {
+  std::vector<uint32_t> keys(pids.begin(), pids.end());
+  return set("task_filter_pids", TASK_FILTER_PID, keys);
+}
+
+StatusTuple BPFTaskFilter::set_tids(const std::vector<pid_t>& tids) {
+  std::vector<uint32_t> keys(tids.begin(), tids.end());
+  return set("task_filter_tids", TASK_FILTER_TID, keys);
+}
+
+StatusTuple BPFTaskFilter::set_cgroups(const std::vector<uint64_t>& ids) {
+  return set("task_filter_cgroups", TASK_FILTER_CGROUP, ids);
+}
+
+StatusTuple BPFTaskFilter::set_cgroups(const std::vector<std::string>& paths) {
+  std::vector<uint64_t> ids;
+  for (const auto& path : paths) {
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0)
+      return StatusTuple(-1, "Unable to stat cgroup %s: %s", path.c_str(),
+                         std::strerror(errno));
+    ids.push_back(st.st_ino);
+  }
+  return set_cgroups(ids);
+}
+
+StatusTuple BPFTaskFilter::set_comms(const std::vector<std::string>& comms) {
+  std::vector<task_filter_comm> keys;
+  for (const auto& comm : comms) {
+    task_filter_comm key = {};
+    std::strncpy(key.comm, comm.c_str(), sizeof(key.comm) - 1);
+    keys.push_back(key);
+  }
+  return set("task_filter_comms", TASK_FILTER_COMM, keys);
+}
+
+StatusTuple BPFTaskFilter::clear() {
+  TRY2(set_pids({}));
+  TRY2(set_tids({}));
+  TRY2(set_cgroups(std::vector<uint64_t>()));
+  TRY2(set_comms({}));
+  return StatusTuple::OK();
+}
+
+}  // namespace ebpf
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "BPF.h"
+#include "bcc_exception.h"
+
+namespace ebpf {
+
+// Sets of processes, threads, cgroups and command names to trace, kept in
+// the BPF_TASK_FILTER maps of a program and changed at runtime, without
+// recompiling it. The program includes program() and calls
+// task_should_be_filtered(), which costs one map lookup per set in use:
+//
+//   ebpf::BPF bpf;
+//   bpf.init(ebpf::BPFTaskFilter::program() + BPF_PROGRAM);
+//   ebpf::BPFTaskFilter filter(bpf);
+//   filter.set_pids({1234, 5678});
+//
+// Nothing is filtered until a set is given. Each set_*() replaces a set,
+// an empty one removing it.
+class BPFTaskFilter {
+ public:
+  static std::string program(int max_entries = 1024);
+
+  explicit BPFTaskFilter(BPF& bpf) : bpf_(bpf) {}
+
+  StatusTuple set_pids(const std::vector<pid_t>& pids);
+  StatusTuple set_tids(const std::vector<pid_t>& tids);
+  // cgroup v2 ids, the inode numbers of the cgroup directories
+  StatusTuple set_cgroups(const std::vector<uint64_t>& ids);
+  StatusTuple set_cgroups(const std::vector<std::string>& paths);
+  StatusTuple set_comms(const std::vector<std::string>& comms);
+  StatusTuple clear();
+
+ private:
+  template <class KeyType>
+  StatusTuple set(const std::string& name, uint32_t flag,
+                  const std::vector<KeyType>& keys);
+  StatusTuple update_conf();
+
+  BPF& bpf_;
+  uint32_t flags_ = 0;
+};
+
+}  // namespace ebpf
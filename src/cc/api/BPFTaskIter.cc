@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+#include "BPFTaskIter.h"
+#include "libbpf.h"
+
+namespace ebpf {
+
+namespace {
+
+const char* TASK_ITER_PROGRAM = R"(
+#include <linux/bpf.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+
+/* the structures are defined in .c files, so explicitly define
+ * them here.
+ */
+struct bpf_iter__task {
+  union {
+    struct bpf_iter_meta *meta;
+  };
+  union {
+    struct task_struct *task;
+  };
+};
+
+struct bpf_iter__task_vma {
+  union {
+    struct bpf_iter_meta *meta;
+  };
+  union {
+    struct task_struct *task;
+  };
+  union {
+    struct vm_area_struct *vma;
+  };
+};
+
+struct iter_conf_t {
+  u32 pid;
+  u32 threads;
+  u32 exec_only;
+};
+BPF_ARRAY(iter_conf, struct iter_conf_t, 1);
+
+/* struct BPFTaskInfo of BPFTaskIter.h */
+struct task_info_t {
+  u32 pid;
+  u32 tid;
+  u32 ppid;
+  u32 uid;
+  u64 start_time_ns;
+  char comm[TASK_COMM_LEN];
+};
+
+/* struct BPFVmaInfo of BPFTaskIter.h */
+struct vma_info_t {
+  u32 pid;
+  u32 pad;
+  u64 start;
+  u64 end;
+  u64 offset;
+  u64 flags;
+  u64 dev;
+  u64 inode;
+  char name[64];
+};
+
+BPF_ITER(task) {
+  struct seq_file *seq = ctx->meta->seq;
+  struct task_struct *task = ctx->task;
+  struct task_info_t info = {};
+  int zero = 0;
+
+  if (task == (void *)0)
+    return 0;
+  struct iter_conf_t *conf = iter_conf.lookup(&zero);
+  if (conf == (void *)0)
+    return 0;
+  if (conf->pid && task->tgid != conf->pid)
+    return 0;
+  if (!conf->threads && task->pid != task->tgid)
+    return 0;
+
+  info.pid = task->tgid;
+  info.tid = task->pid;
+  info.ppid = task->real_parent->tgid;
+  info.uid = task->cred->uid.val;
+  info.start_time_ns = task->start_time;
+  __builtin_memcpy(&info.comm, task->comm, sizeof(info.comm));
+  bpf_seq_write(seq, &info, sizeof(info));
+
+  return 0;
+}
+
+BPF_ITER(task_vma) {
+  struct seq_file *seq = ctx->meta->seq;
+  struct task_struct *task = ctx->task;
+  struct vm_area_struct *vma = ctx->vma;
+  struct vma_info_t info = {};
+  int zero = 0;
+
+  if (task == (void *)0 || vma == (void *)0)
+    return 0;
+  struct iter_conf_t *conf = iter_conf.lookup(&zero);
+  if (conf == (void *)0)
+    return 0;
+  if (conf->pid && task->tgid != conf->pid)
+    return 0;
+  if (conf->exec_only && !(vma->vm_flags & VM_EXEC))
+    return 0;
+
+  info.pid = task->tgid;
+  info.start = vma->vm_start;
+  info.end = vma->vm_end;
+  info.offset = vma->vm_pgoff << PAGE_SHIFT;
+  info.flags = vma->vm_flags;
+  struct file *file = vma->vm_file;
+  if (file) {
+    info.dev = file->f_inode->i_sb->s_dev;
+    info.inode = file->f_inode->i_ino;
+    bpf_probe_read_kernel_str(info.name, sizeof(info.name),
+                              file->f_path.dentry->d_name.name);
+  }
+  bpf_seq_write(seq, &info, sizeof(info));
+
+  return 0;
+}
+)";
+
+struct iter_conf_t {
+  uint32_t pid;
+  uint32_t threads;
+  uint32_t exec_only;
+};
+
+struct task_info_t {
+  uint32_t pid;
+  uint32_t tid;
+  uint32_t ppid;
+  uint32_t uid;
+  uint64_t start_time_ns;
+  char comm[16];
+};
+
+struct vma_info_t {
+  uint32_t pid;
+  uint32_t pad;
+  uint64_t start;
+  uint64_t end;
+  uint64_t offset;
+  uint64_t flags;
+  uint64_t dev;
+  uint64_t inode;
+  char name[64];
+};
+
+}  // namespace
+
+BPFTaskIter::~BPFTaskIter() {
+  if (task_link_fd_ >= 0)
+    close(task_link_fd_);
+  if (vma_link_fd_ >= 0)
+    close(vma_link_fd_);
+}
+
+StatusTuple BPFTaskIter::init() {
+  if (initialized_)
+    return StatusTuple::OK();
+  TRY2(bpf_.init(TASK_ITER_PROGRAM));
+  initialized_ = true;
+  return StatusTuple::OK();
+}
+
+StatusTuple BPFTaskIter::configure(pid_t pid, bool threads, bool exec_only) {
+  if (!initialized_)
+    return StatusTuple(-1, "BPFTaskIter is not initialized");
+  iter_conf_t conf = {static_cast<uint32_t>(pid), threads, exec_only};
+  return bpf_.get_array_table<iter_conf_t>("iter_conf").update_value(0, conf);
+}
+
+StatusTuple BPFTaskIter::attach(const std::string& func, int& link_fd) {
+  if (link_fd >= 0)
+    return StatusTuple::OK();
+  int prog_fd;
+  TRY2(bpf_.load_func(func, BPF_PROG_TYPE_TRACING, prog_fd));
+  link_fd = bcc_iter_attach(prog_fd, nullptr, 0);
+  if (link_fd < 0)
+    return StatusTuple(-1, "Unable to attach iterator %s: %s", func.c_str(),
+                       std::strerror(errno));
+  return StatusTuple::OK();
+}
+
+StatusTuple BPFTaskIter::read_records(int link_fd, size_t record_size,
+                                      std::vector<char>& out) {
+  int iter_fd = bcc_iter_create(link_fd);
+  if (iter_fd < 0)
+    return StatusTuple(-1, "Unable to create iterator: %s",
+                       std::strerror(errno));
+
+  // The kernel hands out whole records, at most a page worth per read
+  out.clear();
+  size_t used = 0;
+  while (true) {
+    out.resize(used + 64 * 1024);
+    ssize_t len = read(iter_fd, out.data() + used, out.size() - used);
+    if (len == 0)
+      break;
+    if (len < 0) {
+      if (errno == EAGAIN)
+        continue;
+      int err = errno;
+      close(iter_fd);
+      return StatusTuple(-1, "Error reading iterator: %s", std::strerror(err));
+    }
+    used += len;
+  }
+  close(iter_fd);
+  out.resize(used - used % record_size);
+  return StatusTuple::OK();
+}
+
+StatusTuple BPFTaskIter::tasks(std::vector<BPFTaskInfo>& out, bool threads,
+                               pid_t pid) {
+  TRY2(configure(pid, threads, false));
+  TRY2(attach("bpf_iter__task", task_link_fd_));
+
+  std::vector<char> buf;
+  TRY2(read_records(task_link_fd_, sizeof(task_info_t), buf));
+  size_t n = buf.size() / sizeof(task_info_t);
+  out.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    task_info_t rec;
+    std::memcpy(&rec, buf.data() + i * sizeof(rec), sizeof(rec));
+    out[i].pid = rec.pid;
+    out[i].tid = rec.tid;
+    out[i].ppid = rec.ppid;
+    out[i].uid = rec.uid;
+    out[i].start_time_ns = rec.start_time_ns;
+    std::memcpy(out[i].comm, rec.comm, sizeof(out[i].comm));
+    out[i].comm[sizeof(out[i].comm) - 1] = '\0';
+  }
+  return StatusTuple::OK();
+}
+
+StatusTuple BPFTaskIter::vmas(std::vector<BPFVmaInfo>& out, pid_t pid,
+                              bool exec_only) {
+  TRY2(configure(pid, false, exec_only));
+  TRY2(attach("bpf_iter__task_vma", vma_link_fd_));
+
+  std::vector<char> buf;
+  TRY2(read_records(vma_link_fd_, sizeof(vma_info_t), buf));
+  size_t n = buf.size() / sizeof(vma_info_t);
+  out.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    vma_info_t rec;
+    std::memcpy(&rec, buf.data() + i * sizeof(rec), sizeof(rec));
+    out[i].pid = rec.pid;
+    out[i].start = rec.start;
+    out[i].end = rec.end;
+    out[i].offset = rec.offset;
+    out[i].flags = rec.flags;
+    out[i].dev = rec.dev;
+    out[i].inode = rec.inode;
+    std::memcpy(out[i].name, rec.name, sizeof(out[i].name));
+    out[i].name[sizeof(out[i].name) - 1] = '\0';
+  }
+  return StatusTuple::OK();
+}
+
+}  // namespace ebpf
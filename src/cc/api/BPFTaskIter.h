@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "BPF.h"
+#include "bcc_exception.h"
+
+namespace ebpf {
+
+struct BPFTaskInfo {
+  pid_t pid;
+  pid_t tid;
+  pid_t ppid;
+  uid_t uid;
+  // CLOCK_MONOTONIC time the task started at
+  uint64_t start_time_ns;
+  char comm[16];
+};
+
+struct BPFVmaInfo {
+  pid_t pid;
+  uint64_t start;
+  uint64_t end;
+  // Offset in the file, in bytes
+  uint64_t offset;
+  // VM_* flags, VM_EXEC being 0x4
+  uint64_t flags;
+  // Device and inode of the mapped file, 0 for anonymous mappings
+  uint64_t dev;
+  uint64_t inode;
+  // Last component of the file's path, possibly truncated
+  char name[64];
+};
+
+// Enumerate processes and their memory mappings with BPF task iterators,
+// from binary records rather than by parsing /proc/<pid>/ files: one read
+// loop lists all tasks of the system, and another all their mappings.
+//
+// Task iteration needs Linux 5.8, mapping iteration 5.12. init() compiles
+// the iterator programs, so the object is meant to be kept and reused.
+class BPFTaskIter {
+ public:
+  BPFTaskIter() = default;
+  ~BPFTaskIter();
+  BPFTaskIter(const BPFTaskIter&) = delete;
+  BPFTaskIter& operator=(const BPFTaskIter&) = delete;
+
+  StatusTuple init();
+
+  // Processes, or every thread if threads is set. pid restricts the list
+  // to the threads of one process.
+  StatusTuple tasks(std::vector<BPFTaskInfo>& out, bool threads = false,
+                    pid_t pid = 0);
+  // Mappings of all processes, or of pid only, optionally only executable
+  // ones
+  StatusTuple vmas(std::vector<BPFVmaInfo>& out, pid_t pid = 0,
+                   bool exec_only = false);
+
+ private:
+  StatusTuple configure(pid_t pid, bool threads, bool exec_only);
+  StatusTuple attach(const std::string& func, int& link_fd);
+  StatusTuple read_records(int link_fd, size_t record_size,
+                           std::vector<char>& out);
+
+  BPF bpf_;
+  bool initialized_ = false;
+  int task_link_fd_ = -1;
+  int vma_link_fd_ = -1;
+};
+
+}  // namespace ebpf
@@ -0,0 +1,423 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <net/if.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+#include "BPFXsk.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+
+namespace ebpf {
+
+namespace {
+
+bool is_pow2(uint32_t n) { return n && !(n & (n - 1)); }
+
+// The flags of the ring offsets are only reported since 5.4, which is also
+// when need_wakeup was added
+StatusTuple get_mmap_offsets(int fd, struct xdp_mmap_offsets* off) {
+  socklen_t optlen = sizeof(*off);
+  if (getsockopt(fd, SOL_XDP, XDP_MMAP_OFFSETS, off, &optlen) < 0)
+    return StatusTuple(-1, "Failed to get AF_XDP ring offsets: %s",
+                       std::strerror(errno));
+  if (optlen != sizeof(*off))
+    return StatusTuple(-1, "AF_XDP rings need kernel 5.4 or later");
+  return StatusTuple::OK();
+}
+
+StatusTuple map_ring(int fd, const struct xdp_ring_offset& off, uint32_t size,
+                     size_t entry_size, off_t pgoff, XskRing& ring) {
+  ring.map_size = off.desc + size * entry_size;
+  void* map = mmap(nullptr, ring.map_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, pgoff);
+  if (map == MAP_FAILED) {
+    ring.map_size = 0;
+    return StatusTuple(-1, "Failed to map AF_XDP ring: %s",
+                       std::strerror(errno));
+  }
+  char* base = static_cast<char*>(map);
+  ring.map = map;
+  ring.size = size;
+  ring.mask = size - 1;
+  ring.producer = reinterpret_cast<uint32_t*>(base + off.producer);
+  ring.consumer = reinterpret_cast<uint32_t*>(base + off.consumer);
+  ring.flags = reinterpret_cast<uint32_t*>(base + off.flags);
+  ring.ring = base + off.desc;
+  return StatusTuple::OK();
+}
+
+void map_prod_ring(XskRing& ring) {
+  ring.cached_prod = *ring.producer;
+  ring.cached_cons = *ring.consumer + ring.size;
+}
+
+void map_cons_ring(XskRing& ring) {
+  ring.cached_prod = *ring.producer;
+  ring.cached_cons = *ring.consumer;
+}
+
+void unmap_ring(XskRing& ring) {
+  if (ring.map)
+    munmap(ring.map, ring.map_size);
+  ring = XskRing();
+}
+
+StatusTuple set_ring_size(int fd, int opt, uint32_t size, const char* name) {
+  if (!is_pow2(size))
+    return StatusTuple(-1, "AF_XDP %s ring size %u is not a power of 2", name,
+                       size);
+  if (setsockopt(fd, SOL_XDP, opt, &size, sizeof(size)) < 0)
+    return StatusTuple(-1, "Failed to set AF_XDP %s ring size: %s", name,
+                       std::strerror(errno));
+  return StatusTuple::OK();
+}
+
+}  // namespace
+
+uint32_t XskRing::prod_reserve(uint32_t n, uint32_t* idx) {
+  uint32_t free = cached_cons - cached_prod;
+  if (free < n) {
+    cached_cons = __atomic_load_n(consumer, __ATOMIC_ACQUIRE) + size;
+    free = cached_cons - cached_prod;
+  }
+  if (n > free)
+    n = free;
+  *idx = cached_prod;
+  cached_prod += n;
+  return n;
+}
+
+void XskRing::prod_submit(uint32_t n) {
+  __atomic_store_n(producer, *producer + n, __ATOMIC_RELEASE);
+}
+
+uint32_t XskRing::cons_peek(uint32_t n, uint32_t* idx) {
+  uint32_t entries = cached_prod - cached_cons;
+  if (entries < n) {
+    cached_prod = __atomic_load_n(producer, __ATOMIC_ACQUIRE);
+    entries = cached_prod - cached_cons;
+  }
+  if (n > entries)
+    n = entries;
+  *idx = cached_cons;
+  cached_cons += n;
+  return n;
+}
+
+void XskRing::cons_release(uint32_t n) {
+  __atomic_store_n(consumer, *consumer + n, __ATOMIC_RELEASE);
+}
+
+bool XskRing::needs_wakeup() const {
+  return flags && (__atomic_load_n(flags, __ATOMIC_RELAXED) &
+                   XDP_RING_NEED_WAKEUP);
+}
+
+XskUmem::XskUmem()
+    : area_(nullptr),
+      area_size_(0),
+      frame_size_(0),
+      frame_count_(0),
+      fd_(-1),
+      fd_bound_(false) {}
+
+XskUmem::~XskUmem() {
+  unmap_ring(fill_);
+  unmap_ring(comp_);
+  if (fd_ >= 0)
+    close(fd_);
+  if (area_)
+    munmap(area_, area_size_);
+}
+
+StatusTuple XskUmem::init(uint32_t frame_count, uint32_t frame_size,
+                          uint32_t headroom, uint32_t fill_size,
+                          uint32_t comp_size) {
+  if (fd_ >= 0)
+    return StatusTuple(-1, "UMEM already initialized");
+  long page_size = sysconf(_SC_PAGESIZE);
+  if (!is_pow2(frame_size) || frame_size < 2048 || frame_size > page_size)
+    return StatusTuple(-1, "Invalid AF_XDP frame size %u", frame_size);
+  if (frame_count == 0)
+    return StatusTuple(-1, "AF_XDP UMEM needs at least one frame");
+
+  area_size_ = static_cast<size_t>(frame_count) * frame_size;
+  void* area = mmap(nullptr, area_size_, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (area == MAP_FAILED) {
+    area_size_ = 0;
+    return StatusTuple(-1, "Failed to allocate AF_XDP UMEM: %s",
+                       std::strerror(errno));
+  }
+  area_ = area;
+  frame_size_ = frame_size;
+  frame_count_ = frame_count;
+
+  fd_ = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+  if (fd_ < 0)
+    return StatusTuple(-1, "Failed to create AF_XDP socket: %s",
+                       std::strerror(errno));
+
+  struct xdp_umem_reg reg = {};
+  reg.addr = reinterpret_cast<uint64_t>(area_);
+  reg.len = area_size_;
+  reg.chunk_size = frame_size;
+  reg.headroom = headroom;
+  if (setsockopt(fd_, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0)
+    return StatusTuple(-1, "Failed to register AF_XDP UMEM: %s",
+                       std::strerror(errno));
+
+  TRY2(set_ring_size(fd_, XDP_UMEM_FILL_RING, fill_size, "fill"));
+  TRY2(set_ring_size(fd_, XDP_UMEM_COMPLETION_RING, comp_size, "completion"));
+
+  struct xdp_mmap_offsets off;
+  TRY2(get_mmap_offsets(fd_, &off));
+  TRY2(map_ring(fd_, off.fr, fill_size, sizeof(uint64_t),
+                XDP_UMEM_PGOFF_FILL_RING, fill_));
+  TRY2(map_ring(fd_, off.cr, comp_size, sizeof(uint64_t),
+                XDP_UMEM_PGOFF_COMPLETION_RING, comp_));
+  map_prod_ring(fill_);
+  map_cons_ring(comp_);
+
+  // Hand out the low addresses first
+  free_frames_.reserve(frame_count);
+  for (uint32_t i = frame_count; i > 0; i--)
+    free_frames_.push_back(static_cast<uint64_t>(i - 1) * frame_size);
+  return StatusTuple::OK();
+}
+
+size_t XskUmem::alloc_frames(uint64_t* addrs, size_t n) {
+  if (n > free_frames_.size())
+    n = free_frames_.size();
+  for (size_t i = 0; i < n; i++) {
+    addrs[i] = free_frames_.back();
+    free_frames_.pop_back();
+  }
+  return n;
+}
+
+void XskUmem::release(const uint64_t* addrs, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    free_frames_.push_back(addrs[i] & ~static_cast<uint64_t>(frame_size_ - 1));
+}
+
+void XskUmem::release(const struct xdp_desc* descs, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    free_frames_.push_back(descs[i].addr &
+                           ~static_cast<uint64_t>(frame_size_ - 1));
+}
+
+size_t XskUmem::fill(size_t n) {
+  if (n > free_frames_.size())
+    n = free_frames_.size();
+  uint32_t idx;
+  uint32_t count = fill_.prod_reserve(n, &idx);
+  for (uint32_t i = 0; i < count; i++) {
+    *fill_.addr(idx + i) = free_frames_.back();
+    free_frames_.pop_back();
+  }
+  if (count)
+    fill_.prod_submit(count);
+  return count;
+}
+
+size_t XskUmem::complete(size_t n) {
+  uint32_t idx;
+  uint32_t count = comp_.cons_peek(n, &idx);
+  for (uint32_t i = 0; i < count; i++)
+    free_frames_.push_back(*comp_.addr(idx + i) &
+                           ~static_cast<uint64_t>(frame_size_ - 1));
+  if (count)
+    comp_.cons_release(count);
+  return count;
+}
+
+XskSocket::XskSocket()
+    : umem_(nullptr),
+      fd_(-1),
+      owns_fd_(false),
+      need_wakeup_(false),
+      busy_poll_(false) {}
+
+XskSocket::~XskSocket() {
+  unmap_ring(rx_);
+  unmap_ring(tx_);
+  if (owns_fd_ && fd_ >= 0)
+    close(fd_);
+}
+
+StatusTuple XskSocket::open(const std::string& dev, uint32_t queue_id,
+                            XskUmem& umem) {
+  return open(dev, queue_id, umem, Options());
+}
+
+StatusTuple XskSocket::open(const std::string& dev, uint32_t queue_id,
+                            XskUmem& umem, const Options& opts) {
+  if (fd_ >= 0)
+    return StatusTuple(-1, "AF_XDP socket already open");
+  if (umem.fd_ < 0)
+    return StatusTuple(-1, "AF_XDP UMEM is not initialized");
+  if (opts.zero_copy && opts.copy)
+    return StatusTuple(-1, "AF_XDP socket can't be both zero-copy and copy");
+  if (!opts.rx_size && !opts.tx_size)
+    return StatusTuple(-1, "AF_XDP socket needs an rx or a tx ring");
+
+  unsigned int ifindex = if_nametoindex(dev.c_str());
+  if (ifindex == 0)
+    return StatusTuple(-1, "Unable to find device %s: %s", dev.c_str(),
+                       std::strerror(errno));
+
+  // The first socket is the one the UMEM was registered on
+  bool shared = umem.fd_bound_;
+  if (shared) {
+    fd_ = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (fd_ < 0)
+      return StatusTuple(-1, "Failed to create AF_XDP socket: %s",
+                         std::strerror(errno));
+    owns_fd_ = true;
+  } else {
+    fd_ = umem.fd_;
+    owns_fd_ = false;
+  }
+  umem_ = &umem;
+
+  if (opts.rx_size)
+    TRY2(set_ring_size(fd_, XDP_RX_RING, opts.rx_size, "rx"));
+  if (opts.tx_size)
+    TRY2(set_ring_size(fd_, XDP_TX_RING, opts.tx_size, "tx"));
+
+  struct xdp_mmap_offsets off;
+  TRY2(get_mmap_offsets(fd_, &off));
+  if (opts.rx_size) {
+    TRY2(map_ring(fd_, off.rx, opts.rx_size, sizeof(struct xdp_desc),
+                  XDP_PGOFF_RX_RING, rx_));
+    map_cons_ring(rx_);
+  }
+  if (opts.tx_size) {
+    TRY2(map_ring(fd_, off.tx, opts.tx_size, sizeof(struct xdp_desc),
+                  XDP_PGOFF_TX_RING, tx_));
+    map_prod_ring(tx_);
+  }
+
+  struct sockaddr_xdp sxdp = {};
+  sxdp.sxdp_family = AF_XDP;
+  sxdp.sxdp_ifindex = ifindex;
+  sxdp.sxdp_queue_id = queue_id;
+  if (shared) {
+    sxdp.sxdp_flags = XDP_SHARED_UMEM;
+    sxdp.sxdp_shared_umem_fd = umem.fd_;
+  } else {
+    if (opts.zero_copy)
+      sxdp.sxdp_flags |= XDP_ZEROCOPY;
+    if (opts.copy)
+      sxdp.sxdp_flags |= XDP_COPY;
+    if (opts.need_wakeup)
+      sxdp.sxdp_flags |= XDP_USE_NEED_WAKEUP;
+  }
+  if (bind(fd_, reinterpret_cast<struct sockaddr*>(&sxdp), sizeof(sxdp)) < 0)
+    return StatusTuple(-1, "Failed to bind AF_XDP socket to %s queue %u: %s",
+                       dev.c_str(), queue_id, std::strerror(errno));
+  umem.fd_bound_ = true;
+  need_wakeup_ = opts.need_wakeup;
+
+  if (opts.busy_poll_usec > 0) {
+    int one = 1;
+    if (setsockopt(fd_, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one,
+                   sizeof(one)) < 0 ||
+        setsockopt(fd_, SOL_SOCKET, SO_BUSY_POLL, &opts.busy_poll_usec,
+                   sizeof(opts.busy_poll_usec)) < 0 ||
+        (opts.busy_poll_budget > 0 &&
+         setsockopt(fd_, SOL_SOCKET, SO_BUSY_POLL_BUDGET,
+                    &opts.busy_poll_budget,
+                    sizeof(opts.busy_poll_budget)) < 0))
+      return StatusTuple(-1, "Failed to enable busy polling: %s",
+                         std::strerror(errno));
+    busy_poll_ = true;
+  }
+  return StatusTuple::OK();
+}
+
+size_t XskSocket::receive(struct xdp_desc* descs, size_t n) {
+  if (!rx_.ring)
+    return 0;
+  uint32_t idx;
+  uint32_t count = rx_.cons_peek(n, &idx);
+  for (uint32_t i = 0; i < count; i++)
+    descs[i] = *rx_.desc(idx + i);
+  if (count)
+    rx_.cons_release(count);
+  return count;
+}
+
+size_t XskSocket::transmit(const struct xdp_desc* descs, size_t n) {
+  if (!tx_.ring)
+    return 0;
+  uint32_t idx;
+  uint32_t count = tx_.prod_reserve(n, &idx);
+  for (uint32_t i = 0; i < count; i++)
+    *tx_.desc(idx + i) = descs[i];
+  if (count) {
+    tx_.prod_submit(count);
+    if (!need_wakeup_ || tx_.needs_wakeup())
+      wakeup_tx();
+  }
+  return count;
+}
+
+void XskSocket::wakeup_tx() {
+  // Errors only mean the kernel is busy with the ring already, or the
+  // device is down; the packets stay queued either way
+  sendto(fd_, nullptr, 0, MSG_DONTWAIT, nullptr, 0);
+}
+
+int XskSocket::poll(int timeout_ms) {
+  if (busy_poll_) {
+    // Drives the device queue from this thread, without waiting
+    recvfrom(fd_, nullptr, 0, MSG_DONTWAIT, nullptr, nullptr);
+    return rx_.ring && __atomic_load_n(rx_.producer, __ATOMIC_ACQUIRE) !=
+                           rx_.cached_cons
+               ? 1
+               : 0;
+  }
+  if (need_wakeup_ && umem_ && umem_->fill_.needs_wakeup())
+    recvfrom(fd_, nullptr, 0, MSG_DONTWAIT, nullptr, nullptr);
+  struct pollfd pfd = {};
+  pfd.fd = fd_;
+  pfd.events = POLLIN;
+  return ::poll(&pfd, 1, timeout_ms);
+}
+
+}  // namespace ebpf
@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <linux/if_xdp.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "bcc_exception.h"
+
+namespace ebpf {
+
+// AF_XDP sockets, to receive and send the packets that XDP programs redirect
+// to a BPF_XSKMAP without copying them through the kernel network stack.
+//
+// An XskUmem is the packet memory shared with the kernel, cut into frames,
+// together with its fill ring (free frames handed to the kernel for
+// receiving) and completion ring (frames the kernel is done transmitting).
+// An XskSocket binds to one queue of a device and has the rx and tx rings of
+// descriptors pointing into its UMEM. The UMEM must outlive its sockets.
+// Several sockets may share a UMEM, and with it the fill and completion
+// rings, if they are bound to the same device and queue.
+//
+// The ring operations work on batches and never block. None of the objects
+// are thread safe: drive a UMEM and its sockets from a single thread.
+//
+// A typical receive loop, after adding the socket to the XSKMAP of the XDP
+// program with BPFXskmapTable::update_value():
+//
+//   umem.fill(umem.free_frame_count());
+//   while (sock.poll(-1) > 0) {
+//     size_t n = sock.receive(descs, 64);
+//     ... process umem.data(descs[i].addr), descs[i].len ...
+//     umem.release(descs, n);
+//     umem.fill(n);
+//   }
+
+// Producer or consumer side of one of the rings mapped from the kernel
+struct XskRing {
+  uint32_t cached_prod = 0;
+  uint32_t cached_cons = 0;
+  uint32_t mask = 0;
+  uint32_t size = 0;
+  uint32_t* producer = nullptr;
+  uint32_t* consumer = nullptr;
+  uint32_t* flags = nullptr;
+  void* ring = nullptr;
+  void* map = nullptr;
+  size_t map_size = 0;
+
+  // Reserve up to n free slots of a producer ring, starting at *idx
+  uint32_t prod_reserve(uint32_t n, uint32_t* idx);
+  void prod_submit(uint32_t n);
+  // Take up to n filled slots of a consumer ring, starting at *idx
+  uint32_t cons_peek(uint32_t n, uint32_t* idx);
+  void cons_release(uint32_t n);
+  uint64_t* addr(uint32_t idx) const {
+    return static_cast<uint64_t*>(ring) + (idx & mask);
+  }
+  struct xdp_desc* desc(uint32_t idx) const {
+    return static_cast<struct xdp_desc*>(ring) + (idx & mask);
+  }
+  bool needs_wakeup() const;
+};
+
+class XskUmem {
+ public:
+  XskUmem();
+  ~XskUmem();
+  XskUmem(const XskUmem&) = delete;
+  XskUmem& operator=(const XskUmem&) = delete;
+
+  // Allocate frame_count frames of frame_size bytes, a power of two between
+  // 2048 and the page size, and register them with the kernel. The first
+  // headroom bytes of each frame are left free in front of the packets.
+  // fill_size and comp_size are the ring sizes, powers of two.
+  StatusTuple init(uint32_t frame_count, uint32_t frame_size = 4096,
+                   uint32_t headroom = 0, uint32_t fill_size = 2048,
+                   uint32_t comp_size = 2048);
+
+  void* data(uint64_t addr) const {
+    return static_cast<char*>(area_) + addr;
+  }
+  uint32_t frame_size() const { return frame_size_; }
+  uint32_t frame_count() const { return frame_count_; }
+
+  // Frames neither in the kernel's hands nor held by the caller
+  size_t free_frame_count() const { return free_frames_.size(); }
+  // Take up to n free frames for transmitting, returns the number taken
+  size_t alloc_frames(uint64_t* addrs, size_t n);
+  // Give frames back to the free list, from receive() or alloc_frames()
+  void release(const uint64_t* addrs, size_t n);
+  void release(const struct xdp_desc* descs, size_t n);
+
+  // Move up to n free frames to the fill ring, returns the number moved
+  size_t fill(size_t n);
+  // Reap up to n transmitted frames from the completion ring back to the
+  // free list, returns the number reaped
+  size_t complete(size_t n);
+
+ private:
+  friend class XskSocket;
+
+  void* area_;
+  size_t area_size_;
+  uint32_t frame_size_;
+  uint32_t frame_count_;
+  int fd_;
+  // whether a socket was bound with fd_ already
+  bool fd_bound_;
+  XskRing fill_;
+  XskRing comp_;
+  std::vector<uint64_t> free_frames_;
+};
+
+class XskSocket {
+ public:
+  struct Options {
+    // Ring sizes, powers of two. A zero size leaves the ring out.
+    uint32_t rx_size = 2048;
+    uint32_t tx_size = 2048;
+    // Require zero-copy mode, or copy mode. Neither lets the kernel pick.
+    bool zero_copy = false;
+    bool copy = false;
+    // Only wake the kernel up when it asks for it, see poll() and
+    // transmit()
+    bool need_wakeup = true;
+    // Busy poll the device queue for that many microseconds, processing
+    // up to busy_poll_budget packets, instead of waiting for interrupts
+    // (kernel 5.11 or later)
+    int busy_poll_usec = 0;
+    int busy_poll_budget = 0;
+  };
+
+  XskSocket();
+  ~XskSocket();
+  XskSocket(const XskSocket&) = delete;
+  XskSocket& operator=(const XskSocket&) = delete;
+
+  StatusTuple open(const std::string& dev, uint32_t queue_id, XskUmem& umem);
+  StatusTuple open(const std::string& dev, uint32_t queue_id, XskUmem& umem,
+                   const Options& opts);
+  // To add to a BPF_XSKMAP
+  int fd() const { return fd_; }
+
+  // Take up to n received packets, whose frames belong to the caller until
+  // released to the UMEM or transmitted. Returns the number taken.
+  size_t receive(struct xdp_desc* descs, size_t n);
+  // Queue up to n packets for transmission and wake the kernel up if
+  // needed. Their frames come back through XskUmem::complete(). Returns
+  // the number queued.
+  size_t transmit(const struct xdp_desc* descs, size_t n);
+  // Wait up to timeout_ms for packets to receive, waking the kernel up to
+  // refill the rx ring if it asked for it. Returns the poll() result.
+  int poll(int timeout_ms);
+
+ private:
+  void wakeup_tx();
+
+  XskUmem* umem_;
+  int fd_;
+  bool owns_fd_;
+  bool need_wakeup_;
+  bool busy_poll_;
+  XskRing rx_;
+  XskRing tx_;
+};
+
+}  // namespace ebpf
@@ -15,11 +15,16 @@
  */
 
 #include "bcc_btf.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stddef.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 #include "linux/btf.h"
 #include "libbpf.h"
 #include "bcc_libbpf_inc.h"
+#include <algorithm>
 #include <vector>
 
 #define BCC_MAX_ERRNO       4095
@@ -30,10 +35,9 @@ namespace ebpf {
 
 int32_t BTFStringTable::addString(std::string S) {
   // Check whether the string already exists.
-  for (auto &OffsetM : OffsetToIdMap) {
-    if (Table[OffsetM.second] == S)
-      return OffsetM.first;
-  }
+  auto It = StrToOffset.find(S);
+  if (It != StrToOffset.end())
+    return It->second;
 
   // Make sure we do not overflow the string table.
   if (OrigTblLen + Size + S.size() + 1 >= BTF_MAX_NAME_OFFSET)
@@ -41,14 +45,15 @@ int32_t BTFStringTable::addString(std::string S) {
 
   // Not find, add to the string table.
   uint32_t Offset = Size;
-  OffsetToIdMap[Offset] = Table.size();
+  StrToOffset[S] = Offset;
   Table.push_back(S);
   Size += S.size() + 1;
   return Offset;
 }
 
 BTF::BTF(bool debug, sec_map_def &sections) : debug_(debug),
-    btf_(nullptr), btf_ext_(nullptr), sections_(sections) {
+    btf_(nullptr), btf_ext_(nullptr), sections_(sections),
+    finfo_rec_size_(0), linfo_rec_size_(0) {
   if (!debug)
     libbpf_set_print(NULL);
 }
@@ -292,6 +297,93 @@ int BTF::load(uint8_t *btf_sec, uintptr_t btf_sec_size,
 
   btf_ = btf;
   btf_ext_ = btf_ext;
+  build_index();
+  return 0;
+}
+
+int BTF::load_types(uint8_t *btf_sec, uintptr_t btf_sec_size) {
+  struct btf_header *hdr = (struct btf_header *)btf_sec;
+  fixup_btf(btf_sec + hdr->hdr_len + hdr->type_off, hdr->type_len,
+            (char *)(btf_sec + hdr->hdr_len + hdr->str_off));
+
+  struct btf *btf = btf__new(btf_sec, btf_sec_size);
+  if (BCC_IS_ERR(btf)) {
+    warning("Processing .BTF section failed\n");
+    return -1;
+  }
+  btf_ = btf;
+  build_index();
+  return 0;
+}
+
+void BTF::build_index() {
+  // Like btf__find_by_name(), the first type of a name wins
+  unsigned nr_types = btf__get_nr_types(btf_);
+  for (unsigned id = 1; id <= nr_types; id++) {
+    const struct btf_type *t = btf__type_by_id(btf_, id);
+    if (!t || !t->name_off)
+      continue;
+    type_ids_.emplace(btf__name_by_offset(btf_, t->name_off), id);
+  }
+  if (!btf_ext_)
+    return;
+
+  uint32_t size;
+  const uint8_t *raw = (const uint8_t *)btf_ext__get_raw_data(btf_ext_, &size);
+  const struct bcc_btf_ext_header *ehdr =
+      (const struct bcc_btf_ext_header *)raw;
+  if (!raw || size < offsetof(struct bcc_btf_ext_header, core_relo_off))
+    return;
+  const uint8_t *data = raw + ehdr->hdr_len;
+  index_ext_info(data + ehdr->func_info_off, ehdr->func_info_len,
+                 &finfo_rec_size_, func_info_secs_);
+  index_ext_info(data + ehdr->line_info_off, ehdr->line_info_len,
+                 &linfo_rec_size_, line_info_secs_);
+}
+
+// A func_info or line_info block is a record size followed by, for each
+// program section, its name offset, its number of records and the records.
+void BTF::index_ext_info(const uint8_t *info, uint32_t len,
+                         unsigned *rec_size,
+                         std::unordered_map<std::string, ext_info_sec> &secs) {
+  if (len < sizeof(uint32_t))
+    return;
+  *rec_size = *(const uint32_t *)info;
+  info += sizeof(uint32_t);
+  len -= sizeof(uint32_t);
+  while (len >= 2 * sizeof(uint32_t)) {
+    const uint32_t *sec = (const uint32_t *)info;
+    uint64_t records_len = (uint64_t)sec[1] * *rec_size;
+    if (records_len > len - 2 * sizeof(uint32_t))
+      break;
+    secs.emplace(btf__name_by_offset(btf_, sec[0]),
+                 ext_info_sec{info + 2 * sizeof(uint32_t), sec[1]});
+    info += 2 * sizeof(uint32_t) + records_len;
+    len -= 2 * sizeof(uint32_t) + records_len;
+  }
+}
+
+// Same as btf_ext__reloc_func_info()/btf_ext__reloc_line_info() for a
+// program starting at instruction 0: the records of fname with their
+// instruction offsets turned from bytes into instructions.
+int BTF::copy_ext_info(
+    const std::unordered_map<std::string, ext_info_sec> &secs,
+    unsigned rec_size, const char *fname, void **info, unsigned *cnt) {
+  auto it = secs.find(fname);
+  if (it == secs.end())
+    return -ENOENT;
+
+  size_t len = (size_t)it->second.num_info * rec_size;
+  uint8_t *data = (uint8_t *)malloc(len ? len : 1);
+  if (!data)
+    return -ENOMEM;
+  memcpy(data, it->second.data, len);
+  for (unsigned i = 0; i < it->second.num_info; i++) {
+    uint32_t *insn_off = (uint32_t *)(data + i * rec_size);
+    *insn_off /= sizeof(struct bpf_insn);
+  }
+  *info = data;
+  *cnt = it->second.num_info;
   return 0;
 }
 
@@ -309,20 +401,22 @@ int BTF::get_btf_info(const char *fname,
   *func_info = *line_info = NULL;
   *func_info_cnt = *line_info_cnt = 0;
 
-  *finfo_rec_size = btf_ext__func_info_rec_size(btf_ext_);
-  *linfo_rec_size = btf_ext__line_info_rec_size(btf_ext_);
+  *finfo_rec_size = finfo_rec_size_;
+  *linfo_rec_size = linfo_rec_size_;
 
-  ret = btf_ext__reloc_func_info(btf_, btf_ext_, fname, 0,
-        func_info, func_info_cnt);
+  ret = copy_ext_info(func_info_secs_, finfo_rec_size_, fname, func_info,
+                      func_info_cnt);
   if (ret) {
     warning(".BTF.ext reloc func_info failed\n");
     return ret;
   }
 
-  ret = btf_ext__reloc_line_info(btf_, btf_ext_, fname, 0,
-        line_info, line_info_cnt);
+  ret = copy_ext_info(line_info_secs_, linfo_rec_size_, fname, line_info,
+                      line_info_cnt);
   if (ret) {
     warning(".BTF.ext reloc line_info failed\n");
+    free(*func_info);
+    *func_info = NULL;
     return ret;
   }
 
@@ -332,9 +426,885 @@ int BTF::get_btf_info(const char *fname,
 int BTF::get_map_tids(std::string map_name,
                       unsigned expected_ksize, unsigned expected_vsize,
                       unsigned *key_tid, unsigned *value_tid) {
-  return btf__get_map_kv_tids(btf_, map_name.c_str(),
-                              expected_ksize, expected_vsize,
-                              key_tid, value_tid);
+  // Same checks as btf__get_map_kv_tids(), with the container looked up in
+  // the index instead of a walk over all types
+  auto it = type_ids_.find("____btf_map_" + map_name);
+  if (it == type_ids_.end()) {
+    warning("map:%s container ____btf_map_%s cannot be found in BTF\n",
+            map_name.c_str(), map_name.c_str());
+    return -ENOENT;
+  }
+
+  const struct btf_type *t = btf__type_by_id(btf_, it->second);
+  if (!t || !btf_is_struct(t) || btf_vlen(t) < 2) {
+    warning("map:%s container ____btf_map_%s is not a key/value struct\n",
+            map_name.c_str(), map_name.c_str());
+    return -EINVAL;
+  }
+
+  const struct btf_member *key = btf_members(t);
+  const struct btf_member *value = key + 1;
+  int64_t key_size = btf__resolve_size(btf_, key->type);
+  if (key_size < 0)
+    return key_size;
+  if (key_size != expected_ksize) {
+    warning("map:%s key size %lld doesn't match %u\n", map_name.c_str(),
+            (long long)key_size, expected_ksize);
+    return -EINVAL;
+  }
+  int64_t value_size = btf__resolve_size(btf_, value->type);
+  if (value_size < 0)
+    return value_size;
+  if (value_size != expected_vsize) {
+    warning("map:%s value size %lld doesn't match %u\n", map_name.c_str(),
+            (long long)value_size, expected_vsize);
+    return -EINVAL;
+  }
+
+  *key_tid = key->type;
+  *value_tid = value->type;
+  return 0;
+}
+
+// Nesting limit for the BTF type walkers, guards against malformed type loops.
+#define BCC_BTF_MAX_DEPTH 32
+
+namespace {
+
+const struct btf_type *skip_mods(const struct btf *btf, unsigned *type_id) {
+  const struct btf_type *t = btf__type_by_id(btf, *type_id);
+  while (t && (btf_is_mod(t) || btf_is_typedef(t))) {
+    *type_id = t->type;
+    t = btf__type_by_id(btf, *type_id);
+  }
+  return t;
+}
+
+uint64_t load_uint(const uint8_t *p, size_t size) {
+  uint8_t v8;
+  uint16_t v16;
+  uint32_t v32;
+  uint64_t v64;
+  switch (size) {
+  case 1: memcpy(&v8, p, 1); return v8;
+  case 2: memcpy(&v16, p, 2); return v16;
+  case 4: memcpy(&v32, p, 4); return v32;
+  default: memcpy(&v64, p, 8); return v64;
+  }
+}
+
+void store_uint(uint8_t *p, size_t size, uint64_t v) {
+  uint8_t v8 = v;
+  uint16_t v16 = v;
+  uint32_t v32 = v;
+  switch (size) {
+  case 1: memcpy(p, &v8, 1); break;
+  case 2: memcpy(p, &v16, 2); break;
+  case 4: memcpy(p, &v32, 4); break;
+  default: memcpy(p, &v, 8); break;
+  }
+}
+
+// Bit i of a bitfield starting at bit_off, in the order the compiler lays
+// bitfields out for the host.
+void bit_pos(uint32_t bit_off, uint32_t bits, uint32_t i, uint32_t *byte,
+             uint32_t *shift) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  uint32_t pos = bit_off + i;
+  *shift = pos % 8;
+#else
+  uint32_t pos = bit_off + bits - 1 - i;
+  *shift = 7 - pos % 8;
+#endif
+  *byte = pos / 8;
+}
+
+uint64_t load_bits(const uint8_t *p, uint32_t bit_off, uint32_t bits) {
+  uint64_t v = 0;
+  for (uint32_t i = 0, byte, shift; i < bits; i++) {
+    bit_pos(bit_off, bits, i, &byte, &shift);
+    v |= (uint64_t)((p[byte] >> shift) & 1) << i;
+  }
+  return v;
+}
+
+void store_bits(uint8_t *p, uint32_t bit_off, uint32_t bits, uint64_t v) {
+  for (uint32_t i = 0, byte, shift; i < bits; i++) {
+    bit_pos(bit_off, bits, i, &byte, &shift);
+    p[byte] = (p[byte] & ~(1 << shift)) | (((v >> i) & 1) << shift);
+  }
+}
+
+void append_hex(std::string &out, uint64_t v) {
+  char buf[32];
+  ::snprintf(buf, sizeof(buf), "0x%llx", (unsigned long long)v);
+  out += buf;
+}
+
+bool scan_char(const char *&str, char c) {
+  while (isspace(*str))
+    str++;
+  if (*str != c)
+    return false;
+  str++;
+  return true;
+}
+
+// Accepts the same inputs as sscanf's %i, truncated to the field width.
+bool scan_uint(const char *&str, uint64_t *v) {
+  char *end;
+  while (isspace(*str))
+    str++;
+  errno = 0;
+  if (*str == '-')
+    *v = (uint64_t)strtoll(str, &end, 0);
+  else
+    *v = strtoull(str, &end, 0);
+  if (end == str || errno)
+    return false;
+  str = end;
+  return true;
+}
+
+// For unions, use the largest member, which covers the whole value.
+const struct btf_member *union_member(const struct btf *btf,
+                                      const struct btf_type *t) {
+  const struct btf_member *m = btf_members(t), *best = nullptr;
+  int64_t best_size = -1;
+  for (int i = 0; i < btf_vlen(t); i++, m++) {
+    int64_t size = btf__resolve_size(btf, m->type);
+    if (size > best_size) {
+      best = m;
+      best_size = size;
+    }
+  }
+  return best;
+}
+
+}  // namespace
+
+// The string format follows the rw engine writers:
+//  integers, enums and pointers => 0x%x
+//  char arrays                  => "..."
+//  other arrays                 => [ 0x%x 0x%x ... ]
+//  structs                      => { 0x%x 0x%x ... }
+int BTF::dump_type(unsigned type_id, const uint8_t *data, std::string &out,
+                   int depth) {
+  if (depth > BCC_BTF_MAX_DEPTH)
+    return -1;
+  const struct btf_type *t = skip_mods(btf_, &type_id);
+  if (!t)
+    return -1;
+
+  switch (btf_kind(t)) {
+  case BTF_KIND_INT:
+  case BTF_KIND_ENUM:
+  case BTF_KIND_FLOAT:
+    if (t->size > 8)
+      return -1;
+    append_hex(out, load_uint(data, t->size));
+    return 0;
+  case BTF_KIND_PTR:
+    append_hex(out, load_uint(data, sizeof(void *)));
+    return 0;
+  case BTF_KIND_ARRAY: {
+    const struct btf_array *arr = btf_array(t);
+    unsigned elem_id = arr->type;
+    const struct btf_type *et = skip_mods(btf_, &elem_id);
+    int64_t elem_size = btf__resolve_size(btf_, elem_id);
+    if (!et || elem_size < 0)
+      return -1;
+    if (btf_is_int(et) && elem_size == 1) {
+      out += "\"";
+      out.append((const char *)data, strnlen((const char *)data, arr->nelems));
+      out += "\"";
+      return 0;
+    }
+    out += "[ ";
+    for (uint32_t i = 0; i < arr->nelems; i++) {
+      if (dump_type(elem_id, data + i * elem_size, out, depth + 1))
+        return -1;
+      out += " ";
+    }
+    out += "]";
+    return 0;
+  }
+  case BTF_KIND_STRUCT: {
+    const struct btf_member *m = btf_members(t);
+    out += "{ ";
+    for (int i = 0; i < btf_vlen(t); i++, m++) {
+      uint32_t bit_off = btf_member_bit_offset(t, i);
+      uint32_t bits = btf_member_bitfield_size(t, i);
+      if (bits)
+        append_hex(out, load_bits(data, bit_off, bits));
+      else if (dump_type(m->type, data + bit_off / 8, out, depth + 1))
+        return -1;
+      out += " ";
+    }
+    out += "}";
+    return 0;
+  }
+  case BTF_KIND_UNION: {
+    const struct btf_member *m = union_member(btf_, t);
+    if (!m)
+      return -1;
+    return dump_type(m->type, data, out, depth + 1);
+  }
+  default:
+    return -1;
+  }
+}
+
+int BTF::scan_type(unsigned type_id, const char *&str, uint8_t *data,
+                   int depth) {
+  uint64_t v;
+  if (depth > BCC_BTF_MAX_DEPTH)
+    return -1;
+  const struct btf_type *t = skip_mods(btf_, &type_id);
+  if (!t)
+    return -1;
+
+  switch (btf_kind(t)) {
+  case BTF_KIND_INT:
+  case BTF_KIND_ENUM:
+  case BTF_KIND_FLOAT:
+    if (t->size > 8 || !scan_uint(str, &v))
+      return -1;
+    store_uint(data, t->size, v);
+    return 0;
+  case BTF_KIND_PTR:
+    if (!scan_uint(str, &v))
+      return -1;
+    store_uint(data, sizeof(void *), v);
+    return 0;
+  case BTF_KIND_ARRAY: {
+    const struct btf_array *arr = btf_array(t);
+    unsigned elem_id = arr->type;
+    const struct btf_type *et = skip_mods(btf_, &elem_id);
+    int64_t elem_size = btf__resolve_size(btf_, elem_id);
+    if (!et || elem_size < 0)
+      return -1;
+    if (btf_is_int(et) && elem_size == 1) {
+      if (!scan_char(str, '"'))
+        return -1;
+      const char *end = strchr(str, '"');
+      if (!end || (size_t)(end - str) > arr->nelems)
+        return -1;
+      memset(data, 0, arr->nelems);
+      memcpy(data, str, end - str);
+      str = end + 1;
+      return 0;
+    }
+    if (!scan_char(str, '['))
+      return -1;
+    for (uint32_t i = 0; i < arr->nelems; i++) {
+      if (scan_type(elem_id, str, data + i * elem_size, depth + 1))
+        return -1;
+    }
+    return scan_char(str, ']') ? 0 : -1;
+  }
+  case BTF_KIND_STRUCT: {
+    const struct btf_member *m = btf_members(t);
+    if (!scan_char(str, '{'))
+      return -1;
+    for (int i = 0; i < btf_vlen(t); i++, m++) {
+      uint32_t bit_off = btf_member_bit_offset(t, i);
+      uint32_t bits = btf_member_bitfield_size(t, i);
+      if (bits) {
+        if (!scan_uint(str, &v))
+          return -1;
+        store_bits(data, bit_off, bits, v);
+      } else if (scan_type(m->type, str, data + bit_off / 8, depth + 1)) {
+        return -1;
+      }
+    }
+    return scan_char(str, '}') ? 0 : -1;
+  }
+  case BTF_KIND_UNION: {
+    const struct btf_member *m = union_member(btf_, t);
+    if (!m)
+      return -1;
+    return scan_type(m->type, str, data, depth + 1);
+  }
+  default:
+    return -1;
+  }
+}
+
+namespace {
+
+// The integer names of the table descriptions, which BPF.str2ctype decodes
+const char *layout_int(const struct btf *btf, const struct btf_type *t) {
+  bool is_signed;
+  if (btf_is_int(t)) {
+    uint8_t enc = btf_int_encoding(t);
+    if (enc & BTF_INT_BOOL)
+      return "_Bool";
+    if (t->size == 1 && !strcmp(btf__name_by_offset(btf, t->name_off), "char"))
+      return "char";
+    is_signed = enc & BTF_INT_SIGNED;
+  } else {
+    // enums, signed when the kind flag says so
+    is_signed = t->info >> 31;
+  }
+  switch (t->size) {
+  case 1:
+    return is_signed ? "signed char" : "unsigned char";
+  case 2:
+    return is_signed ? "short" : "unsigned short";
+  case 4:
+    return is_signed ? "int" : "unsigned int";
+  case 8:
+    return is_signed ? "long long" : "unsigned long long";
+  case 16:
+    return is_signed ? "__int128" : "unsigned __int128";
+  default:
+    return nullptr;
+  }
+}
+
+}  // namespace
+
+// A scalar name, or the record of a struct or union
+int BTF::layout_elem(unsigned type_id, std::string &out, int depth) {
+  if (depth > BCC_BTF_MAX_DEPTH)
+    return -1;
+  const struct btf_type *t = skip_mods(btf_, &type_id);
+  if (!t)
+    return -1;
+
+  const char *name = nullptr;
+  switch (btf_kind(t)) {
+  case BTF_KIND_INT:
+  case BTF_KIND_ENUM:
+    name = layout_int(btf_, t);
+    break;
+  case BTF_KIND_FLOAT:
+    name = t->size == 4 ? "float" : t->size == 8 ? "double" : "long double";
+    break;
+  case BTF_KIND_PTR:
+    name = "unsigned long long";
+    break;
+  case BTF_KIND_STRUCT:
+  case BTF_KIND_UNION:
+    return layout_record(t, out, depth + 1);
+  }
+  if (!name)
+    return -1;
+  out += "\"";
+  out += name;
+  out += "\"";
+  return 0;
+}
+
+// ["name", elem], ["name", elem, [count]] for arrays, ["name", elem, bits]
+// for bitfields, or the record itself for an anonymous struct or union
+int BTF::layout_field(const char *name, unsigned type_id, uint32_t bits,
+                      std::string &out, int depth) {
+  const struct btf_type *t = skip_mods(btf_, &type_id);
+  if (!t)
+    return -1;
+  if (!*name && btf_is_composite(t))
+    return layout_record(t, out, depth + 1);
+
+  // Multi-dimensional arrays are flattened, the layout is the same
+  uint64_t count = 1;
+  bool is_array = false;
+  while (t && btf_is_array(t)) {
+    count *= btf_array(t)->nelems;
+    type_id = btf_array(t)->type;
+    t = skip_mods(btf_, &type_id);
+    is_array = true;
+  }
+
+  out += "[\"";
+  out += name;
+  out += "\", ";
+  if (layout_elem(type_id, out, depth))
+    return -1;
+  if (is_array)
+    out += ", [" + std::to_string(count) + "]";
+  else if (bits)
+    out += ", " + std::to_string(bits);
+  out += "]";
+  return 0;
+}
+
+// Like the rw engine descriptions, structs without bitfields are packed
+// with their padding spelled out, so that any layout decodes exactly
+int BTF::layout_record(const struct btf_type *t, std::string &out,
+                       int depth) {
+  if (depth > BCC_BTF_MAX_DEPTH)
+    return -1;
+  const struct btf_member *m = btf_members(t);
+  int vlen = btf_vlen(t);
+  bool skip_padding = btf_is_union(t) || !vlen;
+  for (int i = 0; i < vlen; i++)
+    if (btf_member_bitfield_size(t, i))
+      skip_padding = true;
+
+  out += "[\"";
+  out += btf__name_by_offset(btf_, t->name_off);
+  out += "\", [";
+  uint32_t offset = 0;
+  for (int i = 0; i < vlen; i++, m++) {
+    if (i)
+      out += ", ";
+    if (!skip_padding) {
+      uint32_t field_offset = btf_member_bit_offset(t, i) / 8;
+      if (field_offset > offset)
+        out += "[\"__pad_" + std::to_string(i) + "\", \"char\", [" +
+               std::to_string(field_offset - offset) + "]], ";
+      int64_t size = btf__resolve_size(btf_, m->type);
+      if (size < 0)
+        return -1;
+      offset = field_offset + size;
+    }
+    if (layout_field(btf__name_by_offset(btf_, m->name_off), m->type,
+                     btf_member_bitfield_size(t, i), out, depth))
+      return -1;
+  }
+  if (!skip_padding && t->size > offset)
+    out += ", [\"__pad_end\", \"char\", [" + std::to_string(t->size - offset) +
+           "]]";
+  out += "]";
+  if (btf_is_union(t))
+    out += ", \"union\"";
+  else
+    out += skip_padding ? ", \"struct\"" : ", \"struct_packed\"";
+  out += "]";
+  return 0;
+}
+
+int BTF::type_layout(unsigned type_id, std::string &out) {
+  // A bare array has no description of its own, see BMapDeclVisitor
+  const struct btf_type *t = skip_mods(btf_, &type_id);
+  if (!t || btf_is_array(t))
+    return -1;
+  std::string layout;
+  if (layout_elem(type_id, layout, 0))
+    return -1;
+  out = std::move(layout);
+  return 0;
+}
+
+StatusTuple BTF::type_snprintf(unsigned type_id, char *buf, size_t len,
+                               const void *val) {
+  std::string out;
+  if (dump_type(type_id, (const uint8_t *)val, out, 0))
+    return StatusTuple(-1, "error in snprintf: unsupported BTF type %u",
+                       type_id);
+  if (out.size() >= len)
+    return StatusTuple(-1, "buffer of size %zd too small", len);
+  memcpy(buf, out.c_str(), out.size() + 1);
+  return StatusTuple::OK();
+}
+
+StatusTuple BTF::type_sscanf(unsigned type_id, const char *str, void *val) {
+  int64_t size = btf__resolve_size(btf_, type_id);
+  if (size < 0)
+    return StatusTuple(-1, "error in sscanf: unknown BTF type %u", type_id);
+
+  // Parse into a zeroed copy so that padding is deterministic for hash keys
+  // and a malformed string leaves val untouched.
+  std::vector<uint8_t> data(size);
+  if (scan_type(type_id, str, data.data(), 0))
+    return StatusTuple(-1, "error in sscanf: cannot parse BTF type %u",
+                       type_id);
+  memcpy(val, data.data(), size);
+  return StatusTuple::OK();
+}
+
+
+namespace {
+
+bool is_cxx_keyword(const std::string &name) {
+  static const char *const keywords[] = {
+      "alignas",  "alignof",   "and",       "asm",      "auto",
+      "bool",     "catch",     "class",     "concept",  "const_cast",
+      "decltype", "delete",    "explicit",  "export",   "friend",
+      "mutable",  "namespace", "new",       "noexcept", "nullptr",
+      "operator", "or",        "private",   "protected", "public",
+      "requires", "template",  "this",      "throw",    "try",
+      "typeid",   "typename",  "using",     "virtual",  "xor"};
+  for (const char *k : keywords)
+    if (name == k)
+      return true;
+  return false;
+}
+
+std::string cxx_int(unsigned size, bool is_signed) {
+  switch (size) {
+  case 1:
+    return is_signed ? "int8_t" : "uint8_t";
+  case 2:
+    return is_signed ? "int16_t" : "uint16_t";
+  case 4:
+    return is_signed ? "int32_t" : "uint32_t";
+  case 8:
+    return is_signed ? "int64_t" : "uint64_t";
+  case 16:
+    return is_signed ? "__int128" : "unsigned __int128";
+  default:
+    return "";
+  }
+}
+
+// Writes C++ declarations laid out exactly like BTF types: explicit padding
+// fills the gaps natural alignment doesn't explain, and each named type is
+// checked with static_assert. Pointers become uint64_t, table keys and
+// leaves hold kernel addresses that user space can't follow anyway.
+class CxxTypeWriter {
+ public:
+  explicit CxxTypeWriter(const struct btf *btf) : btf_(btf) {}
+
+  // Declare type_id and the types it needs, naming it fallback if it has no
+  // name of its own, and return its C++ name. Empty if some type has no C++
+  // equivalent.
+  std::string declare(unsigned type_id, const std::string &fallback);
+  const std::string &decls() const { return decls_; }
+
+ private:
+  bool decl(unsigned type_id, const std::string &declarator, int depth,
+            std::string &out);
+  bool body(const struct btf_type *t, int depth, std::string &out,
+            bool *packed);
+  std::string define(unsigned type_id, const std::string &name, int depth);
+  std::string type_name(unsigned type_id, int depth);
+  unsigned align(unsigned type_id, int depth);
+  std::string member_name(const struct btf_member *m);
+
+  const struct btf *btf_;
+  std::string decls_;
+  std::unordered_map<unsigned, std::string> names_;
+  std::unordered_map<std::string, unsigned> owners_;
+};
+
+std::string CxxTypeWriter::member_name(const struct btf_member *m) {
+  std::string name = btf__name_by_offset(btf_, m->name_off);
+  return is_cxx_keyword(name) ? name + "_" : name;
+}
+
+unsigned CxxTypeWriter::align(unsigned type_id, int depth) {
+  const struct btf_type *t = skip_mods(btf_, &type_id);
+  if (!t || depth > BCC_BTF_MAX_DEPTH)
+    return 1;
+  switch (btf_kind(t)) {
+  case BTF_KIND_INT:
+  case BTF_KIND_ENUM:
+  case BTF_KIND_FLOAT:
+    return std::min<unsigned>(std::max<unsigned>(t->size, 1), 16);
+  case BTF_KIND_PTR:
+    return 8;
+  case BTF_KIND_ARRAY:
+    return align(btf_array(t)->type, depth + 1);
+  case BTF_KIND_STRUCT:
+  case BTF_KIND_UNION: {
+    unsigned a = 1;
+    const struct btf_member *m = btf_members(t);
+    for (int i = 0; i < btf_vlen(t); i++, m++)
+      a = std::max(a, align(m->type, depth + 1));
+    return a;
+  }
+  default:
+    return 1;
+  }
+}
+
+// The C++ name of a named type, defining it first if needed
+std::string CxxTypeWriter::type_name(unsigned type_id, int depth) {
+  auto it = names_.find(type_id);
+  if (it != names_.end())
+    return it->second;
+
+  const struct btf_type *t = btf__type_by_id(btf_, type_id);
+  if (!t)
+    return "";
+  switch (btf_kind(t)) {
+  case BTF_KIND_INT: {
+    if (btf_int_encoding(t) & BTF_INT_BOOL)
+      return "bool";
+    if (t->size == 1 &&
+        !strcmp(btf__name_by_offset(btf_, t->name_off), "char"))
+      return "char";
+    return cxx_int(t->size, btf_int_encoding(t) & BTF_INT_SIGNED);
+  }
+  case BTF_KIND_FLOAT:
+    return t->size == 4 ? "float" : t->size == 8 ? "double" : "long double";
+  case BTF_KIND_STRUCT:
+  case BTF_KIND_UNION:
+  case BTF_KIND_ENUM:
+    return define(type_id, btf__name_by_offset(btf_, t->name_off), depth);
+  default:
+    return "";
+  }
+}
+
+std::string CxxTypeWriter::define(unsigned type_id, const std::string &name,
+                                  int depth) {
+  const struct btf_type *t = btf__type_by_id(btf_, type_id);
+  if (!t || depth > BCC_BTF_MAX_DEPTH)
+    return "";
+
+  // Types of different kinds or from different headers may share a name
+  std::string cxx_name = is_cxx_keyword(name) ? name + "_" : name;
+  auto owner = owners_.find(cxx_name);
+  if (owner != owners_.end() && owner->second != type_id)
+    cxx_name += "_" + std::to_string(type_id);
+  owners_[cxx_name] = type_id;
+  names_[type_id] = cxx_name;
+
+  std::string text;
+  if (btf_is_enum(t)) {
+    // The kind flag marks signed enums, older BTF leaves them unsigned
+    bool is_signed = t->info >> 31;
+    text = "enum class " + cxx_name + " : " + cxx_int(t->size, is_signed) +
+           " {\n";
+    const struct btf_enum *e = btf_enum(t);
+    for (int i = 0; i < btf_vlen(t); i++, e++) {
+      std::string value = btf__name_by_offset(btf_, e->name_off);
+      if (is_cxx_keyword(value))
+        value += "_";
+      text += "  " + value + " = " +
+              (is_signed ? std::to_string(e->val)
+                         : std::to_string((uint32_t)e->val)) +
+              ",\n";
+    }
+    text += "};\n\n";
+    decls_ += text;
+    return cxx_name;
+  }
+
+  // Definitions are written at the top level whatever needs them
+  std::string members;
+  bool packed;
+  if (!body(t, 1, members, &packed))
+    return "";
+  text = btf_is_union(t) ? "union" : "struct";
+  if (packed)
+    text += " __attribute__((packed))";
+  text += " " + cxx_name + " {\n" + members + "};\n";
+  text += "static_assert(sizeof(" + cxx_name + ") == " +
+          std::to_string(t->size) + ", \"" + cxx_name +
+          " size differs from BTF\");\n";
+  if (btf_is_struct(t)) {
+    const struct btf_member *m = btf_members(t);
+    for (int i = 0; i < btf_vlen(t); i++, m++) {
+      if (!m->name_off || btf_member_bitfield_size(t, i))
+        continue;
+      text += "static_assert(offsetof(" + cxx_name + ", " + member_name(m) +
+              ") == " + std::to_string(btf_member_bit_offset(t, i) / 8) +
+              ", \"" + cxx_name + " layout differs from BTF\");\n";
+    }
+  }
+  decls_ += text + "\n";
+  return cxx_name;
+}
+
+// A declaration of declarator with type type_id, defining the named types
+// it needs first. Anonymous structs and unions are declared inline.
+bool CxxTypeWriter::decl(unsigned type_id, const std::string &declarator,
+                         int depth, std::string &out) {
+  if (depth > BCC_BTF_MAX_DEPTH)
+    return false;
+
+  const struct btf_type *t = btf__type_by_id(btf_, type_id);
+  while (t && (btf_is_mod(t) || btf_is_typedef(t))) {
+    // typedef struct { ... } name_t; names the struct after the typedef
+    if (btf_is_typedef(t)) {
+      unsigned target = t->type;
+      const struct btf_type *tt = skip_mods(btf_, &target);
+      if (tt && btf_is_composite(tt) && !tt->name_off) {
+        std::string name = names_.count(target) ? names_[target] :
+            define(target, btf__name_by_offset(btf_, t->name_off), depth);
+        if (name.empty())
+          return false;
+        out = name + (declarator.empty() ? "" : " " + declarator);
+        return true;
+      }
+    }
+    type_id = t->type;
+    t = btf__type_by_id(btf_, type_id);
+  }
+  if (!t)
+    return false;
+
+  std::string type;
+  switch (btf_kind(t)) {
+  case BTF_KIND_PTR:
+    type = "uint64_t";
+    break;
+  case BTF_KIND_ARRAY: {
+    const struct btf_array *arr = btf_array(t);
+    return decl(arr->type, declarator + "[" + std::to_string(arr->nelems) + "]",
+                depth, out);
+  }
+  case BTF_KIND_ENUM:
+    type = t->name_off ? type_name(type_id, depth)
+                       : cxx_int(t->size, t->info >> 31);
+    break;
+  case BTF_KIND_STRUCT:
+  case BTF_KIND_UNION:
+    if (t->name_off) {
+      type = type_name(type_id, depth);
+    } else {
+      std::string members;
+      bool packed;
+      if (!body(t, depth + 1, members, &packed))
+        return false;
+      type = btf_is_union(t) ? "union" : "struct";
+      if (packed)
+        type += " __attribute__((packed))";
+      type += " {\n" + members + std::string(2 * depth, ' ') + "}";
+    }
+    break;
+  default:
+    type = type_name(type_id, depth);
+    break;
+  }
+  if (type.empty())
+    return false;
+  out = type + (declarator.empty() ? "" : " " + declarator);
+  return true;
+}
+
+bool CxxTypeWriter::body(const struct btf_type *t, int depth,
+                         std::string &out, bool *packed) {
+  std::string indent(2 * depth, ' ');
+  const struct btf_member *m = btf_members(t);
+  int vlen = btf_vlen(t);
+  unsigned pads = 0;
+
+  if (btf_is_union(t)) {
+    *packed = false;
+    int64_t largest = 0;
+    for (int i = 0; i < vlen; i++, m++) {
+      std::string d;
+      if (!decl(m->type, member_name(m), depth, d))
+        return false;
+      out += indent + d + ";\n";
+      largest = std::max<int64_t>(largest, btf__resolve_size(btf_, m->type));
+    }
+    if (largest < (int64_t)t->size)
+      out += indent + "char __size[" + std::to_string(t->size) + "];\n";
+    return true;
+  }
+
+  // Packed if some member or the size itself isn't naturally aligned
+  unsigned max_align = 1;
+  *packed = false;
+  for (int i = 0; i < vlen; i++) {
+    unsigned a = align(m[i].type, depth);
+    max_align = std::max(max_align, a);
+    if (!btf_member_bitfield_size(t, i) &&
+        (btf_member_bit_offset(t, i) / 8) % a)
+      *packed = true;
+  }
+  if (t->size % max_align)
+    *packed = true;
+
+  auto pad = [&](uint32_t from, uint32_t to) {
+    out += indent + "char __pad" + std::to_string(pads++) + "[" +
+           std::to_string(to - from) + "];\n";
+  };
+
+  uint32_t cursor = 0;  // in bits
+  for (int i = 0; i < vlen; i++, m++) {
+    uint32_t bit_off = btf_member_bit_offset(t, i);
+    uint32_t bits = btf_member_bitfield_size(t, i);
+    std::string d;
+    if (bits) {
+      if (bit_off > cursor) {
+        if (cursor % 8 == 0 && bit_off % 8 == 0) {
+          pad(cursor / 8, bit_off / 8);
+        } else {
+          if (!decl(m->type, ": " + std::to_string(bit_off - cursor), depth,
+                    d))
+            return false;
+          out += indent + d + ";\n";
+        }
+      }
+      if (!decl(m->type, member_name(m) + " : " + std::to_string(bits), depth,
+                d))
+        return false;
+      out += indent + d + ";\n";
+      cursor = bit_off + bits;
+      continue;
+    }
+
+    uint32_t off = bit_off / 8, at = (cursor + 7) / 8;
+    unsigned a = align(m->type, depth);
+    uint32_t natural = *packed ? at : (at + a - 1) / a * a;
+    if (off < at)
+      return false;
+    if (off > natural)
+      pad(at, off);
+    if (!decl(m->type, member_name(m), depth, d))
+      return false;
+    out += indent + d + ";\n";
+    int64_t size = btf__resolve_size(btf_, m->type);
+    if (size < 0)
+      return false;
+    cursor = (off + size) * 8;
+  }
+
+  uint32_t end = (cursor + 7) / 8;
+  uint32_t natural = *packed ? end : (end + max_align - 1) / max_align * max_align;
+  if (t->size > natural)
+    pad(end, t->size);
+  return true;
+}
+
+std::string CxxTypeWriter::declare(unsigned type_id,
+                                   const std::string &fallback) {
+  unsigned id = type_id;
+  const struct btf_type *t = skip_mods(btf_, &id);
+  if (!t)
+    return "";
+
+  // Anonymous structs can still be named by their typedef
+  std::string d;
+  if (btf_is_composite(t) && !t->name_off) {
+    if (!decl(type_id, "", 0, d))
+      return "";
+    auto it = names_.find(id);
+    return it != names_.end() ? it->second : define(id, fallback, 0);
+  }
+
+  // Arrays can't be table keys or leaves in C++, wrap them in a struct
+  if (btf_is_array(t)) {
+    std::string name = fallback;
+    if (owners_.count(name))
+      name += "_" + std::to_string(id);
+    int64_t size = btf__resolve_size(btf_, id);
+    if (size < 0 || !decl(type_id, "v", 1, d))
+      return "";
+    owners_[name] = id;
+    decls_ += "struct " + name + " {\n  " + d + ";\n};\n" +
+              "static_assert(sizeof(" + name + ") == " +
+              std::to_string(size) + ", \"" + name +
+              " size differs from BTF\");\n\n";
+    return name;
+  }
+
+  return decl(type_id, "", 0, d) ? d : "";
+}
+
+}  // namespace
+
+StatusTuple BTF::cxx_decls(
+    const std::vector<std::pair<unsigned, std::string>> &roots,
+    std::string &decls, std::vector<std::string> &names) {
+  CxxTypeWriter writer(btf_);
+  for (const auto &root : roots) {
+    std::string name = writer.declare(root.first, root.second);
+    if (name.empty())
+      return StatusTuple(-1, "BTF type %u of %s has no C++ equivalent",
+                         root.first, root.second.c_str());
+    names.push_back(name);
+  }
+  decls += writer.decls();
+  return StatusTuple::OK();
 }
 
 } // namespace ebpf
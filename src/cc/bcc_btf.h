@@ -21,12 +21,14 @@
 #include <stdint.h>
 #include <string>
 #include <map>
+#include <unordered_map>
 #include <vector>
 
 #include "bpf_module.h"
 
 struct btf;
 struct btf_ext;
+struct btf_type;
 
 namespace ebpf {
 
@@ -34,7 +36,7 @@ class BTFStringTable {
  private:
   uint32_t Size;
   uint32_t OrigTblLen;
-  std::map<uint32_t, uint32_t> OffsetToIdMap;
+  std::unordered_map<std::string, uint32_t> StrToOffset;
   std::vector<std::string> Table;
 
  public:
@@ -62,6 +64,12 @@ class BTF {
     uint32_t core_relo_len;
 };
 
+  // Records of one program section in a .BTF.ext func_info or line_info
+  struct ext_info_sec {
+    const uint8_t *data;
+    unsigned num_info;
+  };
+
  public:
   BTF(bool debug, sec_map_def &sections);
   ~BTF();
@@ -74,9 +82,27 @@ class BTF {
                    unsigned *finfo_rec_size,
                    void **line_info, unsigned *line_info_cnt,
                    unsigned *linfo_rec_size);
+  // Parse the types of a .BTF section only, without loading it into the
+  // kernel, for what works on types alone: get_map_tids() and cxx_decls().
+  int load_types(uint8_t *btf_sec, uintptr_t btf_sec_size);
   int get_map_tids(std::string map_name,
                    unsigned expected_ksize, unsigned expected_vsize,
                    unsigned *key_tid, unsigned *value_tid);
+  // C++ declarations laid out like the BTF types of roots and the types
+  // they need, appended to decls. Each root is a type id and the name given
+  // to it if it has no name of its own; its C++ name is returned in names.
+  StatusTuple cxx_decls(
+      const std::vector<std::pair<unsigned, std::string>> &roots,
+      std::string &decls, std::vector<std::string> &names);
+  // The layout of a table key or leaf type in the JSON format of the key and
+  // leaf descriptions from json_map_decl_visitor.cc, with integers named by
+  // their size and signedness only, so that typedefs don't matter.
+  int type_layout(unsigned type_id, std::string &out);
+  // Table-driven equivalents of the rw engine key/leaf formatters, using the
+  // BTF type instead of JIT compiled sscanf/snprintf wrappers.
+  StatusTuple type_snprintf(unsigned type_id, char *buf, size_t len,
+                            const void *val);
+  StatusTuple type_sscanf(unsigned type_id, const char *str, void *val);
 
  private:
   void fixup_btf(uint8_t *type_sec, uintptr_t type_sec_size, char *strings);
@@ -85,12 +111,32 @@ class BTF {
               std::map<std::string, std::string> &remapped_sources,
               uint8_t **new_btf_sec, uintptr_t *new_btf_sec_size);
   void warning(const char *format, ...);
+  void build_index();
+  void index_ext_info(const uint8_t *info, uint32_t len, unsigned *rec_size,
+                      std::unordered_map<std::string, ext_info_sec> &secs);
+  int copy_ext_info(const std::unordered_map<std::string, ext_info_sec> &secs,
+                    unsigned rec_size, const char *fname, void **info,
+                    unsigned *cnt);
+  int dump_type(unsigned type_id, const uint8_t *data, std::string &out,
+                int depth);
+  int scan_type(unsigned type_id, const char *&str, uint8_t *data, int depth);
+  int layout_elem(unsigned type_id, std::string &out, int depth);
+  int layout_field(const char *name, unsigned type_id, uint32_t bits,
+                   std::string &out, int depth);
+  int layout_record(const struct btf_type *t, std::string &out, int depth);
 
  private:
   bool debug_;
   struct btf *btf_;
   struct btf_ext *btf_ext_;
   sec_map_def &sections_;
+  // Built once by load(), so that lookups by name don't walk all types
+  // and all program sections each time
+  std::unordered_map<std::string, unsigned> type_ids_;
+  std::unordered_map<std::string, ext_info_sec> func_info_secs_;
+  std::unordered_map<std::string, ext_info_sec> line_info_secs_;
+  unsigned finfo_rec_size_;
+  unsigned linfo_rec_size_;
 };
 
 } // namespace ebpf
@@ -37,6 +37,74 @@ void * bpf_module_create_c_from_string(const char *text, unsigned flags, const c
   return mod;
 }
 
+void * bpf_module_create_c_from_string_cached(const char *text, unsigned flags,
+                                              const char *cflags[], int ncflags,
+                                              bool allow_rlimit,
+                                              const char *dev_name,
+                                              const char *cache_dir) {
+  auto mod = new ebpf::BPFModule(flags, nullptr, false, "", allow_rlimit, dev_name);
+  if (cache_dir)
+    mod->set_object_cache_dir(cache_dir);
+  if (mod->load_string(text, cflags, ncflags) != 0) {
+    delete mod;
+    return nullptr;
+  }
+  return mod;
+}
+
+int bpf_module_compile_object(const char *text, unsigned flags,
+                              const char *cflags[], int ncflags,
+                              const char *path) {
+  ebpf::BPFModule mod(flags, nullptr, false);
+  return mod.compile_object(text, cflags, ncflags, path);
+}
+
+void * bpf_module_create_from_object(const char *path, unsigned flags,
+                                     bool allow_rlimit, const char *dev_name) {
+  auto mod = new ebpf::BPFModule(flags, nullptr, false, "", allow_rlimit, dev_name);
+  if (mod->load_object(path) != 0) {
+    delete mod;
+    return nullptr;
+  }
+  return mod;
+}
+
+void * bpf_module_new(unsigned flags, bool rw_engine, bool allow_rlimit,
+                      const char *dev_name) {
+  return new ebpf::BPFModule(flags, nullptr, rw_engine, "", allow_rlimit,
+                             dev_name);
+}
+
+void bpf_module_set_map_size(void *program, const char *table_name,
+                             unsigned max_entries) {
+  auto mod = static_cast<ebpf::BPFModule *>(program);
+  if (!mod) return;
+  mod->set_map_size(table_name, max_entries);
+}
+
+void bpf_module_set_rodata(void *program, const char *table_name,
+                           const void *data, size_t size) {
+  auto mod = static_cast<ebpf::BPFModule *>(program);
+  if (!mod) return;
+  mod->set_rodata(table_name, data, size);
+}
+
+int bpf_module_load_string(void *program, const char *text,
+                           const char *cflags[], int ncflags,
+                           const char *cache_dir) {
+  auto mod = static_cast<ebpf::BPFModule *>(program);
+  if (!mod) return -1;
+  if (cache_dir)
+    mod->set_object_cache_dir(cache_dir);
+  return mod->load_string(text, cflags, ncflags);
+}
+
+int bpf_module_load_object(void *program, const char *path) {
+  auto mod = static_cast<ebpf::BPFModule *>(program);
+  if (!mod) return -1;
+  return mod->load_object(path);
+}
+
 void bpf_module_destroy(void *program) {
   auto mod = static_cast<ebpf::BPFModule *>(program);
   if (!mod) return;
@@ -181,6 +249,18 @@ const char * bpf_table_leaf_desc_id(void *program, size_t id) {
   return mod->table_leaf_desc(id);
 }
 
+const char * bpf_table_key_layout_id(void *program, size_t id) {
+  auto mod = static_cast<ebpf::BPFModule *>(program);
+  if (!mod) return nullptr;
+  return mod->table_key_layout(id);
+}
+
+const char * bpf_table_leaf_layout_id(void *program, size_t id) {
+  auto mod = static_cast<ebpf::BPFModule *>(program);
+  if (!mod) return nullptr;
+  return mod->table_leaf_layout(id);
+}
+
 size_t bpf_table_key_size(void *program, const char *table_name) {
   auto mod = static_cast<ebpf::BPFModule *>(program);
   if (!mod) return 0;
@@ -241,6 +321,20 @@ int bcc_func_load(void *program, int prog_type, const char *name,
 
 }
 
+int bcc_func_load_attach_type(void *program, int prog_type,
+                              int expected_attach_type, const char *name,
+                              const struct bpf_insn *insns, int prog_len,
+                              const char *license, unsigned kern_version,
+                              int log_level, char *log_buf,
+                              unsigned log_buf_size, const char *dev_name) {
+  auto mod = static_cast<ebpf::BPFModule *>(program);
+  if (!mod) return -1;
+  return mod->bcc_func_load(prog_type, name, insns, prog_len,
+                            license, kern_version, log_level,
+                            log_buf, log_buf_size, dev_name, 0,
+                            expected_attach_type);
+}
+
 size_t bpf_perf_event_fields(void *program, const char *event) {
   auto mod = static_cast<ebpf::BPFModule *>(program);
   if (!mod)
@@ -255,4 +349,25 @@ const char * bpf_perf_event_field(void *program, const char *event, size_t i) {
   return mod->perf_event_field(event, i);
 }
 
+size_t bpf_num_phases(void *program) {
+  auto mod = static_cast<ebpf::BPFModule *>(program);
+  if (!mod)
+    return 0;
+  return mod->phase_times().size();
+}
+
+const char * bpf_phase_name(void *program, size_t id) {
+  auto mod = static_cast<ebpf::BPFModule *>(program);
+  if (!mod || id >= mod->phase_times().size())
+    return nullptr;
+  return mod->phase_times()[id].first.c_str();
+}
+
+uint64_t bpf_phase_ns(void *program, size_t id) {
+  auto mod = static_cast<ebpf::BPFModule *>(program);
+  if (!mod || id >= mod->phase_times().size())
+    return 0;
+  return mod->phase_times()[id].second;
+}
+
 }
@@ -30,6 +30,36 @@ void * bpf_module_create_c(const char *filename, unsigned flags, const char *cfl
 void * bpf_module_create_c_from_string(const char *text, unsigned flags, const char *cflags[],
                                        int ncflags, bool allow_rlimit,
                                        const char *dev_name);
+/* Same as bpf_module_create_c_from_string(), with the rw engine disabled so
+ * the compiled object is cached in cache_dir (see BCC_OBJ_CACHE_DIR). */
+void * bpf_module_create_c_from_string_cached(const char *text, unsigned flags,
+                                              const char *cflags[], int ncflags,
+                                              bool allow_rlimit,
+                                              const char *dev_name,
+                                              const char *cache_dir);
+/* Compile text into an object file at path, without creating any map.
+ * Returns 0 on success. */
+int bpf_module_compile_object(const char *text, unsigned flags,
+                              const char *cflags[], int ncflags,
+                              const char *path);
+/* Create a module from an object file written by bpf_module_compile_object(),
+ * without Clang and LLVM. */
+void * bpf_module_create_from_object(const char *path, unsigned flags,
+                                     bool allow_rlimit, const char *dev_name);
+/* Two-step creation, to set map sizes and BPF_RODATA contents before the
+ * maps are created. bpf_module_load_string() caches the compiled object in
+ * cache_dir if it is not NULL, which requires rw_engine to be false.
+ * Both loads return 0 on success. */
+void * bpf_module_new(unsigned flags, bool rw_engine, bool allow_rlimit,
+                      const char *dev_name);
+void bpf_module_set_map_size(void *program, const char *table_name,
+                             unsigned max_entries);
+void bpf_module_set_rodata(void *program, const char *table_name,
+                           const void *data, size_t size);
+int bpf_module_load_string(void *program, const char *text,
+                           const char *cflags[], int ncflags,
+                           const char *cache_dir);
+int bpf_module_load_object(void *program, const char *path);
 void bpf_module_destroy(void *program);
 char * bpf_module_license(void *program);
 unsigned bpf_module_kern_version(void *program);
@@ -54,6 +84,9 @@ const char * bpf_table_key_desc(void *program, const char *table_name);
 const char * bpf_table_key_desc_id(void *program, size_t id);
 const char * bpf_table_leaf_desc(void *program, const char *table_name);
 const char * bpf_table_leaf_desc_id(void *program, size_t id);
+/* Key and leaf layouts from BTF in the format of the descriptions, or NULL */
+const char * bpf_table_key_layout_id(void *program, size_t id);
+const char * bpf_table_leaf_layout_id(void *program, size_t id);
 size_t bpf_table_key_size(void *program, const char *table_name);
 size_t bpf_table_key_size_id(void *program, size_t id);
 size_t bpf_table_leaf_size(void *program, const char *table_name);
@@ -64,6 +97,66 @@ int bpf_table_key_sscanf(void *program, size_t id, const char *buf, void *key);
 int bpf_table_leaf_sscanf(void *program, size_t id, const char *buf, void *leaf);
 size_t bpf_perf_event_fields(void *program, const char *event);
 const char * bpf_perf_event_field(void *program, const char *event, size_t i);
+/* Wall time of the compile and load phases, see BPFModule::phase_times() */
+size_t bpf_num_phases(void *program);
+const char * bpf_phase_name(void *program, size_t id);
+uint64_t bpf_phase_ns(void *program, size_t id);
+
+// Snapshot of a hash or array table reporting changes between two reads
+#define BCC_TABLE_CHANGE_ADDED 1
+#define BCC_TABLE_CHANGE_CHANGED 2
+#define BCC_TABLE_CHANGE_REMOVED 3
+
+struct bcc_table_change {
+  int kind;
+  const void *key;
+  const void *value;
+  const void *delta;
+};
+
+void * bcc_table_snapshot_new(void *program, size_t id);
+void bcc_table_snapshot_free(void *snap);
+// Returns the number of changes since the previous call, stored in *changes
+// until the next call, or -1 on error
+int bcc_table_snapshot_update(void *snap,
+                              const struct bcc_table_change **changes);
+
+// Unsigned integer field of the values of a table, summed into their score
+struct bcc_table_top_field {
+  size_t offset;
+  size_t size;
+};
+
+// Select the k entries (all of them if k is 0) of a hash table with the
+// largest score, see BPFTableTop
+void * bcc_table_top_new(void *program, size_t id,
+                         const struct bcc_table_top_field *fields,
+                         int nr_fields, size_t k);
+void bcc_table_top_free(void *top);
+// Read the table, deleting the entries read if drain is set. Returns the
+// number of entries selected, whose keys and values are stored contiguously
+// in *keys and *values until the next call, or -1 on error. *total is set to
+// the number of entries read.
+int bcc_table_top_update(void *top, int drain, const void **keys,
+                         const void **values, size_t *total);
+
+// Counts added between two reads to an array or percpu array table of u64
+// histogram slots, see BPFHistogramDelta
+void * bcc_hist_delta_new(void *program, size_t id);
+void bcc_hist_delta_free(void *hist);
+// Returns the number of slots, whose counts since the last call with advance
+// set are stored in *counts until the next call, or -1 on error
+int bcc_hist_delta_update(void *hist, int advance, const uint64_t **counts);
+
+#define BCC_HIST_LOG2 0
+#define BCC_HIST_LINEAR 1
+
+// Store in out the nq percentiles q (0 to 1) of the n slot counts, on the
+// given scale, or with slot i holding values in [bounds[i], bounds[i + 1])
+// if bounds is not NULL
+void bcc_hist_percentiles(const uint64_t *counts, size_t n, int scale,
+                          const double *bounds, const double *q, size_t nq,
+                          double *out);
 
 struct bpf_insn;
 int bcc_func_load(void *program, int prog_type, const char *name,
@@ -71,6 +164,14 @@ int bcc_func_load(void *program, int prog_type, const char *name,
                   const char *license, unsigned kern_version,
                   int log_level, char *log_buf, unsigned log_buf_size,
                   const char *dev_name);
+// Like bcc_func_load, for programs that the kernel needs to know how they will
+// be attached, e.g. BCC_TRACE_KPROBE_MULTI ones
+int bcc_func_load_attach_type(void *program, int prog_type,
+                              int expected_attach_type, const char *name,
+                              const struct bpf_insn *insns, int prog_len,
+                              const char *license, unsigned kern_version,
+                              int log_level, char *log_buf,
+                              unsigned log_buf_size, const char *dev_name);
 
 #ifdef __cplusplus
 }
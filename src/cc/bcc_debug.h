@@ -16,6 +16,10 @@
 
 #include "bpf_module.h"
 
+namespace llvm {
+class Module;
+}
+
 namespace ebpf {
 
 class SourceDebugger {
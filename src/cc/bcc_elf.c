@@ -24,6 +24,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <pthread.h>
+#include <time.h>
 #ifdef HAVE_LIBDEBUGINFOD
 #include <elfutils/debuginfod.h>
 #endif
@@ -47,8 +49,64 @@ static int openelf_fd(int fd, Elf **elf_out) {
   return 0;
 }
 
+// Identity of a file's contents, as far as stat can tell
+struct file_key {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+};
+
+static void file_key_init(struct file_key *key, const struct stat *st) {
+  // zero the padding too, keys are compared with memcmp
+  memset(key, 0, sizeof(*key));
+  key->dev = st->st_dev;
+  key->ino = st->st_ino;
+  key->size = st->st_size;
+  key->mtime = st->st_mtim;
+}
+
+// Recently closed ELF descriptors, most recently used first. Attaching
+// uprobes and resolving symbols go through several of the functions below
+// for the same binary, and a cached descriptor keeps what libelf already
+// parsed. Entries match by file identity, so a replaced binary is opened
+// again. libelf descriptors are not thread safe, so openelf() takes an entry
+// out of the cache and closeelf() puts it back.
+#define ELF_CACHE_SIZE 4
+
+struct elf_cache_entry {
+  struct file_key key;
+  Elf *e;
+  int fd;
+};
+
+static struct elf_cache_entry elf_cache[ELF_CACHE_SIZE];
+static int elf_cache_count;
+static pthread_mutex_t elf_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static int openelf(const char *path, Elf **elf_out, int *fd_out) {
-  *fd_out = open(path, O_RDONLY);
+  struct file_key key;
+  struct stat st;
+  int i;
+
+  if (stat(path, &st) == 0) {
+    file_key_init(&key, &st);
+    pthread_mutex_lock(&elf_cache_lock);
+    for (i = 0; i < elf_cache_count; i++) {
+      if (memcmp(&elf_cache[i].key, &key, sizeof(key)))
+        continue;
+      *elf_out = elf_cache[i].e;
+      *fd_out = elf_cache[i].fd;
+      elf_cache_count--;
+      memmove(&elf_cache[i], &elf_cache[i + 1],
+              (elf_cache_count - i) * sizeof(elf_cache[0]));
+      pthread_mutex_unlock(&elf_cache_lock);
+      return 0;
+    }
+    pthread_mutex_unlock(&elf_cache_lock);
+  }
+
+  *fd_out = open(path, O_RDONLY | O_CLOEXEC);
   if (*fd_out < 0)
     return -1;
 
@@ -60,6 +118,46 @@ static int openelf(const char *path, Elf **elf_out, int *fd_out) {
   return 0;
 }
 
+// Release what openelf() returned, either of them may be unset
+static void closeelf(Elf *e, int fd) {
+  struct elf_cache_entry evicted = {.e = NULL, .fd = -1};
+  struct stat st;
+
+  if (!e || fd < 0 || fstat(fd, &st) < 0) {
+    if (e)
+      elf_end(e);
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+
+  pthread_mutex_lock(&elf_cache_lock);
+  if (elf_cache_count == ELF_CACHE_SIZE)
+    evicted = elf_cache[--elf_cache_count];
+  memmove(&elf_cache[1], &elf_cache[0],
+          elf_cache_count * sizeof(elf_cache[0]));
+  file_key_init(&elf_cache[0].key, &st);
+  elf_cache[0].e = e;
+  elf_cache[0].fd = fd;
+  elf_cache_count++;
+  pthread_mutex_unlock(&elf_cache_lock);
+
+  if (evicted.e) {
+    elf_end(evicted.e);
+    close(evicted.fd);
+  }
+}
+
+static void flush_elf_cache(void) {
+  pthread_mutex_lock(&elf_cache_lock);
+  while (elf_cache_count > 0) {
+    elf_cache_count--;
+    elf_end(elf_cache[elf_cache_count].e);
+    close(elf_cache[elf_cache_count].fd);
+  }
+  pthread_mutex_unlock(&elf_cache_lock);
+}
+
 static const char *parse_stapsdt_note(struct bcc_elf_usdt *probe,
                                       GElf_Shdr *probes_shdr,
                                       const char *desc, int elf_class) {
@@ -204,8 +302,7 @@ int bcc_elf_foreach_usdt(const char *path, bcc_elf_probecb callback,
     return -1;
 
   res = listprobes(e, callback, path, payload);
-  elf_end(e);
-  close(fd);
+  closeelf(e, fd);
 
   return res;
 }
@@ -461,13 +558,27 @@ static unsigned int gnu_debuglink_crc32(unsigned int crc,
   return ~crc & 0xffffffff;
 }
 
+// CRCs of recently checked debug files. Every module that links to the same
+// debug file checks it again, and the CRC covers the whole file.
+#define CRC_CACHE_SIZE 16
+
+struct crc_cache_entry {
+  struct file_key key;
+  unsigned int crc;
+};
+
+static struct crc_cache_entry crc_cache[CRC_CACHE_SIZE];
+static int crc_cache_count, crc_cache_next;
+static pthread_mutex_t crc_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static int verify_checksum(const char *file, unsigned int crc) {
+  struct file_key key;
   struct stat st;
-  int fd;
+  int fd, i;
   void *buf;
   unsigned int actual;
 
-  fd = open(file, O_RDONLY);
+  fd = open(file, O_RDONLY | O_CLOEXEC);
   if (fd < 0)
     return 0;
 
@@ -476,8 +587,20 @@ static int verify_checksum(const char *file, unsigned int crc) {
     return 0;
   }
 
+  file_key_init(&key, &st);
+  pthread_mutex_lock(&crc_cache_lock);
+  for (i = 0; i < crc_cache_count; i++) {
+    if (!memcmp(&crc_cache[i].key, &key, sizeof(key))) {
+      actual = crc_cache[i].crc;
+      pthread_mutex_unlock(&crc_cache_lock);
+      close(fd);
+      return actual == crc;
+    }
+  }
+  pthread_mutex_unlock(&crc_cache_lock);
+
   buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-  if (!buf) {
+  if (buf == MAP_FAILED) {
     close(fd);
     return 0;
   }
@@ -486,6 +609,14 @@ static int verify_checksum(const char *file, unsigned int crc) {
 
   munmap(buf, st.st_size);
   close(fd);
+
+  pthread_mutex_lock(&crc_cache_lock);
+  crc_cache[crc_cache_next].key = key;
+  crc_cache[crc_cache_next].crc = actual;
+  crc_cache_next = (crc_cache_next + 1) % CRC_CACHE_SIZE;
+  if (crc_cache_count < CRC_CACHE_SIZE)
+    crc_cache_count++;
+  pthread_mutex_unlock(&crc_cache_lock);
   return actual == crc;
 }
 
@@ -613,13 +744,7 @@ static char *find_debug_via_symfs(Elf *e, const char* path) {
   result = strdup(fullpath);
 
 out:
-  if (symfs_e) {
-    elf_end(symfs_e);
-  }
-
-  if (symfs_fd != -1) {
-    close(symfs_fd);
-  }
+  closeelf(symfs_e, symfs_fd);
 
   return result;
 }
@@ -649,8 +774,138 @@ static char *find_debug_via_debuginfod(Elf *e){
 }
 #endif
 
+// Debug files found, or not found, for binaries by build-id. Looking them up
+// touches several directories and possibly debuginfod, and profilers do it
+// again for every process running the same binary. Not found results expire
+// after $BCC_DEBUGINFO_NEGATIVE_TTL seconds, so that installing a debuginfo
+// package takes effect. With $BCC_SYM_CACHE_DIR set, results are also kept
+// on disk, as files containing the debug file path or nothing.
+#define DEBUG_FILE_CACHE_SIZE 64
+#define DEBUG_FILE_NEGATIVE_TTL 300
+
+struct debug_file_entry {
+  char buildid[128];
+  int check_crc;
+  char *debug_file;
+  time_t time;
+};
+
+static struct debug_file_entry debug_file_cache[DEBUG_FILE_CACHE_SIZE];
+static int debug_file_cache_count, debug_file_cache_next;
+static pthread_mutex_t debug_file_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static time_t debug_file_negative_ttl(void) {
+  const char *ttl = getenv("BCC_DEBUGINFO_NEGATIVE_TTL");
+  if (ttl && *ttl)
+    return strtol(ttl, NULL, 10);
+  return DEBUG_FILE_NEGATIVE_TTL;
+}
+
+static int debug_file_memo_path(char *out, size_t len, const char *buildid,
+                                int check_crc) {
+  const char *dir = getenv("BCC_SYM_CACHE_DIR");
+  int res;
+
+  if (!dir || !*dir)
+    return 0;
+  res = snprintf(out, len, "%s/%s.%d.debuglookup", dir, buildid, check_crc);
+  return res > 0 && res < len;
+}
+
+// Returns 1 and sets debug_file, which may be NULL for a binary known to have
+// no debug file, if there is a valid result for buildid.
+static int lookup_debug_file(const char *buildid, int check_crc,
+                             char **debug_file) {
+  char memo_path[PATH_MAX], buf[PATH_MAX];
+  time_t now = time(NULL), ttl = debug_file_negative_ttl();
+  struct stat st;
+  FILE *memo;
+  size_t len;
+  int i, found = 0;
+
+  pthread_mutex_lock(&debug_file_cache_lock);
+  for (i = 0; i < debug_file_cache_count; i++) {
+    struct debug_file_entry *entry = &debug_file_cache[i];
+    if (entry->check_crc != check_crc || strcmp(entry->buildid, buildid))
+      continue;
+    if (entry->debug_file ? access(entry->debug_file, F_OK) == 0
+                          : now - entry->time < ttl) {
+      *debug_file = entry->debug_file ? strdup(entry->debug_file) : NULL;
+      found = 1;
+    }
+    break;
+  }
+  pthread_mutex_unlock(&debug_file_cache_lock);
+  if (found)
+    return 1;
+
+  if (!debug_file_memo_path(memo_path, sizeof(memo_path), buildid, check_crc) ||
+      stat(memo_path, &st) < 0)
+    return 0;
+  if (st.st_size == 0) {
+    if (now - st.st_mtime >= ttl)
+      return 0;
+    *debug_file = NULL;
+    return 1;
+  }
+
+  memo = fopen(memo_path, "re");
+  if (!memo)
+    return 0;
+  len = fread(buf, 1, sizeof(buf) - 1, memo);
+  fclose(memo);
+  buf[len] = '\0';
+  if (len == 0 || access(buf, F_OK) < 0)
+    return 0;
+  *debug_file = strdup(buf);
+  return 1;
+}
+
+static void store_debug_file(const char *buildid, int check_crc,
+                             const char *debug_file) {
+  char memo_path[PATH_MAX], tmp_path[PATH_MAX + 32];
+  struct debug_file_entry *entry;
+  FILE *memo;
+  int i;
+
+  pthread_mutex_lock(&debug_file_cache_lock);
+  for (i = 0; i < debug_file_cache_count; i++) {
+    if (debug_file_cache[i].check_crc == check_crc &&
+        !strcmp(debug_file_cache[i].buildid, buildid))
+      break;
+  }
+  if (i == debug_file_cache_count) {
+    i = debug_file_cache_next;
+    debug_file_cache_next = (debug_file_cache_next + 1) % DEBUG_FILE_CACHE_SIZE;
+    if (debug_file_cache_count < DEBUG_FILE_CACHE_SIZE)
+      debug_file_cache_count++;
+  }
+  entry = &debug_file_cache[i];
+  free(entry->debug_file);
+  snprintf(entry->buildid, sizeof(entry->buildid), "%s", buildid);
+  entry->check_crc = check_crc;
+  entry->debug_file = debug_file ? strdup(debug_file) : NULL;
+  entry->time = time(NULL);
+  pthread_mutex_unlock(&debug_file_cache_lock);
+
+  if (!debug_file_memo_path(memo_path, sizeof(memo_path), buildid, check_crc))
+    return;
+  mkdir(getenv("BCC_SYM_CACHE_DIR"), 0755);
+  // Write a private file first, so readers never see a partial path
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%d", memo_path, (int)getpid());
+  memo = fopen(tmp_path, "we");
+  if (!memo)
+    return;
+  if (debug_file)
+    fputs(debug_file, memo);
+  if (fclose(memo) || rename(tmp_path, memo_path))
+    unlink(tmp_path);
+}
+
 static char *find_debug_file(Elf* e, const char* path, int check_crc) {
   char *debug_file = NULL;
+  char buildid[128];
+  int has_buildid;
 
   // If there is a separate debuginfo file, try to locate and read it, first
   // using symfs, then using the build-id section, finally using the debuglink
@@ -659,8 +914,15 @@ static char *find_debug_file(Elf* e, const char* path, int check_crc) {
   // - https://github.com/torvalds/linux/blob/v5.2/tools/perf/Documentation/perf-report.txt#L325
   // - https://sourceware.org/gdb/onlinedocs/gdb/Separate-Debug-Files.html
   debug_file = find_debug_via_symfs(e, path);
-  if (!debug_file)
-    debug_file = find_debug_via_buildid(e);
+  if (debug_file)
+    return debug_file;
+
+  // symfs depends on the path, everything else on the contents
+  has_buildid = find_buildid(e, buildid);
+  if (has_buildid && lookup_debug_file(buildid, check_crc, &debug_file))
+    return debug_file;
+
+  debug_file = find_debug_via_buildid(e);
   if (!debug_file)
     debug_file = find_debug_via_debuglink(e, path, check_crc);
 #ifdef HAVE_LIBDEBUGINFOD
@@ -668,6 +930,8 @@ static char *find_debug_file(Elf* e, const char* path, int check_crc) {
     debug_file = find_debug_via_debuginfod(e);
 #endif
 
+  if (has_buildid)
+    store_debug_file(buildid, check_crc, debug_file);
   return debug_file;
 }
 
@@ -698,8 +962,7 @@ static int foreach_sym_core(const char *path, bcc_elf_symcb callback,
   }
 
   res = listsymbols(e, callback, callback_lazy, payload, option, is_debug_file);
-  elf_end(e);
-  close(fd);
+  closeelf(e, fd);
   return res;
 }
 
@@ -745,10 +1008,7 @@ int bcc_elf_get_text_scn_info(const char *path, uint64_t *addr,
   }
 
 exit:
-  if (e)
-    elf_end(e);
-  if (fd >= 0)
-    close(fd);
+  closeelf(e, fd);
   return err;
 }
 
@@ -780,10 +1040,7 @@ int bcc_elf_foreach_load_section(const char *path,
   err = 0;
 
 exit:
-  if (e)
-    elf_end(e);
-  if (fd >= 0)
-    close(fd);
+  closeelf(e, fd);
   return err;
 }
 
@@ -797,8 +1054,7 @@ int bcc_elf_get_type(const char *path) {
     return -1;
 
   res = (void*)gelf_getehdr(e, &hdr);
-  elf_end(e);
-  close(fd);
+  closeelf(e, fd);
 
   if (!res)
     return -1;
@@ -880,10 +1136,13 @@ int bcc_elf_foreach_vdso_sym(bcc_elf_symcb callback, void *payload) {
   return listsymbols(elf, callback, NULL, payload, &default_option, 0);
 }
 
+// Drop the pages of the section of function sym_name in the ELF file at
+// path, mapped with sym_name at addr, or else at base + its value.
 // return value: 0   : success
 //               < 0 : error and no bcc lib found
 //               > 0 : error and bcc lib found
-static int bcc_free_memory_with_file(const char *path) {
+static int free_text(const char *path, const char *sym_name,
+                     const void *addr, unsigned long base) {
   unsigned long sym_addr = 0, sym_shndx;
   Elf_Scn *section = NULL;
   int fd = -1, err;
@@ -893,7 +1152,7 @@ static int bcc_free_memory_with_file(const char *path) {
   if ((err = openelf(path, &e, &fd)) < 0)
     goto exit;
 
-  // get symbol address of "bcc_free_memory", which
+  // get symbol address of sym_name, which
   // will be used to calculate runtime .text address
   // range, esp. for shared libraries.
   err = -1;
@@ -925,7 +1184,7 @@ static int bcc_free_memory_with_file(const char *path) {
         if ((name = elf_strptr(e, header.sh_link, sym.st_name)) == NULL)
           continue;
 
-        if (strcmp(name, "bcc_free_memory") == 0) {
+        if (strcmp(name, sym_name) == 0) {
           sym_addr = sym.st_value;
           sym_shndx = sym.st_shndx;
           break;
@@ -934,7 +1193,7 @@ static int bcc_free_memory_with_file(const char *path) {
     }
   }
 
-  // Didn't find bcc_free_memory in the ELF file.
+  // Didn't find sym_name in the ELF file.
   if (sym_addr == 0)
     goto exit;
 
@@ -950,7 +1209,9 @@ static int bcc_free_memory_with_file(const char *path) {
       unsigned long saddr, saddr_n, eaddr;
       long page_size = sysconf(_SC_PAGESIZE);
 
-      saddr = (unsigned long)bcc_free_memory - sym_addr + header.sh_addr;
+      if (addr)
+        base = (unsigned long)addr - sym_addr;
+      saddr = base + header.sh_addr;
       eaddr = saddr + header.sh_size;
 
       // adjust saddr and eaddr, start addr needs to be page aligned
@@ -968,13 +1229,14 @@ static int bcc_free_memory_with_file(const char *path) {
   }
 
 exit:
-  if (e)
-    elf_end(e);
-  if (fd >= 0)
-    close(fd);
+  closeelf(e, fd);
   return err;
 }
 
+static int bcc_free_memory_with_file(const char *path) {
+  return free_text(path, "bcc_free_memory", (void *)bcc_free_memory, 0);
+}
+
 // Free bcc mmemory
 //
 // The main purpose of this function is to free llvm/clang text memory
@@ -995,6 +1257,9 @@ exit:
 int bcc_free_memory() {
   int err;
 
+  // Cached descriptors hold parsed ELF data as well
+  flush_elf_cache();
+
   // First try whether bcc is statically linked or not
   err = bcc_free_memory_with_file("/proc/self/exe");
   if (err >= 0)
@@ -1008,8 +1273,8 @@ int bcc_free_memory() {
   char *line = NULL;
   size_t size;
   while (getline(&line, &size, maps) > 0) {
-    char *libbcc = strstr(line, "libbcc.so");
-    if (!libbcc)
+    int compiler = strstr(line, "libbcc_compiler.so") != NULL;
+    if (!compiler && !strstr(line, "libbcc.so"))
       continue;
 
     // Parse the line and get the full libbcc.so path
@@ -1027,8 +1292,14 @@ int bcc_free_memory() {
     char libbcc_path[4096];
     memcpy(libbcc_path, line + path_start, path_end - path_start);
     libbcc_path[path_end - path_start] = '\0';
-    err = bcc_free_memory_with_file(libbcc_path);
-    err = (err <= 0) ? err : -err;
+    if (!compiler) {
+      err = bcc_free_memory_with_file(libbcc_path);
+      err = (err <= 0) ? err : -err;
+    } else if (offset == 0) {
+      // libbcc_compiler is dlopen()ed with local symbols, so it is found
+      // from the mapping of its first segment, at the start of the library.
+      free_text(libbcc_path, "bcc_compiler_new", NULL, addr_start);
+    }
   }
 
   fclose(maps);
@@ -1038,18 +1309,537 @@ int bcc_free_memory() {
 
 int bcc_elf_get_buildid(const char *path, char *buildid)
 {
+  Elf *e;
+  int fd, found;
+
+  if (openelf(path, &e, &fd) < 0)
+    return -1;
+
+  found = find_buildid(e, buildid);
+  closeelf(e, fd);
+  return found ? 0 : -1;
+}
+
+char *bcc_elf_get_dwarf_file(const char *path, void *option) {
+  struct bcc_symbol_option *o = option;
+  GElf_Shdr header;
+  char *dwarf_file = NULL;
   Elf *e;
   int fd;
 
   if (openelf(path, &e, &fd) < 0)
+    return NULL;
+
+  // Stripped files may keep the section header with NOBITS contents
+  if (get_section(e, ".debug_info", &header, NULL) &&
+      header.sh_type != SHT_NOBITS)
+    dwarf_file = strdup(path);
+  else if (o->use_debug_file)
+    dwarf_file = find_debug_file(e, path, o->check_debug_file_crc);
+
+  closeelf(e, fd);
+  return dwarf_file;
+}
+
+// .eh_frame parsing, see bcc_elf_get_cfi_rows()
+
+#define DW_EH_PE_omit 0xff
+#define DW_EH_PE_absptr 0x00
+#define DW_EH_PE_uleb128 0x01
+#define DW_EH_PE_udata2 0x02
+#define DW_EH_PE_udata4 0x03
+#define DW_EH_PE_udata8 0x04
+#define DW_EH_PE_sleb128 0x09
+#define DW_EH_PE_sdata2 0x0a
+#define DW_EH_PE_sdata4 0x0b
+#define DW_EH_PE_sdata8 0x0c
+#define DW_EH_PE_pcrel 0x10
+
+// x86_64 DWARF register numbers
+#define CFI_REG_BP 6
+#define CFI_REG_SP 7
+#define CFI_STATE_STACK 8
+
+struct cfi_reader {
+  const uint8_t *p;
+  const uint8_t *end;
+  // section data and its virtual address, for pc relative pointers
+  const uint8_t *base;
+  uint64_t vaddr;
+  int err;
+};
+
+struct cfi_state {
+  uint64_t cfa_reg;
+  int64_t cfa_offset;
+  int cfa_expr;
+  // bp is saved at CFA + bp_offset, if bp_saved
+  int bp_saved;
+  int64_t bp_offset;
+};
+
+struct cfi_cie {
+  uint64_t code_align;
+  int64_t data_align;
+  uint8_t fde_encoding;
+  int has_aug_data;
+  const uint8_t *insns;
+  const uint8_t *insns_end;
+};
+
+struct cfi_rows {
+  struct bcc_cfi_row *rows;
+  size_t cnt;
+  size_t cap;
+};
+
+static const uint8_t *cfi_take(struct cfi_reader *r, size_t n) {
+  const uint8_t *p = r->p;
+  if (r->err || (size_t)(r->end - r->p) < n) {
+    r->err = 1;
+    return NULL;
+  }
+  r->p += n;
+  return p;
+}
+
+static uint64_t cfi_read_u(struct cfi_reader *r, size_t n) {
+  const uint8_t *p = cfi_take(r, n);
+  uint64_t v = 0;
+  size_t i;
+  if (!p)
+    return 0;
+  // little endian, as x86_64 is
+  for (i = 0; i < n; i++)
+    v |= (uint64_t)p[i] << (8 * i);
+  return v;
+}
+
+static int64_t cfi_read_s(struct cfi_reader *r, size_t n) {
+  uint64_t v = cfi_read_u(r, n);
+  if (n < 8 && (v & (1ull << (8 * n - 1))))
+    v |= ~0ull << (8 * n);
+  return (int64_t)v;
+}
+
+static uint64_t cfi_read_uleb(struct cfi_reader *r) {
+  uint64_t v = 0;
+  unsigned shift = 0;
+  const uint8_t *b;
+  do {
+    if (!(b = cfi_take(r, 1)))
+      return 0;
+    if (shift < 64)
+      v |= (uint64_t)(*b & 0x7f) << shift;
+    shift += 7;
+  } while (*b & 0x80);
+  return v;
+}
+
+static int64_t cfi_read_sleb(struct cfi_reader *r) {
+  uint64_t v = 0;
+  unsigned shift = 0;
+  const uint8_t *b;
+  do {
+    if (!(b = cfi_take(r, 1)))
+      return 0;
+    if (shift < 64)
+      v |= (uint64_t)(*b & 0x7f) << shift;
+    shift += 7;
+  } while (*b & 0x80);
+  if (shift < 64 && (*b & 0x40))
+    v |= ~0ull << shift;
+  return (int64_t)v;
+}
+
+static uint64_t cfi_read_encoded(struct cfi_reader *r, uint8_t enc) {
+  uint64_t pos = r->vaddr + (r->p - r->base);
+  uint64_t v;
+
+  switch (enc & 0x0f) {
+  case DW_EH_PE_absptr: v = cfi_read_u(r, 8); break;
+  case DW_EH_PE_uleb128: v = cfi_read_uleb(r); break;
+  case DW_EH_PE_udata2: v = cfi_read_u(r, 2); break;
+  case DW_EH_PE_udata4: v = cfi_read_u(r, 4); break;
+  case DW_EH_PE_udata8: v = cfi_read_u(r, 8); break;
+  case DW_EH_PE_sleb128: v = cfi_read_sleb(r); break;
+  case DW_EH_PE_sdata2: v = cfi_read_s(r, 2); break;
+  case DW_EH_PE_sdata4: v = cfi_read_s(r, 4); break;
+  case DW_EH_PE_sdata8: v = cfi_read_s(r, 8); break;
+  default: r->err = 1; return 0;
+  }
+  // text and data relative pointers and indirections are not used for the
+  // pc ranges of FDEs in practice
+  switch (enc & 0x70) {
+  case 0: break;
+  case DW_EH_PE_pcrel: v += pos; break;
+  default: r->err = 1; return 0;
+  }
+  return v;
+}
+
+static int cfi_parse_cie(struct cfi_reader *r, struct cfi_cie *cie) {
+  const char *aug;
+  uint8_t version = cfi_read_u(r, 1);
+  const uint8_t *aug_end = NULL;
+
+  aug = (const char *)r->p;
+  if (!memchr(aug, 0, r->end - r->p))
     return -1;
+  r->p += strlen(aug) + 1;
+  if (version >= 4)
+    cfi_take(r, 2);  // address and segment selector sizes
+  cie->code_align = cfi_read_uleb(r);
+  cie->data_align = cfi_read_sleb(r);
+  if (version == 1)
+    cfi_read_u(r, 1);
+  else
+    cfi_read_uleb(r);
+  cie->fde_encoding = DW_EH_PE_absptr;
+  cie->has_aug_data = aug[0] == 'z';
 
-  if (!find_buildid(e, buildid))
+  if (cie->has_aug_data) {
+    uint64_t len = cfi_read_uleb(r);
+    if (r->err || len > (uint64_t)(r->end - r->p))
+      return -1;
+    aug_end = r->p + len;
+    for (aug++; *aug && !r->err; aug++) {
+      if (*aug == 'R') {
+        cie->fde_encoding = cfi_read_u(r, 1);
+      } else if (*aug == 'L') {
+        cfi_read_u(r, 1);
+      } else if (*aug == 'P') {
+        uint8_t enc = cfi_read_u(r, 1);
+        cfi_read_encoded(r, enc & 0x7f);
+      } else if (*aug != 'S') {
+        // the length lets unknown augmentations be skipped
+        break;
+      }
+    }
+    r->p = aug_end;
+  } else if (aug[0]) {
     return -1;
+  }
+
+  cie->insns = r->p;
+  cie->insns_end = r->end;
+  return r->err ? -1 : 0;
+}
 
+static int cfi_push_row(struct cfi_rows *rows, uint64_t pc,
+                        const struct cfi_state *s, int undefined) {
+  struct bcc_cfi_row row = {.pc = pc};
+
+  if (!undefined && !s->cfa_expr &&
+      (s->cfa_reg == CFI_REG_SP || s->cfa_reg == CFI_REG_BP) &&
+      s->cfa_offset >= INT32_MIN && s->cfa_offset <= INT32_MAX) {
+    row.cfa_reg = s->cfa_reg == CFI_REG_SP ? BCC_CFI_CFA_SP : BCC_CFI_CFA_BP;
+    row.cfa_offset = s->cfa_offset;
+    if (s->bp_saved && s->bp_offset >= INT16_MIN && s->bp_offset <= INT16_MAX &&
+        s->bp_offset)
+      row.bp_offset = s->bp_offset;
+  }
+
+  // a later row for the same pc replaces the previous one
+  if (rows->cnt && rows->rows[rows->cnt - 1].pc == pc) {
+    rows->rows[rows->cnt - 1] = row;
+    return 0;
+  }
+  if (rows->cnt == rows->cap) {
+    size_t cap = rows->cap ? rows->cap * 2 : 1024;
+    struct bcc_cfi_row *p = realloc(rows->rows, cap * sizeof(*p));
+    if (!p)
+      return -1;
+    rows->rows = p;
+    rows->cap = cap;
+  }
+  rows->rows[rows->cnt++] = row;
   return 0;
 }
 
+// Run the CFA instructions [p, end), from the state in *s at pc. With
+// rows, a row is added whenever the location advances, and for the last
+// location; initial is the state after the CIE instructions.
+static int cfi_run(const uint8_t *p, const uint8_t *end,
+                   const struct cfi_cie *cie, struct cfi_state *s,
+                   const struct cfi_state *initial, uint64_t pc,
+                   struct cfi_rows *rows) {
+  struct cfi_reader r = {.p = p, .end = end, .base = p};
+  struct cfi_state stack[CFI_STATE_STACK];
+  int depth = 0;
+
+  while (r.p < r.end && !r.err) {
+    uint8_t op = cfi_read_u(&r, 1);
+    uint64_t reg, delta = 0;
+    int64_t off;
+
+    switch (op >> 6) {
+    case 1:  // DW_CFA_advance_loc
+      delta = (op & 0x3f) * cie->code_align;
+      goto advance;
+    case 2:  // DW_CFA_offset
+      off = cfi_read_uleb(&r) * cie->data_align;
+      if ((op & 0x3f) == CFI_REG_BP) {
+        s->bp_saved = 1;
+        s->bp_offset = off;
+      }
+      continue;
+    case 3:  // DW_CFA_restore
+      if ((op & 0x3f) == CFI_REG_BP && initial) {
+        s->bp_saved = initial->bp_saved;
+        s->bp_offset = initial->bp_offset;
+      }
+      continue;
+    }
+
+    switch (op) {
+    case 0x00:  // DW_CFA_nop
+      break;
+    case 0x02:  // DW_CFA_advance_loc1
+      delta = cfi_read_u(&r, 1) * cie->code_align;
+      goto advance;
+    case 0x03:  // DW_CFA_advance_loc2
+      delta = cfi_read_u(&r, 2) * cie->code_align;
+      goto advance;
+    case 0x04:  // DW_CFA_advance_loc4
+      delta = cfi_read_u(&r, 4) * cie->code_align;
+      goto advance;
+    case 0x05:  // DW_CFA_offset_extended
+      reg = cfi_read_uleb(&r);
+      off = cfi_read_uleb(&r) * cie->data_align;
+      if (reg == CFI_REG_BP) {
+        s->bp_saved = 1;
+        s->bp_offset = off;
+      }
+      break;
+    case 0x11:  // DW_CFA_offset_extended_sf
+      reg = cfi_read_uleb(&r);
+      off = cfi_read_sleb(&r) * cie->data_align;
+      if (reg == CFI_REG_BP) {
+        s->bp_saved = 1;
+        s->bp_offset = off;
+      }
+      break;
+    case 0x06:  // DW_CFA_restore_extended
+      reg = cfi_read_uleb(&r);
+      if (reg == CFI_REG_BP && initial) {
+        s->bp_saved = initial->bp_saved;
+        s->bp_offset = initial->bp_offset;
+      }
+      break;
+    case 0x07:  // DW_CFA_undefined
+    case 0x08:  // DW_CFA_same_value
+      if (cfi_read_uleb(&r) == CFI_REG_BP)
+        s->bp_saved = 0;
+      break;
+    case 0x09:  // DW_CFA_register
+      reg = cfi_read_uleb(&r);
+      cfi_read_uleb(&r);
+      if (reg == CFI_REG_BP)
+        s->bp_saved = 0;
+      break;
+    case 0x0a:  // DW_CFA_remember_state
+      if (depth == CFI_STATE_STACK)
+        return -1;
+      stack[depth++] = *s;
+      break;
+    case 0x0b:  // DW_CFA_restore_state
+      if (!depth)
+        return -1;
+      *s = stack[--depth];
+      break;
+    case 0x0c:  // DW_CFA_def_cfa
+      s->cfa_reg = cfi_read_uleb(&r);
+      s->cfa_offset = cfi_read_uleb(&r);
+      s->cfa_expr = 0;
+      break;
+    case 0x12:  // DW_CFA_def_cfa_sf
+      s->cfa_reg = cfi_read_uleb(&r);
+      s->cfa_offset = cfi_read_sleb(&r) * cie->data_align;
+      s->cfa_expr = 0;
+      break;
+    case 0x0d:  // DW_CFA_def_cfa_register
+      s->cfa_reg = cfi_read_uleb(&r);
+      s->cfa_expr = 0;
+      break;
+    case 0x0e:  // DW_CFA_def_cfa_offset
+      s->cfa_offset = cfi_read_uleb(&r);
+      break;
+    case 0x13:  // DW_CFA_def_cfa_offset_sf
+      s->cfa_offset = cfi_read_sleb(&r) * cie->data_align;
+      break;
+    case 0x0f:  // DW_CFA_def_cfa_expression
+      s->cfa_expr = 1;
+      cfi_take(&r, cfi_read_uleb(&r));
+      break;
+    case 0x10:  // DW_CFA_expression
+    case 0x16:  // DW_CFA_val_expression
+      if (cfi_read_uleb(&r) == CFI_REG_BP)
+        s->bp_saved = 0;
+      cfi_take(&r, cfi_read_uleb(&r));
+      break;
+    case 0x14:  // DW_CFA_val_offset
+      if (cfi_read_uleb(&r) == CFI_REG_BP)
+        s->bp_saved = 0;
+      cfi_read_uleb(&r);
+      break;
+    case 0x15:  // DW_CFA_val_offset_sf
+      if (cfi_read_uleb(&r) == CFI_REG_BP)
+        s->bp_saved = 0;
+      cfi_read_sleb(&r);
+      break;
+    case 0x2e:  // DW_CFA_GNU_args_size
+      cfi_read_uleb(&r);
+      break;
+    case 0x2f:  // DW_CFA_GNU_negative_offset_extended
+      reg = cfi_read_uleb(&r);
+      off = -(int64_t)cfi_read_uleb(&r) * cie->data_align;
+      if (reg == CFI_REG_BP) {
+        s->bp_saved = 1;
+        s->bp_offset = off;
+      }
+      break;
+    default:
+      // DW_CFA_set_loc and vendor extensions
+      return -1;
+    }
+    continue;
+
+  advance:
+    if (rows && cfi_push_row(rows, pc, s, 0) < 0)
+      return -1;
+    pc += delta;
+  }
+  if (r.err)
+    return -1;
+  if (rows && cfi_push_row(rows, pc, s, 0) < 0)
+    return -1;
+  return 0;
+}
+
+static int cfi_row_cmp(const void *a, const void *b) {
+  const struct bcc_cfi_row *x = a, *y = b;
+  if (x->pc != y->pc)
+    return x->pc < y->pc ? -1 : 1;
+  // the end of a function before the start of the next one
+  return (x->cfa_reg != BCC_CFI_CFA_UNDEFINED) -
+         (y->cfa_reg != BCC_CFI_CFA_UNDEFINED);
+}
+
+static int parse_eh_frame(const uint8_t *data, size_t size, uint64_t vaddr,
+                          struct bcc_cfi_row **out) {
+  struct cfi_rows rows = {0};
+  const uint8_t *p = data, *end = data + size;
+  const uint8_t *last_cie = NULL;
+  struct cfi_cie cie;
+  struct cfi_state initial;
+  size_t i, n;
+
+  while (p < end) {
+    struct cfi_reader r = {.p = p, .end = end, .base = data, .vaddr = vaddr};
+    uint64_t len = cfi_read_u(&r, 4);
+    const uint8_t *id_pos, *entry_end;
+    uint32_t id;
+
+    if (len == 0xffffffff)
+      len = cfi_read_u(&r, 8);
+    if (r.err || len > (uint64_t)(end - r.p))
+      goto error;
+    // a zero length entry terminates the section
+    if (len == 0)
+      break;
+    entry_end = r.p + len;
+    r.end = entry_end;
+    id_pos = r.p;
+    id = cfi_read_u(&r, 4);
+    p = entry_end;
+    if (id == 0)
+      continue;
+
+    // FDE, whose CIE is id bytes before the id
+    const uint8_t *cie_pos = id_pos - id;
+    if (cie_pos < data || cie_pos >= end)
+      goto error;
+    if (cie_pos != last_cie) {
+      struct cfi_reader cr = {.p = cie_pos, .end = end, .base = data,
+                              .vaddr = vaddr};
+      uint64_t cie_len = cfi_read_u(&cr, 4);
+      if (cie_len == 0xffffffff || cr.err || cie_len > (uint64_t)(end - cr.p))
+        goto error;
+      cr.end = cr.p + cie_len;
+      if (cfi_read_u(&cr, 4) != 0 || cfi_parse_cie(&cr, &cie) < 0)
+        goto error;
+      memset(&initial, 0, sizeof(initial));
+      if (cfi_run(cie.insns, cie.insns_end, &cie, &initial, NULL, 0, NULL) < 0)
+        goto error;
+      last_cie = cie_pos;
+    }
+
+    uint64_t pc = cfi_read_encoded(&r, cie.fde_encoding);
+    uint64_t pc_range = cfi_read_encoded(&r, cie.fde_encoding & 0x0f);
+    if (cie.has_aug_data)
+      cfi_take(&r, cfi_read_uleb(&r));
+    if (r.err)
+      goto error;
+    // functions whose unwind information can't be read can still be
+    // unwound with frame pointers
+    struct cfi_state s = initial;
+    size_t mark = rows.cnt;
+    if (cfi_run(r.p, entry_end, &cie, &s, &initial, pc, &rows) < 0)
+      rows.cnt = mark;
+    if (cfi_push_row(&rows, pc + pc_range, &s, 1) < 0)
+      goto error;
+  }
+
+  if (!rows.cnt)
+    goto error;
+  qsort(rows.rows, rows.cnt, sizeof(*rows.rows), cfi_row_cmp);
+  // drop the ends of functions followed by another one, and rows which
+  // repeat the previous one
+  for (i = 0, n = 0; i < rows.cnt; i++) {
+    struct bcc_cfi_row *row = &rows.rows[i];
+    if (i + 1 < rows.cnt && rows.rows[i + 1].pc == row->pc)
+      continue;
+    if (n && rows.rows[n - 1].cfa_reg == row->cfa_reg &&
+        rows.rows[n - 1].cfa_offset == row->cfa_offset &&
+        rows.rows[n - 1].bp_offset == row->bp_offset)
+      continue;
+    rows.rows[n++] = *row;
+  }
+  *out = rows.rows;
+  return n;
+
+error:
+  free(rows.rows);
+  return -1;
+}
+
+int bcc_elf_get_cfi_rows(const char *path, struct bcc_cfi_row **rows) {
+  GElf_Ehdr ehdr;
+  GElf_Shdr header;
+  Elf_Scn *section;
+  Elf_Data *data;
+  Elf *e;
+  int fd, res = -1;
+
+  if (openelf(path, &e, &fd) < 0)
+    return -1;
+
+  if (!gelf_getehdr(e, &ehdr) || ehdr.e_machine != EM_X86_64 ||
+      ehdr.e_ident[EI_DATA] != ELFDATA2LSB)
+    goto exit;
+  section = get_section(e, ".eh_frame", &header, NULL);
+  if (!section || header.sh_type == SHT_NOBITS)
+    goto exit;
+  data = elf_getdata(section, NULL);
+  if (data && data->d_buf && data->d_size)
+    res = parse_eh_frame(data->d_buf, data->d_size, header.sh_addr, rows);
+
+exit:
+  closeelf(e, fd);
+  return res;
+}
+
 int bcc_elf_symbol_str(const char *path, size_t section_idx,
                        size_t str_table_idx, char *out, size_t len,
                        int debugfile)
@@ -1093,14 +1883,8 @@ int bcc_elf_symbol_str(const char *path, size_t section_idx,
 exit:
   if (debug_file)
     free(debug_file);
-  if (e)
-    elf_end(e);
-  if (d)
-    elf_end(d);
-  if (fd >= 0)
-    close(fd);
-  if (dfd >= 0)
-    close(dfd);
+  closeelf(e, fd);
+  closeelf(d, dfd);
   return err;
 }
 
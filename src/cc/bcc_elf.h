@@ -50,6 +50,24 @@ typedef int (*bcc_elf_symcb_lazy)(size_t, size_t, size_t, uint64_t, uint64_t,
 // Callback returning a negative value indicates to stop the iteration
 typedef int (*bcc_elf_load_sectioncb)(uint64_t, uint64_t, uint64_t, void *);
 
+// How to unwind one frame of x86_64 code from pc up to the pc of the next
+// row, as described by the .eh_frame section: the CFA (the stack pointer
+// before the call) is sp or bp plus cfa_offset, the return address is
+// stored at CFA - 8 and, if bp_offset is not 0, the caller's bp at
+// CFA + bp_offset. Rows whose CFA is BCC_CFI_CFA_UNDEFINED, like the end
+// of a function or a CFA computed by a DWARF expression, can't be unwound.
+#define BCC_CFI_CFA_UNDEFINED 0
+#define BCC_CFI_CFA_SP 1
+#define BCC_CFI_CFA_BP 2
+
+struct bcc_cfi_row {
+  uint64_t pc;
+  int32_t cfa_offset;
+  int16_t bp_offset;
+  uint8_t cfa_reg;
+  uint8_t pad;
+};
+
 // Iterate over all USDT probes noted in a binary module
 // Returns -1 on error, and 0 on success
 int bcc_elf_foreach_usdt(const char *path, bcc_elf_probecb callback,
@@ -82,6 +100,15 @@ int bcc_elf_is_exe(const char *path);
 int bcc_elf_is_vdso(const char *name);
 int bcc_free_memory();
 int bcc_elf_get_buildid(const char *path, char *buildid);
+// Path of the file holding the DWARF of path: path itself if it has a
+// .debug_info section, otherwise its separate debug file if option allows
+// using one. Returns NULL if there is none, the result must be freed.
+char *bcc_elf_get_dwarf_file(const char *path, void *option);
+// Unwind table of an x86_64 ELF, from its .eh_frame section: rows sorted by
+// pc, addresses being ELF virtual addresses. Returns the number of rows,
+// stored in *rows which must be freed, or -1 on error or if the file has
+// no usable .eh_frame.
+int bcc_elf_get_cfi_rows(const char *path, struct bcc_cfi_row **rows);
 int bcc_elf_symbol_str(const char *path, size_t section_idx,
                        size_t str_table_idx, char *out, size_t len,
                        int debugfile);
@@ -0,0 +1,370 @@
+/*
+ * Copyright (c) 2021 Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include "bcc_features.h"
+#include "bcc_proc.h"
+#include "libbpf.h"
+
+#define FEATURES_PREFIX "features."
+
+// Results of the current boot and set of modules, "<feature> <arg>" each,
+// with "-" for no arg
+struct feature_result {
+  char *key;
+  int value;
+};
+
+static pthread_mutex_t features_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct feature_result *results;
+static size_t results_cnt, results_cap;
+static bool results_loaded;
+static uint64_t results_modules;
+static char results_path[PATH_MAX];
+
+static int add_result(const char *key, int value) {
+  char *k;
+
+  if (results_cnt == results_cap) {
+    size_t cap = results_cap ? results_cap * 2 : 32;
+    struct feature_result *r = realloc(results, cap * sizeof(*r));
+    if (!r)
+      return -1;
+    results = r;
+    results_cap = cap;
+  }
+  if (!(k = strdup(key)))
+    return -1;
+  results[results_cnt].key = k;
+  results[results_cnt].value = value;
+  results_cnt++;
+  return 0;
+}
+
+static void clear_results(void) {
+  size_t i;
+
+  for (i = 0; i < results_cnt; i++)
+    free(results[i].key);
+  results_cnt = 0;
+}
+
+static const struct feature_result *find_result(const char *key) {
+  size_t i;
+
+  for (i = 0; i < results_cnt; i++) {
+    if (!strcmp(results[i].key, key))
+      return &results[i];
+  }
+  return NULL;
+}
+
+// Same directory as the object cache of the Python frontend
+static bool cache_dir(char *dir, size_t size) {
+  const char *env = getenv("BCC_OBJ_CACHE_DIR");
+  int n;
+
+  if (env && *env) {
+    n = snprintf(dir, size, "%s", env);
+  } else if ((env = getenv("XDG_CACHE_HOME")) && *env) {
+    mkdir(env, 0755);
+    n = snprintf(dir, size, "%s/bcc", env);
+  } else if ((env = getenv("HOME")) && *env) {
+    char parent[PATH_MAX];
+    snprintf(parent, sizeof(parent), "%s/.cache", env);
+    mkdir(parent, 0755);
+    n = snprintf(dir, size, "%s/.cache/bcc", env);
+  } else {
+    return false;
+  }
+  if (n < 0 || (size_t)n >= size)
+    return false;
+  mkdir(dir, 0755);
+  return true;
+}
+
+// Files of other boots or module sets will not be read again
+static void remove_stale(const char *dir) {
+  struct dirent *ent;
+  DIR *d = opendir(dir);
+
+  if (!d)
+    return;
+  while ((ent = readdir(d))) {
+    if (!strncmp(ent->d_name, FEATURES_PREFIX, strlen(FEATURES_PREFIX)))
+      unlinkat(dirfd(d), ent->d_name, 0);
+  }
+  closedir(d);
+}
+
+// (Re)load the results if this is the first call or the modules changed
+static void load_results(void) {
+  char dir[PATH_MAX], boot_id[64], line[512];
+  uint64_t modules = bcc_procutils_modules_hash();
+  FILE *f;
+  int n;
+
+  if (results_loaded && modules == results_modules)
+    return;
+  clear_results();
+  results_loaded = true;
+  results_modules = modules;
+  results_path[0] = '\0';
+
+  if (!cache_dir(dir, sizeof(dir)))
+    return;
+  f = fopen("/proc/sys/kernel/random/boot_id", "re");
+  if (!f)
+    return;
+  if (!fgets(boot_id, sizeof(boot_id), f)) {
+    fclose(f);
+    return;
+  }
+  fclose(f);
+  boot_id[strcspn(boot_id, "\n")] = '\0';
+  if (!*boot_id)
+    return;
+  n = snprintf(results_path, sizeof(results_path),
+               "%s/" FEATURES_PREFIX "%s.%016" PRIx64, dir, boot_id, modules);
+  if (n < 0 || (size_t)n >= sizeof(results_path)) {
+    results_path[0] = '\0';
+    return;
+  }
+
+  f = fopen(results_path, "re");
+  if (!f) {
+    remove_stale(dir);
+    return;
+  }
+  // "<feature> <arg> <value>\n", a torn last line is skipped
+  while (fgets(line, sizeof(line), f)) {
+    char *value, *end;
+    long v;
+
+    if (!strchr(line, '\n') || !(value = strrchr(line, ' ')))
+      continue;
+    *value++ = '\0';
+    v = strtol(value, &end, 10);
+    if (end == value || *end != '\n')
+      continue;
+    if (!find_result(line))
+      add_result(line, (int)v);
+  }
+  fclose(f);
+}
+
+static void store_result(const char *key, int value) {
+  char record[512];
+  int fd, n;
+
+  add_result(key, value);
+  if (!results_path[0])
+    return;
+  n = snprintf(record, sizeof(record), "%s %d\n", key, value);
+  if (n < 0 || (size_t)n >= sizeof(record))
+    return;
+  // A single O_APPEND write keeps records of concurrent writers whole
+  fd = open(results_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return;
+  if (write(fd, record, n) < 0) {
+    // The cache is an optimization only
+  }
+  close(fd);
+}
+
+int bcc_feature_cached(const char *feature, const char *arg,
+                       int (*probe)(const char *arg)) {
+  const struct feature_result *r;
+  char key[256];
+  int n, value;
+
+  n = snprintf(key, sizeof(key), "%s %s", feature, arg && *arg ? arg : "-");
+  if (n < 0 || (size_t)n >= sizeof(key) || strpbrk(key + strlen(feature) + 1,
+                                                   " \t\n"))
+    return probe(arg);
+
+  pthread_mutex_lock(&features_lock);
+  load_results();
+  r = find_result(key);
+  if (r) {
+    value = r->value;
+  } else {
+    // Probes are only run once per process and don't call back here
+    value = probe(arg);
+    if (value >= -1)
+      store_result(key, value);
+  }
+  pthread_mutex_unlock(&features_lock);
+  return value;
+}
+
+static int ksym_exists(const char *name) {
+  char line[512];
+  FILE *f;
+  int found = 0;
+
+  if (!name)
+    return -EINVAL;
+  f = fopen("/proc/kallsyms", "re");
+  if (!f)
+    return 0;
+  // "<addr> <type> <name>[\t[<module>]]"
+  while (!found && fgets(line, sizeof(line), f)) {
+    char *sym = strchr(line, ' ');
+    if (!sym || !(sym = strchr(sym + 1, ' ')))
+      continue;
+    sym++;
+    sym[strcspn(sym, " \t\n")] = '\0';
+    found = !strcmp(sym, name);
+  }
+  fclose(f);
+  return found;
+}
+
+static int probe_kernel_btf(const char *arg) {
+  return bpf_has_kernel_btf();
+}
+
+static int probe_kfunc(const char *arg) {
+  struct utsname u;
+
+  // There's no trampoline support for other than x86_64
+  if (uname(&u) || strcmp(u.machine, "x86_64"))
+    return 0;
+  if (!bpf_has_kernel_btf())
+    return 0;
+  return ksym_exists("bpf_trampoline_link_prog");
+}
+
+static int probe_lsm(const char *arg) {
+  return bpf_has_kernel_btf() && ksym_exists("bpf_lsm_bpf");
+}
+
+// BPF_RINGBUF_OUTPUT maps came with kernel 5.8
+static int probe_ringbuf(const char *arg) {
+  return ksym_exists("bpf_ringbuf_output");
+}
+
+// BPF_TASK_STORAGE maps need bpf_get_current_task_btf(), both came with 5.11
+static int probe_task_storage(const char *arg) {
+  return bpf_has_kernel_btf() && ksym_exists("bpf_task_storage_get");
+}
+
+static int probe_raw_tracepoint(const char *arg) {
+  return ksym_exists("bpf_find_raw_tracepoint") ||
+         ksym_exists("bpf_get_raw_tracepoint");
+}
+
+// Kernel commit a38d1107 added raw tracepoints of modules
+static int probe_raw_tracepoint_in_module(const char *arg) {
+  return ksym_exists("bpf_trace_modules");
+}
+
+static int probe_tracepoint(const char *arg) {
+  static const char *const tracefs[] = {
+    "/sys/kernel/tracing", "/sys/kernel/debug/tracing",
+  };
+  char path[PATH_MAX], event[256];
+  struct stat st;
+  size_t i;
+
+  if (!arg || !strchr(arg, ':') || strlen(arg) >= sizeof(event))
+    return -EINVAL;
+  strcpy(event, arg);
+  *strchr(event, ':') = '/';
+  for (i = 0; i < sizeof(tracefs) / sizeof(tracefs[0]); i++) {
+    snprintf(path, sizeof(path), "%s/events/%s", tracefs[i], event);
+    if (!stat(path, &st))
+      return S_ISDIR(st.st_mode);
+  }
+  return 0;
+}
+
+static int probe_struct_field(const char *arg) {
+  char name[256], *field;
+
+  if (!arg || strlen(arg) >= sizeof(name))
+    return -EINVAL;
+  strcpy(name, arg);
+  if (!(field = strchr(name, '.')))
+    return -EINVAL;
+  *field++ = '\0';
+  return kernel_struct_has_field(name, field);
+}
+
+struct kprobe_lookup {
+  const char *name;
+  bool found;
+};
+
+static void kprobe_fn_cb(const char *fn, void *payload) {
+  struct kprobe_lookup *l = payload;
+
+  if (!strcmp(fn, l->name))
+    l->found = true;
+}
+
+static int probe_kprobe(const char *arg) {
+  struct kprobe_lookup l = { arg, false };
+
+  if (!arg)
+    return -EINVAL;
+  if (bcc_foreach_kprobe_function(NULL, kprobe_fn_cb, &l) < 0)
+    return 0;
+  return l.found;
+}
+
+static const struct {
+  const char *name;
+  int (*probe)(const char *arg);
+} features[] = {
+  { "kernel_btf", probe_kernel_btf },
+  { "kfunc", probe_kfunc },
+  { "lsm", probe_lsm },
+  { "ringbuf", probe_ringbuf },
+  { "task_storage", probe_task_storage },
+  { "raw_tracepoint", probe_raw_tracepoint },
+  { "raw_tracepoint_in_module", probe_raw_tracepoint_in_module },
+  { "ksym", ksym_exists },
+  { "kprobe", probe_kprobe },
+  { "tracepoint", probe_tracepoint },
+  { "struct_field", probe_struct_field },
+};
+
+int bcc_feature_probe(const char *feature, const char *arg) {
+  size_t i;
+
+  if (!feature)
+    return -EINVAL;
+  for (i = 0; i < sizeof(features) / sizeof(features[0]); i++) {
+    if (!strcmp(features[i].name, feature))
+      return bcc_feature_cached(feature, arg, features[i].probe);
+  }
+  return -EINVAL;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2021 Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BCC_FEATURES_H
+#define BCC_FEATURES_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Kernel feature probes, each run at most once per boot and set of loaded
+ * modules. Results are kept for the life of the process and in a
+ * features.<boot id>.<modules> file of $BCC_OBJ_CACHE_DIR, else of
+ * $XDG_CACHE_HOME/bcc or ~/.cache/bcc, shared by all the tools started
+ * until the next reboot or module (un)load.
+ *
+ * The features, arg is NULL unless shown:
+ *   "kernel_btf"                the kernel has vmlinux BTF
+ *   "kfunc", "lsm"              fentry/fexit and BPF LSM programs
+ *   "ringbuf", "task_storage"   BPF_RINGBUF_OUTPUT and BPF_TASK_STORAGE maps
+ *   "raw_tracepoint"            raw tracepoints
+ *   "raw_tracepoint_in_module"  raw tracepoints of modules
+ *   "ksym"        arg "name"        kernel symbol name exists
+ *   "kprobe"      arg "name"        function name can be kprobed
+ *   "tracepoint"  arg "cat:event"   tracepoint exists
+ *   "struct_field" arg "struct.field"  vmlinux BTF struct has field
+ *
+ * Returns 1 if the feature is there, 0 if not, and for "struct_field" -1
+ * without vmlinux BTF or struct. -EINVAL for unknown features.
+ */
+int bcc_feature_probe(const char *feature, const char *arg);
+
+/* Same cache for a probe of the caller's. feature must not be one of the
+ * above, nor feature or arg contain white space. */
+int bcc_feature_cached(const char *feature, const char *arg,
+                       int (*probe)(const char *arg));
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "bcc_metrics.h"
+
+namespace {
+
+struct MetricDesc {
+  const char *name;
+  const char *help;
+};
+
+const MetricDesc metric_descs[BCC_METRIC_MAX] = {
+    {"perf_samples", "Samples delivered by perf readers"},
+    {"perf_lost", "Samples reported lost in perf buffers"},
+    {"perf_wrap_copies", "Events copied because they wrap around a perf buffer"},
+    {"symcache_hits", "Addresses resolved by symbol caches"},
+    {"symcache_misses", "Addresses symbol caches could not resolve"},
+    {"elf_loads", "Symbol tables read from ELF files"},
+    {"table_syscalls", "Map lookup, update, delete and get_next_key syscalls"},
+    {"table_batch_syscalls", "Map batch syscalls"},
+};
+
+struct ThreadCounters;
+
+// Counters of the live threads, and the sums of those that exited. Never
+// freed, so that threads exiting after static destructors still find it.
+struct Registry {
+  std::mutex mutex;
+  std::vector<ThreadCounters *> threads;
+  uint64_t exited[BCC_METRIC_MAX] = {};
+  // sums at the last reset
+  uint64_t base[BCC_METRIC_MAX] = {};
+};
+
+Registry &registry() {
+  static Registry *r = new Registry();
+  return *r;
+}
+
+struct ThreadCounters {
+  // only written by the owning thread, read by any
+  std::atomic<uint64_t> counts[BCC_METRIC_MAX];
+
+  ThreadCounters() {
+    for (auto &c : counts)
+      c.store(0, std::memory_order_relaxed);
+    Registry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.threads.push_back(this);
+  }
+
+  ~ThreadCounters() {
+    Registry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for (int i = 0; i < BCC_METRIC_MAX; i++)
+      r.exited[i] += counts[i].load(std::memory_order_relaxed);
+    for (auto it = r.threads.begin(); it != r.threads.end(); ++it) {
+      if (*it == this) {
+        r.threads.erase(it);
+        break;
+      }
+    }
+  }
+};
+
+// Called with the registry mutex held
+uint64_t sum_locked(Registry &r, int id) {
+  uint64_t total = r.exited[id];
+  for (auto *t : r.threads)
+    total += t->counts[id].load(std::memory_order_relaxed);
+  return total;
+}
+
+}  // namespace
+
+extern "C" {
+
+volatile int bcc_metrics_on = 0;
+
+void bcc_metric_add_slow(int id, uint64_t n) {
+  static thread_local ThreadCounters counters;
+  if (id < 0 || id >= BCC_METRIC_MAX)
+    return;
+  // single writer, so a plain load and store avoid a locked instruction
+  auto &c = counters.counts[id];
+  c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+void bcc_metrics_enable(int enable) { bcc_metrics_on = enable ? 1 : 0; }
+
+int bcc_metrics_enabled(void) { return bcc_metrics_on; }
+
+const char *bcc_metric_name(int id) {
+  if (id < 0 || id >= BCC_METRIC_MAX)
+    return nullptr;
+  return metric_descs[id].name;
+}
+
+const char *bcc_metric_help(int id) {
+  if (id < 0 || id >= BCC_METRIC_MAX)
+    return nullptr;
+  return metric_descs[id].help;
+}
+
+uint64_t bcc_metric_read(int id) {
+  if (id < 0 || id >= BCC_METRIC_MAX)
+    return 0;
+  Registry &r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  return sum_locked(r, id) - r.base[id];
+}
+
+void bcc_metrics_reset(void) {
+  Registry &r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  for (int i = 0; i < BCC_METRIC_MAX; i++)
+    r.base[i] = sum_locked(r, i);
+}
+
+int bcc_metrics_prometheus(char *buf, size_t size) {
+  std::string text;
+  char line[256];
+  for (int i = 0; i < BCC_METRIC_MAX; i++) {
+    const char *name = metric_descs[i].name;
+    snprintf(line, sizeof(line),
+             "# HELP bcc_%s_total %s\n# TYPE bcc_%s_total counter\n"
+             "bcc_%s_total %" PRIu64 "\n",
+             name, metric_descs[i].help, name, name, bcc_metric_read(i));
+    text += line;
+  }
+  if (buf && size > 0)
+    snprintf(buf, size, "%s", text.c_str());
+  return text.size();
+}
+
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef LIBBCC_METRICS_H
+#define LIBBCC_METRICS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Counters of the userspace work done by libbcc. They are only updated
+// after bcc_metrics_enable(1), until then counting costs one predictable
+// branch. Each thread counts into its own slots, which are summed on read.
+enum bcc_metric {
+  // samples delivered by perf readers to their callbacks
+  BCC_METRIC_PERF_SAMPLES,
+  // samples the kernel reported as lost in perf buffers
+  BCC_METRIC_PERF_LOST,
+  // events copied out of a perf buffer because they wrap around its end
+  BCC_METRIC_PERF_WRAP_COPIES,
+  // addresses resolved by symbol caches, and those that were not found
+  BCC_METRIC_SYMCACHE_HITS,
+  BCC_METRIC_SYMCACHE_MISSES,
+  // symbol tables read from ELF files
+  BCC_METRIC_ELF_LOADS,
+  // map lookup, update, delete and get_next_key syscalls, and batch ones
+  BCC_METRIC_TABLE_SYSCALLS,
+  BCC_METRIC_TABLE_BATCH_SYSCALLS,
+  BCC_METRIC_MAX,
+};
+
+// Turn counting on (1) or off (0). Counts are kept while it is off.
+void bcc_metrics_enable(int enable);
+int bcc_metrics_enabled(void);
+// Name and description of a metric, NULL if id is out of range
+const char *bcc_metric_name(int id);
+const char *bcc_metric_help(int id);
+// Sum of the counts of all threads, including those that exited
+uint64_t bcc_metric_read(int id);
+void bcc_metrics_reset(void);
+// Write all metrics to buf in the Prometheus text format, NUL terminated,
+// and return the length of the full text like snprintf() does, so that a
+// buffer too small can be grown to the returned length + 1.
+int bcc_metrics_prometheus(char *buf, size_t size);
+
+void bcc_metric_add_slow(int id, uint64_t n);
+extern volatile int bcc_metrics_on;
+
+static inline void bcc_metric_add(int id, uint64_t n) {
+  if (__builtin_expect(bcc_metrics_on, 0))
+    bcc_metric_add_slow(id, n);
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -19,6 +19,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "bcc_perf_map.h"
 
@@ -80,6 +83,35 @@ bool bcc_perf_map_path(char *map_path, size_t map_len, int pid) {
   return true;
 }
 
+// Parse one "START SIZE NAME" line, returns 1 and calls callback if valid
+static int perf_map_parse_line(char *line, bcc_perf_map_symcb callback,
+                               void *payload) {
+  char *cursor = line;
+  char *newline, *sep;
+  long long begin, len;
+
+  begin = strtoull(cursor, &sep, 16);
+  if (begin == 0 || *sep != ' ' || (begin == ULLONG_MAX && errno == ERANGE))
+    return 0;
+  cursor = sep;
+  while (*cursor && isspace(*cursor)) cursor++;
+
+  len = strtoull(cursor, &sep, 16);
+  if (*sep != ' ' ||
+      (sep == cursor && len == 0) ||
+      (len == ULLONG_MAX && errno == ERANGE))
+    return 0;
+  cursor = sep;
+  while (*cursor && isspace(*cursor)) cursor++;
+
+  newline = strchr(cursor, '\n');
+  if (newline)
+      newline[0] = '\0';
+
+  callback(cursor, begin, len, payload);
+  return 1;
+}
+
 int bcc_perf_map_foreach_sym(const char *path, bcc_perf_map_symcb callback,
                              void* payload) {
   FILE* file = fopen(path, "r");
@@ -88,34 +120,179 @@ int bcc_perf_map_foreach_sym(const char *path, bcc_perf_map_symcb callback,
 
   char *line = NULL;
   size_t size = 0;
-  long long begin, len;
-  while (getline(&line, &size, file) != -1) {
-    char *cursor = line;
-    char *newline, *sep;
-
-    begin = strtoull(cursor, &sep, 16);
-    if (begin == 0 || *sep != ' ' || (begin == ULLONG_MAX && errno == ERANGE))
-      continue;
-    cursor = sep;
-    while (*cursor && isspace(*cursor)) cursor++;
-
-    len = strtoull(cursor, &sep, 16);
-    if (*sep != ' ' ||
-        (sep == cursor && len == 0) ||
-        (len == ULLONG_MAX && errno == ERANGE))
-      continue;
-    cursor = sep;
-    while (*cursor && isspace(*cursor)) cursor++;
-
-    newline = strchr(cursor, '\n');
-    if (newline)
-        newline[0] = '\0';
-
-    callback(cursor, begin, len, payload);
-  }
+  while (getline(&line, &size, file) != -1)
+    perf_map_parse_line(line, callback, payload);
 
   free(line);
   fclose(file);
 
   return 0;
 }
+
+int bcc_perf_map_foreach_sym_from(const char *path, uint64_t *offset,
+                                  bcc_perf_map_symcb callback,
+                                  void *payload) {
+  FILE* file = fopen(path, "r");
+  if (!file)
+    return -1;
+
+  int res = 0;
+  struct stat st;
+  if (fstat(fileno(file), &st) == 0 && (uint64_t)st.st_size < *offset) {
+    // The map was truncated or rewritten, start over
+    *offset = 0;
+    res = 1;
+  }
+  if (fseeko(file, *offset, SEEK_SET) < 0) {
+    fclose(file);
+    return -1;
+  }
+
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  while ((len = getline(&line, &size, file)) != -1) {
+    // A line without a newline may still be being written, leave it for
+    // the next call
+    if (line[len - 1] != '\n')
+      break;
+    *offset += len;
+    perf_map_parse_line(line, callback, payload);
+  }
+
+  free(line);
+  fclose(file);
+
+  return res;
+}
+
+// tools/perf/util/jitdump.h
+#define JITDUMP_MAGIC 0x4A695444
+#define JITDUMP_CODE_CLOSE 3
+
+struct jitdump_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t total_size;
+  uint32_t elf_mach;
+  uint32_t pad1;
+  uint32_t pid;
+  uint64_t timestamp;
+  uint64_t flags;
+};
+
+struct jitdump_prefix {
+  uint32_t id;
+  uint32_t total_size;
+  uint64_t timestamp;
+};
+
+struct jitdump_code_load {
+  struct jitdump_prefix p;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t vma;
+  uint64_t code_addr;
+  uint64_t code_size;
+  uint64_t code_index;
+  // followed by the name and the code
+};
+
+struct jitdump_code_move {
+  struct jitdump_prefix p;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t vma;
+  uint64_t old_code_addr;
+  uint64_t new_code_addr;
+  uint64_t code_size;
+  uint64_t code_index;
+};
+
+bool bcc_is_jitdump(const char *path) {
+  const char *base = strrchr(path, '/');
+  int pid, end = 0;
+
+  base = base ? base + 1 : path;
+  return sscanf(base, "jit-%d.dump%n", &pid, &end) == 1 && end &&
+         base[end] == '\0';
+}
+
+int bcc_jitdump_foreach_from(const char *path, uint64_t *offset,
+                             bcc_jitdump_cb callback, void *payload) {
+  const struct jitdump_header *hdr;
+  struct stat st;
+  int res = 0;
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*hdr)) {
+    close(fd);
+    return -1;
+  }
+  uint8_t *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return -1;
+
+  hdr = (const struct jitdump_header *)data;
+  if (hdr->magic != JITDUMP_MAGIC || hdr->total_size < sizeof(*hdr) ||
+      hdr->total_size > (uint64_t)st.st_size) {
+    res = -1;
+    goto out;
+  }
+  if ((uint64_t)st.st_size < *offset) {
+    // The dump was rewritten, start over
+    *offset = 0;
+    res = 1;
+  }
+  if (*offset < hdr->total_size)
+    *offset = hdr->total_size;
+
+  // Records are not aligned, copy them out before reading their fields
+  while (*offset + sizeof(struct jitdump_prefix) <= (uint64_t)st.st_size) {
+    struct jitdump_prefix p;
+    struct bcc_jitdump_record rec = {0};
+
+    memcpy(&p, data + *offset, sizeof(p));
+    // A record may still be being written, leave it for the next call
+    if (p.total_size < sizeof(p) ||
+        *offset + p.total_size > (uint64_t)st.st_size)
+      break;
+    if (p.id == JITDUMP_CODE_CLOSE) {
+      *offset = st.st_size;
+      break;
+    }
+
+    rec.type = p.id;
+    if (p.id == BCC_JITDUMP_CODE_LOAD &&
+        p.total_size > sizeof(struct jitdump_code_load)) {
+      struct jitdump_code_load load;
+      memcpy(&load, data + *offset, sizeof(load));
+      const char *name = (const char *)data + *offset + sizeof(load);
+      if (memchr(name, '\0', p.total_size - sizeof(load))) {
+        rec.code_index = load.code_index;
+        rec.addr = load.code_addr;
+        rec.size = load.code_size;
+        rec.name = name;
+        callback(&rec, payload);
+      }
+    } else if (p.id == BCC_JITDUMP_CODE_MOVE &&
+               p.total_size >= sizeof(struct jitdump_code_move)) {
+      struct jitdump_code_move move;
+      memcpy(&move, data + *offset, sizeof(move));
+      rec.code_index = move.code_index;
+      rec.addr = move.new_code_addr;
+      rec.old_addr = move.old_code_addr;
+      rec.size = move.code_size;
+      callback(&rec, payload);
+    }
+    // debug info and unwinding info records are skipped
+    *offset += p.total_size;
+  }
+
+out:
+  munmap(data, st.st_size);
+  return res;
+}
@@ -34,6 +34,41 @@ int bcc_perf_map_nstgid(int pid);
 bool bcc_perf_map_path(char *map_path, size_t map_len, int pid);
 int bcc_perf_map_foreach_sym(const char *path, bcc_perf_map_symcb callback,
                              void* payload);
+// Like bcc_perf_map_foreach_sym, but only visit the complete lines starting
+// at *offset, and advance *offset past them, so that a growing map can be
+// tailed. Returns 1 if the file got shorter than *offset, in which case it
+// is read again from the start, 0 on success and -1 on error.
+int bcc_perf_map_foreach_sym_from(const char *path, uint64_t *offset,
+                                  bcc_perf_map_symcb callback,
+                                  void *payload);
+
+// Records of a jitdump file, the binary format JIT runtimes write for perf
+// to jit-PID.dump and map executable, so that it shows in the mappings
+#define BCC_JITDUMP_CODE_LOAD 0
+#define BCC_JITDUMP_CODE_MOVE 1
+
+struct bcc_jitdump_record {
+  uint32_t type;
+  // code_index of the load the code was moved from for moves
+  uint64_t code_index;
+  // new address for moves
+  uint64_t addr;
+  uint64_t old_addr;
+  uint64_t size;
+  // NULL for moves
+  const char *name;
+};
+
+typedef int (*bcc_jitdump_cb)(const struct bcc_jitdump_record *, void *);
+
+bool bcc_is_jitdump(const char *path);
+// Visit the complete code load and move records of the jitdump at path,
+// starting at *offset, and advance *offset past them, like
+// bcc_perf_map_foreach_sym_from(). The file is mapped, not read. Returns 1
+// if it was rewritten since, 0 on success and -1 on error or if it is not
+// a jitdump of this machine's byte order.
+int bcc_jitdump_foreach_from(const char *path, uint64_t *offset,
+                             bcc_jitdump_cb callback, void *payload);
 
 #ifdef __cplusplus
 }
@@ -19,6 +19,8 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <regex.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -121,61 +123,338 @@ static char *_procutils_memfd_path(const int pid, const uint64_t inum) {
   return path;
 }
 
-// return: 0 -> callback returned < 0, stopped iterating
-//        -1 -> callback never indicated to stop
-int _procfs_maps_each_module(FILE *procmap, int pid,
-                             bcc_procutils_modulecb callback, void *payload) {
-  char buf[PATH_MAX + 1], perm[5];
+static char *read_whole_file(const char *path, size_t *len);
+
+// An executable, file backed mapping of /proc/PID/maps
+struct maps_entry {
+  uint64_t start_addr;
+  uint64_t end_addr;
+  uint64_t file_offset;
+  uint64_t dev_major;
+  uint64_t dev_minor;
+  uint64_t inode;
+  // Points into the maps buffer, or to the allocated /proc/PID/fd path of a
+  // memfd, which is already in the process' mount namespace
   char *name;
-  mod_info mod;
   uint8_t enter_ns;
-  while (true) {
-    enter_ns = 1;
-    buf[0] = '\0';
-    // From fs/proc/task_mmu.c:show_map_vma
-    if (fscanf(procmap, "%lx-%lx %4s %llx %lx:%lx %lu%[^\n]",
-          &mod.start_addr, &mod.end_addr, perm, &mod.file_offset,
-          &mod.dev_major, &mod.dev_minor, &mod.inode, buf) != 8)
+};
+
+// The executable mappings of a process, as read at one point in time
+struct maps_snapshot {
+  int pid;
+  // start time of the process, in case the pid is reused
+  unsigned long long start_time;
+  char *buf;
+  struct maps_entry *entries;
+  size_t cnt;
+  // iterations in progress, the snapshot is only freed once they are done
+  int refs;
+  bool stale;
+  struct maps_snapshot *next;
+};
+
+#define MAPS_SNAPSHOTS_MAX 8
+
+static pthread_mutex_t maps_snapshots_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct maps_snapshot *maps_snapshots;
+
+static void maps_snapshot_free(struct maps_snapshot *s) {
+  size_t i;
+
+  if (!s)
+    return;
+  for (i = 0; i < s->cnt; i++) {
+    if (!s->entries[i].enter_ns)
+      free(s->entries[i].name);
+  }
+  free(s->entries);
+  free(s->buf);
+  free(s);
+}
+
+static int parse_hex(char **p, uint64_t *val) {
+  const char *c = *p;
+  uint64_t v = 0;
+
+  for (;; c++) {
+    if (*c >= '0' && *c <= '9')
+      v = (v << 4) | (*c - '0');
+    else if (*c >= 'a' && *c <= 'f')
+      v = (v << 4) | (*c - 'a' + 10);
+    else
       break;
+  }
+  if (c == *p)
+    return -1;
+  *val = v;
+  *p = (char *)c;
+  return 0;
+}
 
-    if (perm[2] != 'x')
-      continue;
+static int parse_dec(char **p, uint64_t *val) {
+  const char *c = *p;
+  uint64_t v = 0;
 
-    name = buf;
-    while (isspace(*name))
-      name++;
-    mod.name = name;
-    if (!bcc_mapping_is_file_backed(name))
-      continue;
+  for (; *c >= '0' && *c <= '9'; c++)
+    v = v * 10 + (*c - '0');
+  if (c == *p)
+    return -1;
+  *val = v;
+  *p = (char *)c;
+  return 0;
+}
+
+// Parses one NUL terminated line of /proc/PID/maps, as printed by
+// fs/proc/task_mmu.c:show_map_vma, "start-end perm offset major:minor inode
+// name". Returns -1 for malformed lines and for the mappings which are not
+// executable or not file backed.
+static int parse_maps_line(char *line, struct maps_entry *e) {
+  char *p = line;
+
+  if (parse_hex(&p, &e->start_addr) || *p++ != '-' ||
+      parse_hex(&p, &e->end_addr) || *p++ != ' ')
+    return -1;
+  if (!p[0] || !p[1] || !p[2] || !p[3] || p[4] != ' ')
+    return -1;
+  // Most mappings aren't executable, don't parse the rest of them
+  if (p[2] != 'x')
+    return -1;
+  p += 5;
+  if (parse_hex(&p, &e->file_offset) || *p++ != ' ' ||
+      parse_hex(&p, &e->dev_major) || *p++ != ':' ||
+      parse_hex(&p, &e->dev_minor) || *p++ != ' ' ||
+      parse_dec(&p, &e->inode))
+    return -1;
+  while (isspace(*p))
+    p++;
+  if (!bcc_mapping_is_file_backed(p))
+    return -1;
+  e->name = p;
+  e->enter_ns = 1;
+  return 0;
+}
 
-    if (strstr(name, "/memfd:")) {
-      char *memfd_name = _procutils_memfd_path(pid, mod.inode);
+// Builds the snapshot of the maps in buf, which it takes ownership of, in one
+// pass over the buffer
+static struct maps_snapshot *maps_snapshot_parse(char *buf, size_t len,
+                                                 int pid) {
+  struct maps_snapshot *s = calloc(1, sizeof(*s));
+  struct maps_entry *tmp;
+  size_t cap = 0;
+  char *line, *end, *next;
+
+  if (!s) {
+    free(buf);
+    return NULL;
+  }
+  s->pid = pid;
+  s->buf = buf;
+  for (line = buf; line < buf + len; line = next) {
+    end = memchr(line, '\n', buf + len - line);
+    if (end) {
+      *end = '\0';
+      next = end + 1;
+    } else {
+      next = buf + len;
+    }
+
+    if (s->cnt == cap) {
+      cap = cap ? cap * 2 : 64;
+      tmp = realloc(s->entries, cap * sizeof(*s->entries));
+      if (!tmp)
+        goto error;
+      s->entries = tmp;
+    }
+    struct maps_entry *e = &s->entries[s->cnt];
+    if (parse_maps_line(line, e))
+      continue;
+    if (strstr(e->name, "/memfd:")) {
+      char *memfd_name = _procutils_memfd_path(pid, e->inode);
       if (memfd_name != NULL) {
-        strcpy(buf, memfd_name);
-        free(memfd_name);
-        mod.name = buf;
-        enter_ns = 0;
+        e->name = memfd_name;
+        e->enter_ns = 0;
       }
     }
+    s->cnt++;
+  }
+  return s;
+
+error:
+  maps_snapshot_free(s);
+  return NULL;
+}
 
-    if (callback(&mod, enter_ns, payload) < 0)
+// return: 0 -> callback returned < 0, stopped iterating
+//        -1 -> callback never indicated to stop
+static int maps_snapshot_each_module(const struct maps_snapshot *s,
+                                     bcc_procutils_modulecb callback,
+                                     void *payload) {
+  mod_info mod;
+  size_t i;
+
+  for (i = 0; i < s->cnt; i++) {
+    const struct maps_entry *e = &s->entries[i];
+    mod.name = e->name;
+    mod.start_addr = e->start_addr;
+    mod.end_addr = e->end_addr;
+    mod.file_offset = e->file_offset;
+    mod.dev_major = e->dev_major;
+    mod.dev_minor = e->dev_minor;
+    mod.inode = e->inode;
+    if (callback(&mod, e->enter_ns, payload) < 0)
       return 0;
   }
-
   return -1;
 }
 
+int _procfs_maps_each_module(FILE *procmap, int pid,
+                             bcc_procutils_modulecb callback, void *payload) {
+  struct maps_snapshot *s;
+  size_t cap = 1 << 16, n = 0, res;
+  char *buf = NULL, *tmp;
+  int ret;
+
+  for (;;) {
+    if (!buf || cap - n < 2) {
+      cap = buf ? cap * 2 : cap;
+      tmp = realloc(buf, cap);
+      if (!tmp) {
+        free(buf);
+        return -1;
+      }
+      buf = tmp;
+    }
+    res = fread(buf + n, 1, cap - n - 1, procmap);
+    if (res == 0)
+      break;
+    n += res;
+  }
+  buf[n] = '\0';
+
+  s = maps_snapshot_parse(buf, n, pid);
+  if (!s)
+    return -1;
+  ret = maps_snapshot_each_module(s, callback, payload);
+  maps_snapshot_free(s);
+  return ret;
+}
+
+// Field 22 of /proc/PID/stat, 0 if it can't be read
+static unsigned long long proc_start_time(int pid) {
+  char path[64], buf[1024], *p;
+  ssize_t len;
+  int fd, i;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+  len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0)
+    return 0;
+  buf[len] = '\0';
+
+  // comm, the second field, can contain spaces and parentheses
+  p = strrchr(buf, ')');
+  if (!p)
+    return 0;
+  for (i = 0; i < 20 && p; i++)
+    p = strchr(p + 1, ' ');
+  return p ? strtoull(p + 1, NULL, 10) : 0;
+}
+
+// Unlinks s, with maps_snapshots_lock held, and frees it unless it is being
+// iterated
+static void maps_snapshot_unlink(struct maps_snapshot **link) {
+  struct maps_snapshot *s = *link;
+
+  *link = s->next;
+  s->stale = true;
+  if (!s->refs)
+    maps_snapshot_free(s);
+}
+
+static struct maps_snapshot *maps_snapshot_get(int pid) {
+  unsigned long long start_time = proc_start_time(pid);
+  struct maps_snapshot *s, **link;
+  char path[64], *buf;
+  size_t len;
+  int cnt;
+
+  pthread_mutex_lock(&maps_snapshots_lock);
+  for (link = &maps_snapshots; (s = *link); link = &s->next) {
+    if (s->pid != pid)
+      continue;
+    if (s->start_time != start_time) {
+      maps_snapshot_unlink(link);
+      break;
+    }
+    // Most recently used first
+    *link = s->next;
+    s->next = maps_snapshots;
+    maps_snapshots = s;
+    s->refs++;
+    pthread_mutex_unlock(&maps_snapshots_lock);
+    return s;
+  }
+  pthread_mutex_unlock(&maps_snapshots_lock);
+
+  snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+  buf = read_whole_file(path, &len);
+  if (!buf)
+    return NULL;
+  s = maps_snapshot_parse(buf, len, pid);
+  if (!s)
+    return NULL;
+  s->start_time = start_time;
+  s->refs = 1;
+
+  pthread_mutex_lock(&maps_snapshots_lock);
+  // Replace the snapshot another thread may have added meanwhile, and evict
+  // the least recently used one if there are too many
+  for (cnt = 0, link = &maps_snapshots; *link;) {
+    if ((*link)->pid == pid || ++cnt >= MAPS_SNAPSHOTS_MAX)
+      maps_snapshot_unlink(link);
+    else
+      link = &(*link)->next;
+  }
+  s->next = maps_snapshots;
+  maps_snapshots = s;
+  pthread_mutex_unlock(&maps_snapshots_lock);
+  return s;
+}
+
+static void maps_snapshot_put(struct maps_snapshot *s) {
+  bool release;
+
+  pthread_mutex_lock(&maps_snapshots_lock);
+  release = --s->refs == 0 && s->stale;
+  pthread_mutex_unlock(&maps_snapshots_lock);
+  if (release)
+    maps_snapshot_free(s);
+}
+
+void bcc_procutils_invalidate_modules(int pid) {
+  struct maps_snapshot **link;
+
+  pthread_mutex_lock(&maps_snapshots_lock);
+  for (link = &maps_snapshots; *link;) {
+    if (pid < 0 || (*link)->pid == pid)
+      maps_snapshot_unlink(link);
+    else
+      link = &(*link)->next;
+  }
+  pthread_mutex_unlock(&maps_snapshots_lock);
+}
+
 int bcc_procutils_each_module(int pid, bcc_procutils_modulecb callback,
                               void *payload) {
-  char procmap_filename[128];
-  FILE *procmap;
-  snprintf(procmap_filename, sizeof(procmap_filename), "/proc/%ld/maps",
-           (long)pid);
-  procmap = fopen(procmap_filename, "r");
-  if (!procmap)
+  struct maps_snapshot *snapshot = maps_snapshot_get(pid);
+  if (!snapshot)
     return -1;
 
-  _procfs_maps_each_module(procmap, pid, callback, payload);
+  maps_snapshot_each_module(snapshot, callback, payload);
 
   // Address mapping for the entire address space maybe in /tmp/perf-<PID>.map
   // This will be used if symbols aren't resolved in an earlier mapping.
@@ -202,7 +481,7 @@ int bcc_procutils_each_module(int pid, bcc_procutils_modulecb callback,
   }
 
 done:
-  fclose(procmap);
+  maps_snapshot_put(snapshot);
   return 0;
 }
 
@@ -260,6 +539,289 @@ int bcc_procutils_each_ksym(bcc_procutils_ksymcb callback, void *payload) {
   return 0;
 }
 
+// Read all of a procfs or sysfs file, which can't be mapped, into a NUL
+// terminated buffer to be freed by the caller
+static char *read_whole_file(const char *path, size_t *len) {
+  size_t cap = 1 << 20, n = 0;
+  char *buf = NULL, *tmp;
+  ssize_t res;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0)
+    return NULL;
+  for (;;) {
+    if (!buf || cap - n < 2) {
+      cap = buf ? cap * 2 : cap;
+      tmp = realloc(buf, cap);
+      if (!tmp)
+        goto error;
+      buf = tmp;
+    }
+    res = read(fd, buf + n, cap - n - 1);
+    if (res < 0)
+      goto error;
+    if (res == 0)
+      break;
+    n += res;
+  }
+  close(fd);
+  buf[n] = '\0';
+  if (len)
+    *len = n;
+  return buf;
+
+error:
+  free(buf);
+  close(fd);
+  return NULL;
+}
+
+static int cmp_name(const void *a, const void *b) {
+  return strcmp(*(const char **)a, *(const char **)b);
+}
+
+// NUL terminates the next token of a line at *p and returns it, *p is
+// advanced past it
+static char *next_token(char **p) {
+  char *tok = *p, *end;
+
+  while (*tok == ' ' || *tok == '\t')
+    tok++;
+  end = tok + strcspn(tok, " \t");
+  *p = end + (*end != '\0');
+  *end = '\0';
+  return tok;
+}
+
+static bool is_cold_function(const char *name) {
+  const char *cold = strstr(name, ".cold");
+
+  // ".cold" or ".cold.<N>" at the end of the name, from gcc 8 on
+  for (; cold; cold = strstr(cold + 1, ".cold")) {
+    const char *p = cold + 5;
+    if (!*p)
+      return true;
+    if (*p++ != '.' || !*p)
+      continue;
+    while (isdigit(*p))
+      p++;
+    if (!*p)
+      return true;
+  }
+  return false;
+}
+
+struct kprobe_functions {
+  char *kallsyms;
+  char *blacklist;
+  const char **names;
+  size_t cnt;
+  // searched by bsearch for the kprobe blacklist
+  const char **blacklisted;
+  size_t blacklisted_cnt;
+  // hash of the loaded kernel modules and their sizes the list is for
+  uint64_t modules_hash;
+};
+
+static pthread_mutex_t kprobe_functions_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct kprobe_functions *kprobe_functions_cache;
+
+static void kprobe_functions_free(struct kprobe_functions *kf) {
+  if (!kf)
+    return;
+  free(kf->kallsyms);
+  free(kf->blacklist);
+  free(kf->names);
+  free(kf->blacklisted);
+  free(kf);
+}
+
+uint64_t bcc_procutils_modules_hash(void) {
+  char *modules = read_whole_file("/proc/modules", NULL), *p, *line;
+  uint64_t hash = 14695981039346656037ULL;
+
+  if (!modules)
+    return 0;
+  // Lines start with "name size refcount ...", only the first two fields
+  // identify the loaded code.
+  for (p = line = modules; *line; line = p) {
+    const char *name, *size;
+    p = line + strcspn(line, "\n");
+    if (*p)
+      *p++ = '\0';
+    name = next_token(&line);
+    size = next_token(&line);
+    for (; *name; name++)
+      hash = (hash ^ (unsigned char)*name) * 1099511628211ULL;
+    hash = (hash ^ ' ') * 1099511628211ULL;
+    for (; *size; size++)
+      hash = (hash ^ (unsigned char)*size) * 1099511628211ULL;
+    hash = (hash ^ '\n') * 1099511628211ULL;
+  }
+  free(modules);
+  return hash;
+}
+
+static int push_name(const char ***names, size_t *cnt, size_t *cap,
+                     const char *name) {
+  const char **tmp;
+
+  if (*cnt == *cap) {
+    *cap = *cap ? *cap * 2 : 4096;
+    tmp = realloc(*names, *cap * sizeof(**names));
+    if (!tmp)
+      return -1;
+    *names = tmp;
+  }
+  (*names)[(*cnt)++] = name;
+  return 0;
+}
+
+static struct kprobe_functions *kprobe_functions_load(void) {
+  struct kprobe_functions *kf = calloc(1, sizeof(*kf));
+  int in_init_section = 0, in_irq_section = 0;
+  size_t cap = 0, i, j;
+  char *p, *line;
+
+  if (!kf)
+    return NULL;
+  kf->modules_hash = bcc_procutils_modules_hash();
+
+  // Lines of the blacklist are "0x<start>-0x<end> name"
+  kf->blacklist = read_whole_file("/sys/kernel/debug/kprobes/blacklist", NULL);
+  for (p = line = kf->blacklist; p && *line; line = p) {
+    const char *name;
+    p = line + strcspn(line, "\n");
+    if (*p)
+      *p++ = '\0';
+    next_token(&line);
+    name = next_token(&line);
+    if (*name && push_name(&kf->blacklisted, &kf->blacklisted_cnt, &cap, name))
+      goto error;
+  }
+  if (kf->blacklisted_cnt)
+    qsort(kf->blacklisted, kf->blacklisted_cnt, sizeof(*kf->blacklisted),
+          cmp_name);
+
+  kf->kallsyms = read_whole_file("/proc/kallsyms", NULL);
+  if (!kf->kallsyms)
+    goto error;
+  cap = 0;
+  // Lines are "address type name [module]"
+  for (p = line = kf->kallsyms; *line; line = p) {
+    const char *type, *fn;
+    p = line + strcspn(line, "\n");
+    if (*p)
+      *p++ = '\0';
+    next_token(&line);
+    type = next_token(&line);
+    fn = next_token(&line);
+    if (!*fn)
+      continue;
+
+    // Skip all functions defined between __init_begin and __init_end
+    if (in_init_section == 0) {
+      if (strcmp(fn, "__init_begin") == 0) {
+        in_init_section = 1;
+        continue;
+      }
+    } else if (in_init_section == 1) {
+      if (strcmp(fn, "__init_end") == 0)
+        in_init_section = 2;
+      continue;
+    }
+    // Skip all functions defined between __irqentry_text_start and
+    // __irqentry_text_end, the end is not always after the start but then
+    // there are no functions between them
+    if (in_irq_section == 0) {
+      if (strcmp(fn, "__irqentry_text_start") == 0) {
+        in_irq_section = 1;
+        continue;
+      } else if (strcmp(fn, "__irqentry_text_end") == 0) {
+        in_irq_section = 2;
+        continue;
+      }
+    } else if (in_irq_section == 1) {
+      if (strcmp(fn, "__irqentry_text_end") == 0)
+        in_irq_section = 2;
+      continue;
+    }
+
+    if (tolower(type[0]) != 't' && tolower(type[0]) != 'w')
+      continue;
+    // NOKPROBE_SYMBOL() functions, also of kernel modules, perf functions
+    // and static calls can't be attached, nor can gcc's .cold parts
+    if (strncmp(fn, "_kbl_addr_", 10) == 0 || strncmp(fn, "__perf", 6) == 0 ||
+        strncmp(fn, "perf_", 5) == 0 || strncmp(fn, "__SCT__", 7) == 0 ||
+        is_cold_function(fn))
+      continue;
+    if (kf->blacklisted_cnt &&
+        bsearch(&fn, kf->blacklisted, kf->blacklisted_cnt,
+                sizeof(*kf->blacklisted), cmp_name))
+      continue;
+    if (push_name(&kf->names, &kf->cnt, &cap, fn))
+      goto error;
+  }
+
+  // Some functions appear more than once
+  if (kf->cnt) {
+    qsort(kf->names, kf->cnt, sizeof(*kf->names), cmp_name);
+    for (i = 1, j = 1; i < kf->cnt; i++) {
+      if (strcmp(kf->names[i], kf->names[j - 1]) != 0)
+        kf->names[j++] = kf->names[i];
+    }
+    kf->cnt = j;
+  }
+  return kf;
+
+error:
+  kprobe_functions_free(kf);
+  return NULL;
+}
+
+int bcc_foreach_kprobe_function(const char *pattern, bcc_kprobe_fn_cb callback,
+                                void *payload) {
+  regex_t re;
+  char *anchored = NULL;
+  int ret = 0;
+  size_t i;
+
+  if (pattern) {
+    anchored = malloc(strlen(pattern) + 4);
+    if (!anchored)
+      return -1;
+    sprintf(anchored, "^(%s)", pattern);
+    ret = regcomp(&re, anchored, REG_EXTENDED | REG_NOSUB);
+    free(anchored);
+    if (ret != 0)
+      return -1;
+  }
+
+  pthread_mutex_lock(&kprobe_functions_lock);
+  if (kprobe_functions_cache &&
+      kprobe_functions_cache->modules_hash != bcc_procutils_modules_hash()) {
+    kprobe_functions_free(kprobe_functions_cache);
+    kprobe_functions_cache = NULL;
+  }
+  if (!kprobe_functions_cache)
+    kprobe_functions_cache = kprobe_functions_load();
+  if (!kprobe_functions_cache) {
+    ret = -1;
+  } else {
+    for (i = 0; i < kprobe_functions_cache->cnt; i++) {
+      const char *fn = kprobe_functions_cache->names[i];
+      if (pattern && regexec(&re, fn, 0, NULL, 0) != 0)
+        continue;
+      callback(fn, payload);
+    }
+  }
+  pthread_mutex_unlock(&kprobe_functions_lock);
+
+  if (pattern)
+    regfree(&re);
+  return ret;
+}
+
 #define CACHE1_HEADER "ld.so-1.7.0"
 #define CACHE1_HEADER_LEN (sizeof(CACHE1_HEADER) - 1)
 
@@ -50,15 +50,35 @@ int bcc_mapping_is_file_backed(const char *mapname);
 // Iterate over all executable memory mapping sections of a Process.
 // All anonymous and non-file-backed mapping sections, namely those
 // listed in bcc_mapping_is_file_backed, will be ignored.
+// The mappings are read once and reused by later calls for the same pid,
+// until bcc_procutils_invalidate_modules(pid) is called.
 // Returns -1 on error, and 0 on success
 int bcc_procutils_each_module(int pid, bcc_procutils_modulecb callback,
                               void *payload);
+// Forget the mappings bcc_procutils_each_module keeps for pid, or for all
+// processes if pid is -1, so that they are read again on the next call
+void bcc_procutils_invalidate_modules(int pid);
 
 int _procfs_maps_each_module(FILE *procmaps, int pid,
                              bcc_procutils_modulecb callback, void *payload);
 // Iterate over all non-data Kernel symbols.
 // Returns -1 on error, and 0 on success
 int bcc_procutils_each_ksym(bcc_procutils_ksymcb callback, void *payload);
+
+// Function name, payload
+typedef void (*bcc_kprobe_fn_cb)(const char *, void *);
+// Iterate over the kernel functions kprobes can be attached to, in name
+// order: the text symbols of /proc/kallsyms except those of the init and
+// irqentry sections and those in the kprobe blacklist. If pattern is not
+// NULL, only names matching the POSIX extended regular expression at their
+// start are passed to callback. The list is built once and reused until the
+// set of loaded kernel modules changes. callback must not call this again.
+// Returns -1 on error, and 0 on success
+int bcc_foreach_kprobe_function(const char *pattern, bcc_kprobe_fn_cb callback,
+                                void *payload);
+// Hash of the names and sizes of the loaded kernel modules, to notice the
+// set changing. Returns 0 if /proc/modules can't be read
+uint64_t bcc_procutils_modules_hash(void);
 void bcc_procutils_free(const char *ptr);
 const char *bcc_procutils_language(int pid);
 
@@ -18,14 +18,18 @@
 #include <cstring>
 #include <fcntl.h>
 #include <linux/elf.h>
+#include <regex.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <cstdio>
+#include <map>
+#include <tuple>
 
 #include "bcc_elf.h"
+#include "bcc_metrics.h"
 #include "bcc_perf_map.h"
 #include "bcc_proc.h"
 #include "bcc_syms.h"
@@ -34,6 +38,40 @@
 
 #include "syms.h"
 
+// Resolve addresses in ascending order, which keeps consecutive lookups in
+// the same module and symbol range, and copy the result of repeated
+// addresses instead of resolving them again.
+template <class Fn>
+static size_t resolve_sorted(const uint64_t *addrs, size_t n,
+                             struct bcc_symbol *syms, Fn resolve) {
+  std::vector<size_t> order(n);
+  for (size_t i = 0; i < n; i++)
+    order[i] = i;
+  std::sort(order.begin(), order.end(),
+            [addrs](size_t a, size_t b) { return addrs[a] < addrs[b]; });
+
+  size_t resolved = 0;
+  bool prev_ok = false;
+  for (size_t i = 0; i < n; i++) {
+    size_t cur = order[i];
+    if (i > 0 && addrs[cur] == addrs[order[i - 1]]) {
+      syms[cur] = syms[order[i - 1]];
+    } else {
+      prev_ok = resolve(addrs[cur], &syms[cur]);
+    }
+    if (prev_ok)
+      resolved++;
+  }
+  return resolved;
+}
+
+size_t SymbolCache::resolve_addrs(const uint64_t *addrs, size_t n,
+                                  struct bcc_symbol *syms, bool demangle) {
+  return resolve_sorted(addrs, n, syms, [&](uint64_t addr, bcc_symbol *sym) {
+    return resolve_addr(addr, sym, demangle);
+  });
+}
+
 ino_t ProcStat::getinode_() {
   struct stat s;
   return (!stat(procfs_.c_str(), &s)) ? s.st_ino : -1;
@@ -47,63 +85,120 @@ bool ProcStat::is_stale() {
 ProcStat::ProcStat(int pid)
     : procfs_(tfm::format("/proc/%d/exe", pid)), inode_(getinode_()) {}
 
+struct KSyms::Loader {
+  Table *table;
+  // module names already in the pool; symbols of one module are listed
+  // together, so the last one is checked first
+  std::unordered_map<std::string, uint32_t> mods;
+  std::string last_mod;
+  uint32_t last_mod_off = 0;
+
+  uint32_t add_string(const char *str) {
+    uint32_t off = table->strtab.size();
+    table->strtab.append(str, strlen(str) + 1);
+    return off;
+  }
+};
+
 void KSyms::_add_symbol(const char *symname, const char *modname, uint64_t addr, void *p) {
-  KSyms *ks = static_cast<KSyms *>(p);
-  ks->syms_.emplace_back(symname, modname, addr);
+  Loader *loader = static_cast<Loader *>(p);
+  if (loader->last_mod != modname) {
+    auto it = loader->mods.find(modname);
+    if (it == loader->mods.end())
+      it = loader->mods.emplace(modname, loader->add_string(modname)).first;
+    loader->last_mod = modname;
+    loader->last_mod_off = it->second;
+  }
+  uint32_t name = loader->add_string(symname);
+  loader->table->syms.push_back({addr, name, loader->last_mod_off});
+}
+
+std::shared_ptr<KSyms::Table> KSyms::shared_table() {
+  static std::mutex mutex;
+  static std::weak_ptr<Table> shared;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  std::shared_ptr<Table> table = shared.lock();
+  // An empty table means kallsyms could not be read, try again
+  if (table && !table->syms.empty())
+    return table;
+
+  table = std::make_shared<Table>();
+  Loader loader = {table.get()};
+  loader.last_mod_off = loader.add_string("");
+  bcc_procutils_each_ksym(_add_symbol, &loader);
+  std::sort(table->syms.begin(), table->syms.end());
+  table->syms.shrink_to_fit();
+  table->strtab.shrink_to_fit();
+  shared = table;
+  return table;
 }
 
-void KSyms::refresh() {
-  if (syms_.empty()) {
-    bcc_procutils_each_ksym(_add_symbol, this);
-    std::sort(syms_.begin(), syms_.end());
+std::shared_ptr<KSyms::Table> KSyms::table() {
+  std::shared_ptr<Table> table = std::atomic_load(&table_);
+  if (!table || table->syms.empty()) {
+    table = shared_table();
+    std::atomic_store(&table_, table);
   }
+  return table;
 }
 
-bool KSyms::resolve_addr(uint64_t addr, struct bcc_symbol *sym, bool demangle) {
-  refresh();
+void KSyms::refresh() { table(); }
 
-  std::vector<Symbol>::iterator it;
-
-  if (syms_.empty())
-    goto unknown_symbol;
+bool KSyms::resolve_addr(uint64_t addr, struct bcc_symbol *sym, bool demangle) {
+  std::shared_ptr<Table> table = this->table();
 
-  it = std::upper_bound(syms_.begin(), syms_.end(), Symbol("", "", addr));
-  if (it != syms_.begin()) {
+  const std::vector<Table::Symbol> &syms = table->syms;
+  auto it = std::upper_bound(syms.begin(), syms.end(), Table::Symbol{addr, 0, 0});
+  if (it != syms.begin()) {
     it--;
-    sym->name = (*it).name.c_str();
+    sym->name = table->str(it->name);
     if (demangle)
       sym->demangle_name = sym->name;
-    sym->module = (*it).mod.c_str();
-    sym->offset = addr - (*it).addr;
+    sym->module = table->str(it->mod);
+    sym->offset = addr - it->addr;
+    bcc_metric_add(BCC_METRIC_SYMCACHE_HITS, 1);
     return true;
   }
 
-unknown_symbol:
   memset(sym, 0, sizeof(struct bcc_symbol));
+  bcc_metric_add(BCC_METRIC_SYMCACHE_MISSES, 1);
   return false;
 }
 
 bool KSyms::resolve_name(const char *_unused, const char *name,
                          uint64_t *addr) {
-  refresh();
-
-  if (syms_.size() != symnames_.size()) {
-    symnames_.clear();
-    for (Symbol &sym : syms_) {
-      symnames_[sym.name] = sym.addr;
-    }
-  }
-
-  auto it = symnames_.find(name);
-  if (it == symnames_.end())
+  std::shared_ptr<Table> shared = this->table();
+
+  Table &table = *shared;
+  std::call_once(table.names_once, [&table]() {
+    table.by_name.resize(table.syms.size());
+    for (size_t i = 0; i < table.by_name.size(); i++)
+      table.by_name[i] = i;
+    // stable, so that equal names stay in address order
+    std::stable_sort(table.by_name.begin(), table.by_name.end(),
+                     [&table](uint32_t a, uint32_t b) {
+                       return strcmp(table.str(table.syms[a].name),
+                                     table.str(table.syms[b].name)) < 0;
+                     });
+  });
+
+  auto it = std::upper_bound(table.by_name.begin(), table.by_name.end(), name,
+                             [&table](const char *name, uint32_t i) {
+                               return strcmp(name, table.str(table.syms[i].name)) < 0;
+                             });
+  if (it == table.by_name.begin())
     return false;
-
-  *addr = it->second;
+  // The last symbol of a name wins, like the name map used to do
+  const Table::Symbol &sym = table.syms[*--it];
+  if (strcmp(name, table.str(sym.name)))
+    return false;
+  *addr = sym.addr;
   return true;
 }
 
 ProcSyms::ProcSyms(int pid, struct bcc_symbol_option *option)
-    : pid_(pid), procstat_(pid) {
+    : pid_(pid), procstat_(pid), prefetch_stop_(false) {
   if (option)
     std::memcpy(&symbol_option_, option, sizeof(bcc_symbol_option));
   else
@@ -116,14 +211,110 @@ ProcSyms::ProcSyms(int pid, struct bcc_symbol_option *option)
   load_modules();
 }
 
+ProcSyms::~ProcSyms() { stop_prefetch(); }
+
 void ProcSyms::load_modules() {
   bcc_procutils_each_module(pid_, _add_module, this);
+  build_range_index();
+}
+
+void ProcSyms::build_range_index() {
+  range_index_.clear();
+  perf_maps_.clear();
+  for (size_t i = 0; i < modules_.size(); i++) {
+    // perf maps and jitdumps cover the whole address space and are only a
+    // fallback
+    if (modules_[i].type_ == ModuleType::PERF_MAP ||
+        modules_[i].type_ == ModuleType::JIT_DUMP) {
+      perf_maps_.push_back(i);
+      continue;
+    }
+    for (const auto &range : modules_[i].ranges_)
+      range_index_.push_back({range.start, range.end, &range, i});
+  }
+  std::sort(range_index_.begin(), range_index_.end(),
+            [](const RangeEntry &a, const RangeEntry &b) {
+              return a.start < b.start;
+            });
 }
 
 void ProcSyms::refresh() {
-  modules_.clear();
+  std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+  refresh_locked();
+}
+
+void ProcSyms::refresh_if_stale() {
+  if (!procstat_.is_stale())
+    return;
+  std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+  // another thread may have refreshed in the meantime
+  if (procstat_.is_stale())
+    refresh_locked();
+}
+
+void ProcSyms::refresh_locked() {
+  // Keep what was read from perf maps and jitdumps, so that only the
+  // records appended since then are parsed
+  std::unordered_map<std::string, std::shared_ptr<SymbolTable>> perf_maps;
+  for (size_t i : perf_maps_)
+    perf_maps[modules_[i].path_] = modules_[i].table_;
+
+  // The old modules hold their tables until the new ones took them over,
+  // so that files still mapped aren't loaded again and the names other
+  // threads got from them stay valid
+  std::vector<Module> old_modules;
+  old_modules.swap(modules_);
+  bcc_procutils_invalidate_modules(pid_);
   load_modules();
+  for (size_t i : perf_maps_) {
+    auto it = perf_maps.find(modules_[i].path_);
+    if (it != perf_maps.end()) {
+      modules_[i].table_ = it->second;
+      modules_[i].update_perf_map();
+    }
+  }
   procstat_.reset();
+  if (prefetch_threads_)
+    start_prefetch();
+}
+
+void ProcSyms::prefetch(unsigned threads) {
+  std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+  prefetch_threads_ = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+  start_prefetch();
+}
+
+void ProcSyms::start_prefetch() {
+  stop_prefetch();
+
+  // Workers load through copies of the modules, which share the tables but
+  // stay valid while modules_ is reloaded
+  auto tasks = std::make_shared<std::vector<Module>>();
+  for (const Module &mod : modules_) {
+    if (mod.type_ == ModuleType::EXEC || mod.type_ == ModuleType::SO)
+      tasks->push_back(mod);
+  }
+  auto next = std::make_shared<std::atomic<size_t>>(0);
+  size_t threads = std::min<size_t>(prefetch_threads_, tasks->size());
+  for (size_t i = 0; i < threads; i++) {
+    prefetch_workers_.emplace_back([this, tasks, next]() {
+      size_t i;
+      while (!prefetch_stop_ && (i = (*next)++) < tasks->size()) {
+        Module &mod = (*tasks)[i];
+        std::lock_guard<std::mutex> lock(mod.table_->mutex_);
+        mod.load_sym_table();
+      }
+    });
+  }
+}
+
+void ProcSyms::stop_prefetch() {
+  // Tables being loaded are finished, the rest is left to lookups
+  prefetch_stop_ = true;
+  for (std::thread &worker : prefetch_workers_)
+    worker.join();
+  prefetch_workers_.clear();
+  prefetch_stop_ = false;
 }
 
 int ProcSyms::_add_module(mod_info *mod, int enter_ns, void *payload) {
@@ -137,17 +328,6 @@ int ProcSyms::_add_module(mod_info *mod, int enter_ns, void *payload) {
     auto module = Module(
         mod->name, modpath, &ps->symbol_option_);
 
-    // pid/maps doesn't account for file_offset of text within the ELF.
-    // It only gives the mmap offset. We need the real offset for symbol
-    // lookup.
-    if (module.type_ == ModuleType::SO) {
-      if (bcc_elf_get_text_scn_info(modpath, &module.elf_so_addr_,
-                                    &module.elf_so_offset_) < 0) {
-        fprintf(stderr, "WARNING: Couldn't find .text section in %s\n", modpath);
-        fprintf(stderr, "WARNING: BCC can't handle sym look ups for %s", modpath);
-      }
-    }
-
     if (!bcc_is_perf_map(modpath) || module.type_ != ModuleType::UNKNOWN)
       // Always add the module even if we can't read it, so that we could
       // report correct module name. Unless it's a perf map that we only
@@ -156,6 +336,12 @@ int ProcSyms::_add_module(mod_info *mod, int enter_ns, void *payload) {
     else
       return 0;
   }
+  // The JIT code a jitdump describes is anywhere but in its own mapping
+  if (it->type_ == ModuleType::JIT_DUMP) {
+    if (it->ranges_.empty())
+      it->ranges_.emplace_back(0, -1, 0);
+    return 0;
+  }
   it->ranges_.emplace_back(mod->start_addr, mod->end_addr, mod->file_offset);
   // perf-PID map is added last. We try both inside the Process's mount
   // namespace + chroot, and in global /tmp. Make sure we only add one.
@@ -165,37 +351,108 @@ int ProcSyms::_add_module(mod_info *mod, int enter_ns, void *payload) {
   return 0;
 }
 
+void ProcSyms::unmap_range(uint64_t start, uint64_t end) {
+  for (Module &mod : modules_) {
+    if (mod.type_ == ModuleType::PERF_MAP ||
+        mod.type_ == ModuleType::JIT_DUMP)
+      continue;
+    std::vector<Module::Range> ranges;
+    for (const Module::Range &r : mod.ranges_) {
+      if (r.end <= start || r.start >= end) {
+        ranges.push_back(r);
+        continue;
+      }
+      // Keep the parts of a partially unmapped range
+      if (r.start < start)
+        ranges.emplace_back(r.start, start, r.file_offset);
+      if (r.end > end)
+        ranges.emplace_back(end, r.end, r.file_offset + (end - r.start));
+    }
+    mod.ranges_.swap(ranges);
+  }
+  modules_.erase(std::remove_if(modules_.begin(), modules_.end(),
+                                [](const Module &m) { return m.ranges_.empty(); }),
+                 modules_.end());
+}
+
+bool ProcSyms::add_mapping(const mod_info *mod) {
+  if (!mod->name || !bcc_mapping_is_file_backed(mod->name) ||
+      mod->start_addr >= mod->end_addr)
+    return false;
+  std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+  // A new mapping replaces whatever was mapped in its range
+  unmap_range(mod->start_addr, mod->end_addr);
+  mod_info info = *mod;
+  _add_module(&info, 1, this);
+  build_range_index();
+  return true;
+}
+
+bool ProcSyms::remove_mapping(uint64_t start, uint64_t end) {
+  if (start >= end)
+    return false;
+  std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+  unmap_range(start, end);
+  build_range_index();
+  return true;
+}
+
 bool ProcSyms::resolve_addr(uint64_t addr, struct bcc_symbol *sym,
                             bool demangle) {
-  if (procstat_.is_stale())
-    refresh();
+  refresh_if_stale();
+  std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+  return lookup_addr(addr, sym, demangle);
+}
 
+size_t ProcSyms::resolve_addrs(const uint64_t *addrs, size_t n,
+                               struct bcc_symbol *syms, bool demangle) {
+  refresh_if_stale();
+  std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+  return resolve_sorted(addrs, n, syms, [&](uint64_t addr, bcc_symbol *sym) {
+    return lookup_addr(addr, sym, demangle);
+  });
+}
+
+const ProcSyms::RangeEntry *ProcSyms::find_range(uint64_t addr) const {
+  // Mappings of different modules never overlap, so at most one range can
+  // contain addr
+  auto it = std::upper_bound(
+      range_index_.begin(), range_index_.end(), addr,
+      [](uint64_t addr, const RangeEntry &e) { return addr < e.start; });
+  if (it != range_index_.begin() && addr < (--it)->end)
+    return &*it;
+  return nullptr;
+}
+
+bool ProcSyms::lookup_addr(uint64_t addr, struct bcc_symbol *sym,
+                           bool demangle) {
   memset(sym, 0, sizeof(struct bcc_symbol));
 
   const char *original_module = nullptr;
   uint64_t offset;
-  bool only_perf_map = false;
-  for (Module &mod : modules_) {
-    if (only_perf_map && (mod.type_ != ModuleType::PERF_MAP))
-      continue;
-    if (mod.contains(addr, offset)) {
-      if (mod.find_addr(offset, sym)) {
-        if (demangle) {
-          if (sym->name && (!strncmp(sym->name, "_Z", 2) || !strncmp(sym->name, "___Z", 4)))
-            sym->demangle_name =
-                abi::__cxa_demangle(sym->name, nullptr, nullptr, nullptr);
-          if (!sym->demangle_name)
-            sym->demangle_name = sym->name;
-        }
-        return true;
-      } else if (mod.type_ != ModuleType::PERF_MAP) {
-        // In this case, we found the address in the range of a module, but
-        // not able to find a symbol of that address in the module.
-        // Thus, we would try to find the address in perf map, and
-        // save the module's name in case we will need it later.
-        original_module = mod.name_.c_str();
-        only_perf_map = true;
-      }
+  if (const RangeEntry *it = find_range(addr)) {
+    Module &mod = modules_[it->module];
+    offset = mod.offset_of(*it->range, addr);
+    if (mod.find_addr(offset, sym)) {
+      if (demangle)
+        sym->demangle_name = mod.demangled_name(sym->name);
+      bcc_metric_add(BCC_METRIC_SYMCACHE_HITS, 1);
+      return true;
+    }
+    // In this case, we found the address in the range of a module, but
+    // not able to find a symbol of that address in the module.
+    // Thus, we would try to find the address in perf map, and
+    // save the module's name in case we will need it later.
+    original_module = mod.name_.c_str();
+  }
+
+  for (size_t i : perf_maps_) {
+    Module &mod = modules_[i];
+    if (mod.contains(addr, offset) && mod.find_addr(offset, sym)) {
+      if (demangle)
+        sym->demangle_name = mod.demangled_name(sym->name);
+      bcc_metric_add(BCC_METRIC_SYMCACHE_HITS, 1);
+      return true;
     }
   }
   // If we didn't find the symbol anywhere, the module name is probably
@@ -204,13 +461,14 @@ bool ProcSyms::resolve_addr(uint64_t addr, struct bcc_symbol *sym,
   // report the saved original module name instead.
   if (original_module)
     sym->module = original_module;
+  bcc_metric_add(BCC_METRIC_SYMCACHE_MISSES, 1);
   return false;
 }
 
 bool ProcSyms::resolve_name(const char *module, const char *name,
                             uint64_t *addr) {
-  if (procstat_.is_stale())
-    refresh();
+  refresh_if_stale();
+  std::shared_lock<std::shared_timed_mutex> lock(mutex_);
 
   for (Module &mod : modules_) {
     if (mod.name_ == module)
@@ -219,28 +477,204 @@ bool ProcSyms::resolve_name(const char *module, const char *name,
   return false;
 }
 
+int ProcSyms::resolve_source(uint64_t addr, struct bcc_source_frame *frames,
+                             size_t max) {
+  refresh_if_stale();
+  std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+
+  const RangeEntry *it = find_range(addr);
+  if (!it)
+    return -1;
+  Module &mod = modules_[it->module];
+  return mod.find_source(mod.offset_of(*it->range, addr), frames, max);
+}
+
+int ProcSyms::unwind(const struct bcc_user_regs *regs, const void *stack,
+                     size_t stack_len, uint64_t *ips, size_t max) {
+  refresh_if_stale();
+  std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+
+  const uint8_t *data = static_cast<const uint8_t *>(stack);
+  auto read = [&](uint64_t addr, uint64_t *val) {
+    if (addr < regs->sp || addr - regs->sp > stack_len ||
+        stack_len - (addr - regs->sp) < sizeof(*val))
+      return false;
+    memcpy(val, data + (addr - regs->sp), sizeof(*val));
+    return true;
+  };
+
+  uint64_t ip = regs->ip, sp = regs->sp, bp = regs->bp;
+  size_t n = 0;
+  while (n < max && ip) {
+    ips[n++] = ip;
+    // Return addresses point after the call, which may be the start of the
+    // next function
+    uint64_t pc = n == 1 ? ip : ip - 1;
+    uint64_t cfa, ra;
+    struct bcc_cfi_row row;
+    const RangeEntry *it = find_range(pc);
+    if (it && modules_[it->module].find_cfi(
+                  modules_[it->module].offset_of(*it->range, pc), &row)) {
+      cfa = (row.cfa_reg == BCC_CFI_CFA_SP ? sp : bp) + row.cfa_offset;
+      if (!read(cfa - 8, &ra) ||
+          (row.bp_offset && !read(cfa + row.bp_offset, &bp)))
+        break;
+    } else {
+      // No unwind table, hope for a frame pointer
+      cfa = bp + 16;
+      if (!read(bp + 8, &ra) || !read(bp, &bp))
+        break;
+    }
+    // Callers' frames are above, anything else is garbage
+    if (cfa <= sp)
+      break;
+    sp = cfa;
+    ip = ra;
+  }
+  return n;
+}
+
+bool ProcSyms::file_info(const std::string &path, FileInfo &info) {
+  // (dev, inode, size, mtime)
+  typedef std::tuple<dev_t, ino_t, off_t, time_t, long> Key;
+  static std::mutex mutex;
+  static std::map<Key, FileInfo> store;
+  const size_t max_files = 4096;
+
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0)
+    return false;
+  Key key(st.st_dev, st.st_ino, st.st_size, st.st_mtim.tv_sec,
+          st.st_mtim.tv_nsec);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = store.find(key);
+    if (it != store.end()) {
+      info = it->second;
+      return true;
+    }
+  }
+
+  info = FileInfo();
+  info.dev = st.st_dev;
+  info.ino = st.st_ino;
+  info.elf_type = bcc_elf_get_type(path.c_str());
+  char buildid[BPF_BUILD_ID_SIZE * 2 + 1] = {};
+  if (info.elf_type >= 0 && bcc_elf_get_buildid(path.c_str(), buildid) == 0)
+    info.id = info.build_id = buildid;
+  else
+    info.id = tfm::format("%d:%d.%d", (int64_t)st.st_size,
+                          (int64_t)st.st_mtim.tv_sec,
+                          (int64_t)st.st_mtim.tv_nsec);
+  // pid/maps doesn't account for file_offset of text within the ELF.
+  // It only gives the mmap offset. We need the real offset for symbol
+  // lookup.
+  if (info.elf_type == ET_DYN)
+    info.has_text = bcc_elf_get_text_scn_info(path.c_str(), &info.text_addr,
+                                              &info.text_offset) == 0;
+
+  // Only ELF files are worth remembering, perf maps keep changing
+  if (info.elf_type >= 0) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (store.size() >= max_files)
+      store.clear();
+    store.emplace(key, info);
+  }
+  return true;
+}
+
+std::shared_ptr<ProcSyms::SymbolTable> ProcSyms::shared_table(
+    const std::string &path, ModuleType type,
+    const bcc_symbol_option *option) {
+  FileInfo info;
+  if (type == ModuleType::VDSO) {
+    // Every process maps the same vDSO, and its symbols are read from ours
+    info.id = "[vdso]";
+    return shared_table(info, nullptr);
+  }
+  if (!file_info(path, info))
+    return std::make_shared<SymbolTable>();
+  return shared_table(info, option);
+}
+
+std::shared_ptr<ProcSyms::SymbolTable> ProcSyms::shared_table(
+    const FileInfo &info, const bcc_symbol_option *option) {
+  // (dev, inode, build-id or size/mtime, symbol options)
+  typedef std::tuple<dev_t, ino_t, std::string, int, int, int, uint32_t> Key;
+  static std::mutex mutex;
+  static std::map<Key, std::weak_ptr<SymbolTable>> store;
+  static size_t sweep_at = 64;
+
+  Key key = option ? Key(info.dev, info.ino, info.id, option->use_debug_file,
+                         option->check_debug_file_crc,
+                         option->lazy_symbolize, option->use_symbol_type)
+                   : Key(info.dev, info.ino, info.id, 0, 0, 0, 0);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto &entry = store[key];
+  std::shared_ptr<SymbolTable> table = entry.lock();
+  if (!table) {
+    table = std::make_shared<SymbolTable>();
+    table->build_id_ = info.build_id;
+    entry = table;
+  }
+
+  // Drop the entries of binaries no process maps anymore
+  if (store.size() >= sweep_at) {
+    for (auto it = store.begin(); it != store.end();) {
+      if (it->second.expired())
+        it = store.erase(it);
+      else
+        ++it;
+    }
+    sweep_at = std::max<size_t>(64, store.size() * 2);
+  }
+  return table;
+}
+
 ProcSyms::Module::Module(const char *name, const char *path,
     struct bcc_symbol_option *option)
     : name_(name),
       path_(path),
-      loaded_(false),
       symbol_option_(option),
       type_(ModuleType::UNKNOWN) {
-  int elf_type = bcc_elf_get_type(path_.c_str());
+  // The only access to the file when another process mapped it already
+  FileInfo info;
+  int elf_type = file_info(path_, info) ? info.elf_type : -1;
   // The Module is an ELF file
   if (elf_type >= 0) {
     if (elf_type == ET_EXEC)
       type_ = ModuleType::EXEC;
     else if (elf_type == ET_DYN)
       type_ = ModuleType::SO;
+    if (type_ != ModuleType::UNKNOWN)
+      table_ = shared_table(info, symbol_option_);
+    else
+      table_ = std::make_shared<SymbolTable>();
+
+    elf_so_addr_ = info.text_addr;
+    elf_so_offset_ = info.text_offset;
+    if (type_ == ModuleType::SO && !info.has_text) {
+      fprintf(stderr, "WARNING: Couldn't find .text section in %s\n", path);
+      fprintf(stderr, "WARNING: BCC can't handle sym look ups for %s", path);
+    }
     return;
   }
   // Other symbol files
   if (bcc_is_valid_perf_map(path_.c_str()) == 1)
     type_ = ModuleType::PERF_MAP;
+  else if (bcc_is_jitdump(path_.c_str()))
+    type_ = ModuleType::JIT_DUMP;
   else if (bcc_elf_is_vdso(path_.c_str()) == 1)
     type_ = ModuleType::VDSO;
 
+  // perf maps and jitdumps are written by the process itself and never
+  // shared
+  if (type_ == ModuleType::VDSO)
+    table_ = shared_table(path_, type_, symbol_option_);
+  else
+    table_ = std::make_shared<SymbolTable>();
+
   // Will be stored later
   elf_so_offset_ = 0;
   elf_so_addr_ = 0;
@@ -249,8 +683,8 @@ ProcSyms::Module::Module(const char *name, const char *path,
 int ProcSyms::Module::_add_symbol(const char *symname, uint64_t start,
                                   uint64_t size, void *p) {
   Module *m = static_cast<Module *>(p);
-  auto res = m->symnames_.emplace(symname);
-  m->syms_.emplace_back(&*(res.first), start, size);
+  auto res = m->table_->symnames_.emplace(symname);
+  m->table_->syms_.emplace_back(&*(res.first), start, size);
   return 0;
 }
 
@@ -258,23 +692,38 @@ int ProcSyms::Module::_add_symbol_lazy(size_t section_idx, size_t str_table_idx,
                                        size_t str_len, uint64_t start,
                                        uint64_t size, int debugfile, void *p) {
   Module *m = static_cast<Module *>(p);
-  m->syms_.emplace_back(
+  m->table_->syms_.emplace_back(
       section_idx, str_table_idx, str_len, start, size, debugfile);
   return 0;
 }
 
 void ProcSyms::Module::load_sym_table() {
-  if (loaded_)
+  if (table_->loaded_)
     return;
-  loaded_ = true;
+  table_->loaded_ = true;
 
   if (type_ == ModuleType::UNKNOWN)
     return;
 
-  if (type_ == ModuleType::PERF_MAP)
-    bcc_perf_map_foreach_sym(path_.c_str(), _add_symbol, this);
+  std::string index_path;
+  if (type_ == ModuleType::PERF_MAP) {
+    read_perf_map();
+    return;
+  }
+  if (type_ == ModuleType::JIT_DUMP) {
+    read_jitdump();
+    return;
+  }
   if (type_ == ModuleType::EXEC || type_ == ModuleType::SO) {
-    if (symbol_option_->lazy_symbolize)
+    index_path = SymbolIndex::path(table_->build_id_, symbol_option_);
+    if (!index_path.empty()) {
+      table_->index_ = SymbolIndex::open(index_path);
+      if (table_->index_)
+        return;
+    }
+    bcc_metric_add(BCC_METRIC_ELF_LOADS, 1);
+    // Building the index needs every name, so lazy loading is pointless
+    if (symbol_option_->lazy_symbolize && index_path.empty())
       bcc_elf_foreach_sym_lazy(path_.c_str(), _add_symbol_lazy, symbol_option_, this);
     else
       bcc_elf_foreach_sym(path_.c_str(), _add_symbol, symbol_option_, this);
@@ -282,22 +731,138 @@ void ProcSyms::Module::load_sym_table() {
   if (type_ == ModuleType::VDSO)
     bcc_elf_foreach_vdso_sym(_add_symbol, this);
 
-  std::sort(syms_.begin(), syms_.end());
+  std::sort(table_->syms_.begin(), table_->syms_.end());
+  if (!index_path.empty())
+    save_sym_index(index_path);
+}
+
+// Parse the lines appended to the perf map since the last call and merge
+// them into the sorted symbols. Called with table_->mutex_ held.
+void ProcSyms::Module::read_perf_map() {
+  std::vector<Symbol> &syms = table_->syms_;
+  size_t old_size = syms.size();
+  int res = bcc_perf_map_foreach_sym_from(
+      path_.c_str(), &table_->perf_map_offset_, _add_symbol, this);
+  if (res == 1) {
+    // The map was rewritten from scratch, drop what was read before it
+    syms.erase(syms.begin(), syms.begin() + old_size);
+    old_size = 0;
+  }
+  if (res < 0 || syms.size() == old_size)
+    return;
+
+  std::stable_sort(syms.begin() + old_size, syms.end());
+  // Stable, so a symbol emitted again at the same address sorts after the
+  // old one and is found first by find_addr()
+  std::inplace_merge(syms.begin(), syms.begin() + old_size, syms.end());
+}
+
+int ProcSyms::Module::_add_jit_record(const struct bcc_jitdump_record *rec,
+                                      void *p) {
+  Module *m = static_cast<Module *>(p);
+  SymbolTable &table = *m->table_;
+  // no address of empty code to resolve
+  if (!rec->size)
+    return 0;
+  if (rec->type == BCC_JITDUMP_CODE_LOAD) {
+    auto res = table.symnames_.emplace(rec->name);
+    table.jit_names_[rec->code_index] = &*res.first;
+    table.syms_.emplace_back(&*res.first, rec->addr, rec->size);
+    return 0;
+  }
+  auto it = table.jit_names_.find(rec->code_index);
+  if (it == table.jit_names_.end())
+    return 0;
+  table.syms_.emplace_back(it->second, rec->addr, rec->size);
+  // The code is gone from the old address, a zero size symbol there marks
+  // it as moved for read_jitdump()
+  table.syms_.emplace_back(it->second, rec->old_addr, 0);
+  return 0;
+}
+
+// Apply the records appended to the jitdump since the last call. Loads add
+// symbols like the lines of a perf map do, moves also remove the symbol at
+// the old address, so that code moved by the JIT, e.g. by a compacting
+// GC, resolves where it is now. Called with table_->mutex_ held.
+void ProcSyms::Module::read_jitdump() {
+  std::vector<Symbol> &syms = table_->syms_;
+  size_t old_size = syms.size();
+  int res = bcc_jitdump_foreach_from(path_.c_str(), &table_->perf_map_offset_,
+                                     _add_jit_record, this);
+  if (res == 1) {
+    syms.erase(syms.begin(), syms.begin() + old_size);
+    old_size = 0;
+  }
+  if (res < 0 || syms.size() == old_size)
+    return;
+
+  // Only moves add zero size symbols, drop them with the symbol each one
+  // moved away, the last one of that name at that address
+  std::vector<Symbol> moved;
+  for (size_t i = old_size; i < syms.size(); i++) {
+    if (!syms[i].size)
+      moved.push_back(syms[i]);
+  }
+  syms.erase(std::remove_if(syms.begin() + old_size, syms.end(),
+                            [](const Symbol &sym) { return !sym.size; }),
+             syms.end());
+  std::stable_sort(syms.begin() + old_size, syms.end());
+  std::inplace_merge(syms.begin(), syms.begin() + old_size, syms.end());
+  for (const Symbol &m : moved) {
+    auto range = std::equal_range(syms.begin(), syms.end(), m);
+    for (auto it = range.second; it != range.first;) {
+      if ((--it)->data.name == m.data.name) {
+        syms.erase(it);
+        break;
+      }
+    }
+  }
+}
+
+void ProcSyms::Module::update_perf_map() {
+  std::lock_guard<std::mutex> lock(table_->mutex_);
+  // not read yet, the first lookup loads the whole map
+  if (!table_->loaded_)
+    return;
+  if (type_ == ModuleType::JIT_DUMP)
+    read_jitdump();
+  else
+    read_perf_map();
+}
+
+void ProcSyms::Module::save_sym_index(const std::string &path) {
+  std::vector<SymbolIndex::Entry> entries;
+  std::string strtab;
+  std::unordered_map<const std::string *, uint64_t> offsets;
+
+  entries.reserve(table_->syms_.size());
+  for (const Symbol &sym : table_->syms_) {
+    // symnames_ dedups the names, so does the string table
+    auto res = offsets.emplace(sym.data.name, strtab.size());
+    if (res.second) {
+      strtab += *sym.data.name;
+      strtab += '\0';
+    }
+    entries.push_back({sym.start, sym.size, res.first->second});
+  }
+  SymbolIndex::write(path, entries, strtab);
+}
+
+uint64_t ProcSyms::Module::offset_of(const Range &range, uint64_t addr) const {
+  if (type_ == ModuleType::SO || type_ == ModuleType::VDSO) {
+    // Offset within the mmap
+    uint64_t offset = addr - range.start + range.file_offset;
+
+    // Offset within the ELF for SO symbol lookup
+    return offset + (elf_so_addr_ - elf_so_offset_);
+  }
+  return addr;
 }
 
 bool ProcSyms::Module::contains(uint64_t addr, uint64_t &offset) const {
   for (const auto &range : ranges_) {
     if (addr >= range.start && addr < range.end) {
-      if (type_ == ModuleType::SO || type_ == ModuleType::VDSO) {
-        // Offset within the mmap
-        offset = addr - range.start + range.file_offset;
-
-        // Offset within the ELF for SO symbol lookup
-        offset += (elf_so_addr_ - elf_so_offset_);
-      } else {
-        offset = addr;
-      }
-
+      offset = offset_of(range, addr);
       return true;
     }
   }
@@ -305,7 +870,81 @@ bool ProcSyms::Module::contains(uint64_t addr, uint64_t &offset) const {
   return false;
 }
 
+bool ProcSyms::lookup_name(SymbolTable &table, const std::string &path,
+                           const bcc_symbol_option *option,
+                           const char *symname, uint64_t *addr) {
+  std::lock_guard<std::mutex> lock(table.mutex_);
+  if (!table.names_loaded_) {
+    auto cb = [](const char *name, uint64_t start, uint64_t size, void *p) {
+      SymbolTable *t = static_cast<SymbolTable *>(p);
+      const std::string *key = &*t->symnames_.emplace(name).first;
+      // keep the first symbol of a name, like a scan stopping at the first
+      // match would
+      t->name_index_.emplace(key, start);
+      return 0;
+    };
+    if (bcc_elf_foreach_sym(path.c_str(), cb,
+                            const_cast<bcc_symbol_option *>(option),
+                            &table) < 0) {
+      table.name_index_.clear();
+      return false;
+    }
+    table.names_loaded_ = true;
+  }
+
+  auto name = table.symnames_.find(symname);
+  if (name == table.symnames_.end())
+    return false;
+  auto it = table.name_index_.find(&*name);
+  if (it == table.name_index_.end())
+    return false;
+  *addr = it->second;
+  return true;
+}
+
+bool ProcSyms::resolve_elf_name(const std::string &path,
+                                const bcc_symbol_option *option,
+                                const char *symname, uint64_t *addr) {
+  static std::mutex mutex;
+  static std::vector<std::shared_ptr<SymbolTable>> recent;
+  const size_t max_recent = 8;
+
+  auto table = shared_table(path, ModuleType::SO, option);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = std::find(recent.begin(), recent.end(), table);
+    if (it != recent.end())
+      recent.erase(it);
+    else if (recent.size() == max_recent)
+      recent.erase(recent.begin());
+    recent.push_back(table);
+  }
+  return lookup_name(*table, path, option, symname, addr);
+}
+
 bool ProcSyms::Module::find_name(const char *symname, uint64_t *addr) {
+  // ELF files go through the shared name index, perf maps change over
+  // time and the vDSO is small, those are scanned on every lookup
+  if (type_ == ModuleType::EXEC || type_ == ModuleType::SO) {
+    if (!lookup_name(*table_, path_, symbol_option_, symname, addr))
+      return false;
+    if (type_ == ModuleType::SO)
+      *addr += start();
+    return true;
+  }
+  // jitdumps are only applied to the table, code moves and all
+  if (type_ == ModuleType::JIT_DUMP) {
+    std::lock_guard<std::mutex> lock(table_->mutex_);
+    load_sym_table();
+    for (const Symbol &sym : table_->syms_) {
+      if (*sym.data.name == symname) {
+        *addr = sym.start;
+        return true;
+      }
+    }
+    return false;
+  }
+
   struct Payload {
     const char *symname;
     uint64_t *out;
@@ -331,28 +970,117 @@ bool ProcSyms::Module::find_name(const char *symname, uint64_t *addr) {
 
   if (type_ == ModuleType::PERF_MAP)
     bcc_perf_map_foreach_sym(path_.c_str(), cb, &payload);
-  if (type_ == ModuleType::EXEC || type_ == ModuleType::SO)
-    bcc_elf_foreach_sym(path_.c_str(), cb, symbol_option_, &payload);
   if (type_ == ModuleType::VDSO)
     bcc_elf_foreach_vdso_sym(cb, &payload);
 
-  if (!payload.found)
+  return payload.found;
+}
+
+bool ProcSyms::Module::find_cfi(uint64_t offset, struct bcc_cfi_row *row) {
+  if (type_ != ModuleType::EXEC && type_ != ModuleType::SO)
     return false;
 
-  if (type_ == ModuleType::SO)
-    *(payload.out) += start();
+  std::lock_guard<std::mutex> lock(table_->mutex_);
+  if (!table_->cfi_loaded_) {
+    table_->cfi_loaded_ = true;
+    struct bcc_cfi_row *rows;
+    int n = bcc_elf_get_cfi_rows(path_.c_str(), &rows);
+    if (n > 0) {
+      table_->cfi_.assign(rows, rows + n);
+      free(rows);
+    }
+  }
 
+  auto &cfi = table_->cfi_;
+  auto it = std::upper_bound(
+      cfi.begin(), cfi.end(), offset,
+      [](uint64_t pc, const bcc_cfi_row &r) { return pc < r.pc; });
+  if (it == cfi.begin() || (--it)->cfa_reg == BCC_CFI_CFA_UNDEFINED)
+    return false;
+  *row = *it;
   return true;
 }
 
-bool ProcSyms::Module::find_addr(uint64_t offset, struct bcc_symbol *sym) {
-  load_sym_table();
+// Symbol names are stable for the lifetime of the table, so the demangled
+// form is computed once per name and handed out by pointer from then on.
+int ProcSyms::Module::find_source(uint64_t offset,
+                                  struct bcc_source_frame *frames,
+                                  size_t max) {
+  if (type_ != ModuleType::EXEC && type_ != ModuleType::SO)
+    return -1;
+
+  std::vector<SourceLines::Frame> found;
+  size_t n;
+  {
+    std::lock_guard<std::mutex> lock(table_->mutex_);
+    if (!table_->lines_loaded_) {
+      table_->lines_loaded_ = true;
+      char *dwarf_file = bcc_elf_get_dwarf_file(path_.c_str(), symbol_option_);
+      if (dwarf_file) {
+        table_->lines_ = SourceLines::open(dwarf_file);
+        free(dwarf_file);
+      }
+    }
+    if (!table_->lines_ || !table_->lines_->lookup(offset, &found))
+      return -1;
+
+    // Names are interned with the symbol names, so they live as long as the
+    // table
+    n = std::min(found.size(), max);
+    for (size_t i = 0; i < n; i++) {
+      frames[i].name = table_->symnames_.insert(found[i].function).first->c_str();
+      frames[i].file = table_->symnames_.insert(found[i].file).first->c_str();
+      frames[i].line = found[i].line;
+      frames[i].column = found[i].column;
+    }
+  }
+  for (size_t i = 0; i < n; i++)
+    frames[i].demangle_name = demangled_name(frames[i].name);
+  return found.size();
+}
 
+const char *ProcSyms::Module::demangled_name(const char *name) {
+  if (!name || (strncmp(name, "_Z", 2) && strncmp(name, "___Z", 4)))
+    return name;
+
+  std::lock_guard<std::mutex> lock(table_->mutex_);
+  auto res = table_->demangled_.emplace(name, std::string());
+  if (res.second) {
+    char *demangled = abi::__cxa_demangle(name, nullptr, nullptr, nullptr);
+    if (demangled) {
+      res.first->second = demangled;
+      ::free(demangled);
+    }
+  }
+  // names that fail to demangle are cached as empty
+  return res.first->second.empty() ? name : res.first->second.c_str();
+}
+
+bool ProcSyms::Module::find_addr(uint64_t offset, struct bcc_symbol *sym) {
   sym->module = name_.c_str();
   sym->offset = offset;
 
-  auto it = std::upper_bound(syms_.begin(), syms_.end(), Symbol(nullptr, offset, 0));
-  if (it == syms_.begin())
+  // The table may be shared with ProcSyms used on other threads. Until it
+  // is ready, or for ever for perf maps, it is searched with its mutex held.
+  if (!table_->ready_.load(std::memory_order_acquire)) {
+    std::lock_guard<std::mutex> lock(table_->mutex_);
+    load_sym_table();
+    if (type_ == ModuleType::PERF_MAP || type_ == ModuleType::JIT_DUMP)
+      return find_symbol(offset, sym, true);
+    table_->ready_.store(true, std::memory_order_release);
+  }
+  return find_symbol(offset, sym, false);
+}
+
+bool ProcSyms::Module::find_symbol(uint64_t offset, struct bcc_symbol *sym,
+                                   bool locked) {
+  std::vector<Symbol> &syms = table_->syms_;
+
+  if (table_->index_)
+    return table_->index_->find(offset, &sym->name, &sym->offset);
+
+  auto it = std::upper_bound(syms.begin(), syms.end(), Symbol(nullptr, offset, 0));
+  if (it == syms.begin())
     return false;
 
   // 'it' points to the symbol whose start address is strictly greater than
@@ -379,16 +1107,25 @@ bool ProcSyms::Module::find_addr(uint64_t offset, struct bcc_symbol *sym) {
   uint64_t limit = it->start;
   for (; offset >= it->start; --it) {
     if (offset < it->start + it->size) {
-      // Resolve and cache the symbol name if necessary
-      if (!it->is_name_resolved) {
-        std::string sym_name(it->data.name_idx.str_len + 1, '\0');
-        if (bcc_elf_symbol_str(path_.c_str(), it->data.name_idx.section_idx,
-              it->data.name_idx.str_table_idx, &sym_name[0], sym_name.size(),
-              it->data.name_idx.debugfile))
-          break;
-
-        it->data.name = &*(symnames_.emplace(std::move(sym_name)).first);
-        it->is_name_resolved = true;
+      // Resolve and cache the symbol name if necessary. Lookups without
+      // the mutex only read the name once is_name_resolved is set, and
+      // released after the name.
+      // Any path to the file works, the table is keyed by its inode
+      if (!__atomic_load_n(&it->is_name_resolved, __ATOMIC_ACQUIRE)) {
+        std::unique_lock<std::mutex> lock(table_->mutex_, std::defer_lock);
+        if (!locked)
+          lock.lock();
+        if (!it->is_name_resolved) {
+          std::string sym_name(it->data.name_idx.str_len + 1, '\0');
+          if (bcc_elf_symbol_str(path_.c_str(), it->data.name_idx.section_idx,
+                it->data.name_idx.str_table_idx, &sym_name[0],
+                sym_name.size(), it->data.name_idx.debugfile))
+            break;
+
+          it->data.name =
+              &*(table_->symnames_.emplace(std::move(sym_name)).first);
+          __atomic_store_n(&it->is_name_resolved, true, __ATOMIC_RELEASE);
+        }
       }
 
       sym->name = it->data.name->c_str();
@@ -398,7 +1135,7 @@ bool ProcSyms::Module::find_addr(uint64_t offset, struct bcc_symbol *sym) {
     if (limit > it->start + it->size)
       break;
     // But don't step beyond begin()!
-    if (it == syms_.begin())
+    if (it == syms.begin())
       break;
   }
 
@@ -417,6 +1154,7 @@ bool BuildSyms::Module::load_sym_table()
     .use_symbol_type = (1 << STT_FUNC) | (1 << STT_GNU_IFUNC)
   };
 
+  bcc_metric_add(BCC_METRIC_ELF_LOADS, 1);
   bcc_elf_foreach_sym(module_name_.c_str(), _add_symbol, &symbol_option_, this);
   std::sort(syms_.begin(), syms_.end());
 
@@ -454,11 +1192,13 @@ bool BuildSyms::Module::resolve_addr(uint64_t offset, struct bcc_symbol* sym,
       sym->demangle_name = sym->name;
     sym->offset = offset - (*it).start;
     sym->module = module_name_.c_str();
+    bcc_metric_add(BCC_METRIC_SYMCACHE_HITS, 1);
     return true;
   }
 
 unknown_symbol:
   memset(sym, 0, sizeof(struct bcc_symbol));
+  bcc_metric_add(BCC_METRIC_SYMCACHE_MISSES, 1);
   return false;
 }
 
@@ -479,17 +1219,66 @@ bool BuildSyms::add_module(const std::string module_name)
   return true;
 }
 
+bool BuildSyms::add_store(const std::string &dir)
+{
+  struct stat s;
+
+  if (stat(dir.c_str(), &s) < 0 || !S_ISDIR(s.st_mode))
+    return false;
+  stores_.push_back(dir);
+  // build-ids missing so far may be found in this one
+  for (auto it = buildmap_.begin(); it != buildmap_.end();) {
+    if (!it->second)
+      it = buildmap_.erase(it);
+    else
+      ++it;
+  }
+  return true;
+}
+
+BuildSyms::Module *BuildSyms::find_module(const std::string &build_id)
+{
+  auto it = buildmap_.find(build_id);
+  if (it != buildmap_.end())
+    return it->second.get();
+  if (stores_.empty() || build_id.size() < 3)
+    return nullptr;
+
+  // The layouts of /usr/lib/debug/.build-id, of a copy of it, and of the
+  // debuginfod client cache
+  std::string dir = build_id.substr(0, 2), file = build_id.substr(2);
+  const std::string layouts[] = {
+    "/" + dir + "/" + file + ".debug",
+    "/.build-id/" + dir + "/" + file + ".debug",
+    "/" + dir + "/" + file,
+    "/" + build_id + "/debuginfo",
+  };
+  std::unique_ptr<Module> mod;
+  for (const auto &store : stores_) {
+    for (const auto &layout : layouts) {
+      std::string path = store + layout;
+      if (access(path.c_str(), R_OK) == 0) {
+        mod.reset(new Module(path.c_str()));
+        break;
+      }
+    }
+    if (mod)
+      break;
+  }
+  // Remember misses too, stores are searched once per build-id
+  auto &entry = buildmap_[build_id];
+  entry = std::move(mod);
+  return entry.get();
+}
+
 bool BuildSyms::resolve_addr(std::string build_id, uint64_t offset,
                              struct bcc_symbol *sym, bool demangle)
 {
-  std::unordered_map<std::string,std::unique_ptr<BuildSyms::Module> >::iterator it;
-
-  it = buildmap_.find(build_id);
-  if (it == buildmap_.end())
-    /*build-id not added to the BuildSym*/
+  BuildSyms::Module *mod = find_module(build_id);
+  if (!mod)
+    /*build-id not added to the BuildSym nor in a store*/
     return false;
 
-  BuildSyms::Module *mod = it->second.get();
   return mod->resolve_addr(offset, sym, demangle);
 }
 
@@ -509,8 +1298,7 @@ void bcc_free_symcache(void *symcache, int pid) {
 }
 
 void bcc_symbol_free_demangle_name(struct bcc_symbol *sym) {
-  if (sym->demangle_name && (sym->demangle_name != sym->name))
-    free(const_cast<char*>(sym->demangle_name));
+  // Demangled names are owned by the symbol cache now, nothing to free
 }
 
 int bcc_symcache_resolve(void *resolver, uint64_t addr,
@@ -525,6 +1313,19 @@ int bcc_symcache_resolve_no_demangle(void *resolver, uint64_t addr,
   return cache->resolve_addr(addr, sym, false) ? 0 : -1;
 }
 
+int bcc_symcache_resolve_batch(void *resolver, const uint64_t *addrs,
+                               size_t n, struct bcc_symbol *syms) {
+  SymbolCache *cache = static_cast<SymbolCache *>(resolver);
+  return cache->resolve_addrs(addrs, n, syms);
+}
+
+int bcc_symcache_resolve_batch_no_demangle(void *resolver,
+                                           const uint64_t *addrs, size_t n,
+                                           struct bcc_symbol *syms) {
+  SymbolCache *cache = static_cast<SymbolCache *>(resolver);
+  return cache->resolve_addrs(addrs, n, syms, false);
+}
+
 int bcc_symcache_resolve_name(void *resolver, const char *module,
                               const char *name, uint64_t *addr) {
   SymbolCache *cache = static_cast<SymbolCache *>(resolver);
@@ -536,6 +1337,34 @@ void bcc_symcache_refresh(void *resolver) {
   cache->refresh();
 }
 
+int bcc_symcache_resolve_source(void *resolver, uint64_t addr,
+                                struct bcc_source_frame *frames, size_t max) {
+  SymbolCache *cache = static_cast<SymbolCache *>(resolver);
+  return cache->resolve_source(addr, frames, max);
+}
+
+int bcc_symcache_unwind(void *resolver, const struct bcc_user_regs *regs,
+                        const void *stack, size_t stack_len, uint64_t *ips,
+                        size_t max) {
+  SymbolCache *cache = static_cast<SymbolCache *>(resolver);
+  return cache->unwind(regs, stack, stack_len, ips, max);
+}
+
+void bcc_symcache_prefetch(void *resolver, unsigned int threads) {
+  SymbolCache *cache = static_cast<SymbolCache *>(resolver);
+  cache->prefetch(threads);
+}
+
+int bcc_symcache_add_mapping(void *resolver, const struct mod_info *mod) {
+  SymbolCache *cache = static_cast<SymbolCache *>(resolver);
+  return cache->add_mapping(mod) ? 0 : -1;
+}
+
+int bcc_symcache_remove_mapping(void *resolver, uint64_t start, uint64_t end) {
+  SymbolCache *cache = static_cast<SymbolCache *>(resolver);
+  return cache->remove_mapping(start, end) ? 0 : -1;
+}
+
 void *bcc_buildsymcache_new(void) {
   return static_cast<void *>(new BuildSyms());
 }
@@ -550,6 +1379,12 @@ int  bcc_buildsymcache_add_module(void *resolver, const char *module_name)
   return  bsym->add_module(module_name) ? 0 : -1;
 }
 
+int bcc_buildsymcache_add_store(void *resolver, const char *dir)
+{
+  BuildSyms *bsym = static_cast<BuildSyms *>(resolver);
+  return bsym->add_store(dir) ? 0 : -1;
+}
+
 int bcc_buildsymcache_resolve(void *resolver,
                               struct bpf_stack_build_id *trace,
                               struct bcc_symbol *sym)
@@ -636,13 +1471,30 @@ int bcc_resolve_global_addr(int pid, const char *module, const uint64_t address,
   return 0;
 }
 
-static int _sym_cb_wrapper(const char *symname, uint64_t addr, uint64_t,
-                           void *payload) {
-  SYM_CB cb = (SYM_CB) payload;
-  return cb(symname, addr);
+struct sym_match_t {
+  const char *prefix;
+  size_t prefix_len;
+  regex_t *re;
+  SYM_CB cb;
+};
+
+static int _sym_match_cb(const char *symname, uint64_t addr, uint64_t,
+                         void *payload) {
+  struct sym_match_t *m = static_cast<sym_match_t *>(payload);
+
+  if (m->prefix_len && strncmp(symname, m->prefix, m->prefix_len) != 0)
+    return 0;
+  if (m->re && regexec(m->re, symname, 0, NULL, 0) != 0)
+    return 0;
+  return m->cb(symname, addr);
 }
 
 int bcc_foreach_function_symbol(const char *module, SYM_CB cb) {
+  return bcc_foreach_function_symbol_match(module, NULL, NULL, cb);
+}
+
+int bcc_foreach_function_symbol_match(const char *module, const char *prefix,
+                                      const char *sym_re, SYM_CB cb) {
   if (module == 0 || cb == 0)
     return -1;
 
@@ -653,18 +1505,20 @@ int bcc_foreach_function_symbol(const char *module, SYM_CB cb) {
     .use_symbol_type = (1 << STT_FUNC) | (1 << STT_GNU_IFUNC)
   };
 
-  return bcc_elf_foreach_sym(
-      module, _sym_cb_wrapper, &default_option, (void *)cb);
-}
-
-static int _find_sym(const char *symname, uint64_t addr, uint64_t,
-                     void *payload) {
-  struct bcc_symbol *sym = (struct bcc_symbol *)payload;
-  if (!strcmp(sym->name, symname)) {
-    sym->offset = addr;
-    return -1;
+  struct sym_match_t m = {prefix, prefix ? strlen(prefix) : 0, NULL, cb};
+  regex_t re;
+  if (sym_re && *sym_re) {
+    // anchored at the start only, like Python's re.match()
+    std::string anchored = std::string("^(") + sym_re + ")";
+    if (regcomp(&re, anchored.c_str(), REG_EXTENDED | REG_NOSUB) != 0)
+      return -EINVAL;
+    m.re = &re;
   }
-  return 0;
+
+  int res = bcc_elf_foreach_sym(module, _sym_match_cb, &default_option, &m);
+  if (m.re)
+    regfree(m.re);
+  return res;
 }
 
 struct load_addr_t {
@@ -720,9 +1574,13 @@ int bcc_resolve_symname(const char *module, const char *symname,
   if (option == NULL)
     option = &default_option;
 
-  if (sym->name && sym->offset == 0x0)
-    if (bcc_elf_foreach_sym(sym->module, _find_sym, option, sym) < 0)
+  if (sym->name && sym->offset == 0x0) {
+    uint64_t sym_addr;
+    if (!ProcSyms::resolve_elf_name(sym->module, option, sym->name,
+                                    &sym_addr))
       goto invalid_module;
+    sym->offset = sym_addr;
+  }
   if (sym->offset == 0x0)
     goto invalid_module;
 
@@ -20,6 +20,7 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
 #include "linux/bpf.h"
 #include "bcc_proc.h"
@@ -31,6 +32,23 @@ struct bcc_symbol {
   uint64_t offset;
 };
 
+// Source location of an address. name and file are empty if DWARF does not
+// say, line is 0 if it is unknown.
+struct bcc_source_frame {
+  const char *name;
+  const char *demangle_name;
+  const char *file;
+  uint32_t line;
+  uint32_t column;
+};
+
+// User space registers of a stack snapshot, see bcc_symcache_unwind()
+struct bcc_user_regs {
+  uint64_t ip;
+  uint64_t sp;
+  uint64_t bp;
+};
+
 typedef int (*SYM_CB)(const char *symname, uint64_t addr);
 struct mod_info;
 
@@ -54,20 +72,65 @@ struct bcc_symbol_option {
   uint32_t use_symbol_type;
 };
 
+// A symbol cache may be used from several threads at once, lookups only
+// wait for each other while a module is loaded or the cache refreshed.
 void *bcc_symcache_new(int pid, struct bcc_symbol_option *option);
 void bcc_free_symcache(void *symcache, int pid);
 
-// The demangle_name pointer in bcc_symbol struct is returned from the
-// __cxa_demangle function call, which is supposed to be freed by caller. Call
-// this function after done using returned result of bcc_symcache_resolve.
+// The demangle_name pointer in bcc_symbol struct is owned by the symbol cache
+// and, like name, stays valid until the cache is refreshed or freed. This
+// function used to free it and is now a no-op kept for compatibility.
 void bcc_symbol_free_demangle_name(struct bcc_symbol *sym);
 int bcc_symcache_resolve(void *symcache, uint64_t addr, struct bcc_symbol *sym);
 int bcc_symcache_resolve_no_demangle(void *symcache, uint64_t addr,
                                      struct bcc_symbol *sym);
+// Resolve addrs[0..n) into syms[0..n) in one call. This is much cheaper than
+// resolving them one by one: addresses are looked up in sorted order, and
+// repeated addresses are resolved once. Entries that could not be resolved
+// have a NULL name. Returns the number of resolved addresses.
+int bcc_symcache_resolve_batch(void *symcache, const uint64_t *addrs,
+                               size_t n, struct bcc_symbol *syms);
+int bcc_symcache_resolve_batch_no_demangle(void *symcache,
+                                           const uint64_t *addrs, size_t n,
+                                           struct bcc_symbol *syms);
+
+// Resolve addr to source locations using the DWARF of its module, from the
+// binary itself or from the debug file the symbol options allow. Code inlined
+// at addr yields one frame per call site: frames[0] is the innermost inlined
+// function and the last frame is the function that addr is in. Up to max
+// frames are stored, and strings are owned by the cache like symbol names.
+// Line tables are parsed once per module and shared by all caches. Returns
+// the number of frames at addr, or -1 if there is no line info for it. Only
+// libbcc built with LLVM reads DWARF.
+int bcc_symcache_resolve_source(void *resolver, uint64_t addr,
+                                struct bcc_source_frame *frames, size_t max);
+
+// Unwind the user stack of an x86_64 process from a copy of its top
+// stack_len bytes, starting at regs->sp, as taken by bpf_user_stack_fill().
+// Frames are unwound with the .eh_frame of their binary, so binaries built
+// without frame pointers can be unwound, and with frame pointers in code
+// without one. Stores up to max addresses, regs->ip first, in ips and
+// returns how many, or -1 if the cache can't unwind.
+int bcc_symcache_unwind(void *resolver, const struct bcc_user_regs *regs,
+                        const void *stack, size_t stack_len, uint64_t *ips,
+                        size_t max);
 
 int bcc_symcache_resolve_name(void *resolver, const char *module,
                               const char *name, uint64_t *addr);
 void bcc_symcache_refresh(void *resolver);
+// Load the symbols of all binaries mapped by the process in the background,
+// on up to threads threads or one per CPU if threads is 0, and again after
+// every refresh. Without it, symbols are loaded by the first lookup in each
+// binary. Does nothing for kernel symbol caches.
+void bcc_symcache_prefetch(void *resolver, unsigned int threads);
+// Apply an mmap or munmap of the process to the cache, as seen by an mmap
+// tracer or in perf MMAP2 records, instead of waiting for a refresh that
+// rescans /proc/PID/maps. mod describes an executable, file backed mapping
+// and replaces whatever was mapped in its range. An exec is still detected by
+// the cache itself and reloads all modules. Return 0 on success and -1 if the
+// mapping was ignored or the cache does not track mappings.
+int bcc_symcache_add_mapping(void *resolver, const struct mod_info *mod);
+int bcc_symcache_remove_mapping(void *resolver, uint64_t start, uint64_t end);
 
 int _bcc_syms_find_module(struct mod_info *info, int enter_ns, void *p);
 int bcc_resolve_global_addr(int pid, const char *module, const uint64_t address,
@@ -77,6 +140,12 @@ int bcc_resolve_global_addr(int pid, const char *module, const uint64_t address,
 void *bcc_buildsymcache_new(void);
 void bcc_free_buildsymcache(void *symcache);
 int  bcc_buildsymcache_add_module(void *resolver, const char *module_name);
+// Resolve the build-ids not added with bcc_buildsymcache_add_module() with
+// the debug files of dir, a store named by build-id like /usr/lib/debug,
+// e.g. dir/ab/cdef....debug for build-id abcdef..., or a debuginfod cache,
+// e.g. dir/abcdef.../debuginfo. Stores are searched in the order they were
+// added, and once per build-id. Returns -1 if dir is not a directory.
+int bcc_buildsymcache_add_store(void *resolver, const char *dir);
 int bcc_buildsymcache_resolve(void *resolver,
                               struct bpf_stack_build_id *trace,
                               struct bcc_symbol *sym);
@@ -84,6 +153,11 @@ int bcc_buildsymcache_resolve(void *resolver,
 // SYM_CB callback mainly for easier to use in Python API.
 // Will prefer use debug file and check debug file CRC when reading the module.
 int bcc_foreach_function_symbol(const char *module, SYM_CB cb);
+// Same, but only calls cb on the symbols starting with prefix and matching the
+// POSIX extended regular expression sym_re, anchored at the start. Both may be
+// NULL. Returns -EINVAL if sym_re does not compile.
+int bcc_foreach_function_symbol_match(const char *module, const char *prefix,
+                                      const char *sym_re, SYM_CB cb);
 
 // Find the offset of a symbol in a module binary. If addr is not zero, will
 // calculate the offset using the provided addr and the module's load address.
@@ -13,6 +13,7 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <chrono>
 #include <fcntl.h>
 #include <map>
 #include <string>
@@ -23,24 +24,11 @@
 #include <linux/bpf.h>
 #include <net/if.h>
 
-#include <llvm/ExecutionEngine/MCJIT.h>
-#include <llvm/ExecutionEngine/SectionMemoryManager.h>
-#include <llvm/IR/IRPrintingPasses.h>
-#include <llvm/IR/LegacyPassManager.h>
-#include <llvm/IR/LLVMContext.h>
-#include <llvm/IR/Module.h>
-#include <llvm/IR/Verifier.h>
-#include <llvm/Support/TargetSelect.h>
-#include <llvm/Transforms/IPO.h>
-#include <llvm/Transforms/IPO/PassManagerBuilder.h>
-#include <llvm-c/Transforms/IPO.h>
-
 #include "common.h"
-#include "bcc_debug.h"
 #include "bcc_elf.h"
 #include "frontends/clang/loader.h"
-#include "frontends/clang/b_frontend_action.h"
 #include "bpf_module.h"
+#include "bpf_module_compiler.h"
 #include "exported_files.h"
 #include "libbpf.h"
 #include "bcc_btf.h"
@@ -56,42 +44,44 @@ using std::string;
 using std::tuple;
 using std::unique_ptr;
 using std::vector;
-using namespace llvm;
+
+static uint64_t phase_clock_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
 
 const string BPFModule::FN_PREFIX = BPF_FN_PREFIX;
 
-// Snooping class to remember the sections as the JIT creates them
-class MyMemoryManager : public SectionMemoryManager {
- public:
-
-  explicit MyMemoryManager(sec_map_def *sections)
-      : sections_(sections) {
-  }
-
-  virtual ~MyMemoryManager() {}
-  uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
-                               unsigned SectionID,
-                               StringRef SectionName) override {
-    // The programs need to change from fake fd to real map fd, so not allocate ReadOnly regions.
-    uint8_t *Addr = SectionMemoryManager::allocateDataSection(Size, Alignment, SectionID, SectionName, false);
-    //printf("allocateDataSection: %s Addr %p Size %ld Alignment %d SectionID %d\n",
-    //       SectionName.str().c_str(), (void *)Addr, Size, Alignment, SectionID);
-    (*sections_)[SectionName.str()] = make_tuple(Addr, Size, SectionID);
-    return Addr;
-  }
-  uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment,
-                               unsigned SectionID, StringRef SectionName,
-                               bool isReadOnly) override {
-    // The lines in .BTF.ext line_info, if corresponding to remapped files, will have empty source line.
-    // The line_info will be fixed in place, so not allocate ReadOnly regions.
-    uint8_t *Addr = SectionMemoryManager::allocateDataSection(Size, Alignment, SectionID, SectionName, false);
-    //printf("allocateDataSection: %s Addr %p Size %ld Alignment %d SectionID %d\n",
-    //       SectionName.str().c_str(), (void *)Addr, Size, Alignment, SectionID);
-    (*sections_)[SectionName.str()] = make_tuple(Addr, Size, SectionID);
-    return Addr;
-  }
-  sec_map_def *sections_;
-};
+const char * FuncSource::src(const std::string& name) {
+  auto src = funcs_.find(name);
+  if (src == funcs_.end())
+    return "";
+  return src->second.src_.data();
+}
+
+const char * FuncSource::src_rewritten(const std::string& name) {
+  auto src = funcs_.find(name);
+  if (src == funcs_.end())
+    return "";
+  return src->second.src_rewritten_.data();
+}
+
+void FuncSource::set_src(const std::string& name, const std::string& src) {
+  funcs_[name].src_ = src;
+}
+
+void FuncSource::set_src_rewritten(const std::string& name, const std::string& src) {
+  funcs_[name].src_rewritten_ = src;
+}
+
+bool bpf_module_rw_engine_enabled(void) {
+#ifdef BCC_RW_ENGINE_DISABLED
+  return false;
+#else
+  return true;
+#endif
+}
 
 BPFModule::BPFModule(unsigned flags, TableStorage *ts, bool rw_engine_enabled,
                      const std::string &maps_ns, bool allow_rlimit,
@@ -100,22 +90,10 @@ BPFModule::BPFModule(unsigned flags, TableStorage *ts, bool rw_engine_enabled,
       rw_engine_enabled_(rw_engine_enabled && bpf_module_rw_engine_enabled()),
       used_b_loader_(false),
       allow_rlimit_(allow_rlimit),
-      ctx_(new LLVMContext),
       id_(std::to_string((uintptr_t)this)),
       maps_ns_(maps_ns),
-      ts_(ts), btf_(nullptr) {
+      ts_(ts), btf_(nullptr), log_buf_(nullptr), log_buf_size_(0) {
   ifindex_ = dev_name ? if_nametoindex(dev_name) : 0;
-  initialize_rw_engine();
-  LLVMInitializeBPFTarget();
-  LLVMInitializeBPFTargetMC();
-  LLVMInitializeBPFTargetInfo();
-  LLVMInitializeBPFAsmPrinter();
-#if LLVM_MAJOR_VERSION >= 6
-  LLVMInitializeBPFAsmParser();
-  if (flags & DEBUG_SOURCE)
-    LLVMInitializeBPFDisassembler();
-#endif
-  LLVMLinkInMCJIT(); /* call empty function to force linking of MCJIT */
   if (!ts_) {
     local_ts_ = createSharedTableStorage();
     ts_ = &*local_ts_;
@@ -143,13 +121,12 @@ BPFModule::~BPFModule() {
       delete[] get<0>(section.second);
   }
 
-  engine_.reset();
-  cleanup_rw_engine();
-  ctx_.reset();
+  compiler_.reset();
   func_src_.reset();
 
   if (btf_)
     delete btf_;
+  free(log_buf_);
 
   ts_->DeletePrefix(Path({id_}));
 }
@@ -158,34 +135,61 @@ int BPFModule::free_bcc_memory() {
   return bcc_free_memory();
 }
 
+int BPFModule::release_compiler_state() {
+  // The text conversions of the tables run in the rw engine
+  for (auto &v : tables_) {
+    v->key_sscanf = unimplemented_sscanf;
+    v->leaf_sscanf = unimplemented_sscanf;
+    v->key_snprintf = unimplemented_snprintf;
+    v->leaf_snprintf = unimplemented_snprintf;
+    std::string().swap(v->key_desc);
+    std::string().swap(v->leaf_desc);
+  }
+
+  if (!rw_engine_enabled_) {
+    for (auto section : sections_)
+      delete[] get<0>(section.second);
+  }
+  sections_.clear();
+
+  compiler_.reset();
+  func_src_->clear();
+  std::string().swap(mod_src_);
+  src_dbg_fmap_.clear();
+
+  if (btf_) {
+    delete btf_;
+    btf_ = nullptr;
+  }
+  map_tids_.clear();
+  free(log_buf_);
+  log_buf_ = nullptr;
+  log_buf_size_ = 0;
+
+  compiler_state_released_ = true;
+  return bcc_free_memory();
+}
+
 // load an entire c file as a module
 int BPFModule::load_cfile(const string &file, bool in_memory, const char *cflags[], int ncflags) {
-  ClangLoader clang_loader(&*ctx_, flags_);
-  if (clang_loader.parse(&mod_, *ts_, file, in_memory, cflags, ncflags, id_,
-                         *func_src_, mod_src_, maps_ns_, fake_fd_map_, perf_events_))
+  const CompilerEntries *entries = compiler_entries();
+  if (!entries) {
+    fprintf(stderr, "Can't compile without the bcc compiler library\n");
     return -1;
-  return 0;
-}
-
-// NOTE: this is a duplicate of the above, but planning to deprecate if we
-// settle on clang as the frontend
-
-// Load in a pre-built list of functions into the initial Module object, then
-// build an ExecutionEngine.
-int BPFModule::load_includes(const string &text) {
-  ClangLoader clang_loader(&*ctx_, flags_);
-  const char *cflags[] = {"-DB_WORKAROUND"};
-  if (clang_loader.parse(&mod_, *ts_, text, true, cflags, 1, "", *func_src_,
-                         mod_src_, "", fake_fd_map_, perf_events_))
+  }
+  compiler_.reset(entries->compiler_new(this));
+  uint64_t start = phase_clock_ns();
+  if (compiler_->parse(file, in_memory, cflags, ncflags))
     return -1;
+  add_phase_time("parse", start);
+  start = phase_clock_ns();
+  if (int rc = compiler_->annotate())
+    return rc;
+  add_phase_time("annotate", start);
   return 0;
 }
 
-void BPFModule::annotate_light() {
-  for (auto fn = mod_->getFunctionList().begin(); fn != mod_->getFunctionList().end(); ++fn)
-    if (!fn->hasFnAttribute(Attribute::NoInline))
-      fn->addFnAttr(Attribute::AlwaysInline);
-
+void BPFModule::init_table_ids() {
   size_t id = 0;
   Path path({id_});
   for (auto it = ts_->lower_bound(path), up = ts_->upper_bound(path); it != up; ++it) {
@@ -195,38 +199,6 @@ void BPFModule::annotate_light() {
   }
 }
 
-void BPFModule::dump_ir(Module &mod) {
-  legacy::PassManager PM;
-  PM.add(createPrintModulePass(errs()));
-  PM.run(mod);
-}
-
-int BPFModule::run_pass_manager(Module &mod) {
-  if (verifyModule(mod, &errs())) {
-    if (flags_ & DEBUG_LLVM_IR)
-      dump_ir(mod);
-    return -1;
-  }
-
-  legacy::PassManager PM;
-  PassManagerBuilder PMB;
-  PMB.OptLevel = 3;
-  PM.add(createFunctionInliningPass());
-  /*
-   * llvm < 4.0 needs
-   * PM.add(createAlwaysInlinerPass());
-   * llvm >= 4.0 needs
-   * PM.add(createAlwaysInlinerLegacyPass());
-   * use below 'stable' workaround
-   */
-  LLVMAddAlwaysInlinerPass(reinterpret_cast<LLVMPassManagerRef>(&PM));
-  PMB.populateModulePassManager(PM);
-  if (flags_ & DEBUG_LLVM_IR)
-    PM.add(createPrintModulePass(outs()));
-  PM.run(mod);
-  return 0;
-}
-
 void BPFModule::load_btf(sec_map_def &sections) {
   uint8_t *btf_sec = nullptr, *btf_ext_sec = nullptr;
   uintptr_t btf_sec_size = 0, btf_ext_sec_size = 0;
@@ -278,16 +250,16 @@ int BPFModule::create_maps(std::map<std::string, std::pair<int, int>> &map_tids,
                            bool for_inner_map) {
   std::set<std::string> inner_maps;
   if (for_inner_map) {
-    for (auto map : fake_fd_map_) {
-      std::string inner_map_name = get<7>(map.second);
+    for (const auto &map : fake_fd_map_) {
+      const std::string &inner_map_name = get<7>(map.second);
       if (inner_map_name.size())
         inner_maps.insert(inner_map_name);
     }
   }
 
-  for (auto map : fake_fd_map_) {
+  for (const auto &map : fake_fd_map_) {
     int fd, fake_fd, map_type, key_size, value_size, max_entries, map_flags;
-    int pinned_id;
+    int pinned_id, numa_node;
     const char *map_name;
     const char *pinned;
     std::string inner_map_name;
@@ -302,6 +274,10 @@ int BPFModule::create_maps(std::map<std::string, std::pair<int, int>> &map_tids,
     map_flags   = get<5>(map.second);
     pinned_id   = get<6>(map.second);
     inner_map_name = get<7>(map.second);
+    numa_node   = get<9>(map.second);
+    auto node_it = map_numa_nodes_.find(map_name);
+    if (node_it != map_numa_nodes_.end())
+      numa_node = node_it->second;
 
     if (for_inner_map) {
       if (inner_maps.find(map_name) == inner_maps.end())
@@ -328,6 +304,10 @@ int BPFModule::create_maps(std::map<std::string, std::pair<int, int>> &map_tids,
       attr.map_flags = map_flags;
       attr.map_ifindex = ifindex_;
       attr.inner_map_fd = inner_map_fd;
+      if (numa_node >= 0) {
+        attr.map_flags |= BPF_F_NUMA_NODE;
+        attr.numa_node = numa_node;
+      }
 
       if (map_tids.find(map_name) != map_tids.end()) {
         attr.btf_fd = btf_->get_fd();
@@ -359,16 +339,180 @@ int BPFModule::create_maps(std::map<std::string, std::pair<int, int>> &map_tids,
       inner_map_fds[map_name] = fd;
 
     map_fds[fake_fd] = fd;
+
+    if (numa_node == BPF_NUMA_REPLICAS_NODE && pinned_id <= 0 &&
+        create_numa_replicas(fd, map_name, max_entries, inner_map_name,
+                             map_tids))
+      return -1;
+    if (numa_node == BPF_EPOCH_BUFFERS_NODE && pinned_id <= 0 &&
+        create_epoch_buffers(fd, map_name, inner_map_name, inner_map_fds,
+                             map_tids))
+      return -1;
+  }
+
+  return 0;
+}
+
+// Create a map with the layout of the inner map inner_name, on numa_node
+// unless it is -1. Returns its fd, or -1 on error.
+int BPFModule::create_inner_copy(const string &inner_name, const string &name,
+                                 int numa_node,
+                                 map<string, std::pair<int, int>> &map_tids) {
+  const fake_fd_map_def::mapped_type *inner = nullptr;
+  for (const auto &map : fake_fd_map_)
+    if (get<1>(map.second) == inner_name)
+      inner = &map.second;
+  if (!inner) {
+    fprintf(stderr, "%s: no inner map %s to copy\n", name.c_str(),
+            inner_name.c_str());
+    return -1;
+  }
+
+  struct bpf_create_map_attr attr = {};
+  attr.map_type = (enum bpf_map_type)get<0>(*inner);
+  attr.name = name.c_str();
+  attr.key_size = get<2>(*inner);
+  attr.value_size = get<3>(*inner);
+  attr.max_entries = get<4>(*inner);
+  attr.map_flags = get<5>(*inner);
+  if (numa_node >= 0) {
+    attr.map_flags |= BPF_F_NUMA_NODE;
+    attr.numa_node = numa_node;
+  }
+  if (map_tids.find(inner_name) != map_tids.end()) {
+    attr.btf_fd = btf_->get_fd();
+    attr.btf_key_type_id = map_tids[inner_name].first;
+    attr.btf_value_type_id = map_tids[inner_name].second;
+  }
+
+  int fd = bcc_create_map_xattr(&attr, allow_rlimit_);
+  if (fd < 0)
+    fprintf(stderr, "could not create %s as a copy of %s: %s\n", name.c_str(),
+            inner_name.c_str(), strerror(errno));
+  return fd;
+}
+
+// Fill the BPF_NUMA_REPLICAS array of maps outer_fd with a copy of the
+// inner map per online node, allocated on that node, at the node's index
+int BPFModule::create_numa_replicas(int outer_fd, const char *outer_name,
+                                    unsigned max_nodes, const string &inner_name,
+                                    map<string, std::pair<int, int>> &map_tids) {
+  for (int node : get_online_nodes()) {
+    if (node < 0 || unsigned(node) >= max_nodes)
+      continue;
+    int fd = create_inner_copy(inner_name, inner_name + "_" + std::to_string(node),
+                               node, map_tids);
+    if (fd < 0)
+      return -1;
+    // the array of maps keeps the replica
+    int err = bpf_update_elem(outer_fd, &node, &fd, BPF_ANY);
+    close(fd);
+    if (err) {
+      fprintf(stderr, "could not add replica of %s on node %d to %s: %s\n",
+              inner_name.c_str(), node, outer_name, strerror(errno));
+      return -1;
+    }
   }
+  return 0;
+}
 
+// Fill the BPF_EPOCH_BUFFERS array of maps outer_fd with its inner map as the
+// active buffer and a copy of it as the idle one
+int BPFModule::create_epoch_buffers(int outer_fd, const char *outer_name,
+                                    const string &inner_name,
+                                    map<string, int> &inner_map_fds,
+                                    map<string, std::pair<int, int>> &map_tids) {
+  int fd = create_inner_copy(inner_name, inner_name + "_1", -1, map_tids);
+  if (fd < 0)
+    return -1;
+  int active = 0, idle = 1;
+  int err = bpf_update_elem(outer_fd, &active, &inner_map_fds[inner_name],
+                            BPF_ANY);
+  if (!err)
+    err = bpf_update_elem(outer_fd, &idle, &fd, BPF_ANY);
+  close(fd);
+  if (err) {
+    fprintf(stderr, "could not add the buffers of %s to %s: %s\n",
+            inner_name.c_str(), outer_name, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+// Resize the maps given to set_map_size() before they are created
+int BPFModule::apply_map_sizes() {
+  for (const auto &size : map_sizes_) {
+    bool found = false;
+    for (auto &map : fake_fd_map_) {
+      if (get<1>(map.second) != size.first)
+        continue;
+      get<4>(map.second) = size.second;
+      found = true;
+    }
+    if (!found) {
+      fprintf(stderr, "set_map_size: no map %s to resize\n", size.first.c_str());
+      return -1;
+    }
+    for (auto &t : tables_)
+      if (t->name == size.first)
+        t->max_entries = size.second;
+  }
+  return 0;
+}
+
+// Write the contents given to set_rodata() and freeze every BPF_RODATA map
+int BPFModule::fill_rodata() {
+  std::set<std::string> filled;
+  for (auto &t : tables_) {
+    if (t->type != BPF_MAP_TYPE_ARRAY || !(t->flags & BPF_F_RDONLY_PROG) ||
+        t->is_extern || t->fd < 0)
+      continue;
+    auto data = rodata_.find(t->name);
+    if (data != rodata_.end()) {
+      if (data->second.size() != t->leaf_size) {
+        fprintf(stderr, "set_rodata: %s takes %zu bytes, got %zu\n",
+                t->name.c_str(), t->leaf_size, data->second.size());
+        return -1;
+      }
+      int zero = 0;
+      if (bpf_update_elem(t->fd, &zero, (void *)data->second.data(), BPF_ANY)) {
+        fprintf(stderr, "could not write %s: %s\n", t->name.c_str(),
+                strerror(errno));
+        return -1;
+      }
+      filled.insert(t->name);
+    }
+    if (bpf_map_freeze(t->fd)) {
+      fprintf(stderr, "could not freeze %s: %s\n", t->name.c_str(),
+              strerror(errno));
+      return -1;
+    }
+  }
+  for (const auto &data : rodata_) {
+    if (!filled.count(data.first)) {
+      fprintf(stderr, "set_rodata: no BPF_RODATA table %s\n", data.first.c_str());
+      return -1;
+    }
+  }
   return 0;
 }
 
 int BPFModule::load_maps(sec_map_def &sections) {
+  if (apply_map_sizes() < 0)
+    return -1;
+
   // find .maps.<table_name> sections and retrieve all map key/value type id's
   std::map<std::string, std::pair<int, int>> map_tids;
   if (btf_) {
-    for (auto section : sections) {
+    std::map<std::string, bool> extern_tables;
+    for (auto &t : tables_)
+      extern_tables.emplace(t->name, t->is_extern);
+    std::map<std::string, std::pair<unsigned, unsigned>> map_sizes;
+    for (const auto &map : fake_fd_map_)
+      map_sizes.emplace(get<1>(map.second),
+                        std::make_pair(get<2>(map.second), get<3>(map.second)));
+
+    for (const auto &section : sections) {
       auto sec_name = section.first;
       if (strncmp(".maps.", sec_name.c_str(), 6) == 0) {
         std::string map_name = sec_name.substr(6);
@@ -377,25 +521,14 @@ int BPFModule::load_maps(sec_map_def &sections) {
 
         // skip extern maps, which won't be in fake_fd_map_ as they do not
         // require explicit bpf_create_map.
-        bool is_extern = false;
-        for (auto &t : tables_) {
-          if (t->name == map_name) {
-            is_extern = t->is_extern;
-            break;
-          }
-        }
-        if (is_extern)
+        auto ext = extern_tables.find(map_name);
+        if (ext != extern_tables.end() && ext->second)
           continue;
 
-        for (auto map : fake_fd_map_) {
-          std::string name;
-
-          name = get<1>(map.second);
-          if (map_name == name) {
-            expected_ksize = get<2>(map.second);
-            expected_vsize = get<3>(map.second);
-            break;
-          }
+        auto sizes = map_sizes.find(map_name);
+        if (sizes != map_sizes.end()) {
+          expected_ksize = sizes->second.first;
+          expected_vsize = sizes->second.second;
         }
 
         int ret = btf_->get_map_tids(map_name, expected_ksize,
@@ -424,6 +557,8 @@ int BPFModule::load_maps(sec_map_def &sections) {
       table.fake_fd = 0;
     }
   }
+  if (fill_rodata() < 0)
+    return -1;
 
   // update instructions
   for (auto section : sections) {
@@ -438,7 +573,8 @@ int BPFModule::load_maps(sec_map_def &sections) {
       for (i = 0; i < num_insns; i++) {
         if (insns[i].code == (BPF_LD | BPF_DW | BPF_IMM)) {
           // change map_fd is it is a ld_pseudo */
-          if (insns[i].src_reg == BPF_PSEUDO_MAP_FD &&
+          if ((insns[i].src_reg == BPF_PSEUDO_MAP_FD ||
+               insns[i].src_reg == BPF_PSEUDO_MAP_VALUE) &&
               map_fds.find(insns[i].imm) != map_fds.end())
             insns[i].imm = map_fds[insns[i].imm];
           i++;
@@ -447,65 +583,69 @@ int BPFModule::load_maps(sec_map_def &sections) {
     }
   }
 
+  // Without the rw engine, format keys and leaves straight from BTF
+  if (!rw_engine_enabled_ && btf_) {
+    using std::placeholders::_1;
+    using std::placeholders::_2;
+    using std::placeholders::_3;
+    for (auto &t : tables_) {
+      auto tids = map_tids.find(t->name);
+      if (tids == map_tids.end())
+        continue;
+      unsigned key_tid = tids->second.first, value_tid = tids->second.second;
+      if (key_tid) {
+        t->key_sscanf = std::bind(&BTF::type_sscanf, btf_, key_tid, _1, _2);
+        t->key_snprintf =
+            std::bind(&BTF::type_snprintf, btf_, key_tid, _1, _2, _3);
+      }
+      if (value_tid) {
+        t->leaf_sscanf = std::bind(&BTF::type_sscanf, btf_, value_tid, _1, _2);
+        t->leaf_snprintf =
+            std::bind(&BTF::type_snprintf, btf_, value_tid, _1, _2, _3);
+      }
+    }
+  }
+  map_tids_ = std::move(map_tids);
+
   return 0;
 }
 
 int BPFModule::finalize() {
-  Module *mod = &*mod_;
   sec_map_def tmp_sections,
       *sections_p;
 
-  mod->setTargetTriple("bpf-pc-linux");
-#if LLVM_MAJOR_VERSION >= 11
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-  mod->setDataLayout("e-m:e-p:64:64-i64:64-i128:128-n32:64-S128");
-#else
-  mod->setDataLayout("E-m:e-p:64:64-i64:64-i128:128-n32:64-S128");
-#endif
-#else
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-  mod->setDataLayout("e-m:e-p:64:64-i64:64-n32:64-S128");
-#else
-  mod->setDataLayout("E-m:e-p:64:64-i64:64-n32:64-S128");
-#endif
-#endif
   sections_p = rw_engine_enabled_ ? &sections_ : &tmp_sections;
-
-  string err;
-  EngineBuilder builder(move(mod_));
-  builder.setErrorStr(&err);
-  builder.setMCJITMemoryManager(ebpf::make_unique<MyMemoryManager>(sections_p));
-  builder.setMArch("bpf");
-#if LLVM_MAJOR_VERSION <= 11
-  builder.setUseOrcMCJITReplacement(false);
-#endif
-  engine_ = unique_ptr<ExecutionEngine>(builder.create());
-  if (!engine_) {
-    fprintf(stderr, "Could not create ExecutionEngine: %s\n", err.c_str());
-    return -1;
-  }
-
-#if LLVM_MAJOR_VERSION >= 9
-  engine_->setProcessAllSections(true);
-#else
-  if (flags_ & DEBUG_SOURCE)
-    engine_->setProcessAllSections(true);
-#endif
-
-  if (int rc = run_pass_manager(*mod))
+  if (int rc = compiler_->codegen(*sections_p))
     return rc;
-
-  engine_->finalizeObject();
-
-  if (flags_ & DEBUG_SOURCE) {
-    SourceDebugger src_debugger(mod, *sections_p, FN_PREFIX, mod_src_,
-                                src_dbg_fmap_);
-    src_debugger.dump();
+  uint64_t start = phase_clock_ns();
+
+  // Snapshot the sections before load_btf() and load_maps() patch them in
+  // place with process-specific fds.
+  if (!cache_path_.empty())
+    save_cached_object(cache_path_, *sections_p);
+
+  // Compiling an object file only, the maps are created by load_object()
+  if (!object_path_.empty()) {
+    int rc = save_cached_object(object_path_, *sections_p);
+    if (rc == -EINVAL)
+      fprintf(stderr, "Programs with extern, shared or pinned tables can't be "
+              "compiled to an object file\n");
+    else if (rc)
+      fprintf(stderr, "Can't write object file %s\n", object_path_.c_str());
+    return rc ? -1 : 0;
   }
 
+  // Generating a table header only, the types are all that's needed
+  if (header_out_)
+    return write_table_header(*sections_p);
+
   load_btf(*sections_p);
+  add_phase_time("finalize", start);
+  uint64_t maps_start = phase_clock_ns();
   if (load_maps(*sections_p))
     return -1;
+  add_phase_time("load_maps", maps_start);
+  start = phase_clock_ns();
 
   if (!rw_engine_enabled_) {
     // Setup sections_ correctly and then free llvm internal memory
@@ -521,8 +661,7 @@ int BPFModule::finalize() {
       }
       sections_[fname] = make_tuple(tmp_p, size, get<2>(section.second));
     }
-    engine_.reset();
-    ctx_.reset();
+    compiler_.reset();
   }
 
   // give functions an id
@@ -758,6 +897,33 @@ const char * BPFModule::table_leaf_desc(size_t id) const {
 const char * BPFModule::table_leaf_desc(const string &name) const {
   return table_leaf_desc(table_id(name));
 }
+const char * BPFModule::table_layout(size_t id, bool leaf) {
+  if (id >= tables_.size())
+    return nullptr;
+  std::lock_guard<std::mutex> lock(layouts_mutex_);
+  auto key = std::make_pair(id, leaf);
+  auto it = layouts_.find(key);
+  if (it == layouts_.end()) {
+    std::string layout;
+    auto tids = map_tids_.find(tables_[id]->name);
+    if (btf_ && tids != map_tids_.end()) {
+      int tid = leaf ? tids->second.second : tids->second.first;
+      if (tid && btf_->type_layout(tid, layout))
+        layout.clear();
+    }
+    it = layouts_.emplace(key, std::move(layout)).first;
+  }
+  return it->second.empty() ? nullptr : it->second.c_str();
+}
+
+const char * BPFModule::table_key_layout(size_t id) {
+  return table_layout(id, false);
+}
+
+const char * BPFModule::table_leaf_layout(size_t id) {
+  return table_layout(id, true);
+}
+
 size_t BPFModule::table_key_size(size_t id) const {
   if (id >= tables_.size())
     return 0;
@@ -845,12 +1011,6 @@ int BPFModule::load_c(const string &filename, const char *cflags[], int ncflags)
   }
   if (int rc = load_cfile(filename, false, cflags, ncflags))
     return rc;
-  if (rw_engine_enabled_) {
-    if (int rc = annotate())
-      return rc;
-  } else {
-    annotate_light();
-  }
   if (int rc = finalize())
     return rc;
   return 0;
@@ -862,17 +1022,176 @@ int BPFModule::load_string(const string &text, const char *cflags[], int ncflags
     fprintf(stderr, "Program already initialized\n");
     return -1;
   }
+  cache_path_ = object_cache_path(text, cflags, ncflags);
+  if (!cache_path_.empty()) {
+    uint64_t start = phase_clock_ns();
+    int rc = load_cached_object(cache_path_);
+    if (rc == 0) {
+      add_phase_time("load_cached_object", start);
+      return 0;
+    }
+    if (rc != -1)
+      return rc;
+  }
   if (int rc = load_cfile(text, true, cflags, ncflags))
     return rc;
+
+  if (int rc = finalize())
+    return rc;
+  return 0;
+}
+
+// compile a C text string into an object file
+int BPFModule::compile_object(const string &text, const char *cflags[],
+                              int ncflags, const string &path) {
+  if (!sections_.empty()) {
+    fprintf(stderr, "Program already initialized\n");
+    return -1;
+  }
   if (rw_engine_enabled_) {
-    if (int rc = annotate())
-      return rc;
-  } else {
-    annotate_light();
+    fprintf(stderr, "Compiled objects need the rw engine disabled\n");
+    return -1;
   }
+  cache_key_ = object_file_key();
+  object_path_ = path;
+  if (int rc = load_cfile(text, true, cflags, ncflags))
+    return rc;
+  return finalize();
+}
 
-  if (int rc = finalize())
+// compile a C text string into a C++ header of its table types
+int BPFModule::table_header(const string &text, const char *cflags[],
+                            int ncflags, const string &ns, string &header) {
+  if (!sections_.empty()) {
+    fprintf(stderr, "Program already initialized\n");
+    return -1;
+  }
+  if (rw_engine_enabled_) {
+    fprintf(stderr, "Table headers need the rw engine disabled\n");
+    return -1;
+  }
+  header_ns_ = ns;
+  header_out_ = &header;
+  if (int rc = load_cfile(text, true, cflags, ncflags))
     return rc;
+  return finalize();
+}
+
+// The BPF accessor and table class of a map type, and whether the class
+// takes the key type. Other map types get no accessor.
+static bool table_accessor(int type, const char **getter, const char **cls,
+                           bool *keyed) {
+  static const struct {
+    int type;
+    const char *getter, *cls;
+    bool keyed;
+  } accessors[] = {
+    {BPF_MAP_TYPE_HASH, "get_hash_table", "BPFHashTable", true},
+    {BPF_MAP_TYPE_LRU_HASH, "get_hash_table", "BPFHashTable", true},
+    {BPF_MAP_TYPE_PERCPU_HASH, "get_percpu_hash_table", "BPFPercpuHashTable",
+     true},
+    {BPF_MAP_TYPE_LRU_PERCPU_HASH, "get_percpu_hash_table",
+     "BPFPercpuHashTable", true},
+    {BPF_MAP_TYPE_LPM_TRIE, "get_lpm_trie_table", "BPFLpmTrieTable", true},
+    {BPF_MAP_TYPE_ARRAY, "get_array_table", "BPFArrayTable", false},
+    {BPF_MAP_TYPE_PERCPU_ARRAY, "get_percpu_array_table",
+     "BPFPercpuArrayTable", false},
+    {BPF_MAP_TYPE_QUEUE, "get_queuestack_table", "BPFQueueStackTable", false},
+    {BPF_MAP_TYPE_STACK, "get_queuestack_table", "BPFQueueStackTable", false},
+    {BPF_MAP_TYPE_SK_STORAGE, "get_sk_storage_table", "BPFSkStorageTable",
+     false},
+  };
+  for (const auto &a : accessors) {
+    if (a.type == type) {
+      *getter = a.getter;
+      *cls = a.cls;
+      *keyed = a.keyed;
+      return true;
+    }
+  }
+  return false;
+}
+
+int BPFModule::write_table_header(sec_map_def &sections) {
+  auto sec = sections.find(".BTF");
+  if (sec == sections.end()) {
+    fprintf(stderr, "No BTF was generated for the tables\n");
+    return -1;
+  }
+  BTF btf(flags_ & DEBUG_BTF, sections);
+  if (btf.load_types(get<0>(sec->second), get<1>(sec->second)))
+    return -1;
+
+  // Extern tables are declared by the program that owns them
+  std::vector<TableDesc *> tables;
+  std::vector<std::pair<unsigned, std::string>> roots;
+  for (auto t : tables_) {
+    unsigned key_tid, value_tid;
+    if (t->is_extern ||
+        btf.get_map_tids(t->name, t->key_size, t->leaf_size, &key_tid,
+                         &value_tid))
+      continue;
+    tables.push_back(t);
+    roots.emplace_back(key_tid, t->name + "_key");
+    roots.emplace_back(value_tid, t->name + "_leaf");
+  }
+
+  std::string decls;
+  std::vector<std::string> names;
+  StatusTuple rc = btf.cxx_decls(roots, decls, names);
+  if (!rc.ok()) {
+    fprintf(stderr, "%s\n", rc.msg().c_str());
+    return -1;
+  }
+
+  std::string &out = *header_out_;
+  out = "// Generated by bcc from BTF, do not edit.\n"
+        "#pragma once\n\n"
+        "#include <cstddef>\n"
+        "#include <cstdint>\n\n"
+        "#include \"BPF.h\"\n\n";
+  if (!header_ns_.empty())
+    out += "namespace " + header_ns_ + " {\n\n";
+  out += decls;
+  for (size_t i = 0; i < tables.size(); i++) {
+    const char *getter, *cls;
+    bool keyed;
+    if (!table_accessor(tables[i]->type, &getter, &cls, &keyed))
+      continue;
+    const std::string &name = tables[i]->name;
+    std::string args = keyed ? names[2 * i] + ", " : "";
+    args += names[2 * i + 1];
+    out += "inline ebpf::" + std::string(cls) + "<" + args + "> " + name +
+           "(ebpf::BPF &bpf) {\n"
+           "  return bpf." + getter + "<" + args + ">(\"" + name + "\");\n"
+           "}\n\n";
+  }
+  if (!header_ns_.empty())
+    out += "}  // namespace " + header_ns_ + "\n";
+  return 0;
+}
+
+// load an object file written by compile_object()
+int BPFModule::load_object(const string &path) {
+  if (!sections_.empty()) {
+    fprintf(stderr, "Program already initialized\n");
+    return -1;
+  }
+  if (rw_engine_enabled_) {
+    fprintf(stderr, "Compiled objects need the rw engine disabled\n");
+    return -1;
+  }
+  cache_key_ = object_file_key();
+  uint64_t start = phase_clock_ns();
+  int rc = load_cached_object(path);
+  if (rc == -1) {
+    fprintf(stderr, "%s is not an object compiled by this bcc version for "
+            "this architecture\n", path.c_str());
+    return -1;
+  }
+  if (rc)
+    return rc;
+  add_phase_time("load_object", start);
   return 0;
 }
 
@@ -880,7 +1199,8 @@ int BPFModule::bcc_func_load(int prog_type, const char *name,
                 const struct bpf_insn *insns, int prog_len,
                 const char *license, unsigned kern_version,
                 int log_level, char *log_buf, unsigned log_buf_size,
-                const char *dev_name, unsigned flags) {
+                const char *dev_name, unsigned flags,
+                int expected_attach_type) {
   struct bpf_load_program_attr attr = {};
   unsigned func_info_cnt, line_info_cnt, finfo_rec_size, linfo_rec_size;
   void *func_info = NULL, *line_info = NULL;
@@ -895,6 +1215,9 @@ int BPFModule::bcc_func_load(int prog_type, const char *name,
     attr.kern_version = kern_version;
   }
   attr.prog_flags = flags;
+  // Tracing and LSM programs get theirs from their name prefix.
+  if (expected_attach_type >= 0)
+    attr.expected_attach_type = (enum bpf_attach_type)expected_attach_type;
   attr.log_level = log_level;
   if (dev_name)
     attr.prog_ifindex = if_nametoindex(dev_name);
@@ -918,7 +1241,26 @@ int BPFModule::bcc_func_load(int prog_type, const char *name,
     }
   }
 
-  ret = bcc_prog_load_xattr(&attr, prog_len, log_buf, log_buf_size, allow_rlimit_);
+  uint64_t start = phase_clock_ns();
+  if (log_buf && log_buf_size) {
+    ret = bcc_prog_load_xattr(&attr, prog_len, log_buf, log_buf_size,
+                              allow_rlimit_);
+  } else {
+    // Loads running concurrently with the one owning the shared log buffer
+    // get a buffer of their own rather than waiting for the verifier.
+    std::unique_lock<std::mutex> lock(log_mutex_, std::try_to_lock);
+    if (lock.owns_lock()) {
+      ret = bcc_prog_load_xattr_logbuf(&attr, prog_len, &log_buf_,
+                                       &log_buf_size_, allow_rlimit_);
+    } else {
+      char *own_buf = nullptr;
+      unsigned own_buf_size = 0;
+      ret = bcc_prog_load_xattr_logbuf(&attr, prog_len, &own_buf,
+                                       &own_buf_size, allow_rlimit_);
+      free(own_buf);
+    }
+  }
+  add_phase_time("func_load", start);
   if (btf_) {
     free(func_info);
     free(line_info);
@@ -927,6 +1269,18 @@ int BPFModule::bcc_func_load(int prog_type, const char *name,
   return ret;
 }
 
+void BPFModule::add_phase_time(const char *phase, uint64_t start_ns) {
+  uint64_t ns = phase_clock_ns() - start_ns;
+  std::lock_guard<std::mutex> lock(phase_mutex_);
+  for (auto &p : phase_times_) {
+    if (p.first == phase) {
+      p.second += ns;
+      return;
+    }
+  }
+  phase_times_.emplace_back(phase, ns);
+}
+
 int BPFModule::bcc_func_attach(int prog_fd, int attachable_fd,
                                int attach_type, unsigned int flags) {
   return bpf_prog_attach(prog_fd, attachable_fd,
@@ -19,20 +19,13 @@
 #include <stdint.h>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
 #include "bcc_exception.h"
 #include "table_storage.h"
 
-namespace llvm {
-class ExecutionEngine;
-class Function;
-class LLVMContext;
-class Module;
-class Type;
-}
-
 struct bpf_insn;
 
 namespace ebpf {
@@ -61,37 +54,45 @@ class BLoader;
 class ClangLoader;
 class FuncSource;
 class BTF;
+class BPFModuleCompiler;
+class ClangModuleCompiler;
 
 bool bpf_module_rw_engine_enabled(void);
 
 class BPFModule {
  private:
   static const std::string FN_PREFIX;
-  int init_engine();
-  void initialize_rw_engine();
-  void cleanup_rw_engine();
-  int parse(llvm::Module *mod);
+  // The compiler runs parse, annotate and codegen with the module's state
+  friend class ClangModuleCompiler;
   int finalize();
-  int annotate();
-  void annotate_light();
-  std::unique_ptr<llvm::ExecutionEngine> finalize_rw(std::unique_ptr<llvm::Module> mod);
-  std::string make_reader(llvm::Module *mod, llvm::Type *type);
-  std::string make_writer(llvm::Module *mod, llvm::Type *type);
-  void dump_ir(llvm::Module &mod);
-  int load_file_module(std::unique_ptr<llvm::Module> *mod, const std::string &file, bool in_memory);
-  int load_includes(const std::string &text);
   int load_cfile(const std::string &file, bool in_memory, const char *cflags[], int ncflags);
-  int kbuild_flags(const char *uname_release, std::vector<std::string> *cflags);
-  int run_pass_manager(llvm::Module &mod);
-  StatusTuple sscanf(std::string fn_name, const char *str, void *val);
-  StatusTuple snprintf(std::string fn_name, char *str, size_t sz,
-                       const void *val);
+  void init_table_ids();
+  std::string object_cache_path(const std::string &text, const char *cflags[],
+                                int ncflags);
+  int load_cached_object(const std::string &path);
+  std::string object_file_key() const;
+  int save_cached_object(const std::string &path, const sec_map_def &sections);
   void load_btf(sec_map_def &sections);
   int load_maps(sec_map_def &sections);
+  int write_table_header(sec_map_def &sections);
+  const char * table_layout(size_t id, bool leaf);
+  int apply_map_sizes();
+  int fill_rodata();
+  void add_phase_time(const char *phase, uint64_t start_ns);
   int create_maps(std::map<std::string, std::pair<int, int>> &map_tids,
                   std::map<int, int> &map_fds,
                   std::map<std::string, int> &inner_map_fds,
                   bool for_inner_map);
+  int create_inner_copy(const std::string &inner_name, const std::string &name,
+                        int numa_node,
+                        std::map<std::string, std::pair<int, int>> &map_tids);
+  int create_numa_replicas(int outer_fd, const char *outer_name,
+                           unsigned max_nodes, const std::string &inner_name,
+                           std::map<std::string, std::pair<int, int>> &map_tids);
+  int create_epoch_buffers(int outer_fd, const char *outer_name,
+                           const std::string &inner_name,
+                           std::map<std::string, int> &inner_map_fds,
+                           std::map<std::string, std::pair<int, int>> &map_tids);
 
  public:
   BPFModule(unsigned flags, TableStorage *ts = nullptr, bool rw_engine_enabled = true,
@@ -99,8 +100,50 @@ class BPFModule {
             const char *dev_name = nullptr);
   ~BPFModule();
   int free_bcc_memory();
+  // Free what was only needed to compile and load functions: the LLVM
+  // context and engines, the function sections and sources, BTF and the
+  // table descriptions. Tables keep working through their typed accessors,
+  // but can't be converted to or from text any more, and no function can
+  // be loaded afterwards.
+  int release_compiler_state();
+  bool compiler_state_released() const { return compiler_state_released_; }
   int load_c(const std::string &filename, const char *cflags[], int ncflags);
   int load_string(const std::string &text, const char *cflags[], int ncflags);
+  // Cache compiled objects in dir, overriding $BCC_OBJ_CACHE_DIR. Only used
+  // by load_string() when the rw engine is disabled.
+  void set_object_cache_dir(const std::string &dir) { obj_cache_dir_ = dir; }
+  // Compile a C text string into an object file at path, for load_object()
+  // to load later without Clang and LLVM. No map is created, and the module
+  // can't be used for anything else afterwards. The object only fits kernels
+  // whose headers match those it was compiled with.
+  int compile_object(const std::string &text, const char *cflags[],
+                     int ncflags, const std::string &path);
+  // Load an object written by compile_object() and create its maps
+  int load_object(const std::string &path);
+  // Compile a C text string and write a C++ header to header declaring, in
+  // namespace ns, the key and leaf types of its tables from their BTF, and
+  // a typed accessor per table returning the BPF::get_*_table<K, V>() that
+  // fits its type. Like compile_object(), nothing is loaded or created.
+  int table_header(const std::string &text, const char *cflags[], int ncflags,
+                   const std::string &ns, std::string &header);
+  // Create the map called name with max_entries instead of the size in the
+  // program. Sizes are applied when the maps are created, so the same
+  // program text, cache entry or object file serves any size.
+  void set_map_size(const std::string &name, unsigned max_entries) {
+    map_sizes_[name] = max_entries;
+  }
+  // Allocate the map called name on NUMA node numa_node, or on any node if
+  // it is -1, instead of the node given with BPF_F_TABLE_NUMA in the program.
+  // Like sizes, nodes are applied when the maps are created.
+  void set_map_numa_node(const std::string &name, int numa_node) {
+    map_numa_nodes_[name] = numa_node;
+  }
+  // Contents of the BPF_RODATA table called name, written before programs
+  // are loaded. The map is then frozen, and the verifier treats its fields
+  // as constants. Tables without contents are left zeroed.
+  void set_rodata(const std::string &name, const void *data, size_t size) {
+    rodata_[name] = std::string((const char *)data, size);
+  }
   std::string id() const { return id_; }
   std::string maps_ns() const { return maps_ns_; }
   size_t num_functions() const;
@@ -126,6 +169,11 @@ class BPFModule {
   int table_flags(size_t id) const;
   const char * table_key_desc(size_t id) const;
   const char * table_key_desc(const std::string &name) const;
+  // Layouts of the key and leaf types from BTF, in the format of the
+  // descriptions above but independent of typedefs. Built on first use,
+  // nullptr without BTF or for types the format can't describe.
+  const char * table_key_layout(size_t id);
+  const char * table_leaf_layout(size_t id);
   size_t table_key_size(size_t id) const;
   size_t table_key_size(const std::string &name) const;
   int table_key_printf(size_t id, char *buf, size_t buflen, const void *key);
@@ -139,48 +187,77 @@ class BPFModule {
   char * license() const;
   unsigned kern_version() const;
   TableStorage &table_storage() { return *ts_; }
+  // Can be called from several threads at once, the verifier checks each
+  // program independently.
   int bcc_func_load(int prog_type, const char *name,
                     const struct bpf_insn *insns, int prog_len,
                     const char *license, unsigned kern_version,
                     int log_level, char *log_buf, unsigned log_buf_size,
                     const char *dev_name = nullptr,
-                    unsigned flags = 0);
+                    unsigned flags = 0, int expected_attach_type = -1);
   int bcc_func_attach(int prog_fd, int attachable_fd,
                       int attach_type, unsigned int flags);
   int bcc_func_detach(int prog_fd, int attachable_fd, int attach_type);
   size_t perf_event_fields(const char *) const;
   const char * perf_event_field(const char *, size_t i) const;
+  // Wall time in ns of each phase of compiling and loading the program, in
+  // the order they first ran: "load_cached_object" or "load_object", or
+  // "parse", "annotate",
+  // "finalize" (code generation), "run_pass_manager" and "load_maps", then
+  // "func_load" summed over every program verified by bcc_func_load(). The
+  // phases don't overlap.
+  const std::vector<std::pair<std::string, uint64_t>> &phase_times() const {
+    return phase_times_;
+  }
 
  private:
   unsigned flags_;  // 0x1 for printing
   bool rw_engine_enabled_;
   bool used_b_loader_;
   bool allow_rlimit_;
+  bool compiler_state_released_ = false;
   std::string filename_;
   std::string proto_filename_;
-  std::unique_ptr<llvm::LLVMContext> ctx_;
-  std::unique_ptr<llvm::ExecutionEngine> engine_;
-  std::unique_ptr<llvm::ExecutionEngine> rw_engine_;
-  std::unique_ptr<llvm::Module> mod_;
+  // Created by load_cfile(), kept with the rw engine for the text
+  // conversions of the tables
+  std::unique_ptr<BPFModuleCompiler> compiler_;
   std::unique_ptr<FuncSource> func_src_;
   sec_map_def sections_;
   std::vector<TableDesc *> tables_;
   std::map<std::string, size_t> table_names_;
   std::vector<std::string> function_names_;
-  std::map<llvm::Type *, std::string> readers_;
-  std::map<llvm::Type *, std::string> writers_;
   std::string id_;
   std::string maps_ns_;
   std::string mod_src_;
+  std::string obj_cache_dir_;
+  std::string cache_path_;
+  std::string cache_key_;
+  std::string object_path_;
+  std::string header_ns_;
+  std::string *header_out_ = nullptr;
   std::map<std::string, std::string> src_dbg_fmap_;
   TableStorage *ts_;
   std::unique_ptr<TableStorage> local_ts_;
   BTF *btf_;
+  // BTF key and leaf type ids of the tables, and the layouts built from them
+  std::map<std::string, std::pair<int, int>> map_tids_;
+  std::map<std::pair<size_t, bool>, std::string> layouts_;
+  std::mutex layouts_mutex_;
   fake_fd_map_def fake_fd_map_;
+  std::map<std::string, unsigned> map_sizes_;
+  std::map<std::string, int> map_numa_nodes_;
+  std::map<std::string, std::string> rodata_;
   unsigned int ifindex_;
 
   // map of events -- key: event name, value: event fields
   std::map<std::string, std::vector<std::string>> perf_events_;
+  std::vector<std::pair<std::string, uint64_t>> phase_times_;
+  // verifier log of loads without a log buffer of their own, grown to the
+  // largest log seen so later loads fit it on their first verification
+  char *log_buf_;
+  unsigned log_buf_size_;
+  std::mutex log_mutex_;
+  std::mutex phase_mutex_;
 };
 
 }  // namespace ebpf
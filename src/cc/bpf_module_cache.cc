@@ -0,0 +1,415 @@
+/*
+ * Copyright (c) 2021 Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <llvm/Config/llvm-config.h>
+
+#include "bcc_version.h"
+#include "bpf_module.h"
+#include "frontends/clang/loader.h"
+#include "table_storage.h"
+
+// The on-disk object cache stores everything BPFModule::finalize() produces
+// before maps are created: the raw ELF sections (including .BTF and
+// .BTF.ext), the table and map definitions collected by the frontend, and
+// the rewritten sources. A cache hit skips the Clang and LLVM pipelines and
+// goes straight to load_btf()/load_maps().
+
+namespace ebpf {
+
+using std::get;
+using std::make_tuple;
+using std::string;
+using std::vector;
+
+namespace {
+
+// Bump this whenever the layout below changes.
+const char CACHE_MAGIC[] = "BCCOBJ02";
+
+class CacheWriter {
+ public:
+  void u64(uint64_t v) { buf_.append((const char *)&v, sizeof(v)); }
+  void i64(int64_t v) { u64((uint64_t)v); }
+  void bytes(const void *p, size_t len) {
+    u64(len);
+    if (len)
+      buf_.append((const char *)p, len);
+  }
+  void str(const string &s) { bytes(s.data(), s.size()); }
+  const string &buf() const { return buf_; }
+
+ private:
+  string buf_;
+};
+
+class CacheReader {
+ public:
+  explicit CacheReader(const string &buf) : buf_(buf), pos_(0), ok_(true) {}
+  uint64_t u64() {
+    uint64_t v = 0;
+    if (!check(sizeof(v)))
+      return 0;
+    memcpy(&v, buf_.data() + pos_, sizeof(v));
+    pos_ += sizeof(v);
+    return v;
+  }
+  int64_t i64() { return (int64_t)u64(); }
+  const char *bytes(size_t *len) {
+    *len = u64();
+    if (!check(*len))
+      return nullptr;
+    const char *p = buf_.data() + pos_;
+    pos_ += *len;
+    return p;
+  }
+  string str() {
+    size_t len;
+    const char *p = bytes(&len);
+    return p ? string(p, len) : string();
+  }
+  bool ok() const { return ok_; }
+
+ private:
+  bool check(size_t len) {
+    if (!ok_ || len > buf_.size() - pos_)
+      ok_ = false;
+    return ok_;
+  }
+
+  const string &buf_;
+  size_t pos_;
+  bool ok_;
+};
+
+}  // namespace
+
+// Returns the path of the cache entry for the given program, or an empty
+// string if caching is disabled. The key covers every input that can change
+// the produced object: the program text and cflags, the running kernel and its
+// header overrides, and the bcc and LLVM versions. Since the rewriter is
+// deterministic for a given input, hashing its input is equivalent to hashing
+// the rewritten source.
+string BPFModule::object_cache_path(const string &text, const char *cflags[],
+                                    int ncflags) {
+  const char *dir = obj_cache_dir_.empty() ? ::getenv("BCC_OBJ_CACHE_DIR")
+                                           : obj_cache_dir_.c_str();
+  if (!dir || !*dir)
+    return "";
+  // The sscanf/snprintf helpers generated by the rw engine live in JIT
+  // memory and cannot be persisted.
+  if (rw_engine_enabled_)
+    return "";
+
+  struct utsname un;
+  uname(&un);
+
+  const char *env_vars[] = {"BCC_KERNEL_SOURCE", "BCC_LINUX_VERSION_CODE",
+                            "BCC_KERNEL_MODULES_SUFFIX", "ARCH"};
+  string key;
+  key += string(CACHE_MAGIC) + '\0';
+  key += string(LIBBCC_VERSION) + '\0';
+  key += string(LLVM_VERSION_STRING) + '\0';
+  key += string(un.release) + '\0' + un.version + '\0' + un.machine + '\0';
+  for (auto var : env_vars) {
+    const char *val = ::getenv(var);
+    key += string(var) + "=" + (val ? val : "") + '\0';
+  }
+  key += std::to_string(flags_) + '\0';
+  for (int i = 0; i < ncflags; i++)
+    key += string(cflags[i]) + '\0';
+  key += text;
+
+  char name[32];
+  ::snprintf(name, sizeof(name), "%016zx", std::hash<string>()(key));
+  cache_key_ = std::move(key);
+  return string(dir) + "/" + name + ".bccobj";
+}
+
+// Compiled object files use the layout of cache entries under a key of their
+// own. They don't depend on the running kernel, only on the bcc version that
+// wrote them and the architecture, which the table layouts follow.
+string BPFModule::object_file_key() const {
+  struct utsname un;
+  uname(&un);
+  return string("BCCAOT02") + '\0' + LIBBCC_VERSION + '\0' + un.machine;
+}
+
+// Persist the sections produced by the JIT together with the frontend state
+// needed to recreate the module. Returns -EINVAL for programs that can't be
+// persisted and -EIO if the file can't be written. For the cache these
+// failures are not fatal, the compiled module is used as is.
+int BPFModule::save_cached_object(const string &path,
+                                  const sec_map_def &sections) {
+  std::set<int> fake_fds;
+  for (auto &t : tables_) {
+    // Extern, shared and pinned maps refer to objects owned by someone else,
+    // so programs using them cannot be replayed from the cache.
+    if (t->is_extern || t->is_shared)
+      return -EINVAL;
+    fake_fds.insert(t->fake_fd);
+  }
+  for (auto &map : fake_fd_map_)
+    if (get<6>(map.second) > 0)
+      return -EINVAL;
+  // Tables exported to the global or maps_ns namespace are copies of our own
+  // tables sharing their fake fd.
+  string prefix = Path({id_}).to_string() + Path::DELIM;
+  for (auto it = ts_->begin(), up = ts_->end(); it != up; ++it) {
+    if (it->first.compare(0, prefix.size(), prefix) &&
+        it->second.fake_fd && fake_fds.count(it->second.fake_fd))
+      return -EINVAL;
+  }
+
+  CacheWriter w;
+  w.str(CACHE_MAGIC);
+  w.str(cache_key_);
+  w.str(mod_src_);
+
+  w.u64(sections.size());
+  for (auto &section : sections) {
+    uint8_t *addr = get<0>(section.second);
+    uintptr_t size = get<1>(section.second);
+    w.str(section.first);
+    w.u64(size);
+    w.u64(get<2>(section.second));
+    // map sections only serve as placeholders and are never read
+    if (strncmp("maps/", section.first.c_str(), 5))
+      w.bytes(addr, size);
+    else
+      w.bytes(nullptr, 0);
+  }
+
+  w.u64(fake_fd_map_.size());
+  for (auto &map : fake_fd_map_) {
+    w.i64(map.first);
+    w.i64(get<0>(map.second));
+    w.str(get<1>(map.second));
+    w.i64(get<2>(map.second));
+    w.i64(get<3>(map.second));
+    w.i64(get<4>(map.second));
+    w.i64(get<5>(map.second));
+    w.i64(get<6>(map.second));
+    w.str(get<7>(map.second));
+    w.str(get<8>(map.second));
+    w.i64(get<9>(map.second));
+  }
+
+  w.u64(tables_.size());
+  for (auto &t : tables_) {
+    w.str(t->name);
+    w.i64(t->fake_fd);
+    w.i64(t->type);
+    w.u64(t->key_size);
+    w.u64(t->leaf_size);
+    w.u64(t->max_entries);
+    w.i64(t->flags);
+    w.str(t->key_desc);
+    w.str(t->leaf_desc);
+  }
+
+  w.u64(perf_events_.size());
+  for (auto &event : perf_events_) {
+    w.str(event.first);
+    w.u64(event.second.size());
+    for (auto &field : event.second)
+      w.str(field);
+  }
+
+  vector<string> fn_names;
+  for (auto &section : sections)
+    if (!strncmp(FN_PREFIX.c_str(), section.first.c_str(), FN_PREFIX.size()))
+      fn_names.push_back(section.first.substr(FN_PREFIX.size()));
+  w.u64(fn_names.size());
+  for (auto &fn : fn_names) {
+    w.str(fn);
+    w.str(func_src_->src(fn));
+    w.str(func_src_->src_rewritten(fn));
+  }
+
+  size_t slash = path.rfind('/');
+  if (slash != string::npos && slash > 0) {
+    string dir = path.substr(0, slash);
+    if (mkdir(dir.c_str(), 0755) && errno != EEXIST)
+      return -EIO;
+  }
+
+  // Write to a private file first so concurrent readers never observe a
+  // partially written entry.
+  string tmp_path = path + ".tmp." + std::to_string(getpid()) + "." + id_;
+  {
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!out)
+      return -EIO;
+    out.write(w.buf().data(), w.buf().size());
+    if (!out) {
+      out.close();
+      unlink(tmp_path.c_str());
+      return -EIO;
+    }
+  }
+  if (rename(tmp_path.c_str(), path.c_str())) {
+    unlink(tmp_path.c_str());
+    return -EIO;
+  }
+  return 0;
+}
+
+// Recreate the module from a cache entry. Returns 0 on success, and a
+// negative value if the entry is missing, stale or corrupt, in which case
+// the module is left untouched. It must only be called before anything was
+// compiled into this module.
+int BPFModule::load_cached_object(const string &path) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in)
+    return -1;
+  std::stringstream ss;
+  ss << in.rdbuf();
+  string buf = ss.str();
+
+  CacheReader r(buf);
+  if (r.str() != CACHE_MAGIC || r.str() != cache_key_)
+    return -1;
+
+  string mod_src = r.str();
+
+  sec_map_def sections;
+  vector<uint8_t *> allocated;
+  bool bad = false;
+  uint64_t nsections = r.u64();
+  for (uint64_t i = 0; i < nsections && r.ok(); i++) {
+    string name = r.str();
+    uintptr_t size = r.u64();
+    unsigned sec_id = r.u64();
+    size_t len;
+    const char *data = r.bytes(&len);
+    uint8_t *p = nullptr;
+    if (len) {
+      if (len != size) {
+        bad = true;
+        break;
+      }
+      p = new uint8_t[size];
+      memcpy(p, data, size);
+      allocated.push_back(p);
+    }
+    sections[name] = make_tuple(p, size, sec_id);
+  }
+
+  fake_fd_map_def fake_fd_map;
+  uint64_t nmaps = r.u64();
+  for (uint64_t i = 0; i < nmaps && r.ok(); i++) {
+    int fake_fd = r.i64();
+    int map_type = r.i64();
+    string name = r.str();
+    int key_size = r.i64();
+    int value_size = r.i64();
+    int max_entries = r.i64();
+    int map_flags = r.i64();
+    int pinned_id = r.i64();
+    string inner_map_name = r.str();
+    string pinned = r.str();
+    int numa_node = r.i64();
+    fake_fd_map[fake_fd] = make_tuple(map_type, name, key_size, value_size,
+                                      max_entries, map_flags, pinned_id,
+                                      inner_map_name, pinned, numa_node);
+  }
+
+  vector<TableDesc> tables;
+  uint64_t ntables = r.u64();
+  for (uint64_t i = 0; i < ntables && r.ok(); i++) {
+    TableDesc desc;
+    desc.name = r.str();
+    desc.fake_fd = r.i64();
+    desc.type = r.i64();
+    desc.key_size = r.u64();
+    desc.leaf_size = r.u64();
+    desc.max_entries = r.u64();
+    desc.flags = r.i64();
+    desc.key_desc = r.str();
+    desc.leaf_desc = r.str();
+    tables.push_back(std::move(desc));
+  }
+
+  std::map<string, vector<string>> perf_events;
+  uint64_t nevents = r.u64();
+  for (uint64_t i = 0; i < nevents && r.ok(); i++) {
+    string name = r.str();
+    uint64_t nfields = r.u64();
+    for (uint64_t j = 0; j < nfields && r.ok(); j++)
+      perf_events[name].push_back(r.str());
+  }
+
+  vector<std::tuple<string, string, string>> fn_srcs;
+  uint64_t nfns = r.u64();
+  for (uint64_t i = 0; i < nfns && r.ok(); i++) {
+    string name = r.str();
+    string src = r.str();
+    string src_rewritten = r.str();
+    fn_srcs.emplace_back(name, src, src_rewritten);
+  }
+
+  if (bad || !r.ok()) {
+    for (auto p : allocated)
+      delete[] p;
+    fprintf(stderr, "WARNING: ignoring corrupt bcc object cache entry %s\n",
+            path.c_str());
+    return -1;
+  }
+
+  mod_src_ = std::move(mod_src);
+  fake_fd_map_ = std::move(fake_fd_map);
+  perf_events_ = std::move(perf_events);
+  for (auto &fn : fn_srcs) {
+    func_src_->set_src(get<0>(fn), get<1>(fn));
+    func_src_->set_src_rewritten(get<0>(fn), get<2>(fn));
+  }
+  for (auto &t : tables) {
+    string name = t.name;
+    ts_->Insert(Path({id_, name}), std::move(t));
+  }
+  init_table_ids();
+
+  sections_ = std::move(sections);
+  load_btf(sections_);
+  if (load_maps(sections_))
+    return -2;
+
+  for (auto section : sections_)
+    if (!strncmp(FN_PREFIX.c_str(), section.first.c_str(), FN_PREFIX.size()))
+      function_names_.push_back(section.first);
+
+  return 0;
+}
+
+}  // namespace ebpf
@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <chrono>
+#include <map>
+#include <string>
+
+#include <llvm/ExecutionEngine/MCJIT.h>
+#include <llvm/ExecutionEngine/SectionMemoryManager.h>
+#include <llvm/IR/IRPrintingPasses.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Transforms/IPO.h>
+#include <llvm/Transforms/IPO/PassManagerBuilder.h>
+#include <llvm-c/Transforms/IPO.h>
+
+#include "common.h"
+#include "bcc_debug.h"
+#include "frontends/clang/loader.h"
+#include "bpf_module_compiler.h"
+#include "libbpf.h"
+
+namespace ebpf {
+
+using std::get;
+using std::make_tuple;
+using std::move;
+using std::string;
+using std::unique_ptr;
+using namespace llvm;
+
+static uint64_t phase_clock_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Snooping class to remember the sections as the JIT creates them
+class MyMemoryManager : public SectionMemoryManager {
+ public:
+
+  explicit MyMemoryManager(sec_map_def *sections)
+      : sections_(sections) {
+  }
+
+  virtual ~MyMemoryManager() {}
+  uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID,
+                               StringRef SectionName) override {
+    // The programs need to change from fake fd to real map fd, so not allocate ReadOnly regions.
+    uint8_t *Addr = SectionMemoryManager::allocateDataSection(Size, Alignment, SectionID, SectionName, false);
+    //printf("allocateDataSection: %s Addr %p Size %ld Alignment %d SectionID %d\n",
+    //       SectionName.str().c_str(), (void *)Addr, Size, Alignment, SectionID);
+    (*sections_)[SectionName.str()] = make_tuple(Addr, Size, SectionID);
+    return Addr;
+  }
+  uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID, StringRef SectionName,
+                               bool isReadOnly) override {
+    // The lines in .BTF.ext line_info, if corresponding to remapped files, will have empty source line.
+    // The line_info will be fixed in place, so not allocate ReadOnly regions.
+    uint8_t *Addr = SectionMemoryManager::allocateDataSection(Size, Alignment, SectionID, SectionName, false);
+    //printf("allocateDataSection: %s Addr %p Size %ld Alignment %d SectionID %d\n",
+    //       SectionName.str().c_str(), (void *)Addr, Size, Alignment, SectionID);
+    (*sections_)[SectionName.str()] = make_tuple(Addr, Size, SectionID);
+    return Addr;
+  }
+  sec_map_def *sections_;
+};
+
+ClangModuleCompiler::ClangModuleCompiler(BPFModule *module)
+    : module_(module), ctx_(new LLVMContext) {
+  initialize_rw_engine();
+  LLVMInitializeBPFTarget();
+  LLVMInitializeBPFTargetMC();
+  LLVMInitializeBPFTargetInfo();
+  LLVMInitializeBPFAsmPrinter();
+#if LLVM_MAJOR_VERSION >= 6
+  LLVMInitializeBPFAsmParser();
+  if (module_->flags_ & DEBUG_SOURCE)
+    LLVMInitializeBPFDisassembler();
+#endif
+  LLVMLinkInMCJIT(); /* call empty function to force linking of MCJIT */
+}
+
+ClangModuleCompiler::~ClangModuleCompiler() {
+  engine_.reset();
+  cleanup_rw_engine();
+  mod_.reset();
+  ctx_.reset();
+}
+
+// load an entire c file as a module
+int ClangModuleCompiler::parse(const string &file, bool in_memory,
+                               const char *cflags[], int ncflags) {
+  BPFModule &m = *module_;
+  ClangLoader clang_loader(&*ctx_, m.flags_);
+  return clang_loader.parse(&mod_, *m.ts_, file, in_memory, cflags, ncflags,
+                            m.id_, *m.func_src_, m.mod_src_, m.maps_ns_,
+                            m.fake_fd_map_, m.perf_events_);
+}
+
+int ClangModuleCompiler::annotate() {
+  if (module_->rw_engine_enabled_)
+    return annotate_rw();
+
+  for (auto fn = mod_->getFunctionList().begin(); fn != mod_->getFunctionList().end(); ++fn)
+    if (!fn->hasFnAttribute(Attribute::NoInline))
+      fn->addFnAttr(Attribute::AlwaysInline);
+
+  module_->init_table_ids();
+  return 0;
+}
+
+void ClangModuleCompiler::dump_ir(Module &mod) {
+  legacy::PassManager PM;
+  PM.add(createPrintModulePass(errs()));
+  PM.run(mod);
+}
+
+int ClangModuleCompiler::run_pass_manager(Module &mod) {
+  if (verifyModule(mod, &errs())) {
+    if (module_->flags_ & DEBUG_LLVM_IR)
+      dump_ir(mod);
+    return -1;
+  }
+
+  legacy::PassManager PM;
+  PassManagerBuilder PMB;
+  PMB.OptLevel = 3;
+  PM.add(createFunctionInliningPass());
+  /*
+   * llvm < 4.0 needs
+   * PM.add(createAlwaysInlinerPass());
+   * llvm >= 4.0 needs
+   * PM.add(createAlwaysInlinerLegacyPass());
+   * use below 'stable' workaround
+   */
+  LLVMAddAlwaysInlinerPass(reinterpret_cast<LLVMPassManagerRef>(&PM));
+  PMB.populateModulePassManager(PM);
+  if (module_->flags_ & DEBUG_LLVM_IR)
+    PM.add(createPrintModulePass(outs()));
+  PM.run(mod);
+  return 0;
+}
+
+int ClangModuleCompiler::codegen(sec_map_def &sections) {
+  uint64_t start = phase_clock_ns();
+  Module *mod = &*mod_;
+
+  mod->setTargetTriple("bpf-pc-linux");
+#if LLVM_MAJOR_VERSION >= 11
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  mod->setDataLayout("e-m:e-p:64:64-i64:64-i128:128-n32:64-S128");
+#else
+  mod->setDataLayout("E-m:e-p:64:64-i64:64-i128:128-n32:64-S128");
+#endif
+#else
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  mod->setDataLayout("e-m:e-p:64:64-i64:64-n32:64-S128");
+#else
+  mod->setDataLayout("E-m:e-p:64:64-i64:64-n32:64-S128");
+#endif
+#endif
+
+  string err;
+  EngineBuilder builder(move(mod_));
+  builder.setErrorStr(&err);
+  builder.setMCJITMemoryManager(ebpf::make_unique<MyMemoryManager>(&sections));
+  builder.setMArch("bpf");
+#if LLVM_MAJOR_VERSION <= 11
+  builder.setUseOrcMCJITReplacement(false);
+#endif
+  engine_ = unique_ptr<ExecutionEngine>(builder.create());
+  if (!engine_) {
+    fprintf(stderr, "Could not create ExecutionEngine: %s\n", err.c_str());
+    return -1;
+  }
+
+#if LLVM_MAJOR_VERSION >= 9
+  engine_->setProcessAllSections(true);
+#else
+  if (module_->flags_ & DEBUG_SOURCE)
+    engine_->setProcessAllSections(true);
+#endif
+
+  module_->add_phase_time("finalize", start);
+  uint64_t pass_start = phase_clock_ns();
+  if (int rc = run_pass_manager(*mod))
+    return rc;
+  module_->add_phase_time("run_pass_manager", pass_start);
+  start = phase_clock_ns();
+
+  engine_->finalizeObject();
+
+  if (module_->flags_ & DEBUG_SOURCE) {
+    SourceDebugger src_debugger(mod, sections, BPFModule::FN_PREFIX,
+                                module_->mod_src_, module_->src_dbg_fmap_);
+    src_debugger.dump();
+  }
+  module_->add_phase_time("finalize", start);
+  return 0;
+}
+
+}  // namespace ebpf
+
+ebpf::BPFModuleCompiler *bcc_compiler_new(ebpf::BPFModule *mod) {
+  return new ebpf::ClangModuleCompiler(mod);
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2021 Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "bpf_module.h"
+
+namespace llvm {
+class ExecutionEngine;
+class LLVMContext;
+class Module;
+class Type;
+}
+
+class SourceLines;
+
+namespace ebpf {
+
+class MapTypesVisitor;
+
+// The part of a BPFModule that runs Clang and LLVM. It lives in
+// libbcc_compiler, which libbcc only loads the first time a module has to
+// compile a program, so that programs loaded from the object cache or an
+// object file, and tools that only read tables or resolve symbols, never map
+// Clang and LLVM. In the static libraries both are linked together.
+class BPFModuleCompiler {
+ public:
+  virtual ~BPFModuleCompiler() {}
+  // Compile the C file, or the text in file if in_memory, into LLVM IR,
+  // registering its tables in the module's table storage.
+  virtual int parse(const std::string &file, bool in_memory,
+                    const char *cflags[], int ncflags) = 0;
+  // Give the module its table ids and, with the rw engine, the text
+  // conversions of the tables.
+  virtual int annotate() = 0;
+  // Generate the BPF code of the parsed program into sections. With the rw
+  // engine, the sections stay owned by the compiler.
+  virtual int codegen(sec_map_def &sections) = 0;
+};
+
+// The BPFModuleCompiler of libbcc_compiler
+class ClangModuleCompiler : public BPFModuleCompiler {
+ public:
+  explicit ClangModuleCompiler(BPFModule *module);
+  ~ClangModuleCompiler() override;
+  int parse(const std::string &file, bool in_memory, const char *cflags[],
+            int ncflags) override;
+  int annotate() override;
+  int codegen(sec_map_def &sections) override;
+
+ private:
+  void initialize_rw_engine();
+  void cleanup_rw_engine();
+  int annotate_rw();
+  std::unique_ptr<llvm::ExecutionEngine> finalize_rw(std::unique_ptr<llvm::Module> mod);
+  std::string make_reader(llvm::Module *mod, llvm::Type *type);
+  std::string make_writer(llvm::Module *mod, llvm::Type *type);
+  void dump_ir(llvm::Module &mod);
+  int run_pass_manager(llvm::Module &mod);
+  StatusTuple sscanf(std::string fn_name, const char *str, void *val);
+  StatusTuple snprintf(std::string fn_name, char *str, size_t sz,
+                       const void *val);
+  StatusTuple make_rw_fn(llvm::Type *type, bool writer, std::string *fn_name);
+  StatusTuple type_sscanf(llvm::Type *type, const char *str, void *val);
+  StatusTuple type_snprintf(llvm::Type *type, char *str, size_t sz,
+                            const void *val);
+
+  BPFModule *module_;
+  std::unique_ptr<llvm::LLVMContext> ctx_;
+  std::unique_ptr<llvm::ExecutionEngine> engine_;
+  std::unique_ptr<llvm::ExecutionEngine> rw_engine_;
+  std::unique_ptr<llvm::Module> mod_;
+  std::map<llvm::Type *, std::string> readers_;
+  std::map<llvm::Type *, std::string> writers_;
+  std::mutex rw_mutex_;
+};
+
+// The entry points of libbcc_compiler, or of the objects linked into the
+// static libraries, or nullptr if it can't be loaded.
+struct CompilerEntries {
+  BPFModuleCompiler *(*compiler_new)(BPFModule *mod);
+  MapTypesVisitor *(*json_map_types_visitor_new)();
+  // nullptr if LLVM has no DWARF reader
+  SourceLines *(*source_lines_open)(const char *path);
+};
+const CompilerEntries *compiler_entries();
+
+}  // namespace ebpf
+
+extern "C" {
+ebpf::BPFModuleCompiler *bcc_compiler_new(ebpf::BPFModule *mod);
+ebpf::MapTypesVisitor *bcc_json_map_types_visitor_new();
+SourceLines *bcc_source_lines_open(const char *path);
+}
@@ -22,7 +22,7 @@
 #include <llvm/Support/TargetSelect.h>
 
 #include "common.h"
-#include "bpf_module.h"
+#include "bpf_module_compiler.h"
 #include "table_storage.h"
 
 namespace ebpf {
@@ -34,16 +34,12 @@ using std::unique_ptr;
 using std::vector;
 using namespace llvm;
 
-bool bpf_module_rw_engine_enabled(void) {
-  return true;
-}
-
-void BPFModule::initialize_rw_engine() {
+void ClangModuleCompiler::initialize_rw_engine() {
   InitializeNativeTarget();
   InitializeNativeTargetAsmPrinter();
 }
 
-void BPFModule::cleanup_rw_engine() {
+void ClangModuleCompiler::cleanup_rw_engine() {
   rw_engine_.reset();
 }
 
@@ -234,7 +230,7 @@ static void parse_type(IRBuilder<> &B, vector<Value *> *args, string *fmt,
 //  nesting is supported
 //   struct { struct { u8 a[]; }; }    <= { "" }
 //   struct { struct { u64 a[]; }; }   <= { [ %i %i .. ] }
-string BPFModule::make_reader(Module *mod, Type *type) {
+string ClangModuleCompiler::make_reader(Module *mod, Type *type) {
   auto fn_it = readers_.find(type);
   if (fn_it != readers_.end())
     return fn_it->second;
@@ -306,7 +302,7 @@ string BPFModule::make_reader(Module *mod, Type *type) {
 //  nesting is supported
 //   struct { struct { u8 a[]; }; }    => { "" }
 //   struct { struct { u64 a[]; }; }   => { [ 0x%x 0x%x .. ] }
-string BPFModule::make_writer(Module *mod, Type *type) {
+string ClangModuleCompiler::make_writer(Module *mod, Type *type) {
   auto fn_it = writers_.find(type);
   if (fn_it != writers_.end())
     return fn_it->second;
@@ -367,7 +363,7 @@ string BPFModule::make_writer(Module *mod, Type *type) {
   return name;
 }
 
-unique_ptr<ExecutionEngine> BPFModule::finalize_rw(unique_ptr<Module> m) {
+unique_ptr<ExecutionEngine> ClangModuleCompiler::finalize_rw(unique_ptr<Module> m) {
   Module *mod = &*m;
 
   run_pass_manager(*mod);
@@ -384,20 +380,18 @@ unique_ptr<ExecutionEngine> BPFModule::finalize_rw(unique_ptr<Module> m) {
   return engine;
 }
 
-int BPFModule::annotate() {
+int ClangModuleCompiler::annotate_rw() {
   for (auto fn = mod_->getFunctionList().begin(); fn != mod_->getFunctionList().end(); ++fn)
     if (!fn->hasFnAttribute(Attribute::NoInline))
       fn->addFnAttr(Attribute::AlwaysInline);
 
-  // separate module to hold the reader functions
-  auto m = ebpf::make_unique<Module>("sscanf", *ctx_);
-
   size_t id = 0;
-  Path path({id_});
-  for (auto it = ts_->lower_bound(path), up = ts_->upper_bound(path); it != up; ++it) {
+  Path path({module_->id_});
+  TableStorage *ts = module_->ts_;
+  for (auto it = ts->lower_bound(path), up = ts->upper_bound(path); it != up; ++it) {
     TableDesc &table = it->second;
-    tables_.push_back(&it->second);
-    table_names_[table.name] = id++;
+    module_->tables_.push_back(&it->second);
+    module_->table_names_[table.name] = id++;
     GlobalValue *gvar = mod_->getNamedValue(table.name);
     if (!gvar) continue;
     if (PointerType *pt = dyn_cast<PointerType>(gvar->getType())) {
@@ -406,30 +400,67 @@ int BPFModule::annotate() {
         Type *key_type = st->elements()[0];
         Type *leaf_type = st->elements()[1];
 
+        // The reader/writer functions are only generated and JIT compiled
+        // the first time a table is formatted, see make_rw_fn().
         using std::placeholders::_1;
         using std::placeholders::_2;
         using std::placeholders::_3;
-        table.key_sscanf = std::bind(&BPFModule::sscanf, this,
-                                     make_reader(&*m, key_type), _1, _2);
-        table.leaf_sscanf = std::bind(&BPFModule::sscanf, this,
-                                      make_reader(&*m, leaf_type), _1, _2);
-        table.key_snprintf = std::bind(&BPFModule::snprintf, this,
-                                       make_writer(&*m, key_type), _1, _2, _3);
-        table.leaf_snprintf =
-            std::bind(&BPFModule::snprintf, this, make_writer(&*m, leaf_type),
-                      _1, _2, _3);
+        table.key_sscanf = std::bind(&ClangModuleCompiler::type_sscanf, this,
+                                     key_type, _1, _2);
+        table.leaf_sscanf = std::bind(&ClangModuleCompiler::type_sscanf, this,
+                                      leaf_type, _1, _2);
+        table.key_snprintf = std::bind(&ClangModuleCompiler::type_snprintf, this,
+                                       key_type, _1, _2, _3);
+        table.leaf_snprintf = std::bind(&ClangModuleCompiler::type_snprintf, this,
+                                        leaf_type, _1, _2, _3);
       }
     }
   }
 
-  rw_engine_ = finalize_rw(move(m));
-  if (!rw_engine_)
-    return -1;
   return 0;
 }
 
-StatusTuple BPFModule::sscanf(string fn_name, const char *str, void *val) {
-  if (!rw_engine_enabled_)
+StatusTuple ClangModuleCompiler::make_rw_fn(Type *type, bool writer, string *fn_name) {
+  std::lock_guard<std::mutex> lock(rw_mutex_);
+  map<Type *, string> &fns = writer ? writers_ : readers_;
+  auto fn_it = fns.find(type);
+  if (fn_it != fns.end()) {
+    *fn_name = fn_it->second;
+    return StatusTuple::OK();
+  }
+
+  // separate module to hold the new reader or writer function
+  auto m = ebpf::make_unique<Module>(writer ? "snprintf" : "sscanf", *ctx_);
+  string name = writer ? make_writer(&*m, type) : make_reader(&*m, type);
+  if (!rw_engine_) {
+    rw_engine_ = finalize_rw(move(m));
+  } else {
+    run_pass_manager(*m);
+    rw_engine_->addModule(move(m));
+  }
+  if (!rw_engine_) {
+    fns.erase(type);
+    return StatusTuple(-1, "Could not create rw_engine");
+  }
+  *fn_name = name;
+  return StatusTuple::OK();
+}
+
+StatusTuple ClangModuleCompiler::type_sscanf(Type *type, const char *str, void *val) {
+  string fn_name;
+  TRY2(make_rw_fn(type, false, &fn_name));
+  return sscanf(fn_name, str, val);
+}
+
+StatusTuple ClangModuleCompiler::type_snprintf(Type *type, char *str, size_t sz,
+                                     const void *val) {
+  string fn_name;
+  TRY2(make_rw_fn(type, true, &fn_name));
+  return snprintf(fn_name, str, sz, val);
+}
+
+StatusTuple ClangModuleCompiler::sscanf(string fn_name, const char *str, void *val) {
+  if (!module_->rw_engine_enabled_)
     return StatusTuple(-1, "rw_engine not enabled");
   auto fn =
       (int (*)(const char *, void *))rw_engine_->getFunctionAddress(fn_name);
@@ -441,9 +472,9 @@ StatusTuple BPFModule::sscanf(string fn_name, const char *str, void *val) {
   return StatusTuple(rc);
 }
 
-StatusTuple BPFModule::snprintf(string fn_name, char *str, size_t sz,
+StatusTuple ClangModuleCompiler::snprintf(string fn_name, char *str, size_t sz,
                                 const void *val) {
-  if (!rw_engine_enabled_)
+  if (!module_->rw_engine_enabled_)
     return StatusTuple(-1, "rw_engine not enabled");
   auto fn = (int (*)(char *, size_t,
                      const void *))rw_engine_->getFunctionAddress(fn_name);
@@ -14,21 +14,17 @@
  * limitations under the License.
  */
 
-#include "bpf_module.h"
+#include "bpf_module_compiler.h"
 
 namespace ebpf {
 
-bool bpf_module_rw_engine_enabled(void) {
-  return false;
+void ClangModuleCompiler::initialize_rw_engine() {
 }
 
-void BPFModule::initialize_rw_engine() {
+void ClangModuleCompiler::cleanup_rw_engine() {
 }
 
-void BPFModule::cleanup_rw_engine() {
-}
-
-int BPFModule::annotate() {
+int ClangModuleCompiler::annotate_rw() {
   return -1;
 }
 
@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "cgroup_cache.h"
+
+namespace {
+
+// Directories are all that matter in a cgroup hierarchy, their files are
+// the controls of the cgroups
+const uint32_t WATCH_MASK =
+    IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR;
+
+struct Cgroup {
+  std::string path;
+  std::string label;
+};
+
+bool is_below(const std::string &path, const std::string &dir) {
+  if (dir == "/")
+    return true;
+  return path.compare(0, dir.size(), dir) == 0 &&
+         (path.size() == dir.size() || path[dir.size()] == '/');
+}
+
+std::string join(const std::string &dir, const char *name) {
+  return dir == "/" ? dir + name : dir + "/" + name;
+}
+
+}  // namespace
+
+struct bcc_cgroup_cache {
+  std::string root;
+  bcc_cgroup_label_cb label_cb;
+  void *ctx;
+  int fd;
+
+  std::mutex mutex;
+  std::unordered_map<uint64_t, Cgroup> by_id;
+  std::unordered_map<std::string, uint64_t> by_path;
+  // paths of the watched directories, by watch descriptor
+  std::unordered_map<int, std::string> watches;
+
+  int add(const std::string &path);
+  int remove(const std::string &path);
+  int apply();
+};
+
+// Add the cgroup at path and those below, returning their number. The
+// directory is watched before it is read, so that no cgroup created in
+// between is missed.
+int bcc_cgroup_cache::add(const std::string &path) {
+  std::string full = path == "/" ? root : root + path;
+  int wd = inotify_add_watch(fd, full.c_str(), WATCH_MASK);
+  if (wd >= 0)
+    watches[wd] = path;
+  // without watches left (ENOSPC), what is below is still found once
+
+  struct stat st;
+  if (stat(full.c_str(), &st) < 0 || !S_ISDIR(st.st_mode))
+    return 0;
+  auto old = by_path.find(path);
+  if (old != by_path.end()) {
+    if (old->second == st.st_ino)
+      return 0;
+    by_id.erase(old->second);
+  }
+  Cgroup &cg = by_id[st.st_ino];
+  cg.path = path;
+  cg.label.clear();
+  if (label_cb) {
+    char label[256];
+    int len = label_cb(path.c_str(), label, sizeof(label), ctx);
+    if (len > 0)
+      cg.label.assign(label, std::min<size_t>(len, sizeof(label) - 1));
+  }
+  by_path[path] = st.st_ino;
+  int n = 1;
+
+  DIR *dir = opendir(full.c_str());
+  if (!dir)
+    return n;
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != nullptr) {
+    if (ent->d_type != DT_DIR && ent->d_type != DT_UNKNOWN)
+      continue;
+    if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+      continue;
+    n += add(join(path, ent->d_name));
+  }
+  closedir(dir);
+  return n;
+}
+
+// Remove the cgroup at path and those below, returning their number
+int bcc_cgroup_cache::remove(const std::string &path) {
+  int n = 0;
+  for (auto it = by_path.begin(); it != by_path.end();) {
+    if (!is_below(it->first, path)) {
+      ++it;
+      continue;
+    }
+    by_id.erase(it->second);
+    it = by_path.erase(it);
+    n++;
+  }
+  // a directory moved elsewhere is still watched, under its old path
+  for (auto it = watches.begin(); it != watches.end();) {
+    if (!is_below(it->second, path)) {
+      ++it;
+      continue;
+    }
+    inotify_rm_watch(fd, it->first);
+    it = watches.erase(it);
+  }
+  return n;
+}
+
+int bcc_cgroup_cache::apply() {
+  alignas(struct inotify_event) char buf[16 * 1024];
+  int n = 0;
+
+  while (true) {
+    ssize_t len = read(fd, buf, sizeof(buf));
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      return errno == EAGAIN ? n : -errno;
+    }
+    for (ssize_t off = 0; off < len;) {
+      auto ev = reinterpret_cast<struct inotify_event *>(buf + off);
+      off += sizeof(*ev) + ev->len;
+
+      if (ev->mask & IN_Q_OVERFLOW) {
+        // events were dropped, start over
+        n += remove("/");
+        n += add("/");
+        continue;
+      }
+      if (ev->mask & IN_IGNORED) {
+        watches.erase(ev->wd);
+        continue;
+      }
+      auto w = watches.find(ev->wd);
+      if (w == watches.end() || !(ev->mask & IN_ISDIR) || !ev->len)
+        continue;
+      std::string path = join(w->second, ev->name);
+      if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+        n += remove(path);
+      if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+        n += add(path);
+    }
+  }
+}
+
+struct bcc_cgroup_cache *bcc_cgroup_cache_new(const char *root,
+                                              bcc_cgroup_label_cb label_cb,
+                                              void *ctx) {
+  std::string dir = root ? root : "/sys/fs/cgroup";
+  while (dir.size() > 1 && dir.back() == '/')
+    dir.pop_back();
+  struct stat st;
+  if (stat(dir.c_str(), &st) < 0)
+    return nullptr;
+  if (!S_ISDIR(st.st_mode)) {
+    errno = ENOTDIR;
+    return nullptr;
+  }
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0)
+    return nullptr;
+
+  auto cache = new bcc_cgroup_cache();
+  cache->root = dir;
+  cache->label_cb = label_cb;
+  cache->ctx = ctx;
+  cache->fd = fd;
+  cache->add("/");
+  return cache;
+}
+
+void bcc_cgroup_cache_free(struct bcc_cgroup_cache *cache) {
+  if (!cache)
+    return;
+  close(cache->fd);
+  delete cache;
+}
+
+int bcc_cgroup_cache_fd(struct bcc_cgroup_cache *cache) { return cache->fd; }
+
+int bcc_cgroup_cache_poll(struct bcc_cgroup_cache *cache) {
+  std::lock_guard<std::mutex> lock(cache->mutex);
+  return cache->apply();
+}
+
+static void copy_str(const std::string &s, char *buf, size_t size) {
+  if (!buf || !size)
+    return;
+  size_t len = std::min(s.size(), size - 1);
+  memcpy(buf, s.data(), len);
+  buf[len] = '\0';
+}
+
+int bcc_cgroup_cache_lookup(struct bcc_cgroup_cache *cache, uint64_t id,
+                            char *path, size_t path_size, char *label,
+                            size_t label_size) {
+  std::lock_guard<std::mutex> lock(cache->mutex);
+  auto it = cache->by_id.find(id);
+  if (it == cache->by_id.end()) {
+    // perhaps created since the last poll
+    if (cache->apply() <= 0)
+      return -ENOENT;
+    it = cache->by_id.find(id);
+    if (it == cache->by_id.end())
+      return -ENOENT;
+  }
+  copy_str(it->second.path, path, path_size);
+  copy_str(it->second.label, label, label_size);
+  return 0;
+}
+
+size_t bcc_cgroup_cache_size(struct bcc_cgroup_cache *cache) {
+  std::lock_guard<std::mutex> lock(cache->mutex);
+  return cache->by_id.size();
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef LIBBCC_CGROUP_CACHE_H
+#define LIBBCC_CGROUP_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Resolve the cgroup ids of bpf_get_current_cgroup_id() to the path of the
+ * cgroup v2 directory, like the "0::" line of /proc/PID/cgroup, and to a
+ * label such as the name of its container. The hierarchy is walked once,
+ * then kept up to date with inotify, so that a lookup is a hash table
+ * lookup instead of reading files for every event.
+ *
+ * Ids are the inode numbers of the directories, which are the cgroup ids
+ * on 64-bit kernels. */
+struct bcc_cgroup_cache;
+
+/* Write the label of the cgroup at path, relative to the root of the
+ * hierarchy, into buf of size bytes, NUL terminated. Return its length, or
+ * 0 for no label. Called once per cgroup, when it is found. */
+typedef int (*bcc_cgroup_label_cb)(const char *path, char *buf, size_t size,
+                                   void *ctx);
+
+/* Walk the hierarchy mounted at root, /sys/fs/cgroup if NULL. label_cb can
+ * be NULL. Returns NULL with errno set on failure. */
+struct bcc_cgroup_cache *bcc_cgroup_cache_new(const char *root,
+                                              bcc_cgroup_label_cb label_cb,
+                                              void *ctx);
+void bcc_cgroup_cache_free(struct bcc_cgroup_cache *cache);
+
+/* The inotify fd, readable when the hierarchy changed, to poll the cache
+ * from an event loop */
+int bcc_cgroup_cache_fd(struct bcc_cgroup_cache *cache);
+/* Apply the changes of the hierarchy, without blocking. Lookups of unknown
+ * ids do it too, for the cgroups created since. Returns the number of
+ * cgroups added or removed, or a negative errno. */
+int bcc_cgroup_cache_poll(struct bcc_cgroup_cache *cache);
+
+/* Copy the path and the label of the cgroup id into path and label, of
+ * path_size and label_size bytes, either of which can be NULL. Returns 0,
+ * or -ENOENT for an unknown id. The cache can be used from any thread. */
+int bcc_cgroup_cache_lookup(struct bcc_cgroup_cache *cache, uint64_t id,
+                            char *path, size_t path_size, char *label,
+                            size_t label_size);
+/* Number of cgroups known */
+size_t bcc_cgroup_cache_size(struct bcc_cgroup_cache *cache);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
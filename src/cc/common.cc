@@ -49,6 +49,15 @@ std::vector<int> get_possible_cpus() {
   return read_cpu_range("/sys/devices/system/cpu/possible");
 }
 
+std::vector<int> get_online_nodes() {
+  return read_cpu_range("/sys/devices/system/node/online");
+}
+
+std::vector<int> get_node_cpus(int node) {
+  return read_cpu_range(
+      tfm::format("/sys/devices/system/node/node%d/cpulist", node));
+}
+
 std::string get_pid_exe(pid_t pid) {
   char exe_path[4096];
   int res;
@@ -37,6 +37,10 @@ std::vector<int> get_online_cpus();
 
 std::vector<int> get_possible_cpus();
 
+std::vector<int> get_online_nodes();
+
+std::vector<int> get_node_cpus(int node);
+
 std::string get_pid_exe(pid_t pid);
 
 std::string parse_tracepoint(std::istream &input, std::string const& category,
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2021 Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <dlfcn.h>
+#include <stdio.h>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <clang/AST/Type.h>
+
+#include "bpf_module_compiler.h"
+#include "sym_lines.h"
+#include "table_desc.h"
+
+namespace ebpf {
+
+#ifdef BCC_STATIC_COMPILER
+
+const CompilerEntries *compiler_entries() {
+  static const CompilerEntries entries = {
+    bcc_compiler_new,
+    bcc_json_map_types_visitor_new,
+#if LLVM_MAJOR_VERSION >= 6
+    bcc_source_lines_open,
+#else
+    nullptr,
+#endif
+  };
+  return &entries;
+}
+
+#else
+
+#define COMPILER_LIB "libbcc_compiler.so.0"
+
+// Next to libbcc first, so that a build tree or a private install uses its
+// own, then wherever the dynamic linker finds it.
+static void *open_compiler_lib() {
+  Dl_info info;
+  if (dladdr((void *)&compiler_entries, &info) && info.dli_fname) {
+    std::string path = info.dli_fname;
+    size_t slash = path.rfind('/');
+    if (slash != std::string::npos) {
+      path = path.substr(0, slash + 1) + COMPILER_LIB;
+      if (void *handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL))
+        return handle;
+    }
+  }
+  return dlopen(COMPILER_LIB, RTLD_NOW | RTLD_LOCAL);
+}
+
+static std::once_flag compiler_once;
+static CompilerEntries entries;
+static bool loaded;
+
+const CompilerEntries *compiler_entries() {
+  std::call_once(compiler_once, []() {
+    // Never closed, the tables keep pointers into the rw engine
+    void *handle = open_compiler_lib();
+    if (!handle) {
+      fprintf(stderr, "Could not load " COMPILER_LIB ": %s\n", dlerror());
+      return;
+    }
+    entries.compiler_new = (BPFModuleCompiler * (*)(BPFModule *))
+        dlsym(handle, "bcc_compiler_new");
+    entries.json_map_types_visitor_new = (MapTypesVisitor * (*)())
+        dlsym(handle, "bcc_json_map_types_visitor_new");
+    entries.source_lines_open = (SourceLines * (*)(const char *))
+        dlsym(handle, "bcc_source_lines_open");
+    if (!entries.compiler_new || !entries.json_map_types_visitor_new) {
+      fprintf(stderr, COMPILER_LIB " is not from this bcc version\n");
+      return;
+    }
+    loaded = true;
+  });
+  return loaded ? &entries : nullptr;
+}
+
+#endif
+
+namespace {
+
+// Table storages are created before anything is compiled, but only the
+// frontend visits the types of their tables, so the visitor of
+// libbcc_compiler is created on the first visit.
+class JsonMapTypesVisitorProxy : public MapTypesVisitor {
+ public:
+  void Visit(TableDesc &desc, clang::ASTContext &C, clang::QualType key_type,
+             clang::QualType leaf_type) override {
+    if (!visitor_) {
+      const CompilerEntries *entries = compiler_entries();
+      if (!entries)
+        return;
+      visitor_.reset(entries->json_map_types_visitor_new());
+    }
+    visitor_->Visit(desc, C, key_type, leaf_type);
+  }
+
+ private:
+  std::unique_ptr<MapTypesVisitor> visitor_;
+};
+
+}  // namespace
+
+std::unique_ptr<MapTypesVisitor> createJsonMapTypesVisitor() {
+  return std::unique_ptr<MapTypesVisitor>(new JsonMapTypesVisitorProxy());
+}
+
+}  // namespace ebpf
+
+// Source lines need the DWARF reader of LLVM, so symbolizing with them loads
+// libbcc_compiler too.
+std::unique_ptr<SourceLines> SourceLines::open(const std::string &path) {
+  const ebpf::CompilerEntries *entries = ebpf::compiler_entries();
+  if (!entries || !entries->source_lines_open)
+    return nullptr;
+  return std::unique_ptr<SourceLines>(entries->source_lines_open(path.c_str()));
+}
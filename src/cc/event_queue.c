@@ -0,0 +1,359 @@
+/*
+ * Copyright (c) 2021 Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "event_queue.h"
+#include "libbpf.h"
+#include "perf_reader.h"
+
+#define EVENT_QUEUE_MAX_EVENTS 64
+#define EVENT_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+// Header of a record in the queue, followed by its data padded to 8 bytes
+struct event_hdr {
+  uint32_t size;
+  uint16_t tag;
+  uint16_t type;
+  int32_t cpu;
+  uint32_t pad;
+};
+
+struct event_source {
+  struct bcc_event_queue *queue;
+  uint16_t tag;
+  int cpu;
+  void *reader; // perf reader, NULL for ring buffers
+};
+
+/* Single producer (the polling thread), single consumer byte ring. head and
+ * tail only grow, the ring is full when they are size bytes apart. */
+struct bcc_event_queue {
+  uint64_t head __attribute__((aligned(64)));
+  uint64_t tail __attribute__((aligned(64)));
+  char *ring __attribute__((aligned(64)));
+  uint64_t size;
+  uint64_t dropped;
+  bool pending; // records pushed since the reader was last woken up
+
+  struct event_source **sources;
+  int nr_sources;
+  struct ring_buffer *rb;
+
+  int epoll_fd;
+  int data_fd; // wakes up the reader
+  int stop_fd; // wakes up the polling thread to stop it
+  bool stop;
+  bool running;
+  pthread_t thread;
+};
+
+static void ring_write(struct bcc_event_queue *q, uint64_t pos,
+                       const void *data, size_t len) {
+  uint64_t off = pos & (q->size - 1);
+  size_t first = len < q->size - off ? len : q->size - off;
+
+  memcpy(q->ring + off, data, first);
+  memcpy(q->ring, (const char *)data + first, len - first);
+}
+
+static void ring_read(struct bcc_event_queue *q, uint64_t pos, void *data,
+                      size_t len) {
+  uint64_t off = pos & (q->size - 1);
+  size_t first = len < q->size - off ? len : q->size - off;
+
+  memcpy(data, q->ring + off, first);
+  memcpy((char *)data + first, q->ring, len - first);
+}
+
+static void queue_push(struct event_source *src, uint16_t type,
+                       const void *data, uint32_t size) {
+  struct bcc_event_queue *q = src->queue;
+  struct event_hdr hdr = {size, src->tag, type, src->cpu, 0};
+  uint64_t head = q->head;
+  uint64_t len = sizeof(hdr) + EVENT_ALIGN(size);
+
+  if (len > q->size - (head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE))) {
+    __atomic_add_fetch(&q->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  ring_write(q, head, &hdr, sizeof(hdr));
+  ring_write(q, head + sizeof(hdr), data, size);
+  __atomic_store_n(&q->head, head + len, __ATOMIC_RELEASE);
+  q->pending = true;
+}
+
+static void perf_raw_cb(void *cookie, void *raw, int size) {
+  queue_push(cookie, BCC_EVENT_SAMPLE, raw, size);
+}
+
+static void perf_lost_cb(void *cookie, uint64_t lost) {
+  queue_push(cookie, BCC_EVENT_LOST, &lost, sizeof(lost));
+}
+
+static int ringbuf_cb(void *ctx, void *data, size_t size) {
+  queue_push(ctx, BCC_EVENT_SAMPLE, data, size);
+  return 0;
+}
+
+static void *poll_thread(void *arg) {
+  struct bcc_event_queue *q = arg;
+  struct epoll_event events[EVENT_QUEUE_MAX_EVENTS];
+  uint64_t val = 1;
+  int i, cnt;
+
+  while (!__atomic_load_n(&q->stop, __ATOMIC_ACQUIRE)) {
+    cnt = epoll_wait(q->epoll_fd, events, EVENT_QUEUE_MAX_EVENTS, -1);
+    if (cnt < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    for (i = 0; i < cnt; i++) {
+      void *ptr = events[i].data.ptr;
+
+      if (ptr == &q->stop_fd)
+        continue;
+      if (ptr == &q->rb)
+        bpf_consume_ringbuf(q->rb);
+      else
+        perf_reader_event_read(((struct event_source *)ptr)->reader);
+    }
+    // one wakeup for everything read in this round
+    if (q->pending) {
+      q->pending = false;
+      if (write(q->data_fd, &val, sizeof(val)) < 0)
+        break;
+    }
+  }
+  return NULL;
+}
+
+static int queue_start(struct bcc_event_queue *q) {
+  sigset_t all, old;
+  int err;
+
+  // signals such as SIGINT must keep going to the threads of the caller
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  q->stop = false;
+  err = pthread_create(&q->thread, NULL, poll_thread, q);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (err)
+    return -err;
+  q->running = true;
+  return 0;
+}
+
+static void queue_stop(struct bcc_event_queue *q) {
+  uint64_t val = 1;
+
+  if (!q->running)
+    return;
+  __atomic_store_n(&q->stop, true, __ATOMIC_RELEASE);
+  if (write(q->stop_fd, &val, sizeof(val)) < 0)
+    return;
+  pthread_join(q->thread, NULL);
+  if (read(q->stop_fd, &val, sizeof(val)) < 0)
+    val = 0;
+  q->running = false;
+}
+
+static int epoll_add(struct bcc_event_queue *q, int fd, void *ptr) {
+  struct epoll_event ev = {};
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = ptr;
+  return epoll_ctl(q->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0 ? -errno : 0;
+}
+
+struct bcc_event_queue * bcc_event_queue_new(size_t size) {
+  struct bcc_event_queue *q;
+  uint64_t cap = 4096;
+
+  while (cap < size)
+    cap <<= 1;
+
+  q = calloc(1, sizeof(*q));
+  if (!q)
+    return NULL;
+  q->size = cap;
+  q->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  q->data_fd = eventfd(0, EFD_CLOEXEC);
+  q->stop_fd = eventfd(0, EFD_CLOEXEC);
+  q->ring = malloc(cap);
+  if (q->epoll_fd < 0 || q->data_fd < 0 || q->stop_fd < 0 || !q->ring ||
+      epoll_add(q, q->stop_fd, &q->stop_fd)) {
+    bcc_event_queue_free(q);
+    return NULL;
+  }
+  return q;
+}
+
+void bcc_event_queue_free(struct bcc_event_queue *queue) {
+  int i;
+
+  if (!queue)
+    return;
+
+  queue_stop(queue);
+  for (i = 0; i < queue->nr_sources; i++) {
+    if (queue->sources[i]->reader)
+      perf_reader_free(queue->sources[i]->reader);
+    free(queue->sources[i]);
+  }
+  free(queue->sources);
+  if (queue->rb)
+    bpf_free_ringbuf(queue->rb);
+  if (queue->epoll_fd >= 0)
+    close(queue->epoll_fd);
+  if (queue->data_fd >= 0)
+    close(queue->data_fd);
+  if (queue->stop_fd >= 0)
+    close(queue->stop_fd);
+  free(queue->ring);
+  free(queue);
+}
+
+static struct event_source *add_source(struct bcc_event_queue *q, uint16_t tag,
+                                       int cpu) {
+  struct event_source **sources, *src;
+
+  src = calloc(1, sizeof(*src));
+  if (!src)
+    return NULL;
+  sources = realloc(q->sources, (q->nr_sources + 1) * sizeof(*sources));
+  if (!sources) {
+    free(src);
+    return NULL;
+  }
+  src->queue = q;
+  src->tag = tag;
+  src->cpu = cpu;
+  q->sources = sources;
+  q->sources[q->nr_sources++] = src;
+  return src;
+}
+
+void * bcc_event_queue_open_perf_buffer(struct bcc_event_queue *queue,
+                                        uint16_t tag, int page_cnt,
+                                        struct bcc_perf_buffer_opts *opts) {
+  struct event_source *src;
+  void *reader;
+
+  src = add_source(queue, tag, opts->cpu);
+  if (!src)
+    return NULL;
+  reader = bpf_open_perf_buffer_opts(perf_raw_cb, perf_lost_cb, src, page_cnt,
+                                     opts);
+  if (!reader)
+    return NULL;
+  // epoll_ctl() is fine while the polling thread waits
+  if (epoll_add(queue, perf_reader_fd(reader), src)) {
+    perf_reader_free(reader);
+    return NULL;
+  }
+  src->reader = reader;
+  return reader;
+}
+
+int bcc_event_queue_add_ringbuf(struct bcc_event_queue *queue, uint16_t tag,
+                                int map_fd) {
+  struct event_source *src;
+  int err;
+
+  src = add_source(queue, tag, -1);
+  if (!src)
+    return -ENOMEM;
+
+  // libbpf ring buffer managers cannot grow while they are consumed
+  queue_stop(queue);
+  if (!queue->rb) {
+    queue->rb = bpf_new_ringbuf(map_fd, ringbuf_cb, src);
+    if (!queue->rb)
+      return -errno;
+    err = epoll_add(queue, bpf_ringbuf_epoll_fd(queue->rb), &queue->rb);
+    if (err)
+      return err;
+  } else {
+    err = bpf_add_ringbuf(queue->rb, map_fd, ringbuf_cb, src);
+    if (err)
+      return err;
+  }
+  return 0;
+}
+
+int bcc_event_queue_read(struct bcc_event_queue *queue, void *buf,
+                         size_t buf_size, struct bcc_event *events,
+                         int max_events, int timeout_ms) {
+  struct bcc_event_queue *q = queue;
+  uint64_t tail = q->tail, head, val;
+  struct event_hdr hdr;
+  size_t off = 0;
+  int cnt = 0, err;
+
+  if (!q->running && q->nr_sources) {
+    err = queue_start(q);
+    if (err)
+      return err;
+  }
+
+  head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+  if (head == tail) {
+    struct pollfd pfd = {q->data_fd, POLLIN, 0};
+
+    err = poll(&pfd, 1, timeout_ms);
+    if (err <= 0)
+      return err < 0 ? -errno : 0;
+    if (read(q->data_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+      return -errno;
+    head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+  }
+
+  while (tail != head && cnt < max_events) {
+    ring_read(q, tail, &hdr, sizeof(hdr));
+    if (off + hdr.size > buf_size) {
+      if (cnt)
+        break;
+      events[0].size = hdr.size;
+      return -EMSGSIZE;
+    }
+    ring_read(q, tail + sizeof(hdr), (char *)buf + off, hdr.size);
+    events[cnt].offset = off;
+    events[cnt].size = hdr.size;
+    events[cnt].tag = hdr.tag;
+    events[cnt].type = hdr.type;
+    events[cnt].cpu = hdr.cpu;
+    cnt++;
+    // keep every record 8 byte aligned in buf, like in the queue
+    off = EVENT_ALIGN(off + hdr.size);
+    tail += sizeof(hdr) + EVENT_ALIGN(hdr.size);
+  }
+  __atomic_store_n(&q->tail, tail, __ATOMIC_RELEASE);
+  return cnt;
+}
+
+uint64_t bcc_event_queue_dropped(struct bcc_event_queue *queue) {
+  return __atomic_load_n(&queue->dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2021 Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BCC_EVENT_QUEUE_H
+#define BCC_EVENT_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libbpf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A thread of its own polls perf and ring buffers and copies their records
+ * into a queue, which is drained with bcc_event_queue_read(). The reading
+ * thread never runs the callbacks of the buffers, so a caller holding a lock
+ * while it reads (such as the Python GIL) only takes it to handle batches of
+ * records. */
+struct bcc_event_queue;
+
+enum {
+  BCC_EVENT_SAMPLE = 0,
+  BCC_EVENT_LOST = 1, // data is the uint64_t count of lost samples
+};
+
+// A record copied out by bcc_event_queue_read()
+struct bcc_event {
+  uint32_t offset; // of the data in the read buffer
+  uint32_t size;
+  uint16_t tag;    // of the buffer it came from
+  uint16_t type;   // BCC_EVENT_*
+  int32_t cpu;     // -1 for ring buffers
+};
+
+/* size is the capacity of the queue in bytes, rounded up to a power of two.
+ * Records that do not fit are dropped and counted. */
+struct bcc_event_queue * bcc_event_queue_new(size_t size);
+void bcc_event_queue_free(struct bcc_event_queue *queue);
+
+/* Open a perf buffer like bpf_open_perf_buffer_opts() whose records go to the
+ * queue. Returns the reader, which belongs to the queue, or NULL. */
+void * bcc_event_queue_open_perf_buffer(struct bcc_event_queue *queue,
+                                        uint16_t tag, int page_cnt,
+                                        struct bcc_perf_buffer_opts *opts);
+// Add the ring buffer map map_fd to the queue
+int bcc_event_queue_add_ringbuf(struct bcc_event_queue *queue, uint16_t tag,
+                                int map_fd);
+
+/* Copy up to max_events records into buf, waiting up to timeout_ms (-1 for
+ * ever) for the first one. Starts the polling thread if needed. Returns the
+ * number of records, 0 on timeout, or a negative errno. -EMSGSIZE means the
+ * first record, of events[0].size bytes, does not fit in buf. Only one thread
+ * may read at a time. */
+int bcc_event_queue_read(struct bcc_event_queue *queue, void *buf,
+                         size_t buf_size, struct bcc_event *events,
+                         int max_events, int timeout_ms);
+// Number of records dropped because the queue was full
+uint64_t bcc_event_queue_dropped(struct bcc_event_queue *queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -94,8 +94,9 @@ R"********(
         __attribute__ ((section(".maps." #name), used)) \
                 ____btf_map_##name = { }
 
+// Allocate the map on NUMA node _numa_node, or on any node if it is -1
 // Changes to the macro require changes in BFrontendAction classes
-#define BPF_F_TABLE(_table_type, _key_type, _leaf_type, _name, _max_entries, _flags) \
+#define BPF_F_TABLE_NUMA(_table_type, _key_type, _leaf_type, _name, _max_entries, _flags, _numa_node) \
 struct _name##_table_t { \
   _key_type key; \
   _leaf_type leaf; \
@@ -111,11 +112,33 @@ struct _name##_table_t { \
   int (*get_stackid) (void *, u64); \
   u32 max_entries; \
   int flags; \
+  int numa_node; \
 }; \
 __attribute__((section("maps/" _table_type))) \
-struct _name##_table_t _name = { .flags = (_flags), .max_entries = (_max_entries) }; \
+struct _name##_table_t _name = { .flags = (_flags), .max_entries = (_max_entries), \
+                                 .numa_node = (_numa_node) }; \
 BPF_ANNOTATE_KV_PAIR(_name, _key_type, _leaf_type)
 
+#define BPF_F_TABLE(_table_type, _key_type, _leaf_type, _name, _max_entries, _flags) \
+  BPF_F_TABLE_NUMA(_table_type, _key_type, _leaf_type, _name, _max_entries, _flags, -1)
+
+
+// Read-only data set from user space before the programs are loaded (see
+// BPFModule::set_rodata). The map is frozen, so the verifier treats the
+// fields read through name.get() as constants.
+// Changes to the macro require changes in BFrontendAction classes
+#define BPF_RODATA(_name, _leaf_type) \
+struct _name##_table_t { \
+  int key; \
+  _leaf_type leaf; \
+  _leaf_type * (*lookup) (int *); \
+  const _leaf_type * (*get) (void); \
+  u32 max_entries; \
+  int flags; \
+}; \
+__attribute__((section("maps/array"))) \
+struct _name##_table_t _name = { .flags = BPF_F_RDONLY_PROG, .max_entries = 1 }; \
+BPF_ANNOTATE_KV_PAIR(_name, int, _leaf_type)
 
 // Changes to the macro require changes in BFrontendAction classes
 #define BPF_QUEUESTACK(_table_type, _name, _leaf_type, _max_entries, _flags) \
@@ -296,6 +319,19 @@ struct _name##_table_t _name = { .max_entries = (_max_entries) }
 #define BPF_ARRAY(...) \
   BPF_ARRAYX(__VA_ARGS__, BPF_ARRAY3, BPF_ARRAY2, BPF_ARRAY1)(__VA_ARGS__)
 
+// Array that userspace can mmap and read without syscalls (kernel >= 5.5)
+#define BPF_MMAP_ARRAY1(_name) \
+  BPF_F_TABLE("array", int, u64, _name, 10240, BPF_F_MMAPABLE)
+#define BPF_MMAP_ARRAY2(_name, _leaf_type) \
+  BPF_F_TABLE("array", int, _leaf_type, _name, 10240, BPF_F_MMAPABLE)
+#define BPF_MMAP_ARRAY3(_name, _leaf_type, _size) \
+  BPF_F_TABLE("array", int, _leaf_type, _name, _size, BPF_F_MMAPABLE)
+
+// Define a mmapable array function, some arguments optional
+// BPF_MMAP_ARRAY(name, leaf_type=u64, size=10240)
+#define BPF_MMAP_ARRAY(...) \
+  BPF_ARRAYX(__VA_ARGS__, BPF_MMAP_ARRAY3, BPF_MMAP_ARRAY2, BPF_MMAP_ARRAY1)(__VA_ARGS__)
+
 #define BPF_PERCPU_ARRAY1(_name)                        \
     BPF_TABLE("percpu_array", int, u64, _name, 10240)
 #define BPF_PERCPU_ARRAY2(_name, _leaf_type) \
@@ -313,6 +349,19 @@ struct _name##_table_t _name = { .max_entries = (_max_entries) }
     __VA_ARGS__, BPF_PERCPU_ARRAY3, BPF_PERCPU_ARRAY2, BPF_PERCPU_ARRAY1) \
            (__VA_ARGS__)
 
+// Packets and bytes of each device queue, per CPU, indexed by
+// skb->queue_mapping:
+//   u32 queue = skb->queue_mapping;
+//   struct bpf_queue_stats *stats = name.lookup(&queue);
+//   if (stats) { stats->packets++; stats->bytes += skb->len; }
+// BPF_QUEUE_STATS(name, num_queues)
+struct bpf_queue_stats {
+  u64 packets;
+  u64 bytes;
+};
+#define BPF_QUEUE_STATS(_name, _num_queues) \
+  BPF_PERCPU_ARRAY(_name, struct bpf_queue_stats, _num_queues)
+
 #define BPF_HIST1(_name) \
   BPF_TABLE("histogram", int, u64, _name, 64)
 #define BPF_HIST2(_name, _key_type) \
@@ -355,6 +404,40 @@ struct bpf_stacktrace_buildid {
 #define BPF_STACK_TRACE_BUILDID(_name, _max_entries) \
   BPF_F_TABLE("stacktrace", int, struct bpf_stacktrace_buildid, _name, roundup_pow_of_two(_max_entries), BPF_F_STACK_BUILD_ID)
 
+/* A stack record of a BPF_STACK_RINGBUF: kernel_nr kernel frames, then
+ * user_nr user frames of pid. Only the header and those frames are
+ * submitted; ip is sized for the verifier to bound the user stack written
+ * after a kernel stack of up to 1023 bytes. */
+struct bpf_stack_record {
+  u64 tag;
+  u32 pid;
+  u16 kernel_nr;
+  u16 user_nr;
+  u64 ip[2 * (BPF_MAX_STACK_DEPTH + 1)];
+};
+
+#define BPF_STACK_RECORD_KERNEL 1
+#define BPF_STACK_RECORD_USER   2
+
+/* Stacks of variable depth in a ring buffer, as an alternative to the stack
+ * ids of a BPF_STACK_TRACE: no stack is lost to a full stack map or to a
+ * hash collision, and each record only takes the frames it has.
+ *   stacks.record_stack(ctx, tag, BPF_STACK_RECORD_KERNEL | BPF_STACK_RECORD_USER)
+ * submits a record with the stacks asked for and returns 0 or a negative
+ * error. User space gives each distinct stack an id when reading the
+ * records. The record is built in the per-CPU _name##_stack_buf. */
+#define BPF_STACK_RINGBUF(_name, _num_pages) \
+BPF_PERCPU_ARRAY(_name##_stack_buf, struct bpf_stack_record, 1); \
+struct _name##_table_t { \
+  int key; \
+  u32 leaf; \
+  /* map.record_stack(ctx, tag, which) */ \
+  int (*record_stack) (void *, u64, u64); \
+  u32 max_entries; \
+}; \
+__attribute__((section("maps/ringbuf"))) \
+struct _name##_table_t _name = { .max_entries = ((_num_pages) * PAGE_SIZE) }
+
 #define BPF_PROG_ARRAY(_name, _max_entries) \
   BPF_TABLE("prog", u32, u32, _name, _max_entries)
 
@@ -390,6 +473,34 @@ struct _name##_table_t _name = { .max_entries = (_max_entries) }
 #define BPF_ARRAY_OF_MAPS(_name, _inner_map_name, _max_entries) \
   BPF_TABLE("array_of_maps$" _inner_map_name, int, int, _name, _max_entries)
 
+/* One copy of the map _inner_map_name per NUMA node, each allocated on its
+ * node, for programs on every node to update a local copy:
+ *   u32 node = bpf_get_numa_node_id();
+ *   void *counts = counts_nodes.lookup(&node);
+ *   if (counts) { u64 *val = bpf_map_lookup_elem(counts, &key); ... }
+ * The copies are created with the maps, at the index of their node, on up to
+ * _max_nodes nodes. User space reads them merged with
+ * BPF::get_numa_replicas_offline(). */
+#define BPF_NUMA_REPLICAS_NODE -2
+#define BPF_NUMA_REPLICAS(_name, _inner_map_name, _max_nodes) \
+  BPF_F_TABLE_NUMA("array_of_maps$" _inner_map_name, int, int, _name, _max_nodes, 0, \
+                   BPF_NUMA_REPLICAS_NODE)
+
+/* Two buffers with the layout of the map _inner_map_name, which is the first
+ * of them, for counters read in exact intervals. Programs update the active
+ * buffer, at index 0:
+ *   int active = 0;
+ *   void *counts = counts_epochs.lookup(&active);
+ *   if (counts) { u64 *val = bpf_map_lookup_elem(counts, &key); ... }
+ * User space swaps the buffers with BPF::flip_epoch() or
+ * MapInMapArray.flip_epoch() and reads the one that was active, which no
+ * program updates anymore, with no need to race the writers. Programs should
+ * not use _inner_map_name directly. */
+#define BPF_EPOCH_BUFFERS_NODE -3
+#define BPF_EPOCH_BUFFERS(_name, _inner_map_name) \
+  BPF_F_TABLE_NUMA("array_of_maps$" _inner_map_name, int, int, _name, 2, 0, \
+                   BPF_EPOCH_BUFFERS_NODE)
+
 #define BPF_HASH_OF_MAPS2(_name, _inner_map_name) \
   BPF_TABLE("hash_of_maps$" _inner_map_name, int, int, _name, 10240)
 #define BPF_HASH_OF_MAPS3(_name, _key_type, _inner_map_name) \
@@ -414,6 +525,18 @@ __attribute__((section("maps/sk_storage"))) \
 struct _name##_table_t _name = { .flags = BPF_F_NO_PREALLOC }; \
 BPF_ANNOTATE_KV_PAIR(_name, int, _leaf_type)
 
+#define BPF_TASK_STORAGE(_name, _leaf_type) \
+struct _name##_table_t { \
+  int key; \
+  _leaf_type leaf; \
+  void * (*task_storage_get) (void *, void *, int); \
+  int (*task_storage_delete) (void *); \
+  u32 flags; \
+}; \
+__attribute__((section("maps/task_storage"))) \
+struct _name##_table_t _name = { .flags = BPF_F_NO_PREALLOC }; \
+BPF_ANNOTATE_KV_PAIR(_name, int, _leaf_type)
+
 #define BPF_SOCKMAP_COMMON(_name, _max_entries, _kind, _helper_name) \
 struct _name##_table_t { \
   u32 key; \
@@ -1045,6 +1168,253 @@ unsigned int bpf_log2l(unsigned long v)
     return bpf_log2(v) + 1;
 }
 
+// Log-linear (HDR style) histogram slots: every power of two range is split
+// in 2^sub_bits linear slots, so a slot is at most 1/2^sub_bits of the
+// values it holds wide (3% with 5 sub bits), values below 2^sub_bits having
+// one slot each. BPF_LOG_LINEAR_SLOTS(sub_bits) slots hold any u64:
+//   BPF_HISTOGRAM(dist, int, BPF_LOG_LINEAR_SLOTS(5));
+//   dist.increment(bpf_log_linear_slot(delta, 5));
+// Decoded by print_log_linear_hist() in Python and
+// BPFHistogram::log_linear_bounds() in C++.
+#define BPF_LOG_LINEAR_SLOTS(_sub_bits) ((65 - (_sub_bits)) << (_sub_bits))
+
+static inline __attribute__((always_inline))
+unsigned int bpf_log_linear_slot(u64 v, unsigned int sub_bits)
+{
+  if (v < (1ull << sub_bits))
+    return v;
+  // v >= 2^sub_bits, so its log2 is at least sub_bits
+  unsigned int shift = bpf_log2l(v) - 1 - sub_bits;
+  return ((shift + 1) << sub_bits) + (v >> shift) - (1u << sub_bits);
+}
+
+// Token bucket of each CPU, letting through on average rate events per
+// second with bursts of up to burst events, and counting the others:
+//   BPF_RATE_LIMIT(limit);
+//   int zero = 0;
+//   struct bpf_rate_limit *rl = limit.lookup(&zero);
+//   if (!rl || !bpf_rate_limit_allow(rl, 1000, 100))
+//     return 0;
+//   events.perf_submit(ctx, &data, sizeof(data));
+// BPF_RATE_LIMIT(name)
+struct bpf_rate_limit {
+  u64 tokens;      // in 1/1000000000 events
+  u64 last_ns;
+  u64 passed;
+  u64 suppressed;
+};
+#define BPF_RATE_LIMIT(_name) \
+  BPF_PERCPU_ARRAY(_name, struct bpf_rate_limit, 1)
+
+static inline __attribute__((always_inline))
+int bpf_rate_limit_allow(struct bpf_rate_limit *rl, u64 rate, u64 burst)
+{
+  u64 now = bpf_ktime_get_ns();
+  u64 cap = burst * 1000000000ull;
+
+  if (!rate)
+    return 0;
+  // Refill since the last event, the elapsed time being capped so that the
+  // product can't overflow
+  u64 elapsed = now - rl->last_ns;
+  if (elapsed > cap / rate)
+    elapsed = cap / rate;
+  rl->last_ns = now;
+  rl->tokens += elapsed * rate;
+  if (rl->tokens > cap)
+    rl->tokens = cap;
+  if (rl->tokens < 1000000000ull) {
+    rl->suppressed++;
+    return 0;
+  }
+  rl->tokens -= 1000000000ull;
+  rl->passed++;
+  return 1;
+}
+
+// Deterministic 1 in n sampling of each CPU: the first event and every nth
+// one after it pass, the others are counted:
+//   BPF_SAMPLER(sampler);
+//   int zero = 0;
+//   struct bpf_sampler *s = sampler.lookup(&zero);
+//   if (!s || !bpf_sample_one_in(s, 10))
+//     return 0;
+// BPF_SAMPLER(name)
+struct bpf_sampler {
+  u64 seen;
+  u64 suppressed;
+};
+#define BPF_SAMPLER(_name) \
+  BPF_PERCPU_ARRAY(_name, struct bpf_sampler, 1)
+
+static inline __attribute__((always_inline))
+int bpf_sample_one_in(struct bpf_sampler *s, u64 n)
+{
+  if (n > 1 && s->seen++ % n) {
+    s->suppressed++;
+    return 0;
+  }
+  return 1;
+}
+
+// 64-bit hash of size bytes, a constant for the loop to be unrolled
+static inline __attribute__((always_inline))
+u64 bpf_hash_bytes(const void *key, u32 size)
+{
+  const unsigned char *p = key;
+  u64 h = 14695981039346656037ull;  // FNV-1a
+
+#pragma unroll
+  for (u32 i = 0; i < size; i++) {
+    h ^= p[i];
+    h *= 1099511628211ull;
+  }
+  // FNV leaves the low bits poorly mixed, finish with the murmur3 finalizer
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+// The keys counted the most, in bounded memory whatever the number of keys.
+// A count-min sketch of BPF_HEAVY_HITTERS_DEPTH rows of width counters (a
+// power of two) estimates the count of any key, never below the real one and
+// with high probability at most e / width of the total above it, and the k
+// keys with the largest estimates are kept as candidates. Both are per CPU,
+// the readers summing the sketches of all CPUs and estimating the
+// candidates of every CPU with the sum (heavy_hitters() in Python,
+// BPFHeavyHitters in C++):
+//   BPF_HEAVY_HITTERS(top, struct key_t, 32, 256);
+//   int zero = 0;
+//   struct top_hh *hh = top.lookup(&zero);
+//   if (hh)
+//     bpf_heavy_hitters_add(hh, &key, 1);
+// Keys are hashed with their padding, so zero them before filling them in.
+// The whole per-CPU value must stay below 32KB, a width of 512 at most.
+// BPF_HEAVY_HITTERS(name, key_type, k, width)
+#define BPF_HEAVY_HITTERS_DEPTH 4
+struct bpf_heavy_hitter {
+  u64 hash;
+  u64 count;  // 0 for an unused slot
+};
+#define BPF_HEAVY_HITTERS(_name, _key_type, _k, _width) \
+  struct _name##_hh_slot { \
+    struct bpf_heavy_hitter hdr; \
+    _key_type key; \
+  }; \
+  struct _name##_hh { \
+    u64 total; \
+    u64 counts[BPF_HEAVY_HITTERS_DEPTH * (_width)]; \
+    struct _name##_hh_slot top[_k]; \
+  }; \
+  BPF_PERCPU_ARRAY(_name, struct _name##_hh, 1)
+
+static inline __attribute__((always_inline))
+u64 __bpf_heavy_hitters_add(u64 *total, u64 *counts, u32 width, void *top,
+                            u32 k, u32 slot_size, const void *key,
+                            u32 key_size, u64 inc)
+{
+  u64 h = bpf_hash_bytes(key, key_size);
+  u64 est = ~0ull;
+
+  *total += inc;
+  // each row picks its counter with its own 16 bits of the hash
+#pragma unroll
+  for (u32 i = 0; i < BPF_HEAVY_HITTERS_DEPTH; i++) {
+    u64 *c = counts + i * width + ((h >> (i * 16)) & (width - 1));
+    *c += inc;
+    if (*c < est)
+      est = *c;
+  }
+
+  struct bpf_heavy_hitter *min = top;
+#pragma unroll
+  for (u32 i = 0; i < k; i++) {
+    struct bpf_heavy_hitter *s = (void *)((char *)top + i * slot_size);
+    if (s->count && s->hash == h) {
+      s->count = est;
+      return est;
+    }
+    if (s->count < min->count)
+      min = s;
+  }
+  if (est > min->count) {
+    min->hash = h;
+    min->count = est;
+    __builtin_memcpy(min + 1, key, key_size);
+  }
+  return est;
+}
+
+// Count inc more for *key, returning the estimated count of this CPU
+#define bpf_heavy_hitters_add(_hh, _key, _inc) \
+  __bpf_heavy_hitters_add(&(_hh)->total, (_hh)->counts, \
+                          sizeof((_hh)->counts) / sizeof(u64) / \
+                              BPF_HEAVY_HITTERS_DEPTH, \
+                          (_hh)->top, \
+                          sizeof((_hh)->top) / sizeof((_hh)->top[0]), \
+                          sizeof((_hh)->top[0]), (_key), sizeof(*(_key)), \
+                          (_inc))
+
+// Suppresses the repeats of an event within window_ns of the last time it
+// was let through, counting them for the next one let through to report.
+// Events are told apart by a hash of what makes them the same, in an LRU
+// hash shared by all CPUs, so that max_entries bounds the memory whatever
+// the number of distinct events:
+//   BPF_DEDUP(dedup, 10240);
+//   struct bpf_dedup zero = {};
+//   u64 h = bpf_hash_bytes(&key, sizeof(key));
+//   struct bpf_dedup *d = dedup.lookup_or_try_init(&h, &zero);
+//   if (d && !bpf_dedup_allow(d, 1000000000, &data.repeats))
+//     return 0;
+//   events.perf_submit(ctx, &data, sizeof(data));
+// BPF_DEDUP(name, max_entries)
+struct bpf_dedup {
+  u64 last_ns;
+  u64 repeats;
+};
+#define BPF_DEDUP(_name, _max_entries) \
+  BPF_TABLE("lru_hash", u64, struct bpf_dedup, _name, _max_entries)
+
+static inline __attribute__((always_inline))
+int bpf_dedup_allow(struct bpf_dedup *d, u64 window_ns, u64 *repeats)
+{
+  u64 now = bpf_ktime_get_ns();
+
+  if (d->last_ns && now - d->last_ns < window_ns) {
+    __sync_fetch_and_add(&d->repeats, 1);
+    return 0;
+  }
+  d->last_ns = now;
+  // other CPUs may be adding repeats meanwhile, keep theirs
+  *repeats = d->repeats;
+  __sync_fetch_and_add(&d->repeats, -*repeats);
+  return 1;
+}
+
+// Sets of processes, threads, cgroups and command names to trace, which
+// userspace fills and changes at runtime, without recompiling the program.
+// name_conf holds the BPF_TASK_FILTER_* flags of the sets in use, a task
+// being traced when it is in all of them. The check itself is the
+// task_should_be_filtered() function of bcc.filters.task_filter_text() and
+// ebpf::BPFTaskFilter::program().
+// BPF_TASK_FILTER(name, max_entries)
+#define BPF_TASK_FILTER_PID    (1 << 0)
+#define BPF_TASK_FILTER_TID    (1 << 1)
+#define BPF_TASK_FILTER_CGROUP (1 << 2)
+#define BPF_TASK_FILTER_COMM   (1 << 3)
+struct bpf_task_filter_comm {
+  char comm[16];
+};
+#define BPF_TASK_FILTER(_name, _max_entries) \
+  BPF_ARRAY(_name##_conf, u32, 1); \
+  BPF_HASH(_name##_pids, u32, u8, _max_entries); \
+  BPF_HASH(_name##_tids, u32, u8, _max_entries); \
+  BPF_HASH(_name##_cgroups, u64, u8, _max_entries); \
+  BPF_HASH(_name##_comms, struct bpf_task_filter_comm, u8, _max_entries)
+
 struct bpf_context;
 
 static inline __attribute__((always_inline))
@@ -1131,6 +1501,38 @@ int bpf_map_delete_elem_(uintptr_t map, void *key) {
   return bpf_map_delete_elem((void *)map, key);
 }
 
+static inline __attribute__((always_inline))
+BCC_SEC_HELPERS
+int bcc_record_stack(uintptr_t ringbuf, uintptr_t buf, void *ctx, u64 tag,
+                     u64 which) {
+  u32 zero = 0;
+  long kbytes = 0, ubytes = 0;
+  struct bpf_stack_record *rec = bpf_map_lookup_elem_(buf, &zero);
+
+  if (!rec)
+    return -1;
+  rec->tag = tag;
+  rec->pid = bpf_get_current_pid_tgid() >> 32;
+  if (which & BPF_STACK_RECORD_KERNEL) {
+    kbytes = bpf_get_stack(ctx, rec->ip, BPF_MAX_STACK_DEPTH * sizeof(u64), 0);
+    if (kbytes < 0)
+      kbytes = 0;
+    kbytes &= 1023;
+  }
+  if (which & BPF_STACK_RECORD_USER) {
+    ubytes = bpf_get_stack(ctx, (void *)rec->ip + kbytes,
+                           BPF_MAX_STACK_DEPTH * sizeof(u64), BPF_F_USER_STACK);
+    if (ubytes < 0)
+      ubytes = 0;
+    ubytes &= 1023;
+  }
+  rec->kernel_nr = kbytes / sizeof(u64);
+  rec->user_nr = ubytes / sizeof(u64);
+  return bpf_ringbuf_output((void *)ringbuf, rec,
+                            __builtin_offsetof(struct bpf_stack_record, ip) +
+                            kbytes + ubytes, 0);
+}
+
 static inline __attribute__((always_inline))
 BCC_SEC_HELPERS
 int bpf_l3_csum_replace_(void *ctx, u64 off, u64 from, u64 to, u64 flags) {
@@ -1171,6 +1573,80 @@ struct pt_regs;
 int bpf_usdt_readarg(int argc, struct pt_regs *ctx, void *arg) asm("llvm.bpf.extra");
 int bpf_usdt_readarg_p(int argc, struct pt_regs *ctx, void *buf, u64 len) asm("llvm.bpf.extra");
 
+// Where the arguments of a USDT probe location are, for the probes whose
+// arguments are read through the BPF cookie of their uprobes
+// (USDT::set_cookie_args() in C++): the cookie is the slot of the spec of
+// the location in __bcc_usdt_specs. Keep in sync with USDT::ArgSpec.
+#define BCC_USDT_ARG_CONST 0       // val_off
+#define BCC_USDT_ARG_REG 1         // the register at reg_off in pt_regs
+#define BCC_USDT_ARG_REG_DEREF 2   // at the register plus val_off, plus the
+                                   // index register times scale if any
+#define BCC_USDT_ARG_ADDR_DEREF 3  // at address val_off
+#define BCC_USDT_MAX_ARGS 12
+#ifndef BCC_USDT_MAX_SPECS
+#define BCC_USDT_MAX_SPECS 256
+#endif
+struct bcc_usdt_arg_spec {
+  u64 val_off;
+  u16 reg_off;
+  u16 idx_reg_off;
+  u8 kind;
+  u8 scale;
+  u8 bitshift;  // 64 - 8 * size
+  u8 is_signed;
+};
+struct bcc_usdt_spec {
+  struct bcc_usdt_arg_spec args[BCC_USDT_MAX_ARGS];
+};
+
+static inline __attribute__((always_inline))
+int bcc_usdt_arg(struct pt_regs *ctx, const struct bcc_usdt_arg_spec *spec,
+                 u64 *res)
+{
+  u64 val = 0, idx = 0;
+
+  switch (spec->kind) {
+  case BCC_USDT_ARG_CONST:
+    *res = spec->val_off;
+    return 0;
+  case BCC_USDT_ARG_REG:
+    if (bpf_probe_read_kernel(&val, sizeof(val), (void *)ctx + spec->reg_off))
+      return -1;
+    break;
+  case BCC_USDT_ARG_REG_DEREF:
+    if (bpf_probe_read_kernel(&val, sizeof(val), (void *)ctx + spec->reg_off))
+      return -1;
+    if (spec->scale) {
+      if (bpf_probe_read_kernel(&idx, sizeof(idx),
+                                (void *)ctx + spec->idx_reg_off))
+        return -1;
+      val += idx * spec->scale;
+    }
+    val += spec->val_off;
+    // fallthrough
+  case BCC_USDT_ARG_ADDR_DEREF:
+    if (spec->kind == BCC_USDT_ARG_ADDR_DEREF)
+      val = spec->val_off;
+    if (bpf_probe_read_user(&val, sizeof(val), (void *)val))
+      return -1;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    // the argument is in the top bytes already
+    val >>= spec->bitshift;
+#endif
+    break;
+  default:
+    return -1;
+  }
+  // keep the low size bytes, sign extended
+  val <<= spec->bitshift;
+  if (spec->is_signed)
+    val = (u64)((s64)val >> spec->bitshift);
+  else
+    val >>= spec->bitshift;
+  *res = val;
+  return 0;
+}
+
 /* Scan the ARCH passed in from ARCH env variable (see kbuild_helper.cc) */
 #if defined(__TARGET_ARCH_x86)
 #define bpf_target_x86
@@ -1287,8 +1763,237 @@ int bpf_usdt_readarg_p(int argc, struct pt_regs *ctx, void *buf, u64 len) asm("l
 #define PT_REGS_PARM6_SYSCALL(ctx)	PT_REGS_PARM6(ctx)
 #endif
 
+/* Argument n of a kprobe handler, in register reg of its context. The copies
+ * of the handlers compiled with -DBCC_KPROBE_AS_KFUNC, to be attached as
+ * fentry and fexit programs, redefine it and PT_REGS_RC() for the context of
+ * those. Their PT_REGS_RC() needs Linux 5.17, and the handlers are attached
+ * as kretprobes where their copy can't be loaded. */
+#define BCC_CTX_ARG(ctx, n, reg) ((ctx)->reg)
+
+static inline __attribute__((always_inline))
+u64 bcc_kfunc_ret(void *ctx) {
+  u64 ret = 0;
+  bpf_get_func_ret(ctx, &ret);
+  return ret;
+}
+
 #define lock_xadd(ptr, val) ((void)__sync_fetch_and_add(ptr, val))
 
+/* Packet samples from XDP programs, for a BPF_RINGBUF_OUTPUT:
+ *   if (bpf_xdp_sample_hit(RATE)) {
+ *     struct xdp_sample *s = samples.ringbuf_reserve(sizeof(*s));
+ *     if (s) {
+ *       bpf_xdp_sample_fill(ctx, s);
+ *       samples.ringbuf_submit(s, 0);
+ *     }
+ *   }
+ */
+#ifndef XDP_SAMPLE_SNAPLEN
+#define XDP_SAMPLE_SNAPLEN 128
+#endif
+
+struct xdp_sample {
+  u64 ts;
+  u32 ifindex;
+  u32 rx_queue;
+  u32 pkt_len;
+  u32 cap_len;
+  u8 data[XDP_SAMPLE_SNAPLEN];
+};
+
+/* true for one call in rate on average */
+static inline __attribute__((always_inline))
+BCC_SEC_HELPERS
+int bpf_xdp_sample_hit(u32 rate) {
+  return rate <= 1 || bpf_get_prandom_u32() % rate == 0;
+}
+
+static inline __attribute__((always_inline))
+BCC_SEC_HELPERS
+void bpf_xdp_sample_fill(struct xdp_md *ctx, struct xdp_sample *s) {
+  u8 *data = (u8 *)(long)ctx->data;
+  u8 *data_end = (u8 *)(long)ctx->data_end;
+  u32 i;
+
+  s->ts = bpf_ktime_get_ns();
+  s->ifindex = ctx->ingress_ifindex;
+  s->rx_queue = ctx->rx_queue_index;
+  s->pkt_len = data_end - data;
+  /* byte by byte, to bound every packet access for the verifier */
+#pragma unroll
+  for (i = 0; i < XDP_SAMPLE_SNAPLEN; i++) {
+    if (data + i + 1 > data_end)
+      break;
+    s->data[i] = data[i];
+  }
+  s->cap_len = i;
+}
+
+static inline __attribute__((always_inline))
+BCC_SEC_HELPERS
+u32 bpf_flow_hash_mix(u32 h, u32 v) {
+  v *= 0xcc9e2d51;
+  v = (v << 15) | (v >> 17);
+  h ^= v * 0x1b873593;
+  h = (h << 13) | (h >> 19);
+  return h * 5 + 0xe6546b64;
+}
+
+/* Hash of the addresses, protocol and ports of an untagged IPv4 or IPv6
+ * packet, or of its ethernet addresses otherwise, to spread flows e.g. over
+ * the CPUs of a BPF_CPUMAP */
+static inline __attribute__((always_inline))
+BCC_SEC_HELPERS
+u32 bpf_xdp_flow_hash(struct xdp_md *ctx) {
+  u8 *data = (u8 *)(long)ctx->data;
+  u8 *data_end = (u8 *)(long)ctx->data_end;
+  u32 h = 0, *w;
+  u8 *l4 = 0;
+  u8 proto = 0;
+  int i;
+
+  if (data + 14 > data_end)
+    return 0;
+  if (*(u16 *)(data + 12) == bpf_htons(0x0800)) {
+    if (data + 34 > data_end)
+      return 0;
+    proto = data[23];
+    w = (u32 *)(data + 26);
+    h = bpf_flow_hash_mix(h, w[0]);
+    h = bpf_flow_hash_mix(h, w[1]);
+    /* no ports in fragments but the first */
+    if (!(*(u16 *)(data + 20) & bpf_htons(0x1fff)))
+      l4 = data + 14 + (data[14] & 0xf) * 4;
+  } else if (*(u16 *)(data + 12) == bpf_htons(0x86DD)) {
+    if (data + 54 > data_end)
+      return 0;
+    proto = data[20];
+    w = (u32 *)(data + 22);
+#pragma unroll
+    for (i = 0; i < 8; i++)
+      h = bpf_flow_hash_mix(h, w[i]);
+    l4 = data + 54;
+  } else {
+    w = (u32 *)data;
+    h = bpf_flow_hash_mix(h, w[0]);
+    h = bpf_flow_hash_mix(h, w[1]);
+    h = bpf_flow_hash_mix(h, w[2]);
+  }
+  h = bpf_flow_hash_mix(h, proto);
+  if (l4 && (proto == 6 || proto == 17 || proto == 132) && l4 + 4 <= data_end)
+    h = bpf_flow_hash_mix(h, *(u32 *)l4);
+
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  return h ^ (h >> 16);
+}
+
+/* User stack snapshots, for bcc_symcache_unwind() to unwind user code built
+ * without frame pointers with the .eh_frame of its binaries. From a perf
+ * event or uprobe, with user space registers, to a BPF_RINGBUF_OUTPUT:
+ *   struct user_stack *s = stacks.ringbuf_reserve(sizeof(*s));
+ *   if (s) {
+ *     bpf_user_stack_fill(&ctx->regs, s);
+ *     stacks.ringbuf_submit(s, 0);
+ *   }
+ * Frames deeper than USER_STACK_SNAPLEN bytes are lost. x86_64 only.
+ */
+#ifndef USER_STACK_SNAPLEN
+#define USER_STACK_SNAPLEN 8192
+#endif
+
+struct user_stack {
+  u32 pid;
+  u32 tid;
+  u64 ip;
+  u64 sp;
+  u64 bp;
+  u32 size;
+  u32 pad;
+  u8 data[USER_STACK_SNAPLEN];
+};
+
+#if defined(bpf_target_x86)
+static inline __attribute__((always_inline))
+BCC_SEC_HELPERS
+int bpf_user_stack_fill(struct pt_regs *regs, struct user_stack *s) {
+  u64 id = bpf_get_current_pid_tgid();
+  u32 size = USER_STACK_SNAPLEN;
+  int i;
+
+  s->pid = id >> 32;
+  s->tid = id;
+  s->ip = PT_REGS_IP(regs);
+  s->sp = PT_REGS_SP(regs);
+  s->bp = PT_REGS_FP(regs);
+  /* the stack may end closer to sp than the snapshot size */
+#pragma unroll
+  for (i = 0; i < 4; i++) {
+    if (bpf_probe_read_user(s->data, size, (void *)s->sp) == 0) {
+      s->size = size;
+      return 0;
+    }
+    size /= 2;
+  }
+  s->size = 0;
+  return -1;
+}
+#endif
+
+/* Connection of a TCP socket, to key a BPF_SOCKHASH with, ports in host
+ * order. The peer of a local connection, e.g. between a proxy and an
+ * application, has the same key with local and remote swapped. */
+struct sock_tuple_key {
+  u32 family;
+  u32 local_ip[4];
+  u32 remote_ip[4];
+  u32 local_port;
+  u32 remote_port;
+};
+
+#define __BPF_SOCK_TUPLE(_k, _ctx, _local, _remote)                  \
+  do {                                                                \
+    __builtin_memset(_k, 0, sizeof(*(_k)));                           \
+    (_k)->family = (_ctx)->family;                                    \
+    if ((_ctx)->family == 2 /* AF_INET */) {                          \
+      (_k)->_local##_ip[0] = (_ctx)->local_ip4;                       \
+      (_k)->_remote##_ip[0] = (_ctx)->remote_ip4;                     \
+    } else {                                                          \
+      (_k)->_local##_ip[0] = (_ctx)->local_ip6[0];                    \
+      (_k)->_local##_ip[1] = (_ctx)->local_ip6[1];                    \
+      (_k)->_local##_ip[2] = (_ctx)->local_ip6[2];                    \
+      (_k)->_local##_ip[3] = (_ctx)->local_ip6[3];                    \
+      (_k)->_remote##_ip[0] = (_ctx)->remote_ip6[0];                  \
+      (_k)->_remote##_ip[1] = (_ctx)->remote_ip6[1];                  \
+      (_k)->_remote##_ip[2] = (_ctx)->remote_ip6[2];                  \
+      (_k)->_remote##_ip[3] = (_ctx)->remote_ip6[3];                  \
+    }                                                                 \
+    (_k)->_local##_port = (_ctx)->local_port;                         \
+    (_k)->_remote##_port = bpf_ntohl((_ctx)->remote_port);            \
+  } while (0)
+
+/* key of the socket itself, e.g. to add it from a sock_ops program */
+static inline __attribute__((always_inline))
+BCC_SEC_HELPERS
+void bpf_sock_ops_tuple(struct bpf_sock_ops *skops, struct sock_tuple_key *k) {
+  __BPF_SOCK_TUPLE(k, skops, local, remote);
+}
+
+/* key of the other end of the connection, to redirect the message to */
+static inline __attribute__((always_inline))
+BCC_SEC_HELPERS
+void bpf_sk_msg_peer_tuple(struct sk_msg_md *msg, struct sock_tuple_key *k) {
+  __BPF_SOCK_TUPLE(k, msg, remote, local);
+}
+
+static inline __attribute__((always_inline))
+BCC_SEC_HELPERS
+void bpf_sk_skb_peer_tuple(struct __sk_buff *skb, struct sock_tuple_key *k) {
+  __BPF_SOCK_TUPLE(k, skb, remote, local);
+}
+
 #define TRACEPOINT_PROBE(category, event) \
 int tracepoint__##category##__##event(struct tracepoint__##category##__##event *args)
 
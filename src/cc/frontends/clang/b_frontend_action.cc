@@ -26,6 +26,7 @@
 #include <clang/Frontend/MultiplexConsumer.h>
 #include <clang/Rewrite/Core/Rewriter.h>
 #include <clang/Lex/Lexer.h>
+#include <clang/Lex/Preprocessor.h>
 
 #include "frontend_action_common.h"
 #include "b_frontend_action.h"
@@ -37,6 +38,7 @@
 #include "bcc_libbpf_inc.h"
 
 #include "libbpf.h"
+#include "bcc_features.h"
 #include "bcc_syms.h"
 
 namespace ebpf {
@@ -95,8 +97,8 @@ const char **get_call_conv(bool for_syscall = false) {
   return ret;
 }
 
-/* Use resolver only once per translation */
-static void *kresolver = NULL;
+/* Use resolver only once per translation, translations may run in parallel */
+static thread_local void *kresolver = NULL;
 static void *get_symbol_resolver(void) {
   if (!kresolver)
     kresolver = bcc_symcache_new(-1, nullptr);
@@ -118,6 +120,20 @@ static std::string check_bpf_probe_read_kernel(void) {
     return "bpf_probe_read";
 }
 
+static bool has_bpf_get_current_task_btf(void) {
+  void *resolver = get_symbol_resolver();
+  uint64_t addr = 0;
+  return bcc_symcache_resolve_name(resolver, nullptr,
+                                   "bpf_get_current_task_btf", &addr) >= 0;
+}
+
+static bool has_bpf_ringbuf(void) {
+  void *resolver = get_symbol_resolver();
+  uint64_t addr = 0;
+  return bcc_symcache_resolve_name(resolver, nullptr,
+                                   "bpf_ringbuf_output", &addr) >= 0;
+}
+
 static std::string check_bpf_probe_read_user(llvm::StringRef probe,
         bool& overlap_addr) {
   if (probe.str() == "bpf_probe_read_user" ||
@@ -159,9 +175,11 @@ using namespace clang;
 class ProbeChecker : public RecursiveASTVisitor<ProbeChecker> {
  public:
   explicit ProbeChecker(Expr *arg, const set<tuple<Decl *, int>> &ptregs,
-                        bool track_helpers, bool is_assign)
+                        bool track_helpers, bool is_assign,
+                        const set<const Stmt *> *btf_calls = nullptr)
       : needs_probe_(false), is_transitive_(false), ptregs_(ptregs),
-        track_helpers_(track_helpers), nb_derefs_(0), is_assign_(is_assign) {
+        track_helpers_(track_helpers), nb_derefs_(0), is_assign_(is_assign),
+        btf_calls_(btf_calls) {
     if (arg) {
       TraverseStmt(arg);
       if (arg->getType()->isPointerType())
@@ -196,8 +214,11 @@ class ProbeChecker : public RecursiveASTVisitor<ProbeChecker> {
 
     if (!track_helpers_)
       return false;
+    // Calls rewritten to bpf_get_current_task_btf() return a BTF pointer the
+    // program can load from directly.
     if (VarDecl *V = dyn_cast<VarDecl>(E->getCalleeDecl()))
-      needs_probe_ = V->getName() == "bpf_get_current_task";
+      needs_probe_ = V->getName() == "bpf_get_current_task" &&
+                     !(btf_calls_ && btf_calls_->count(E));
     return false;
   }
   bool VisitMemberExpr(MemberExpr *M) {
@@ -213,7 +234,8 @@ class ProbeChecker : public RecursiveASTVisitor<ProbeChecker> {
        * indirections; &A->b is a pointer to A with an offset. */
       if (nb_derefs_ >= 0) {
         ProbeChecker checker = ProbeChecker(M->getBase(), ptregs_,
-                                            track_helpers_, is_assign_);
+                                            track_helpers_, is_assign_,
+                                            btf_calls_);
         if (checker.needs_probe() && checker.get_nb_derefs() == 0) {
           needs_probe_ = true;
           return false;
@@ -228,7 +250,8 @@ class ProbeChecker : public RecursiveASTVisitor<ProbeChecker> {
       /* In *A, if A is an external pointer, then *A should be considered one
        * too. */
       ProbeChecker checker = ProbeChecker(E->getSubExpr(), ptregs_,
-                                          track_helpers_, is_assign_);
+                                          track_helpers_, is_assign_,
+                                          btf_calls_);
       if (checker.needs_probe() && checker.get_nb_derefs() == 0) {
         needs_probe_ = true;
         return false;
@@ -273,6 +296,7 @@ class ProbeChecker : public RecursiveASTVisitor<ProbeChecker> {
   // A negative number counts the number of addrof.
   int nb_derefs_;
   bool is_assign_;
+  const set<const Stmt *> *btf_calls_;
 };
 
 // Visit a piece of the AST and mark it as needing probe reads
@@ -303,6 +327,83 @@ class ProbeSetter : public RecursiveASTVisitor<ProbeSetter> {
   int nb_derefs_;
 };
 
+// Find the (T *)bpf_get_current_task() casts of a BTF-typed program, whose
+// result can be a BTF pointer instead of a plain integer
+class BTFTaskVisitor : public RecursiveASTVisitor<BTFTaskVisitor> {
+ public:
+  explicit BTFTaskVisitor(vector<CallExpr *> &calls) : calls_(calls) {}
+  bool VisitCStyleCastExpr(CStyleCastExpr *E) {
+    if (!E->getType()->isPointerType())
+      return true;
+    CallExpr *Call = dyn_cast<CallExpr>(E->getSubExpr()->IgnoreParenImpCasts());
+    if (!Call || Call->getNumArgs() != 0 || GET_BEGINLOC(Call).isMacroID())
+      return true;
+    if (VarDecl *V = dyn_cast_or_null<VarDecl>(Call->getCalleeDecl()))
+      if (V->getName() == "bpf_get_current_task")
+        calls_.push_back(Call);
+    return true;
+  }
+ private:
+  vector<CallExpr *> &calls_;
+};
+
+// Check whether a local variable is ever written, or has its address taken
+// for anything other than the key of a map lookup
+class KeyWriteChecker : public RecursiveASTVisitor<KeyWriteChecker> {
+ public:
+  explicit KeyWriteChecker(VarDecl *V) : V_(V), written_(false) {}
+  bool VisitCallExpr(CallExpr *Call) {
+    if (MemberExpr *Memb = dyn_cast<MemberExpr>(Call->getCallee()->IgnoreImplicit()))
+      if (Memb->getMemberDecl()->getName() == "lookup" && Call->getNumArgs() == 1)
+        lookup_keys_.insert(Call->getArg(0)->IgnoreParenImpCasts());
+    return true;
+  }
+  bool VisitUnaryOperator(UnaryOperator *E) {
+    if (!refersToVar(E->getSubExpr()))
+      return true;
+    if (E->getOpcode() == UO_AddrOf)
+      written_ |= !lookup_keys_.count(E);
+    else
+      written_ |= E->isIncrementDecrementOp();
+    return !written_;
+  }
+  bool VisitBinaryOperator(BinaryOperator *E) {
+    if (E->isAssignmentOp() && refersToVar(E->getLHS()))
+      written_ = true;
+    return !written_;
+  }
+  bool written() const { return written_; }
+ private:
+  bool refersToVar(Expr *E) {
+    DeclRefExpr *Ref = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts());
+    return Ref && Ref->getDecl() == V_;
+  }
+
+  VarDecl *V_;
+  bool written_;
+  set<const Expr *> lookup_keys_;
+};
+
+static bool evaluate_int(Expr *E, ASTContext &C, int64_t &val) {
+  if (auto I = dyn_cast<InitListExpr>(E)) {
+    if (I->getNumInits() != 1)
+      return false;
+    E = I->getInit(0);
+  }
+#if LLVM_MAJOR_VERSION >= 8
+  Expr::EvalResult res;
+  if (!E->EvaluateAsInt(res, C))
+    return false;
+  val = res.Val.getInt().getExtValue();
+#else
+  llvm::APSInt res;
+  if (!E->EvaluateAsInt(res, C))
+    return false;
+  val = res.getExtValue();
+#endif
+  return true;
+}
+
 MapVisitor::MapVisitor(set<Decl *> &m) : m_(m) {}
 
 bool MapVisitor::VisitCallExpr(CallExpr *Call) {
@@ -328,7 +429,7 @@ bool MapVisitor::VisitCallExpr(CallExpr *Call) {
 ProbeVisitor::ProbeVisitor(ASTContext &C, Rewriter &rewriter,
                            set<Decl *> &m, bool track_helpers) :
   C(C), rewriter_(rewriter), m_(m), ctx_(nullptr), track_helpers_(track_helpers),
-  addrof_stmt_(nullptr), is_addrof_(false) {
+  btf_calls_(nullptr), addrof_stmt_(nullptr), is_addrof_(false) {
   const char **calling_conv_regs = get_call_conv();
   has_overlap_kuaddr_ = calling_conv_regs == calling_conv_regs_s390x;
 }
@@ -346,7 +447,7 @@ bool ProbeVisitor::assignsExtPtr(Expr *E, int *nbDerefs) {
     return false;
 
   ProbeChecker checker = ProbeChecker(E, ptregs_, track_helpers_,
-                                      true);
+                                      true, btf_calls_);
   if (checker.is_transitive()) {
     // The negative of the number of dereferences is the number of addrof.  In
     // an assignment, if we went through n addrof before getting the external
@@ -422,7 +523,7 @@ bool ProbeVisitor::VisitCallExpr(CallExpr *Call) {
       unsigned i = 0;
       for (auto arg : Call->arguments()) {
         ProbeChecker checker = ProbeChecker(arg, ptregs_, track_helpers_,
-                                            true);
+                                            true, btf_calls_);
         if (checker.needs_probe()) {
           tuple<Decl *, int> pt = make_tuple(F->getParamDecl(i),
                                              -checker.get_nb_derefs());
@@ -462,7 +563,7 @@ bool ProbeVisitor::VisitReturnStmt(ReturnStmt *R) {
     return false;
 
   ProbeChecker checker = ProbeChecker(R->getRetValue(), ptregs_,
-                                      track_helpers_, true);
+                                      track_helpers_, true, btf_calls_);
   if (checker.needs_probe()) {
     int curr_nb_derefs = ptregs_returned_.back();
     int nb_derefs = -checker.get_nb_derefs();
@@ -498,7 +599,8 @@ bool ProbeVisitor::VisitUnaryOperator(UnaryOperator *E) {
   if (memb_visited_.find(E) != memb_visited_.end())
     return true;
   Expr *sub = E->getSubExpr();
-  if (!ProbeChecker(sub, ptregs_, track_helpers_).needs_probe())
+  if (!ProbeChecker(sub, ptregs_, track_helpers_, false, btf_calls_)
+           .needs_probe())
     return true;
   memb_visited_.insert(E);
   string pre, post;
@@ -556,7 +658,8 @@ bool ProbeVisitor::VisitMemberExpr(MemberExpr *E) {
 
   // Checks to see if the expression references something that needs to be run
   // through bpf_probe_read.
-  if (!ProbeChecker(base, ptregs_, track_helpers_).needs_probe())
+  if (!ProbeChecker(base, ptregs_, track_helpers_, false, btf_calls_)
+           .needs_probe())
     return true;
 
   // If the base is an array, we will skip rewriting. See issue #2352.
@@ -578,7 +681,8 @@ bool ProbeVisitor::VisitMemberExpr(MemberExpr *E) {
 }
 bool ProbeVisitor::VisitArraySubscriptExpr(ArraySubscriptExpr *E) {
   if (memb_visited_.find(E) != memb_visited_.end()) return true;
-  if (!ProbeChecker(E, ptregs_, track_helpers_).needs_probe())
+  if (!ProbeChecker(E, ptregs_, track_helpers_, false, btf_calls_)
+           .needs_probe())
     return true;
 
   // Parent expr has addrof, skip the rewrite.
@@ -734,8 +838,13 @@ void BTypeVisitor::genParamDirectAssign(FunctionDecl *D, string& preamble,
       arg->addAttr(UnavailableAttr::CreateImplicit(C, "ptregs"));
       size_t d = idx - 1;
       const char *reg = calling_conv_regs[d];
-      preamble += " " + text + " = " + fn_args_[0]->getName().str() + "->" +
-                  string(reg) + ";";
+      if (fe_.kprobe_as_kfunc())
+        preamble += " " + text + " = BCC_CTX_ARG(" +
+                    fn_args_[0]->getName().str() + ", " + std::to_string(d) +
+                    ", " + string(reg) + ");";
+      else
+        preamble += " " + text + " = " + fn_args_[0]->getName().str() + "->" +
+                    string(reg) + ";";
     }
   }
 }
@@ -749,9 +858,15 @@ void BTypeVisitor::genParamIndirectAssign(FunctionDecl *D, string& preamble,
 
     if (idx == 0) {
       new_ctx = "__" + arg->getName().str();
-      preamble += " struct pt_regs * " + new_ctx + " = " +
-                  arg->getName().str() + "->" +
-                  string(calling_conv_regs[0]) + ";";
+      if (fe_.kprobe_as_kfunc())
+        preamble += " struct pt_regs * " + new_ctx +
+                    " = (struct pt_regs *)BCC_CTX_ARG(" +
+                    arg->getName().str() + ", 0, " +
+                    string(calling_conv_regs[0]) + ");";
+      else
+        preamble += " struct pt_regs * " + new_ctx + " = " +
+                    arg->getName().str() + "->" +
+                    string(calling_conv_regs[0]) + ";";
     } else {
       // Move the args into a preamble section where the same params are
       // declared and initialized from pt_regs.
@@ -831,6 +946,15 @@ bool BTypeVisitor::VisitFunctionDecl(FunctionDecl *D) {
       fn_args_.push_back(arg);
     }
     rewriteFuncParam(D);
+    if (fe_.kprobe_as_kfunc() && !D->getLocation().isMacroID() &&
+        D->param_size() >= 1) {
+      QualType ctx_type = D->getParamDecl(0)->getType();
+      if (ctx_type->isPointerType() &&
+          ctx_type->getPointeeType().getUnqualifiedType().getAsString() ==
+              "struct pt_regs")
+        fe_.kfunc_compat_fns_.push_back(
+            make_pair(current_fn_, D->getParamDecl(0)->getName().str()));
+    }
   } else if (D->hasBody() &&
              rewriter_.getSourceMgr().getFileID(real_start_loc)
                == rewriter_.getSourceMgr().getMainFileID()) {
@@ -866,8 +990,10 @@ bool BTypeVisitor::VisitCallExpr(CallExpr *Call) {
         if (!A->getName().startswith("maps"))
           return true;
 
-        string args = rewriter_.getRewrittenText(expansionRange(SourceRange(GET_BEGINLOC(Call->getArg(0)),
-                                                   GET_ENDLOC(Call->getArg(Call->getNumArgs() - 1)))));
+        string args;
+        if (Call->getNumArgs())
+          args = rewriter_.getRewrittenText(expansionRange(SourceRange(GET_BEGINLOC(Call->getArg(0)),
+                                              GET_ENDLOC(Call->getArg(Call->getNumArgs() - 1)))));
 
         // find the table fd, which was opened at declaration time
         TableStorage::iterator desc;
@@ -912,7 +1038,10 @@ bool BTypeVisitor::VisitCallExpr(CallExpr *Call) {
           string lookup = "bpf_map_lookup_elem_(bpf_pseudo_fd(1, " + fd + ")";
           string update = "bpf_map_update_elem_(bpf_pseudo_fd(1, " + fd + ")";
           txt  = "({ typeof(" + name + ".key) _key = " + arg0 + "; ";
-          txt += "typeof(" + name + ".leaf) *_leaf = " + lookup + ", &_key); ";
+          if (isDirectArrayValue(desc->second, Call->getArg(0), false))
+            txt += "typeof(" + name + ".leaf) *_leaf = (void *)bpf_pseudo_fd(2, (unsigned int)" + fd + "); ";
+          else
+            txt += "typeof(" + name + ".leaf) *_leaf = " + lookup + ", &_key); ";
           txt += "if (_leaf) ";
 
           if (memb_name == "atomic_increment") {
@@ -931,8 +1060,14 @@ bool BTypeVisitor::VisitCallExpr(CallExpr *Call) {
           string arg0 = rewriter_.getRewrittenText(expansionRange(Call->getArg(0)->getSourceRange()));
           string args_other = rewriter_.getRewrittenText(expansionRange(SourceRange(GET_BEGINLOC(Call->getArg(1)),
                                                            GET_ENDLOC(Call->getArg(2)))));
-          txt = "bpf_perf_event_output(" + arg0 + ", bpf_pseudo_fd(1, " + fd + ")";
-          txt += ", CUR_CPU_IDENTIFIER, " + args_other + ")";
+          if (desc->second.type == BPF_MAP_TYPE_RINGBUF) {
+            // BCC_PERF_OUTPUT_RINGBUF: the context is not needed
+            txt = "bpf_ringbuf_output(bpf_pseudo_fd(1, " + fd + "), ";
+            txt += args_other + ", 0)";
+          } else {
+            txt = "bpf_perf_event_output(" + arg0 + ", bpf_pseudo_fd(1, " + fd + ")";
+            txt += ", CUR_CPU_IDENTIFIER, " + args_other + ")";
+          }
 
           // e.g.
           // struct data_t { u32 pid; }; data_t data;
@@ -951,6 +1086,10 @@ bool BTypeVisitor::VisitCallExpr(CallExpr *Call) {
             fe_.perf_events_[name] = perf_event;
           }
         } else if (memb_name == "perf_submit_skb") {
+          if (desc->second.type == BPF_MAP_TYPE_RINGBUF) {
+            error(GET_BEGINLOC(Call), "perf_submit_skb cannot be used with BCC_PERF_OUTPUT_RINGBUF");
+            return false;
+          }
           string skb = rewriter_.getRewrittenText(expansionRange(Call->getArg(0)->getSourceRange()));
           string skb_len = rewriter_.getRewrittenText(expansionRange(Call->getArg(1)->getSourceRange()));
           string meta = rewriter_.getRewrittenText(expansionRange(Call->getArg(2)->getSourceRange()));
@@ -972,6 +1111,20 @@ bool BTypeVisitor::VisitCallExpr(CallExpr *Call) {
               error(GET_BEGINLOC(Call), "get_stackid only available on stacktrace maps");
               return false;
             }
+        } else if (memb_name == "record_stack") {
+          // BPF_STACK_RINGBUF: the record is built in its per-CPU buffer
+          string buf_name = string(Ref->getDecl()->getName()) + "_stack_buf";
+          TableStorage::iterator buf_desc;
+          if (desc->second.type != BPF_MAP_TYPE_RINGBUF ||
+              (!fe_.table_storage().Find(Path({fe_.id(), buf_name}), buf_desc) &&
+               !fe_.table_storage().Find(Path({buf_name}), buf_desc))) {
+            error(GET_BEGINLOC(Call), "record_stack only available on BPF_STACK_RINGBUF tables");
+            return false;
+          }
+          string buf_fd = to_string(buf_desc->second.fd >= 0 ? buf_desc->second.fd
+                                                             : buf_desc->second.fake_fd);
+          txt = "bcc_record_stack(bpf_pseudo_fd(1, " + fd + "), bpf_pseudo_fd(1, " +
+                buf_fd + "), " + args + ")";
         } else if (memb_name == "sock_map_update" || memb_name == "sock_hash_update") {
           string ctx = rewriter_.getRewrittenText(expansionRange(Call->getArg(0)->getSourceRange()));
           string keyp = rewriter_.getRewrittenText(expansionRange(Call->getArg(1)->getSourceRange()));
@@ -1041,6 +1194,18 @@ bool BTypeVisitor::VisitCallExpr(CallExpr *Call) {
 
           txt = "bpf_" + string(memb_name) + "(" + arg0 + ", (void *)bpf_pseudo_fd(1, " + fd + "), ";
           txt += args_other + ")";
+        } else if (memb_name == "get") {
+          if (desc->second.type != BPF_MAP_TYPE_ARRAY ||
+              !(desc->second.flags & BPF_F_RDONLY_PROG)) {
+            error(GET_BEGINLOC(Call), "get only available on BPF_RODATA tables");
+            return false;
+          }
+          string name = string(Ref->getDecl()->getName());
+          txt = "((const typeof(" + name + ".leaf) *)bpf_pseudo_fd(2, (unsigned int)" + fd + "))";
+        } else if (memb_name == "lookup" &&
+                   isDirectArrayValue(desc->second, Call->getArg(0), true)) {
+          string name = string(Ref->getDecl()->getName());
+          txt = "((typeof(" + name + ".leaf) *)bpf_pseudo_fd(2, (unsigned int)" + fd + "))";
         } else {
           if (memb_name == "lookup") {
             prefix = "bpf_map_lookup_elem";
@@ -1078,6 +1243,12 @@ bool BTypeVisitor::VisitCallExpr(CallExpr *Call) {
           } else if (memb_name == "sk_storage_delete") {
             prefix = "bpf_sk_storage_delete";
             suffix = ")";
+          } else if (memb_name == "task_storage_get") {
+            prefix = "bpf_task_storage_get";
+            suffix = ")";
+          } else if (memb_name == "task_storage_delete") {
+            prefix = "bpf_task_storage_delete";
+            suffix = ")";
           } else if (memb_name == "get_local_storage") {
             prefix = "bpf_get_local_storage";
             suffix = ")";
@@ -1333,6 +1504,47 @@ DiagnosticBuilder BTypeVisitor::warning(SourceLocation loc, const char (&fmt)[N]
   return C.getDiagnostics().Report(loc, diag_id);
 }
 
+// With -DBCC_DIRECT_ARRAY_LOOKUP, and always for BPF_RODATA, the element of a
+// single-entry BPF_ARRAY is addressed straight from the map value
+// (BPF_PSEUDO_MAP_VALUE, as libbpf does for .data and .bss) instead of through
+// bpf_map_lookup_elem. The key must be 0 at compile time: a constant, a
+// &(type){0} literal or &var where var is initialized to 0 and never written.
+bool BTypeVisitor::isDirectArrayValue(const TableDesc &desc, Expr *key, bool is_ptr) {
+  if (desc.type != BPF_MAP_TYPE_ARRAY || desc.max_entries != 1)
+    return false;
+  if (!(desc.flags & BPF_F_RDONLY_PROG) && !fe_.direct_array_lookup())
+    return false;
+
+  Expr *E = key->IgnoreParenImpCasts();
+  if (is_ptr) {
+    UnaryOperator *U = dyn_cast<UnaryOperator>(E);
+    if (!U || U->getOpcode() != UO_AddrOf)
+      return false;
+    E = U->getSubExpr()->IgnoreParenImpCasts();
+    if (CompoundLiteralExpr *L = dyn_cast<CompoundLiteralExpr>(E)) {
+      E = L->getInitializer();
+    } else if (DeclRefExpr *Ref = dyn_cast<DeclRefExpr>(E)) {
+      VarDecl *V = dyn_cast<VarDecl>(Ref->getDecl());
+      if (!V || !V->hasLocalStorage() || !V->getInit() ||
+          V->getType().isVolatileQualified())
+        return false;
+      FunctionDecl *F = dyn_cast<FunctionDecl>(V->getDeclContext());
+      if (!F || !F->hasBody())
+        return false;
+      KeyWriteChecker checker(V);
+      checker.TraverseStmt(F->getBody());
+      if (checker.written())
+        return false;
+      E = V->getInit();
+    } else {
+      return false;
+    }
+  }
+
+  int64_t idx;
+  return evaluate_int(E, C, idx) && idx == 0;
+}
+
 int64_t BTypeVisitor::getFieldValue(VarDecl *Decl, FieldDecl *FDecl, int64_t OrigFValue) {
   unsigned idx = FDecl->getFieldIndex();
 
@@ -1373,6 +1585,7 @@ bool BTypeVisitor::VisitVarDecl(VarDecl *Decl) {
     Path maps_ns_path({"ns", fe_.maps_ns(), table.name});
     Path global_path({table.name});
     QualType key_type, leaf_type;
+    int numa_node = -1;
 
     unsigned i = 0;
     for (auto F : RD->fields()) {
@@ -1400,6 +1613,8 @@ bool BTypeVisitor::VisitVarDecl(VarDecl *Decl) {
             table.max_entries = getFieldValue(Decl, F, table.max_entries);
       } else if (F->getName() == "flags") {
             table.flags = getFieldValue(Decl, F, table.flags);
+      } else if (F->getName() == "numa_node") {
+            numa_node = getFieldValue(Decl, F, numa_node);
       }
       ++i;
     }
@@ -1478,6 +1693,17 @@ bool BTypeVisitor::VisitVarDecl(VarDecl *Decl) {
       if (numcpu <= 0)
         numcpu = 1;
       table.max_entries = numcpu;
+      if (fe_.perf_output_ringbuf()) {
+        // One ring buffer as large as the default 8-page perf buffers of all
+        // CPUs together, rounded up to a power of two
+        size_t pages = 1;
+        while (pages < (size_t)numcpu * 8)
+          pages <<= 1;
+        map_type = BPF_MAP_TYPE_RINGBUF;
+        table.key_size = 0;
+        table.leaf_size = 0;
+        table.max_entries = pages * sysconf(_SC_PAGESIZE);
+      }
     } else if (section_attr == "maps/ringbuf") {
       map_type = BPF_MAP_TYPE_RINGBUF;
       // values from libbpf/src/libbpf_probes.c
@@ -1507,6 +1733,8 @@ bool BTypeVisitor::VisitVarDecl(VarDecl *Decl) {
       map_type = BPF_MAP_TYPE_ARRAY_OF_MAPS;
     } else if (section_attr == "maps/sk_storage") {
       map_type = BPF_MAP_TYPE_SK_STORAGE;
+    } else if (section_attr == "maps/task_storage") {
+      map_type = BPF_MAP_TYPE_TASK_STORAGE;
     } else if (section_attr == "maps/sockmap") {
       map_type = BPF_MAP_TYPE_SOCKMAP;
     } else if (section_attr == "maps/sockhash") {
@@ -1559,7 +1787,7 @@ bool BTypeVisitor::VisitVarDecl(VarDecl *Decl) {
       fe_.add_map_def(table.fake_fd, std::make_tuple((int)map_type, std::string(table.name),
                       (int)table.key_size, (int)table.leaf_size,
                       (int)table.max_entries, table.flags, pinned_id,
-                      inner_map_name, pinned));
+                      inner_map_name, pinned, numa_node));
     }
 
     if (!table.is_extern)
@@ -1585,15 +1813,44 @@ bool BTypeVisitor::VisitVarDecl(VarDecl *Decl) {
 BTypeConsumer::BTypeConsumer(ASTContext &C, BFrontendAction &fe,
                              Rewriter &rewriter, set<Decl *> &m)
     : fe_(fe),
+      rewriter_(rewriter),
       map_visitor_(m),
       btype_visitor_(C, fe),
       probe_visitor1_(C, rewriter, m, true),
       probe_visitor2_(C, rewriter, m, false) {}
 
+/**
+ * fentry, fexit, LSM and iterator programs can load from BTF pointers
+ * directly. Their arguments are never seeded as external pointers; this also
+ * switches their (T *)bpf_get_current_task() to bpf_get_current_task_btf() so
+ * the task and everything reached through it is read without bpf_probe_read.
+ */
+void BTypeConsumer::RewriteBTFTaskCalls(DeclContext *DC) {
+  vector<CallExpr *> calls;
+  BTFTaskVisitor visitor(calls);
+  for (auto it = DC->decls_begin(); it != DC->decls_end(); it++) {
+    if (FunctionDecl *F = dyn_cast<FunctionDecl>(*it))
+      if (fe_.is_btf_typed_func(F))
+        visitor.TraverseDecl(F);
+  }
+  if (calls.empty() || !has_bpf_get_current_task_btf())
+    return;
+
+  for (auto Call : calls) {
+    Expr *Callee = Call->getCallee()->IgnoreParenImpCasts();
+    rewriter_.ReplaceText(Callee->getSourceRange(), "bpf_get_current_task_btf");
+    btf_calls_.insert(Call);
+  }
+  probe_visitor1_.set_btf_calls(&btf_calls_);
+  probe_visitor2_.set_btf_calls(&btf_calls_);
+}
+
 void BTypeConsumer::HandleTranslationUnit(ASTContext &Context) {
   DeclContext::decl_iterator it;
   DeclContext *DC = TranslationUnitDecl::castToDeclContext(Context.getTranslationUnitDecl());
 
+  RewriteBTFTaskCalls(DC);
+
   /**
    * In a first traversal, ProbeVisitor tracks external pointers identified
    * through each function's arguments and replaces their dereferences with
@@ -1605,6 +1862,8 @@ void BTypeConsumer::HandleTranslationUnit(ASTContext &Context) {
     if (FunctionDecl *F = dyn_cast<FunctionDecl>(D)) {
       if (fe_.is_rewritable_ext_func(F)) {
         for (auto arg : F->parameters()) {
+          if (fe_.is_btf_typed_func(F))
+            break;
           if (arg == F->getParamDecl(0)) {
             /**
              * Limit tracing of pointers from context to tracing contexts.
@@ -1688,7 +1947,31 @@ BFrontendAction::BFrontendAction(llvm::raw_ostream &os, unsigned flags,
       mod_src_(mod_src),
       next_fake_fd_(-1),
       fake_fd_map_(fake_fd_map),
-      perf_events_(perf_events) {}
+      perf_events_(perf_events),
+      kprobe_as_kfunc_(-1) {}
+
+// BPF_PERF_OUTPUT tables become ring buffers with -DBCC_PERF_OUTPUT_RINGBUF,
+// on kernels that have them
+bool BFrontendAction::perf_output_ringbuf() {
+  return getCompilerInstance().getPreprocessor().isMacroDefined(
+             "BCC_PERF_OUTPUT_RINGBUF") &&
+         has_bpf_ringbuf();
+}
+
+// kprobe handlers are also compiled as fentry and fexit programs with
+// -DBCC_KPROBE_AS_KFUNC, on kernels that have them
+bool BFrontendAction::kprobe_as_kfunc() {
+  if (kprobe_as_kfunc_ < 0)
+    kprobe_as_kfunc_ = getCompilerInstance().getPreprocessor().isMacroDefined(
+                           "BCC_KPROBE_AS_KFUNC") &&
+                       bcc_feature_probe("kfunc", nullptr) == 1;
+  return kprobe_as_kfunc_;
+}
+
+bool BFrontendAction::direct_array_lookup() {
+  return getCompilerInstance().getPreprocessor().isMacroDefined(
+      "BCC_DIRECT_ARRAY_LOOKUP");
+}
 
 bool BFrontendAction::is_rewritable_ext_func(FunctionDecl *D) {
   StringRef file_name = rewriter_->getSourceMgr().getFilename(GET_BEGINLOC(D));
@@ -1696,6 +1979,20 @@ bool BFrontendAction::is_rewritable_ext_func(FunctionDecl *D) {
           (file_name.empty() || file_name == main_path_));
 }
 
+// Programs whose context is BTF-typed, including the static ____<name>
+// bodies of BPF_PROG
+bool BFrontendAction::is_btf_typed_func(FunctionDecl *D) {
+  StringRef file_name = rewriter_->getSourceMgr().getFilename(GET_BEGINLOC(D));
+  if (!D->hasBody() || !(file_name.empty() || file_name == main_path_))
+    return false;
+  StringRef name = D->getName();
+  if (name.startswith("____"))
+    name = name.drop_front(4);
+  return name.startswith("kfunc__") || name.startswith("kretfunc__") ||
+         name.startswith("kmod_ret__") || name.startswith("lsm__") ||
+         name.startswith("bpf_iter__");
+}
+
 void BFrontendAction::DoMiscWorkAround() {
   // In 4.16 and later, CONFIG_CC_STACKPROTECTOR is moved out of Kconfig and into
   // Makefile. It will be set depending on CONFIG_CC_STACKPROTECTOR_{AUTO|REGULAR|STRONG}.
@@ -1741,10 +2038,87 @@ void BFrontendAction::DoMiscWorkAround() {
     "\n#include <bcc/footer.h>\n");
 }
 
+// The macros the copies of AddKfuncCompatCopies() redefine
+static const char *kfunc_compat_macros[][2] = {
+  {"BCC_CTX_ARG(ctx, n, reg)", "(((unsigned long long *)(ctx))[n])"},
+  {"PT_REGS_RC(ctx)", "bcc_kfunc_ret(ctx)"},
+  {"PT_REGS_IP(ctx)", "bpf_get_func_ip(ctx)"},
+};
+
+// Whether the handler text reads registers of its context ctx other than
+// the ones kfunc_compat_macros can redirect
+static bool reads_other_regs(const string &text, const string &ctx) {
+  auto ident = [](char c) { return isalnum(c) || c == '_'; };
+  for (size_t pos = text.find(ctx + "->"); pos != string::npos;
+       pos = text.find(ctx + "->", pos + 1))
+    if (pos == 0 || !ident(text[pos - 1]))
+      return true;
+  for (size_t pos = text.find("PT_REGS_"); pos != string::npos;
+       pos = text.find("PT_REGS_", pos + 1))
+    if (text.compare(pos, 11, "PT_REGS_RC(") &&
+        text.compare(pos, 11, "PT_REGS_IP("))
+      return true;
+  return false;
+}
+
+// Append a copy of each kprobe handler in kfunc_compat_fns_, named with
+// BPF_KFUNC_COMPAT_PREFIX, that reads its arguments and return value from
+// the context of fentry and fexit programs. The copy is loaded as one of
+// those for each kernel function the handler is attached to, see
+// BPF::attach_kprobe(). Handlers that read other registers are not copied;
+// the ones reads_other_regs() misses are rejected by the verifier, and
+// attached as kprobes.
+void BFrontendAction::AddKfuncCompatCopies() {
+  string begin, end;
+  for (const auto &m : kfunc_compat_macros) {
+    string name = string(m[0]).substr(0, string(m[0]).find('('));
+    begin += "#pragma push_macro(\"" + name + "\")\n#undef " + name +
+             "\n#define " + m[0] + " " + m[1] + "\n";
+    end += "#pragma pop_macro(\"" + name + "\")\n";
+  }
+
+  SourceManager &sm = rewriter_->getSourceMgr();
+  for (const auto &it : kfunc_compat_fns_) {
+    const string &fn = it.first;
+    SourceRange range = func_range_[fn];
+    string text = rewriter_->getRewrittenText(range);
+    if (reads_other_regs(text, it.second))
+      continue;
+    string copy = BPF_KFUNC_COMPAT_PREFIX + fn;
+    string section = string("section(\"") + BPF_FN_PREFIX + fn + "\")";
+    size_t pos = text.find(section);
+    if (pos == string::npos)
+      continue;
+    text.replace(pos, section.size(),
+                 string("section(\"") + BPF_FN_PREFIX + copy + "\")");
+    // the name of the function follows its attribute
+    for (pos = text.find(fn + "(", pos); pos != string::npos;
+         pos = text.find(fn + "(", pos + 1)) {
+      char prev = text[pos - 1];
+      if (!isalnum(prev) && prev != '_')
+        break;
+    }
+    if (pos == string::npos)
+      continue;
+    text.replace(pos, fn.size(), copy);
+
+    SourceLocation loc = Lexer::getLocForEndOfToken(
+        range.getEnd(), 0, sm, getCompilerInstance().getLangOpts());
+    rewriter_->InsertTextAfter(loc, "\n" + begin + text + "\n" + end);
+  }
+}
+
 void BFrontendAction::EndSourceFileAction() {
   // Additional misc rewrites
   DoMiscWorkAround();
 
+  for (auto func : func_range_) {
+    auto f = func.first;
+    string bd = rewriter_->getRewrittenText(func_range_[f]);
+    func_src_.set_src_rewritten(f, bd);
+  }
+  AddKfuncCompatCopies();
+
   if (flags_ & DEBUG_PREPROCESSOR)
     rewriter_->getEditBuffer(rewriter_->getSourceMgr().getMainFileID()).write(llvm::errs());
 #if LLVM_MAJOR_VERSION >= 9
@@ -1759,11 +2133,6 @@ void BFrontendAction::EndSourceFileAction() {
   }
 #endif
 
-  for (auto func : func_range_) {
-    auto f = func.first;
-    string bd = rewriter_->getRewrittenText(func_range_[f]);
-    func_src_.set_src_rewritten(f, bd);
-  }
   rewriter_->getEditBuffer(rewriter_->getSourceMgr().getMainFileID()).write(os_);
   os_.flush();
 }
@@ -75,6 +75,7 @@ class BTypeVisitor : public clang::RecursiveASTVisitor<BTypeVisitor> {
   void genParamIndirectAssign(clang::FunctionDecl *D, std::string& preamble,
                               const char **calling_conv_regs);
   void rewriteFuncParam(clang::FunctionDecl *D);
+  bool isDirectArrayValue(const TableDesc &desc, clang::Expr *key, bool is_ptr);
   int64_t getFieldValue(clang::VarDecl *Decl, clang::FieldDecl *FDecl,
                         int64_t OrigFValue);
   template <unsigned N>
@@ -108,6 +109,7 @@ class ProbeVisitor : public clang::RecursiveASTVisitor<ProbeVisitor> {
   bool VisitArraySubscriptExpr(clang::ArraySubscriptExpr *E);
   void set_ptreg(std::tuple<clang::Decl *, int> &pt) { ptregs_.insert(pt); }
   void set_ctx(clang::Decl *D) { ctx_ = D; }
+  void set_btf_calls(const std::set<const clang::Stmt *> *calls) { btf_calls_ = calls; }
   std::set<std::tuple<clang::Decl *, int>> get_ptregs() { return ptregs_; }
  private:
   bool assignsExtPtr(clang::Expr *E, int *nbAddrOf);
@@ -127,6 +129,7 @@ class ProbeVisitor : public clang::RecursiveASTVisitor<ProbeVisitor> {
   std::set<clang::Decl *> &m_;
   clang::Decl *ctx_;
   bool track_helpers_;
+  const std::set<const clang::Stmt *> *btf_calls_;
   std::list<int> ptregs_returned_;
   const clang::Stmt *addrof_stmt_;
   bool is_addrof_;
@@ -140,11 +143,16 @@ class BTypeConsumer : public clang::ASTConsumer {
                          clang::Rewriter &rewriter, std::set<clang::Decl *> &m);
   void HandleTranslationUnit(clang::ASTContext &Context) override;
  private:
+  void RewriteBTFTaskCalls(clang::DeclContext *DC);
+
   BFrontendAction &fe_;
+  clang::Rewriter &rewriter_;
   MapVisitor map_visitor_;
   BTypeVisitor btype_visitor_;
   ProbeVisitor probe_visitor1_;
   ProbeVisitor probe_visitor2_;
+  // bpf_get_current_task() calls turned into bpf_get_current_task_btf()
+  std::set<const clang::Stmt *> btf_calls_;
 };
 
 // Create a B program in 2 phases (everything else is normal C frontend):
@@ -173,12 +181,17 @@ class BFrontendAction : public clang::ASTFrontendAction {
   std::string id() const { return id_; }
   std::string maps_ns() const { return maps_ns_; }
   bool is_rewritable_ext_func(clang::FunctionDecl *D);
+  bool is_btf_typed_func(clang::FunctionDecl *D);
+  bool direct_array_lookup();
+  bool perf_output_ringbuf();
+  bool kprobe_as_kfunc();
   void DoMiscWorkAround();
+  void AddKfuncCompatCopies();
   // negative fake_fd to be different from real fd in bpf_pseudo_fd.
   int get_next_fake_fd() { return next_fake_fd_--; }
   void add_map_def(int fd,
     std::tuple<int, std::string, int, int, int, int, int, std::string,
-               std::string> map_def) {
+               std::string, int> map_def) {
     fake_fd_map_[fd] = move(map_def);
   }
 
@@ -198,6 +211,10 @@ class BFrontendAction : public clang::ASTFrontendAction {
   int next_fake_fd_;
   fake_fd_map_def &fake_fd_map_;
   std::map<std::string, std::vector<std::string>> &perf_events_;
+  int kprobe_as_kfunc_;
+  // kprobe handlers to copy as fentry and fexit programs, with the names
+  // of their context arguments
+  std::vector<std::pair<std::string, std::string>> kfunc_compat_fns_;
 };
 
 }  // namespace visitor
@@ -15,10 +15,14 @@
  */
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <tuple>
 
 #include <dirent.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 #include <sys/utsname.h>
 #include <unistd.h>
 
@@ -33,8 +37,30 @@ KBuildHelper::KBuildHelper(const std::string &kdir, bool has_source_dir) : kdir_
                                                                            has_source_dir_(has_source_dir) {
 }
 
-// read the flags from cache or learn
+// The flags only depend on the kernel dir layout and the architecture, so
+// they are computed once per process for each combination.
 int KBuildHelper::get_flags(const char *uname_machine, vector<string> *cflags) {
+  typedef std::tuple<string, bool, string, string> FlagsKey;
+  static std::mutex mutex;
+  static std::map<FlagsKey, vector<string>> cache;
+
+  const char *archenv = getenv("ARCH");
+  FlagsKey key(kdir_, has_source_dir_, uname_machine,
+               archenv ? string("=") + archenv : string());
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = cache.find(key);
+  if (it == cache.end()) {
+    vector<string> flags;
+    if (compute_flags(uname_machine, &flags))
+      return -1;
+    it = cache.emplace(key, std::move(flags)).first;
+  }
+  cflags->insert(cflags->end(), it->second.begin(), it->second.end());
+  return 0;
+}
+
+int KBuildHelper::compute_flags(const char *uname_machine,
+                                vector<string> *cflags) {
   //uname -m | sed -e s/i.86/x86/ -e s/x86_64/x86/ -e s/sun4u/sparc64/ -e s/arm.*/arm/
   //               -e s/sa110/arm/ -e s/s390x/s390/ -e s/parisc64/parisc/
   //               -e s/ppc.*/powerpc/ -e s/mips.*/mips/ -e s/sh[234].*/sh/
@@ -147,6 +173,51 @@ static inline int proc_kheaders_exists(void)
   return file_exists(PROC_KHEADERS_PATH);
 }
 
+// Read the GNU build ID of the running kernel from its ELF notes, as a hex
+// string, or return an empty string if it has none.
+static string kernel_build_id()
+{
+  std::ifstream notes("/sys/kernel/notes", std::ios::binary);
+  struct {
+    uint32_t namesz, descsz, type;
+  } nhdr;
+  while (notes.read(reinterpret_cast<char *>(&nhdr), sizeof(nhdr))) {
+    uint32_t namesz = (nhdr.namesz + 3) & ~3U;
+    uint32_t descsz = (nhdr.descsz + 3) & ~3U;
+    if (namesz > 256 || descsz > 256)
+      break;
+    char buf[512];
+    if (!notes.read(buf, namesz + descsz))
+      break;
+    // NT_GNU_BUILD_ID
+    if (nhdr.type == 3 && nhdr.namesz == 4 && !memcmp(buf, "GNU", 4)) {
+      static const char hex[] = "0123456789abcdef";
+      string id;
+      for (uint32_t i = 0; i < nhdr.descsz; i++) {
+        unsigned char c = buf[namesz + i];
+        id += hex[c >> 4];
+        id += hex[c & 0xf];
+      }
+      return id;
+    }
+  }
+  return "";
+}
+
+// An extracted tree is only trusted if it was made by us or by root, and
+// nobody else can write to it.
+static bool kheaders_dir_ok(const string &dirpath)
+{
+  struct stat st;
+  if (lstat(dirpath.c_str(), &st) || !S_ISDIR(st.st_mode))
+    return false;
+  if (st.st_uid != geteuid() && st.st_uid != 0)
+    return false;
+  if (st.st_mode & (S_IWGRP | S_IWOTH))
+    return false;
+  return file_exists((dirpath + "/include/linux/kconfig.h").c_str());
+}
+
 static inline int extract_kheaders(const std::string &dirpath,
                                    const struct utsname &uname_data)
 {
@@ -165,7 +236,7 @@ static inline int extract_kheaders(const std::string &dirpath,
     }
   }
 
-  snprintf(dirpath_tmp, sizeof(dirpath_tmp), "/tmp/kheaders-%s-XXXXXX", uname_data.release);
+  snprintf(dirpath_tmp, sizeof(dirpath_tmp), "%s-XXXXXX", dirpath.c_str());
   if (mkdtemp(dirpath_tmp) == NULL) {
     ret = -1;
     goto cleanup;
@@ -182,8 +253,8 @@ static inline int extract_kheaders(const std::string &dirpath,
   }
 
   /*
-   * If the new directory exists, it could have raced with a parallel
-   * extraction, in this case just delete the old directory and ignore.
+   * If the new directory exists, it could have raced with an extraction by
+   * a process not taking the lock, in this case just delete ours and ignore.
    */
   ret = rename(dirpath_tmp, dirpath.c_str());
   if (ret)
@@ -199,22 +270,67 @@ cleanup:
   return ret;
 }
 
+// The headers are extracted once per kernel build, into $BCC_KHEADERS_DIR
+// (default /tmp), and reused by later processes. Concurrent processes
+// serialize on a lock file next to the tree, so that only the first one pays
+// for the decompression and the others wait for its result.
 int get_proc_kheaders(std::string &dirpath)
 {
+  static std::mutex mutex;
+  static std::string cached;
   struct utsname uname_data;
   char dirpath_tmp[256];
 
+  std::lock_guard<std::mutex> guard(mutex);
+  if (!cached.empty()) {
+    dirpath = cached;
+    return 0;
+  }
+
   if (uname(&uname_data))
     return -errno;
 
-  snprintf(dirpath_tmp, 256, "/tmp/kheaders-%s", uname_data.release);
+  const char *root = getenv("BCC_KHEADERS_DIR");
+  if (!root || !*root)
+    root = "/tmp";
+  string build_id = kernel_build_id();
+  if (build_id.empty())
+    snprintf(dirpath_tmp, sizeof(dirpath_tmp), "%s/kheaders-%s", root,
+             uname_data.release);
+  else
+    snprintf(dirpath_tmp, sizeof(dirpath_tmp), "%s/kheaders-%s-%.16s", root,
+             uname_data.release, build_id.c_str());
   dirpath = std::string(dirpath_tmp);
 
-  if (file_exists(dirpath_tmp))
+  if (kheaders_dir_ok(dirpath)) {
+    cached = dirpath;
     return 0;
+  }
 
-  // First time so extract it
-  return extract_kheaders(dirpath, uname_data);
+  int lock_fd = open((dirpath + ".lock").c_str(),
+                     O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+  if (lock_fd >= 0 && flock(lock_fd, LOCK_EX)) {
+    close(lock_fd);
+    lock_fd = -1;
+  }
+
+  int ret = 0;
+  // Another process may have extracted it while we waited for the lock
+  if (!kheaders_dir_ok(dirpath)) {
+    // Drop what a failed or untrusted extraction left behind
+    if (file_exists(dirpath.c_str()))
+      system(("rm -rf " + dirpath).c_str());
+    // First time so extract it
+    ret = extract_kheaders(dirpath, uname_data);
+    if (!ret && !kheaders_dir_ok(dirpath))
+      ret = -1;
+  }
+  if (lock_fd >= 0)
+    close(lock_fd);
+
+  if (!ret)
+    cached = dirpath;
+  return ret;
 }
 
 }  // namespace ebpf
@@ -13,8 +13,10 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <condition_variable>
 #include <cstring>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <unistd.h>
@@ -32,29 +34,64 @@ struct FileDeleter {
 };
 typedef std::unique_ptr<FILE, FileDeleter> FILEPtr;
 
-// Helper with pushd/popd semantics
+// Helper with pushd/popd semantics. The working directory is process-wide,
+// so concurrent users targeting the same directory share a single chdir and
+// the original directory is restored when the last one goes away. Users of a
+// different directory wait until then.
 class DirStack {
  public:
   explicit DirStack(const std::string &dst) : ok_(false) {
-    if (getcwd(cwd_, sizeof(cwd_)) == NULL) {
-      ::perror("getcwd");
-      return;
-    }
-    if (::chdir(dst.c_str())) {
-      fprintf(stderr, "chdir(%s): %s\n", dst.c_str(), strerror(errno));
-      return;
+    std::unique_lock<std::mutex> lock(mutex());
+    State &st = state();
+    cond().wait(lock, [&] { return st.depth == 0 || st.dst == dst; });
+    if (st.depth == 0) {
+      if (getcwd(st.cwd, sizeof(st.cwd)) == NULL) {
+        ::perror("getcwd");
+        return;
+      }
+      if (::chdir(dst.c_str())) {
+        fprintf(stderr, "chdir(%s): %s\n", dst.c_str(), strerror(errno));
+        return;
+      }
+      st.dst = dst;
     }
+    ++st.depth;
+    memcpy(cwd_, st.cwd, sizeof(cwd_));
     ok_ = true;
   }
   ~DirStack() {
     if (!ok_) return;
-    if (::chdir(cwd_)) {
-      fprintf(stderr, "chdir(%s): %s\n", cwd_, strerror(errno));
+    std::lock_guard<std::mutex> lock(mutex());
+    State &st = state();
+    if (--st.depth > 0)
+      return;
+    if (::chdir(st.cwd)) {
+      fprintf(stderr, "chdir(%s): %s\n", st.cwd, strerror(errno));
     }
+    st.dst.clear();
+    cond().notify_all();
   }
   bool ok() const { return ok_; }
   const char * cwd() const { return cwd_; }
  private:
+  struct State {
+    int depth = 0;
+    std::string dst;
+    char cwd[256];
+  };
+  static std::mutex &mutex() {
+    static std::mutex m;
+    return m;
+  }
+  static std::condition_variable &cond() {
+    static std::condition_variable c;
+    return c;
+  }
+  static State &state() {
+    static State st;
+    return st;
+  }
+
   bool ok_;
   char cwd_[256];
 };
@@ -99,9 +136,12 @@ class KBuildHelper {
   explicit KBuildHelper(const std::string &kdir, bool has_source_dir);
   int get_flags(const char *uname_machine, std::vector<std::string> *cflags);
  private:
+  int compute_flags(const char *uname_machine, std::vector<std::string> *cflags);
   std::string kdir_;
   bool has_source_dir_;
 };
 
+// Extract the headers of the running kernel from /sys/kernel/kheaders.tar.xz
+// unless a previous process did, and return their directory in dir.
 int get_proc_kheaders(std::string &dir);
 }  // namespace ebpf
@@ -17,8 +17,10 @@
 #include <map>
 #include <string>
 #include <algorithm>
+#include <errno.h>
 #include <fcntl.h>
 #include <ftw.h>
+#include <limits.h>
 #include <map>
 #include <stdlib.h>
 #include <stdio.h>
@@ -29,6 +31,7 @@
 #include <unistd.h>
 #include <utility>
 #include <vector>
+#include <functional>
 #include <iostream>
 #include <linux/bpf.h>
 
@@ -48,6 +51,7 @@
 #include <clang/FrontendTool/Utils.h>
 #include <clang/Lex/PreprocessorOptions.h>
 
+#include <llvm/Config/llvm-config.h>
 #include <llvm/IR/Module.h>
 
 #include "bcc_exception.h"
@@ -152,6 +156,109 @@ static int CreateFromArgs(clang::CompilerInvocation &invocation,
 
 }
 
+// Precompiled headers are generated from this virtual file, which includes
+// everything passed with -include on the command line.
+static const char *PCH_SRC_PATH = "/virtual/include/bcc/pch.h";
+
+// Returns the path of a precompiled header covering the bcc headers and the
+// kernel headers that are implicitly included in every program, generating it
+// first if needed. Returns an empty string if precompiled headers are disabled
+// or could not be generated, in which case the headers are parsed as usual.
+string ClangLoader::get_pch(const llvm::opt::ArgStringList &ccargs,
+                            clang::DiagnosticsEngine &diags)
+{
+  const char *pch_dir = ::getenv("BCC_PCH_DIR");
+  if (!pch_dir || !*pch_dir)
+    return "";
+
+  // The -cc1 arguments pin down the include paths, macros and language
+  // options, and the kernel build is covered by uname. The exported headers
+  // are remapped in memory, so hash their content as well.
+  struct utsname un;
+  uname(&un);
+  string key = string(LLVM_VERSION_STRING) + '\0' + un.release + '\0' +
+               un.version + '\0';
+  for (auto arg : ccargs)
+    key += string(arg) + '\0';
+  for (const auto &f : remapped_headers_)
+    key += f.first + '\0' + f.second->getBuffer().str() + '\0';
+
+  char name[32];
+  ::snprintf(name, sizeof(name), "%016zx", std::hash<string>()(key));
+  string pch_path = string(pch_dir) + "/" + name + ".pch";
+  struct stat st;
+  if (::stat(pch_path.c_str(), &st) == 0)
+    return pch_path;
+
+  if (mkdir(pch_dir, 0755) && errno != EEXIST)
+    return "";
+
+  clang::CompilerInstance compiler;
+  clang::CompilerInvocation &invocation = compiler.getInvocation();
+  if (!CreateFromArgs(invocation, ccargs, diags))
+    return "";
+  add_remapped_includes(invocation);
+
+  // -include paths are relative to the kernel directory we are running in
+  string pch_src;
+  clang::PreprocessorOptions &pp_opts = invocation.getPreprocessorOpts();
+  char cwd[PATH_MAX];
+  if (!getcwd(cwd, sizeof(cwd)))
+    return "";
+  for (const auto &inc : pp_opts.Includes) {
+    if (inc[0] == '/')
+      pch_src += "#include \"" + inc + "\"\n";
+    else
+      pch_src += "#include \"" + string(cwd) + "/" + inc + "\"\n";
+  }
+  pp_opts.Includes.clear();
+  unique_ptr<llvm::MemoryBuffer> pch_buf =
+      llvm::MemoryBuffer::getMemBuffer(pch_src);
+  pp_opts.addRemappedFile(PCH_SRC_PATH, &*pch_buf);
+
+  clang::FrontendOptions &fe_opts = invocation.getFrontendOpts();
+  fe_opts.Inputs.clear();
+  fe_opts.Inputs.push_back(clang::FrontendInputFile(
+      PCH_SRC_PATH, clang::FrontendOptions::getInputKindForExtension("h")));
+  // Write to a private file first so concurrent compilations never pick up a
+  // partially written header.
+  string tmp_path = pch_path + ".tmp." + std::to_string(getpid()) + "." +
+                    std::to_string((uintptr_t)this);
+  fe_opts.OutputFile = tmp_path;
+  fe_opts.ProgramAction = clang::frontend::GeneratePCH;
+  fe_opts.DisableFree = false;
+
+  compiler.createDiagnostics(new clang::IgnoringDiagConsumer());
+  clang::GeneratePCHAction pch_act;
+  if (!compiler.ExecuteAction(pch_act) || ::rename(tmp_path.c_str(), pch_path.c_str())) {
+    ::unlink(tmp_path.c_str());
+    return "";
+  }
+
+  return pch_path;
+}
+
+// Replace the implicitly included headers of the invocation with the
+// precompiled header returned by get_pch().
+void ClangLoader::use_pch(clang::CompilerInvocation& invocation,
+                          const std::string &pch_path)
+{
+  if (pch_path.empty())
+    return;
+
+  clang::PreprocessorOptions &pp_opts = invocation.getPreprocessorOpts();
+  pp_opts.Includes.clear();
+  pp_opts.ImplicitPCHInclude = pch_path;
+  // The remapped headers have no timestamps to validate against, and the PCH
+  // file name already encodes their content.
+#if LLVM_MAJOR_VERSION >= 13
+  pp_opts.DisablePCHOrModuleValidation =
+      clang::DisableValidationForModuleKind::PCH;
+#else
+  pp_opts.DisablePCHValidation = true;
+#endif
+}
+
 int ClangLoader::parse(unique_ptr<llvm::Module> *mod, TableStorage &ts,
                        const string &file, bool in_memory, const char *cflags[],
                        int ncflags, const std::string &id, FuncSource &func_src,
@@ -407,6 +514,8 @@ int ClangLoader::do_compile(unique_ptr<llvm::Module> *mod, TableStorage &ts,
     llvm::errs() << "\n";
   }
 
+  string pch_path = get_pch(ccargs, diags);
+
   // pre-compilation pass for generating tracepoint structures
   CompilerInstance compiler0;
   CompilerInvocation &invocation0 = compiler0.getInvocation();
@@ -414,6 +523,7 @@ int ClangLoader::do_compile(unique_ptr<llvm::Module> *mod, TableStorage &ts,
     return -1;
 
   add_remapped_includes(invocation0);
+  use_pch(invocation0, pch_path);
 
   if (in_memory) {
     add_main_input(invocation0, main_path, &*main_buf);
@@ -436,6 +546,7 @@ int ClangLoader::do_compile(unique_ptr<llvm::Module> *mod, TableStorage &ts,
     return -1;
 
   add_remapped_includes(invocation1);
+  use_pch(invocation1, pch_path);
   add_main_input(invocation1, main_path, &*out_buf);
   invocation1.getFrontendOpts().DisableFree = false;
 
@@ -457,6 +568,7 @@ int ClangLoader::do_compile(unique_ptr<llvm::Module> *mod, TableStorage &ts,
     return -1;
 
   add_remapped_includes(invocation2);
+  use_pch(invocation2, pch_path);
   add_main_input(invocation2, main_path, &*out_buf1);
   invocation2.getFrontendOpts().DisableFree = false;
   invocation2.getCodeGenOpts().DisableFree = false;
@@ -475,26 +587,4 @@ int ClangLoader::do_compile(unique_ptr<llvm::Module> *mod, TableStorage &ts,
   return 0;
 }
 
-const char * FuncSource::src(const std::string& name) {
-  auto src = funcs_.find(name);
-  if (src == funcs_.end())
-    return "";
-  return src->second.src_.data();
-}
-
-const char * FuncSource::src_rewritten(const std::string& name) {
-  auto src = funcs_.find(name);
-  if (src == funcs_.end())
-    return "";
-  return src->second.src_rewritten_.data();
-}
-
-void FuncSource::set_src(const std::string& name, const std::string& src) {
-  funcs_[name].src_ = src;
-}
-
-void FuncSource::set_src_rewritten(const std::string& name, const std::string& src) {
-  funcs_[name].src_rewritten_ = src;
-}
-
 }  // namespace ebpf
@@ -21,6 +21,7 @@
 #include <string>
 
 #include <clang/Frontend/CompilerInvocation.h>
+#include <llvm/Option/ArgList.h>
 
 #include "table_storage.h"
 
@@ -75,6 +76,10 @@ class ClangLoader {
   void add_main_input(clang::CompilerInvocation& invocation,
                       const std::string& main_path,
                       llvm::MemoryBuffer *main_buf);
+  std::string get_pch(const llvm::opt::ArgStringList &ccargs,
+                      clang::DiagnosticsEngine &diags);
+  void use_pch(clang::CompilerInvocation& invocation,
+               const std::string &pch_path);
 
  private:
   std::map<std::string, std::unique_ptr<llvm::MemoryBuffer>> remapped_headers_;
@@ -13,13 +13,18 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <dirent.h>
+#include <fcntl.h>
 #include <linux/bpf.h>
 #include <linux/version.h>
+#include <sys/stat.h>
 #include <sys/utsname.h>
 #include <unistd.h>
 
 #include <fstream>
+#include <mutex>
 #include <regex>
+#include <sstream>
 
 #include <clang/AST/ASTConsumer.h>
 #include <clang/AST/ASTContext.h>
@@ -30,7 +35,9 @@
 
 #include "frontend_action_common.h"
 #include "tp_frontend_action.h"
+#include "bcc_libbpf_inc.h"
 #include "common.h"
+#include "libbpf.h"
 
 namespace ebpf {
 
@@ -51,15 +58,232 @@ TracepointTypeVisitor::TracepointTypeVisitor(ASTContext &C, Rewriter &rewriter)
     : diag_(C.getDiagnostics()), rewriter_(rewriter), out_(llvm::errs()) {
 }
 
+namespace {
+
+// Tracepoint formats only change when the kernel does, so the structs made
+// from them are kept for the life of the process and, with
+// $BCC_OBJ_CACHE_DIR set, in a file for the current boot that is shared by
+// all processes. Each record is "<category>/<event> <length>\n<struct>".
+class TracepointStructCache {
+ public:
+  bool lookup(const string &key, string &tp_struct) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    load();
+    auto it = structs_.find(key);
+    if (it == structs_.end())
+      return false;
+    tp_struct = it->second;
+    return true;
+  }
+
+  void insert(const string &key, const string &tp_struct) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    structs_[key] = tp_struct;
+    if (path_.empty())
+      return;
+    // A single O_APPEND write keeps records of concurrent writers whole.
+    string record = key + " " + to_string(tp_struct.size()) + "\n" + tp_struct;
+    int fd = ::open(path_.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+                    0644);
+    if (fd < 0)
+      return;
+    if (::write(fd, record.data(), record.size()) < 0) {
+      // The cache is an optimization only
+    }
+    ::close(fd);
+  }
+
+ private:
+  void load() {
+    if (loaded_)
+      return;
+    loaded_ = true;
+    const char *dir = ::getenv("BCC_OBJ_CACHE_DIR");
+    if (!dir || !*dir)
+      return;
+    ifstream boot_id_file("/proc/sys/kernel/random/boot_id");
+    string boot_id;
+    if (!getline(boot_id_file, boot_id) || boot_id.empty())
+      return;
+    path_ = string(dir) + "/tracepoints." + boot_id;
+
+    ifstream input(path_);
+    if (!input) {
+      remove_stale(dir);
+      return;
+    }
+    string key;
+    size_t len;
+    while (input >> key >> len && input.get() == '\n') {
+      string tp_struct(len, '\0');
+      if (!input.read(&tp_struct[0], len))
+        break;
+      structs_.emplace(key, std::move(tp_struct));
+    }
+  }
+
+  // Drop the files of earlier boots when starting the one of this boot
+  static void remove_stale(const char *dir) {
+    DIR *d = ::opendir(dir);
+    if (!d)
+      return;
+    while (struct dirent *ent = ::readdir(d)) {
+      if (!strncmp(ent->d_name, "tracepoints.", 12))
+        ::unlinkat(dirfd(d), ent->d_name, 0);
+    }
+    ::closedir(d);
+  }
+
+  std::mutex mutex_;
+  bool loaded_ = false;
+  string path_;
+  map<string, string> structs_;
+};
+
+TracepointStructCache tp_struct_cache;
+
+// Declare a member of BTF type id named decl, e.g. "char comm[16]". Only the
+// types that tracepoint fields are made of are handled.
+bool btf_type_decl(const struct btf *btf, __u32 id, const string &decl,
+                   string &out) {
+  const struct btf_type *t = btf__type_by_id(btf, id);
+  if (!t)
+    return false;
+  switch (btf_kind(t)) {
+  case BTF_KIND_INT:
+  case BTF_KIND_TYPEDEF:
+    out = string(btf__name_by_offset(btf, t->name_off)) + " " + decl;
+    return true;
+  case BTF_KIND_ENUM: {
+    const char *name = btf__name_by_offset(btf, t->name_off);
+    if (name && *name)
+      out = "enum " + string(name) + " " + decl;
+    else
+      out = (t->size == 8 ? "s64 " : "int ") + decl;
+    return true;
+  }
+  case BTF_KIND_CONST:
+  case BTF_KIND_VOLATILE:
+  case BTF_KIND_RESTRICT:
+    return btf_type_decl(btf, t->type, decl, out);
+  case BTF_KIND_ARRAY: {
+    const struct btf_array *arr = btf_array(t);
+    return btf_type_decl(btf, arr->type,
+                         decl + "[" + to_string(arr->nelems) + "]", out);
+  }
+  case BTF_KIND_PTR: {
+    const struct btf_type *pointee = btf__type_by_id(btf, t->type);
+    while (pointee && (btf_is_const(pointee) || btf_is_volatile(pointee) ||
+                       btf_is_restrict(pointee)))
+      pointee = btf__type_by_id(btf, pointee->type);
+    if (pointee && (btf_is_struct(pointee) || btf_is_union(pointee))) {
+      const char *name = btf__name_by_offset(btf, pointee->name_off);
+      if (name && *name) {
+        out = string(btf_is_struct(pointee) ? "struct " : "union ") + name +
+              " *" + decl;
+        return true;
+      }
+    }
+    if (t->type == 0 || !pointee || btf_is_func_proto(pointee) ||
+        btf_is_struct(pointee) || btf_is_union(pointee) ||
+        btf_is_fwd(pointee)) {
+      out = "void *" + decl;
+      return true;
+    }
+    // Arrays need parentheses, e.g. char (*p)[16]
+    return btf_type_decl(btf, t->type,
+                         btf_is_array(pointee) ? "(*" + decl + ")" : "*" + decl,
+                         out);
+  }
+  default:
+    // Structs, unions and the like need definitions the program may lack
+    return false;
+  }
+}
+
+// Make the struct of category:event from the vmlinux BTF type of its record,
+// trace_event_raw_<event>, the same way parse_tracepoint() makes it from the
+// format file. That is the type of the class of events defined by
+// TRACE_EVENT(), other events are made from classes of another name, and the
+// btf_trace_<event> typedef that the kernel has for each event rules out
+// module events. Returns "" if the type isn't there or has fields that the
+// format file would describe differently.
+string btf_tracepoint_struct(const struct btf *btf, const string &category,
+                             const string &event) {
+  if (btf__find_by_name_kind(btf, ("btf_trace_" + event).c_str(),
+                             BTF_KIND_TYPEDEF) < 0)
+    return "";
+  int id = btf__find_by_name_kind(btf, ("trace_event_raw_" + event).c_str(),
+                                  BTF_KIND_STRUCT);
+  if (id < 0)
+    return "";
+  const struct btf_type *t = btf__type_by_id(btf, id);
+  const struct btf_member *m = btf_members(t);
+  int vlen = btf_vlen(t);
+  if (vlen < 1 || strcmp(btf__name_by_offset(btf, m->name_off), "ent"))
+    return "";
+  int64_t last_offset = btf__resolve_size(btf, m->type);
+  if (last_offset < 8)
+    return "";
+
+  string tp_struct = "struct tracepoint__" + category + "__" + event + " {\n";
+  tp_struct += "\tu64 __do_not_use__;\n";
+  for (int common_offset = 8; common_offset < last_offset; common_offset++)
+    tp_struct += "\tchar __do_not_use__" + to_string(common_offset) + ";\n";
+
+  for (int i = 1; i < vlen; i++) {
+    string name = btf__name_by_offset(btf, m[i].name_off);
+    int64_t size = btf__resolve_size(btf, m[i].type);
+    const struct btf_type *mt = btf__type_by_id(btf, m[i].type);
+    uint32_t bit_offset = btf_member_bit_offset(t, i);
+    if (size < 0 || bit_offset % 8 || btf_member_bitfield_size(t, i))
+      return "";
+    if (btf_is_int(mt) && btf_int_bits(mt) != size * 8)
+      return "";
+    int64_t offset = bit_offset / 8;
+    // The flexible array at the end holds the dynamic fields
+    if (name == "__data" && size == 0)
+      break;
+    for (; last_offset < offset; last_offset++)
+      tp_struct += "\tchar __pad_" + to_string(last_offset) + ";\n";
+    if (name.compare(0, 11, "__data_loc_") == 0) {
+      tp_struct += "\tint data_loc_" + name.substr(11) + ";\n";
+    } else {
+      string decl;
+      if (name.empty() || name.compare(0, 10, "__rel_loc_") == 0 ||
+          !btf_type_decl(btf, m[i].type, name, decl))
+        return "";
+      tp_struct += "\t" + decl + ";\n";
+    }
+    last_offset = offset + size;
+  }
+
+  tp_struct += "};\n";
+  return tp_struct;
+}
+
+}  // namespace
+
 string TracepointTypeVisitor::GenerateTracepointStruct(
     SourceLocation loc, string const& category, string const& event) {
-  string format_file = "/sys/kernel/debug/tracing/events/" +
-    category + "/" + event + "/format";
-  ifstream input(format_file.c_str());
-  if (!input)
-    return "";
+  string key = category + "/" + event, tp_struct;
+  if (tp_struct_cache.lookup(key, tp_struct))
+    return tp_struct;
 
-  return ebpf::parse_tracepoint(input, category, event);
+  if (const struct btf *btf = bcc_vmlinux_btf_get()) {
+    tp_struct = btf_tracepoint_struct(btf, category, event);
+    bcc_vmlinux_btf_put(btf);
+  }
+  if (tp_struct.empty()) {
+    string format_file = "/sys/kernel/debug/tracing/events/" +
+      category + "/" + event + "/format";
+    ifstream input(format_file.c_str());
+    if (!input)
+      return "";
+    tp_struct = ebpf::parse_tracepoint(input, category, event);
+  }
+  tp_struct_cache.insert(key, tp_struct);
+  return tp_struct;
 }
 
 static inline bool _is_tracepoint_struct_type(string const& type_name,
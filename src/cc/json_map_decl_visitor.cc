@@ -23,6 +23,7 @@
 #include <llvm/ADT/StringExtras.h>
 #include "common.h"
 #include "table_desc.h"
+#include "bpf_module_compiler.h"
 
 namespace ebpf {
 
@@ -186,8 +187,8 @@ class JsonMapTypesVisitor : public virtual MapTypesVisitor {
   }
 };
 
-unique_ptr<MapTypesVisitor> createJsonMapTypesVisitor() {
-  return make_unique<JsonMapTypesVisitor>();
-}
-
 }  // namespace ebpf
+
+ebpf::MapTypesVisitor *bcc_json_map_types_visitor_new() {
+  return new ebpf::JsonMapTypesVisitor();
+}
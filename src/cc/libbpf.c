@@ -34,6 +34,7 @@
 #include <linux/version.h>
 #include <net/ethernet.h>
 #include <net/if.h>
+#include <pthread.h>
 #include <sched.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -48,6 +49,7 @@
 #include <unistd.h>
 #include <linux/if_alg.h>
 
+#include "bcc_metrics.h"
 #include "libbpf.h"
 #include "perf_reader.h"
 
@@ -367,44 +369,52 @@ int bcc_create_map(enum bpf_map_type map_type, const char *name,
 
 int bpf_update_elem(int fd, void *key, void *value, unsigned long long flags)
 {
+  bcc_metric_add(BCC_METRIC_TABLE_SYSCALLS, 1);
   return bpf_map_update_elem(fd, key, value, flags);
 }
 
 int bpf_lookup_elem(int fd, void *key, void *value)
 {
+  bcc_metric_add(BCC_METRIC_TABLE_SYSCALLS, 1);
   return bpf_map_lookup_elem(fd, key, value);
 }
 
 int bpf_delete_elem(int fd, void *key)
 {
+  bcc_metric_add(BCC_METRIC_TABLE_SYSCALLS, 1);
   return bpf_map_delete_elem(fd, key);
 }
 
 int bpf_lookup_and_delete(int fd, void *key, void *value)
 {
+  bcc_metric_add(BCC_METRIC_TABLE_SYSCALLS, 1);
   return bpf_map_lookup_and_delete_elem(fd, key, value);
 }
 
 int bpf_lookup_batch(int fd, __u32 *in_batch, __u32 *out_batch, void *keys,
                      void *values, __u32 *count)
 {
+  bcc_metric_add(BCC_METRIC_TABLE_BATCH_SYSCALLS, 1);
   return bpf_map_lookup_batch(fd, in_batch, out_batch, keys, values, count,
                               NULL);
 }
 
 int bpf_delete_batch(int fd,  void *keys, __u32 *count)
 {
+  bcc_metric_add(BCC_METRIC_TABLE_BATCH_SYSCALLS, 1);
   return bpf_map_delete_batch(fd, keys, count, NULL);
 }
 
 int bpf_update_batch(int fd, void *keys, void *values, __u32 *count)
 {
+  bcc_metric_add(BCC_METRIC_TABLE_BATCH_SYSCALLS, 1);
   return bpf_map_update_batch(fd, keys, values, count, NULL);
 }
 
 int bpf_lookup_and_delete_batch(int fd, __u32 *in_batch, __u32 *out_batch,
                                 void *keys, void *values, __u32 *count)
 {
+  bcc_metric_add(BCC_METRIC_TABLE_BATCH_SYSCALLS, 1);
   return bpf_map_lookup_and_delete_batch(fd, in_batch, out_batch, keys, values,
                                          count, NULL);
 }
@@ -415,6 +425,7 @@ int bpf_get_first_key(int fd, void *key, size_t key_size)
 
   // 4.12 and above kernel supports passing NULL to BPF_MAP_GET_NEXT_KEY
   // to get first key of the map. For older kernels, the call will fail.
+  bcc_metric_add(BCC_METRIC_TABLE_SYSCALLS, 1);
   res = bpf_map_get_next_key(fd, 0, key);
   if (res < 0 && errno == EFAULT) {
     // Fall back to try to find a non-existing key.
@@ -442,6 +453,7 @@ int bpf_get_first_key(int fd, void *key, size_t key_size)
 
 int bpf_get_next_key(int fd, void *key, void *next_key)
 {
+  bcc_metric_add(BCC_METRIC_TABLE_SYSCALLS, 1);
   return bpf_map_get_next_key(fd, key, next_key);
 }
 
@@ -608,12 +620,274 @@ int bpf_prog_get_tag(int fd, unsigned long long *ptag)
   return 0;
 }
 
-int bcc_prog_load_xattr(struct bpf_load_program_attr *attr, int prog_len,
-                        char *log_buf, unsigned log_buf_size, bool allow_rlimit)
+int bcc_enable_run_stats(void)
+{
+  int fd = bpf_enable_stats(BPF_STATS_RUN_TIME);
+  if (fd < 0) {
+    // older libbpf returns -1 and sets errno, newer returns -errno
+    if (fd != -1)
+      errno = -fd;
+    return -1;
+  }
+  return fd;
+}
+
+int bcc_prog_run_stats(int prog_fd, uint64_t *run_cnt, uint64_t *run_time_ns)
+{
+  struct bpf_prog_info info = {};
+  uint32_t info_len = sizeof(info);
+
+  if (bpf_obj_get_info_by_fd(prog_fd, &info, &info_len))
+    return -1;
+  // both stay 0 on kernels older than the stats
+  *run_cnt = info.run_cnt;
+  *run_time_ns = info.run_time_ns;
+  return 0;
+}
+
+static uint64_t fd_memlock(int fd)
+{
+  char path[64], line[128];
+  unsigned long long memlock = 0;
+  FILE *f;
+
+  snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", fd);
+  f = fopen(path, "r");
+  if (!f)
+    return 0;
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "memlock: %llu", &memlock) == 1)
+      break;
+  }
+  fclose(f);
+  return memlock;
+}
+
+static int map_is_array(uint32_t type)
+{
+  switch (type) {
+  case BPF_MAP_TYPE_ARRAY:
+  case BPF_MAP_TYPE_PERCPU_ARRAY:
+  case BPF_MAP_TYPE_PROG_ARRAY:
+  case BPF_MAP_TYPE_PERF_EVENT_ARRAY:
+  case BPF_MAP_TYPE_CGROUP_ARRAY:
+  case BPF_MAP_TYPE_ARRAY_OF_MAPS:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+int bcc_map_mem_info(int map_fd, struct bcc_map_mem *mem, int count_entries)
+{
+  struct bpf_map_info info = {};
+  uint32_t info_len = sizeof(info);
+  void *key, *next_key, *tmp;
+
+  if (bpf_obj_get_info_by_fd(map_fd, &info, &info_len))
+    return -1;
+  memset(mem, 0, sizeof(*mem));
+  mem->type = info.type;
+  mem->key_size = info.key_size;
+  mem->value_size = info.value_size;
+  mem->max_entries = info.max_entries;
+  mem->memlock = fd_memlock(map_fd);
+  if (!count_entries)
+    return 0;
+  if (map_is_array(info.type)) {
+    mem->entries = info.max_entries;
+    return 0;
+  }
+  // maps without keys, like ring buffers and stacks, fail the first call
+  if (!info.key_size)
+    return 0;
+  key = calloc(2, info.key_size);
+  if (!key)
+    return -1;
+  next_key = (char *)key + info.key_size;
+  if (bpf_get_next_key(map_fd, NULL, next_key) == 0) {
+    do {
+      mem->entries++;
+      tmp = key;
+      key = next_key;
+      next_key = tmp;
+    } while (mem->entries < info.max_entries &&
+             bpf_get_next_key(map_fd, key, next_key) == 0);
+  }
+  free(key < next_key ? key : next_key);
+  return 0;
+}
+
+int bcc_prog_mem_info(int prog_fd, struct bcc_prog_mem *mem)
+{
+  struct bpf_prog_info info = {};
+  uint32_t info_len = sizeof(info);
+
+  if (bpf_obj_get_info_by_fd(prog_fd, &info, &info_len))
+    return -1;
+  mem->jited_len = info.jited_prog_len;
+  mem->xlated_len = info.xlated_prog_len;
+  mem->memlock = fd_memlock(prog_fd);
+  return 0;
+}
+
+int bcc_flip_epoch(int outer_fd)
+{
+  int active = 0, idle = 1, active_fd, idle_fd, err, saved_errno;
+  uint32_t active_id, idle_id;
+
+  // arrays of maps hold the ids of their maps for user space
+  if (bpf_lookup_elem(outer_fd, &active, &active_id) ||
+      bpf_lookup_elem(outer_fd, &idle, &idle_id))
+    return -1;
+  active_fd = bpf_map_get_fd_by_id(active_id);
+  if (active_fd < 0)
+    return -1;
+  idle_fd = bpf_map_get_fd_by_id(idle_id);
+  if (idle_fd < 0) {
+    saved_errno = errno;
+    close(active_fd);
+    errno = saved_errno;
+    return -1;
+  }
+
+  err = bpf_update_elem(outer_fd, &active, &idle_fd, BPF_ANY);
+  if (!err)
+    err = bpf_update_elem(outer_fd, &idle, &active_fd, BPF_ANY);
+  saved_errno = errno;
+  close(idle_fd);
+  if (err) {
+    close(active_fd);
+    errno = saved_errno;
+    return -1;
+  }
+  return active_fd;
+}
+
+/*
+ * The vmlinux BTF is several MB to parse, so it is parsed on first use and
+ * kept for the whole process. A failure to find it is remembered as well.
+ * bcc_vmlinux_btf_drop_cache() frees it once its last user is done.
+ */
+static pthread_mutex_t vmlinux_btf_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct btf *vmlinux_btf;
+static int vmlinux_btf_refs;
+static bool vmlinux_btf_missing;
+static bool vmlinux_btf_dropped;
+
+const struct btf *bcc_vmlinux_btf_get(void)
+{
+  struct btf *btf;
+
+  pthread_mutex_lock(&vmlinux_btf_lock);
+  if (!vmlinux_btf && !vmlinux_btf_missing) {
+    btf = btf__load_vmlinux_btf();
+    if (libbpf_get_error(btf))
+      vmlinux_btf_missing = true;
+    else
+      vmlinux_btf = btf;
+  }
+  btf = vmlinux_btf;
+  if (btf)
+    vmlinux_btf_refs++;
+  pthread_mutex_unlock(&vmlinux_btf_lock);
+  return btf;
+}
+
+static void vmlinux_btf_free_locked(void)
+{
+  btf__free(vmlinux_btf);
+  vmlinux_btf = NULL;
+  vmlinux_btf_dropped = false;
+}
+
+void bcc_vmlinux_btf_put(const struct btf *btf)
+{
+  if (!btf)
+    return;
+  pthread_mutex_lock(&vmlinux_btf_lock);
+  if (--vmlinux_btf_refs == 0 && vmlinux_btf_dropped)
+    vmlinux_btf_free_locked();
+  pthread_mutex_unlock(&vmlinux_btf_lock);
+}
+
+void bcc_vmlinux_btf_drop_cache(void)
+{
+  pthread_mutex_lock(&vmlinux_btf_lock);
+  vmlinux_btf_missing = false;
+  if (vmlinux_btf_refs == 0)
+    vmlinux_btf_free_locked();
+  else
+    vmlinux_btf_dropped = true;
+  pthread_mutex_unlock(&vmlinux_btf_lock);
+}
+
+/*
+ * libbpf_find_vmlinux_btf_id() over the shared vmlinux BTF rather than one
+ * parsed for the call. Returns -EINVAL without vmlinux BTF like it does.
+ */
+static int bcc_find_vmlinux_btf_id(const char *name,
+                                   enum bpf_attach_type attach_type)
+{
+  const struct btf *btf;
+  const char *prefix = "";
+  char type_name[256];
+  int ret;
+
+  if (attach_type == BPF_TRACE_ITER)
+    prefix = "bpf_iter_";
+  else if (attach_type == BPF_LSM_MAC)
+    prefix = "bpf_lsm_";
+  if (snprintf(type_name, sizeof(type_name), "%s%s", prefix, name) >=
+      (int)sizeof(type_name))
+    return -ENAMETOOLONG;
+
+  btf = bcc_vmlinux_btf_get();
+  if (!btf)
+    return -EINVAL;
+  ret = btf__find_by_name_kind(btf, type_name, BTF_KIND_FUNC);
+  bcc_vmlinux_btf_put(btf);
+  return ret;
+}
+
+// Grow the buffer *buf of *size bytes to at least size bytes, keeping it as
+// is on failure.
+static int grow_log_buf(char **buf, unsigned *size, unsigned new_size)
+{
+  char *new_buf;
+
+  if (*buf && *size >= new_size)
+    return 0;
+  new_buf = realloc(*buf, new_size);
+  if (!new_buf) {
+    fprintf(stderr, "bpf: Failed to allocate temporary log buffer: %s\n\n",
+            strerror(errno));
+    return -1;
+  }
+  *buf = new_buf;
+  *size = new_size;
+  return 0;
+}
+
+// The kernel rejects logs of UINT_MAX >> 2 bytes or more
+#define MAX_LOG_BUF_SIZE ((UINT32_MAX >> 2) - 1)
+
+static unsigned next_log_buf_size(unsigned size)
+{
+  return size >= MAX_LOG_BUF_SIZE / 4 ? MAX_LOG_BUF_SIZE : size * 4;
+}
+
+// Without a user log buffer, the log goes to *tmp_log_buf, which is grown as
+// needed and left to the caller.
+static int prog_load(struct bpf_load_program_attr *attr, int prog_len,
+                     char *log_buf, unsigned log_buf_size,
+                     char **tmp_log_buf, unsigned *tmp_log_buf_size,
+                     bool allow_rlimit)
 {
   unsigned name_len = attr->name ? strlen(attr->name) : 0;
-  char *tmp_log_buf = NULL, *attr_log_buf = NULL;
-  unsigned tmp_log_buf_size = 0, attr_log_buf_size = 0;
+  char *attr_log_buf = NULL;
+  unsigned attr_log_buf_size = 0;
+  int initial_log_level = attr->log_level;
   int ret = 0, name_offset = 0, expected_attach_type = 0;
   char prog_name[BPF_OBJ_NAME_LEN] = {};
 
@@ -627,17 +901,13 @@ int bcc_prog_load_xattr(struct bpf_load_program_attr *attr, int prog_len,
       attr_log_buf = log_buf;
       attr_log_buf_size = log_buf_size;
     } else {
-      // Create and use temporary log buffer if user didn't provide one.
-      tmp_log_buf_size = LOG_BUF_SIZE;
-      tmp_log_buf = malloc(tmp_log_buf_size);
-      if (!tmp_log_buf) {
-        fprintf(stderr, "bpf: Failed to allocate temporary log buffer: %s\n\n",
-                strerror(errno));
+      // Use the temporary log buffer if user didn't provide one.
+      if (grow_log_buf(tmp_log_buf, tmp_log_buf_size, LOG_BUF_SIZE)) {
         attr->log_level = 0;
       } else {
-        tmp_log_buf[0] = 0;
-        attr_log_buf = tmp_log_buf;
-        attr_log_buf_size = tmp_log_buf_size;
+        (*tmp_log_buf)[0] = 0;
+        attr_log_buf = *tmp_log_buf;
+        attr_log_buf_size = *tmp_log_buf_size;
       }
     }
   }
@@ -670,8 +940,8 @@ int bcc_prog_load_xattr(struct bpf_load_program_attr *attr, int prog_len,
 
     if (attr->prog_type == BPF_PROG_TYPE_TRACING ||
         attr->prog_type == BPF_PROG_TYPE_LSM) {
-      ret = libbpf_find_vmlinux_btf_id(attr->name + name_offset,
-                                       expected_attach_type);
+      ret = bcc_find_vmlinux_btf_id(attr->name + name_offset,
+                                    expected_attach_type);
       if (ret == -EINVAL) {
         fprintf(stderr, "bpf: vmlinux BTF is not found\n");
         return ret;
@@ -754,33 +1024,36 @@ int bcc_prog_load_xattr(struct bpf_load_program_attr *attr, int prog_len,
       goto return_result;
     }
 
-    // User did not provide log buffer. We will try to increase size of
-    // our temporary log buffer to get full error message.
-    if (tmp_log_buf)
-      free(tmp_log_buf);
-    tmp_log_buf_size = LOG_BUF_SIZE;
+    // User did not provide log buffer. Unless the load was already logged
+    // in full, load again with logging, growing the temporary log buffer
+    // until the whole message fits. Each attempt is a full verification, so
+    // grow by large steps.
+    unsigned want = LOG_BUF_SIZE;
+    if (initial_log_level > 0 && attr->log_level > 0) {
+      if (errno != ENOSPC)
+        goto print_log;
+      want = next_log_buf_size(*tmp_log_buf_size);
+    }
     if (attr->log_level == 0)
       attr->log_level = 1;
+    if (grow_log_buf(tmp_log_buf, tmp_log_buf_size, want))
+      goto return_result;
     for (;;) {
-      tmp_log_buf = malloc(tmp_log_buf_size);
-      if (!tmp_log_buf) {
-        fprintf(stderr, "bpf: Failed to allocate temporary log buffer: %s\n\n",
-                strerror(errno));
-        goto return_result;
-      }
-      tmp_log_buf[0] = 0;
-      ret = bpf_load_program_xattr(attr, tmp_log_buf, tmp_log_buf_size);
-      if (ret < 0 && errno == ENOSPC) {
-        // Temporary buffer size is not enough. Double it and try again.
-        free(tmp_log_buf);
-        tmp_log_buf = NULL;
-        tmp_log_buf_size <<= 1;
+      (*tmp_log_buf)[0] = 0;
+      ret = bpf_load_program_xattr(attr, *tmp_log_buf, *tmp_log_buf_size);
+      if (ret < 0 && errno == ENOSPC &&
+          *tmp_log_buf_size < next_log_buf_size(*tmp_log_buf_size)) {
+        // Temporary buffer size is not enough. Grow it and try again.
+        if (grow_log_buf(tmp_log_buf, tmp_log_buf_size,
+                         next_log_buf_size(*tmp_log_buf_size)))
+          goto return_result;
       } else {
         break;
       }
     }
   }
 
+print_log:
   // Check if we should print the log message if log_level is not 0,
   // either specified by user or set due to error.
   if (attr->log_level > 0) {
@@ -788,16 +1061,37 @@ int bcc_prog_load_xattr(struct bpf_load_program_attr *attr, int prog_len,
     // but there is no error.
     if (log_buf && ret < 0)
       bpf_print_hints(ret, log_buf);
-    else if (tmp_log_buf)
-      bpf_print_hints(ret, tmp_log_buf);
+    else if (!log_buf_size && *tmp_log_buf)
+      bpf_print_hints(ret, *tmp_log_buf);
   }
 
 return_result:
-  if (tmp_log_buf)
-    free(tmp_log_buf);
   return ret;
 }
 
+int bcc_prog_load_xattr(struct bpf_load_program_attr *attr, int prog_len,
+                        char *log_buf, unsigned log_buf_size, bool allow_rlimit)
+{
+  char *tmp_log_buf = NULL;
+  unsigned tmp_log_buf_size = 0;
+  int ret, err;
+
+  ret = prog_load(attr, prog_len, log_buf, log_buf_size, &tmp_log_buf,
+                  &tmp_log_buf_size, allow_rlimit);
+  err = errno;
+  free(tmp_log_buf);
+  errno = err;
+  return ret;
+}
+
+int bcc_prog_load_xattr_logbuf(struct bpf_load_program_attr *attr,
+                               int prog_len, char **log_buf,
+                               unsigned *log_buf_size, bool allow_rlimit)
+{
+  return prog_load(attr, prog_len, NULL, 0, log_buf, log_buf_size,
+                   allow_rlimit);
+}
+
 int bcc_prog_load(enum bpf_prog_type prog_type, const char *name,
                   const struct bpf_insn *insns, int prog_len,
                   const char *license, unsigned kern_version,
@@ -965,8 +1259,11 @@ static int bpf_try_perf_event_open_with_probe(const char *name, uint64_t offs,
 // In either case, if the attach partially failed (such as issue with the
 // ioctl operations), the **caller** need to clean up the Perf Event FD, either
 // provided by the caller or opened here.
+// With a cookie, the program is attached through a BPF link passing it to
+// bpf_get_attach_cookie(), and pfd is replaced with the link FD, which holds
+// the Perf Event.
 static int bpf_attach_tracing_event(int progfd, const char *event_path, int pid,
-                                    int *pfd)
+                                    int *pfd, const uint64_t *cookie)
 {
   int efd, cpu = 0;
   ssize_t bytes;
@@ -1009,6 +1306,26 @@ static int bpf_attach_tracing_event(int progfd, const char *event_path, int pid,
     }
   }
 
+  if (cookie) {
+    DECLARE_LIBBPF_OPTS(bpf_link_create_opts, link_create_opts);
+    int link_fd;
+
+    link_create_opts.perf_event.bpf_cookie = *cookie;
+    link_fd = bpf_link_create(progfd, *pfd, BPF_PERF_EVENT, &link_create_opts);
+    if (link_fd < 0) {
+      fprintf(stderr, "bpf_link_create(BPF_PERF_EVENT): %s\n", strerror(errno));
+      return -1;
+    }
+    if (ioctl(*pfd, PERF_EVENT_IOC_ENABLE, 0) < 0) {
+      perror("ioctl(PERF_EVENT_IOC_ENABLE)");
+      close(link_fd);
+      return -1;
+    }
+    close(*pfd);
+    *pfd = link_fd;
+    return 0;
+  }
+
   if (ioctl(*pfd, PERF_EVENT_IOC_SET_BPF, progfd) < 0) {
     perror("ioctl(PERF_EVENT_IOC_SET_BPF)");
     return -1;
@@ -1090,7 +1407,7 @@ error:
 static int bpf_attach_probe(int progfd, enum bpf_probe_attach_type attach_type,
                             const char *ev_name, const char *config1, const char* event_type,
                             uint64_t offset, pid_t pid, int maxactive,
-                            uint32_t ref_ctr_offset)
+                            uint32_t ref_ctr_offset, const uint64_t *cookie)
 {
   int kfd, pfd = -1;
   char buf[PATH_MAX], fname[256];
@@ -1150,7 +1467,7 @@ static int bpf_attach_probe(int progfd, enum bpf_probe_attach_type attach_type,
   // Perf Event FD directly and buf would be empty and unused.
   // Otherwise it will read the event ID from the path in buf, create the
   // Perf Event event using that ID, and updated value of pfd.
-  if (bpf_attach_tracing_event(progfd, buf, pid, &pfd) == 0)
+  if (bpf_attach_tracing_event(progfd, buf, pid, &pfd, cookie) == 0)
     return pfd;
 
 error:
@@ -1164,7 +1481,31 @@ int bpf_attach_kprobe(int progfd, enum bpf_probe_attach_type attach_type,
 {
   return bpf_attach_probe(progfd, attach_type,
                           ev_name, fn_name, "kprobe",
-                          fn_offset, -1, maxactive, 0);
+                          fn_offset, -1, maxactive, 0, NULL);
+}
+
+int bpf_attach_kprobe_shared(int progfd, enum bpf_probe_attach_type attach_type,
+                             const char *ev_name, const char *fn_name,
+                             uint64_t fn_offset, int create)
+{
+  char buf[PATH_MAX];
+  int pfd = -1;
+
+  // Unlike those of the perf_kprobe PMU, an event of kprobe_events can be
+  // opened any number of times
+  if (create) {
+    if (create_probe_event(buf, ev_name, attach_type, fn_name, fn_offset,
+                           "kprobe", -1, 0) < 0)
+      return -1;
+  } else {
+    snprintf(buf, sizeof(buf), "/sys/kernel/debug/tracing/events/kprobes/%s_bcc_%d",
+             ev_name, getpid());
+  }
+  if (bpf_attach_tracing_event(progfd, buf, -1, &pfd, NULL) == 0)
+    return pfd;
+
+  bpf_close_perf_event_fd(pfd);
+  return -1;
 }
 
 int bpf_attach_uprobe(int progfd, enum bpf_probe_attach_type attach_type,
@@ -1174,7 +1515,17 @@ int bpf_attach_uprobe(int progfd, enum bpf_probe_attach_type attach_type,
 
   return bpf_attach_probe(progfd, attach_type,
                           ev_name, binary_path, "uprobe",
-                          offset, pid, -1, ref_ctr_offset);
+                          offset, pid, -1, ref_ctr_offset, NULL);
+}
+
+int bpf_attach_uprobe_cookie(int progfd, enum bpf_probe_attach_type attach_type,
+                             const char *ev_name, const char *binary_path,
+                             uint64_t offset, pid_t pid,
+                             uint32_t ref_ctr_offset, uint64_t cookie)
+{
+  return bpf_attach_probe(progfd, attach_type,
+                          ev_name, binary_path, "uprobe",
+                          offset, pid, -1, ref_ctr_offset, &cookie);
 }
 
 static int bpf_detach_probe(const char *ev_name, const char *event_type)
@@ -1255,6 +1606,225 @@ int bpf_detach_uprobe(const char *ev_name)
   return bpf_detach_probe(ev_name, "uprobe");
 }
 
+static int cmp_str(const void *a, const void *b)
+{
+  return strcmp(*(const char **)a, *(const char **)b);
+}
+
+/* Read the "<event_type>s/<name>" of all events in the [k,u]probe_events file
+ * that were created by this process into a sorted array. */
+static char **read_probe_events(const char *event_type, size_t *cnt)
+{
+  char buf[PATH_MAX], suffix[32];
+  char **events = NULL, **tmp, *line = NULL, *name, *end;
+  size_t n = 0, cap = 0, bufsize = 0, suffix_len;
+  FILE *fp;
+
+  snprintf(buf, sizeof(buf), "/sys/kernel/debug/tracing/%s_events", event_type);
+  fp = fopen(buf, "r");
+  if (!fp) {
+    fprintf(stderr, "open(%s): %s\n", buf, strerror(errno));
+    return NULL;
+  }
+  suffix_len = snprintf(suffix, sizeof(suffix), "_bcc_%d", getpid());
+
+  // Lines look like "p:kprobes/p_do_sys_open_bcc_1234 do_sys_open"
+  while (getline(&line, &bufsize, fp) != -1) {
+    name = strchr(line, ':');
+    if (!name)
+      continue;
+    name++;
+    end = name + strcspn(name, " \n");
+    if (end - name < suffix_len || memcmp(end - suffix_len, suffix, suffix_len))
+      continue;
+    *end = '\0';
+    if (n == cap) {
+      cap = cap ? cap * 2 : 64;
+      tmp = realloc(events, cap * sizeof(*events));
+      if (!tmp)
+        goto error;
+      events = tmp;
+    }
+    if (!(events[n] = strdup(name)))
+      goto error;
+    n++;
+  }
+  free(line);
+  fclose(fp);
+
+  if (n)
+    qsort(events, n, sizeof(*events), cmp_str);
+  *cnt = n;
+  // An empty array is not an error
+  return events ? events : calloc(1, sizeof(*events));
+
+error:
+  fprintf(stderr, "%s: out of memory\n", __func__);
+  while (n)
+    free(events[--n]);
+  free(events);
+  free(line);
+  fclose(fp);
+  return NULL;
+}
+
+static int bpf_detach_probes(const char **ev_names, int cnt,
+                             const char *event_type)
+{
+  char name[PATH_MAX], *cmds = NULL, *tmp, **events, *key = name;
+  size_t nevents = 0, len = 0, cap = 0;
+  int i, kfd, res, ret = 0, batched = 0;
+
+  if (cnt <= 0)
+    return 0;
+  events = read_probe_events(event_type, &nevents);
+  if (!events)
+    return -1;
+
+  // Probes created with perf_event_open are not in the file and need no
+  // cleanup, the others are removed with a single write.
+  for (i = 0; i < cnt && nevents; i++) {
+    res = snprintf(name, sizeof(name), "%ss/%s_bcc_%d", event_type,
+                   ev_names[i], getpid());
+    if (res < 0 || res >= sizeof(name) - 3)
+      continue;
+    if (!bsearch(&key, events, nevents, sizeof(*events), cmp_str))
+      continue;
+    if (len + res + 3 >= cap) {
+      cap = cap ? cap * 2 : PATH_MAX;
+      while (cap <= len + res + 3)
+        cap *= 2;
+      tmp = realloc(cmds, cap);
+      if (!tmp) {
+        fprintf(stderr, "%s: out of memory\n", __func__);
+        ret = -1;
+        goto out;
+      }
+      cmds = tmp;
+    }
+    len += snprintf(cmds + len, cap - len, "-:%s\n", name);
+    batched++;
+  }
+  if (!batched)
+    goto out;
+
+  snprintf(name, sizeof(name), "/sys/kernel/debug/tracing/%s_events",
+           event_type);
+  kfd = open(name, O_WRONLY | O_APPEND, 0);
+  if (kfd < 0) {
+    fprintf(stderr, "open(%s): %s\n", name, strerror(errno));
+    ret = -1;
+    goto out;
+  }
+  res = write(kfd, cmds, len);
+  close(kfd);
+  if (res == len)
+    goto out;
+
+  // The kernel stops at the first command it fails, so retry one by one to
+  // remove the others and report which ones could not be removed.
+  for (i = 0; i < cnt; i++) {
+    if (bpf_detach_probe(ev_names[i], event_type) < 0)
+      ret = -1;
+  }
+
+out:
+  while (nevents)
+    free(events[--nevents]);
+  free(events);
+  free(cmds);
+  return ret;
+}
+
+int bpf_detach_kprobes(const char **ev_names, int cnt)
+{
+  return bpf_detach_probes(ev_names, cnt, "kprobe");
+}
+
+int bpf_detach_uprobes(const char **ev_names, int cnt)
+{
+  return bpf_detach_probes(ev_names, cnt, "uprobe");
+}
+
+#define BPF_F_KPROBE_MULTI_RETURN (1U << 0)
+#define BPF_F_UPROBE_MULTI_RETURN (1U << 0)
+
+/* The BPF_LINK_CREATE attributes of multi [k,u]probe links, laid out as in
+ * kernels >= 5.18 (kprobe_multi) and >= 6.6 (uprobe_multi). They are newer
+ * than our uapi headers, so the syscall is issued directly.
+ */
+struct bpf_probe_multi_link_attr {
+  __u32 prog_fd;
+  __u32 target_fd;
+  __u32 attach_type;
+  __u32 flags;
+  union {
+    struct {
+      __u32 flags;
+      __u32 cnt;
+      __aligned_u64 syms;
+      __aligned_u64 addrs;
+      __aligned_u64 cookies;
+    } kprobe_multi;
+    struct {
+      __aligned_u64 path;
+      __aligned_u64 offsets;
+      __aligned_u64 ref_ctr_offsets;
+      __aligned_u64 cookies;
+      __u32 cnt;
+      __u32 flags;
+      __u32 pid;
+    } uprobe_multi;
+  };
+};
+
+static int bpf_probe_multi_link_create(struct bpf_probe_multi_link_attr *attr)
+{
+  // Older kernels see a shorter bpf_attr and fail with EINVAL, E2BIG or
+  // EOPNOTSUPP, callers then attach the probes one by one instead.
+  return syscall(__NR_bpf, BPF_LINK_CREATE, attr, sizeof(*attr));
+}
+
+int bpf_attach_kprobe_multi(int progfd, enum bpf_probe_attach_type attach_type,
+                            const char **syms, const uint64_t *cookies, int cnt)
+{
+  struct bpf_probe_multi_link_attr attr = {};
+
+  if (cnt <= 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  attr.prog_fd = progfd;
+  attr.attach_type = BCC_TRACE_KPROBE_MULTI;
+  attr.kprobe_multi.flags =
+      attach_type == BPF_PROBE_RETURN ? BPF_F_KPROBE_MULTI_RETURN : 0;
+  attr.kprobe_multi.cnt = cnt;
+  attr.kprobe_multi.syms = ptr_to_u64((void *)syms);
+  attr.kprobe_multi.cookies = ptr_to_u64((void *)cookies);
+  return bpf_probe_multi_link_create(&attr);
+}
+
+int bpf_attach_uprobe_multi(int progfd, enum bpf_probe_attach_type attach_type,
+                            const char *binary_path, const uint64_t *offsets,
+                            int cnt, pid_t pid)
+{
+  struct bpf_probe_multi_link_attr attr = {};
+
+  if (cnt <= 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  attr.prog_fd = progfd;
+  attr.attach_type = BCC_TRACE_UPROBE_MULTI;
+  attr.uprobe_multi.path = ptr_to_u64((void *)binary_path);
+  attr.uprobe_multi.offsets = ptr_to_u64((void *)offsets);
+  attr.uprobe_multi.cnt = cnt;
+  attr.uprobe_multi.flags =
+      attach_type == BPF_PROBE_RETURN ? BPF_F_UPROBE_MULTI_RETURN : 0;
+  attr.uprobe_multi.pid = pid > 0 ? pid : 0;
+  return bpf_probe_multi_link_create(&attr);
+}
+
 int bpf_attach_tracepoint(int progfd, const char *tp_category,
                           const char *tp_name)
 {
@@ -1263,7 +1833,7 @@ int bpf_attach_tracepoint(int progfd, const char *tp_category,
 
   snprintf(buf, sizeof(buf), "/sys/kernel/debug/tracing/events/%s/%s",
            tp_category, tp_name);
-  if (bpf_attach_tracing_event(progfd, buf, -1 /* PID */, &pfd) == 0)
+  if (bpf_attach_tracing_event(progfd, buf, -1 /* PID */, &pfd, NULL) == 0)
     return pfd;
 
   bpf_close_perf_event_fd(pfd);
@@ -1290,19 +1860,18 @@ int bpf_attach_raw_tracepoint(int progfd, const char *tp_name)
 
 bool bpf_has_kernel_btf(void)
 {
-  return libbpf_find_vmlinux_btf_id("bpf_prog_put", 0) > 0;
+  return bcc_find_vmlinux_btf_id("bpf_prog_put", 0) > 0;
 }
 
 int kernel_struct_has_field(const char *struct_name, const char *field_name)
 {
   const struct btf_type *btf_type;
   const struct btf_member *btf_member;
-  struct btf *btf;
+  const struct btf *btf;
   int i, ret, btf_id;
 
-  btf = btf__load_vmlinux_btf();
-  ret = libbpf_get_error(btf);
-  if (ret)
+  btf = bcc_vmlinux_btf_get();
+  if (!btf)
     return -1;
 
   btf_id = btf__find_by_name_kind(btf, struct_name, BTF_KIND_STRUCT);
@@ -1322,7 +1891,7 @@ int kernel_struct_has_field(const char *struct_name, const char *field_name)
   ret = 0;
 
 cleanup:
-  btf__free(btf);
+  bcc_vmlinux_btf_put(btf);
   return ret;
 }
 
@@ -1349,6 +1918,19 @@ int bpf_attach_lsm(int prog_fd)
 void * bpf_open_perf_buffer(perf_reader_raw_cb raw_cb,
                             perf_reader_lost_cb lost_cb, void *cb_cookie,
                             int pid, int cpu, int page_cnt) {
+  struct bcc_perf_buffer_opts opts = {
+    .pid = pid,
+    .cpu = cpu,
+    .wakeup_events = 1,
+  };
+
+  return bpf_open_perf_buffer_opts(raw_cb, lost_cb, cb_cookie, page_cnt, &opts);
+}
+
+void * bpf_open_perf_buffer_opts(perf_reader_raw_cb raw_cb,
+                                 perf_reader_lost_cb lost_cb, void *cb_cookie,
+                                 int page_cnt,
+                                 struct bcc_perf_buffer_opts *opts) {
   int pfd;
   struct perf_event_attr attr = {};
   struct perf_reader *reader = NULL;
@@ -1361,8 +1943,20 @@ void * bpf_open_perf_buffer(perf_reader_raw_cb raw_cb,
   attr.type = PERF_TYPE_SOFTWARE;
   attr.sample_type = PERF_SAMPLE_RAW;
   attr.sample_period = 1;
-  attr.wakeup_events = 1;
-  pfd = syscall(__NR_perf_event_open, &attr, pid, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+  if (opts->overwrite) {
+    // Nobody waits for the samples, only wake up once per ring size
+    attr.write_backward = 1;
+    attr.watermark = 1;
+    attr.wakeup_watermark = page_cnt * getpagesize();
+    perf_reader_set_overwrite(reader, 1);
+  } else if (opts->wakeup_watermark > 0) {
+    attr.watermark = 1;
+    attr.wakeup_watermark = opts->wakeup_watermark;
+  } else {
+    attr.wakeup_events = opts->wakeup_events > 0 ? opts->wakeup_events : 1;
+  }
+  pfd = syscall(__NR_perf_event_open, &attr, opts->pid, opts->cpu, -1,
+                PERF_FLAG_FD_CLOEXEC);
   if (pfd < 0) {
     fprintf(stderr, "perf_event_open: %s\n", strerror(errno));
     fprintf(stderr, "   (check your kernel for PERF_COUNT_SW_BPF_OUTPUT support, 4.4 or newer)\n");
@@ -1427,6 +2021,11 @@ is_invalid:
 }
 
 int bpf_open_perf_event(uint32_t type, uint64_t config, int pid, int cpu) {
+  return bpf_open_perf_event_group(type, config, pid, cpu, -1);
+}
+
+int bpf_open_perf_event_group(uint32_t type, uint64_t config, int pid,
+                              int cpu, int group_fd) {
   int fd;
   struct perf_event_attr attr = {};
 
@@ -1438,7 +2037,8 @@ int bpf_open_perf_event(uint32_t type, uint64_t config, int pid, int cpu) {
   attr.type = type;
   attr.config = config;
 
-  fd = syscall(__NR_perf_event_open, &attr, pid, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+  fd = syscall(__NR_perf_event_open, &attr, pid, cpu, group_fd,
+               PERF_FLAG_FD_CLOEXEC);
   if (fd < 0) {
     fprintf(stderr, "perf_event_open: %s\n", strerror(errno));
     return -1;
@@ -1473,6 +2073,71 @@ int bpf_attach_xdp(const char *dev_name, int progfd, uint32_t flags) {
   return 0;
 }
 
+static int bpf_tc_hook_init(const char *dev_name, int egress,
+                            struct bpf_tc_hook *hook) {
+  int ifindex = if_nametoindex(dev_name);
+
+  if (ifindex == 0) {
+    fprintf(stderr, "bpf: Resolving device name to index: %s\n", strerror(errno));
+    return -1;
+  }
+  hook->ifindex = ifindex;
+  hook->attach_point = egress ? BPF_TC_EGRESS : BPF_TC_INGRESS;
+  return 0;
+}
+
+int bpf_attach_tc(const char *dev_name, int progfd, int egress,
+                  uint32_t handle, uint32_t priority) {
+  DECLARE_LIBBPF_OPTS(bpf_tc_hook, hook);
+  DECLARE_LIBBPF_OPTS(bpf_tc_opts, opts, .handle = handle,
+                      .priority = priority, .prog_fd = progfd);
+  char err_buf[256];
+  int ret;
+
+  if (bpf_tc_hook_init(dev_name, egress, &hook) < 0)
+    return -1;
+
+  // The clsact qdisc holds both hooks, and may already be there
+  ret = bpf_tc_hook_create(&hook);
+  if (ret && ret != -EEXIST) {
+    libbpf_strerror(ret, err_buf, sizeof(err_buf));
+    fprintf(stderr, "bpf: Adding clsact qdisc to %s: %s\n", dev_name, err_buf);
+    return -1;
+  }
+
+  ret = bpf_tc_attach(&hook, &opts);
+  if (ret) {
+    libbpf_strerror(ret, err_buf, sizeof(err_buf));
+    fprintf(stderr, "bpf: Attaching prog to %s %s: %s\n", dev_name,
+            egress ? "egress" : "ingress", err_buf);
+    return -1;
+  }
+
+  return 0;
+}
+
+int bpf_detach_tc(const char *dev_name, int egress, uint32_t handle,
+                  uint32_t priority) {
+  DECLARE_LIBBPF_OPTS(bpf_tc_hook, hook);
+  DECLARE_LIBBPF_OPTS(bpf_tc_opts, opts, .handle = handle,
+                      .priority = priority);
+  char err_buf[256];
+  int ret;
+
+  if (bpf_tc_hook_init(dev_name, egress, &hook) < 0)
+    return -1;
+
+  ret = bpf_tc_detach(&hook, &opts);
+  if (ret) {
+    libbpf_strerror(ret, err_buf, sizeof(err_buf));
+    fprintf(stderr, "bpf: Detaching prog from %s %s: %s\n", dev_name,
+            egress ? "egress" : "ingress", err_buf);
+    return -1;
+  }
+
+  return 0;
+}
+
 int bpf_attach_perf_event_raw(int progfd, void *perf_event_attr, pid_t pid,
                               int cpu, int group_fd, unsigned long extra_flags) {
   int fd = syscall(__NR_perf_event_open, perf_event_attr, pid, cpu, group_fd,
@@ -1495,9 +2160,12 @@ int bpf_attach_perf_event_raw(int progfd, void *perf_event_attr, pid_t pid,
   return fd;
 }
 
-int bpf_attach_perf_event(int progfd, uint32_t ev_type, uint32_t ev_config,
-                          uint64_t sample_period, uint64_t sample_freq,
-                          pid_t pid, int cpu, int group_fd) {
+static int attach_sampling_event(int progfd, uint32_t ev_type,
+                                 uint32_t ev_config, uint64_t sample_period,
+                                 uint64_t sample_freq,
+                                 uint64_t branch_sample_type, pid_t pid,
+                                 int cpu, int group_fd,
+                                 unsigned long extra_flags) {
   if (invalid_perf_config(ev_type, ev_config)) {
     return -1;
   }
@@ -1511,7 +2179,7 @@ int bpf_attach_perf_event(int progfd, uint32_t ev_type, uint32_t ev_config,
   struct perf_event_attr attr = {};
   attr.type = ev_type;
   attr.config = ev_config;
-  if (pid > 0)
+  if (pid > 0 && !(extra_flags & PERF_FLAG_PID_CGROUP))
     attr.inherit = 1;
   if (sample_freq > 0) {
     attr.freq = 1;
@@ -1519,8 +2187,49 @@ int bpf_attach_perf_event(int progfd, uint32_t ev_type, uint32_t ev_config,
   } else {
     attr.sample_period = sample_period;
   }
+  if (branch_sample_type) {
+    // the records are only read by bpf_read_branch_records(), but the PMU
+    // keeps them only for events that sample them
+    attr.sample_type |= PERF_SAMPLE_BRANCH_STACK;
+    attr.branch_sample_type = branch_sample_type;
+  }
 
-  return bpf_attach_perf_event_raw(progfd, &attr, pid, cpu, group_fd, 0);
+  return bpf_attach_perf_event_raw(progfd, &attr, pid, cpu, group_fd,
+                                   extra_flags);
+}
+
+int bpf_attach_perf_event(int progfd, uint32_t ev_type, uint32_t ev_config,
+                          uint64_t sample_period, uint64_t sample_freq,
+                          pid_t pid, int cpu, int group_fd) {
+  return attach_sampling_event(progfd, ev_type, ev_config, sample_period,
+                               sample_freq, 0, pid, cpu, group_fd, 0);
+}
+
+int bpf_attach_perf_event_branch(int progfd, uint32_t ev_type,
+                                 uint32_t ev_config, uint64_t sample_period,
+                                 uint64_t sample_freq,
+                                 uint64_t branch_sample_type, pid_t pid,
+                                 int cpu, int group_fd) {
+  if (!branch_sample_type) {
+    fprintf(stderr, "branch_sample_type should be set\n");
+    return -1;
+  }
+  return attach_sampling_event(progfd, ev_type, ev_config, sample_period,
+                               sample_freq, branch_sample_type, pid, cpu,
+                               group_fd, 0);
+}
+
+int bpf_attach_perf_event_cgroup(int progfd, uint32_t ev_type,
+                                 uint32_t ev_config, uint64_t sample_period,
+                                 uint64_t sample_freq, int cgroup_fd,
+                                 int cpu) {
+  if (cpu < 0) {
+    fprintf(stderr, "perf events of a cgroup need a CPU\n");
+    return -1;
+  }
+  return attach_sampling_event(progfd, ev_type, ev_config, sample_period,
+                               sample_freq, 0, cgroup_fd, cpu, -1,
+                               PERF_FLAG_PID_CGROUP);
 }
 
 int bpf_close_perf_event_fd(int fd) {
@@ -1572,6 +2281,12 @@ int bpf_consume_ringbuf(struct ring_buffer *rb) {
     return ring_buffer__consume(rb);
 }
 
+/* Epoll fd of the ring buffer manager rb, readable when any of its ring
+ * buffers has data. */
+int bpf_ringbuf_epoll_fd(struct ring_buffer *rb) {
+    return ring_buffer__epoll_fd(rb);
+}
+
 int bcc_iter_attach(int prog_fd, union bpf_iter_link_info *link_info,
                     uint32_t link_info_len)
 {
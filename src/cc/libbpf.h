@@ -29,6 +29,7 @@ extern "C" {
 
 struct bpf_create_map_attr;
 struct bpf_load_program_attr;
+struct btf;
 
 enum bpf_probe_attach_type {
 	BPF_PROBE_ENTRY,
@@ -69,6 +70,15 @@ int bcc_prog_load(enum bpf_prog_type prog_type, const char *name,
 int bcc_prog_load_xattr(struct bpf_load_program_attr *attr,
                         int prog_len, char *log_buf,
                         unsigned log_buf_size, bool allow_rlimit);
+/*
+ * Like bcc_prog_load_xattr() without a log buffer, but the log goes to
+ * *log_buf of *log_buf_size bytes, allocated with malloc(). It is grown when
+ * the log does not fit and left to the caller, who reuses it for later loads
+ * and frees it. A failed load that was already logged is not verified again.
+ */
+int bcc_prog_load_xattr_logbuf(struct bpf_load_program_attr *attr,
+                               int prog_len, char **log_buf,
+                               unsigned *log_buf_size, bool allow_rlimit);
 
 int bpf_attach_socket(int sockfd, int progfd);
 
@@ -79,15 +89,60 @@ int bpf_open_raw_sock(const char *name);
 typedef void (*perf_reader_raw_cb)(void *cb_cookie, void *raw, int raw_size);
 typedef void (*perf_reader_lost_cb)(void *cb_cookie, uint64_t lost);
 
+/* A raw sample, pointing into the perf ring or into the reader's scratch area
+ * for samples that wrap around the end of the ring */
+struct perf_reader_span {
+  void *raw;
+  int raw_size;
+};
+typedef void (*perf_reader_batch_cb)(void *cb_cookie,
+                                     struct perf_reader_span *spans, int cnt);
+
 int bpf_attach_kprobe(int progfd, enum bpf_probe_attach_type attach_type,
                       const char *ev_name, const char *fn_name, uint64_t fn_offset,
                       int maxactive);
+// Attach progfd to the kprobe event ev_name this process created in
+// kprobe_events, creating it first if create is set. The programs of all
+// the perf events opened on it run from a single hit of the kprobe. The
+// event is removed with bpf_detach_kprobe() once all are closed.
+int bpf_attach_kprobe_shared(int progfd, enum bpf_probe_attach_type attach_type,
+                             const char *ev_name, const char *fn_name,
+                             uint64_t fn_offset, int create);
 int bpf_detach_kprobe(const char *ev_name);
 
 int bpf_attach_uprobe(int progfd, enum bpf_probe_attach_type attach_type,
                       const char *ev_name, const char *binary_path,
                       uint64_t offset, pid_t pid, uint32_t ref_ctr_offset);
+/* bpf_attach_uprobe() passing cookie to the bpf_get_attach_cookie() of the
+ * program (Linux 5.15). The returned FD is the BPF link holding the perf
+ * event, which is closed with close() rather than bpf_close_perf_event_fd(). */
+int bpf_attach_uprobe_cookie(int progfd, enum bpf_probe_attach_type attach_type,
+                             const char *ev_name, const char *binary_path,
+                             uint64_t offset, pid_t pid,
+                             uint32_t ref_ctr_offset, uint64_t cookie);
 int bpf_detach_uprobe(const char *ev_name);
+/* Detach all cnt [k,u]probe events in ev_names with one read and, for the
+ * events created through tracefs, one write of the [k,u]probe_events file
+ * rather than one of each per event. Their perf event FDs must be closed. */
+int bpf_detach_kprobes(const char **ev_names, int cnt);
+int bpf_detach_uprobes(const char **ev_names, int cnt);
+
+/* Expected attach types of programs for multi [k,u]probe links, which our
+ * uapi headers predate. Programs must be loaded with them to be attached by
+ * bpf_attach_[k,u]probe_multi, and can then only be attached that way. */
+#define BCC_TRACE_KPROBE_MULTI 42
+#define BCC_TRACE_UPROBE_MULTI 48
+
+/* Attach progfd to all cnt kernel functions in syms, or to all cnt offsets of
+ * binary_path, with one link. Return the link FD, to be closed to detach
+ * them, or -1 with errno set if the kernel does not support such links
+ * (kprobe_multi needs 5.18, uprobe_multi 6.6). cookies, if not NULL, holds
+ * the value of bpf_get_attach_cookie() for each function in syms. */
+int bpf_attach_kprobe_multi(int progfd, enum bpf_probe_attach_type attach_type,
+                            const char **syms, const uint64_t *cookies, int cnt);
+int bpf_attach_uprobe_multi(int progfd, enum bpf_probe_attach_type attach_type,
+                            const char *binary_path, const uint64_t *offsets,
+                            int cnt, pid_t pid);
 
 int bpf_attach_tracepoint(int progfd, const char *tp_category,
                           const char *tp_name);
@@ -99,6 +154,16 @@ int bpf_attach_kfunc(int prog_fd);
 
 int bpf_attach_lsm(int prog_fd);
 
+/*
+ * Process-wide vmlinux BTF, parsed on the first call. Returns NULL without
+ * vmlinux BTF, else a reference to release with bcc_vmlinux_btf_put().
+ * bcc_vmlinux_btf_drop_cache() has it parsed again on the next get, the old
+ * one is freed when its last reference is put.
+ */
+const struct btf *bcc_vmlinux_btf_get(void);
+void bcc_vmlinux_btf_put(const struct btf *btf);
+void bcc_vmlinux_btf_drop_cache(void);
+
 bool bpf_has_kernel_btf(void);
 
 int kernel_struct_has_field(const char *struct_name, const char *field_name);
@@ -107,9 +172,37 @@ void * bpf_open_perf_buffer(perf_reader_raw_cb raw_cb,
                             perf_reader_lost_cb lost_cb, void *cb_cookie,
                             int pid, int cpu, int page_cnt);
 
+struct bcc_perf_buffer_opts {
+  int pid;
+  int cpu;
+  /* wake up the reader every wakeup_events samples */
+  int wakeup_events;
+  /* if non-zero, wake up the reader once this many bytes are available
+   * instead, wakeup_events is then ignored */
+  int wakeup_watermark;
+  /* if non-zero, open a flight recorder: a backward ring the kernel keeps
+   * overwriting, never drained and never waking up its reader, read with
+   * perf_reader_snapshot (Linux 4.7 or newer) */
+  int overwrite;
+};
+
+void * bpf_open_perf_buffer_opts(perf_reader_raw_cb raw_cb,
+                                 perf_reader_lost_cb lost_cb, void *cb_cookie,
+                                 int page_cnt,
+                                 struct bcc_perf_buffer_opts *opts);
+
 /* attached a prog expressed by progfd to the device specified in dev_name */
 int bpf_attach_xdp(const char *dev_name, int progfd, uint32_t flags);
 
+/* attach a SCHED_CLS prog expressed by progfd, in direct-action mode, to the
+ * ingress or egress tc hook of dev_name as filter handle:priority, adding a
+ * clsact qdisc to the device if it has none */
+int bpf_attach_tc(const char *dev_name, int progfd, int egress,
+                  uint32_t handle, uint32_t priority);
+/* remove the filter handle:priority from that hook, leaving the qdisc */
+int bpf_detach_tc(const char *dev_name, int egress, uint32_t handle,
+                  uint32_t priority);
+
 // attach a prog expressed by progfd to run on a specific perf event. The perf
 // event will be created using the perf_event_attr pointer provided.
 int bpf_attach_perf_event_raw(int progfd, void *perf_event_attr, pid_t pid,
@@ -119,8 +212,26 @@ int bpf_attach_perf_event_raw(int progfd, void *perf_event_attr, pid_t pid,
 int bpf_attach_perf_event(int progfd, uint32_t ev_type, uint32_t ev_config,
                           uint64_t sample_period, uint64_t sample_freq,
                           pid_t pid, int cpu, int group_fd);
+// like bpf_attach_perf_event, with the last branch records of the CPU, as
+// selected by the PERF_SAMPLE_BRANCH_* bits of branch_sample_type, kept for
+// bpf_read_branch_records() in the program. Needs a hardware event.
+int bpf_attach_perf_event_branch(int progfd, uint32_t ev_type,
+                                 uint32_t ev_config, uint64_t sample_period,
+                                 uint64_t sample_freq,
+                                 uint64_t branch_sample_type, pid_t pid,
+                                 int cpu, int group_fd);
+// like bpf_attach_perf_event, counting only while tasks of the cgroup v2
+// directory opened as cgroup_fd run on cpu
+int bpf_attach_perf_event_cgroup(int progfd, uint32_t ev_type,
+                                 uint32_t ev_config, uint64_t sample_period,
+                                 uint64_t sample_freq, int cgroup_fd,
+                                 int cpu);
 
 int bpf_open_perf_event(uint32_t type, uint64_t config, int pid, int cpu);
+// Same, with the event in the group of group_fd, which the PMU schedules
+// together with its leader, e.g. for ratios of counters of the same period
+int bpf_open_perf_event_group(uint32_t type, uint64_t config, int pid,
+                              int cpu, int group_fd);
 
 int bpf_close_perf_event_fd(int fd);
 
@@ -134,6 +245,7 @@ int bpf_add_ringbuf(struct ring_buffer *rb, int map_fd,
                     ring_buffer_sample_fn sample_cb, void *ctx);
 int bpf_poll_ringbuf(struct ring_buffer *rb, int timeout_ms);
 int bpf_consume_ringbuf(struct ring_buffer *rb);
+int bpf_ringbuf_epoll_fd(struct ring_buffer *rb);
 
 int bpf_obj_pin(int fd, const char *pathname);
 int bpf_obj_get(const char *pathname);
@@ -145,6 +257,41 @@ int bpf_prog_get_next_id(uint32_t start_id, uint32_t *next_id);
 int bpf_prog_get_fd_by_id(uint32_t id);
 int bpf_map_get_fd_by_id(uint32_t id);
 int bpf_obj_get_info_by_fd(int prog_fd, void *info, uint32_t *info_len);
+// Have the kernel count the runs and run time of every BPF program until the
+// returned fd is closed (BPF_ENABLE_STATS). Returns -1 with errno set on
+// error.
+int bcc_enable_run_stats(void);
+// Runs and run time in ns of the program so far, counted while run stats
+// are enabled by anyone. Returns -1 with errno set on error.
+int bcc_prog_run_stats(int prog_fd, uint64_t *run_cnt, uint64_t *run_time_ns);
+
+// Kernel memory held by a map. memlock is what the kernel charges for it, as
+// reported in /proc/self/fdinfo, and 0 on kernels that don't. entries is the
+// number of keys present, found by walking them, so it is only filled in if
+// asked for; arrays always hold max_entries.
+struct bcc_map_mem {
+  uint32_t type;
+  uint32_t key_size;
+  uint32_t value_size;
+  uint32_t max_entries;
+  uint32_t entries;
+  uint64_t memlock;
+};
+int bcc_map_mem_info(int map_fd, struct bcc_map_mem *mem, int count_entries);
+// Kernel memory held by a program: its memlock charge and the sizes in
+// bytes of its JITed and translated instructions
+struct bcc_prog_mem {
+  uint32_t jited_len;
+  uint32_t xlated_len;
+  uint64_t memlock;
+};
+int bcc_prog_mem_info(int prog_fd, struct bcc_prog_mem *mem);
+// Swap the buffers of a BPF_EPOCH_BUFFERS array of maps, see helpers.h, and
+// return an fd of the buffer that was active, for the caller to read and
+// close. The kernel waits for the programs running to finish when an array
+// of maps is updated, so none updates that buffer anymore once this returns.
+// Returns -1 with errno set on error.
+int bcc_flip_epoch(int outer_fd);
 
 int bcc_iter_attach(int prog_fd, union bpf_iter_link_info *link_info,
                     uint32_t link_info_len);
@@ -163,6 +310,9 @@ int bpf_lookup_and_delete_batch(int fd, __u32 *in_batch, __u32 *out_batch,
 // Put non-static/inline functions in their own section with this prefix +
 // fn_name to enable discovery by the bcc library.
 #define BPF_FN_PREFIX ".bpf.fn."
+// Prefix of the copies of kprobe handlers compiled as fentry and fexit
+// programs with -DBCC_KPROBE_AS_KFUNC
+#define BPF_KFUNC_COMPAT_PREFIX "kfunc_compat__"
 
 /* ALU ops on registers, bpf_add|sub|...: dst_reg += src_reg */
 
@@ -28,9 +28,15 @@
 #include <linux/types.h>
 #include <linux/perf_event.h>
 
+#include "bcc_metrics.h"
 #include "libbpf.h"
 #include "perf_reader.h"
 
+// Max number of spans handed to the batch callback at once
+#define PERF_READER_BATCH_MAX 256
+// A perf record size is a u16, so this holds any record wrapping the ring
+#define PERF_READER_SCRATCH_SIZE 65536
+
 enum {
   RB_NOT_USED = 0, // ring buffer not usd
   RB_USED_IN_MUNMAP = 1, // used in munmap
@@ -40,15 +46,20 @@ enum {
 struct perf_reader {
   perf_reader_raw_cb raw_cb;
   perf_reader_lost_cb lost_cb;
+  perf_reader_batch_cb batch_cb;
   void *cb_cookie; // to be returned in the cb
   void *buf; // for keeping segmented data
   size_t buf_size;
+  struct perf_reader_span *spans; // pending samples in batch mode
   void *base;
   int rb_use_state;
   pid_t rb_read_tid;
   int page_size;
   int page_cnt;
   int fd;
+  int overwrite; // read only, backward ring
+  uint64_t *snapshot_pos; // record positions found by perf_reader_snapshot
+  size_t snapshot_cap;
 };
 
 struct perf_reader * perf_reader_new(perf_reader_raw_cb raw_cb,
@@ -81,10 +92,45 @@ void perf_reader_free(void *ptr) {
       close(reader->fd);
     }
     free(reader->buf);
+    free(reader->spans);
+    free(reader->snapshot_pos);
     free(ptr);
   }
 }
 
+int perf_reader_set_batch_cb(struct perf_reader *reader,
+                             perf_reader_batch_cb batch_cb) {
+  if (batch_cb && !reader->spans) {
+    reader->spans = calloc(PERF_READER_BATCH_MAX, sizeof(*reader->spans));
+    if (!reader->spans)
+      return -1;
+  }
+  // The pass over the ring crosses its end at most once, so a single scratch
+  // area holds every wrapped sample of a batch.
+  if (batch_cb && reader->buf_size < PERF_READER_SCRATCH_SIZE) {
+    void *buf = realloc(reader->buf, PERF_READER_SCRATCH_SIZE);
+    if (!buf)
+      return -1;
+    reader->buf = buf;
+    reader->buf_size = PERF_READER_SCRATCH_SIZE;
+  }
+  reader->batch_cb = batch_cb;
+  return 0;
+}
+
+int perf_reader_spans_pack(struct perf_reader_span *spans, int cnt, void *buf,
+                           int *offsets) {
+  int i, off = 0;
+
+  for (i = 0; i < cnt; i++) {
+    offsets[i] = off;
+    memcpy((char *)buf + off, spans[i].raw, spans[i].raw_size);
+    off += spans[i].raw_size;
+  }
+  offsets[cnt] = off;
+  return off;
+}
+
 int perf_reader_mmap(struct perf_reader *reader) {
   int mmap_size = reader->page_size * (reader->page_cnt + 1);
 
@@ -93,7 +139,11 @@ int perf_reader_mmap(struct perf_reader *reader) {
     return -1;
   }
 
-  reader->base = mmap(NULL, mmap_size, PROT_READ | PROT_WRITE , MAP_SHARED, reader->fd, 0);
+  // Without write access to data_tail, the kernel overwrites the oldest
+  // records of the ring instead of dropping new ones
+  reader->base = mmap(NULL, mmap_size,
+                      reader->overwrite ? PROT_READ : PROT_READ | PROT_WRITE,
+                      MAP_SHARED, reader->fd, 0);
   if (reader->base == MAP_FAILED) {
     perror("mmap");
     return -1;
@@ -114,7 +164,7 @@ struct perf_sample_trace_kprobe {
   uint64_t ip;
 };
 
-static void parse_sw(struct perf_reader *reader, void *data, int size) {
+static void *parse_sw(void *data, int size, int *raw_size) {
   uint8_t *ptr = data;
   struct perf_event_header *header = (void *)data;
 
@@ -126,24 +176,24 @@ static void parse_sw(struct perf_reader *reader, void *data, int size) {
   ptr += sizeof(*header);
   if (ptr > (uint8_t *)data + size) {
     fprintf(stderr, "%s: corrupt sample header\n", __FUNCTION__);
-    return;
+    return NULL;
   }
 
   raw = (void *)ptr;
   ptr += sizeof(raw->size) + raw->size;
   if (ptr > (uint8_t *)data + size) {
     fprintf(stderr, "%s: corrupt raw sample\n", __FUNCTION__);
-    return;
+    return NULL;
   }
 
   // sanity check
   if (ptr != (uint8_t *)data + size) {
     fprintf(stderr, "%s: extra data at end of sample\n", __FUNCTION__);
-    return;
+    return NULL;
   }
 
-  if (reader->raw_cb)
-    reader->raw_cb(reader->cb_cookie, raw->data, raw->size);
+  *raw_size = raw->size;
+  return raw->data;
 }
 
 static uint64_t read_data_head(volatile struct perf_event_mmap_page *perf_header) {
@@ -157,66 +207,203 @@ static void write_data_tail(volatile struct perf_event_mmap_page *perf_header, u
   perf_header->data_tail = data_tail;
 }
 
+static void flush_batch(struct perf_reader *reader,
+                        volatile struct perf_event_mmap_page *perf_header,
+                        int *cnt, uint64_t data_tail) {
+  if (*cnt)
+    reader->batch_cb(reader->cb_cookie, reader->spans, *cnt);
+  *cnt = 0;
+  write_data_tail(perf_header, data_tail);
+}
+
 void perf_reader_event_read(struct perf_reader *reader) {
+  perf_reader_consume(reader);
+}
+
+int perf_reader_consume(struct perf_reader *reader) {
   volatile struct perf_event_mmap_page *perf_header = reader->base;
   uint64_t buffer_size = (uint64_t)reader->page_size * reader->page_cnt;
   uint64_t data_head;
   uint8_t *base = (uint8_t *)reader->base + reader->page_size;
   uint8_t *sentinel = (uint8_t *)reader->base + buffer_size + reader->page_size;
   uint8_t *begin, *end;
+  int batch_cnt = 0;
+  int samples = 0;
 
   reader->rb_read_tid = syscall(__NR_gettid);
   if (!__sync_bool_compare_and_swap(&reader->rb_use_state, RB_NOT_USED, RB_USED_IN_READ))
-    return;
+    return -1;
 
   // Consume all the events on this ring, calling the cb function for each one.
   // The message may fall on the ring boundary, in which case copy the message
   // into a malloced buffer.
+  // In batch mode, samples are collected as spans over the ring and data_tail
+  // is only advanced after the batch callback has consumed them.
   for (data_head = read_data_head(perf_header); perf_header->data_tail != data_head;
       data_head = read_data_head(perf_header)) {
     uint64_t data_tail = perf_header->data_tail;
-    uint8_t *ptr;
 
-    begin = base + data_tail % buffer_size;
-    // event header is u64, won't wrap
+    while (data_tail != data_head) {
+      uint8_t *ptr;
+
+      begin = base + data_tail % buffer_size;
+      // event header is u64, won't wrap
+      struct perf_event_header *e = (void *)begin;
+      ptr = begin;
+      end = base + (data_tail + e->size) % buffer_size;
+      if (end < begin) {
+        // perf event wraps around the ring, make a contiguous copy
+        bcc_metric_add(BCC_METRIC_PERF_WRAP_COPIES, 1);
+        if (reader->buf_size < e->size) {
+          reader->buf = realloc(reader->buf, e->size);
+          reader->buf_size = e->size;
+        }
+        size_t len = sentinel - begin;
+        memcpy(reader->buf, begin, len);
+        memcpy((void *)((unsigned long)reader->buf + len), base, e->size - len);
+        ptr = reader->buf;
+      }
+
+      if (e->type == PERF_RECORD_LOST) {
+        /*
+         * struct {
+         *    struct perf_event_header    header;
+         *    u64                id;
+         *    u64                lost;
+         *    struct sample_id        sample_id;
+         * };
+         */
+        uint64_t lost = *(uint64_t *)(ptr + sizeof(*e) + sizeof(uint64_t));
+        bcc_metric_add(BCC_METRIC_PERF_LOST, lost);
+        // keep samples and lost notifications in ring order
+        if (reader->batch_cb)
+          flush_batch(reader, perf_header, &batch_cnt, data_tail);
+        if (reader->lost_cb) {
+          reader->lost_cb(reader->cb_cookie, lost);
+        } else {
+          fprintf(stderr, "Possibly lost %" PRIu64 " samples\n", lost);
+        }
+      } else if (e->type == PERF_RECORD_SAMPLE) {
+        int raw_size;
+        void *raw = parse_sw(ptr, e->size, &raw_size);
+        if (raw) {
+          bcc_metric_add(BCC_METRIC_PERF_SAMPLES, 1);
+          samples++;
+        }
+        if (raw && reader->batch_cb) {
+          reader->spans[batch_cnt].raw = raw;
+          reader->spans[batch_cnt].raw_size = raw_size;
+          batch_cnt++;
+        } else if (raw && reader->raw_cb) {
+          reader->raw_cb(reader->cb_cookie, raw, raw_size);
+        }
+      } else {
+        fprintf(stderr, "%s: unknown sample type %d\n", __FUNCTION__, e->type);
+      }
+
+      data_tail += e->size;
+      if (!reader->batch_cb)
+        write_data_tail(perf_header, data_tail);
+      else if (batch_cnt == PERF_READER_BATCH_MAX)
+        flush_batch(reader, perf_header, &batch_cnt, data_tail);
+    }
+
+    if (reader->batch_cb)
+      flush_batch(reader, perf_header, &batch_cnt, data_tail);
+  }
+  reader->rb_use_state = RB_NOT_USED;
+  __sync_synchronize();
+  reader->rb_read_tid = 0;
+  return samples;
+}
+
+void perf_reader_set_overwrite(struct perf_reader *reader, int overwrite) {
+  reader->overwrite = overwrite;
+}
+
+int perf_reader_pause(struct perf_reader *reader, int pause) {
+  return ioctl(reader->fd, PERF_EVENT_IOC_PAUSE_OUTPUT, pause ? 1 : 0);
+}
+
+int perf_reader_snapshot(struct perf_reader *reader) {
+  volatile struct perf_event_mmap_page *perf_header = reader->base;
+  uint64_t buffer_size = (uint64_t)reader->page_size * reader->page_cnt;
+  uint8_t *base = (uint8_t *)reader->base + reader->page_size;
+  uint8_t *sentinel = base + buffer_size;
+  uint64_t data_head, pos;
+  size_t cnt = 0;
+  int delivered = 0;
+
+  if (!reader->overwrite)
+    return -1;
+  reader->rb_read_tid = syscall(__NR_gettid);
+  if (!__sync_bool_compare_and_swap(&reader->rb_use_state, RB_NOT_USED, RB_USED_IN_READ))
+    return -1;
+
+  // The kernel writes backward: the newest record starts at data_head and
+  // older ones follow it, up to a record the ring has no room for or, until
+  // the ring wraps, the zeroed pages never written.
+  data_head = read_data_head(perf_header);
+  for (pos = data_head; pos - data_head < buffer_size;) {
+    struct perf_event_header *e = (void *)(base + pos % buffer_size);
+    if (e->size == 0 || pos - data_head + e->size > buffer_size)
+      break;
+    if (cnt == reader->snapshot_cap) {
+      size_t cap = reader->snapshot_cap ? reader->snapshot_cap * 2 : 1024;
+      uint64_t *tmp = realloc(reader->snapshot_pos, cap * sizeof(*tmp));
+      if (!tmp)
+        break;
+      reader->snapshot_pos = tmp;
+      reader->snapshot_cap = cap;
+    }
+    reader->snapshot_pos[cnt++] = pos;
+    pos += e->size;
+  }
+
+  // Oldest first
+  while (cnt--) {
+    uint8_t *begin = base + reader->snapshot_pos[cnt] % buffer_size, *ptr = begin;
     struct perf_event_header *e = (void *)begin;
-    ptr = begin;
-    end = base + (data_tail + e->size) % buffer_size;
-    if (end < begin) {
-      // perf event wraps around the ring, make a contiguous copy
-      reader->buf = realloc(reader->buf, e->size);
+
+    if (begin + e->size > sentinel) {
+      // the record wraps around the ring, make a contiguous copy
+      if (reader->buf_size < e->size) {
+        void *buf = realloc(reader->buf, e->size);
+        if (!buf)
+          break;
+        reader->buf = buf;
+        reader->buf_size = e->size;
+      }
       size_t len = sentinel - begin;
       memcpy(reader->buf, begin, len);
-      memcpy((void *)((unsigned long)reader->buf + len), base, e->size - len);
+      memcpy((uint8_t *)reader->buf + len, base, e->size - len);
       ptr = reader->buf;
     }
 
     if (e->type == PERF_RECORD_LOST) {
-      /*
-       * struct {
-       *    struct perf_event_header    header;
-       *    u64                id;
-       *    u64                lost;
-       *    struct sample_id        sample_id;
-       * };
-       */
       uint64_t lost = *(uint64_t *)(ptr + sizeof(*e) + sizeof(uint64_t));
-      if (reader->lost_cb) {
+      bcc_metric_add(BCC_METRIC_PERF_LOST, lost);
+      if (reader->lost_cb)
         reader->lost_cb(reader->cb_cookie, lost);
-      } else {
-        fprintf(stderr, "Possibly lost %" PRIu64 " samples\n", lost);
-      }
     } else if (e->type == PERF_RECORD_SAMPLE) {
-      parse_sw(reader, ptr, e->size);
-    } else {
-      fprintf(stderr, "%s: unknown sample type %d\n", __FUNCTION__, e->type);
+      int raw_size;
+      void *raw = parse_sw(ptr, e->size, &raw_size);
+      if (!raw)
+        continue;
+      bcc_metric_add(BCC_METRIC_PERF_SAMPLES, 1);
+      if (reader->batch_cb) {
+        struct perf_reader_span span = {raw, raw_size};
+        reader->batch_cb(reader->cb_cookie, &span, 1);
+      } else if (reader->raw_cb) {
+        reader->raw_cb(reader->cb_cookie, raw, raw_size);
+      }
+      delivered++;
     }
-
-    write_data_tail(perf_header, perf_header->data_tail + e->size);
   }
   reader->rb_use_state = RB_NOT_USED;
   __sync_synchronize();
   reader->rb_read_tid = 0;
+  return delivered;
 }
 
 int perf_reader_poll(int num_readers, struct perf_reader **readers, int timeout) {
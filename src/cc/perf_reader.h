@@ -29,8 +29,29 @@ struct perf_reader * perf_reader_new(perf_reader_raw_cb raw_cb,
                                      perf_reader_lost_cb lost_cb,
                                      void *cb_cookie, int page_cnt);
 void perf_reader_free(void *ptr);
+/* Deliver samples in batches of spans instead of one raw_cb call per sample.
+ * The spans are only valid during the callback. */
+int perf_reader_set_batch_cb(struct perf_reader *reader,
+                             perf_reader_batch_cb batch_cb);
+/* Copy the samples of spans back to back into buf, which must hold the sum of
+ * their sizes, and store the start of each in offsets[0..cnt-1] and the total
+ * size in offsets[cnt], which is also returned. */
+int perf_reader_spans_pack(struct perf_reader_span *spans, int cnt, void *buf,
+                           int *offsets);
+/* Map the ring read only, for a backward ring the kernel keeps overwriting.
+ * To be called before perf_reader_mmap. */
+void perf_reader_set_overwrite(struct perf_reader *reader, int overwrite);
+/* Stop or resume writes to the ring, which are counted as lost meanwhile */
+int perf_reader_pause(struct perf_reader *reader, int pause);
+/* Deliver the records of an overwrite ring, oldest first, without consuming
+ * them. The ring should be paused. Returns the number of samples delivered,
+ * or -1 if the ring isn't an overwrite one or is being read. */
+int perf_reader_snapshot(struct perf_reader *reader);
 int perf_reader_mmap(struct perf_reader *reader);
 void perf_reader_event_read(struct perf_reader *reader);
+/* Same as perf_reader_event_read, returning the number of samples read, or
+ * -1 if the ring is being read or unmapped by another thread. */
+int perf_reader_consume(struct perf_reader *reader);
 int perf_reader_poll(int num_readers, struct perf_reader **readers, int timeout);
 int perf_reader_fd(struct perf_reader *reader);
 void perf_reader_set_fd(struct perf_reader *reader, int fd);
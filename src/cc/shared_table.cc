@@ -27,7 +27,8 @@ namespace ebpf {
 using std::string;
 using std::unique_ptr;
 
-/// A process-wide singleton of shared tables
+/// A process-wide singleton of shared tables, or a private set of tables
+/// owned by a single storage instance when constructed with local = true
 class SharedTableStorage : public TableStorageImpl {
  public:
   class iterator : public TableStorageIteratorImpl {
@@ -44,6 +45,9 @@ class SharedTableStorage : public TableStorageImpl {
     virtual value_type &operator*() const override { return *it_; }
     virtual pointer operator->() const override { return &*it_; }
   };
+  explicit SharedTableStorage(bool local = false)
+      : local_tables_(local ? make_unique<std::map<string, TableDesc>>() : nullptr),
+        tables_(local ? *local_tables_ : global_tables_) {}
   virtual ~SharedTableStorage() {}
   virtual bool Find(const string &name, TableStorage::iterator &result) const override;
   virtual bool Insert(const string &name, TableDesc &&desc) override;
@@ -55,7 +59,9 @@ class SharedTableStorage : public TableStorageImpl {
   virtual unique_ptr<TableStorageIteratorImpl> erase(const TableStorageIteratorImpl &it) override;
 
  private:
-  static std::map<string, TableDesc> tables_;
+  unique_ptr<std::map<string, TableDesc>> local_tables_;
+  std::map<string, TableDesc> &tables_;
+  static std::map<string, TableDesc> global_tables_;
 };
 
 bool SharedTableStorage::Find(const string &name, TableStorage::iterator &result) const {
@@ -103,7 +109,7 @@ unique_ptr<TableStorageIteratorImpl> SharedTableStorage::erase(const TableStorag
 }
 
 // All maps for this process are kept in global static storage.
-std::map<string, TableDesc> SharedTableStorage::tables_;
+std::map<string, TableDesc> SharedTableStorage::global_tables_;
 
 unique_ptr<TableStorage> createSharedTableStorage() {
   auto t = make_unique<TableStorage>();
@@ -111,4 +117,13 @@ unique_ptr<TableStorage> createSharedTableStorage() {
   t->AddMapTypesVisitor(createJsonMapTypesVisitor());
   return t;
 }
+
+// Tables in a local storage are only visible to modules using that storage
+// instance, so independent modules can be loaded concurrently.
+unique_ptr<TableStorage> createLocalTableStorage() {
+  auto t = make_unique<TableStorage>();
+  t->Init(make_unique<SharedTableStorage>(true));
+  t->AddMapTypesVisitor(createJsonMapTypesVisitor());
+  return t;
+}
 }
@@ -0,0 +1,432 @@
+/*
+ * Copyright (c) 2021 Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#include "common.h"
+#include "table_storage.h"
+#include "table_storage_impl.h"
+
+namespace ebpf {
+
+using std::string;
+using std::unique_ptr;
+
+// Registry layout, kept in a memfd shared with every reader:
+//   header, then for each table:
+//   u32 path_len, path, i32 type, u32 key_size, u32 leaf_size,
+//   u32 max_entries, i32 flags, u32 key_desc_len, key_desc,
+//   u32 leaf_desc_len, leaf_desc
+// The map fds follow the memfd over the socket, in the order of the records.
+struct registry_header {
+  uint32_t magic;
+  uint32_t count;
+  uint64_t size;
+};
+
+static const uint32_t REGISTRY_MAGIC = 0x62636372;  // "bccr"
+// SCM_MAX_FD in the kernel
+static const size_t MAX_FDS_PER_MSG = 253;
+
+/// Table storage shared with other processes over a unix socket. A publisher
+/// serves every table inserted into it; a reader attaches to the tables of a
+/// publisher, receiving their descriptors through a shared memory registry
+/// and the map fds as SCM_RIGHTS messages.
+class SockTableStorage : public TableStorageImpl {
+ public:
+  class iterator : public TableStorageIteratorImpl {
+    std::map<string, TableDesc>::iterator it_;
+
+   public:
+    explicit iterator(const std::map<string, TableDesc>::iterator &it) : it_(it) {}
+    virtual ~iterator() {}
+    virtual unique_ptr<self_type> clone() const override { return make_unique<iterator>(it_); }
+    virtual self_type &operator++() override {
+      ++it_;
+      return *this;
+    }
+    virtual value_type &operator*() const override { return *it_; }
+    virtual pointer operator->() const override { return &*it_; }
+  };
+  explicit SockTableStorage(const string &sock_path) : sock_path_(sock_path) {}
+  virtual ~SockTableStorage();
+  virtual bool Find(const string &name, TableStorage::iterator &result) const override;
+  virtual bool Insert(const string &name, TableDesc &&desc) override;
+  virtual bool Delete(const string &name) override;
+  virtual unique_ptr<TableStorageIteratorImpl> begin() override;
+  virtual unique_ptr<TableStorageIteratorImpl> end() override;
+  virtual unique_ptr<TableStorageIteratorImpl> lower_bound(const string &k) override;
+  virtual unique_ptr<TableStorageIteratorImpl> upper_bound(const string &k) override;
+  virtual unique_ptr<TableStorageIteratorImpl> erase(const TableStorageIteratorImpl &it) override;
+
+  bool serve();
+  bool attach(bool verbose = true) const;
+
+ private:
+  void update_registry();
+  void serve_loop();
+  bool send_tables(int conn);
+
+  string sock_path_;
+  mutable std::map<string, TableDesc> tables_;
+  // publisher side
+  std::mutex mutex_;
+  int listen_fd_ = -1;
+  int stop_fd_ = -1;
+  int registry_fd_ = -1;
+  std::vector<int> registry_fds_;
+  std::thread server_;
+};
+
+static void put_u32(string &out, uint32_t v) { out.append((const char *)&v, sizeof(v)); }
+
+static void put_str(string &out, const string &s) {
+  put_u32(out, s.size());
+  out += s;
+}
+
+static bool get_u32(const char *&p, const char *end, uint32_t &v) {
+  if (end - p < (ptrdiff_t)sizeof(v))
+    return false;
+  memcpy(&v, p, sizeof(v));
+  p += sizeof(v);
+  return true;
+}
+
+static bool get_str(const char *&p, const char *end, string &s) {
+  uint32_t len;
+  if (!get_u32(p, end, len) || end - p < (ptrdiff_t)len)
+    return false;
+  s.assign(p, len);
+  p += len;
+  return true;
+}
+
+static StatusTuple remote_sscanf(const char *, void *) {
+  return StatusTuple(-1, "formatters are not available for remote tables");
+}
+
+static StatusTuple remote_snprintf(char *, size_t, const void *) {
+  return StatusTuple(-1, "formatters are not available for remote tables");
+}
+
+SockTableStorage::~SockTableStorage() {
+  if (server_.joinable()) {
+    uint64_t one = 1;
+    if (write(stop_fd_, &one, sizeof(one)) < 0)
+      fprintf(stderr, "Failed to stop table server: %s\n", strerror(errno));
+    server_.join();
+  }
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+    unlink(sock_path_.c_str());
+  }
+  if (stop_fd_ >= 0)
+    close(stop_fd_);
+  if (registry_fd_ >= 0)
+    close(registry_fd_);
+}
+
+void SockTableStorage::update_registry() {
+  string data;
+  registry_header hdr = {REGISTRY_MAGIC, 0, 0};
+  data.append((const char *)&hdr, sizeof(hdr));
+
+  registry_fds_.clear();
+  for (auto &it : tables_) {
+    const TableDesc &desc = it.second;
+    if ((int)desc.fd < 0)
+      continue;
+    put_str(data, it.first);
+    put_u32(data, desc.type);
+    put_u32(data, desc.key_size);
+    put_u32(data, desc.leaf_size);
+    put_u32(data, desc.max_entries);
+    put_u32(data, desc.flags);
+    put_str(data, desc.key_desc);
+    put_str(data, desc.leaf_desc);
+    registry_fds_.push_back(desc.fd);
+    hdr.count++;
+  }
+  hdr.size = data.size();
+  memcpy(&data[0], &hdr, sizeof(hdr));
+
+  // readers map the registry they were sent, so publish a new memfd rather
+  // than rewriting the current one under their feet
+  int fd = syscall(SYS_memfd_create, "bcc_table_registry", MFD_CLOEXEC);
+  if (fd < 0 || ftruncate(fd, data.size()) < 0 ||
+      pwrite(fd, data.data(), data.size(), 0) != (ssize_t)data.size()) {
+    fprintf(stderr, "Failed to write table registry: %s\n", strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+  if (registry_fd_ >= 0)
+    close(registry_fd_);
+  registry_fd_ = fd;
+}
+
+bool SockTableStorage::send_tables(int conn) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (registry_fd_ < 0)
+    return false;
+
+  std::vector<int> fds;
+  fds.push_back(registry_fd_);
+  fds.insert(fds.end(), registry_fds_.begin(), registry_fds_.end());
+
+  for (size_t off = 0; off < fds.size(); off += MAX_FDS_PER_MSG) {
+    size_t n = std::min(MAX_FDS_PER_MSG, fds.size() - off);
+    uint32_t total = fds.size();
+    struct iovec iov = {&total, sizeof(total)};
+    std::vector<char> cbuf(CMSG_SPACE(n * sizeof(int)));
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf.data();
+    msg.msg_controllen = cbuf.size();
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fds[off], n * sizeof(int));
+    if (sendmsg(conn, &msg, MSG_NOSIGNAL) < 0)
+      return false;
+  }
+  return true;
+}
+
+void SockTableStorage::serve_loop() {
+  struct pollfd pfds[2] = {{listen_fd_, POLLIN, 0}, {stop_fd_, POLLIN, 0}};
+  while (true) {
+    if (poll(pfds, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "Table server poll failed: %s\n", strerror(errno));
+      return;
+    }
+    if (pfds[1].revents)
+      return;
+    int conn = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (conn < 0)
+      continue;
+    if (!send_tables(conn))
+      fprintf(stderr, "Failed to send tables: %s\n", strerror(errno));
+    close(conn);
+  }
+}
+
+bool SockTableStorage::serve() {
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (sock_path_.size() >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path %s is too long\n", sock_path_.c_str());
+    return false;
+  }
+  strcpy(addr.sun_path, sock_path_.c_str());
+
+  update_registry();
+  stop_fd_ = eventfd(0, EFD_CLOEXEC);
+  listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (stop_fd_ < 0 || listen_fd_ < 0) {
+    fprintf(stderr, "Failed to create table server: %s\n", strerror(errno));
+    return false;
+  }
+  unlink(sock_path_.c_str());
+  if (bind(listen_fd_, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listen_fd_, 16) < 0) {
+    fprintf(stderr, "Failed to listen on %s: %s\n", sock_path_.c_str(),
+            strerror(errno));
+    close(listen_fd_);
+    listen_fd_ = -1;
+    return false;
+  }
+  server_ = std::thread(&SockTableStorage::serve_loop, this);
+  return true;
+}
+
+static bool recv_fds(int sock, std::vector<int> &fds) {
+  uint32_t total = 0;
+  do {
+    struct iovec iov = {&total, sizeof(total)};
+    std::vector<char> cbuf(CMSG_SPACE(MAX_FDS_PER_MSG * sizeof(int)));
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf.data();
+    msg.msg_controllen = cbuf.size();
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL) != sizeof(total))
+      return false;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        continue;
+      size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      const int *data = reinterpret_cast<const int *>(CMSG_DATA(cmsg));
+      fds.insert(fds.end(), data, data + n);
+    }
+  } while (fds.size() < total);
+  return fds.size() == total;
+}
+
+bool SockTableStorage::attach(bool verbose) const {
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (sock_path_.size() >= sizeof(addr.sun_path))
+    return false;
+  strcpy(addr.sun_path, sock_path_.c_str());
+
+  FileDesc sock(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  if ((int)sock < 0 ||
+      connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    if (verbose)
+      fprintf(stderr, "Failed to connect to %s: %s\n", sock_path_.c_str(),
+              strerror(errno));
+    return false;
+  }
+
+  std::vector<int> raw_fds;
+  bool ok = recv_fds(sock, raw_fds);
+  // own every received fd so that none leaks on error
+  std::vector<FileDesc> fds;
+  for (int fd : raw_fds)
+    fds.emplace_back(fd);
+  if (!ok || fds.empty())
+    return false;
+
+  registry_header hdr;
+  if (pread(fds[0], &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+      hdr.magic != REGISTRY_MAGIC || hdr.count != fds.size() - 1)
+    return false;
+  void *map = mmap(nullptr, hdr.size, PROT_READ, MAP_SHARED, fds[0], 0);
+  if (map == MAP_FAILED)
+    return false;
+
+  const char *p = static_cast<const char *>(map) + sizeof(hdr);
+  const char *end = static_cast<const char *>(map) + hdr.size;
+  for (uint32_t i = 0; i < hdr.count; i++) {
+    string path, key_desc, leaf_desc;
+    uint32_t type, key_size, leaf_size, max_entries, flags;
+    if (!get_str(p, end, path) || !get_u32(p, end, type) ||
+        !get_u32(p, end, key_size) || !get_u32(p, end, leaf_size) ||
+        !get_u32(p, end, max_entries) || !get_u32(p, end, flags) ||
+        !get_str(p, end, key_desc) || !get_str(p, end, leaf_desc))
+      break;
+    if (tables_.count(path))
+      continue;
+    TableDesc desc(path, std::move(fds[i + 1]), type, key_size, leaf_size,
+                   max_entries, flags);
+    desc.key_desc = key_desc;
+    desc.leaf_desc = leaf_desc;
+    desc.key_sscanf = desc.leaf_sscanf = remote_sscanf;
+    desc.key_snprintf = desc.leaf_snprintf = remote_snprintf;
+    desc.is_shared = true;
+    tables_[path] = std::move(desc);
+  }
+  munmap(map, hdr.size);
+  return true;
+}
+
+bool SockTableStorage::Find(const string &name, TableStorage::iterator &result) const {
+  auto it = tables_.find(name);
+  // tables may have been published since we last attached
+  if (it == tables_.end() && !server_.joinable() && attach(false))
+    it = tables_.find(name);
+  if (it == tables_.end())
+    return false;
+  result = TableStorage::iterator(make_unique<iterator>(it));
+  return true;
+}
+
+bool SockTableStorage::Insert(const string &name, TableDesc &&desc) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = tables_.find(name);
+  if (it != tables_.end())
+    return false;
+  tables_[name] = std::move(desc);
+  if (server_.joinable())
+    update_registry();
+  return true;
+}
+
+bool SockTableStorage::Delete(const string &name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = tables_.find(name);
+  if (it == tables_.end())
+    return false;
+  tables_.erase(it);
+  if (server_.joinable())
+    update_registry();
+  return true;
+}
+
+unique_ptr<TableStorageIteratorImpl> SockTableStorage::begin() {
+  return make_unique<iterator>(tables_.begin());
+}
+unique_ptr<TableStorageIteratorImpl> SockTableStorage::end() {
+  return make_unique<iterator>(tables_.end());
+}
+
+unique_ptr<TableStorageIteratorImpl> SockTableStorage::lower_bound(const string &k) {
+  return make_unique<iterator>(tables_.lower_bound(k));
+}
+unique_ptr<TableStorageIteratorImpl> SockTableStorage::upper_bound(const string &k) {
+  return make_unique<iterator>(tables_.upper_bound(k));
+}
+unique_ptr<TableStorageIteratorImpl> SockTableStorage::erase(const TableStorageIteratorImpl &it) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto i = tables_.find((*it).first);
+  if (i == tables_.end())
+    return unique_ptr<iterator>();
+  auto next = tables_.erase(i);
+  if (server_.joinable())
+    update_registry();
+  return make_unique<iterator>(next);
+}
+
+unique_ptr<TableStorage> createPublishedTableStorage(const string &sock_path) {
+  auto impl = make_unique<SockTableStorage>(sock_path);
+  if (!impl->serve())
+    return nullptr;
+  auto t = make_unique<TableStorage>();
+  t->Init(std::move(impl));
+  t->AddMapTypesVisitor(createJsonMapTypesVisitor());
+  return t;
+}
+
+unique_ptr<TableStorage> createRemoteTableStorage(const string &sock_path) {
+  auto impl = make_unique<SockTableStorage>(sock_path);
+  if (!impl->attach())
+    return nullptr;
+  auto t = make_unique<TableStorage>();
+  t->Init(std::move(impl));
+  t->AddMapTypesVisitor(createJsonMapTypesVisitor());
+  return t;
+}
+
+}  // namespace ebpf
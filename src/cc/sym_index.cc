@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2021 Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+
+#include "sym_index.h"
+#include "vendor/tinyformat.hpp"
+
+namespace {
+
+// Bump this whenever the layout below changes.
+const char INDEX_MAGIC[8] = {'B', 'C', 'C', 'S', 'Y', 'M', '0', '1'};
+
+// Followed by count SymbolIndex::Entry and strtab_size bytes of names
+struct IndexHeader {
+  char magic[8];
+  uint64_t count;
+  uint64_t strtab_size;
+};
+
+}  // namespace
+
+SymbolIndex::SymbolIndex(void *addr, size_t len)
+    : addr_(addr), len_(len) {
+  const IndexHeader *hdr = static_cast<const IndexHeader *>(addr);
+  entries_ = reinterpret_cast<const Entry *>(hdr + 1);
+  count_ = hdr->count;
+  strtab_ = reinterpret_cast<const char *>(entries_ + count_);
+}
+
+SymbolIndex::~SymbolIndex() { munmap(addr_, len_); }
+
+std::string SymbolIndex::path(const std::string &build_id,
+                              const struct bcc_symbol_option *option) {
+  const char *dir = ::getenv("BCC_SYM_CACHE_DIR");
+  if (!dir || !*dir || build_id.empty())
+    return "";
+  // The options select which symbols get loaded, so they are part of the key
+  return tfm::format("%s/%s.%d%d.%x.sym", dir, build_id,
+                     option->use_debug_file, option->check_debug_file_crc,
+                     option->use_symbol_type);
+}
+
+std::unique_ptr<SymbolIndex> SymbolIndex::open(const std::string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return nullptr;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(IndexHeader)) {
+    close(fd);
+    return nullptr;
+  }
+  size_t len = st.st_size;
+  void *addr = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    return nullptr;
+
+  // Reject anything that does not match the layout exactly, so that lookups
+  // never need bounds checks
+  const IndexHeader *hdr = static_cast<const IndexHeader *>(addr);
+  size_t avail = len - sizeof(IndexHeader);
+  if (memcmp(hdr->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) ||
+      hdr->count > avail / sizeof(Entry) ||
+      hdr->strtab_size != avail - hdr->count * sizeof(Entry)) {
+    munmap(addr, len);
+    return nullptr;
+  }
+
+  std::unique_ptr<SymbolIndex> index(new SymbolIndex(addr, len));
+  if (hdr->strtab_size && index->strtab_[hdr->strtab_size - 1] != '\0')
+    return nullptr;
+  for (size_t i = 0; i < index->count_; i++) {
+    const Entry &e = index->entries_[i];
+    if (e.name_off >= hdr->strtab_size ||
+        (i > 0 && e.start < index->entries_[i - 1].start))
+      return nullptr;
+  }
+  return index;
+}
+
+void SymbolIndex::write(const std::string &path,
+                        const std::vector<Entry> &entries,
+                        const std::string &strtab) {
+  size_t slash = path.rfind('/');
+  if (slash != std::string::npos && slash > 0) {
+    std::string dir = path.substr(0, slash);
+    if (mkdir(dir.c_str(), 0755) && errno != EEXIST)
+      return;
+  }
+
+  IndexHeader hdr;
+  memcpy(hdr.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+  hdr.count = entries.size();
+  hdr.strtab_size = strtab.size();
+
+  // Write to a private file first so concurrent readers never map a
+  // partially written index.
+  std::string tmp_path = path + ".tmp." + std::to_string(getpid());
+  {
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!out)
+      return;
+    out.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+    out.write(reinterpret_cast<const char *>(entries.data()),
+              entries.size() * sizeof(Entry));
+    out.write(strtab.data(), strtab.size());
+    if (!out) {
+      out.close();
+      unlink(tmp_path.c_str());
+      return;
+    }
+  }
+  if (rename(tmp_path.c_str(), path.c_str()))
+    unlink(tmp_path.c_str());
+}
+
+bool SymbolIndex::find(uint64_t offset, const char **name,
+                       uint64_t *sym_offset) const {
+  const Entry *begin = entries_, *end = entries_ + count_;
+  const Entry *it = std::upper_bound(
+      begin, end, offset,
+      [](uint64_t off, const Entry &e) { return off < e.start; });
+  if (it == begin)
+    return false;
+
+  // Walk back over nested symbols, see ProcSyms::Module::find_addr()
+  --it;
+  uint64_t limit = it->start;
+  for (; offset >= it->start; --it) {
+    if (offset < it->start + it->size) {
+      *name = strtab_ + it->name_off;
+      *sym_offset = offset - it->start;
+      return true;
+    }
+    if (limit > it->start + it->size)
+      break;
+    if (it == begin)
+      break;
+  }
+  return false;
+}
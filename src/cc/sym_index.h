@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2021 Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bcc_syms.h"
+
+// Persistent symbol index of an ELF file, stored per build-id under
+// $BCC_SYM_CACHE_DIR. The file holds the symbols sorted by address followed
+// by their names, and is mapped read-only so that later runs resolve
+// addresses without parsing the symbol tables.
+class SymbolIndex {
+ public:
+  struct Entry {
+    uint64_t start;
+    uint64_t size;
+    // offset of the NUL terminated name in the string table
+    uint64_t name_off;
+  };
+
+  ~SymbolIndex();
+
+  // Path of the index for a build-id and symbol options, or an empty string
+  // if the cache is disabled.
+  static std::string path(const std::string &build_id,
+                          const struct bcc_symbol_option *option);
+  // Map the index at path. Returns nullptr if it is missing or corrupt.
+  static std::unique_ptr<SymbolIndex> open(const std::string &path);
+  // Atomically replace the index at path. entries must be sorted by start.
+  // Failures are not reported, the next run just builds the index again.
+  static void write(const std::string &path, const std::vector<Entry> &entries,
+                    const std::string &strtab);
+
+  // Same lookup as ProcSyms::Module::find_addr(), nested symbols included
+  bool find(uint64_t offset, const char **name, uint64_t *sym_offset) const;
+  size_t size() const { return count_; }
+
+ private:
+  SymbolIndex(void *addr, size_t len);
+
+  void *addr_;
+  size_t len_;
+  const Entry *entries_;
+  size_t count_;
+  const char *strtab_;
+};
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2021 Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <llvm/DebugInfo/DIContext.h>
+#include <llvm/DebugInfo/DWARF/DWARFContext.h>
+#include <llvm/Object/ObjectFile.h>
+
+#include "bpf_module_compiler.h"
+#include "sym_lines.h"
+
+using namespace llvm;
+
+namespace {
+
+// DILineInfo fields that DWARF did not provide
+const char BAD_STRING[] = "<invalid>";
+
+class DwarfSourceLines : public SourceLines {
+ public:
+  DwarfSourceLines(object::OwningBinary<object::ObjectFile> binary)
+      : binary_(std::move(binary)),
+        context_(DWARFContext::create(*binary_.getBinary())) {}
+
+  bool lookup(uint64_t addr, std::vector<Frame> *frames) override {
+    DILineInfoSpecifier spec(
+        DILineInfoSpecifier::FileLineInfoKind::AbsoluteFilePath,
+        DINameKind::LinkageName);
+#if LLVM_MAJOR_VERSION >= 9
+    DIInliningInfo info = context_->getInliningInfoForAddress(
+        {addr, object::SectionedAddress::UndefSection}, spec);
+#else
+    DIInliningInfo info = context_->getInliningInfoForAddress(addr, spec);
+#endif
+
+    frames->clear();
+    for (uint32_t i = 0; i < info.getNumberOfFrames(); i++) {
+      const DILineInfo &frame = info.getFrame(i);
+      if (frame.Line == 0 && frame.FunctionName == BAD_STRING)
+        continue;
+      frames->push_back({frame.FunctionName == BAD_STRING ? "" : frame.FunctionName,
+                         frame.FileName == BAD_STRING ? "" : frame.FileName,
+                         frame.Line, frame.Column});
+    }
+    return !frames->empty();
+  }
+
+ private:
+  object::OwningBinary<object::ObjectFile> binary_;
+  std::unique_ptr<DWARFContext> context_;
+};
+
+}  // namespace
+
+// Called by SourceLines::open() in libbcc, through the compiler entries
+SourceLines *bcc_source_lines_open(const char *path) {
+  Expected<object::OwningBinary<object::ObjectFile>> binary =
+      object::ObjectFile::createObjectFile(path);
+  if (!binary) {
+    consumeError(binary.takeError());
+    return nullptr;
+  }
+  return new DwarfSourceLines(std::move(*binary));
+}
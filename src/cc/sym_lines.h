@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2021 Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Source locations of the code of one ELF file, read from its DWARF. Only
+// available in builds linked against LLVM, elsewhere open() always fails.
+class SourceLines {
+ public:
+  struct Frame {
+    std::string function;
+    std::string file;
+    uint32_t line;
+    uint32_t column;
+  };
+
+  virtual ~SourceLines() = default;
+
+  // Read the DWARF of the file at path, which may be a separate debug file.
+  // Returns nullptr if it has none.
+  static std::unique_ptr<SourceLines> open(const std::string &path);
+
+  // Frames at the ELF virtual address addr, the innermost inlined call first
+  // and the function that contains addr last. Line tables are parsed on the
+  // first lookup in their compile unit and kept. Returns false if addr has no
+  // line info.
+  virtual bool lookup(uint64_t addr, std::vector<Frame> *frames) = 0;
+};
@@ -16,20 +16,29 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
 #include <sys/types.h>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include "bcc_elf.h"
+#include "bcc_perf_map.h"
 #include "bcc_proc.h"
 #include "bcc_syms.h"
 #include "file_desc.h"
+#include "sym_index.h"
+#include "sym_lines.h"
 
 class ProcStat {
   std::string procfs_;
-  ino_t inode_;
+  // checked by lookups on any thread while a refresh resets it
+  std::atomic<ino_t> inode_;
   ino_t getinode_();
 
 public:
@@ -44,22 +53,59 @@ public:
 
   virtual void refresh() = 0;
   virtual bool resolve_addr(uint64_t addr, struct bcc_symbol *sym, bool demangle = true) = 0;
+  // Resolve addrs[0..n) into syms[0..n), resolving each distinct address
+  // once. Returns the number of addresses resolved.
+  virtual size_t resolve_addrs(const uint64_t *addrs, size_t n,
+                               struct bcc_symbol *syms, bool demangle = true);
   virtual bool resolve_name(const char *module, const char *name,
                             uint64_t *addr) = 0;
+  // Apply a mapping change of the target to the cache, for callers that
+  // trace mmap/munmap instead of having the cache rescan the process.
+  // Returns false if the cache does not track mappings.
+  virtual bool add_mapping(const mod_info *mod) { return false; }
+  virtual bool remove_mapping(uint64_t start, uint64_t end) { return false; }
+  // Start loading the symbols of all modules in the background
+  virtual void prefetch(unsigned threads) {}
+  // Source frames of addr, see bcc_symcache_resolve_source()
+  virtual int resolve_source(uint64_t addr, struct bcc_source_frame *frames,
+                             size_t max) {
+    return -1;
+  }
+  // Call stack of a stack snapshot, see bcc_symcache_unwind()
+  virtual int unwind(const struct bcc_user_regs *regs, const void *stack,
+                     size_t stack_len, uint64_t *ips, size_t max) {
+    return -1;
+  }
 };
 
 class KSyms : SymbolCache {
-  struct Symbol {
-    Symbol(const char *name, const char *mod, uint64_t addr) : name(name), mod(mod), addr(addr) {}
-    std::string name;
-    std::string mod;
-    uint64_t addr;
+  // Symbols of /proc/kallsyms with all names packed into one string pool.
+  // Loaded once and shared by every KSyms in the process.
+  struct Table {
+    struct Symbol {
+      uint64_t addr;
+      // offsets of the symbol and module name in strtab
+      uint32_t name;
+      uint32_t mod;
+
+      bool operator<(const Symbol &rhs) const { return addr < rhs.addr; }
+    };
 
-    bool operator<(const Symbol &rhs) const { return addr < rhs.addr; }
+    std::vector<Symbol> syms;
+    std::string strtab;
+    // indexes into syms sorted by name, built on the first lookup by name
+    std::once_flag names_once;
+    std::vector<uint32_t> by_name;
+
+    const char *str(uint32_t off) const { return strtab.data() + off; }
   };
+  struct Loader;
 
-  std::vector<Symbol> syms_;
-  std::unordered_map<std::string, uint64_t> symnames_;
+  // Only accessed with std::atomic_load() and std::atomic_store(), lookups
+  // may run on several threads while an empty table is reloaded
+  std::shared_ptr<Table> table_;
+  std::shared_ptr<Table> table();
+  static std::shared_ptr<Table> shared_table();
   static void _add_symbol(const char *, const char *, uint64_t, void *);
 
 public:
@@ -103,11 +149,67 @@ class ProcSyms : SymbolCache {
     }
   };
 
+  // Symbols of one file. ELF files and the vDSO are looked up in a process
+  // wide store keyed by file identity and symbol options, so every ProcSyms
+  // mapping the same binary shares one table; only the address ranges are
+  // per process.
+  struct SymbolTable {
+    std::mutex mutex_;
+    bool loaded_ = false;
+    // Set once the symbols of a file are loaded. They never change after
+    // that, so lookups search them without the mutex, which is only taken
+    // to resolve a lazy name. Perf maps and jitdumps, which grow, are
+    // always searched with the mutex held.
+    std::atomic<bool> ready_{false};
+    std::unordered_set<std::string> symnames_;
+    std::vector<Symbol> syms_;
+    // empty if the file has none
+    std::string build_id_;
+    // when set, symbols are looked up here and syms_ stays empty
+    std::unique_ptr<SymbolIndex> index_;
+    // Address of the first symbol of each name, keyed by the names interned
+    // in symnames_. Built on the first lookup by name.
+    bool names_loaded_ = false;
+    std::unordered_map<const std::string *, uint64_t> name_index_;
+    // demangled form of the mangled names handed out so far, keyed by the
+    // name pointer
+    std::unordered_map<const char *, std::string> demangled_;
+    // how far a perf map or jitdump has been read
+    uint64_t perf_map_offset_ = 0;
+    // names of the code loaded by a jitdump so far, by code index
+    std::unordered_map<uint64_t, const std::string *> jit_names_;
+    // DWARF of the file, opened on the first lookup of a source location
+    bool lines_loaded_ = false;
+    std::unique_ptr<SourceLines> lines_;
+    // .eh_frame unwind table, read on the first unwind through the file
+    bool cfi_loaded_ = false;
+    std::vector<bcc_cfi_row> cfi_;
+  };
+
+  // What the modules need of a file besides its symbols, cached by
+  // (dev, inode, size, mtime): processes mapping the same file, like
+  // containers sharing image layers, then only stat it through their
+  // mount namespace before reusing the ELF type, build-id, text section
+  // and symbol table found for another one.
+  struct FileInfo {
+    dev_t dev = 0;
+    ino_t ino = 0;
+    // build-id, or size and mtime if the file has none
+    std::string id;
+    std::string build_id;
+    // ET_* of an ELF file, -1 otherwise
+    int elf_type = -1;
+    bool has_text = false;
+    uint64_t text_addr = 0;
+    uint64_t text_offset = 0;
+  };
+
   enum class ModuleType {
     UNKNOWN,
     EXEC,
     SO,
     PERF_MAP,
+    JIT_DUMP,
     VDSO
   };
 
@@ -125,7 +227,6 @@ class ProcSyms : SymbolCache {
     std::string name_;
     std::string path_;
     std::vector<Range> ranges_;
-    bool loaded_;
     bcc_symbol_option *symbol_option_;
     ModuleType type_;
 
@@ -133,38 +234,105 @@ class ProcSyms : SymbolCache {
     uint64_t elf_so_offset_;
     uint64_t elf_so_addr_;
 
-    std::unordered_set<std::string> symnames_;
-    std::vector<Symbol> syms_;
+    std::shared_ptr<SymbolTable> table_;
 
+    // Called with table_->mutex_ held
     void load_sym_table();
+    void read_perf_map();
+    void read_jitdump();
+    void update_perf_map();
+    void save_sym_index(const std::string &path);
 
     bool contains(uint64_t addr, uint64_t &offset) const;
+    uint64_t offset_of(const Range &range, uint64_t addr) const;
     uint64_t start() const { return ranges_.begin()->start; }
 
     bool find_addr(uint64_t offset, struct bcc_symbol *sym);
+    bool find_symbol(uint64_t offset, struct bcc_symbol *sym, bool locked);
+    const char *demangled_name(const char *name);
     bool find_name(const char *symname, uint64_t *addr);
+    int find_source(uint64_t offset, struct bcc_source_frame *frames,
+                    size_t max);
+    bool find_cfi(uint64_t offset, struct bcc_cfi_row *row);
 
     static int _add_symbol(const char *symname, uint64_t start, uint64_t size,
                            void *p);
+    static int _add_jit_record(const struct bcc_jitdump_record *rec, void *p);
     static int _add_symbol_lazy(size_t section_idx, size_t str_table_idx,
                                 size_t str_len, uint64_t start, uint64_t size,
                                 int debugfile, void *p);
   };
 
   int pid_;
+  // Held shared by lookups and exclusively while the modules change, so
+  // one ProcSyms can be used from several threads
+  mutable std::shared_timed_mutex mutex_;
   std::vector<Module> modules_;
+
+  struct RangeEntry {
+    uint64_t start;
+    uint64_t end;
+    const Module::Range *range;
+    size_t module;
+  };
+  // Ranges of all modules but perf maps sorted by start, rebuilt whenever
+  // modules_ changes
+  std::vector<RangeEntry> range_index_;
+  std::vector<size_t> perf_maps_;
   ProcStat procstat_;
   bcc_symbol_option symbol_option_;
+  // Background loading of symbol tables, see prefetch()
+  unsigned prefetch_threads_ = 0;
+  std::atomic<bool> prefetch_stop_;
+  std::vector<std::thread> prefetch_workers_;
+  void start_prefetch();
+  void stop_prefetch();
 
   static int _add_module(mod_info *, int, void *);
   void load_modules();
+  void refresh_locked();
+  void refresh_if_stale();
+  void unmap_range(uint64_t start, uint64_t end);
+  void build_range_index();
+  const RangeEntry *find_range(uint64_t addr) const;
+  bool lookup_addr(uint64_t addr, struct bcc_symbol *sym, bool demangle);
+  static bool file_info(const std::string &path, FileInfo &info);
+  static std::shared_ptr<SymbolTable> shared_table(
+      const std::string &path, ModuleType type,
+      const bcc_symbol_option *option);
+  static std::shared_ptr<SymbolTable> shared_table(
+      const FileInfo &info, const bcc_symbol_option *option);
+  static bool lookup_name(SymbolTable &table, const std::string &path,
+                          const bcc_symbol_option *option,
+                          const char *symname, uint64_t *addr);
 
 public:
   ProcSyms(int pid, struct bcc_symbol_option *option = nullptr);
+  virtual ~ProcSyms();
   virtual void refresh() override;
   virtual bool resolve_addr(uint64_t addr, struct bcc_symbol *sym, bool demangle = true) override;
+  virtual size_t resolve_addrs(const uint64_t *addrs, size_t n,
+                               struct bcc_symbol *syms,
+                               bool demangle = true) override;
   virtual bool resolve_name(const char *module, const char *name,
                             uint64_t *addr) override;
+  virtual bool add_mapping(const mod_info *mod) override;
+  virtual bool remove_mapping(uint64_t start, uint64_t end) override;
+  virtual int resolve_source(uint64_t addr, struct bcc_source_frame *frames,
+                             size_t max) override;
+  virtual int unwind(const struct bcc_user_regs *regs, const void *stack,
+                     size_t stack_len, uint64_t *ips, size_t max) override;
+  // Load the symbol tables of all ELF modules on up to threads worker
+  // threads, now and after every refresh, so that the first lookups do not
+  // parse them one by one. Lookups in a module wait for its table only.
+  virtual void prefetch(unsigned threads) override;
+
+  // Address of symname in the ELF file at path, through the same name index
+  // ProcSyms uses. The indexes of the last few files are kept around, so
+  // repeated lookups in one binary only parse it once.
+  static bool resolve_elf_name(const std::string &path,
+                               const bcc_symbol_option *option,
+                               const char *symname, uint64_t *addr);
 };
 
 class BuildSyms {
@@ -197,11 +365,18 @@ class BuildSyms {
     bool resolve_addr(uint64_t offset, struct bcc_symbol*, bool demangle=true);
   };
 
+  // null for build-ids found in no store
   std::unordered_map<std::string, std::unique_ptr<Module> > buildmap_;
+  std::vector<std::string> stores_;
+
+  Module *find_module(const std::string &build_id);
 
 public:
   BuildSyms() {}
   virtual ~BuildSyms() = default;
   virtual bool add_module(const std::string module_name);
+  // Look up the build-ids not added with add_module() in dir, a store of
+  // debug files named by build-id, see bcc_buildsymcache_add_store()
+  virtual bool add_store(const std::string &dir);
   virtual bool resolve_addr(std::string build_id, uint64_t offset, struct bcc_symbol *sym, bool demangle = true);
 };
@@ -27,9 +27,18 @@
 
 namespace ebpf {
 
-typedef std::map<int, std::tuple<int, std::string, int, int, int, int, int, std::string, std::string>>
+// fake fd -> map type, name, key size, value size, max entries, flags, pinned
+// id, inner map name, pin path and NUMA node
+typedef std::map<int, std::tuple<int, std::string, int, int, int, int, int, std::string, std::string,
+                                 int>>
         fake_fd_map_def;
 
+// The NUMA node of the arrays of maps of BPF_NUMA_REPLICAS in helpers.h,
+// filled with a copy of their inner map per node
+static const int BPF_NUMA_REPLICAS_NODE = -2;
+// and of those of BPF_EPOCH_BUFFERS, filled with their inner map and a copy
+static const int BPF_EPOCH_BUFFERS_NODE = -3;
+
 class TableStorageImpl;
 class TableStorageIteratorImpl;
 
@@ -109,5 +118,14 @@ class TableStorage {
 };
 
 std::unique_ptr<TableStorage> createSharedTableStorage();
+std::unique_ptr<TableStorage> createLocalTableStorage();
 std::unique_ptr<TableStorage> createBpfFsTableStorage();
+
+/// Table storage whose tables are served to other processes through the unix
+/// socket at sock_path. Returns null if the socket cannot be created.
+std::unique_ptr<TableStorage> createPublishedTableStorage(const std::string &sock_path);
+/// Table storage attached to the tables published at sock_path by another
+/// process, without recompiling or pinning them. The tables lack key and leaf
+/// formatters. Returns null if the publisher cannot be reached.
+std::unique_ptr<TableStorage> createRemoteTableStorage(const std::string &sock_path);
 }
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2021 Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace_pipe.h"
+
+// width of the right aligned task name, followed by '-'
+#define TRACE_TASK_LEN 16
+
+struct bcc_trace_pipe {
+  int fd;
+  char *buf; // size + 1 bytes, to terminate a line filling all of it
+  size_t size;
+  size_t start; // of the first line not parsed yet
+  size_t end;
+};
+
+struct bcc_trace_pipe * bcc_trace_pipe_new(int fd, size_t size) {
+  struct bcc_trace_pipe *tp;
+
+  if (size < 2 * TRACE_TASK_LEN)
+    size = 2 * TRACE_TASK_LEN;
+
+  tp = calloc(1, sizeof(*tp));
+  if (!tp)
+    return NULL;
+  tp->buf = malloc(size + 1);
+  if (!tp->buf) {
+    free(tp);
+    return NULL;
+  }
+  tp->fd = fd;
+  tp->size = size;
+  return tp;
+}
+
+void bcc_trace_pipe_free(struct bcc_trace_pipe *tp) {
+  if (!tp)
+    return;
+  free(tp->buf);
+  free(tp);
+}
+
+static bool parse_int(const char *s, int32_t *val) {
+  char *end;
+  long v;
+
+  errno = 0;
+  v = strtol(s, &end, 10);
+  if (errno || end == s || *end)
+    return false;
+  *val = v;
+  return true;
+}
+
+// Same parsing as BPF.trace_fields() used to do in Python
+static bool parse_line(char *base, char *line, size_t len,
+                       struct bcc_trace_record *rec) {
+  char *tok[4], *save, *p, *ts_end, *msg, *end;
+  int i;
+
+  while (len && isspace((unsigned char)line[len - 1]))
+    line[--len] = '\0';
+  // "CPU:N [LOST M EVENTS]"
+  if (len >= 4 && !strncmp(line, "CPU:", 4))
+    return false;
+  if (len <= TRACE_TASK_LEN)
+    return false;
+
+  p = line;
+  while (p < line + TRACE_TASK_LEN && isspace((unsigned char)*p))
+    p++;
+  line[TRACE_TASK_LEN] = '\0';
+  rec->task = p - base;
+
+  p = line + TRACE_TASK_LEN + 1;
+  ts_end = strchr(p, ':');
+  if (!ts_end)
+    return false;
+  *ts_end = '\0';
+  for (i = 0; i < 4; i++, p = NULL) {
+    tok[i] = strtok_r(p, " \t", &save);
+    if (!tok[i])
+      return false;
+  }
+  if (strtok_r(NULL, " \t", &save))
+    return false;
+
+  // tok[1] is "[cpu]"
+  i = strlen(tok[1]);
+  if (i < 3 || tok[1][0] != '[' || tok[1][i - 1] != ']')
+    return false;
+  tok[1][i - 1] = '\0';
+  if (!parse_int(tok[0], &rec->pid) || !parse_int(tok[1] + 1, &rec->cpu))
+    return false;
+  rec->flags = tok[2] - base;
+  rec->ts = strtod(tok[3], &end);
+  if (end == tok[3] || *end)
+    return false;
+
+  // ": <sym_or_addr>: <msg>", the symbol is missing on kernels before 4.13
+  // when the address is invalid
+  end = line + len;
+  p = strchr(ts_end + 1, ':');
+  msg = p ? p + 2 : ts_end + 2;
+  if (msg > end)
+    msg = end;
+  rec->msg = msg - base;
+  rec->msg_len = end - msg;
+  return true;
+}
+
+int bcc_trace_pipe_read(struct bcc_trace_pipe *tp,
+                        struct bcc_trace_record *recs, int max_recs,
+                        const char **data) {
+  char *line, *nl;
+  ssize_t n;
+  int cnt = 0;
+
+  if (tp->start) {
+    memmove(tp->buf, tp->buf + tp->start, tp->end - tp->start);
+    tp->end -= tp->start;
+    tp->start = 0;
+  }
+
+  if (!memchr(tp->buf, '\n', tp->end) && tp->end < tp->size) {
+    n = read(tp->fd, tp->buf + tp->end, tp->size - tp->end);
+    if (n < 0)
+      return errno == EAGAIN || errno == EINTR ? 0 : -errno;
+    tp->end += n;
+  }
+
+  *data = tp->buf;
+  while (cnt < max_recs && tp->start < tp->end) {
+    line = tp->buf + tp->start;
+    nl = memchr(line, '\n', tp->end - tp->start);
+    if (!nl) {
+      // a line longer than the buffer is cut
+      if (tp->start || tp->end < tp->size)
+        break;
+      nl = tp->buf + tp->end;
+    }
+    *nl = '\0';
+    tp->start = nl - tp->buf + 1;
+    if (tp->start > tp->end)
+      tp->start = tp->end;
+    if (parse_line(tp->buf, line, nl - line, &recs[cnt]))
+      cnt++;
+  }
+  return cnt;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2021 Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BCC_TRACE_PIPE_H
+#define BCC_TRACE_PIPE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Buffered reader of trace_pipe, which parses the header of the lines written
+ * by bpf_trace_printk():
+ *
+ *   <task>-<pid> [<cpu>] <flags> <timestamp>: <sym>: <msg>
+ */
+struct bcc_trace_pipe;
+
+// A parsed line, the strings are offsets of NUL terminated strings in data
+struct bcc_trace_record {
+  uint32_t task;
+  uint32_t flags;
+  uint32_t msg;
+  uint32_t msg_len;
+  int32_t pid;
+  int32_t cpu;
+  double ts;
+};
+
+/* Read from the already open trace_pipe fd through a buffer of size bytes,
+ * which also bounds the length of a line. The fd stays owned by the caller. */
+struct bcc_trace_pipe * bcc_trace_pipe_new(int fd, size_t size);
+void bcc_trace_pipe_free(struct bcc_trace_pipe *tp);
+
+/* Parse up to max_recs lines, reading from the fd only if no complete line is
+ * buffered, which blocks unless the fd is non blocking. Lines that are not
+ * from bpf_trace_printk(), such as the lost events notices, are skipped.
+ * Returns the number of records, whose strings are in *data until the next
+ * call, 0 if nothing could be read yet, or a negative errno. */
+int bcc_trace_pipe_read(struct bcc_trace_pipe *tp,
+                        struct bcc_trace_record *recs, int max_recs,
+                        const char **data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -17,6 +17,7 @@
 
 #include <memory>
 #include <string>
+#include <tuple>
 #include <unordered_map>
 #include <vector>
 
@@ -43,6 +44,26 @@ static const std::string USDT_PROGRAM_HEADER =
 static const std::string COMPILER_BARRIER =
     "__asm__ __volatile__(\"\": : :\"memory\");";
 
+// Where an argument is at a probe location, for the programs reading the
+// arguments through the BPF cookies of their uprobes. Keep in sync with
+// struct bcc_usdt_arg_spec in export/helpers.h.
+struct ArgSpec {
+  enum Kind : uint8_t { CONST, REG, REG_DEREF, ADDR_DEREF };
+
+  uint64_t val_off;
+  uint16_t reg_off;
+  uint16_t idx_reg_off;
+  uint8_t kind;
+  uint8_t scale;
+  uint8_t bitshift;
+  uint8_t is_signed;
+};
+
+// BCC_USDT_MAX_ARGS of export/helpers.h
+static const size_t MAX_SPEC_ARGS = 12;
+// The BPF_ARRAY of the argument specs of all locations, by slot
+static const std::string SPECS_TABLE = "__bcc_usdt_specs";
+
 class Argument {
 private:
   optional<int> arg_size_;
@@ -63,6 +84,8 @@ public:
   bool assign_to_local(std::ostream &stream, const std::string &local_name,
                        const std::string &binpath,
                        const optional<int> &pid = nullopt) const;
+  bool to_spec(ArgSpec *spec, const std::string &binpath,
+               const optional<int> &pid = nullopt) const;
 
   int arg_size() const { return arg_size_.value_or(sizeof(void *)); }
   std::string ctype() const;
@@ -194,6 +217,21 @@ struct Location {
   std::string bin_path_;
   std::vector<Argument> arguments_;
   Location(uint64_t addr, const std::string &bin_path, const char *arg_fmt);
+  Location(uint64_t addr, const std::string &bin_path,
+           const std::vector<Argument> &arguments);
+
+  static std::vector<Argument> parse_arguments(const char *arg_fmt);
+};
+
+// A probe location as read from the .note.stapsdt of a binary, with its
+// arguments already parsed
+struct ProbeNote {
+  uint64_t pc;
+  uint64_t semaphore;
+  uint64_t semaphore_offset;
+  std::string provider;
+  std::string name;
+  std::vector<Argument> arguments;
 };
 
 class Probe {
@@ -214,11 +252,13 @@ class Probe {
 
   std::string largest_arg_type(size_t arg_n);
 
+  bool semaphore_address(uint64_t *address);
   bool add_to_semaphore(int16_t val);
   bool resolve_global_address(uint64_t *global, const std::string &bin_path,
                               const uint64_t addr);
   bool lookup_semaphore_addr(uint64_t *address);
-  void add_location(uint64_t addr, const std::string &bin_path, const char *fmt);
+  void add_location(uint64_t addr, const std::string &bin_path,
+                    const std::vector<Argument> &arguments);
 
 public:
   Probe(const char *bin_path, const char *provider, const char *name,
@@ -236,6 +276,13 @@ public:
 
   bool usdt_getarg(std::ostream &stream);
   bool usdt_getarg(std::ostream &stream, const std::string& probe_func);
+  // Accessors reading the arguments through the spec of the location in
+  // SPECS_TABLE, whose slot is the cookie of the uprobe. They do not depend
+  // on the addresses of the locations, nor on the process.
+  bool usdt_getarg_spec(std::ostream &stream, const std::string &probe_func);
+  // The specs of the num_arguments() arguments at location n, in pid if the
+  // addresses of globals are needed
+  bool arg_specs(size_t n, const optional<int> &pid, ArgSpec *specs) const;
   std::string get_arg_ctype(int arg_index) {
     return largest_arg_type(arg_index);
   }
@@ -266,11 +313,16 @@ class Context {
   std::string cmd_bin_path_;
   bool loaded_;
 
-  static void _each_probe(const char *binpath, const struct bcc_elf_usdt *probe,
-                          void *p);
+  static void _each_note(const char *binpath, const struct bcc_elf_usdt *probe,
+                         void *p);
   static int _each_module(mod_info *, int enter_ns, void *p);
+  // Probe notes of the binary at path. Notes are cached by file identity, so
+  // Contexts of processes running the same binaries parse them once.
+  static std::shared_ptr<const std::vector<ProbeNote>> probe_notes(
+      const std::string &path);
 
-  void add_probe(const char *binpath, const struct bcc_elf_usdt *probe);
+  int add_probes(const std::string &binpath);
+  void add_probe(const std::string &binpath, const ProbeNote &note);
   std::string resolve_bin_path(const std::string &bin_path);
   Probe *get_checked(const std::string &provider_name,
                      const std::string &probe_name);
@@ -297,6 +349,12 @@ public:
   bool enable_probe(const std::string &probe_name, const std::string &fn_name);
   bool enable_probe(const std::string &provider_name,
                     const std::string &probe_name, const std::string &fn_name);
+  // Enable the (provider, probe, fn) triples, updating the semaphores of all
+  // of them at once. Fails without enabling anything if a probe is unknown
+  // or already enabled.
+  bool enable_probes(
+      const std::vector<std::tuple<std::string, std::string, std::string>>
+          &probes);
   bool addsem_probe(const std::string &provider_name,
                     const std::string &probe_name, const std::string &fn_name,
                     int16_t val);
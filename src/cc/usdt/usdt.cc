@@ -15,12 +15,16 @@
  */
 #include <algorithm>
 #include <cstring>
+#include <map>
+#include <mutex>
 #include <sstream>
+#include <tuple>
 #include <unordered_set>
 
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "bcc_elf.h"
@@ -34,8 +38,17 @@ namespace USDT {
 
 Location::Location(uint64_t addr, const std::string &bin_path, const char *arg_fmt)
     : address_(addr),
-      bin_path_(bin_path) {
+      bin_path_(bin_path),
+      arguments_(parse_arguments(arg_fmt)) {}
 
+Location::Location(uint64_t addr, const std::string &bin_path,
+                   const std::vector<Argument> &arguments)
+    : address_(addr),
+      bin_path_(bin_path),
+      arguments_(arguments) {}
+
+std::vector<Argument> Location::parse_arguments(const char *arg_fmt) {
+  std::vector<Argument> arguments;
 #ifdef __aarch64__
   ArgumentParser_aarch64 parser(arg_fmt);
 #elif __powerpc64__
@@ -49,8 +62,9 @@ Location::Location(uint64_t addr, const std::string &bin_path, const char *arg_f
     Argument arg;
     if (!parser.parse(&arg))
       continue;
-    arguments_.push_back(std::move(arg));
+    arguments.push_back(std::move(arg));
   }
+  return arguments;
 }
 
 Probe::Probe(const char *bin_path, const char *provider, const char *name,
@@ -83,43 +97,103 @@ bool Probe::resolve_global_address(uint64_t *global, const std::string &bin_path
   return true;
 }
 
-bool Probe::add_to_semaphore(int16_t val) {
-  assert(pid_);
+namespace {
 
-  if (!attached_semaphore_) {
-    uint64_t addr;
-    if (!resolve_global_address(&addr, bin_path_, semaphore_))
-      return false;
-    attached_semaphore_ = addr;
-  }
+struct SemaphoreUpdate {
+  uint64_t address;
+  int16_t delta;
+};
 
-  off_t address = static_cast<off_t>(attached_semaphore_.value());
+// At most UIO_MAXIOV entries per process_vm_readv/writev call
+const size_t SEMAPHORE_BATCH = 1024;
 
-  std::string procmem = tfm::format("/proc/%d/mem", pid_.value());
-  int memfd = ::open(procmem.c_str(), O_RDWR);
+bool update_semaphores_procmem(int pid, const SemaphoreUpdate *updates,
+                               size_t n) {
+  std::string procmem = tfm::format("/proc/%d/mem", pid);
+  int memfd = ::open(procmem.c_str(), O_RDWR | O_CLOEXEC);
   if (memfd < 0)
     return false;
 
-  int16_t original;
-
-  if (::lseek(memfd, address, SEEK_SET) < 0 ||
-      ::read(memfd, &original, 2) != 2) {
-    ::close(memfd);
-    return false;
+  for (size_t i = 0; i < n; i++) {
+    off_t address = static_cast<off_t>(updates[i].address);
+    int16_t value;
+    if (::pread(memfd, &value, 2, address) != 2) {
+      ::close(memfd);
+      return false;
+    }
+    value += updates[i].delta;
+    if (::pwrite(memfd, &value, 2, address) != 2) {
+      ::close(memfd);
+      return false;
+    }
   }
 
-  original = original + val;
+  ::close(memfd);
+  return true;
+}
+
+// Add the deltas to the semaphores of pid, reading and writing up to
+// SEMAPHORE_BATCH of them with a single process_vm_readv and
+// process_vm_writev. Whatever those cannot do, e.g. on kernels without them
+// or when they are not permitted, goes through /proc/PID/mem.
+bool update_semaphores(int pid, const std::vector<SemaphoreUpdate> &updates) {
+  // One entry per semaphore, they are read and written once per batch
+  std::map<uint64_t, int16_t> deltas;
+  for (const SemaphoreUpdate &update : updates)
+    deltas[update.address] += update.delta;
+  std::vector<SemaphoreUpdate> merged;
+  for (const auto &delta : deltas)
+    merged.push_back({delta.first, delta.second});
+
+  for (size_t start = 0; start < merged.size(); start += SEMAPHORE_BATCH) {
+    size_t n = std::min(SEMAPHORE_BATCH, merged.size() - start);
+    const SemaphoreUpdate *batch = &merged[start];
+    std::vector<int16_t> values(n);
+    std::vector<struct iovec> local(n), remote(n);
+    for (size_t i = 0; i < n; i++) {
+      local[i] = {&values[i], 2};
+      remote[i] = {reinterpret_cast<void *>(batch[i].address), 2};
+    }
 
-  if (::lseek(memfd, address, SEEK_SET) < 0 ||
-      ::write(memfd, &original, 2) != 2) {
-    ::close(memfd);
-    return false;
+    ssize_t len = n * 2, done = 0;
+    if (::process_vm_readv(pid, local.data(), n, remote.data(), n, 0) == len) {
+      for (size_t i = 0; i < n; i++)
+        values[i] += batch[i].delta;
+      done = ::process_vm_writev(pid, local.data(), n, remote.data(), n, 0);
+      if (done < 0)
+        done = 0;
+    }
+    // Semaphores before a partial write are updated already
+    size_t written = done / 2;
+    if (written < n &&
+        !update_semaphores_procmem(pid, batch + written, n - written))
+      return false;
   }
+  return true;
+}
 
-  ::close(memfd);
+}  // namespace
+
+bool Probe::semaphore_address(uint64_t *address) {
+  if (!attached_semaphore_) {
+    uint64_t addr;
+    if (!resolve_global_address(&addr, bin_path_, semaphore_))
+      return false;
+    attached_semaphore_ = addr;
+  }
+  *address = attached_semaphore_.value();
   return true;
 }
 
+bool Probe::add_to_semaphore(int16_t val) {
+  assert(pid_);
+
+  uint64_t address;
+  if (!semaphore_address(&address))
+    return false;
+  return update_semaphores(pid_.value(), {{address, val}});
+}
+
 bool Probe::enable(const std::string &fn_name) {
   if (attached_to_)
     return false;
@@ -192,31 +266,102 @@ bool Probe::usdt_getarg(std::ostream &stream, const std::string& probe_func) {
                                                       pid_))
         return false;
       stream << "\n  return 0;\n}\n";
-    } else {
-      stream << "  switch(PT_REGS_IP(ctx)) {\n";
-      for (Location &location : locations_) {
-        uint64_t global_address;
+      continue;
+    }
+
+    // Sites that read the argument the same way, which is the common case
+    // for inlined probes, share one accessor: (code, addresses of the sites)
+    std::vector<std::pair<std::string, std::vector<uint64_t>>> accessors;
+    std::unordered_map<std::string, size_t> accessor_of;
+    for (Location &location : locations_) {
+      uint64_t global_address;
 
-        if (!resolve_global_address(&global_address, location.bin_path_,
-                                    location.address_))
-          return false;
+      if (!resolve_global_address(&global_address, location.bin_path_,
+                                  location.address_))
+        return false;
 
-        tfm::format(stream, "  case 0x%xULL: ", global_address);
-        if (!location.arguments_[arg_n].assign_to_local(stream, cptr, location.bin_path_,
-                                                        pid_))
-          return false;
+      std::ostringstream code;
+      if (!location.arguments_[arg_n].assign_to_local(code, cptr, location.bin_path_,
+                                                      pid_))
+        return false;
 
-        stream << " return 0;\n";
-      }
-      stream << "  }\n";
-      stream << "  return -1;\n}\n";
+      auto it = accessor_of.emplace(code.str(), accessors.size());
+      if (it.second)
+        accessors.emplace_back(code.str(), std::vector<uint64_t>());
+      accessors[it.first->second].second.push_back(global_address);
     }
+
+    // The program is only attached to these sites, so a single accessor
+    // needs no dispatch
+    if (accessors.size() == 1) {
+      stream << "  " << accessors.front().first << "\n  return 0;\n}\n";
+      continue;
+    }
+
+    stream << "  switch(PT_REGS_IP(ctx)) {\n";
+    for (const auto &accessor : accessors) {
+      for (size_t i = 0; i < accessor.second.size(); i++)
+        tfm::format(stream, "  case 0x%xULL:%s", accessor.second[i],
+                    i + 1 < accessor.second.size() ? "\n" : " ");
+      stream << accessor.first << " return 0;\n";
+    }
+    stream << "  }\n";
+    stream << "  return -1;\n}\n";
+  }
+  return true;
+}
+
+bool Probe::usdt_getarg_spec(std::ostream &stream,
+                             const std::string &probe_func) {
+  const size_t arg_count = locations_[0].arguments_.size();
+
+  if (arg_count == 0)
+    return true;
+  if (arg_count > MAX_SPEC_ARGS)
+    return false;
+
+  // Shared by all the probes of the program
+  tfm::format(stream,
+              "#ifndef __BCC_USDT_SPECS\n"
+              "#define __BCC_USDT_SPECS\n"
+              "BPF_ARRAY(%s, struct bcc_usdt_spec, BCC_USDT_MAX_SPECS);\n"
+              "#endif\n",
+              SPECS_TABLE);
+
+  for (size_t arg_n = 0; arg_n < arg_count; ++arg_n) {
+    std::string ctype = largest_arg_type(arg_n);
+
+    tfm::format(stream,
+                "static __always_inline int _bpf_readarg_%s_%d("
+                "struct pt_regs *ctx, void *dest, size_t len) {\n"
+                "  if (len != sizeof(%s)) return -1;\n"
+                "  int __slot = bpf_get_attach_cookie(ctx);\n"
+                "  struct bcc_usdt_spec *__spec = %s.lookup(&__slot);\n"
+                "  u64 __val;\n"
+                "  if (!__spec || bcc_usdt_arg(ctx, &__spec->args[%d], &__val))\n"
+                "    return -1;\n"
+                "  *((%s *)dest) = __val;\n"
+                "  return 0;\n}\n",
+                probe_func, arg_n + 1, ctype, SPECS_TABLE, arg_n, ctype);
+  }
+  return true;
+}
+
+bool Probe::arg_specs(size_t n, const optional<int> &pid,
+                      ArgSpec *specs) const {
+  const Location &location = locations_[n];
+  if (location.arguments_.size() > MAX_SPEC_ARGS)
+    return false;
+  for (size_t i = 0; i < location.arguments_.size(); i++) {
+    if (!location.arguments_[i].to_spec(&specs[i], location.bin_path_, pid))
+      return false;
   }
   return true;
 }
 
-void Probe::add_location(uint64_t addr, const std::string &bin_path, const char *fmt) {
-  locations_.emplace_back(addr, bin_path, fmt);
+void Probe::add_location(uint64_t addr, const std::string &bin_path,
+                         const std::vector<Argument> &arguments) {
+  locations_.emplace_back(addr, bin_path, arguments);
 }
 
 void Probe::finalize_locations() {
@@ -235,10 +380,54 @@ void Probe::finalize_locations() {
   locations_.erase(last, locations_.end());
 }
 
-void Context::_each_probe(const char *binpath, const struct bcc_elf_usdt *probe,
-                          void *p) {
-  Context *ctx = static_cast<Context *>(p);
-  ctx->add_probe(binpath, probe);
+void Context::_each_note(const char *binpath, const struct bcc_elf_usdt *probe,
+                         void *p) {
+  auto notes = static_cast<std::vector<ProbeNote> *>(p);
+  notes->push_back({probe->pc, probe->semaphore, probe->semaphore_offset,
+                    probe->provider, probe->name,
+                    Location::parse_arguments(probe->arg_fmt)});
+}
+
+std::shared_ptr<const std::vector<ProbeNote>> Context::probe_notes(
+    const std::string &path) {
+  // (dev, inode, size, mtime)
+  typedef std::tuple<dev_t, ino_t, off_t, time_t, long> Key;
+  static const size_t MAX_CACHED = 64;
+  static std::mutex mutex;
+  // notes and when they were last used
+  typedef std::pair<std::shared_ptr<const std::vector<ProbeNote>>, uint64_t>
+      Entry;
+  static std::map<Key, Entry> cache;
+  static uint64_t clock;
+
+  struct stat st;
+  if (::stat(path.c_str(), &st) < 0)
+    return nullptr;
+  Key key(st.st_dev, st.st_ino, st.st_size, st.st_mtim.tv_sec,
+          st.st_mtim.tv_nsec);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = cache.find(key);
+  if (it != cache.end()) {
+    it->second.second = ++clock;
+    return it->second.first;
+  }
+
+  auto notes = std::make_shared<std::vector<ProbeNote>>();
+  if (bcc_elf_foreach_usdt(path.c_str(), _each_note, notes.get()) < 0)
+    return nullptr;
+
+  if (cache.size() >= MAX_CACHED) {
+    auto oldest = std::min_element(
+        cache.begin(), cache.end(),
+        [](const std::pair<const Key, Entry> &a,
+           const std::pair<const Key, Entry> &b) {
+          return a.second.second < b.second.second;
+        });
+    cache.erase(oldest);
+  }
+  cache.emplace(key, std::make_pair(notes, ++clock));
+  return notes;
 }
 
 int Context::_each_module(mod_info *mod, int enter_ns, void *p) {
@@ -253,24 +442,33 @@ int Context::_each_module(mod_info *mod, int enter_ns, void *p) {
   // executable region. We are going to parse the ELF on disk anyway, so we
   // don't need these duplicates.
   if (ctx->modules_.insert(path).second /*inserted new?*/) {
-    bcc_elf_foreach_usdt(path.c_str(), _each_probe, p);
+    ctx->add_probes(path);
   }
   return 0;
 }
 
-void Context::add_probe(const char *binpath, const struct bcc_elf_usdt *probe) {
+int Context::add_probes(const std::string &binpath) {
+  auto notes = probe_notes(binpath);
+  if (!notes)
+    return -1;
+  for (const ProbeNote &note : *notes)
+    add_probe(binpath, note);
+  return 0;
+}
+
+void Context::add_probe(const std::string &binpath, const ProbeNote &note) {
   for (auto &p : probes_) {
-    if (p->provider_ == probe->provider && p->name_ == probe->name) {
-      p->add_location(probe->pc, binpath, probe->arg_fmt);
+    if (p->provider_ == note.provider && p->name_ == note.name) {
+      p->add_location(note.pc, binpath, note.arguments);
       return;
     }
   }
 
   probes_.emplace_back(
-    new Probe(binpath, probe->provider, probe->name, probe->semaphore,
-              probe->semaphore_offset, pid_, mod_match_inode_only_)
+    new Probe(binpath.c_str(), note.provider.c_str(), note.name.c_str(),
+              note.semaphore, note.semaphore_offset, pid_, mod_match_inode_only_)
   );
-  probes_.back()->add_location(probe->pc, binpath, probe->arg_fmt);
+  probes_.back()->add_location(note.pc, binpath, note.arguments);
 }
 
 std::string Context::resolve_bin_path(const std::string &bin_path) {
@@ -345,6 +543,32 @@ bool Context::enable_probe(const std::string &provider_name,
   return false;
 }
 
+bool Context::enable_probes(
+    const std::vector<std::tuple<std::string, std::string, std::string>>
+        &probes) {
+  std::vector<Probe *> found;
+  std::vector<SemaphoreUpdate> updates;
+  for (const auto &probe : probes) {
+    Probe *p = get_checked(std::get<0>(probe), std::get<1>(probe));
+    if (!p || p->enabled() ||
+        std::find(found.begin(), found.end(), p) != found.end())
+      return false;
+    if (p->need_enable()) {
+      uint64_t address;
+      if (!pid_ || !p->semaphore_address(&address))
+        return false;
+      updates.push_back({address, 1});
+    }
+    found.push_back(p);
+  }
+
+  if (!updates.empty() && !update_semaphores(pid_.value(), updates))
+    return false;
+  for (size_t i = 0; i < found.size(); i++)
+    found[i]->attached_to_ = std::get<2>(probes[i]);
+  return true;
+}
+
 void Context::each(each_cb callback) {
   for (const auto &probe : probes_) {
     struct bcc_usdt info = {0};
@@ -391,7 +615,7 @@ Context::Context(const std::string &bin_path, uint8_t mod_match_inode_only)
     : loaded_(false), mod_match_inode_only_(mod_match_inode_only) {
   std::string full_path = resolve_bin_path(bin_path);
   if (!full_path.empty()) {
-    if (bcc_elf_foreach_usdt(full_path.c_str(), _each_probe, this) == 0) {
+    if (add_probes(full_path) == 0) {
       cmd_bin_path_ = full_path;
       loaded_ = true;
     }
@@ -420,7 +644,7 @@ Context::Context(int pid, const std::string &bin_path,
       mod_match_inode_only_(mod_match_inode_only) {
   std::string full_path = resolve_bin_path(bin_path);
   if (!full_path.empty()) {
-    int res = bcc_elf_foreach_usdt(full_path.c_str(), _each_probe, this);
+    int res = add_probes(full_path);
     if (res == 0) {
       cmd_bin_path_ = ebpf::get_pid_exe(pid);
       if (cmd_bin_path_.empty())
@@ -434,7 +658,18 @@ Context::Context(int pid, const std::string &bin_path,
 
 Context::~Context() {
   if (pid_stat_ && !pid_stat_->is_stale()) {
-    for (auto &p : probes_) p->disable();
+    // Release the semaphores of all enabled probes in one go
+    std::vector<SemaphoreUpdate> updates;
+    for (auto &p : probes_) {
+      if (!p->enabled())
+        continue;
+      p->attached_to_ = nullopt;
+      uint64_t address;
+      if (p->need_enable() && p->semaphore_address(&address))
+        updates.push_back({address, -1});
+    }
+    if (!updates.empty())
+      update_semaphores(pid_.value(), updates);
   }
 }
 }
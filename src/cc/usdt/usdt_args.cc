@@ -13,6 +13,7 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <cstring>
 #include <unordered_map>
 #include <regex>
 
@@ -114,6 +115,86 @@ bool Argument::assign_to_local(std::ostream &stream,
   return false;
 }
 
+// Offset of a register, as named by the argument parsers, in the struct
+// pt_regs of the kernel
+static bool pt_regs_offset(const std::string &reg, uint16_t *offset) {
+#if defined(__aarch64__) || defined(__powerpc64__) || defined(__s390x__)
+#if defined(__aarch64__)
+  const char *array = "regs[";
+  const uint16_t base = 0;
+  if (reg == "sp") {
+    *offset = 31 * 8;
+    return true;
+  }
+#elif defined(__powerpc64__)
+  const char *array = "gpr[";
+  const uint16_t base = 0;
+#else
+  // after args[1] and the psw
+  const char *array = "gprs[";
+  const uint16_t base = 24;
+#endif
+  size_t len = strlen(array);
+  if (reg.compare(0, len, array) != 0)
+    return false;
+  *offset = base + 8 * std::stoi(reg.substr(len));
+  return true;
+#elif defined(__x86_64__)
+  static const char *const regs[] = {
+      "r15", "r14", "r13", "r12", "bp", "bx", "r11", "r10", "r9", "r8",
+      "ax",  "cx",  "dx",  "si",  "di", "orig_ax", "ip", "cs", "flags", "sp"};
+  for (size_t i = 0; i < sizeof(regs) / sizeof(regs[0]); i++) {
+    if (reg == regs[i]) {
+      *offset = 8 * i;
+      return true;
+    }
+  }
+  return false;
+#else
+  return false;
+#endif
+}
+
+bool Argument::to_spec(ArgSpec *spec, const std::string &binpath,
+                       const optional<int> &pid) const {
+  *spec = {};
+  int size = std::abs(arg_size());
+  spec->bitshift = 64 - 8 * size;
+  spec->is_signed = arg_size() < 0;
+
+  if (constant_) {
+    spec->kind = ArgSpec::CONST;
+    spec->val_off = *constant_;
+    return true;
+  }
+
+  if (deref_ident_) {
+    uint64_t global_address;
+    if (*base_register_name_ != "ip" ||
+        !get_global_address(&global_address, binpath, pid))
+      return false;
+    spec->kind = ArgSpec::ADDR_DEREF;
+    spec->val_off = global_address + deref_offset_.value_or(0);
+    return true;
+  }
+
+  if (!pt_regs_offset(*base_register_name_, &spec->reg_off))
+    return false;
+  if (!deref_offset_) {
+    spec->kind = ArgSpec::REG;
+    return true;
+  }
+
+  spec->kind = ArgSpec::REG_DEREF;
+  spec->val_off = *deref_offset_;
+  if (index_register_name_) {
+    if (!pt_regs_offset(*index_register_name_, &spec->idx_reg_off))
+      return false;
+    spec->scale = scale_.value_or(1);
+  }
+  return true;
+}
+
 void ArgumentParser::print_error(ssize_t pos) {
   fprintf(stderr, "Parse error:\n    %s\n", arg_);
   for (ssize_t i = 0; i < pos + 4; ++i) fputc('-', stderr);
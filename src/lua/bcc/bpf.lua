@@ -25,6 +25,7 @@ local Bpf = class("BPF")
 Bpf.static.open_kprobes = {}
 Bpf.static.open_uprobes = {}
 Bpf.static.perf_buffers = {}
+Bpf.static.ringbuf_manager = nil
 Bpf.static.KPROBE_LIMIT = 1000
 Bpf.static.tracer_pipe = nil
 Bpf.static.DEFAULT_CFLAGS = {
@@ -62,6 +63,11 @@ function Bpf.static.cleanup()
     Bpf.static.perf_buffers[key] = nil
   end
 
+  if Bpf.static.ringbuf_manager ~= nil then
+    libbcc.bpf_free_ringbuf(Bpf.static.ringbuf_manager)
+    Bpf.static.ringbuf_manager = nil
+  end
+
   if Bpf.static.tracer_pipe ~= nil then
     Bpf.static.tracer_pipe:close()
   end
@@ -249,6 +255,20 @@ function Bpf:perf_buffer_store(id, reader)
     log.info("%s -> %s", id, reader)
 end
 
+-- all ring buffers share one manager, polled by ring_buffer_poll()
+function Bpf:ring_buffer_store(map_fd, callback)
+  if Bpf.ringbuf_manager == nil then
+    local rb = libbcc.bpf_new_ringbuf(map_fd, callback, nil)
+    assert(rb ~= nil, "failed to open ring buffer")
+    Bpf.ringbuf_manager = rb
+  else
+    assert(libbcc.bpf_add_ringbuf(Bpf.ringbuf_manager, map_fd, callback, nil) == 0,
+      "failed to add ring buffer")
+  end
+
+  log.info("ringbuf %s -> %s", map_fd, Bpf.ringbuf_manager)
+end
+
 function Bpf:probe_lookup(t, id)
   if t == "kprobe" then
     return Bpf.open_kprobes[id]
@@ -295,4 +315,14 @@ function Bpf:kprobe_poll(timeout)
   self:perf_buffer_poll(timeout)
 end
 
+function Bpf:ring_buffer_poll(timeout)
+  assert(Bpf.ringbuf_manager, "no ring buffers have been opened")
+  return libbcc.bpf_poll_ringbuf(Bpf.ringbuf_manager, timeout or -1)
+end
+
+function Bpf:ring_buffer_consume()
+  assert(Bpf.ringbuf_manager, "no ring buffers have been opened")
+  return libbcc.bpf_consume_ringbuf(Bpf.ringbuf_manager)
+end
+
 return Bpf
@@ -104,6 +104,21 @@ int perf_reader_fd(struct perf_reader *reader);
 void perf_reader_set_fd(struct perf_reader *reader, int fd);
 ]]
 
+ffi.cdef[[
+struct ring_buffer;
+typedef int (*ring_buffer_sample_fn)(void *ctx, void *data, size_t size);
+
+void * bpf_new_ringbuf(int map_fd, ring_buffer_sample_fn sample_cb, void *ctx);
+void bpf_free_ringbuf(struct ring_buffer *rb);
+int bpf_add_ringbuf(struct ring_buffer *rb, int map_fd,
+                    ring_buffer_sample_fn sample_cb, void *ctx);
+int bpf_poll_ringbuf(struct ring_buffer *rb, int timeout_ms);
+int bpf_consume_ringbuf(struct ring_buffer *rb);
+
+int bpf_lookup_batch(int fd, uint32_t *in_batch, uint32_t *out_batch, void *keys,
+                     void *values, uint32_t *count);
+]]
+
 ffi.cdef[[
 struct bcc_symbol {
 	const char *name;
@@ -30,6 +30,10 @@ BaseTable.static.BPF_MAP_TYPE_CGROUP_ARRAY = 8
 BaseTable.static.BPF_MAP_TYPE_LRU_HASH = 9
 BaseTable.static.BPF_MAP_TYPE_LRU_PERCPU_HASH = 10
 BaseTable.static.BPF_MAP_TYPE_LPM_TRIE = 11
+BaseTable.static.BPF_MAP_TYPE_RINGBUF = 27
+
+local ENOENT = 2
+local ENOSPC = 28
 
 function BaseTable:initialize(t_type, bpf, map_id, map_fd, key_type, leaf_type)
   assert(t_type == libbcc.bpf_table_type_id(bpf.module, map_id))
@@ -38,8 +42,10 @@ function BaseTable:initialize(t_type, bpf, map_id, map_fd, key_type, leaf_type)
   self.bpf = bpf
   self.map_id = map_id
   self.map_fd = map_fd
-  self.c_key = ffi.typeof(key_type.."[1]")
-  self.c_leaf = ffi.typeof(leaf_type.."[1]")
+  self.c_key_t = ffi.typeof(key_type)
+  self.c_leaf_t = ffi.typeof(leaf_type)
+  self.c_key = ffi.typeof("$[1]", self.c_key_t)
+  self.c_leaf = ffi.typeof("$[1]", self.c_leaf_t)
 end
 
 function BaseTable:key_sprintf(key)
@@ -149,8 +155,65 @@ end
 
 local HashTable = class("HashTable", BaseTable)
 
+HashTable.static.ITEMS_CHUNK = 1024
+
 function HashTable:initialize(bpf, map_id, map_fd, key_type, leaf_type)
   BaseTable.initialize(self, BaseTable.BPF_MAP_TYPE_HASH, bpf, map_id, map_fd, key_type, leaf_type)
+  self.max_entries = tonumber(libbcc.bpf_table_max_entries_id(self.bpf.module, self.map_id))
+  self.c_keys = ffi.typeof("$[?]", self.c_key_t)
+  self.c_leaves = ffi.typeof("$[?]", self.c_leaf_t)
+end
+
+-- Fetches the entries ITEMS_CHUNK at a time with BPF_MAP_LOOKUP_BATCH
+-- instead of two syscalls per entry
+function HashTable:items()
+  local n = math.max(math.min(self.max_entries, HashTable.ITEMS_CHUNK), 1)
+  local keys, values = self.c_keys(n), self.c_leaves(n)
+  local batch = ffi.new("uint32_t[1]")
+  local count = ffi.new("uint32_t[1]")
+  local started, done = false, false
+  local cnt, i = 0, 0
+
+  local function fetch()
+    while true do
+      count[0] = n
+      local res = libbcc.bpf_lookup_batch(self.map_fd, started and batch or nil,
+        batch, keys, values, count)
+      local err = res ~= 0 and ffi.errno() or 0
+
+      if err == ENOSPC and count[0] == 0 and n < self.max_entries then
+        -- a hash bucket holds more entries than the chunk
+        n = math.min(n * 2, self.max_entries)
+        keys, values = self.c_keys(n), self.c_leaves(n)
+      elseif err ~= 0 and err ~= ENOENT then
+        return false, err
+      else
+        started = true
+        done = err == ENOENT
+        cnt, i = count[0], 0
+        return true
+      end
+    end
+  end
+
+  if not fetch() then
+    -- no batch operations before 5.6
+    return BaseTable.items(self)
+  end
+
+  return function()
+    while i == cnt do
+      if done then
+        return nil
+      end
+      local ok, err = fetch()
+      assert(ok, string.format("BPF_MAP_LOOKUP_BATCH failed (errno %d)", err or 0))
+    end
+
+    local pkey, pvalue = self.c_key(keys[i]), self.c_leaf(values[i])
+    i = i + 1
+    return pkey[0], pvalue[0]
+  end
 end
 
 function HashTable:delete(key)
@@ -276,6 +339,25 @@ function PerfEventArray:open_perf_buffer(callback, data_type, data_params, page_
 end
 
 
+local RingBuf = class("RingBuf", BaseTable)
+
+function RingBuf:initialize(bpf, map_id, map_fd, key_type, leaf_type)
+  BaseTable.initialize(self, BaseTable.BPF_MAP_TYPE_RINGBUF, bpf, map_id, map_fd, key_type, leaf_type)
+end
+
+function RingBuf:open_ring_buffer(callback, data_type, data_params)
+  assert(data_type, "a data type is needed for callback conversion")
+  assert(self._callback == nil, "ring buffer is already open")
+  local ctype = ffi.typeof(data_type.."*", unpack(data_params or {}))
+
+  self._callback = ffi.cast("ring_buffer_sample_fn",
+    function (ctx, data, size)
+      return callback(ctype(data)[0], tonumber(size)) or 0
+    end)
+  self.bpf:ring_buffer_store(self.map_fd, self._callback)
+end
+
+
 local StackTrace = class("StackTrace", BaseTable)
 
 StackTrace.static.MAX_STACK = 127
@@ -379,6 +461,8 @@ local function NewTable(bpf, name, key_type, leaf_type)
     table = PerfEventArray
   elseif t_type == BaseTable.BPF_MAP_TYPE_STACK_TRACE then
     table = StackTrace
+  elseif t_type == BaseTable.BPF_MAP_TYPE_RINGBUF then
+    table = RingBuf
   end
 
   assert(table, "unsupported table type %d" % t_type)
@@ -1344,6 +1344,126 @@ local function dump(code)
 	print(dump_string(code))
 end
 
+-- Compiled program cache
+--
+-- Programs are cached by their bytecode, the values of the upvalues and
+-- globals they read and their parameter types. Maps are identified by their
+-- spec for the on-disk cache, and their fds are relocated when loading, so
+-- a script started again with the same code skips the translation.
+-- Programs using no maps can also be pinned in a bpffs directory, so that
+-- they don't need to be verified again either.
+local cache = {
+	mem = {},     -- full key (with map fds) -> compiled code
+	dir = nil,    -- directory of compiled code
+	pin = nil,    -- bpffs directory of loaded programs
+}
+
+-- 32-bit FNV-1a of a string
+local function fnv1a(str, h)
+	for i = 1, #str do
+		h = bit.bxor(h, string.byte(str, i))
+		-- h * 16777619 == (h << 24) + h * 403 (mod 2^32), exact in doubles
+		h = bit.tobit(bit.lshift(h, 24) + h * 403)
+	end
+	return h
+end
+local function cache_hash(key)
+	return bit.tohex(fnv1a(key, 0x811c9dc5))..bit.tohex(fnv1a(key:reverse(), 0x811c9dc5))
+end
+
+-- Describe a value read by a program, or return nil if it may change without
+-- the program being compiled again. Returns whether the description holds in
+-- other processes as second value
+local function value_key(name, v)
+	if type(v) == 'table' and v.__map then
+		return string.format('map(%s,%s,%s,%d)', tostring(v.map_type),
+			tostring(v.key_type), tostring(v.val_type), v.max_entries), true
+	elseif v == nil or type(v) == 'number' or type(v) == 'string' or type(v) == 'boolean' then
+		return type(v)..'('..tostring(v)..')', true
+	elseif type(v) == 'cdata' then
+		-- ctypes and 64-bit integers, other cdata print their address
+		local str = tostring(v)
+		if not str:find(': 0x', 1, true) then return 'cdata('..str..')', true end
+	elseif v == builtins[name] or v == proto[name] or v == _G[name] then
+		return 'builtin('..name..')', true
+	end
+	return nil
+end
+
+-- Return the cache key of prog, the map fds it embeds by upvalue or global name,
+-- and whether the key is valid in other processes. The key is nil if prog
+-- can't be cached
+local function cache_key(prog, env, param_types)
+	local parts, maps, portable = {string.dump(prog)}, {}, true
+	for _,op,_,_,c in bytecode.decoder(prog) do
+		if (op == 'UGET' or op == 'GGET') and not maps[c] then
+			local v = env[c]
+			local desc, same = value_key(c, v)
+			if not desc then return nil end
+			table.insert(parts, c..'='..desc)
+			portable = portable and same
+			if type(v) == 'table' and v.__map then maps[c] = v.fd end
+		end
+	end
+	for _, t in ipairs(param_types) do
+		table.insert(parts, string.format('param(%s,%s,%s)', tostring(t.__dissector), tostring(t.source), tostring(t.off)))
+	end
+	return table.concat(parts, '\0'), maps, portable
+end
+
+-- Map fd relocations of the code: list of {pc, name}, or nil if it loads a map the
+-- cache key doesn't know about
+local function cache_relocs(code, maps)
+	local names = {}
+	for name, fd in pairs(maps) do names[fd] = name end
+	local relocs, pc = {}, 0
+	while pc < code.pc do
+		local ins = code.insn[pc]
+		if ins.code == BPF.LD + BPF.DW then
+			if ins.src_reg == BPF.PSEUDO_MAP_FD then
+				local name = names[ins.imm]
+				if not name then return nil end
+				table.insert(relocs, {pc, name})
+			end
+			pc = pc + 1 -- Skip the second half of the 64-bit immediate
+		end
+		pc = pc + 1
+	end
+	return relocs
+end
+
+-- File format: '<key length> <pc> <relocations>\n', key, instructions, then
+-- a '<pc> <name>\n' line for each relocation
+local function cache_store(path, key, code, relocs)
+	local f = io.open(path..'.tmp', 'wb')
+	if not f then return end
+	f:write(string.format('%d %d %d\n', #key, code.pc, #relocs), key,
+	        ffi.string(code.insn, code.pc * ffi.sizeof('struct bpf_insn')))
+	for _, r in ipairs(relocs) do f:write(string.format('%d %s\n', r[1], r[2])) end
+	f:close()
+	os.rename(path..'.tmp', path)
+end
+
+local function cache_load(path, key, env)
+	local f = io.open(path, 'rb')
+	if not f then return nil end
+	local klen, pc, nrelocs = (f:read('*l') or ''):match('^(%d+) (%d+) (%d+)$')
+	if not klen or f:read(tonumber(klen)) ~= key then f:close() return nil end
+	pc = tonumber(pc)
+	local size = pc * ffi.sizeof('struct bpf_insn')
+	local data = f:read(size)
+	if not data or #data ~= size then f:close() return nil end
+	local code = {pc = pc, insn = ffi.new('struct bpf_insn[?]', pc), nmaps = tonumber(nrelocs)}
+	ffi.copy(code.insn, data, size)
+	for _ = 1, code.nmaps do
+		local rpc, name = (f:read('*l') or ''):match('^(%d+) (.+)$')
+		if not rpc then f:close() return nil end
+		code.insn[tonumber(rpc)].imm = env[name].fd
+	end
+	f:close()
+	return code
+end
+
 local function compile(prog, params)
 	-- Create code emitter sandbox, include caller locals
 	local env = { pkt=proto.pkt, eth=proto.pkt, BPF=BPF, ffi=ffi }
@@ -1365,6 +1485,23 @@ local function compile(prog, params)
 	})
 	-- Create code emitter and compile LuaJIT bytecode
 	if type(prog) == 'string' then prog = loadstring(prog) end
+	local key, maps, portable = cache_key(prog, env, params or {})
+	local mem_key, hash, path
+	if key then
+		mem_key = {key}
+		for name, fd in pairs(maps) do table.insert(mem_key, name..'@'..fd) end
+		table.sort(mem_key)
+		mem_key = table.concat(mem_key, '\0')
+		if cache.mem[mem_key] then return cache.mem[mem_key] end
+		hash = cache_hash(key)
+		path = portable and cache.dir and cache.dir..'/'..hash
+		local code = path and cache_load(path, key, env)
+		if code then
+			code.hash = hash
+			cache.mem[mem_key] = code
+			return code
+		end
+	end
 	-- Create error handler to print traceback
 	local funci, pc = bytecode.funcinfo(prog), 0
 	local E = create_emitter(env, funci.stackslots, funci.params, params or {})
@@ -1385,7 +1522,47 @@ local function compile(prog, params)
 			return nil, err
 		end
 	end
-	return E:compile()
+	local code = E:compile()
+	local relocs = key and cache_relocs(code, maps)
+	if relocs then
+		code.hash, code.nmaps = hash, #relocs
+		cache.mem[mem_key] = code
+		if path then cache_store(path, key, code, relocs) end
+	end
+	return code
+end
+
+-- BPF_OBJ_PIN and BPF_OBJ_GET, not wrapped by ljsyscall
+ffi.cdef [[
+struct bpf_obj_attr {
+	uint64_t pathname;
+	uint32_t bpf_fd;
+	uint32_t file_flags;
+};
+]]
+pcall(ffi.cdef, 'long syscall(long number, ...);')
+local function bpf_obj(cmd, path, fd)
+	local attr = ffi.new('struct bpf_obj_attr[1]')
+	attr[0].pathname = ffi.cast('uintptr_t', ffi.cast('const char *', path))
+	attr[0].bpf_fd = fd or 0
+	return tonumber(ffi.C.syscall(S.c.SYS.bpf, ffi.cast('int', cmd), attr,
+	                              ffi.cast('unsigned int', ffi.sizeof(attr))))
+end
+
+-- Load a compiled program, reusing the program pinned for the same code by
+-- an earlier run if it uses no maps
+local function prog_load(ptype, prog)
+	local path = cache.pin and prog.hash and prog.nmaps == 0 and
+	             string.format('%s/%s_%d', cache.pin, prog.hash, ptype)
+	if path then
+		local fd = bpf_obj(7, path) -- BPF_OBJ_GET
+		if fd >= 0 then return S.t.fd(fd) end
+	end
+	local prog_fd, err, log = S.bpf_prog_load(ptype, prog.insn, prog.pc)
+	if prog_fd and path then
+		bpf_obj(6, path, prog_fd:getfd()) -- BPF_OBJ_PIN
+	end
+	return prog_fd, err, log
 end
 
 -- BPF map interface
@@ -1475,7 +1652,7 @@ local tracepoint_mt = {
 				prog = compile(prog, {proto.type(t.type, {source='ptr_to_probe'})})
 			end
 			-- Load the BPF program
-			local prog_fd, err, log = S.bpf_prog_load(S.c.BPF_PROG.TRACEPOINT, prog.insn, prog.pc)
+			local prog_fd, err, log = prog_load(S.c.BPF_PROG.TRACEPOINT, prog)
 			assert(prog_fd, tostring(err)..': '..tostring(log))
 			-- Open tracepoint and attach
 			t.reader:setbpf(prog_fd:getfd())
@@ -1499,7 +1676,7 @@ local function trace_bpf(ptype, pname, pdef, retprobe, prog, pid, cpu, group_fd)
 	if type(prog) ~= 'table' then
 		prog = compile(prog, {proto.pt_regs})
 	end
-	local prog_fd, err, log = S.bpf_prog_load(S.c.BPF_PROG.KPROBE, prog.insn, prog.pc)
+	local prog_fd, err, log = prog_load(S.c.BPF_PROG.KPROBE, prog)
 	assert(prog_fd, tostring(err)..': '..tostring(log))
 	-- Open tracepoint and attach
 	local tp, err = S.perf_probe(ptype, pname, pdef, retprobe)
@@ -1536,6 +1713,14 @@ return setmetatable({
 	dump = dump,
 	dump_string = dump_string,
 	maps = {},
+	-- Keep compiled programs in directory dir, and loaded programs that use
+	-- no maps pinned in bpffs directory pin, for faster starts of the same
+	-- code. Either can be nil.
+	cache = function (dir, pin)
+		cache.dir, cache.pin = dir, pin
+		if dir and not S.stat(dir) then assert(S.mkdir(dir, '0700')) end
+		if pin and not S.stat(pin) then assert(S.mkdir(pin, '0700')) end
+	end,
 	map = function (type, max_entries, key_ctype, val_ctype)
 		if not key_ctype then key_ctype = ffi.typeof('uint32_t') end
 		if not val_ctype then val_ctype = ffi.typeof('uint32_t') end
@@ -1580,7 +1765,7 @@ return setmetatable({
 		if type(prog) ~= 'table' then
 			prog = compile(prog, {proto.skb})
 		end
-		local prog_fd, err, log = S.bpf_prog_load(S.c.BPF_PROG.SOCKET_FILTER, prog.insn, prog.pc)
+		local prog_fd, err, log = prog_load(S.c.BPF_PROG.SOCKET_FILTER, prog)
 		assert(prog_fd, tostring(err)..': '..tostring(log))
 		assert(sock:setsockopt('socket', 'attach_bpf', prog_fd:getfd()))
 		return prog_fd, err
@@ -20,4 +20,42 @@ describe('compile', function()
 		assert.same(type(code), 'table')
 		assert.same(code.pc, 15)
 	end)
+
+	it('caches compiled code', function()
+		local function mock(fd)
+			return {
+				max_entries = 16,
+				key_type = ffi.typeof('uint64_t [1]'),
+				val_type = ffi.typeof('uint64_t [1]'),
+				fd = fd,
+				__map = true,
+			}
+		end
+		local function compile_with(mock_map)
+			return bpf(function ()
+			   local proto = pkt.ip.proto
+			   xadd(mock_map[proto], 1)
+			end)
+		end
+		local code = compile_with(mock(1))
+		-- Same code and maps
+		assert.equal(code, compile_with(mock(1)))
+		-- Same code, with another map of the same spec
+		local other = compile_with(mock(2))
+		assert.are_not.equal(code, other)
+		assert.same(code.pc, other.pc)
+		assert.same(code.hash, other.hash)
+		-- Persistent cache, written for new code
+		local dir = os.tmpname()
+		os.remove(dir)
+		bpf.cache(dir)
+		local third = compile_with(mock(3))
+		bpf.cache(nil)
+		assert.same(code.hash, third.hash)
+		local f = io.open(dir..'/'..code.hash, 'rb')
+		assert.truthy(f)
+		f:close()
+		os.remove(dir..'/'..code.hash)
+		os.remove(dir)
+	end)
 end)
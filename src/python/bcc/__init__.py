@@ -14,6 +14,7 @@
 
 from __future__ import print_function
 import atexit
+from collections import OrderedDict, deque
 import ctypes as ct
 import fcntl
 import json
@@ -21,10 +22,13 @@ import os
 import re
 import errno
 import sys
-import platform
+import threading
+import time
 
-from .libbcc import lib, bcc_symbol, bcc_symbol_option, bcc_stacktrace_build_id, _SYM_CB_TYPE
-from .table import Table, PerfEventArray, RingBuf, BPF_MAP_TYPE_QUEUE, BPF_MAP_TYPE_STACK
+from .libbcc import lib, bcc_symbol, bcc_symbol_option, bcc_stacktrace_build_id, _SYM_CB_TYPE, \
+    bcc_trace_record, bcc_user_regs, bcc_map_mem, bcc_prog_mem, _KPROBE_FN_CB_TYPE
+from .table import Table, PerfEventArray, RingBuf, EventQueue, \
+    BPF_MAP_TYPE_QUEUE, BPF_MAP_TYPE_STACK, BPF_MAP_TYPE_RINGBUF
 from .perf import Perf
 from .utils import get_online_cpus, printb, _assert_is_bytes, ArgString, StrcmpRewrite
 from .version import __version__
@@ -63,9 +67,16 @@ DEBUG_BTF = 0x20
 
 class SymbolCache(object):
     def __init__(self, pid):
+        self.pid = pid
         self.cache = lib.bcc_symcache_new(
                 pid, ct.cast(None, ct.POINTER(bcc_symbol_option)))
 
+    def __del__(self):
+        # lib may already be gone at interpreter exit
+        if self.cache and lib:
+            lib.bcc_free_symcache(self.cache, self.pid)
+            self.cache = None
+
     def resolve(self, addr, demangle):
         """
         Return a tuple of the symbol (function), its offset from the beginning
@@ -95,6 +106,40 @@ class SymbolCache(object):
             name_res = sym.name
         return (name_res, sym.offset, ct.cast(sym.module, ct.c_char_p).value)
 
+    def resolve_batch(self, addrs, demangle):
+        """
+        Same as resolve() for a list of addresses, returning a list of
+        tuples. All addresses are looked up in one call, and repeated
+        addresses are only resolved once.
+        """
+        n = len(addrs)
+        if n == 0:
+            return []
+        c_addrs = (ct.c_ulonglong * n)(*addrs)
+        syms = (bcc_symbol * n)()
+        if demangle:
+            lib.bcc_symcache_resolve_batch(self.cache, c_addrs, n, syms)
+        else:
+            lib.bcc_symcache_resolve_batch_no_demangle(self.cache, c_addrs,
+                                                       n, syms)
+        res = []
+        for addr, sym in zip(addrs, syms):
+            if not sym.name:
+                if sym.module and sym.offset:
+                    res.append((None, sym.offset,
+                                ct.cast(sym.module, ct.c_char_p).value))
+                else:
+                    res.append((None, addr, None))
+                continue
+            if demangle:
+                name_res = sym.demangle_name
+                lib.bcc_symbol_free_demangle_name(ct.byref(sym))
+            else:
+                name_res = sym.name
+            res.append((name_res, sym.offset,
+                        ct.cast(sym.module, ct.c_char_p).value))
+        return res
+
     def resolve_name(self, module, name):
         module = _assert_is_bytes(module)
         name = _assert_is_bytes(name)
@@ -104,6 +149,22 @@ class SymbolCache(object):
             return -1
         return addr.value
 
+    def unwind(self, ip, sp, bp, stack, size, max_frames=127):
+        """
+        Return the list of addresses of the call stack of a user stack
+        snapshot, ip first, as filled by bpf_user_stack_fill(): stack is
+        its data, of which size bytes are valid. Frames are unwound with the
+        .eh_frame of the binaries, so those built without frame pointers
+        can be unwound too. Returns an empty list if the cache can't
+        unwind.
+        """
+        regs = bcc_user_regs(ip, sp, bp)
+        ips = (ct.c_uint64 * max_frames)()
+        n = lib.bcc_symcache_unwind(self.cache, ct.byref(regs),
+                                    ct.addressof(stack), size, ips,
+                                    max_frames)
+        return ips[:n] if n > 0 else []
+
 class PerfType:
     # From perf_type_id in uapi/linux/perf_event.h
     HARDWARE = 0
@@ -168,6 +229,25 @@ class PerfEventSampleFormat:
     CODE_PAGE_SIZE = (1 << 23)
     WEIGHT_STRUCT = (1 << 24)
 
+class PerfBranchSampleType:
+    # From perf_branch_sample_type in uapi/linux/perf_event.h
+    USER = (1 << 0)
+    KERNEL = (1 << 1)
+    HV = (1 << 2)
+    ANY = (1 << 3)
+    ANY_CALL = (1 << 4)
+    ANY_RETURN = (1 << 5)
+    IND_CALL = (1 << 6)
+    ABORT_TX = (1 << 7)
+    IN_TX = (1 << 8)
+    NO_TX = (1 << 9)
+    COND = (1 << 10)
+    CALL_STACK = (1 << 11)
+    IND_JUMP = (1 << 12)
+    CALL = (1 << 13)
+    NO_FLAGS = (1 << 14)
+    NO_CYCLES = (1 << 15)
+
 class BPFProgType:
     # From bpf_prog_type in uapi/linux/bpf.h
     SOCKET_FILTER = 1
@@ -232,6 +312,16 @@ class BPFAttachType:
     SK_LOOKUP = 36
     XDP = 37
     SK_SKB_VERDICT = 38
+    SK_REUSEPORT_SELECT = 39
+    SK_REUSEPORT_SELECT_OR_MIGRATE = 40
+    PERF_EVENT = 41
+    TRACE_KPROBE_MULTI = 42
+    LSM_CGROUP = 43
+    STRUCT_OPS = 44
+    NETFILTER = 45
+    TCX_INGRESS = 46
+    TCX_EGRESS = 47
+    TRACE_UPROBE_MULTI = 48
 
 class XDPAction:
     # from xdp_action uapi/linux/bpf.h
@@ -290,7 +380,10 @@ class BPF(object):
     # END enum backwards compat
 
     _probe_repl = re.compile(b"[^a-zA-Z0-9_]")
-    _sym_caches = {}
+    # Symbol caches of the most recently used pids, the kernel one is kept
+    # regardless
+    _sym_caches = OrderedDict()
+    _sym_caches_max = 64
     _bsymcache =  lib.bcc_buildsymcache_new()
 
     _auto_includes = {
@@ -360,6 +453,33 @@ class BPF(object):
             self.name = name
             self.fd = fd
 
+    class _MultiProbe(object):
+        """A multi [k,u]probe link, shared by the probe events it attached.
+        Links cannot be changed, so detaching some of the events replaces it
+        with a link for the others."""
+        def __init__(self, attach, events):
+            # attach(targets) returns the FD of a new link for targets
+            self.attach = attach
+            self.events = events
+            self.fd = attach(list(events.values()))
+
+        def detach(self, ev_name):
+            del self.events[ev_name]
+            if self.fd < 0:
+                return
+            fd = -1
+            if self.events:
+                fd = self.attach(list(self.events.values()))
+                if fd < 0:
+                    raise Exception("Failed to detach BPF from %s" % ev_name)
+            os.close(self.fd)
+            self.fd = fd
+
+        def close(self):
+            if self.fd >= 0:
+                os.close(self.fd)
+                self.fd = -1
+
     @staticmethod
     def _find_file(filename):
         """ If filename is invalid, search in ./ of argv[0] """
@@ -404,7 +524,8 @@ class BPF(object):
 
     def __init__(self, src_file=b"", hdr_file=b"", text=None, debug=0,
             cflags=[], usdt_contexts=[], allow_rlimit=True, device=None,
-            attach_usdt_ignore_pid=False):
+            attach_usdt_ignore_pid=False, cache=False, cache_dir=None,
+            obj_file=None, map_sizes=None, rodata=None, kfunc_upgrade=None):
         """Create a new BPF module with the given source code.
 
         Note:
@@ -417,13 +538,41 @@ class BPF(object):
             text (Optional[str]): Contents of a source file for the module
             debug (Optional[int]): Flags used for debug prints, can be |'d together
                                    See "Debug flags" for explanation
+            cache (Optional[bool]): Reuse the compiled object of a previous
+                                    run of the same program, see the
+                                    compiled object cache in the reference
+                                    guide. Disables key_sprintf(),
+                                    leaf_sprintf() and the scanf variants.
+            cache_dir (Optional[str]): Directory of the cache, implies cache.
+                                       Defaults to $BCC_OBJ_CACHE_DIR, or
+                                       bcc in the user's cache directory.
+            obj_file (Optional[str]): Object file written by
+                                      BPF.compile_object() to load instead
+                                      of compiling a source, without Clang
+                                      and LLVM.
+            map_sizes (Optional[dict]): Table name to the number of entries
+                                        to create it with, overriding the
+                                        size in the program. The program
+                                        is not recompiled, so a cached or
+                                        compiled object serves every size.
+            rodata (Optional[dict]): Table name to the contents of a
+                                     BPF_RODATA table, as a ctypes object
+                                     or bytes. Read by the programs as
+                                     constants, without recompiling.
+            kfunc_upgrade (Optional[bool]): Attach kprobe and kretprobe
+                                            handlers as fentry and fexit
+                                            programs where the kernel and
+                                            the handler allow it. Defaults
+                                            to $BCC_KFUNC_UPGRADE.
         """
 
         src_file = _assert_is_bytes(src_file)
         hdr_file = _assert_is_bytes(hdr_file)
         text = _assert_is_bytes(text)
+        obj_file = _assert_is_bytes(obj_file)
 
         assert not (text and src_file)
+        assert not (obj_file and (text or src_file or usdt_contexts))
 
         self.kprobe_fds = {}
         self.uprobe_fds = {}
@@ -432,16 +581,28 @@ class BPF(object):
         self.kfunc_entry_fds = {}
         self.kfunc_exit_fds = {}
         self.lsm_fds = {}
+        # (kind, attach point) -> function, for run_stats()
+        self._attach_fns = {}
+        self._run_stats_fd = None
+        self._overhead_last = None
         self.perf_buffers = {}
         self.open_perf_events = {}
         self._ringbuf_manager = None
+        self._event_queue = None
         self.tracefile = None
+        self._trace_pipe = None
+        self._trace_fields = deque()
         atexit.register(self.cleanup)
 
         self.debug = debug
         self.funcs = {}
         self.tables = {}
         self.module = None
+        if kfunc_upgrade is None:
+            kfunc_upgrade = os.environ.get("BCC_KFUNC_UPGRADE", "0") not in \
+                    ("", "0")
+        if kfunc_upgrade and not obj_file and BPF.support_kfunc():
+            cflags = list(cflags) + ["-DBCC_KPROBE_AS_KFUNC"]
         cflags_array = (ct.c_char_p * len(cflags))()
         for i, s in enumerate(cflags): cflags_array[i] = bytes(ArgString(s))
 
@@ -455,23 +616,30 @@ class BPF(object):
             with open(src_file, mode="rb") as file:
                 text = file.read()
 
-        ctx_array = (ct.c_void_p * len(usdt_contexts))()
-        for i, usdt in enumerate(usdt_contexts):
-            ctx_array[i] = ct.c_void_p(usdt.get_context())
-        usdt_text = lib.bcc_usdt_genargs(ctx_array, len(usdt_contexts))
-        if usdt_text is None:
-            raise Exception("can't generate USDT probe arguments; " +
-                            "possible cause is missing pid when a " +
-                            "probe in a shared object has multiple " +
-                            "locations")
-        text = usdt_text + text
-
-
-        self.module = lib.bpf_module_create_c_from_string(text,
-                                                          self.debug,
-                                                          cflags_array, len(cflags_array),
-                                                          allow_rlimit, device)
+        if not obj_file:
+            text = BPF._usdt_text(usdt_contexts) + text
+
+        if map_sizes or rodata:
+            self.module = BPF._module_with_overrides(text, obj_file,
+                    self.debug, cflags_array, allow_rlimit, device,
+                    cache or cache_dir, cache_dir, map_sizes or {},
+                    rodata or {})
+        elif obj_file:
+            self.module = lib.bpf_module_create_from_object(obj_file,
+                    self.debug, allow_rlimit, device)
+        elif cache or cache_dir:
+            cache_dir = _assert_is_bytes(cache_dir or BPF._obj_cache_dir())
+            self.module = lib.bpf_module_create_c_from_string_cached(text,
+                    self.debug, cflags_array, len(cflags_array),
+                    allow_rlimit, device, cache_dir)
+        else:
+            self.module = lib.bpf_module_create_c_from_string(text,
+                                                              self.debug,
+                                                              cflags_array, len(cflags_array),
+                                                              allow_rlimit, device)
         if not self.module:
+            if obj_file:
+                raise Exception("Failed to load BPF object %s" % obj_file)
             raise Exception("Failed to compile BPF module %s" % (src_file or "<text>"))
 
         for usdt_context in usdt_contexts:
@@ -482,30 +650,134 @@ class BPF(object):
         # they will be loaded and attached here.
         self._trace_autoload()
 
-    def load_funcs(self, prog_type=KPROBE):
-        """load_funcs(prog_type=KPROBE)
-
-        Load all functions in this BPF module with the given type.
-        Returns a list of the function handles."""
+    @staticmethod
+    def _module_with_overrides(text, obj_file, debug, cflags_array,
+                               allow_rlimit, device, cache, cache_dir,
+                               map_sizes, rodata):
+        cached = bool(obj_file or cache)
+        module = lib.bpf_module_new(debug, not cached, allow_rlimit, device)
+        for name, size in map_sizes.items():
+            lib.bpf_module_set_map_size(module, _assert_is_bytes(name), size)
+        for name, value in rodata.items():
+            data = bytes(value)
+            lib.bpf_module_set_rodata(module, _assert_is_bytes(name), data,
+                                      len(data))
+        if obj_file:
+            ret = lib.bpf_module_load_object(module, obj_file)
+        else:
+            if cache:
+                cache_dir = _assert_is_bytes(cache_dir or BPF._obj_cache_dir())
+            ret = lib.bpf_module_load_string(module, text, cflags_array,
+                                             len(cflags_array),
+                                             cache_dir if cache else None)
+        if ret != 0:
+            lib.bpf_module_destroy(module)
+            return None
+        return module
 
-        fns = []
-        for i in range(0, lib.bpf_num_functions(self.module)):
-            func_name = lib.bpf_function_name(self.module, i)
-            fns.append(self.load_func(func_name, prog_type))
+    @staticmethod
+    def _usdt_text(usdt_contexts):
+        ctx_array = (ct.c_void_p * len(usdt_contexts))()
+        for i, usdt in enumerate(usdt_contexts):
+            ctx_array[i] = ct.c_void_p(usdt.get_context())
+        usdt_text = lib.bcc_usdt_genargs(ctx_array, len(usdt_contexts))
+        if usdt_text is None:
+            raise Exception("can't generate USDT probe arguments; " +
+                            "possible cause is missing pid when a " +
+                            "probe in a shared object has multiple " +
+                            "locations")
+        return usdt_text
 
-        return fns
+    @staticmethod
+    def compile_object(path, text=None, src_file=b"", cflags=[], debug=0):
+        """compile_object(path, text=None, src_file="", cflags=[], debug=0)
+
+        Compile the program given as text or in src_file into an object file
+        at path, which BPF(obj_file=path) loads later without Clang and LLVM.
+        No map is created. The object only fits kernels whose headers match
+        the ones it was compiled with."""
+        path = _assert_is_bytes(path)
+        text = _assert_is_bytes(text)
+        src_file = _assert_is_bytes(src_file)
+        assert not (text and src_file)
+        if src_file:
+            with open(BPF._find_file(src_file), mode="rb") as file:
+                text = file.read()
+        cflags_array = (ct.c_char_p * len(cflags))()
+        for i, s in enumerate(cflags): cflags_array[i] = bytes(ArgString(s))
+        if lib.bpf_module_compile_object(text, debug, cflags_array,
+                                         len(cflags_array), path) != 0:
+            raise Exception("Failed to compile BPF object %s" % path)
 
-    def load_func(self, func_name, prog_type, device = None):
+    @staticmethod
+    def _obj_cache_dir():
+        cache_dir = os.environ.get("BCC_OBJ_CACHE_DIR")
+        if cache_dir:
+            return cache_dir
+        base = os.environ.get("XDG_CACHE_HOME") or \
+            os.path.join(os.path.expanduser("~"), ".cache")
+        if not os.path.isdir(base):
+            os.makedirs(base)
+        return os.path.join(base, "bcc")
+
+    def load_funcs(self, prog_type=KPROBE, func_names=None, max_jobs=0):
+        """load_funcs(prog_type=KPROBE, func_names=None, max_jobs=0)
+
+        Load func_names, or all functions in this BPF module, with the given
+        type. Up to max_jobs of them (0 means one per online CPU) are
+        verified concurrently. Returns a list of the function handles."""
+
+        if func_names is None:
+            func_names = [lib.bpf_function_name(self.module, i)
+                          for i in range(0, lib.bpf_num_functions(self.module))]
+            # copies made for kfunc_upgrade are loaded by attach_kprobe()
+            func_names = [name for name in func_names
+                          if not name.startswith(b"kfunc_compat__")]
+        func_names = [_assert_is_bytes(name) for name in func_names]
+        pending = list(OrderedDict.fromkeys(
+            name for name in func_names if name not in self.funcs))
+        if not max_jobs:
+            max_jobs = len(get_online_cpus())
+        njobs = min(max_jobs, len(pending))
+        if njobs > 1:
+            # ctypes drops the GIL around bcc_func_load, so the kernel
+            # verifies the programs of different threads in parallel
+            errors = []
+            def worker(names):
+                for name in names:
+                    try:
+                        self.load_func(name, prog_type)
+                    except Exception as e:
+                        errors.append(e)
+            threads = [threading.Thread(target=worker,
+                                        args=(pending[i::njobs],))
+                       for i in range(njobs)]
+            for t in threads:
+                t.start()
+            for t in threads:
+                t.join()
+            if errors:
+                raise errors[0]
+
+        return [self.load_func(name, prog_type) for name in func_names]
+
+    def load_func(self, func_name, prog_type, device = None, log_level = None):
+        """load_func(func_name, prog_type, device=None, log_level=None)
+
+        Load func_name as a program of prog_type. log_level is the verifier
+        log level, by default set from the DEBUG_BPF flags. A failed load is
+        verified again to print its log unless log_level is above 0."""
         func_name = _assert_is_bytes(func_name)
         if func_name in self.funcs:
             return self.funcs[func_name]
         if not lib.bpf_function_start(self.module, func_name):
             raise Exception("Unknown program %s" % func_name)
-        log_level = 0
-        if (self.debug & DEBUG_BPF_REGISTER_STATE):
-            log_level = 2
-        elif (self.debug & DEBUG_BPF):
-            log_level = 1
+        if log_level is None:
+            log_level = 0
+            if (self.debug & DEBUG_BPF_REGISTER_STATE):
+                log_level = 2
+            elif (self.debug & DEBUG_BPF):
+                log_level = 1
         fd = lib.bcc_func_load(self.module, prog_type, func_name,
                 lib.bpf_function_start(self.module, func_name),
                 lib.bpf_function_size(self.module, func_name),
@@ -527,6 +799,33 @@ class BPF(object):
 
         return fn
 
+    def _load_multi_func(self, func_name, attach_type):
+        """Load func_name as a KPROBE program for multi probe links of
+        attach_type, or return None if the kernel does not support it."""
+        func_name = _assert_is_bytes(func_name)
+        key = (func_name, attach_type)
+        if key in self.funcs:
+            return self.funcs[key]
+        if not lib.bpf_function_start(self.module, func_name):
+            raise Exception("Unknown program %s" % func_name)
+        log_level = 0
+        if (self.debug & DEBUG_BPF_REGISTER_STATE):
+            log_level = 2
+        elif (self.debug & DEBUG_BPF):
+            log_level = 1
+        fd = lib.bcc_func_load_attach_type(self.module, BPF.KPROBE,
+                attach_type, func_name,
+                lib.bpf_function_start(self.module, func_name),
+                lib.bpf_function_size(self.module, func_name),
+                lib.bpf_module_license(self.module),
+                lib.bpf_module_kern_version(self.module),
+                log_level, None, 0, None)
+        if fd < 0:
+            return None
+        fn = BPF.Function(self, func_name, fd)
+        self.funcs[key] = fn
+        return fn
+
     def dump_func(self, func_name):
         """
         Return the eBPF bytecodes for the specified function as a string
@@ -551,6 +850,7 @@ class BPF(object):
     str2ctype = {
         u"_Bool": ct.c_bool,
         u"char": ct.c_char,
+        u"signed char": ct.c_byte,
         u"wchar_t": ct.c_wchar,
         u"unsigned char": ct.c_ubyte,
         u"short": ct.c_short,
@@ -567,6 +867,20 @@ class BPF(object):
         u"__int128": ct.c_int64 * 2,
         u"unsigned __int128": ct.c_uint64 * 2,
     }
+    # ctypes classes of the JSON type descriptions decoded so far, the same
+    # types recur across the tables and modules of a process. BTF layouts
+    # name integers by size only, so identical layouts share one class
+    # whatever typedefs declared them.
+    _table_types = {}
+
+    @staticmethod
+    def _decode_table_desc(desc):
+        cls = BPF._table_types.get(desc)
+        if cls is None:
+            cls = BPF._decode_table_type(json.loads(desc))
+            BPF._table_types[desc] = cls
+        return cls
+
     @staticmethod
     def _decode_table_type(desc):
         if isinstance(desc, basestring):
@@ -611,23 +925,32 @@ class BPF(object):
                 _fields_=fields))
         return cls
 
+    def _table_type(self, map_id, leaf):
+        """The ctypes class of the key or the leaf of a table, from its BTF
+        layout when there is one, else from its description."""
+        if leaf:
+            desc = (lib.bpf_table_leaf_layout_id(self.module, map_id) or
+                    lib.bpf_table_leaf_desc_id(self.module, map_id))
+        else:
+            desc = (lib.bpf_table_key_layout_id(self.module, map_id) or
+                    lib.bpf_table_key_desc_id(self.module, map_id))
+        if not desc:
+            raise Exception("Failed to load BPF Table %s %s desc" %
+                            (lib.bpf_table_name(self.module, map_id),
+                             "leaf" if leaf else "key"))
+        return BPF._decode_table_desc(desc.decode("utf-8"))
+
     def get_table(self, name, keytype=None, leaftype=None, reducer=None):
+        """Return the table called name. Its key and leaf types are built on
+        first use unless given as keytype and leaftype."""
         name = _assert_is_bytes(name)
         map_id = lib.bpf_table_id(self.module, name)
         map_fd = lib.bpf_table_fd(self.module, name)
         is_queuestack = lib.bpf_table_type_id(self.module, map_id) in [BPF_MAP_TYPE_QUEUE, BPF_MAP_TYPE_STACK]
         if map_fd < 0:
             raise KeyError
-        if not keytype and not is_queuestack:
-            key_desc = lib.bpf_table_key_desc(self.module, name).decode("utf-8")
-            if not key_desc:
-                raise Exception("Failed to load BPF Table %s key desc" % name)
-            keytype = BPF._decode_table_type(json.loads(key_desc))
-        if not leaftype:
-            leaf_desc = lib.bpf_table_leaf_desc(self.module, name).decode("utf-8")
-            if not leaf_desc:
-                raise Exception("Failed to load BPF Table %s leaf desc" % name)
-            leaftype = BPF._decode_table_type(json.loads(leaf_desc))
+        if not leaftype and is_queuestack:
+            leaftype = self._table_type(map_id, True)
         return Table(self, map_id, map_fd, keytype, leaftype, name, reducer=reducer)
 
     def __getitem__(self, key):
@@ -685,69 +1008,18 @@ class BPF(object):
 
     @staticmethod
     def get_kprobe_functions(event_re):
-        blacklist_file = "%s/../kprobes/blacklist" % TRACEFS
-        try:
-            with open(blacklist_file, "rb") as blacklist_f:
-                blacklist = set([line.rstrip().split()[1] for line in blacklist_f])
-        except IOError as e:
-            if e.errno != errno.EPERM:
-                raise e
-            blacklist = set([])
-
-        fns = []
-
-        in_init_section = 0
-        in_irq_section = 0
-        with open("/proc/kallsyms", "rb") as avail_file:
-            for line in avail_file:
-                (t, fn) = line.rstrip().split()[1:3]
-                # Skip all functions defined between __init_begin and
-                # __init_end
-                if in_init_section == 0:
-                    if fn == b'__init_begin':
-                        in_init_section = 1
-                        continue
-                elif in_init_section == 1:
-                    if fn == b'__init_end':
-                        in_init_section = 2
-                    continue
-                # Skip all functions defined between __irqentry_text_start and
-                # __irqentry_text_end
-                if in_irq_section == 0:
-                    if fn == b'__irqentry_text_start':
-                        in_irq_section = 1
-                        continue
-                    # __irqentry_text_end is not always after
-                    # __irqentry_text_start. But only happens when
-                    # no functions between two irqentry_text
-                    elif fn == b'__irqentry_text_end':
-                        in_irq_section = 2
-                        continue
-                elif in_irq_section == 1:
-                    if fn == b'__irqentry_text_end':
-                        in_irq_section = 2
-                    continue
-                # All functions defined as NOKPROBE_SYMBOL() start with the
-                # prefix _kbl_addr_*, blacklisting them by looking at the name
-                # allows to catch also those symbols that are defined in kernel
-                # modules.
-                if fn.startswith(b'_kbl_addr_'):
-                    continue
-                # Explicitly blacklist perf-related functions, they are all
-                # non-attachable.
-                elif fn.startswith(b'__perf') or fn.startswith(b'perf_'):
-                    continue
-                # Exclude all static functions with prefix __SCT__, they are
-                # all non-attachable
-                elif fn.startswith(b'__SCT__'):
-                    continue
-                # Exclude all gcc 8's extra .cold functions
-                elif re.match(b'^.*\.cold(\.\d+)?$', fn):
-                    continue
-                if (t.lower() in [b't', b'w']) and re.match(event_re, fn) \
-                    and fn not in blacklist:
-                    fns.append(fn)
-        return set(fns)     # Some functions may appear more than once
+        # libbcc lists the functions kprobes can attach to once, leaving out
+        # the blacklisted, init, irqentry, perf, static call and .cold ones.
+        # The match is made here to keep Python regular expressions.
+        match = re.compile(_assert_is_bytes(event_re)).match
+        fns = set()
+        def fn_cb(fn, payload):
+            if match(fn):
+                fns.add(fn)
+        if lib.bcc_foreach_kprobe_function(None, _KPROBE_FN_CB_TYPE(fn_cb),
+                                           None) < 0:
+            raise Exception("Failed to list kernel functions")
+        return fns
 
     def _check_probe_quota(self, num_new_probes):
         global _num_open_probes
@@ -774,9 +1046,103 @@ class BPF(object):
         del self.kprobe_fds[ev_name][fn_name]
         _num_open_probes -= 1
 
-    def _add_uprobe_fd(self, name, fd):
+    def _attach_kprobe_multi(self, prefix, events, fn_name, attach_type,
+                             cookies=None):
+        """Attach fn_name to all kernel functions in events with one kprobe
+        multi link, so that they are attached with a single syscall instead
+        of a perf event each. Returns False if the kernel cannot, and the
+        caller should attach them one by one."""
+        fn = self._load_multi_func(fn_name, BPFAttachType.TRACE_KPROBE_MULTI)
+        if fn is None:
+            return False
+        cookie_of = dict(zip(events, cookies)) if cookies else None
+        def attach(syms):
+            # links are recreated for the remaining functions on detach, and
+            # each keeps its cookie
+            ct_cookies = (ct.c_uint64 * len(syms))(
+                    *[cookie_of[sym] for sym in syms]) if cookie_of else None
+            return lib.bpf_attach_kprobe_multi(fn.fd, attach_type,
+                    (ct.c_char_p * len(syms))(*syms), ct_cookies, len(syms))
+        link = BPF._MultiProbe(attach, dict(
+            (prefix + event.replace(b"+", b"_").replace(b".", b"_"), event)
+            for event in events))
+        if link.fd < 0:
+            return False
+        for ev_name in link.events:
+            self._add_kprobe_fd(ev_name, fn_name, link)
+        return True
+
+    def _attach_uprobe_multi(self, prefix, name, addresses, fn_name, pid,
+                             attach_type):
+        """Like _attach_kprobe_multi, for the addresses in binary name."""
+        events = {}
+        path = None
+        for addr in addresses:
+            (addr_path, offset) = BPF._check_path_symbol(name, b"", addr, pid)
+            if path is not None and addr_path != path:
+                return False
+            path = addr_path
+            events[self._get_uprobe_evname(prefix, path, offset, pid)] = offset
+        fn = self._load_multi_func(fn_name, BPFAttachType.TRACE_UPROBE_MULTI)
+        if fn is None:
+            return False
+        def attach(offsets):
+            return lib.bpf_attach_uprobe_multi(fn.fd, attach_type, path,
+                    (ct.c_uint64 * len(offsets))(*offsets), len(offsets), pid)
+        link = BPF._MultiProbe(attach, events)
+        if link.fd < 0:
+            return False
+        for ev_name in link.events:
+            self._add_uprobe_fd(ev_name, link, fn_name)
+        return True
+
+    def _attach_kfunc_compat(self, event, fn_name, ret):
+        """Attach the copy of kprobe handler fn_name made for kfunc_upgrade
+        as an fentry, or fexit if ret, program of event. Returns False if
+        there is no copy or the kernel rejects it, and the caller should
+        attach a kprobe."""
+        compat = b"kfunc_compat__" + fn_name
+        if not lib.bpf_function_start(self.module, compat):
+            return False
+        # the copy is loaded for each kernel function, found by its BTF id
+        prog_name = (b"kretfunc__" if ret else b"kfunc__") + event
+        key = compat + b"/" + prog_name
+        fn = self.funcs.get(key)
+        if fn is None:
+            fd = lib.bcc_func_load(self.module, BPF.TRACING, prog_name,
+                    lib.bpf_function_start(self.module, compat),
+                    lib.bpf_function_size(self.module, compat),
+                    lib.bpf_module_license(self.module),
+                    lib.bpf_module_kern_version(self.module), 0, None, 0,
+                    None)
+            if fd < 0:
+                return False
+            fn = self.funcs[key] = BPF.Function(self, key, fd)
+        ev_name = (b"r_" if ret else b"p_") + \
+                event.replace(b"+", b"_").replace(b".", b"_")
+        # a link like those of kprobe multi, with no kprobe event to remove
+        link = BPF._MultiProbe(lambda _: lib.bpf_attach_kfunc(fn.fd),
+                               {ev_name: event})
+        if link.fd < 0:
+            os.close(fn.fd)
+            del self.funcs[key]
+            return False
+        self._add_kprobe_fd(ev_name, fn_name, link)
+        return True
+
+    def _close_multi_probes(self):
+        for fds in self.kprobe_fds.values():
+            for fd in fds.values():
+                if isinstance(fd, BPF._MultiProbe):
+                    fd.close()
+        for fd in self.uprobe_fds.values():
+            if isinstance(fd, BPF._MultiProbe):
+                fd.close()
+
+    def _add_uprobe_fd(self, name, fd, fn_name):
         global _num_open_probes
         self.uprobe_fds[name] = fd
+        self._attach_fns[("uprobe", name)] = fn_name
         _num_open_probes += 1
 
     def _del_uprobe_fd(self, name):
@@ -810,6 +1176,23 @@ class BPF(object):
                 return self.get_syscall_fnname(name[len(prefix):])
         return name
 
+    def attach_kprobe_multi(self, events, fn_name, cookies=None):
+        """attach_kprobe_multi(events, fn_name, cookies=None)
+
+        Attach fn_name to the entry of all the kernel functions in events with
+        a single kprobe multi link (Linux 5.18). cookies is an optional list
+        of integers, one per function, that the program reads with
+        bpf_get_attach_cookie(ctx) to tell which function it runs for.
+        Returns False, without attaching anything, if the kernel does not
+        support these links.
+        """
+        events = [_assert_is_bytes(e) for e in events]
+        fn_name = _assert_is_bytes(fn_name)
+        if cookies is not None and len(cookies) != len(events):
+            raise Exception("expected a cookie per kernel function")
+        self._check_probe_quota(len(events))
+        return self._attach_kprobe_multi(b"p_", events, fn_name, 0, cookies)
+
     def attach_kprobe(self, event=b"", event_off=0, fn_name=b"", event_re=b""):
         event = _assert_is_bytes(event)
         fn_name = _assert_is_bytes(fn_name)
@@ -819,6 +1202,9 @@ class BPF(object):
         if event_re:
             matches = BPF.get_kprobe_functions(event_re)
             self._check_probe_quota(len(matches))
+            if len(matches) > 1 and \
+                    self._attach_kprobe_multi(b"p_", matches, fn_name, 0):
+                return
             failed = 0
             probes = []
             for line in matches:
@@ -833,6 +1219,8 @@ class BPF(object):
             return
 
         self._check_probe_quota(1)
+        if event_off == 0 and self._attach_kfunc_compat(event, fn_name, False):
+            return self
         fn = self.load_func(fn_name, BPF.KPROBE)
         ev_name = b"p_" + event.replace(b"+", b"_").replace(b".", b"_")
         fd = lib.bpf_attach_kprobe(fn.fd, 0, ev_name, event, event_off, 0)
@@ -850,6 +1238,10 @@ class BPF(object):
         # allow the caller to glob multiple functions together
         if event_re:
             matches = BPF.get_kprobe_functions(event_re)
+            # kprobe multi links have no maxactive
+            if len(matches) > 1 and maxactive <= 0 and \
+                    self._attach_kprobe_multi(b"r_", matches, fn_name, 1):
+                return
             failed = 0
             probes = []
             for line in matches:
@@ -865,6 +1257,8 @@ class BPF(object):
             return
 
         self._check_probe_quota(1)
+        if self._attach_kfunc_compat(event, fn_name, True):
+            return self
         fn = self.load_func(fn_name, BPF.KPROBE)
         ev_name = b"r_" + event.replace(b"+", b"_").replace(b".", b"_")
         fd = lib.bpf_attach_kprobe(fn.fd, 1, ev_name, event, 0, maxactive)
@@ -885,11 +1279,17 @@ class BPF(object):
         fn_name = _assert_is_bytes(fn_name)
         if ev_name not in self.kprobe_fds:
             raise Exception("Kprobe %s is not attached" % ev_name)
-        res = lib.bpf_close_perf_event_fd(self.kprobe_fds[ev_name][fn_name])
-        if res < 0:
-            raise Exception("Failed to close kprobe FD")
+        fd = self.kprobe_fds[ev_name][fn_name]
+        multi = isinstance(fd, BPF._MultiProbe)
+        if multi:
+            fd.detach(ev_name)
+        else:
+            res = lib.bpf_close_perf_event_fd(fd)
+            if res < 0:
+                raise Exception("Failed to close kprobe FD")
         self._del_kprobe_fd(ev_name, fn_name)
-        if len(self.kprobe_fds[ev_name]) == 0:
+        # Multi links create no kprobe event to remove
+        if len(self.kprobe_fds[ev_name]) == 0 and not multi:
             res = lib.bpf_detach_kprobe(ev_name)
             if res < 0:
                 raise Exception("Failed to detach BPF from kprobe")
@@ -991,8 +1391,8 @@ class BPF(object):
 
     @staticmethod
     def tracepoint_exists(category, event):
-        evt_dir = os.path.join(TRACEFS, "events", category, event)
-        return os.path.isdir(evt_dir)
+        tp = _assert_is_bytes(category) + b":" + _assert_is_bytes(event)
+        return lib.bcc_feature_probe(b"tracepoint", tp) == 1
 
     def attach_tracepoint(self, tp=b"", tp_re=b"", fn_name=b""):
         """attach_tracepoint(tp="", tp_re="", fn_name="")
@@ -1030,6 +1430,7 @@ class BPF(object):
             raise Exception("Failed to attach BPF program %s to tracepoint %s" %
                             (fn_name, tp))
         self.tracepoint_fds[tp] = fd
+        self._attach_fns[("tracepoint", tp)] = fn_name
         return self
 
     def attach_raw_tracepoint(self, tp=b"", fn_name=b""):
@@ -1054,6 +1455,7 @@ class BPF(object):
         if fd < 0:
             raise Exception("Failed to attach BPF to raw tracepoint")
         self.raw_tracepoint_fds[tp] = fd
+        self._attach_fns[("raw_tracepoint", tp)] = fn_name
         return self
 
     def detach_raw_tracepoint(self, tp=b""):
@@ -1079,24 +1481,20 @@ class BPF(object):
 
     @staticmethod
     def support_kfunc():
-        # there's no trampoline support for other than x86_64 arch
-        if platform.machine() != 'x86_64':
-            return False
-        if not lib.bpf_has_kernel_btf():
-            return False
-        # kernel symbol "bpf_trampoline_link_prog" indicates kfunc support
-        if BPF.ksymname("bpf_trampoline_link_prog") != -1:
-            return True
-        return False
+        # libbcc probes features once per boot and set of loaded modules
+        return lib.bcc_feature_probe(b"kfunc", None) == 1
 
     @staticmethod
     def support_lsm():
-        if not lib.bpf_has_kernel_btf():
-            return False
-        # kernel symbol "bpf_lsm_bpf" indicates BPF LSM support
-        if BPF.ksymname(b"bpf_lsm_bpf") != -1:
-            return True
-        return False
+        return lib.bcc_feature_probe(b"lsm", None) == 1
+
+    @staticmethod
+    def support_ringbuf():
+        return lib.bcc_feature_probe(b"ringbuf", None) == 1
+
+    @staticmethod
+    def support_task_storage():
+        return lib.bcc_feature_probe(b"task_storage", None) == 1
 
     def detach_kfunc(self, fn_name=b""):
         fn_name = _assert_is_bytes(fn_name)
@@ -1169,29 +1567,28 @@ class BPF(object):
 
     @staticmethod
     def support_raw_tracepoint():
-        # kernel symbol "bpf_find_raw_tracepoint" indicates raw_tracepoint support
-        if BPF.ksymname("bpf_find_raw_tracepoint") != -1 or \
-           BPF.ksymname("bpf_get_raw_tracepoint") != -1:
-            return True
-        return False
+        return lib.bcc_feature_probe(b"raw_tracepoint", None) == 1
 
     @staticmethod
     def support_raw_tracepoint_in_module():
-        # kernel symbol "bpf_trace_modules" indicates raw tp support in modules, ref: kernel commit a38d1107
-        kallsyms = "/proc/kallsyms"
-        with open(kallsyms) as syms:
-            for line in syms:
-                (_, _, name) = line.rstrip().split(" ", 2)
-                name = name.split("\t")[0]
-                if name == "bpf_trace_modules":
-                    return True
-            return False
+        return lib.bcc_feature_probe(b"raw_tracepoint_in_module", None) == 1
 
     @staticmethod
     def kernel_struct_has_field(struct_name, field_name):
-        struct_name = _assert_is_bytes(struct_name)
-        field_name = _assert_is_bytes(field_name)
-        return lib.kernel_struct_has_field(struct_name, field_name)
+        field = _assert_is_bytes(struct_name) + b"." + \
+            _assert_is_bytes(field_name)
+        return lib.bcc_feature_probe(b"struct_field", field)
+
+    @staticmethod
+    def kprobe_exists(fn_name):
+        """kprobe_exists(fn_name)
+
+        Return True if a kprobe can be attached to kernel function fn_name.
+        Unlike get_kprobe_functions(), the answer is cached per boot and set
+        of loaded modules, for tools choosing between alternative functions.
+        """
+        fn_name = _assert_is_bytes(fn_name)
+        return lib.bcc_feature_probe(b"kprobe", fn_name) == 1
 
     def detach_tracepoint(self, tp=b""):
         """detach_tracepoint(tp="")
@@ -1215,26 +1612,47 @@ class BPF(object):
         del self.tracepoint_fds[tp]
 
     def _attach_perf_event(self, progfd, ev_type, ev_config,
-            sample_period, sample_freq, pid, cpu, group_fd):
-        res = lib.bpf_attach_perf_event(progfd, ev_type, ev_config,
-                sample_period, sample_freq, pid, cpu, group_fd)
+            sample_period, sample_freq, pid, cpu, group_fd, cgroup_fd,
+            branch_sample_type):
+        if cgroup_fd >= 0:
+            res = lib.bpf_attach_perf_event_cgroup(progfd, ev_type,
+                    ev_config, sample_period, sample_freq, cgroup_fd, cpu)
+        elif branch_sample_type:
+            res = lib.bpf_attach_perf_event_branch(progfd, ev_type,
+                    ev_config, sample_period, sample_freq,
+                    branch_sample_type, pid, cpu, group_fd)
+        else:
+            res = lib.bpf_attach_perf_event(progfd, ev_type, ev_config,
+                    sample_period, sample_freq, pid, cpu, group_fd)
         if res < 0:
             raise Exception("Failed to attach BPF to perf event")
         return res
 
     def attach_perf_event(self, ev_type=-1, ev_config=-1, fn_name=b"",
-            sample_period=0, sample_freq=0, pid=-1, cpu=-1, group_fd=-1):
+            sample_period=0, sample_freq=0, pid=-1, cpu=-1, group_fd=-1,
+            cgroup_fd=-1, branch_sample_type=0):
+        """With cgroup_fd, an open cgroup v2 directory, the events only
+        count while its tasks run, instead of pid.
+
+        With branch_sample_type, PerfBranchSampleType bits, the last branch
+        records of the CPU are kept for bpf_read_branch_records() in the
+        program. This needs a hardware event."""
+        if cgroup_fd >= 0 and branch_sample_type:
+            raise Exception("cgroup_fd can't be used with branch_sample_type")
         fn_name = _assert_is_bytes(fn_name)
         fn = self.load_func(fn_name, BPF.PERF_EVENT)
         res = {}
         if cpu >= 0:
             res[cpu] = self._attach_perf_event(fn.fd, ev_type, ev_config,
-                    sample_period, sample_freq, pid, cpu, group_fd)
+                    sample_period, sample_freq, pid, cpu, group_fd, cgroup_fd,
+                    branch_sample_type)
         else:
             for i in get_online_cpus():
                 res[i] = self._attach_perf_event(fn.fd, ev_type, ev_config,
-                        sample_period, sample_freq, pid, i, group_fd)
+                        sample_period, sample_freq, pid, i, group_fd,
+                        cgroup_fd, branch_sample_type)
         self.open_perf_events[(ev_type, ev_config)] = res
+        self._attach_fns[("perf_event", (ev_type, ev_config))] = fn_name
 
     def _attach_perf_event_raw(self, progfd, attr, pid, cpu, group_fd):
         res = lib.bpf_attach_perf_event_raw(progfd, ct.byref(attr), pid,
@@ -1255,6 +1673,7 @@ class BPF(object):
                 res[i] = self._attach_perf_event_raw(fn.fd, attr,
                         pid, i, group_fd)
         self.open_perf_events[(attr.type, attr.config)] = res
+        self._attach_fns[("perf_event", (attr.type, attr.config))] = fn_name
 
     def detach_perf_event(self, ev_type=-1, ev_config=-1):
         try:
@@ -1288,18 +1707,49 @@ class BPF(object):
         return set([address for (_, address) in
                     BPF.get_user_functions_and_addresses(name, sym_re)])
 
+    _sym_re_posix = re.compile(br"^[A-Za-z0-9_.*+?|()\[\]^$-]*$")
+    _sym_re_meta = b".^$*+?{}[]\\|()"
+
+    @staticmethod
+    def _sym_re_filter(sym_re):
+        """Return the literal prefix of sym_re and sym_re itself if it has
+        the same meaning for re.match() and POSIX regexec(), else None."""
+        prefix = b""
+        if b"|" not in sym_re:
+            for i in range(len(sym_re)):
+                c = sym_re[i:i + 1]
+                if c in BPF._sym_re_meta:
+                    # a quantifier applies to the previous character
+                    if c in b"*?{" and prefix:
+                        prefix = prefix[:-1]
+                    break
+                prefix += c
+        posix_re = sym_re if BPF._sym_re_posix.match(sym_re) and \
+            b"[[" not in sym_re and b"[." not in sym_re else None
+        return prefix or None, posix_re
+
     @staticmethod
     def get_user_functions_and_addresses(name, sym_re):
         name = _assert_is_bytes(name)
         sym_re = _assert_is_bytes(sym_re)
         addresses = []
+        sym_pat = re.compile(sym_re)
         def sym_cb(sym_name, addr):
-            dname = sym_name
-            if re.match(sym_re, dname):
-                addresses.append((dname, addr))
+            # symbols filtered in libbcc are checked again, in case the
+            # POSIX regex matched more than Python would
+            if sym_pat.match(sym_name):
+                addresses.append((sym_name, addr))
             return 0
 
-        res = lib.bcc_foreach_function_symbol(name, _SYM_CB_TYPE(sym_cb))
+        # Filter in libbcc so that only matching symbols come back to Python.
+        # The literal prefix of the pattern always goes, the pattern itself
+        # only when it means the same as a POSIX extended regex.
+        prefix, posix_re = BPF._sym_re_filter(sym_re)
+        res = lib.bcc_foreach_function_symbol_match(name, prefix, posix_re,
+                                                    _SYM_CB_TYPE(sym_cb))
+        if res == -errno.EINVAL and posix_re:
+            res = lib.bcc_foreach_function_symbol_match(name, prefix, None,
+                                                        _SYM_CB_TYPE(sym_cb))
         if res < 0:
             raise Exception("Error %d enumerating symbols in %s" % (res, name))
         return addresses
@@ -1353,6 +1803,9 @@ class BPF(object):
         if sym_re:
             addresses = BPF.get_user_addresses(name, sym_re)
             self._check_probe_quota(len(addresses))
+            if len(addresses) > 1 and self._attach_uprobe_multi(b"p", name,
+                    addresses, fn_name, pid, 0):
+                return
             for sym_addr in addresses:
                 self.attach_uprobe(name=name, addr=sym_addr,
                                    fn_name=fn_name, pid=pid)
@@ -1366,7 +1819,7 @@ class BPF(object):
         fd = lib.bpf_attach_uprobe(fn.fd, 0, ev_name, path, addr, pid)
         if fd < 0:
             raise Exception("Failed to attach BPF to uprobe")
-        self._add_uprobe_fd(ev_name, fd)
+        self._add_uprobe_fd(ev_name, fd, fn_name)
         return self
 
     def attach_uretprobe(self, name=b"", sym=b"", sym_re=b"", addr=None,
@@ -1385,7 +1838,11 @@ class BPF(object):
         fn_name = _assert_is_bytes(fn_name)
 
         if sym_re:
-            for sym_addr in BPF.get_user_addresses(name, sym_re):
+            addresses = BPF.get_user_addresses(name, sym_re)
+            if len(addresses) > 1 and self._attach_uprobe_multi(b"r", name,
+                    addresses, fn_name, pid, 1):
+                return
+            for sym_addr in addresses:
                 self.attach_uretprobe(name=name, addr=sym_addr,
                                       fn_name=fn_name, pid=pid)
             return
@@ -1398,18 +1855,22 @@ class BPF(object):
         fd = lib.bpf_attach_uprobe(fn.fd, 1, ev_name, path, addr, pid)
         if fd < 0:
             raise Exception("Failed to attach BPF to uretprobe")
-        self._add_uprobe_fd(ev_name, fd)
+        self._add_uprobe_fd(ev_name, fd, fn_name)
         return self
 
     def detach_uprobe_event(self, ev_name):
         if ev_name not in self.uprobe_fds:
             raise Exception("Uprobe %s is not attached" % ev_name)
-        res = lib.bpf_close_perf_event_fd(self.uprobe_fds[ev_name])
-        if res < 0:
-            raise Exception("Failed to detach BPF from uprobe")
-        res = lib.bpf_detach_uprobe(ev_name)
-        if res < 0:
-            raise Exception("Failed to detach BPF from uprobe")
+        fd = self.uprobe_fds[ev_name]
+        if isinstance(fd, BPF._MultiProbe):
+            fd.detach(ev_name)
+        else:
+            res = lib.bpf_close_perf_event_fd(fd)
+            if res < 0:
+                raise Exception("Failed to detach BPF from uprobe")
+            res = lib.bpf_detach_uprobe(ev_name)
+            if res < 0:
+                raise Exception("Failed to detach BPF from uprobe")
         self._del_uprobe_fd(ev_name)
 
     def detach_uprobe(self, name=b"", sym=b"", addr=None, pid=-1, sym_off=0):
@@ -1480,6 +1941,9 @@ class BPF(object):
                 fcntl.fcntl(fd, fcntl.F_SETFL, fl | os.O_NONBLOCK)
         return self.tracefile
 
+    TRACE_PIPE_BUF_SIZE = 64 * 1024
+    TRACE_FIELDS_BATCH = 1024
+
     def trace_fields(self, nonblocking=False):
         """trace_fields(nonblocking=False)
 
@@ -1487,33 +1951,48 @@ class BPF(object):
         fields (task, pid, cpu, flags, timestamp, msg) or None if no
         line was read (nonblocking=True)
         """
+        if not self._trace_fields:
+            self._trace_fields.extend(self.trace_fields_batch(nonblocking))
+            if not self._trace_fields:
+                return (None,) * 6
+        return self._trace_fields.popleft()
+
+    def trace_fields_batch(self, nonblocking=False):
+        """trace_fields_batch(nonblocking=False)
+
+        Read from the kernel debug trace pipe and return a list of the tuples
+        of fields returned by trace_fields(), for all the lines available
+        at once. The lines are read and parsed in libbcc, so this keeps up
+        with much higher rates than trace_fields(). Returns an empty list if
+        no line was read (nonblocking=True).
+
+        Lines are buffered ahead, don't mix this with trace_readline().
+        """
+        if not self._trace_pipe:
+            trace = self.trace_open(nonblocking)
+            self._trace_pipe = lib.bcc_trace_pipe_new(trace.fileno(),
+                    self.TRACE_PIPE_BUF_SIZE)
+            if not self._trace_pipe:
+                raise Exception("Could not allocate trace_pipe reader")
+            self._trace_records = \
+                (bcc_trace_record * self.TRACE_FIELDS_BATCH)()
+
+        recs = self._trace_records
+        data = ct.c_void_p()
         while True:
-            line = self.trace_readline(nonblocking)
-            if not line and nonblocking: return (None,) * 6
-            # don't print messages related to lost events
-            if line.startswith(b"CPU:"): continue
-            task = line[:16].lstrip()
-            line = line[17:]
-            ts_end = line.find(b":")
-            try:
-                pid, cpu, flags, ts = line[:ts_end].split()
-            except Exception as e:
-                continue
-            cpu = cpu[1:-1]
-            # line[ts_end:] will have ": [sym_or_addr]: msgs"
-            # For trace_pipe debug output, the addr typically
-            # is invalid (e.g., 0x1). For kernel 4.12 or earlier,
-            # if address is not able to match a kernel symbol,
-            # nothing will be printed out. For kernel 4.13 and later,
-            # however, the illegal address will be printed out.
-            # Hence, both cases are handled here.
-            line = line[ts_end + 1:]
-            sym_end = line.find(b":")
-            msg = line[sym_end + 2:]
-            try:
-                return (task, int(pid), int(cpu), flags, float(ts), msg)
-            except Exception as e:
-                return ("Unknown", 0, 0, "Unknown", 0.0, "Unknown")
+            cnt = lib.bcc_trace_pipe_read(self._trace_pipe, recs, len(recs),
+                                          ct.byref(data))
+            if cnt < 0:
+                raise Exception("Failed to read trace_pipe: %s" %
+                                os.strerror(-cnt))
+            if cnt or nonblocking:
+                break
+
+        base = data.value
+        return [(ct.string_at(base + r.task), r.pid, r.cpu,
+                 ct.string_at(base + r.flags), r.ts,
+                 ct.string_at(base + r.msg, r.msg_len))
+                for r in recs[:cnt]]
 
     def trace_readline(self, nonblocking=False):
         """trace_readline(nonblocking=False)
@@ -1559,9 +2038,16 @@ class BPF(object):
         """
         if pid < 0 and pid != -1:
             pid = -1
-        if not pid in BPF._sym_caches:
-            BPF._sym_caches[pid] = SymbolCache(pid)
-        return BPF._sym_caches[pid]
+        cache = BPF._sym_caches.pop(pid, None)
+        if cache is None:
+            cache = SymbolCache(pid)
+            if len(BPF._sym_caches) >= BPF._sym_caches_max:
+                for old in BPF._sym_caches:
+                    if old != -1:
+                        del BPF._sym_caches[old]
+                        break
+        BPF._sym_caches[pid] = cache
+        return cache
 
     @staticmethod
     def sym(addr, pid, show_module=False, show_offset=False, demangle=True):
@@ -1605,6 +2091,10 @@ class BPF(object):
         else:
           name, offset, module = BPF._sym_cache(pid).resolve(addr, demangle)
 
+        return BPF._sym_str(name, offset, module, show_module, show_offset)
+
+    @staticmethod
+    def _sym_str(name, offset, module, show_module, show_offset):
         offset = b"+0x%x" % offset if show_offset and name is not None else b""
         name = name or b"[unknown]"
         name = name + offset
@@ -1612,6 +2102,19 @@ class BPF(object):
             if show_module and module is not None else b""
         return name + module
 
+    @staticmethod
+    def sym_batch(addrs, pid, show_module=False, show_offset=False,
+                  demangle=True):
+        """sym_batch(addrs, pid, show_module=False, show_offset=False)
+
+        Same as sym() for a list of addresses of one pid, returning a list of
+        strings. This is much faster than calling sym() for each address when
+        symbolizing many stack frames.
+        """
+        return [BPF._sym_str(name, offset, module, show_module, show_offset)
+                for name, offset, module in
+                BPF._sym_cache(pid).resolve_batch(addrs, demangle)]
+
     @staticmethod
     def ksym(addr, show_module=False, show_offset=False):
         """ksym(addr)
@@ -1626,6 +2129,15 @@ class BPF(object):
         """
         return BPF.sym(addr, -1, show_module, show_offset, False)
 
+    @staticmethod
+    def ksym_batch(addrs, show_module=False, show_offset=False):
+        """ksym_batch(addrs, show_module=False, show_offset=False)
+
+        Same as ksym() for a list of kernel addresses, returning a list of
+        strings.
+        """
+        return BPF.sym_batch(addrs, -1, show_module, show_offset, False)
+
     @staticmethod
     def ksymname(name):
         """ksymname(name)
@@ -1634,6 +2146,247 @@ class BPF(object):
         ksym. Returns -1 when the function name is unknown."""
         return BPF._sym_cache(-1).resolve_name(None, name)
 
+    def phase_times(self):
+        """phase_times()
+
+        Return an OrderedDict of the wall time in nanoseconds spent in each
+        phase of compiling the program and loading its functions so far, such
+        as "parse", "run_pass_manager" or "func_load". If $BCC_PHASE_TIMES
+        names a file, a JSON line with the program name and these times is
+        appended to it at cleanup.
+        """
+        times = OrderedDict()
+        if not self.module:
+            return times
+        for i in range(lib.bpf_num_phases(self.module)):
+            times[lib.bpf_phase_name(self.module, i).decode()] = \
+                lib.bpf_phase_ns(self.module, i)
+        return times
+
+    def enable_run_stats(self):
+        """enable_run_stats()
+
+        Have the kernel count the runs and run time of all BPF programs
+        until this object is cleaned up, for run_stats(). It costs a couple
+        of clock reads per program run, so it is off unless enabled here or
+        with sysctl kernel.bpf_stats_enabled.
+        """
+        if self._run_stats_fd is None:
+            fd = lib.bcc_enable_run_stats()
+            if fd < 0:
+                errstr = os.strerror(ct.get_errno())
+                raise Exception("Failed to enable BPF run stats: %s" % errstr)
+            self._run_stats_fd = fd
+        self._overhead_last = (time.time(), self._total_run_time())
+        return self
+
+    def _attach_points(self):
+        points = {}
+        for ev_name, fns in self.kprobe_fds.items():
+            for fn_name in fns:
+                points.setdefault(fn_name, []).append(b"kprobe:" + ev_name)
+        live = {"uprobe": self.uprobe_fds, "tracepoint": self.tracepoint_fds,
+                "raw_tracepoint": self.raw_tracepoint_fds,
+                "perf_event": self.open_perf_events}
+        for (kind, key), fn_name in self._attach_fns.items():
+            if key not in live[kind]:
+                continue
+            if kind == "perf_event":
+                point = ("perf_event:%d:%d" % key).encode()
+            else:
+                point = kind.encode() + b":" + key
+            points.setdefault(fn_name, []).append(point)
+        for kind, fds in (("kfunc", self.kfunc_entry_fds),
+                          ("kretfunc", self.kfunc_exit_fds),
+                          ("lsm", self.lsm_fds)):
+            for fn_name in fds:
+                points.setdefault(fn_name, []).append(
+                    kind.encode() + b":" + fn_name)
+        return points
+
+    def run_stats(self):
+        """run_stats()
+
+        Return an OrderedDict of the loaded functions with the points they
+        are attached to and the runs and run time in nanoseconds the kernel
+        counted for them, as {"attach_points": [...], "run_cnt": n,
+        "run_time_ns": n}. The kernel counts per program, so a function
+        attached to several points gets one entry listing all of them.
+        Counts only grow while run stats are enabled, see enable_run_stats().
+        """
+        points = self._attach_points()
+        stats = OrderedDict()
+        run_cnt = ct.c_uint64()
+        run_time_ns = ct.c_uint64()
+        for name, fn in sorted(self.funcs.items()):
+            if lib.bcc_prog_run_stats(fn.fd, ct.byref(run_cnt),
+                                      ct.byref(run_time_ns)) < 0:
+                errstr = os.strerror(ct.get_errno())
+                raise Exception("Failed to get run stats of %s: %s" %
+                                (name, errstr))
+            stats[name.decode()] = {
+                "attach_points": sorted(p.decode() for p in
+                                        points.get(name, [])),
+                "run_cnt": run_cnt.value,
+                "run_time_ns": run_time_ns.value,
+            }
+        return stats
+
+    def memory_usage(self, count_entries=False):
+        """memory_usage(count_entries=False)
+
+        Return the kernel memory held by this object, as a dict of "maps"
+        and "progs", each an OrderedDict by name of their memlock charge in
+        bytes and sizes, and of "perf_buffer_pages", "ringbuf_pages" and
+        "total_bytes". memlock is 0 on kernels that don't report it. A ring
+        buffer's pages are part of its map's memlock, while perf buffers are
+        mmapped per cpu and charged to no map. With count_entries, the keys
+        present in each map are counted by walking them, which takes a
+        syscall per entry.
+        """
+        usage = {"maps": OrderedDict(), "progs": OrderedDict(),
+                 "perf_buffer_pages": 0, "ringbuf_pages": 0,
+                 "total_bytes": 0}
+        if not self.module:
+            return usage
+        page_size = os.sysconf("SC_PAGESIZE")
+        mem = bcc_map_mem()
+        for i in range(lib.bpf_num_tables(self.module)):
+            name = lib.bpf_table_name(self.module, i)
+            if lib.bcc_map_mem_info(lib.bpf_table_fd_id(self.module, i),
+                                    ct.byref(mem), count_entries) < 0:
+                errstr = os.strerror(ct.get_errno())
+                raise Exception("Failed to get memory usage of table %s: %s"
+                                % (name, errstr))
+            usage["maps"][name.decode()] = {
+                "type": mem.type,
+                "max_entries": mem.max_entries,
+                "entries": mem.entries if count_entries else None,
+                "memlock": mem.memlock,
+            }
+            if mem.type == BPF_MAP_TYPE_RINGBUF:
+                usage["ringbuf_pages"] += mem.max_entries // page_size
+            usage["total_bytes"] += mem.memlock
+
+        prog_mem = bcc_prog_mem()
+        for name, fn in sorted(self.funcs.items()):
+            if lib.bcc_prog_mem_info(fn.fd, ct.byref(prog_mem)) < 0:
+                errstr = os.strerror(ct.get_errno())
+                raise Exception("Failed to get memory usage of %s: %s" %
+                                (name, errstr))
+            usage["progs"][name.decode()] = {
+                "jited_len": prog_mem.jited_len,
+                "xlated_len": prog_mem.xlated_len,
+                "memlock": prog_mem.memlock,
+            }
+            usage["total_bytes"] += prog_mem.memlock
+
+        for table in self.tables.values():
+            if isinstance(table, PerfEventArray):
+                # the kernel maps a header page in front of each ring
+                usage["perf_buffer_pages"] += sum(
+                    p + 1 for p in table._buffer_pages.values())
+        usage["total_bytes"] += usage["perf_buffer_pages"] * page_size
+        return usage
+
+    def _total_run_time(self):
+        return sum(s["run_time_ns"] for s in self.run_stats().values())
+
+    def overhead(self):
+        """overhead()
+
+        Return the share of one CPU, 0.01 for 1%, that the loaded functions
+        took since the previous call or since enable_run_stats(). Tools can
+        check it against an overhead budget and detach when they exceed it.
+        """
+        if self._overhead_last is None:
+            raise Exception("Run stats are not enabled")
+        (last, last_ns) = self._overhead_last
+        now = time.time()
+        total = self._total_run_time()
+        self._overhead_last = (now, total)
+        if now <= last:
+            return 0.0
+        return (total - last_ns) / ((now - last) * 1e9)
+
+    def run_stats_metrics(self, prefix="bcc_prog"):
+        """run_stats_metrics(prefix="bcc_prog")
+
+        Return run_stats() in the Prometheus text format, one series per
+        function labelled with its attach points.
+        """
+        def label(val):
+            return val.replace("\\", "\\\\").replace('"', '\\"')
+        stats = self.run_stats()
+        lines = []
+        for (metric, key, help) in (
+                ("run_count_total", "run_cnt", "Runs of the BPF program"),
+                ("run_time_seconds_total", "run_time_ns",
+                 "Time spent running the BPF program")):
+            lines.append("# HELP %s_%s %s" % (prefix, metric, help))
+            lines.append("# TYPE %s_%s counter" % (prefix, metric))
+            for name, s in stats.items():
+                val = s[key] / 1e9 if key == "run_time_ns" else s[key]
+                lines.append('%s_%s{prog="%s",attach="%s"} %s' % (
+                    prefix, metric, label(name),
+                    label(",".join(s["attach_points"])), val))
+        return "\n".join(lines) + "\n"
+
+    @staticmethod
+    def enable_metrics(enable=True):
+        """enable_metrics(enable=True)
+
+        Start, or stop, counting the userspace work done by libbcc: perf
+        samples delivered and lost, symbol cache hits and misses, ELF symbol
+        tables read and map syscalls. Counting is off by default.
+        """
+        lib.bcc_metrics_enable(1 if enable else 0)
+
+    @staticmethod
+    def metrics():
+        """metrics()
+
+        Return the libbcc counters as an OrderedDict of name to count, summed
+        across threads.
+        """
+        res = OrderedDict()
+        i = 0
+        while True:
+            name = lib.bcc_metric_name(i)
+            if name is None:
+                break
+            res[name.decode()] = lib.bcc_metric_read(i)
+            i += 1
+        return res
+
+    @staticmethod
+    def reset_metrics():
+        lib.bcc_metrics_reset()
+
+    @staticmethod
+    def metrics_prometheus():
+        """metrics_prometheus()
+
+        Return the libbcc counters in the Prometheus text format.
+        """
+        size = lib.bcc_metrics_prometheus(None, 0) + 1
+        buf = ct.create_string_buffer(size)
+        lib.bcc_metrics_prometheus(buf, size)
+        return buf.value.decode()
+
+    def _dump_phase_times(self):
+        path = os.environ.get("BCC_PHASE_TIMES")
+        if not path or not self.module:
+            return
+        record = {"program": os.path.basename(sys.argv[0]) if sys.argv else "",
+                  "pid": os.getpid(), "phases": self.phase_times()}
+        try:
+            with open(path, "a") as f:
+                f.write(json.dumps(record) + "\n")
+        except IOError as e:
+            print("Cannot write phase times to %s: %s" % (path, e),
+                  file=sys.stderr)
+
     def num_open_kprobes(self):
         """num_open_kprobes()
 
@@ -1660,12 +2413,27 @@ class BPF(object):
         """perf_buffer_poll(self)
 
         Poll from all open perf ring buffers, calling the callback that was
-        provided when calling open_perf_buffer for each entry.
+        provided when calling open_perf_buffer for each entry. This also
+        handles the records of the buffers opened with background=True,
+        and the BPF_PERF_OUTPUT tables compiled as ring buffers.
         """
-        readers = (ct.c_void_p * len(self.perf_buffers))()
-        for i, v in enumerate(self.perf_buffers.values()):
-            readers[i] = v
-        lib.perf_reader_poll(len(readers), readers, timeout)
+        if self.perf_buffers or not (self._event_queue or
+                                     self._ringbuf_manager):
+            readers = (ct.c_void_p * len(self.perf_buffers))()
+            for i, v in enumerate(self.perf_buffers.values()):
+                readers[i] = v
+            lib.perf_reader_poll(len(readers), readers, timeout)
+            timeout = 0
+        if self._ringbuf_manager:
+            lib.bpf_poll_ringbuf(self._ringbuf_manager, timeout)
+            timeout = 0
+        if self._event_queue:
+            self._event_queue.poll(timeout)
+
+    def _get_event_queue(self):
+        if not self._event_queue:
+            self._event_queue = EventQueue()
+        return self._event_queue
 
     def kprobe_poll(self, timeout = -1):
         """kprobe_poll(self)
@@ -1688,11 +2456,16 @@ class BPF(object):
         """ring_buffer_poll(self)
 
         Poll from all open ringbuf buffers, calling the callback that was
-        provided when calling open_ring_buffer for each entry.
+        provided when calling open_ring_buffer for each entry. This also
+        handles the records of the buffers opened with background=True.
         """
-        if not self._ringbuf_manager:
+        if not self._ringbuf_manager and not self._event_queue:
             raise Exception("No ring buffers to poll")
-        lib.bpf_poll_ringbuf(self._ringbuf_manager, timeout)
+        if self._ringbuf_manager:
+            lib.bpf_poll_ringbuf(self._ringbuf_manager, timeout)
+            timeout = 0
+        if self._event_queue:
+            self._event_queue.poll(timeout)
 
     def ring_buffer_consume(self):
         """ring_buffer_consume(self)
@@ -1707,6 +2480,7 @@ class BPF(object):
         lib.bpf_consume_ringbuf(self._ringbuf_manager)
 
     def free_bcc_memory(self):
+        lib.bcc_vmlinux_btf_drop_cache()
         return lib.bcc_free_memory()
 
     @staticmethod
@@ -1724,7 +2498,9 @@ class BPF(object):
         """the do nothing exit handler"""
 
     def cleanup(self):
-        # Clean up opened probes
+        # Clean up opened probes, multi probe links at once rather than
+        # replacing them for each event they leave attached
+        self._close_multi_probes()
         for k, v in list(self.kprobe_fds.items()):
             self.detach_kprobe_event(k)
         for k, v in list(self.uprobe_fds.items()):
@@ -1740,6 +2516,12 @@ class BPF(object):
         for k, v in list(self.lsm_fds.items()):
             self.detach_lsm(k)
 
+        # The event queue owns the readers of background buffers, stop its
+        # thread before the tables go away
+        if self._event_queue:
+            self._event_queue.free()
+            self._event_queue = None
+
         # Clean up opened perf ring buffer and perf events
         table_keys = list(self.tables.keys())
         for key in table_keys:
@@ -1747,6 +2529,9 @@ class BPF(object):
                 del self.tables[key]
         for (ev_type, ev_config) in list(self.open_perf_events.keys()):
             self.detach_perf_event(ev_type, ev_config)
+        if self._trace_pipe:
+            lib.bcc_trace_pipe_free(self._trace_pipe)
+            self._trace_pipe = None
         if self.tracefile:
             self.tracefile.close()
             self.tracefile = None
@@ -1754,8 +2539,12 @@ class BPF(object):
             os.close(fn.fd)
             del self.funcs[name]
         if self.module:
+            self._dump_phase_times()
             lib.bpf_module_destroy(self.module)
             self.module = None
+        if self._run_stats_fd is not None:
+            os.close(self._run_stats_fd)
+            self._run_stats_fd = None
 
         # Clean up ringbuf
         if self._ringbuf_manager:
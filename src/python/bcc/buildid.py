@@ -0,0 +1,358 @@
+# Copyright (c) Facebook, Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""buildid.py moves the symbolization of user stacks off the traced hosts.
+
+The hosts record their stacks in a BPF_STACK_TRACE_BUILDID map and write
+the frames unresolved, as (build-id, offset) pairs, with BuildIdStackWriter.
+A Symbolizer then resolves them elsewhere, from stores of debug files named
+by build-id, reading them with BuildIdStackReader.
+
+The format is a stream of records, all integers being unsigned LEB128
+varints, after the 8 byte magic b"BCCBIDS1":
+  1 MODULE  length, build-id        defines the next module index
+  2 STRING  length, bytes           defines the next string index
+  3 SAMPLE  count, pid, comm string index, number of frames, frames
+A frame, from the leaf to the root, is a varint (index << 2 | kind) with
+kind 0 for a build-id frame (module index, followed by the offset varint),
+1 for an address without build-id (the address) and 2 for a symbol already
+resolved on the host, like kernel frames (string index). Modules and
+strings are written before the first sample using them, so files can be
+concatenated and read as they are written."""
+
+import collections
+import ctypes as ct
+import os
+import shutil
+import sys
+
+from .libbcc import lib, bcc_symbol, bcc_stacktrace_build_id
+
+MAGIC = b"BCCBIDS1"
+
+_REC_MODULE = 1
+_REC_STRING = 2
+_REC_SAMPLE = 3
+
+_FRAME_BUILD_ID = 0
+_FRAME_ADDR = 1
+_FRAME_SYMBOL = 2
+
+# bpf_stack_build_id.status
+_BUILD_ID_EMPTY = 0
+_BUILD_ID_VALID = 1
+_BUILD_ID_IP = 2
+
+Sample = collections.namedtuple("Sample", ["frames", "count", "pid", "comm"])
+
+def _varint(val):
+    out = bytearray()
+    while val > 0x7f:
+        out.append((val & 0x7f) | 0x80)
+        val >>= 7
+    out.append(val)
+    return bytes(out)
+
+def _to_bytes(s):
+    if isinstance(s, bytes):
+        return s
+    return s.encode("utf-8", "replace")
+
+def stack_frames(table, stack_id):
+    """stack_frames(table, stack_id)
+
+    Return the frames of a stack of a BPF_STACK_TRACE_BUILDID table as
+    BuildIdStackWriter takes them: (build-id, offset) tuples, or addresses
+    for the frames the kernel found no build-id for. Invalid or missing
+    stack ids give an empty list.
+    """
+    if stack_id < 0:
+        return []
+    try:
+        stack = table[table.Key(stack_id)]
+    except KeyError:
+        return []
+    frames = []
+    for frame in stack.trace:
+        if frame.status == _BUILD_ID_VALID:
+            frames.append((bytes(bytearray(frame.build_id)), frame.offset))
+        elif frame.status == _BUILD_ID_IP:
+            # the address shares the union of the offset
+            frames.append(frame.offset)
+        else:
+            break
+    return frames
+
+def build_id(path):
+    """build_id(path)
+
+    Return the build-id of the ELF file at path as a hex string, or None if
+    it has none."""
+    buf = ct.create_string_buffer(41)
+    if lib.bcc_elf_get_buildid(_to_bytes(path), buf) < 0:
+        return None
+    return buf.value.decode()
+
+def store_path(store, bid):
+    """store_path(store, bid)
+
+    Return the path of the debug file of the hex build-id bid in store, in
+    the layout of /usr/lib/debug/.build-id."""
+    return os.path.join(store, bid[:2], bid[2:] + ".debug")
+
+def publish(store, path):
+    """publish(store, path)
+
+    Copy the ELF file at path, a binary with symbols or its debug file, to
+    store under its build-id, for Symbolizers to find it. Returns the
+    build-id, or None if the file has none."""
+    bid = build_id(path)
+    if not bid:
+        return None
+    dest = store_path(store, bid)
+    if not os.path.exists(dest):
+        if not os.path.isdir(os.path.dirname(dest)):
+            os.makedirs(os.path.dirname(dest))
+        tmp = "%s.%d" % (dest, os.getpid())
+        shutil.copyfile(path, tmp)
+        os.rename(tmp, dest)
+    return bid
+
+class BuildIdStackWriter(object):
+    """BuildIdStackWriter(path)
+
+    Write stack samples with unresolved user frames to path, or to stdout
+    if path is "-".
+    """
+    def __init__(self, path):
+        if path == "-":
+            self._file = getattr(sys.stdout, "buffer", sys.stdout)
+        else:
+            self._file = open(path, "wb")
+        self._path = path
+        self._modules = {}
+        self._strings = {}
+        self._file.write(MAGIC)
+
+    def _module(self, bid):
+        idx = self._modules.get(bid)
+        if idx is None:
+            idx = len(self._modules)
+            self._modules[bid] = idx
+            self._file.write(_varint(_REC_MODULE) + _varint(len(bid)) + bid)
+        return idx
+
+    def _string(self, s):
+        s = _to_bytes(s)
+        idx = self._strings.get(s)
+        if idx is None:
+            idx = len(self._strings)
+            self._strings[s] = idx
+            self._file.write(_varint(_REC_STRING) + _varint(len(s)) + s)
+        return idx
+
+    def add_sample(self, frames, count=1, pid=0, comm=b""):
+        """add_sample(frames, count=1, pid=0, comm=b"")
+
+        Add count samples of the stack frames, from the leaf to the root.
+        A frame is a (build-id, offset) tuple, as stack_frames() returns,
+        an address, or a symbol name already resolved.
+        """
+        out = [_varint(count), _varint(pid), _varint(self._string(comm)),
+               _varint(len(frames))]
+        for frame in frames:
+            if isinstance(frame, tuple):
+                idx = self._module(bytes(frame[0]))
+                out.append(_varint(idx << 2 | _FRAME_BUILD_ID) +
+                           _varint(frame[1]))
+            elif isinstance(frame, (bytes, str)):
+                idx = self._string(frame)
+                out.append(_varint(idx << 2 | _FRAME_SYMBOL))
+            else:
+                out.append(_varint(frame << 2 | _FRAME_ADDR))
+        self._file.write(_varint(_REC_SAMPLE) + b"".join(out))
+
+    def close(self):
+        if not self._file:
+            return
+        if self._path != "-":
+            self._file.close()
+        else:
+            self._file.flush()
+        self._file = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_val, exc_tb):
+        self.close()
+
+class BuildIdStackReader(object):
+    """BuildIdStackReader(path)
+
+    Iterate over the samples of a file written by BuildIdStackWriter, or of
+    stdin if path is "-", as Sample(frames, count, pid, comm) tuples whose
+    frames are those given to add_sample(), names being bytes.
+    """
+    def __init__(self, path):
+        if path == "-":
+            self._file = getattr(sys.stdin, "buffer", sys.stdin)
+        else:
+            self._file = open(path, "rb")
+        self._path = path
+
+    def _byte(self):
+        b = self._file.read(1)
+        if not b:
+            raise EOFError()
+        return bytearray(b)[0]
+
+    def _varint(self):
+        val = shift = 0
+        while True:
+            b = self._byte()
+            val |= (b & 0x7f) << shift
+            shift += 7
+            if not b & 0x80:
+                return val
+
+    def _bytes(self):
+        size = self._varint()
+        data = self._file.read(size)
+        if len(data) != size:
+            raise EOFError()
+        return data
+
+    def __iter__(self):
+        modules = []
+        strings = []
+        if self._file.read(len(MAGIC)) != MAGIC:
+            raise ValueError("not a build-id stack file")
+        while True:
+            try:
+                rec = self._varint()
+            except EOFError:
+                return
+            try:
+                if rec == _REC_MODULE:
+                    modules.append(self._bytes())
+                elif rec == _REC_STRING:
+                    strings.append(self._bytes())
+                elif rec == _REC_SAMPLE:
+                    count = self._varint()
+                    pid = self._varint()
+                    comm = strings[self._varint()]
+                    frames = []
+                    for _ in range(self._varint()):
+                        val = self._varint()
+                        kind, idx = val & 3, val >> 2
+                        if kind == _FRAME_BUILD_ID:
+                            frames.append((modules[idx], self._varint()))
+                        elif kind == _FRAME_SYMBOL:
+                            frames.append(strings[idx])
+                        else:
+                            frames.append(idx)
+                    yield Sample(frames, count, pid, comm)
+                else:
+                    raise ValueError("unknown record type %d" % rec)
+            except EOFError:
+                raise ValueError("truncated build-id stack file")
+
+    def close(self):
+        if self._file and self._path != "-":
+            self._file.close()
+        self._file = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_val, exc_tb):
+        self.close()
+
+class Symbolizer(object):
+    """Symbolizer(stores=(), modules=(), cache_size=1 << 20)
+
+    Resolve build-id frames with the debug files of stores, directories laid
+    out like /usr/lib/debug/.build-id (see publish()) or debuginfod caches,
+    and of the binaries of modules. Each debug file is only parsed the first
+    time one of its frames is resolved, and the names of up to cache_size
+    frames are kept, so a long running service resolves the frames common
+    to many profiles once.
+    """
+    def __init__(self, stores=(), modules=(), cache_size=1 << 20):
+        self._cache = lib.bcc_buildsymcache_new()
+        self._names = {}
+        self._cache_size = cache_size
+        for store in stores:
+            self.add_store(store)
+        for module in modules:
+            lib.bcc_buildsymcache_add_module(self._cache, _to_bytes(module))
+
+    def __del__(self):
+        # lib may already be gone at interpreter exit
+        if self._cache and lib:
+            lib.bcc_free_buildsymcache(self._cache)
+            self._cache = None
+
+    def add_store(self, store):
+        if lib.bcc_buildsymcache_add_store(self._cache, _to_bytes(store)) < 0:
+            raise ValueError("%s is not a directory" % store)
+        # frames unresolved so far may be resolved now
+        self._names = {}
+
+    def _resolve(self, frame):
+        bid, offset = frame
+        b = bcc_stacktrace_build_id()
+        b.status = _BUILD_ID_VALID
+        ct.memmove(b.build_id, bid, min(len(bid), ct.sizeof(b.build_id)))
+        b.u.offset = offset
+        sym = bcc_symbol()
+        if lib.bcc_buildsymcache_resolve(self._cache, ct.byref(b),
+                                         ct.byref(sym)) == 0 and sym.name:
+            return sym.name
+        hex_id = "".join("%02x" % c for c in bytearray(bid))
+        return ("[%s+0x%x]" % (hex_id, offset)).encode()
+
+    def resolve_batch(self, frames):
+        """resolve_batch(frames)
+
+        Return the names of frames, as bytes, in the forms add_sample()
+        takes them. Names already resolved are kept, and unresolved frames
+        are named after their build-id and offset, or their address.
+        """
+        res = []
+        for frame in frames:
+            if isinstance(frame, tuple):
+                name = self._names.get(frame)
+                if name is None:
+                    if len(self._names) >= self._cache_size:
+                        self._names = {}
+                    name = self._names[frame] = self._resolve(frame)
+                res.append(name)
+            elif isinstance(frame, bytes):
+                res.append(frame)
+            elif isinstance(frame, str):
+                res.append(frame.encode())
+            else:
+                res.append(("0x%x" % frame).encode())
+        return res
+
+    def symbolize(self, samples):
+        """symbolize(samples)
+
+        Resolve the frames of samples, e.g. a BuildIdStackReader, yielding
+        Sample tuples whose frames are names.
+        """
+        for sample in samples:
+            yield sample._replace(frames=self.resolve_batch(sample.frames))
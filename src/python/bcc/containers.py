@@ -12,6 +12,11 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
+import ctypes as ct
+import os
+
+from .libbcc import lib, _CGROUP_LABEL_CB_TYPE
+
 def _cgroup_filter_func_writer(cgroupmap):
     if not cgroupmap:
         return """
@@ -111,3 +116,69 @@ def filter_by_containers(args):
     mntnsmap_text = _mntns_filter_func_writer(args.mntnsmap)
 
     return cgroupmap_text + mntnsmap_text + filter_by_containers_text
+
+class CgroupCache(object):
+    """Resolve the ids of bpf_get_current_cgroup_id() to cgroup paths and
+    labels, such as container names.
+
+    The hierarchy at root is walked once and kept up to date with inotify.
+    label, if given, is called with the path of each new cgroup, relative
+    to root, and returns its label or None.
+    """
+    def __init__(self, root=None, label=None):
+        def _label(path, buf, size, ctx):
+            try:
+                res = label(path.decode())
+            except Exception:
+                return 0
+            if not res:
+                return 0
+            res = res.encode()[:size - 1]
+            ct.memmove(buf, res + b"\0", len(res) + 1)
+            return len(res)
+        # keep a reference, the callback outlives this call
+        self._cb = _CGROUP_LABEL_CB_TYPE(_label if label else 0)
+        self.cache = lib.bcc_cgroup_cache_new(
+            root.encode() if root else None, self._cb, None)
+        if not self.cache:
+            err = ct.get_errno()
+            raise OSError(err, "cannot walk cgroups at %s: %s" %
+                          (root or "/sys/fs/cgroup", os.strerror(err)))
+
+    def _lookup(self, cgroup_id):
+        path = ct.create_string_buffer(4096)
+        label = ct.create_string_buffer(256)
+        if lib.bcc_cgroup_cache_lookup(self.cache, cgroup_id, path,
+                                       len(path), label, len(label)) < 0:
+            return None, None
+        return path.value.decode(), label.value.decode()
+
+    def path(self, cgroup_id):
+        """The path of the cgroup, None if unknown"""
+        return self._lookup(cgroup_id)[0]
+
+    def label(self, cgroup_id):
+        """The label of the cgroup, "" if it has none, None if unknown"""
+        return self._lookup(cgroup_id)[1]
+
+    def fd(self):
+        return lib.bcc_cgroup_cache_fd(self.cache)
+
+    def poll(self):
+        """Apply the changes of the hierarchy, returning the number of
+        cgroups added or removed"""
+        res = lib.bcc_cgroup_cache_poll(self.cache)
+        if res < 0:
+            raise OSError(-res, os.strerror(-res))
+        return res
+
+    def __len__(self):
+        return lib.bcc_cgroup_cache_size(self.cache)
+
+    def close(self):
+        if self.cache:
+            lib.bcc_cgroup_cache_free(self.cache)
+            self.cache = None
+
+    def __del__(self):
+        self.close()
@@ -0,0 +1,136 @@
+# Copyright (c) Facebook, Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import ctypes as ct
+import os
+
+# Same values as in helpers.h
+TASK_FILTER_PID = 1 << 0
+TASK_FILTER_TID = 1 << 1
+TASK_FILTER_CGROUP = 1 << 2
+TASK_FILTER_COMM = 1 << 3
+
+_task_filter_text = """
+BPF_TASK_FILTER(task_filter, MAX_ENTRIES);
+
+static inline int task_should_be_filtered() {
+    int zero = 0;
+    u32 *conf = task_filter_conf.lookup(&zero);
+    if (!conf || !*conf)
+        return 0;
+
+    u32 flags = *conf;
+    u64 id = bpf_get_current_pid_tgid();
+    if (flags & BPF_TASK_FILTER_PID) {
+        u32 pid = id >> 32;
+        if (!task_filter_pids.lookup(&pid))
+            return 1;
+    }
+    if (flags & BPF_TASK_FILTER_TID) {
+        u32 tid = id;
+        if (!task_filter_tids.lookup(&tid))
+            return 1;
+    }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 18, 0)
+    if (flags & BPF_TASK_FILTER_CGROUP) {
+        u64 cgroupid = bpf_get_current_cgroup_id();
+        if (!task_filter_cgroups.lookup(&cgroupid))
+            return 1;
+    }
+#endif
+    if (flags & BPF_TASK_FILTER_COMM) {
+        struct bpf_task_filter_comm comm = {};
+        bpf_get_current_comm(&comm.comm, sizeof(comm.comm));
+        if (!task_filter_comms.lookup(&comm))
+            return 1;
+    }
+    return 0;
+}
+"""
+
+def task_filter_text(max_entries=1024):
+    """task_filter_text(max_entries=1024)
+
+    Returns the BPF source of the task filter maps, and of a
+    task_should_be_filtered() function which returns 1 when the current
+    task is not in the sets of TaskFilter, with one map lookup per set in
+    use. Nothing is filtered until a set is given.
+    """
+    return _task_filter_text.replace('MAX_ENTRIES', str(max_entries))
+
+class TaskFilter(object):
+    """Sets of processes, threads, cgroups and command names of the
+    task_filter_text() maps of a BPF program, which can be changed at
+    runtime. Each set_*() replaces a set, None or an empty list removing it.
+    """
+
+    def __init__(self, bpf):
+        self.conf = bpf["task_filter_conf"]
+        self.pids = bpf["task_filter_pids"]
+        self.tids = bpf["task_filter_tids"]
+        self.cgroups = bpf["task_filter_cgroups"]
+        self.comms = bpf["task_filter_comms"]
+        self.flags = 0
+
+    def _set(self, table, flag, keys):
+        # ctypes objects compare by identity, so compare their bytes
+        raw = lambda key: ct.string_at(ct.addressof(key), ct.sizeof(key))
+        new = set(raw(key) for key in keys)
+        old = list(table.keys())
+        # Add the new entries before removing the stale ones, for the set
+        # never to be empty in between
+        for key in keys:
+            table[key] = ct.c_ubyte(1)
+        for key in old:
+            if raw(key) not in new:
+                del table[key]
+        if keys:
+            self.flags |= flag
+        else:
+            self.flags &= ~flag
+        self.conf[ct.c_int(0)] = ct.c_uint(self.flags)
+
+    def set_pids(self, pids):
+        self._set(self.pids, TASK_FILTER_PID,
+                  [self.pids.Key(pid) for pid in pids or []])
+
+    def set_tids(self, tids):
+        self._set(self.tids, TASK_FILTER_TID,
+                  [self.tids.Key(tid) for tid in tids or []])
+
+    def set_cgroups(self, cgroups):
+        """cgroups are cgroup v2 ids or directories, the id of a cgroup
+        being the inode number of its directory."""
+        ids = []
+        for cgroup in cgroups or []:
+            if not isinstance(cgroup, int):
+                cgroup = os.stat(cgroup).st_ino
+            ids.append(self.cgroups.Key(cgroup))
+        self._set(self.cgroups, TASK_FILTER_CGROUP, ids)
+
+    def set_comms(self, comms):
+        keys = []
+        for comm in comms or []:
+            key = self.comms.Key()
+            if not isinstance(comm, bytes):
+                comm = comm.encode()
+            key.comm = comm[:ct.sizeof(key.comm) - 1]
+            keys.append(key)
+        self._set(self.comms, TASK_FILTER_COMM, keys)
+
+    def clear(self):
+        for table in (self.pids, self.tids, self.cgroups, self.comms):
+            table.clear()
+        self.flags = 0
+        self.conf[ct.c_int(0)] = ct.c_uint(0)
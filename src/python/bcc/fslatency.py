@@ -0,0 +1,390 @@
+# Copyright (c) Facebook, Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""fslatency.py measures the latency of file system operations.
+
+FsLatency traces the read, write, open and fsync (or getattr for NFS)
+operations of several file systems at once, with one BPF program. The file
+systems are told apart by the magic number of their superblock, so functions
+shared by several of them, like generic_file_read_iter(), are probed once.
+The program text does not depend on the file systems or the options, which
+are passed as BPF_RODATA: it is compiled once and then loaded from the
+compiled object cache.
+
+    fs = FsLatency(["ext4", "xfs"])
+    ...
+    fs.print_dist("usecs")
+
+Latencies go to log2 histograms keyed by file system and operation, and,
+with events=True, operations slower than min_us are sent as events.
+"""
+
+import collections
+import ctypes as ct
+
+from . import BPF
+
+READ = 0
+WRITE = 1
+OPEN = 2
+FSYNC = 3
+GETATTR = 4
+
+OP_NAMES = ["read", "write", "open", "fsync", "getattr"]
+OP_LETTERS = "RWOSG"
+
+# The most file systems traced together
+MAX_FS = 8
+
+# Entry probes, by the arguments of the traced function:
+#   kiocb: (struct kiocb *iocb, ...), like the read_iter file operations
+#   open:  (struct inode *inode, struct file *file)
+#   file:  (struct file *file, ...)
+#   nfs:   any, on NFS
+_ENTRY_FNS = {
+    "kiocb": "trace_kiocb_entry",
+    "open": "trace_open_entry",
+    "file": "trace_file_entry",
+    "nfs": "trace_nfs_entry",
+}
+
+_RETURN_FNS = ["trace_read_return", "trace_write_return", "trace_open_return",
+               "trace_fsync_return", "trace_getattr_return"]
+
+# A file system: the magic number of its superblock, and for each of its
+# operations, the functions to trace as (name, entry kind) pairs. The first
+# function found in the kernel is traced, or all of them with every=True.
+FileSystem = collections.namedtuple("FileSystem", ["magic", "ops"])
+Op = collections.namedtuple("Op", ["op", "functions", "every"])
+
+def _op(op, functions, every=False):
+    return Op(op, functions, every)
+
+FILESYSTEMS = {
+    "ext4": FileSystem(0xEF53, [
+        # Linux 4.5 to 4.9 read through generic_file_read_iter()
+        _op(READ, [("ext4_file_read_iter", "kiocb"),
+                   ("generic_file_read_iter", "kiocb")]),
+        _op(WRITE, [("ext4_file_write_iter", "kiocb")]),
+        _op(OPEN, [("ext4_file_open", "open")]),
+        _op(FSYNC, [("ext4_sync_file", "file")]),
+    ]),
+    "xfs": FileSystem(0x58465342, [
+        _op(READ, [("xfs_file_read_iter", "kiocb")]),
+        _op(WRITE, [("xfs_file_write_iter", "kiocb")]),
+        _op(OPEN, [("xfs_file_open", "open")]),
+        _op(FSYNC, [("xfs_file_fsync", "file")]),
+    ]),
+    "btrfs": FileSystem(0x9123683E, [
+        _op(READ, [("btrfs_file_read_iter", "kiocb"),
+                   ("generic_file_read_iter", "kiocb")]),
+        _op(WRITE, [("btrfs_file_write_iter", "kiocb")]),
+        _op(OPEN, [("btrfs_file_open", "open"),
+                   ("generic_file_open", "open")]),
+        _op(FSYNC, [("btrfs_sync_file", "file")]),
+    ]),
+    "nfs": FileSystem(0x6969, [
+        _op(READ, [("nfs_file_read", "kiocb")]),
+        _op(WRITE, [("nfs_file_write", "kiocb")]),
+        # NFSv4 opens go through nfs4_file_open() only
+        _op(OPEN, [("nfs4_file_open", "open"), ("nfs_file_open", "open")],
+            every=True),
+        _op(GETATTR, [("nfs_getattr", "nfs")]),
+    ]),
+    "zfs": FileSystem(0x2FC12FC1, [
+        _op(READ, [("zpl_iter_read", "kiocb"), ("zpl_aio_read", "kiocb"),
+                   ("zpl_read", "file")]),
+        _op(WRITE, [("zpl_iter_write", "kiocb"), ("zpl_aio_write", "kiocb"),
+                    ("zpl_write", "file")]),
+        _op(OPEN, [("zpl_open", "open")]),
+        _op(FSYNC, [("zpl_fsync", "file")]),
+    ]),
+}
+
+TEXT = """
+#include <uapi/linux/ptrace.h>
+#include <linux/fs.h>
+#include <linux/sched.h>
+#include <linux/dcache.h>
+
+#define MAX_FS %d
+#define NFS_SUPER_MAGIC 0x6969
+
+struct fs_config {
+    u64 factor;         // of the latencies in the histograms, in ns
+    u64 min_ns;         // of the operations sent as events
+    u32 pid;            // traced, or 0 for all
+    u32 histograms;
+    u32 events;
+    u32 magic[MAX_FS];  // of the traced file systems
+};
+
+BPF_RODATA(cfg, struct fs_config);
+
+struct start_t {
+    u64 ts;
+    u64 offset;
+    struct file *fp;
+    u32 fs;
+};
+
+// id is the index of the file system << 8 | the operation
+struct dist_key {
+    u64 id;
+    u64 slot;
+};
+
+struct event_t {
+    u64 ts_us;
+    u64 size;
+    u64 offset;
+    u64 delta_us;
+    u32 pid;
+    u32 fs;
+    u32 op;
+    char task[TASK_COMM_LEN];
+    char file[DNAME_INLINE_LEN];
+};
+
+BPF_HASH(start, u32, struct start_t);
+BPF_HISTOGRAM(dist, struct dist_key, MAX_FS * 5 * 64);
+BPF_PERF_OUTPUT(events);
+
+static __always_inline int trace_entry(struct file *fp, u64 offset, u32 magic)
+{
+    const struct fs_config *c = cfg.get();
+    u64 id = bpf_get_current_pid_tgid();
+    int fs = -1;
+
+    if (!c || (c->pid && c->pid != id >> 32))
+        return 0;
+    #pragma unroll
+    for (int i = 0; i < MAX_FS; i++) {
+        if (c->magic[i] && c->magic[i] == magic)
+            fs = i;
+    }
+    if (fs < 0)
+        return 0;
+
+    u32 tid = id;
+    struct start_t s = {};
+    s.ts = bpf_ktime_get_ns();
+    s.offset = offset;
+    s.fp = fp;
+    s.fs = fs;
+    start.update(&tid, &s);
+    return 0;
+}
+
+int trace_kiocb_entry(struct pt_regs *ctx, struct kiocb *iocb)
+{
+    struct file *fp = iocb->ki_filp;
+    return trace_entry(fp, iocb->ki_pos, fp->f_inode->i_sb->s_magic);
+}
+
+int trace_open_entry(struct pt_regs *ctx, struct inode *inode,
+    struct file *file)
+{
+    return trace_entry(file, 0, inode->i_sb->s_magic);
+}
+
+int trace_file_entry(struct pt_regs *ctx, struct file *file)
+{
+    return trace_entry(file, 0, file->f_inode->i_sb->s_magic);
+}
+
+int trace_nfs_entry(struct pt_regs *ctx)
+{
+    return trace_entry(NULL, 0, NFS_SUPER_MAGIC);
+}
+
+static __always_inline int trace_return(struct pt_regs *ctx, u32 op)
+{
+    const struct fs_config *c = cfg.get();
+    u64 id = bpf_get_current_pid_tgid();
+    u32 tid = id;
+
+    struct start_t *s = start.lookup(&tid);
+    if (!s || !c)
+        return 0;   // missed or filtered entry
+    u64 ts = bpf_ktime_get_ns();
+    u64 delta = ts - s->ts;
+    u32 fs = s->fs;
+    u64 offset = s->offset;
+    struct file *fp = s->fp;
+    start.delete(&tid);
+
+    if (c->histograms) {
+        struct dist_key key = {};
+        key.id = (u64)fs << 8 | op;
+        key.slot = bpf_log2l(delta / c->factor);
+        dist.atomic_increment(key);
+    }
+
+    if (!c->events || delta < c->min_ns)
+        return 0;
+    struct event_t data = {};
+    data.ts_us = ts / 1000;
+    data.size = (u32)PT_REGS_RC(ctx);
+    data.offset = offset;
+    data.delta_us = delta / 1000;
+    data.pid = id >> 32;
+    data.fs = fs;
+    data.op = op;
+    bpf_get_current_comm(&data.task, sizeof(data.task));
+    if (fp) {
+        struct dentry *de = fp->f_path.dentry;
+        struct qstr qs = de->d_name;
+        bpf_probe_read_kernel(&data.file, sizeof(data.file), (void *)qs.name);
+    }
+    events.perf_submit(ctx, &data, sizeof(data));
+    return 0;
+}
+
+int trace_read_return(struct pt_regs *ctx)
+{
+    return trace_return(ctx, %d);
+}
+
+int trace_write_return(struct pt_regs *ctx)
+{
+    return trace_return(ctx, %d);
+}
+
+int trace_open_return(struct pt_regs *ctx)
+{
+    return trace_return(ctx, %d);
+}
+
+int trace_fsync_return(struct pt_regs *ctx)
+{
+    return trace_return(ctx, %d);
+}
+
+int trace_getattr_return(struct pt_regs *ctx)
+{
+    return trace_return(ctx, %d);
+}
+""" % (MAX_FS, READ, WRITE, OPEN, FSYNC, GETATTR)
+
+class _Config(ct.Structure):
+    _fields_ = [("factor", ct.c_uint64),
+                ("min_ns", ct.c_uint64),
+                ("pid", ct.c_uint32),
+                ("histograms", ct.c_uint32),
+                ("events", ct.c_uint32),
+                ("magic", ct.c_uint32 * MAX_FS)]
+
+# type is the letter of the operation in OP_LETTERS
+Event = collections.namedtuple("Event", ["ts_us", "fs", "type", "size",
+                                         "offset", "delta_us", "pid", "task",
+                                         "file"])
+
+def probes(filesystems, available=None):
+    """probes(filesystems, available=None)
+
+    Return the (function, entry function, return function) probes tracing
+    the file systems named in filesystems, each function once. available
+    tells whether a kernel function can be traced, and defaults to
+    BPF.get_kprobe_functions(). Raises ValueError for an unknown file
+    system, or one without any function to trace."""
+    if available is None:
+        available = lambda fn: bool(BPF.get_kprobe_functions(
+            ("^%s$" % fn).encode()))
+    res = []
+    seen = set()
+    for name in filesystems:
+        fs = FILESYSTEMS.get(name)
+        if not fs:
+            raise ValueError("unknown file system %s" % name)
+        found = False
+        for op in fs.ops:
+            for fn, kind in op.functions:
+                if not available(fn):
+                    continue
+                found = True
+                if fn not in seen:
+                    seen.add(fn)
+                    res.append((fn, _ENTRY_FNS[kind], _RETURN_FNS[op.op]))
+                if not op.every:
+                    break
+        if not found:
+            raise ValueError("no %s functions to trace, is %s loaded?" %
+                             (name, name))
+    return res
+
+class FsLatency(object):
+    """FsLatency(filesystems, pid=None, milliseconds=False, histograms=True,
+                 events=False, min_us=0)
+
+    Trace the operations of filesystems, a list of FILESYSTEMS names, and
+    of process pid only if given. Latencies go to histograms, in
+    milliseconds or microseconds, and operations taking at least min_us
+    are sent as events with events=True.
+    """
+    def __init__(self, filesystems, pid=None, milliseconds=False,
+                 histograms=True, events=False, min_us=0):
+        if len(filesystems) > MAX_FS:
+            raise ValueError("at most %d file systems" % MAX_FS)
+        self.filesystems = list(filesystems)
+        config = _Config()
+        config.factor = 1000000 if milliseconds else 1000
+        config.min_ns = min_us * 1000
+        config.pid = int(pid or 0)
+        config.histograms = histograms
+        config.events = events
+        for i, name in enumerate(self.filesystems):
+            if name not in FILESYSTEMS:
+                raise ValueError("unknown file system %s" % name)
+            config.magic[i] = FILESYSTEMS[name].magic
+        probe_list = probes(self.filesystems)
+
+        self.bpf = BPF(text=TEXT, cache=True, rodata={"cfg": config})
+        for fn, entry_fn, return_fn in probe_list:
+            self.bpf.attach_kprobe(event=fn, fn_name=entry_fn)
+            self.bpf.attach_kretprobe(event=fn, fn_name=return_fn)
+
+    def _op_name(self, id):
+        fs, op = id >> 8, id & 0xff
+        if len(self.filesystems) == 1:
+            return OP_NAMES[op]
+        return "%s %s" % (self.filesystems[fs], OP_NAMES[op])
+
+    def print_dist(self, label, clear=True):
+        """print_dist(label, clear=True)
+
+        Print the histograms of the operations, with label as the header of
+        their latency column, and clear them unless clear is False."""
+        dist = self.bpf["dist"]
+        dist.print_log2_hist(label, "operation",
+                             section_print_fn=self._op_name,
+                             bucket_sort_fn=sorted)
+        if clear:
+            dist.clear()
+
+    def open_events(self, callback, page_cnt=64):
+        """open_events(callback, page_cnt=64)
+
+        Call callback with an Event for each operation slower than min_us,
+        from poll()."""
+        def event_cb(cpu, data, size):
+            e = self.bpf["events"].event(data)
+            callback(Event(e.ts_us, self.filesystems[e.fs], OP_LETTERS[e.op],
+                           e.size, e.offset, e.delta_us, e.pid,
+                           e.task.decode("utf-8", "replace"),
+                           e.file.decode("utf-8", "replace")))
+        self.bpf["events"].open_perf_buffer(event_cb, page_cnt=page_cnt)
+
+    def poll(self, timeout=-1):
+        self.bpf.perf_buffer_poll(timeout)
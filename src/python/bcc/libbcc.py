@@ -26,6 +26,27 @@ lib.bpf_module_create_c.argtypes = [ct.c_char_p, ct.c_uint,
 lib.bpf_module_create_c_from_string.restype = ct.c_void_p
 lib.bpf_module_create_c_from_string.argtypes = [ct.c_char_p, ct.c_uint,
         ct.POINTER(ct.c_char_p), ct.c_int, ct.c_bool, ct.c_char_p]
+lib.bpf_module_create_c_from_string_cached.restype = ct.c_void_p
+lib.bpf_module_create_c_from_string_cached.argtypes = [ct.c_char_p, ct.c_uint,
+        ct.POINTER(ct.c_char_p), ct.c_int, ct.c_bool, ct.c_char_p, ct.c_char_p]
+lib.bpf_module_compile_object.restype = ct.c_int
+lib.bpf_module_compile_object.argtypes = [ct.c_char_p, ct.c_uint,
+        ct.POINTER(ct.c_char_p), ct.c_int, ct.c_char_p]
+lib.bpf_module_create_from_object.restype = ct.c_void_p
+lib.bpf_module_create_from_object.argtypes = [ct.c_char_p, ct.c_uint,
+        ct.c_bool, ct.c_char_p]
+lib.bpf_module_new.restype = ct.c_void_p
+lib.bpf_module_new.argtypes = [ct.c_uint, ct.c_bool, ct.c_bool, ct.c_char_p]
+lib.bpf_module_set_map_size.restype = None
+lib.bpf_module_set_map_size.argtypes = [ct.c_void_p, ct.c_char_p, ct.c_uint]
+lib.bpf_module_set_rodata.restype = None
+lib.bpf_module_set_rodata.argtypes = [ct.c_void_p, ct.c_char_p, ct.c_void_p,
+        ct.c_size_t]
+lib.bpf_module_load_string.restype = ct.c_int
+lib.bpf_module_load_string.argtypes = [ct.c_void_p, ct.c_char_p,
+        ct.POINTER(ct.c_char_p), ct.c_int, ct.c_char_p]
+lib.bpf_module_load_object.restype = ct.c_int
+lib.bpf_module_load_object.argtypes = [ct.c_void_p, ct.c_char_p]
 lib.bpf_module_destroy.restype = None
 lib.bpf_module_destroy.argtypes = [ct.c_void_p]
 lib.bpf_module_license.restype = ct.c_char_p
@@ -40,8 +61,14 @@ lib.bpf_function_start.restype = ct.c_void_p
 lib.bpf_function_start.argtypes = [ct.c_void_p, ct.c_char_p]
 lib.bpf_function_size.restype = ct.c_size_t
 lib.bpf_function_size.argtypes = [ct.c_void_p, ct.c_char_p]
+lib.bpf_num_tables.restype = ct.c_ulonglong
+lib.bpf_num_tables.argtypes = [ct.c_void_p]
+lib.bpf_table_fd_id.restype = ct.c_int
+lib.bpf_table_fd_id.argtypes = [ct.c_void_p, ct.c_ulonglong]
 lib.bpf_table_id.restype = ct.c_ulonglong
 lib.bpf_table_id.argtypes = [ct.c_void_p, ct.c_char_p]
+lib.bpf_table_name.restype = ct.c_char_p
+lib.bpf_table_name.argtypes = [ct.c_void_p, ct.c_ulonglong]
 lib.bpf_table_fd.restype = ct.c_int
 lib.bpf_table_fd.argtypes = [ct.c_void_p, ct.c_char_p]
 lib.bpf_table_type_id.restype = ct.c_int
@@ -54,6 +81,14 @@ lib.bpf_table_key_desc.restype = ct.c_char_p
 lib.bpf_table_key_desc.argtypes = [ct.c_void_p, ct.c_char_p]
 lib.bpf_table_leaf_desc.restype = ct.c_char_p
 lib.bpf_table_leaf_desc.argtypes = [ct.c_void_p, ct.c_char_p]
+lib.bpf_table_key_desc_id.restype = ct.c_char_p
+lib.bpf_table_key_desc_id.argtypes = [ct.c_void_p, ct.c_ulonglong]
+lib.bpf_table_leaf_desc_id.restype = ct.c_char_p
+lib.bpf_table_leaf_desc_id.argtypes = [ct.c_void_p, ct.c_ulonglong]
+lib.bpf_table_key_layout_id.restype = ct.c_char_p
+lib.bpf_table_key_layout_id.argtypes = [ct.c_void_p, ct.c_ulonglong]
+lib.bpf_table_leaf_layout_id.restype = ct.c_char_p
+lib.bpf_table_leaf_layout_id.argtypes = [ct.c_void_p, ct.c_ulonglong]
 lib.bpf_table_key_snprintf.restype = ct.c_int
 lib.bpf_table_key_snprintf.argtypes = [ct.c_void_p, ct.c_ulonglong,
         ct.c_char_p, ct.c_ulonglong, ct.c_void_p]
@@ -70,6 +105,55 @@ lib.bpf_perf_event_fields.restype = ct.c_ulonglong
 lib.bpf_perf_event_fields.argtypes = [ct.c_void_p, ct.c_char_p]
 lib.bpf_perf_event_field.restype = ct.c_char_p
 lib.bpf_perf_event_field.argtypes = [ct.c_void_p, ct.c_char_p, ct.c_ulonglong]
+lib.bpf_num_phases.restype = ct.c_ulonglong
+lib.bpf_num_phases.argtypes = [ct.c_void_p]
+lib.bpf_phase_name.restype = ct.c_char_p
+lib.bpf_phase_name.argtypes = [ct.c_void_p, ct.c_ulonglong]
+lib.bpf_phase_ns.restype = ct.c_ulonglong
+lib.bpf_phase_ns.argtypes = [ct.c_void_p, ct.c_ulonglong]
+lib.bcc_enable_run_stats.restype = ct.c_int
+lib.bcc_enable_run_stats.argtypes = None
+lib.bcc_prog_run_stats.restype = ct.c_int
+lib.bcc_prog_run_stats.argtypes = [ct.c_int, ct.POINTER(ct.c_uint64),
+        ct.POINTER(ct.c_uint64)]
+
+class bcc_map_mem(ct.Structure):
+    _fields_ = [
+            ('type', ct.c_uint32),
+            ('key_size', ct.c_uint32),
+            ('value_size', ct.c_uint32),
+            ('max_entries', ct.c_uint32),
+            ('entries', ct.c_uint32),
+            ('memlock', ct.c_uint64),
+        ]
+
+class bcc_prog_mem(ct.Structure):
+    _fields_ = [
+            ('jited_len', ct.c_uint32),
+            ('xlated_len', ct.c_uint32),
+            ('memlock', ct.c_uint64),
+        ]
+
+lib.bcc_map_mem_info.restype = ct.c_int
+lib.bcc_map_mem_info.argtypes = [ct.c_int, ct.POINTER(bcc_map_mem), ct.c_int]
+lib.bcc_prog_mem_info.restype = ct.c_int
+lib.bcc_prog_mem_info.argtypes = [ct.c_int, ct.POINTER(bcc_prog_mem)]
+lib.bcc_flip_epoch.restype = ct.c_int
+lib.bcc_flip_epoch.argtypes = [ct.c_int]
+lib.bcc_metrics_enable.restype = None
+lib.bcc_metrics_enable.argtypes = [ct.c_int]
+lib.bcc_metrics_enabled.restype = ct.c_int
+lib.bcc_metrics_enabled.argtypes = None
+lib.bcc_metric_name.restype = ct.c_char_p
+lib.bcc_metric_name.argtypes = [ct.c_int]
+lib.bcc_metric_help.restype = ct.c_char_p
+lib.bcc_metric_help.argtypes = [ct.c_int]
+lib.bcc_metric_read.restype = ct.c_uint64
+lib.bcc_metric_read.argtypes = [ct.c_int]
+lib.bcc_metrics_reset.restype = None
+lib.bcc_metrics_reset.argtypes = None
+lib.bcc_metrics_prometheus.restype = ct.c_int
+lib.bcc_metrics_prometheus.argtypes = [ct.c_char_p, ct.c_size_t]
 
 # keep in sync with libbpf.h
 lib.bpf_get_next_key.restype = ct.c_int
@@ -101,8 +185,24 @@ lib.bpf_attach_socket.argtypes = [ct.c_int, ct.c_int]
 lib.bcc_func_load.restype = ct.c_int
 lib.bcc_func_load.argtypes = [ct.c_void_p, ct.c_int, ct.c_char_p, ct.c_void_p,
         ct.c_size_t, ct.c_char_p, ct.c_uint, ct.c_int, ct.c_char_p, ct.c_uint, ct.c_char_p]
+lib.bcc_func_load_attach_type.restype = ct.c_int
+lib.bcc_func_load_attach_type.argtypes = [ct.c_void_p, ct.c_int, ct.c_int,
+        ct.c_char_p, ct.c_void_p, ct.c_size_t, ct.c_char_p, ct.c_uint, ct.c_int,
+        ct.c_char_p, ct.c_uint, ct.c_char_p]
 _RAW_CB_TYPE = ct.CFUNCTYPE(None, ct.py_object, ct.c_void_p, ct.c_int)
 _LOST_CB_TYPE = ct.CFUNCTYPE(None, ct.py_object, ct.c_ulonglong)
+
+# keep in sync with perf_reader.c
+PERF_READER_BATCH_MAX = 256
+
+class perf_reader_span(ct.Structure):
+    _fields_ = [
+            ('raw', ct.c_void_p),
+            ('raw_size', ct.c_int),
+        ]
+
+_BATCH_CB_TYPE = ct.CFUNCTYPE(None, ct.py_object,
+        ct.POINTER(perf_reader_span), ct.c_int)
 lib.bpf_attach_kprobe.restype = ct.c_int
 lib.bpf_attach_kprobe.argtypes = [ct.c_int, ct.c_int, ct.c_char_p, ct.c_char_p,
         ct.c_ulonglong, ct.c_int]
@@ -113,6 +213,12 @@ lib.bpf_attach_uprobe.argtypes = [ct.c_int, ct.c_int, ct.c_char_p, ct.c_char_p,
         ct.c_ulonglong, ct.c_int]
 lib.bpf_detach_uprobe.restype = ct.c_int
 lib.bpf_detach_uprobe.argtypes = [ct.c_char_p]
+lib.bpf_attach_kprobe_multi.restype = ct.c_int
+lib.bpf_attach_kprobe_multi.argtypes = [ct.c_int, ct.c_int,
+        ct.POINTER(ct.c_char_p), ct.POINTER(ct.c_uint64), ct.c_int]
+lib.bpf_attach_uprobe_multi.restype = ct.c_int
+lib.bpf_attach_uprobe_multi.argtypes = [ct.c_int, ct.c_int, ct.c_char_p,
+        ct.POINTER(ct.c_uint64), ct.c_int, ct.c_int]
 lib.bpf_attach_tracepoint.restype = ct.c_int
 lib.bpf_attach_tracepoint.argtypes = [ct.c_int, ct.c_char_p, ct.c_char_p]
 lib.bpf_detach_tracepoint.restype = ct.c_int
@@ -131,8 +237,136 @@ lib.bpf_has_kernel_btf.restype = ct.c_bool
 lib.bpf_has_kernel_btf.argtypes = None
 lib.kernel_struct_has_field.restype = ct.c_int
 lib.kernel_struct_has_field.argtypes = [ct.c_char_p, ct.c_char_p]
+lib.bcc_feature_probe.restype = ct.c_int
+lib.bcc_feature_probe.argtypes = [ct.c_char_p, ct.c_char_p]
 lib.bpf_open_perf_buffer.restype = ct.c_void_p
 lib.bpf_open_perf_buffer.argtypes = [_RAW_CB_TYPE, _LOST_CB_TYPE, ct.py_object, ct.c_int, ct.c_int, ct.c_int]
+
+class bcc_perf_buffer_opts(ct.Structure):
+    _fields_ = [
+            ('pid', ct.c_int),
+            ('cpu', ct.c_int),
+            ('wakeup_events', ct.c_int),
+            ('wakeup_watermark', ct.c_int),
+            ('overwrite', ct.c_int),
+        ]
+
+lib.bpf_open_perf_buffer_opts.restype = ct.c_void_p
+lib.bpf_open_perf_buffer_opts.argtypes = [_RAW_CB_TYPE, _LOST_CB_TYPE, ct.py_object, ct.c_int, ct.POINTER(bcc_perf_buffer_opts)]
+
+# keep in sync with event_queue.h
+BCC_EVENT_SAMPLE = 0
+BCC_EVENT_LOST = 1
+
+class bcc_event(ct.Structure):
+    _fields_ = [
+            ('offset', ct.c_uint32),
+            ('size', ct.c_uint32),
+            ('tag', ct.c_uint16),
+            ('type', ct.c_uint16),
+            ('cpu', ct.c_int32),
+        ]
+
+lib.bcc_event_queue_new.restype = ct.c_void_p
+lib.bcc_event_queue_new.argtypes = [ct.c_size_t]
+lib.bcc_event_queue_free.restype = None
+lib.bcc_event_queue_free.argtypes = [ct.c_void_p]
+lib.bcc_event_queue_open_perf_buffer.restype = ct.c_void_p
+lib.bcc_event_queue_open_perf_buffer.argtypes = [ct.c_void_p, ct.c_uint16,
+        ct.c_int, ct.POINTER(bcc_perf_buffer_opts)]
+lib.bcc_event_queue_add_ringbuf.restype = ct.c_int
+lib.bcc_event_queue_add_ringbuf.argtypes = [ct.c_void_p, ct.c_uint16, ct.c_int]
+lib.bcc_event_queue_read.restype = ct.c_int
+lib.bcc_event_queue_read.argtypes = [ct.c_void_p, ct.c_void_p, ct.c_size_t,
+        ct.POINTER(bcc_event), ct.c_int, ct.c_int]
+lib.bcc_event_queue_dropped.restype = ct.c_ulonglong
+lib.bcc_event_queue_dropped.argtypes = [ct.c_void_p]
+
+# keep in sync with trace_pipe.h
+class bcc_trace_record(ct.Structure):
+    _fields_ = [
+            ('task', ct.c_uint32),
+            ('flags', ct.c_uint32),
+            ('msg', ct.c_uint32),
+            ('msg_len', ct.c_uint32),
+            ('pid', ct.c_int32),
+            ('cpu', ct.c_int32),
+            ('ts', ct.c_double),
+        ]
+
+lib.bcc_trace_pipe_new.restype = ct.c_void_p
+lib.bcc_trace_pipe_new.argtypes = [ct.c_int, ct.c_size_t]
+lib.bcc_trace_pipe_free.restype = None
+lib.bcc_trace_pipe_free.argtypes = [ct.c_void_p]
+lib.bcc_trace_pipe_read.restype = ct.c_int
+lib.bcc_trace_pipe_read.argtypes = [ct.c_void_p, ct.POINTER(bcc_trace_record),
+        ct.c_int, ct.POINTER(ct.c_void_p)]
+
+_CGROUP_LABEL_CB_TYPE = ct.CFUNCTYPE(ct.c_int, ct.c_char_p, ct.c_void_p,
+        ct.c_size_t, ct.c_void_p)
+lib.bcc_cgroup_cache_new.restype = ct.c_void_p
+lib.bcc_cgroup_cache_new.argtypes = [ct.c_char_p, _CGROUP_LABEL_CB_TYPE,
+        ct.c_void_p]
+lib.bcc_cgroup_cache_free.restype = None
+lib.bcc_cgroup_cache_free.argtypes = [ct.c_void_p]
+lib.bcc_cgroup_cache_fd.restype = ct.c_int
+lib.bcc_cgroup_cache_fd.argtypes = [ct.c_void_p]
+lib.bcc_cgroup_cache_poll.restype = ct.c_int
+lib.bcc_cgroup_cache_poll.argtypes = [ct.c_void_p]
+lib.bcc_cgroup_cache_lookup.restype = ct.c_int
+lib.bcc_cgroup_cache_lookup.argtypes = [ct.c_void_p, ct.c_ulonglong,
+        ct.c_char_p, ct.c_size_t, ct.c_char_p, ct.c_size_t]
+lib.bcc_cgroup_cache_size.restype = ct.c_size_t
+lib.bcc_cgroup_cache_size.argtypes = [ct.c_void_p]
+
+class bcc_table_change(ct.Structure):
+    _fields_ = [
+            ('kind', ct.c_int),
+            ('key', ct.c_void_p),
+            ('value', ct.c_void_p),
+            ('delta', ct.c_void_p),
+        ]
+
+lib.bcc_table_snapshot_new.restype = ct.c_void_p
+lib.bcc_table_snapshot_new.argtypes = [ct.c_void_p, ct.c_ulonglong]
+lib.bcc_table_snapshot_free.restype = None
+lib.bcc_table_snapshot_free.argtypes = [ct.c_void_p]
+lib.bcc_table_snapshot_update.restype = ct.c_int
+lib.bcc_table_snapshot_update.argtypes = [ct.c_void_p,
+        ct.POINTER(ct.POINTER(bcc_table_change))]
+
+class bcc_table_top_field(ct.Structure):
+    _fields_ = [
+            ('offset', ct.c_size_t),
+            ('size', ct.c_size_t),
+        ]
+
+lib.bcc_table_top_new.restype = ct.c_void_p
+lib.bcc_table_top_new.argtypes = [ct.c_void_p, ct.c_ulonglong,
+        ct.POINTER(bcc_table_top_field), ct.c_int, ct.c_size_t]
+lib.bcc_table_top_free.restype = None
+lib.bcc_table_top_free.argtypes = [ct.c_void_p]
+lib.bcc_table_top_update.restype = ct.c_int
+lib.bcc_table_top_update.argtypes = [ct.c_void_p, ct.c_int,
+        ct.POINTER(ct.c_void_p), ct.POINTER(ct.c_void_p),
+        ct.POINTER(ct.c_size_t)]
+
+# keep in sync with bcc_common.h
+BCC_HIST_LOG2 = 0
+BCC_HIST_LINEAR = 1
+
+lib.bcc_hist_delta_new.restype = ct.c_void_p
+lib.bcc_hist_delta_new.argtypes = [ct.c_void_p, ct.c_ulonglong]
+lib.bcc_hist_delta_free.restype = None
+lib.bcc_hist_delta_free.argtypes = [ct.c_void_p]
+lib.bcc_hist_delta_update.restype = ct.c_int
+lib.bcc_hist_delta_update.argtypes = [ct.c_void_p, ct.c_int,
+        ct.POINTER(ct.POINTER(ct.c_uint64))]
+lib.bcc_hist_percentiles.restype = None
+lib.bcc_hist_percentiles.argtypes = [ct.POINTER(ct.c_uint64), ct.c_size_t,
+        ct.c_int, ct.POINTER(ct.c_double), ct.POINTER(ct.c_double),
+        ct.c_size_t, ct.POINTER(ct.c_double)]
+
 lib.bpf_open_perf_event.restype = ct.c_int
 lib.bpf_open_perf_event.argtypes = [ct.c_uint, ct.c_ulonglong, ct.c_int, ct.c_int]
 lib.perf_reader_poll.restype = ct.c_int
@@ -141,6 +375,11 @@ lib.perf_reader_free.restype = None
 lib.perf_reader_free.argtypes = [ct.c_void_p]
 lib.perf_reader_fd.restype = int
 lib.perf_reader_fd.argtypes = [ct.c_void_p]
+lib.perf_reader_set_batch_cb.restype = ct.c_int
+lib.perf_reader_set_batch_cb.argtypes = [ct.c_void_p, _BATCH_CB_TYPE]
+lib.perf_reader_spans_pack.restype = ct.c_int
+lib.perf_reader_spans_pack.argtypes = [ct.POINTER(perf_reader_span), ct.c_int,
+        ct.c_void_p, ct.POINTER(ct.c_int)]
 
 lib.bpf_attach_xdp.restype = ct.c_int
 lib.bpf_attach_xdp.argtypes = [ct.c_char_p, ct.c_int, ct.c_uint]
@@ -149,6 +388,15 @@ lib.bpf_attach_perf_event.restype = ct.c_int
 lib.bpf_attach_perf_event.argtype = [ct.c_int, ct.c_uint, ct.c_uint, ct.c_ulonglong, ct.c_ulonglong,
         ct.c_int, ct.c_int, ct.c_int]
 
+lib.bpf_attach_perf_event_branch.restype = ct.c_int
+lib.bpf_attach_perf_event_branch.argtypes = [ct.c_int, ct.c_uint, ct.c_uint,
+        ct.c_ulonglong, ct.c_ulonglong, ct.c_ulonglong, ct.c_int, ct.c_int,
+        ct.c_int]
+
+lib.bpf_attach_perf_event_cgroup.restype = ct.c_int
+lib.bpf_attach_perf_event_cgroup.argtypes = [ct.c_int, ct.c_uint, ct.c_uint,
+        ct.c_ulonglong, ct.c_ulonglong, ct.c_int, ct.c_int]
+
 lib.bpf_attach_perf_event_raw.restype = ct.c_int
 lib.bpf_attach_perf_event_raw.argtype = [Perf.perf_event_attr(), ct.c_uint, ct.c_uint, ct.c_uint, ct.c_uint]
 
@@ -211,6 +459,13 @@ lib.bcc_resolve_symname.argtypes = [
 _SYM_CB_TYPE = ct.CFUNCTYPE(ct.c_int, ct.c_char_p, ct.c_ulonglong)
 lib.bcc_foreach_function_symbol.restype = ct.c_int
 lib.bcc_foreach_function_symbol.argtypes = [ct.c_char_p, _SYM_CB_TYPE]
+lib.bcc_foreach_function_symbol_match.restype = ct.c_int
+lib.bcc_foreach_function_symbol_match.argtypes = [ct.c_char_p, ct.c_char_p,
+    ct.c_char_p, _SYM_CB_TYPE]
+_KPROBE_FN_CB_TYPE = ct.CFUNCTYPE(None, ct.c_char_p, ct.c_void_p)
+lib.bcc_foreach_kprobe_function.restype = ct.c_int
+lib.bcc_foreach_kprobe_function.argtypes = [ct.c_char_p, _KPROBE_FN_CB_TYPE,
+        ct.c_void_p]
 
 lib.bcc_symcache_new.restype = ct.c_void_p
 lib.bcc_symcache_new.argtypes = [ct.c_int, ct.POINTER(bcc_symbol_option)]
@@ -227,6 +482,12 @@ lib.bcc_free_buildsymcache.argtypes = [ct.c_void_p]
 lib.bcc_buildsymcache_add_module.restype = ct.c_int
 lib.bcc_buildsymcache_add_module.argtypes = [ct.c_void_p, ct.c_char_p]
 
+lib.bcc_buildsymcache_add_store.restype = ct.c_int
+lib.bcc_buildsymcache_add_store.argtypes = [ct.c_void_p, ct.c_char_p]
+
+lib.bcc_elf_get_buildid.restype = ct.c_int
+lib.bcc_elf_get_buildid.argtypes = [ct.c_char_p, ct.c_char_p]
+
 lib.bcc_buildsymcache_resolve.restype = ct.c_int
 lib.bcc_buildsymcache_resolve.argtypes = [ct.c_void_p, ct.POINTER(bcc_stacktrace_build_id), ct.POINTER(bcc_symbol)]
 
@@ -239,6 +500,14 @@ lib.bcc_symcache_resolve.argtypes = [ct.c_void_p, ct.c_ulonglong, ct.POINTER(bcc
 lib.bcc_symcache_resolve_no_demangle.restype = ct.c_int
 lib.bcc_symcache_resolve_no_demangle.argtypes = [ct.c_void_p, ct.c_ulonglong, ct.POINTER(bcc_symbol)]
 
+lib.bcc_symcache_resolve_batch.restype = ct.c_int
+lib.bcc_symcache_resolve_batch.argtypes = [ct.c_void_p,
+    ct.POINTER(ct.c_ulonglong), ct.c_size_t, ct.POINTER(bcc_symbol)]
+
+lib.bcc_symcache_resolve_batch_no_demangle.restype = ct.c_int
+lib.bcc_symcache_resolve_batch_no_demangle.argtypes = [ct.c_void_p,
+    ct.POINTER(ct.c_ulonglong), ct.c_size_t, ct.POINTER(bcc_symbol)]
+
 lib.bcc_symcache_resolve_name.restype = ct.c_int
 lib.bcc_symcache_resolve_name.argtypes = [
     ct.c_void_p, ct.c_char_p, ct.c_char_p, ct.POINTER(ct.c_ulonglong)]
@@ -246,8 +515,21 @@ lib.bcc_symcache_resolve_name.argtypes = [
 lib.bcc_symcache_refresh.restype = None
 lib.bcc_symcache_refresh.argtypes = [ct.c_void_p]
 
+class bcc_user_regs(ct.Structure):
+    _fields_ = [
+            ('ip', ct.c_uint64),
+            ('sp', ct.c_uint64),
+            ('bp', ct.c_uint64),
+        ]
+
+lib.bcc_symcache_unwind.restype = ct.c_int
+lib.bcc_symcache_unwind.argtypes = [ct.c_void_p, ct.POINTER(bcc_user_regs),
+    ct.c_void_p, ct.c_size_t, ct.POINTER(ct.c_uint64), ct.c_size_t]
+
 lib.bcc_free_memory.restype = ct.c_int
 lib.bcc_free_memory.argtypes = None
+lib.bcc_vmlinux_btf_drop_cache.restype = None
+lib.bcc_vmlinux_btf_drop_cache.argtypes = None
 
 lib.bcc_usdt_new_frompid.restype = ct.c_void_p
 lib.bcc_usdt_new_frompid.argtypes = [ct.c_int, ct.c_char_p]
@@ -0,0 +1,182 @@
+# Copyright (c) Facebook, Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""pprof.py writes stack samples in the pprof format of
+https://github.com/google/pprof/blob/main/proto/profile.proto
+
+The profile is written as it goes: the repeated fields of a Profile message
+may come in any order, so every string, function and location goes out the
+first time a sample uses it, followed by the sample itself. Only the indexes
+of the strings and frames seen so far are kept in memory."""
+
+import gzip
+import numbers
+import sys
+import time
+
+# field numbers of profile.proto
+_PROFILE_SAMPLE_TYPE = 1
+_PROFILE_SAMPLE = 2
+_PROFILE_LOCATION = 4
+_PROFILE_FUNCTION = 5
+_PROFILE_STRING_TABLE = 6
+_PROFILE_TIME_NANOS = 9
+_PROFILE_DURATION_NANOS = 10
+_PROFILE_PERIOD_TYPE = 11
+_PROFILE_PERIOD = 12
+_VALUE_TYPE_TYPE = 1
+_VALUE_TYPE_UNIT = 2
+_SAMPLE_LOCATION_ID = 1
+_SAMPLE_VALUE = 2
+_SAMPLE_LABEL = 3
+_LABEL_KEY = 1
+_LABEL_STR = 2
+_LABEL_NUM = 3
+_LOCATION_ID = 1
+_LOCATION_LINE = 4
+_LINE_FUNCTION_ID = 1
+_FUNCTION_ID = 1
+_FUNCTION_NAME = 2
+_FUNCTION_SYSTEM_NAME = 3
+
+_WIRE_VARINT = 0
+_WIRE_BYTES = 2
+
+def _varint(val):
+    # int64 fields encode negative numbers in their 64 bit two's complement
+    val &= 0xffffffffffffffff
+    out = bytearray()
+    while val > 0x7f:
+        out.append((val & 0x7f) | 0x80)
+        val >>= 7
+    out.append(val)
+    return bytes(out)
+
+def _int_field(field, val):
+    return _varint(field << 3 | _WIRE_VARINT) + _varint(val)
+
+def _bytes_field(field, data):
+    return _varint(field << 3 | _WIRE_BYTES) + _varint(len(data)) + data
+
+def _packed_field(field, vals):
+    return _bytes_field(field, b"".join([_varint(v) for v in vals]))
+
+def _to_bytes(s):
+    if isinstance(s, bytes):
+        return s
+    return s.encode("utf-8", "replace")
+
+class PprofWriter(object):
+    """PprofWriter(path, sample_types, period_type=None, period=0,
+                   compress=True)
+
+    Write a profile to path, or to stdout if path is "-". sample_types is a
+    list of (type, unit) pairs, such as [("samples", "count")], naming the
+    values of each sample. The file is gzipped like pprof writes them unless
+    compress is False.
+    """
+    def __init__(self, path, sample_types, period_type=None, period=0,
+                 compress=True):
+        if path == "-":
+            out = getattr(sys.stdout, "buffer", sys.stdout)
+            self._file = gzip.GzipFile(fileobj=out, mode="wb") \
+                if compress else out
+        else:
+            self._file = gzip.open(path, "wb") if compress \
+                else open(path, "wb")
+        self._path = path
+        self._start = time.time()
+        self._strings = {}
+        self._functions = {}
+        self._nr_values = len(sample_types)
+
+        # string_table[0] must be ""
+        self._string(b"")
+        for (stype, unit) in sample_types:
+            self._write(_PROFILE_SAMPLE_TYPE, self._value_type(stype, unit))
+        if period_type:
+            self._write(_PROFILE_PERIOD_TYPE, self._value_type(*period_type))
+            self._file.write(_int_field(_PROFILE_PERIOD, period))
+        self._file.write(_int_field(_PROFILE_TIME_NANOS,
+                                    int(self._start * 1e9)))
+
+    def _write(self, field, data):
+        self._file.write(_bytes_field(field, data))
+
+    def _string(self, s):
+        s = _to_bytes(s)
+        idx = self._strings.get(s)
+        if idx is None:
+            idx = len(self._strings)
+            self._strings[s] = idx
+            self._write(_PROFILE_STRING_TABLE, s)
+        return idx
+
+    def _value_type(self, stype, unit):
+        return _int_field(_VALUE_TYPE_TYPE, self._string(stype)) + \
+            _int_field(_VALUE_TYPE_UNIT, self._string(unit))
+
+    def _location(self, name):
+        """Return the id of the location of the function name, which is
+        also the id of the function, writing both if they are new."""
+        name = self._string(name)
+        fid = self._functions.get(name)
+        if fid is None:
+            fid = len(self._functions) + 1
+            self._functions[name] = fid
+            self._write(_PROFILE_FUNCTION, _int_field(_FUNCTION_ID, fid) +
+                        _int_field(_FUNCTION_NAME, name) +
+                        _int_field(_FUNCTION_SYSTEM_NAME, name))
+            self._write(_PROFILE_LOCATION, _int_field(_LOCATION_ID, fid) +
+                        _bytes_field(_LOCATION_LINE,
+                                     _int_field(_LINE_FUNCTION_ID, fid)))
+        return fid
+
+    def add_sample(self, frames, values, labels=None):
+        """add_sample(frames, values, labels=None)
+
+        Add a sample of the stack frames, given as function names from the
+        leaf to the root, with one value per sample type. labels is an
+        optional dict of string or integer labels, such as {"pid": 123}.
+        """
+        if len(values) != self._nr_values:
+            raise ValueError("expected %d values" % self._nr_values)
+        sample = _packed_field(_SAMPLE_LOCATION_ID,
+                               [self._location(f) for f in frames]) + \
+            _packed_field(_SAMPLE_VALUE, values)
+        for key, val in sorted((labels or {}).items()):
+            label = _int_field(_LABEL_KEY, self._string(key))
+            if isinstance(val, numbers.Integral):
+                label += _int_field(_LABEL_NUM, val)
+            else:
+                label += _int_field(_LABEL_STR, self._string(val))
+            sample += _bytes_field(_SAMPLE_LABEL, label)
+        self._write(_PROFILE_SAMPLE, sample)
+
+    def close(self):
+        if not self._file:
+            return
+        self._file.write(_int_field(_PROFILE_DURATION_NANOS,
+                                    int((time.time() - self._start) * 1e9)))
+        # closing a GzipFile on stdout leaves stdout open
+        if self._path != "-" or isinstance(self._file, gzip.GzipFile):
+            self._file.close()
+        sys.stdout.flush()
+        self._file = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_val, exc_tb):
+        self.close()
@@ -20,12 +20,18 @@ except ImportError:
 from time import strftime
 import ctypes as ct
 from functools import reduce
+from operator import itemgetter
 import os
 import errno
+import mmap
 import re
+import struct
 import sys
 
-from .libbcc import lib, _RAW_CB_TYPE, _LOST_CB_TYPE, _RINGBUF_CB_TYPE
+from .libbcc import lib, _RAW_CB_TYPE, _LOST_CB_TYPE, _RINGBUF_CB_TYPE, \
+    _BATCH_CB_TYPE, PERF_READER_BATCH_MAX, bcc_perf_buffer_opts, \
+    bcc_table_change, bcc_table_top_field, bcc_event, BCC_EVENT_LOST, \
+    BCC_HIST_LOG2, BCC_HIST_LINEAR
 from .utils import get_online_cpus
 from .utils import get_possible_cpus
 
@@ -56,6 +62,10 @@ BPF_MAP_TYPE_SK_STORAGE = 24
 BPF_MAP_TYPE_DEVMAP_HASH = 25
 BPF_MAP_TYPE_STRUCT_OPS = 26
 BPF_MAP_TYPE_RINGBUF = 27
+BPF_MAP_TYPE_INODE_STORAGE = 28
+BPF_MAP_TYPE_TASK_STORAGE = 29
+
+BPF_F_MMAPABLE = (1 << 10)
 
 map_type_name = {BPF_MAP_TYPE_HASH: "HASH",
                  BPF_MAP_TYPE_ARRAY: "ARRAY",
@@ -83,11 +93,15 @@ map_type_name = {BPF_MAP_TYPE_HASH: "HASH",
                  BPF_MAP_TYPE_SK_STORAGE: "SK_STORAGE",
                  BPF_MAP_TYPE_DEVMAP_HASH: "DEVMAP_HASH",
                  BPF_MAP_TYPE_STRUCT_OPS: "STRUCT_OPS",
-                 BPF_MAP_TYPE_RINGBUF: "RINGBUF",}
+                 BPF_MAP_TYPE_RINGBUF: "RINGBUF",
+                 BPF_MAP_TYPE_INODE_STORAGE: "INODE_STORAGE",
+                 BPF_MAP_TYPE_TASK_STORAGE: "TASK_STORAGE",}
 
 stars_max = 40
 log2_index_max = 65
 linear_index_max = 1025
+# BPF_HEAVY_HITTERS_DEPTH in helpers.h
+HEAVY_HITTERS_DEPTH = 4
 
 # helper functions, consider moving these to a utils module
 def _stars(val, val_max, width):
@@ -193,6 +207,133 @@ def _print_linear_hist(vals, val_type, strip_leading_zero):
                 print(body % (i, val, stars,
                               _stars(val, val_max, stars)))
 
+def _log_linear_low(slot, sub_bits):
+    if slot < (1 << sub_bits):
+        return slot
+    g, m = slot >> sub_bits, slot & ((1 << sub_bits) - 1)
+    return ((1 << sub_bits) + m) << (g - 1)
+
+def _print_log_linear_hist(vals, val_type, sub_bits):
+    global stars_max
+    val_max = max(vals) if vals else 0
+    if not val_max:
+        return
+
+    idx_max = max(i for i, v in enumerate(vals) if v)
+    if _log_linear_low(idx_max + 1, sub_bits) <= 1 << 32:
+        header = "     %-19s : count     distribution"
+        body = "%10d -> %-10d : %-8d |%-*s|"
+        stars = stars_max
+    else:
+        header = "               %-29s : count     distribution"
+        body = "%20d -> %-20d : %-8d |%-*s|"
+        stars = int(stars_max / 2)
+
+    # only non-empty slots: there are 2^sub_bits per power of two
+    print(header % val_type)
+    for i, val in enumerate(vals):
+        if not val:
+            continue
+        low = _log_linear_low(i, sub_bits)
+        high = _log_linear_low(i + 1, sub_bits) - 1
+        print(body % (low, high, val, stars, _stars(val, val_max, stars)))
+
+def log_linear_bounds(sub_bits, n):
+    """log_linear_bounds(sub_bits, n)
+
+    Return the n + 1 bounds of the first n slots of
+    bpf_log_linear_slot(v, sub_bits), for histogram_percentiles().
+    """
+    return [float(_log_linear_low(i, sub_bits)) for i in range(n + 1)]
+
+def histogram_percentiles(counts, pcts, bounds=None, linear=False):
+    """histogram_percentiles(counts, pcts, bounds=None, linear=False)
+
+    Return the percentiles pcts (0 to 100) of a histogram of slot counts,
+    linearly interpolated within the matching slots. Slots are log2 ones, as
+    produced by bpf_log2l(), linear ones of width 1 if linear is True, or
+    hold values in [bounds[i], bounds[i + 1]) if bounds is given, which then
+    has one more element than counts.
+    """
+    n, nq = len(counts), len(pcts)
+    ct_counts = (ct.c_uint64 * n)(*counts)
+    ct_q = (ct.c_double * nq)(*[p / 100.0 for p in pcts])
+    out = (ct.c_double * nq)()
+    ct_bounds = None
+    if bounds is not None:
+        if len(bounds) != n + 1:
+            raise ValueError("bounds must have one more element than counts")
+        ct_bounds = (ct.c_double * (n + 1))(*bounds)
+    lib.bcc_hist_percentiles(ct_counts, n,
+                             BCC_HIST_LINEAR if linear else BCC_HIST_LOG2,
+                             ct_bounds, ct_q, nq, out)
+    return list(out)
+
+def ctype_dtype(ctype):
+    """Describe a ctypes type as a numpy dtype specification: a format
+    string for scalars, a (format, shape) tuple for arrays, and a dict of
+    names, formats, offsets and itemsize for structures and unions. Bit
+    fields are left out as numpy cannot describe them."""
+    if issubclass(ctype, ct.Array):
+        if ctype._type_ is ct.c_char:
+            return "S%d" % ctype._length_
+        return (ctype_dtype(ctype._type_), (ctype._length_,))
+    if issubclass(ctype, (ct.Structure, ct.Union)):
+        names, formats, offsets = [], [], []
+        for field in ctype._fields_:
+            if len(field) > 2:
+                continue
+            name, ftype = field
+            names.append(name)
+            formats.append(ctype_dtype(ftype))
+            offsets.append(getattr(ctype, name).offset)
+        return {"names": names, "formats": formats, "offsets": offsets,
+                "itemsize": ct.sizeof(ctype)}
+    fmt = ctype._type_
+    if fmt == "c":
+        return "S1"
+    if fmt == "?":
+        return "?"
+    size = ct.sizeof(ctype)
+    if fmt in "bhilq":
+        return "i%d" % size
+    if fmt in "BHILQ":
+        return "u%d" % size
+    if fmt in "fd":
+        return "f%d" % size
+    return "V%d" % size
+
+def ctype_struct(ctype):
+    """Describe a ctypes structure as a struct module format, with padding
+    for the gaps, and the names of the fields it unpacks. Integers unpack
+    to ints, and arrays, nested structures and unions to bytes. Bit fields
+    are left out."""
+    fmt = ["="]
+    names = []
+    pos = 0
+    for field in ctype._fields_:
+        if len(field) > 2:
+            continue
+        name, ftype = field
+        offset = getattr(ctype, name).offset
+        size = ct.sizeof(ftype)
+        if offset < pos:
+            # a member of a union
+            continue
+        if offset > pos:
+            fmt.append("%dx" % (offset - pos))
+        code = getattr(ftype, "_type_", None)
+        if issubclass(ftype, (ct.Array, ct.Structure, ct.Union)) or \
+                not isinstance(code, str) or code not in "bBhHiIlLqQPc?fd":
+            fmt.append("%ds" % size)
+        elif code in "lLP":
+            # as wide as a pointer
+            fmt.append("q" if code == "l" else "Q")
+        else:
+            fmt.append(code)
+        names.append(name)
+        pos = offset + size
+    return "".join(fmt), names
 
 def get_table_type_name(ttype):
     try:
@@ -268,7 +409,11 @@ def Table(bpf, map_id, map_fd, keytype, leaftype, name, **kwargs):
     if ttype == BPF_MAP_TYPE_HASH:
         t = HashTable(bpf, map_id, map_fd, keytype, leaftype)
     elif ttype == BPF_MAP_TYPE_ARRAY:
-        t = Array(bpf, map_id, map_fd, keytype, leaftype)
+        flags = lib.bpf_table_flags_id(bpf.module, map_id)
+        if flags & BPF_F_MMAPABLE:
+            t = MmapArray(bpf, map_id, map_fd, keytype, leaftype)
+        else:
+            t = Array(bpf, map_id, map_fd, keytype, leaftype)
     elif ttype == BPF_MAP_TYPE_PROG_ARRAY:
         t = ProgArray(bpf, map_id, map_fd, keytype, leaftype)
     elif ttype == BPF_MAP_TYPE_PERF_EVENT_ARRAY:
@@ -306,14 +451,103 @@ def Table(bpf, map_id, map_fd, keytype, leaftype, name, **kwargs):
     return t
 
 
+class _BatchUnsupported(Exception):
+    pass
+
+
+class EventQueue(object):
+    """Queue of the records of the perf and ring buffers opened with
+    background=True. A native thread polls the buffers and copies their
+    records, so the interpreter only runs to handle them, in batches, from
+    BPF.perf_buffer_poll() or BPF.ring_buffer_poll(). Other Python threads
+    keep running while these wait for records."""
+
+    MAX_EVENTS = 1024
+
+    def __init__(self, size=16 << 20):
+        self.queue = lib.bcc_event_queue_new(size)
+        if not self.queue:
+            raise Exception("Could not create event queue")
+        self.buf = ct.create_string_buffer(1 << 20)
+        self.events = (bcc_event * self.MAX_EVENTS)()
+        # (callback, lost_cb) of each tag
+        self.handlers = []
+
+    def _add_handler(self, callback, lost_cb):
+        if len(self.handlers) > 0xffff:
+            raise Exception("Too many buffers in event queue")
+        self.handlers.append((callback, lost_cb))
+        return len(self.handlers) - 1
+
+    def open_perf_buffer(self, callback, lost_cb, page_cnt, opts):
+        tag = self._add_handler(callback, lost_cb)
+        reader = lib.bcc_event_queue_open_perf_buffer(self.queue, tag,
+                                                      page_cnt, ct.byref(opts))
+        if not reader:
+            raise Exception("Could not open perf buffer")
+        return reader
+
+    def add_ring_buffer(self, map_fd, callback):
+        tag = self._add_handler(callback, None)
+        if lib.bcc_event_queue_add_ringbuf(self.queue, tag, map_fd) < 0:
+            raise Exception("Could not open ring buffer")
+
+    def poll(self, timeout=-1):
+        """Wait up to timeout ms for records and run their callbacks.
+        Returns the number of records handled."""
+        cnt = lib.bcc_event_queue_read(self.queue, self.buf, len(self.buf),
+                                       self.events, self.MAX_EVENTS, timeout)
+        if cnt == -errno.EMSGSIZE:
+            self.buf = ct.create_string_buffer(self.events[0].size)
+            return self.poll(0)
+        if cnt == -errno.EINTR:
+            return 0
+        if cnt < 0:
+            raise Exception("Could not read event queue: %s" %
+                            os.strerror(-cnt))
+        base = ct.addressof(self.buf)
+        try:
+            for i in range(cnt):
+                ev = self.events[i]
+                callback, lost_cb = self.handlers[ev.tag]
+                if ev.type == BCC_EVENT_LOST:
+                    lost = ct.c_uint64.from_buffer(self.buf, ev.offset).value
+                    if lost_cb:
+                        lost_cb(lost)
+                    else:
+                        print("Possibly lost %d samples" % lost,
+                              file=sys.stderr)
+                else:
+                    callback(ev.cpu, base + ev.offset, ev.size)
+        except IOError as e:
+            if e.errno == errno.EPIPE:
+                exit()
+            raise e
+        return cnt
+
+    def dropped(self):
+        """Number of records dropped because the queue was full"""
+        return lib.bcc_event_queue_dropped(self.queue)
+
+    def free(self):
+        if self.queue:
+            lib.bcc_event_queue_free(self.queue)
+            self.queue = None
+
+
 class TableBase(MutableMapping):
+    # Iterate with BPF_MAP_LOOKUP_BATCH, ITER_CHUNK entries per syscall, when
+    # looking up an entry is a plain bpf_lookup_elem(). Cleared on tables
+    # whose kernel doesn't support batch operations.
+    _batch_iter = False
+    ITER_CHUNK = 1024
 
     def __init__(self, bpf, map_id, map_fd, keytype, leaftype, name=None):
         self.bpf = bpf
         self.map_id = map_id
         self.map_fd = map_fd
-        self.Key = keytype
-        self.Leaf = leaftype
+        self._key = keytype
+        self._leaf = leaftype
         self.ttype = lib.bpf_table_type_id(self.bpf.module, self.map_id)
         self.flags = lib.bpf_table_flags_id(self.bpf.module, self.map_id)
         self._cbs = {}
@@ -321,9 +555,44 @@ class TableBase(MutableMapping):
         self.max_entries = int(lib.bpf_table_max_entries_id(self.bpf.module,
                 self.map_id))
 
+    # Key and Leaf are built by the BPF object on first use: a tool with many
+    # tables only pays for the types of those it reads or writes.
+    @property
+    def Key(self):
+        if self._key is None:
+            self._key = self.bpf._table_type(self.map_id, False)
+        return self._key
+
+    @Key.setter
+    def Key(self, keytype):
+        self._key = keytype
+
+    @property
+    def Leaf(self):
+        if self._leaf is None:
+            self._leaf = self.bpf._table_type(self.map_id, True)
+        return self._leaf
+
+    @Leaf.setter
+    def Leaf(self, leaftype):
+        self._leaf = leaftype
+
     def get_fd(self):
         return self.map_fd
 
+    def snapshot(self):
+        """Return a TableSnapshot of this table. Each call to its update()
+        method returns only the entries that changed since the previous call.
+        """
+        return TableSnapshot(self)
+
+    def top(self, k=0, fields=None):
+        """Return a TopTable of this hash table. Each call to its update()
+        method drains the table and returns its k largest entries by the sum
+        of the given fields of their value.
+        """
+        return TopTable(self, k, fields)
+
     def key_sprintf(self, key):
         buf = ct.create_string_buffer(ct.sizeof(self.Key) * 8)
         res = lib.bpf_table_key_snprintf(self.bpf.module, self.map_id, buf,
@@ -377,21 +646,68 @@ class TableBase(MutableMapping):
     # override the MutableMapping's implementation of these since they
     # don't handle KeyError nicely
     def itervalues(self):
-        for key in self:
-            # a map entry may be deleted in between discovering the key and
-            # fetching the value, suppress such errors
-            try:
-                yield self[key]
-            except KeyError:
-                pass
+        for _, value in self.iteritems():
+            yield value
 
     def iteritems(self):
+        if self._batch_iter:
+            items = self._iter_batch()
+            try:
+                first = next(items)
+            except StopIteration:
+                return
+            except _BatchUnsupported:
+                self._batch_iter = False
+            else:
+                yield first
+                for item in items:
+                    yield item
+                return
         for key in self:
+            # a map entry may be deleted in between discovering the key and
+            # fetching the value, suppress such errors
             try:
                 yield (key, self[key])
             except KeyError:
                 pass
 
+    def _iter_batch(self):
+        """Yield copies of all the entries, fetched in chunks of up to
+        ITER_CHUNK entries per BPF_MAP_LOOKUP_BATCH. Raises _BatchUnsupported
+        before yielding anything if the kernel can't do batch lookups."""
+        n = max(min(self.max_entries, self.ITER_CHUNK), 1)
+        key_size = ct.sizeof(self.Key)
+        leaf_size = ct.sizeof(self.Leaf)
+        keys = (self.Key * n)()
+        values = (self.Leaf * n)()
+        batch = ct.c_uint32(0)
+        cnt = ct.c_uint32(0)
+        started = False
+        while True:
+            cnt.value = n
+            res = lib.bpf_lookup_batch(self.map_fd,
+                                       ct.byref(batch) if started else None,
+                                       ct.byref(batch), ct.byref(keys),
+                                       ct.byref(values), ct.byref(cnt))
+            errcode = ct.get_errno() if res != 0 else 0
+            if errcode == errno.ENOSPC and cnt.value == 0 and n < self.max_entries:
+                # a hash bucket holds more entries than the chunk
+                n = min(n * 2, self.max_entries)
+                keys = (self.Key * n)()
+                values = (self.Leaf * n)()
+                continue
+            if errcode not in (0, errno.ENOENT):
+                if not started:
+                    raise _BatchUnsupported()
+                raise Exception("BPF_MAP_LOOKUP_BATCH has failed: %s" %
+                                os.strerror(errcode))
+            started = True
+            for i in range(cnt.value):
+                yield (self.Key.from_buffer_copy(keys, i * key_size),
+                       self.Leaf.from_buffer_copy(values, i * leaf_size))
+            if errcode == errno.ENOENT:
+                return
+
     def items(self):
         return [item for item in self.iteritems()]
 
@@ -515,7 +831,8 @@ class TableBase(MutableMapping):
     def items_update_batch(self, ct_keys, ct_values):
         """Update all the key-value pairs in the map provided.
         The arrays must be the same length, between 1 and the maximum number
-        of entries.
+        of entries. Maps without batch ops, like LPM tries, are updated one
+        entry at a time.
 
         Args:
             ct_keys (ct.Array): keys array to update
@@ -530,8 +847,23 @@ class TableBase(MutableMapping):
                                    ct.byref(ct_cnt)
                                    )
         if (res != 0):
+            errcode = ct.get_errno()
+            # 524 is the kernel internal ENOTSUPP, returned for map types
+            # without batch ops, like LPM tries: update them entry by entry
+            if errcode in (errno.EOPNOTSUPP, 524):
+                key_size = ct.sizeof(self.Key)
+                leaf_size = ct.sizeof(self.Leaf)
+                for i in range(len(ct_keys)):
+                    res = lib.bpf_update_elem(self.map_fd,
+                                              ct.byref(ct_keys, i * key_size),
+                                              ct.byref(ct_values, i * leaf_size),
+                                              0)
+                    if res < 0:
+                        raise Exception("Could not update table: %s"
+                                        % os.strerror(ct.get_errno()))
+                return
             raise Exception("BPF_MAP_UPDATE_BATCH has failed: %s"
-                            % os.strerror(ct.get_errno()))
+                            % os.strerror(errcode))
 
     def items_lookup_and_delete_batch(self):
         """Look up and delete all the key-value pairs in the map.
@@ -562,6 +894,17 @@ class TableBase(MutableMapping):
         Notes: lookup and delete batch on a keys subset is not supported by
         the kernel.
         """
+        total, _, _, ct_keys, ct_values = self._lookup_batch(delete)
+        for i in range(0, total):
+            yield (ct_keys[i], ct_values[i])
+
+    def _lookup_batch(self, delete):
+        """Run BPF_MAP_LOOKUP(_AND_DELETE)_BATCH over the whole map.
+
+        Returns:
+            tuple: (count, keys_buf, values_buf, keys, values) where the
+            buffers are bytearrays backing the keys and values ct.Array.
+        """
         if delete is True:
             bpf_batch = lib.bpf_lookup_and_delete_batch
             bpf_cmd = "BPF_MAP_LOOKUP_AND_DELETE_BATCH"
@@ -569,9 +912,13 @@ class TableBase(MutableMapping):
             bpf_batch = lib.bpf_lookup_batch
             bpf_cmd = "BPF_MAP_LOOKUP_BATCH"
 
-        # alloc keys and values to the max size
-        ct_buf_size, ct_keys, ct_values = self._alloc_keys_values(alloc_k=True,
-                                                                  alloc_v=True)
+        # alloc keys and values to the max size, in plain byte buffers so
+        # that they can be handed out without copies by items_columnar()
+        ct_buf_size = ct.c_uint32(self.max_entries)
+        keys_buf = bytearray(ct.sizeof(self.Key) * self.max_entries)
+        values_buf = bytearray(ct.sizeof(self.Leaf) * self.max_entries)
+        ct_keys = (self.Key * self.max_entries).from_buffer(keys_buf)
+        ct_values = (self.Leaf * self.max_entries).from_buffer(values_buf)
         ct_out_batch = ct_cnt = ct.c_uint32(0)
         total = 0
         while True:
@@ -600,8 +947,37 @@ class TableBase(MutableMapping):
                 # puts too many elements in one bucket.
                 break
 
-        for i in range(0, total):
-            yield (ct_keys[i], ct_values[i])
+        return (total, keys_buf, values_buf, ct_keys, ct_values)
+
+    def items_columnar(self, delete=False):
+        """Look up (and optionally delete) all the entries of the map in
+        bulk, without creating a Python object per entry.
+
+        Args:
+            delete (bool): also delete the entries when True.
+        Returns:
+            tuple: (count, keys, values) where keys and values are
+            memoryviews over contiguous arrays of count keys and values.
+            They can be wrapped without copies, e.g. with
+            numpy.frombuffer(keys, dtype=table.key_dtype()).
+        Raises:
+            Exception: If bpf syscall return value indicates an error.
+        Notes: requires kernel support for batch operations (v5.6).
+        """
+        total, keys_buf, values_buf, _, _ = self._lookup_batch(delete)
+        keys = memoryview(keys_buf)[:total * ct.sizeof(self.Key)]
+        values = memoryview(values_buf)[:total * ct.sizeof(self.Leaf)]
+        return (total, keys, values)
+
+    def key_dtype(self):
+        """Return a numpy compatible dtype description of the key type,
+        with field names, formats and offsets of the decoded table type."""
+        return ctype_dtype(self.Key)
+
+    def leaf_dtype(self):
+        """Return a numpy compatible dtype description of the leaf type,
+        with field names, formats and offsets of the decoded table type."""
+        return ctype_dtype(self.Leaf)
 
     def zero(self):
         # Even though this is not very efficient, we grab the entire list of
@@ -612,6 +988,11 @@ class TableBase(MutableMapping):
             self[k] = self.Leaf()
 
     def __iter__(self):
+        if self._batch_iter:
+            return (key for key, _ in self.iteritems())
+        return self._iter_keys()
+
+    def _iter_keys(self):
         return TableBase.Iter(self)
 
     def iter(self): return self.__iter__()
@@ -643,7 +1024,8 @@ class TableBase(MutableMapping):
             raise StopIteration()
         return next_key
 
-    def decode_c_struct(self, tmp, buckets, bucket_fn, bucket_sort_fn):
+    def decode_c_struct(self, tmp, buckets, bucket_fn, bucket_sort_fn,
+                        nslots=log2_index_max):
         f1 = self.Key._fields_[0][0]
         f2 = self.Key._fields_[1][0]
         # The above code assumes that self.Key._fields_[1][0] holds the
@@ -657,7 +1039,7 @@ class TableBase(MutableMapping):
             bucket = getattr(k, f1)
             if bucket_fn:
                 bucket = bucket_fn(bucket)
-            vals = tmp[bucket] = tmp.get(bucket, [0] * log2_index_max)
+            vals = tmp[bucket] = tmp.get(bucket, [0] * nslots)
             slot = getattr(k, f2)
             vals[slot] = v.value
         buckets_lst = list(tmp.keys())
@@ -742,6 +1124,39 @@ class TableBase(MutableMapping):
                 vals[k.value] = v.value
             _print_log2_hist(vals, val_type, strip_leading_zero)
 
+    def print_log_linear_hist(self, val_type="value", sub_bits=5,
+            section_header="Bucket ptr", section_print_fn=None,
+            bucket_fn=None, bucket_sort_fn=None):
+        """print_log_linear_hist(val_type="value", sub_bits=5,
+                           section_header="Bucket ptr", section_print_fn=None,
+                           bucket_fn=None, bucket_sort_fn=None)
+
+        Prints a table as a log-linear histogram, whose slots were computed
+        with bpf_log_linear_slot(value, sub_bits): every power of two range
+        is split in 2^sub_bits slots. Only non-empty slots are printed. The
+        other arguments are the same as for print_log2_hist().
+        """
+        nslots = (65 - sub_bits) << sub_bits
+        if isinstance(self.Key(), ct.Structure):
+            tmp = {}
+            buckets = []
+            self.decode_c_struct(tmp, buckets, bucket_fn, bucket_sort_fn,
+                                 nslots)
+            for bucket in buckets:
+                vals = tmp[bucket]
+                if section_print_fn:
+                    print("\n%s = %s" % (section_header,
+                        section_print_fn(bucket)))
+                else:
+                    print("\n%s = %r" % (section_header, bucket))
+                _print_log_linear_hist(vals, val_type, sub_bits)
+        else:
+            vals = [0] * nslots
+            for k, v in self.items():
+                if k.value < nslots:
+                    vals[k.value] = v.value
+            _print_log_linear_hist(vals, val_type, sub_bits)
+
     def print_linear_hist(self, val_type="value", section_header="Bucket ptr",
             section_print_fn=None, bucket_fn=None, strip_leading_zero=None,
             bucket_sort_fn=None):
@@ -790,7 +1205,131 @@ class TableBase(MutableMapping):
             _print_linear_hist(vals, val_type, strip_leading_zero)
 
 
+class TableSnapshot(object):
+    """Previous contents of a hash or array table, kept in libbcc so that
+    only the entries which changed between two reads reach Python."""
+    ADDED = 1
+    CHANGED = 2
+    REMOVED = 3
+
+    def __init__(self, table):
+        self.table = table
+        self._snap = lib.bcc_table_snapshot_new(table.bpf.module, table.map_id)
+        if not self._snap:
+            raise Exception("Could not create a snapshot of table")
+
+    def __del__(self):
+        if getattr(self, "_snap", None):
+            lib.bcc_table_snapshot_free(self._snap)
+            self._snap = None
+
+    @staticmethod
+    def _copy(ptr, ctype):
+        return ctype.from_buffer_copy(ct.string_at(ptr, ct.sizeof(ctype)))
+
+    def update(self):
+        """Read the table and return a list of (kind, key, value, delta)
+        tuples for every entry added, changed or removed since the previous
+        call. The value of a removed entry is its last known value. The
+        delta is the value minus the previous value, computed counter by
+        counter. It is the value itself for added entries and None for
+        removed ones. The first call reports every entry as added."""
+        changes = ct.POINTER(bcc_table_change)()
+        n = lib.bcc_table_snapshot_update(self._snap, ct.byref(changes))
+        if n < 0:
+            raise Exception("Could not update snapshot of table")
+
+        Key, Leaf = self.table.Key, self.table.Leaf
+        res = []
+        for i in range(n):
+            c = changes[i]
+            delta = self._copy(c.delta, Leaf) if c.delta else None
+            res.append((c.kind, self._copy(c.key, Key),
+                        self._copy(c.value, Leaf), delta))
+        return res
+
+class TopTable(object):
+    """Reads a hash table, by default removing the entries read, and selects
+    in libbcc the k entries with the largest sum of some integer fields of
+    their value, so that only those reach Python. fields names members of
+    the Leaf struct, or is ["value"] for an integer Leaf. Without fields the
+    entries come in table order. k of 0 keeps all of them."""
+
+    def __init__(self, table, k=0, fields=None):
+        self.table = table
+        self.total = 0
+        fields = fields or []
+        top_fields = (bcc_table_top_field * max(len(fields), 1))()
+        for i, name in enumerate(fields):
+            if issubclass(table.Leaf, ct.Structure):
+                member = getattr(table.Leaf, name)
+                top_fields[i].offset = member.offset
+                top_fields[i].size = member.size
+            elif name == "value":
+                top_fields[i].size = ct.sizeof(table.Leaf)
+            else:
+                raise ValueError("Leaf of table has no field %s" % name)
+        self._top = lib.bcc_table_top_new(table.bpf.module, table.map_id,
+                                          top_fields, len(fields), k)
+        if not self._top:
+            raise Exception("Could not select the top entries of table")
+
+    def __del__(self):
+        if getattr(self, "_top", None):
+            lib.bcc_table_top_free(self._top)
+            self._top = None
+
+    def update(self, drain=True):
+        """Read the table, and drain it unless drain is False. Returns a
+        list of (key, value) of the top entries, largest first. The number
+        of entries read is left in self.total."""
+        keys, values = ct.c_void_p(), ct.c_void_p()
+        total = ct.c_size_t()
+        n = lib.bcc_table_top_update(self._top, drain, ct.byref(keys),
+                                     ct.byref(values), ct.byref(total))
+        if n < 0:
+            raise Exception("Could not read top entries of table")
+        self.total = total.value
+        if n == 0:
+            return []
+
+        Key, Leaf = self.table.Key, self.table.Leaf
+        key_size, leaf_size = ct.sizeof(Key), ct.sizeof(Leaf)
+        keys = ct.string_at(keys, key_size * n)
+        values = ct.string_at(values, leaf_size * n)
+        return [(Key.from_buffer_copy(keys, i * key_size),
+                 Leaf.from_buffer_copy(values, i * leaf_size))
+                for i in range(n)]
+
+class HistogramDelta(object):
+    """Counts added to an array or percpu array table of u64 histogram slots
+    between two reads, summed over the CPUs in libbcc. The table is never
+    cleared, so no event is lost between two reads."""
+
+    def __init__(self, table):
+        self.table = table
+        self._hist = lib.bcc_hist_delta_new(table.bpf.module, table.map_id)
+        if not self._hist:
+            raise Exception("Could not read table as a histogram")
+
+    def __del__(self):
+        if getattr(self, "_hist", None):
+            lib.bcc_hist_delta_free(self._hist)
+            self._hist = None
+
+    def update(self, advance=True):
+        """Read the table and return the list of the counts of every slot
+        added since the last call with advance set. Calls without advance
+        accumulate from the same previous read."""
+        counts = ct.POINTER(ct.c_uint64)()
+        n = lib.bcc_hist_delta_update(self._hist, advance, ct.byref(counts))
+        if n < 0:
+            raise Exception("Could not read histogram table")
+        return counts[:n]
+
 class HashTable(TableBase):
+    _batch_iter = True
+
     def __init__(self, *args, **kwargs):
         super(HashTable, self).__init__(*args, **kwargs)
 
@@ -840,6 +1379,10 @@ class ArrayBase(TableBase):
         if res < 0:
             raise Exception("Could not clear item")
 
+    def histogram_delta(self):
+        """Return a HistogramDelta reading this table of u64 slots."""
+        return HistogramDelta(self)
+
     def __iter__(self):
         return ArrayBase.Iter(self, self.Key)
 
@@ -867,6 +1410,39 @@ class Array(ArrayBase):
         # Delete in Array type does not have an effect, so zero out instead
         self.clearitem(key)
 
+class MmapArray(Array):
+    """Array created with BPF_F_MMAPABLE, accessed through a shared memory
+    mapping instead of one syscall per element."""
+
+    def __init__(self, *args, **kwargs):
+        super(MmapArray, self).__init__(*args, **kwargs)
+        # the kernel lays out array elements with an 8 byte stride
+        self._stride = (ct.sizeof(self.Leaf) + 7) & ~7
+        size = self._stride * self.max_entries
+        size = (size + mmap.PAGESIZE - 1) & ~(mmap.PAGESIZE - 1)
+        self._mm = mmap.mmap(self.map_fd, size, mmap.MAP_SHARED,
+                             mmap.PROT_READ | mmap.PROT_WRITE)
+
+    def __getitem__(self, key):
+        key = self._normalize_key(key)
+        return self.Leaf.from_buffer_copy(self._mm, key.value * self._stride)
+
+    def __setitem__(self, key, leaf):
+        key = self._normalize_key(key)
+        off = key.value * self._stride
+        self._mm[off:off + ct.sizeof(self.Leaf)] = bytes(bytearray(leaf))
+
+    def clearitem(self, key):
+        self[key] = self.Leaf()
+
+    def view(self):
+        """Return a ctypes array aliasing the table memory, so reads and
+        writes go straight to the map. Requires the leaf size to be a
+        multiple of 8 bytes."""
+        if self._stride != ct.sizeof(self.Leaf):
+            raise Exception("leaf must be aligned to 8 bytes")
+        return (self.Leaf * self.max_entries).from_buffer(self._mm)
+
 class ProgArray(ArrayBase):
     def __init__(self, *args, **kwargs):
         super(ProgArray, self).__init__(*args, **kwargs)
@@ -917,6 +1493,8 @@ class PerfEventArray(ArrayBase):
     def __init__(self, *args, **kwargs):
         super(PerfEventArray, self).__init__(*args, **kwargs)
         self._open_key_fds = {}
+        # pages of the perf buffer open on each cpu
+        self._buffer_pages = {}
         self._event_class = None
 
     def __del__(self):
@@ -929,13 +1507,14 @@ class PerfEventArray(ArrayBase):
             return
         # Delete entry from the array
         super(PerfEventArray, self).__delitem__(key)
+        self._buffer_pages.pop(key, None)
         key_id = (id(self), key)
         if key_id in self.bpf.perf_buffers:
             # The key is opened for perf ring buffer
             lib.perf_reader_free(self.bpf.perf_buffers[key_id])
             del self.bpf.perf_buffers[key_id]
             del self._cbs[key]
-        else:
+        elif self._open_key_fds[key] >= 0:
             # The key is opened for perf event read
             lib.bpf_close_perf_event_fd(self._open_key_fds[key])
         del self._open_key_fds[key]
@@ -952,23 +1531,127 @@ class PerfEventArray(ArrayBase):
             self._event_class = _get_event_class(self)
         return ct.cast(data, ct.POINTER(self._event_class)).contents
 
-    def open_perf_buffer(self, callback, page_cnt=8, lost_cb=None):
+    def event_dtype(self):
+        """Return a numpy compatible dtype description of the event struct
+        deduced from the BPF program, see event()."""
+        if self._event_class == None:
+            self._event_class = _get_event_class(self)
+        return ctype_dtype(self._event_class)
+
+    def event_struct(self):
+        """event_struct()
+
+        Return a struct.Struct unpacking the event struct deduced from the
+        BPF program (see event()) into a tuple, and the names of the fields
+        of the tuple. Unlike event(), this needs no ctypes object per event:
+        a batch callback (see open_perf_buffer) unpacks event i with
+        unpack_from(data, offsets[i]). Arrays, such as strings, unpack to
+        the bytes of the whole array.
+        """
+        if self._event_class == None:
+            self._event_class = _get_event_class(self)
+        fmt, names = ctype_struct(self._event_class)
+        return struct.Struct(fmt), names
+
+    def event_unpacker(self, fields):
+        """event_unpacker(fields)
+
+        Return a function unpack(data, offset) returning the tuple of the
+        given fields of the event at offset in data, in the order of fields.
+        See event_struct().
+        """
+        st, names = self.event_struct()
+        unpack_from = st.unpack_from
+        if len(fields) == 1:
+            i = names.index(fields[0])
+            return lambda data, offset: (unpack_from(data, offset)[i],)
+        get = itemgetter(*[names.index(name) for name in fields])
+        return lambda data, offset: get(unpack_from(data, offset))
+
+    def events(self, data, offsets, columns=False):
+        """events(data, offsets, columns=False)
+
+        Decode the events of a batch callback (see open_perf_buffer) into
+        a numpy structured array with the fields of event_dtype(), in a
+        single copy. With columns=True, return a dict mapping each field
+        name to an array instead. Events longer than the struct, as perf
+        pads samples to 8 bytes, are truncated. Requires numpy.
+        """
+        import numpy as np
+
+        dtype = np.dtype(self.event_dtype())
+        offs = np.frombuffer(offsets, dtype=np.intc)
+        sizes = np.diff(offs)
+        count = len(sizes)
+        if count and sizes.min() < dtype.itemsize:
+            raise ValueError("event of %d bytes is shorter than %d bytes" %
+                             (sizes.min(), dtype.itemsize))
+        if count and (sizes == sizes[0]).all():
+            # evenly spaced: view the events in place, copy out the fields
+            spaced = np.dtype({"names": dtype.names,
+                               "formats": [dtype.fields[n][0] for n in dtype.names],
+                               "offsets": [dtype.fields[n][1] for n in dtype.names],
+                               "itemsize": int(sizes[0])})
+            arr = np.frombuffer(data, dtype=spaced, count=count,
+                                offset=int(offs[0])).astype(dtype)
+        else:
+            raw = np.frombuffer(data, dtype=np.uint8)
+            idx = offs[:-1, None] + np.arange(dtype.itemsize)
+            arr = raw[idx].reshape(-1).view(dtype)
+        if columns:
+            return {name: arr[name] for name in dtype.names}
+        return arr
+
+    def open_perf_buffer(self, callback, page_cnt=8, lost_cb=None,
+                         wakeup_events=1, wakeup_watermark=0, batch=False,
+                         background=False):
         """open_perf_buffers(callback)
 
         Opens a set of per-cpu ring buffer to receive custom perf event
         data from the bpf program. The callback will be invoked for each
         event submitted from the kernel, up to millions per second. Use
         page_cnt to change the size of the per-cpu ring buffer. The value
-        must be a power of two and defaults to 8.
+        must be a power of two and defaults to 8. Polling wakes up every
+        wakeup_events events, or once wakeup_watermark bytes are available
+        if that is non-zero.
+
+        With batch=True, the callback is invoked as callback(cpu, data,
+        offsets) for up to 256 events at a time instead. data is a
+        memoryview of the events back to back, event i being
+        data[offsets[i]:offsets[i + 1]]. Both views are only valid during
+        the callback.
+
+        With background=True, a native thread reads the buffers into the
+        event queue of the BPF object (see EventQueue), and the callbacks
+        run from perf_buffer_poll() without holding up other Python
+        threads while it waits. This can't be combined with batch.
         """
 
         if page_cnt & (page_cnt - 1) != 0:
             raise Exception("Perf buffer page_cnt must be a power of two")
+        if batch and background:
+            raise ValueError("batch and background cannot be combined")
 
         for i in get_online_cpus():
-            self._open_perf_buffer(i, callback, page_cnt, lost_cb)
-
-    def _open_perf_buffer(self, cpu, callback, page_cnt, lost_cb):
+            self._open_perf_buffer(i, callback, page_cnt, lost_cb,
+                                   wakeup_events, wakeup_watermark, batch,
+                                   background)
+
+    def _open_perf_buffer(self, cpu, callback, page_cnt, lost_cb,
+                          wakeup_events, wakeup_watermark, batch, background):
+        if background:
+            opts = bcc_perf_buffer_opts()
+            opts.pid = -1
+            opts.cpu = cpu
+            opts.wakeup_events = wakeup_events
+            opts.wakeup_watermark = wakeup_watermark
+            reader = self.bpf._get_event_queue().open_perf_buffer(
+                callback, lost_cb, page_cnt, opts)
+            # the reader and its fd belong to the event queue
+            self[self.Key(cpu)] = self.Leaf(lib.perf_reader_fd(reader))
+            self._open_key_fds[cpu] = -1
+            self._buffer_pages[cpu] = page_cnt
+            return
         def raw_cb_(_, data, size):
             try:
                 callback(cpu, data, size)
@@ -987,16 +1670,47 @@ class PerfEventArray(ArrayBase):
                     raise e
         fn = _RAW_CB_TYPE(raw_cb_)
         lost_fn = _LOST_CB_TYPE(lost_cb_) if lost_cb else ct.cast(None, _LOST_CB_TYPE)
-        reader = lib.bpf_open_perf_buffer(fn, lost_fn, None, -1, cpu, page_cnt)
+        opts = bcc_perf_buffer_opts()
+        opts.pid = -1
+        opts.cpu = cpu
+        opts.wakeup_events = wakeup_events
+        opts.wakeup_watermark = wakeup_watermark
+        reader = lib.bpf_open_perf_buffer_opts(fn, lost_fn, None, page_cnt,
+                                               ct.byref(opts))
         if not reader:
             raise Exception("Could not open perf buffer")
+        batch_fn = None
+        if batch:
+            batch_fn = self._perf_buffer_batch_fn(cpu, callback, page_cnt)
+            if lib.perf_reader_set_batch_cb(reader, batch_fn) < 0:
+                lib.perf_reader_free(reader)
+                raise Exception("Could not set perf buffer batch callback")
         fd = lib.perf_reader_fd(reader)
         self[self.Key(cpu)] = self.Leaf(fd)
         self.bpf.perf_buffers[(id(self), cpu)] = reader
         # keep a refcnt
-        self._cbs[cpu] = (fn, lost_fn)
+        self._cbs[cpu] = (fn, lost_fn, batch_fn)
         # The actual fd is held by the perf reader, add to track opened keys
         self._open_key_fds[cpu] = -1
+        self._buffer_pages[cpu] = page_cnt
+
+    def _perf_buffer_batch_fn(self, cpu, callback, page_cnt):
+        # The samples of a batch come from a single pass over the ring, so
+        # they fit in a buffer of its size.
+        buf = ct.create_string_buffer(page_cnt * mmap.PAGESIZE)
+        offs = (ct.c_int * (PERF_READER_BATCH_MAX + 1))()
+        data_view = memoryview(buf).cast('B')
+        offs_view = memoryview(offs).cast('B').cast('i')
+        def batch_cb_(_, spans, cnt):
+            size = lib.perf_reader_spans_pack(spans, cnt, buf, offs)
+            try:
+                callback(cpu, data_view[:size], offs_view[:cnt + 1])
+            except IOError as e:
+                if e.errno == errno.EPIPE:
+                    exit()
+                else:
+                    raise e
+        return _BATCH_CB_TYPE(batch_cb_)
 
     def _open_perf_event(self, cpu, typ, config):
         fd = lib.bpf_open_perf_event(typ, config, -1, cpu)
@@ -1016,7 +1730,39 @@ class PerfEventArray(ArrayBase):
             self._open_perf_event(i, typ, config)
 
 
+def _percpu_items_sum(table, delete):
+    # the (key, sum over CPUs) pairs of the per-CPU map table
+    if not hasattr(table.sLeaf, "_type_") or \
+            not isinstance(table.sLeaf._type_, str):
+        raise IndexError("Leaf must be an integer type for default sum functions")
+    try:
+        total, keys_buf, values_buf, _, values = table._lookup_batch(delete)
+    except Exception:
+        items = []
+        for k in list(table.keys()):
+            try:
+                items.append((k, table.sum(k)))
+                if delete:
+                    del table[k]
+            except KeyError:
+                pass
+        return items
+
+    ncpu = table.total_cpu
+    try:
+        flat = memoryview(values_buf).cast(table.Leaf._type_._type_)
+        sums = [sum(flat[i * ncpu:(i + 1) * ncpu]) for i in range(total)]
+    except (AttributeError, TypeError):
+        # no memoryview.cast() in Python 2
+        sums = [sum(values[i]) for i in range(total)]
+    key_size = ct.sizeof(table.Key)
+    return [(table.Key.from_buffer(keys_buf, i * key_size),
+             table.sLeaf(sums[i])) for i in range(total)]
+
 class PerCpuHash(HashTable):
+    # values go through the reducer of __getitem__
+    _batch_iter = False
+
     def __init__(self, *args, **kwargs):
         self.reducer = kwargs.pop("reducer", None)
         super(PerCpuHash, self).__init__(*args, **kwargs)
@@ -1068,6 +1814,17 @@ class PerCpuHash(HashTable):
         result = self.sum(key)
         return result.value / self.total_cpu
 
+    def items_sum(self, delete=False):
+        """items_sum(delete=False)
+
+        Return a list of the (key, value) pairs of the map, with the values
+        of all CPUs summed up like sum() does for a single key. The entries
+        are fetched with batch lookups, and also deleted if delete is True,
+        and the values of each entry are summed without a ctypes object per
+        CPU. Falls back to a lookup per key on kernels before 5.6.
+        """
+        return _percpu_items_sum(self, delete)
+
 class LruPerCpuHash(PerCpuHash):
     def __init__(self, *args, **kwargs):
         super(LruPerCpuHash, self).__init__(*args, **kwargs)
@@ -1128,6 +1885,44 @@ class PerCpuArray(ArrayBase):
         result = self.sum(key)
         return result.value / self.total_cpu
 
+    def items_sum(self):
+        """items_sum()
+
+        Return a list of the (key, value) pairs of the array, with the values
+        of all CPUs summed up, read with batch lookups like
+        PerCpuHash.items_sum().
+        """
+        return _percpu_items_sum(self, False)
+
+    def heavy_hitters(self, n=0, clear=False):
+        """heavy_hitters(n=0, clear=False)
+
+        Return the (key, count) pairs of the candidates of a
+        BPF_HEAVY_HITTERS table, largest count first, and only the n first
+        unless n is 0. The sketches of all CPUs are summed and the
+        candidates of every CPU estimated with the sum, so counts are those
+        of all CPUs, never below the real ones. With clear, the table is
+        zeroed once read, for the next interval to be counted on its own.
+        """
+        values = self.getvalue(self.Key(0))
+        if clear:
+            self.clearitem(self.Key(0))
+        width = len(values[0].counts) // HEAVY_HITTERS_DEPTH
+        candidates = {}
+        for v in values:
+            for slot in v.top:
+                if slot.hdr.count:
+                    candidates.setdefault(slot.hdr.hash, slot.key)
+        res = []
+        for h, key in candidates.items():
+            # the counters of each row, as picked by bpf_heavy_hitters_add()
+            idx = [row * width + ((h >> (row * 16)) & (width - 1))
+                   for row in range(HEAVY_HITTERS_DEPTH)]
+            res.append((key, min(sum(v.counts[i] for v in values)
+                                 for i in idx)))
+        res.sort(key=lambda kv: kv[1], reverse=True)
+        return res[:n] if n else res
+
 class LpmTrie(TableBase):
     def __init__(self, *args, **kwargs):
         super(LpmTrie, self).__init__(*args, **kwargs)
@@ -1136,6 +1931,16 @@ class LpmTrie(TableBase):
         raise NotImplementedError
 
 
+def _sym_stacks(bpf, stacks, pid, show_module, show_offset, demangle):
+    names = bpf.sym_batch([addr for stack in stacks for addr in stack],
+                          pid, show_module, show_offset, demangle)
+    res = []
+    pos = 0
+    for stack in stacks:
+        res.append(names[pos:pos + len(stack)])
+        pos += len(stack)
+    return res
+
 class StackTrace(TableBase):
     MAX_DEPTH = 127
     BPF_F_STACK_BUILD_ID = (1<<5)
@@ -1180,6 +1985,68 @@ class StackTrace(TableBase):
     def walk(self, stack_id, resolve=None):
         return StackTrace.StackWalker(self[self.Key(stack_id)], self.flags, resolve)
 
+    def get_all(self, stack_ids, pid=None, show_module=False,
+                show_offset=False, demangle=True):
+        """get_all(stack_ids, pid=None, show_module=False, show_offset=False)
+
+        Return the frames of several stacks as a list of lists, one per
+        stack id, in the order of stack_ids. Each stack is looked up once
+        and trimmed without walking it frame by frame in Python. Invalid or
+        missing stack ids give empty lists. When pid is given, the frames
+        are symbolized as in sym_stacks() instead.
+        """
+        if self.flags & StackTrace.BPF_F_STACK_BUILD_ID:
+            stacks = [list(self.walk(stack_id)) if stack_id >= 0 else []
+                      for stack_id in stack_ids]
+        else:
+            # Stack trace maps have no batch lookup, so look up each
+            # distinct id into the same leaf, copying out its ips at once.
+            key = self.Key()
+            leaf = self.Leaf()
+            found = {}
+            stacks = []
+            for stack_id in stack_ids:
+                stack = found.get(stack_id)
+                if stack is None:
+                    stack = []
+                    key.value = stack_id
+                    if stack_id >= 0 and lib.bpf_lookup_elem(self.map_fd,
+                            ct.byref(key), ct.byref(leaf)) == 0:
+                        stack = leaf.ip[:]
+                        try:
+                            del stack[stack.index(0):]
+                        except ValueError:
+                            pass
+                    found[stack_id] = stack
+                stacks.append(stack)
+        if pid is None:
+            return stacks
+        return self._sym_stacks(stacks, pid, show_module, show_offset,
+                                demangle)
+
+    def sym_stacks(self, stack_ids, pid, show_module=False, show_offset=False,
+                   demangle=True):
+        """sym_stacks(stack_ids, pid, show_module=False, show_offset=False)
+
+        Symbolize the frames of several stacks of one pid, returning a list
+        of lists of strings formatted like BPF.sym(). All frames are resolved
+        in a single batch, so frames shared between the stacks only cost one
+        lookup. A pid of less than zero resolves kernel stacks.
+        """
+        stacks = [list(self.walk(stack_id)) for stack_id in stack_ids]
+        return self._sym_stacks(stacks, pid, show_module, show_offset,
+                                demangle)
+
+    def _sym_stacks(self, stacks, pid, show_module, show_offset, demangle):
+        if self.flags & StackTrace.BPF_F_STACK_BUILD_ID:
+            # build-id frames are resolved through the build-id cache
+            return [[self.bpf.sym(addr, pid, show_module, show_offset,
+                                  demangle) for addr in stack]
+                    for stack in stacks]
+
+        return _sym_stacks(self.bpf, stacks, pid, show_module, show_offset,
+                           demangle)
+
     def __len__(self):
         i = 0
         for k in self: i += 1
@@ -1203,16 +2070,59 @@ class XskMap(ArrayBase):
 class MapInMapArray(ArrayBase):
     def __init__(self, *args, **kwargs):
         super(MapInMapArray, self).__init__(*args, **kwargs)
+        self._idle_fd = -1
+
+    def __del__(self):
+        if self._idle_fd >= 0:
+            os.close(self._idle_fd)
+            self._idle_fd = -1
+
+    def flip_epoch(self, inner):
+        """flip_epoch(inner)
+
+        Swap the buffers of a BPF_EPOCH_BUFFERS declared with the inner map
+        called inner, and return a table of the buffer that was active.
+        No program updates it anymore by the time this returns, so it
+        holds exactly what was counted since the previous flip. Read and
+        clear it before the next flip, which makes it active again and
+        invalidates the table.
+        """
+        fd = lib.bcc_flip_epoch(self.map_fd)
+        if fd < 0:
+            errstr = os.strerror(ct.get_errno())
+            raise Exception("Failed to flip the epoch of %s: %s" %
+                            (lib.bpf_table_name(self.bpf.module, self.map_id),
+                             errstr))
+        if self._idle_fd >= 0:
+            os.close(self._idle_fd)
+        self._idle_fd = fd
+        if not isinstance(inner, bytes):
+            inner = inner.encode()
+        template = self.bpf[inner]
+        return Table(self.bpf, lib.bpf_table_id(self.bpf.module, inner), fd,
+                     template.Key, template.Leaf, inner)
 
 class MapInMapHash(HashTable):
+    _batch_iter = False
+
     def __init__(self, *args, **kwargs):
         super(MapInMapHash, self).__init__(*args, **kwargs)
 
+class _StackRecordHeader(ct.Structure):
+    # struct bpf_stack_record of helpers.h, without its frames
+    _fields_ = [("tag", ct.c_ulonglong),
+                ("pid", ct.c_uint),
+                ("kernel_nr", ct.c_ushort),
+                ("user_nr", ct.c_ushort)]
+
 class RingBuf(TableBase):
     def __init__(self, *args, **kwargs):
         super(RingBuf, self).__init__(*args, **kwargs)
         self._ringbuf = None
         self._event_class = None
+        # stacks of a BPF_STACK_RINGBUF, and the ids given to them
+        self._stacks = []
+        self._stack_ids = {}
 
     def __delitem(self, key):
         pass
@@ -1235,14 +2145,22 @@ class RingBuf(TableBase):
             self._event_class = _get_event_class(self)
         return ct.cast(data, ct.POINTER(self._event_class)).contents
 
-    def open_ring_buffer(self, callback, ctx=None):
+    def open_ring_buffer(self, callback, ctx=None, background=False):
         """open_ring_buffer(callback)
 
         Opens a ring buffer to receive custom event data from the bpf program.
         The callback will be invoked for each event submitted from the kernel,
-        up to millions per second.
+        up to millions per second. With background=True, the ring buffer is
+        read into the event queue of the BPF object, as for perf buffers.
         """
 
+        if background:
+            def queue_cb_(cpu, data, size):
+                callback(ctx, data, size)
+            self.bpf._get_event_queue().add_ring_buffer(self.map_fd,
+                                                        queue_cb_)
+            return
+
         def ringbuf_cb_(ctx, data, size):
             try:
                 ret = callback(ctx, data, size)
@@ -1265,6 +2183,102 @@ class RingBuf(TableBase):
         # keep a refcnt
         self._cbs[0] = fn
 
+    def open_perf_buffer(self, callback, page_cnt=8, lost_cb=None,
+                         wakeup_events=1, wakeup_watermark=0, batch=False,
+                         background=False):
+        """open_perf_buffer(callback)
+
+        For a BPF_PERF_OUTPUT table compiled as a ring buffer with
+        -DBCC_PERF_OUTPUT_RINGBUF. The callback is invoked as for perf
+        buffers, with -1 as the cpu since the ring buffer is shared by all
+        CPUs, and perf_buffer_poll() polls it. The size of the buffer is
+        fixed at compile time, so page_cnt and the wakeup settings are
+        ignored, and nothing is ever reported to lost_cb. batch is not
+        supported.
+        """
+        if batch:
+            raise ValueError("batch is not supported on ring buffers")
+
+        def perf_cb_(ctx, data, size):
+            callback(-1, data, size)
+        self.open_ring_buffer(perf_cb_, background=background)
+
+    def _stack_id(self, ips):
+        if not ips:
+            return -1
+        stack_id = self._stack_ids.get(ips)
+        if stack_id is None:
+            stack_id = len(self._stacks)
+            self._stacks.append(ips)
+            self._stack_ids[ips] = stack_id
+        return stack_id
+
+    def open_stack_buffer(self, callback, background=False):
+        """open_stack_buffer(callback)
+
+        For a BPF_STACK_RINGBUF. Each record is passed to the callback as
+        callback(tag, pid, kernel_stack_id, user_stack_id), after each
+        distinct stack was given an id of this table, as a stack map would,
+        for walk(), get_all() and sym_stacks(). A stack that was not
+        recorded has the id -1. Stacks are kept until clear_stacks().
+        ring_buffer_poll() reads the records.
+        """
+        hdr_size = ct.sizeof(_StackRecordHeader)
+
+        def stack_cb_(ctx, data, size):
+            if size < hdr_size:
+                return 0
+            hdr = ct.cast(data, ct.POINTER(_StackRecordHeader)).contents
+            nr = hdr.kernel_nr + hdr.user_nr
+            if size < hdr_size + nr * 8:
+                return 0
+            ips = tuple((ct.c_ulonglong * nr).from_address(data + hdr_size))
+            callback(hdr.tag, hdr.pid,
+                     self._stack_id(ips[:hdr.kernel_nr]),
+                     self._stack_id(ips[hdr.kernel_nr:]))
+            return 0
+        self.open_ring_buffer(stack_cb_, background=background)
+
+    def walk(self, stack_id, resolve=None):
+        """walk(stack_id, resolve=None)
+
+        Iterate over the frames of a stack of a BPF_STACK_RINGBUF, as
+        StackTrace.walk() does.
+        """
+        stack = self._stacks[stack_id] if stack_id >= 0 else ()
+        return iter([resolve(addr) for addr in stack] if resolve else stack)
+
+    def get_all(self, stack_ids, pid=None, show_module=False,
+                show_offset=False, demangle=True):
+        """get_all(stack_ids, pid=None, show_module=False, show_offset=False)
+
+        As StackTrace.get_all(), for the stacks of a BPF_STACK_RINGBUF.
+        """
+        stacks = [list(self._stacks[i]) if 0 <= i < len(self._stacks)
+                  else [] for i in stack_ids]
+        if pid is None:
+            return stacks
+        return _sym_stacks(self.bpf, stacks, pid, show_module, show_offset,
+                           demangle)
+
+    def sym_stacks(self, stack_ids, pid, show_module=False, show_offset=False,
+                   demangle=True):
+        """sym_stacks(stack_ids, pid, show_module=False, show_offset=False)
+
+        As StackTrace.sym_stacks(), for the stacks of a BPF_STACK_RINGBUF.
+        """
+        return self.get_all(stack_ids, pid, show_module, show_offset,
+                            demangle)
+
+    def clear_stacks(self):
+        """clear_stacks()
+
+        Forget the stacks read so far; their ids are given again to new
+        stacks.
+        """
+        self._stacks = []
+        self._stack_ids = {}
+
 class QueueStack:
     # Flag for map.push
     BPF_EXIST = 2
@@ -12,6 +12,9 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
+from socket import inet_ntop, AF_INET, AF_INET6
+from struct import pack
+
 # from include/net/tcp_states.h:
 tcpstate = {}
 tcpstate[1] = 'ESTABLISHED'
@@ -56,3 +59,61 @@ def flags2str(flags):
     if flags & TCPHDR_CWR:
         arr.append("CWR")
     return "|".join(arr)
+
+class AddrCache(object):
+    """AddrCache(max_entries=65536)
+
+    Formats the IPv4 and IPv6 addresses of events, calling inet_ntop() once
+    per distinct address: during storms the same few peers come up in most
+    events. The cache starts over once it holds max_entries addresses.
+    """
+    def __init__(self, max_entries=65536):
+        self._names = {}
+        self._max_entries = max_entries
+
+    def _add(self, key, name):
+        if len(self._names) >= self._max_entries:
+            self._names.clear()
+        self._names[key] = name
+        return name
+
+    def v4(self, addr):
+        """Format an IPv4 address, given as the int of a u32 field."""
+        name = self._names.get(addr)
+        if name is None:
+            name = self._add(addr, inet_ntop(AF_INET, pack("I", addr)))
+        return name
+
+    def v6(self, addr):
+        """Format an IPv6 address, given as its 16 bytes."""
+        addr = bytes(addr)
+        name = self._names.get(addr)
+        if name is None:
+            name = self._add(addr, inet_ntop(AF_INET6, addr))
+        return name
+
+class KernelStacks(object):
+    """KernelStacks(bpf, stack_traces, show_offset=False)
+
+    Symbolizes the kernel stacks of a BPF_STACK_TRACE table by stack id,
+    each id once. Without BPF_F_REUSE_STACKID an id keeps its stack until
+    it is deleted, so the names stay valid as long as the tool does not
+    delete stacks.
+    """
+    def __init__(self, bpf, stack_traces, show_offset=False):
+        self._bpf = bpf
+        self._table = stack_traces
+        self._show_offset = show_offset
+        self._stacks = {}
+
+    def get(self, stack_id):
+        """Return the names of the frames of a stack, from its leaf, or an
+        empty list for an invalid stack id."""
+        names = self._stacks.get(stack_id)
+        if names is None:
+            addrs = self._table.get_all([stack_id])[0]
+            names = [name.decode("utf-8", "replace") for name in
+                     self._bpf.ksym_batch(addrs,
+                                          show_offset=self._show_offset)]
+            self._stacks[stack_id] = names
+        return names
@@ -0,0 +1,155 @@
+# Copyright (c) Facebook, Inc.
+# Licensed under the Apache License, Version 2.0 (the "License")
+
+import ctypes as ct
+
+# Default of XDP_SAMPLE_SNAPLEN in helpers.h
+XDP_SAMPLE_SNAPLEN = 128
+
+_sample_types = {}
+
+def xdp_sample_type(snaplen=XDP_SAMPLE_SNAPLEN):
+    """xdp_sample_type(snaplen=XDP_SAMPLE_SNAPLEN)
+
+    The ctypes structure of struct xdp_sample from helpers.h, for programs
+    compiled with -DXDP_SAMPLE_SNAPLEN=snaplen.
+    """
+    if snaplen not in _sample_types:
+        class XdpSample(ct.Structure):
+            _fields_ = [("ts", ct.c_ulonglong),
+                        ("ifindex", ct.c_uint),
+                        ("rx_queue", ct.c_uint),
+                        ("pkt_len", ct.c_uint),
+                        ("cap_len", ct.c_uint),
+                        ("data", ct.c_ubyte * snaplen)]
+
+            def packet(self):
+                """The captured bytes of the packet"""
+                return bytes(bytearray(self.data[:self.cap_len]))
+
+        _sample_types[snaplen] = XdpSample
+    return _sample_types[snaplen]
+
+class XdpSampleReader(object):
+    """XdpSampleReader(ringbuf, callback, batch_size=64,
+                       snaplen=XDP_SAMPLE_SNAPLEN)
+
+    Read the samples of bpf_xdp_sample_fill() from the ring buffer table
+    ringbuf and pass them to callback in lists of up to batch_size, rather
+    than one call per sample. Poll with BPF.ring_buffer_poll() or
+    ring_buffer_consume(), then call flush() to deliver a partial batch.
+    The samples are copies, so they may be kept after the callback returns.
+    """
+    def __init__(self, ringbuf, callback, batch_size=64,
+                 snaplen=XDP_SAMPLE_SNAPLEN):
+        self._type = xdp_sample_type(snaplen)
+        self._size = ct.sizeof(self._type)
+        self._callback = callback
+        self._batch_size = batch_size
+        self._batch = []
+        ringbuf.open_ring_buffer(self._on_sample)
+
+    def _on_sample(self, ctx, data, size):
+        if size < self._size:
+            return 0
+        sample = self._type()
+        ct.memmove(ct.byref(sample), data, self._size)
+        self._batch.append(sample)
+        if len(self._batch) >= self._batch_size:
+            self.flush()
+        return 0
+
+    def flush(self):
+        """Pass the samples read so far to the callback"""
+        if self._batch:
+            batch, self._batch = self._batch, []
+            self._callback(batch)
+
+class CpuSteering(object):
+    """CpuSteering(bpf, cpumap, slots, slot_pkts)
+
+    Spread the packets of an XDP program over CPUs by flow and move flows
+    away from the busiest CPUs, like ebpf::BPFCpuSteering in C++. cpumap is
+    the name of the BPF_CPUMAP, slots of the BPF_ARRAY of u32 mapping each
+    bpf_xdp_flow_hash() slot to a CPU, and slot_pkts of the BPF_PERCPU_ARRAY
+    of u64 counting the packets of each slot.
+    """
+    def __init__(self, bpf, cpumap, slots, slot_pkts):
+        self._cpumap = bpf[cpumap]
+        self._slots = bpf[slots]
+        self._slot_pkts = bpf[slot_pkts]
+        if len(self._slots) != len(self._slot_pkts):
+            raise Exception("Tables %s and %s differ in size" %
+                            (slots, slot_pkts))
+        self.cpus = []
+        self.slot_cpus = [0] * len(self._slots)
+        # load read by the last update_load() or rebalance(), before its
+        # moves
+        self.load = {}
+        self._prev = [0] * len(self._slots)
+
+    def set_cpus(self, cpus, qsize):
+        """Create a queue of qsize packets to each of cpus, remove those to
+        other CPUs, and deal the slots out to cpus in turn"""
+        if not cpus:
+            raise Exception("No CPU to steer packets to")
+        for cpu in cpus:
+            self._cpumap[ct.c_int(cpu)] = ct.c_uint32(qsize)
+        for i in range(len(self.slot_cpus)):
+            cpu = cpus[i % len(cpus)]
+            self._slots[ct.c_int(i)] = ct.c_uint32(cpu)
+            self.slot_cpus[i] = cpu
+        for cpu in set(self.cpus) - set(cpus):
+            del self._cpumap[ct.c_int(cpu)]
+        self.cpus = sorted(set(cpus))
+
+    def set_qsize(self, cpu, qsize):
+        if cpu not in self.cpus:
+            raise Exception("Packets are not steered to CPU %d" % cpu)
+        self._cpumap[ct.c_int(cpu)] = ct.c_uint32(qsize)
+
+    def _deltas(self):
+        pkts = [0] * len(self._prev)
+        for k, v in self._slot_pkts.items_sum():
+            pkts[k.value] = v.value
+        deltas = [p - q for p, q in zip(pkts, self._prev)]
+        self._prev = pkts
+        self.load = dict((cpu, 0) for cpu in self.cpus)
+        for i, d in enumerate(deltas):
+            self.load[self.slot_cpus[i]] += d
+        return deltas
+
+    def update_load(self):
+        """Packets of each CPU since the last call to update_load() or
+        rebalance(), as a dict"""
+        self._deltas()
+        return dict(self.load)
+
+    def rebalance(self, tolerance=0.1):
+        """Move slots from the CPUs whose load is more than tolerance above
+        the average to the least loaded ones, until none is or no move
+        helps. Returns the number of slots moved."""
+        deltas = self._deltas()
+        if len(self.cpus) < 2:
+            return 0
+        load = dict(self.load)
+        limit = (1.0 + tolerance) * sum(deltas) / len(self.cpus)
+
+        moved = 0
+        for _ in range(len(self.slot_cpus)):
+            hot = max(self.cpus, key=lambda c: load[c])
+            cold = min(self.cpus, key=lambda c: load[c])
+            if load[hot] <= limit:
+                break
+            gap = load[hot] - load[cold]
+            candidates = [i for i, c in enumerate(self.slot_cpus)
+                          if c == hot and 0 < deltas[i] < gap]
+            if not candidates:
+                break
+            best = max(candidates, key=lambda i: deltas[i])
+            self._slots[ct.c_int(best)] = ct.c_uint32(cold)
+            self.slot_cpus[best] = cold
+            load[hot] -= deltas[best]
+            load[cold] += deltas[best]
+            moved += 1
+        return moved
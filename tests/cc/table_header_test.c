@@ -0,0 +1,28 @@
+// Tables of test_table_header.cc, whose C++ header is generated at build time
+struct flow {
+  u32 saddr;
+  u32 daddr;
+  u16 sport;
+  u16 dport;
+  u8 proto;
+};
+
+typedef struct {
+  u64 packets;
+  u64 bytes;
+  char comm[TASK_COMM_LEN];
+} flow_stats_t;
+
+BPF_HASH(flows, struct flow, flow_stats_t, 128);
+BPF_ARRAY(totals, u64, 4);
+
+int on_sys_getuid(void *ctx) {
+  struct flow key = {.sport = 1, .proto = 6};
+  flow_stats_t zero = {}, *stats;
+  stats = flows.lookup_or_try_init(&key, &zero);
+  if (stats) {
+    stats->packets++;
+    bpf_get_current_comm(&stats->comm, sizeof(stats->comm));
+  }
+  return 0;
+}
@@ -144,5 +144,89 @@ TEST_CASE("percpu array table", "[percpu_array_table]") {
     res = t.get_value(i, v2);
     REQUIRE(!res.ok());
   }
+
+  SECTION("reduce values") {
+    std::vector<uint64_t> v(ncpus);
+
+    for (int i = 0; i < 64; i++) {
+      for (size_t j = 0; j < ncpus; j++) {
+        v[j] = i + j;
+      }
+      res = t.update_value(i, v);
+      REQUIRE(res.ok());
+    }
+
+    uint64_t min;
+    auto min_fn = [](uint64_t a, uint64_t b) { return a < b ? a : b; };
+    res = t.get_value_reduced(5, min, min_fn);
+    REQUIRE(res.ok());
+    REQUIRE(min == 5);
+
+    auto sums = t.get_table_offline_reduced(std::plus<uint64_t>());
+    REQUIRE(sums.size() == t.capacity());
+    for (int i = 0; i < 64; i++) {
+      REQUIRE(sums.at(i) == i * ncpus + ncpus * (ncpus - 1) / 2);
+    }
+  }
+}
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,5,0)
+TEST_CASE("mmap array table", "[mmap_array_table]") {
+  const std::string BPF_PROGRAM = R"(
+    BPF_MMAP_ARRAY(mymmap, u64, 128);
+    BPF_ARRAY(myarray, u64, 128);
+  )";
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+
+  ebpf::BPFMmapArrayTable<uint64_t> t =
+    bpf.get_mmap_array_table<uint64_t>("mymmap");
+  REQUIRE(t.is_mapped());
+
+  SECTION("bad table type") {
+    // plain arrays are not mmapable
+    auto f1 = [&](){
+      bpf.get_mmap_array_table<uint64_t>("myarray");
+    };
+
+    REQUIRE_THROWS(f1());
+  }
+
+  SECTION("standard methods") {
+    uint64_t v;
+
+    // writes through the mapping are visible to the syscall interface
+    res = t.update_value(1, 42);
+    REQUIRE(res.ok());
+    ebpf::BPFArrayTable<uint64_t> a = bpf.get_array_table<uint64_t>("mymmap");
+    res = a.get_value(1, v);
+    REQUIRE(res.ok());
+    REQUIRE(v == 42);
+
+    // and the other way round
+    res = a.update_value(2, 69);
+    REQUIRE(res.ok());
+    REQUIRE(t.data()[2] == 69);
+    res = t.get_value(2, v);
+    REQUIRE(res.ok());
+    REQUIRE(v == 69);
+
+    // get non existing element
+    res = t.get_value(1024, v);
+    REQUIRE(!res.ok());
+  }
+
+  SECTION("walk table") {
+    for (int i = 0; i < 128; i++)
+      t.data()[i] = i * 3;
+    auto offline = t.get_table_offline();
+    REQUIRE(offline.size() == 128);
+    for (int i = 0; i < 128; i++)
+      REQUIRE(offline.at(i) == (uint64_t)i * 3);
+  }
 }
 #endif
@@ -72,6 +72,15 @@ TEST_CASE("test bpf table", "[bpf_table]") {
     }
   }
 
+  // visit the table and stop after the first element
+  int visited = 0;
+  res = t.for_each([&](const std::string &, const std::string &) {
+    visited++;
+    return false;
+  });
+  REQUIRE(res.ok());
+  REQUIRE(visited == 1);
+
   res = t.clear_table_non_atomic();
   REQUIRE(res.ok());
   res = t.get_table_offline(elements);
@@ -122,6 +131,154 @@ TEST_CASE("test bpf percpu tables", "[bpf_percpu_table]") {
 }
 #endif
 
+TEST_CASE("test bpf batch init", "[bpf_table]") {
+  const std::string BPF_PROGRAM = R"(
+    BPF_TABLE("hash", int, int, myhash, 128);
+  )";
+
+  std::vector<std::string> programs(4, BPF_PROGRAM);
+  std::vector<std::unique_ptr<ebpf::BPF>> bpfs;
+  ebpf::StatusTuple res = ebpf::BPF::init_batch(programs, bpfs);
+  REQUIRE(res.ok());
+  REQUIRE(bpfs.size() == programs.size());
+
+  // each program of a batch has its own tables
+  int value;
+  for (size_t i = 0; i < bpfs.size(); i++) {
+    auto t = bpfs[i]->get_hash_table<int, int>("myhash");
+    res = t.update_value(1, i);
+    REQUIRE(res.ok());
+  }
+  for (size_t i = 0; i < bpfs.size(); i++) {
+    auto t = bpfs[i]->get_hash_table<int, int>("myhash");
+    res = t.get_value(1, value);
+    REQUIRE(res.ok());
+    REQUIRE(value == (int)i);
+  }
+
+  // a failing program fails the whole batch
+  programs.push_back("int broken(void *ctx) { return undefined_symbol; }");
+  res = ebpf::BPF::init_batch(programs, bpfs, {}, 0, 2);
+  REQUIRE(!res.ok());
+  REQUIRE(bpfs.empty());
+}
+
+TEST_CASE("test bpf load funcs", "[bpf_table]") {
+  const std::string BPF_PROGRAM = R"(
+    int fn0(void *ctx) { return 0; }
+    int fn1(void *ctx) { return 1; }
+    int fn2(void *ctx) { return 2; }
+    int fn3(void *ctx) { return 3; }
+  )";
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+
+  int fd0;
+  res = bpf.load_func("fn0", BPF_PROG_TYPE_KPROBE, fd0);
+  REQUIRE(res.ok());
+
+  std::vector<std::pair<std::string, bpf_prog_type>> funcs;
+  for (auto name : {"fn0", "fn1", "fn2", "fn3", "fn1"})
+    funcs.emplace_back(name, BPF_PROG_TYPE_KPROBE);
+  std::vector<int> fds;
+  res = bpf.load_funcs(funcs, fds, 0, 2);
+  REQUIRE(res.ok());
+  REQUIRE(fds.size() == funcs.size());
+  REQUIRE(fds[0] == fd0);
+  REQUIRE(fds[4] == fds[1]);
+  for (size_t i = 0; i < funcs.size(); i++) {
+    int fd;
+    REQUIRE(fds[i] >= 0);
+    res = bpf.load_func(funcs[i].first, BPF_PROG_TYPE_KPROBE, fd);
+    REQUIRE(res.ok());
+    REQUIRE(fd == fds[i]);
+  }
+
+  funcs.emplace_back("missing", BPF_PROG_TYPE_KPROBE);
+  res = bpf.load_funcs(funcs, fds);
+  REQUIRE(!res.ok());
+}
+
+TEST_CASE("test bpf release compiler state", "[bpf_table]") {
+  const std::string BPF_PROGRAM = R"(
+    BPF_HASH(myhash, int, int, 128);
+    int fn0(void *ctx) {
+      int key = 1, zero = 0;
+      int *val = myhash.lookup_or_try_init(&key, &zero);
+      if (val)
+        (*val)++;
+      return 0;
+    }
+    int fn1(void *ctx) { return 1; }
+  )";
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+
+  int fd;
+  res = bpf.load_func("fn0", BPF_PROG_TYPE_KPROBE, fd);
+  REQUIRE(res.ok());
+  res = bpf.release_compiler_state();
+  REQUIRE(res.ok());
+
+  // loaded functions still attach, new ones can't be loaded
+  std::string getuid_fnname = bpf.get_syscall_fnname("getuid");
+  res = bpf.attach_kprobe(getuid_fnname, "fn0");
+  REQUIRE(res.ok());
+  res = bpf.load_func("fn1", BPF_PROG_TYPE_KPROBE, fd);
+  REQUIRE(!res.ok());
+
+  REQUIRE(getuid() >= 0);
+  res = bpf.detach_kprobe(getuid_fnname);
+  REQUIRE(res.ok());
+
+  auto t = bpf.get_hash_table<int, int>("myhash");
+  int val;
+  res = t.get_value(1, val);
+  REQUIRE(res.ok());
+  REQUIRE(val >= 1);
+  res = t.update_value(2, 42);
+  REQUIRE(res.ok());
+
+  // without the rw engine tables have no text conversions
+  std::string value;
+  res = bpf.get_table("myhash").get_value("0x2", value);
+  REQUIRE(!res.ok());
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 18, 0)
+TEST_CASE("test bpf table btf formatters", "[bpf_table]") {
+  const std::string BPF_PROGRAM = R"(
+    struct leaf_t {
+      u32 a;
+      char name[8];
+      u16 b[2];
+      u8 c:3, d:5;
+    };
+    BPF_TABLE("hash", u64, struct leaf_t, myhash, 128);
+  )";
+
+  // without the rw engine, strings are formatted from the BTF types
+  ebpf::BPF bpf(0, nullptr, false);
+  ebpf::StatusTuple res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+
+  ebpf::BPFTable t = bpf.get_table("myhash");
+  std::string value;
+  res = t.update_value("0x7", "{ 0x1 \"bcc\" [ 0x2 0x3 ] 0x4 0x1f }");
+  REQUIRE(res.ok());
+  res = t.get_value("7", value);
+  REQUIRE(res.ok());
+  REQUIRE(value == "{ 0x1 \"bcc\" [ 0x2 0x3 ] 0x4 0x1f }");
+
+  res = t.update_value("0x8", "{ 0x1 \"bcc\" }");
+  REQUIRE(!res.ok());
+}
+#endif
+
 TEST_CASE("test bpf hash table", "[bpf_hash_table]") {
   const std::string BPF_PROGRAM = R"(
     BPF_HASH(myhash, int, int, 128);
@@ -172,6 +329,156 @@ TEST_CASE("test bpf hash table", "[bpf_hash_table]") {
   REQUIRE(values.size() == 0);
 }
 
+struct hist_key_t {
+  uint32_t disk;
+  uint32_t pad;
+  uint64_t slot;
+};
+
+TEST_CASE("test bpf histogram table", "[bpf_histogram_table]") {
+  const std::string BPF_PROGRAM = R"(
+    typedef struct { u32 disk; u32 pad; u64 slot; } hist_key_t;
+    BPF_HISTOGRAM(dist);
+    BPF_HISTOGRAM(disk_dist, hist_key_t);
+  )";
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+
+  // slots 1, 2 and 3 hold values in [1, 1], [2, 3] and [4, 7]
+  auto slots = bpf.get_array_table<uint64_t>("dist");
+  REQUIRE(slots.update_value(1, 10).ok());
+  REQUIRE(slots.update_value(2, 20).ok());
+  REQUIRE(slots.update_value(3, 10).ok());
+
+  ebpf::BPFHistogram hist;
+  auto t = bpf.get_histogram_table("dist");
+  res = t.get_histogram(hist);
+  REQUIRE(res.ok());
+  REQUIRE(hist.total() == 40);
+  REQUIRE(hist.percentile(0.25) == 2);
+  REQUIRE(hist.percentile(0.5) == 3);
+  REQUIRE(hist.percentile(1) == 8);
+
+  ebpf::BPFHistogram copy;
+  res = ebpf::BPFHistogram::deserialize(hist.serialize(), copy);
+  REQUIRE(res.ok());
+  REQUIRE(copy.counts == hist.counts);
+
+  copy.merge(hist);
+  REQUIRE(copy.total() == 80);
+
+  auto disks = bpf.get_hash_table<hist_key_t, uint64_t>("disk_dist");
+  for (uint32_t disk = 0; disk < 3; disk++) {
+    for (uint64_t slot = 0; slot < 4; slot++) {
+      hist_key_t key = {disk, 0, slot};
+      REQUIRE(disks.update_value(key, disk + 1).ok());
+    }
+  }
+
+  auto d = bpf.get_histogram_table<hist_key_t>("disk_dist");
+  std::vector<std::pair<hist_key_t, ebpf::BPFHistogram>> sections;
+  res = d.get_sections(sections);
+  REQUIRE(res.ok());
+  REQUIRE(sections.size() == 3);
+  for (const auto &it : sections) {
+    REQUIRE(it.first.slot == 0);
+    REQUIRE(it.second.counts.size() == 4);
+    REQUIRE(it.second.total() == 4 * (it.first.disk + 1));
+  }
+  res = d.get_histogram(hist);
+  REQUIRE(res.ok());
+  REQUIRE(hist.total() == 24);
+}
+
+TEST_CASE("test bpf log-linear histogram", "[bpf_histogram_table]") {
+  const std::string BPF_PROGRAM = R"(
+    BPF_HISTOGRAM(dist, int, BPF_LOG_LINEAR_SLOTS(5));
+    int on_sys_getuid(void *ctx) {
+      dist.increment(bpf_log_linear_slot(31, 5));
+      dist.increment(bpf_log_linear_slot(1000, 5));
+      dist.increment(bpf_log_linear_slot(~0ull, 5));
+      return 0;
+    }
+  )";
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+  std::string getuid_fnname = bpf.get_syscall_fnname("getuid");
+  res = bpf.attach_kprobe(getuid_fnname, "on_sys_getuid");
+  REQUIRE(res.ok());
+  REQUIRE(getuid() >= 0);
+  res = bpf.detach_kprobe(getuid_fnname);
+  REQUIRE(res.ok());
+
+  ebpf::BPFHistogram hist;
+  auto t = bpf.get_histogram_table("dist");
+  res = t.get_histogram(hist);
+  REQUIRE(res.ok());
+  // values below 32 have their own slot, then 32 slots per power of two
+  REQUIRE(hist.counts.size() == 1920);
+  REQUIRE(hist.counts[31] > 0);
+  REQUIRE(hist.counts[190] > 0);
+  REQUIRE(hist.counts[1919] > 0);
+
+  auto bounds = ebpf::BPFHistogram::log_linear_bounds(5, hist.counts.size());
+  REQUIRE(bounds.size() == 1921);
+  REQUIRE(bounds[31] == 31);
+  REQUIRE(bounds[32] == 32);
+  REQUIRE(bounds[190] == 992);
+  REQUIRE(bounds[191] == 1008);
+  REQUIRE(bounds[1919] == 0xfc00000000000000ull);
+}
+
+TEST_CASE("test bpf histogram delta", "[bpf_histogram_delta]") {
+  const std::string BPF_PROGRAM = R"(
+    BPF_PERCPU_ARRAY(slots, u64, 4);
+  )";
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+
+  auto t = bpf.get_percpu_array_table<uint64_t>("slots");
+  size_t ncpus = ebpf::BPFTable::get_possible_cpu_count();
+  REQUIRE(t.update_value(1, std::vector<uint64_t>(ncpus, 2)).ok());
+
+  auto delta = bpf.get_histogram_delta("slots");
+  res = delta.update();
+  REQUIRE(res.ok());
+  REQUIRE(delta.delta().counts.size() == 4);
+  REQUIRE(delta.delta().counts[1] == 2 * ncpus);
+
+  // only what was added since the previous read is counted
+  REQUIRE(t.update_value(1, std::vector<uint64_t>(ncpus, 3)).ok());
+  REQUIRE(t.update_value(3, std::vector<uint64_t>(ncpus, 1)).ok());
+  res = delta.update(false);
+  REQUIRE(res.ok());
+  REQUIRE(delta.delta().counts[1] == ncpus);
+  REQUIRE(delta.delta().counts[3] == ncpus);
+  REQUIRE(delta.delta().total() == 2 * ncpus);
+
+  // without advancing, the next delta still starts from the first read
+  res = delta.update();
+  REQUIRE(res.ok());
+  REQUIRE(delta.delta().total() == 2 * ncpus);
+  res = delta.update();
+  REQUIRE(res.ok());
+  REQUIRE(delta.delta().total() == 0);
+
+  // slots of 10, 90 and 900 wide
+  ebpf::BPFHistogram hist;
+  hist.counts = {5, 0, 5};
+  std::vector<double> bounds = {0, 10, 100, 1000};
+  REQUIRE(hist.percentile(0.5, bounds) == 10);
+  REQUIRE(hist.percentile(0.75, bounds) == 550);
+}
+
 TEST_CASE("test bpf stack table", "[bpf_stack_table]") {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0)
   const std::string BPF_PROGRAM = R"(
@@ -219,9 +526,18 @@ TEST_CASE("test bpf stack table", "[bpf_stack_table]") {
     }
   REQUIRE(found);
 
+  // Cached symbols are the same, with or without looking the stack up
+  stack_traces.set_symbol_cache_size(16);
+  REQUIRE(stack_traces.get_stack_symbol(stack_id, -1) == symbols);
+  REQUIRE(stack_traces.get_stack_symbol(stack_id, -1) == symbols);
+  stack_traces.set_symbol_cache_size(16, false);
+  REQUIRE(stack_traces.get_stack_symbol(stack_id, -1) == symbols);
+  REQUIRE(stack_traces.get_stack_symbol(stack_id, -1) == symbols);
+
   stack_traces.clear_table_non_atomic();
   addrs = stack_traces.get_stack_addr(stack_id);
   REQUIRE(addrs.size() == 0);
+  REQUIRE(stack_traces.get_stack_symbol(stack_id, -1).empty());
 #endif
 }
 
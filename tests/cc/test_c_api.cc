@@ -13,6 +13,8 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <algorithm>
+#include <atomic>
 #include <fcntl.h>
 #include <dlfcn.h>
 #include <stdint.h>
@@ -24,12 +26,17 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <thread>
 
 #include "bcc_elf.h"
+#include "bcc_features.h"
 #include "bcc_perf_map.h"
 #include "bcc_proc.h"
 #include "bcc_syms.h"
+#include "cgroup_cache.h"
 #include "common.h"
+#include "libbpf.h"
+#include "trace_pipe.h"
 #include "vendor/tinyformat.hpp"
 
 #include "catch.hpp"
@@ -37,6 +44,7 @@
 using namespace std;
 
 static pid_t spawn_child(void *, bool, bool, int (*)(void *));
+static int perf_map_func_noop(void *);
 
 TEST_CASE("language detection", "[c_api]") {
   const char *c = bcc_procutils_language(getpid());
@@ -78,6 +86,52 @@ TEST_CASE("list all kernel symbols", "[c_api]") {
   bcc_procutils_each_ksym(_test_ksym, NULL);
 }
 
+TEST_CASE("share kernel symbols between caches", "[c_api]") {
+  if (geteuid() != 0)
+    return;
+
+  void *resolver = bcc_symcache_new(-1, nullptr);
+  void *other_resolver = bcc_symcache_new(-1, nullptr);
+  REQUIRE(resolver);
+  REQUIRE(other_resolver);
+
+  uint64_t addr;
+  struct bcc_symbol sym, other_sym;
+  REQUIRE(bcc_symcache_resolve_name(resolver, nullptr, "schedule", &addr) == 0);
+  REQUIRE(bcc_symcache_resolve(resolver, addr, &sym) == 0);
+  REQUIRE(string("schedule") == sym.name);
+  REQUIRE(string("kernel") == sym.module);
+  REQUIRE(sym.offset == 0);
+
+  // both caches point into the same symbol table
+  REQUIRE(bcc_symcache_resolve(other_resolver, addr, &other_sym) == 0);
+  REQUIRE(sym.name == other_sym.name);
+
+  bcc_free_symcache(resolver, -1);
+  bcc_free_symcache(other_resolver, -1);
+}
+
+static void _test_kprobe_fn(const char *fn, void *payload) {
+  static_cast<std::vector<std::string> *>(payload)->emplace_back(fn);
+}
+
+TEST_CASE("list kprobe functions", "[c_api]") {
+  std::vector<std::string> fns, all;
+  REQUIRE(bcc_foreach_kprobe_function("vfs_(read|write)", _test_kprobe_fn,
+                                      &fns) == 0);
+  REQUIRE(std::find(fns.begin(), fns.end(), "vfs_read") != fns.end());
+  for (const auto &fn : fns)
+    REQUIRE(fn.compare(0, 4, "vfs_") == 0);
+  REQUIRE(std::is_sorted(fns.begin(), fns.end()));
+
+  REQUIRE(bcc_foreach_kprobe_function(nullptr, _test_kprobe_fn, &all) == 0);
+  REQUIRE(all.size() > fns.size());
+  REQUIRE(std::adjacent_find(all.begin(), all.end()) == all.end());
+  REQUIRE(std::find(all.begin(), all.end(), "__init_begin") == all.end());
+
+  REQUIRE(bcc_foreach_kprobe_function("(", _test_kprobe_fn, &fns) == -1);
+}
+
 TEST_CASE("file-backed mapping identification") {
   CHECK(bcc_mapping_is_file_backed("/bin/ls") == 1);
   CHECK(bcc_mapping_is_file_backed("") == 0);
@@ -198,6 +252,21 @@ static int mntns_func(void *arg) {
 
 extern int cmd_scanf(const char *cmd, const char *fmt, ...);
 
+struct mapping_search {
+  uint64_t addr;
+  mod_info mod;
+  string name;
+};
+
+static int _find_mapping(mod_info *mod, int enter_ns, void *p) {
+  mapping_search *search = static_cast<mapping_search *>(p);
+  if (search->addr < mod->start_addr || search->addr >= mod->end_addr)
+    return 0;
+  search->mod = *mod;
+  search->name = mod->name;
+  return -1;
+}
+
 TEST_CASE("resolve symbol addresses for a given PID", "[c_api]") {
   struct bcc_symbol sym;
   struct bcc_symbol lazy_sym;
@@ -233,6 +302,69 @@ TEST_CASE("resolve symbol addresses for a given PID", "[c_api]") {
     REQUIRE(string(lazy_sym.module) == sym.module);
   }
 
+  SECTION("resolve source lines in our own binary") {
+    struct bcc_source_frame frames[4];
+    int n = bcc_symcache_resolve_source(resolver, (uint64_t)&_a_test_function,
+                                        frames, 4);
+    // The tests may be built without debug info
+    if (n > 0) {
+      REQUIRE(n == 1);
+      REQUIRE(string("_a_test_function") == frames[0].name);
+      REQUIRE(string(frames[0].file).find("test_c_api.cc") != string::npos);
+      REQUIRE(frames[0].line > 0);
+    }
+  }
+
+  SECTION("prefetch symbol tables") {
+    void *prefetch_resolver = bcc_symcache_new(getpid(), &lazy_opt);
+    REQUIRE(prefetch_resolver);
+    bcc_symcache_prefetch(prefetch_resolver, 2);
+
+    void *libc_fptr = dlsym(NULL, "strtok");
+    REQUIRE(libc_fptr);
+    REQUIRE(bcc_symcache_resolve(prefetch_resolver, (uint64_t)libc_fptr, &sym) == 0);
+    REQUIRE(string("strtok") == sym.name);
+    REQUIRE(bcc_symcache_resolve(prefetch_resolver, (uint64_t)&_a_test_function,
+                                 &sym) == 0);
+    REQUIRE(string("_a_test_function") == sym.name);
+
+    // a refresh starts over, and freeing waits for the workers
+    bcc_symcache_refresh(prefetch_resolver);
+    bcc_free_symcache(prefetch_resolver, getpid());
+  }
+
+  SECTION("resolve from several threads") {
+    void *shared_resolver = bcc_symcache_new(getpid(), &lazy_opt);
+    REQUIRE(shared_resolver);
+    void *libc_fptr = dlsym(NULL, "strtok");
+    REQUIRE(libc_fptr);
+
+    // Catch assertions aren't thread safe, count the failures instead
+    std::atomic<int> failures(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; t++) {
+      threads.emplace_back([&, t]() {
+        struct bcc_symbol s;
+        for (int i = 0; i < 1000; i++) {
+          // one thread keeps reloading the modules under the others
+          if (t == 0 && i % 100 == 0)
+            bcc_symcache_refresh(shared_resolver);
+          if (bcc_symcache_resolve(shared_resolver, (uint64_t)libc_fptr, &s) ||
+              string("strtok") != s.name)
+            failures++;
+          if (bcc_symcache_resolve(shared_resolver,
+                                   (uint64_t)&_a_test_function, &s) ||
+              string("_a_test_function") != s.name)
+            failures++;
+        }
+      });
+    }
+    for (auto &thread : threads)
+      thread.join();
+    REQUIRE(failures == 0);
+    bcc_free_symcache(shared_resolver, getpid());
+  }
+
   SECTION("resolve in " LIBBCC_NAME) {
     void *libbcc = dlopen(LIBBCC_NAME, RTLD_LAZY | RTLD_NOLOAD);
     REQUIRE(libbcc);
@@ -289,6 +421,74 @@ TEST_CASE("resolve symbol addresses for a given PID", "[c_api]") {
     REQUIRE(sym_match);
   }
 
+  SECTION("share symbol tables between caches") {
+    void *libc_fptr = dlsym(NULL, "strtok");
+    REQUIRE(libc_fptr);
+
+    void *other_lazy_resolver = bcc_symcache_new(getpid(), &lazy_opt);
+    REQUIRE(other_lazy_resolver);
+
+    REQUIRE(bcc_symcache_resolve(lazy_resolver, (uint64_t)libc_fptr, &lazy_sym) == 0);
+    REQUIRE(bcc_symcache_resolve(other_lazy_resolver, (uint64_t)libc_fptr, &sym) == 0);
+    // both caches map the same libc with the same options, so the name comes
+    // from the one shared table
+    REQUIRE(sym.name == lazy_sym.name);
+    REQUIRE(string(sym.module) == lazy_sym.module);
+
+    // and outlives the cache that loaded it
+    bcc_free_symcache(lazy_resolver, getpid());
+    lazy_resolver = bcc_symcache_new(getpid(), &lazy_opt);
+    REQUIRE(bcc_symcache_resolve(other_lazy_resolver, (uint64_t)libc_fptr, &sym) == 0);
+    REQUIRE(string(sym.name) == lazy_sym.name);
+
+    bcc_free_symcache(other_lazy_resolver, getpid());
+  }
+
+  SECTION("share symbol tables across mount namespaces") {
+    void *libc_fptr = dlsym(NULL, "strtok");
+    REQUIRE(libc_fptr);
+    REQUIRE(bcc_symcache_resolve(lazy_resolver, (uint64_t)libc_fptr, &lazy_sym) == 0);
+
+    // the child maps our libc, but its modules are opened through
+    // /proc/<child>/root
+    pid_t child = spawn_child(0, false, true, perf_map_func_noop);
+    REQUIRE(child > 0);
+    void *child_resolver = bcc_symcache_new(child, &lazy_opt);
+    REQUIRE(child_resolver);
+    REQUIRE(bcc_symcache_resolve(child_resolver, (uint64_t)libc_fptr, &sym) == 0);
+    REQUIRE(sym.name == lazy_sym.name);
+
+    bcc_free_symcache(child_resolver, child);
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+  }
+
+  SECTION("apply mapping changes") {
+    void *libc_fptr = dlsym(NULL, "strtok");
+    REQUIRE(libc_fptr);
+
+    mapping_search search = {};
+    search.addr = (uint64_t)libc_fptr;
+    bcc_procutils_each_module(getpid(), _find_mapping, &search);
+    REQUIRE(!search.name.empty());
+    search.mod.name = &search.name[0];
+
+    REQUIRE(bcc_symcache_resolve(resolver, search.addr, &sym) == 0);
+    REQUIRE(string("strtok") == sym.name);
+
+    // unmapping part of a range keeps the rest addressable
+    REQUIRE(bcc_symcache_remove_mapping(resolver, search.mod.start_addr,
+                                        search.addr + 1) == 0);
+    REQUIRE(bcc_symcache_resolve(resolver, search.addr, &sym) < 0);
+    if (search.addr + 1 < search.mod.end_addr)
+      REQUIRE(bcc_symcache_resolve(resolver, search.addr + 1, &sym) == 0);
+
+    REQUIRE(bcc_symcache_add_mapping(resolver, &search.mod) == 0);
+    REQUIRE(bcc_symcache_resolve(resolver, search.addr, &sym) == 0);
+    REQUIRE(string("strtok") == sym.name);
+    REQUIRE(sym.offset == 0);
+  }
+
   SECTION("resolve in separate mount namespace") {
     pid_t child;
     uint64_t addr = 0;
@@ -414,6 +614,38 @@ TEST_CASE("resolve symbols using /tmp/perf-pid.map", "[c_api]") {
     REQUIRE(string("right_next_door_fn") == sym.name);
   }
 
+  SECTION("appended perf map entries") {
+    child = spawn_child(map_addr, /* own_pidns */ false, false, perf_map_func);
+    REQUIRE(child > 0);
+
+    void *resolver = bcc_symcache_new(child, nullptr);
+    REQUIRE(resolver);
+
+    REQUIRE(bcc_symcache_resolve(resolver, (unsigned long long)map_addr,
+        &sym) == 0);
+    REQUIRE(string("dummy_fn") == sym.name);
+    REQUIRE(bcc_symcache_resolve(resolver, (unsigned long long)map_addr + 0x20,
+        &sym) < 0);
+
+    FILE *file = fopen(perf_map_path(child).c_str(), "a");
+    REQUIRE(file);
+    // the second entry for map_addr replaces the first one
+    fprintf(file, "%llx 10 appended_fn\n", (unsigned long long)map_addr + 0x20);
+    fprintf(file, "%llx 10 recompiled_fn\n", (unsigned long long)map_addr);
+    fclose(file);
+
+    bcc_symcache_refresh(resolver);
+    REQUIRE(bcc_symcache_resolve(resolver, (unsigned long long)map_addr + 0x20,
+        &sym) == 0);
+    REQUIRE(string("appended_fn") == sym.name);
+    REQUIRE(bcc_symcache_resolve(resolver, (unsigned long long)map_addr,
+        &sym) == 0);
+    REQUIRE(string("recompiled_fn") == sym.name);
+    REQUIRE(bcc_symcache_resolve(resolver, (unsigned long long)map_addr + 0x10,
+        &sym) == 0);
+    REQUIRE(string("right_next_door_fn") == sym.name);
+  }
+
   SECTION("separate namespace") {
     child = spawn_child(map_addr, /* own_pidns */ true, false, perf_map_func);
     REQUIRE(child > 0);
@@ -472,6 +704,100 @@ TEST_CASE("resolve symbols using /tmp/perf-pid.map", "[c_api]") {
   munmap(map_addr, map_sz);
 }
 
+static void jitdump_write(FILE *file, const void *rec, size_t len,
+                          const char *name) {
+  fwrite(rec, len, 1, file);
+  if (name)
+    fwrite(name, strlen(name) + 1, 1, file);
+}
+
+static void jitdump_load(FILE *file, uint64_t addr, uint64_t size,
+                         uint64_t index, const char *name) {
+  // prefix, pid, tid, vma, code_addr, code_size, code_index, then the name
+  // and the code, left out
+  struct {
+    uint32_t id, total_size;
+    uint64_t timestamp;
+    uint32_t pid, tid;
+    uint64_t vma, code_addr, code_size, code_index;
+  } rec = {0, 0, 0, 0, 0, addr, addr, size, index};
+  rec.total_size = sizeof(rec) + strlen(name) + 1;
+  jitdump_write(file, &rec, sizeof(rec), name);
+}
+
+static void jitdump_move(FILE *file, uint64_t from, uint64_t to, uint64_t size,
+                         uint64_t index) {
+  struct {
+    uint32_t id, total_size;
+    uint64_t timestamp;
+    uint32_t pid, tid;
+    uint64_t vma, old_code_addr, new_code_addr, code_size, code_index;
+  } rec = {1, 0, 0, 0, 0, to, from, to, size, index};
+  rec.total_size = sizeof(rec);
+  jitdump_write(file, &rec, sizeof(rec), nullptr);
+}
+
+TEST_CASE("resolve symbols using a jitdump", "[c_api]") {
+  const int code_sz = 4096;
+  void *code = mmap(NULL, code_sz, PROT_READ | PROT_EXEC,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  REQUIRE(code != MAP_FAILED);
+  uint64_t addr = (uint64_t)code;
+
+  string path = tfm::format("/tmp/jit-%d.dump", getpid());
+  REQUIRE(bcc_is_jitdump(path.c_str()));
+  REQUIRE(!bcc_is_jitdump("/tmp/jit-1.dump.old"));
+  FILE *file = fopen(path.c_str(), "w");
+  REQUIRE(file);
+  struct {
+    uint32_t magic, version, total_size, elf_mach, pad1, pid;
+    uint64_t timestamp, flags;
+  } header = {0x4A695444, 1, sizeof(header), 62, 0, (uint32_t)getpid(), 0, 0};
+  jitdump_write(file, &header, sizeof(header), nullptr);
+  jitdump_load(file, addr, 0x10, 1, "jit_fn");
+  jitdump_load(file, addr + 0x10, 0x10, 2, "jit_next_door_fn");
+  fflush(file);
+
+  // JIT runtimes map the dump executable for perf to find it
+  int fd = open(path.c_str(), O_RDONLY);
+  REQUIRE(fd >= 0);
+  void *dump = mmap(NULL, 4096, PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+  close(fd);
+  REQUIRE(dump != MAP_FAILED);
+
+  bcc_procutils_invalidate_modules(getpid());
+  void *resolver = bcc_symcache_new(getpid(), nullptr);
+  REQUIRE(resolver);
+  struct bcc_symbol sym;
+  REQUIRE(bcc_symcache_resolve(resolver, addr + 4, &sym) == 0);
+  REQUIRE(string("jit_fn") == sym.name);
+  REQUIRE(sym.offset == 4);
+  REQUIRE(bcc_symcache_resolve(resolver, addr + 0x10, &sym) == 0);
+  REQUIRE(string("jit_next_door_fn") == sym.name);
+  REQUIRE(bcc_symcache_resolve(resolver, addr + 0x40, &sym) < 0);
+
+  // moved code only resolves at its new address
+  jitdump_move(file, addr, addr + 0x40, 0x10, 1);
+  fclose(file);
+  bcc_symcache_refresh(resolver);
+  REQUIRE(bcc_symcache_resolve(resolver, addr + 0x44, &sym) == 0);
+  REQUIRE(string("jit_fn") == sym.name);
+  REQUIRE(sym.offset == 4);
+  REQUIRE(bcc_symcache_resolve(resolver, addr + 4, &sym) < 0);
+  REQUIRE(bcc_symcache_resolve(resolver, addr + 0x10, &sym) == 0);
+  REQUIRE(string("jit_next_door_fn") == sym.name);
+
+  uint64_t found;
+  REQUIRE(bcc_symcache_resolve_name(resolver, path.c_str(), "jit_fn",
+                                    &found) == 0);
+  REQUIRE(found == addr + 0x40);
+
+  bcc_free_symcache(resolver, getpid());
+  munmap(dump, 4096);
+  munmap(code, code_sz);
+  unlink(path.c_str());
+}
+
 // must match exactly the defitinion of mod_search in bcc_syms.cc
 struct mod_search {
   const char *name;
@@ -600,8 +926,234 @@ TEST_CASE("resolve global addr in libc in this process", "[c_api][!mayfail]") {
   REQUIRE(global_addr == (search.start + local_addr - search.file_offset));
 }
 
+static int _find_start_addr(mod_info *mod, int enter_ns, void *payload) {
+  uint64_t *addr = static_cast<uint64_t *>(payload);
+  if (mod->start_addr == *addr) {
+    *addr = 0;
+    return -1;
+  }
+  return 0;
+}
+
+TEST_CASE("reuse the mappings of a process until invalidated", "[c_api]") {
+  int pid = getpid();
+  uint64_t dummy = 0;
+  REQUIRE(bcc_procutils_each_module(pid, _find_start_addr, &dummy) == 0);
+
+  int fd = open("/proc/self/exe", O_RDONLY);
+  REQUIRE(fd >= 0);
+  void *map = mmap(NULL, 4096, PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+  close(fd);
+  REQUIRE(map != MAP_FAILED);
+
+  // the new mapping isn't in the mappings read before it
+  uint64_t addr = (uint64_t)map;
+  REQUIRE(bcc_procutils_each_module(pid, _find_start_addr, &addr) == 0);
+  REQUIRE(addr == (uint64_t)map);
+
+  bcc_procutils_invalidate_modules(pid);
+  REQUIRE(bcc_procutils_each_module(pid, _find_start_addr, &addr) == 0);
+  REQUIRE(addr == 0);
+
+  munmap(map, 4096);
+  bcc_procutils_invalidate_modules(pid);
+}
+
+#if defined(__x86_64__)
+struct _unwind_snapshot {
+  struct bcc_user_regs regs;
+  uint8_t stack[8192];
+};
+
+static __attribute__((noinline)) void _unwind_leaf(struct _unwind_snapshot *s) {
+  asm volatile("lea 0(%%rip), %0\n\tmov %%rsp, %1\n\tmov %%rbp, %2"
+               : "=r"(s->regs.ip), "=r"(s->regs.sp), "=r"(s->regs.bp));
+  memcpy(s->stack, (void *)s->regs.sp, sizeof(s->stack));
+}
+
+static __attribute__((noinline)) void _unwind_caller(
+    struct _unwind_snapshot *s) {
+  _unwind_leaf(s);
+  // no tail call
+  asm volatile("");
+}
+
+TEST_CASE("unwind a user stack snapshot", "[c_api]") {
+  static struct _unwind_snapshot s;
+  _unwind_caller(&s);
+
+  void *resolver = bcc_symcache_new(getpid(), nullptr);
+  REQUIRE(resolver);
+  uint64_t ips[16];
+  int n = bcc_symcache_unwind(resolver, &s.regs, s.stack, sizeof(s.stack),
+                              ips, 16);
+  REQUIRE(n >= 3);
+  REQUIRE(ips[0] == s.regs.ip);
+
+  struct bcc_symbol sym;
+  REQUIRE(bcc_symcache_resolve(resolver, ips[0], &sym) == 0);
+  REQUIRE(string("_unwind_leaf") == sym.name);
+  REQUIRE(bcc_symcache_resolve(resolver, ips[1] - 1, &sym) == 0);
+  REQUIRE(string("_unwind_caller") == sym.name);
+
+  // the snapshot bounds the unwinding
+  REQUIRE(bcc_symcache_unwind(resolver, &s.regs, s.stack, 0, ips, 16) == 1);
+  bcc_free_symcache(resolver, getpid());
+}
+#endif
+
 TEST_CASE("get online CPUs", "[c_api]") {
 	std::vector<int> cpus = ebpf::get_online_cpus();
 	int num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
 	REQUIRE(cpus.size() == num_cpus);
 }
+
+TEST_CASE("share the vmlinux BTF", "[c_api]") {
+  const struct btf *btf = bcc_vmlinux_btf_get();
+  if (!btf) {
+    REQUIRE(!bpf_has_kernel_btf());
+    REQUIRE(kernel_struct_has_field("task_struct", "pid") == -1);
+    return;
+  }
+
+  const struct btf *again = bcc_vmlinux_btf_get();
+  REQUIRE(again == btf);
+  bcc_vmlinux_btf_put(again);
+  REQUIRE(bpf_has_kernel_btf());
+  REQUIRE(kernel_struct_has_field("task_struct", "pid") == 1);
+  REQUIRE(kernel_struct_has_field("task_struct", "no_such_field") == 0);
+
+  // still usable after the cache is dropped, until the reference is put
+  bcc_vmlinux_btf_drop_cache();
+  REQUIRE(kernel_struct_has_field("task_struct", "pid") == 1);
+  bcc_vmlinux_btf_put(btf);
+  REQUIRE(kernel_struct_has_field("task_struct", "pid") == 1);
+}
+
+TEST_CASE("cache kernel feature probes", "[c_api]") {
+  char dir[] = "/tmp/bcc-features-XXXXXX";
+  REQUIRE(mkdtemp(dir));
+  REQUIRE(setenv("BCC_OBJ_CACHE_DIR", dir, 1) == 0);
+
+  static int calls;
+  auto probe = [](const char *arg) -> int {
+    calls++;
+    return arg && !strcmp(arg, "yes");
+  };
+  calls = 0;
+  REQUIRE(bcc_feature_cached("test_feature", "yes", probe) == 1);
+  REQUIRE(bcc_feature_cached("test_feature", "no", probe) == 0);
+  REQUIRE(bcc_feature_cached("test_feature", "yes", probe) == 1);
+  REQUIRE(bcc_feature_cached("test_feature", "no", probe) == 0);
+  REQUIRE(calls == 2);
+
+  REQUIRE(bcc_feature_probe("no_such_feature", nullptr) == -EINVAL);
+  REQUIRE(bcc_feature_probe("tracepoint", "no_colon") == -EINVAL);
+  REQUIRE(bcc_feature_probe("kernel_btf", nullptr) ==
+          (bpf_has_kernel_btf() ? 1 : 0));
+  REQUIRE(bcc_feature_probe("kprobe", "no_such_function_for_bcc") == 0);
+
+  unsetenv("BCC_OBJ_CACHE_DIR");
+  std::string cmd = std::string("rm -rf ") + dir;
+  REQUIRE(system(cmd.c_str()) == 0);
+}
+
+TEST_CASE("parse trace_pipe lines", "[c_api]") {
+  int fds[2];
+  REQUIRE(pipe(fds) == 0);
+  const char *lines =
+      "           <...>-1234    [003] d..31 12345.678901: bpf_trace_printk: hello  \n"
+      "CPU:2 [LOST 3 EVENTS]\n"
+      "  python-my-task-99      [000] .... 1.5: 0x00000001: world\n"
+      "            bash-7      [001] d.h1   2.0";
+  REQUIRE(write(fds[1], lines, strlen(lines)) == (ssize_t)strlen(lines));
+
+  struct bcc_trace_pipe *tp = bcc_trace_pipe_new(fds[0], 4096);
+  REQUIRE(tp);
+  struct bcc_trace_record recs[4];
+  const char *data;
+
+  REQUIRE(bcc_trace_pipe_read(tp, recs, 4, &data) == 2);
+  REQUIRE(string(data + recs[0].task) == "<...>");
+  REQUIRE(recs[0].pid == 1234);
+  REQUIRE(recs[0].cpu == 3);
+  REQUIRE(string(data + recs[0].flags) == "d..31");
+  REQUIRE(recs[0].ts == 12345.678901);
+  REQUIRE(string(data + recs[0].msg, recs[0].msg_len) == "hello");
+  REQUIRE(string(data + recs[1].task) == "python-my-task");
+  REQUIRE(recs[1].pid == 99);
+  REQUIRE(string(data + recs[1].msg, recs[1].msg_len) == "world");
+
+  // the last line is only parsed once it is complete
+  const char *rest = "00001: bpf_trace_printk: !\n";
+  REQUIRE(write(fds[1], rest, strlen(rest)) == (ssize_t)strlen(rest));
+  REQUIRE(bcc_trace_pipe_read(tp, recs, 4, &data) == 1);
+  REQUIRE(string(data + recs[0].task) == "bash");
+  REQUIRE(recs[0].ts == 2.000001);
+  REQUIRE(string(data + recs[0].msg, recs[0].msg_len) == "!");
+
+  bcc_trace_pipe_free(tp);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+static int cgroup_label(const char *path, char *buf, size_t size, void *ctx) {
+  const char *name = strrchr(path, '/') + 1;
+  return snprintf(buf, size, "%s", name);
+}
+
+static uint64_t dir_ino(const string &path) {
+  struct stat st;
+  REQUIRE(stat(path.c_str(), &st) == 0);
+  return st.st_ino;
+}
+
+TEST_CASE("resolve cgroup ids to paths and labels", "[c_api]") {
+  char root[] = "/tmp/bcc-cgroup-XXXXXX";
+  REQUIRE(mkdtemp(root));
+  string r(root);
+  REQUIRE(mkdir((r + "/system.slice").c_str(), 0755) == 0);
+  REQUIRE(mkdir((r + "/system.slice/sshd.service").c_str(), 0755) == 0);
+
+  struct bcc_cgroup_cache *cache =
+      bcc_cgroup_cache_new(root, cgroup_label, nullptr);
+  REQUIRE(cache);
+  REQUIRE(bcc_cgroup_cache_size(cache) == 3);
+
+  char path[256], label[64];
+  uint64_t system_sshd = dir_ino(r + "/system.slice/sshd.service");
+  REQUIRE(bcc_cgroup_cache_lookup(cache, system_sshd, path, sizeof(path), label,
+                                  sizeof(label)) == 0);
+  REQUIRE(string(path) == "/system.slice/sshd.service");
+  REQUIRE(string(label) == "sshd.service");
+  REQUIRE(bcc_cgroup_cache_lookup(cache, dir_ino(r), path, sizeof(path),
+                                  nullptr, 0) == 0);
+  REQUIRE(string(path) == "/");
+
+  // new cgroups are found by the lookups themselves
+  REQUIRE(mkdir((r + "/system.slice/cron.service").c_str(), 0755) == 0);
+  uint64_t cron = dir_ino(r + "/system.slice/cron.service");
+  REQUIRE(bcc_cgroup_cache_lookup(cache, cron, path, sizeof(path), label,
+                                  sizeof(label)) == 0);
+  REQUIRE(string(path) == "/system.slice/cron.service");
+
+  REQUIRE(rmdir((r + "/system.slice/cron.service").c_str()) == 0);
+  REQUIRE(bcc_cgroup_cache_poll(cache) == 1);
+  REQUIRE(bcc_cgroup_cache_lookup(cache, cron, path, sizeof(path), label,
+                                  sizeof(label)) == -ENOENT);
+
+  // moves rename the whole subtree
+  REQUIRE(rename((r + "/system.slice").c_str(), (r + "/init.slice").c_str()) ==
+          0);
+  bcc_cgroup_cache_poll(cache);
+  REQUIRE(bcc_cgroup_cache_size(cache) == 3);
+  uint64_t init_sshd = dir_ino(r + "/init.slice/sshd.service");
+  REQUIRE(bcc_cgroup_cache_lookup(cache, init_sshd, path, sizeof(path), label,
+                                  sizeof(label)) == 0);
+  REQUIRE(string(path) == "/init.slice/sshd.service");
+
+  bcc_cgroup_cache_free(cache);
+  rmdir((r + "/init.slice/sshd.service").c_str());
+  rmdir((r + "/init.slice").c_str());
+  rmdir(root);
+}
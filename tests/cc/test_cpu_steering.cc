@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <linux/version.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "BPF.h"
+#include "BPFCpuSteering.h"
+#include "catch.hpp"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 15, 0)
+
+TEST_CASE("test cpu steering", "[cpu_steering]") {
+  const std::string BPF_PROGRAM = R"(
+BPF_CPUMAP(cpumap, 4);
+BPF_ARRAY(cpu_slots, u32, 8);
+BPF_PERCPU_ARRAY(cpu_slot_pkts, u64, 8);
+
+int steer(struct xdp_md *ctx) {
+  u32 slot = bpf_xdp_flow_hash(ctx) % 8;
+  u32 *cpu = cpu_slots.lookup(&slot);
+  u64 *pkts = cpu_slot_pkts.lookup(&slot);
+  if (!cpu || !pkts)
+    return XDP_PASS;
+  *pkts += 1;
+  return cpumap.redirect_map(*cpu, 0);
+}
+  )";
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+  int fd;
+  res = bpf.load_func("steer", BPF_PROG_TYPE_XDP, fd);
+  REQUIRE(res.ok());
+
+  REQUIRE_THROWS(ebpf::BPFCpuSteering(bpf, "cpu_slots", "cpu_slots",
+                                      "cpu_slot_pkts"));
+  ebpf::BPFCpuSteering steering(bpf, "cpumap", "cpu_slots", "cpu_slot_pkts");
+
+  res = steering.set_cpus({0, 4}, 64);
+  REQUIRE(!res.ok());
+  res = steering.set_cpus({0, 1}, 64);
+  REQUIRE(res.ok());
+  REQUIRE(steering.slot_cpus() ==
+          std::vector<uint32_t>({0, 1, 0, 1, 0, 1, 0, 1}));
+
+  auto cpumap = bpf.get_cpumap_table("cpumap");
+  uint32_t qsize;
+  res = cpumap.get_value(1, qsize);
+  REQUIRE(res.ok());
+  REQUIRE(qsize == 64);
+  res = steering.set_qsize(1, 128);
+  REQUIRE(res.ok());
+  res = steering.set_qsize(2, 128);
+  REQUIRE(!res.ok());
+
+  // Pretend all the packets hit the slots of CPU 0
+  auto pkts = bpf.get_percpu_array_table<uint64_t>("cpu_slot_pkts");
+  std::vector<uint64_t> counts(ebpf::BPFTable::get_possible_cpu_count(), 0);
+  for (int slot : {0, 2, 4, 6}) {
+    counts[0] = slot + 10;
+    res = pkts.update_value(slot, counts);
+    REQUIRE(res.ok());
+  }
+
+  size_t moved;
+  res = steering.rebalance(0.1, moved);
+  REQUIRE(res.ok());
+  REQUIRE(moved == 2);
+  REQUIRE(steering.load() == std::map<int, uint64_t>({{0, 52}, {1, 0}}));
+  REQUIRE(steering.slot_cpus() ==
+          std::vector<uint32_t>({0, 1, 0, 1, 1, 1, 1, 1}));
+  uint32_t cpu;
+  auto slots = bpf.get_array_table<uint32_t>("cpu_slots");
+  res = slots.get_value(6, cpu);
+  REQUIRE(res.ok());
+  REQUIRE(cpu == 1);
+
+  // Nothing new since the rebalance
+  std::map<int, uint64_t> load;
+  res = steering.update_load(load);
+  REQUIRE(res.ok());
+  REQUIRE(load == std::map<int, uint64_t>({{0, 0}, {1, 0}}));
+
+  res = steering.set_cpus({1, 2}, 64);
+  REQUIRE(res.ok());
+  res = cpumap.get_value(0, qsize);
+  REQUIRE(!res.ok());
+}
+
+#endif
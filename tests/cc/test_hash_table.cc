@@ -17,6 +17,8 @@
 #include "BPF.h"
 #include <linux/version.h>
 
+#include <algorithm>
+
 #include "catch.hpp"
 
 TEST_CASE("test hash table", "[hash_table]") {
@@ -89,6 +91,208 @@ TEST_CASE("test hash table", "[hash_table]") {
     t.clear_table_non_atomic();
     REQUIRE(t.get_table_offline().size() == 0);
   }
+
+  SECTION("walk table in batches") {
+    for (int i = 1; i <= 100; i++) {
+      res = t.update_value(i, i * 2);
+      REQUIRE(res.ok());
+    }
+
+    // batch size smaller than the table, and batching disabled
+    for (size_t batch_size : {3, 0}) {
+      t.set_batch_size(batch_size);
+      auto offline = t.get_table_offline();
+      REQUIRE(offline.size() == 100);
+      std::sort(offline.begin(), offline.end());
+      for (int i = 0; i < 100; i++) {
+        REQUIRE(offline.at(i).first == i + 1);
+        REQUIRE(offline.at(i).second == (i + 1) * 2);
+      }
+    }
+  }
+
+  SECTION("update table in batches") {
+    std::vector<std::pair<int, int>> entries;
+    for (int i = 1; i <= 100; i++)
+      entries.emplace_back(i, i * 3);
+
+    // batch size smaller than the table, and batching disabled
+    for (size_t batch_size : {16, 0}) {
+      t.set_batch_size(batch_size);
+      res = t.update_batch(entries);
+      REQUIRE(res.ok());
+      auto offline = t.get_table_offline();
+      REQUIRE(offline.size() == 100);
+      for (const auto &pair : offline)
+        REQUIRE(pair.second == pair.first * 3);
+      t.clear_table_non_atomic();
+    }
+  }
+
+  SECTION("visit table") {
+    for (int i = 1; i <= 100; i++) {
+      res = t.update_value(i, i * 2);
+      REQUIRE(res.ok());
+    }
+
+    for (size_t batch_size : {16, 0}) {
+      t.set_batch_size(batch_size);
+
+      int visited = 0;
+      res = t.for_each([&](const int &key, const int &value) {
+        REQUIRE(value == key * 2);
+        visited++;
+        return true;
+      });
+      REQUIRE(res.ok());
+      REQUIRE(visited == 100);
+
+      // stop early
+      visited = 0;
+      res = t.for_each([&](const int &, const int &) {
+        return ++visited < 10;
+      });
+      REQUIRE(res.ok());
+      REQUIRE(visited == 10);
+    }
+  }
+
+  SECTION("snapshot") {
+    ebpf::BPFTableSnapshot snap = bpf.get_table_snapshot("myhash");
+    for (int i = 1; i <= 10; i++) {
+      res = t.update_value(i, i);
+      REQUIRE(res.ok());
+    }
+
+    res = snap.update();
+    REQUIRE(res.ok());
+    REQUIRE(snap.size() == 10);
+    REQUIRE(snap.changes().size() == 10);
+    for (const auto &c : snap.changes())
+      REQUIRE(c.kind == ebpf::BPFTableSnapshot::ADDED);
+
+    // nothing changed
+    res = snap.update();
+    REQUIRE(res.ok());
+    REQUIRE(snap.changes().size() == 0);
+
+    res = t.update_value(3, 10);
+    REQUIRE(res.ok());
+    res = t.remove_value(5);
+    REQUIRE(res.ok());
+    res = t.update_value(42, 1);
+    REQUIRE(res.ok());
+
+    res = snap.update();
+    REQUIRE(res.ok());
+    REQUIRE(snap.size() == 10);
+    REQUIRE(snap.changes().size() == 3);
+    for (const auto &c : snap.changes()) {
+      int key = *static_cast<const int *>(c.key);
+      int value = *static_cast<const int *>(c.value);
+      if (c.kind == ebpf::BPFTableSnapshot::CHANGED) {
+        REQUIRE(key == 3);
+        REQUIRE(value == 10);
+        REQUIRE(*static_cast<const int *>(c.delta) == 7);
+      } else if (c.kind == ebpf::BPFTableSnapshot::REMOVED) {
+        REQUIRE(key == 5);
+        REQUIRE(value == 5);
+        REQUIRE(c.delta == nullptr);
+      } else {
+        REQUIRE(c.kind == ebpf::BPFTableSnapshot::ADDED);
+        REQUIRE(key == 42);
+        REQUIRE(value == 1);
+      }
+    }
+  }
+
+  SECTION("poller") {
+    ebpf::BPFTablePoller poller(std::chrono::milliseconds(10));
+    res = bpf.add_poller_table(poller, "myhash");
+    REQUIRE(res.ok());
+    res = bpf.add_poller_table(poller, "nosuchtable");
+    REQUIRE(!res.ok());
+
+    REQUIRE(poller.read()->generation == 0);
+    for (int i = 1; i <= 10; i++) {
+      res = t.update_value(i, i * 3);
+      REQUIRE(res.ok());
+    }
+    res = poller.poll();
+    REQUIRE(res.ok());
+    {
+      auto snap = poller.read();
+      REQUIRE(snap->generation == 1);
+      const ebpf::BPFTablePoller::Table *table = snap->find("myhash");
+      REQUIRE(table != nullptr);
+      REQUIRE(table->count == 10);
+      for (size_t i = 0; i < table->count; i++) {
+        int key = *reinterpret_cast<const int *>(table->key(i));
+        REQUIRE(*reinterpret_cast<const int *>(table->value(i)) == key * 3);
+      }
+    }
+
+    res = poller.start();
+    REQUIRE(res.ok());
+    res = poller.poll();
+    REQUIRE(!res.ok());
+    res = t.update_value(42, 1);
+    REQUIRE(res.ok());
+    for (int i = 0; i < 100 && poller.read()->tables[0].count != 11; i++)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    REQUIRE(poller.read()->tables[0].count == 11);
+    res = poller.stop();
+    REQUIRE(res.ok());
+    REQUIRE(poller.last_status().ok());
+  }
+
+  SECTION("drain table") {
+    for (int i = 1; i <= 10; i++) {
+      res = t.update_value(i, i * 2);
+      REQUIRE(res.ok());
+    }
+
+    std::vector<std::pair<int, int>> drained;
+    res = t.drain(drained);
+    REQUIRE(res.ok());
+    REQUIRE(drained.size() == 10);
+    for (const auto &pair : drained) {
+      REQUIRE(pair.second == pair.first * 2);
+    }
+    REQUIRE(t.get_table_offline().size() == 0);
+
+    res = t.drain(drained);
+    REQUIRE(res.ok());
+    REQUIRE(drained.size() == 0);
+  }
+
+  SECTION("top") {
+    for (int i = 1; i <= 10; i++) {
+      res = t.update_value(i, (i * 7) % 11);
+      REQUIRE(res.ok());
+    }
+
+    ebpf::BPFTableTop top = bpf.get_table_top("myhash", {{0, sizeof(int)}}, 3);
+    res = top.update(false);
+    REQUIRE(res.ok());
+    REQUIRE(top.total() == 10);
+    REQUIRE(top.size() == 3);
+    const int *keys = reinterpret_cast<const int *>(top.keys());
+    const int *values = reinterpret_cast<const int *>(top.values());
+    for (int i = 0; i < 3; i++) {
+      REQUIRE(values[i] == 10 - i);
+      REQUIRE(values[i] == (keys[i] * 7) % 11);
+    }
+    REQUIRE(t.get_table_offline().size() == 10);
+
+    res = top.update(true);
+    REQUIRE(res.ok());
+    REQUIRE(top.size() == 3);
+    REQUIRE(t.get_table_offline().size() == 0);
+
+    auto f = [&]() { bpf.get_table_top("myhash", {{2, sizeof(int)}}, 3); };
+    REQUIRE_THROWS(f());
+  }
 }
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,6,0)
@@ -189,5 +393,151 @@ TEST_CASE("percpu hash table", "[percpu_hash_table]") {
     t.clear_table_non_atomic();
     REQUIRE(t.get_table_offline().size() == 0);
   }
+
+  SECTION("walk table in batches") {
+    std::vector<uint64_t> v(ncpus);
+
+    for (int k = 1; k <= 50; k++) {
+      for (size_t cpu = 0; cpu < ncpus; cpu++) {
+        v[cpu] = k * cpu;
+      }
+      res = t.update_value(k, v);
+      REQUIRE(res.ok());
+    }
+
+    t.set_batch_size(7);
+    auto offline = t.get_table_offline();
+    REQUIRE(offline.size() == 50);
+    for (const auto &pair : offline) {
+      REQUIRE(pair.second.size() == ncpus);
+      for (size_t cpu = 0; cpu < ncpus; cpu++) {
+        REQUIRE(pair.second.at(cpu) == cpu * pair.first);
+      }
+    }
+
+    std::vector<std::pair<int, std::vector<uint64_t>>> drained;
+    res = t.drain(drained);
+    REQUIRE(res.ok());
+    REQUIRE(drained.size() == 50);
+    for (const auto &pair : drained) {
+      REQUIRE(pair.second.size() == ncpus);
+      for (size_t cpu = 0; cpu < ncpus; cpu++) {
+        REQUIRE(pair.second.at(cpu) == cpu * pair.first);
+      }
+    }
+    REQUIRE(t.get_table_offline().size() == 0);
+  }
+
+  SECTION("reduce values") {
+    std::vector<uint64_t> v(ncpus);
+
+    for (int k = 1; k <= 10; k++) {
+      for (size_t cpu = 0; cpu < ncpus; cpu++) {
+        v[cpu] = k * (cpu + 1);
+      }
+      res = t.update_value(k, v);
+      REQUIRE(res.ok());
+    }
+
+    uint64_t sum;
+    res = t.get_value_reduced(3, sum, std::plus<uint64_t>());
+    REQUIRE(res.ok());
+    REQUIRE(sum == 3 * ncpus * (ncpus + 1) / 2);
+
+    auto max = [](uint64_t a, uint64_t b) { return a > b ? a : b; };
+    auto offline = t.get_table_offline_reduced(max);
+    REQUIRE(offline.size() == 10);
+    for (const auto &pair : offline) {
+      REQUIRE(pair.second == pair.first * ncpus);
+    }
+  }
+}
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+TEST_CASE("lpm trie table", "[lpm_trie_table]") {
+  const std::string BPF_PROGRAM = R"(
+    struct key_v4 {
+      u32 prefixlen;
+      u32 data;
+    };
+    BPF_LPM_TRIE(trie, struct key_v4, int, 1024);
+    BPF_TABLE("hash", int, int, myhash, 1024);
+  )";
+
+  struct KeyV4 {
+    uint32_t prefixlen;
+    uint8_t data[4];
+  };
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+
+  auto f1 = [&](){
+    bpf.get_lpm_trie_table<KeyV4, int>("myhash");
+  };
+  REQUIRE_THROWS(f1());
+
+  auto t = bpf.get_lpm_trie_table<KeyV4, int>("trie");
+
+  // the kernel has no batch ops for tries, entries go one by one
+  std::vector<std::pair<KeyV4, int>> entries;
+  for (int i = 0; i < 256; i++)
+    entries.push_back({{24, {10, 0, static_cast<uint8_t>(i), 0}}, i});
+  entries.push_back({{16, {10, 0, 0, 0}}, -1});
+  res = t.update_batch(entries);
+  REQUIRE(res.ok());
+
+  int v;
+  res = t.get_value({32, {10, 0, 42, 7}}, v);
+  REQUIRE(res.ok());
+  REQUIRE(v == 42);
+  res = t.remove_value({24, {10, 0, 42, 0}});
+  REQUIRE(res.ok());
+  res = t.get_value({32, {10, 0, 42, 7}}, v);
+  REQUIRE(res.ok());
+  REQUIRE(v == -1);
+  res = t.get_value({32, {10, 1, 0, 1}}, v);
+  REQUIRE(!res.ok());
+
+  auto t4 = bpf.get_lpm_trie_table<ebpf::BPFLpmKeyV4, int>("trie");
+  ebpf::BPFLpmKeyV4 key;
+  REQUIRE(ebpf::parse_lpm_prefix("192.168.0.0/16", key).ok());
+  REQUIRE(key.prefixlen == 16);
+  REQUIRE(key.data[0] == 192);
+  REQUIRE(!ebpf::parse_lpm_prefix("192.168.0.0/33", key).ok());
+  REQUIRE(!ebpf::parse_lpm_prefix("2001:db8::/32", key).ok());
+  ebpf::BPFLpmKeyV6 key6;
+  REQUIRE(ebpf::parse_lpm_prefix("2001:db8::", key6).ok());
+  REQUIRE(key6.prefixlen == 128);
+
+  // load() replaces the whole list
+  std::vector<std::pair<ebpf::BPFLpmKeyV4, int>> list;
+  for (const char* prefix : {"10.0.0.0/8", "10.1.0.0/16", "192.168.1.0/24"}) {
+    REQUIRE(ebpf::parse_lpm_prefix(prefix, key).ok());
+    list.push_back({key, static_cast<int>(list.size())});
+  }
+  res = t4.load(list);
+  REQUIRE(res.ok());
+  auto dump = t4.get_table_offline();
+  REQUIRE(dump.size() == list.size());
+
+  REQUIRE(ebpf::parse_lpm_prefix("10.1.2.3", key).ok());
+  res = t4.get_value(key, v);
+  REQUIRE(res.ok());
+  REQUIRE(v == 1);
+  REQUIRE(ebpf::parse_lpm_prefix("10.0.42.7", key).ok());
+  res = t4.get_value(key, v);
+  REQUIRE(res.ok());
+  REQUIRE(v == 0);
+
+  list.erase(list.begin());
+  res = t4.load(list);
+  REQUIRE(res.ok());
+  REQUIRE(t4.get_table_offline().size() == list.size());
+  res = t4.get_value(key, v);
+  REQUIRE(!res.ok());
 }
 #endif
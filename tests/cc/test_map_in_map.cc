@@ -326,4 +326,69 @@ TEST_CASE("test array of maps", "[array_of_maps]") {
     REQUIRE(res.ok());
   }
 }
+
+TEST_CASE("test swapping inner maps", "[array_of_maps]") {
+  const std::string BPF_PROGRAM = R"(
+    BPF_HASH(cfg_a, int, int, 1024);
+    BPF_HASH(cfg_b, int, int, 1024);
+    BPF_ARRAY_OF_MAPS(cfg, "cfg_a", 1);
+    BPF_ARRAY(out, int, 1);
+
+    int syscall__getuid(void *ctx) {
+      int key = 0, *val;
+      void *inner_map = cfg.lookup(&key);
+      if (!inner_map)
+        return 0;
+      key = 1;
+      val = bpf_map_lookup_elem(inner_map, &key);
+      key = 0;
+      if (val)
+        out.update(&key, val);
+      return 0;
+    }
+  )";
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+
+  auto t = bpf.get_map_in_map_table<int>("cfg");
+  auto cfg_a = bpf.get_hash_table<int, int>("cfg_a");
+  auto cfg_b = bpf.get_hash_table<int, int>("cfg_b");
+  auto out = bpf.get_array_table<int>("out");
+  std::string getuid_fnname = bpf.get_syscall_fnname("getuid");
+  res = bpf.attach_kprobe(getuid_fnname, "syscall__getuid");
+  REQUIRE(res.ok());
+
+  ebpf::BPFHashTable<int, int>* installed = nullptr;
+  int value;
+  res = t.swap_inner_map(0, cfg_a, cfg_b, {{1, 10}}, &installed);
+  REQUIRE(res.ok());
+  REQUIRE(installed == &cfg_a);
+  REQUIRE(getuid() >= 0);
+  REQUIRE(out.get_value(0, value).ok());
+  REQUIRE(value == 10);
+
+  res = t.swap_inner_map(0, cfg_a, cfg_b, {{1, 20}, {2, 2}}, &installed);
+  REQUIRE(res.ok());
+  REQUIRE(installed == &cfg_b);
+  REQUIRE(getuid() >= 0);
+  REQUIRE(out.get_value(0, value).ok());
+  REQUIRE(value == 20);
+  // the previous map is left as it was
+  REQUIRE(cfg_a.get_value(1, value).ok());
+  REQUIRE(value == 10);
+
+  res = t.swap_inner_map(0, cfg_a, cfg_b, {{1, 30}}, &installed);
+  REQUIRE(res.ok());
+  REQUIRE(installed == &cfg_a);
+  REQUIRE(getuid() >= 0);
+  REQUIRE(out.get_value(0, value).ok());
+  REQUIRE(value == 30);
+  REQUIRE(cfg_a.get_table_offline().size() == 1);
+
+  res = bpf.detach_kprobe(getuid_fnname);
+  REQUIRE(res.ok());
+}
 #endif
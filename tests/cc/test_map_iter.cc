@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <linux/version.h>
+#include <cstdint>
+#include <cstring>
+#include <map>
+
+#include "BPF.h"
+#include "BPFMapIter.h"
+#include "catch.hpp"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+
+TEST_CASE("test map element iterator", "[map_iter]") {
+  const std::string BPF_PROGRAM = R"(
+    BPF_TABLE("hash", u32, u64, counts, 8192);
+    BPF_TABLE("percpu_array", int, u32, stats, 4);
+    BPF_PROG_ARRAY(progs, 4);
+  )";
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+  auto t = bpf.get_hash_table<uint32_t, uint64_t>("counts");
+  // more entries than a page of records
+  for (uint32_t i = 0; i < 5000; i++) {
+    res = t.update_value(i, i * 10);
+    REQUIRE(res.ok());
+  }
+
+  ebpf::BPFMapIter iter;
+  std::vector<char> records;
+  res = iter.dump(records);
+  REQUIRE(!res.ok());
+  res = bpf.init_map_iter(iter, "counts");
+  REQUIRE(res.ok());
+  REQUIRE(iter.record_size() == sizeof(uint32_t) + sizeof(uint64_t));
+
+  std::map<uint32_t, uint64_t> seen;
+  res = iter.for_each([&](const void* key, const void* value) {
+    uint32_t k;
+    uint64_t v;
+    std::memcpy(&k, key, sizeof(k));
+    std::memcpy(&v, value, sizeof(v));
+    seen[k] = v;
+    return true;
+  });
+  REQUIRE(res.ok());
+  REQUIRE(seen.size() == 5000);
+  for (const auto& e : seen)
+    REQUIRE(e.second == e.first * 10);
+
+  // the iterator is reused for the entries added since
+  res = t.update_value(9000, 1);
+  REQUIRE(res.ok());
+  res = iter.dump(records);
+  REQUIRE(res.ok());
+  REQUIRE(records.size() == 5001 * iter.record_size());
+
+  SECTION("filter") {
+    ebpf::BPFMapIter filtered;
+    res = bpf.init_map_iter(filtered, "counts", "*(u64 *)value >= 49900");
+    REQUIRE(res.ok());
+    res = filtered.dump(records);
+    REQUIRE(res.ok());
+    REQUIRE(records.size() == 10 * filtered.record_size());
+
+    std::vector<std::pair<std::string, std::string>> entries;
+    res = bpf.get_table("counts").dump_via_iter(entries,
+                                                "*(u32 *)key % 1000 == 0");
+    REQUIRE(res.ok());
+    REQUIRE(entries.size() == 6);
+  }
+
+  SECTION("per-CPU values") {
+    ebpf::BPFMapIter percpu;
+    res = bpf.init_map_iter(percpu, "stats");
+    REQUIRE(res.ok());
+    REQUIRE(percpu.value_size() ==
+            8 * ebpf::BPFTable::get_possible_cpu_count());
+    res = percpu.dump(records);
+    REQUIRE(res.ok());
+    REQUIRE(records.size() == 4 * percpu.record_size());
+
+    std::vector<std::pair<std::string, std::string>> entries;
+    res = bpf.get_table("stats").dump_via_iter(entries);
+    REQUIRE(!res.ok());
+  }
+
+  SECTION("unsupported map") {
+    ebpf::BPFMapIter prog_iter;
+    res = bpf.init_map_iter(prog_iter, "progs");
+    REQUIRE(!res.ok());
+    res = bpf.init_map_iter(prog_iter, "nosuchtable");
+    REQUIRE(!res.ok());
+  }
+}
+
+#endif
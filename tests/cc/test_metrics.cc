@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+#include <thread>
+
+#include "BPF.h"
+#include "bcc_metrics.h"
+#include "catch.hpp"
+
+TEST_CASE("test libbcc metrics", "[metrics]") {
+  const std::string BPF_PROGRAM = R"(
+BPF_HASH(myhash, int, int, 128);
+)";
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+  auto t = bpf.get_hash_table<int, int>("myhash");
+
+  bcc_metrics_reset();
+
+  SECTION("nothing counted while disabled") {
+    bcc_metrics_enable(0);
+    REQUIRE(t.update_value(1, 1).ok());
+    REQUIRE(bcc_metric_read(BCC_METRIC_TABLE_SYSCALLS) == 0);
+  }
+
+  SECTION("map syscalls of all threads") {
+    bcc_metrics_enable(1);
+    REQUIRE(t.update_value(1, 1).ok());
+    std::thread th([&t]() {
+      int v;
+      t.get_value(1, v);
+    });
+    th.join();
+    bcc_metrics_enable(0);
+    // the exited thread's count is kept
+    REQUIRE(bcc_metric_read(BCC_METRIC_TABLE_SYSCALLS) == 2);
+
+    bcc_metrics_reset();
+    REQUIRE(bcc_metric_read(BCC_METRIC_TABLE_SYSCALLS) == 0);
+  }
+
+  SECTION("prometheus text") {
+    int len = bcc_metrics_prometheus(nullptr, 0);
+    REQUIRE(len > 0);
+    std::string text(len + 1, '\0');
+    REQUIRE(bcc_metrics_prometheus(&text[0], text.size()) == len);
+    text.resize(len);
+    REQUIRE(text.find("# TYPE bcc_table_syscalls_total counter\n") !=
+            std::string::npos);
+    REQUIRE(text.find("\nbcc_table_syscalls_total 0\n") != std::string::npos);
+  }
+
+  bcc_metrics_enable(0);
+}
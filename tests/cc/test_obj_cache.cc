@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2021 Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <linux/version.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "BPF.h"
+#include "catch.hpp"
+
+static std::vector<std::string> list_dir(const std::string &dir) {
+  std::vector<std::string> res;
+  DIR *d = opendir(dir.c_str());
+  if (!d)
+    return res;
+  while (struct dirent *ent = readdir(d)) {
+    std::string name(ent->d_name);
+    if (name != "." && name != "..")
+      res.push_back(dir + "/" + name);
+  }
+  closedir(d);
+  return res;
+}
+
+TEST_CASE("test compiled object cache", "[obj_cache]") {
+  const std::string BPF_PROGRAM = R"(
+    BPF_HASH(myhash, int, u64, 128);
+    int on_sys_getuid(void *ctx) {
+      int key = 1;
+      myhash.increment(key);
+      return 0;
+    }
+  )";
+
+  char dir_tmpl[] = "/tmp/bcc_obj_cache_XXXXXX";
+  char *dir = mkdtemp(dir_tmpl);
+  REQUIRE(dir != nullptr);
+  setenv("BCC_OBJ_CACHE_DIR", dir, 1);
+
+  SECTION("cold and warm start") {
+    {
+      ebpf::BPF bpf(0, nullptr, false);
+      ebpf::StatusTuple res = bpf.init(BPF_PROGRAM);
+      REQUIRE(res.ok());
+    }
+    REQUIRE(list_dir(dir).size() == 1);
+
+    ebpf::BPF bpf(0, nullptr, false);
+    ebpf::StatusTuple res = bpf.init(BPF_PROGRAM);
+    REQUIRE(res.ok());
+    REQUIRE(list_dir(dir).size() == 1);
+
+    int fd;
+    res = bpf.load_func("on_sys_getuid", BPF_PROG_TYPE_KPROBE, fd);
+    REQUIRE(res.ok());
+
+    auto t = bpf.get_hash_table<int, uint64_t>("myhash");
+    REQUIRE(t.update_value(1, 42).ok());
+    uint64_t v;
+    REQUIRE(t.get_value(1, v).ok());
+    REQUIRE(v == 42);
+  }
+
+  SECTION("corrupt entry falls back to compilation") {
+    {
+      ebpf::BPF bpf(0, nullptr, false);
+      REQUIRE(bpf.init(BPF_PROGRAM).ok());
+    }
+    auto entries = list_dir(dir);
+    REQUIRE(entries.size() == 1);
+    REQUIRE(truncate(entries[0].c_str(), 64) == 0);
+
+    ebpf::BPF bpf(0, nullptr, false);
+    REQUIRE(bpf.init(BPF_PROGRAM).ok());
+    auto t = bpf.get_hash_table<int, uint64_t>("myhash");
+    REQUIRE(t.capacity() == 128);
+  }
+
+  unsetenv("BCC_OBJ_CACHE_DIR");
+  for (auto &f : list_dir(dir))
+    unlink(f.c_str());
+  rmdir(dir);
+}
+
+TEST_CASE("test compiled object file", "[obj_cache]") {
+  const std::string BPF_PROGRAM = R"(
+    BPF_HASH(myhash, int, u64, 128);
+    int on_sys_getuid(void *ctx) {
+      int key = 1;
+      myhash.increment(key);
+      return 0;
+    }
+  )";
+
+  char dir_tmpl[] = "/tmp/bcc_obj_file_XXXXXX";
+  char *dir = mkdtemp(dir_tmpl);
+  REQUIRE(dir != nullptr);
+  std::string path = std::string(dir) + "/prog.bccobj";
+
+  ebpf::StatusTuple res = ebpf::BPF::compile_object(BPF_PROGRAM, path);
+  REQUIRE(res.ok());
+  REQUIRE(list_dir(dir).size() == 1);
+
+  SECTION("load without compiling") {
+    ebpf::BPF bpf(0, nullptr, false);
+    res = bpf.init_object(path);
+    REQUIRE(res.ok());
+
+    int fd;
+    res = bpf.load_func("on_sys_getuid", BPF_PROG_TYPE_KPROBE, fd);
+    REQUIRE(res.ok());
+
+    auto t = bpf.get_hash_table<int, uint64_t>("myhash");
+    REQUIRE(t.capacity() == 128);
+    REQUIRE(t.update_value(1, 42).ok());
+    uint64_t v;
+    REQUIRE(t.get_value(1, v).ok());
+    REQUIRE(v == 42);
+  }
+
+  SECTION("objects are not cache entries") {
+    setenv("BCC_OBJ_CACHE_DIR", dir, 1);
+    ebpf::BPF bpf(0, nullptr, false);
+    REQUIRE(bpf.init(BPF_PROGRAM).ok());
+    unsetenv("BCC_OBJ_CACHE_DIR");
+
+    ebpf::BPF other(0, nullptr, false);
+    for (auto &f : list_dir(dir))
+      if (f != path)
+        REQUIRE(!other.init_object(f).ok());
+  }
+
+  SECTION("rw engine must be disabled") {
+    ebpf::BPF bpf(0, nullptr, true);
+    if (bpf_module_rw_engine_enabled())
+      REQUIRE(!bpf.init_object(path).ok());
+  }
+
+  for (auto &f : list_dir(dir))
+    unlink(f.c_str());
+  rmdir(dir);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
+TEST_CASE("test map sizes and rodata at load time", "[obj_cache]") {
+  const std::string BPF_PROGRAM = R"(
+    struct config { u64 step; };
+    BPF_RODATA(cfg, struct config);
+    BPF_HASH(myhash, int, u64, 128);
+    int on_sys_getuid(void *ctx) {
+      int key = 1;
+      myhash.increment(key, cfg.get()->step);
+      return 0;
+    }
+  )";
+  struct config {
+    uint64_t step;
+  } cfg = {3};
+
+  char dir_tmpl[] = "/tmp/bcc_obj_file_XXXXXX";
+  char *dir = mkdtemp(dir_tmpl);
+  REQUIRE(dir != nullptr);
+  std::string path = std::string(dir) + "/prog.bccobj";
+  REQUIRE(ebpf::BPF::compile_object(BPF_PROGRAM, path).ok());
+
+  SECTION("one object, several sizes") {
+    for (unsigned size : {16, 4096}) {
+      ebpf::BPF bpf(0, nullptr, false);
+      bpf.set_map_size("myhash", size);
+      bpf.set_rodata("cfg", &cfg, sizeof(cfg));
+      REQUIRE(bpf.init_object(path).ok());
+
+      int fd;
+      REQUIRE(bpf.load_func("on_sys_getuid", BPF_PROG_TYPE_KPROBE, fd).ok());
+      REQUIRE(bpf.get_hash_table<int, uint64_t>("myhash").capacity() == size);
+
+      auto t = bpf.get_array_table<uint64_t>("cfg");
+      uint64_t v;
+      REQUIRE(t.get_value(0, v).ok());
+      REQUIRE(v == 3);
+      // frozen once the maps are created
+      REQUIRE(!t.update_value(0, 4).ok());
+    }
+  }
+
+  SECTION("unknown tables") {
+    ebpf::BPF bpf(0, nullptr, false);
+    bpf.set_map_size("nosuch", 16);
+    REQUIRE(!bpf.init_object(path).ok());
+
+    ebpf::BPF other(0, nullptr, false);
+    other.set_rodata("myhash", &cfg, sizeof(cfg));
+    REQUIRE(!other.init_object(path).ok());
+  }
+
+  for (auto &f : list_dir(dir))
+    unlink(f.c_str());
+  rmdir(dir);
+}
+#endif
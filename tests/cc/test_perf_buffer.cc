@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <linux/version.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <string>
+
+#include "BPF.h"
+#include "catch.hpp"
+#include "common.h"
+
+namespace {
+
+const std::string BPF_PROGRAM = R"(
+  BPF_PERF_OUTPUT(events);
+
+  struct event_t {
+    u32 pid;
+    u64 ts;
+  };
+
+  int on_sys_getuid(void *ctx) {
+    struct event_t e = {};
+    e.pid = bpf_get_current_pid_tgid() >> 32;
+    e.ts = bpf_ktime_get_ns();
+    events.perf_submit(ctx, &e, sizeof(e));
+    return 0;
+  }
+)";
+
+struct event_t {
+  uint32_t pid;
+  uint64_t ts;
+};
+
+void count_own(void* cb_cookie, void* raw, int raw_size) {
+  auto e = static_cast<event_t*>(raw);
+  if (raw_size >= (int)sizeof(*e) && e->pid == (uint32_t)getpid())
+    (*static_cast<int*>(cb_cookie))++;
+}
+
+}  // namespace
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
+TEST_CASE("test perf buffer flight recorder", "[perf_buffer]") {
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+
+  int seen = 0;
+  res = bpf.open_flight_recorder("events", count_own, nullptr, &seen);
+  REQUIRE(res.ok());
+  // not consumed from userspace
+  REQUIRE(bpf.get_perf_buffer("events")->consume_all() == -1);
+
+  std::string getuid_fnname = bpf.get_syscall_fnname("getuid");
+  res = bpf.attach_kprobe(getuid_fnname, "on_sys_getuid");
+  REQUIRE(res.ok());
+  for (int i = 0; i < 10; i++)
+    REQUIRE(getuid() >= 0);
+  res = bpf.detach_kprobe(getuid_fnname);
+  REQUIRE(res.ok());
+
+  REQUIRE(bpf.snapshot_perf_buffer("events") >= 10);
+  REQUIRE(seen == 10);
+  // the samples stay in the rings
+  seen = 0;
+  REQUIRE(bpf.snapshot_perf_buffer("events") >= 10);
+  REQUIRE(seen == 10);
+
+  res = bpf.close_perf_buffer("events");
+  REQUIRE(res.ok());
+  REQUIRE(bpf.snapshot_perf_buffer("events") == -1);
+}
+#endif
+
+TEST_CASE("test adaptive perf buffer", "[perf_buffer]") {
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+
+  int seen = 0;
+  res = bpf.open_perf_buffer("events", count_own, nullptr, &seen, 1);
+  REQUIRE(res.ok());
+  auto perf_buffer = bpf.get_perf_buffer("events");
+  REQUIRE(!perf_buffer->enable_adaptive(3, 1024).ok());
+  res = perf_buffer->enable_adaptive(4, 1024);
+  REQUIRE(res.ok());
+
+  std::string getuid_fnname = bpf.get_syscall_fnname("getuid");
+  res = bpf.attach_kprobe(getuid_fnname, "on_sys_getuid");
+  REQUIRE(res.ok());
+  // Overflow the one page ring of our CPU
+  for (int i = 0; i < 10000; i++)
+    REQUIRE(getuid() >= 0);
+  res = bpf.detach_kprobe(getuid_fnname);
+  REQUIRE(res.ok());
+  REQUIRE(perf_buffer->consume_all() > 0);
+  REQUIRE(seen > 0);
+
+  bool grown = false;
+  for (int cpu : ebpf::get_online_cpus())
+    grown |= perf_buffer->page_cnt(cpu) == 2;
+  REQUIRE(grown);
+
+  res = bpf.close_perf_buffer("events");
+  REQUIRE(res.ok());
+}
+
+TEST_CASE("test perf buffer in an event loop", "[perf_buffer]") {
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+
+  int seen = 0;
+  res = bpf.open_perf_buffer("events", count_own, nullptr, &seen);
+  REQUIRE(res.ok());
+  auto perf_buffer = bpf.get_perf_buffer("events");
+  REQUIRE(perf_buffer->epoll_fd() >= 0);
+  REQUIRE(perf_buffer->consume() == 0);
+
+  // the reactor of the application
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  REQUIRE(epfd >= 0);
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  REQUIRE(epoll_ctl(epfd, EPOLL_CTL_ADD, perf_buffer->epoll_fd(), &ev) == 0);
+
+  std::string getuid_fnname = bpf.get_syscall_fnname("getuid");
+  res = bpf.attach_kprobe(getuid_fnname, "on_sys_getuid");
+  REQUIRE(res.ok());
+  for (int i = 0; i < 10; i++)
+    REQUIRE(getuid() >= 0);
+  res = bpf.detach_kprobe(getuid_fnname);
+  REQUIRE(res.ok());
+
+  REQUIRE(epoll_wait(epfd, &ev, 1, 1000) == 1);
+  REQUIRE(perf_buffer->consume() >= 10);
+  REQUIRE(seen == 10);
+  close(epfd);
+
+  res = bpf.close_perf_buffer("events");
+  REQUIRE(res.ok());
+}
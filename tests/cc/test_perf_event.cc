@@ -20,6 +20,7 @@
 #include <string>
 
 #include "BPF.h"
+#include "BPFPerfCounters.h"
 #include "catch.hpp"
 
 TEST_CASE("test read perf event", "[bpf_perf_event]") {
@@ -142,3 +143,75 @@ TEST_CASE("test attach perf event", "[bpf_perf_event]") {
   REQUIRE(counter.running <= counter.enabled);
 #endif
 }
+
+TEST_CASE("test read perf event group", "[bpf_perf_event]") {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 15, 0)
+  const std::string BPF_PROGRAM = R"(
+    BPF_PERF_ARRAY(cpu_clock, NUM_CPUS);
+    BPF_PERF_ARRAY(faults, NUM_CPUS);
+    BPF_HASH(counters, int, struct bpf_perf_event_value, 2);
+
+    int on_sys_getuid(void *ctx) {
+      u32 cpu = bpf_get_smp_processor_id();
+      struct bpf_perf_event_value c = {0}, f = {0};
+      if (cpu_clock.perf_counter_value(cpu, &c, sizeof(c)) ||
+          faults.perf_counter_value(cpu, &f, sizeof(f)))
+        return 0;
+      int key = 0;
+      counters.update(&key, &c);
+      key = 1;
+      counters.update(&key, &f);
+      return 0;
+    }
+  )";
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(
+      BPF_PROGRAM,
+      {"-DNUM_CPUS=" + std::to_string(sysconf(_SC_NPROCESSORS_ONLN))}, {});
+  REQUIRE(res.ok());
+  res = bpf.open_perf_event_group(
+      {"cpu_clock", "faults"},
+      {{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_CLOCK},
+       {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS}});
+  REQUIRE(res.ok());
+  res = bpf.open_perf_event_group({"cpu_clock"}, {});
+  REQUIRE(!res.ok());
+
+  std::string getuid_fnname = bpf.get_syscall_fnname("getuid");
+  res = bpf.attach_kprobe(getuid_fnname, "on_sys_getuid");
+  REQUIRE(res.ok());
+  REQUIRE(getuid() >= 0);
+  res = bpf.detach_kprobe(getuid_fnname);
+  REQUIRE(res.ok());
+  REQUIRE(bpf.close_perf_event("faults").ok());
+  REQUIRE(bpf.close_perf_event("cpu_clock").ok());
+
+  auto counters =
+      bpf.get_hash_table<int, struct bpf_perf_event_value>("counters");
+  auto clock = counters[0], faults = counters[1];
+  REQUIRE(clock.enabled > 0);
+  REQUIRE(faults.enabled > 0);
+  REQUIRE(faults.running <= faults.enabled);
+#endif
+}
+
+TEST_CASE("test read perf counters of the thread", "[bpf_perf_event]") {
+  ebpf::BPFPerfCounters counters;
+  std::vector<uint64_t> before, after;
+  REQUIRE(!counters.read(before).ok());
+
+  auto res = counters.open({{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+                            {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS}});
+  REQUIRE(res.ok());
+  REQUIRE(counters.read(before).ok());
+  REQUIRE(before.size() == 2);
+  // Software events have no hardware counter to read
+  REQUIRE(!counters.used_rdpmc());
+
+  std::vector<char> touched(1 << 20, 1);
+  REQUIRE(counters.read(after).ok());
+  REQUIRE(after[0] > before[0]);
+  REQUIRE(after[1] >= before[1]);
+}
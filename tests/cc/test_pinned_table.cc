@@ -84,4 +84,65 @@ TEST_CASE("test pinned table", "[pinned_table]") {
     REQUIRE(umount("/sys/fs/bpf") == 0);
   }
 }
+
+TEST_CASE("test pin and restore a module", "[pinned_table]") {
+  bool mounted = false;
+  if (system("mount | grep /sys/fs/bpf")) {
+    REQUIRE(system("mkdir -p /sys/fs/bpf") == 0);
+    REQUIRE(system("mount -o nosuid,nodev,noexec,mode=700 -t bpf bpf /sys/fs/bpf") == 0);
+    mounted = true;
+  }
+  const std::string dir = "/sys/fs/bpf/test_pin_all";
+
+  {
+    const std::string BPF_PROGRAM = R"(
+      BPF_HASH(counts, u32, u64, 1024);
+      int on_sys_getuid(void *ctx) {
+        counts.increment(bpf_get_current_pid_tgid() >> 32);
+        return 0;
+      }
+    )";
+
+    ebpf::BPF bpf;
+    ebpf::StatusTuple res(0);
+    res = bpf.init(BPF_PROGRAM);
+    REQUIRE(res.ok());
+    int fd;
+    res = bpf.load_func("on_sys_getuid", BPF_PROG_TYPE_KPROBE, fd);
+    REQUIRE(res.ok());
+    auto counts = bpf.get_hash_table<uint32_t, uint64_t>("counts");
+    REQUIRE(counts.update_value(1, 42).ok());
+
+    res = bpf.pin_all(dir);
+    REQUIRE(res.ok());
+  }
+
+  {
+    ebpf::BPF bpf;
+    ebpf::StatusTuple res(0);
+    res = bpf.restore(dir);
+    REQUIRE(res.ok());
+
+    // The table kept its contents, and the function attaches as is
+    auto counts = bpf.get_hash_table<uint32_t, uint64_t>("counts");
+    uint64_t val;
+    REQUIRE(counts.get_value(1, val).ok());
+    REQUIRE(val == 42);
+
+    std::string getuid_fnname = bpf.get_syscall_fnname("getuid");
+    res = bpf.attach_kprobe(getuid_fnname, "on_sys_getuid");
+    REQUIRE(res.ok());
+    getuid();
+    REQUIRE(counts.get_value(getpid(), val).ok());
+    REQUIRE(val >= 1);
+  }
+
+  REQUIRE(system(("rm -rf " + dir).c_str()) == 0);
+  if (mounted) {
+    REQUIRE(umount("/sys/fs/bpf") == 0);
+  }
+
+  ebpf::BPF bpf;
+  REQUIRE(!bpf.restore(dir).ok());
+}
 #endif
@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <unistd.h>
+
 #include "BPF.h"
 
 #include "catch.hpp"
@@ -63,3 +65,89 @@ TEST_CASE("test prog table", "[prog_table]") {
     REQUIRE(!res.ok());
   }
 }
+
+TEST_CASE("test xdp chain", "[prog_table]") {
+  const std::string BPF_PROGRAM = R"(
+    BPF_PROG_ARRAY(xdp_chain, 4);
+    int dispatch(struct xdp_md *ctx) {
+      xdp_chain.call(ctx, 0);
+      return XDP_PASS;
+    }
+    int first(struct xdp_md *ctx) {
+      xdp_chain.call(ctx, 1);
+      return XDP_PASS;
+    }
+    int second(struct xdp_md *ctx) {
+      return XDP_PASS;
+    }
+  )";
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+
+  res = bpf.attach_xdp_chain("lo", "dispatch", "xdp_chain",
+                             {"first", "second"}, ebpf::XdpMode::SKB);
+  REQUIRE(res.ok());
+
+  // The hook is taken, by this object or anyone else
+  res = bpf.attach_xdp("lo", "second", ebpf::XdpMode::SKB);
+  REQUIRE(!res.ok());
+  res = bpf.attach_xdp_chain("lo", "dispatch", "xdp_chain", {"first"},
+                             ebpf::XdpMode::HW);
+  REQUIRE(!res.ok());
+
+  res = bpf.detach_xdp("lo");
+  REQUIRE(res.ok());
+  res = bpf.detach_xdp("lo");
+  REQUIRE(!res.ok());
+
+  res = bpf.attach_xdp("lo", "second", ebpf::XdpMode::SKB);
+  REQUIRE(res.ok());
+  // Left for detach_all()
+}
+
+TEST_CASE("test swappable function", "[prog_table]") {
+  const std::string BPF_PROGRAM = R"(
+    BPF_ARRAY(version, u64, 1);
+    int on_sys_getuid(void *ctx) {
+      version.increment(0, 1);
+      return 0;
+    }
+    int on_sys_getuid_v2(void *ctx) {
+      version.increment(0, 1000);
+      return 0;
+    }
+  )";
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+
+  res = bpf.replace_func("on_sys_getuid", "on_sys_getuid_v2");
+  REQUIRE(!res.ok());
+
+  res = bpf.load_func_swappable("on_sys_getuid", BPF_PROG_TYPE_KPROBE);
+  REQUIRE(res.ok());
+  std::string getuid_fnname = bpf.get_syscall_fnname("getuid");
+  res = bpf.attach_kprobe(getuid_fnname, "on_sys_getuid");
+  REQUIRE(res.ok());
+
+  auto version = bpf.get_array_table<uint64_t>("version");
+  uint64_t before, after;
+  getuid();
+  REQUIRE(version.get_value(0, before).ok());
+  REQUIRE(before >= 1);
+
+  // The kprobe stays attached, and the map keeps its value
+  res = bpf.replace_func("on_sys_getuid", "on_sys_getuid_v2");
+  REQUIRE(res.ok());
+  getuid();
+  REQUIRE(version.get_value(0, after).ok());
+  REQUIRE(after >= before + 1000);
+
+  res = bpf.detach_kprobe(getuid_fnname);
+  REQUIRE(res.ok());
+}
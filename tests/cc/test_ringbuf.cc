@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2021 Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <linux/version.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string>
+
+#include "BPF.h"
+#include "catch.hpp"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+TEST_CASE("test ring buffer", "[ringbuf]") {
+  const std::string BPF_PROGRAM = R"(
+    BPF_RINGBUF_OUTPUT(events, 8);
+    BPF_HASH(not_a_ringbuf, int, int, 1);
+
+    struct event_t {
+      u32 pid;
+      u64 seq;
+    };
+
+    int on_sys_getuid(void *ctx) {
+      struct event_t e = {};
+      e.pid = bpf_get_current_pid_tgid() >> 32;
+      e.seq = 42;
+      events.ringbuf_output(&e, sizeof(e), 0);
+      return 0;
+    }
+  )";
+
+  struct event_t {
+    uint32_t pid;
+    uint64_t seq;
+  };
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+
+  res = bpf.open_ring_buffer("not_a_ringbuf", nullptr);
+  REQUIRE(!res.ok());
+
+  int seen = 0;
+  res = bpf.open_ring_buffer<event_t>(
+      "events", [&seen](const event_t& e) {
+        if (e.pid == (uint32_t)getpid() && e.seq == 42)
+          seen++;
+        return 0;
+      });
+  REQUIRE(res.ok());
+  REQUIRE(bpf.get_ring_buffer("events") != nullptr);
+
+  std::string getuid_fnname = bpf.get_syscall_fnname("getuid");
+  res = bpf.attach_kprobe(getuid_fnname, "on_sys_getuid");
+  REQUIRE(res.ok());
+  REQUIRE(getuid() >= 0);
+  REQUIRE(bpf.poll_ring_buffer("events", 1000) >= 0);
+  REQUIRE(getuid() >= 0);
+  REQUIRE(bpf.get_ring_buffer("events")->busy_poll(1000) >= 0);
+  // as an event loop would
+  REQUIRE(getuid() >= 0);
+  struct pollfd pfd = {bpf.get_ring_buffer("events")->epoll_fd(), POLLIN, 0};
+  REQUIRE(pfd.fd >= 0);
+  REQUIRE(::poll(&pfd, 1, 1000) == 1);
+  REQUIRE(bpf.get_ring_buffer("events")->consume() >= 1);
+  res = bpf.detach_kprobe(getuid_fnname);
+  REQUIRE(res.ok());
+  REQUIRE(seen >= 3);
+
+  res = bpf.close_ring_buffer("events");
+  REQUIRE(res.ok());
+  REQUIRE(bpf.poll_ring_buffer("events", 0) == -1);
+}
+#endif
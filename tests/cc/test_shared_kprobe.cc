@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <unistd.h>
+#include <fstream>
+#include <string>
+
+#include "BPF.h"
+#include "catch.hpp"
+
+// Lines of kprobe_events for event, created by this process
+static int kprobe_event_count(const std::string& event) {
+  std::ifstream f("/sys/kernel/debug/tracing/kprobe_events");
+  std::string name = "kprobes/" + event + "_bcc_" + std::to_string(getpid());
+  std::string line;
+  int n = 0;
+  while (std::getline(f, line))
+    if (line.find(name + " ") != std::string::npos)
+      n++;
+  return n;
+}
+
+static uint64_t hits(ebpf::BPF& bpf) {
+  uint64_t v = 0;
+  auto res = bpf.get_array_table<uint64_t>("hits").get_value(0, v);
+  REQUIRE(res.ok());
+  return v;
+}
+
+TEST_CASE("test shared kprobe", "[shared_kprobe]") {
+  const std::string BPF_PROGRAM = R"(
+    BPF_ARRAY(hits, u64, 1);
+    int on_sys_getuid(void *ctx) {
+      if (bpf_get_current_pid_tgid() >> 32 == TGID)
+        hits.atomic_increment(0);
+      return 0;
+    }
+  )";
+  std::string program = BPF_PROGRAM;
+  program.replace(program.find("TGID"), 4, std::to_string(getpid()));
+
+  ebpf::BPF bpf1, bpf2;
+  ebpf::StatusTuple res(0);
+  res = bpf1.init(program);
+  REQUIRE(res.ok());
+  res = bpf2.init(program);
+  REQUIRE(res.ok());
+
+  std::string getuid_fnname = bpf1.get_syscall_fnname("getuid");
+  std::string event = "p_" + getuid_fnname;
+  res = bpf1.attach_kprobe_shared(getuid_fnname, "on_sys_getuid");
+  REQUIRE(res.ok());
+  res = bpf2.attach_kprobe_shared(getuid_fnname, "on_sys_getuid");
+  REQUIRE(res.ok());
+  res = bpf2.attach_kprobe_shared(getuid_fnname, "on_sys_getuid");
+  REQUIRE(!res.ok());
+
+  // one kprobe runs the programs of both objects
+  REQUIRE(kprobe_event_count(event) == 1);
+  for (int i = 0; i < 10; i++)
+    getuid();
+  REQUIRE(hits(bpf1) == 10);
+  REQUIRE(hits(bpf2) == 10);
+
+  // the kprobe stays while it is attached in any object
+  res = bpf1.detach_kprobe(getuid_fnname);
+  REQUIRE(res.ok());
+  REQUIRE(kprobe_event_count(event) == 1);
+  getuid();
+  REQUIRE(hits(bpf1) == 10);
+  REQUIRE(hits(bpf2) == 11);
+  res = bpf1.attach_kprobe_shared(getuid_fnname, "on_sys_getuid", 4);
+  REQUIRE(!res.ok());
+
+  res = bpf1.attach_kprobe_shared(getuid_fnname, "on_sys_getuid");
+  REQUIRE(res.ok());
+  res = bpf2.detach_all();
+  REQUIRE(res.ok());
+  REQUIRE(kprobe_event_count(event) == 1);
+  res = bpf1.detach_kprobe(getuid_fnname);
+  REQUIRE(res.ok());
+  REQUIRE(kprobe_event_count(event) == 0);
+}
@@ -73,3 +73,44 @@ TEST_CASE("test shared table", "[shared_table]") {
   REQUIRE(res.ok());
   REQUIRE(v3 == 42);  // value should still be 42
 }
+
+TEST_CASE("test published table storage", "[shared_table]") {
+  const std::string sock_path = "/tmp/bcc_test_published_tables.sock";
+  const std::string BPF_PUBLISHER = R"(
+BPF_TABLE_PUBLIC("hash", int, int, mypubtable, 128);
+)";
+  const std::string BPF_READER = R"(
+BPF_TABLE("extern", int, int, mypubtable, 128);
+)";
+
+  auto published = ebpf::createPublishedTableStorage(sock_path);
+  REQUIRE(published);
+  ebpf::BPF publisher(0, published.get());
+  ebpf::StatusTuple res = publisher.init(BPF_PUBLISHER);
+  REQUIRE(res.ok());
+  auto t_pub = publisher.get_hash_table<int, int>("mypubtable");
+  res = t_pub.update_value(7, 42);
+  REQUIRE(res.ok());
+
+  // attach to the published table without compiling anything
+  auto remote = ebpf::createRemoteTableStorage(sock_path);
+  REQUIRE(remote);
+  ebpf::TableStorage::iterator it;
+  REQUIRE(remote->Find(ebpf::Path({"mypubtable"}), it));
+  ebpf::BPFHashTable<int, int> t_remote(it->second);
+  int v;
+  res = t_remote.get_value(7, v);
+  REQUIRE(res.ok());
+  REQUIRE(v == 42);
+
+  // or through an extern table of another module
+  ebpf::BPF reader(0, remote.get());
+  res = reader.init(BPF_READER);
+  REQUIRE(res.ok());
+  auto t_reader = reader.get_hash_table<int, int>("mypubtable");
+  res = t_reader.update_value(8, 69);
+  REQUIRE(res.ok());
+  res = t_pub.get_value(8, v);
+  REQUIRE(res.ok());
+  REQUIRE(v == 69);
+}
@@ -21,6 +21,7 @@
 #include <string>
 
 #include "BPF.h"
+#include "BPFSockProxy.h"
 #include "catch.hpp"
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 18, 0)
@@ -107,4 +108,59 @@ int test(struct bpf_sock_ops *skops)
   }
 }
 
+TEST_CASE("test sock proxy", "[sockhash]") {
+  const std::string BPF_PROGRAM = R"(
+BPF_SOCKHASH(socks, struct sock_tuple_key, 16);
+int add_sock(struct bpf_sock_ops *skops) {
+  struct sock_tuple_key key;
+  if (skops->op == BPF_SOCK_OPS_PASSIVE_ESTABLISHED_CB ||
+      skops->op == BPF_SOCK_OPS_ACTIVE_ESTABLISHED_CB) {
+    bpf_sock_ops_tuple(skops, &key);
+    socks.sock_hash_update(skops, &key, BPF_NOEXIST);
+  }
+  return 0;
+}
+int redirect_msg(struct sk_msg_md *msg) {
+  struct sock_tuple_key key;
+  bpf_sk_msg_peer_tuple(msg, &key);
+  return socks.msg_redirect_hash(msg, &key, BPF_F_INGRESS);
+}
+int parse_skb(struct __sk_buff *skb) {
+  return skb->len;
+}
+int redirect_skb(struct __sk_buff *skb) {
+  struct sock_tuple_key key;
+  bpf_sk_skb_peer_tuple(skb, &key);
+  return socks.sk_redirect_hash(skb, &key, BPF_F_INGRESS);
+}
+  )";
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+
+  {
+    ebpf::BPFSockProxy proxy(bpf, "socks");
+    res = proxy.attach_msg_verdict("redirect_msg");
+    REQUIRE(res.ok());
+    res = proxy.attach_skb_verdict("redirect_skb", "parse_skb");
+    REQUIRE(res.ok());
+    res = proxy.attach_sock_ops("/nonexistent/cgroup", "add_sock");
+    REQUIRE(!res.ok());
+
+    ebpf::BPFSockKey key = {};
+    key.family = AF_INET;
+    res = proxy.remove(key);
+    REQUIRE(!res.ok());
+
+    res = proxy.detach_all();
+    REQUIRE(res.ok());
+    res = proxy.attach_msg_verdict("redirect_msg");
+    REQUIRE(res.ok());
+    // detached again on destruction
+  }
+  REQUIRE_THROWS(ebpf::BPFSockProxy(bpf, "nonexistent"));
+}
+
 #endif
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "BPF.h"
+#include "catch.hpp"
+#include "table_header_test.h"
+
+TEST_CASE("test table header text", "[table_header]") {
+  const std::string BPF_PROGRAM = R"(
+    struct key {
+      u32 pid;
+      u64 ts;
+      u8 flags : 3;
+      u8 cpu;
+    } __attribute__((packed));
+    BPF_HASH(starts, struct key, struct task_struct *, 16);
+    BPF_PERCPU_ARRAY(counts, u64, 2);
+    BPF_PERF_OUTPUT(events);
+    int on_sys_getuid(void *ctx) {
+      struct key k = {};
+      struct task_struct *t = (void *)bpf_get_current_task();
+      starts.update(&k, &t);
+      return 0;
+    }
+  )";
+
+  std::string header;
+  auto res = ebpf::BPF::table_header(BPF_PROGRAM, "gen", header);
+  REQUIRE(res.ok());
+
+  REQUIRE(header.find("namespace gen {") != std::string::npos);
+  REQUIRE(header.find("struct __attribute__((packed)) key {") !=
+          std::string::npos);
+  REQUIRE(header.find("uint8_t flags : 3;") != std::string::npos);
+  REQUIRE(header.find("static_assert(sizeof(key) == 14") != std::string::npos);
+  // Pointers are kept as kernel addresses, task_struct isn't declared
+  REQUIRE(header.find("struct task_struct") == std::string::npos);
+  REQUIRE(header.find("inline ebpf::BPFHashTable<key, uint64_t> starts(") !=
+          std::string::npos);
+  REQUIRE(header.find("inline ebpf::BPFPercpuArrayTable<uint64_t> counts(") !=
+          std::string::npos);
+  // No typed accessor for perf buffers
+  REQUIRE(header.find(" events(") == std::string::npos);
+}
+
+TEST_CASE("test generated table header", "[table_header]") {
+  static_assert(sizeof(table_header_test::flow) == 16, "");
+  static_assert(sizeof(table_header_test::flow_stats_t) == 32, "");
+
+  std::ifstream src(TABLE_HEADER_TEST_SRC);
+  std::stringstream text;
+  text << src.rdbuf();
+
+  ebpf::BPF bpf;
+  auto res = bpf.init(text.str());
+  REQUIRE(res.ok());
+  std::string getuid_fnname = bpf.get_syscall_fnname("getuid");
+  res = bpf.attach_kprobe(getuid_fnname, "on_sys_getuid");
+  REQUIRE(res.ok());
+  REQUIRE(getuid() >= 0);
+  res = bpf.detach_kprobe(getuid_fnname);
+  REQUIRE(res.ok());
+
+  auto flows = table_header_test::flows(bpf);
+  auto entries = flows.get_table_offline();
+  REQUIRE(entries.size() == 1);
+  REQUIRE(entries[0].first.sport == 1);
+  REQUIRE(entries[0].first.proto == 6);
+  REQUIRE(entries[0].second.packets >= 1);
+
+  uint64_t total;
+  res = table_header_test::totals(bpf).get_value(0, total);
+  REQUIRE(res.ok());
+  REQUIRE(total == 0);
+}
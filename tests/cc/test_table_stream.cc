@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <unistd.h>
+#include <cstring>
+
+#include "BPF.h"
+#include "BPFTableStream.h"
+#include "catch.hpp"
+
+static bool same_contents(ebpf::BPFHashTable<int, uint64_t> &t,
+                          const ebpf::BPFTableStreamDecoder::Table *table) {
+  auto entries = t.get_table_offline();
+  if (!table || entries.size() != table->entries.size())
+    return false;
+  for (const auto &e : entries) {
+    std::string key(reinterpret_cast<const char *>(&e.first), sizeof(e.first));
+    auto it = table->entries.find(key);
+    if (it == table->entries.end() ||
+        std::memcmp(it->second.data(), &e.second, sizeof(e.second)))
+      return false;
+  }
+  return true;
+}
+
+TEST_CASE("test table stream", "[table_stream]") {
+  const std::string BPF_PROGRAM = R"(
+    BPF_TABLE("hash", int, u64, counts, 1024);
+  )";
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+  auto t = bpf.get_hash_table<int, uint64_t>("counts");
+
+  std::vector<std::vector<uint8_t>> frames;
+  bool fail = false;
+  ebpf::BPFTableStreamer streamer(
+      std::unique_ptr<ebpf::BPFStreamTransport>(
+          new ebpf::BPFCallbackStreamTransport(
+              [&](const uint8_t *data, size_t size) {
+                if (fail)
+                  return ebpf::StatusTuple(-1, "collector unreachable");
+                frames.emplace_back(data, data + size);
+                return ebpf::StatusTuple::OK();
+              })),
+      0);
+  res = bpf.add_stream_table(streamer, "counts");
+  REQUIRE(res.ok());
+  res = bpf.add_stream_table(streamer, "nosuchtable");
+  REQUIRE(!res.ok());
+
+  for (int i = 0; i < 100; i++) {
+    res = t.update_value(i, 1000000 + i);
+    REQUIRE(res.ok());
+  }
+  res = streamer.push(1);
+  REQUIRE(res.ok());
+  size_t keyframe_size = streamer.last_frame_size();
+
+  ebpf::BPFTableStreamDecoder decoder;
+  res = decoder.decode(frames.back().data(), frames.back().size());
+  REQUIRE(res.ok());
+  REQUIRE(decoder.synced());
+  REQUIRE(decoder.timestamp_ns() == 1);
+  REQUIRE(same_contents(t, decoder.find("counts")));
+
+  // nothing changed, only the frame header is sent
+  res = streamer.push(2);
+  REQUIRE(res.ok());
+  REQUIRE(streamer.last_frame_size() < 8);
+  res = decoder.decode(frames.back().data(), frames.back().size());
+  REQUIRE(res.ok());
+
+  // small increments are a byte per counter, decrements included
+  for (int i = 0; i < 100; i++) {
+    res = t.update_value(i, 1000000 + i + (i % 2 ? 3 : -3));
+    REQUIRE(res.ok());
+  }
+  res = t.remove_value(7);
+  REQUIRE(res.ok());
+  res = t.update_value(500, 5);
+  REQUIRE(res.ok());
+  res = streamer.push(3);
+  REQUIRE(res.ok());
+  REQUIRE(streamer.last_frame_size() < keyframe_size);
+  res = decoder.decode(frames.back().data(), frames.back().size());
+  REQUIRE(res.ok());
+  REQUIRE(same_contents(t, decoder.find("counts")));
+
+  SECTION("missed frame") {
+    res = t.update_value(1, 42);
+    REQUIRE(res.ok());
+    res = streamer.push(4);
+    REQUIRE(res.ok());
+    res = t.update_value(2, 42);
+    REQUIRE(res.ok());
+    res = streamer.push(5);
+    REQUIRE(res.ok());
+
+    // skipping frame 4 waits for a keyframe
+    res = decoder.decode(frames.back().data(), frames.back().size());
+    REQUIRE(!res.ok());
+    REQUIRE(!decoder.synced());
+
+    streamer.request_keyframe();
+    res = streamer.push(6);
+    REQUIRE(res.ok());
+    res = decoder.decode(frames.back().data(), frames.back().size());
+    REQUIRE(res.ok());
+    REQUIRE(same_contents(t, decoder.find("counts")));
+  }
+
+  SECTION("transport failure") {
+    fail = true;
+    res = t.update_value(1, 42);
+    REQUIRE(res.ok());
+    res = streamer.push(4);
+    REQUIRE(!res.ok());
+    fail = false;
+
+    // the next frame is a keyframe the decoder can resync from
+    res = streamer.push(5);
+    REQUIRE(res.ok());
+    res = decoder.decode(frames.back().data(), frames.back().size());
+    REQUIRE(res.ok());
+    REQUIRE(same_contents(t, decoder.find("counts")));
+  }
+
+  SECTION("fd transport") {
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+    ebpf::BPFTableStreamer fd_streamer(
+        std::unique_ptr<ebpf::BPFStreamTransport>(
+            new ebpf::BPFFdStreamTransport(fds[1])));
+    res = bpf.add_stream_table(fd_streamer, "counts");
+    REQUIRE(res.ok());
+    res = fd_streamer.push(7);
+    REQUIRE(res.ok());
+    close(fds[1]);
+
+    uint8_t hdr[4];
+    REQUIRE(read(fds[0], hdr, sizeof(hdr)) == sizeof(hdr));
+    size_t size = hdr[0] | hdr[1] << 8 | hdr[2] << 16 | hdr[3] << 24;
+    REQUIRE(size == fd_streamer.last_frame_size());
+    std::vector<uint8_t> frame(size);
+    size_t got = 0;
+    ssize_t n;
+    while (got < size && (n = read(fds[0], &frame[got], size - got)) > 0)
+      got += n;
+    close(fds[0]);
+    REQUIRE(got == size);
+
+    ebpf::BPFTableStreamDecoder fd_decoder;
+    res = fd_decoder.decode(frame.data(), frame.size());
+    REQUIRE(res.ok());
+    REQUIRE(fd_decoder.timestamp_ns() == 7);
+    REQUIRE(same_contents(t, fd_decoder.find("counts")));
+  }
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstdint>
+
+#include "BPF.h"
+#include "BPFTaskFilter.h"
+#include "catch.hpp"
+
+TEST_CASE("test task filter", "[task_filter]") {
+  const std::string BPF_PROGRAM = R"(
+BPF_ARRAY(calls, u64, 1);
+int on_sys_getuid(void *ctx) {
+  int zero = 0;
+  if (task_should_be_filtered())
+    return 0;
+  calls.increment(zero);
+  return 0;
+}
+)";
+
+  ebpf::BPF bpf;
+  ebpf::BPFTaskFilter filter(bpf);
+  auto res = filter.set_pids({getpid()});
+  REQUIRE(!res.ok());
+
+  res = bpf.init(ebpf::BPFTaskFilter::program() + BPF_PROGRAM);
+  REQUIRE(res.ok());
+  std::string getuid_fnname = bpf.get_syscall_fnname("getuid");
+  res = bpf.attach_kprobe(getuid_fnname, "on_sys_getuid");
+  REQUIRE(res.ok());
+
+  auto calls = bpf.get_array_table<uint64_t>("calls");
+  auto count = [&]() {
+    uint64_t value = 0;
+    REQUIRE(calls.get_value(0, value).ok());
+    return value;
+  };
+
+  // our calls pass once our pid is in the set
+  res = filter.set_pids({getpid(), 1});
+  REQUIRE(res.ok());
+  uint64_t before = count();
+  for (int i = 0; i < 10; i++)
+    syscall(SYS_getuid);
+  REQUIRE(count() >= before + 10);
+
+  // and are filtered out once it is not, without recompiling
+  res = filter.set_pids({1});
+  REQUIRE(res.ok());
+  auto pids = bpf.get_hash_table<uint32_t, uint8_t>("task_filter_pids")
+                  .get_table_offline();
+  REQUIRE(pids.size() == 1);
+  before = count();
+  for (int i = 0; i < 10; i++)
+    syscall(SYS_getuid);
+  REQUIRE(count() == before);
+
+  // the command name is another set, both need to match
+  res = filter.set_pids({getpid()});
+  REQUIRE(res.ok());
+  res = filter.set_comms({"no_such_comm"});
+  REQUIRE(res.ok());
+  before = count();
+  syscall(SYS_getuid);
+  REQUIRE(count() == before);
+
+  res = filter.clear();
+  REQUIRE(res.ok());
+  before = count();
+  syscall(SYS_getuid);
+  REQUIRE(count() > before);
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <linux/version.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstdint>
+#include <thread>
+
+#include "BPFTaskIter.h"
+#include "catch.hpp"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+
+TEST_CASE("test task iterator", "[task_iter]") {
+  ebpf::BPFTaskIter iter;
+  std::vector<ebpf::BPFTaskInfo> tasks;
+
+  auto res = iter.tasks(tasks);
+  REQUIRE(!res.ok());
+  res = iter.init();
+  REQUIRE(res.ok());
+
+  res = iter.tasks(tasks);
+  REQUIRE(res.ok());
+  bool found = false;
+  for (const auto& task : tasks) {
+    // processes only
+    REQUIRE(task.pid == task.tid);
+    if (task.pid == getpid()) {
+      found = true;
+      REQUIRE(task.ppid == getppid());
+      REQUIRE(task.uid == getuid());
+    }
+  }
+  REQUIRE(found);
+
+  // a second thread shows up with threads, and pid filters out the rest
+  pid_t tid = 0;
+  bool done = false;
+  std::thread t([&]() {
+    tid = syscall(SYS_gettid);
+    while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE))
+      usleep(1000);
+  });
+  while (!__atomic_load_n(&tid, __ATOMIC_ACQUIRE))
+    usleep(1000);
+  res = iter.tasks(tasks, true, getpid());
+  __atomic_store_n(&done, true, __ATOMIC_RELEASE);
+  t.join();
+  REQUIRE(res.ok());
+  REQUIRE(tasks.size() >= 2);
+  found = false;
+  for (const auto& task : tasks) {
+    REQUIRE(task.pid == getpid());
+    if (task.tid == tid)
+      found = true;
+  }
+  REQUIRE(found);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+  // the code running this test is in an executable mapping of ours
+  std::vector<ebpf::BPFVmaInfo> vmas;
+  res = iter.vmas(vmas, getpid(), true);
+  REQUIRE(res.ok());
+  REQUIRE(!vmas.empty());
+  auto pc = reinterpret_cast<uintptr_t>(&getpid);
+  found = false;
+  for (const auto& vma : vmas) {
+    REQUIRE(vma.pid == getpid());
+    REQUIRE((vma.flags & 0x4));
+    if (vma.start <= pc && pc < vma.end) {
+      found = true;
+      REQUIRE(vma.inode != 0);
+    }
+  }
+  REQUIRE(found);
+#endif
+}
+
+#endif
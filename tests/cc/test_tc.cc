@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/inet.h>
+#include <linux/version.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+
+#include "BPF.h"
+#include "catch.hpp"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+
+TEST_CASE("test tc attach and queue stats", "[tc]") {
+  const std::string BPF_PROGRAM = R"(
+BPF_QUEUE_STATS(queue_stats, 4);
+int count(struct __sk_buff *skb) {
+  u32 queue = skb->queue_mapping;
+  struct bpf_queue_stats *stats = queue_stats.lookup(&queue);
+  if (stats) {
+    stats->packets++;
+    stats->bytes += skb->len;
+  }
+  return TC_ACT_OK;
+}
+  )";
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+
+  auto stats_table = bpf.get_queue_stats_table("queue_stats");
+  REQUIRE(stats_table.capacity() == 4);
+
+  res = bpf.attach_tc("lo", ebpf::TcDirection::EGRESS, "count");
+  REQUIRE(res.ok());
+  res = bpf.attach_tc("lo", ebpf::TcDirection::EGRESS, "count");
+  REQUIRE(!res.ok());
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  REQUIRE(fd >= 0);
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(9);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  for (int i = 0; i < 10; i++)
+    sendto(fd, "x", 1, 0, reinterpret_cast<struct sockaddr*>(&addr),
+           sizeof(addr));
+  close(fd);
+
+  auto stats = stats_table.get_queue_stats();
+  REQUIRE(stats.size() == 4);
+  uint64_t packets = 0, bytes = 0;
+  for (const auto& s : stats) {
+    packets += s.packets;
+    bytes += s.bytes;
+  }
+  REQUIRE(packets >= 10);
+  REQUIRE(bytes >= packets);
+
+  res = bpf.detach_tc("lo", ebpf::TcDirection::EGRESS);
+  REQUIRE(res.ok());
+  res = bpf.detach_tc("lo", ebpf::TcDirection::EGRESS);
+  REQUIRE(!res.ok());
+
+  res = bpf.attach_tc("lo", ebpf::TcDirection::INGRESS, "count", 2);
+  REQUIRE(res.ok());
+  // Left for detach_all()
+}
+
+#endif
@@ -74,6 +74,23 @@ TEST_CASE("test finding a probe in our own process", "[usdt]") {
   }
 }
 
+TEST_CASE("test reusing probe notes across contexts", "[usdt]") {
+  USDT::Context ctx(getpid());
+  USDT::Context other_ctx(getpid());
+  REQUIRE(ctx.num_probes() >= 1);
+  REQUIRE(other_ctx.num_probes() == ctx.num_probes());
+
+  auto probe = ctx.get("sample_probe_1");
+  auto other_probe = other_ctx.get("sample_probe_1");
+  REQUIRE(probe);
+  REQUIRE(other_probe);
+  // each context still gets its own probes and locations
+  REQUIRE(probe != other_probe);
+  REQUIRE(other_probe->num_locations() == probe->num_locations());
+  REQUIRE(other_probe->address() == probe->address());
+  REQUIRE(other_probe->num_arguments() == probe->num_arguments());
+}
+
 TEST_CASE("test probe's attributes with C++ API", "[usdt]") {
     const ebpf::USDT u("/proc/self/exe", "libbcc_test", "sample_probe_1", "on_event");
 
@@ -112,6 +129,52 @@ TEST_CASE("test fine probes in our own binary with C++ API", "[usdt]") {
     REQUIRE(res.ok());
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+TEST_CASE("test reading arguments through cookies with C++ API", "[usdt]") {
+    ebpf::BPF bpf;
+    ebpf::USDT u("/proc/self/exe", "libbcc_test", "sample_probe_1", "on_event");
+    u.set_cookie_args(true);
+    const std::string BPF_PROGRAM = R"(
+BPF_ARRAY(args, u64, 2);
+int on_event(struct pt_regs *ctx) {
+  int an_int = 0, zero = 0, one = 1;
+  u64 a_pointer = 0, value;
+  if (bpf_usdt_readarg(1, ctx, &an_int) || bpf_usdt_readarg(2, ctx, &a_pointer))
+    return 0;
+  value = an_int;
+  args.update(&zero, &value);
+  args.update(&one, &a_pointer);
+  return 0;
+}
+)";
+
+    auto res = bpf.init(BPF_PROGRAM, {}, {u});
+    REQUIRE(res.ok());
+    auto args = bpf.get_array_table<uint64_t>("args");
+    uint64_t value;
+
+    res = bpf.attach_usdt(u);
+    REQUIRE(res.ok());
+    REQUIRE(a_probed_function() == 23 + ::getpid());
+    REQUIRE(args.get_value(0, value).ok());
+    REQUIRE(value == (uint64_t)(23 + ::getpid()));
+    REQUIRE(args.get_value(1, value).ok());
+    REQUIRE(value != 0);
+    res = bpf.detach_usdt(u);
+    REQUIRE(res.ok());
+
+    // the same program attaches to a given process without recompiling
+    REQUIRE(args.update_value(0, 0).ok());
+    res = bpf.attach_usdt(u, ::getpid());
+    REQUIRE(res.ok());
+    REQUIRE(a_probed_function() != 0);
+    REQUIRE(args.get_value(0, value).ok());
+    REQUIRE(value == (uint64_t)(23 + ::getpid()));
+    res = bpf.detach_usdt(u, ::getpid());
+    REQUIRE(res.ok());
+}
+#endif  // linux version >= 5.15
+
 TEST_CASE("test fine a probe in our Process with C++ API", "[usdt]") {
     ebpf::BPF bpf;
     ebpf::USDT u(::getpid(), "libbcc_test", "sample_probe_1", "on_event");
@@ -126,6 +189,56 @@ TEST_CASE("test fine a probe in our Process with C++ API", "[usdt]") {
     REQUIRE(res.ok());
 }
 
+TEST_CASE("test sharing a probe among pids with C++ API", "[usdt]") {
+    ebpf::BPF bpf;
+    ebpf::USDT u("/proc/self/exe", "libbcc_test", "sample_probe_1", "on_event");
+    const std::string BPF_PROGRAM = R"(
+BPF_HASH(pids, u32, u8);
+BPF_ARRAY(hits, u64, 1);
+int on_event() {
+  u32 tgid = bpf_get_current_pid_tgid() >> 32;
+  if (!pids.lookup(&tgid))
+    return 0;
+  hits.increment(0);
+  return 0;
+}
+)";
+
+    auto res = bpf.init(BPF_PROGRAM, {}, {u});
+    REQUIRE(res.ok());
+    bpf.set_uprobe_pid_table("pids");
+
+    pid_t self = ::getpid(), parent = ::getppid();
+    res = bpf.attach_usdt(u, self);
+    REQUIRE(res.ok());
+    res = bpf.attach_usdt(u, parent);
+    REQUIRE(res.ok());
+    res = bpf.attach_usdt(u, self);
+    REQUIRE(!res.ok());
+
+    auto pids = bpf.get_hash_table<uint32_t, uint8_t>("pids");
+    REQUIRE(pids.get_table_offline().size() == 2);
+
+    auto hits = bpf.get_array_table<uint64_t>("hits");
+    REQUIRE(a_probed_function() != 0);
+    uint64_t count;
+    REQUIRE(hits.get_value(0, count).ok());
+    REQUIRE(count == 1);
+
+    res = bpf.detach_usdt(u, self);
+    REQUIRE(res.ok());
+    REQUIRE(pids.get_table_offline().size() == 1);
+    REQUIRE(a_probed_function() != 0);
+    REQUIRE(hits.get_value(0, count).ok());
+    REQUIRE(count == 1);
+
+    res = bpf.detach_usdt(u, self);
+    REQUIRE(!res.ok());
+    res = bpf.detach_usdt(u, parent);
+    REQUIRE(res.ok());
+    REQUIRE(pids.get_table_offline().empty());
+}
+
 TEST_CASE("test find a probe in our process' shared libs with c++ API", "[usdt]") {
   ebpf::BPF bpf;
   ebpf::USDT u(::getpid(), "libbcc_test", "sample_lib_probe_1", "on_event");
@@ -428,4 +541,26 @@ TEST_CASE("Test uprobe refcnt semaphore activation", "[usdt]") {
 
     REQUIRE(a_probed_function_with_sem() != 0);
 }
+
+TEST_CASE("Test enabling probes with one semaphore update", "[usdt]") {
+    REQUIRE(!FOLLY_SDT_IS_ENABLED(libbcc_test, sample_probe_2));
+
+    {
+      USDT::Context ctx(getpid());
+      REQUIRE(ctx.loaded());
+
+      // unknown probes fail the whole batch
+      REQUIRE(!ctx.enable_probes({{"libbcc_test", "sample_probe_2", "on_event"},
+                                  {"libbcc_test", "no_such_probe", "on_event"}}));
+      REQUIRE(!FOLLY_SDT_IS_ENABLED(libbcc_test, sample_probe_2));
+
+      REQUIRE(ctx.enable_probes({{"libbcc_test", "sample_probe_1", "on_event"},
+                                 {"libbcc_test", "sample_probe_2", "on_event"}}));
+      REQUIRE(FOLLY_SDT_IS_ENABLED(libbcc_test, sample_probe_2));
+      REQUIRE(ctx.get("libbcc_test", "sample_probe_1")->enabled());
+    }
+
+    // the context releases the semaphores when it goes away
+    REQUIRE(!FOLLY_SDT_IS_ENABLED(libbcc_test, sample_probe_2));
+}
 #endif // linux version  >= 4.20
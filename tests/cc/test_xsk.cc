@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <linux/version.h>
+#include <cstring>
+#include <string>
+
+#include "BPF.h"
+#include "BPFXsk.h"
+#include "catch.hpp"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+
+TEST_CASE("test xsk umem and socket", "[xsk]") {
+  const std::string BPF_PROGRAM = R"(
+BPF_XSKMAP(xsks_map, 4);
+int redirect(struct xdp_md *ctx) {
+  return xsks_map.redirect_map(ctx->rx_queue_index, XDP_PASS);
+}
+  )";
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+
+  ebpf::XskUmem umem;
+  res = umem.init(64, 3000);
+  REQUIRE(!res.ok());
+  res = umem.init(64);
+  REQUIRE(res.ok());
+  REQUIRE(umem.free_frame_count() == 64);
+
+  ebpf::XskSocket sock;
+  ebpf::XskSocket::Options opts;
+  opts.copy = true;
+  res = sock.open("lo", 0, umem, opts);
+  REQUIRE(res.ok());
+  REQUIRE(sock.fd() >= 0);
+
+  auto xsks_map = bpf.get_xskmap_table("xsks_map");
+  res = xsks_map.update_value(0, sock.fd());
+  REQUIRE(res.ok());
+
+  SECTION("fill ring") {
+    REQUIRE(umem.fill(16) == 16);
+    REQUIRE(umem.free_frame_count() == 48);
+  }
+
+  SECTION("transmit and complete") {
+    uint64_t addr;
+    REQUIRE(umem.alloc_frames(&addr, 1) == 1);
+    REQUIRE(umem.free_frame_count() == 63);
+    std::memset(umem.data(addr), 0xff, 64);
+
+    struct xdp_desc desc = {};
+    desc.addr = addr;
+    desc.len = 64;
+    REQUIRE(sock.transmit(&desc, 1) == 1);
+    // Copy mode transmits from the wakeup, before it returns
+    REQUIRE(umem.complete(64) == 1);
+    REQUIRE(umem.free_frame_count() == 64);
+  }
+}
+
+#endif
@@ -323,6 +323,22 @@ function TestClang:test_exported_maps()
   local b2 = BPF{text=[[BPF_TABLE("extern", int, int, table1, 10);]]}
 end
 
+function TestClang:test_hash_items()
+  local b = BPF:new{text=[[BPF_HASH(stats, int, u64, 4096);]]}
+  local t = b:get_table("stats")
+  -- more entries than fetched by one batch lookup
+  for i = 1, 3000 do
+    t:set(i, i * 2)
+  end
+
+  local n = 0
+  for k, v in t:items() do
+    assert_equals(tonumber(v), k * 2)
+    n = n + 1
+  end
+  assert_equals(n, 3000)
+end
+
 function TestClang:test_syntax_error()
   assert_error_msg_contains(
     "failed to compile BPF module",
@@ -8,7 +8,8 @@ import random
 import time
 import subprocess
 from bcc.utils import get_online_cpus
-from unittest import main, TestCase
+from unittest import main, skipUnless, TestCase
+from utils import kernel_version_ge
 
 class TestArray(TestCase):
     def test_simple(self):
@@ -38,6 +39,28 @@ class TestArray(TestCase):
         self.assertEqual(t1[-2].value, 37)
         self.assertEqual(t1[-1].value, t1[127].value)
 
+    @skipUnless(kernel_version_ge(5,2), "requires kernel >= 5.2")
+    def test_direct_lookup(self):
+        text = """
+BPF_ARRAY(hits, u64, 1);
+BPF_ARRAY(misses, u64, 1);
+int count(void *ctx) {
+    u32 zero = 0;
+    u64 *val = hits.lookup(&zero);
+    if (val)
+        lock_xadd(val, 1);
+    misses.increment(0);
+    return 0;
+}
+"""
+        b = BPF(text=text, cflags=["-DBCC_DIRECT_ARRAY_LOOKUP"])
+        b.load_func("count", BPF.SOCKET_FILTER)
+        insns = b.dump_func("count")
+        # ld_imm64 with src_reg BPF_PSEUDO_MAP_VALUE, one per map
+        direct = [i for i in range(0, len(insns), 8)
+                  if insns[i] == 0x18 and insns[i + 1] >> 4 == 2]
+        self.assertEqual(len(direct), 2)
+
     def test_perf_buffer(self):
         self.counter = 0
 
@@ -110,5 +133,127 @@ int do_sys_nanosleep(void *ctx) {
         b.cleanup()
         self.assertGreaterEqual(len(self.events), len(online_cpus), 'Received only {}/{} events'.format(len(self.events), len(online_cpus)))
 
+    def test_perf_buffer_background(self):
+        self.events = []
+
+        class Data(ct.Structure):
+            _fields_ = [("cpu", ct.c_ulonglong)]
+
+        def cb(cpu, data, size):
+            self.assertGreater(size, ct.sizeof(Data))
+            event = ct.cast(data, ct.POINTER(Data)).contents
+            self.assertEqual(event.cpu, cpu)
+            self.events.append(event.cpu)
+
+        text = """
+BPF_PERF_OUTPUT(events);
+int do_sys_nanosleep(void *ctx) {
+    struct {
+        u64 cpu;
+    } data = {bpf_get_smp_processor_id()};
+    events.perf_submit(ctx, &data, sizeof(data));
+    return 0;
+}
+"""
+        b = BPF(text=text)
+        b.attach_kprobe(event=b.get_syscall_fnname("nanosleep"),
+                        fn_name="do_sys_nanosleep")
+        b.attach_kprobe(event=b.get_syscall_fnname("clock_nanosleep"),
+                        fn_name="do_sys_nanosleep")
+        b["events"].open_perf_buffer(cb, background=True)
+        # starts the polling thread
+        b.perf_buffer_poll(0)
+        online_cpus = get_online_cpus()
+        for cpu in online_cpus:
+            subprocess.call(['taskset', '-c', str(cpu), 'sleep', '0.1'])
+        for _ in range(10):
+            if len(self.events) >= len(online_cpus):
+                break
+            b.perf_buffer_poll(100)
+        b.cleanup()
+        self.assertGreaterEqual(len(self.events), len(online_cpus))
+
+    def test_perf_buffer_batch(self):
+        self.events = []
+
+        class Data(ct.Structure):
+            _fields_ = [("cpu", ct.c_ulonglong)]
+
+        def cb(cpu, data, offsets):
+            for i in range(len(offsets) - 1):
+                event = data[offsets[i]:offsets[i + 1]]
+                self.assertGreater(len(event), ct.sizeof(Data))
+                self.events.append(Data.from_buffer_copy(event[:ct.sizeof(Data)]))
+
+        text = """
+BPF_PERF_OUTPUT(events);
+int do_sys_nanosleep(void *ctx) {
+    struct {
+        u64 cpu;
+    } data = {bpf_get_smp_processor_id()};
+    events.perf_submit(ctx, &data, sizeof(data));
+    return 0;
+}
+"""
+        b = BPF(text=text)
+        b.attach_kprobe(event=b.get_syscall_fnname("nanosleep"),
+                        fn_name="do_sys_nanosleep")
+        b.attach_kprobe(event=b.get_syscall_fnname("clock_nanosleep"),
+                        fn_name="do_sys_nanosleep")
+        b["events"].open_perf_buffer(cb, batch=True)
+        online_cpus = get_online_cpus()
+        for cpu in online_cpus:
+            subprocess.call(['taskset', '-c', str(cpu), 'sleep', '0.1'])
+        b.perf_buffer_poll()
+        b.cleanup()
+        self.assertGreaterEqual(len(self.events), len(online_cpus))
+        for event in self.events:
+            self.assertIn(event.cpu, online_cpus)
+
+    def test_perf_buffer_batch_unpack(self):
+        self.events = []
+
+        def cb(cpu, data, offsets):
+            for i in range(len(offsets) - 1):
+                self.events.append(unpack(data, offsets[i]))
+
+        text = """
+BPF_PERF_OUTPUT(events);
+int do_sys_nanosleep(void *ctx) {
+    struct {
+        u32 pid;
+        u64 cpu;
+        char comm[16];
+        u8 one;
+    } data = {};
+    data.pid = bpf_get_current_pid_tgid() >> 32;
+    data.cpu = bpf_get_smp_processor_id();
+    bpf_get_current_comm(&data.comm, sizeof(data.comm));
+    data.one = 1;
+    events.perf_submit(ctx, &data, sizeof(data));
+    return 0;
+}
+"""
+        b = BPF(text=text)
+        st, names = b["events"].event_struct()
+        self.assertEqual(names, ["pid", "cpu", "comm", "one"])
+        self.assertEqual(st.size, 4 + 4 + 8 + 16 + 1)
+        unpack = b["events"].event_unpacker(["one", "cpu", "comm"])
+        b.attach_kprobe(event=b.get_syscall_fnname("nanosleep"),
+                        fn_name="do_sys_nanosleep")
+        b.attach_kprobe(event=b.get_syscall_fnname("clock_nanosleep"),
+                        fn_name="do_sys_nanosleep")
+        b["events"].open_perf_buffer(cb, batch=True)
+        online_cpus = get_online_cpus()
+        for cpu in online_cpus:
+            subprocess.call(['taskset', '-c', str(cpu), 'sleep', '0.1'])
+        b.perf_buffer_poll()
+        b.cleanup()
+        self.assertGreaterEqual(len(self.events), 1)
+        for one, cpu, comm in self.events:
+            self.assertEqual(one, 1)
+            self.assertIn(cpu, online_cpus)
+            self.assertEqual(len(comm), 16)
+
 if __name__ == "__main__":
     main()
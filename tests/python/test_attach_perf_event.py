@@ -7,6 +7,7 @@ import os
 import time
 import unittest
 from bcc import BPF, PerfType, PerfHWConfig, PerfSWConfig, PerfEventSampleFormat
+from bcc import PerfBranchSampleType
 from bcc import Perf
 from time import sleep
 from utils import kernel_version_ge, mayFail
@@ -155,5 +156,73 @@ int on_sample_hit(struct bpf_perf_event_data *ctx) {
         print("Running for 1 seconds or hit Ctrl-C to end. Check trace file for samples information written by bpf_trace_printk.")
         sleep(1)
 
+    @staticmethod
+    def own_cgroup():
+        # the cgroup v2 directory of this process, or None
+        with open("/proc/self/cgroup") as f:
+            for line in f:
+                if line.startswith("0::"):
+                    path = "/sys/fs/cgroup" + line[3:].strip()
+                    if os.path.isdir(path):
+                        return path
+        return None
+
+    def test_attach_cgroup_sw_event(self):
+        path = self.own_cgroup()
+        if path is None:
+            self.skipTest("requires a cgroup v2 hierarchy")
+        b = BPF(text=b"""
+BPF_HASH(samples, u32, u64);
+int on_sample_hit(struct bpf_perf_event_data *ctx) {
+    samples.increment(bpf_get_current_pid_tgid() >> 32);
+    return 0;
+}
+""")
+        fd = os.open(path, os.O_RDONLY)
+        try:
+            b.attach_perf_event(ev_type=PerfType.SOFTWARE,
+                                ev_config=PerfSWConfig.CPU_CLOCK,
+                                fn_name="on_sample_hit", sample_freq=999,
+                                cgroup_fd=fd)
+        finally:
+            os.close(fd)
+        end = time.time() + 0.5
+        while time.time() < end:
+            pass
+        b.detach_perf_event(PerfType.SOFTWARE, PerfSWConfig.CPU_CLOCK)
+        pids = [k.value for k in b["samples"].keys()]
+        self.assertIn(os.getpid(), pids)
+        b.cleanup()
+
+    @mayFail("This fails on github actions environment, hw perf events are not supported")
+    @unittest.skipUnless(kernel_version_ge(5,7), "requires kernel >= 5.7")
+    def test_attach_branch_event(self):
+        b = BPF(text=b"""
+#include <linux/perf_event.h>
+BPF_ARRAY(records, u64, 1);
+int on_sample_hit(struct bpf_perf_event_data *ctx) {
+    struct perf_branch_entry entries[4];
+    int size = bpf_read_branch_records(ctx, entries, sizeof(entries), 0);
+    if (size > 0)
+        records.atomic_increment(0, size / sizeof(entries[0]));
+    return 0;
+}
+""")
+        try:
+            b.attach_perf_event(ev_type=PerfType.HARDWARE,
+                                ev_config=PerfHWConfig.CPU_CYCLES,
+                                fn_name="on_sample_hit", sample_freq=999,
+                                pid=os.getpid(),
+                                branch_sample_type=PerfBranchSampleType.ANY |
+                                PerfBranchSampleType.USER)
+        except Exception:
+            self.skipTest("requires last branch records (LBR)")
+        end = time.time() + 0.5
+        while time.time() < end:
+            pass
+        b.detach_perf_event(PerfType.HARDWARE, PerfHWConfig.CPU_CYCLES)
+        self.assertGreater(b["records"][0].value, 0)
+        b.cleanup()
+
 if __name__ == "__main__":
     unittest.main()
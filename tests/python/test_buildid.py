@@ -0,0 +1,70 @@
+#!/usr/bin/env python3
+# Licensed under the Apache License, Version 2.0 (the "License")
+
+from bcc import BPF
+from bcc.buildid import BuildIdStackReader, BuildIdStackWriter, Symbolizer, \
+    build_id, publish, store_path
+import os
+import shutil
+import tempfile
+import unittest
+
+class TestBuildId(unittest.TestCase):
+    def setUp(self):
+        self.dir = tempfile.mkdtemp()
+        self.path = os.path.join(self.dir, "out.bids")
+
+    def tearDown(self):
+        shutil.rmtree(self.dir)
+
+    def test_round_trip(self):
+        bid = bytes(range(20))
+        with BuildIdStackWriter(self.path) as w:
+            w.add_sample([b"kfunc", (bid, 0x1234), 0x7f0000001000,
+                          (bid, 0x20)], 3, 42, b"app")
+            w.add_sample([(bid, 0x1234)], 1, 7, b"other")
+
+        with BuildIdStackReader(self.path) as r:
+            samples = list(r)
+        self.assertEqual(len(samples), 2)
+        self.assertEqual(samples[0].frames, [b"kfunc", (bid, 0x1234),
+                                             0x7f0000001000, (bid, 0x20)])
+        self.assertEqual((samples[0].count, samples[0].pid, samples[0].comm),
+                         (3, 42, b"app"))
+        self.assertEqual(samples[1].frames, [(bid, 0x1234)])
+        self.assertEqual(samples[1].comm, b"other")
+
+    def test_truncated(self):
+        with BuildIdStackWriter(self.path) as w:
+            w.add_sample([(b"\x01" * 20, 0x10)])
+        with open(self.path, "rb+") as f:
+            f.truncate(os.path.getsize(self.path) - 1)
+        with BuildIdStackReader(self.path) as r:
+            self.assertRaises(ValueError, list, r)
+
+    def test_symbolize_from_store(self):
+        module = BPF.find_library(b"bcc")
+        bid = build_id(module) if module else None
+        if not bid:
+            self.skipTest("no libbcc with a build-id")
+        store = os.path.join(self.dir, "store")
+        self.assertEqual(publish(store, module), bid)
+        self.assertTrue(os.path.exists(store_path(store, bid)))
+
+        _, offset = BPF._check_path_symbol(module, b"bcc_buildsymcache_new",
+                                           None, -1)
+        frame = (bytes(bytearray.fromhex(bid)), offset)
+        unknown = (b"\xab" * 20, 0x10)
+        with BuildIdStackWriter(self.path) as w:
+            w.add_sample([frame, unknown, 0x1000, b"kfunc"], 2)
+
+        sym = Symbolizer(stores=[store])
+        with BuildIdStackReader(self.path) as r:
+            samples = list(sym.symbolize(r))
+        self.assertEqual(samples[0].frames,
+                         [b"bcc_buildsymcache_new", b"[" + b"ab" * 20 +
+                          b"+0x10]", b"0x1000", b"kfunc"])
+        self.assertEqual(samples[0].count, 2)
+
+if __name__ == "__main__":
+    unittest.main()
@@ -2,7 +2,8 @@
 # Copyright (c) PLUMgrid, Inc.
 # Licensed under the Apache License, Version 2.0 (the "License")
 
-from bcc import BPF
+from bcc import BPF, DEBUG_PREPROCESSOR
+from bcc.libbcc import lib
 import ctypes as ct
 from unittest import main, skipUnless, TestCase
 from utils import kernel_version_ge
@@ -899,6 +900,27 @@ int trace_entry(struct pt_regs *ctx) {
         self.assertIn(expectedWarn, output)
         r.close()
 
+    @skipUnless(kernel_version_ge(5,11), "requires kernel >= 5.11")
+    def test_kfunc_btf_task(self):
+        if not BPF.support_kfunc():
+            self.skipTest("kfunc not supported")
+        text = """
+#include <linux/sched.h>
+KFUNC_PROBE(vfs_read) {
+  struct task_struct *t = (struct task_struct *)bpf_get_current_task();
+  bpf_trace_printk("%d\\n", t->real_parent->tgid);
+  return 0;
+}
+"""
+        r, w = os.pipe()
+        with redirect_stderr(to=w):
+            BPF(text=text, debug=DEBUG_PREPROCESSOR)
+        r = os.fdopen(r)
+        output = r.read()
+        self.assertIn("bpf_get_current_task_btf()", output)
+        self.assertNotIn("bpf_probe_read", output)
+        r.close()
+
     def test_map_insert(self):
         text = """
 BPF_HASH(dummy);
@@ -1324,5 +1346,68 @@ int do_request(struct pt_regs *ctx, struct request *rq) {
         b = BPF(text=text)
         fns = b.load_funcs(BPF.KPROBE)
 
+    def test_rate_limit_and_sampler(self):
+        text = """
+BPF_RATE_LIMIT(rate_limit);
+BPF_SAMPLER(sampler);
+int trace(struct pt_regs *ctx) {
+    int zero = 0;
+    struct bpf_sampler *s = sampler.lookup(&zero);
+    if (!s || !bpf_sample_one_in(s, 10))
+        return 0;
+    struct bpf_rate_limit *rl = rate_limit.lookup(&zero);
+    if (!rl || !bpf_rate_limit_allow(rl, 100, 10))
+        return 0;
+    return 0;
+}
+"""
+        b = BPF(text=text)
+        b.load_func("trace", BPF.KPROBE)
+        self.assertEqual(sum(v.suppressed for v in b["sampler"][0]), 0)
+        self.assertEqual(sum(v.passed for v in b["rate_limit"][0]), 0)
+
+    def test_dedup(self):
+        text = """
+BPF_DEDUP(dedup, 16);
+BPF_ARRAY(emitted, u64, 1);
+int trace(struct pt_regs *ctx) {
+    struct key_t { u32 pid; char comm[16]; } key = {};
+    key.pid = bpf_get_current_pid_tgid() >> 32;
+    bpf_get_current_comm(&key.comm, sizeof(key.comm));
+    struct bpf_dedup zero = {};
+    u64 h = bpf_hash_bytes(&key, sizeof(key));
+    struct bpf_dedup *d = dedup.lookup_or_try_init(&h, &zero);
+    u64 repeats;
+    if (d && !bpf_dedup_allow(d, 1000000000, &repeats))
+        return 0;
+    emitted.increment(0);
+    return 0;
+}
+"""
+        b = BPF(text=text)
+        b.load_func("trace", BPF.KPROBE)
+        self.assertEqual(len(b["dedup"]), 0)
+
+    def test_btf_table_layouts(self):
+        text = b"""
+struct val { u16 a; u64 b; };
+typedef unsigned long counter_t;
+BPF_HASH(by_u64, u32, u64);
+BPF_HASH(by_typedef, unsigned int, counter_t);
+BPF_ARRAY(vals, struct val, 2);
+"""
+        b = BPF(text=text, cache=True)
+        t = b["vals"]
+        self.assertIsNone(t._key)
+        self.assertIsNone(t._leaf)
+        self.assertEqual(ct.sizeof(t.Leaf), 16)
+        self.assertEqual(t.Leaf.b.offset, 8)
+        t[0] = t.Leaf(1, 2)
+        self.assertEqual(t[0].b, 2)
+        # The same layout decodes to one class whatever its typedefs
+        if lib.bpf_table_leaf_layout_id(b.module, t.map_id):
+            self.assertIs(b["by_u64"].Leaf, b["by_typedef"].Leaf)
+            self.assertIs(b["by_u64"].Key, b["by_typedef"].Key)
+
 if __name__ == "__main__":
     main()
@@ -0,0 +1,54 @@
+#!/usr/bin/env python3
+# Licensed under the Apache License, Version 2.0 (the "License")
+
+from bcc import BPF
+from bcc.fslatency import FsLatency, probes, TEXT
+import unittest
+
+class TestFsLatency(unittest.TestCase):
+    def test_probes_shared(self):
+        available = lambda fn: fn in ("generic_file_read_iter",
+                                      "ext4_file_write_iter", "ext4_file_open",
+                                      "ext4_sync_file", "btrfs_file_write_iter",
+                                      "generic_file_open", "btrfs_sync_file")
+        res = probes(["ext4", "btrfs"], available)
+        fns = [fn for fn, _, _ in res]
+        self.assertEqual(len(fns), len(set(fns)))
+        self.assertIn(("generic_file_read_iter", "trace_kiocb_entry",
+                       "trace_read_return"), res)
+        self.assertIn(("generic_file_open", "trace_open_entry",
+                       "trace_open_return"), res)
+
+    def test_probes_first_found(self):
+        available = lambda fn: fn != "zpl_iter_read"
+        res = probes(["zfs"], available)
+        self.assertIn(("zpl_aio_read", "trace_kiocb_entry",
+                       "trace_read_return"), res)
+        self.assertNotIn("zpl_read", [fn for fn, _, _ in res])
+
+    def test_probes_every(self):
+        res = probes(["nfs"], lambda fn: True)
+        opens = [fn for fn, _, ret in res if ret == "trace_open_return"]
+        self.assertEqual(opens, ["nfs4_file_open", "nfs_file_open"])
+
+    def test_probes_errors(self):
+        self.assertRaises(ValueError, probes, ["ext3"], lambda fn: True)
+        self.assertRaises(ValueError, probes, ["xfs"], lambda fn: False)
+
+    def test_load(self):
+        b = BPF(text=TEXT)
+        for fn in ("trace_kiocb_entry", "trace_open_entry", "trace_file_entry",
+                   "trace_nfs_entry", "trace_read_return",
+                   "trace_getattr_return"):
+            b.load_func(fn.encode(), BPF.KPROBE)
+
+    @unittest.skipUnless(BPF.get_kprobe_functions(b"^ext4_file_open$"),
+                         "ext4 not available")
+    def test_ext4(self):
+        fs = FsLatency(["ext4"], events=True)
+        with open(__file__) as f:
+            f.read()
+        fs.print_dist("usecs")
+
+if __name__ == "__main__":
+    unittest.main()
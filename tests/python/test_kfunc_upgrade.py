@@ -0,0 +1,63 @@
+#!/usr/bin/env python3
+# Copyright (c) Facebook, Inc.
+# Licensed under the Apache License, Version 2.0 (the "License")
+
+from bcc import BPF
+import ctypes as ct
+import os
+from unittest import main, skipUnless, TestCase
+
+@skipUnless(BPF.support_kfunc(), "requires fentry and fexit support")
+class TestKfuncUpgrade(TestCase):
+    text = b"""
+    BPF_ARRAY(counts, u64, 2);
+    int enter(struct pt_regs *ctx) {
+        counts.increment(0);
+        return 0;
+    }
+    int leave(struct pt_regs *ctx) {
+        if (PT_REGS_RC(ctx) == bpf_get_current_pid_tgid() >> 32)
+            counts.increment(1);
+        return 0;
+    }
+    int raw(struct pt_regs *ctx) {
+        u64 arg = PT_REGS_PARM1(ctx);
+        return 0;
+    }
+    """
+
+    def upgraded(self, b):
+        return [name for name in b.funcs
+                if name.startswith(b"kfunc_compat__")]
+
+    def test_upgrade(self):
+        b = BPF(text=self.text, kfunc_upgrade=True)
+        event = b.get_syscall_fnname(b"getpid")
+        b.attach_kprobe(event=event, fn_name=b"enter")
+        b.attach_kretprobe(event=event, fn_name=b"leave")
+        self.assertEqual(2, len(self.upgraded(b)))
+        os.getpid()
+        counts = b[b"counts"]
+        self.assertGreater(counts[ct.c_int(0)].value, 0)
+        self.assertGreater(counts[ct.c_int(1)].value, 0)
+        b.detach_kprobe(event)
+        b.detach_kretprobe(event)
+        b.cleanup()
+
+    def test_other_registers(self):
+        # handlers reading registers other than the return value stay kprobes
+        b = BPF(text=self.text, kfunc_upgrade=True)
+        b.attach_kprobe(event=b.get_syscall_fnname(b"getpid"), fn_name=b"raw")
+        self.assertEqual([], self.upgraded(b))
+        self.assertIn(b"raw", b.funcs)
+        b.cleanup()
+
+    def test_no_upgrade(self):
+        b = BPF(text=self.text, kfunc_upgrade=False)
+        b.attach_kprobe(event=b.get_syscall_fnname(b"getpid"),
+                        fn_name=b"enter")
+        self.assertEqual([], self.upgraded(b))
+        b.cleanup()
+
+if __name__ == "__main__":
+    main()
@@ -11,6 +11,7 @@ from utils import kernel_version_ge
 from bcc import BPF
 
 import os
+import sys
 import ctypes as ct
 
 
@@ -73,6 +74,18 @@ class TestMapBatch(TestCase):
         count = sum(1 for _ in hmap.items())
         self.assertEqual(count, 0)
 
+    def test_chunked_iteration(self):
+        hmap = self.fill_hashmap()
+        hmap.ITER_CHUNK = 100
+        items = sorted((k.value, v.value) for k, v in hmap.items())
+        self.assertEqual(items, [(i, i) for i in range(self.MAPSIZE)])
+        self.assertTrue(hmap._batch_iter)
+        self.assertEqual(sorted(k.value for k in hmap),
+                         list(range(self.MAPSIZE)))
+        self.assertEqual(len(hmap), self.MAPSIZE)
+        hmap.clear()
+        self.assertEqual(len(hmap), 0)
+
     def test_lookup_batch_all_keys(self):
         # fill the hashmap
         hmap = self.fill_hashmap()
@@ -81,6 +94,24 @@ class TestMapBatch(TestCase):
         count = self.check_hashmap_values(hmap.items_lookup_batch())
         self.assertEqual(count, self.MAPSIZE)
 
+    def test_items_columnar(self):
+        hmap = self.fill_hashmap()
+
+        count, keys, values = hmap.items_columnar()
+        self.assertEqual(count, self.MAPSIZE)
+        self.assertEqual(len(keys), self.MAPSIZE * ct.sizeof(hmap.Key))
+        self.assertEqual(hmap.key_dtype(), "i4")
+        ints_k = keys.cast("i")
+        ints_v = values.cast("i")
+        self.assertEqual(sorted(ints_k), list(range(self.MAPSIZE)))
+        for i in range(count):
+            self.assertEqual(ints_k[i], ints_v[i])
+
+        # same with delete, the map is then empty
+        count, _, _ = hmap.items_columnar(delete=True)
+        self.assertEqual(count, self.MAPSIZE)
+        self.assertEqual(sum(1 for _ in hmap.items()), 0)
+
     def test_delete_batch_all_keys(self):
         # Delete all key/value in the map
         # fill the hashmap
@@ -138,6 +169,27 @@ class TestMapBatch(TestCase):
 
         self.assertEqual(i, self.SUBSET_SIZE)
 
+    def test_update_batch_lpm_trie(self):
+        # tries have no batch ops, the update falls back to one per entry
+        b = BPF(text=b"""
+        struct key_v4 {
+            u32 prefixlen;
+            u32 data;
+        };
+        BPF_LPM_TRIE(trie, struct key_v4, int, %d);
+        """ % self.MAPSIZE)
+        trie = b[b"trie"]
+        keys = (trie.Key * 256)()
+        values = (trie.Leaf * 256)()
+        for i in range(256):
+            keys[i].prefixlen = 24
+            keys[i].data = int.from_bytes(bytes([10, 0, i, 0]), sys.byteorder)
+            values[i] = ct.c_int(i)
+        trie.items_update_batch(keys, values)
+
+        k = trie.Key(32, int.from_bytes(bytes([10, 0, 42, 7]), sys.byteorder))
+        self.assertEqual(trie[k].value, 42)
+
 
 if __name__ == "__main__":
     main()
@@ -213,5 +213,43 @@ class TestUDST(TestCase):
 
         b.detach_kprobe(event=syscall_fnname)
 
+    def test_epoch_buffers(self):
+        bpf_text = """
+BPF_HASH(counts, int, u64, 10);
+BPF_EPOCH_BUFFERS(counts_epochs, "counts");
+
+int syscall__getuid(void *ctx) {
+   int active = 0, key = 1;
+   u64 one = 1, *val;
+   void *buf = counts_epochs.lookup(&active);
+   if (!buf)
+     return 0;
+   val = bpf_map_lookup_elem(buf, &key);
+   if (val)
+     __sync_fetch_and_add(val, 1);
+   else
+     bpf_map_update_elem(buf, &key, &one, BPF_NOEXIST);
+   return 0;
+}
+"""
+        b = BPF(text=bpf_text)
+        syscall_fnname = b.get_syscall_fnname("getuid")
+        b.attach_kprobe(event=syscall_fnname, fn_name="syscall__getuid")
+        epochs = b["counts_epochs"]
+
+        for i in range(5):
+            os.getuid()
+        idle = epochs.flip_epoch("counts")
+        self.assertGreaterEqual(idle[ct.c_int(1)].value, 5)
+        idle.clear()
+
+        # the other buffer counts meanwhile
+        for i in range(3):
+            os.getuid()
+        idle = epochs.flip_epoch("counts")
+        self.assertGreaterEqual(idle[ct.c_int(1)].value, 3)
+
+        b.detach_kprobe(event=syscall_fnname)
+
 if __name__ == "__main__":
     main()
@@ -0,0 +1,43 @@
+#!/usr/bin/env python3
+# Copyright (c) Facebook, Inc.
+# Licensed under the Apache License, Version 2.0 (the "License")
+
+from bcc import BPF
+import ctypes as ct
+from unittest import main, TestCase
+
+class TestMemoryUsage(TestCase):
+    def setUp(self):
+        self.b = BPF(text=b"""
+        BPF_HASH(counts, u32, u64, 1024);
+        BPF_ARRAY(slots, u64, 16);
+        BPF_PERF_OUTPUT(events);
+        int count(void *ctx) { return 0; }
+        """)
+        self.b.load_func(b"count", BPF.KPROBE)
+
+    def tearDown(self):
+        self.b.cleanup()
+
+    def test_memory_usage(self):
+        counts = self.b[b"counts"]
+        for i in range(10):
+            counts[ct.c_uint(i)] = ct.c_ulonglong(i)
+        self.b[b"events"].open_perf_buffer(lambda cpu, data, size: None,
+                                           page_cnt=4)
+        usage = self.b.memory_usage(count_entries=True)
+        self.assertEqual({"counts", "slots", "events"},
+                         set(usage["maps"].keys()))
+        self.assertEqual(10, usage["maps"]["counts"]["entries"])
+        self.assertEqual(1024, usage["maps"]["counts"]["max_entries"])
+        self.assertEqual(16, usage["maps"]["slots"]["entries"])
+        self.assertGreater(usage["progs"]["count"]["xlated_len"], 0)
+        self.assertEqual(0, usage["perf_buffer_pages"] % 5)
+        self.assertGreater(usage["perf_buffer_pages"], 0)
+        self.assertGreater(usage["total_bytes"], 0)
+
+        usage = self.b.memory_usage()
+        self.assertIsNone(usage["maps"]["counts"]["entries"])
+
+if __name__ == "__main__":
+    main()
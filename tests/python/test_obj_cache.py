@@ -0,0 +1,50 @@
+#!/usr/bin/env python3
+# Licensed under the Apache License, Version 2.0 (the "License")
+
+from bcc import BPF
+import ctypes as ct
+import os
+import shutil
+import tempfile
+from unittest import main, TestCase
+
+text = b"""
+struct key_t {
+    u32 pid;
+    char comm[16];
+};
+BPF_HASH(counts, struct key_t, u64, 128);
+int count(void *ctx) {
+    struct key_t key = {.pid = bpf_get_current_pid_tgid() >> 32};
+    bpf_get_current_comm(&key.comm, sizeof(key.comm));
+    counts.increment(key);
+    return 0;
+}
+"""
+
+class TestObjCache(TestCase):
+    def setUp(self):
+        self.dir = tempfile.mkdtemp(prefix="bcc_obj_cache_")
+
+    def tearDown(self):
+        shutil.rmtree(self.dir)
+
+    def test_cold_and_warm_start(self):
+        b = BPF(text=text, cache_dir=self.dir)
+        self.assertEqual(len(os.listdir(self.dir)), 1)
+        key = b["counts"].Key
+        b.cleanup()
+
+        b = BPF(text=text, cache_dir=self.dir)
+        self.assertEqual(len(os.listdir(self.dir)), 1)
+        # the same table types are decoded once per process
+        self.assertIs(b["counts"].Key, key)
+        counts = b["counts"]
+        k = counts.Key(pid=1, comm=b"init")
+        counts[k] = ct.c_ulonglong(42)
+        self.assertEqual(counts[k].value, 42)
+        b.load_func(b"count", BPF.KPROBE)
+        b.cleanup()
+
+if __name__ == "__main__":
+    main()
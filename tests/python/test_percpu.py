@@ -121,6 +121,64 @@ class TestPercpu(unittest.TestCase):
         self.assertGreater(k.c1, int(0))
         bpf_code.detach_kprobe(event_name)
 
+    def test_items_sum(self):
+        test_prog1 = """
+        BPF_PERCPU_HASH(stats, u32, u64, 16);
+        """
+        bpf_code = BPF(text=test_prog1)
+        stats_map = bpf_code.get_table("stats")
+        ncpu = len(stats_map.Leaf())
+        for k in range(4):
+            ini = stats_map.Leaf()
+            for i in range(ncpu):
+                ini[i] = k + i
+            stats_map[stats_map.Key(k)] = ini
+        items = sorted((k.value, v.value) for k, v in stats_map.items_sum())
+        self.assertEqual(items, [(k, k * ncpu + ncpu * (ncpu - 1) // 2)
+                                 for k in range(4)])
+        self.assertEqual(len(stats_map.items_sum(delete=True)), 4)
+        self.assertEqual(len(stats_map), 0)
+
+    def test_heavy_hitters(self):
+        test_prog1 = """
+        BPF_HEAVY_HITTERS(top, u32, 8, 256);
+        TRACEPOINT_PROBE(syscalls, sys_enter_getpriority) {
+            if (bpf_get_current_pid_tgid() >> 32 != TGID)
+                return 0;
+            int zero = 0;
+            u32 who = args->who;
+            struct top_hh *hh = top.lookup(&zero);
+            if (hh)
+                bpf_heavy_hitters_add(hh, &who, 1);
+            return 0;
+        }
+        """
+        bpf_code = BPF(text=test_prog1.replace("TGID", str(os.getpid())))
+        top = bpf_code["top"]
+
+        def getpriority(who):
+            try:
+                os.getpriority(os.PRIO_PROCESS, who)
+            except OSError:
+                pass
+        # far more keys than candidate slots, and three heavy hitters
+        for i in range(4000):
+            getpriority(1000000 + i)
+            if i % 4 == 0:
+                getpriority(1)
+            if i % 8 == 0:
+                getpriority(2)
+            if i % 16 == 0:
+                getpriority(3)
+        total = 4000 + 1000 + 500 + 250
+        self.assertEqual(sum(v.total for v in top[0]), total)
+        hitters = top.heavy_hitters(3, clear=True)
+        self.assertEqual([k for k, _ in hitters], [1, 2, 3])
+        for (k, count), real in zip(hitters, [1000, 500, 250]):
+            self.assertGreaterEqual(count, real)
+            self.assertLess(count, real + total * 3 // 256)
+        self.assertEqual(top.heavy_hitters(), [])
+
 
 if __name__ == "__main__":
     unittest.main()
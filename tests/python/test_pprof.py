@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+# Licensed under the Apache License, Version 2.0 (the "License")
+
+from bcc.pprof import PprofWriter
+import gzip
+import os
+import tempfile
+import unittest
+
+def decode(data):
+    """Return the (field, value) pairs of a protobuf message, with the
+    value of length delimited fields as bytes."""
+    fields = []
+    pos = 0
+    def varint():
+        nonlocal pos
+        val = shift = 0
+        while True:
+            byte = data[pos]
+            pos += 1
+            val |= (byte & 0x7f) << shift
+            shift += 7
+            if not byte & 0x80:
+                return val
+    while pos < len(data):
+        key = varint()
+        if key & 7 == 0:
+            fields.append((key >> 3, varint()))
+        else:
+            size = varint()
+            fields.append((key >> 3, data[pos:pos + size]))
+            pos += size
+    return fields
+
+def varints(data):
+    """Return the values of a packed repeated field."""
+    vals = []
+    val = shift = 0
+    for byte in bytearray(data):
+        val |= (byte & 0x7f) << shift
+        shift += 7
+        if not byte & 0x80:
+            vals.append(val)
+            val = shift = 0
+    return vals
+
+class TestPprof(unittest.TestCase):
+    def setUp(self):
+        fd, self.path = tempfile.mkstemp(suffix=".pb.gz")
+        os.close(fd)
+
+    def tearDown(self):
+        os.unlink(self.path)
+
+    def test_samples(self):
+        with PprofWriter(self.path, [("samples", "count")]) as w:
+            w.add_sample([b"leaf", b"main"], [3], {"comm": b"a", "pid": 7})
+            w.add_sample([b"other", b"main"], [4], {"comm": b"a", "pid": 7})
+
+        with gzip.open(self.path, "rb") as f:
+            fields = decode(f.read())
+        strings = [val for (field, val) in fields if field == 6]
+        # string_table starts with "", each string is there once
+        self.assertEqual(strings[0], b"")
+        self.assertEqual(len(strings), len(set(strings)))
+        for s in [b"samples", b"count", b"leaf", b"other", b"main", b"comm",
+                  b"a", b"pid"]:
+            self.assertIn(s, strings)
+
+        functions = {}
+        for (field, val) in fields:
+            if field == 5:
+                func = dict(decode(val))
+                functions[func[1]] = strings[func[2]]
+        # one function and location per distinct frame
+        self.assertEqual(sorted(functions.values()),
+                         [b"leaf", b"main", b"other"])
+        self.assertEqual(len([f for (f, _) in fields if f == 4]), 3)
+
+        samples = [decode(val) for (field, val) in fields if field == 2]
+        self.assertEqual(len(samples), 2)
+        stacks = [[functions[loc] for loc in varints(dict(s)[1])]
+                  for s in samples]
+        self.assertEqual(stacks, [[b"leaf", b"main"], [b"other", b"main"]])
+        self.assertEqual([varints(dict(s)[2]) for s in samples], [[3], [4]])
+
+if __name__ == "__main__":
+    unittest.main()
@@ -25,6 +25,13 @@ class TestKprobeCnt(TestCase):
         open_cnt = self.b.num_open_kprobes()
         self.assertEqual(actual_cnt, open_cnt)
 
+    def test_detach_one(self):
+        # vfs_* may share one multi kprobe link, which must keep the others
+        open_cnt = self.b.num_open_kprobes()
+        self.b.detach_kprobe(event="vfs_read", fn_name="wololo")
+        self.assertEqual(open_cnt - 1,
+                         sum(1 for fds in self.b.kprobe_fds.values() if fds))
+
     def tearDown(self):
         self.b.cleanup()
 
@@ -46,6 +46,77 @@ int do_sys_nanosleep(void *ctx) {
         self.assertGreater(self.counter, 0)
         b.cleanup()
 
+    @skipUnless(kernel_version_ge(5,8), "requires kernel >= 5.8")
+    def test_perf_output_as_ringbuf(self):
+        self.counter = 0
+
+        def cb(cpu, data, size):
+            self.assertEqual(cpu, -1)
+            event = b["events"].event(data)
+            self.assertGreater(event.ts, 0)
+            self.counter += 1
+
+        text = """
+BPF_PERF_OUTPUT(events);
+struct data_t {
+    u64 ts;
+};
+int do_sys_nanosleep(void *ctx) {
+    struct data_t data = {bpf_ktime_get_ns()};
+    events.perf_submit(ctx, &data, sizeof(data));
+    return 0;
+}
+"""
+        b = BPF(text=text, cflags=["-DBCC_PERF_OUTPUT_RINGBUF"])
+        self.assertEqual(b["events"].__class__.__name__, "RingBuf")
+        b.attach_kprobe(event=b.get_syscall_fnname("nanosleep"),
+                        fn_name="do_sys_nanosleep")
+        b.attach_kprobe(event=b.get_syscall_fnname("clock_nanosleep"),
+                        fn_name="do_sys_nanosleep")
+        b["events"].open_perf_buffer(cb)
+        subprocess.call(['sleep', '0.1'])
+        b.perf_buffer_poll()
+        self.assertGreater(self.counter, 0)
+        b.cleanup()
+
+    @skipUnless(kernel_version_ge(5,8), "requires kernel >= 5.8")
+    def test_ringbuf_background(self):
+        self.counter = 0
+
+        class Data(ct.Structure):
+            _fields_ = [("ts", ct.c_ulonglong)]
+
+        def cb(ctx, data, size):
+            self.assertEqual(ctx, 42)
+            self.assertEqual(size, ct.sizeof(Data))
+            event = ct.cast(data, ct.POINTER(Data)).contents
+            self.assertGreater(event.ts, 0)
+            self.counter += 1
+
+        text = """
+BPF_RINGBUF_OUTPUT(events, 8);
+struct data_t {
+    u64 ts;
+};
+int do_sys_nanosleep(void *ctx) {
+    struct data_t data = {bpf_ktime_get_ns()};
+    events.ringbuf_output(&data, sizeof(data), 0);
+    return 0;
+}
+"""
+        b = BPF(text=text)
+        b.attach_kprobe(event=b.get_syscall_fnname("nanosleep"),
+                        fn_name="do_sys_nanosleep")
+        b.attach_kprobe(event=b.get_syscall_fnname("clock_nanosleep"),
+                        fn_name="do_sys_nanosleep")
+        b["events"].open_ring_buffer(cb, ctx=42, background=True)
+        # starts the polling thread
+        b.ring_buffer_poll(0)
+        subprocess.call(['sleep', '0.1'])
+        b.ring_buffer_poll(1000)
+        self.assertGreater(self.counter, 0)
+        b.cleanup()
+
     @skipUnless(kernel_version_ge(5,8), "requires kernel >= 5.8")
     def test_ringbuf_consume(self):
         self.counter = 0
@@ -154,5 +225,85 @@ int do_sys_nanosleep(void *ctx) {
         self.assertEqual(self.counter, 0)
         b.cleanup()
 
+    @skipUnless(kernel_version_ge(5,8), "requires kernel >= 5.8")
+    def test_xdp_sample(self):
+        import socket
+        from bcc.xdp import XdpSampleReader
+
+        batches = []
+        text = """
+BPF_RINGBUF_OUTPUT(samples, 8);
+int sample(struct xdp_md *ctx) {
+    if (bpf_xdp_sample_hit(1)) {
+        struct xdp_sample *s = samples.ringbuf_reserve(sizeof(*s));
+        if (s) {
+            bpf_xdp_sample_fill(ctx, s);
+            samples.ringbuf_submit(s, 0);
+        }
+    }
+    return XDP_PASS;
+}
+"""
+        b = BPF(text=text, cflags=["-DXDP_SAMPLE_SNAPLEN=64"])
+        fn = b.load_func("sample", BPF.XDP)
+        BPF.attach_xdp("lo", fn, BPF.XDP_FLAGS_SKB_MODE)
+        try:
+            reader = XdpSampleReader(b["samples"], batches.append,
+                                     batch_size=1000, snaplen=64)
+            sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+            sock.sendto(b"x" * 100, ("127.0.0.1", 9))
+            sock.close()
+            b.ring_buffer_poll(100)
+            reader.flush()
+        finally:
+            BPF.remove_xdp("lo", BPF.XDP_FLAGS_SKB_MODE)
+
+        samples = [s for batch in batches for s in batch]
+        self.assertTrue(samples)
+        # ethernet, IPv4 and UDP headers plus the payload
+        big = [s for s in samples if s.pkt_len == 14 + 20 + 8 + 100]
+        self.assertTrue(big)
+        self.assertEqual(big[0].cap_len, 64)
+        self.assertEqual(len(big[0].packet()), 64)
+        b.cleanup()
+
+    @skipUnless(kernel_version_ge(5,8), "requires kernel >= 5.8")
+    def test_stack_ringbuf(self):
+        records = []
+
+        def cb(tag, pid, kernel_stack_id, user_stack_id):
+            records.append((tag, pid, kernel_stack_id, user_stack_id))
+
+        text = """
+BPF_STACK_RINGBUF(stacks, 8);
+int do_sys_nanosleep(void *ctx) {
+    stacks.record_stack(ctx, 42,
+                        BPF_STACK_RECORD_KERNEL | BPF_STACK_RECORD_USER);
+    return 0;
+}
+"""
+        b = BPF(text=text)
+        b.attach_kprobe(event=b.get_syscall_fnname("nanosleep"),
+                        fn_name="do_sys_nanosleep")
+        b.attach_kprobe(event=b.get_syscall_fnname("clock_nanosleep"),
+                        fn_name="do_sys_nanosleep")
+        stacks = b["stacks"]
+        stacks.open_stack_buffer(cb)
+        for _ in range(3):
+            subprocess.call(['sleep', '0.01'])
+        b.ring_buffer_poll()
+        self.assertGreater(len(records), 0)
+        tag, pid, kernel_stack_id, user_stack_id = records[0]
+        self.assertEqual(tag, 42)
+        self.assertGreaterEqual(kernel_stack_id, 0)
+        self.assertTrue(list(stacks.walk(kernel_stack_id)))
+        syms = stacks.sym_stacks([kernel_stack_id], -1)[0]
+        self.assertTrue(any(b"nanosleep" in s for s in syms))
+        # each distinct kernel stack has a single id
+        ids = set(r[2] for r in records)
+        self.assertEqual(len(ids),
+                         len(set(tuple(stacks.walk(i)) for i in ids)))
+        b.cleanup()
+
 if __name__ == "__main__":
     main()
@@ -0,0 +1,49 @@
+#!/usr/bin/env python3
+# Copyright (c) Facebook, Inc.
+# Licensed under the Apache License, Version 2.0 (the "License")
+
+from bcc import BPF
+import os
+from unittest import main, skipUnless, TestCase
+from utils import kernel_version_ge
+
+@skipUnless(kernel_version_ge(5, 8), "requires kernel >= 5.8")
+class TestRunStats(TestCase):
+    def setUp(self):
+        self.b = BPF(text=b"""
+        int count_tp(void *ctx) { return 0; }
+        int count_kp(void *ctx) { return 0; }
+        """)
+        self.b.enable_run_stats()
+        self.b.attach_tracepoint(tp=b"syscalls:sys_enter_getppid",
+                                 fn_name=b"count_tp")
+        self.b.attach_kprobe(event=self.b.get_syscall_fnname(b"getppid"),
+                             fn_name=b"count_kp")
+
+    def tearDown(self):
+        self.b.cleanup()
+
+    def test_run_stats(self):
+        for _ in range(100):
+            os.getppid()
+        stats = self.b.run_stats()
+        self.assertEqual(["count_kp", "count_tp"], list(stats.keys()))
+        self.assertEqual(["tracepoint:syscalls:sys_enter_getppid"],
+                         stats["count_tp"]["attach_points"])
+        self.assertEqual(1, len(stats["count_kp"]["attach_points"]))
+        self.assertTrue(
+            stats["count_kp"]["attach_points"][0].startswith("kprobe:"))
+        for s in stats.values():
+            self.assertGreaterEqual(s["run_cnt"], 100)
+            self.assertGreater(s["run_time_ns"], 0)
+        self.assertGreater(self.b.overhead(), 0)
+
+    def test_metrics(self):
+        os.getppid()
+        text = self.b.run_stats_metrics()
+        self.assertIn("# TYPE bcc_prog_run_count_total counter", text)
+        self.assertIn('bcc_prog_run_count_total{prog="count_tp",'
+                      'attach="tracepoint:syscalls:sys_enter_getppid"}', text)
+
+if __name__ == "__main__":
+    main()
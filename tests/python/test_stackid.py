@@ -39,6 +39,12 @@ int kprobe__htab_map_lookup_elem(struct pt_regs *ctx, struct bpf_map *map, u64 *
         self.assertIsNotNone(stackid)
         stack = stack_traces[stackid].ip
         self.assertEqual(b.ksym(stack[0]), b"htab_map_lookup_elem")
+        stacks = stack_traces.get_all([stackid.value, -1, stackid.value])
+        self.assertEqual(stacks[0], list(stack_traces.walk(stackid.value)))
+        self.assertEqual(stacks[1], [])
+        self.assertEqual(stacks[2], stacks[0])
+        names = stack_traces.get_all([stackid.value], pid=-1)
+        self.assertEqual(names[0][0], b"htab_map_lookup_elem")
 
 def Get_libc_path():
   cmd = 'cat /proc/self/maps | grep libc | awk \'{print $6}\' | uniq'
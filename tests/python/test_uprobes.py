@@ -6,6 +6,7 @@ import bcc
 import ctypes
 import errno
 import os
+import re
 import subprocess
 import shutil
 import time
@@ -65,6 +66,23 @@ int count(struct pt_regs *ctx) {
         b.detach_uretprobe(name=pythonpath, sym="main")
         b.detach_uprobe(name=pythonpath, sym="main")
 
+    def test_sym_re_filter(self):
+        def python_match(sym_re):
+            found = []
+            def sym_cb(sym_name, addr):
+                if re.match(sym_re, sym_name):
+                    found.append((sym_name, addr))
+                return 0
+            bcc.lib.bcc_foreach_function_symbol(b"c", bcc._SYM_CB_TYPE(sym_cb))
+            return sorted(found)
+
+        # filtered in libbcc by prefix and regex, by prefix only, not at all
+        for sym_re in [b"malloc", b"pthread_mutex_.*", b"mall?oc|free",
+                       b"str[a-c]+", br"mem\w+", b"^(x|y)*_?exit"]:
+            self.assertEqual(
+                sorted(bcc.BPF.get_user_functions_and_addresses(b"c", sym_re)),
+                python_match(sym_re))
+
     def test_mount_namespace(self):
         text = """
 #include <uapi/linux/ptrace.h>
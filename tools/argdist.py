@@ -5,12 +5,14 @@
 #
 # USAGE: argdist [-h] [-p PID] [-z STRING_SIZE] [-i INTERVAL] [-n COUNT] [-v]
 #                [-c] [-T TOP] [-C specifier] [-H specifier] [-I header]
-#                [-t TID]
+#                [-t TID] [--linear STEP] [-P [PERCENTILES]]
 #
 # Licensed under the Apache License, Version 2.0 (the "License")
 # Copyright (C) 2016 Sasha Goldshtein.
 
 from bcc import BPF, USDT, StrcmpRewrite
+from bcc.table import _print_log2_hist, _print_linear_hist, \
+        log2_index_max, linear_index_max
 from time import sleep, strftime
 import argparse
 import re
@@ -189,6 +191,8 @@ u64 __time = bpf_ktime_get_ns();
                 self.pid = tool.args.pid
                 self.tid = tool.args.tid
                 self.cumulative = tool.args.cumulative or False
+                self.linear = tool.args.linear
+                self.percentiles = tool.percentiles
                 self.raw_spec = specifier
                 self.probe_user_list = set()
                 self.bin_cmp = False
@@ -227,8 +231,6 @@ u64 __time = bpf_ktime_get_ns();
                         self._parse_exprs(parts[4])
                         if len(self.exprs) != len(self.expr_types):
                                 self._bail("mismatched # of exprs and types")
-                        if self.type == "hist" and len(self.expr_types) > 1:
-                                self._bail("histograms can only have 1 expr")
                 else:
                         if not self.probe_type == "r" and self.type == "hist":
                                 self._bail("histograms must have expr")
@@ -311,8 +313,22 @@ u64 __time = bpf_ktime_get_ns();
                         return text + "        __key.v%d = %s;\n" % \
                                (i, self.exprs[i])
 
+        def _is_keyed_hist(self):
+                # the first expression is the value in the histogram, the
+                # others are dimensions with a histogram each
+                return self.type == "hist" and \
+                       (len(self.exprs) > 1 or self.linear is not None)
+
         def _generate_hash_decl(self):
-                if self.type == "hist":
+                if self._is_keyed_hist():
+                        text = "struct %s_key_t {\n" % self.probe_hash_name
+                        for i in range(1, len(self.expr_types)):
+                                text += self._generate_hash_field(i)
+                        text += "u64 slot;\n};\n"
+                        text += "BPF_HISTOGRAM(%s, struct %s_key_t, 10240);\n" % \
+                                (self.probe_hash_name, self.probe_hash_name)
+                        return text
+                elif self.type == "hist":
                         return "BPF_HISTOGRAM(%s, %s);" % \
                                (self.probe_hash_name, self.expr_types[0])
                 else:
@@ -325,7 +341,24 @@ u64 __time = bpf_ktime_get_ns();
                         return text
 
         def _generate_key_assignment(self):
-                if self.type == "hist":
+                if self._is_keyed_hist():
+                        text = "struct %s_key_t __key = {};\n" % \
+                                self.probe_hash_name
+                        for i in range(1, len(self.exprs)):
+                                text += self._generate_field_assignment(i)
+                        text += self._generate_usdt_arg_assignment(0)
+                        text += "%s __val = %s;\n" % \
+                                (self.expr_types[0], self.exprs[0])
+                        if self.linear is None:
+                                text += "__key.slot = bpf_log2l(__val);\n"
+                        else:
+                                text += ("__key.slot = (u64)__val / %d;\n" +
+                                         "if (__key.slot > %d) " +
+                                         "__key.slot = %d;\n") % \
+                                        (self.linear, linear_index_max - 1,
+                                         linear_index_max - 1)
+                        return text
+                elif self.type == "hist":
                         return self._generate_usdt_arg_assignment(0) + \
                                ("%s __key = %s;\n" %
                                 (self.expr_types[0], self.exprs[0]))
@@ -337,7 +370,7 @@ u64 __time = bpf_ktime_get_ns();
                         return text
 
         def _generate_hash_update(self):
-                if self.type == "hist":
+                if self.type == "hist" and not self._is_keyed_hist():
                         return "%s.atomic_increment(bpf_log2l(__key));" % \
                                 self.probe_hash_name
                 else:
@@ -490,12 +523,79 @@ DATA_DECL
                                         (self._display_expr(i), key_i)
                         return ", ".join(map(str_i, range(0, len(self.exprs))))
 
+        def _display_dims(self, key):
+                return ", ".join(["%s = %s" % (self._display_expr(i),
+                                  self._v2s(getattr(key, "v%d" % i)))
+                                  for i in range(1, len(self.exprs))])
+
+        def _bucket_max(self, slot):
+                if self.linear is not None:
+                        return (slot + 1) * self.linear - 1
+                return (1 << slot) - 1
+
+        def _display_percentiles(self, vals):
+                total = sum(vals)
+                if not total:
+                        return
+                text = []
+                for pct in self.percentiles:
+                        acc = 0
+                        for slot, val in enumerate(vals):
+                                acc += val
+                                if acc * 100 >= total * pct:
+                                        break
+                        text.append("p%g <= %d" % (pct, self._bucket_max(slot)))
+                print("\t%s" % ", ".join(text))
+
+        def _read_items(self, data):
+                # A snapshot of the map that also clears it in one syscall,
+                # instead of a walk of all the keys followed by another to
+                # delete them. Arrays and old kernels have no batch ops.
+                if self.cumulative:
+                        return data.items()
+                try:
+                        return list(data.items_lookup_and_delete_batch())
+                except Exception:
+                        items = data.items()
+                        data.clear()
+                        return items
+
+        def _display_hist(self, items):
+                label = self.label or (self._display_expr(0)
+                        if not self.is_default_expr else "retval")
+                if self.linear is not None:
+                        label = "%s / %d" % (label, self.linear)
+                        nr_slots = linear_index_max
+                else:
+                        nr_slots = log2_index_max
+                sections = {}
+                for key, value in items:
+                        if self._is_keyed_hist():
+                                section, slot = self._display_dims(key), \
+                                                key.slot
+                        else:
+                                section, slot = "", key.value
+                        vals = sections.setdefault(section, [0] * nr_slots)
+                        if slot < nr_slots:
+                                vals[slot] += value.value
+                for section in sorted(sections):
+                        vals = sections[section]
+                        if section:
+                                print("\n%s" % section)
+                        if self.linear is not None:
+                                _print_linear_hist(vals, label, None)
+                        else:
+                                _print_log2_hist(vals, label, None)
+                        if self.percentiles:
+                                self._display_percentiles(vals)
+
         def display(self, top):
                 data = self.bpf.get_table(self.probe_hash_name)
+                items = self._read_items(data)
                 if self.type == "freq":
                         print(self.label or self.raw_spec)
                         print("\t%-10s %s" % ("COUNT", "EVENT"))
-                        sdata = sorted(data.items(), key=lambda p: p[1].value)
+                        sdata = sorted(items, key=lambda p: p[1].value)
                         if top is not None:
                                 sdata = sdata[-top:]
                         for key, value in sdata:
@@ -512,11 +612,7 @@ DATA_DECL
                                 print("\t%-10s %s" %
                                       (str(value.value), key_str))
                 elif self.type == "hist":
-                        label = self.label or (self._display_expr(0)
-                                if not self.is_default_expr else "retval")
-                        data.print_log2_hist(val_type=label)
-                if not self.cumulative:
-                        data.clear()
+                        self._display_hist(items)
 
         def __str__(self):
                 return self.label or self.raw_spec
@@ -595,6 +691,15 @@ argdist -H 'p:c:sleep(u32 seconds):u32:seconds' \\
         -H 'p:c:nanosleep(struct timespec *req):long:req->tv_nsec'
         Print histograms of sleep() and nanosleep() parameter values
 
+argdist -P -H 'r::__vfs_read(void *file, void *buf, size_t count):u64,u32:
+            $latency,$PID'
+        Print a histogram of read latency per process, with its 50th, 90th
+        and 99th percentiles
+
+argdist --linear 100 -H 't:block:block_rq_complete():u32:args->nr_sector'
+        Print a histogram of sectors in completing block I/O requests, in
+        linear buckets of 100 sectors
+
 argdist -p 2780 -z 120 \\
         -C 'p:c:write(int fd, char* buf, size_t len):char*:buf:fd==1'
         Spy on writes to STDOUT performed by process 2780, up to a string size
@@ -648,7 +753,23 @@ argdist -I 'kernel/sched/sched.h' \\
                        "as either full path, "
                        "or relative to relative to current working directory, "
                        "or relative to default kernel header search path")
+                parser.add_argument("--linear", type=int, metavar="STEP",
+                  help="use linear histogram buckets of STEP instead of log2 " +
+                  "buckets")
+                parser.add_argument("-P", "--percentiles", nargs="?",
+                  const="50,90,99", metavar="PERCENTILES",
+                  help="print these comma separated percentiles of " +
+                  "histograms (default 50,90,99)")
                 self.args = parser.parse_args()
+                if self.args.linear is not None and self.args.linear <= 0:
+                        parser.error("the linear step must be positive")
+                try:
+                        self.percentiles = [float(p) for p in
+                                self.args.percentiles.split(",")] \
+                                if self.args.percentiles else []
+                except ValueError:
+                        parser.error("invalid percentiles %s" %
+                                     self.args.percentiles)
                 self.usdt_ctx = None
 
         def _create_probes(self):
@@ -4,7 +4,7 @@
 # biolatency    Summarize block device I/O latency as a histogram.
 #       For Linux, uses BCC, eBPF.
 #
-# USAGE: biolatency [-h] [-T] [-Q] [-m] [-D] [-e] [interval] [count]
+# USAGE: biolatency [-h] [-T] [-Q] [-m] [-D] [-e] [-H] [interval] [count]
 #
 # Copyright (c) 2015 Brendan Gregg.
 # Licensed under the Apache License, Version 2.0 (the "License")
@@ -13,6 +13,7 @@
 
 from __future__ import print_function
 from bcc import BPF
+from bcc.table import histogram_percentiles, log_linear_bounds
 from time import sleep, strftime
 import argparse
 import ctypes as ct
@@ -27,6 +28,7 @@ examples = """examples:
     ./biolatency -F                 # show I/O flags separately
     ./biolatency -j                 # print a dictionary
     ./biolatency -e                 # show extension summary(total, average)
+    ./biolatency -H                 # high resolution histogram, percentiles
 """
 parser = argparse.ArgumentParser(
     description="Summarize block device I/O latency as a histogram",
@@ -44,6 +46,9 @@ parser.add_argument("-F", "--flags", action="store_true",
     help="print a histogram per set of I/O flags")
 parser.add_argument("-e", "--extension", action="store_true",
     help="summarize average/total value")
+parser.add_argument("-H", "--hdr", action="store_true",
+    help="log-linear histogram with 32 slots per power of two, and " +
+         "percentiles")
 parser.add_argument("interval", nargs="?", default=99999999,
     help="output interval, in seconds")
 parser.add_argument("count", nargs="?", default=99999999,
@@ -60,6 +65,12 @@ debug = 0
 if args.flags and args.disks:
     print("ERROR: can only use -D or -F. Exiting.")
     exit()
+if args.hdr and args.json:
+    print("ERROR: can only use -H or -j. Exiting.")
+    exit()
+
+# log-linear slots are 1/2^HDR_SUB_BITS of their values wide at most
+HDR_SUB_BITS = 5
 
 # define BPF program
 bpf_text = """
@@ -81,28 +92,59 @@ typedef struct ext_val {
     u64 count;
 } ext_val_t;
 
-BPF_HASH(start, struct request *);
+// In-flight requests live in a preallocated array indexed by a hash of
+// their address, so issue and completion never insert, delete, or take a
+// bucket lock. A slot is tagged with its request: if a later request
+// lands on the same slot first, the earlier one is simply not timed.
+#define START_SLOTS 65536
+
+typedef struct start_slot {
+    u64 req;
+    u64 ts;
+} start_slot_t;
+
+BPF_ARRAY(start, start_slot_t, START_SLOTS);
 STORAGE
 
+static __always_inline u32 start_index(struct request *req)
+{
+    u64 h = (u64)req;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h & (START_SLOTS - 1);
+}
+
 // time block I/O
 int trace_req_start(struct pt_regs *ctx, struct request *req)
 {
-    u64 ts = bpf_ktime_get_ns();
-    start.update(&req, &ts);
+    u32 idx = start_index(req);
+    start_slot_t *s = start.lookup(&idx);
+
+    if (s) {
+        s->ts = bpf_ktime_get_ns();
+        s->req = (u64)req;
+    }
     return 0;
 }
 
 // output
 int trace_req_done(struct pt_regs *ctx, struct request *req)
 {
-    u64 *tsp, delta;
+    u32 idx = start_index(req);
+    start_slot_t *s = start.lookup(&idx);
+    u64 delta;
 
     // fetch timestamp and calculate delta
-    tsp = start.lookup(&req);
-    if (tsp == 0) {
+    if (s == 0 || s->req != (u64)req) {
         return 0;   // missed issue
     }
-    delta = bpf_ktime_get_ns() - *tsp;
+    s->req = 0;
+    delta = bpf_ktime_get_ns() - s->ts;
+    if ((s64)delta < 0) {
+        return 0;
+    }
 
     EXTENSION
 
@@ -111,7 +153,6 @@ int trace_req_done(struct pt_regs *ctx, struct request *req)
     // store as histogram
     STORE
 
-    start.delete(&req);
     return 0;
 }
 """
@@ -124,26 +165,34 @@ else:
     bpf_text = bpf_text.replace('FACTOR', 'delta /= 1000;')
     label = "usecs"
 
+if args.hdr:
+    slot_str = "bpf_log_linear_slot(delta, %d)" % HDR_SUB_BITS
+    size_str = ", BPF_LOG_LINEAR_SLOTS(%d)" % HDR_SUB_BITS
+else:
+    slot_str = "bpf_log2l(delta)"
+    size_str = ""
+
 storage_str = ""
 store_str = ""
 if args.disks:
-    storage_str += "BPF_HISTOGRAM(dist, disk_key_t);"
+    storage_str += "BPF_HISTOGRAM(dist, disk_key_t%s);" % size_str
     store_str += """
-    disk_key_t key = {.slot = bpf_log2l(delta)};
+    disk_key_t key = {.slot = SLOT};
     void *__tmp = (void *)req->rq_disk->disk_name;
     bpf_probe_read(&key.disk, sizeof(key.disk), __tmp);
     dist.atomic_increment(key);
     """
 elif args.flags:
-    storage_str += "BPF_HISTOGRAM(dist, flag_key_t);"
+    storage_str += "BPF_HISTOGRAM(dist, flag_key_t%s);" % size_str
     store_str += """
-    flag_key_t key = {.slot = bpf_log2l(delta)};
+    flag_key_t key = {.slot = SLOT};
     key.flags = req->cmd_flags;
     dist.atomic_increment(key);
     """
 else:
-    storage_str += "BPF_HISTOGRAM(dist);"
-    store_str += "dist.atomic_increment(bpf_log2l(delta));"
+    storage_str += "BPF_HISTOGRAM(dist, int%s);" % size_str
+    store_str += "dist.atomic_increment(SLOT);"
+store_str = store_str.replace("SLOT", slot_str)
 
 if args.extension:
     storage_str += "BPF_ARRAY(extension, ext_val_t, 1);"
@@ -260,7 +309,18 @@ while (1):
         if args.timestamp:
             print("%-8s\n" % strftime("%H:%M:%S"), end="")
 
-        if args.flags:
+        if args.hdr and args.flags:
+            dist.print_log_linear_hist(label, HDR_SUB_BITS, "flags",
+                                       flags_print)
+        elif args.hdr:
+            dist.print_log_linear_hist(label, HDR_SUB_BITS, "disk")
+            if not args.disks:
+                counts = [v.value for v in dist.values()]
+                pcts = histogram_percentiles(counts, [50, 99, 99.9],
+                    log_linear_bounds(HDR_SUB_BITS, len(counts)))
+                print("\np50 = %d %s, p99 = %d %s, p99.9 = %d %s" %
+                      (pcts[0], label, pcts[1], label, pcts[2], label))
+        elif args.flags:
             dist.print_log2_hist(label, "flags", flags_print)
         else:
             dist.print_log2_hist(label, "disk")
@@ -14,6 +14,7 @@
 
 from __future__ import print_function
 from bcc import BPF
+from bcc.table import histogram_percentiles
 from time import sleep
 from threading import Event
 import argparse
@@ -151,61 +152,27 @@ else:
 MSEC = 1000
 SEC = 1000 * 1000
 
-cur_rwdf_100ms = bpf["rwdf_100ms"]
-cur_rwdf_1ms = bpf["rwdf_1ms"]
-cur_rwdf_10us = bpf["rwdf_10us"]
-
-last_rwdf_100ms = [0] * 400
-last_rwdf_1ms = [0] * 400
-last_rwdf_10us = [0] * 400
-
-rwdf_100ms = [0] * 400
-rwdf_1ms = [0] * 400
-rwdf_10us = [0] * 400
+# The counts added to each table since the last read are computed in libbcc,
+# summed over the CPUs.
+hist_100ms = bpf["rwdf_100ms"].histogram_delta()
+hist_1ms = bpf["rwdf_1ms"].histogram_delta()
+hist_10us = bpf["rwdf_10us"].histogram_delta()
 
 io_type = ["read", "write", "discard", "flush"]
 
-def find_pct(req, total, slots, idx, counted):
-    while idx > 0:
-        idx -= 1
-        if slots[idx] > 0:
-            counted += slots[idx]
-            if args.verbose > 1:
-                print('idx={} counted={} pct={:.1f} req={}'
-                      .format(idx, counted, counted / total, req))
-            if (counted / total) * 100 >= 100 - req:
-                break
-    return (idx, counted)
-
-def calc_lat_pct(req_pcts, total, lat_100ms, lat_1ms, lat_10us):
-    pcts = [0] * len(req_pcts)
-
-    if total == 0:
-        return pcts
-
-    data = [(100 * MSEC, lat_100ms), (MSEC, lat_1ms), (10, lat_10us)]
-    data_sel = 0
-    idx = 100
-    counted = 0
-
-    for pct_idx in reversed(range(len(req_pcts))):
-        req = float(req_pcts[pct_idx])
-        while True:
-            last_counted = counted
-            (gran, slots) = data[data_sel]
-            (idx, counted) = find_pct(req, total, slots, idx, counted)
-            if args.verbose > 1:
-                print('pct_idx={} req={} gran={} idx={} counted={} total={}'
-                      .format(pct_idx, req, gran, idx, counted, total))
-            if idx > 0 or data_sel == len(data) - 1:
-                break
-            counted = last_counted
-            data_sel += 1
-            idx = 100
-
-        pcts[pct_idx] = gran * idx + gran / 2
-
-    return pcts
+# Slot 0 of each table counts the IOs that the next finer table spreads over
+# its slots, so the latency distribution of an IO type is the 10us slots,
+# followed by the 1ms and 100ms ones but their first.
+lat_bounds = [10 * i for i in range(100)] + \
+             [MSEC * i for i in range(1, 100)] + \
+             [100 * MSEC * i for i in range(1, 101)]
+pcts = [float(pct) for pct in args.pcts]
+
+def calc_lat_pct(lat_100ms, lat_1ms, lat_10us):
+    if sum(lat_100ms) == 0:
+        return [0] * len(pcts)
+    return histogram_percentiles(lat_10us + lat_1ms[1:] + lat_100ms[1:],
+                                 pcts, bounds=lat_bounds)
 
 def format_usec(lat):
     if lat > SEC:
@@ -253,33 +220,16 @@ while keep_running:
 
     update_last_rwdf = args.interval > 0 or force_update_last_rwdf
     force_update_last_rwdf = False
-    rwdf_total = [0] * 4;
-
-    for i in range(400):
-        v = cur_rwdf_100ms.sum(i).value
-        rwdf_100ms[i] = max(v - last_rwdf_100ms[i], 0)
-        if update_last_rwdf:
-            last_rwdf_100ms[i] = v
-
-        v = cur_rwdf_1ms.sum(i).value
-        rwdf_1ms[i] = max(v - last_rwdf_1ms[i], 0)
-        if update_last_rwdf:
-            last_rwdf_1ms[i] = v
-
-        v = cur_rwdf_10us.sum(i).value
-        rwdf_10us[i] = max(v - last_rwdf_10us[i], 0)
-        if update_last_rwdf:
-            last_rwdf_10us[i] = v
-
-        rwdf_total[int(i / 100)] += rwdf_100ms[i]
+    rwdf_100ms = hist_100ms.update(update_last_rwdf)
+    rwdf_1ms = hist_1ms.update(update_last_rwdf)
+    rwdf_10us = hist_10us.update(update_last_rwdf)
 
     rwdf_lat = []
     for i in range(4):
         left = i * 100
         right = left + 100
         rwdf_lat.append(
-            calc_lat_pct(args.pcts, rwdf_total[i],
-                         rwdf_100ms[left:right],
+            calc_lat_pct(rwdf_100ms[left:right],
                          rwdf_1ms[left:right],
                          rwdf_10us[left:right]))
 
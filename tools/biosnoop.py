@@ -41,11 +41,13 @@ bpf_text="""
 
 // for saving the timestamp and __data_len of each request
 struct start_req_t {
+    u64 req;
     u64 ts;
     u64 data_len;
 };
 
 struct val_t {
+    u64 req;
     u64 ts;
     u32 pid;
     char name[TASK_COMM_LEN];
@@ -63,22 +65,40 @@ struct data_t {
     char name[TASK_COMM_LEN];
 };
 
-BPF_HASH(start, struct request *, struct start_req_t);
-BPF_HASH(infobyreq, struct request *, struct val_t);
+// Per-request state lives in preallocated arrays indexed by a hash of the
+// request address, tagged with the request it belongs to: no entries are
+// inserted or deleted per I/O. A request whose slot is reused before it
+// completes is not reported.
+#define REQ_SLOTS 65536
+
+BPF_ARRAY(start, struct start_req_t, REQ_SLOTS);
+BPF_ARRAY(infobyreq, struct val_t, REQ_SLOTS);
 BPF_PERF_OUTPUT(events);
 
+static __always_inline u32 req_index(struct request *req)
+{
+    u64 h = (u64)req;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h & (REQ_SLOTS - 1);
+}
+
 // cache PID and comm by-req
 int trace_pid_start(struct pt_regs *ctx, struct request *req)
 {
-    struct val_t val = {};
-    u64 ts;
+    u32 idx = req_index(req);
+    struct val_t *valp = infobyreq.lookup(&idx);
 
-    if (bpf_get_current_comm(&val.name, sizeof(val.name)) == 0) {
-        val.pid = bpf_get_current_pid_tgid() >> 32;
-        if (##QUEUE##) {
-            val.ts = bpf_ktime_get_ns();
-        }
-        infobyreq.update(&req, &val);
+    if (valp == 0) {
+        return 0;
+    }
+    valp->req = 0;
+    if (bpf_get_current_comm(&valp->name, sizeof(valp->name)) == 0) {
+        valp->pid = bpf_get_current_pid_tgid() >> 32;
+        valp->ts = ##QUEUE## ? bpf_ktime_get_ns() : 0;
+        valp->req = (u64)req;
     }
     return 0;
 }
@@ -86,42 +106,48 @@ int trace_pid_start(struct pt_regs *ctx, struct request *req)
 // time block I/O
 int trace_req_start(struct pt_regs *ctx, struct request *req)
 {
-    struct start_req_t start_req = {
-        .ts = bpf_ktime_get_ns(),
-        .data_len = req->__data_len
-    };
-    start.update(&req, &start_req);
+    u32 idx = req_index(req);
+    struct start_req_t *startp = start.lookup(&idx);
+
+    if (startp) {
+        startp->ts = bpf_ktime_get_ns();
+        startp->data_len = req->__data_len;
+        startp->req = (u64)req;
+    }
     return 0;
 }
 
 // output
 int trace_req_completion(struct pt_regs *ctx, struct request *req)
 {
+    u32 idx = req_index(req);
     struct start_req_t *startp;
     struct val_t *valp;
     struct data_t data = {};
     u64 ts;
 
     // fetch timestamp and calculate delta
-    startp = start.lookup(&req);
-    if (startp == 0) {
+    startp = start.lookup(&idx);
+    if (startp == 0 || startp->req != (u64)req) {
         // missed tracing issue
         return 0;
     }
+    startp->req = 0;
     ts = bpf_ktime_get_ns();
     data.delta = ts - startp->ts;
     data.ts = ts / 1000;
     data.qdelta = 0;
 
-    valp = infobyreq.lookup(&req);
+    valp = infobyreq.lookup(&idx);
     data.len = startp->data_len;
-    if (valp == 0) {
+    if (valp == 0 || valp->req != (u64)req) {
         data.name[0] = '?';
         data.name[1] = 0;
     } else {
         if (##QUEUE##) {
             data.qdelta = startp->ts - valp->ts;
         }
+        valp->req = 0;
         data.pid = valp->pid;
         data.sector = req->__sector;
         bpf_probe_read_kernel(&data.name, sizeof(data.name), valp->name);
@@ -146,8 +172,6 @@ int trace_req_completion(struct pt_regs *ctx, struct request *req)
 #endif
 
     events.perf_submit(ctx, &data, sizeof(data));
-    start.delete(&req);
-    infobyreq.delete(&req);
 
     return 0;
 }
@@ -196,6 +196,9 @@ with open(diskstats) as stats:
         a = line.split()
         disklookup[a[0] + "," + a[1]] = a[2]
 
+# the maxrows largest entries by bytes are selected in libbcc
+top = b.get_table("counts").top(maxrows, ["bytes"])
+
 # output
 exiting = 0
 while 1:
@@ -214,11 +217,8 @@ while 1:
     print("%-6s %-16s %1s %-3s %-3s %-8s %5s %7s %6s" % ("PID", "COMM",
         "D", "MAJ", "MIN", "DISK", "I/O", "Kbytes", "AVGms"))
 
-    # by-PID output
-    counts = b.get_table("counts")
-    line = 0
-    for k, v in reversed(sorted(counts.items(),
-                                key=lambda counts: counts[1].bytes)):
+    # by-PID output, draining the table
+    for k, v in top.update():
 
         # lookup disk
         disk = str(k.major) + "," + str(k.minor)
@@ -233,11 +233,6 @@ while 1:
             k.name.decode('utf-8', 'replace'), "W" if k.rwflag else "R",
             k.major, k.minor, diskname, v.io, v.bytes / 1024, avg_ms))
 
-        line += 1
-        if line >= maxrows:
-            break
-    counts.clear()
-
     countdown -= 1
     if exiting or countdown == 0:
         print("Detaching...")
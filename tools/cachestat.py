@@ -3,7 +3,7 @@
 # cachestat     Count cache kernel function calls.
 #               For Linux, uses BCC, eBPF. See .c file.
 #
-# USAGE: cachestat
+# USAGE: cachestat [-T] [-C] [interval [count]]
 # Taken from funccount by Brendan Gregg
 # This is a rewrite of cachestat from perf to bcc
 # https://github.com/brendangregg/perf-tools/blob/master/fs/cachestat
@@ -22,8 +22,7 @@ from bcc import BPF
 from time import sleep, strftime
 import argparse
 import signal
-import re
-from sys import argv
+import os
 
 # signal handler
 def signal_ignore(signal, frame):
@@ -40,14 +39,20 @@ def get_meminfo():
         result[k[0]] = int(v[0])
     return result
 
-# set global variables
-mpa = 0
-mbd = 0
-apcl = 0
-apd = 0
-total = 0
-misses = 0
-hits = 0
+# The functions counted, by their index in the counts table, with the name
+# they have on older kernels first. account_page_dirtied() became
+# folio_account_dirtied() in 5.15.
+# FIXME: Both folio_account_dirtied() and account_page_dirtied() are
+# static functions and they may be gone during compilation and this may
+# introduce some inaccuracy.
+MPA, MBD, APCL, APD = range(4)
+FUNCS = [
+    (MPA, "do_count_mpa", ["mark_page_accessed", "folio_mark_accessed"]),
+    (MBD, "do_count_mbd", ["mark_buffer_dirty"]),
+    (APCL, "do_count_apcl", ["add_to_page_cache_lru", "filemap_add_folio"]),
+    (APD, "do_count_apd", ["account_page_dirtied", "folio_account_dirtied"]),
+]
+
 debug = 0
 
 # arguments
@@ -56,6 +61,8 @@ parser = argparse.ArgumentParser(
     formatter_class=argparse.RawDescriptionHelpFormatter)
 parser.add_argument("-T", "--timestamp", action="store_true",
     help="include timestamp on output")
+parser.add_argument("-C", "--cgroups", action="store_true",
+    help="also print a line per cgroup")
 parser.add_argument("interval", nargs="?", default=1,
     help="output interval, in seconds")
 parser.add_argument("count", nargs="?", default=-1,
@@ -70,22 +77,44 @@ interval = int(args.interval)
 # define BPF program
 bpf_text = """
 #include <uapi/linux/ptrace.h>
-struct key_t {
-    u64 ip;
-};
 
-BPF_HASH(counts, struct key_t);
+// Per-CPU counters indexed by function, never cleared: these functions are
+// among the hottest of the kernel, so they take no lock or atomic, and user
+// space reads the deltas summed over the CPUs.
+BPF_PERCPU_ARRAY(counts, u64, 4);
 
-int do_count(struct pt_regs *ctx) {
-    struct key_t key = {};
-    u64 ip;
+#ifdef BY_CGROUP
+struct cgroup_key_t {
+    u64 cgroup;
+    u64 func;
+};
 
-    key.ip = PT_REGS_IP(ctx);
-    counts.atomic_increment(key); // update counter
+BPF_PERCPU_HASH(cgroup_counts, struct cgroup_key_t, u64, 10240);
+#endif
+
+static __always_inline int do_count(int func)
+{
+    u64 *val = counts.lookup(&func);
+    if (val)
+        (*val)++;
+
+#ifdef BY_CGROUP
+    struct cgroup_key_t key = {};
+    u64 zero = 0;
+    key.cgroup = bpf_get_current_cgroup_id();
+    key.func = func;
+    val = cgroup_counts.lookup_or_try_init(&key, &zero);
+    if (val)
+        (*val)++;
+#endif
     return 0;
 }
 
-"""
+int do_count_mpa(struct pt_regs *ctx) { return do_count(%d); }
+int do_count_mbd(struct pt_regs *ctx) { return do_count(%d); }
+int do_count_apcl(struct pt_regs *ctx) { return do_count(%d); }
+int do_count_apd(struct pt_regs *ctx) { return do_count(%d); }
+""" % (MPA, MBD, APCL, APD)
 
 if debug or args.ebpf:
     print(bpf_text)
@@ -93,19 +122,52 @@ if debug or args.ebpf:
         exit()
 
 # load BPF program
-b = BPF(text=bpf_text)
-b.attach_kprobe(event="add_to_page_cache_lru", fn_name="do_count")
-b.attach_kprobe(event="mark_page_accessed", fn_name="do_count")
+b = BPF(text=bpf_text, cflags=["-DBY_CGROUP"] if args.cgroups else [])
+for func, fn_name, events in FUNCS:
+    for event in events:
+        if BPF.get_kprobe_functions(("^%s$" % event).encode()):
+            b.attach_kprobe(event=event, fn_name=fn_name)
+            break
+
+def cgroup_paths():
+    # cgroup v2 ids are the inode numbers of the cgroup directories
+    mount = "/sys/fs/cgroup"
+    with open("/proc/mounts") as f:
+        for line in f:
+            fields = line.split()
+            if fields[2] == "cgroup2":
+                mount = fields[1]
+                break
+    paths = {}
+    for path, _, _ in os.walk(mount):
+        try:
+            paths[os.stat(path).st_ino] = path[len(mount):] or "/"
+        except OSError:
+            pass
+    return paths
+
+def cache_stats(calls):
+    mpa, mbd, apcl, apd = calls
+    # total = total cache accesses without counting dirties
+    # misses = total of add to lru because of read misses
+    total = max(0, mpa - mbd)
+    misses = max(0, apcl - apd)
+    hits = total - misses
 
-# Function account_page_dirtied() is changed to folio_account_dirtied() in 5.15.
-# FIXME: Both folio_account_dirtied() and account_page_dirtied() are
-# static functions and they may be gone during compilation and this may
-# introduce some inaccuracy.
-if BPF.get_kprobe_functions(b'folio_account_dirtied'):
-    b.attach_kprobe(event="folio_account_dirtied", fn_name="do_count")
-elif BPF.get_kprobe_functions(b'account_page_dirtied'):
-    b.attach_kprobe(event="account_page_dirtied", fn_name="do_count")
-b.attach_kprobe(event="mark_buffer_dirty", fn_name="do_count")
+    # If hits are < 0, then its possible misses are overestimated
+    # due to possibly page cache read ahead adding more pages than
+    # needed. In this case just assume misses as total and reset hits.
+    if hits < 0:
+        misses = total
+        hits = 0
+    ratio = 0
+    if total > 0:
+        ratio = float(hits) / total
+
+    if debug:
+        print("%d %d %d %d %d %d %d\n" %
+        (mpa, mbd, apcl, apd, total, misses, hits))
+    return hits, misses, mbd, ratio
 
 # header
 if tstamp:
@@ -113,6 +175,10 @@ if tstamp:
 print("%8s %8s %8s %8s %12s %10s" %
      ("HITS", "MISSES", "DIRTIES", "HITRATIO", "BUFFERS_MB", "CACHED_MB"))
 
+calls = b["counts"].histogram_delta()
+if args.cgroups:
+    cgroup_counts = b["cgroup_counts"]
+
 loop = 0
 exiting = 0
 while 1:
@@ -128,44 +194,7 @@ while 1:
         # as cleanup can take many seconds, trap Ctrl-C:
         signal.signal(signal.SIGINT, signal_ignore)
 
-    counts = b["counts"]
-    for k, v in sorted(counts.items(), key=lambda counts: counts[1].value):
-        func = b.ksym(k.ip)
-        # partial string matches in case of .isra (necessary?)
-        if func.find(b"mark_page_accessed") == 0:
-            mpa = max(0, v.value)
-        if func.find(b"mark_buffer_dirty") == 0:
-            mbd = max(0, v.value)
-        if func.find(b"add_to_page_cache_lru") == 0:
-            apcl = max(0, v.value)
-        if func.find(b"account_page_dirtied") == 0:
-            apd = max(0, v.value)
-
-    # total = total cache accesses without counting dirties
-    # misses = total of add to lru because of read misses
-    total = mpa - mbd
-    misses = apcl - apd
-    if misses < 0:
-        misses = 0
-    if total < 0:
-        total = 0
-    hits = total - misses
-
-    # If hits are < 0, then its possible misses are overestimated
-    # due to possibly page cache read ahead adding more pages than
-    # needed. In this case just assume misses as total and reset hits.
-    if hits < 0:
-        misses = total
-        hits = 0
-    ratio = 0
-    if total > 0:
-        ratio = float(hits) / total
-
-    if debug:
-        print("%d %d %d %d %d %d %d\n" %
-        (mpa, mbd, apcl, apd, total, misses, hits))
-
-    counts.clear()
+    hits, misses, mbd, ratio = cache_stats(calls.update())
 
     # Get memory info
     mem = get_meminfo()
@@ -177,7 +206,17 @@ while 1:
     print("%8d %8d %8d %7.2f%% %12.0f %10.0f" %
         (hits, misses, mbd, 100 * ratio, buff, cached))
 
-    mpa = mbd = apcl = apd = total = misses = hits = cached = buff = 0
+    if args.cgroups:
+        by_cgroup = {}
+        for k, v in cgroup_counts.items_sum(delete=True):
+            by_cgroup.setdefault(k.cgroup, [0] * len(FUNCS))[k.func] = v.value
+        paths = cgroup_paths()
+        for cgroup, cg_calls in sorted(by_cgroup.items()):
+            hits, misses, mbd, ratio = cache_stats(cg_calls)
+            if tstamp:
+                print("%-8s " % "", end="")
+            print("%8d %8d %8d %7.2f%%   %s" % (hits, misses, mbd,
+                100 * ratio, paths.get(cgroup, cgroup)))
 
     if exiting:
         print("Detaching...")
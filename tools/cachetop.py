@@ -25,7 +25,6 @@ from time import strftime
 import argparse
 import curses
 import pwd
-import re
 import signal
 from time import sleep
 
@@ -42,6 +41,16 @@ FIELDS = (
 DEFAULT_FIELD = "HITS"
 DEFAULT_SORT_FIELD = FIELDS.index(DEFAULT_FIELD)
 
+# The functions counted, by their index in the func field of the counts
+# keys, with the name they have on older kernels first. See cachestat.
+MPA, MBD, APCL, APD = range(4)
+FUNCS = [
+    (MPA, "do_count_mpa", ["mark_page_accessed", "folio_mark_accessed"]),
+    (MBD, "do_count_mbd", ["mark_buffer_dirty"]),
+    (APCL, "do_count_apcl", ["add_to_page_cache_lru", "filemap_add_folio"]),
+    (APD, "do_count_apd", ["account_page_dirtied", "folio_account_dirtied"]),
+]
+
 # signal handler
 def signal_ignore(signal, frame):
     print()
@@ -61,6 +70,7 @@ def get_meminfo():
 
 def get_processes_stats(
         bpf,
+        counts,
         sort_field=DEFAULT_SORT_FIELD,
         sort_reverse=False):
     '''
@@ -69,54 +79,36 @@ def get_processes_stats(
     cached
     list of tuple with per process cache stats
     '''
-    counts = bpf.get_table("counts")
-    stats = defaultdict(lambda: defaultdict(int))
-    for k, v in counts.items():
-        stats["%d-%d-%s" % (k.pid, k.uid, k.comm.decode('utf-8', 'replace'))][k.ip] = v.value
+    stats = defaultdict(lambda: [0] * len(FUNCS))
+    # drain the counts, every entry is needed to sum them by process
+    for k, v in counts.items_sum(delete=True):
+        stats["%d-%d-%s" % (k.pid, k.uid, k.comm.decode('utf-8', 'replace'))][k.func] = v.value
     stats_list = []
 
     for pid, count in sorted(stats.items(), key=lambda stat: stat[0]):
         rtaccess = 0
         wtaccess = 0
-        mpa = 0
-        mbd = 0
-        apcl = 0
-        apd = 0
-        access = 0
-        misses = 0
         rhits = 0
         whits = 0
-
-        for k, v in count.items():
-            if re.match(b'mark_page_accessed', bpf.ksym(k)) is not None:
-                mpa = max(0, v)
-
-            if re.match(b'mark_buffer_dirty', bpf.ksym(k)) is not None:
-                mbd = max(0, v)
-
-            if re.match(b'add_to_page_cache_lru', bpf.ksym(k)) is not None:
-                apcl = max(0, v)
-
-            if re.match(b'account_page_dirtied', bpf.ksym(k)) is not None:
-                apd = max(0, v)
-
-            # access = total cache access incl. reads(mpa) and writes(mbd)
-            # misses = total of add to lru which we do when we write(mbd)
-            # and also the mark the page dirty(same as mbd)
-            access = (mpa + mbd)
-            misses = (apcl + apd)
-
-            # rtaccess is the read hit % during the sample period.
-            # wtaccess is the write hit % during the sample period.
-            if mpa > 0:
-                rtaccess = float(mpa) / (access + misses)
-            if apcl > 0:
-                wtaccess = float(apcl) / (access + misses)
-
-            if wtaccess != 0:
-                whits = 100 * wtaccess
-            if rtaccess != 0:
-                rhits = 100 * rtaccess
+        mpa, mbd, apcl, apd = [max(0, v) for v in count]
+
+        # access = total cache access incl. reads(mpa) and writes(mbd)
+        # misses = total of add to lru which we do when we write(mbd)
+        # and also the mark the page dirty(same as mbd)
+        access = (mpa + mbd)
+        misses = (apcl + apd)
+
+        # rtaccess is the read hit % during the sample period.
+        # wtaccess is the write hit % during the sample period.
+        if mpa > 0:
+            rtaccess = float(mpa) / (access + misses)
+        if apcl > 0:
+            wtaccess = float(apcl) / (access + misses)
+
+        if wtaccess != 0:
+            whits = 100 * wtaccess
+        if rtaccess != 0:
+            rhits = 100 * rtaccess
 
         _pid, uid, comm = pid.split('-', 2)
         stats_list.append(
@@ -127,7 +119,6 @@ def get_processes_stats(
     stats_list = sorted(
         stats_list, key=lambda stat: stat[sort_field], reverse=sort_reverse
     )
-    counts.clear()
     return stats_list
 
 
@@ -143,40 +134,46 @@ def handle_loop(stdscr, args):
 
     #include <uapi/linux/ptrace.h>
     struct key_t {
-        u64 ip;
         u32 pid;
         u32 uid;
+        u32 func;
         char comm[16];
     };
 
-    BPF_HASH(counts, struct key_t);
+    // per-CPU, so that these hot paths take no lock or atomic
+    BPF_PERCPU_HASH(counts, struct key_t, u64);
 
-    int do_count(struct pt_regs *ctx) {
+    static __always_inline int do_count(u32 func) {
         struct key_t key = {};
         u64 pid = bpf_get_current_pid_tgid();
         u32 uid = bpf_get_current_uid_gid();
+        u64 zero = 0, *val;
 
-        key.ip = PT_REGS_IP(ctx);
         key.pid = pid >> 32;
         key.uid = uid;
+        key.func = func;
         bpf_get_current_comm(&(key.comm), 16);
 
-        counts.increment(key);
+        val = counts.lookup_or_try_init(&key, &zero);
+        if (val)
+            (*val)++;
         return 0;
     }
 
-    """
-    b = BPF(text=bpf_text)
-    b.attach_kprobe(event="add_to_page_cache_lru", fn_name="do_count")
-    b.attach_kprobe(event="mark_page_accessed", fn_name="do_count")
-    b.attach_kprobe(event="mark_buffer_dirty", fn_name="do_count")
+    int do_count_mpa(struct pt_regs *ctx) { return do_count(%d); }
+    int do_count_mbd(struct pt_regs *ctx) { return do_count(%d); }
+    int do_count_apcl(struct pt_regs *ctx) { return do_count(%d); }
+    int do_count_apd(struct pt_regs *ctx) { return do_count(%d); }
 
-    # Function account_page_dirtied() is changed to folio_account_dirtied() in 5.15.
-    if BPF.get_kprobe_functions(b'folio_account_dirtied'):
-        b.attach_kprobe(event="folio_account_dirtied", fn_name="do_count")
-    elif BPF.get_kprobe_functions(b'account_page_dirtied'):
-        b.attach_kprobe(event="account_page_dirtied", fn_name="do_count")
+    """ % (MPA, MBD, APCL, APD)
+    b = BPF(text=bpf_text)
+    for func, fn_name, events in FUNCS:
+        for event in events:
+            if BPF.get_kprobe_functions(("^%s$" % event).encode()):
+                b.attach_kprobe(event=event, fn_name=fn_name)
+                break
 
+    counts = b.get_table("counts")
     exiting = 0
 
     while 1:
@@ -203,6 +200,7 @@ def handle_loop(stdscr, args):
 
         process_stats = get_processes_stats(
             b,
+            counts,
             sort_field=sort_field,
             sort_reverse=sort_reverse)
         stdscr.clear()
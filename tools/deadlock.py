@@ -67,7 +67,6 @@ class DiGraph(object):
         # Map of node -> set of nodes
         self.adjacency_map = {}
         # Map of (node1, node2) -> map string -> arbitrary attribute
-        # This will not be copied in subgraph()
         self.attributes_map = {}
 
     def neighbors(self, node):
@@ -94,19 +93,6 @@ class DiGraph(object):
         self.adjacency_map[node1].add(node2)
         self.attributes_map[(node1, node2)] = kwargs
 
-    def remove_node(self, node):
-        self.adjacency_map.pop(node, None)
-        for _, neighbors in self.adjacency_map.items():
-            neighbors.discard(node)
-
-    def subgraph(self, nodes):
-        graph = DiGraph()
-        for node in nodes:
-            for neighbor in self.neighbors(node):
-                if neighbor in nodes:
-                    graph.add_edge(node, neighbor)
-        return graph
-
     def node_link_data(self):
         '''
         Returns the graph as a dictionary in a format that can be
@@ -136,150 +122,105 @@ class DiGraph(object):
         return data
 
 
-def strongly_connected_components(G):
-    '''
-    Adapted from networkx: http://networkx.github.io/
-    Parameters
-    ----------
-    G : DiGraph
-    Returns
-    -------
-    comp : generator of sets
-        A generator of sets of nodes, one for each strongly connected
-        component of G.
-    '''
-    preorder = {}
-    lowlink = {}
-    scc_found = {}
-    scc_queue = []
-    i = 0  # Preorder counter
-    for source in G.nodes():
-        if source not in scc_found:
-            queue = [source]
-            while queue:
-                v = queue[-1]
-                if v not in preorder:
-                    i = i + 1
-                    preorder[v] = i
-                done = 1
-                v_nbrs = G.neighbors(v)
-                for w in v_nbrs:
-                    if w not in preorder:
-                        queue.append(w)
-                        done = 0
-                        break
-                if done == 1:
-                    lowlink[v] = preorder[v]
-                    for w in v_nbrs:
-                        if w not in scc_found:
-                            if preorder[w] > preorder[v]:
-                                lowlink[v] = min([lowlink[v], lowlink[w]])
-                            else:
-                                lowlink[v] = min([lowlink[v], preorder[w]])
-                    queue.pop()
-                    if lowlink[v] == preorder[v]:
-                        scc_found[v] = True
-                        scc = {v}
-                        while (
-                            scc_queue and preorder[scc_queue[-1]] > preorder[v]
-                        ):
-                            k = scc_queue.pop()
-                            scc_found[k] = True
-                            scc.add(k)
-                        yield scc
-                    else:
-                        scc_queue.append(v)
-
-
-def simple_cycles(G):
+class CycleDetector(object):
     '''
-    Adapted from networkx: http://networkx.github.io/
-    Parameters
-    ----------
-    G : DiGraph
-    Returns
-    -------
-    cycle_generator: generator
-       A generator that produces elementary cycles of the graph.
-       Each cycle is represented by a list of nodes along the cycle.
+    Finds the first cycle in a graph whose edges are added one at a time.
+    A topological order of the nodes is kept up to date (Pearce and Kelly,
+    "A Dynamic Topological Sort Algorithm for Directed Acyclic Graphs"), so
+    that an edge agreeing with the order costs nothing, and the search for
+    a cycle closed by another edge only visits the nodes between its ends in
+    the order, instead of the whole graph.
     '''
 
-    def _unblock(thisnode, blocked, B):
-        stack = set([thisnode])
+    def __init__(self, graph):
+        self.graph = graph
+        # Map of node -> position in the topological order
+        self.order = {}
+        # Map of node -> set of nodes with an edge to it
+        self.predecessors = defaultdict(set)
+
+    def add_edge(self, node1, node2, **kwargs):
+        '''
+        Adds the edge node1 => node2 to the graph. If it closes a cycle of
+        nodes a1, a2, ..., an, returns its edges:
+            [(a1,a2), (a2,a3), ... (an-1,an), (an, a1)]
+        Otherwise returns an empty list.
+        '''
+        new_edge = node2 not in self.graph.neighbors(node1)
+        self.graph.add_edge(node1, node2, **kwargs)
+        if not new_edge:
+            return []
+        for node in (node1, node2):
+            if node not in self.order:
+                self.order[node] = len(self.order)
+        self.predecessors[node2].add(node1)
+
+        lower, upper = self.order[node2], self.order[node1]
+        if lower > upper:
+            return []
+
+        # Nodes reachable from node2 that are ordered before node1: reaching
+        # node1 closes a cycle
+        parents = {node2: None}
+        forward = []
+        stack = [node2]
         while stack:
             node = stack.pop()
-            if node in blocked:
-                blocked.remove(node)
-                stack.update(B[node])
-                B[node].clear()
-
-    # Johnson's algorithm requires some ordering of the nodes.
-    # We assign the arbitrary ordering given by the strongly connected comps
-    # There is no need to track the ordering as each node removed as processed.
-    # save the actual graph so we can mutate it here
-    # We only take the edges because we do not want to
-    # copy edge and node attributes here.
-    subG = G.subgraph(G.nodes())
-    sccs = list(strongly_connected_components(subG))
-    while sccs:
-        scc = sccs.pop()
-        # order of scc determines ordering of nodes
-        startnode = scc.pop()
-        # Processing node runs 'circuit' routine from recursive version
-        path = [startnode]
-        blocked = set()  # vertex: blocked from search?
-        closed = set()  # nodes involved in a cycle
-        blocked.add(startnode)
-        B = defaultdict(set)  # graph portions that yield no elementary circuit
-        stack = [(startnode, list(subG.neighbors(startnode)))]
+            forward.append(node)
+            for neighbor in self.graph.neighbors(node):
+                if neighbor == node1:
+                    return self._cycle(node1, node, parents)
+                if neighbor not in parents and self.order[neighbor] < upper:
+                    parents[neighbor] = node
+                    stack.append(neighbor)
+
+        # Nodes reaching node1 that are ordered after node2
+        seen = set([node1])
+        backward = []
+        stack = [node1]
         while stack:
-            thisnode, nbrs = stack[-1]
-            if nbrs:
-                nextnode = nbrs.pop()
-                if nextnode == startnode:
-                    yield path[:]
-                    closed.update(path)
-                elif nextnode not in blocked:
-                    path.append(nextnode)
-                    stack.append((nextnode, list(subG.neighbors(nextnode))))
-                    closed.discard(nextnode)
-                    blocked.add(nextnode)
-                    continue
-            # done with nextnode... look for more neighbors
-            if not nbrs:  # no more nbrs
-                if thisnode in closed:
-                    _unblock(thisnode, blocked, B)
-                else:
-                    for nbr in subG.neighbors(thisnode):
-                        if thisnode not in B[nbr]:
-                            B[nbr].add(thisnode)
-                stack.pop()
-                path.pop()
-        # done processing this node
-        subG.remove_node(startnode)
-        H = subG.subgraph(scc)  # make smaller to avoid work in SCC routine
-        sccs.extend(list(strongly_connected_components(H)))
-
-
-def find_cycle(graph):
+            node = stack.pop()
+            backward.append(node)
+            for pred in self.predecessors[node]:
+                if pred not in seen and self.order[pred] > lower:
+                    seen.add(pred)
+                    stack.append(pred)
+
+        # Both sets keep their own order and move to the positions they
+        # held together, backward ones first
+        backward.sort(key=self.order.get)
+        forward.sort(key=self.order.get)
+        nodes = backward + forward
+        positions = sorted(self.order[node] for node in nodes)
+        for node, position in zip(nodes, positions):
+            self.order[node] = position
+        return []
+
+    def _cycle(self, node1, last, parents):
+        # node1 => node2 => ... => last => node1
+        path = [last]
+        while parents[path[-1]] is not None:
+            path.append(parents[path[-1]])
+        nodes = [node1] + path[::-1] + [node1]
+        return list(zip(nodes[:-1], nodes[1:]))
+
+
+def drain_edges(table):
     '''
-    Looks for a cycle in the graph. If found, returns the first cycle.
-    If nodes a1, a2, ..., an are in a cycle, then this returns:
-        [(a1,a2), (a2,a3), ... (an-1,an), (an, a1)]
-    Otherwise returns an empty list.
+    Returns the edges recorded since the last call and removes them from the
+    table, so that it only has to hold the edges of one interval.
     '''
-    cycles = list(simple_cycles(graph))
-    if cycles:
-        nodes = cycles[0]
-        nodes.append(nodes[0])
-        edges = []
-        prev = nodes[0]
-        for node in nodes[1:]:
-            edges.append((prev, node))
-            prev = node
-        return edges
-    else:
-        return []
+    try:
+        return list(table.items_lookup_and_delete_batch())
+    except Exception:
+        # no batch ops before Linux 5.6
+        items = table.items()
+        for key, _ in items:
+            try:
+                del table[key]
+            except KeyError:
+                pass
+        return items
 
 
 def print_cycle(binary, graph, edges, thread_info, print_stack_trace_fn):
@@ -464,8 +405,9 @@ def main():
     )
     parser.add_argument(
         '-e', '--edges', type=int, default=65536,
-        help='Specifies the maximum number of edge cases that can be recorded. '
-             'default 65536. Note. 88 bytes per edge case.'
+        help='Specifies the maximum number of new edge cases that can be '
+             'recorded each second. default 65536. Note. 88 bytes per edge '
+             'case.'
     )
     args = parser.parse_args()
     if not args.binary:
@@ -522,21 +464,20 @@ def main():
                     line = symbol
             print('@ %016x %s' % (addr, line))
 
+    # Mutex wait directed graph. Nodes are mutexes. Edge (A,B) exists
+    # if there exists some thread T where lock(A) was called and
+    # lock(B) was called before unlock(A) was called.
+    graph = DiGraph()
+    detector = CycleDetector(graph)
+
     print('Tracing... Hit Ctrl-C to end.')
     while True:
         try:
-            # Map of child thread pid -> parent info
-            thread_info = {
-                child.value: (parent.parent_pid, parent.stack_id, parent.comm)
-                for child, parent in bpf.get_table('thread_to_parent').items()
-            }
-
-            # Mutex wait directed graph. Nodes are mutexes. Edge (A,B) exists
-            # if there exists some thread T where lock(A) was called and
-            # lock(B) was called before unlock(A) was called.
-            graph = DiGraph()
-            for key, leaf in bpf.get_table('edges').items():
-                graph.add_edge(
+            # The edges are checked as they come, and only the new ones are
+            # kept in the kernel
+            cycle = []
+            for key, leaf in drain_edges(bpf.get_table('edges')):
+                cycle = detector.add_edge(
                     key.mutex1,
                     key.mutex2,
                     thread_pid=leaf.thread_pid,
@@ -544,6 +485,8 @@ def main():
                     first_mutex_stack_id=leaf.mutex1_stack_id,
                     second_mutex_stack_id=leaf.mutex2_stack_id,
                 )
+                if cycle:
+                    break
             if args.verbose:
                 print(
                     'Mutexes: %d, Edges: %d' %
@@ -554,8 +497,14 @@ def main():
                     data = graph.node_link_data()
                     f.write(json.dumps(data, indent=2))
 
-            cycle = find_cycle(graph)
             if cycle:
+                # Map of child thread pid -> parent info
+                thread_info = {
+                    child.value: (parent.parent_pid, parent.stack_id,
+                                  parent.comm)
+                    for child, parent in
+                    bpf.get_table('thread_to_parent').items()
+                }
                 print_cycle(
                     args.binary, graph, cycle, thread_info, print_stack_trace
                 )
@@ -23,10 +23,10 @@ from bcc.containers import filter_by_containers
 from bcc.utils import ArgString, printb
 import bcc.utils as utils
 import argparse
+import ctypes as ct
 import re
 import time
 import pwd
-from collections import defaultdict
 from time import strftime
 
 
@@ -101,38 +101,38 @@ bpf_text = """
 #include <linux/fs.h>
 
 #define ARGSIZE  128
+#define ARGSBUF  (MAXARG * ARGSIZE)
 
-enum event_type {
-    EVENT_ARG,
-    EVENT_RET,
-};
-
+// The whole argv goes out in one record when the exec returns: the
+// arguments are packed in args, each with its terminating NUL, and the
+// record is cut after args_size bytes. args_count exceeds the number of
+// arguments in args when the list was truncated.
 struct data_t {
     u32 pid;  // PID as in the userspace term (i.e. task->tgid in kernel)
     u32 ppid; // Parent PID as in the userspace term (i.e task->real_parent->tgid in kernel)
     u32 uid;
-    char comm[TASK_COMM_LEN];
-    enum event_type type;
-    char argv[ARGSIZE];
     int retval;
+    u32 args_count;
+    u32 args_size;
+    char comm[TASK_COMM_LEN];
+    char args[ARGSBUF];
 };
 
+// execs in flight, by thread: too large for the stack
+BPF_HASH(execs, u32, struct data_t, 10240);
+BPF_PERCPU_ARRAY(scratch, struct data_t, 1);
 BPF_PERF_OUTPUT(events);
 
-static int __submit_arg(struct pt_regs *ctx, void *ptr, struct data_t *data)
+static __always_inline int append_arg(struct data_t *data, const char *ptr)
 {
-    bpf_probe_read_user(data->argv, sizeof(data->argv), ptr);
-    events.perf_submit(ctx, data, sizeof(struct data_t));
-    return 1;
-}
-
-static int submit_arg(struct pt_regs *ctx, void *ptr, struct data_t *data)
-{
-    const char *argp = NULL;
-    bpf_probe_read_user(&argp, sizeof(argp), ptr);
-    if (argp) {
-        return __submit_arg(ctx, (void *)(argp), data);
-    }
+    if (data->args_size > ARGSBUF - ARGSIZE)
+        return -1;
+    int len = bpf_probe_read_user_str(&data->args[data->args_size], ARGSIZE,
+                                      ptr);
+    if (len <= 0)
+        return -1;
+    data->args_size += len;
+    data->args_count++;
     return 0;
 }
 
@@ -150,63 +150,66 @@ int syscall__execve(struct pt_regs *ctx,
         return 0;
     }
 
-    // create data here and pass to submit_arg to save stack space (#555)
-    struct data_t data = {};
+    u64 id = bpf_get_current_pid_tgid();
+    u32 tid = id;
+    int zero = 0;
+    struct data_t *data = scratch.lookup(&zero);
+    if (!data || execs.insert(&tid, data) != 0)
+        return 0;
+    data = execs.lookup(&tid);
+    if (!data)
+        return 0;
+
     struct task_struct *task;
 
-    data.pid = bpf_get_current_pid_tgid() >> 32;
+    data->pid = id >> 32;
+    data->uid = uid;
+    data->args_count = 0;
+    data->args_size = 0;
 
     task = (struct task_struct *)bpf_get_current_task();
     // Some kernels, like Ubuntu 4.13.0-generic, return 0
     // as the real_parent->tgid.
     // We use the get_ppid function as a fallback in those cases. (#1883)
-    data.ppid = task->real_parent->tgid;
-
-    bpf_get_current_comm(&data.comm, sizeof(data.comm));
-    data.type = EVENT_ARG;
+    data->ppid = task->real_parent->tgid;
 
-    __submit_arg(ctx, (void *)filename, &data);
+    if (append_arg(data, filename) != 0)
+        return 0;
 
     // skip first arg, as we submitted filename
+    const char *argp;
     #pragma unroll
     for (int i = 1; i < MAXARG; i++) {
-        if (submit_arg(ctx, (void *)&__argv[i], &data) == 0)
-             goto out;
+        argp = NULL;
+        bpf_probe_read_user(&argp, sizeof(argp), (void *)&__argv[i]);
+        if (!argp || append_arg(data, argp) != 0)
+            return 0;
     }
 
-    // handle truncated argument list
-    char ellipsis[] = "...";
-    __submit_arg(ctx, (void *)ellipsis, &data);
-out:
+    // flag a truncated argument list
+    argp = NULL;
+    bpf_probe_read_user(&argp, sizeof(argp), (void *)&__argv[MAXARG]);
+    if (argp)
+        data->args_count++;
     return 0;
 }
 
 int do_ret_sys_execve(struct pt_regs *ctx)
 {
-    if (container_should_be_filtered()) {
+    u32 tid = bpf_get_current_pid_tgid();
+    struct data_t *data = execs.lookup(&tid);
+    if (!data)
         return 0;
-    }
-
-    struct data_t data = {};
-    struct task_struct *task;
-
-    u32 uid = bpf_get_current_uid_gid() & 0xffffffff;
-    UID_FILTER
-
-    data.pid = bpf_get_current_pid_tgid() >> 32;
-    data.uid = uid;
-
-    task = (struct task_struct *)bpf_get_current_task();
-    // Some kernels, like Ubuntu 4.13.0-generic, return 0
-    // as the real_parent->tgid.
-    // We use the get_ppid function as a fallback in those cases. (#1883)
-    data.ppid = task->real_parent->tgid;
-
-    bpf_get_current_comm(&data.comm, sizeof(data.comm));
-    data.type = EVENT_RET;
-    data.retval = PT_REGS_RC(ctx);
-    events.perf_submit(ctx, &data, sizeof(data));
 
+    data->retval = PT_REGS_RC(ctx);
+    if (data->retval == 0 || INCLUDE_FAILED) {
+        bpf_get_current_comm(&data->comm, sizeof(data->comm));
+        u32 len = data->args_size;
+        if (len <= ARGSBUF)
+            events.perf_submit(ctx, data,
+                               offsetof(struct data_t, args) + len);
+    }
+    execs.delete(&tid);
     return 0;
 }
 """
@@ -218,13 +221,17 @@ if args.uid:
         'if (uid != %s) { return 0; }' % args.uid)
 else:
     bpf_text = bpf_text.replace('UID_FILTER', '')
+bpf_text = bpf_text.replace('INCLUDE_FAILED', "1" if args.fails else "0")
 bpf_text = filter_by_containers(args) + bpf_text
 if args.ebpf:
     print(bpf_text)
     exit()
 
 # initialize BPF
-b = BPF(text=bpf_text)
+# a ring buffer shared by all CPUs keeps the records in order, without
+# memory set aside per CPU
+cflags = ["-DBCC_PERF_OUTPUT_RINGBUF"] if BPF.support_ringbuf() else []
+b = BPF(text=bpf_text, cflags=cflags)
 execve_fnname = b.get_syscall_fnname("execve")
 b.attach_kprobe(event=execve_fnname, fn_name="syscall__execve")
 b.attach_kretprobe(event=execve_fnname, fn_name="do_ret_sys_execve")
@@ -238,12 +245,7 @@ if args.print_uid:
     print("%-6s" % ("UID"), end="")
 print("%-16s %-6s %-6s %3s %s" % ("PCOMM", "PID", "PPID", "RET", "ARGS"))
 
-class EventType(object):
-    EVENT_ARG = 0
-    EVENT_RET = 1
-
 start_ts = time.time()
-argv = defaultdict(list)
 
 # This is best-effort PPID matching. Short-lived processes may exit
 # before we get a chance to read the PPID.
@@ -262,40 +264,32 @@ def get_ppid(pid):
 # process event
 def print_event(cpu, data, size):
     event = b["events"].event(data)
-    skip = False
-
-    if event.type == EventType.EVENT_ARG:
-        argv[event.pid].append(event.argv)
-    elif event.type == EventType.EVENT_RET:
-        if event.retval != 0 and not args.fails:
-            skip = True
-        if args.name and not re.search(bytes(args.name), event.comm):
-            skip = True
-        if args.line and not re.search(bytes(args.line),
-                                       b' '.join(argv[event.pid])):
-            skip = True
-        if args.quote:
-            argv[event.pid] = [
-                b"\"" + arg.replace(b"\"", b"\\\"") + b"\""
-                for arg in argv[event.pid]
-            ]
-
-        if not skip:
-            if args.time:
-                printb(b"%-9s" % strftime("%H:%M:%S").encode('ascii'), nl="")
-            if args.timestamp:
-                printb(b"%-8.3f" % (time.time() - start_ts), nl="")
-            if args.print_uid:
-                printb(b"%-6d" % event.uid, nl="")
-            ppid = event.ppid if event.ppid > 0 else get_ppid(event.pid)
-            ppid = b"%d" % ppid if ppid > 0 else b"?"
-            argv_text = b' '.join(argv[event.pid]).replace(b'\n', b'\\n')
-            printb(b"%-16s %-6d %-6s %3d %s" % (event.comm, event.pid,
-                   ppid, event.retval, argv_text))
-        try:
-            del(argv[event.pid])
-        except Exception:
-            pass
+
+    # the c_char array stops at the first NUL, take the packed args raw
+    offset = type(event).args.offset
+    raw = ct.string_at(data, offset + event.args_size)[offset:]
+    argv = raw.split(b"\0")[:-1]
+    if event.args_count > len(argv):
+        argv.append(b"...")
+
+    if args.name and not re.search(bytes(args.name), event.comm):
+        return
+    if args.line and not re.search(bytes(args.line), b' '.join(argv)):
+        return
+    if args.quote:
+        argv = [b"\"" + arg.replace(b"\"", b"\\\"") + b"\"" for arg in argv]
+
+    if args.time:
+        printb(b"%-9s" % strftime("%H:%M:%S").encode('ascii'), nl="")
+    if args.timestamp:
+        printb(b"%-8.3f" % (time.time() - start_ts), nl="")
+    if args.print_uid:
+        printb(b"%-6d" % event.uid, nl="")
+    ppid = event.ppid if event.ppid > 0 else get_ppid(event.pid)
+    ppid = b"%d" % ppid if ppid > 0 else b"?"
+    argv_text = b' '.join(argv).replace(b'\n', b'\\n')
+    printb(b"%-16s %-6d %-6s %3d %s" % (event.comm, event.pid,
+           ppid, event.retval, argv_text))
 
 
 # loop with callback to print_event
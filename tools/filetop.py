@@ -169,11 +169,12 @@ DNAME_INLINE_LEN = 32  # linux/dcache.h
 
 print('Tracing... Output every %d secs. Hit Ctrl-C to end' % interval)
 
-def sort_fn(counts):
-    if args.sort == "all":
-        return (counts[1].rbytes + counts[1].wbytes + counts[1].reads + counts[1].writes)
-    else:
-        return getattr(counts[1], args.sort)
+# the maxrows largest entries by the sort column are selected in libbcc
+if args.sort == "all":
+    sort_fields = ["rbytes", "wbytes", "reads", "writes"]
+else:
+    sort_fields = [args.sort]
+top = b.get_table("counts").top(maxrows, sort_fields)
 
 # output
 exiting = 0
@@ -193,11 +194,8 @@ while 1:
     print("%-7s %-16s %-6s %-6s %-7s %-7s %1s %s" % ("TID", "COMM",
         "READS", "WRITES", "R_Kb", "W_Kb", "T", "FILE"))
 
-    # by-TID output
-    counts = b.get_table("counts")
-    line = 0
-    for k, v in reversed(sorted(counts.items(),
-                                key=sort_fn)):
+    # by-TID output, draining the table
+    for k, v in top.update():
         name = k.name.decode('utf-8', 'replace')
         if k.name_len > DNAME_INLINE_LEN:
             name = name[:-3] + "..."
@@ -208,11 +206,6 @@ while 1:
             v.rbytes / 1024, v.wbytes / 1024,
             k.type.decode('utf-8', 'replace'), name))
 
-        line += 1
-        if line >= maxrows:
-            break
-    counts.clear()
-
     countdown -= 1
     if exiting or countdown == 0:
         print("Detaching...")
@@ -82,11 +82,23 @@ class Probe(object):
         self.cpu = cpu
         self.matched = 0
         self.trace_functions = {}   # map location number to function name
+        # kernel functions are first tried with one kprobe multi link
+        self.multi = self.is_kernel_probe() and self.type == b"p"
 
     def is_kernel_probe(self):
         return self.type == b"t" or (self.type == b"p" and self.library == b"")
 
     def attach(self):
+        if self.multi:
+            functions = [self.trace_functions[i] for i in range(self.matched)]
+            if self.bpf.attach_kprobe_multi(functions, "trace_count",
+                                            cookies=list(range(self.matched))):
+                return
+            # no kprobe multi links before Linux 5.18, compile a program for
+            # each function instead
+            self.bpf.cleanup()
+            self.multi = False
+            self.load()
         if self.type == b"p" and not self.library:
             for index, function in self.trace_functions.items():
                 self.bpf.attach_kprobe(
@@ -117,8 +129,17 @@ class Probe(object):
 
     def _generate_functions(self, template):
         self.usdt = None
+        self.matched = 0
+        self.trace_functions = {}
         text = b""
-        if self.type == b"p" and not self.library:
+        if self.multi:
+            # a single program that finds the location in its cookie
+            functions = BPF.get_kprobe_functions(self.pattern)
+            verify_limit(len(functions))
+            for function in functions:
+                self._add_function(b"", function)
+            text = template
+        elif self.type == b"p" and not self.library:
             functions = BPF.get_kprobe_functions(self.pattern)
             verify_limit(len(functions))
             for function in functions:
@@ -163,7 +184,23 @@ class Probe(object):
         return text
 
     def load(self):
-        trace_count_text = b"""
+        if self.multi:
+            # the counts are per CPU, so they need no atomic increments
+            trace_count_text = b"""
+int trace_count(struct pt_regs *ctx) {
+    FILTERPID
+    FILTERCPU
+    int loc = bpf_get_attach_cookie(ctx);
+    counts.increment(loc);
+    return 0;
+}
+        """
+            bpf_text = b"""#include <uapi/linux/ptrace.h>
+
+BPF_PERCPU_ARRAY(counts, u64, NUMLOCATIONS);
+        """
+        else:
+            trace_count_text = b"""
 int PROBE_FUNCTION(void *ctx) {
     FILTERPID
     FILTERCPU
@@ -172,7 +209,7 @@ int PROBE_FUNCTION(void *ctx) {
     return 0;
 }
         """
-        bpf_text = b"""#include <uapi/linux/ptrace.h>
+            bpf_text = b"""#include <uapi/linux/ptrace.h>
 
 BPF_ARRAY(counts, u64, NUMLOCATIONS);
         """
@@ -210,8 +247,21 @@ BPF_ARRAY(counts, u64, NUMLOCATIONS);
     def counts(self):
         return self.bpf["counts"]
 
+    def items(self):
+        counts = self.bpf["counts"]
+        return counts.items_sum() if self.multi else counts.items()
+
     def clear(self):
         counts = self.bpf["counts"]
+        if self.multi:
+            # zero all the locations in one syscall
+            try:
+                counts.items_update_batch(
+                    (counts.Key * self.matched)(*range(self.matched)),
+                    (counts.Leaf * self.matched)())
+                return
+            except Exception:
+                pass
         for location, _ in list(self.trace_functions.items()):
             counts[counts.Key(location)] = counts.Leaf()
 
@@ -289,8 +339,7 @@ class Tool(object):
                 print("%-8s\n" % strftime("%H:%M:%S"), end="")
 
             print("%-36s %8s" % ("FUNC", "COUNT"))
-            counts = self.probe.counts()
-            for k, v in sorted(counts.items(),
+            for k, v in sorted(self.probe.items(),
                                key=lambda counts: counts[1].value):
                 if v.value == 0:
                     continue
@@ -77,31 +77,50 @@ parser.add_argument("--stack-storage-size", default=16384,
     type=positive_nonzero_int,
     help="the number of unique stack traces that can be stored and "
          "displayed (default 16384)")
+parser.add_argument("--max-tasks", default=10240,
+    type=positive_nonzero_int,
+    help="the number of tasks whose locks can be tracked at once, without "
+         "task local storage (default 10240)")
+parser.add_argument("--hash-state", action="store_true",
+    help="keep the state of the tasks in a hash map even when task local "
+         "storage is available")
 
 args = parser.parse_args()
 
 program = """
 #include <uapi/linux/ptrace.h>
 
-struct depth_id {
-  u64 id;
-  u64 depth;
+// locks held at once by a task whose hold time is measured, a power of 2
+#define MAX_LOCK_DEPTH 16
+
+// in-flight state of a task, one lookup per lock event
+struct lock_state {
+  u64 aq_ts;      // mutex_lock() entry time, 0 outside of mutex_lock()
+  u32 depth;      // locks taken and not released yet
+  int aq_stackid;
+  u64 held_ts[MAX_LOCK_DEPTH];
+  int stackid[MAX_LOCK_DEPTH];
 };
 
-BPF_ARRAY(enabled,   u64, 1);
-BPF_HASH(track,      u64, u64);
-BPF_HASH(time_aq,    u64, u64);
-BPF_HASH(lock_depth, u64, u64);
-BPF_HASH(time_held,  struct depth_id, u64);
-BPF_HASH(stack,      struct depth_id, int);
+struct report_t {
+  u64 count;
+  u64 total;
+  u64 max;
+};
 
-BPF_HASH(aq_report_count, int, u64);
-BPF_HASH(aq_report_max,   int, u64);
-BPF_HASH(aq_report_total, int, u64);
+BPF_ARRAY(enabled, u64, 1);
 
-BPF_HASH(hl_report_count, int, u64);
-BPF_HASH(hl_report_max,   int, u64);
-BPF_HASH(hl_report_total, int, u64);
+#if USE_TASK_STORAGE
+BPF_TASK_STORAGE(lock_states, struct lock_state);
+#else
+BPF_HASH(lock_states, u32, struct lock_state, MAX_TASKS);
+#endif
+
+// per-CPU, so that reporting a lock does not contend on the report
+BPF_F_TABLE("percpu_hash", int, struct report_t, aq_report, MAX_REPORTS,
+            BPF_F_NO_PREALLOC);
+BPF_F_TABLE("percpu_hash", int, struct report_t, hl_report, MAX_REPORTS,
+            BPF_F_NO_PREALLOC);
 
 BPF_STACK_TRACE(stack_traces, STACK_STORAGE_SIZE);
 
@@ -124,117 +143,60 @@ static bool allow_pid(u64 id)
     return 1;
 }
 
-static int do_mutex_lock_enter(void *ctx, int skip)
-{
-    if (!is_enabled())
-        return 0;
-
-    u64 id = bpf_get_current_pid_tgid();
-
-    if (!allow_pid(id))
-        return 0;
-
-    u64 one = 1, zero = 0;
-
-    track.update(&id, &one);
-
-    u64 *depth = lock_depth.lookup(&id);
-
-    if (!depth) {
-        lock_depth.update(&id, &zero);
-
-        depth = lock_depth.lookup(&id);
-        /* something is wrong.. */
-        if (!depth)
-            return 0;
-    }
-
-    int stackid = stack_traces.get_stackid(ctx, skip);
-    struct depth_id did = {
-      .id    = id,
-      .depth = *depth,
-    };
-    stack.update(&did, &stackid);
-
-    u64 ts = bpf_ktime_get_ns();
-    time_aq.update(&id, &ts);
-
-    *depth += 1;
-    return 0;
-}
-
-static void update_aq_report_count(int *stackid)
+static struct lock_state *get_state(u32 tid, bool create)
 {
-    u64 *count, one = 1;
-
-    count = aq_report_count.lookup(stackid);
-    if (!count) {
-        aq_report_count.update(stackid, &one);
-    } else {
-        *count += 1;
-    }
-}
-
-static void update_hl_report_count(int *stackid)
-{
-    u64 *count, one = 1;
-
-    count = hl_report_count.lookup(stackid);
-    if (!count) {
-        hl_report_count.update(stackid, &one);
-    } else {
-        *count += 1;
-    }
+#if USE_TASK_STORAGE
+    return lock_states.task_storage_get(bpf_get_current_task_btf(), 0,
+        create ? BPF_LOCAL_STORAGE_GET_F_CREATE : 0);
+#else
+    struct lock_state zero = {};
+
+    if (create)
+        return lock_states.lookup_or_try_init(&tid, &zero);
+    return lock_states.lookup(&tid);
+#endif
 }
 
-static void update_aq_report_max(int *stackid, u64 time)
+static void put_state(u32 tid, struct lock_state *state)
 {
-    u64 *max;
-
-    max = aq_report_max.lookup(stackid);
-    if (!max || *max < time)
-        aq_report_max.update(stackid, &time);
+#if !USE_TASK_STORAGE
+    // task storage goes away with the task, hash entries have to be removed
+    if (state->depth == 0 && state->aq_ts == 0)
+        lock_states.delete(&tid);
+#endif
 }
 
-static void update_hl_report_max(int *stackid, u64 time)
+static void update_report(struct report_t *report, u64 delta)
 {
-    u64 *max;
-
-    max = hl_report_max.lookup(stackid);
-    if (!max || *max < time)
-        hl_report_max.update(stackid, &time);
+    report->count += 1;
+    report->total += delta;
+    if (report->max < delta)
+        report->max = delta;
 }
 
-static void update_aq_report_total(int *stackid, u64 delta)
+static int do_mutex_lock_enter(void *ctx, int skip)
 {
-    u64 *count, *time;
+    if (!is_enabled())
+        return 0;
 
-    count = aq_report_count.lookup(stackid);
-    if (!count)
-        return;
+    u64 id = bpf_get_current_pid_tgid();
 
-    time = aq_report_total.lookup(stackid);
-    if (!time) {
-        aq_report_total.update(stackid, &delta);
-    } else {
-        *time = *time + delta;
-    }
-}
+    if (!allow_pid(id))
+        return 0;
 
-static void update_hl_report_total(int *stackid, u64 delta)
-{
-    u64 *count, *time;
+    struct lock_state *state = get_state(id, true);
+    if (!state)
+        return 0;
 
-    count = hl_report_count.lookup(stackid);
-    if (!count)
-        return;
+    u32 depth = state->depth;
 
-    time = hl_report_total.lookup(stackid);
-    if (!time) {
-        hl_report_total.update(stackid, &delta);
-    } else {
-        *time = *time + delta;
-    }
+    state->depth = depth + 1;
+    if (depth >= MAX_LOCK_DEPTH)
+        return 0;
+    state->stackid[depth & (MAX_LOCK_DEPTH - 1)] =
+        stack_traces.get_stackid(ctx, skip);
+    state->aq_ts = bpf_ktime_get_ns();
+    return 0;
 }
 
 static int do_mutex_lock_return(void)
@@ -247,41 +209,30 @@ static int do_mutex_lock_return(void)
     if (!allow_pid(id))
         return 0;
 
-    u64 *one = track.lookup(&id);
-
-    if (!one)
-        return 0;
-
-    track.delete(&id);
-
-    u64 *depth = lock_depth.lookup(&id);
-    if (!depth)
+    struct lock_state *state = get_state(id, false);
+    if (!state || !state->aq_ts)
         return 0;
 
-    struct depth_id did = {
-      .id    = id,
-      .depth = *depth - 1,
-    };
+    u64 aq = state->aq_ts;
+    u32 depth = state->depth - 1;
 
-    u64 *aq = time_aq.lookup(&id);
-    if (!aq)
+    state->aq_ts = 0;
+    if (depth >= MAX_LOCK_DEPTH)
         return 0;
+    depth &= MAX_LOCK_DEPTH - 1;
 
-    int *stackid = stack.lookup(&did);
-    if (!stackid)
-        return 0;
-
-    int stackid_ = *stackid;
+    int stackid = state->stackid[depth];
     u64 cur = bpf_ktime_get_ns();
 
-    if (cur > *aq) {
-        int val = cur - *aq;
-        update_aq_report_count(&stackid_);
-        update_aq_report_max(&stackid_, val);
-        update_aq_report_total(&stackid_, val);
+    if (cur > aq) {
+        struct report_t *report, zero = {};
+
+        report = aq_report.lookup_or_try_init(&stackid, &zero);
+        if (report)
+            update_report(report, cur - aq);
     }
 
-    time_held.update(&did, &cur);
+    state->held_ts[depth] = cur;
     return 0;
 }
 
@@ -295,39 +246,31 @@ static int do_mutex_unlock_enter(void)
     if (!allow_pid(id))
         return 0;
 
-    u64 *depth = lock_depth.lookup(&id);
-
-    if (!depth || *depth == 0)
-        return 0;
-
-    *depth -= 1;
-
-    struct depth_id did = {
-      .id    = id,
-      .depth = *depth,
-    };
-
-    u64 *held = time_held.lookup(&did);
-    if (!held)
+    struct lock_state *state = get_state(id, false);
+    if (!state || state->depth == 0)
         return 0;
 
-    int *stackid = stack.lookup(&did);
-    if (!stackid)
-        return 0;
+    u32 depth = --state->depth;
+    u64 held = 0;
+    int stackid = 0;
 
+    if (depth < MAX_LOCK_DEPTH) {
+        depth &= MAX_LOCK_DEPTH - 1;
+        held = state->held_ts[depth];
+        stackid = state->stackid[depth];
+        state->held_ts[depth] = 0;
+    }
+    put_state(id, state);
 
-    int stackid_ = *stackid;
     u64 cur = bpf_ktime_get_ns();
 
-    if (cur > *held) {
-        u64 val = cur - *held;
-        update_hl_report_count(&stackid_);
-        update_hl_report_max(&stackid_, val);
-        update_hl_report_total(&stackid_, val);
-    }
+    if (held && cur > held) {
+        struct report_t *report, zero = {};
 
-    stack.delete(&did);
-    time_held.delete(&did);
+        report = hl_report.lookup_or_try_init(&stackid, &zero);
+        if (report)
+            update_report(report, cur - held);
+    }
     return 0;
 }
 """
@@ -368,47 +311,68 @@ KFUNC_PROBE(mutex_lock, void *lock)
 """
 
 is_support_kfunc = BPF.support_kfunc()
+# task local storage is only used from the BTF enabled kfunc probes
+use_task_storage = is_support_kfunc and not args.hash_state and \
+    BPF.support_task_storage()
 if is_support_kfunc:
     program += program_kfunc
 else:
     program += program_kprobe
 
-def sort_list(maxs, totals, counts):
+def sort_field(prefix):
     if (not args.sort):
-        return maxs;
+        return "max"
 
     for field in args.sort.split(','):
-        if (field == "acq_max" or field == "hld_max"):
-            return maxs
-        if (field == "acq_total" or field == "hld_total"):
-            return totals
-        if (field == "acq_count" or field == "hld_count"):
-            return counts
-
-    print("Wrong sort argument: %s", args.sort)
-    exit(-1)
+        if (field not in ("acq_max", "acq_total", "acq_count",
+                          "hld_max", "hld_total", "hld_count")):
+            print("Wrong sort argument: %s" % args.sort)
+            exit(-1)
+    for field in args.sort.split(','):
+        if (field.startswith(prefix)):
+            return field[len(prefix):]
+    return "max"
 
-def display(sort, maxs, totals, counts):
+def read_report(report):
+    """Drain a per-CPU report map into a list of (stackid, count, total, max)
+    tuples, summing the counts and totals of the CPUs."""
+    try:
+        entries = list(report.items_lookup_and_delete_batch())
+    except Exception:
+        # kernels before 5.6
+        entries = list(report.items())
+        report.clear()
+
+    res = []
+    for k, percpu in entries:
+        res.append((k.value, sum(v.count for v in percpu),
+                    sum(v.total for v in percpu),
+                    max(v.max for v in percpu)))
+    return res
+
+def display(sort, report):
     global missing_stacks
     global has_enomem
 
-    for k, v in sorted(sort.items(), key=lambda sort: sort[1].value, reverse=True)[:args.locks]:
-        missing_stacks += int(stack_id_err(k.value))
-        has_enomem      = has_enomem or (k.value == -errno.ENOMEM)
+    idx = {"count": 1, "total": 2, "max": 3}[sort]
+    for stackid, count, total, maxv in sorted(read_report(report),
+            key=lambda r: r[idx], reverse=True)[:args.locks]:
+        missing_stacks += int(stack_id_err(stackid))
+        has_enomem      = has_enomem or (stackid == -errno.ENOMEM)
 
         caller = "[Missed Kernel Stack]"
         stack  = []
 
-        if (k.value >= 0):
-            stack  = list(stack_traces.walk(k.value))
+        if (stackid >= 0):
+            stack  = list(stack_traces.walk(stackid))
             caller = b.ksym(stack[1], show_offset=True)
 
             if (args.caller and caller.find(args.caller.encode())):
                 continue
 
-        avg = totals[k].value / counts[k].value
+        avg = total / count
 
-        print("%40s %10lu %6lu %10lu %10lu" % (caller, avg, counts[k].value, maxs[k].value, totals[k].value))
+        print("%40s %10lu %6lu %10lu %10lu" % (caller, avg, count, maxv, total))
 
         for addr in stack[2:args.stacks]:
             print("%40s" %  b.ksym(addr, show_offset=True))
@@ -424,6 +388,10 @@ else:
     program = program.replace('FILTER', '')
 
 program = program.replace('STACK_STORAGE_SIZE', str(args.stack_storage_size))
+# every stack id or negative error can be a report entry
+program = program.replace('MAX_REPORTS', str(args.stack_storage_size + 64))
+program = program.replace('MAX_TASKS', str(args.max_tasks))
+program = program.replace('USE_TASK_STORAGE', str(int(use_task_storage)))
 
 b = BPF(text=program)
 
@@ -435,16 +403,11 @@ if not is_support_kfunc:
 enabled = b.get_table("enabled");
 
 stack_traces = b.get_table("stack_traces")
-aq_counts = b.get_table("aq_report_count")
-aq_maxs   = b.get_table("aq_report_max")
-aq_totals = b.get_table("aq_report_total")
-
-hl_counts = b.get_table("hl_report_count")
-hl_maxs   = b.get_table("hl_report_max")
-hl_totals = b.get_table("hl_report_total")
+aq_report = b.get_table("aq_report")
+hl_report = b.get_table("hl_report")
 
-aq_sort = sort_list(aq_maxs, aq_totals, aq_counts)
-hl_sort = sort_list(hl_maxs, hl_totals, hl_counts)
+aq_sort = sort_field("acq_")
+hl_sort = sort_field("hld_")
 
 print("Tracing lock events... Hit Ctrl-C to end.")
 
@@ -472,22 +435,16 @@ while (1):
     enabled[ct.c_int(0)] = ct.c_int(0)
 
     print("\n%40s %10s %6s %10s %10s" % ("Caller", "Avg Spin", "Count", "Max spin", "Total spin"))
-    display(aq_sort, aq_maxs, aq_totals, aq_counts)
+    display(aq_sort, aq_report)
 
 
     print("\n%40s %10s %6s %10s %10s" % ("Caller", "Avg Hold", "Count", "Max hold", "Total hold"))
-    display(hl_sort, hl_maxs, hl_totals, hl_counts)
+    display(hl_sort, hl_report)
 
     if exiting:
         break;
 
     stack_traces.clear()
-    aq_counts.clear()
-    aq_maxs.clear()
-    aq_totals.clear()
-    hl_counts.clear()
-    hl_maxs.clear()
-    hl_totals.clear()
 
 if missing_stacks > 0:
     enomem_str = " Consider increasing --stack-storage-size."
@@ -4,7 +4,8 @@
 #           memory leaks in user-mode processes and the kernel.
 #
 # USAGE: memleak [-h] [-p PID] [-t] [-a] [-o OLDER] [-c COMMAND]
-#                [--combined-only] [--wa-missing-free] [-s SAMPLE_RATE]
+#                [--combined-only] [--wa-missing-free]
+#                [-s SAMPLE_RATE | --sample-bytes BYTES] [--size-classes]
 #                [-T TOP] [-z MIN_SIZE] [-Z MAX_SIZE] [-O OBJ]
 #                [interval] [count]
 #
@@ -60,6 +61,9 @@ EXAMPLES:
         allocations that are at least one minute (60 seconds) old
 ./memleak -s 5
         Trace roughly every 5th allocation, to reduce overhead
+./memleak -p $(pidof allocs) --size-classes --sample-bytes 524288
+        Sample on average one allocation per 512 KB allocated, and display
+        the stacks allocating the most with a histogram of their sizes
 """
 
 description = """
@@ -90,8 +94,15 @@ parser.add_argument("--combined-only", default=False, action="store_true",
         help="show combined allocation statistics only")
 parser.add_argument("--wa-missing-free", default=False, action="store_true",
         help="Workaround to alleviate misjudgments when free is missing")
-parser.add_argument("-s", "--sample-rate", default=1, type=int,
+sampling = parser.add_mutually_exclusive_group()
+sampling.add_argument("-s", "--sample-rate", default=1, type=int,
         help="sample every N-th allocation to decrease the overhead")
+sampling.add_argument("--sample-bytes", default=0, type=int, metavar="BYTES",
+        help="sample allocations with a probability of their size in BYTES, "
+             "about one per BYTES allocated")
+parser.add_argument("--size-classes", default=False, action="store_true",
+        help="only count allocations by stack and log2 size class, without "
+             "tracking frees")
 parser.add_argument("-T", "--top", type=int, default=10,
         help="display only this many top allocating stacks (by size)")
 parser.add_argument("-z", "--min-size", type=int,
@@ -124,6 +135,14 @@ if min_size is not None and max_size is not None and min_size > max_size:
         print("min_size (-z) can't be greater than max_size (-Z)")
         exit(1)
 
+if sample_every_n < 1 or args.sample_bytes < 0:
+        print("the sample rate (-s) and bytes (--sample-bytes) must be positive")
+        exit(1)
+
+if args.size_classes and trace_all:
+        print("size classes (--size-classes) can't be traced (-t)")
+        exit(1)
+
 if command is not None:
         print("Executing '%s' and tracing the resulting process." % command)
         pid = run_command_get_pid(command)
@@ -142,9 +161,18 @@ struct combined_alloc_info_t {
         u64 number_of_allocs;
 };
 
+struct size_class_key_t {
+        u64 stack_id;
+        u64 slot;
+};
+
+#if SIZE_CLASSES
+BPF_HISTOGRAM(size_classes, struct size_class_key_t, 10240);
+#else
 BPF_HASH(sizes, u64);
 BPF_HASH(allocs, u64, struct alloc_info_t, 1000000);
 BPF_HASH(memptrs, u64, u64);
+#endif
 BPF_STACK_TRACE(stack_traces, 10240);
 BPF_HASH(combined_allocs, u64, struct combined_alloc_info_t, 10240);
 
@@ -181,14 +209,52 @@ static inline void update_statistics_del(u64 stack_id, u64 sz) {
         combined_allocs.update(&stack_id, &cinfo);
 }
 
+static inline int sample_alloc(u64 size) {
+        if (SAMPLE_EVERY_N > 1 && bpf_get_prandom_u32() % SAMPLE_EVERY_N != 0)
+                return 0;
+        // like tcmalloc, keep an allocation with a probability of
+        // size / SAMPLE_BYTES, so that large ones are always kept
+        if (SAMPLE_BYTES > 0 && size < SAMPLE_BYTES &&
+            bpf_get_prandom_u32() % SAMPLE_BYTES >= size)
+                return 0;
+        return 1;
+}
+
+#if SIZE_CLASSES
+// Count a sampled allocation, weighted by the allocations it stands for
+static inline void size_class_add(struct pt_regs *ctx, u64 size) {
+        struct combined_alloc_info_t zero = {0}, *cinfo;
+        struct size_class_key_t key = {};
+        u64 count = SAMPLE_EVERY_N, bytes = size * SAMPLE_EVERY_N;
+        int stack_id = stack_traces.get_stackid(ctx, STACK_FLAGS);
+        u64 stack_id64 = stack_id;
+
+        if (stack_id < 0)
+                return;
+        if (SAMPLE_BYTES > 0 && size < SAMPLE_BYTES) {
+                count = (SAMPLE_BYTES + size / 2) / size;
+                bytes = SAMPLE_BYTES;
+        }
+        key.stack_id = stack_id;
+        key.slot = bpf_log2l(size);
+        size_classes.atomic_increment(key, count);
+        cinfo = combined_allocs.lookup_or_try_init(&stack_id64, &zero);
+        if (cinfo) {
+                lock_xadd(&cinfo->total_size, bytes);
+                lock_xadd(&cinfo->number_of_allocs, count);
+        }
+}
+#endif
+
 static inline int gen_alloc_enter(struct pt_regs *ctx, size_t size) {
         SIZE_FILTER
-        if (SAMPLE_EVERY_N > 1) {
-                u64 ts = bpf_ktime_get_ns();
-                if (ts % SAMPLE_EVERY_N != 0)
-                        return 0;
-        }
+        if (!sample_alloc(size))
+                return 0;
 
+#if SIZE_CLASSES
+        size_class_add(ctx, size);
+        return 0;
+#else
         u64 pid = bpf_get_current_pid_tgid();
         u64 size64 = size;
         sizes.update(&pid, &size64);
@@ -196,9 +262,13 @@ static inline int gen_alloc_enter(struct pt_regs *ctx, size_t size) {
         if (SHOULD_PRINT)
                 bpf_trace_printk("alloc entered, size = %u\\n", size);
         return 0;
+#endif
 }
 
 static inline int gen_alloc_exit2(struct pt_regs *ctx, u64 address) {
+#if SIZE_CLASSES
+        return 0;
+#else
         u64 pid = bpf_get_current_pid_tgid();
         u64* size64 = sizes.lookup(&pid);
         struct alloc_info_t info = {0};
@@ -221,6 +291,7 @@ static inline int gen_alloc_exit2(struct pt_regs *ctx, u64 address) {
                                  info.size, address);
         }
         return 0;
+#endif
 }
 
 static inline int gen_alloc_exit(struct pt_regs *ctx) {
@@ -228,6 +299,9 @@ static inline int gen_alloc_exit(struct pt_regs *ctx) {
 }
 
 static inline int gen_free_enter(struct pt_regs *ctx, void *address) {
+#if SIZE_CLASSES
+        return 0;
+#else
         u64 addr = (u64)address;
         struct alloc_info_t *info = allocs.lookup(&addr);
         if (info == 0)
@@ -241,6 +315,7 @@ static inline int gen_free_enter(struct pt_regs *ctx, void *address) {
                                  address, info->size);
         }
         return 0;
+#endif
 }
 
 int malloc_enter(struct pt_regs *ctx, size_t size) {
@@ -274,14 +349,19 @@ int realloc_exit(struct pt_regs *ctx) {
 
 int posix_memalign_enter(struct pt_regs *ctx, void **memptr, size_t alignment,
                          size_t size) {
+#if !SIZE_CLASSES
         u64 memptr64 = (u64)(size_t)memptr;
         u64 pid = bpf_get_current_pid_tgid();
 
         memptrs.update(&pid, &memptr64);
+#endif
         return gen_alloc_enter(ctx, size);
 }
 
 int posix_memalign_exit(struct pt_regs *ctx) {
+#if SIZE_CLASSES
+        return 0;
+#else
         u64 pid = bpf_get_current_pid_tgid();
         u64 *memptr64 = memptrs.lookup(&pid);
         void *addr;
@@ -296,6 +376,7 @@ int posix_memalign_exit(struct pt_regs *ctx) {
 
         u64 addr64 = (u64)(size_t)addr;
         return gen_alloc_exit2(ctx, addr64);
+#endif
 }
 
 int aligned_alloc_enter(struct pt_regs *ctx, size_t alignment, size_t size) {
@@ -403,6 +484,9 @@ if kernel_trace:
 
 bpf_source = bpf_source.replace("SHOULD_PRINT", "1" if trace_all else "0")
 bpf_source = bpf_source.replace("SAMPLE_EVERY_N", str(sample_every_n))
+bpf_source = bpf_source.replace("SAMPLE_BYTES", str(args.sample_bytes))
+bpf_source = bpf_source.replace("SIZE_CLASSES",
+                                "1" if args.size_classes else "0")
 bpf_source = bpf_source.replace("PAGE_SIZE", str(resource.getpagesize()))
 
 size_filter = ""
@@ -437,9 +521,12 @@ if not kernel_trace:
                         bpf.attach_uprobe(name=obj, sym=sym,
                                           fn_name=fn_prefix + "_enter",
                                           pid=pid)
-                        bpf.attach_uretprobe(name=obj, sym=sym,
-                                             fn_name=fn_prefix + "_exit",
-                                             pid=pid)
+                        # size classes are counted on entry, and neither the
+                        # returned addresses nor frees are needed
+                        if not args.size_classes:
+                                bpf.attach_uretprobe(name=obj, sym=sym,
+                                                     fn_name=fn_prefix + "_exit",
+                                                     pid=pid)
                 except Exception:
                         if can_fail:
                                 return
@@ -454,7 +541,8 @@ if not kernel_trace:
         attach_probes("memalign")
         attach_probes("pvalloc", can_fail=True) # failed on Android, is deprecated in libc.so from bionic directory
         attach_probes("aligned_alloc", can_fail=True)  # added in C11
-        bpf.attach_uprobe(name=obj, sym="free", fn_name="free_enter",
+        if not args.size_classes:
+                bpf.attach_uprobe(name=obj, sym="free", fn_name="free_enter",
                                   pid=pid)
 
 else:
@@ -539,6 +627,38 @@ def print_outstanding_combined():
 
         print('\n'.join(reversed(entries)))
 
+def print_size_classes():
+        stack_traces = bpf["stack_traces"]
+        combined = bpf["combined_allocs"]
+        totals = dict((k.value, v) for k, v in combined.items())
+
+        def stack_str(stack_id):
+                info = totals[stack_id]
+                try:
+                        trace = [bpf.sym(addr, pid, show_module=True,
+                                         show_offset=True).decode("ascii",
+                                                                  "replace")
+                                 for addr in stack_traces.walk(stack_id)]
+                        trace = "\n\t".join(trace)
+                except KeyError:
+                        trace = "stack information lost"
+                return "%d, ~%d bytes in ~%d allocations\n\t%s" % \
+                       (stack_id, info.total_size, info.number_of_allocs,
+                        trace)
+
+        def top_stacks_fn(stack_ids):
+                stack_ids = [s for s in stack_ids if s in totals]
+                return sorted(stack_ids,
+                              key=lambda s: totals[s].total_size)[-top_stacks:]
+
+        print("[%s] Top %d stacks by allocated bytes:" %
+              (datetime.now().strftime("%H:%M:%S"), top_stacks))
+        bpf["size_classes"].print_log2_hist("allocs", "stack",
+                section_print_fn=stack_str, bucket_sort_fn=top_stacks_fn)
+        bpf["size_classes"].clear()
+        combined.clear()
+        stack_traces.clear()
+
 count_so_far = 0
 while True:
         if trace_all:
@@ -548,7 +668,9 @@ while True:
                         sleep(interval)
                 except KeyboardInterrupt:
                         exit()
-                if args.combined_only:
+                if args.size_classes:
+                        print_size_classes()
+                elif args.combined_only:
                         print_outstanding_combined()
                 else:
                         print_outstanding()
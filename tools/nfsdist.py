@@ -9,7 +9,7 @@
 # 4-Sep-2017    Samuel Nair     created this
 
 from __future__ import print_function
-from bcc import BPF
+from bcc.fslatency import FsLatency, TEXT
 from time import sleep, strftime
 import argparse
 
@@ -40,128 +40,23 @@ args = parser.parse_args()
 pid = args.pid
 countdown = int(args.count)
 if args.milliseconds:
-    factor = 1000000
     label = "msecs"
 else:
-    factor = 1000
     label = "usecs"
-    if args.interval and int(args.interval) == 0:
-        print("ERROR: interval 0. Exiting.")
-        exit()
-debug = 0
-
-# define BPF program
-bpf_text = """
-#include <uapi/linux/ptrace.h>
-#include <linux/fs.h>
-#include <linux/sched.h>
-
-#define OP_NAME_LEN 8
-typedef struct dist_key {
-    char op[OP_NAME_LEN];
-    u64 slot;
-} dist_key_t;
-
-BPF_HASH(start, u32);
-BPF_HISTOGRAM(dist, dist_key_t);
-
-// time operation
-int trace_entry(struct pt_regs *ctx)
-{
-    u64 pid_tgid = bpf_get_current_pid_tgid();
-    u32 pid = pid_tgid >> 32;
-    u32 tid = (u32)pid_tgid;
-
-    if (FILTER_PID)
-        return 0;
-    u64 ts = bpf_ktime_get_ns();
-    start.update(&tid, &ts);
-    return 0;
-}
-
-static int trace_return(struct pt_regs *ctx, const char *op)
-{
-    u64 *tsp;
-    u64 pid_tgid = bpf_get_current_pid_tgid();
-    u32 pid = pid_tgid >> 32;
-    u32 tid = (u32)pid_tgid;
-
-    // fetch timestamp and calculate delta
-    tsp = start.lookup(&tid);
-    if (tsp == 0) {
-        return 0;   // missed start or filtered
-    }
-    u64 delta = (bpf_ktime_get_ns() - *tsp) / FACTOR;
-
-    // store as histogram
-    dist_key_t key = {.slot = bpf_log2l(delta)};
-    __builtin_memcpy(&key.op, op, sizeof(key.op));
-    dist.atomic_increment(key);
-
-    start.delete(&tid);
-    return 0;
-}
-
-int trace_read_return(struct pt_regs *ctx)
-{
-    char *op = "read";
-    return trace_return(ctx, op);
-}
-
-int trace_write_return(struct pt_regs *ctx)
-{
-    char *op = "write";
-    return trace_return(ctx, op);
-}
-
-int trace_open_return(struct pt_regs *ctx)
-{
-    char *op = "open";
-    return trace_return(ctx, op);
-}
-
-int trace_getattr_return(struct pt_regs *ctx)
-{
-    char *op = "getattr";
-    return trace_return(ctx, op);
-}
-"""
-bpf_text = bpf_text.replace('FACTOR', str(factor))
-if args.pid:
-    bpf_text = bpf_text.replace('FILTER_PID', 'pid != %s' % pid)
-else:
-    bpf_text = bpf_text.replace('FILTER_PID', '0')
-if debug or args.ebpf:
-    print(bpf_text)
-    if args.ebpf:
-        exit()
+if args.interval and int(args.interval) == 0:
+    print("ERROR: interval 0. Exiting.")
+    exit()
+if args.ebpf:
+    print(TEXT)
+    exit()
 
 # load BPF program
-b = BPF(text=bpf_text)
-
-# common file functions
-b.attach_kprobe(event="nfs_file_read", fn_name="trace_entry")
-b.attach_kprobe(event="nfs_file_write", fn_name="trace_entry")
-b.attach_kprobe(event="nfs_file_open", fn_name="trace_entry")
-b.attach_kprobe(event="nfs_getattr", fn_name="trace_entry")
-
-b.attach_kretprobe(event="nfs_file_read", fn_name="trace_read_return")
-b.attach_kretprobe(event="nfs_file_write", fn_name="trace_write_return")
-b.attach_kretprobe(event="nfs_file_open", fn_name="trace_open_return")
-b.attach_kretprobe(event="nfs_getattr", fn_name="trace_getattr_return")
-
-if BPF.get_kprobe_functions(b'nfs4_file_open'):
-    b.attach_kprobe(event="nfs4_file_open", fn_name="trace_entry")
-    b.attach_kretprobe(event="nfs4_file_open", fn_name="trace_open_return")
-else:
-    b.attach_kprobe(event="nfs_file_open", fn_name="trace_entry")
-    b.attach_kretprobe(event="nfs_file_open", fn_name="trace_open_return")
+fs = FsLatency(["nfs"], pid=pid, milliseconds=args.milliseconds)
 
 print("Tracing NFS operation latency... Hit Ctrl-C to end.")
 
 # output
 exiting = 0
-dist = b.get_table("dist")
 while (1):
     try:
         if args.interval:
@@ -175,8 +70,7 @@ while (1):
     if args.interval and (not args.notimestamp):
         print(strftime("%H:%M:%S:"))
 
-    dist.print_log2_hist(label, "operation", section_print_fn=bytes.decode)
-    dist.clear()
+    fs.print_dist(label)
 
     countdown -= 1
     if exiting or countdown == 0:
@@ -12,6 +12,7 @@
 
 from __future__ import print_function
 from bcc import BPF
+from bcc.pprof import PprofWriter
 from sys import stderr
 from time import strftime
 import argparse
@@ -45,6 +46,7 @@ examples = """examples:
     ./offcputime             # trace off-CPU stack time until Ctrl-C
     ./offcputime 5           # trace for 5 seconds only
     ./offcputime -f 5        # 5 seconds, and output in folded format
+    ./offcputime --pprof out.pb.gz 5  # 5 seconds, write a pprof profile
     ./offcputime -m 1000     # trace only events that last more than 1000 usec
     ./offcputime -M 10000    # trace only events that last less than 10000 usec
     ./offcputime -p 185      # only trace threads for PID 185
@@ -78,6 +80,12 @@ parser.add_argument("-d", "--delimited", action="store_true",
     help="insert delimiter between kernel/user stacks")
 parser.add_argument("-f", "--folded", action="store_true",
     help="output folded format")
+parser.add_argument("--pprof", metavar="FILE",
+    help="write a gzipped pprof profile to FILE ('-' for stdout) instead "
+         "of printing the stacks")
+parser.add_argument("--percpu", action="store_true",
+    help="count stacks in per-CPU maps, which avoids contention on the "
+         "hash buckets with many CPUs, at the cost of memory per CPU")
 parser.add_argument("--stack-storage-size", default=1024,
     type=positive_nonzero_int,
     help="the number of unique stack traces that can be stored and "
@@ -122,7 +130,7 @@ struct key_t {
     int kernel_stack_id;
     char name[TASK_COMM_LEN];
 };
-BPF_HASH(counts, struct key_t);
+COUNTS_MAP(counts, struct key_t);
 BPF_HASH(start, u32);
 BPF_STACK_TRACE(stack_traces, STACK_STORAGE_SIZE);
 
@@ -220,6 +228,8 @@ else:
 
 # set stack storage size
 bpf_text = bpf_text.replace('STACK_STORAGE_SIZE', str(args.stack_storage_size))
+bpf_text = bpf_text.replace('COUNTS_MAP',
+    'BPF_PERCPU_HASH' if args.percpu else 'BPF_HASH')
 bpf_text = bpf_text.replace('MINBLOCK_US_VALUE', str(args.min_block_time))
 bpf_text = bpf_text.replace('MAXBLOCK_US_VALUE', str(args.max_block_time))
 
@@ -263,7 +273,7 @@ if matched == 0:
     exit(1)
 
 # header
-if not folded:
+if not (folded or args.pprof):
     print("Tracing off-CPU time (us) of %s by %s stack" %
         (thread_context, stack_context), end="")
     if duration < 99999999:
@@ -292,14 +302,20 @@ except KeyboardInterrupt:
     # as cleanup can take many seconds, trap Ctrl-C:
     signal.signal(signal.SIGINT, signal_ignore)
 
-if not folded:
+if not (folded or args.pprof):
     print()
 
+pprof = None
+if args.pprof:
+    pprof = PprofWriter(args.pprof, [("offcpu", "microseconds")])
+
 missing_stacks = 0
 has_enomem = False
 counts = b.get_table("counts")
 stack_traces = b.get_table("stack_traces")
-for k, v in sorted(counts.items(), key=lambda counts: counts[1].value):
+# per-CPU counts are summed up in one pass over a batch lookup
+items = counts.items_sum() if args.percpu else counts.items()
+for k, v in sorted(items, key=lambda counts: counts[1].value):
     # handle get_stackid errors
     if not args.user_stacks_only and stack_id_err(k.kernel_stack_id):
         missing_stacks += 1
@@ -315,7 +331,22 @@ for k, v in sorted(counts.items(), key=lambda counts: counts[1].value):
     kernel_stack = [] if k.kernel_stack_id < 0 else \
         stack_traces.walk(k.kernel_stack_id)
 
-    if folded:
+    if pprof:
+        # frames from the leaf, names are interned by the writer
+        frames = []
+        if not args.user_stacks_only:
+            if stack_id_err(k.kernel_stack_id):
+                frames.append(b"[Missed Kernel Stack]")
+            else:
+                frames.extend(b.ksym_batch(list(kernel_stack)))
+        if not args.kernel_stacks_only:
+            if stack_id_err(k.user_stack_id):
+                frames.append(b"[Missed User Stack]")
+            else:
+                frames.extend(b.sym_batch(list(user_stack), k.tgid))
+        pprof.add_sample(frames, [v.value],
+                         {"comm": k.name, "pid": k.tgid, "tid": k.pid})
+    elif folded:
         # print folded stack output
         user_stack = list(user_stack)
         kernel_stack = list(kernel_stack)
@@ -326,15 +357,15 @@ for k, v in sorted(counts.items(), key=lambda counts: counts[1].value):
             if stack_id_err(k.user_stack_id):
                 line.append("[Missed User Stack]")
             else:
-                line.extend([b.sym(addr, k.tgid).decode('utf-8', 'replace')
-                    for addr in reversed(user_stack)])
+                line.extend([name.decode('utf-8', 'replace') for name in
+                    b.sym_batch(list(reversed(user_stack)), k.tgid)])
         if not args.user_stacks_only:
             line.extend(["-"] if (need_delimiter and k.kernel_stack_id >= 0 and k.user_stack_id >= 0) else [])
             if stack_id_err(k.kernel_stack_id):
                 line.append("[Missed Kernel Stack]")
             else:
-                line.extend([b.ksym(addr).decode('utf-8', 'replace')
-                    for addr in reversed(kernel_stack)])
+                line.extend([name.decode('utf-8', 'replace') for name in
+                    b.ksym_batch(list(reversed(kernel_stack)))])
         print("%s %d" % (";".join(line), v.value))
     else:
         # print default multi-line stack output
@@ -342,19 +373,22 @@ for k, v in sorted(counts.items(), key=lambda counts: counts[1].value):
             if stack_id_err(k.kernel_stack_id):
                 print("    [Missed Kernel Stack]")
             else:
-                for addr in kernel_stack:
-                    print("    %s" % b.ksym(addr).decode('utf-8', 'replace'))
+                for name in b.ksym_batch(list(kernel_stack)):
+                    print("    %s" % name.decode('utf-8', 'replace'))
         if not args.kernel_stacks_only:
             if need_delimiter and k.user_stack_id >= 0 and k.kernel_stack_id >= 0:
                 print("    --")
             if stack_id_err(k.user_stack_id):
                 print("    [Missed User Stack]")
             else:
-                for addr in user_stack:
-                    print("    %s" % b.sym(addr, k.tgid).decode('utf-8', 'replace'))
+                for name in b.sym_batch(list(user_stack), k.tgid):
+                    print("    %s" % name.decode('utf-8', 'replace'))
         print("    %-16s %s (%d)" % ("-", k.name.decode('utf-8', 'replace'), k.pid))
         print("        %d\n" % v.value)
 
+if pprof:
+    pprof.close()
+
 if missing_stacks > 0:
     enomem_str = "" if not has_enomem else \
         " Consider increasing --stack-storage-size."
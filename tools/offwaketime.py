@@ -3,7 +3,8 @@
 # offwaketime   Summarize blocked time by kernel off-CPU stack + waker stack
 #               For Linux, uses BCC, eBPF.
 #
-# USAGE: offwaketime [-h] [-p PID | -u | -k] [-U | -K] [-f] [duration]
+# USAGE: offwaketime [-h] [-p PID | -u | -k] [-U | -K] [-f] [-i INTERVAL]
+#                    [duration]
 #
 # Copyright 2016 Netflix, Inc.
 # Licensed under the Apache License, Version 2.0 (the "License")
@@ -12,11 +13,12 @@
 
 from __future__ import print_function
 from bcc import BPF
-from time import sleep
+from bcc.pprof import PprofWriter
+from time import sleep, strftime
 import argparse
 import signal
 import errno
-from sys import stderr
+from sys import stderr, stdout
 
 # arg validation
 def positive_int(val):
@@ -65,6 +67,8 @@ examples = """examples:
     ./offwaketime             # trace off-CPU + waker stack time until Ctrl-C
     ./offwaketime 5           # trace for 5 seconds only
     ./offwaketime -f 5        # 5 seconds, and output in folded format
+    ./offwaketime --pprof out.pb.gz 5  # 5 seconds, write a pprof profile
+    ./offwaketime -f -i 60    # print and clear folded stacks every minute
     ./offwaketime -m 1000     # trace only events that last more than 1000 usec
     ./offwaketime -M 9000     # trace only events that last less than 9000 usec
     ./offwaketime -p 185      # only trace threads for PID 185
@@ -100,6 +104,15 @@ parser.add_argument("-d", "--delimited", action="store_true",
     help="insert delimiter between kernel/user stacks")
 parser.add_argument("-f", "--folded", action="store_true",
     help="output folded format")
+parser.add_argument("--pprof", metavar="FILE",
+    help="write a gzipped pprof profile to FILE ('-' for stdout) instead "
+         "of printing the stacks")
+parser.add_argument("--percpu", action="store_true",
+    help="count stacks in per-CPU maps, which avoids contention on the "
+         "hash buckets with many CPUs, at the cost of memory per CPU")
+parser.add_argument("-i", "--interval", type=positive_nonzero_int,
+    help="print and clear the stacks every interval seconds, for "
+         "continuous tracing")
 parser.add_argument("--stack-storage-size", default=1024,
     type=positive_nonzero_int,
     help="the number of unique stack traces that can be stored and "
@@ -148,11 +161,12 @@ struct key_t {
     u32 w_pid;
     u32 w_tgid;
 };
-BPF_HASH(counts, struct key_t);
+COUNTS_MAP(counts, struct key_t);
 
 // Key of this hash is PID of waiting Process,
-// value is timestamp when it went into waiting
-BPF_HASH(start, u32);
+// value is timestamp when it went into waiting. Threads that exit while
+// waiting leave their entry, so the oldest ones are evicted.
+BPF_TABLE("lru_hash", u32, u64, start, 10240);
 
 struct wokeby_t {
     char name[TASK_COMM_LEN];
@@ -163,7 +177,7 @@ struct wokeby_t {
 };
 // Key of the hash is PID of the Process to be waken, value is information
 // of the Process who wakes it
-BPF_HASH(wokeby, u32, struct wokeby_t);
+BPF_TABLE("lru_hash", u32, struct wokeby_t, wokeby, 10240);
 
 BPF_STACK_TRACE(stack_traces, STACK_STORAGE_SIZE);
 
@@ -269,6 +283,8 @@ else:
 
 # set stack storage size
 bpf_text = bpf_text.replace('STACK_STORAGE_SIZE', str(args.stack_storage_size))
+bpf_text = bpf_text.replace('COUNTS_MAP',
+    'BPF_PERCPU_HASH' if args.percpu else 'BPF_HASH')
 bpf_text = bpf_text.replace('MINBLOCK_US_VALUE', str(args.min_block_time))
 bpf_text = bpf_text.replace('MAXBLOCK_US_VALUE', str(args.max_block_time))
 
@@ -300,8 +316,10 @@ if matched == 0:
     print("0 functions traced. Exiting.")
     exit()
 
+quiet = folded or args.pprof
+
 # header
-if not folded:
+if not quiet:
     print("Tracing blocked time (us) by %s off-CPU and waker stack" %
         stack_context, end="")
     if duration < 99999999:
@@ -309,117 +327,194 @@ if not folded:
     else:
         print("... Hit Ctrl-C to end.")
 
-try:
-    sleep(duration)
-except KeyboardInterrupt:
-    # as cleanup can take many seconds, trap Ctrl-C:
-    # print a newline for folded output on Ctrl-C
-    signal.signal(signal.SIGINT, signal_ignore)
-
+pprof = None
+if args.pprof:
+    pprof = PprofWriter(args.pprof, [("offcpu", "microseconds")])
 
-if not folded:
-    print()
-
-missing_stacks = 0
-has_enomem = False
 counts = b.get_table("counts")
 stack_traces = b.get_table("stack_traces")
 need_delimiter = args.delimited and not (args.kernel_stacks_only or
                                          args.user_stacks_only)
-for k, v in sorted(counts.items(), key=lambda counts: counts[1].value):
-    # handle get_stackid errors
+
+def drain_counts():
+    if args.percpu:
+        return counts.items_sum(delete=True)
+    try:
+        return list(counts.items_lookup_and_delete_batch())
+    except Exception:
+        # no batch operations before 5.6, blocked time counted between the
+        # lookup and the delete of a key is lost
+        items = []
+        for k, v in counts.items():
+            items.append((k, v))
+            try:
+                del counts[k]
+            except KeyError:
+                pass
+        return items
+
+def folded_line(k, stacks):
+    # from the root of the target stack to its leaf, then from the leaf of
+    # the waker stack to its root
+    line = [k.target]
+    if not args.kernel_stacks_only:
+        if stack_id_err(k.t_u_stack_id):
+            line.append(b"[Missed User Stack] %d" % k.t_u_stack_id)
+        else:
+            line.extend(b.sym_batch(list(reversed(
+                stacks[k.t_u_stack_id][1:])), k.t_tgid))
     if not args.user_stacks_only:
-        missing_stacks += int(stack_id_err(k.w_k_stack_id))
-        missing_stacks += int(stack_id_err(k.t_k_stack_id))
-        has_enomem = has_enomem or (k.w_k_stack_id == -errno.ENOMEM) or \
-                     (k.t_k_stack_id == -errno.ENOMEM)
+        line.extend([b"-"] if (need_delimiter and k.t_k_stack_id > 0 and k.t_u_stack_id > 0) else [])
+        if stack_id_err(k.t_k_stack_id):
+            line.append(b"[Missed Kernel Stack]")
+        else:
+            line.extend(b.ksym_batch(list(reversed(
+                stacks[k.t_k_stack_id][1:]))))
+    line.append(b"--")
+    if not args.user_stacks_only:
+        if stack_id_err(k.w_k_stack_id):
+            line.append(b"[Missed Kernel Stack]")
+        else:
+            line.extend(b.ksym_batch(stacks[k.w_k_stack_id][1:]))
     if not args.kernel_stacks_only:
-        missing_stacks += int(stack_id_err(k.w_u_stack_id))
-        missing_stacks += int(stack_id_err(k.t_u_stack_id))
-        has_enomem = has_enomem or (k.w_u_stack_id == -errno.ENOMEM) or \
-                     (k.t_u_stack_id == -errno.ENOMEM)
-
-    waker_user_stack = [] if k.w_u_stack_id < 1 else \
-        reversed(list(stack_traces.walk(k.w_u_stack_id))[1:])
-    waker_kernel_stack = [] if k.w_k_stack_id < 1 else \
-        reversed(list(stack_traces.walk(k.w_k_stack_id))[1:])
-    target_user_stack = [] if k.t_u_stack_id < 1 else \
-        stack_traces.walk(k.t_u_stack_id)
-    target_kernel_stack = [] if k.t_k_stack_id < 1 else \
-        stack_traces.walk(k.t_k_stack_id)
-
-    if folded:
-        # print folded stack output
-        line = [k.target.decode('utf-8', 'replace')]
-        if not args.kernel_stacks_only:
-            if stack_id_err(k.t_u_stack_id):
-                line.append("[Missed User Stack] %d" % k.t_u_stack_id)
-            else:
-                line.extend([b.sym(addr, k.t_tgid).decode('utf-8', 'replace')
-                    for addr in reversed(list(target_user_stack)[1:])])
-        if not args.user_stacks_only:
-            line.extend(["-"] if (need_delimiter and k.t_k_stack_id > 0 and k.t_u_stack_id > 0) else [])
-            if stack_id_err(k.t_k_stack_id):
-                line.append("[Missed Kernel Stack]")
-            else:
-                line.extend([b.ksym(addr).decode('utf-8', 'replace')
-                    for addr in reversed(list(target_kernel_stack)[1:])])
-        line.append("--")
-        if not args.user_stacks_only:
-            if stack_id_err(k.w_k_stack_id):
-                line.append("[Missed Kernel Stack]")
-            else:
-                line.extend([b.ksym(addr).decode('utf-8', 'replace')
-                    for addr in reversed(list(waker_kernel_stack))])
-        if not args.kernel_stacks_only:
-            line.extend(["-"] if (need_delimiter and k.w_u_stack_id > 0 and k.w_k_stack_id > 0) else [])
-            if stack_id_err(k.w_u_stack_id):
-                line.append("[Missed User Stack]")
-            else:
-                line.extend([b.sym(addr, k.w_tgid).decode('utf-8', 'replace')
-                    for addr in reversed(list(waker_user_stack))])
-        line.append(k.waker.decode('utf-8', 'replace'))
-        print("%s %d" % (";".join(line), v.value))
+        line.extend([b"-"] if (need_delimiter and k.w_u_stack_id > 0 and k.w_k_stack_id > 0) else [])
+        if stack_id_err(k.w_u_stack_id):
+            line.append(b"[Missed User Stack]")
+        else:
+            line.extend(b.sym_batch(stacks[k.w_u_stack_id][1:], k.w_tgid))
+    line.append(k.waker)
+    return line
+
+def print_stacks(recycle):
+    missing_stacks = 0
+    has_enomem = False
+    if recycle:
+        items = drain_counts()
     else:
-        # print wakeup name then stack in reverse order
-        print("    %-16s %s %s" % ("waker:", k.waker.decode('utf-8', 'replace'), k.w_pid))
-        if not args.kernel_stacks_only:
-            if stack_id_err(k.w_u_stack_id):
-                print("    [Missed User Stack] %d" % k.w_u_stack_id)
-            else:
-                for addr in waker_user_stack:
-                    print("    %s" % b.sym(addr, k.w_tgid))
+        items = counts.items_sum() if args.percpu else counts.items()
+    stack_ids = list(set([k.w_k_stack_id for k, _ in items] +
+        [k.w_u_stack_id for k, _ in items] +
+        [k.t_k_stack_id for k, _ in items] +
+        [k.t_u_stack_id for k, _ in items]))
+    stacks = dict(zip(stack_ids, stack_traces.get_all(stack_ids)))
+    # ids under 1 were not looked up by the waker and the target
+    for stack_id in stack_ids:
+        if stack_id < 1:
+            stacks[stack_id] = []
+    if recycle:
+        # the ids of these stacks are free again for new stacks, blocked
+        # time counted with one of them since the drain may show another
+        # stack that took its id
+        for stack_id in stack_ids:
+            if stack_id < 0:
+                continue
+            try:
+                del stack_traces[stack_traces.Key(stack_id)]
+            except KeyError:
+                pass
+
+    for k, v in sorted(items, key=lambda counts: counts[1].value):
+        # handle get_stackid errors
         if not args.user_stacks_only:
-            if need_delimiter and k.w_u_stack_id > 0 and k.w_k_stack_id > 0:
-                print("    -")
-            if stack_id_err(k.w_k_stack_id):
-                print("    [Missed Kernel Stack]")
-            else:
-                for addr in waker_kernel_stack:
-                    print("    %s" % b.ksym(addr))
-
-        # print waker/wakee delimiter
-        print("    %-16s %s" % ("--", "--"))
-
-        if not args.user_stacks_only:
-            if stack_id_err(k.t_k_stack_id):
-                print("    [Missed Kernel Stack]")
-            else:
-                for addr in target_kernel_stack:
-                    print("    %s" % b.ksym(addr))
+            missing_stacks += int(stack_id_err(k.w_k_stack_id))
+            missing_stacks += int(stack_id_err(k.t_k_stack_id))
+            has_enomem = has_enomem or (k.w_k_stack_id == -errno.ENOMEM) or \
+                         (k.t_k_stack_id == -errno.ENOMEM)
         if not args.kernel_stacks_only:
-            if need_delimiter and k.t_u_stack_id > 0 and k.t_k_stack_id > 0:
-                print("    -")
-            if stack_id_err(k.t_u_stack_id):
-                print("    [Missed User Stack]")
-            else:
-                for addr in target_user_stack:
-                    print("    %s" % b.sym(addr, k.t_tgid))
-        print("    %-16s %s %s" % ("target:", k.target.decode('utf-8', 'replace'), k.t_pid))
-        print("        %d\n" % v.value)
-
-if missing_stacks > 0:
-    enomem_str = " Consider increasing --stack-storage-size."
-    print("WARNING: %d stack traces lost and could not be displayed.%s" %
-        (missing_stacks, (enomem_str if has_enomem else "")),
-        file=stderr)
+            missing_stacks += int(stack_id_err(k.w_u_stack_id))
+            missing_stacks += int(stack_id_err(k.t_u_stack_id))
+            has_enomem = has_enomem or (k.w_u_stack_id == -errno.ENOMEM) or \
+                         (k.t_u_stack_id == -errno.ENOMEM)
+
+        if pprof:
+            # frames from the leaf, which is the waker
+            line = folded_line(k, stacks)
+            pprof.add_sample(list(reversed(line[1:])), [v.value],
+                             {"comm": k.target, "pid": k.t_tgid,
+                              "tid": k.t_pid, "waker": k.waker})
+        elif folded:
+            # print folded stack output
+            line = folded_line(k, stacks)
+            print("%s %d" % (b";".join(line).decode('utf-8', 'replace'),
+                v.value))
+        else:
+            waker_user_stack = reversed(stacks[k.w_u_stack_id][1:])
+            waker_kernel_stack = reversed(stacks[k.w_k_stack_id][1:])
+            target_user_stack = stacks[k.t_u_stack_id]
+            target_kernel_stack = stacks[k.t_k_stack_id]
+
+            # print wakeup name then stack in reverse order
+            print("    %-16s %s %s" % ("waker:", k.waker.decode('utf-8', 'replace'), k.w_pid))
+            if not args.kernel_stacks_only:
+                if stack_id_err(k.w_u_stack_id):
+                    print("    [Missed User Stack] %d" % k.w_u_stack_id)
+                else:
+                    for addr in waker_user_stack:
+                        print("    %s" % b.sym(addr, k.w_tgid))
+            if not args.user_stacks_only:
+                if need_delimiter and k.w_u_stack_id > 0 and k.w_k_stack_id > 0:
+                    print("    -")
+                if stack_id_err(k.w_k_stack_id):
+                    print("    [Missed Kernel Stack]")
+                else:
+                    for addr in waker_kernel_stack:
+                        print("    %s" % b.ksym(addr))
+
+            # print waker/wakee delimiter
+            print("    %-16s %s" % ("--", "--"))
+
+            if not args.user_stacks_only:
+                if stack_id_err(k.t_k_stack_id):
+                    print("    [Missed Kernel Stack]")
+                else:
+                    for addr in target_kernel_stack:
+                        print("    %s" % b.ksym(addr))
+            if not args.kernel_stacks_only:
+                if need_delimiter and k.t_u_stack_id > 0 and k.t_k_stack_id > 0:
+                    print("    -")
+                if stack_id_err(k.t_u_stack_id):
+                    print("    [Missed User Stack]")
+                else:
+                    for addr in target_user_stack:
+                        print("    %s" % b.sym(addr, k.t_tgid))
+            print("    %-16s %s %s" % ("target:", k.target.decode('utf-8', 'replace'), k.t_pid))
+            print("        %d\n" % v.value)
+
+    if missing_stacks > 0:
+        enomem_str = " Consider increasing --stack-storage-size."
+        print("WARNING: %d stack traces lost and could not be displayed.%s" %
+            (missing_stacks, (enomem_str if has_enomem else "")),
+            file=stderr)
+
+if args.interval:
+    # drain the counts and recycle the stacks every interval, so that the
+    # maps never fill up however long this runs
+    exiting = False
+    remaining = duration
+    while not exiting:
+        try:
+            sleep(min(args.interval, remaining))
+        except KeyboardInterrupt:
+            exiting = True
+            signal.signal(signal.SIGINT, signal_ignore)
+        remaining -= args.interval
+        if remaining <= 0:
+            exiting = True
+        if not quiet:
+            print("\n[%s]" % strftime("%H:%M:%S"))
+        print_stacks(recycle=True)
+        stdout.flush()
+else:
+    try:
+        sleep(duration)
+    except KeyboardInterrupt:
+        # as cleanup can take many seconds, trap Ctrl-C:
+        # print a newline for folded output on Ctrl-C
+        signal.signal(signal.SIGINT, signal_ignore)
+
+    if not quiet:
+        print()
+    print_stacks(recycle=False)
+
+if pprof:
+    pprof.close()
@@ -5,6 +5,7 @@
 #           For Linux, uses BCC, eBPF. Embedded C.
 #
 # USAGE: opensnoop [-h] [-T] [-x] [-p PID] [-d DURATION] [-t TID] [-n NAME]
+#                  [--rate RATE] [--sample N] [--dedup MS]
 #
 # Copyright (c) 2015 Brendan Gregg.
 # Licensed under the Apache License, Version 2.0 (the "License")
@@ -18,10 +19,12 @@
 from __future__ import print_function
 from bcc import ArgString, BPF
 from bcc.containers import filter_by_containers
+from bcc.filters import TaskFilter, task_filter_text
 from bcc.utils import printb
 import argparse
 from datetime import datetime, timedelta
 import os
+import sys
 
 # arguments
 examples = """examples:
@@ -30,6 +33,7 @@ examples = """examples:
     ./opensnoop -U        # include UID
     ./opensnoop -x        # only show failed opens
     ./opensnoop -p 181    # only trace PID 181
+    ./opensnoop -p 181,182  # only trace PIDs 181 and 182
     ./opensnoop -t 123    # only trace TID 123
     ./opensnoop -u 1000   # only trace UID 1000
     ./opensnoop -d 10     # trace for 10 seconds only
@@ -38,6 +42,9 @@ examples = """examples:
     ./opensnoop -f O_WRONLY -f O_RDWR  # only print calls for writing
     ./opensnoop --cgroupmap mappath  # only trace cgroups in this BPF map
     ./opensnoop --mntnsmap mappath   # only trace mount namespaces in the map
+    ./opensnoop --rate 100  # at most about 100 opens per second per CPU
+    ./opensnoop --sample 10 # only trace 1 in 10 opens
+    ./opensnoop --dedup 1000  # print the same open at most once a second
 """
 parser = argparse.ArgumentParser(
     description="Trace open() syscalls",
@@ -50,9 +57,9 @@ parser.add_argument("-U", "--print-uid", action="store_true",
 parser.add_argument("-x", "--failed", action="store_true",
     help="only show failed opens")
 parser.add_argument("-p", "--pid",
-    help="trace this PID only")
+    help="trace these PIDs only, comma separated")
 parser.add_argument("-t", "--tid",
-    help="trace this TID only")
+    help="trace these TIDs only, comma separated")
 parser.add_argument("--cgroupmap",
     help="trace cgroups in this BPF map only")
 parser.add_argument("--mntnsmap",
@@ -70,6 +77,14 @@ parser.add_argument("-e", "--extended_fields", action="store_true",
     help="show extended fields")
 parser.add_argument("-f", "--flag_filter", action="append",
     help="filter on flags argument (e.g., O_WRONLY)")
+parser.add_argument("--rate", type=int,
+    help="trace at most about this many opens per second on each CPU, " +
+         "in bursts of as many")
+parser.add_argument("--sample", type=int,
+    help="only trace 1 in this many opens of each CPU")
+parser.add_argument("--dedup", type=int, metavar="MS",
+    help="print the opens of a path with the same result by a process at " +
+         "most once every MS milliseconds, counting the others")
 args = parser.parse_args()
 debug = 0
 if args.duration:
@@ -104,9 +119,13 @@ struct data_t {
     char comm[TASK_COMM_LEN];
     char fname[NAME_MAX];
     int flags; // EXTENDED_STRUCT_MEMBER
+    u64 repeats; // DEDUP_MEMBER
 };
 
 BPF_PERF_OUTPUT(events);
+BPF_RATE_LIMIT(rate_limit);    // RATE_MEMBER
+BPF_SAMPLER(sampler);          // SAMPLE_MEMBER
+BPF_DEDUP(dedup, 10240);       // DEDUP_MEMBER
 """
 
 bpf_text_kprobe = """
@@ -126,12 +145,13 @@ int trace_return(struct pt_regs *ctx)
         return 0;
     }
     bpf_probe_read_kernel(&data.comm, sizeof(data.comm), valp->comm);
-    bpf_probe_read_user(&data.fname, sizeof(data.fname), (void *)valp->fname);
+    bpf_probe_read_user_str(&data.fname, sizeof(data.fname), (void *)valp->fname);
     data.id = valp->id;
     data.ts = tsp / 1000;
     data.uid = bpf_get_current_uid_gid();
     data.flags = valp->flags; // EXTENDED_STRUCT_MEMBER
     data.ret = PT_REGS_RC(ctx);
+    DEDUP_FILTER
 
     events.perf_submit(ctx, &data, sizeof(data));
     infotmp.delete(&id);
@@ -171,6 +191,7 @@ bpf_text_kprobe_body = """
     if (container_should_be_filtered()) {
         return 0;
     }
+    RATE_SAMPLE_FILTER
 
     if (bpf_get_current_comm(&val.comm, sizeof(val.comm)) == 0) {
         val.id = id;
@@ -239,18 +260,20 @@ bpf_text_kfunc_body = """
     if (container_should_be_filtered()) {
         return 0;
     }
+    RATE_SAMPLE_FILTER
 
     struct data_t data = {};
     bpf_get_current_comm(&data.comm, sizeof(data.comm));
 
     u64 tsp = bpf_ktime_get_ns();
 
-    bpf_probe_read_user(&data.fname, sizeof(data.fname), (void *)filename);
+    bpf_probe_read_user_str(&data.fname, sizeof(data.fname), (void *)filename);
     data.id    = id;
     data.ts    = tsp / 1000;
     data.uid   = bpf_get_current_uid_gid();
     data.flags = flags; // EXTENDED_STRUCT_MEMBER
     data.ret   = ret;
+    DEDUP_FILTER
 
     events.perf_submit(ctx, &data, sizeof(data));
 
@@ -290,12 +313,10 @@ else:
         bpf_text += bpf_text_kprobe_header_openat2
         bpf_text += bpf_text_kprobe_body
 
-if args.tid:  # TID trumps PID
-    bpf_text = bpf_text.replace('PID_TID_FILTER',
-        'if (tid != %s) { return 0; }' % args.tid)
-elif args.pid:
-    bpf_text = bpf_text.replace('PID_TID_FILTER',
-        'if (pid != %s) { return 0; }' % args.pid)
+# TID trumps PID, the sets are in maps filled once the program is loaded
+if args.tid or args.pid:
+    bpf_text = task_filter_text() + bpf_text.replace('PID_TID_FILTER',
+        'if (task_should_be_filtered()) { return 0; }')
 else:
     bpf_text = bpf_text.replace('PID_TID_FILTER', '')
 if args.uid:
@@ -309,6 +330,43 @@ if args.flag_filter:
         'if (!(flags & %d)) { return 0; }' % flag_filter_mask)
 else:
     bpf_text = bpf_text.replace('FLAGS_FILTER', '')
+# after the other filters, so that only the opens traced are counted
+rate_sample_filter = ''
+if args.sample:
+    rate_sample_filter += """{
+        int zero = 0;
+        struct bpf_sampler *s = sampler.lookup(&zero);
+        if (!s || !bpf_sample_one_in(s, %d)) { return 0; }
+    }""" % args.sample
+if args.rate:
+    rate_sample_filter += """{
+        int zero = 0;
+        struct bpf_rate_limit *rl = rate_limit.lookup(&zero);
+        if (!rl || !bpf_rate_limit_allow(rl, %d, %d)) { return 0; }
+    }""" % (args.rate, args.rate)
+bpf_text = bpf_text.replace('RATE_SAMPLE_FILTER', rate_sample_filter)
+if args.dedup:
+    # the result, command name, path and flags, and the process
+    bpf_text = bpf_text.replace('DEDUP_FILTER', """{
+        struct bpf_dedup zero = {};
+        u64 h = bpf_hash_bytes(&data.ret,
+            sizeof(data) - offsetof(struct data_t, ret) -
+            sizeof(data.repeats)) ^ (data.id >> 32);
+        struct bpf_dedup *d = dedup.lookup_or_try_init(&h, &zero);
+        if (d && !bpf_dedup_allow(d, %dULL * 1000000, &data.repeats)) {
+            return 0;
+        }
+    }""" % args.dedup)
+else:
+    bpf_text = bpf_text.replace('DEDUP_FILTER', '')
+    bpf_text = '\n'.join(x for x in bpf_text.split('\n')
+        if 'DEDUP_MEMBER' not in x)
+if not args.rate:
+    bpf_text = '\n'.join(x for x in bpf_text.split('\n')
+        if 'RATE_MEMBER' not in x)
+if not args.sample:
+    bpf_text = '\n'.join(x for x in bpf_text.split('\n')
+        if 'SAMPLE_MEMBER' not in x)
 if not (args.extended_fields or args.flag_filter):
     bpf_text = '\n'.join(x for x in bpf_text.split('\n')
         if 'EXTENDED_STRUCT_MEMBER' not in x)
@@ -319,6 +377,10 @@ if debug or args.ebpf:
 
 # initialize BPF
 b = BPF(text=bpf_text)
+if args.tid:
+    TaskFilter(b).set_tids([int(x) for x in args.tid.split(',')])
+elif args.pid:
+    TaskFilter(b).set_pids([int(x) for x in args.pid.split(',')])
 if not is_support_kfunc:
     b.attach_kprobe(event=fnname_open, fn_name="syscall__trace_entry_open")
     b.attach_kretprobe(event=fnname_open, fn_name="trace_return")
@@ -379,7 +441,23 @@ def print_event(cpu, data, size):
     if args.extended_fields:
         printb(b"%08o " % event.flags, nl="")
 
-    printb(b'%s' % event.fname)
+    if args.dedup and event.repeats:
+        printb(b'%s (%d repeats)' % (event.fname, event.repeats))
+    else:
+        printb(b'%s' % event.fname)
+
+def print_suppressed():
+    suppressed = 0
+    if args.sample:
+        suppressed += sum(v.suppressed for v in b["sampler"][0])
+    if args.rate:
+        suppressed += sum(v.suppressed for v in b["rate_limit"][0])
+    if args.rate or args.sample:
+        print("%d opens not traced" % suppressed, file=sys.stderr)
+    if args.dedup:
+        repeats = sum(v.repeats for v in b["dedup"].values())
+        print("%d repeated opens since their last print" % repeats,
+              file=sys.stderr)
 
 # loop with callback to print_event
 b["events"].open_perf_buffer(print_event, page_cnt=64)
@@ -388,4 +466,6 @@ while not args.duration or datetime.now() - start_time < args.duration:
     try:
         b.perf_buffer_poll()
     except KeyboardInterrupt:
+        print_suppressed()
         exit()
+print_suppressed()
@@ -25,13 +25,25 @@
 # 15-Jul-2016   Brendan Gregg   Created this.
 # 20-Oct-2016      "      "     Switched to use the new 4.9 support.
 # 26-Jan-2019      "      "     Changed to exclude CPU idle by default.
+#
+# With --dwarf, user stacks are copied to user space and unwound there with
+# the .eh_frame of the binaries, for code built without frame pointers.
+# With --buildid-out, user stacks are written unresolved, as build-id and
+# offset pairs, to be symbolized on another host (see bcc.buildid).
+# With --branches, the last branch records (LBR) of the CPU cycles samples are
+# read instead of stacks, and the branch edges counted and symbolized.
 
 from __future__ import print_function
-from bcc import BPF, PerfType, PerfSWConfig
+from bcc import BPF, PerfType, PerfSWConfig, PerfHWConfig, \
+    PerfBranchSampleType
 from bcc.containers import filter_by_containers
-from sys import stderr
-from time import sleep
+from bcc.pprof import PprofWriter
+from bcc.buildid import BuildIdStackWriter, stack_frames
+from sys import stderr, stdout
+from time import sleep, strftime, time
 import argparse
+import ctypes as ct
+import platform
 import signal
 import os
 import errno
@@ -69,11 +81,17 @@ examples = """examples:
     ./profile -c 1000000  # profile stack traces every 1 in a million events
     ./profile 5           # profile at 49 Hertz for 5 seconds only
     ./profile -f 5        # output in folded format for flame graphs
+    ./profile -f -i 60    # continuously, print folded stacks every minute
+    ./profile --pprof out.pb.gz 30  # write a pprof profile of 30 seconds
     ./profile -p 185      # only profile process with PID 185
     ./profile -L 185      # only profile thread with TID 185
     ./profile -U          # only show user space stacks (no kernel)
     ./profile -K          # only show kernel space stacks (no user)
+    ./profile --dwarf -p 185  # unwind user stacks without frame pointers
+    ./profile --buildid-out out.bids 30  # user stacks left to symbolize
+    ./profile --branches -p 185 10  # count the taken branches of PID 185
     ./profile --cgroupmap mappath  # only trace cgroups in this BPF map
+    ./profile --cgroup /sys/fs/cgroup/app  # only sample this cgroup's CPU time
     ./profile --mntnsmap mappath   # only trace mount namespaces in the map
 """
 parser = argparse.ArgumentParser(
@@ -104,6 +122,15 @@ parser.add_argument("-I", "--include-idle", action="store_true",
     help="include CPU idle stacks")
 parser.add_argument("-f", "--folded", action="store_true",
     help="output folded format, one line per stack (for flame graphs)")
+parser.add_argument("--pprof", metavar="FILE",
+    help="write a gzipped pprof profile to FILE ('-' for stdout) instead "
+        "of printing the stacks")
+parser.add_argument("--percpu", action="store_true",
+    help="count stacks in per-CPU maps, which avoids contention on the "
+        "hash buckets with many CPUs, at the cost of memory per CPU")
+parser.add_argument("-i", "--interval", type=positive_nonzero_int,
+    help="print and clear the stacks every interval seconds, for "
+        "continuous profiling")
 parser.add_argument("--stack-storage-size", default=16384,
     type=positive_nonzero_int,
     help="the number of unique stack traces that can be stored and "
@@ -119,20 +146,47 @@ parser.add_argument("--cgroupmap",
     help="trace cgroups in this BPF map only")
 parser.add_argument("--mntnsmap",
     help="trace mount namespaces in this BPF map only")
+parser.add_argument("--cgroup", metavar="PATH",
+    help="sample only while tasks of this cgroup v2 directory run, so "
+        "that other cgroups take no sampling interrupts")
+parser.add_argument("--dwarf", action="store_true",
+    help="unwind the user stacks of samples in user code from a copy of the "
+        "stack, with the .eh_frame of the binaries, for code built without "
+        "frame pointers (x86_64, Linux 5.8+)")
+parser.add_argument("--buildid-out", metavar="FILE",
+    help="write the stacks to FILE ('-' for stdout) with user frames as "
+        "build-id and offset pairs, to be symbolized elsewhere with "
+        "bcc.buildid, instead of printing them")
+parser.add_argument("--branches", action="store_true",
+    help="sample CPU cycles and count the branch edges of the last branch "
+        "records (LBR) of the samples, instead of stacks")
 
 # option logic
 args = parser.parse_args()
+if args.dwarf and args.kernel_stacks_only:
+    parser.error("--dwarf unwinds user stacks, it can't be used with -K")
+if args.dwarf and platform.machine() != "x86_64":
+    parser.error("--dwarf is only supported on x86_64")
+if args.buildid_out and (args.dwarf or args.pprof or args.folded):
+    parser.error("--buildid-out can't be used with --dwarf, --pprof or -f")
+if args.branches and (args.dwarf or args.pprof or args.folded or
+        args.buildid_out or args.cgroup):
+    parser.error("--branches can't be used with --dwarf, --pprof, -f, "
+        "--buildid-out or --cgroup")
 pid = int(args.pid) if args.pid is not None else -1
 duration = int(args.duration)
 debug = 0
 need_delimiter = args.delimited and not (args.kernel_stacks_only or
     args.user_stacks_only)
-# TODO: add stack depth, and interval
+# TODO: add stack depth
 
 #
 # Setup BPF
 #
 
+# the most records of current LBRs (Intel Arch LBR has up to 32)
+MAX_BRANCHES = 32
+
 # define BPF program
 bpf_text = """
 #include <uapi/linux/ptrace.h>
@@ -146,8 +200,31 @@ struct key_t {
     int kernel_stack_id;
     char name[TASK_COMM_LEN];
 };
-BPF_HASH(counts, struct key_t);
+COUNTS_MAP(counts, struct key_t);
 BPF_STACK_TRACE(stack_traces, STACK_STORAGE_SIZE);
+#ifdef BUILDID_STACKS
+BPF_STACK_TRACE_BUILDID(buildid_traces, STACK_STORAGE_SIZE);
+#endif
+
+#ifdef DWARF_UNWIND
+struct dwarf_sample_t {
+    struct key_t key;
+    struct user_stack stack;
+};
+BPF_RINGBUF_OUTPUT(user_stacks, 1024);
+#endif
+
+#ifdef BRANCH_RECORDS
+#include <uapi/linux/perf_event.h>
+
+struct branch_sample_t {
+    u32 pid;
+    u32 nr;
+    char name[TASK_COMM_LEN];
+    struct perf_branch_entry entries[MAX_BRANCHES];
+};
+BPF_RINGBUF_OUTPUT(branches, 256);
+#endif
 
 // This code gets a bit complex. Probably not suitable for casual hacking.
 
@@ -170,6 +247,38 @@ int do_perf_event(struct bpf_perf_event_data *ctx) {
     struct key_t key = {.pid = tgid};
     bpf_get_current_comm(&key.name, sizeof(key.name));
 
+#ifdef BRANCH_RECORDS
+    // the records are counted by edge in user space, where they are
+    // symbolized anyway
+    struct branch_sample_t *s = branches.ringbuf_reserve(sizeof(*s));
+    if (!s)
+        return 0;
+    int size = bpf_read_branch_records(ctx, s->entries, sizeof(s->entries), 0);
+    if (size <= 0) {
+        branches.ringbuf_discard(s, 0);
+        return 0;
+    }
+    s->pid = tgid;
+    s->nr = size / sizeof(s->entries[0]);
+    __builtin_memcpy(s->name, key.name, sizeof(s->name));
+    branches.ringbuf_submit(s, 0);
+    return 0;
+#endif
+
+#ifdef DWARF_UNWIND
+    // samples in user code, whose addresses are the positive ones, are
+    // unwound in user space. The others keep the frame pointer stack.
+    if ((s64)PT_REGS_IP(&ctx->regs) > 0) {
+        struct dwarf_sample_t *s = user_stacks.ringbuf_reserve(sizeof(*s));
+        if (s) {
+            s->key = key;
+            bpf_user_stack_fill(&ctx->regs, &s->stack);
+            user_stacks.ringbuf_submit(s, 0);
+            return 0;
+        }
+    }
+#endif
+
     // get stacks
     key.user_stack_id = USER_STACK_GET;
     key.kernel_stack_id = KERNEL_STACK_GET;
@@ -223,10 +332,14 @@ elif args.tid is not None:
 else:
     thread_context = "all threads"
     thread_filter = '1'
+if args.cgroup:
+    thread_context += " of cgroup %s" % args.cgroup
 bpf_text = bpf_text.replace('THREAD_FILTER', thread_filter)
 
 # set stack storage size
 bpf_text = bpf_text.replace('STACK_STORAGE_SIZE', str(args.stack_storage_size))
+bpf_text = bpf_text.replace('COUNTS_MAP',
+    'BPF_PERCPU_HASH' if args.percpu else 'BPF_HASH')
 
 # handle stack args
 kernel_stack_get = "stack_traces.get_stackid(&ctx->regs, 0)"
@@ -240,9 +353,27 @@ elif args.kernel_stacks_only:
     user_stack_get = "-1"
 else:
     stack_context = "user + kernel"
+if args.buildid_out and not args.kernel_stacks_only:
+    user_stack_get = \
+        "buildid_traces.get_stackid(&ctx->regs, BPF_F_USER_STACK)"
+    bpf_text = "#define BUILDID_STACKS\n" + bpf_text
 bpf_text = bpf_text.replace('USER_STACK_GET', user_stack_get)
 bpf_text = bpf_text.replace('KERNEL_STACK_GET', kernel_stack_get)
 bpf_text = filter_by_containers(args) + bpf_text
+if args.dwarf:
+    bpf_text = "#define DWARF_UNWIND\n" + bpf_text
+    stack_context += ", user unwound with DWARF"
+sample_kind = "stack"
+branch_sample_type = 0
+if args.branches:
+    bpf_text = "#define BRANCH_RECORDS\n#define MAX_BRANCHES %d\n" % \
+        MAX_BRANCHES + bpf_text
+    branch_sample_type = PerfBranchSampleType.ANY
+    if not args.kernel_stacks_only:
+        branch_sample_type |= PerfBranchSampleType.USER
+    if not args.user_stacks_only:
+        branch_sample_type |= PerfBranchSampleType.KERNEL
+    sample_kind = "branch records"
 
 sample_freq = 0
 sample_period = 0
@@ -257,9 +388,10 @@ sample_context = "%s%d %s" % (("", sample_freq, "Hertz") if sample_freq
                          else ("every ", sample_period, "events"))
 
 # header
-if not args.folded:
-    print("Sampling at %s of %s by %s stack" %
-        (sample_context, thread_context, stack_context), end="")
+quiet = args.folded or args.pprof or args.buildid_out
+if not quiet:
+    print("Sampling at %s of %s by %s %s" %
+        (sample_context, thread_context, stack_context, sample_kind), end="")
     if args.cpu >= 0:
         print(" on CPU#{}".format(args.cpu), end="")
     if duration < 99999999:
@@ -274,9 +406,20 @@ if debug or args.ebpf:
 
 # initialize BPF & perf_events
 b = BPF(text=bpf_text)
-b.attach_perf_event(ev_type=PerfType.SOFTWARE,
-    ev_config=PerfSWConfig.CPU_CLOCK, fn_name="do_perf_event",
-    sample_period=sample_period, sample_freq=sample_freq, cpu=args.cpu)
+cgroup_fd = os.open(args.cgroup, os.O_RDONLY) if args.cgroup else -1
+if args.branches:
+    # only the PMU keeps branch records, which needs a hardware event
+    b.attach_perf_event(ev_type=PerfType.HARDWARE,
+        ev_config=PerfHWConfig.CPU_CYCLES, fn_name="do_perf_event",
+        sample_period=sample_period, sample_freq=sample_freq, cpu=args.cpu,
+        branch_sample_type=branch_sample_type)
+else:
+    b.attach_perf_event(ev_type=PerfType.SOFTWARE,
+        ev_config=PerfSWConfig.CPU_CLOCK, fn_name="do_perf_event",
+        sample_period=sample_period, sample_freq=sample_freq, cpu=args.cpu,
+        cgroup_fd=cgroup_fd)
+if cgroup_fd >= 0:
+    os.close(cgroup_fd)
 
 # signal handler
 def signal_ignore(signal, frame):
@@ -286,93 +429,334 @@ def signal_ignore(signal, frame):
 # Output Report
 #
 
-# collect samples
-try:
-    sleep(duration)
-except KeyboardInterrupt:
-    # as cleanup can take some time, trap Ctrl-C:
-    signal.signal(signal.SIGINT, signal_ignore)
-
-if not args.folded:
-    print()
-
 def aksym(addr):
     if args.annotations:
         return b.ksym(addr) + "_[k]".encode()
     else:
         return b.ksym(addr)
 
-# output stacks
-missing_stacks = 0
-has_collision = False
 counts = b.get_table("counts")
 stack_traces = b.get_table("stack_traces")
-for k, v in sorted(counts.items(), key=lambda counts: counts[1].value):
-    # handle get_stackid errors
-    if not args.user_stacks_only and stack_id_err(k.kernel_stack_id):
-        missing_stacks += 1
-        # hash collision (-EEXIST) suggests that the map size may be too small
-        has_collision = has_collision or k.kernel_stack_id == -errno.EEXIST
-    if not args.kernel_stacks_only and stack_id_err(k.user_stack_id):
-        missing_stacks += 1
-        has_collision = has_collision or k.user_stack_id == -errno.EEXIST
-
-    user_stack = [] if k.user_stack_id < 0 else \
-        stack_traces.walk(k.user_stack_id)
-    kernel_tmp = [] if k.kernel_stack_id < 0 else \
-        stack_traces.walk(k.kernel_stack_id)
-
-    # fix kernel stack
-    kernel_stack = []
-    if k.kernel_stack_id >= 0:
-        for addr in kernel_tmp:
-            kernel_stack.append(addr)
-        # the later IP checking
-        if k.kernel_ip:
-            kernel_stack.insert(0, k.kernel_ip)
-
-    if args.folded:
-        # print folded stack output
-        user_stack = list(user_stack)
-        kernel_stack = list(kernel_stack)
-        line = [k.name]
-        # if we failed to get the stack is, such as due to no space (-ENOMEM) or
-        # hash collision (-EEXIST), we still print a placeholder for consistency
-        if not args.kernel_stacks_only:
-            if stack_id_err(k.user_stack_id):
-                line.append(b"[Missed User Stack]")
-            else:
-                line.extend([b.sym(addr, k.pid) for addr in reversed(user_stack)])
-        if not args.user_stacks_only:
-            line.extend([b"-"] if (need_delimiter and k.kernel_stack_id >= 0 and k.user_stack_id >= 0) else [])
-            if stack_id_err(k.kernel_stack_id):
-                line.append(b"[Missed Kernel Stack]")
-            else:
-                line.extend([aksym(addr) for addr in reversed(kernel_stack)])
-        print("%s %d" % (b";".join(line).decode('utf-8', 'replace'), v.value))
+
+# user stacks unwound with --dwarf, counted by (pid, comm, addresses)
+dwarf_counts = {}
+
+class Key(ct.Structure):
+    _fields_ = [
+        ("pid", ct.c_uint32),
+        ("kernel_ip", ct.c_uint64),
+        ("user_stack_id", ct.c_int),
+        ("kernel_stack_id", ct.c_int),
+        ("name", ct.c_char * 16),
+    ]
+
+class UserStack(ct.Structure):
+    _fields_ = [
+        ("pid", ct.c_uint32),
+        ("tid", ct.c_uint32),
+        ("ip", ct.c_uint64),
+        ("sp", ct.c_uint64),
+        ("bp", ct.c_uint64),
+        ("size", ct.c_uint32),
+        ("pad", ct.c_uint32),
+        ("data", ct.c_uint8 * 8192),
+    ]
+
+class DwarfSample(ct.Structure):
+    _fields_ = [("key", Key), ("stack", UserStack)]
+
+def unwind_sample(ctx, data, size):
+    s = ct.cast(data, ct.POINTER(DwarfSample)).contents
+    # unwound now, while the mappings of the process are those sampled
+    ips = BPF._sym_cache(s.key.pid).unwind(s.stack.ip, s.stack.sp,
+        s.stack.bp, s.stack.data, s.stack.size)
+    k = (s.key.pid, s.key.name, tuple(ips))
+    dwarf_counts[k] = dwarf_counts.get(k, 0) + 1
+
+if args.dwarf:
+    b["user_stacks"].open_ring_buffer(unwind_sample)
+
+# branch edges of --branches, counted by (pid, comm, from, to)
+branch_counts = {}
+
+class PerfBranchEntry(ct.Structure):
+    _fields_ = [
+        ("from_ip", ct.c_uint64),
+        ("to_ip", ct.c_uint64),
+        ("flags", ct.c_uint64),
+    ]
+
+class BranchSample(ct.Structure):
+    _fields_ = [
+        ("pid", ct.c_uint32),
+        ("nr", ct.c_uint32),
+        ("name", ct.c_char * 16),
+        ("entries", PerfBranchEntry * MAX_BRANCHES),
+    ]
+
+def count_branches(ctx, data, size):
+    s = ct.cast(data, ct.POINTER(BranchSample)).contents
+    for i in range(min(s.nr, MAX_BRANCHES)):
+        e = s.entries[i]
+        k = (s.pid, s.name, e.from_ip, e.to_ip)
+        branch_counts[k] = branch_counts.get(k, 0) + 1
+
+if args.branches:
+    b["branches"].open_ring_buffer(count_branches)
+
+def wait(seconds):
+    if not (args.dwarf or args.branches):
+        sleep(seconds)
+        return
+    deadline = time() + seconds
+    while time() < deadline:
+        b.ring_buffer_poll(100)
+
+def drain_dwarf_counts(recycle):
+    # keys and values like those of the counts map, with stack ids past
+    # the ones of stack_traces
+    items = []
+    stacks = {}
+    for i, ((pid, name, ips), n) in enumerate(dwarf_counts.items()):
+        k = counts.Key()
+        k.pid = pid
+        k.name = name
+        k.user_stack_id = args.stack_storage_size + i
+        k.kernel_stack_id = -errno.EFAULT
+        items.append((k, ct.c_ulonglong(n)))
+        stacks[k.user_stack_id] = ips
+    if recycle:
+        dwarf_counts.clear()
+    return items, stacks
+
+pprof = None
+if args.pprof:
+    sample_types = [("samples", "count")]
+    if sample_freq:
+        # CPU time, as each sample stands for a period of 1/freq seconds
+        sample_ns = 1000000000 // sample_freq
+        sample_types.append(("cpu", "nanoseconds"))
+        pprof = PprofWriter(args.pprof, sample_types,
+            period_type=("cpu", "nanoseconds"), period=sample_ns)
     else:
-        # print default multi-line stack output
-        if not args.user_stacks_only:
-            if stack_id_err(k.kernel_stack_id):
-                print("    [Missed Kernel Stack]")
-            else:
-                for addr in kernel_stack:
-                    print("    %s" % aksym(addr))
-        if not args.kernel_stacks_only:
-            if need_delimiter and k.user_stack_id >= 0 and k.kernel_stack_id >= 0:
-                print("    --")
-            if stack_id_err(k.user_stack_id):
-                print("    [Missed User Stack]")
-            else:
-                for addr in user_stack:
-                    print("    %s" % b.sym(addr, k.pid).decode('utf-8', 'replace'))
-        print("    %-16s %s (%d)" % ("-", k.name.decode('utf-8', 'replace'), k.pid))
-        print("        %d\n" % v.value)
-
-# check missing
-if missing_stacks > 0:
-    enomem_str = "" if not has_collision else \
-        " Consider increasing --stack-storage-size."
-    print("WARNING: %d stack traces could not be displayed.%s" %
-        (missing_stacks, enomem_str),
-        file=stderr)
+        pprof = PprofWriter(args.pprof, sample_types,
+            period_type=("events", "count"), period=sample_period)
+
+buildid_out = None
+buildid_traces = None
+if args.buildid_out:
+    buildid_out = BuildIdStackWriter(args.buildid_out)
+    if not args.kernel_stacks_only:
+        buildid_traces = b.get_table("buildid_traces")
+
+def drain_counts():
+    if args.percpu:
+        return counts.items_sum(delete=True)
+    try:
+        return list(counts.items_lookup_and_delete_batch())
+    except Exception:
+        # no batch operations before 5.6, samples counted between the
+        # lookup and the delete of a key are lost
+        items = []
+        for k, v in counts.items():
+            items.append((k, v))
+            try:
+                del counts[k]
+            except KeyError:
+                pass
+        return items
+
+def branch_sym(addr, pid):
+    # kernel addresses are those of the upper half
+    if addr >> 63:
+        return b.ksym(addr, show_offset=True) + \
+            (b"_[k]" if args.annotations else b"")
+    return b.sym(addr, pid, show_offset=True)
+
+def print_branches(recycle):
+    items = sorted(branch_counts.items(), key=lambda e: e[1])
+    if recycle:
+        branch_counts.clear()
+    for (k_pid, name, from_ip, to_ip), n in items:
+        print("    %s" % branch_sym(from_ip, k_pid).decode('utf-8', 'replace'))
+        print("    -> %s" % branch_sym(to_ip, k_pid).decode('utf-8',
+            'replace'))
+        print("    %-16s %s (%d)" % ("-", name.decode('utf-8', 'replace'),
+            k_pid))
+        print("        %d\n" % n)
+
+# output stacks
+def print_stacks(recycle):
+    if args.branches:
+        print_branches(recycle)
+        return
+    missing_stacks = 0
+    has_collision = False
+    if recycle:
+        items = drain_counts()
+    else:
+        items = counts.items_sum() if args.percpu else counts.items()
+    if buildid_traces:
+        # user stacks are in their own map, whose ids overlap those of
+        # stack_traces
+        user_ids = list(set([k.user_stack_id for k, _ in items]))
+        user_stacks = dict((stack_id, stack_frames(buildid_traces, stack_id))
+            for stack_id in user_ids)
+        stack_ids = list(set([k.kernel_stack_id for k, _ in items]))
+    else:
+        stack_ids = list(set([k.user_stack_id for k, _ in items] +
+            [k.kernel_stack_id for k, _ in items]))
+    stacks = dict(zip(stack_ids, stack_traces.get_all(stack_ids)))
+    if not buildid_traces:
+        user_stacks = stacks
+    if args.dwarf:
+        dwarf_items, dwarf_stacks = drain_dwarf_counts(recycle)
+        items = list(items) + dwarf_items
+        stacks.update(dwarf_stacks)
+    if recycle:
+        # the ids of these stacks are free again for new stacks, a sample
+        # of one of them counted since the drain shows as missed
+        for stack_id in stack_ids:
+            if stack_id < 0:
+                continue
+            try:
+                del stack_traces[stack_traces.Key(stack_id)]
+            except KeyError:
+                pass
+        for stack_id in (user_ids if buildid_traces else []):
+            if stack_id < 0:
+                continue
+            try:
+                del buildid_traces[buildid_traces.Key(stack_id)]
+            except KeyError:
+                pass
+
+    for k, v in sorted(items, key=lambda counts: counts[1].value):
+        # handle get_stackid errors
+        if not args.user_stacks_only and stack_id_err(k.kernel_stack_id):
+            missing_stacks += 1
+            # hash collision (-EEXIST) suggests that the map size may be too small
+            has_collision = has_collision or k.kernel_stack_id == -errno.EEXIST
+        if not args.kernel_stacks_only and stack_id_err(k.user_stack_id):
+            missing_stacks += 1
+            has_collision = has_collision or k.user_stack_id == -errno.EEXIST
+
+        user_stack = user_stacks[k.user_stack_id]
+
+        # fix kernel stack
+        kernel_stack = []
+        if k.kernel_stack_id >= 0:
+            kernel_stack = list(stacks[k.kernel_stack_id])
+            # the later IP checking
+            if k.kernel_ip:
+                kernel_stack.insert(0, k.kernel_ip)
+
+        if buildid_out:
+            # frames from the leaf, user ones left for the symbolizer
+            frames = []
+            if not args.user_stacks_only:
+                if stack_id_err(k.kernel_stack_id):
+                    frames.append(b"[Missed Kernel Stack]")
+                else:
+                    frames.extend([aksym(addr) for addr in kernel_stack])
+            if not args.kernel_stacks_only:
+                if stack_id_err(k.user_stack_id):
+                    frames.append(b"[Missed User Stack]")
+                else:
+                    frames.extend(user_stack)
+            buildid_out.add_sample(frames, v.value, k.pid, k.name)
+        elif pprof:
+            # frames from the leaf, names are interned by the writer
+            frames = []
+            if not args.user_stacks_only:
+                if stack_id_err(k.kernel_stack_id):
+                    frames.append(b"[Missed Kernel Stack]")
+                else:
+                    frames.extend([aksym(addr) for addr in kernel_stack])
+            if not args.kernel_stacks_only:
+                if stack_id_err(k.user_stack_id):
+                    frames.append(b"[Missed User Stack]")
+                else:
+                    frames.extend([b.sym(addr, k.pid) for addr in user_stack])
+            values = [v.value]
+            if sample_freq:
+                values.append(v.value * sample_ns)
+            pprof.add_sample(frames, values, {"comm": k.name, "pid": k.pid})
+        elif args.folded:
+            # print folded stack output
+            line = [k.name]
+            # if we failed to get the stack is, such as due to no space (-ENOMEM) or
+            # hash collision (-EEXIST), we still print a placeholder for consistency
+            if not args.kernel_stacks_only:
+                if stack_id_err(k.user_stack_id):
+                    line.append(b"[Missed User Stack]")
+                else:
+                    line.extend([b.sym(addr, k.pid) for addr in reversed(user_stack)])
+            if not args.user_stacks_only:
+                line.extend([b"-"] if (need_delimiter and k.kernel_stack_id >= 0 and k.user_stack_id >= 0) else [])
+                if stack_id_err(k.kernel_stack_id):
+                    line.append(b"[Missed Kernel Stack]")
+                else:
+                    line.extend([aksym(addr) for addr in reversed(kernel_stack)])
+            print("%s %d" % (b";".join(line).decode('utf-8', 'replace'), v.value))
+        else:
+            # print default multi-line stack output
+            if not args.user_stacks_only:
+                if stack_id_err(k.kernel_stack_id):
+                    print("    [Missed Kernel Stack]")
+                else:
+                    for addr in kernel_stack:
+                        print("    %s" % aksym(addr))
+            if not args.kernel_stacks_only:
+                if need_delimiter and k.user_stack_id >= 0 and k.kernel_stack_id >= 0:
+                    print("    --")
+                if stack_id_err(k.user_stack_id):
+                    print("    [Missed User Stack]")
+                else:
+                    for addr in user_stack:
+                        print("    %s" % b.sym(addr, k.pid).decode('utf-8', 'replace'))
+            print("    %-16s %s (%d)" % ("-", k.name.decode('utf-8', 'replace'), k.pid))
+            print("        %d\n" % v.value)
+
+    # check missing
+    if missing_stacks > 0:
+        enomem_str = "" if not has_collision else \
+            " Consider increasing --stack-storage-size."
+        print("WARNING: %d stack traces could not be displayed.%s" %
+            (missing_stacks, enomem_str),
+            file=stderr)
+
+# collect samples
+if args.interval:
+    # drain the counts and recycle the stacks every interval, the symbols
+    # resolved so far stay cached for the next ones
+    exiting = False
+    remaining = duration
+    while not exiting:
+        try:
+            wait(min(args.interval, remaining))
+        except KeyboardInterrupt:
+            exiting = True
+            signal.signal(signal.SIGINT, signal_ignore)
+        remaining -= args.interval
+        if remaining <= 0:
+            exiting = True
+        if not quiet:
+            print("\n[%s]" % strftime("%H:%M:%S"))
+        print_stacks(recycle=True)
+        stdout.flush()
+else:
+    try:
+        wait(duration)
+    except KeyboardInterrupt:
+        # as cleanup can take some time, trap Ctrl-C:
+        signal.signal(signal.SIGINT, signal_ignore)
+
+    if not quiet:
+        print()
+    print_stacks(recycle=False)
+
+if pprof:
+    pprof.close()
+if buildid_out:
+    buildid_out.close()
@@ -4,7 +4,7 @@
 # runqlat   Run queue (scheduler) latency as a histogram.
 #           For Linux, uses BCC, eBPF.
 #
-# USAGE: runqlat [-h] [-T] [-m] [-P] [-L] [-p PID] [interval] [count]
+# USAGE: runqlat [-h] [-T] [-m] [-P] [-L] [-C] [-p PID] [interval] [count]
 #
 # This measures the time a task spends waiting on a run queue for a turn
 # on-CPU, and shows this time as a histogram. This time should be small, but a
@@ -28,6 +28,7 @@ from __future__ import print_function
 from bcc import BPF
 from time import sleep, strftime
 import argparse
+import os
 
 # arguments
 examples = """examples:
@@ -35,6 +36,7 @@ examples = """examples:
     ./runqlat 1 10       # print 1 second summaries, 10 times
     ./runqlat -mT 1      # 1s summaries, milliseconds, and timestamps
     ./runqlat -P         # show each PID separately
+    ./runqlat -C         # show each cgroup separately
     ./runqlat -p 185     # trace PID 185 only
 """
 parser = argparse.ArgumentParser(
@@ -53,6 +55,8 @@ parser.add_argument("--pidnss", action="store_true",
     help="print a histogram per PID namespace")
 parser.add_argument("-L", "--tids", action="store_true",
     help="print a histogram per thread ID")
+parser.add_argument("-C", "--cgroups", action="store_true",
+    help="print a histogram per cgroup (v2)")
 parser.add_argument("-p", "--pid",
     help="trace this PID only")
 parser.add_argument("interval", nargs="?", default=99999999,
@@ -72,6 +76,7 @@ bpf_text = """
 #include <linux/nsproxy.h>
 #include <linux/pid_namespace.h>
 #include <linux/init_task.h>
+#include <linux/cgroup.h>
 
 typedef struct pid_key {
     u64 id;    // work around
@@ -83,21 +88,55 @@ typedef struct pidns_key {
     u64 slot;
 } pidns_key_t;
 
-BPF_HASH(start, u32);
+typedef struct cgroup_key {
+    u64 id;
+    u64 slot;
+} cgroup_key_t;
+
+// Enqueue timestamps, with a slot for every possible TID: stamping a task
+// on the scheduler paths of all CPUs takes no hash bucket lock
+BPF_ARRAY(start, u64, MAX_PID);
 STORAGE
 
 struct rq;
 
+static __always_inline void store_start(u32 pid)
+{
+    u64 *tsp = start.lookup(&pid);
+    if (tsp)
+        *tsp = bpf_ktime_get_ns();
+}
+
+// the enqueue timestamp of pid, cleared, or 0 if it was missed
+static __always_inline u64 take_start(u32 pid)
+{
+    u64 *tsp = start.lookup(&pid);
+    if (tsp == 0)
+        return 0;
+    u64 ts = *tsp;
+    *tsp = 0;
+    return ts;
+}
+
 // record enqueue timestamp
 static int trace_enqueue(u32 tgid, u32 pid)
 {
     if (FILTER || pid == 0)
         return 0;
-    u64 ts = bpf_ktime_get_ns();
-    start.update(&pid, &ts);
+    store_start(pid);
     return 0;
 }
 
+// the id of the cgroup v2 of task, as bpf_get_current_cgroup_id() returns
+static __always_inline u64 task_cgroup_id(struct task_struct *task)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+    return task->cgroups->dfl_cgrp->kn->id;
+#else
+    return task->cgroups->dfl_cgrp->kn->id.id;
+#endif
+}
+
 static __always_inline unsigned int pid_namespace(struct task_struct *task)
 {
 
@@ -159,30 +198,27 @@ int trace_run(struct pt_regs *ctx, struct task_struct *prev)
     if (prev->STATE_FIELD == TASK_RUNNING) {
         tgid = prev->tgid;
         pid = prev->pid;
-        if (!(FILTER || pid == 0)) {
-            u64 ts = bpf_ktime_get_ns();
-            start.update(&pid, &ts);
-        }
+        if (!(FILTER || pid == 0))
+            store_start(pid);
     }
 
     tgid = bpf_get_current_pid_tgid() >> 32;
     pid = bpf_get_current_pid_tgid();
     if (FILTER || pid == 0)
         return 0;
-    u64 *tsp, delta;
+    u64 ts, delta;
 
     // fetch timestamp and calculate delta
-    tsp = start.lookup(&pid);
-    if (tsp == 0) {
+    ts = take_start(pid);
+    if (ts == 0) {
         return 0;   // missed enqueue
     }
-    delta = bpf_ktime_get_ns() - *tsp;
+    delta = bpf_ktime_get_ns() - ts;
     FACTOR
 
     // store as histogram
     STORE
 
-    start.delete(&pid);
     return 0;
 }
 """
@@ -213,30 +249,27 @@ RAW_TRACEPOINT_PROBE(sched_switch)
     if (prev->STATE_FIELD == TASK_RUNNING) {
         tgid = prev->tgid;
         pid = prev->pid;
-        if (!(FILTER || pid == 0)) {
-            u64 ts = bpf_ktime_get_ns();
-            start.update(&pid, &ts);
-        }
+        if (!(FILTER || pid == 0))
+            store_start(pid);
     }
 
     tgid = next->tgid;
     pid = next->pid;
     if (FILTER || pid == 0)
         return 0;
-    u64 *tsp, delta;
+    u64 ts, delta;
 
     // fetch timestamp and calculate delta
-    tsp = start.lookup(&pid);
-    if (tsp == 0) {
+    ts = take_start(pid);
+    if (ts == 0) {
         return 0;   // missed enqueue
     }
-    delta = bpf_ktime_get_ns() - *tsp;
+    delta = bpf_ktime_get_ns() - ts;
     FACTOR
 
     // store as histogram
     STORE
 
-    start.delete(&pid);
     return 0;
 }
 """
@@ -247,6 +280,10 @@ if is_support_raw_tp:
 else:
     bpf_text += bpf_text_kprobe
 
+# TIDs above the limit at start, if it is raised later, are not traced
+with open("/proc/sys/kernel/pid_max") as f:
+    bpf_text = bpf_text.replace('MAX_PID', f.read().strip())
+
 # code substitutions
 if BPF.kernel_struct_has_field(b'task_struct', b'__state') == 1:
     bpf_text = bpf_text.replace('STATE_FIELD', '__state')
@@ -274,6 +311,16 @@ if args.pids or args.tids:
     bpf_text = bpf_text.replace('STORE',
         'pid_key_t key = {.id = ' + pid + ', .slot = bpf_log2l(delta)}; ' +
         'dist.increment(key);')
+elif args.cgroups:
+    section = "cgroup"
+    # finish_task_switch() runs in the task switched to
+    cgroup_id = 'task_cgroup_id(next)' if is_support_raw_tp else \
+        'bpf_get_current_cgroup_id()'
+    bpf_text = bpf_text.replace('STORAGE',
+        'BPF_HISTOGRAM(dist, cgroup_key_t);')
+    bpf_text = bpf_text.replace('STORE', 'cgroup_key_t key = ' +
+        '{.id = ' + cgroup_id + ', .slot = bpf_log2l(delta)}; ' +
+        'dist.atomic_increment(key);')
 elif args.pidnss:
     section = "pidns"
     bpf_text = bpf_text.replace('STORAGE',
@@ -299,6 +346,23 @@ if not is_support_raw_tp:
     b.attach_kprobe(event_re="^finish_task_switch$|^finish_task_switch\.isra\.\d$",
                     fn_name="trace_run")
 
+def cgroup_paths():
+    # cgroup v2 ids are the inode numbers of the cgroup directories
+    mount = "/sys/fs/cgroup"
+    with open("/proc/mounts") as f:
+        for line in f:
+            fields = line.split()
+            if fields[2] == "cgroup2":
+                mount = fields[1]
+                break
+    paths = {}
+    for path, _, _ in os.walk(mount):
+        try:
+            paths[os.stat(path).st_ino] = path[len(mount):] or "/"
+        except OSError:
+            pass
+    return paths
+
 print("Tracing run queue latency... Hit Ctrl-C to end.")
 
 # output
@@ -314,7 +378,12 @@ while (1):
     if args.timestamp:
         print("%-8s\n" % strftime("%H:%M:%S"), end="")
 
-    dist.print_log2_hist(label, section, section_print_fn=int)
+    if args.cgroups:
+        paths = cgroup_paths()
+        section_print_fn = lambda id: paths.get(id, str(id))
+    else:
+        section_print_fn = int
+    dist.print_log2_hist(label, section, section_print_fn=section_print_fn)
     dist.clear()
 
     countdown -= 1
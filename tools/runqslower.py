@@ -74,7 +74,9 @@ bpf_text = """
 #include <linux/nsproxy.h>
 #include <linux/pid_namespace.h>
 
-BPF_HASH(start, u32);
+// Enqueue timestamps, with a slot for every possible TID: stamping a task
+// on the scheduler paths of all CPUs takes no hash bucket lock
+BPF_ARRAY(start, u64, MAX_PID);
 
 struct rq;
 
@@ -88,13 +90,30 @@ struct data_t {
 
 BPF_PERF_OUTPUT(events);
 
+static __always_inline void store_start(u32 pid, u64 ts)
+{
+    u64 *tsp = start.lookup(&pid);
+    if (tsp)
+        *tsp = ts;
+}
+
+// the enqueue timestamp of pid, cleared, or 0 if it was missed
+static __always_inline u64 take_start(u32 pid)
+{
+    u64 *tsp = start.lookup(&pid);
+    if (tsp == 0)
+        return 0;
+    u64 ts = *tsp;
+    *tsp = 0;
+    return ts;
+}
+
 // record enqueue timestamp
 static int trace_enqueue(u32 tgid, u32 pid)
 {
     if (FILTER_PID || FILTER_TGID || pid == 0)
         return 0;
-    u64 ts = bpf_ktime_get_ns();
-    start.update(&pid, &ts);
+    store_start(pid, bpf_ktime_get_ns());
     return 0;
 }
 """
@@ -123,21 +142,21 @@ int trace_run(struct pt_regs *ctx, struct task_struct *prev)
         u64 ts = bpf_ktime_get_ns();
         if (prev_pid != 0) {
             if (!(FILTER_PID) && !(FILTER_TGID)) {
-                start.update(&prev_pid, &ts);
+                store_start(prev_pid, ts);
             }
         }
     }
 
     pid = bpf_get_current_pid_tgid();
 
-    u64 *tsp, delta_us;
+    u64 ts, delta_us;
 
     // fetch timestamp and calculate delta
-    tsp = start.lookup(&pid);
-    if (tsp == 0) {
+    ts = take_start(pid);
+    if (ts == 0) {
         return 0;   // missed enqueue
     }
-    delta_us = (bpf_ktime_get_ns() - *tsp) / 1000;
+    delta_us = (bpf_ktime_get_ns() - ts) / 1000;
 
     if (FILTER_US)
         return 0;
@@ -151,8 +170,6 @@ int trace_run(struct pt_regs *ctx, struct task_struct *prev)
 
     // output
     events.perf_submit(ctx, &data, sizeof(data));
-
-    start.delete(&pid);
     return 0;
 }
 """
@@ -192,7 +209,7 @@ RAW_TRACEPOINT_PROBE(sched_switch)
         u64 ts = bpf_ktime_get_ns();
         if (prev_pid != 0) {
             if (!(FILTER_PID) && !(FILTER_TGID)) {
-                start.update(&prev_pid, &ts);
+                store_start(prev_pid, ts);
             }
         }
 
@@ -200,14 +217,14 @@ RAW_TRACEPOINT_PROBE(sched_switch)
 
     bpf_probe_read_kernel(&pid, sizeof(next->pid), &next->pid);
 
-    u64 *tsp, delta_us;
+    u64 ts, delta_us;
 
     // fetch timestamp and calculate delta
-    tsp = start.lookup(&pid);
-    if (tsp == 0) {
+    ts = take_start(pid);
+    if (ts == 0) {
         return 0;   // missed enqueue
     }
-    delta_us = (bpf_ktime_get_ns() - *tsp) / 1000;
+    delta_us = (bpf_ktime_get_ns() - ts) / 1000;
 
     if (FILTER_US)
         return 0;
@@ -221,8 +238,6 @@ RAW_TRACEPOINT_PROBE(sched_switch)
 
     // output
     events.perf_submit(ctx, &data, sizeof(data));
-
-    start.delete(&pid);
     return 0;
 }
 """
@@ -234,6 +249,9 @@ else:
     bpf_text += bpf_text_kprobe
 
 # code substitutions
+# TIDs above the limit at start, if it is raised later, are not traced
+with open("/proc/sys/kernel/pid_max") as f:
+    bpf_text = bpf_text.replace('MAX_PID', f.read().strip())
 if BPF.kernel_struct_has_field(b'task_struct', b'__state') == 1:
     bpf_text = bpf_text.replace('STATE_FIELD', '__state')
 else:
@@ -112,6 +112,9 @@ b = BPF(text=bpf_text)
 
 print('Tracing... Output every %d secs. Hit Ctrl-C to end' % interval)
 
+# the maxrows largest entries by size are selected in libbcc
+top = b.get_table("counts").top(maxrows, ["size"])
+
 # output
 exiting = 0
 while 1:
@@ -129,18 +132,10 @@ while 1:
         print("%-8s loadavg: %s" % (strftime("%H:%M:%S"), stats.read()))
     print("%-32s %6s %10s" % ("CACHE", "ALLOCS", "BYTES"))
 
-    # by-TID output
-    counts = b.get_table("counts")
-    line = 0
-    for k, v in reversed(sorted(counts.items(),
-                                key=lambda counts: counts[1].size)):
+    # by-TID output, draining the table
+    for k, v in top.update():
         printb(b"%-32s %6d %10d" % (k.name, v.count, v.size))
 
-        line += 1
-        if line >= maxrows:
-            break
-    counts.clear()
-
     countdown -= 1
     if exiting or countdown == 0:
         print("Detaching...")
@@ -18,6 +18,8 @@ from __future__ import print_function
 from bcc import BPF
 import argparse
 import binascii
+import ctypes as ct
+import struct
 import textwrap
 
 # arguments
@@ -56,7 +58,7 @@ parser.add_argument("--ebpf", action="store_true",
 parser.add_argument("--hexdump", action="store_true", dest="hexdump",
                     help="show data as hexdump instead of trying to decode it as UTF-8")
 parser.add_argument('--max-buffer-size', type=int, default=8192,
-                    help='Size of captured buffer')
+                    help='Size of captured buffer, at most per call')
 args = parser.parse_args()
 
 
@@ -65,62 +67,129 @@ prog = """
 #include <linux/sched.h>        /* For TASK_COMM_LEN */
 
 #define MAX_BUF_SIZE __MAX_BUF_SIZE__
-
-struct probe_SSL_data_t {
+#define CHUNK_SIZE 4096
+
+// Each call is sent in records of up to CHUNK_SIZE bytes of data with ring
+// buffers, up to MAX_BUF_SIZE bytes in all, and in one record of up to
+// MAX_BUF_SIZE bytes with perf buffers.
+#ifdef USE_RINGBUF
+#define BUF_SIZE CHUNK_SIZE
+#define MAX_CHUNKS ((MAX_BUF_SIZE + CHUNK_SIZE - 1) / CHUNK_SIZE)
+#else
+#define BUF_SIZE MAX_BUF_SIZE
+#endif
+
+struct probe_SSL_hdr_t {
         u64 timestamp_ns;
         u32 pid;
         u32 tid;
         u32 uid;
-        u32 len;
-        int buf_filled;
+        u32 len;        // bytes of the call
+        u32 offset;     // of the data of this record in the call
+        u32 size;       // bytes of data in this record, 0 if unreadable
+        u32 is_read;
+        u32 pad;
         char comm[TASK_COMM_LEN];
-        u8 buf[MAX_BUF_SIZE];
 };
 
-#define BASE_EVENT_SIZE ((size_t)(&((struct probe_SSL_data_t*)0)->buf))
-#define EVENT_SIZE(X) (BASE_EVENT_SIZE + ((size_t)(X)))
+struct probe_SSL_data_t {
+        struct probe_SSL_hdr_t hdr;
+        u8 buf[BUF_SIZE];
+};
 
+#ifdef USE_RINGBUF
+BPF_RINGBUF_OUTPUT(ssl_events, __RINGBUF_PAGES__);
+
+// Reserve a record for up to max bytes and read the data straight into it
+static __always_inline int submit_chunk(struct probe_SSL_hdr_t *hdr,
+                                        const u8 *src, u32 offset, u32 n,
+                                        const u32 max) {
+        if (n > max)
+                n = max;
+        struct probe_SSL_data_t *data =
+                ssl_events.ringbuf_reserve(sizeof(struct probe_SSL_hdr_t) + max);
+        if (!data)
+                return 0;
+        __builtin_memcpy(&data->hdr, hdr, sizeof(*hdr));
+        data->hdr.offset = offset;
+        if (bpf_probe_read_user(data->buf, n, src + offset) != 0)
+                n = 0;
+        data->hdr.size = n;
+        ssl_events.ringbuf_submit(data, 0);
+        return n;
+}
 
+static __always_inline void submit_data(struct pt_regs *ctx,
+                                        struct probe_SSL_hdr_t *hdr,
+                                        const u8 *src) {
+        u32 total = min((u32)MAX_BUF_SIZE, hdr->len);
+        u32 offset = 0;
+
+        for (int i = 0; i < MAX_CHUNKS && offset < total; i++) {
+                u32 n = total - offset;
+                int ret;
+                // the record size has to be constant, the last chunk of a
+                // call takes the smallest that fits
+                if (n <= 256)
+                        ret = submit_chunk(hdr, src, offset, n, 256);
+                else if (n <= 1024)
+                        ret = submit_chunk(hdr, src, offset, n, 1024);
+                else
+                        ret = submit_chunk(hdr, src, offset, n, CHUNK_SIZE);
+                if (ret <= 0)
+                        break;
+                offset += ret;
+        }
+}
+#else
 BPF_PERCPU_ARRAY(ssl_data, struct probe_SSL_data_t, 1);
-BPF_PERF_OUTPUT(perf_SSL_write);
+BPF_PERF_OUTPUT(ssl_events);
 
-int probe_SSL_write(struct pt_regs *ctx, void *ssl, void *buf, int num) {
-        int ret;
+static __always_inline void submit_data(struct pt_regs *ctx,
+                                        struct probe_SSL_hdr_t *hdr,
+                                        const u8 *src) {
         u32 zero = 0;
+        struct probe_SSL_data_t *data = ssl_data.lookup(&zero);
+        if (!data)
+                return;
+
+        __builtin_memcpy(&data->hdr, hdr, sizeof(*hdr));
+        u32 n = min((u32)MAX_BUF_SIZE, hdr->len);
+        if (bpf_probe_read_user(data->buf, n, src) != 0)
+                n = 0;
+        data->hdr.size = n;
+        ssl_events.perf_submit(ctx, data, sizeof(struct probe_SSL_hdr_t) + n);
+}
+#endif
+
+static __always_inline void fill_hdr(struct probe_SSL_hdr_t *hdr, u64 pid_tgid,
+                                     u32 uid, u32 len, u32 is_read) {
+        __builtin_memset(hdr, 0, sizeof(*hdr));
+        hdr->timestamp_ns = bpf_ktime_get_ns();
+        hdr->pid = pid_tgid >> 32;
+        hdr->tid = pid_tgid;
+        hdr->uid = uid;
+        hdr->len = len;
+        hdr->is_read = is_read;
+        bpf_get_current_comm(&hdr->comm, sizeof(hdr->comm));
+}
+
+int probe_SSL_write(struct pt_regs *ctx, void *ssl, void *buf, int num) {
         u64 pid_tgid = bpf_get_current_pid_tgid();
         u32 pid = pid_tgid >> 32;
-        u32 tid = pid_tgid;
         u32 uid = bpf_get_current_uid_gid();
+        struct probe_SSL_hdr_t hdr;
 
         PID_FILTER
         UID_FILTER
-        struct probe_SSL_data_t *data = ssl_data.lookup(&zero);
-        if (!data)
-                return 0;
 
-        data->timestamp_ns = bpf_ktime_get_ns();
-        data->pid = pid;
-        data->tid = tid;
-        data->uid = uid;
-        data->len = num;
-        data->buf_filled = 0;
-        bpf_get_current_comm(&data->comm, sizeof(data->comm));
-        u32 buf_copy_size = min((size_t)MAX_BUF_SIZE, (size_t)num);
-
-        if (buf != 0)
-                ret = bpf_probe_read_user(data->buf, buf_copy_size, buf);
-
-        if (!ret)
-                data->buf_filled = 1;
-        else
-                buf_copy_size = 0;
-
-        perf_SSL_write.perf_submit(ctx, data, EVENT_SIZE(buf_copy_size));
+        if (num <= 0)
+                return 0;
+        fill_hdr(&hdr, pid_tgid, uid, num, 0);
+        submit_data(ctx, &hdr, buf);
         return 0;
 }
 
-BPF_PERF_OUTPUT(perf_SSL_read);
-
 BPF_HASH(bufs, u32, u64);
 
 int probe_SSL_read_enter(struct pt_regs *ctx, void *ssl, void *buf, int num) {
@@ -137,12 +206,11 @@ int probe_SSL_read_enter(struct pt_regs *ctx, void *ssl, void *buf, int num) {
 }
 
 int probe_SSL_read_exit(struct pt_regs *ctx, void *ssl, void *buf, int num) {
-        u32 zero = 0;
         u64 pid_tgid = bpf_get_current_pid_tgid();
         u32 pid = pid_tgid >> 32;
         u32 tid = (u32)pid_tgid;
         u32 uid = bpf_get_current_uid_gid();
-        int ret;
+        struct probe_SSL_hdr_t hdr;
 
         PID_FILTER
         UID_FILTER
@@ -150,36 +218,15 @@ int probe_SSL_read_exit(struct pt_regs *ctx, void *ssl, void *buf, int num) {
         u64 *bufp = bufs.lookup(&tid);
         if (bufp == 0)
                 return 0;
+        const u8 *src = (const u8 *)*bufp;
+        bufs.delete(&tid);
 
         int len = PT_REGS_RC(ctx);
         if (len <= 0) // read failed
                 return 0;
 
-        struct probe_SSL_data_t *data = ssl_data.lookup(&zero);
-        if (!data)
-                return 0;
-
-        data->timestamp_ns = bpf_ktime_get_ns();
-        data->pid = pid;
-        data->tid = tid;
-        data->uid = uid;
-        data->len = (u32)len;
-        data->buf_filled = 0;
-        u32 buf_copy_size = min((size_t)MAX_BUF_SIZE, (size_t)len);
-
-        bpf_get_current_comm(&data->comm, sizeof(data->comm));
-
-        if (bufp != 0)
-                ret = bpf_probe_read_user(&data->buf, buf_copy_size, (char *)*bufp);
-
-        bufs.delete(&tid);
-
-        if (!ret)
-                data->buf_filled = 1;
-        else
-                buf_copy_size = 0;
-
-        perf_SSL_read.perf_submit(ctx, data, EVENT_SIZE(buf_copy_size));
+        fill_hdr(&hdr, pid_tgid, uid, len, 1);
+        submit_data(ctx, &hdr, src);
         return 0;
 }
 """
@@ -196,6 +243,15 @@ else:
 
 prog = prog.replace('__MAX_BUF_SIZE__', str(args.max_buffer_size))
 
+# Ring buffers take the data of a call in chunks, without the copy through
+# a per-CPU array, and let the calls be captured whole up to
+# --max-buffer-size. Size the buffer for 64 calls of that size, at least.
+use_ringbuf = BPF.support_ringbuf()
+if use_ringbuf:
+    pages = max(64, (64 * args.max_buffer_size) // 4096)
+    prog = "#define USE_RINGBUF\n" + prog.replace('__RINGBUF_PAGES__',
+        str(1 << (pages - 1).bit_length()))
+
 if args.debug or args.ebpf:
     print(prog)
     if args.ebpf:
@@ -239,7 +295,8 @@ if args.nss:
                        fn_name="probe_SSL_read_exit", pid=args.pid or -1)
 
 # define output data structure in Python
-
+# struct probe_SSL_hdr_t, which the data of the record follows
+HDR = struct.Struct("=QIIIIIIII16s")
 
 # header
 header = "%-12s %-18s %-16s %-7s %-6s" % ("FUNC", "TIME(s)", "COMM", "PID", "LEN")
@@ -250,44 +307,58 @@ if args.extra:
 print(header)
 # process event
 start = 0
+# calls whose chunks are still arriving, by tid
+pending = {}
+
+
+def handle_event(data, size):
+    # the record is only valid during the callback: read it in place, and
+    # copy the data only to join the chunks of a call
+    view = memoryview((ct.c_ubyte * size).from_address(data))
+    hdr = HDR.unpack_from(view)
+    tid, length, offset, chunk = hdr[2], hdr[4], hdr[5], hdr[6]
+    payload = view[HDR.size:HDR.size + chunk]
+    captured = min(length, args.max_buffer_size)
+
+    call = pending.pop(tid, None)
+    if offset == 0:
+        if call:
+            # the end of the previous call was lost
+            print_event(*call)
+        call = (hdr, payload)
+    elif call and len(call[1]) == offset:
+        call[1].extend(payload)
+    else:
+        # the start of the call was lost
+        return
 
-
-def print_event_write(cpu, data, size):
-    print_event(cpu, data, size, "WRITE/SEND", "perf_SSL_write")
-
-
-def print_event_read(cpu, data, size):
-    print_event(cpu, data, size, "READ/RECV", "perf_SSL_read")
+    if chunk and offset + chunk < captured:
+        if not isinstance(call[1], bytearray):
+            call = (call[0], bytearray(call[1]))
+        pending[tid] = call
+        return
+    print_event(*call)
 
 
-def print_event(cpu, data, size, rw, evt):
+def print_event(hdr, buf):
     global start
-    event = b[evt].event(data)
-    if event.len <= args.max_buffer_size:
-        buf_size = event.len
-    else:
-        buf_size = args.max_buffer_size
-
-    if event.buf_filled == 1:
-        buf = bytearray(event.buf[:buf_size])
-    else:
-        buf_size = 0
-        buf = b""
+    (timestamp_ns, pid, tid, uid, length, _, _, is_read, _, comm) = hdr
+    comm = comm.split(b"\0", 1)[0].decode('utf-8', 'replace')
 
     # Filter events by command
     if args.comm:
-        if not args.comm == event.comm.decode('utf-8', 'replace'):
+        if not args.comm == comm:
             return
 
     if start == 0:
-        start = event.timestamp_ns
-    time_s = (float(event.timestamp_ns - start)) / 1000000000
+        start = timestamp_ns
+    time_s = (float(timestamp_ns - start)) / 1000000000
 
     s_mark = "-" * 5 + " DATA " + "-" * 5
 
     e_mark = "-" * 5 + " END DATA " + "-" * 5
 
-    truncated_bytes = event.len - buf_size
+    truncated_bytes = length - len(buf)
     if truncated_bytes > 0:
         e_mark = "-" * 5 + " END DATA (TRUNCATED, " + str(truncated_bytes) + \
                 " bytes lost) " + "-" * 5
@@ -302,16 +373,16 @@ def print_event(cpu, data, size, rw, evt):
         unwrapped_data = binascii.hexlify(buf)
         data = textwrap.fill(unwrapped_data.decode('utf-8', 'replace'), width=32)
     else:
-        data = buf.decode('utf-8', 'replace')
+        data = bytes(buf).decode('utf-8', 'replace')
 
     fmt_data = {
-        'func': rw,
+        'func': "READ/RECV" if is_read else "WRITE/SEND",
         'time': time_s,
-        'comm': event.comm.decode('utf-8', 'replace'),
-        'pid': event.pid,
-        'tid': event.tid,
-        'uid': event.uid,
-        'len': event.len,
+        'comm': comm,
+        'pid': pid,
+        'tid': tid,
+        'uid': uid,
+        'len': length,
         'begin': s_mark,
         'end': e_mark,
         'data': data
@@ -320,10 +391,16 @@ def print_event(cpu, data, size, rw, evt):
     print(fmt % fmt_data)
 
 
-b["perf_SSL_write"].open_perf_buffer(print_event_write)
-b["perf_SSL_read"].open_perf_buffer(print_event_read)
+if use_ringbuf:
+    b["ssl_events"].open_ring_buffer(
+        lambda ctx, data, size: handle_event(data, size))
+    poll = b.ring_buffer_poll
+else:
+    b["ssl_events"].open_perf_buffer(
+        lambda cpu, data, size: handle_event(data, size))
+    poll = b.perf_buffer_poll
 while 1:
     try:
-        b.perf_buffer_poll()
+        poll()
     except KeyboardInterrupt:
         exit()
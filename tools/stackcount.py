@@ -17,6 +17,7 @@
 
 from __future__ import print_function
 from bcc import BPF, USDT
+from bcc.pprof import PprofWriter
 from time import sleep, strftime
 import argparse
 import re
@@ -220,6 +221,7 @@ class Tool(object):
     ./stackcount -p 185 u:node:*    # count stacks for all USDT probes in node
     ./stackcount -K t:sched:sched_switch   # kernel stacks only
     ./stackcount -U t:sched:sched_switch   # user stacks only
+    ./stackcount --pprof out.pb.gz -D 10 submit_bio  # write a pprof profile
         """
         parser = argparse.ArgumentParser(
             description="Count events and their stack traces",
@@ -251,6 +253,9 @@ class Tool(object):
             help="insert delimiter between kernel/user stacks")
         parser.add_argument("-f", "--folded", action="store_true",
             help="output folded format")
+        parser.add_argument("--pprof", metavar="FILE",
+            help="write a gzipped pprof profile to FILE ('-' for stdout) " +
+                "instead of printing the stacks")
         parser.add_argument("--debug", action="store_true",
             help="print BPF program before starting (for debugging purposes)")
         parser.add_argument("pattern",
@@ -315,10 +320,14 @@ class Tool(object):
     def run(self):
         self.probe.load()
         self.probe.attach()
-        if not self.args.folded:
+        text = not (self.args.folded or self.args.pprof)
+        if text:
             print("Tracing %d functions for \"%s\"... Hit Ctrl-C to end." %
                   (self.probe.matched, self.args.pattern))
         b = self.probe.bpf
+        # all intervals go to the same profile
+        pprof = PprofWriter(self.args.pprof, [("events", "count")]) \
+            if self.args.pprof else None
         exiting = 0 if self.args.interval else 1
         seconds = 0
         while True:
@@ -332,9 +341,9 @@ class Tool(object):
             if self.args.duration and seconds >= int(self.args.duration):
                 exiting = 1
 
-            if not self.args.folded:
+            if text:
                 print()
-            if self.args.timestamp:
+            if self.args.timestamp and not pprof:
                 print("%-8s\n" % strftime("%H:%M:%S"), end="")
 
             counts = self.probe.bpf["counts"]
@@ -347,15 +356,24 @@ class Tool(object):
                 kernel_stack = [] if k.kernel_stack_id < 0 else \
                     stack_traces.walk(k.kernel_stack_id)
 
-                if self.args.folded:
+                if pprof:
+                    # frames from the leaf, names are interned by the writer
+                    labels = {"comm": k.name}
+                    if k.tgid != 0xffffffff:
+                        labels["pid"] = k.tgid
+                    pprof.add_sample(b.ksym_batch(list(kernel_stack)) +
+                                     b.sym_batch(list(user_stack), k.tgid),
+                                     [v.value], labels)
+                elif self.args.folded:
                     # print folded stack output
                     user_stack = list(user_stack)
                     kernel_stack = list(kernel_stack)
                     line = [k.name.decode('utf-8', 'replace')] + \
-                        [b.sym(addr, k.tgid).decode('utf-8', 'replace') for addr in
-                        reversed(user_stack)] + \
+                        [name.decode('utf-8', 'replace') for name in
+                        b.sym_batch(user_stack[::-1], k.tgid)] + \
                         (self.need_delimiter and ["-"] or []) + \
-                        [b.ksym(addr).decode('utf-8', 'replace') for addr in reversed(kernel_stack)]
+                        [name.decode('utf-8', 'replace') for name in
+                        b.ksym_batch(kernel_stack[::-1])]
                     print("%s %d" % (";".join(line), v.value))
                 else:
                     # print multi-line stack output
@@ -371,7 +389,9 @@ class Tool(object):
             counts.clear()
 
             if exiting:
-                if not self.args.folded:
+                if pprof:
+                    pprof.close()
+                if text:
                     print("Detaching...")
                 exit()
 
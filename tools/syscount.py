@@ -76,16 +76,32 @@ if args.list:
 
 text = """
 #ifdef LATENCY
+#ifdef USE_TASK_STORAGE
+BPF_TASK_STORAGE(start, u64);
+#else
+BPF_HASH(start, u64, u64);
+#endif
+#endif
+
+#ifdef BY_PROCESS
+#ifdef LATENCY
 struct data_t {
     u64 count;
     u64 total_ns;
 };
 
-BPF_HASH(start, u64, u64);
 BPF_HASH(data, u32, struct data_t);
 #else
 BPF_HASH(data, u32, u64);
 #endif
+#else
+// Syscall numbers are small and dense: per-CPU arrays indexed by them take
+// no lock and share no cache line between CPUs
+BPF_PERCPU_ARRAY(counts, u64, MAX_SYSCALLS);
+#ifdef LATENCY
+BPF_PERCPU_ARRAY(total_ns, u64, MAX_SYSCALLS);
+#endif
+#endif
 
 #ifdef LATENCY
 TRACEPOINT_PROBE(raw_syscalls, sys_enter) {
@@ -96,8 +112,15 @@ TRACEPOINT_PROBE(raw_syscalls, sys_enter) {
         return 0;
 #endif
 
+#ifdef USE_TASK_STORAGE
+    u64 *t = start.task_storage_get(bpf_get_current_task_btf(), 0,
+                                    BPF_LOCAL_STORAGE_GET_F_CREATE);
+    if (t)
+        *t = bpf_ktime_get_ns();
+#else
     u64 t = bpf_ktime_get_ns();
     start.update(&pid_tgid, &t);
+#endif
     return 0;
 }
 #endif
@@ -120,22 +143,25 @@ TRACEPOINT_PROBE(raw_syscalls, sys_exit) {
         return 0;
 #endif
 
-#ifdef BY_PROCESS
-    u32 key = pid_tgid >> 32;
-#else
-    u32 key = args->id;
-#endif
-
 #ifdef LATENCY
-    struct data_t *val, zero = {};
+#ifdef USE_TASK_STORAGE
+    u64 *start_ns = start.task_storage_get(bpf_get_current_task_btf(), 0, 0);
+#else
     u64 *start_ns = start.lookup(&pid_tgid);
+#endif
     if (!start_ns)
         return 0;
+    u64 delta = bpf_ktime_get_ns() - *start_ns;
+#endif
 
+#ifdef BY_PROCESS
+    u32 key = pid_tgid >> 32;
+#ifdef LATENCY
+    struct data_t *val, zero = {};
     val = data.lookup_or_try_init(&key, &zero);
     if (val) {
         val->count++;
-        val->total_ns += bpf_ktime_get_ns() - *start_ns;
+        val->total_ns += delta;
     }
 #else
     u64 *val, zero = 0;
@@ -143,11 +169,27 @@ TRACEPOINT_PROBE(raw_syscalls, sys_exit) {
     if (val) {
         ++(*val);
     }
+#endif
+#else
+    // the lookup fails for the id -1 of some exits, and ids past the array
+    u32 key = args->id;
+    u64 *val = counts.lookup(&key);
+    if (!val)
+        return 0;
+    ++(*val);
+#ifdef LATENCY
+    val = total_ns.lookup(&key);
+    if (val)
+        *val += delta;
+#endif
 #endif
     return 0;
 }
 """
 
+# above the largest syscall number of the architectures, the x32 ABI ones
+# excepted
+text = "#define MAX_SYSCALLS 1024\n" + text
 if args.pid:
     text = ("#define FILTER_PID %d\n" % args.pid) + text
 if args.failures:
@@ -162,7 +204,43 @@ if args.ebpf:
     print(text)
     exit()
 
-bpf = BPF(text=text)
+# Keep the start timestamps in task local storage, without the hash bucket
+# locks of a map by thread, where tracepoints may use it
+bpf = None
+if args.latency and BPF.support_task_storage():
+    try:
+        bpf = BPF(text="#define USE_TASK_STORAGE\n" + text)
+    except Exception:
+        pass
+if not bpf:
+    bpf = BPF(text=text)
+
+# totals of the per-CPU arrays at the last print, which are never cleared
+last_totals = {}
+
+def read_stats():
+    # (key, count, total_ns) since the last call
+    if args.process:
+        data = bpf["data"]
+        if args.latency:
+            stats = [(k.value, v.count, v.total_ns) for k, v in data.items()]
+        else:
+            stats = [(k.value, v.value, 0) for k, v in data.items()]
+        data.clear()
+        return stats
+
+    total_ns = {}
+    if args.latency:
+        total_ns = dict((k.value, v.value)
+                        for k, v in bpf["total_ns"].items_sum())
+    stats = []
+    for k, v in bpf["counts"].items_sum():
+        totals = (v.value, total_ns.get(k.value, 0))
+        last = last_totals.get(k.value, (0, 0))
+        if totals[0] > last[0]:
+            stats.append((k.value, totals[0] - last[0], totals[1] - last[1]))
+            last_totals[k.value] = totals
+    return stats
 
 def print_stats():
     if args.latency:
@@ -181,34 +259,31 @@ def comm_for_pid(pid):
 
 def agg_colval(key):
     if args.process:
-        return b"%-6d %-15s" % (key.value, comm_for_pid(key.value))
+        return b"%-6d %-15s" % (key, comm_for_pid(key))
     else:
-        return syscall_name(key.value)
+        return syscall_name(key)
 
 def print_count_stats():
-    data = bpf["data"]
+    stats = read_stats()
     print("[%s]" % strftime("%H:%M:%S"))
     print("%-22s %8s" % (agg_colname, "COUNT"))
-    for k, v in sorted(data.items(), key=lambda kv: -kv[1].value)[:args.top]:
-        if k.value == 0xFFFFFFFF:
+    for k, count, _ in sorted(stats, key=lambda s: -s[1])[:args.top]:
+        if k == 0xFFFFFFFF:
             continue    # happens occasionally, we don't need it
-        printb(b"%-22s %8d" % (agg_colval(k), v.value))
+        printb(b"%-22s %8d" % (agg_colval(k), count))
     print("")
-    data.clear()
 
 def print_latency_stats():
-    data = bpf["data"]
+    stats = read_stats()
     print("[%s]" % strftime("%H:%M:%S"))
     print("%-22s %8s %16s" % (agg_colname, "COUNT", time_colname))
-    for k, v in sorted(data.items(),
-                       key=lambda kv: -kv[1].total_ns)[:args.top]:
-        if k.value == 0xFFFFFFFF:
+    for k, count, total_ns in sorted(stats, key=lambda s: -s[2])[:args.top]:
+        if k == 0xFFFFFFFF:
             continue    # happens occasionally, we don't need it
         printb((b"%-22s %8d " + (b"%16.6f" if args.milliseconds else b"%16.3f")) %
-               (agg_colval(k), v.count,
-                v.total_ns / (1e6 if args.milliseconds else 1e3)))
+               (agg_colval(k), count,
+                total_ns / (1e6 if args.milliseconds else 1e3)))
     print("")
-    data.clear()
 
 print("Tracing %ssyscalls, printing top %d... Ctrl+C to quit." %
       ("failed " if args.failures else "", args.top))
@@ -21,9 +21,7 @@ from __future__ import print_function
 from bcc import BPF
 import argparse
 from time import strftime
-from socket import inet_ntop, AF_INET, AF_INET6
-from struct import pack
-from time import sleep
+from sys import stdout
 from bcc import tcp
 
 # arguments
@@ -169,30 +167,29 @@ elif args.ipv6:
 else:
     bpf_text = bpf_text.replace('FILTER_FAMILY', '')
 
-# process event
-def print_ipv4_event(cpu, data, size):
-    event = b["ipv4_events"].event(data)
-    print("%-8s %-7d %-2d %-20s > %-20s %s (%s)" % (
-        strftime("%H:%M:%S"), event.pid, event.ip,
-        "%s:%d" % (inet_ntop(AF_INET, pack('I', event.saddr)), event.sport),
-        "%s:%s" % (inet_ntop(AF_INET, pack('I', event.daddr)), event.dport),
-        tcp.tcpstate[event.state], tcp.flags2str(event.tcpflags)))
-    for addr in stack_traces.walk(event.stack_id):
-        sym = b.ksym(addr, show_offset=True)
-        print("\t%s" % sym)
-    print("")
-
-def print_ipv6_event(cpu, data, size):
-    event = b["ipv6_events"].event(data)
-    print("%-8s %-7d %-2d %-20s > %-20s %s (%s)" % (
-        strftime("%H:%M:%S"), event.pid, event.ip,
-        "%s:%d" % (inet_ntop(AF_INET6, event.saddr), event.sport),
-        "%s:%d" % (inet_ntop(AF_INET6, event.daddr), event.dport),
-        tcp.tcpstate[event.state], tcp.flags2str(event.tcpflags)))
-    for addr in stack_traces.walk(event.stack_id):
-        sym = b.ksym(addr, show_offset=True)
-        print("\t%s" % sym)
-    print("")
+# process events, a batch at a time: each event is unpacked without a ctypes
+# object, addresses and stacks are formatted once, and the batch is written
+# at once
+FIELDS = ["pid", "ip", "saddr", "daddr", "sport", "dport", "state",
+          "tcpflags", "stack_id"]
+
+def print_events(unpack, ntop):
+    def print_batch(cpu, data, offsets):
+        now = strftime("%H:%M:%S")
+        out = []
+        for i in range(len(offsets) - 1):
+            (pid, ip, saddr, daddr, sport, dport, state, tcpflags,
+             stack_id) = unpack(data, offsets[i])
+            out.append("%-8s %-7d %-2d %-20s > %-20s %s (%s)\n" % (
+                now, pid, ip,
+                "%s:%d" % (ntop(saddr), sport),
+                "%s:%d" % (ntop(daddr), dport),
+                tcp.tcpstate[state], tcp.flags2str(tcpflags)))
+            for sym in stacks.get(stack_id):
+                out.append("\t%s\n" % sym)
+            out.append("\n")
+        stdout.write("".join(out))
+    return print_batch
 
 # initialize BPF
 b = BPF(text=bpf_text)
@@ -202,15 +199,18 @@ else:
     print("ERROR: tcp_drop() kernel function not found or traceable. "
         "Older kernel versions not supported.")
     exit()
-stack_traces = b.get_table("stack_traces")
+stacks = tcp.KernelStacks(b, b.get_table("stack_traces"), show_offset=True)
+addrs = tcp.AddrCache()
 
 # header
 print("%-8s %-7s %-2s %-20s > %-20s %s (%s)" % ("TIME", "PID", "IP",
     "SADDR:SPORT", "DADDR:DPORT", "STATE", "FLAGS"))
 
 # read events
-b["ipv4_events"].open_perf_buffer(print_ipv4_event)
-b["ipv6_events"].open_perf_buffer(print_ipv6_event)
+for events, ntop in ((b["ipv4_events"], addrs.v4),
+                     (b["ipv6_events"], addrs.v6)):
+    events.open_perf_buffer(print_events(events.event_unpacker(FIELDS), ntop),
+                            page_cnt=64, batch=True)
 while 1:
     try:
         b.perf_buffer_poll()
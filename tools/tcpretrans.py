@@ -21,7 +21,9 @@ import argparse
 from time import strftime
 from socket import inet_ntop, AF_INET, AF_INET6
 from struct import pack
+from sys import stdout
 from time import sleep
+from bcc import tcp
 
 # arguments
 examples = """examples:
@@ -352,32 +354,27 @@ tcpstate[10] = 'LISTEN'
 tcpstate[11] = 'CLOSING'
 tcpstate[12] = 'NEW_SYN_RECV'
 
-# process event
-def print_ipv4_event(cpu, data, size):
-    event = b["ipv4_events"].event(data)
-    print("%-8s %-6d %-2d %-20s %1s> %-20s" % (
-        strftime("%H:%M:%S"), event.pid, event.ip,
-        "%s:%d" % (inet_ntop(AF_INET, pack('I', event.saddr)), event.lport),
-        type[event.type],
-        "%s:%s" % (inet_ntop(AF_INET, pack('I', event.daddr)), event.dport)),
-        end='')
-    if args.sequence:
-        print(" %-12s %s" % (tcpstate[event.state], event.seq))
-    else:
-        print(" %s" % (tcpstate[event.state]))
-
-def print_ipv6_event(cpu, data, size):
-    event = b["ipv6_events"].event(data)
-    print("%-8s %-6d %-2d %-20s %1s> %-20s" % (
-        strftime("%H:%M:%S"), event.pid, event.ip,
-        "%s:%d" % (inet_ntop(AF_INET6, event.saddr), event.lport),
-        type[event.type],
-        "%s:%d" % (inet_ntop(AF_INET6, event.daddr), event.dport)),
-        end='')
-    if args.sequence:
-        print(" %-12s %s" % (tcpstate[event.state], event.seq))
-    else:
-        print(" %s" % (tcpstate[event.state]))
+# process events, a batch at a time: each event is unpacked without a ctypes
+# object, addresses are formatted once, and the batch is written at once
+FIELDS = ["pid", "ip", "saddr", "lport", "type", "daddr", "dport", "state",
+          "seq"]
+
+def print_events(unpack, ntop):
+    def print_batch(cpu, data, offsets):
+        now = strftime("%H:%M:%S")
+        out = []
+        for i in range(len(offsets) - 1):
+            (pid, ip, saddr, lport, typ, daddr, dport, state,
+             seq) = unpack(data, offsets[i])
+            line = "%-8s %-6d %-2d %-20s %1s> %-20s" % (
+                now, pid, ip, "%s:%d" % (ntop(saddr), lport), type[typ],
+                "%s:%d" % (ntop(daddr), dport))
+            if args.sequence:
+                out.append("%s %-12s %s\n" % (line, tcpstate[state], seq))
+            else:
+                out.append("%s %s\n" % (line, tcpstate[state]))
+        stdout.write("".join(out))
+    return print_batch
 
 def depict_cnt(counts_tab, l3prot='ipv4'):
     for k, v in sorted(counts_tab.items(), key=lambda counts: counts[1].value):
@@ -421,8 +418,12 @@ else:
         print(" %-12s %-10s" % ("STATE", "SEQ"))
     else:
         print(" %-4s" % ("STATE"))
-    b["ipv4_events"].open_perf_buffer(print_ipv4_event)
-    b["ipv6_events"].open_perf_buffer(print_ipv6_event)
+    addrs = tcp.AddrCache()
+    for events, ntop in ((b["ipv4_events"], addrs.v4),
+                         (b["ipv6_events"], addrs.v6)):
+        events.open_perf_buffer(
+            print_events(events.event_unpacker(FIELDS), ntop),
+            page_cnt=64, batch=True)
     while 1:
         try:
             b.perf_buffer_poll()
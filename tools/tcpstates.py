@@ -17,9 +17,10 @@
 
 from __future__ import print_function
 from bcc import BPF
+from bcc import tcp
 import argparse
-from socket import inet_ntop, AF_INET, AF_INET6
-from struct import pack
+from socket import AF_INET, AF_INET6
+from sys import stdout
 from time import strftime, time
 from os import getuid
 
@@ -308,28 +309,10 @@ if args.journal:
 
 
 def tcpstate2str(state):
-    # from include/net/tcp_states.h:
-    tcpstate = {
-        1: "ESTABLISHED",
-        2: "SYN_SENT",
-        3: "SYN_RECV",
-        4: "FIN_WAIT1",
-        5: "FIN_WAIT2",
-        6: "TIME_WAIT",
-        7: "CLOSE",
-        8: "CLOSE_WAIT",
-        9: "LAST_ACK",
-        10: "LISTEN",
-        11: "CLOSING",
-        12: "NEW_SYN_RECV",
-    }
-
-    if state in tcpstate:
-        return tcpstate[state]
-    else:
-        return str(state)
+    return tcp.tcpstate.get(state, str(state))
 
-def journal_fields(event, addr_family):
+def journal_fields(pid, task, addr_family, saddr, sport, daddr, dport,
+                   oldstate, newstate, span_us):
     addr_pfx = 'IPV4'
     if addr_family == AF_INET6:
         addr_pfx = 'IPV6'
@@ -342,16 +325,16 @@ def journal_fields(event, addr_family):
         'SYSLOG_IDENTIFIER': 'tcpstates',
         'PRIORITY': 5,
         '_SOURCE_REALTIME_TIMESTAMP': time() * 1000000,
-        'OBJECT_PID': str(event.pid),
-        'OBJECT_COMM': event.task.decode('utf-8', 'replace'),
+        'OBJECT_PID': str(pid),
+        'OBJECT_COMM': task,
         # Custom fields, aka "stuff we sort of made up".
-        'OBJECT_' + addr_pfx + '_SOURCE_ADDRESS': inet_ntop(addr_family, pack("I", event.saddr)),
-        'OBJECT_TCP_SOURCE_PORT': str(event.ports >> 16),
-        'OBJECT_' + addr_pfx + '_DESTINATION_ADDRESS': inet_ntop(addr_family, pack("I", event.daddr)),
-        'OBJECT_TCP_DESTINATION_PORT': str(event.ports & 0xffff),
-        'OBJECT_TCP_OLD_STATE': tcpstate2str(event.oldstate),
-        'OBJECT_TCP_NEW_STATE': tcpstate2str(event.newstate),
-        'OBJECT_TCP_SPAN_TIME': str(event.span_us)
+        'OBJECT_' + addr_pfx + '_SOURCE_ADDRESS': saddr,
+        'OBJECT_TCP_SOURCE_PORT': str(sport),
+        'OBJECT_' + addr_pfx + '_DESTINATION_ADDRESS': daddr,
+        'OBJECT_TCP_DESTINATION_PORT': str(dport),
+        'OBJECT_TCP_OLD_STATE': tcpstate2str(oldstate),
+        'OBJECT_TCP_NEW_STATE': tcpstate2str(newstate),
+        'OBJECT_TCP_SPAN_TIME': str(span_us)
         }
 
     msg_format_string = (u"%(OBJECT_COMM)s " +
@@ -367,56 +350,49 @@ def journal_fields(event, addr_family):
 
     return fields
 
-# process event
-def print_ipv4_event(cpu, data, size):
-    event = b["ipv4_events"].event(data)
-    global start_ts
-    if args.time:
-        if args.csv:
-            print("%s," % strftime("%H:%M:%S"), end="")
-        else:
-            print("%-8s " % strftime("%H:%M:%S"), end="")
-    if args.timestamp:
-        if start_ts == 0:
-            start_ts = event.ts_us
-        delta_s = (float(event.ts_us) - start_ts) / 1000000
-        if args.csv:
-            print("%.6f," % delta_s, end="")
-        else:
-            print("%-9.6f " % delta_s, end="")
-    print(format_string % (event.skaddr, event.pid, event.task.decode('utf-8', 'replace'),
-        "4" if args.wide or args.csv else "",
-        inet_ntop(AF_INET, pack("I", event.saddr)), event.ports >> 16,
-        inet_ntop(AF_INET, pack("I", event.daddr)), event.ports & 0xffff,
-        tcpstate2str(event.oldstate), tcpstate2str(event.newstate),
-        float(event.span_us) / 1000))
-    if args.journal:
-        journal.send(**journal_fields(event, AF_INET))
-
-def print_ipv6_event(cpu, data, size):
-    event = b["ipv6_events"].event(data)
-    global start_ts
-    if args.time:
-        if args.csv:
-            print("%s," % strftime("%H:%M:%S"), end="")
-        else:
-            print("%-8s " % strftime("%H:%M:%S"), end="")
-    if args.timestamp:
-        if start_ts == 0:
-            start_ts = event.ts_us
-        delta_s = (float(event.ts_us) - start_ts) / 1000000
-        if args.csv:
-            print("%.6f," % delta_s, end="")
-        else:
-            print("%-9.6f " % delta_s, end="")
-    print(format_string % (event.skaddr, event.pid, event.task.decode('utf-8', 'replace'),
-        "6" if args.wide or args.csv else "",
-        inet_ntop(AF_INET6, event.saddr), event.ports >> 16,
-        inet_ntop(AF_INET6, event.daddr), event.ports & 0xffff,
-        tcpstate2str(event.oldstate), tcpstate2str(event.newstate),
-        float(event.span_us) / 1000))
-    if args.journal:
-        journal.send(**journal_fields(event, AF_INET6))
+# process events, a batch at a time: each event is unpacked without a ctypes
+# object, addresses are formatted once, and the batch is written at once
+FIELDS = ["ts_us", "skaddr", "pid", "task", "saddr", "daddr", "ports",
+          "oldstate", "newstate", "span_us"]
+
+def print_events(unpack, family, ntop):
+    ip = "4" if family == AF_INET else "6"
+    if not (args.wide or args.csv):
+        ip = ""
+    def print_batch(cpu, data, offsets):
+        global start_ts
+        now = strftime("%H:%M:%S")
+        out = []
+        for i in range(len(offsets) - 1):
+            (ts_us, skaddr, pid, task, saddr, daddr, ports, oldstate,
+             newstate, span_us) = unpack(data, offsets[i])
+            task = task.split(b"\0", 1)[0].decode('utf-8', 'replace')
+            saddr = ntop(saddr)
+            daddr = ntop(daddr)
+            if args.time:
+                if args.csv:
+                    out.append("%s," % now)
+                else:
+                    out.append("%-8s " % now)
+            if args.timestamp:
+                if start_ts == 0:
+                    start_ts = ts_us
+                delta_s = (float(ts_us) - start_ts) / 1000000
+                if args.csv:
+                    out.append("%.6f," % delta_s)
+                else:
+                    out.append("%-9.6f " % delta_s)
+            out.append(format_string % (skaddr, pid, task, ip,
+                saddr, ports >> 16, daddr, ports & 0xffff,
+                tcpstate2str(oldstate), tcpstate2str(newstate),
+                float(span_us) / 1000))
+            out.append("\n")
+            if args.journal:
+                journal.send(**journal_fields(pid, task, family, saddr,
+                    ports >> 16, daddr, ports & 0xffff, oldstate, newstate,
+                    span_us))
+        stdout.write("".join(out))
+    return print_batch
 
 # initialize BPF
 b = BPF(text=bpf_text)
@@ -440,8 +416,12 @@ print(header_string % ("SKADDR", "C-PID", "C-COMM",
 start_ts = 0
 
 # read events
-b["ipv4_events"].open_perf_buffer(print_ipv4_event, page_cnt=64)
-b["ipv6_events"].open_perf_buffer(print_ipv6_event, page_cnt=64)
+addrs = tcp.AddrCache()
+for events, family, ntop in ((b["ipv4_events"], AF_INET, addrs.v4),
+                             (b["ipv6_events"], AF_INET6, addrs.v6)):
+    events.open_perf_buffer(
+        print_events(events.event_unpacker(FIELDS), family, ntop),
+        page_cnt=64, batch=True)
 while 1:
     try:
         b.perf_buffer_poll()
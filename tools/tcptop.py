@@ -32,7 +32,7 @@ from socket import inet_ntop, AF_INET, AF_INET6
 from struct import pack
 from time import sleep, strftime
 from subprocess import call
-from collections import namedtuple, defaultdict
+from collections import namedtuple
 
 # arguments
 def range_check(string):
@@ -88,6 +88,12 @@ bpf_text = """
 #include <net/sock.h>
 #include <bcc/proto.h>
 
+// sent and received bytes share an entry, to be sorted by their sum
+struct bytes_t {
+    u64 sent;
+    u64 received;
+};
+
 struct ipv4_key_t {
     u32 pid;
     char name[TASK_COMM_LEN];
@@ -96,8 +102,7 @@ struct ipv4_key_t {
     u16 lport;
     u16 dport;
 };
-BPF_HASH(ipv4_send_bytes, struct ipv4_key_t);
-BPF_HASH(ipv4_recv_bytes, struct ipv4_key_t);
+BPF_HASH(ipv4_bytes, struct ipv4_key_t, struct bytes_t);
 
 struct ipv6_key_t {
     unsigned __int128 saddr;
@@ -108,8 +113,7 @@ struct ipv6_key_t {
     u16 dport;
     u64 __pad__;
 };
-BPF_HASH(ipv6_send_bytes, struct ipv6_key_t);
-BPF_HASH(ipv6_recv_bytes, struct ipv6_key_t);
+BPF_HASH(ipv6_bytes, struct ipv6_key_t, struct bytes_t);
 
 int kprobe__tcp_sendmsg(struct pt_regs *ctx, struct sock *sk,
     struct msghdr *msg, size_t size)
@@ -122,6 +126,7 @@ int kprobe__tcp_sendmsg(struct pt_regs *ctx, struct sock *sk,
     FILTER_PID
 
     u16 dport = 0, family = sk->__sk_common.skc_family;
+    struct bytes_t *val, zero = {};
 
     FILTER_FAMILY
     
@@ -133,7 +138,9 @@ int kprobe__tcp_sendmsg(struct pt_regs *ctx, struct sock *sk,
         ipv4_key.lport = sk->__sk_common.skc_num;
         dport = sk->__sk_common.skc_dport;
         ipv4_key.dport = ntohs(dport);
-        ipv4_send_bytes.increment(ipv4_key, size);
+        val = ipv4_bytes.lookup_or_try_init(&ipv4_key, &zero);
+        if (val)
+            lock_xadd(&val->sent, size);
 
     } else if (family == AF_INET6) {
         struct ipv6_key_t ipv6_key = {.pid = pid};
@@ -145,7 +152,9 @@ int kprobe__tcp_sendmsg(struct pt_regs *ctx, struct sock *sk,
         ipv6_key.lport = sk->__sk_common.skc_num;
         dport = sk->__sk_common.skc_dport;
         ipv6_key.dport = ntohs(dport);
-        ipv6_send_bytes.increment(ipv6_key, size);
+        val = ipv6_bytes.lookup_or_try_init(&ipv6_key, &zero);
+        if (val)
+            lock_xadd(&val->sent, size);
     }
     // else drop
 
@@ -168,7 +177,7 @@ int kprobe__tcp_cleanup_rbuf(struct pt_regs *ctx, struct sock *sk, int copied)
     FILTER_PID
 
     u16 dport = 0, family = sk->__sk_common.skc_family;
-    u64 *val, zero = 0;
+    struct bytes_t *val, zero = {};
 
     if (copied <= 0)
         return 0;
@@ -183,7 +192,9 @@ int kprobe__tcp_cleanup_rbuf(struct pt_regs *ctx, struct sock *sk, int copied)
         ipv4_key.lport = sk->__sk_common.skc_num;
         dport = sk->__sk_common.skc_dport;
         ipv4_key.dport = ntohs(dport);
-        ipv4_recv_bytes.increment(ipv4_key, copied);
+        val = ipv4_bytes.lookup_or_try_init(&ipv4_key, &zero);
+        if (val)
+            lock_xadd(&val->received, copied);
 
     } else if (family == AF_INET6) {
         struct ipv6_key_t ipv6_key = {.pid = pid};
@@ -195,7 +206,9 @@ int kprobe__tcp_cleanup_rbuf(struct pt_regs *ctx, struct sock *sk, int copied)
         ipv6_key.lport = sk->__sk_common.skc_num;
         dport = sk->__sk_common.skc_dport;
         ipv6_key.dport = ntohs(dport);
-        ipv6_recv_bytes.increment(ipv6_key, copied);
+        val = ipv6_bytes.lookup_or_try_init(&ipv6_key, &zero);
+        if (val)
+            lock_xadd(&val->received, copied);
     }
     // else drop
 
@@ -243,10 +256,9 @@ def get_ipv6_session_key(k):
 # initialize BPF
 b = BPF(text=bpf_text)
 
-ipv4_send_bytes = b["ipv4_send_bytes"]
-ipv4_recv_bytes = b["ipv4_recv_bytes"]
-ipv6_send_bytes = b["ipv6_send_bytes"]
-ipv6_recv_bytes = b["ipv6_recv_bytes"]
+# both directions of every session, largest total first
+ipv4_bytes = b["ipv4_bytes"].top(fields=["sent", "received"])
+ipv6_bytes = b["ipv6_bytes"].top(fields=["sent", "received"])
 
 print('Tracing... Output every %s secs. Hit Ctrl-C to end' % args.interval)
 
@@ -268,43 +280,25 @@ while i != args.count and not exiting:
         with open(loadavg) as stats:
             print("%-8s loadavg: %s" % (strftime("%H:%M:%S"), stats.read()))
 
-    # IPv4: build dict of all seen keys
-    ipv4_throughput = defaultdict(lambda: [0, 0])
-    for k, v in ipv4_send_bytes.items():
-        key = get_ipv4_session_key(k)
-        ipv4_throughput[key][0] = v.value
-    ipv4_send_bytes.clear()
-
-    for k, v in ipv4_recv_bytes.items():
-        key = get_ipv4_session_key(k)
-        ipv4_throughput[key][1] = v.value
-    ipv4_recv_bytes.clear()
+    # IPv4: drain the table
+    ipv4_throughput = [(get_ipv4_session_key(k), v)
+                       for k, v in ipv4_bytes.update()]
 
     if ipv4_throughput:
         print("%-6s %-12s %-21s %-21s %6s %6s" % ("PID", "COMM",
             "LADDR", "RADDR", "RX_KB", "TX_KB"))
 
     # output
-    for k, (send_bytes, recv_bytes) in sorted(ipv4_throughput.items(),
-                                              key=lambda kv: sum(kv[1]),
-                                              reverse=True):
+    for k, v in ipv4_throughput:
         print("%-6d %-12.12s %-21s %-21s %6d %6d" % (k.pid,
             k.name,
             k.laddr + ":" + str(k.lport),
             k.daddr + ":" + str(k.dport),
-            int(recv_bytes / 1024), int(send_bytes / 1024)))
-
-    # IPv6: build dict of all seen keys
-    ipv6_throughput = defaultdict(lambda: [0, 0])
-    for k, v in ipv6_send_bytes.items():
-        key = get_ipv6_session_key(k)
-        ipv6_throughput[key][0] = v.value
-    ipv6_send_bytes.clear()
+            int(v.received / 1024), int(v.sent / 1024)))
 
-    for k, v in ipv6_recv_bytes.items():
-        key = get_ipv6_session_key(k)
-        ipv6_throughput[key][1] = v.value
-    ipv6_recv_bytes.clear()
+    # IPv6: drain the table
+    ipv6_throughput = [(get_ipv6_session_key(k), v)
+                       for k, v in ipv6_bytes.update()]
 
     if ipv6_throughput:
         # more than 80 chars, sadly.
@@ -312,13 +306,11 @@ while i != args.count and not exiting:
             "LADDR6", "RADDR6", "RX_KB", "TX_KB"))
 
     # output
-    for k, (send_bytes, recv_bytes) in sorted(ipv6_throughput.items(),
-                                              key=lambda kv: sum(kv[1]),
-                                              reverse=True):
+    for k, v in ipv6_throughput:
         print("%-6d %-12.12s %-32s %-32s %6d %6d" % (k.pid,
             k.name,
             k.laddr + ":" + str(k.lport),
             k.daddr + ":" + str(k.dport),
-            int(recv_bytes / 1024), int(send_bytes / 1024)))
+            int(v.received / 1024), int(v.sent / 1024)))
 
     i += 1
@@ -5,13 +5,14 @@
 #
 # usage: trace [-h] [-p PID] [-L TID] [-v] [-Z STRING_SIZE] [-S] [-c cgroup_path]
 #              [-M MAX_EVENTS] [-s SYMBOLFILES] [-T] [-t] [-K] [-U] [-a] [-I header]
-#              probe [probe ...]
+#              [-R] probe [probe ...]
 #
 # Licensed under the Apache License, Version 2.0 (the "License")
 # Copyright (C) 2016 Sasha Goldshtein.
 
 from __future__ import print_function
 from bcc import BPF, USDT, StrcmpRewrite
+from bcc.utils import get_online_cpus
 from functools import partial
 from time import strftime
 import time
@@ -40,6 +41,7 @@ class Probe(object):
         uid = -1
         page_cnt = None
         build_id_enabled = False
+        shared_events = None
 
         @classmethod
         def configure(cls, args):
@@ -58,6 +60,8 @@ class Probe(object):
                 cls.page_cnt = args.buffer_pages
                 cls.bin_cmp = args.bin_cmp
                 cls.build_id_enabled = args.sym_file_list is not None
+                if args.ring_buffer:
+                        cls.shared_events = "__events"
 
         def __init__(self, probe, string_size, kernel_stack, user_stack,
                      cgroup_map_name, name, msg_filter):
@@ -334,6 +338,8 @@ class Probe(object):
                 self.python_struct_name = "%s_%d_Data" % \
                                 (self._display_function(), self.probe_num)
                 fields = []
+                if self.shared_events:
+                    fields.append(("probe_id", ct.c_uint))
                 if self.time_field:
                     fields.append(("timestamp_ns", ct.c_ulonglong))
                 if self.print_cpu:
@@ -374,7 +380,16 @@ class Probe(object):
                 # The BPF program will populate values into the struct
                 # according to the format string, and the Python program will
                 # construct the final display string.
-                self.events_name = "%s_events" % self.probe_name
+                # probes sharing a ring buffer tell their events apart by
+                # the probe_id in front of them
+                if self.shared_events:
+                        self.events_name = self.shared_events
+                        events_decl = ""
+                        id_str = "u32 probe_id;"
+                else:
+                        self.events_name = "%s_events" % self.probe_name
+                        events_decl = "BPF_PERF_OUTPUT(%s);" % self.events_name
+                        id_str = ""
                 self.struct_name = "%s_data_t" % self.probe_name
                 self.stacks_name = "%s_stacks" % self.probe_name
                 stack_type = "BPF_STACK_TRACE" if self.build_id_enabled is False \
@@ -396,6 +411,7 @@ class Probe(object):
 struct %s
 {
 %s
+%s
 %s
         u32 tgid;
         u32 pid;
@@ -406,12 +422,12 @@ struct %s
         u32 uid;
 };
 
-BPF_PERF_OUTPUT(%s);
+%s
 %s
 """
-                return text % (self.struct_name, time_str, cpu_str, data_fields,
-                               kernel_stack_str, user_stack_str,
-                               self.events_name, stack_table)
+                return text % (self.struct_name, id_str, time_str, cpu_str,
+                               data_fields, kernel_stack_str, user_stack_str,
+                               events_decl, stack_table)
 
         def _generate_field_assign(self, idx):
                 field_type = self.types[idx]
@@ -519,6 +535,13 @@ BPF_PERF_OUTPUT(%s);
                         heading = "int %s(%s)" % (self.probe_name, signature)
                         ctx_name = "ctx"
 
+                if self.shared_events:
+                        submit_str = """__data.probe_id = %d;
+        %s.ringbuf_output(&__data, sizeof(__data), 0);""" % \
+                                     (self.probe_num, self.events_name)
+                else:
+                        submit_str = "%s.perf_submit(%s, &__data, sizeof(__data));" \
+                                     % (self.events_name, ctx_name)
                 time_str = """
         __data.timestamp_ns = bpf_ktime_get_ns();""" if self.time_field else ""
                 cpu_str = """
@@ -557,14 +580,14 @@ BPF_PERF_OUTPUT(%s);
         bpf_get_current_comm(&__data.comm, sizeof(__data.comm));
 %s
 %s
-        %s.perf_submit(%s, &__data, sizeof(__data));
+        %s
         return 0;
 }
 """
                 text = text % (pid_filter, uid_filter, cgroup_filter, prefix,
                                self._generate_usdt_filter_read(), self.filter,
                                self.struct_name, time_str, cpu_str, data_fields,
-                               stack_trace, self.events_name, ctx_name)
+                               stack_trace, submit_str)
 
                 return self.streq_functions + data_decl + "\n" + text
 
@@ -654,6 +677,8 @@ BPF_PERF_OUTPUT(%s);
                 else:
                         self._attach_u(bpf)
                 self.python_struct = self._generate_python_data_decl()
+                if self.shared_events:
+                        return
                 callback = partial(self.print_event, bpf)
                 bpf[self.events_name].open_perf_buffer(callback,
                         page_cnt=self.page_cnt)
@@ -815,6 +840,9 @@ trace -I 'linux/fs_struct.h' 'mntns_install "users = %d", $task->fs->users'
                        "as either full path, "
                        "or relative to current working directory, "
                        "or relative to default kernel header search path")
+                parser.add_argument("-R", "--ring-buffer", action="store_true",
+                  help="send the events of all probes through one BPF ring "
+                       "buffer instead of a perf buffer per probe (Linux 5.8+)")
                 parser.add_argument("--ebpf", action="store_true",
                   help=argparse.SUPPRESS)
                 self.args = parser.parse_args()
@@ -851,6 +879,10 @@ trace -I 'linux/fs_struct.h' 'mntns_install "users = %d", $task->fs->users'
                 if self.cgroup_map_name is not None:
                         self.program += "BPF_CGROUP_ARRAY(%s, 1);\n" % \
                                         self.cgroup_map_name
+                if Probe.shared_events:
+                        self.program += "BPF_RINGBUF_OUTPUT(%s, %d);\n" % \
+                                        (Probe.shared_events,
+                                         self._ring_buffer_pages())
                 for probe in self.probes:
                         self.program += probe.generate_program(
                                         self.args.include_self)
@@ -860,6 +892,17 @@ trace -I 'linux/fs_struct.h' 'mntns_install "users = %d", $task->fs->users'
                         if self.args.ebpf:
                                 exit()
 
+        def _ring_buffer_pages(self):
+                # as much memory as the perf buffer of one probe, rounded up
+                # to the power of two the ring buffer needs
+                pages = self.args.buffer_pages * len(get_online_cpus())
+                return 1 << (pages - 1).bit_length()
+
+        def _print_shared_event(self, ctx, data, size):
+                probe_id = ct.cast(data, ct.POINTER(ct.c_uint)).contents.value
+                self.probes_by_id[probe_id].print_event(self.bpf, -1, data,
+                                                        size)
+
         def _attach_probes(self):
                 usdt_contexts = []
                 for probe in self.probes:
@@ -882,10 +925,20 @@ trace -I 'linux/fs_struct.h' 'mntns_install "users = %d", $task->fs->users'
                         cgroup_array = self.bpf.get_table(self.cgroup_map_name)
                         cgroup_array[0] = self.args.cgroup_path
 
+                # verify the kprobe and uprobe programs concurrently before
+                # attaching them one by one
+                self.bpf.load_funcs(BPF.KPROBE, [p.probe_name
+                                    for p in self.probes
+                                    if p.probe_type in ("p", "r")])
                 for probe in self.probes:
                         if self.args.verbose:
                                 print(probe)
                         probe.attach(self.bpf, self.args.verbose)
+                if Probe.shared_events:
+                        self.probes_by_id = dict((p.probe_num, p)
+                                                 for p in self.probes)
+                        self.bpf[Probe.shared_events].open_ring_buffer(
+                                self._print_shared_event)
 
         def _main_loop(self):
                 all_probes_trivial = all(map(Probe.is_default_action,
@@ -903,7 +956,10 @@ trace -I 'linux/fs_struct.h' 'mntns_install "users = %d", $task->fs->users'
                 sys.stdout.flush()
 
                 while True:
-                        self.bpf.perf_buffer_poll()
+                        if Probe.shared_events:
+                                self.bpf.ring_buffer_poll()
+                        else:
+                                self.bpf.perf_buffer_poll()
 
         def run(self):
                 try: